@@ -0,0 +1,152 @@
+/**
+ *		Tempesta DB
+ *
+ * Read-only mapping of tables to user space.
+ *
+ * User-space tools can walk a table in its own memory without copying the
+ * records through netlink. The mapping is read-only, so the kernel still
+ * exclusively modifies the table and the readers must validate the data
+ * they read against concurrent updates, see libtdb.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+
+#include "table.h"
+#include "tdb_if.h"
+
+static unsigned long
+tdb_dev_pfn(char *p)
+{
+	return is_vmalloc_addr(p) ? vmalloc_to_pfn(p) : __pa(p) >> PAGE_SHIFT;
+}
+
+/**
+ * Bind the file to a table. The table reference is held until the file
+ * release, so mappings of a closed table stay valid until they're unmapped.
+ */
+static long
+tdb_dev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	char name[TDB_TBLNAME_LEN + 1];
+	TDB *db;
+
+	if (cmd != TDB_IOC_TABLE)
+		return -ENOTTY;
+	if (copy_from_user(name, (void __user *)arg, sizeof(name)))
+		return -EFAULT;
+	name[TDB_TBLNAME_LEN] = 0;
+
+	db = tdb_tbl_lookup(name, sizeof(name));
+	if (!db)
+		return -ENOENT;
+	if (cmpxchg(&filp->private_data, NULL, db)) {
+		tdb_close(db);
+		return -EBUSY;
+	}
+
+	return 0;
+}
+
+/**
+ * Map the table memory from its beginning. Huge pages of the direct mapping
+ * and vmalloc()'ed pages of a node are mapped by physically contiguous runs.
+ */
+static int
+tdb_dev_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	int r;
+	TDB *db = filp->private_data;
+	unsigned long len = vma->vm_end - vma->vm_start;
+	unsigned long off, pfn, run_pfn = 0, run = 0;
+	char *base;
+
+	if (!db)
+		return -EINVAL;
+	if (vma->vm_pgoff || len > db->hdr->dbsz)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+
+	base = (char *)db->hdr;
+	for (off = 0; off < len; off += PAGE_SIZE) {
+		pfn = tdb_dev_pfn(base + off);
+		if (run && pfn == run_pfn + run / PAGE_SIZE) {
+			run += PAGE_SIZE;
+			continue;
+		}
+		if (run) {
+			r = remap_pfn_range(vma, vma->vm_start + off - run,
+					    run_pfn, run, vma->vm_page_prot);
+			if (r)
+				return r;
+		}
+		run_pfn = pfn;
+		run = PAGE_SIZE;
+	}
+
+	return remap_pfn_range(vma, vma->vm_start + off - run, run_pfn, run,
+			       vma->vm_page_prot);
+}
+
+static int
+tdb_dev_release(struct inode *inode, struct file *filp)
+{
+	TDB *db = filp->private_data;
+
+	if (db)
+		tdb_close(db);
+
+	return 0;
+}
+
+static const struct file_operations tdb_dev_fops = {
+	.owner		= THIS_MODULE,
+	.unlocked_ioctl	= tdb_dev_ioctl,
+	.mmap		= tdb_dev_mmap,
+	.release	= tdb_dev_release,
+};
+
+static struct miscdevice tdb_dev = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= TDB_DEV_NAME,
+	.fops		= &tdb_dev_fops,
+};
+
+int __init
+tdb_dev_init(void)
+{
+	int r = misc_register(&tdb_dev);
+
+	if (r)
+		TDB_ERR("Failed to register /dev/%s\n", TDB_DEV_NAME);
+
+	return r;
+}
+
+void __exit
+tdb_dev_exit(void)
+{
+	misc_deregister(&tdb_dev);
+}
@@ -25,9 +25,15 @@
 #include <linux/slab.h>
 #include <linux/tempesta.h>
 #include <linux/topology.h>
+#include <linux/vmalloc.h>
 #include <linux/writeback.h>
 
+#include "lib/hash.h"
 #include "file.h"
+#include "htrie.h"
+
+/* Number of extents checked for changes by one incremental checkpoint. */
+#define TDB_CKPT_SCAN		64
 
 /**
  * Node of list of free/user memory areas.
@@ -102,6 +108,61 @@ ma_split(MArea *ma, unsigned long len)
 	return ret;
 }
 
+/**
+ * Split @len length memory area from the head of @ma, so the rest of @ma
+ * stays free just after the returned area and can be used to extend it.
+ */
+static MArea *
+ma_split_head(MArea *ma, unsigned long len)
+{
+	unsigned long req_pages = len / PAGE_SIZE;
+	MArea *rest;
+
+	BUG_ON(ma->pages < req_pages);
+	BUG_ON(!MA_FREE(ma));
+
+	if (ma->pages > req_pages) {
+		rest = kmalloc(sizeof(MArea), GFP_KERNEL);
+		if (!rest)
+			return NULL;
+
+		rest->pages = ma->pages - req_pages;
+		rest->flags = 0;
+		rest->start = ma->start + len;
+		rest->prev = ma;
+		rest->next = ma->next;
+		if (rest->next)
+			rest->next->prev = rest;
+		ma->next = rest;
+		ma->pages = req_pages;
+	}
+	ma->flags |= MA_F_USED;
+
+	return ma;
+}
+
+/**
+ * Move @len bytes from the head of free area @next to its left neighbour.
+ */
+static void
+ma_shift(MArea *next, unsigned long len)
+{
+	MArea *ma = next->prev;
+
+	BUG_ON(!MA_FREE(next) || next->pages < len / PAGE_SIZE);
+
+	ma->pages += len / PAGE_SIZE;
+	next->start += len;
+	next->pages -= len / PAGE_SIZE;
+	if (next->pages)
+		return;
+
+	ma->next = next->next;
+	if (next->next)
+		next->next->prev = ma;
+	kfree(next);
+}
+
 static MArea *
 ma_lookup(unsigned long addr, int node)
 {
@@ -162,14 +223,71 @@ ma_free(unsigned long addr, int node)
 	__ma_free(ma);
 }
 
+/**
+ * Hash of extent data at @p, never zero which means unknown file content.
+ */
+static inline unsigned long
+tdb_ext_hash(const char *p)
+{
+	return hash_calc(p, TDB_EXT_SZ) | 1;
+}
+
+/**
+ * Read the table snapshot from @file to @p of @len bytes and set hashes
+ * @hash of the read extents. If the snapshot is consistent, then only the
+ * used extents are read and the rest of the area is zeroed. Otherwise only
+ * the first extent is read and the table is initialized from scratch by
+ * tdb_htrie_init().
+ */
+static int
+tdb_file_load(struct file *file, char *p, unsigned long len,
+	      unsigned long *hash)
+{
+	loff_t off = 0;
+	unsigned long e;
+	TdbHdr *hdr = (TdbHdr *)p;
+
+	if (kernel_read(file, p, TDB_EXT_SZ, &off) != TDB_EXT_SZ)
+		return -EIO;
+
+	if (hdr->magic != TDB_MAGIC || hdr->dbsz != len
+	    || !(hdr->flags & TDB_HDR_CLEAN))
+	{
+		hdr->magic = 0;
+		return 0;
+	}
+	hash[0] = tdb_ext_hash(p);
+
+	for (e = 1; e < len / TDB_EXT_SZ; ++e) {
+		char *ext = p + e * TDB_EXT_SZ;
+
+		if (!test_bit(e, hdr->ext_bmp)) {
+			memset(ext, 0, TDB_EXT_SZ);
+			continue;
+		}
+		off = e * TDB_EXT_SZ;
+		if (kernel_read(file, ext, TDB_EXT_SZ, &off) != TDB_EXT_SZ)
+			return -EIO;
+		hash[e] = tdb_ext_hash(ext);
+		cond_resched();
+	}
+
+	return 0;
+}
+
 /**
  * Map file to reserved set of unswappable pages.
+ *
+ * A table which can grow up to @max bytes is placed at the head of a free
+ * area, large enough for the maximum size if possible, while fixed size
+ * tables are split from tails of free areas. So the free memory after the
+ * growing table isn't taken by other tables.
  */
 static unsigned long
-tempesta_map_file(struct file *file, unsigned long len, int node)
+tempesta_map_file(struct file *file, unsigned long len, unsigned long max,
+		  int node, unsigned long *hash)
 {
 	MArea *ma;
-	loff_t off = 0;
 	unsigned long addr = -ENOMEM;
 
 	BUG_ON(len & ~TDB_EXT_MASK);
@@ -181,23 +299,26 @@ tempesta_map_file(struct file *file, unsigned long len, int node)
 
 	mutex_lock(&map_mtx);
 
-	ma = ma_get_best_fit(len, node);
+	if (max > len) {
+		ma = ma_get_best_fit(max, node) ? : ma_get_best_fit(len, node);
+		if (ma)
+			ma = ma_split_head(ma, len);
+	} else {
+		ma = ma_get_best_fit(len, node);
+		if (ma)
+			ma = ma_split(ma, len);
+	}
 	if (!ma) {
 		TDB_ERR("Cannot allocate %lu pages at node %d\n",
 			len / PAGE_SIZE, node);
 		goto err;
 	}
 
-	ma = ma_split(ma, len);
-	if (!ma)
-		goto err;
-
 	get_file(file);
 
-	addr = kernel_read(file, (char *)ma->start, len, &off);
-	if (addr != len) {
-		TDB_ERR("Cannot read %lu bytes to addr %p, ret = %ld\n",
-			len, (void *)ma->start, addr);
+	if (tdb_file_load(file, (char *)ma->start, len, hash)) {
+		TDB_ERR("Cannot read %lu bytes to addr %p\n",
+			len, (void *)ma->start);
 		fput(file);
 		__ma_free(ma);
 		addr = -EIO;
@@ -212,38 +333,121 @@ err:
 }
 
 /**
- * Synchronize memory mapping with the file.
+ * Release the memory mapping, the file must be synchronized by
+ * tdb_file_sync() before.
  * Called from process context.
  */
 static void
-tempesta_unmap_file(struct file *file, unsigned long addr, unsigned long len,
-		    int node)
+tempesta_unmap_file(struct file *file, unsigned long addr, int node)
 {
-	MArea *ma;
-	loff_t off = 0;
-	ssize_t r;
-
 	mutex_lock(&map_mtx);
 
-	ma = ma_lookup(addr, node);
-	if (!ma) {
-		TDB_WARN("Cannot sync memory area for %#lx address at node"
-			 " %d\n", addr, node);
-		goto err;
+	fput(file);
+	ma_free(addr, node);
+
+	mutex_unlock(&map_mtx);
+}
+
+static int
+tdb_file_write_ext(TDB *db, void *data, unsigned long e)
+{
+	loff_t off = e * TDB_EXT_SZ;
+
+	if (kernel_write(db->filp, data, TDB_EXT_SZ, &off) != TDB_EXT_SZ) {
+		TDB_WARN("Cannot write extent %lu of table %s\n", e,
+			 db->tbl_name);
+		return -EIO;
 	}
 
-	r = kernel_write(file, (void *)ma->start, len, &off);
-	if (r != len) {
-		TDB_WARN("Cannot sync mapping %lx of size %lu pages\n",
-			 ma->start, ma->pages);
-		goto err;
+	return 0;
+}
+
+/**
+ * Write the table header with the snapshot generation and flags.
+ */
+static int
+tdb_file_write_hdr(TDB *db)
+{
+	loff_t off = 0;
+	size_t len = TDB_HDR_SZ(db->hdr);
+
+	if (kernel_write(db->filp, db->hdr, len, &off) != len
+	    || vfs_fsync(db->filp, 0))
+	{
+		TDB_WARN("Cannot write header of table %s\n", db->tbl_name);
+		return -EIO;
 	}
 
-err:
-	fput(file);
-	ma_free(addr, node);
+	return 0;
+}
 
-	mutex_unlock(&map_mtx);
+/**
+ * Incremental checkpoint: check the next TDB_CKPT_SCAN extents in use and
+ * write the changed ones to the file. The extents are changed concurrently,
+ * so a copy of the extent is written and hashed, then the next checkpoints
+ * see the changes made during the writing.
+ *
+ * The file content becomes consistent only on tdb_file_sync() when there
+ * are no database users. The checkpoints make the close fast, since only
+ * the extents changed after the last checkpoint are written on the close.
+ */
+void
+tdb_file_checkpoint(TDB *db)
+{
+	int i;
+	unsigned long e, n = db->hdr->dbsz / TDB_EXT_SZ;
+	char *base = (char *)db->hdr;
+
+	if (!db->ckpt_buf && !(db->ckpt_buf = vmalloc(TDB_EXT_SZ)))
+		return;
+
+	for (i = 0; i < TDB_CKPT_SCAN; ++i) {
+		e = db->ckpt_ext;
+		db->ckpt_ext = (e + 1) % n;
+		if (!db->ckpt_ext)
+			db->hdr->gen++;
+
+		if (!test_bit(e, db->hdr->ext_bmp)
+		    || tdb_ext_hash(base + e * TDB_EXT_SZ) == db->ckpt_hash[e])
+			continue;
+
+		memcpy(db->ckpt_buf, base + e * TDB_EXT_SZ, TDB_EXT_SZ);
+		db->ckpt_hash[e] = tdb_file_write_ext(db, db->ckpt_buf, e)
+				   ? 0 : tdb_ext_hash(db->ckpt_buf);
+		cond_resched();
+	}
+}
+
+/**
+ * Write all the changed extents and mark the snapshot consistent.
+ * Called on the table close when there are no users of the table.
+ */
+static void
+tdb_file_sync(TDB *db)
+{
+	unsigned long e, n = db->hdr->dbsz / TDB_EXT_SZ;
+	char *base = (char *)db->hdr;
+
+	for (e = 0; e < n; ++e) {
+		char *ext = base + e * TDB_EXT_SZ;
+
+		if (!test_bit(e, db->hdr->ext_bmp)
+		    || tdb_ext_hash(ext) == db->ckpt_hash[e])
+			continue;
+		if (tdb_file_write_ext(db, ext, e))
+			return;
+		cond_resched();
+	}
+	if (vfs_fsync(db->filp, 0)) {
+		TDB_WARN("Cannot sync table %s\n", db->tbl_name);
+		return;
+	}
+
+	db->hdr->gen++;
+	db->hdr->flags |= TDB_HDR_CLEAN;
+	if (!tdb_file_write_hdr(db))
+		TDB_LOG("Table %s snapshot generation %lu is written\n",
+			db->tbl_name, db->hdr->gen);
 }
 
 /**
@@ -251,10 +455,13 @@ err:
  * write to it in softirqs.
  * Use MAP_SHARED to synchronize the mapping with underlying file.
  *
+ * The table snapshot extended by tdb_file_extend() is loaded with its
+ * size if the size doesn't exceed @max_size.
+ *
  * The function must not be called from softirq!
  */
 int
-tdb_file_open(TDB *db, unsigned long size)
+tdb_file_open(TDB *db, unsigned long size, unsigned long max_size)
 {
 	unsigned long ret, addr;
 	struct file *filp;
@@ -273,8 +480,12 @@ tdb_file_open(TDB *db, unsigned long size)
 		return -EBADF;
 	}
 
-	/* Allocate continuous extents. */
 	inode = file_inode(filp);
+	if (i_size_read(inode) > size && i_size_read(inode) <= max_size
+	    && !(i_size_read(inode) & ~TDB_EXT_MASK))
+		size = i_size_read(inode);
+
+	/* Allocate continuous extents. */
 	sb_start_write(inode->i_sb);
 	ret = filp->f_op->fallocate(filp, 0, 0, size);
 	sb_end_write(inode->i_sb);
@@ -284,31 +495,113 @@ tdb_file_open(TDB *db, unsigned long size)
 		return ret;
 	}
 
-	addr = tempesta_map_file(filp, size, db->node);
+	db->ckpt_hash = vzalloc(max_size / TDB_EXT_SZ * sizeof(long));
+	if (!db->ckpt_hash) {
+		TDB_ERR("Cannot allocate extent hashes\n");
+		filp_close(filp, NULL);
+		return -ENOMEM;
+	}
+
+	addr = tempesta_map_file(filp, size, max_size, db->node,
+				 db->ckpt_hash);
 	if (IS_ERR((void *)addr)) {
 		TDB_ERR("Cannot map file\n");
+		vfree(db->ckpt_hash);
 		filp_close(filp, NULL);
 		return (int)addr;
 	}
 
 	db->filp = filp;
 	db->hdr = (TdbHdr *)addr;
+	db->max_sz = max_size;
+
+	/*
+	 * The file content is going to be changed by the checkpoints, so it
+	 * isn't consistent any more: a crash leads to the empty table.
+	 */
+	if (db->hdr->magic == TDB_MAGIC) {
+		TDB_LOG("Load table %s snapshot generation %lu\n",
+			db->path, db->hdr->gen);
+		db->hdr->flags &= ~TDB_HDR_CLEAN;
+		db->ckpt_hash[0] = 0;
+		tdb_file_write_hdr(db);
+	}
 
 	file_accessed(filp);
 
 	return 0;
 }
 
+/**
+ * Extend table @db up to @size bytes by the free reserved memory just after
+ * the table. The table is extended by less if there is not enough adjacent
+ * free memory. The file is extended as well, so the next checkpoints write
+ * the new extents.
+ * Called from process context.
+ *
+ * @return the new table size or 0 if the table can't be extended.
+ */
+unsigned long
+tdb_file_extend(TDB *db, unsigned long size)
+{
+	int r;
+	MArea *ma, *next;
+	struct inode *inode = file_inode(db->filp);
+	unsigned long e, len, old = db->hdr->dbsz;
+	char *base = (char *)db->hdr;
+
+	BUG_ON(size & ~TDB_EXT_MASK);
+
+	mutex_lock(&map_mtx);
+
+	ma = ma_lookup((unsigned long)base, db->node);
+	BUG_ON(!ma);
+	next = ma->next;
+	if (!next || !MA_FREE(next)
+	    || next->start != ma->start + ma->pages * PAGE_SIZE)
+		goto nomem;
+	len = min(size - old, TDB_EXT_O(next->pages * PAGE_SIZE));
+	if (!len)
+		goto nomem;
+
+	sb_start_write(inode->i_sb);
+	r = db->filp->f_op->fallocate(db->filp, 0, 0, old + len);
+	sb_end_write(inode->i_sb);
+	if (r) {
+		TDB_WARN("Cannot fallocate %lu bytes for table %s, %d\n",
+			 old + len, db->tbl_name, r);
+		goto nomem;
+	}
+	ma_shift(next, len);
+
+	mutex_unlock(&map_mtx);
+
+	/* The memory could be used by a closed table. */
+	for (e = old; e < old + len; e += TDB_EXT_SZ) {
+		memset(base + e, 0, TDB_EXT_SZ);
+		cond_resched();
+	}
+	tdb_htrie_extend(db->hdr, old + len);
+
+	return old + len;
+nomem:
+	mutex_unlock(&map_mtx);
+	return 0;
+}
+
 void
 tdb_file_close(TDB *db)
 {
 	if (!db->hdr || !db->hdr->dbsz)
 		return;
 
-	tempesta_unmap_file(db->filp, (unsigned long)db->hdr, db->hdr->dbsz,
-			    db->node);
+	tdb_file_sync(db);
+
+	tempesta_unmap_file(db->filp, (unsigned long)db->hdr, db->node);
 
 	filp_close(db->filp, NULL);
+	vfree(db->ckpt_hash);
+	vfree(db->ckpt_buf);
 }
 
 int
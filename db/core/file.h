@@ -21,10 +21,25 @@
 #ifndef __FILE_H__
 #define __FILE_H__
 
+#include <linux/mm.h>
+
 #include "tdb.h"
 
-int tdb_file_open(TDB *db, unsigned long size);
+/*
+ * True if the table is backed by huge pages of the kernel direct mapping,
+ * so each extent is mapped by single TLB entry. Otherwise the reserved
+ * memory is allocated by vmalloc() with 4KB pages.
+ */
+static inline bool
+tdb_file_hugepages(TDB *db)
+{
+	return !is_vmalloc_addr(db->hdr);
+}
+
+int tdb_file_open(TDB *db, unsigned long size, unsigned long max_size);
+unsigned long tdb_file_extend(TDB *db, unsigned long size);
 void tdb_file_close(TDB *db);
+void tdb_file_checkpoint(TDB *db);
 int tdb_init_mappings(void);
 
 #endif /* __FILE_H__ */
@@ -27,16 +27,26 @@
  * this program; if not, write to the Free Software Foundation, Inc., 59
  * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
+#include <linux/bitmap.h>
 #include <linux/bitops.h>
+#include <linux/hash.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <asm/sync_bitops.h>
 
 #include "lib/str.h"
 #include "htrie.h"
 
-#define TDB_MAGIC	0x434947414D424454UL /* "TDBMAGIC" */
 #define TDB_BLK_SZ	PAGE_SIZE
 #define TDB_BLK_MASK	(~(TDB_BLK_SZ - 1))
+/* Reference counter value of a released block with stale data. */
+#define TDB_BLK_DIRTY	(-1)
+/* Reference counter value of a block in a run, but not the first one. */
+#define TDB_BLK_RUN	(-2)
+/* Maximum number of blocks in a run, the first extent block isn't used. */
+#define TDB_BLK_RUN_MAX	(TDB_EXT_SZ / TDB_BLK_SZ - 1)
 
 /**
  * Tempesta DB extent descriptor.
@@ -86,14 +96,41 @@ tdb_set_bit(unsigned long *bmp, unsigned int nr)
 	set_bit(nr % BITS_PER_LONG, bmp + nr / BITS_PER_LONG);
 }
 
+/**
+ * Current size of the table, which may be extended concurrently.
+ */
+static inline unsigned long
+tdb_htrie_size(TdbHdr *dbh)
+{
+	/* Pairs with smp_store_release() in tdb_htrie_extend(). */
+	return smp_load_acquire(&dbh->dbsz);
+}
+
+/**
+ * Check that index node shift @o references an index node or a data bucket
+ * within the table. Index nodes and buckets are addressed in different units.
+ */
+static inline bool
+tdb_htrie_shift_bad(TdbHdr *dbh, unsigned long o)
+{
+	unsigned long off = o & TDB_HTRIE_DBIT
+			    ? TDB_DI2O(o & ~TDB_HTRIE_DBIT)
+			    : TDB_II2O(o);
+
+	return off < TDB_HDR_SZ(dbh) + sizeof(TdbExt)
+	       || off > tdb_htrie_size(dbh);
+}
+
 static TdbHdr *
-tdb_init_mapping(void *p, size_t db_size, unsigned int rec_len)
+tdb_init_mapping(void *p, size_t db_size, size_t max_size,
+		 unsigned int rec_len)
 {
 	int b, hdr_sz;
 	TdbHdr *hdr = (TdbHdr *)p;
 
-	if (db_size > TDB_MAX_DB_SZ) {
-		TDB_ERR("too large database size (%lu)", db_size);
+	if (max_size > TDB_MAX_DB_SZ || db_size > max_size) {
+		TDB_ERR("bad database size (%lu) or maximum size (%lu)",
+			db_size, max_size);
 		return NULL;
 	}
 	/* Use variable-size records for large data to store. */
@@ -129,7 +166,7 @@ tdb_free_index_blk(TdbHtrieNode *node)
 	bzero_fast(node, sizeof(*node));
 }
 
-/* TODO synchronize the bucket access. */
+/* The bucket isn't linked with the index yet, so nobody can access it. */
 static inline void
 tdb_free_data_blk(TdbBucket *bckt)
 {
@@ -148,6 +185,71 @@ tdb_free_vsrec(TdbVRec *rec)
 	rec->len |= TDB_HTRIE_VRFREED;
 }
 
+/*
+ * Data blocks are shared by several allocations, so we count references to
+ * a block: one per each allocated record or record chunk and one more while
+ * the block is a per-CPU current data block. The block is returned to the
+ * extent bitmap when the last reference is released.
+ *
+ * A run of contiguous blocks allocated for a large record or record chunk
+ * is never shared, so only the first block of the run is referenced and the
+ * rest of the blocks are marked with TDB_BLK_RUN. The whole run is released
+ * with the first block.
+ */
+static inline void
+tdb_blk_get(TdbHdr *dbh, unsigned long o)
+{
+	if (dbh->blk_ref)
+		atomic_inc(&dbh->blk_ref[o / TDB_BLK_SZ]);
+}
+
+static void
+tdb_blk_put(TdbHdr *dbh, unsigned long o)
+{
+	TdbExt *e;
+	atomic_t *ref;
+
+	if (!dbh->blk_ref)
+		return;
+
+	ref = &dbh->blk_ref[o / TDB_BLK_SZ];
+	if (!atomic_dec_and_test(ref))
+		return;
+
+	e = tdb_ext(dbh, TDB_PTR(dbh, o));
+	do {
+		atomic_set(ref, TDB_BLK_DIRTY);
+		smp_mb__before_atomic();
+		clear_bit(TDB_BLK_ID(o) / TDB_BLK_SZ, e->b_bmp);
+
+		TDB_DBG("Release dblk %#lx\n", TDB_BLK_O(o));
+
+		o = TDB_BLK_O(o) + TDB_BLK_SZ;
+		ref++;
+	} while (TDB_EXT_O(o) == TDB_EXT_O(o - 1)
+		 && atomic_read(ref) == TDB_BLK_RUN);
+}
+
+/**
+ * Zero a reclaimed block at offset @o returned by the block allocator:
+ * the trie code expects that new blocks are zeroed.
+ */
+static void
+tdb_blk_reinit(TdbHdr *dbh, unsigned long o)
+{
+	atomic_t *ref;
+
+	if (!dbh->blk_ref)
+		return;
+
+	ref = &dbh->blk_ref[o / TDB_BLK_SZ];
+	if (atomic_read(ref) != TDB_BLK_DIRTY)
+		return;
+
+	bzero_fast(TDB_PTR(dbh, o), TDB_BLK_SZ - (o & ~TDB_BLK_MASK));
+	atomic_set(ref, 0);
+}
+
 /**
  * Allocates a free block (system page) in extent @e.
  * @return start of available room (offset in bytes) at the block.
@@ -185,6 +287,27 @@ repeat:
 	       + (i * BITS_PER_LONG + r) * TDB_BLK_SZ;
 }
 
+/**
+ * All the extents are in use, so scan them for blocks released by removed
+ * records. This is slow, but happens only when the database is full.
+ */
+static unsigned long
+tdb_alloc_blk_freed(TdbHdr *dbh)
+{
+	unsigned long o, rptr;
+
+	if (!dbh->blk_ref)
+		return 0;
+
+	for (o = 0; o < tdb_htrie_size(dbh); o += TDB_EXT_SZ) {
+		rptr = __tdb_alloc_blk_ext(dbh, tdb_ext(dbh, TDB_PTR(dbh, o)));
+		if (rptr)
+			return rptr;
+	}
+
+	return 0;
+}
+
 static unsigned long
 tdb_alloc_blk(TdbHdr *dbh)
 {
@@ -219,13 +342,16 @@ retry:
 	 * The new extent should be used.
 	 * Whole extent shouldn't be fully utilized by concurrent contexts
 	 * while we're in the function, so we expect that it will satisfy
-	 * our allocation request.
+	 * our allocation request. The table could be extended after a
+	 * concurrent context got the last extent, so re-read the size.
 	 */
-	if (unlikely(TDB_HTRIE_OFF(dbh, e) == dbh->dbsz)) {
+	if (unlikely(TDB_HTRIE_OFF(dbh, e) >= tdb_htrie_size(dbh))) {
+		rptr = tdb_alloc_blk_freed(dbh);
+		if (rptr)
+			goto reclaimed;
 		TDB_ERR("out of free space\n");
 		return 0;
 	}
-	BUG_ON(TDB_HTRIE_OFF(dbh, e) > dbh->dbsz);
 	set_bit(TDB_EXT_ID(TDB_EXT_BASE(dbh, e)), dbh->ext_bmp);
 
 	TDB_DBG("Allocated new extent %p\n", e);
@@ -238,6 +364,9 @@ allocated:
 	for ( ; g_nwb <= rptr; g_nwb = atomic64_read(&dbh->nwb))
 		atomic64_cmpxchg(&dbh->nwb, g_nwb, next_blk);
 
+reclaimed:
+	tdb_blk_reinit(dbh, rptr);
+
 	/*
 	 * Align offsets of new blocks for data records.
 	 * This is only for first blocks in extents, so we lose only
@@ -246,12 +375,104 @@ allocated:
 	return TDB_HTRIE_DALIGN(rptr);
 }
 
+/**
+ * Allocates a run of @n contiguous free blocks in extent @e. The first block
+ * of an extent keeps the extent descriptor, so it's never used for runs.
+ * @return byte offset of the run or 0 if there is no room for it.
+ */
+static unsigned long
+__tdb_alloc_run_ext(TdbHdr *dbh, TdbExt *e, unsigned int n)
+{
+	unsigned int i, b = 1;
+
+retry:
+	b = bitmap_find_next_zero_area(e->b_bmp, TDB_EXT_SZ / TDB_BLK_SZ, b,
+				       n, 0);
+	if (b + n > TDB_EXT_SZ / TDB_BLK_SZ)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		if (!sync_test_and_set_bit(b + i, e->b_bmp))
+			continue;
+		/* Race conflict, release the grabbed blocks and retry. */
+		while (i--)
+			sync_clear_bit(b + i, e->b_bmp);
+		b++;
+		goto retry;
+	}
+
+	return TDB_EXT_BASE(dbh, e) + b * TDB_BLK_SZ;
+}
+
+/**
+ * Allocates a run of @n contiguous blocks for a large record. The run is
+ * looked up in the current extent, in the next one and in all the extents
+ * if the database is full, like tdb_alloc_blk() does for a single block.
+ * @return byte offset of the run or 0 if there is no such room.
+ */
+static unsigned long
+tdb_alloc_run(TdbHdr *dbh, unsigned int n)
+{
+	TdbExt *e;
+	unsigned int i;
+	unsigned long o;
+	long g_nwb, rptr, next_blk;
+
+	BUG_ON(n < 2 || n > TDB_BLK_RUN_MAX);
+
+	g_nwb = atomic64_read(&dbh->nwb);
+	e = tdb_ext(dbh, TDB_PTR(dbh, g_nwb));
+
+	if (likely(g_nwb & ~TDB_EXT_MASK)) {
+		rptr = __tdb_alloc_run_ext(dbh, e, n);
+		if (rptr)
+			goto allocated;
+		e = tdb_ext(dbh, TDB_PTR(dbh, TDB_EXT_O(g_nwb) + TDB_EXT_SZ));
+	}
+
+	if (likely(TDB_HTRIE_OFF(dbh, e) < tdb_htrie_size(dbh))) {
+		set_bit(TDB_EXT_ID(TDB_EXT_BASE(dbh, e)), dbh->ext_bmp);
+		rptr = __tdb_alloc_run_ext(dbh, e, n);
+		if (rptr)
+			goto allocated;
+		return 0;
+	}
+
+	if (!dbh->blk_ref)
+		return 0;
+	for (o = 0; o < tdb_htrie_size(dbh); o += TDB_EXT_SZ) {
+		rptr = __tdb_alloc_run_ext(dbh, tdb_ext(dbh, TDB_PTR(dbh, o)),
+					   n);
+		if (rptr)
+			goto reclaimed;
+	}
+
+	return 0;
+
+allocated:
+	next_blk = rptr + n * TDB_BLK_SZ;
+	for ( ; g_nwb <= rptr; g_nwb = atomic64_read(&dbh->nwb))
+		atomic64_cmpxchg(&dbh->nwb, g_nwb, next_blk);
+
+reclaimed:
+	for (i = 0; i < n; i++) {
+		tdb_blk_reinit(dbh, rptr + i * TDB_BLK_SZ);
+		if (i && dbh->blk_ref)
+			atomic_set(&dbh->blk_ref[rptr / TDB_BLK_SZ + i],
+				   TDB_BLK_RUN);
+	}
+
+	return rptr;
+}
+
 static void
 tdb_htrie_init_bucket(TdbBucket *b)
 {
+	memset(b->tags, 0, sizeof(b->tags));
 	b->coll_next = 0;
 	b->flags = 0;
-	rwlock_init(&b->lock);
+	spin_lock_init(&b->lock);
+	seqcount_init(&b->seq);
 #ifdef CONFIG_LOCKDEP
 	/*
 	 * To lock buckets in a chain for the trie traversal.
@@ -273,8 +494,13 @@ tdb_htrie_init_bucket(TdbBucket *b)
  *      we need this to properly calculate length.
  *      This mess must be fixed.
  *
- * TODO Allocate sequence of pages if there are any for large @len.
- *      Probably we should use external location for large data.
+ * Data larger than a block is placed in a run of contiguous blocks, at most
+ * an extent wide, so it's read sequentially and can be referenced by few
+ * large page fragments. The tail of the last run block isn't used by other
+ * allocations. If there is no room for the run, then a single block is
+ * allocated as for smaller data.
+ *
+ * TODO Probably we should use external location for large data.
  *      Defragment memory blocks in background by page table remappings.
  */
 static unsigned long
@@ -283,7 +509,7 @@ tdb_alloc_data(TdbHdr *dbh, size_t *len, int bucket_hdr)
 	unsigned long rptr, new_wcl;
 	size_t hdr_len, res_len = *len;
 
-	hdr_len = (bucket_hdr ? sizeof(TdbBucket) : 0)
+	hdr_len = (bucket_hdr ? TDB_HTRIE_BCKT_HDR_SZ : 0)
 		  + (TDB_HTRIE_VARLENRECS(dbh)
 		     ? sizeof(TdbVRec)
 		     : sizeof(TdbFRec));
@@ -295,6 +521,23 @@ tdb_alloc_data(TdbHdr *dbh, size_t *len, int bucket_hdr)
 	 */
 	res_len = TDB_HTRIE_DALIGN(res_len);
 
+	if (res_len > TDB_BLK_SZ) {
+		unsigned int n = min_t(size_t, DIV_ROUND_UP(res_len, TDB_BLK_SZ),
+				       TDB_BLK_RUN_MAX);
+
+		rptr = tdb_alloc_run(dbh, n);
+		if (rptr) {
+			if (res_len > n * TDB_BLK_SZ) {
+				res_len = n * TDB_BLK_SZ;
+				*len = res_len - hdr_len;
+			}
+			TDB_DBG("alloc run %#lx of %u blocks for len=%lu\n",
+				rptr, n, *len);
+			tdb_blk_get(dbh, rptr);
+			goto init;
+		}
+	}
+
 	local_bh_disable();
 
 	rptr = this_cpu_ptr(dbh->pcpu)->d_wcl;
@@ -303,6 +546,7 @@ tdb_alloc_data(TdbHdr *dbh, size_t *len, int bucket_hdr)
 	    || TDB_BLK_O(rptr + res_len) > TDB_BLK_O(rptr))
 	{
 		size_t max_data_len;
+		unsigned long old_wcl = rptr;
 
 		/*
 		 * Use a new page and/or extent for the data.
@@ -311,6 +555,13 @@ tdb_alloc_data(TdbHdr *dbh, size_t *len, int bucket_hdr)
 		rptr = tdb_alloc_blk(dbh);
 		if (!rptr)
 			goto out;
+		/*
+		 * Move the current block reference to the new block. @old_wcl
+		 * points to the end of the previous block if it's fully used.
+		 */
+		tdb_blk_get(dbh, rptr);
+		if (old_wcl)
+			tdb_blk_put(dbh, old_wcl - 1);
 
 		max_data_len = TDB_BLK_SZ - (rptr & ~TDB_BLK_MASK);
 		if (res_len > max_data_len) {
@@ -328,15 +579,19 @@ tdb_alloc_data(TdbHdr *dbh, size_t *len, int bucket_hdr)
 	new_wcl = rptr + res_len;
 	BUG_ON(TDB_HTRIE_DALIGN(new_wcl) != new_wcl);
 	this_cpu_ptr(dbh->pcpu)->d_wcl = new_wcl;
+	tdb_blk_get(dbh, rptr);
 
+	local_bh_enable();
+init:
 	if (bucket_hdr) {
 		tdb_htrie_init_bucket(TDB_PTR(dbh, rptr));
-		rptr += sizeof(TdbBucket);
+		rptr += TDB_HTRIE_BCKT_HDR_SZ;
 	}
 
+	return rptr;
 out:
 	local_bh_enable();
-	return rptr;
+	return 0;
 }
 
 /**
@@ -372,6 +627,332 @@ out:
 	return rptr;
 }
 
+/**
+ * Full length of record @r including its header in a bucket.
+ */
+static inline size_t
+tdb_htrie_rlen(TdbHdr *dbh, TdbRec *r)
+{
+	size_t hdr = TDB_HTRIE_VARLENRECS(dbh) ? sizeof(TdbVRec)
+					       : sizeof(TdbFRec);
+
+	return TDB_HTRIE_RALIGN(hdr + TDB_HTRIE_RBODYLEN(dbh, r));
+}
+
+/**
+ * @return the record following @r in bucket @b or NULL if @r is the last one.
+ * Only the first record of a bucket can exceed TDB_HTRIE_MINDREC.
+ */
+static TdbRec *
+tdb_htrie_rec_after(TdbHdr *dbh, TdbBucket *b, TdbRec *r)
+{
+	r = (TdbRec *)((char *)r + tdb_htrie_rlen(dbh, r));
+	if ((char *)r + sizeof(*r) - (char *)b > TDB_HTRIE_MINDREC
+	    || (char *)r + tdb_htrie_rlen(dbh, r) - (char *)b
+	       > TDB_HTRIE_MINDREC)
+		return NULL;
+
+	return r;
+}
+
+/**
+ * Records retired in a bucket, see TdbBucket.
+ *
+ * @dbh		- database header;
+ * @b		- the bucket;
+ * @removed	- slots of removed records, their chunks are released;
+ * @moved	- slots of records copied to other buckets by a burst;
+ */
+typedef struct {
+	struct rcu_head	rcu;
+	TdbHdr		*dbh;
+	TdbBucket	*b;
+	unsigned int	removed;
+	unsigned int	moved;
+} TdbRetired;
+
+/*
+ * Records pinned by zero-copy transmission of their data, see tdb_htrie_pin().
+ * The pins are hashed by the first chunk of the record, which is shared with
+ * a copy of the record made by a burst, or by the record address if the
+ * record has no chunks.
+ */
+#define TDB_PIN_BITS		8
+
+/**
+ * Pinned record.
+ *
+ * @hentry	- entry in the pins hash table;
+ * @dbh		- database header;
+ * @rec		- the record;
+ * @chunk	- index of the first chunk of the record;
+ * @count	- number of pins of the record;
+ * @removed	- the record slot if it's removed but not freed yet;
+ * @moved	- the record slot if it's moved but not freed yet;
+ * @chunks	- the chunks are released by a copy of the record, but they're
+ *		  not freed yet;
+ */
+typedef struct {
+	struct hlist_node	hentry;
+	TdbHdr			*dbh;
+	TdbRec			*rec;
+	unsigned int		chunk;
+	unsigned int		count;
+	unsigned int		removed;
+	unsigned int		moved;
+	bool			chunks;
+} TdbPin;
+
+typedef struct {
+	spinlock_t		lock;
+	struct hlist_head	list;
+} TdbPinBucket;
+
+static TdbPinBucket tdb_pins[1 << TDB_PIN_BITS];
+
+static unsigned int
+tdb_htrie_rec_chunk(TdbHdr *dbh, TdbRec *r)
+{
+	return TDB_HTRIE_VARLENRECS(dbh) ? ((TdbVRec *)r)->chunk_next : 0;
+}
+
+static TdbPinBucket *
+tdb_htrie_pin_bucket(TdbRec *r, unsigned int chunk)
+{
+	unsigned int h = chunk ? hash_32(chunk, TDB_PIN_BITS)
+			       : hash_ptr(r, TDB_PIN_BITS);
+
+	return &tdb_pins[h];
+}
+
+static void
+tdb_htrie_free_chunks(TdbHdr *dbh, unsigned int next)
+{
+	while (next) {
+		TdbVRec *chunk = TDB_PTR(dbh, TDB_DI2O(next));
+
+		next = chunk->chunk_next;
+		tdb_blk_put(dbh, TDB_HTRIE_OFF(dbh, chunk));
+	}
+}
+
+/**
+ * Defer freeing of retired record @r if it's pinned: its @removed or @moved
+ * slot is freed by tdb_htrie_unpin().
+ *
+ * Called under bucket lock.
+ */
+static bool
+tdb_htrie_pin_defer(TdbHdr *dbh, TdbRec *r, unsigned int removed,
+		    unsigned int moved)
+{
+	TdbPin *p;
+	TdbPinBucket *pb = tdb_htrie_pin_bucket(r, tdb_htrie_rec_chunk(dbh, r));
+
+	spin_lock(&pb->lock);
+	hlist_for_each_entry(p, &pb->list, hentry) {
+		if (p->rec == r) {
+			p->removed |= removed;
+			p->moved |= moved;
+			break;
+		}
+	}
+	spin_unlock(&pb->lock);
+
+	return p;
+}
+
+/**
+ * Defer freeing of chunks starting from @chunk of a removed record if they
+ * are shared with a pinned record. The chunks are freed by tdb_htrie_unpin().
+ *
+ * Called under bucket lock.
+ */
+static bool
+tdb_htrie_pin_defer_chunks(TdbHdr *dbh, unsigned int chunk)
+{
+	TdbPin *p;
+	TdbPinBucket *pb = tdb_htrie_pin_bucket(NULL, chunk);
+
+	spin_lock(&pb->lock);
+	hlist_for_each_entry(p, &pb->list, hentry) {
+		if (p->dbh == dbh && p->chunk == chunk) {
+			p->chunks = true;
+			break;
+		}
+	}
+	spin_unlock(&pb->lock);
+
+	return p;
+}
+
+/**
+ * Free the records retired in the bucket after RCU grace period, when
+ * nobody can use them. Free room at the end of the bucket is zeroed to be
+ * reused by small records.
+ */
+static void
+tdb_htrie_reclaim(struct rcu_head *rcu)
+{
+	TdbRetired *tr = container_of(rcu, TdbRetired, rcu);
+	TdbHdr *dbh = tr->dbh;
+	TdbBucket *b = tr->b;
+	TdbRec *r = TDB_HTRIE_BCKT_1ST_REC(b);
+	char *end;
+
+	tdb_htrie_bucket_lock(b);
+
+	/* Always leave the first record in the bucket. */
+	end = (char *)r + tdb_htrie_rlen(dbh, r);
+	for ( ; r; r = tdb_htrie_rec_after(dbh, b, r)) {
+		unsigned int slot = TDB_HTRIE_SLOT(b, r);
+
+		if (slot & (tr->removed | tr->moved)) {
+			TdbVRec *vr = (TdbVRec *)r;
+			unsigned int next;
+
+			if (tdb_htrie_pin_defer(dbh, r, slot & tr->removed,
+						slot & tr->moved))
+			{
+				end = (char *)r + tdb_htrie_rlen(dbh, r);
+				continue;
+			}
+			b->flags &= ~slot;
+			b->tags[TDB_HTRIE_SLOT_ID(b, r)] = 0;
+			if (!TDB_HTRIE_VARLENRECS(dbh)) {
+				tdb_free_fsrec(dbh, (TdbFRec *)r);
+				continue;
+			}
+			/* Chunks of moved records belong to their copies. */
+			next = (slot & tr->removed) ? vr->chunk_next : 0;
+			vr->chunk_next = 0;
+			tdb_free_vsrec(vr);
+			if (!next || !tdb_htrie_pin_defer_chunks(dbh, next))
+				tdb_htrie_free_chunks(dbh, next);
+		} else if (tdb_live_rec(dbh, r) || TDB_HTRIE_RETIRED(b, r)) {
+			end = (char *)r + tdb_htrie_rlen(dbh, r);
+		}
+	}
+	if (end - (char *)b < TDB_HTRIE_MINDREC)
+		bzero_fast(end, TDB_HTRIE_MINDREC - (end - (char *)b));
+
+	tdb_htrie_bucket_unlock(b);
+
+	kfree(tr);
+}
+
+/**
+ * Make records of @removed and @moved slots of bucket @b invisible for
+ * lookups and free them after RCU grace period, the readers can still use
+ * the records until the end of their RCU read-side sections. Use @tr
+ * preallocated descriptor if it's specified.
+ *
+ * Called under bucket lock.
+ */
+static void
+tdb_htrie_retire(TdbHdr *dbh, TdbBucket *b, TdbRetired *tr,
+		 unsigned int removed, unsigned int moved)
+{
+	b->flags |= removed | moved;
+
+	if (!tr && !(tr = kmalloc(sizeof(*tr), GFP_ATOMIC))) {
+		/* Leak the records rather than free them under readers. */
+		TDB_WARN("cannot reclaim records of bucket %p\n", b);
+		return;
+	}
+	tr->dbh = dbh;
+	tr->b = b;
+	tr->removed = removed;
+	tr->moved = moved;
+	call_rcu(&tr->rcu, tdb_htrie_reclaim);
+}
+
+/**
+ * Pin record @rec, so the record data isn't freed when the record is removed
+ * until tdb_htrie_unpin(). RCU protects the records only during lookups,
+ * while the pin keeps the data valid as long as it's needed, e.g. until the
+ * network stack completes a zero-copy transmission of the data. The record
+ * must be complete and it's pinned in the RCU read-side section which found
+ * the record.
+ *
+ * @return the pin handle or NULL on memory allocation failure.
+ */
+void *
+tdb_htrie_pin(TdbHdr *dbh, TdbRec *rec)
+{
+	TdbPin *p;
+	unsigned int chunk = tdb_htrie_rec_chunk(dbh, rec);
+	TdbPinBucket *pb = tdb_htrie_pin_bucket(rec, chunk);
+
+	spin_lock_bh(&pb->lock);
+	hlist_for_each_entry(p, &pb->list, hentry)
+		if (p->rec == rec)
+			goto found;
+	if (!(p = kmalloc(sizeof(*p), GFP_ATOMIC)))
+		goto out;
+	p->dbh = dbh;
+	p->rec = rec;
+	p->chunk = chunk;
+	p->count = 0;
+	p->removed = p->moved = 0;
+	p->chunks = false;
+	hlist_add_head(&p->hentry, &pb->list);
+found:
+	++p->count;
+out:
+	spin_unlock_bh(&pb->lock);
+
+	return p;
+}
+
+/**
+ * Release pin @pin of a record and free the record data if it was removed
+ * while the record was pinned. Can be called in any context except hardirq.
+ */
+void
+tdb_htrie_unpin(void *pin)
+{
+	TdbPin *p = pin;
+	TdbHdr *dbh = p->dbh;
+	TdbPinBucket *pb = tdb_htrie_pin_bucket(p->rec, p->chunk);
+
+	spin_lock_bh(&pb->lock);
+	if (--p->count) {
+		spin_unlock_bh(&pb->lock);
+		return;
+	}
+	hlist_del(&p->hentry);
+	spin_unlock_bh(&pb->lock);
+
+	if (p->removed | p->moved) {
+		TdbBucket *b = (TdbBucket *)((unsigned long)p->rec
+					     & TDB_HTRIE_DMASK);
+
+		/* The record is already invisible for lookups. */
+		tdb_htrie_bucket_lock(b);
+		tdb_htrie_retire(dbh, b, NULL, p->removed, p->moved);
+		tdb_htrie_bucket_unlock(b);
+	}
+	if (p->chunks) {
+		local_bh_disable();
+		tdb_htrie_free_chunks(dbh, p->chunk);
+		local_bh_enable();
+	}
+
+	kfree(p);
+}
+
+void
+tdb_htrie_pins_init(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(tdb_pins); ++i) {
+		spin_lock_init(&tdb_pins[i].lock);
+		INIT_HLIST_HEAD(&tdb_pins[i].list);
+	}
+}
+
 /**
  * Lookup for some room just after @b bucket if it's small enough.
  * Traverses the collision chain in hope to find some room somewhere.
@@ -390,7 +971,9 @@ tdb_htrie_smallrec_link(TdbHdr *dbh, size_t len, TdbBucket *bckt)
 		TDB_HTRIE_FOREACH_REC_UNLOCKED(dbh, bckt, r) {
 			n = (char *)r - (char *)bckt
 			    + TDB_HTRIE_RALIGN(sizeof(*r) + len);
-			if (!tdb_live_vsrec(r) && n <= TDB_HTRIE_MINDREC) {
+			if (!tdb_live_vsrec(r) && !TDB_HTRIE_RETIRED(bckt, r)
+			    && n <= TDB_HTRIE_MINDREC)
+			{
 				/* Freed record - reuse. */
 				bzero_fast(r, sizeof(*r) + TDB_HTRIE_VRLEN(r));
 				o = TDB_HTRIE_OFF(dbh, r);
@@ -402,7 +985,9 @@ tdb_htrie_smallrec_link(TdbHdr *dbh, size_t len, TdbBucket *bckt)
 		TDB_HTRIE_FOREACH_REC_UNLOCKED(dbh, bckt, r) {
 			n = (char *)r - (char *)bckt
 			    + TDB_HTRIE_RALIGN(sizeof(*r) + len);
-			if (!tdb_live_fsrec(dbh, r) && n <= TDB_HTRIE_MINDREC) {
+			if (!tdb_live_fsrec(dbh, r) && !TDB_HTRIE_RETIRED(bckt, r)
+			    && n <= TDB_HTRIE_MINDREC)
+			{
 				/* Already freed record - just reuse. */
 				o = TDB_HTRIE_OFF(dbh, r);
 				goto done;
@@ -426,18 +1011,21 @@ done:
  * 		  determine next tree branch offset at new node created by
  * 		  the function.
  *
- * Called under bucket lock, so we can safely copy and remove records
- * from the bucket.
+ * Called under bucket lock, so we can safely copy records from the bucket.
+ * Lockless readers can use the records, so the records going to other
+ * branches are copied to new buckets and the originals are retired, while
+ * records staying in the bucket aren't moved.
  */
 static int
 tdb_htrie_burst(TdbHdr *dbh, TdbHtrieNode **node, TdbBucket *bckt,
 		unsigned long key, int bits)
 {
-	int i, free_nb;
-	unsigned int new_in_idx;
+	int i;
+	unsigned int new_in_idx, moved = 0;
 	unsigned long k, n;
 	TdbBucket *b = TDB_HTRIE_BCKT_1ST_REC(bckt);
 	TdbHtrieNode *new_in;
+	TdbRetired *tr = NULL;
 	struct {
 		unsigned long	b;
 		unsigned char	off;
@@ -460,8 +1048,6 @@ do {									\
 		bckt, new_in_idx, k, r->key);				\
 	n = TDB_HTRIE_RECLEN(dbh, r);					\
 	nb[k].b = TDB_HTRIE_OFF(dbh, bckt);				\
-	nb[k].off = sizeof(*b) + n;					\
-	free_nb = -(long)k; /* remember which block we save & copy */	\
 	r = (Type *)((char *)r + n);					\
 	for ( ; ; r = (Type *)((char *)r + n)) {			\
 		unsigned long copied = (char *)r - (char *)bckt;	\
@@ -470,11 +1056,15 @@ do {									\
 		n = TDB_HTRIE_RECLEN(dbh, r);				\
 		if (n + copied >= TDB_HTRIE_MINDREC)			\
 			break; /* end of records */			\
-		if (!live)						\
+		if (!(live) || TDB_HTRIE_RETIRED(bckt, r))		\
 			continue;					\
 		/* Small record cannot exceed TDB_HTRIE_MINDREC. */	\
 		BUG_ON(copied + n > TDB_HTRIE_MINDREC);			\
 		k = TDB_HTRIE_IDX(r->key, bits);			\
+		if (nb[k].b == TDB_HTRIE_OFF(dbh, bckt))		\
+			continue; /* the record stays in place */	\
+		if (!tr && !(tr = kmalloc(sizeof(*tr), GFP_ATOMIC)))	\
+			goto err_cleanup;				\
 		if (!nb[k].b) {						\
 			/* Just allocate TDB_HTRIE_MINDREC bytes. */	\
 			size_t _n = 0;					\
@@ -483,22 +1073,17 @@ do {									\
 				goto err_cleanup;			\
 			b = TDB_PTR(dbh, nb[k].b);			\
 			tdb_htrie_init_bucket(b);			\
-			memcpy_fast(TDB_HTRIE_BCKT_1ST_REC(b), r, n);	\
-			nb[k].off = sizeof(*b) + n;			\
+			nb[k].off = TDB_HTRIE_BCKT_HDR_SZ;		\
 			new_in->shifts[k] = TDB_O2DI(nb[k].b) | TDB_HTRIE_DBIT;\
-			/* We copied a record, clear its original place. */\
-			free_nb = free_nb > 0 ? free_nb : -free_nb;	\
-			TDB_DBG("burst: copied rec=%p (len=%lu key=%#lx)"\
-				" to new dblk=%#lx w/ idx=%#lx\n",	\
-				r, n, r->key, nb[k].b, k);		\
-		} else {						\
-			b = TDB_PTR(dbh, nb[k].b + nb[k].off);		\
-			memmove(b, r, n);				\
-			nb[k].off += n;					\
-			TDB_DBG("burst: moved rec=%p (len=%lu key=%#lx)"\
-				" to dblk=%#lx w/ idx=%#lx\n",		\
-				r, n, r->key, nb[k].b, k);		\
 		}							\
+		b = TDB_PTR(dbh, nb[k].b);				\
+		memcpy_fast((char *)b + nb[k].off, r, n);		\
+		b->tags[nb[k].off / 8] = tdb_htrie_key_tag(r->key);	\
+		nb[k].off += n;						\
+		moved |= TDB_HTRIE_SLOT(bckt, r);			\
+		TDB_DBG("burst: copied rec=%p (len=%lu key=%#lx)"	\
+			" to dblk=%#lx w/ idx=%#lx\n",			\
+			r, n, r->key, nb[k].b, k);			\
 	}								\
 } while (0)
 
@@ -519,21 +1104,19 @@ do {									\
 	(*node)->shifts[k] = new_in_idx;
 	*node = new_in;
 
-	/* Now we can safely remove all copied records. */
-	if (free_nb > 0) {
-		TDB_DBG("clear dblk=%#lx from %#x\n",
-			nb[free_nb].b, nb[free_nb].off);
-		bzero_fast(TDB_PTR(dbh, nb[free_nb].b + nb[free_nb].off),
-			   TDB_HTRIE_MINDREC - nb[free_nb].off);
-	}
+	/* The copied records are reachable by the new index node now. */
+	if (moved)
+		tdb_htrie_retire(dbh, bckt, tr, 0, moved);
+	else
+		kfree(tr);
 
 	return 0;
 err_cleanup:
-	if (free_nb > 0)
-		for (i = 0; i < TDB_HTRIE_FANOUT; ++i)
-			if (i != free_nb && nb[i].b)
-				tdb_free_data_blk(TDB_PTR(dbh, nb[i].b));
+	for (i = 0; i < TDB_HTRIE_FANOUT; ++i)
+		if (nb[i].b && nb[i].b != TDB_HTRIE_OFF(dbh, bckt))
+			tdb_free_data_blk(TDB_PTR(dbh, nb[i].b));
 	tdb_free_index_blk(new_in);
+	kfree(tr);
 	return -ENOMEM;
 }
 
@@ -560,11 +1143,7 @@ tdb_htrie_descend(TdbHdr *dbh, TdbHtrieNode **node, unsigned long key,
 
 		o = (*node)->shifts[TDB_HTRIE_IDX(key, *bits)];
 
-		BUG_ON(o
-		       && (TDB_DI2O(o & ~TDB_HTRIE_DBIT)
-				< TDB_HDR_SZ(dbh) + sizeof(TdbExt)
-			   || TDB_DI2O(o & ~TDB_HTRIE_DBIT)
-				> dbh->dbsz));
+		BUG_ON(o && tdb_htrie_shift_bad(dbh, o));
 
 		if (o & TDB_HTRIE_DBIT) {
 			/* We're at a data pointer - resolve it. */
@@ -587,6 +1166,7 @@ tdb_htrie_create_rec(TdbHdr *dbh, unsigned long off, unsigned long key,
 {
 	char *ptr = TDB_PTR(dbh, off);
 	TdbRec *r = (TdbRec *)ptr;
+	TdbBucket *b = TDB_PTR(dbh, off & TDB_HTRIE_DMASK);
 
 	BUG_ON(r->key);
 	r->key = key;
@@ -601,6 +1181,7 @@ tdb_htrie_create_rec(TdbHdr *dbh, unsigned long off, unsigned long key,
 	}
 	if (data)
 		memcpy_fast(ptr, data, len);
+	b->tags[TDB_HTRIE_SLOT_ID(b, r)] = tdb_htrie_key_tag(key);
 
 	return r;
 }
@@ -645,6 +1226,57 @@ retry:
 	return chunk;
 }
 
+/**
+ * Reuse the first record of bucket @bckt if the record was removed and it's
+ * a large record, i.e. there are no other records in the bucket. The bucket
+ * is linked with the index, so it isn't released with the record data
+ * blocks and the same bucket is the only way to reuse the memory.
+ * Small records are reused by tdb_htrie_smallrec_link().
+ *
+ * Called under bucket lock.
+ */
+static TdbRec *
+tdb_htrie_reuse_rec(TdbHdr *dbh, TdbBucket *bckt, unsigned long key,
+		    void *data, size_t *len)
+{
+	size_t room;
+	TdbVRec *r = TDB_HTRIE_BCKT_1ST_REC(bckt);
+
+	if (!TDB_HTRIE_VARLENRECS(dbh) || tdb_live_vsrec(r)
+	    || TDB_HTRIE_RETIRED(bckt, r) || !TDB_HTRIE_LARGEREC(*len))
+		return NULL;
+
+	room = TDB_HTRIE_VRLEN(r);
+	if (!TDB_HTRIE_LARGEREC(room))
+		return NULL;
+	if (*len > room)
+		*len = room;
+
+	TDB_DBG("Reuse freed record %p (len=%lu) for key=%#lx len=%lu\n",
+		r, room, key, *len);
+
+	bzero_fast(r, sizeof(*r) + room);
+
+	return tdb_htrie_create_rec(dbh, TDB_HTRIE_OFF(dbh, r), key, data, *len);
+}
+
+/**
+ * Remove record @rec and release all its chunks after RCU grace period.
+ * The record header stays in the bucket and is reused by next insertions
+ * to the bucket.
+ *
+ * Called under bucket lock.
+ */
+void
+tdb_htrie_remove(TdbHdr *dbh, TdbRec *rec)
+{
+	TdbBucket *b = (TdbBucket *)((unsigned long)rec & TDB_HTRIE_DMASK);
+
+	BUG_ON(!tdb_live_rec(dbh, rec) || TDB_HTRIE_RETIRED(b, rec));
+
+	tdb_htrie_retire(dbh, b, NULL, TDB_HTRIE_SLOT(b, rec), 0);
+}
+
 /**
  * @len returns number of copied data on success.
  *
@@ -667,10 +1299,14 @@ tdb_htrie_insert(TdbHdr *dbh, unsigned long key, void *data, size_t *len)
 		return NULL;
 
 retry:
+	/* Dead buckets are released by tdb_htrie_compact() after grace period. */
+	rcu_read_lock_bh();
 	o = tdb_htrie_descend(dbh, &node, key, &bits);
 	if (!o) {
 		int i;
 
+		rcu_read_unlock_bh();
+
 		TDB_DBG("Create a new htrie node for key=%#lx len=%lu"
 			" bits_used=%d\n", key, *len, bits);
 
@@ -696,7 +1332,7 @@ retry:
 	bckt = TDB_PTR(dbh, o);
 	BUG_ON(!bckt);
 
-	write_lock_bh(&bckt->lock);
+	tdb_htrie_bucket_lock(bckt);
 
 	/*
 	 * Recheck last index node in case of just inserted new nodes -
@@ -711,13 +1347,22 @@ retry:
 		bits_cur = bits - TDB_HTRIE_BITS;
 		o_new = node->shifts[TDB_HTRIE_IDX(key, bits_cur)];
 
-		if (!o_new || TDB_DI2O(o_new & ~TDB_HTRIE_DBIT) != o) {
+		if (o_new != (TDB_O2DI(o) | TDB_HTRIE_DBIT)) {
 			/* Try to descend again from the last index node. */
 			bits -= TDB_HTRIE_BITS;
-			write_unlock_bh(&bckt->lock);
+			tdb_htrie_bucket_unlock(bckt);
+			rcu_read_unlock_bh();
 			goto retry;
 		}
 	}
+	/* The bucket is linked with the index and can't be released now. */
+	rcu_read_unlock_bh();
+
+	rec = tdb_htrie_reuse_rec(dbh, bckt, key, data, len);
+	if (rec) {
+		tdb_htrie_bucket_unlock(bckt);
+		return rec;
+	}
 
 	/*
 	 * Try to place the small record in preallocated room for
@@ -736,7 +1381,7 @@ retry:
 		o = tdb_htrie_smallrec_link(dbh, n, bckt);
 		if (o) {
 			rec = tdb_htrie_create_rec(dbh, o, key, data, *len);
-			write_unlock_bh(&bckt->lock);
+			tdb_htrie_bucket_unlock(bckt);
 			return rec;
 		}
 	}
@@ -750,21 +1395,27 @@ retry:
 
 		while (bckt->coll_next && !(bckt->flags & TDB_HTRIE_VRFREED)) {
 			TdbBucket *next = TDB_HTRIE_BUCKET_NEXT(dbh, bckt);
-			write_lock_bh(&next->lock);
-			write_unlock_bh(&bckt->lock);
+			tdb_htrie_bucket_lock(next);
+			tdb_htrie_bucket_unlock(bckt);
 			bckt = next;
+
+			rec = tdb_htrie_reuse_rec(dbh, bckt, key, data, len);
+			if (rec) {
+				tdb_htrie_bucket_unlock(bckt);
+				return rec;
+			}
 		}
 
 		o = tdb_alloc_data(dbh, len, 1);
 		if (!o) {
-			write_unlock_bh(&bckt->lock);
+			tdb_htrie_bucket_unlock(bckt);
 			return NULL;
 		}
 
 		rec = tdb_htrie_create_rec(dbh, o, key, data, *len);
 		bckt->coll_next = TDB_O2DI(o);
 
-		write_unlock_bh(&bckt->lock);
+		tdb_htrie_bucket_unlock(bckt);
 
 		return rec;
 	}
@@ -781,13 +1432,13 @@ retry:
 		bits, key, *len, bckt);
 
 	if (tdb_htrie_burst(dbh, &node, bckt, key, bits)) {
-		write_unlock_bh(&bckt->lock);
+		tdb_htrie_bucket_unlock(bckt);
 		TDB_ERR("Cannot burst node=%p and bckt=%p for key %#lx\n",
 			node, bckt, key);
 		return NULL;
 	}
 
-	write_unlock_bh(&bckt->lock);
+	tdb_htrie_bucket_unlock(bckt);
 
 	goto retry;
 }
@@ -806,33 +1457,77 @@ tdb_htrie_lookup(TdbHdr *dbh, unsigned long key)
 	return TDB_PTR(dbh, o);
 }
 
-#define TDB_HTRIE_FOREACH_REC(dbh, b_tmp, b, r, body)			\
-	read_lock_bh(&(*b)->lock);					\
-	do {								\
-		r = TDB_HTRIE_BCKT_1ST_REC(*b);				\
-		do {							\
-			size_t rlen = sizeof(*r) +			\
-				      TDB_HTRIE_RBODYLEN(dbh, r);	\
-			rlen = TDB_HTRIE_RALIGN(rlen);			\
-			if ((char *)r + rlen - (char *)*b		\
-				> TDB_HTRIE_MINDREC			\
-			    && r != TDB_HTRIE_BCKT_1ST_REC(*b))		\
-				break;					\
-			body;						\
-			r = (TdbRec *)((char *)r + rlen);		\
-		} while ((char *)r + sizeof(*r) - (char *)*b		\
-			 <= TDB_HTRIE_MINDREC);				\
-		b_tmp = TDB_HTRIE_BUCKET_NEXT(dbh, *b);			\
-		if (b_tmp)						\
-			read_lock_bh(&b_tmp->lock);			\
-		read_unlock_bh(&(*b)->lock);				\
-		*b = b_tmp;						\
-	} while (*b)
-/**
- * Iterate over all records in collision chain with locked buckets.
- * Buckets are inspected according to following rules:
- * - if first record is > TDB_HTRIE_MINDREC, then only it is observer;
- * - all records which fit TDB_HTRIE_MINDREC.
+#define TDB_HTRIE_TAG_ONES	0x0101010101010101UL
+#define TDB_HTRIE_TAG_LOW7	0x7f7f7f7f7f7f7f7fUL
+
+/**
+ * @return bitmap of the slots of bucket @b tagged by @tag.
+ *
+ * Vector registers can't be used here without saving FPU context, so 8 tags
+ * are compared at once in a general purpose register: each zero byte of
+ * the tags XOR'ed with @tag gets the most significant bit set and the bits
+ * are gathered into one byte by the multiplication.
+ */
+static unsigned int
+tdb_htrie_tag_match(TdbBucket *b, unsigned char tag)
+{
+	int i;
+	unsigned int mask = 0;
+	const unsigned long *w = (const unsigned long *)b->tags;
+
+	for (i = 0; i < sizeof(b->tags) / sizeof(long); ++i) {
+		unsigned long x = READ_ONCE(w[i]) ^ (TDB_HTRIE_TAG_ONES * tag);
+
+		x = ~(((x & TDB_HTRIE_TAG_LOW7) + TDB_HTRIE_TAG_LOW7)
+		      | x | TDB_HTRIE_TAG_LOW7);
+		mask |= ((x >> 7) * 0x0102040810204080UL >> 56) << (i * 8);
+	}
+
+	return mask;
+}
+
+/**
+ * Scan bucket @b for a live record with @key following record @r, or from
+ * the first record if @r is NULL, and set @next to the next bucket in the
+ * collision chain. Only the records with the key tag matching @key are
+ * inspected, so typically the scan touches only the first cache line of
+ * the bucket and the found record.
+ *
+ * The scan is lockless and is repeated if the bucket was modified
+ * concurrently. Called in RCU read-side section, the found record can be
+ * used until the end of the section.
+ */
+static TdbRec *
+tdb_htrie_bscan(TdbHdr *dbh, TdbBucket *b, TdbRec *r, unsigned long key,
+		TdbBucket **next)
+{
+	unsigned int seq, slots;
+	unsigned char tag = tdb_htrie_key_tag(key);
+	TdbRec *res;
+
+	do {
+		seq = read_seqcount_begin(&b->seq);
+		res = NULL;
+		slots = tdb_htrie_tag_match(b, tag) & ~READ_ONCE(b->flags);
+		if (r)
+			slots &= ~((TDB_HTRIE_SLOT(b, r) << 1) - 1);
+		for ( ; slots; slots &= slots - 1) {
+			TdbRec *c = (TdbRec *)((char *)b + __ffs(slots) * 8);
+
+			if (tdb_live_rec(dbh, c) && c->key == key) {
+				res = c;
+				break;
+			}
+		}
+		*next = TDB_HTRIE_BUCKET_NEXT(dbh, b);
+	} while (read_seqcount_retry(&b->seq, seq));
+
+	return res;
+}
+
+/**
+ * Iterate over all records in collision chain starting from bucket @b.
+ * Readers don't lock the buckets and enter RCU read-side section instead.
  *
  * The bucket @b at the head of the list must be alive regardless
  * deleted/evicted records in it.
@@ -840,76 +1535,114 @@ tdb_htrie_lookup(TdbHdr *dbh, unsigned long key)
 TdbRec *
 tdb_htrie_bscan_for_rec(TdbHdr *dbh, TdbBucket **b, unsigned long key)
 {
-	TdbBucket *b_tmp;
 	TdbRec *r;
+	TdbBucket *next;
 
-	TDB_HTRIE_FOREACH_REC(dbh, b_tmp, b, r, {
-		if (tdb_live_rec(dbh, r) && r->key == key)
-			/* Unlock the bucket by tdb_rec_put(). */
+	rcu_read_lock_bh();
+	for ( ; *b; *b = next) {
+		r = tdb_htrie_bscan(dbh, *b, NULL, key, &next);
+		if (r)
+			/* Leave the RCU section by tdb_rec_put(). */
 			return r;
-	});
+	}
+	rcu_read_unlock_bh();
 
 	return NULL;
 }
 
 /**
- * Called with already locked bucket by tdb_htrie_lookup().
- * Unlocks the last bucked when all records are read from it.
+ * Called in RCU read-side section entered by tdb_htrie_bscan_for_rec().
+ * Leaves the section when all records are read.
  */
 TdbRec *
 tdb_htrie_next_rec(TdbHdr *dbh, TdbRec *r, TdbBucket **b, unsigned long key)
 {
-	TdbBucket *_b = *b;
+	TdbBucket *next;
 
-	do {
-		size_t rlen = TDB_HTRIE_RALIGN(sizeof(*r)
-					       + TDB_HTRIE_RBODYLEN(dbh, r));
-		if ((char *)r + rlen - (char *)_b > TDB_HTRIE_MINDREC)
-			goto next_bckt;
-		r = (TdbRec *)((char *)r + rlen);
-
-		do {
-			rlen = TDB_HTRIE_RALIGN(sizeof(*r)
-						+ TDB_HTRIE_RBODYLEN(dbh, r));
-			if ((char *)r + rlen - (char *)_b > TDB_HTRIE_MINDREC)
-				break;
-			if (tdb_live_rec(dbh, r) && r->key == key)
-				/* Unlock the bucket by tdb_rec_put(). */
-				return r;
-			r = (TdbRec *)((char *)r + rlen);
-		} while ((char *)r + sizeof(*r) - (char *)_b
-			 <= TDB_HTRIE_MINDREC);
-next_bckt:
-		*b = TDB_HTRIE_BUCKET_NEXT(dbh, _b);
-		if (*b) {
-			read_lock_bh(&(*b)->lock);
-			r = TDB_HTRIE_BCKT_1ST_REC(*b);
-
-			if (r && tdb_live_rec(dbh, r) && r->key == key) {
-				read_unlock_bh(&_b->lock);
-				/* Unlock the bucket by tdb_rec_put(). */
-				return r;
-			}
-		}
-		read_unlock_bh(&_b->lock);
-		_b = *b;
-	} while (_b);
+	for ( ; *b; *b = next) {
+		r = tdb_htrie_bscan(dbh, *b, r, key, &next);
+		if (r)
+			/* Leave the RCU section by tdb_rec_put(). */
+			return r;
+	}
+	rcu_read_unlock_bh();
 
 	return NULL;
 }
 
+/**
+ * Check that record @r, found by a lookup with @key in an earlier RCU
+ * read-side section when the compaction generation was @gen, is still live
+ * and reachable by the key. The record may be removed, moved by a burst or
+ * its slot may be reused since then. Buckets released by the compaction may
+ * be reused for any data, so @r isn't accessed at all if the generation has
+ * changed.
+ *
+ * Called in RCU read-side section, the record can be used until the end of
+ * the section on success.
+ */
+bool
+tdb_htrie_rec_valid(TdbHdr *dbh, TdbRec *r, unsigned long key,
+		    unsigned long gen)
+{
+	TdbBucket *b = (TdbBucket *)((unsigned long)r & TDB_HTRIE_DMASK);
+	unsigned int seq;
+	bool ok;
+
+	if (atomic64_read(&dbh->free_gen) != gen)
+		return false;
+	smp_rmb();
+
+	do {
+		seq = read_seqcount_begin(&b->seq);
+		ok = !TDB_HTRIE_RETIRED(b, r)
+		     && READ_ONCE(b->tags[TDB_HTRIE_SLOT_ID(b, r)])
+			== tdb_htrie_key_tag(key)
+		     && tdb_live_rec(dbh, r) && r->key == key;
+	} while (read_seqcount_retry(&b->seq, seq));
+
+	/* The bucket could be released while we were reading it. */
+	smp_rmb();
+	return ok && atomic64_read(&dbh->free_gen) == gen;
+}
+
+/**
+ * Initialize the table at @p of @db_size bytes, which can be extended up to
+ * @max_size bytes by tdb_htrie_extend().
+ */
 TdbHdr *
-tdb_htrie_init(void *p, size_t db_size, unsigned int rec_len)
+tdb_htrie_init(void *p, size_t db_size, size_t max_size, unsigned int rec_len)
 {
 	int cpu;
 	TdbHdr *hdr = (TdbHdr *)p;
 
+	/* Retired record slots must fit TdbBucket->flags. */
+	BUILD_BUG_ON(TDB_HTRIE_MINDREC / 8 > 31);
+
+	/* The snapshot is validated by tdb_file_open(), except the records. */
+	if (hdr->magic == TDB_MAGIC && hdr->rec_len != rec_len) {
+		TDB_WARN("snapshot record length %u doesn't match %u,"
+			 " initialize empty table\n", hdr->rec_len, rec_len);
+		hdr->magic = 0;
+	}
+
 	if (hdr->magic != TDB_MAGIC) {
-		hdr = tdb_init_mapping(p, db_size, rec_len);
+		hdr = tdb_init_mapping(p, db_size, max_size, rec_len);
 		if (!hdr) {
 			TDB_ERR("cannot init db mapping\n");
 			return NULL;
 		}
+		/*
+		 * Block references aren't persistent, so we can reclaim
+		 * blocks of removed records only for a new database.
+		 */
+		hdr->blk_ref = vzalloc(max_size / TDB_BLK_SZ
+				       * sizeof(atomic_t));
+		if (!hdr->blk_ref)
+			TDB_WARN("cannot allocate block references, removed"
+				 " records memory won't be reclaimed\n");
+	} else {
+		hdr->blk_ref = NULL;
 	}
 
 	/* Set per-CPU pointers. */
@@ -921,7 +1654,8 @@ tdb_htrie_init(void *p, size_t db_size, unsigned int rec_len)
 	for_each_possible_cpu(cpu) {
 		TdbPerCpu *p = per_cpu_ptr(hdr->pcpu, cpu);
 		p->i_wcl = tdb_alloc_blk(hdr);
-		p->d_wcl = tdb_alloc_blk(hdr);
+		/* The data block is allocated on the first record insertion. */
+		p->d_wcl = 0;
 	}
 
 	TDB_DBG("init db header: nwb=%llu db_size=%lu rec_len=%u\n",
@@ -930,29 +1664,55 @@ tdb_htrie_init(void *p, size_t db_size, unsigned int rec_len)
 	return hdr;
 }
 
+/**
+ * Make the table @db_size bytes. The caller provides zeroed memory for the
+ * new extents just after the current end of the table, so the allocators
+ * start to use the extents as soon as they see the new size.
+ */
+void
+tdb_htrie_extend(TdbHdr *dbh, size_t db_size)
+{
+	BUG_ON(db_size & ~TDB_EXT_MASK);
+	BUG_ON(db_size <= dbh->dbsz || db_size > TDB_MAX_DB_SZ);
+
+	smp_store_release(&dbh->dbsz, db_size);
+}
+
 void
 tdb_htrie_exit(TdbHdr *dbh)
 {
+	/* Wait for reclamation of retired records. */
+	rcu_barrier();
+
 	free_percpu(dbh->pcpu);
+	vfree(dbh->blk_ref);
+	dbh->blk_ref = NULL;
 }
 
+/**
+ * Call @fn for each live record in collision chain starting from bucket @b.
+ * The bucket lock is held during the callback, so records aren't changed
+ * under it. Unlike lookups, the walk doesn't invalidate concurrent lockless
+ * readers of the bucket.
+ */
 static int
 tdb_htrie_bucket_walk(TdbHdr *dbh, TdbBucket *b, int (*fn)(void *))
 {
-	TdbBucket *b_tmp;
+	int res = 0;
 	TdbRec *r;
+	TdbBucket *next;
+
+	for ( ; b && !res; b = next) {
+		spin_lock_bh(&b->lock);
+		for (r = TDB_HTRIE_BCKT_1ST_REC(b); r && !res;
+		     r = tdb_htrie_rec_after(dbh, b, r))
+			if (tdb_live_rec(dbh, r) && !TDB_HTRIE_RETIRED(b, r))
+				res = fn(r->data);
+		next = TDB_HTRIE_BUCKET_NEXT(dbh, b);
+		spin_unlock_bh(&b->lock);
+	}
 
-	TDB_HTRIE_FOREACH_REC(dbh, b_tmp, &b, r, {
-		if (tdb_live_rec(dbh, r)) {
-			int res = fn(r->data);
-			if (unlikely(res)) {
-				read_unlock_bh(&b->lock);
-				return res;
-			}
-		}
-	});
-
-	return 0;
+	return res;
 }
 
 static int
@@ -971,8 +1731,7 @@ tdb_htrie_node_visit(TdbHdr *dbh, TdbHtrieNode *node, int (*fn)(void *))
 		if (likely(!o))
 			continue;
 
-		BUG_ON(TDB_DI2O(o & ~TDB_HTRIE_DBIT) < TDB_HDR_SZ(dbh) + sizeof(TdbExt)
-			   || TDB_DI2O(o & ~TDB_HTRIE_DBIT) > dbh->dbsz);
+		BUG_ON(tdb_htrie_shift_bad(dbh, o));
 
 		if (o & TDB_HTRIE_DBIT) {
 			TdbBucket *b;
@@ -982,7 +1741,12 @@ tdb_htrie_node_visit(TdbHdr *dbh, TdbHtrieNode *node, int (*fn)(void *))
 			BUG_ON(!o);
 
 			b = (TdbBucket *)TDB_PTR(dbh, TDB_DI2O(o));
-			res = tdb_htrie_bucket_walk(dbh, b, fn);
+			/* The bucket can be released by tdb_htrie_compact(). */
+			res = 0;
+			rcu_read_lock_bh();
+			if (READ_ONCE(node->shifts[bits]) == (o | TDB_HTRIE_DBIT))
+				res = tdb_htrie_bucket_walk(dbh, b, fn);
+			rcu_read_unlock_bh();
 			if (unlikely(res))
 				return res;
 		} else {
@@ -1007,3 +1771,274 @@ tdb_htrie_walk(TdbHdr *dbh, int (*fn)(void *))
 
 	return tdb_htrie_node_visit(dbh, node, fn);
 }
+
+/**
+ * Release the blocks of bucket @tr->b unlinked from the index after RCU
+ * grace period.
+ */
+static void
+tdb_htrie_free_bucket(struct rcu_head *rcu)
+{
+	TdbRetired *tr = container_of(rcu, TdbRetired, rcu);
+
+	atomic64_inc(&tr->dbh->free_gen);
+	tdb_blk_put(tr->dbh, TDB_HTRIE_OFF(tr->dbh, tr->b));
+	kfree(tr);
+}
+
+/**
+ * @return true if bucket @b has neither live nor retired records and
+ * doesn't head a collision chain, so it can be unlinked from the index.
+ * Chunks of the removed records are already released by
+ * tdb_htrie_reclaim(), so only the bucket allocation itself is left.
+ *
+ * Called under bucket lock.
+ */
+static bool
+tdb_htrie_bucket_dead(TdbHdr *dbh, TdbBucket *b)
+{
+	TdbRec *r;
+
+	if (b->coll_next || (b->flags & ~TDB_HTRIE_VRFREED))
+		return false;
+
+	for (r = TDB_HTRIE_BCKT_1ST_REC(b); r;
+	     r = tdb_htrie_rec_after(dbh, b, r))
+		if (tdb_live_rec(dbh, r))
+			return false;
+
+	return true;
+}
+
+/**
+ * Unlink the dead bucket referenced by slot @i of index node @node, which
+ * resolves @bits of keys. Lookups entered the bucket before the unlinking
+ * are in RCU read-side sections, so the bucket is released after grace
+ * period. Insertions recheck the index slot under the bucket lock, except
+ * full key collisions, so deeper buckets are left as is.
+ *
+ * @tr is a preallocated descriptor for the release, it's consumed on success.
+ */
+static unsigned long
+tdb_htrie_compact_bucket(TdbHdr *dbh, TdbHtrieNode *node, int i, int bits,
+			 TdbRetired **tr)
+{
+	unsigned long o, n = 0;
+	TdbBucket *b;
+
+	if (TDB_HTRIE_RESOLVED(bits + TDB_HTRIE_BITS))
+		return 0;
+
+	rcu_read_lock_bh();
+
+	o = READ_ONCE(node->shifts[i]);
+	if (!(o & TDB_HTRIE_DBIT))
+		goto out;
+	b = TDB_PTR(dbh, TDB_DI2O(o ^ TDB_HTRIE_DBIT));
+
+	/* The bucket content isn't changed, so don't disturb the readers. */
+	spin_lock_bh(&b->lock);
+	if (tdb_htrie_bucket_dead(dbh, b)
+	    && atomic_cmpxchg((atomic_t *)&node->shifts[i], o, 0) == o)
+	{
+		TDB_DBG("Release dead bucket %p\n", b);
+		(*tr)->dbh = dbh;
+		(*tr)->b = b;
+		call_rcu(&(*tr)->rcu, tdb_htrie_free_bucket);
+		*tr = NULL;
+		n = 1;
+	}
+	spin_unlock_bh(&b->lock);
+out:
+	rcu_read_unlock_bh();
+
+	return n;
+}
+
+static unsigned long
+tdb_htrie_compact_slot(TdbHdr *dbh, TdbHtrieNode *node, int i, int bits,
+		       TdbRetired **tr)
+{
+	int j;
+	unsigned long o, n = 0;
+
+	o = READ_ONCE(node->shifts[i]);
+	if (!o)
+		return 0;
+
+	if (o & TDB_HTRIE_DBIT) {
+		if (!*tr && !(*tr = kmalloc(sizeof(**tr), GFP_KERNEL)))
+			return 0;
+		return tdb_htrie_compact_bucket(dbh, node, i, bits, tr);
+	}
+
+	/* Index nodes are never released, so descend w/o locking. */
+	node = TDB_PTR(dbh, TDB_II2O(o));
+	for (j = 0; j < TDB_HTRIE_FANOUT; ++j) {
+		n += tdb_htrie_compact_slot(dbh, node, j,
+					    bits + TDB_HTRIE_BITS, tr);
+		cond_resched();
+	}
+
+	return n;
+}
+
+/**
+ * Incremental database compaction: one call processes the subtree of @slot
+ * of the root index node. Dead buckets, i.e. buckets of removed records,
+ * are unlinked from the index and their blocks are returned to the extent
+ * bitmaps, so they can be reused by any new allocation. Lookups aren't
+ * blocked, only the bucket being released is locked for a short time.
+ *
+ * Live records aren't moved to defragment the blocks: the database users,
+ * e.g. the cache and the clients tables, keep pointers to the records.
+ *
+ * Must be called from process context.
+ * @return number of released buckets.
+ */
+unsigned long
+tdb_htrie_compact(TdbHdr *dbh, unsigned int slot)
+{
+	unsigned long n;
+	TdbRetired *tr = NULL;
+
+	BUG_ON(slot >= TDB_HTRIE_FANOUT);
+
+	/* Blocks can't be released w/o the reference counters. */
+	if (!dbh->blk_ref)
+		return 0;
+
+	n = tdb_htrie_compact_slot(dbh, TDB_HTRIE_ROOT(dbh), slot, 0, &tr);
+	kfree(tr);
+
+	return n;
+}
+
+/**
+ * Bytes of record @r in a bucket with all its chunks.
+ */
+static size_t
+tdb_htrie_rec_bytes(TdbHdr *dbh, TdbRec *r)
+{
+	size_t n = tdb_htrie_rlen(dbh, r);
+	TdbVRec *chunk = (TdbVRec *)r;
+
+	if (!TDB_HTRIE_VARLENRECS(dbh))
+		return n;
+
+	while (chunk->chunk_next) {
+		chunk = TDB_PTR(dbh, TDB_DI2O(chunk->chunk_next));
+		n += tdb_htrie_rlen(dbh, (TdbRec *)chunk);
+	}
+
+	return n;
+}
+
+/**
+ * Account collision chain starting from bucket @b referenced by an index
+ * node of @depth. Called in RCU read-side section.
+ */
+static void
+tdb_htrie_bucket_stat(TdbHdr *dbh, TdbBucket *b, int depth, TdbStat *st)
+{
+	unsigned int n;
+	TdbRec *r;
+	TdbBucket *next;
+
+	for (n = 0; b; b = next, ++n) {
+		spin_lock_bh(&b->lock);
+		for (r = TDB_HTRIE_BCKT_1ST_REC(b); r;
+		     r = tdb_htrie_rec_after(dbh, b, r))
+		{
+			if (!tdb_live_rec(dbh, r) || TDB_HTRIE_RETIRED(b, r))
+				continue;
+			st->recs++;
+			st->rec_bytes += tdb_htrie_rec_bytes(dbh, r);
+		}
+		next = TDB_HTRIE_BUCKET_NEXT(dbh, b);
+		spin_unlock_bh(&b->lock);
+	}
+
+	st->buckets += n;
+	st->depth[depth]++;
+	st->chain[min_t(unsigned int, n, TDB_STAT_CHAIN) - 1]++;
+}
+
+static void
+tdb_htrie_node_stat(TdbHdr *dbh, TdbHtrieNode *node, int bits, TdbStat *st)
+{
+	int i;
+	unsigned long o;
+	TdbBucket *b;
+
+	st->nodes++;
+
+	for (i = 0; i < TDB_HTRIE_FANOUT; ++i) {
+		o = READ_ONCE(node->shifts[i]);
+		if (!o)
+			continue;
+
+		if (!(o & TDB_HTRIE_DBIT)) {
+			/* Index nodes are never released. */
+			tdb_htrie_node_stat(dbh, TDB_PTR(dbh, TDB_II2O(o)),
+					    bits + TDB_HTRIE_BITS, st);
+			continue;
+		}
+
+		/* The bucket can be released by tdb_htrie_compact(). */
+		rcu_read_lock_bh();
+		if (READ_ONCE(node->shifts[i]) == o) {
+			b = TDB_PTR(dbh, TDB_DI2O(o ^ TDB_HTRIE_DBIT));
+			tdb_htrie_bucket_stat(dbh, b, bits / TDB_HTRIE_BITS,
+					      st);
+		}
+		rcu_read_unlock_bh();
+	}
+
+	cond_resched();
+}
+
+/**
+ * Account used and free blocks of the used extents.
+ */
+static void
+tdb_htrie_ext_stat(TdbHdr *dbh, TdbStat *st)
+{
+	const unsigned long n = TDB_EXT_SZ / TDB_BLK_SZ;
+	unsigned long o, b, end;
+	TdbExt *e;
+
+	for (o = 0; o < tdb_htrie_size(dbh); o += TDB_EXT_SZ) {
+		if (!test_bit(TDB_EXT_ID(o), dbh->ext_bmp))
+			continue;
+		e = tdb_ext(dbh, TDB_PTR(dbh, o));
+
+		st->ext_used++;
+		st->blk_used += bitmap_weight(e->b_bmp, n);
+		for (b = find_first_zero_bit(e->b_bmp, n); b < n;
+		     b = find_next_zero_bit(e->b_bmp, n, end))
+		{
+			end = find_next_bit(e->b_bmp, n, b);
+			st->free_runs++;
+			st->free_run_max = max(st->free_run_max, end - b);
+		}
+	}
+	st->blk_free = st->ext_used * n - st->blk_used;
+}
+
+/**
+ * Collect the index and blocks statistics of the table by a walk over it.
+ * The walk doesn't block lookups and insertions, only buckets are locked
+ * for a short time, so the statistics are approximate for a changing table.
+ *
+ * Must be called from process context.
+ */
+void
+tdb_htrie_stat(TdbHdr *dbh, TdbStat *st)
+{
+	BUILD_BUG_ON(BITS_PER_LONG / TDB_HTRIE_BITS > TDB_STAT_DEPTH);
+
+	st->size = tdb_htrie_size(dbh);
+	tdb_htrie_node_stat(dbh, TDB_HTRIE_ROOT(dbh), 0, st);
+	tdb_htrie_ext_stat(dbh, st);
+}
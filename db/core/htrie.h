@@ -21,6 +21,8 @@
 #ifndef __HTRIE_H__
 #define __HTRIE_H__
 
+#include <linux/seqlock.h>
+
 #include "tdb.h"
 
 #define TDB_BLK_BMP_2L		(TDB_EXT_SZ / PAGE_SIZE / BITS_PER_LONG)
@@ -59,9 +61,13 @@
 #define TDB_HTRIE_DBIT		(1U << (sizeof(int) * 8 - 1))
 #define TDB_HTRIE_OMASK		(TDB_HTRIE_DBIT - 1) /* offset mask */
 #define TDB_HTRIE_IDX(k, b)	(((k) >> (b)) & TDB_HTRIE_KMASK)
-#define TDB_EXT_BMP_2L(h)	(((h)->dbsz / TDB_EXT_SZ + BITS_PER_LONG - 1)\
-				 / BITS_PER_LONG)
 #define TDB_MAX_DB_SZ		((1UL << 31) * L1_CACHE_BYTES)
+/*
+ * The extents bitmap covers the largest table, so neither the bitmap nor
+ * the index root move when a table grows under its readers.
+ */
+#define TDB_EXT_BMP_2L		(TDB_MAX_DB_SZ / TDB_EXT_SZ		\
+				 / BITS_PER_LONG)
 /* Get internal offset from a pointer. */
 #define TDB_HTRIE_OFF(h, p)	((unsigned long)(p) - (unsigned long)(h))
 /* Base offset of extent containing pointer @p. */
@@ -70,12 +76,28 @@
 /**
  * Header for bucket of small records.
  *
+ * Readers don't acquire the bucket lock: they scan the bucket under @seq and
+ * use the found records under RCU read lock. Writers serialize on @lock and
+ * retire removed or moved records instead of freeing them, the records are
+ * reclaimed after RCU grace period.
+ *
+ * Each bucket record is tagged by a few bits of its key in @tags, so lookups
+ * compare the tags, kept in the first cache line of the bucket, and touch
+ * only the records with matching tags.
+ *
+ * @tags	- key tags of the records indexed by the record slots, zero for
+ *		  slots which don't start a record;
  * @coll_next	- next record offset (in data blocks) in collision chain;
+ * @flags	- TDB_HTRIE_VRFREED and bitmap of retired record slots;
+ * @lock	- writers lock;
+ * @seq		- bumped on each bucket modification for lockless readers;
  */
 typedef struct {
+	unsigned char	tags[TDB_HTRIE_MINDREC / 8];
 	unsigned int 	coll_next;
 	unsigned int	flags;
-	rwlock_t	lock;
+	spinlock_t	lock;
+	seqcount_t	seq;
 } __attribute__((packed)) TdbBucket;
 
 #define TDB_HTRIE_VRFREED	TDB_HTRIE_DBIT
@@ -92,7 +114,25 @@ typedef struct {
 				   error, @r is always TdbVRec here. */	\
 				TDB_HTRIE_VRLEN((TdbVRec *)r),		\
 				(h)->rec_len))
-#define TDB_HTRIE_BCKT_1ST_REC(b) ((void *)((b) + 1))
+/*
+ * Records follow the bucket header at 8-byte aligned offsets, the header
+ * size isn't aligned with lock debugging.
+ */
+#define TDB_HTRIE_BCKT_HDR_SZ	TDB_HTRIE_RALIGN(sizeof(TdbBucket))
+/* True if a variable-length record of @n bytes occupies a bucket alone. */
+#define TDB_HTRIE_LARGEREC(n)						\
+	(TDB_HTRIE_BCKT_HDR_SZ + TDB_HTRIE_RALIGN(sizeof(TdbVRec) + (n))\
+	 > TDB_HTRIE_MINDREC)
+/*
+ * A retired record is invisible for lookups, but can be still used by readers
+ * until RCU grace period. Records are 8-byte aligned, so a bucket slot is
+ * identified by the record offset in 8-byte words.
+ */
+#define TDB_HTRIE_SLOT_ID(b, r)	(((char *)(r) - (char *)(b)) / 8)
+#define TDB_HTRIE_SLOT(b, r)	(1U << TDB_HTRIE_SLOT_ID(b, r))
+#define TDB_HTRIE_RETIRED(b, r)	(READ_ONCE((b)->flags) & TDB_HTRIE_SLOT(b, r))
+#define TDB_HTRIE_BCKT_1ST_REC(b)					\
+	((void *)((char *)(b) + TDB_HTRIE_BCKT_HDR_SZ))
 #define TDB_HTRIE_BUCKET_KEY(b)	(*(unsigned long *)TDB_HTRIE_BCKT_1ST_REC(b))
 /* Iterate over buckets in collision chain. */
 #define TDB_HTRIE_BUCKET_NEXT(h, b) ((b)->coll_next			\
@@ -100,10 +140,21 @@ typedef struct {
 				     : NULL)				\
 
 #define TDB_HDR_SZ(h)							\
-	(sizeof(TdbHdr) + TDB_EXT_BMP_2L(h) * sizeof(long))
+	(sizeof(TdbHdr) + TDB_EXT_BMP_2L * sizeof(long))
 #define TDB_HTRIE_ROOT(h)						\
 	(TdbHtrieNode *)((char *)(h) + TDB_HDR_SZ(h) + sizeof(TdbExt))
 
+/*
+ * Records in a bucket share the least significant key bits resolved by the
+ * index, so the tag is made of the most significant bits. Zero tag marks
+ * a slot without a record.
+ */
+static inline unsigned char
+tdb_htrie_key_tag(unsigned long key)
+{
+	return (key >> 56) ? : 1;
+}
+
 /* FIXME we can't store zero bytes by zero key. */
 static inline int
 tdb_live_fsrec(TdbHdr *dbh, TdbFRec *rec)
@@ -131,15 +182,39 @@ tdb_live_rec(TdbHdr *dbh, TdbRec *r)
 	       : tdb_live_fsrec(dbh, (TdbFRec *)r);
 }
 
+static inline void
+tdb_htrie_bucket_lock(TdbBucket *b)
+{
+	spin_lock_bh(&b->lock);
+	write_seqcount_begin(&b->seq);
+}
+
+static inline void
+tdb_htrie_bucket_unlock(TdbBucket *b)
+{
+	write_seqcount_end(&b->seq);
+	spin_unlock_bh(&b->lock);
+}
+
 TdbVRec *tdb_htrie_extend_rec(TdbHdr *dbh, TdbVRec *rec, size_t size);
 TdbRec *tdb_htrie_insert(TdbHdr *dbh, unsigned long key, void *data,
 			 size_t *len);
+void tdb_htrie_remove(TdbHdr *dbh, TdbRec *rec);
+void *tdb_htrie_pin(TdbHdr *dbh, TdbRec *rec);
+void tdb_htrie_unpin(void *pin);
+void tdb_htrie_pins_init(void);
 TdbBucket *tdb_htrie_lookup(TdbHdr *dbh, unsigned long key);
 TdbRec *tdb_htrie_bscan_for_rec(TdbHdr *dbh, TdbBucket **b, unsigned long key);
 TdbRec *tdb_htrie_next_rec(TdbHdr *dbh, TdbRec *r, TdbBucket **b,
 			   unsigned long key);
-TdbHdr *tdb_htrie_init(void *p, size_t db_size, unsigned int rec_len);
+bool tdb_htrie_rec_valid(TdbHdr *dbh, TdbRec *r, unsigned long key,
+			 unsigned long gen);
+TdbHdr *tdb_htrie_init(void *p, size_t db_size, size_t max_size,
+		       unsigned int rec_len);
+void tdb_htrie_extend(TdbHdr *dbh, size_t db_size);
 void tdb_htrie_exit(TdbHdr *dbh);
 int tdb_htrie_walk(TdbHdr *dbh, int (*fn)(void *));
+unsigned long tdb_htrie_compact(TdbHdr *dbh, unsigned int slot);
+void tdb_htrie_stat(TdbHdr *dbh, TdbStat *st);
 
 #endif /* __HTRIE_H__ */
@@ -20,6 +20,7 @@
  * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 #include <linux/ctype.h>
+#include <linux/slab.h>
 #include <net/netlink.h>
 #include <net/net_namespace.h>
 
@@ -33,6 +34,8 @@ static DEFINE_MUTEX(tdb_if_mtx);
 
 #define TDB_NLMSG_MAXSZ		(NL_FR_SZ / 2 - NLMSG_HDRLEN - sizeof(TdbMsg) \
 				 - sizeof(TdbMsgRec))
+/* Room for records in a response message. */
+#define TDB_NLMSG_RECSZ		(TDB_NLMSG_MAXSZ - sizeof(TdbMsg))
 
 static int
 tdb_if_info(struct sk_buff *skb, struct netlink_callback *cb)
@@ -61,6 +64,54 @@ tdb_if_info(struct sk_buff *skb, struct netlink_callback *cb)
 	return 0; /* end transfer */
 }
 
+/**
+ * Order key of a record in TdbMsgRec format: the first TDB_OKEY_MAX bytes of
+ * the record key stored in the first chunk.
+ */
+static unsigned int
+tdb_if_okey(const TdbMsgRec *r, size_t len, char *buf)
+{
+	if (len < sizeof(*r))
+		return 0;
+	len = min3(len - sizeof(*r), (size_t)r->klen, (size_t)TDB_OKEY_MAX);
+	memcpy(buf, r->data, len);
+
+	return len;
+}
+
+static unsigned int
+tdb_if_okey_frec(TdbRec *rec, char *buf)
+{
+	return tdb_if_okey((TdbMsgRec *)rec->data, TDB_OKEY_MAX, buf);
+}
+
+static unsigned int
+tdb_if_okey_vrec(TdbRec *rec, char *buf)
+{
+	TdbVRec *vr = (TdbVRec *)rec;
+
+	return tdb_if_okey((TdbMsgRec *)vr->data, vr->len, buf);
+}
+
+static TDB *
+tdb_if_open(TdbCrTblRec *ct)
+{
+	TDB *db = tdb_open(ct->path, ct->tbl_size, ct->tbl_size, ct->rec_size,
+			   numa_node_id());
+
+	if (!db || !(ct->flags & TDB_CRTBL_OIDX))
+		return db;
+
+	if (tdb_oidx_init(db, TDB_HTRIE_VARLENRECS(db->hdr)
+			      ? tdb_if_okey_vrec : tdb_if_okey_frec))
+	{
+		tdb_close(db);
+		return NULL;
+	}
+
+	return db;
+}
+
 static int
 tdb_if_open_close(struct sk_buff *skb, struct netlink_callback *cb)
 {
@@ -77,9 +128,12 @@ tdb_if_open_close(struct sk_buff *skb, struct netlink_callback *cb)
 	resp_m = nlmsg_data(nlh);
 	resp_m->rec_n = 0;
 
+	/* Concurrent opening of the same table must find the same handle. */
+	mutex_lock(&tdb_if_mtx);
+
 	if (m->type == TDB_MSG_OPEN) {
 		resp_m->type = TDB_MSG_OPEN;
-		if (tdb_open(ct->path, ct->tbl_size, ct->rec_size, numa_node_id()))
+		if (tdb_if_open(ct))
 			resp_m->type |= TDB_NLF_RESP_OK;
 	} else {
 		TDB *db;
@@ -97,6 +151,8 @@ tdb_if_open_close(struct sk_buff *skb, struct netlink_callback *cb)
 		}
 	}
 
+	mutex_unlock(&tdb_if_mtx);
+
 	return 0;
 }
 
@@ -174,13 +230,64 @@ tdb_if_insert(struct sk_buff *skb, struct netlink_callback *cb)
 	return 0;
 }
 
+/**
+ * Copy record @rec, stored in TdbMsgRec format, to @dst of @room bytes.
+ * If the record doesn't fit, then copy its head, adjust its data length
+ * and set @trunc.
+ *
+ * @return number of copied bytes or 0 if even the record key doesn't fit.
+ */
+static size_t
+tdb_if_copy_rec(TDB *db, TdbRec *rec, char *dst, size_t room, bool *trunc)
+{
+	size_t n, off = 0;
+	TdbMsgRec *r = (TdbMsgRec *)dst;
+
+	if (TDB_HTRIE_VARLENRECS(db->hdr)) {
+		TdbVRec *vr = (TdbVRec *)rec;
+
+		while (1) {
+			n = min_t(size_t, vr->len, room - off);
+			memcpy(dst + off, vr->data, n);
+			off += n;
+			if (n < vr->len) {
+				*trunc = true;
+				break;
+			}
+			if (!vr->chunk_next)
+				break;
+			vr = TDB_PTR(db->hdr, TDB_DI2O(vr->chunk_next));
+		}
+	} else {
+		off = min_t(size_t, db->hdr->rec_len, room);
+		memcpy(dst, rec->data, off);
+		*trunc = off < db->hdr->rec_len;
+	}
+
+	if (*trunc) {
+		if (off < sizeof(*r) || off < sizeof(*r) + r->klen)
+			return 0;
+		r->dlen = off - sizeof(*r) - r->klen;
+	}
+
+	return off;
+}
+
+/**
+ * Select all the records for each key of the request. As many keys as fit
+ * one message are processed by each call, the progress is stored in
+ * @cb->args: index and offset of the next key. Records of one key aren't
+ * split between messages, the last record is truncated only if the records
+ * of the key don't fit an empty message.
+ */
 static int
 tdb_if_select(struct sk_buff *skb, struct netlink_callback *cb)
 {
 	TdbIter iter;
-	unsigned long key;
+	unsigned int i = cb->args[0];
+	unsigned long key, off = cb->args[1];
+	size_t len = 0;
 	TdbMsg *resp_m, *m = cb->data;
-	TdbRec *res;
 	struct nlmsghdr *nlh;
 	TDB *db;
 
@@ -202,52 +309,323 @@ tdb_if_select(struct sk_buff *skb, struct netlink_callback *cb)
 
 	/*
 	 * FIXME implement select of all records:
-	 * 1. full HTrie iterator is required;
-	 * 2. use many netlink frames to send probably large data set.
+	 * full HTrie iterator is required.
 	 */
-	key = hash_calc(m->recs[0].data, m->recs[0].klen);
-	iter = tdb_rec_get(db, key);
-	res = iter.rec;
-	if (res) {
-		resp_m->rec_n = 1;
-		if (TDB_HTRIE_VARLENRECS(db->hdr)) {
-			TdbVRec *vr = (TdbVRec *)res;
-			size_t off = vr->len;
-			memcpy(resp_m->recs, vr->data, vr->len);
-			while (1) {
-				size_t n = vr->len;
-				if (n + off > TDB_NLMSG_MAXSZ) {
-					n = TDB_NLMSG_MAXSZ - off;
-					resp_m->type |= TDB_NLF_RESP_TRUNC;
-				}
-				memcpy((char *)resp_m->recs + off, vr->data, n);
-				if (n < vr->len || !vr->chunk_next)
+	for ( ; i < m->rec_n; ++i) {
+		TdbMsgRec *r = (TdbMsgRec *)((char *)m->recs + off);
+		unsigned int rec_n = resp_m->rec_n;
+		size_t start = len;
+		bool trunc = false;
+
+		key = hash_calc(r->data, r->klen);
+		iter = tdb_rec_get(db, key);
+		while (!TDB_ITER_BAD(iter)) {
+			size_t n = tdb_if_copy_rec(db, iter.rec,
+						   (char *)resp_m->recs + len,
+						   TDB_NLMSG_RECSZ - len,
+						   &trunc);
+			if (trunc) {
+				tdb_rec_put(iter.rec);
+				if (start)
 					break;
-				vr = TDB_PTR(db->hdr, TDB_DI2O(vr->chunk_next));
-				off += n;
+				len += n;
+				resp_m->rec_n += !!n;
+				resp_m->type |= TDB_NLF_RESP_TRUNC;
+				break;
 			}
+			len += n;
+			resp_m->rec_n++;
+			tdb_rec_next(db, &iter);
 		}
-		else {
-			memcpy(resp_m->recs, res->data, db->hdr->rec_len);
+		if (trunc && start) {
+			/* Send the records of the key in the next message. */
+			len = start;
+			resp_m->rec_n = rec_n;
+			break;
+		}
+		off += TDB_MSGREC_LEN(r);
+		if (trunc) {
+			++i;
+			break;
+		}
+	}
+
+	tdb_put(db);
+	resp_m->type |= TDB_NLF_RESP_OK;
+	if (i < m->rec_n) {
+		cb->args[0] = i;
+		cb->args[1] = off;
+		return skb->len;
+	}
+	resp_m->type |= TDB_NLF_RESP_END;
+
+	return 0;
+}
+
+/* The same record can be removed concurrently by other user. */
+static bool
+tdb_if_may_remove(TdbRec *rec)
+{
+	TdbBucket *b = (TdbBucket *)((unsigned long)rec & TDB_HTRIE_DMASK);
+
+	return !TDB_HTRIE_RETIRED(b, rec);
+}
+
+/**
+ * Remove all the records for each key of the request. Records of a table
+ * owned by a kernel user are removed only through the owner.
+ */
+static int
+tdb_if_remove(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	TdbIter iter;
+	unsigned int i, off, n = 0;
+	unsigned long key;
+	TdbMsg *resp_m, *m = cb->data;
+	TdbMsgRec *r;
+	struct nlmsghdr *nlh;
+	TDB *db;
+	bool owned, (*remove)(TDB *db, TdbRec *rec);
+
+	/* Create status response. */
+	nlh = nlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+			cb->nlh->nlmsg_type, sizeof(TdbMsg), 0);
+	if (!nlh)
+		return -EMSGSIZE;
+
+	resp_m = nlmsg_data(nlh);
+	resp_m->rec_n = 0;
+	resp_m->type = TDB_MSG_REMOVE;
+
+	db = tdb_tbl_lookup(m->t_name, TDB_TBLNAME_LEN);
+	if (!db) {
+		TDB_WARN("Tried to remove from non existent table '%s'\n",
+			 m->t_name);
+		return 0;
+	}
+
+	/* The owner waits for the callback calls, see tdb_set_owner(). */
+	rcu_read_lock_bh();
+	owned = smp_load_acquire(&db->owned);
+	remove = READ_ONCE(db->remove);
+	if (owned && !remove) {
+		rcu_read_unlock_bh();
+		TDB_WARN("Tried to remove from table '%s' owned by a kernel"
+			 " user\n", m->t_name);
+		tdb_put(db);
+		return 0;
+	}
+
+	for (i = 0, off = 0; i < m->rec_n; ++i) {
+		r = (TdbMsgRec *)((char *)m->recs + off);
+		key = hash_calc(r->data, r->klen);
+		iter = tdb_rec_get(db, key);
+		while (!TDB_ITER_BAD(iter)) {
+			n += remove
+			     ? remove(db, iter.rec)
+			     : tdb_entry_remove(db, iter.rec,
+						tdb_if_may_remove);
+			tdb_rec_next(db, &iter);
+		}
+		off += TDB_MSGREC_LEN(r);
+	}
+	rcu_read_unlock_bh();
+
+	tdb_put(db);
+	resp_m->type |= TDB_NLF_RESP_OK;
+	resp_m->rec_n = n;
+
+	return 0;
+}
+
+/**
+ * State of a range select.
+ *
+ * @db		- the table;
+ * @resp_m	- the response message;
+ * @len		- length of the records in the response;
+ * @start	- length of the records of index positions before @cur;
+ * @start_n	- number of the records of index positions before @cur;
+ * @trunc	- a record of @cur was truncated;
+ * @cur		- index position of the last copied record;
+ */
+typedef struct {
+	TDB		*db;
+	TdbMsg		*resp_m;
+	size_t		len;
+	size_t		start;
+	unsigned int	start_n;
+	bool		trunc;
+	TdbOidxPos	cur;
+} TdbIfRange;
+
+static int
+tdb_if_range_rec(TdbRec *rec, const TdbOidxPos *pos, void *arg)
+{
+	TdbIfRange *rc = arg;
+	TdbMsg *resp_m = rc->resp_m;
+	size_t n;
+
+	if (pos->key != rc->cur.key || pos->len != rc->cur.len
+	    || memcmp(pos->okey, rc->cur.okey, pos->len))
+	{
+		rc->cur = *pos;
+		rc->start = rc->len;
+		rc->start_n = resp_m->rec_n;
+	}
+
+	n = tdb_if_copy_rec(rc->db, rec, (char *)resp_m->recs + rc->len,
+			    TDB_NLMSG_RECSZ - rc->len, &rc->trunc);
+	if (!rc->trunc) {
+		rc->len += n;
+		resp_m->rec_n++;
+		return 0;
+	}
+
+	if (rc->start) {
+		/* Send the records of the position in the next message. */
+		rc->len = rc->start;
+		resp_m->rec_n = rc->start_n;
+		rc->trunc = false;
+	} else {
+		rc->len += n;
+		resp_m->rec_n += !!n;
+		resp_m->type |= TDB_NLF_RESP_TRUNC;
+	}
+
+	return 1;
+}
+
+/**
+ * Select records by a range of their keys from a table with ordered index.
+ * The records are sent in as many messages as required, the index position
+ * to continue from is stored in @cb->args[0]. Like for the plain select,
+ * records of one index position aren't split between messages.
+ */
+static int
+tdb_if_range(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	TdbMsg *m = cb->data;
+	TdbMsgRec *from = m->recs;
+	TdbMsgRec *to = (TdbMsgRec *)((char *)from + TDB_MSGREC_LEN(from));
+	TdbOidxPos *pos = (TdbOidxPos *)cb->args[0];
+	TdbIfRange rc = { .len = 0 };
+	struct nlmsghdr *nlh;
+	int r;
+
+	if (!pos) {
+		pos = kzalloc(sizeof(*pos), GFP_KERNEL);
+		if (!pos)
+			return -ENOMEM;
+		pos->len = min_t(unsigned int, from->klen, TDB_OKEY_MAX);
+		memcpy(pos->okey, from->data, pos->len);
+		cb->args[0] = (long)pos;
+	}
+
+	nlh = nlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+			cb->nlh->nlmsg_type, TDB_NLMSG_MAXSZ, 0);
+	if (!nlh)
+		return -EMSGSIZE;
+
+	rc.resp_m = nlmsg_data(nlh);
+	rc.resp_m->rec_n = 0;
+	rc.resp_m->type = TDB_MSG_RANGE;
+
+	rc.db = tdb_tbl_lookup(m->t_name, TDB_TBLNAME_LEN);
+	if (!rc.db) {
+		TDB_WARN("Tried to select from non existent table '%s'\n",
+			 m->t_name);
+		return 0;
+	}
+	if (!rc.db->oidx) {
+		TDB_WARN("Table '%s' has no ordered index\n", m->t_name);
+		tdb_put(rc.db);
+		return 0;
+	}
+
+	r = tdb_oidx_range(rc.db, pos, to->klen ? to->data : NULL,
+			   min_t(unsigned int, to->klen, TDB_OKEY_MAX),
+			   tdb_if_range_rec, &rc);
+	tdb_put(rc.db);
+	rc.resp_m->type |= TDB_NLF_RESP_OK;
+
+	if (!r) {
+		rc.resp_m->type |= TDB_NLF_RESP_END;
+		return 0;
+	}
+	if (rc.trunc) {
+		/* Skip the rest of the truncated position. */
+		if (pos->key != ULONG_MAX) {
+			pos->key++;
+		} else if (pos->len < TDB_OKEY_MAX) {
+			pos->okey[pos->len++] = 0;
+			pos->key = 0;
+		} else {
+			rc.resp_m->type |= TDB_NLF_RESP_END;
+			return 0;
 		}
-		tdb_rec_put(res);
 	}
 
+	return skb->len;
+}
+
+static int
+tdb_if_range_done(struct netlink_callback *cb)
+{
+	kfree((void *)cb->args[0]);
+
+	return 0;
+}
+
+static int
+tdb_if_stat(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	TdbMsg *resp_m, *m = cb->data;
+	struct nlmsghdr *nlh;
+	TDB *db;
+
+	nlh = nlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+			cb->nlh->nlmsg_type,
+			sizeof(TdbMsg) + sizeof(TdbMsgRec) + sizeof(TdbStat),
+			0);
+	if (!nlh)
+		return -EMSGSIZE;
+
+	resp_m = nlmsg_data(nlh);
+	resp_m->rec_n = 0;
+	resp_m->type = TDB_MSG_STAT;
+
+	db = tdb_tbl_lookup(m->t_name, TDB_TBLNAME_LEN);
+	if (!db) {
+		TDB_WARN("Tried to get statistics of non existent table '%s'\n",
+			 m->t_name);
+		return 0;
+	}
+
+	resp_m->recs[0].klen = 0;
+	resp_m->recs[0].dlen = sizeof(TdbStat);
+	tdb_stat(db, (TdbStat *)resp_m->recs[0].data);
+
 	tdb_put(db);
-	/* Only one record is fetched for now. */
-	resp_m->type |= TDB_NLF_RESP_OK | TDB_NLF_RESP_END;
+	resp_m->type |= TDB_NLF_RESP_OK;
+	resp_m->rec_n = 1;
 
 	return 0;
 }
 
 static const struct {
 	int (*dump)(struct sk_buff *, struct netlink_callback *);
+	int (*done)(struct netlink_callback *);
 } tdb_if_call_tbl[__TDB_MSG_TYPE_MAX] = {
 	[TDB_MSG_INFO - __TDB_MSG_BASE]		= { .dump = tdb_if_info },
 	[TDB_MSG_OPEN - __TDB_MSG_BASE]		= { .dump = tdb_if_open_close },
 	[TDB_MSG_CLOSE - __TDB_MSG_BASE]	= { .dump = tdb_if_open_close },
 	[TDB_MSG_INSERT - __TDB_MSG_BASE]	= { .dump = tdb_if_insert },
 	[TDB_MSG_SELECT - __TDB_MSG_BASE]	= { .dump = tdb_if_select },
+	[TDB_MSG_REMOVE - __TDB_MSG_BASE]	= { .dump = tdb_if_remove },
+	[TDB_MSG_RANGE - __TDB_MSG_BASE]	= { .dump = tdb_if_range,
+						    .done = tdb_if_range_done },
+	[TDB_MSG_STAT - __TDB_MSG_BASE]		= { .dump = tdb_if_stat },
 };
 
 static int
@@ -266,6 +644,28 @@ tdb_if_check_tblname(const TdbMsg *m)
 	return ret;
 }
 
+/**
+ * Check that all the @m records are inside message @nlh.
+ */
+static bool
+tdb_if_check_recs(const struct nlmsghdr *nlh, const TdbMsg *m)
+{
+	unsigned int i;
+	size_t off = 0, len = nlmsg_len(nlh) - sizeof(*m);
+
+	for (i = 0; i < m->rec_n; ++i) {
+		const TdbMsgRec *r = (TdbMsgRec *)((char *)m->recs + off);
+
+		if (off + sizeof(*r) > len || off + TDB_MSGREC_LEN(r) > len) {
+			TDB_ERR("record %u is out of netlink msg\n", i);
+			return false;
+		}
+		off += TDB_MSGREC_LEN(r);
+	}
+
+	return true;
+}
+
 static int
 tdb_if_proc_msg(struct sk_buff *skb, struct nlmsghdr *nlh,
 		struct netlink_ext_ack *extack)
@@ -311,27 +711,31 @@ tdb_if_proc_msg(struct sk_buff *skb, struct nlmsghdr *nlh,
 		}
 		break;
 	case TDB_MSG_CLOSE:
+	case TDB_MSG_STAT:
 		if (m->rec_n) {
-			TDB_ERR("Bad close table msg: rec_n=%u\n", m->rec_n);
+			TDB_ERR("Bad table msg: type=%u rec_n=%u\n", m->type,
+				m->rec_n);
 			return -EINVAL;
 		}
 		if (!tdb_if_check_tblname(m))
 			return -EINVAL;
 		break;
 	case TDB_MSG_INSERT:
+	case TDB_MSG_SELECT:
+	case TDB_MSG_REMOVE:
 		if (m->rec_n < 1) {
-			TDB_ERR("empty insert msg\n");
+			TDB_ERR("empty records msg, type=%u\n", m->type);
 			return -EINVAL;
 		}
-		if (!tdb_if_check_tblname(m))
+		if (!tdb_if_check_tblname(m) || !tdb_if_check_recs(nlh, m))
 			return -EINVAL;
 		break;
-	case TDB_MSG_SELECT:
-		if (m->rec_n != 1) {
-			TDB_ERR("empty select msg\n");
+	case TDB_MSG_RANGE:
+		if (m->rec_n != 2) {
+			TDB_ERR("Bad range msg: rec_n=%u\n", m->rec_n);
 			return -EINVAL;
 		}
-		if (!tdb_if_check_tblname(m))
+		if (!tdb_if_check_tblname(m) || !tdb_if_check_recs(nlh, m))
 			return -EINVAL;
 		break;
 	default:
@@ -342,6 +746,7 @@ tdb_if_proc_msg(struct sk_buff *skb, struct nlmsghdr *nlh,
 	{
 		struct netlink_dump_control c = {
 			.dump = tdb_if_call_tbl[m->type - __TDB_MSG_BASE].dump,
+			.done = tdb_if_call_tbl[m->type - __TDB_MSG_BASE].done,
 			.data = m,
 			.min_dump_alloc = NL_FR_SZ / 2,
 		};
@@ -349,15 +754,15 @@ tdb_if_proc_msg(struct sk_buff *skb, struct nlmsghdr *nlh,
 	}
 }
 
+/*
+ * Messages from different sockets are processed concurrently: records are
+ * inserted, selected and removed without locking of the table, only
+ * opening and closing of tables are serialized.
+ */
 static void
 tdb_if_rcv(struct sk_buff *skb)
 {
-	/* TODO remove the mutex for concurrent user-space updates. */
-	mutex_lock(&tdb_if_mtx);
-
 	netlink_rcv_skb(skb, &tdb_if_proc_msg);
-
-	mutex_unlock(&tdb_if_mtx);
 }
 
 static struct netlink_kernel_cfg tdb_if_nlcfg = {
@@ -20,31 +20,63 @@
  * this program; if not, write to the Free Software Foundation, Inc., 59
  * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
+#include <linux/delay.h>
 #include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <linux/sched/clock.h>
 #include <linux/slab.h>
+#include <linux/workqueue.h>
 
 #include "file.h"
 #include "htrie.h"
+#include "oidx.h"
 #include "table.h"
 #include "tdb_if.h"
-
-#define TDB_VERSION	"0.1.18"
+#include "wheel.h"
+
+#define TDB_VERSION	"0.1.21"
+/* Interval between incremental compactions of a table. */
+#define TDB_COMPACT_INTERVAL	HZ
+/* Interval between incremental checkpoints of a table. */
+#define TDB_CKPT_INTERVAL	HZ
+/* Interval between checks whether a table must be extended. */
+#define TDB_GROW_INTERVAL	(HZ / 10)
+/* Number of 10ms intervals to wait for pinned records on table closing. */
+#define TDB_PIN_WAIT		1000
 
 MODULE_AUTHOR("Tempesta Technologies");
 MODULE_DESCRIPTION("Tempesta DB");
 MODULE_VERSION(TDB_VERSION);
 MODULE_LICENSE("GPL");
 
+/* Account operation @op of table @db started at @t0. */
+#define TDB_STAT_OP(db, op, t0)						\
+do {									\
+	this_cpu_inc((db)->stat->op##s);				\
+	this_cpu_add((db)->stat->op##_ns, local_clock() - (t0));	\
+} while (0)
+
+static void tdb_compact(struct work_struct *work);
+static void tdb_checkpoint(struct work_struct *work);
+static void tdb_grow(struct work_struct *work);
+
 /**
  * Create TDB entry and copy @len contiguous bytes from @data to the entry.
+ * The entry is added to the table ordered index, if any.
  */
 TdbRec *
 tdb_entry_create(TDB *db, unsigned long key, void *data, size_t *len)
 {
+	u64 t0 = local_clock();
 	TdbRec *r = tdb_htrie_insert(db->hdr, key, data, len);
+
+	TDB_STAT_OP(db, insert, t0);
 	if (!r)
 		TDB_ERR("Cannot create cache entry for %.*s, key=%#lx\n",
 			(int)*len, (char *)data, key);
+	else if (tdb_oidx_add(db, r))
+		TDB_ERR("Cannot index entry, key=%#lx\n", key);
 
 	return r;
 }
@@ -57,7 +89,10 @@ EXPORT_SYMBOL(tdb_entry_create);
 TdbRec *
 tdb_entry_alloc(TDB *db, unsigned long key, size_t *len)
 {
+	u64 t0 = local_clock();
 	TdbRec *r = tdb_htrie_insert(db->hdr, key, NULL, len);
+
+	TDB_STAT_OP(db, insert, t0);
 	if (!r)
 		TDB_ERR("Cannot allocate cache entry for key=%#lx\n", key);
 
@@ -78,6 +113,42 @@ tdb_entry_add(TDB *db, TdbVRec *r, size_t size)
 }
 EXPORT_SYMBOL(tdb_entry_add);
 
+/**
+ * Remove record @rec, returned by tdb_entry_alloc() or tdb_rec_get(), from
+ * the database and release its chunks. If @may_remove is specified, then
+ * it's called under the record bucket lock and the record is removed only if
+ * the callback returns true. The callback must not access the database.
+ *
+ * Concurrent readers may still use the record, so its memory is released
+ * after RCU grace period.
+ *
+ * The caller must not hold the record bucket lock and must guarantee that
+ * the record is removed only once.
+ *
+ * @return true if the record was removed.
+ */
+bool
+tdb_entry_remove(TDB *db, TdbRec *rec, bool (*may_remove)(TdbRec *))
+{
+	TdbBucket *b;
+	bool r = true;
+
+	BUG_ON(!rec);
+
+	b = (TdbBucket *)((unsigned long)rec & TDB_HTRIE_DMASK);
+	BUG_ON(!b);
+
+	tdb_htrie_bucket_lock(b);
+	if (!may_remove || (r = may_remove(rec))) {
+		tdb_oidx_del(db, rec);
+		tdb_htrie_remove(db->hdr, rec);
+	}
+	tdb_htrie_bucket_unlock(b);
+
+	return r;
+}
+EXPORT_SYMBOL(tdb_entry_remove);
+
 /**
  * Check available room in @trec and allocate new record if it's not enough.
  * Chop tail of @trec if we allocated more space, but can't use the tail
@@ -99,23 +170,27 @@ EXPORT_SYMBOL(tdb_entry_get_room);
 
 /**
  * Lookup and get a record.
- * Since we don't copy returned records, we have to lock the bucket
- * where the record is placed and the user must call tdb_rec_put() when finish
- * with the record.
+ * Since we don't copy returned records, the record is used in RCU read-side
+ * section and the user must call tdb_rec_put() when finish with the record.
+ * Readers don't acquire the bucket locks, so they don't contend with each
+ * other. Removed records stay valid until all readers leave the section.
  *
  * The caller must not call sleeping functions during work with the record.
- * Typically there is only one large record per bucket, so the bucket lock
- * is exactly the same as to lock the record. While there could be many
- * small records in a bucket, so the caller should not perform long jobs
- * with small records.
+ * The record can be removed or, for small records, copied to another bucket
+ * concurrently, so the caller should not perform long jobs with the record:
+ * that delays reclamation of removed records.
  *
- * @return pointer to record with acquired bucket lock if the record is
- * found and NULL without acquired locks otherwise.
+ * @return pointer to record in RCU read-side section if the record is found
+ * and NULL outside of the section otherwise.
  */
 TdbIter
 tdb_rec_get(TDB *db, unsigned long key)
 {
 	TdbIter iter = { NULL };
+	u64 t0 = local_clock();
+
+	/* The bucket can be released by the compaction, see tdb_compact(). */
+	rcu_read_lock_bh();
 
 	iter.bckt = tdb_htrie_lookup(db->hdr, key);
 	if (!iter.bckt)
@@ -124,6 +199,8 @@ tdb_rec_get(TDB *db, unsigned long key)
 	iter.rec = tdb_htrie_bscan_for_rec(db->hdr, (TdbBucket **)&iter.bckt,
 					   key);
 out:
+	rcu_read_unlock_bh();
+	TDB_STAT_OP(db, lookup, t0);
 	return iter;
 }
 EXPORT_SYMBOL(tdb_rec_get);
@@ -142,34 +219,106 @@ tdb_rec_next(TDB *db, TdbIter *iter)
 }
 EXPORT_SYMBOL(tdb_rec_next);
 
+/**
+ * The generation of database @db to be passed to tdb_rec_revalidate() along
+ * with a record found by tdb_rec_get() after the call.
+ */
+unsigned long
+tdb_rec_gen(TDB *db)
+{
+	return atomic64_read(&db->hdr->free_gen);
+}
+EXPORT_SYMBOL(tdb_rec_gen);
+
+/**
+ * Get again record @rec with @key, which was found by tdb_rec_get() in an
+ * earlier RCU read-side section, w/o the lookup. This allows the users to
+ * keep small caches of the records pointers, e.g. per-CPU, which are
+ * validated by the generation @gen, see tdb_rec_gen().
+ *
+ * @return @rec in RCU read-side section, so the user must call tdb_rec_put()
+ * when finish with the record, if it's still live and NULL outside of the
+ * section otherwise.
+ */
+void *
+tdb_rec_revalidate(TDB *db, void *rec, unsigned long key, unsigned long gen)
+{
+	rcu_read_lock_bh();
+
+	if (tdb_htrie_rec_valid(db->hdr, rec, key, gen))
+		return rec;
+
+	rcu_read_unlock_bh();
+	return NULL;
+}
+EXPORT_SYMBOL(tdb_rec_revalidate);
+
 void
 tdb_rec_put(void *rec)
 {
-	TdbBucket *b;
-
 	BUG_ON(!rec);
 
-	b = (TdbBucket *)((unsigned long)rec & TDB_HTRIE_DMASK);
-	BUG_ON(!b);
-
-	read_unlock_bh(&b->lock);
+	rcu_read_unlock_bh();
 }
 EXPORT_SYMBOL(tdb_rec_put);
 
 void
 tdb_rec_keep(void *rec)
 {
-	TdbBucket *b;
-
 	BUG_ON(!rec);
 
-	b = (TdbBucket *)((unsigned long)rec & TDB_HTRIE_DMASK);
-	BUG_ON(!b);
-
-	read_lock_bh(&b->lock);
+	rcu_read_lock_bh();
 }
 EXPORT_SYMBOL(tdb_rec_keep);
 
+/**
+ * Pin record @rec found by tdb_rec_get(), so its data is freed only after
+ * tdb_rec_unpin() even if the record is removed or evicted meantime.
+ */
+void *
+tdb_rec_pin(TDB *db, void *rec)
+{
+	void *pin = tdb_htrie_pin(db->hdr, rec);
+
+	if (pin)
+		atomic_inc(&db->pins);
+
+	return pin;
+}
+EXPORT_SYMBOL(tdb_rec_pin);
+
+void
+tdb_rec_unpin(TDB *db, void *pin)
+{
+	tdb_htrie_unpin(pin);
+	atomic_dec(&db->pins);
+}
+EXPORT_SYMBOL(tdb_rec_unpin);
+
+/**
+ * Declare the kernel user of table @db as the owner of the table records.
+ * The owner may reference the records, e.g. link them into timer wheel or
+ * its own eviction structures, so other users, i.e. the netlink interface,
+ * must not remove the records directly. Instead they remove a record by
+ * @remove, which is called in RCU read-side section without the bucket lock
+ * and returns true if the record was removed. If @remove isn't specified,
+ * then the records can't be removed by other users at all.
+ *
+ * The owner calls the function with NULL @remove before it releases the
+ * data used by the previous callback: the function waits until running
+ * calls of the callback finish.
+ *
+ * The function must not be called from softirq!
+ */
+void
+tdb_set_owner(TDB *db, bool (*remove)(TDB *db, TdbRec *rec))
+{
+	WRITE_ONCE(db->remove, remove);
+	smp_store_release(&db->owned, true);
+	synchronize_rcu();
+}
+EXPORT_SYMBOL(tdb_set_owner);
+
 int
 tdb_info(char *buf, size_t len)
 {
@@ -177,7 +326,7 @@ tdb_info(char *buf, size_t len)
 
 	n = snprintf(buf, len,
 		     "\nTempesta DB version: %s\n"
-		     "Open tables: ",
+		     "Open tables [page size]: ",
 		     TDB_VERSION);
 	if (n <= 0)
 		return n;
@@ -189,6 +338,47 @@ tdb_info(char *buf, size_t len)
 	return n;
 }
 
+static void
+tdb_stat_sum(TDB *db, TdbPcpuStat *sum)
+{
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		TdbPcpuStat *s = per_cpu_ptr(db->stat, cpu);
+
+		sum->lookups += s->lookups;
+		sum->inserts += s->inserts;
+		sum->lookup_ns += s->lookup_ns;
+		sum->insert_ns += s->insert_ns;
+	}
+}
+
+/**
+ * Collect statistics of table @db: the operations counters and the index
+ * and blocks statistics, which are collected by a walk over the table.
+ *
+ * Must be called from process context.
+ */
+void
+tdb_stat(TDB *db, TdbStat *st)
+{
+	TdbPcpuStat sum;
+
+	memset(st, 0, sizeof(*st));
+	tdb_htrie_stat(db->hdr, st);
+	st->max_size = db->max_sz;
+
+	tdb_stat_sum(db, &sum);
+	st->lookups = sum.lookups;
+	st->inserts = sum.inserts;
+	st->lookup_ns = sum.lookup_ns;
+	st->insert_ns = sum.insert_ns;
+	st->lookup_rate = READ_ONCE(db->lookup_rate);
+	st->insert_rate = READ_ONCE(db->insert_rate);
+}
+EXPORT_SYMBOL(tdb_stat);
+
 /**
  * Search for already opened handler for the database or allocate a new one.
  *
@@ -241,6 +431,9 @@ tdb_get_db(const char *path, int node)
 		 (int)(full_len - sizeof(TDB_SUFFIX) + 1), path, node);
 	snprintf(db->tbl_name, TDB_TBLNAME_LEN, "%.*s%d.tdb",
 		 len, slash + 1, node);
+	INIT_DELAYED_WORK(&db->compact_work, tdb_compact);
+	INIT_DELAYED_WORK(&db->ckpt_work, tdb_checkpoint);
+	INIT_DELAYED_WORK(&db->grow_work, tdb_grow);
 
 	return tdb_get(db);
 }
@@ -303,14 +496,84 @@ tdb_entry_walk(TDB *db, int (*fn)(void *))
 }
 EXPORT_SYMBOL(tdb_entry_walk);
 
+/**
+ * Incremental compaction of table @db: release dead buckets of the next
+ * root index slot subtree on each run. A full pass over the table takes
+ * TDB_HTRIE_FANOUT runs.
+ */
+static void
+tdb_compact(struct work_struct *work)
+{
+	unsigned long n;
+	TdbPcpuStat sum;
+	TDB *db = container_of(to_delayed_work(work), TDB, compact_work);
+
+	n = tdb_htrie_compact(db->hdr, db->compact_slot);
+	if (n)
+		TDB_DBG("Released %lu dead buckets in slot %u for table %s\n",
+			n, db->compact_slot, db->tbl_name);
+	db->compact_slot = (db->compact_slot + 1) % TDB_HTRIE_FANOUT;
+
+	/* Sample the operations rates on the periodic work. */
+	tdb_stat_sum(db, &sum);
+	WRITE_ONCE(db->lookup_rate, (sum.lookups - db->stat_last.lookups)
+				    * HZ / TDB_COMPACT_INTERVAL);
+	WRITE_ONCE(db->insert_rate, (sum.inserts - db->stat_last.inserts)
+				    * HZ / TDB_COMPACT_INTERVAL);
+	db->stat_last = sum;
+
+	schedule_delayed_work(&db->compact_work, TDB_COMPACT_INTERVAL);
+}
+
+static void
+tdb_checkpoint(struct work_struct *work)
+{
+	TDB *db = container_of(to_delayed_work(work), TDB, ckpt_work);
+
+	tdb_file_checkpoint(db);
+
+	schedule_delayed_work(&db->ckpt_work, TDB_CKPT_INTERVAL);
+}
+
+/**
+ * Extend table @db by a half when less than 1/8 of the table is left for new
+ * extents. Blocks of removed records are reclaimed only when the table is
+ * full, which is slow, so the table is extended in advance.
+ */
+static void
+tdb_grow(struct work_struct *work)
+{
+	TDB *db = container_of(to_delayed_work(work), TDB, grow_work);
+	unsigned long sz = db->hdr->dbsz;
+
+	if (atomic64_read(&db->hdr->nwb) >= sz - sz / 8) {
+		sz = min(db->max_sz, sz + max(TDB_EXT_O(sz / 2), TDB_EXT_SZ));
+		sz = tdb_file_extend(db, sz);
+		if (!sz) {
+			TDB_WARN("Cannot extend table %s: no free memory"
+				 " after the table\n", db->tbl_name);
+			return;
+		}
+		TDB_LOG("Table %s is extended to %lu bytes\n",
+			db->tbl_name, sz);
+	}
+
+	if (db->hdr->dbsz < db->max_sz)
+		schedule_delayed_work(&db->grow_work, TDB_GROW_INTERVAL);
+}
+
 /**
  * Open database file and @return its descriptor.
  * If the database is already opened, then returns the handler.
  *
+ * The table is extended online up to @max_size bytes when it becomes full.
+ * The table isn't extended if @max_size isn't larger than @fsize.
+ *
  * The function must not be called from softirq!
  */
 TDB *
-tdb_open(const char *path, size_t fsize, unsigned int rec_size, int node)
+tdb_open(const char *path, size_t fsize, size_t max_size,
+	 unsigned int rec_size, int node)
 {
 	TDB *db;
 
@@ -318,6 +581,11 @@ tdb_open(const char *path, size_t fsize, unsigned int rec_size, int node)
 		TDB_ERR("Bad table size: %lu\n", fsize);
 		return NULL;
 	}
+	max_size = max(fsize, max_size);
+	if ((max_size & ~TDB_EXT_MASK) || max_size > TDB_MAX_DB_SZ) {
+		TDB_ERR("Bad table maximum size: %lu\n", max_size);
+		return NULL;
+	}
 
 	db = tdb_get_db(path, node);
 	if (!db)
@@ -325,22 +593,32 @@ tdb_open(const char *path, size_t fsize, unsigned int rec_size, int node)
 
 	db->node = node;
 
-	if (tdb_file_open(db, fsize)) {
+	if (tdb_file_open(db, fsize, max_size)) {
 		TDB_ERR("Cannot open db for %s\n", path);
 		goto err;
 	}
 
-	db->hdr = tdb_htrie_init(db->hdr, db->filp->f_inode->i_size, rec_size);
+	db->hdr = tdb_htrie_init(db->hdr, db->filp->f_inode->i_size, max_size,
+				 rec_size);
 	if (!db->hdr) {
 		TDB_ERR("Cannot initialize db header\n");
 		goto err_init;
 	}
+	if (!db->stat && !(db->stat = alloc_percpu(TdbPcpuStat))) {
+		TDB_ERR("Cannot allocate statistics\n");
+		goto err_init;
+	}
 
 	tdb_tbl_enumerate(db);
 	spin_lock_init(&db->ga_lock);
+	schedule_delayed_work(&db->compact_work, TDB_COMPACT_INTERVAL);
+	schedule_delayed_work(&db->ckpt_work, TDB_CKPT_INTERVAL);
+	if (db->hdr->dbsz < db->max_sz)
+		schedule_delayed_work(&db->grow_work, TDB_GROW_INTERVAL);
 
-	TDB_LOG("Opened table %s: size=%lu rec_size=%u base=%p\n",
-		db->path, fsize, rec_size, db->hdr);
+	TDB_LOG("Opened table %s: size=%lu max_size=%lu rec_size=%u base=%p"
+		" pages=%s\n", db->path, db->hdr->dbsz, db->max_sz, rec_size,
+		db->hdr, tdb_file_hugepages(db) ? "2M" : "4K");
 
 	return db;
 err_init:
@@ -354,11 +632,19 @@ EXPORT_SYMBOL(tdb_open);
 static void
 __do_close_table(TDB *db)
 {
-	/* Unmapping can be done from process context. */
-	tdb_file_close(db);
+	tdb_timers_exit(db);
+	tdb_oidx_exit(db);
+	cancel_delayed_work_sync(&db->compact_work);
+	cancel_delayed_work_sync(&db->ckpt_work);
+	cancel_delayed_work_sync(&db->grow_work);
 
+	/* Reclaim retired records before the final checkpoint. */
 	tdb_htrie_exit(db->hdr);
 
+	/* Unmapping can be done from process context. */
+	tdb_file_close(db);
+	free_percpu(db->stat);
+
 	TDB_LOG("Close table '%s'\n", db->tbl_name);
 
 	kfree(db);
@@ -367,6 +653,8 @@ __do_close_table(TDB *db)
 void
 tdb_close(TDB *db)
 {
+	int i;
+
 	if (!db)
 		return;
 
@@ -375,10 +663,103 @@ tdb_close(TDB *db)
 
 	tdb_tbl_forget(db);
 
+	/*
+	 * The pins are released when the data is acknowledged by peers or
+	 * the connections are closed. Leak the table rather than unmap it
+	 * under the pinned data.
+	 */
+	for (i = 0; atomic_read(&db->pins) && i < TDB_PIN_WAIT; ++i)
+		msleep(10);
+	if (atomic_read(&db->pins)) {
+		TDB_WARN("Cannot close table '%s': %d records are pinned\n",
+			 db->tbl_name, atomic_read(&db->pins));
+		return;
+	}
+
 	__do_close_table(db);
 }
 EXPORT_SYMBOL(tdb_close);
 
+/**
+ * Open replicas of table @path on all NUMA nodes with CPUs. Each replica is
+ * stored in its own file and is loaded from its own snapshot, so the replicas
+ * are the same after restart only if all of them were closed cleanly.
+ *
+ * The function must not be called from softirq!
+ */
+TdbRepl *
+tdb_repl_open(const char *path, size_t fsize, unsigned int rec_size)
+{
+	int node;
+	TdbRepl *repl;
+
+	repl = kzalloc(sizeof(*repl), GFP_KERNEL);
+	if (!repl)
+		return NULL;
+
+	for_each_node_with_cpus(node) {
+		repl->db[node] = tdb_open(path, fsize, fsize, rec_size, node);
+		if (!repl->db[node]) {
+			tdb_repl_close(repl);
+			return NULL;
+		}
+	}
+
+	return repl;
+}
+EXPORT_SYMBOL(tdb_repl_open);
+
+void
+tdb_repl_close(TdbRepl *repl)
+{
+	int node;
+
+	if (!repl)
+		return;
+
+	for_each_node_with_cpus(node)
+		tdb_close(repl->db[node]);
+
+	kfree(repl);
+}
+EXPORT_SYMBOL(tdb_repl_close);
+
+/**
+ * Create the record in all the replicas of @repl. If some replica can't
+ * store the record, then the record is removed from the other replicas, so
+ * all the nodes see the same records.
+ *
+ * @return the record in the local replica.
+ */
+TdbRec *
+tdb_repl_create(TdbRepl *repl, unsigned long key, void *data, size_t *len)
+{
+	int node;
+	size_t n = *len;
+	TdbRec **recs, *r = NULL;
+
+	recs = kcalloc(nr_node_ids, sizeof(*recs), GFP_ATOMIC);
+	if (!recs)
+		return NULL;
+
+	for_each_node_with_cpus(node) {
+		*len = n;
+		recs[node] = tdb_entry_create(repl->db[node], key, data, len);
+		if (!recs[node])
+			goto err;
+	}
+	r = recs[numa_node_id()];
+	goto out;
+err:
+	for_each_node_with_cpus(node)
+		if (recs[node])
+			tdb_entry_remove(repl->db[node], recs[node], NULL);
+out:
+	kfree(recs);
+	return r;
+}
+EXPORT_SYMBOL(tdb_repl_create);
+
 static int __init
 tdb_init(void)
 {
@@ -386,15 +767,28 @@ tdb_init(void)
 
 	TDB_LOG("Start Tempesta DB\n");
 
+	tdb_htrie_pins_init();
+
 	r = tdb_init_mappings();
 	if (r)
 		return r;
 
+	tdb_tbl_procfs_init();
+
 	r = tdb_if_init();
 	if (r)
-		return r;
+		goto err_if;
+
+	r = tdb_dev_init();
+	if (r) {
+		tdb_if_exit();
+		goto err_if;
+	}
 
 	return 0;
+err_if:
+	tdb_tbl_procfs_exit();
+	return r;
 }
 
 static void __exit
@@ -402,7 +796,9 @@ tdb_exit(void)
 {
 	TDB_LOG("Shutdown Tempesta DB\n");
 
+	tdb_dev_exit();
 	tdb_if_exit();
+	tdb_tbl_procfs_exit();
 
 	/*
 	 * There are no database users, so roughly close all abandoned
@@ -0,0 +1,376 @@
+/**
+ *		Tempesta DB
+ *
+ * Ordered index of table records.
+ *
+ * HTrie indexes records by hashed keys, so it can't find records by a key
+ * range or a key prefix. A table can have an additional index ordered by
+ * record order keys, defined by the table owner. The index is a red-black
+ * tree of order keys and the record keys, so it doesn't depend on the record
+ * locations, which change when small records are moved between buckets.
+ * The index is kept in memory and is built from the table records on the
+ * table opening, so table snapshots don't depend on the index.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+
+#include "htrie.h"
+#include "oidx.h"
+
+/**
+ * Ordered index entry for all the records with the same order and record
+ * keys.
+ *
+ * @node	- the tree linkage;
+ * @key		- the record key;
+ * @n		- number of the indexed records;
+ * @len		- length of the order key;
+ * @okey	- the order key;
+ */
+typedef struct {
+	struct rb_node	node;
+	unsigned long	key;
+	unsigned int	n;
+	unsigned int	len;
+	char		okey[0];
+} TdbOidxNode;
+
+/**
+ * @lock	- protects the tree;
+ * @root	- the tree of TdbOidxNode;
+ * @okey	- the order key of a record, see tdb_oidx_init();
+ */
+struct tdb_oidx_t {
+	spinlock_t	lock;
+	struct rb_root	root;
+	unsigned int	(*okey)(TdbRec *rec, char *buf);
+};
+
+/* The index being built from the table records. */
+static DEFINE_MUTEX(tdb_oidx_build_mtx);
+static TdbOidx *tdb_oidx_building;
+
+static int
+tdb_oidx_cmp_okey(const char *okey, unsigned int len, const TdbOidxNode *n)
+{
+	int r = memcmp(okey, n->okey, min(len, n->len));
+
+	if (r)
+		return r;
+	return len < n->len ? -1 : len > n->len;
+}
+
+static int
+tdb_oidx_cmp(const char *okey, unsigned int len, unsigned long key,
+	     const TdbOidxNode *n)
+{
+	int r = tdb_oidx_cmp_okey(okey, len, n);
+
+	if (r)
+		return r;
+	return key < n->key ? -1 : key > n->key;
+}
+
+static TdbOidxNode *
+tdb_oidx_find(TdbOidx *oi, const char *okey, unsigned int len,
+	      unsigned long key)
+{
+	struct rb_node *rb = oi->root.rb_node;
+
+	while (rb) {
+		TdbOidxNode *n = rb_entry(rb, TdbOidxNode, node);
+		int r = tdb_oidx_cmp(okey, len, key, n);
+
+		if (!r)
+			return n;
+		rb = r < 0 ? rb->rb_left : rb->rb_right;
+	}
+
+	return NULL;
+}
+
+/**
+ * @return the first entry which isn't less than @pos.
+ */
+static TdbOidxNode *
+tdb_oidx_lower_bound(TdbOidx *oi, const TdbOidxPos *pos)
+{
+	struct rb_node *rb = oi->root.rb_node;
+	TdbOidxNode *res = NULL;
+
+	while (rb) {
+		TdbOidxNode *n = rb_entry(rb, TdbOidxNode, node);
+
+		if (tdb_oidx_cmp(pos->okey, pos->len, pos->key, n) <= 0) {
+			res = n;
+			rb = rb->rb_left;
+		} else {
+			rb = rb->rb_right;
+		}
+	}
+
+	return res;
+}
+
+static int
+__tdb_oidx_add(TdbOidx *oi, TdbRec *rec)
+{
+	char okey[TDB_OKEY_MAX];
+	unsigned int len = oi->okey(rec, okey);
+	struct rb_node **p = &oi->root.rb_node, *parent = NULL;
+	TdbOidxNode *n;
+
+	if (!len)
+		return 0;
+	BUG_ON(len > TDB_OKEY_MAX);
+
+	spin_lock_bh(&oi->lock);
+
+	while (*p) {
+		int r;
+
+		parent = *p;
+		n = rb_entry(parent, TdbOidxNode, node);
+		r = tdb_oidx_cmp(okey, len, rec->key, n);
+		if (!r) {
+			n->n++;
+			goto out;
+		}
+		p = r < 0 ? &parent->rb_left : &parent->rb_right;
+	}
+
+	n = kmalloc(sizeof(*n) + len, GFP_ATOMIC);
+	if (!n) {
+		spin_unlock_bh(&oi->lock);
+		return -ENOMEM;
+	}
+	n->key = rec->key;
+	n->n = 1;
+	n->len = len;
+	memcpy(n->okey, okey, len);
+	rb_link_node(&n->node, parent, p);
+	rb_insert_color(&n->node, &oi->root);
+out:
+	spin_unlock_bh(&oi->lock);
+
+	return 0;
+}
+
+/**
+ * Index record @rec. Records created by tdb_entry_create() are indexed
+ * automatically, while the function must be called once for each record
+ * created by other means when its order key is written.
+ */
+int
+tdb_oidx_add(TDB *db, TdbRec *rec)
+{
+	if (!db->oidx)
+		return 0;
+
+	return __tdb_oidx_add(db->oidx, rec);
+}
+EXPORT_SYMBOL(tdb_oidx_add);
+
+/**
+ * Remove record @rec from the index. Called under the record bucket lock
+ * before the record removal.
+ */
+void
+tdb_oidx_del(TDB *db, TdbRec *rec)
+{
+	char okey[TDB_OKEY_MAX];
+	TdbOidx *oi = db->oidx;
+	TdbOidxNode *n;
+	unsigned int len;
+
+	if (!oi || !(len = oi->okey(rec, okey)))
+		return;
+
+	spin_lock(&oi->lock);
+	n = tdb_oidx_find(oi, okey, len, rec->key);
+	if (n && !--n->n) {
+		rb_erase(&n->node, &oi->root);
+		kfree(n);
+	}
+	spin_unlock(&oi->lock);
+}
+
+static bool
+tdb_oidx_rec_match(TdbOidx *oi, TdbRec *rec, const TdbOidxNode *n)
+{
+	char okey[TDB_OKEY_MAX];
+	unsigned int len = oi->okey(rec, okey);
+
+	return len && !tdb_oidx_cmp_okey(okey, len, n);
+}
+
+/**
+ * Call @fn for each record starting from position @pos and with order key
+ * less than @to of @tlen bytes, or for all the records till the end of the
+ * index if @to is NULL. If @fn returns non-zero, then the iteration stops,
+ * @pos is set to the position of the current record and the value returned
+ * by @fn is returned. Records with the same order and record keys have the
+ * same position, so the iteration can be resumed from @pos with repeating
+ * the records with the same position as the current one.
+ *
+ * @fn is called in RCU read-side section under the index lock, so it must
+ * not sleep and must not modify the table.
+ */
+int
+tdb_oidx_range(TDB *db, TdbOidxPos *pos, const char *to, unsigned int tlen,
+	       int (*fn)(TdbRec *rec, const TdbOidxPos *pos, void *arg),
+	       void *arg)
+{
+	int r = 0;
+	TdbOidx *oi = db->oidx;
+	TdbOidxNode *n;
+	TdbOidxPos cur;
+
+	if (!oi)
+		return -EINVAL;
+
+	spin_lock_bh(&oi->lock);
+
+	for (n = tdb_oidx_lower_bound(oi, pos); n;
+	     n = rb_entry_safe(rb_next(&n->node), TdbOidxNode, node))
+	{
+		TdbIter iter;
+
+		if (to && tdb_oidx_cmp_okey(to, tlen, n) <= 0)
+			break;
+
+		cur.key = n->key;
+		cur.len = n->len;
+		memcpy(cur.okey, n->okey, n->len);
+
+		iter = tdb_rec_get(db, n->key);
+		while (!TDB_ITER_BAD(iter)) {
+			if (tdb_oidx_rec_match(oi, iter.rec, n)
+			    && (r = fn(iter.rec, &cur, arg)))
+			{
+				tdb_rec_put(iter.rec);
+				*pos = cur;
+				goto out;
+			}
+			tdb_rec_next(db, &iter);
+		}
+	}
+out:
+	spin_unlock_bh(&oi->lock);
+
+	return r;
+}
+EXPORT_SYMBOL(tdb_oidx_range);
+
+/**
+ * Call @fn for each record with order key starting with @prefix of @len
+ * bytes, see tdb_oidx_range().
+ */
+int
+tdb_oidx_prefix(TDB *db, const char *prefix, unsigned int len,
+		int (*fn)(TdbRec *rec, const TdbOidxPos *pos, void *arg),
+		void *arg)
+{
+	TdbOidxPos pos = { .key = 0 };
+	char to[TDB_OKEY_MAX];
+	unsigned int tlen;
+
+	pos.len = min_t(unsigned int, len, TDB_OKEY_MAX);
+	memcpy(pos.okey, prefix, pos.len);
+
+	/* The least key greater than all the keys with the prefix. */
+	memcpy(to, pos.okey, pos.len);
+	for (tlen = pos.len; tlen && (unsigned char)to[tlen - 1] == 0xff; )
+		--tlen;
+	if (tlen)
+		to[tlen - 1]++;
+
+	return tdb_oidx_range(db, &pos, tlen ? to : NULL, tlen, fn, arg);
+}
+EXPORT_SYMBOL(tdb_oidx_prefix);
+
+/* Called by tdb_entry_walk() for the record data under the bucket lock. */
+static int
+tdb_oidx_build_rec(void *data)
+{
+	TdbRec *r = container_of(data, TdbRec, data);
+
+	return __tdb_oidx_add(tdb_oidx_building, r);
+}
+
+/**
+ * Create ordered index for table @db by order keys of the records. @okey
+ * writes order key of record @rec to @buf of TDB_OKEY_MAX bytes and returns
+ * the key length or zero if the record must not be indexed. The order key
+ * must be in the first record chunk and must not change during the record
+ * lifetime.
+ *
+ * The records already stored in the table are indexed, so the function must
+ * be called when the table has no concurrent writers, typically right after
+ * the table opening. The function must not be called from softirq!
+ */
+int
+tdb_oidx_init(TDB *db, unsigned int (*okey)(TdbRec *rec, char *buf))
+{
+	int r;
+	TdbOidx *oi;
+
+	if (db->oidx)
+		return 0;
+
+	oi = kmalloc(sizeof(*oi), GFP_KERNEL);
+	if (!oi)
+		return -ENOMEM;
+	spin_lock_init(&oi->lock);
+	oi->root = RB_ROOT;
+	oi->okey = okey;
+
+	mutex_lock(&tdb_oidx_build_mtx);
+	tdb_oidx_building = oi;
+	r = tdb_entry_walk(db, tdb_oidx_build_rec);
+	tdb_oidx_building = NULL;
+	mutex_unlock(&tdb_oidx_build_mtx);
+
+	if (r) {
+		TDB_ERR("Cannot build ordered index for table %s\n",
+			db->tbl_name);
+		db->oidx = oi;
+		tdb_oidx_exit(db);
+		return r;
+	}
+	db->oidx = oi;
+
+	return 0;
+}
+EXPORT_SYMBOL(tdb_oidx_init);
+
+void
+tdb_oidx_exit(TDB *db)
+{
+	TdbOidxNode *n, *tmp;
+
+	if (!db->oidx)
+		return;
+
+	rbtree_postorder_for_each_entry_safe(n, tmp, &db->oidx->root, node)
+		kfree(n);
+	kfree(db->oidx);
+	db->oidx = NULL;
+}
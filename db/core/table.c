@@ -19,6 +19,10 @@
  * this program; if not, write to the Free Software Foundation, Inc., 59
  * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+
+#include "file.h"
 #include "tdb.h"
 
 #define TDB_MAXTBL	512
@@ -32,6 +36,51 @@ typedef struct {
 static TdbTable tdb_tbls[TDB_MAXTBL];
 static int tbl_last;
 static DEFINE_MUTEX(tbl_mtx);
+/* /proc/tempesta_db directory with statistics file of each table. */
+static struct proc_dir_entry *tdb_procfs;
+
+static int
+tdb_tbl_stat_show(struct seq_file *seq, void *off)
+{
+	int i, n;
+	TdbStat st;
+
+	tdb_stat(seq->private, &st);
+
+	seq_printf(seq, "Size\t\t\t: %lu\n", st.size);
+	seq_printf(seq, "Maximum size\t\t: %lu\n", st.max_size);
+	seq_printf(seq, "Used extents\t\t: %lu\n", st.ext_used);
+	seq_printf(seq, "Used blocks\t\t: %lu\n", st.blk_used);
+	seq_printf(seq, "Free blocks\t\t: %lu\n", st.blk_free);
+	seq_printf(seq, "Free block runs\t\t: %lu\n", st.free_runs);
+	seq_printf(seq, "Longest free run\t: %lu\n", st.free_run_max);
+	seq_printf(seq, "Index nodes\t\t: %lu\n", st.nodes);
+	seq_printf(seq, "Buckets\t\t\t: %lu\n", st.buckets);
+	seq_printf(seq, "Records\t\t\t: %lu\n", st.recs);
+	seq_printf(seq, "Records bytes\t\t: %lu\n", st.rec_bytes);
+	/* The blocks are pages. */
+	seq_printf(seq, "Blocks fill ratio\t: %lu%%\n", st.blk_used
+		   ? st.rec_bytes * 100 / (st.blk_used * PAGE_SIZE) : 0);
+
+	for (n = TDB_STAT_DEPTH; n > 1 && !st.depth[n - 1]; --n)
+		;
+	seq_printf(seq, "Buckets by depth\t:");
+	for (i = 0; i < n; ++i)
+		seq_printf(seq, " %lu", st.depth[i]);
+	seq_printf(seq, "\nCollision chains\t:");
+	for (i = 0; i < TDB_STAT_CHAIN; ++i)
+		seq_printf(seq, " %d%s=%lu", i + 1,
+			   i == TDB_STAT_CHAIN - 1 ? "+" : "", st.chain[i]);
+
+	seq_printf(seq, "\nLookups\t\t\t: %lu, %lu/s, avg %lu ns\n",
+		   st.lookups, st.lookup_rate,
+		   st.lookups ? st.lookup_ns / st.lookups : 0);
+	seq_printf(seq, "Inserts\t\t\t: %lu, %lu/s, avg %lu ns\n",
+		   st.inserts, st.insert_rate,
+		   st.inserts ? st.insert_ns / st.inserts : 0);
+
+	return 0;
+}
 
 void
 tdb_tbl_enumerate(TDB *db)
@@ -45,6 +94,11 @@ tdb_tbl_enumerate(TDB *db)
 		strncpy(tdb_tbls[tbl_last].name, db->tbl_name, TDB_TBLNAME_LEN);
 		tdb_tbls[tbl_last].db = db;
 		++tbl_last;
+		if (tdb_procfs
+		    && !proc_create_single_data(db->tbl_name, 0444, tdb_procfs,
+						tdb_tbl_stat_show, db))
+			TDB_WARN("Cannot create procfs entry for %s\n",
+				 db->tbl_name);
 	} else
 		TDB_WARN("Cannot enumerate %s\n", db->tbl_name);
 
@@ -63,6 +117,9 @@ tdb_tbl_forget(TDB *db)
 	for (i = 0; i < tbl_last; ++i) {
 		if (strncmp(db->tbl_name, tdb_tbls[i].name, TDB_TBLNAME_LEN))
 			continue;
+		/* Waits for the readers of the table statistics. */
+		if (tdb_procfs)
+			remove_proc_entry(db->tbl_name, tdb_procfs);
 		if (i < TDB_MAXTBL - 1)
 			memmove(tdb_tbls + i, tdb_tbls + i + 1,
 				(tbl_last - i) * sizeof(TdbTable));
@@ -83,7 +140,8 @@ tdb_tbl_print_all(char *buf, size_t len)
 	mutex_lock(&tbl_mtx);
 
 	for (i = 0; i < tbl_last; ++i) {
-		int r = snprintf(buf + n, len - n, "%s ", tdb_tbls[i].name);
+		int r = snprintf(buf + n, len - n, "%s[%s] ", tdb_tbls[i].name,
+				 tdb_file_hugepages(tdb_tbls[i].db) ? "2M" : "4K");
 		if (r <= 0) {
 			TDB_WARN("Not enough space to print all tables\n");
 			break;
@@ -128,3 +186,18 @@ tdb_tbl_lookup(char *table, size_t len)
 
 	return db;
 }
+
+void
+tdb_tbl_procfs_init(void)
+{
+	tdb_procfs = proc_mkdir("tempesta_db", NULL);
+	if (!tdb_procfs)
+		TDB_WARN("Cannot create /proc/tempesta_db\n");
+}
+
+void
+tdb_tbl_procfs_exit(void)
+{
+	if (tdb_procfs)
+		proc_remove(tdb_procfs);
+}
@@ -27,5 +27,7 @@ void tdb_tbl_forget(TDB *db);
 int tdb_tbl_print_all(char *buf, size_t len);
 void tdb_tbl_foreach(void (*func)(TDB *db));
 TDB *tdb_tbl_lookup(char *table, size_t len);
+void tdb_tbl_procfs_init(void);
+void tdb_tbl_procfs_exit(void);
 
 #endif /* __TABLE_H__ */
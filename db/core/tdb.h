@@ -25,6 +25,8 @@
 
 #include <linux/fs.h>
 #include <linux/slab.h>
+#include <linux/topology.h>
+#include <linux/workqueue.h>
 
 #include "tdb_if.h"
 
@@ -43,18 +45,36 @@ typedef struct {
 	unsigned long	d_wcl;
 } TdbPerCpu;
 
+/**
+ * Per-CPU counters of the table operations, see tdb_stat().
+ */
+typedef struct {
+	unsigned long	lookups;
+	unsigned long	inserts;
+	unsigned long	lookup_ns;
+	unsigned long	insert_ns;
+} TdbPcpuStat;
+
 /**
  * Tempesta DB file descriptor.
  *
  * We store independent records in at least cache line size data blocks
  * to avoid false sharing.
  *
- * @dbsz	- the database size in bytes;
+ * @dbsz	- the database size in bytes, grows online up to the maximum
+ *		  size of the table, see tdb_htrie_extend();
  * @nwb		- next to write block (byte offset);
  * @pcpu	- pointer to per-cpu dynamic data for the TDB handler;
  * @rec_len	- fixed-size records length or zero for variable-length records;
- ** @ext_bmp	- bitmap of used/free extents.
- * 		  Must be small and cache line aligned;
+ * @blk_ref	- runtime array of per-block reference counters for data blocks,
+ *		  used to reclaim blocks of removed records;
+ * @gen		- snapshot generation, incremented on each complete checkpoint;
+ * @flags	- TDB_HDR_CLEAN if the file keeps a consistent snapshot;
+ * @free_gen	- incremented each time compaction releases a bucket, so
+ *		  lockless readers of a user-space mapping can detect blocks
+ *		  reused under them;
+ ** @ext_bmp	- bitmap of used/free extents of the largest possible table.
+ * 		  Must be cache line aligned;
  */
 typedef struct {
 	unsigned long		magic;
@@ -62,30 +82,88 @@ typedef struct {
 	atomic64_t		nwb;
 	TdbPerCpu __percpu	*pcpu;
 	unsigned int		rec_len;
-	unsigned char		_padding[8 * 3 + 4];
+	atomic_t		*blk_ref;
+	unsigned long		gen;
+	unsigned int		flags;
+	atomic64_t		free_gen;
 	unsigned long		ext_bmp[0];
 } __attribute__((packed)) TdbHdr;
 
+/* Changed with the on-disk layout of the tables. */
+#define TDB_MAGIC		0x334947414D424454UL /* "TDBMAGI3" */
+/* The table was closed cleanly and all its extents are written. */
+#define TDB_HDR_CLEAN		0x1
+
+typedef struct tdb_wheel_t TdbWheel;
+typedef struct tdb_oidx_t TdbOidx;
+
 /**
  * Database handle descriptor.
  *
  * @filp	- mmap()'ed file;
  * @node	- NUMA node ID;
  * @count	- reference counter;
+ * @pins	- number of pins of the records, see tdb_rec_pin();
  * @ga_lock	- Lock for atomic execution of lookup and create a record TDB;
+ * @compact_work - periodic incremental compaction of the table;
+ * @compact_slot - root index slot to be compacted next;
+ * @ckpt_work	- periodic incremental checkpoint of the table;
+ * @ckpt_ext	- extent to be checked for changes next;
+ * @ckpt_hash	- per-extent hashes of the data written to the file, zero
+ *		  if the file content of the extent is unknown;
+ * @ckpt_buf	- bounce buffer to write a consistent copy of an extent;
+ * @grow_work	- periodic check whether the table must be extended;
+ * @max_sz	- maximum size of the table in bytes;
+ * @stat	- per-CPU counters of the table operations;
+ * @stat_last	- sum of @stat on the previous rates sampling;
+ * @lookup_rate, @insert_rate - operations per second, sampled by the
+ *		  compaction work;
+ * @wheel	- timer wheel for records expiration, see tdb_timers_init();
+ * @oidx	- ordered index of the records, see tdb_oidx_init();
+ * @owned	- the records are referenced by a kernel user of the table,
+ *		  see tdb_set_owner();
+ * @remove	- removal of a record on behalf of other table users;
  * @tbl_name	- table name;
  * @path	- path to the table;
  */
-typedef struct {
+typedef struct tdb_t {
 	TdbHdr		*hdr;
 	struct file	*filp;
 	int		node;
 	atomic_t	count;
+	atomic_t	pins;
 	spinlock_t	ga_lock; /* TODO: remove and make lockless. */
+	struct delayed_work compact_work;
+	unsigned int	compact_slot;
+	struct delayed_work ckpt_work;
+	unsigned long	ckpt_ext;
+	unsigned long	*ckpt_hash;
+	void		*ckpt_buf;
+	struct delayed_work grow_work;
+	unsigned long	max_sz;
+	TdbPcpuStat __percpu *stat;
+	TdbPcpuStat	stat_last;
+	unsigned long	lookup_rate;
+	unsigned long	insert_rate;
+	TdbWheel	*wheel;
+	TdbOidx		*oidx;
+	bool		owned;
+	bool		(*remove)(struct tdb_t *db, TdbRec *rec);
 	char		tbl_name[TDB_TBLNAME_LEN + 1];
 	char		path[TDB_PATH_LEN];
 } TDB;
 
+/**
+ * Table replicated on all NUMA nodes with CPUs: records are created in all
+ * the replicas and lookups are served by the replica in local memory.
+ * Suitable for rarely updated tables looked up on hot paths.
+ *
+ * @db		- per-node replicas;
+ */
+typedef struct {
+	TDB		*db[MAX_NUMNODES];
+} TdbRepl;
+
 /**
  * Fixed-size (and typically small) records.
  */
@@ -110,6 +188,24 @@ typedef struct {
 /* Common interface for database records of all kinds. */
 typedef TdbFRec TdbRec;
 
+/**
+ * Expiration timer of a record, embedded into the record data.
+ * The record must not move, i.e. it must be larger than TDB_HTRIE_MINDREC.
+ *
+ * @list	- timer wheel slot list;
+ * @rec		- the record;
+ * @expires	- expiration time in jiffies;
+ * @wheel	- identifier of the wheel the timer was armed in, timers of
+ *		  records loaded from a snapshot don't belong to the current
+ *		  wheel and aren't armed;
+ */
+typedef struct {
+	struct list_head	list;
+	TdbRec			*rec;
+	unsigned long		expires;
+	unsigned int		wheel;
+} TdbTimer;
+
 /**
  * Iterator for TDB full key collision chains.
  */
@@ -120,6 +216,19 @@ typedef struct {
 
 #define TDB_ITER_BAD(i)		(!(i).rec)
 
+/**
+ * Position in the ordered index of a table.
+ *
+ * @key		- the record key, orders records with the same order key;
+ * @len		- length of the order key;
+ * @okey	- the order key;
+ */
+typedef struct {
+	unsigned long	key;
+	unsigned int	len;
+	char		okey[TDB_OKEY_MAX];
+} TdbOidxPos;
+
 /**
  * Hooks for tdb_rec_get_alloc() function.
  * @eq_rec		- record match function, used in collision chain;
@@ -193,6 +302,7 @@ typedef struct {
 TdbRec *tdb_entry_alloc(TDB *db, unsigned long key, size_t *len);
 TdbRec *tdb_entry_create(TDB *db, unsigned long key, void *data, size_t *len);
 TdbVRec *tdb_entry_add(TDB *db, TdbVRec *r, size_t size);
+bool tdb_entry_remove(TDB *db, TdbRec *rec, bool (*may_remove)(TdbRec *));
 void *tdb_entry_get_room(TDB *db, TdbVRec **r, char *curr_ptr, size_t tail_len,
 			 size_t tot_size);
 TdbIter tdb_rec_get(TDB *db, unsigned long key);
@@ -213,15 +323,65 @@ void tdb_rec_put(void *rec);
  */
 void tdb_rec_keep(void *rec);
 
+/*
+ * Get a record found by tdb_rec_get() earlier again if it's still live.
+ */
+unsigned long tdb_rec_gen(TDB *db);
+void *tdb_rec_revalidate(TDB *db, void *rec, unsigned long key,
+			 unsigned long gen);
+
+/*
+ * Keep the record data valid after the record is removed until the pin is
+ * released, e.g. while the data is transmitted by reference.
+ */
+void *tdb_rec_pin(TDB *db, void *rec);
+void tdb_rec_unpin(TDB *db, void *pin);
+
+/*
+ * Declare a kernel user as the owner of the table records, see
+ * tdb_set_owner().
+ */
+void tdb_set_owner(TDB *db, bool (*remove)(TDB *db, TdbRec *rec));
+
 int tdb_info(char *buf, size_t len);
+void tdb_stat(TDB *db, TdbStat *st);
 TdbRec * tdb_rec_get_alloc(TDB *db, unsigned long key, TdbGetAllocCtx *ctx);
 int tdb_entry_walk(TDB *db, int (*fn)(void *));
 void tdb_rec_get_lock(void *rec);
 
 /* Open/close database handler. */
-TDB *tdb_open(const char *path, size_t fsize, unsigned int rec_size, int node);
+TDB *tdb_open(const char *path, size_t fsize, size_t max_size,
+	      unsigned int rec_size, int node);
 void tdb_close(TDB *db);
 
+/* Records expiration. */
+int tdb_timers_init(TDB *db, bool (*expire)(TdbRec *rec));
+void tdb_timer_init(TdbTimer *t, TdbRec *rec);
+void tdb_timer_add(TDB *db, TdbTimer *t, unsigned long expires);
+void tdb_timer_del(TDB *db, TdbTimer *t);
+
+/* Ordered index. */
+int tdb_oidx_init(TDB *db, unsigned int (*okey)(TdbRec *rec, char *buf));
+int tdb_oidx_add(TDB *db, TdbRec *rec);
+int tdb_oidx_range(TDB *db, TdbOidxPos *pos, const char *to, unsigned int tlen,
+		   int (*fn)(TdbRec *rec, const TdbOidxPos *pos, void *arg),
+		   void *arg);
+int tdb_oidx_prefix(TDB *db, const char *prefix, unsigned int len,
+		    int (*fn)(TdbRec *rec, const TdbOidxPos *pos, void *arg),
+		    void *arg);
+
+/* Tables replicated on all NUMA nodes. */
+TdbRepl *tdb_repl_open(const char *path, size_t fsize, unsigned int rec_size);
+void tdb_repl_close(TdbRepl *repl);
+TdbRec *tdb_repl_create(TdbRepl *repl, unsigned long key, void *data,
+			size_t *len);
+
+static inline TDB *
+tdb_repl_local(TdbRepl *repl)
+{
+	return repl->db[numa_node_id()];
+}
+
 static inline TDB *
 tdb_get(TDB *db)
 {
@@ -22,6 +22,8 @@
 #ifndef __TDB_IF_H__
 #define __TDB_IF_H__
 
+#include <linux/ioctl.h>
+
 #include "extent.h"
 
 #ifndef NETLINK_TEMPESTA
@@ -35,6 +37,8 @@
 #define TDB_TBLNAME_LEN		15
 #define TDB_PATH_LEN		128
 #define NL_FR_SZ		16384
+/* Maximum length of record order keys, longer keys are ordered by prefix. */
+#define TDB_OKEY_MAX		64
 
 enum tdb_msg_type {
 	__TDB_MSG_UNSPEC,
@@ -44,6 +48,9 @@ enum tdb_msg_type {
 	TDB_MSG_CLOSE,
 	TDB_MSG_INSERT,
 	TDB_MSG_SELECT,
+	TDB_MSG_REMOVE,
+	TDB_MSG_RANGE,
+	TDB_MSG_STAT,
 	__TDB_MSG_TYPE_MAX
 };
 
@@ -52,12 +59,16 @@ enum tdb_msg_type {
 #define TDB_NLF_RESP_TRUNC	0x0200 /* response was truncated */
 #define TDB_NLF_RESP_END	0x0400 /* end of chunked response */
 
+/* Maintain ordered index of the table records by their keys. */
+#define TDB_CRTBL_OIDX		0x1
+
 /**
  * Record for create table command.
  */
 typedef struct {
 	size_t		tbl_size;
 	unsigned int	rec_size;
+	unsigned int	flags;
 	unsigned int	path_len;
 	char		path[0];
 } TdbCrTblRec;
@@ -82,8 +93,17 @@ typedef struct {
  * @type	- message type;
  * @rec_n	- number of record specifications;
  * @t_name	- table name;
- * @recs	- record specifications (keys only for select or <key,value>
- * 		  for inserts and updates);
+ * @recs	- record specifications (keys only for select and remove or
+ *		  <key,value> for inserts and updates);
+ *
+ * All the message types operating on records process batches of @rec_n
+ * records. Select responses for many keys are sent in many messages, the
+ * last one has TDB_NLF_RESP_END flag.
+ *
+ * Range select has two keys: records with keys in [@recs[0], @recs[1]) are
+ * sent in the order of their keys, an empty @recs[1] key means no upper
+ * bound. Only tables opened with TDB_CRTBL_OIDX support range selects and
+ * the keys are compared by their first TDB_OKEY_MAX bytes.
  */
 typedef struct {
 	unsigned int	type;
@@ -92,9 +112,74 @@ typedef struct {
 	TdbMsgRec	recs[0];
 } TdbMsg;
 
+#define TDB_STAT_DEPTH		16
+#define TDB_STAT_CHAIN		8
+
+/**
+ * Table statistics, the response record of TDB_MSG_STAT.
+ *
+ * @size		- current table size in bytes;
+ * @max_size		- size the table can grow up to;
+ * @ext_used		- number of used extents;
+ * @blk_used		- number of used blocks in the used extents;
+ * @blk_free		- number of free blocks in the used extents;
+ * @free_runs		- number of runs of contiguous free blocks, the free
+ *			  blocks fragmentation;
+ * @free_run_max	- the longest run of free blocks;
+ * @nodes		- number of index nodes;
+ * @buckets		- number of buckets, including collision chains;
+ * @recs		- number of live records;
+ * @rec_bytes		- bytes used by the live records with all their chunks,
+ *			  fill ratio of the data blocks is @rec_bytes to
+ *			  @blk_used blocks;
+ * @depth		- number of buckets referenced by index nodes of each
+ *			  depth, the root node has zero depth;
+ * @chain		- number of collision chains of 1, 2... buckets, the
+ *			  last item counts longer chains as well;
+ * @lookups, @inserts	- number of lookups and inserts since the table open;
+ * @lookup_ns, @insert_ns - total time spent in the lookups and inserts;
+ * @lookup_rate, @insert_rate - lookups and inserts per second;
+ *
+ * The index and blocks statistics are collected by a walk over the table, so
+ * they're approximate for a changing table.
+ */
+typedef struct {
+	unsigned long	size;
+	unsigned long	max_size;
+	unsigned long	ext_used;
+	unsigned long	blk_used;
+	unsigned long	blk_free;
+	unsigned long	free_runs;
+	unsigned long	free_run_max;
+	unsigned long	nodes;
+	unsigned long	buckets;
+	unsigned long	recs;
+	unsigned long	rec_bytes;
+	unsigned long	depth[TDB_STAT_DEPTH];
+	unsigned long	chain[TDB_STAT_CHAIN];
+	unsigned long	lookups;
+	unsigned long	inserts;
+	unsigned long	lookup_ns;
+	unsigned long	insert_ns;
+	unsigned long	lookup_rate;
+	unsigned long	insert_rate;
+} TdbStat;
+
+/*
+ * Character device for read-only mapping of tables to user space.
+ * TDB_IOC_TABLE binds an open file of the device to a table by its name,
+ * as reported by TDB_MSG_INFO, and the file can be mmap()'ed after that.
+ * The mapping starts from the table header and can't exceed the table size.
+ */
+#define TDB_DEV_NAME		"tempesta_db"
+#define TDB_IOC_MAGIC		0xDB
+#define TDB_IOC_TABLE		_IOW(TDB_IOC_MAGIC, 1, char[TDB_TBLNAME_LEN + 1])
+
 #ifdef __KERNEL__
 int tdb_if_init(void);
 void tdb_if_exit(void);
+int tdb_dev_init(void);
+void tdb_dev_exit(void);
 #endif
 
 #endif /* __TDB_IF_H__ */
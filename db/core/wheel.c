@@ -0,0 +1,333 @@
+/**
+ *		Tempesta DB
+ *
+ * Records expiration by hierarchical timer wheel.
+ *
+ * Each table has its own wheel of TDB_TW_LEVELS levels of TDB_TW_SLOTS slots.
+ * A timer is placed at the level which covers its expiration time, slots of
+ * upper levels are cascaded to lower levels when the lower level wraps, so
+ * the wheel can be advanced in O(1) while each timer is moved between the
+ * levels at most TDB_TW_LEVELS times. Only expired timers are processed, so
+ * the work to reclaim dead records doesn't depend on the table size.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "htrie.h"
+#include "oidx.h"
+#include "wheel.h"
+
+/* The wheel granularity, also the interval between the wheel runs. */
+#define TDB_TW_TICK		HZ
+#define TDB_TW_BITS		6
+#define TDB_TW_SLOTS		(1 << TDB_TW_BITS)
+#define TDB_TW_MASK		(TDB_TW_SLOTS - 1)
+#define TDB_TW_LEVELS		4
+/* Later timers are expired at the end of the wheel range, ~194 days. */
+#define TDB_TW_MAX		((1UL << (TDB_TW_BITS * TDB_TW_LEVELS)) - 1)
+#define TDB_TW_IDX(t, l)	(((t) >> (TDB_TW_BITS * (l))) & TDB_TW_MASK)
+
+/**
+ * Timer wheel of a table.
+ *
+ * @lock	- protects the slots and all the armed timers;
+ * @id		- the wheel identifier, see TdbTimer;
+ * @now		- the next tick to be processed;
+ * @expire	- called under the record bucket lock for an expired record and
+ *		  returns true if the record can be removed;
+ * @db		- the table;
+ * @work	- periodic run of the wheel;
+ * @slots	- lists of armed timers;
+ */
+struct tdb_wheel_t {
+	spinlock_t		lock;
+	unsigned int		id;
+	unsigned long		now;
+	bool			(*expire)(TdbRec *rec);
+	TDB			*db;
+	struct delayed_work	work;
+	struct list_head	slots[TDB_TW_LEVELS][TDB_TW_SLOTS];
+};
+
+static inline unsigned long
+tdb_tw_ticks(unsigned long j)
+{
+	return j / TDB_TW_TICK;
+}
+
+/*
+ * Records loaded from a snapshot keep timers of the previous run,
+ * the timers aren't armed in the current wheel.
+ */
+static inline bool
+tdb_tw_armed(TdbWheel *tw, TdbTimer *t)
+{
+	return t->wheel == tw->id && !list_empty(&t->list);
+}
+
+/**
+ * Put timer @t to the wheel level covering its expiration time.
+ * Called under the wheel lock.
+ */
+static void
+__tdb_tw_add(TdbWheel *tw, TdbTimer *t)
+{
+	int l;
+	unsigned long e = tdb_tw_ticks(t->expires), d = e - tw->now;
+
+	if ((long)d < 0) {
+		/* Already expired: fire on the next tick. */
+		e = tw->now;
+		d = 0;
+	} else if (d > TDB_TW_MAX) {
+		e = tw->now + TDB_TW_MAX;
+		d = TDB_TW_MAX;
+	}
+	for (l = 0; l < TDB_TW_LEVELS - 1; ++l)
+		if (d < 1UL << (TDB_TW_BITS * (l + 1)))
+			break;
+
+	list_add_tail(&t->list, &tw->slots[l][TDB_TW_IDX(e, l)]);
+}
+
+/**
+ * Move the timers of the current slot of level @l to lower levels.
+ * @return index of the slot.
+ */
+static unsigned int
+tdb_tw_cascade(TdbWheel *tw, int l)
+{
+	unsigned int idx = TDB_TW_IDX(tw->now, l);
+	TdbTimer *t, *tmp;
+	LIST_HEAD(list);
+
+	list_splice_init(&tw->slots[l][idx], &list);
+	list_for_each_entry_safe(t, tmp, &list, list) {
+		list_del(&t->list);
+		__tdb_tw_add(tw, t);
+	}
+
+	return idx;
+}
+
+/**
+ * Advance the wheel up to the current time and move the expired timers
+ * to @expired. Called under the wheel lock.
+ */
+static void
+tdb_tw_advance(TdbWheel *tw, struct list_head *expired)
+{
+	unsigned long now = tdb_tw_ticks(jiffies);
+
+	while ((long)(now - tw->now) >= 0) {
+		int l;
+		unsigned int idx = TDB_TW_IDX(tw->now, 0);
+
+		for (l = 1; !idx && l < TDB_TW_LEVELS; ++l)
+			idx = tdb_tw_cascade(tw, l);
+
+		list_splice_tail_init(&tw->slots[0][TDB_TW_IDX(tw->now, 0)],
+				      expired);
+		tw->now++;
+	}
+}
+
+/**
+ * Remove the record of expired timer @t if it wasn't rearmed and the table
+ * owner allows the record removal. The caller guarantees that the record
+ * memory isn't reclaimed.
+ */
+static bool
+tdb_tw_expire_rec(TdbWheel *tw, TdbTimer *t)
+{
+	bool r = false;
+	TdbHdr *dbh = tw->db->hdr;
+	TdbRec *rec = t->rec;
+	TdbBucket *b = (TdbBucket *)((unsigned long)rec & TDB_HTRIE_DMASK);
+
+	tdb_htrie_bucket_lock(b);
+
+	spin_lock(&tw->lock);
+	if (tdb_tw_armed(tw, t)) {
+		spin_unlock(&tw->lock);
+		goto out;
+	}
+	spin_unlock(&tw->lock);
+
+	if (!tdb_live_rec(dbh, rec) || TDB_HTRIE_RETIRED(b, rec))
+		goto out;
+	if (tw->expire && !tw->expire(rec))
+		goto out;
+
+	tdb_oidx_del(tw->db, rec);
+	tdb_htrie_remove(dbh, rec);
+	r = true;
+out:
+	tdb_htrie_bucket_unlock(b);
+
+	return r;
+}
+
+static void
+tdb_tw_run(struct work_struct *work)
+{
+	unsigned long n = 0;
+	TdbWheel *tw = container_of(to_delayed_work(work), TdbWheel, work);
+	TdbTimer *t;
+	LIST_HEAD(expired);
+
+	spin_lock_bh(&tw->lock);
+	tdb_tw_advance(tw, &expired);
+	spin_unlock_bh(&tw->lock);
+
+	/*
+	 * The timers are still linked, so tdb_timer_del() and tdb_timer_add()
+	 * can work with them concurrently, while the lock is held. Owners
+	 * remove records only after the timers deletion, so the RCU read-side
+	 * section entered under the lock keeps the record of the just unlinked
+	 * timer alive.
+	 */
+	for ( ; ; ) {
+		spin_lock_bh(&tw->lock);
+		if (list_empty(&expired)) {
+			spin_unlock_bh(&tw->lock);
+			break;
+		}
+		t = list_first_entry(&expired, TdbTimer, list);
+		list_del_init(&t->list);
+		rcu_read_lock_bh();
+		spin_unlock_bh(&tw->lock);
+
+		n += tdb_tw_expire_rec(tw, t);
+
+		rcu_read_unlock_bh();
+		cond_resched();
+	}
+	if (n)
+		TDB_DBG("Expired %lu records in table %s\n", n,
+			tw->db->tbl_name);
+
+	schedule_delayed_work(&tw->work, TDB_TW_TICK);
+}
+
+void
+tdb_timer_init(TdbTimer *t, TdbRec *rec)
+{
+	INIT_LIST_HEAD(&t->list);
+	t->rec = rec;
+	t->expires = 0;
+	t->wheel = 0;
+}
+EXPORT_SYMBOL(tdb_timer_init);
+
+/**
+ * Arm or rearm timer @t to expire the record at @expires jiffies.
+ * The record will be removed after the time if the table expiration callback
+ * allows this.
+ */
+void
+tdb_timer_add(TDB *db, TdbTimer *t, unsigned long expires)
+{
+	TdbWheel *tw = db->wheel;
+
+	BUG_ON(!tw);
+
+	spin_lock_bh(&tw->lock);
+	if (tdb_tw_armed(tw, t))
+		list_del(&t->list);
+	t->wheel = tw->id;
+	t->expires = expires;
+	__tdb_tw_add(tw, t);
+	spin_unlock_bh(&tw->lock);
+}
+EXPORT_SYMBOL(tdb_timer_add);
+
+/**
+ * Disarm timer @t. As for kernel timers, the timer must be deleted before
+ * the record removal by the table owner.
+ */
+void
+tdb_timer_del(TDB *db, TdbTimer *t)
+{
+	TdbWheel *tw = db->wheel;
+
+	BUG_ON(!tw);
+
+	spin_lock_bh(&tw->lock);
+	if (tdb_tw_armed(tw, t))
+		list_del_init(&t->list);
+	spin_unlock_bh(&tw->lock);
+}
+EXPORT_SYMBOL(tdb_timer_del);
+
+/**
+ * Enable records expiration for table @db. @expire is called under the
+ * record bucket lock for each expired record and must return true if the
+ * record can be removed, it must not access the table. If @expire isn't
+ * specified, then the records are removed unconditionally.
+ *
+ * The function must not be called from softirq!
+ */
+int
+tdb_timers_init(TDB *db, bool (*expire)(TdbRec *rec))
+{
+	int l, i;
+	TdbWheel *tw;
+
+	if (db->wheel)
+		return 0;
+
+	tw = kmalloc(sizeof(*tw), GFP_KERNEL);
+	if (!tw)
+		return -ENOMEM;
+
+	spin_lock_init(&tw->lock);
+	tw->id = get_random_u32() | 1;
+	tw->now = tdb_tw_ticks(jiffies);
+	tw->expire = expire;
+	tw->db = db;
+	INIT_DELAYED_WORK(&tw->work, tdb_tw_run);
+	for (l = 0; l < TDB_TW_LEVELS; ++l)
+		for (i = 0; i < TDB_TW_SLOTS; ++i)
+			INIT_LIST_HEAD(&tw->slots[l][i]);
+
+	db->wheel = tw;
+	schedule_delayed_work(&tw->work, TDB_TW_TICK);
+
+	return 0;
+}
+EXPORT_SYMBOL(tdb_timers_init);
+
+/**
+ * Stop the records expiration on the table close. Armed timers are just
+ * forgotten, the records stay in the table.
+ */
+void
+tdb_timers_exit(TDB *db)
+{
+	if (!db->wheel)
+		return;
+
+	cancel_delayed_work_sync(&db->wheel->work);
+	kfree(db->wheel);
+	db->wheel = NULL;
+}
@@ -63,6 +63,15 @@ TdbHndl::LastOpStatus::update(const TdbMsg *m) noexcept
 	case TDB_MSG_SELECT:
 		op = "SELECT";
 		break;
+	case TDB_MSG_REMOVE:
+		op = "REMOVE";
+		break;
+	case TDB_MSG_RANGE:
+		op = "RANGE";
+		break;
+	case TDB_MSG_STAT:
+		op = "STAT";
+		break;
 	default:
 		op = "[unspecified]";
 	}
@@ -153,6 +162,9 @@ TdbHndl::msg_recv(std::function<bool (nlmsghdr *)> msg_cb)
 	}
 }
 
+/**
+ * Send all the valid frames of the TX ring by one system call.
+ */
 void
 TdbHndl::send_to_kernel()
 {
@@ -161,13 +173,13 @@ TdbHndl::send_to_kernel()
 	};
 	if (sendto(fd_, NULL, 0, 0, (const sockaddr *)&addr, sizeof(addr)) < 0)
 		throw TdbExcept("cannot send msg to kernel");
-
-	advance_frame_offset(tx_fr_off_);
 }
 
 void
 TdbHndl::msg_send(std::function<void (nlmsghdr *)> msg_build_cb)
 {
+	check_sync();
+
 	nl_mmap_hdr *hdr = (nl_mmap_hdr *)(tx_ring_ + tx_fr_off_);
 	if (hdr->nm_status != NL_MMAP_STATUS_UNUSED)
 		throw TdbExcept("no tx frame available");
@@ -181,6 +193,111 @@ TdbHndl::msg_send(std::function<void (nlmsghdr *)> msg_build_cb)
 	hdr->nm_status = NL_MMAP_STATUS_VALID;
 
 	send_to_kernel();
+
+	advance_frame_offset(tx_fr_off_);
+}
+
+/**
+ * Read status message of @type operation and account the processed records.
+ */
+/**
+ * Receive records of the multi-message response for @type request.
+ */
+void
+TdbHndl::recv_recs(unsigned int type,
+		   std::function<void (char *, size_t, char *, size_t)>
+			&process_cb)
+{
+	msg_recv([this, type, &process_cb](nlmsghdr *nlh) -> bool {
+		if (nlh->nlmsg_len < sizeof(*nlh) + sizeof(TdbMsg))
+			throw TdbExcept("bad info msg len %u", nlh->nlmsg_len);
+
+		TdbMsg *m = (TdbMsg *)NLMSG_DATA(nlh);
+		if ((m->type & TDB_NLF_TYPE_MASK) != type
+		    || nlh->nlmsg_len < sizeof(*nlh) + sizeof(TdbMsg)
+					+ m->rec_n * sizeof(TdbMsgRec))
+			throw TdbExcept("malformed query results type=%u rec_n=%u",
+					m->type, m->rec_n);
+		if (!(m->type & TDB_NLF_RESP_OK))
+			throw TdbExcept("cannot execute query, see dmesg");
+
+		for (unsigned int i = 0, off = 0; i < m->rec_n; ++i) {
+			TdbMsgRec *r = (TdbMsgRec *)((char *)m->recs + off);
+			process_cb(r->data, r->klen,
+				   TDB_MSGREC_DATA(r), r->dlen);
+			off += TDB_MSGREC_LEN(r);
+		}
+
+		if (m->type & TDB_NLF_RESP_END)
+			last_status_.update(m);
+
+		return !(m->type & TDB_NLF_RESP_END);
+	});
+}
+
+void
+TdbHndl::recv_status(unsigned int type, const char *what)
+{
+	msg_recv([this, type, what](nlmsghdr *nlh) -> bool {
+		if (nlh->nlmsg_len < sizeof(*nlh) + sizeof(TdbMsg))
+			throw TdbExcept("bad %s status msg", what);
+
+		TdbMsg *m = (TdbMsg *)NLMSG_DATA(nlh);
+		if (m->type != (type | TDB_NLF_RESP_OK))
+			throw TdbExcept("%s failed, see dmesg", what);
+
+		last_status_.update(m);
+		trx_.rec_n += m->rec_n;
+
+		return false;
+	});
+}
+
+/**
+ * Build message of @type for table @tbl_name with as many keys from @keys
+ * starting from @i as fit one frame.
+ * @return index of the first key which doesn't fit the message.
+ */
+size_t
+TdbHndl::build_keys_msg(nlmsghdr *nlh, unsigned int type,
+			std::string &tbl_name,
+			const std::vector<std::string> &keys, size_t i)
+{
+	static const size_t HDRS_LEN = NL_MMAP_HDRLEN + sizeof(nlmsghdr)
+				       + sizeof(TdbMsg);
+	TdbMsg *m = (TdbMsg *)NLMSG_DATA(nlh);
+	size_t off = 0;
+
+	memset(m, 0, sizeof(*m));
+	m->type = type;
+	tbl_name.copy(m->t_name, TDB_TBLNAME_LEN);
+	m->t_name[tbl_name.length()] = 0;
+
+	for ( ; i < keys.size(); ++i) {
+		const std::string &k = keys[i];
+
+		if (HDRS_LEN + off + sizeof(TdbMsgRec) + k.length()
+		    > NL_FR_SZ)
+		{
+			if (!m->rec_n)
+				throw TdbExcept("too large key");
+			break;
+		}
+
+		TdbMsgRec *r = (TdbMsgRec *)((char *)m->recs + off);
+		r->klen = k.length();
+		r->dlen = 0;
+		k.copy(r->data, r->klen);
+
+		off += TDB_MSGREC_LEN(r);
+		++m->rec_n;
+	}
+
+	nlh->nlmsg_len = sizeof(*nlh) + sizeof(*m) + off;
+	nlh->nlmsg_type = NLMSG_MIN_TYPE + 1;
+	nlh->nlmsg_flags = NLM_F_REQUEST;
+
+	return i;
 }
 
 /*
@@ -206,12 +323,47 @@ TdbHndl::alloc_trx_frame() noexcept
 	memset(trx_.tdb_hdr, 0, sizeof(TdbMsg));
 }
 
+/**
+ * Finish current transaction frame. The frame is sent to the kernel
+ * together with other finished frames, so many frames can be sent by one
+ * system call.
+ */
+void
+TdbHndl::trx_frame_done() noexcept
+{
+	trx_.msg_hdr->nlmsg_len = sizeof(*trx_.msg_hdr) + sizeof(*trx_.tdb_hdr)
+				  + trx_.off;
+	trx_.fr_hdr->nm_len = trx_.msg_hdr->nlmsg_len;
+	trx_.fr_hdr->nm_status = NL_MMAP_STATUS_VALID;
+
+	++trx_.fr_n;
+	advance_frame_offset(tx_fr_off_);
+}
+
+/**
+ * Send all finished frames and check status of each of them.
+ */
+void
+TdbHndl::trx_flush()
+{
+	if (!trx_.fr_n)
+		return;
+
+	send_to_kernel();
+
+	for ( ; trx_.fr_n; --trx_.fr_n)
+		recv_status(TDB_MSG_INSERT, "transaction");
+}
+
 void
 TdbHndl::trx_begin()
 {
 	if (trx_)
 		throw TdbExcept("nested trx!");
+	check_sync();
 
+	trx_.fr_n = 0;
+	trx_.rec_n = 0;
 	alloc_trx_frame();
 }
 
@@ -221,28 +373,12 @@ TdbHndl::trx_begin()
 void
 TdbHndl::trx_commit()
 {
-	trx_.msg_hdr->nlmsg_len = sizeof(*trx_.msg_hdr) + sizeof(*trx_.tdb_hdr)
-				  + trx_.off;
-	trx_.fr_hdr->nm_len = trx_.msg_hdr->nlmsg_len;
-	trx_.fr_hdr->nm_status = NL_MMAP_STATUS_VALID;
-
-	send_to_kernel();
-
+	trx_frame_done();
 	trx_.init();
 
-	// Check trx status.
-	msg_recv([this](nlmsghdr *nlh) -> bool {
-		if (nlh->nlmsg_len < sizeof(*nlh) + sizeof(TdbMsg))
-			throw TdbExcept("bad transaction status msg");
-
-		TdbMsg *m = (TdbMsg *)NLMSG_DATA(nlh);
-		if (!(m->type & TDB_NLF_RESP_OK))
-			throw TdbExcept("transaction failed, see dmesg");
-
-		last_status_.update(m);
+	trx_flush();
 
-		return false;
-	});
+	last_status_.rec_n = trx_.rec_n;
 }
 
 void
@@ -288,7 +424,7 @@ TdbHndl::get_info(std::function<void (char *)> data_cb)
 
 void
 TdbHndl::open_table(std::string &db_path, std::string &tbl_name,
-		    size_t pages, unsigned int rec_size)
+		    size_t pages, unsigned int rec_size, bool ordered)
 {
 	if (trx_)
 		throw TdbExcept("cannot run the action inside transaction");
@@ -300,7 +436,9 @@ TdbHndl::open_table(std::string &db_path, std::string &tbl_name,
 	if (tbl_size & ~TDB_EXT_MASK)
 		throw TdbExcept("table size must be multiple of extent size");
 
-	msg_send([&db_path, &tbl_name, tbl_size, rec_size](nlmsghdr *nlh) {
+	msg_send([&db_path, &tbl_name, tbl_size, rec_size, ordered]
+		 (nlmsghdr *nlh)
+	{
 		TdbMsg *m = (TdbMsg *)NLMSG_DATA(nlh);
 		m->type = TDB_MSG_OPEN;
 		m->rec_n = 1;
@@ -312,6 +450,7 @@ TdbHndl::open_table(std::string &db_path, std::string &tbl_name,
 		TdbCrTblRec *ct = (TdbCrTblRec *)(m->recs + 1);
 		ct->tbl_size = tbl_size;
 		ct->rec_size = rec_size;
+		ct->flags = ordered ? TDB_CRTBL_OIDX : 0;
 		ct->path_len = p.length() + 1;
 		p.copy(ct->path, p.length());
 		ct->path[p.length()] = 0;
@@ -376,6 +515,50 @@ TdbHndl::close_table(std::string &tbl_name)
 	});
 }
 
+void
+TdbHndl::get_stat(std::string &tbl_name, TdbStat &st)
+{
+	if (trx_)
+		throw TdbExcept("cannot run the action inside transaction");
+
+	if (tbl_name.length() > TDB_TBLNAME_LEN)
+		throw TdbExcept("too long table name");
+
+	msg_send([&tbl_name](nlmsghdr *nlh) {
+		nlh->nlmsg_len = sizeof(*nlh) + sizeof(TdbMsg);
+		nlh->nlmsg_type = NLMSG_MIN_TYPE + 1;
+		nlh->nlmsg_flags |= NLM_F_REQUEST;
+
+		TdbMsg *m = (TdbMsg *)NLMSG_DATA(nlh);
+		memset(m, 0, sizeof(*m));
+		m->type = TDB_MSG_STAT;
+		tbl_name.copy(m->t_name, TDB_TBLNAME_LEN);
+		m->t_name[tbl_name.length()] = 0;
+	});
+
+	msg_recv([this, &st](nlmsghdr *nlh) -> bool {
+		if (nlh->nlmsg_len < sizeof(*nlh) + sizeof(TdbMsg))
+			throw TdbExcept("bad stat msg len %u", nlh->nlmsg_len);
+
+		TdbMsg *m = (TdbMsg *)NLMSG_DATA(nlh);
+		if (m->type != (TDB_MSG_STAT | TDB_NLF_RESP_OK))
+			throw TdbExcept("cannot get table statistics,"
+					" see dmesg");
+		if (m->rec_n != 1
+		    || nlh->nlmsg_len < sizeof(*nlh) + sizeof(TdbMsg)
+					+ sizeof(TdbMsgRec) + sizeof(st)
+		    || m->recs[0].klen || m->recs[0].dlen != sizeof(st))
+			throw TdbExcept("malformed stat msg rec_n=%u",
+					m->rec_n);
+
+		memcpy(&st, m->recs[0].data, sizeof(st));
+
+		last_status_.update(m);
+
+		return false;
+	});
+}
+
 void
 TdbHndl::insert(std::string &tbl_name, size_t klen, size_t vlen,
 		std::function<void (char *, char *)> placement_cb)
@@ -387,15 +570,19 @@ TdbHndl::insert(std::string &tbl_name, size_t klen, size_t vlen,
 	if (!in_trx)
 		trx_begin();
 
-	if (trx_.off + sizeof(nlmsghdr) + sizeof(TdbMsgRec) + klen + vlen
-	    > NL_FR_SZ)
+	if (klen + vlen + HDRS_LEN + sizeof(nlmsghdr) > NL_FR_SZ)
+		throw TdbExcept("too large data for one insertion");
+	if (trx_.off + klen + vlen + HDRS_LEN + sizeof(nlmsghdr) > NL_FR_SZ)
 	{
 		// Not enough space in current frame, allocate a new one.
-		advance_frame_offset(tx_fr_off_);
+		// All the frames are sent at once if the TX ring is full
+		// or on the transaction commit.
+		trx_frame_done();
+		if (((nl_mmap_hdr *)(tx_ring_ + tx_fr_off_))->nm_status
+		    != NL_MMAP_STATUS_UNUSED)
+			trx_flush();
 		alloc_trx_frame();
 	}
-	if (klen + vlen + HDRS_LEN > NL_FR_SZ)
-		throw TdbExcept("too large data for one insertion");
 
 	if (!trx_.tdb_hdr->type || !trx_.tdb_hdr->t_name[0]) {
 		// New transaction.
@@ -420,6 +607,17 @@ TdbHndl::insert(std::string &tbl_name, size_t klen, size_t vlen,
 void
 TdbHndl::query(std::string &tbl_name, std::string &key,
 	       std::function<void (char *, size_t, char *, size_t)> process_cb)
+{
+	query(tbl_name, std::vector<std::string>{key}, process_cb);
+}
+
+/**
+ * Select records for all the @keys. As many keys as fit a frame are sent
+ * in one request, the results are returned in many messages.
+ */
+void
+TdbHndl::query(std::string &tbl_name, const std::vector<std::string> &keys,
+	       std::function<void (char *, size_t, char *, size_t)> process_cb)
 {
 	if (trx_)
 		throw TdbExcept("cannot run the action inside transaction");
@@ -427,50 +625,464 @@ TdbHndl::query(std::string &tbl_name, std::string &key,
 	if (tbl_name.length() > TDB_TBLNAME_LEN)
 		throw TdbExcept("too long table name");
 
-	msg_send([&tbl_name, &key](nlmsghdr *nlh) {
-		TdbMsg *m = (TdbMsg *)NLMSG_DATA(nlh);
-		m->type = TDB_MSG_SELECT;
-		m->rec_n = 1;
-		tbl_name.copy(m->t_name, tbl_name.length());
-		m->t_name[tbl_name.length()] = 0;
+	for (size_t i = 0; i < keys.size(); )
+		query_keys(tbl_name, keys, i, process_cb);
+}
+
+/**
+ * Select records with keys in [@from, @to) in the order of the keys, empty
+ * @to means no upper bound. The table must be opened with ordered index.
+ */
+void
+TdbHndl::range(std::string &tbl_name, const std::string &from,
+	       const std::string &to,
+	       std::function<void (char *, size_t, char *, size_t)> process_cb)
+{
+	if (trx_)
+		throw TdbExcept("cannot run the action inside transaction");
 
-		m->recs[0].klen = key.length();
-		m->recs[0].dlen = 0;
-		key.copy(m->recs[0].data, m->recs[0].klen);
+	if (tbl_name.length() > TDB_TBLNAME_LEN)
+		throw TdbExcept("too long table name");
 
-		nlh->nlmsg_len = sizeof(*nlh) + sizeof(*m) + sizeof(TdbMsgRec)
-				 + m->recs[0].klen;
-		nlh->nlmsg_type = NLMSG_MIN_TYPE + 1;
-		nlh->nlmsg_flags |= NLM_F_REQUEST;
+	msg_send([this, &tbl_name, &from, &to](nlmsghdr *nlh) {
+		if (build_keys_msg(nlh, TDB_MSG_RANGE, tbl_name,
+				   std::vector<std::string>{from, to}, 0) != 2)
+			throw TdbExcept("too large keys");
+	});
+
+	recv_recs(TDB_MSG_RANGE, process_cb);
+}
+
+/**
+ * Select records with keys starting with @prefix in the order of the keys.
+ * The table orders records by the first TDB_OKEY_MAX bytes of their keys,
+ * so longer prefixes are cut.
+ */
+void
+TdbHndl::prefix(std::string &tbl_name, const std::string &prefix,
+		std::function<void (char *, size_t, char *, size_t)> process_cb)
+{
+	std::string from = prefix.substr(0, TDB_OKEY_MAX), to = from;
+
+	// The least key greater than all the keys with the prefix.
+	while (!to.empty() && (unsigned char)to.back() == 0xff)
+		to.pop_back();
+	if (!to.empty())
+		++to.back();
+
+	range(tbl_name, from, to, process_cb);
+}
+
+/**
+ * Send select request for keys from @keys starting from @i and process
+ * the results. @i is set to the first key which didn't fit the request.
+ */
+void
+TdbHndl::query_keys(std::string &tbl_name,
+		    const std::vector<std::string> &keys, size_t &i,
+		    std::function<void (char *, size_t, char *, size_t)>
+			process_cb)
+{
+	msg_send([this, &tbl_name, &keys, &i](nlmsghdr *nlh) {
+		i = build_keys_msg(nlh, TDB_MSG_SELECT, tbl_name, keys, i);
 	});
 
-	// Read results.
-	msg_recv([this, &process_cb](nlmsghdr *nlh) -> bool {
+	recv_recs(TDB_MSG_SELECT, process_cb);
+}
+
+/**
+ * Remove all records for each of @keys. All free frames of the TX ring are
+ * filled with the keys and sent by one system call.
+ */
+void
+TdbHndl::remove(std::string &tbl_name, const std::vector<std::string> &keys)
+{
+	if (trx_)
+		throw TdbExcept("cannot run the action inside transaction");
+
+	if (tbl_name.length() > TDB_TBLNAME_LEN)
+		throw TdbExcept("too long table name");
+	check_sync();
+
+	trx_.rec_n = 0;
+
+	for (size_t i = 0; i < keys.size(); ) {
+		unsigned int fr_n = 0;
+
+		do {
+			nl_mmap_hdr *hdr = (nl_mmap_hdr *)(tx_ring_
+							   + tx_fr_off_);
+			if (hdr->nm_status != NL_MMAP_STATUS_UNUSED)
+				break;
+
+			nlmsghdr *nlh = (nlmsghdr *)((char *)hdr
+						     + NL_MMAP_HDRLEN);
+			i = build_keys_msg(nlh, TDB_MSG_REMOVE, tbl_name,
+					   keys, i);
+
+			hdr->nm_len = nlh->nlmsg_len;
+			hdr->nm_status = NL_MMAP_STATUS_VALID;
+			advance_frame_offset(tx_fr_off_);
+			++fr_n;
+		} while (i < keys.size());
+		if (!fr_n)
+			throw TdbExcept("no tx frame available");
+
+		send_to_kernel();
+
+		for ( ; fr_n; --fr_n)
+			recv_status(TDB_MSG_REMOVE, "remove");
+	}
+
+	last_status_.rec_n = trx_.rec_n;
+}
+
+/*
+ * ------------------------------------------------------------------------
+ *	Asynchronous operations
+ * ------------------------------------------------------------------------
+ *
+ * Many requests are pipelined over the socket: each request has its own
+ * sequence number, which the kernel copies to the response messages, so
+ * the responses are matched with the operations, and all the queued
+ * requests are sent by one system call. The callbacks are called from
+ * poll_async() and wait_async().
+ *
+ * The kernel runs only one multi-message response per socket at a time and
+ * rejects requests arriving meanwhile with -EBUSY. The rejected requests are
+ * resent in the order of their sequence numbers, and no requests are sent
+ * until the response is finished, so the operations are executed in the
+ * order they were submitted.
+ *
+ * Each response takes an RX frame until it's read, so no more requests than
+ * there are frames in the RX ring are sent before their responses are read.
+ * Synchronous operations can't be done while asynchronous ones are pending.
+ */
+void
+TdbHndl::check_sync() const
+{
+	if (!ops_.empty())
+		throw TdbExcept("asynchronous operations are in progress");
+}
+
+/**
+ * Allocate the request message of @len bytes for @type operation on
+ * @tbl_name table.
+ */
+static TdbMsg *
+async_msg_init(std::string &req, size_t len, unsigned int type,
+	       std::string &tbl_name)
+{
+	if (tbl_name.length() > TDB_TBLNAME_LEN)
+		throw TdbExcept("too long table name");
+
+	req.assign(len, 0);
+
+	nlmsghdr *nlh = (nlmsghdr *)&req[0];
+	nlh->nlmsg_len = len;
+	nlh->nlmsg_type = NLMSG_MIN_TYPE + 1;
+	nlh->nlmsg_flags = NLM_F_REQUEST;
+
+	TdbMsg *m = (TdbMsg *)NLMSG_DATA(nlh);
+	m->type = type;
+	tbl_name.copy(m->t_name, TDB_TBLNAME_LEN);
+
+	return m;
+}
+
+/**
+ * Assign the next sequence number to the request of @op and queue it.
+ * The requests are sent as soon as they fill the TX ring.
+ */
+void
+TdbHndl::async_submit(AsyncOp &&op)
+{
+	if (trx_)
+		throw TdbExcept("cannot run the action inside transaction");
+
+	// Zero sequence number is used by the synchronous operations.
+	if (!++seq_)
+		++seq_;
+	((nlmsghdr *)&op.req[0])->nlmsg_seq = seq_;
+	op.rec_n = 0;
+
+	ops_.emplace(seq_, std::move(op));
+	txq_.push_back(seq_);
+
+	if (txq_.size() >= ring_sz_ / NL_FR_SZ)
+		async_flush();
+}
+
+/**
+ * Queue the rejected request @seq again before all the requests with
+ * greater sequence numbers.
+ */
+void
+TdbHndl::async_requeue(unsigned int seq)
+{
+	auto i = txq_.begin();
+
+	while (i != txq_.end() && (int)(*i - seq) < 0)
+		++i;
+	txq_.insert(i, seq);
+}
+
+/**
+ * Send the queued requests by one system call.
+ */
+void
+TdbHndl::async_flush()
+{
+	unsigned int n = 0;
+
+	while (!txq_.empty() && !dump_seq_ && inflight_ < ring_sz_ / NL_FR_SZ)
+	{
+		nl_mmap_hdr *hdr = (nl_mmap_hdr *)(tx_ring_ + tx_fr_off_);
+		if (hdr->nm_status != NL_MMAP_STATUS_UNUSED)
+			break;
+
+		const std::string &req = ops_.at(txq_.front()).req;
+		memcpy((char *)hdr + NL_MMAP_HDRLEN, req.data(), req.size());
+		hdr->nm_len = req.size();
+		hdr->nm_status = NL_MMAP_STATUS_VALID;
+		advance_frame_offset(tx_fr_off_);
+
+		txq_.pop_front();
+		++inflight_;
+		++n;
+	}
+
+	if (n)
+		send_to_kernel();
+}
+
+/**
+ * Process response message @nlh.
+ * @return 1 if the operation is completed and 0 otherwise.
+ */
+size_t
+TdbHndl::async_recv_msg(nlmsghdr *nlh)
+{
+	// NLMSG_DONE is sent after the last message of a response.
+	auto it = ops_.find(nlh->nlmsg_seq);
+	if (it == ops_.end() || nlh->nlmsg_type == NLMSG_DONE)
+		return 0;
+
+	unsigned int seq = it->first;
+	AsyncOp &op = it->second;
+	bool ok, end = true;
+
+	if (nlh->nlmsg_type == NLMSG_ERROR) {
+		nlmsgerr *e = (nlmsgerr *)NLMSG_DATA(nlh);
+		if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*e)))
+			throw TdbExcept("bad error msg len %u",
+					nlh->nlmsg_len);
+		if (!e->error)
+			return 0;
+		--inflight_;
+		if (e->error == -EBUSY) {
+			async_requeue(seq);
+			return 0;
+		}
+		ok = false;
+	} else {
 		if (nlh->nlmsg_len < sizeof(*nlh) + sizeof(TdbMsg))
-			throw TdbExcept("bad info msg len %u", nlh->nlmsg_len);
+			throw TdbExcept("bad response msg len %u",
+					nlh->nlmsg_len);
 
 		TdbMsg *m = (TdbMsg *)NLMSG_DATA(nlh);
-		if ((m->type & TDB_MSG_SELECT) != TDB_MSG_SELECT
+		if ((m->type & TDB_NLF_TYPE_MASK) != op.type
 		    || nlh->nlmsg_len < sizeof(*nlh) + sizeof(TdbMsg)
 					+ m->rec_n * sizeof(TdbMsgRec))
-			throw TdbExcept("malformed query results type=%u rec_n=%u",
+			throw TdbExcept("malformed response type=%u rec_n=%u",
 					m->type, m->rec_n);
-		if (!(m->type & TDB_NLF_RESP_OK))
-			throw TdbExcept("cannot execute query, see dmesg");
 
-		for (unsigned int i = 0, off = 0; i < m->rec_n; ++i) {
-			TdbMsgRec *r = (TdbMsgRec *)((char *)m->recs + off);
-			process_cb(r->data, r->klen,
-				   TDB_MSGREC_DATA(r), r->dlen);
-			off += TDB_MSGREC_LEN(r);
+		if (seq != dump_seq_)
+			--inflight_;
+		ok = m->type & TDB_NLF_RESP_OK;
+		if (op.type != TDB_MSG_SELECT) {
+			op.rec_n = m->rec_n;
+		}
+		else if (ok) {
+			for (unsigned int i = 0, off = 0; i < m->rec_n; ++i) {
+				TdbMsgRec *r = (TdbMsgRec *)((char *)m->recs
+							     + off);
+				op.process_cb(r->data, r->klen,
+					      TDB_MSGREC_DATA(r), r->dlen);
+				off += TDB_MSGREC_LEN(r);
+			}
+			op.rec_n += m->rec_n;
+			end = m->type & TDB_NLF_RESP_END;
 		}
+	}
 
-		if (m->type & TDB_NLF_RESP_END)
-			last_status_.update(m);
+	if (!end) {
+		dump_seq_ = seq;
+		return 0;
+	}
+	if (dump_seq_ == seq)
+		dump_seq_ = 0;
 
-		return !(m->type & TDB_NLF_RESP_END);
-	});
+	DoneCb done_cb = std::move(op.done_cb);
+	size_t rec_n = op.rec_n;
+	ops_.erase(it);
+	if (done_cb)
+		done_cb(ok, rec_n);
+
+	return 1;
+}
 
+/**
+ * Process all the received frames, a frame may carry several messages.
+ * @return number of completed operations.
+ */
+size_t
+TdbHndl::async_recv()
+{
+	size_t done = 0;
+
+	for ( ; ; advance_frame_offset(rx_fr_off_)) {
+		nl_mmap_hdr *hdr = (nl_mmap_hdr *)(rx_ring_ + rx_fr_off_);
+		nlmsghdr *nlh;
+		int len;
+
+		if (hdr->nm_status == NL_MMAP_STATUS_VALID) {
+			last_status_.set_copying(false);
+			nlh = (nlmsghdr *)((char *)hdr + NL_MMAP_HDRLEN);
+			len = hdr->nm_len;
+		}
+		else if (hdr->nm_status == NL_MMAP_STATUS_COPY) {
+			last_status_.set_copying(true);
+			lazy_buffer_alloc();
+
+			ssize_t r = recv(fd_, buf_, NL_FR_SZ, MSG_DONTWAIT);
+			if (r <= 0)
+				throw TdbExcept("cannot copy msg");
+			nlh = (nlmsghdr *)buf_;
+			len = r;
+		} else
+			break;
+
+		for ( ; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len))
+			done += async_recv_msg(nlh);
+
+		hdr->nm_status = NL_MMAP_STATUS_UNUSED;
+	}
+
+	return done;
+}
+
+/**
+ * Insert a record asynchronously, see insert() for @klen, @vlen and
+ * @placement_cb.
+ */
+void
+TdbHndl::insert_async(std::string &tbl_name, size_t klen, size_t vlen,
+		      std::function<void (char *, char *)> placement_cb,
+		      DoneCb done_cb)
+{
+	static const size_t HDRS_LEN = sizeof(nlmsghdr) + sizeof(TdbMsg)
+				       + sizeof(TdbMsgRec);
+	AsyncOp op;
+
+	if (NL_MMAP_HDRLEN + HDRS_LEN + klen + vlen > NL_FR_SZ)
+		throw TdbExcept("too large data for one insertion");
+
+	TdbMsg *m = async_msg_init(op.req, HDRS_LEN + klen + vlen,
+				   TDB_MSG_INSERT, tbl_name);
+	m->rec_n = 1;
+	m->recs[0].klen = klen;
+	m->recs[0].dlen = vlen;
+	placement_cb(m->recs[0].data, TDB_MSGREC_DATA(&m->recs[0]));
+
+	op.type = TDB_MSG_INSERT;
+	op.done_cb = std::move(done_cb);
+	async_submit(std::move(op));
+}
+
+/**
+ * Select all the records of @key asynchronously, @process_cb is called for
+ * each of them.
+ */
+void
+TdbHndl::query_async(std::string &tbl_name, const std::string &key,
+		     RecCb process_cb, DoneCb done_cb)
+{
+	AsyncOp op;
+
+	async_msg_init(op.req, sizeof(nlmsghdr) + sizeof(TdbMsg)
+			       + sizeof(TdbMsgRec) + key.length(),
+		       TDB_MSG_SELECT, tbl_name);
+	build_keys_msg((nlmsghdr *)&op.req[0], TDB_MSG_SELECT, tbl_name,
+		       std::vector<std::string>{key}, 0);
+
+	op.type = TDB_MSG_SELECT;
+	op.process_cb = std::move(process_cb);
+	op.done_cb = std::move(done_cb);
+	async_submit(std::move(op));
+}
+
+/**
+ * Remove all the records of @key asynchronously.
+ */
+void
+TdbHndl::remove_async(std::string &tbl_name, const std::string &key,
+		      DoneCb done_cb)
+{
+	AsyncOp op;
+
+	async_msg_init(op.req, sizeof(nlmsghdr) + sizeof(TdbMsg)
+			       + sizeof(TdbMsgRec) + key.length(),
+		       TDB_MSG_REMOVE, tbl_name);
+	build_keys_msg((nlmsghdr *)&op.req[0], TDB_MSG_REMOVE, tbl_name,
+		       std::vector<std::string>{key}, 0);
+
+	op.type = TDB_MSG_REMOVE;
+	op.done_cb = std::move(done_cb);
+	async_submit(std::move(op));
+}
+
+/**
+ * Send the queued requests, wait for responses for up to @timeout
+ * milliseconds, or infinitely if @timeout is negative, and process all
+ * the received responses.
+ * @return number of completed operations.
+ */
+size_t
+TdbHndl::poll_async(int timeout)
+{
+	async_flush();
+	if (ops_.empty())
+		return 0;
+
+	// poll(2) also continues a multi-message response.
+	pollfd pfd = { fd_, POLLIN | POLLERR, 0 };
+	if (poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+		throw TdbExcept("poll failure");
+	if (pfd.revents & POLLERR)
+		throw TdbExcept("poll failure");
+
+	size_t done = async_recv();
+
+	async_flush();
+
+	return done;
+}
+
+/**
+ * Wait until all the asynchronous operations are completed.
+ */
+void
+TdbHndl::wait_async()
+{
+	while (!ops_.empty())
+		poll_async(-1);
+}
+
+size_t
+TdbHndl::async_pending() const noexcept
+{
+	return ops_.size();
 }
 
 std::string
@@ -487,7 +1099,10 @@ TdbHndl::TdbHndl(size_t mm_sz)
 	: ring_sz_(mm_sz / 2),
 	rx_fr_off_(0),
 	tx_fr_off_(0),
-	buf_(NULL)
+	buf_(NULL),
+	seq_(0),
+	inflight_(0),
+	dump_seq_(0)
 {
 	fd_ = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_TEMPESTA);
 	if (fd_ < 0)
@@ -22,8 +22,11 @@
 
 #include <linux/netlink.h>
 
+#include <deque>
 #include <functional>
 #include <iostream>
+#include <unordered_map>
+#include <vector>
 
 #include <tdb_if.h>
 #include "exception.h"
@@ -32,6 +35,11 @@ class TdbHndl {
 public:
 	static const size_t MMSZ;
 
+	typedef std::function<void (char *, size_t, char *, size_t)> RecCb;
+	// Completion of an asynchronous operation: whether it succeeded and
+	// the number of inserted, selected or removed records.
+	typedef std::function<void (bool, size_t)> DoneCb;
+
 private:
 	// Transaction handling helper.
 	struct Trx {
@@ -44,6 +52,7 @@ private:
 		}
 
 		Trx() noexcept
+			: fr_n(0), rec_n(0)
 		{
 			init();
 		}
@@ -53,6 +62,10 @@ private:
 			return !!fr_hdr;
 		}
 
+		// Number of finished frames, which are not sent yet.
+		unsigned int	fr_n;
+		// Number of records processed by the sent frames.
+		size_t		rec_n;
 		size_t		off;
 		nl_mmap_hdr	*fr_hdr;
 		nlmsghdr	*msg_hdr;
@@ -81,6 +94,15 @@ private:
 	friend std::ostream &
 	operator<<(std::ostream &os, const LastOpStatus &los);
 
+	// Asynchronous operation waiting for its response.
+	struct AsyncOp {
+		std::string	req;
+		RecCb		process_cb;
+		DoneCb		done_cb;
+		unsigned int	type;
+		size_t		rec_n;
+	};
+
 public:
 	TdbHndl(size_t mm_sz);
 	~TdbHndl() noexcept;
@@ -90,13 +112,38 @@ public:
 
 	void get_info(std::function<void (char *)> data_cb);
 	void open_table(std::string &db_path, std::string &tbl_name,
-			size_t pages, unsigned int rec_size);
+			size_t pages, unsigned int rec_size,
+			bool ordered = false);
 	void close_table(std::string &tbl_name);
+	void get_stat(std::string &tbl_name, TdbStat &st);
 	void insert(std::string &tbl_name, size_t klen, size_t vlen,
 		    std::function<void (char *, char *)> placement_cb);
 	void query(std::string &tbl_name, std::string &key,
 		   std::function<void (char *, size_t, char *, size_t)>
 			process_cb);
+	void query(std::string &tbl_name, const std::vector<std::string> &keys,
+		   std::function<void (char *, size_t, char *, size_t)>
+			process_cb);
+	void remove(std::string &tbl_name,
+		    const std::vector<std::string> &keys);
+	void range(std::string &tbl_name, const std::string &from,
+		   const std::string &to,
+		   std::function<void (char *, size_t, char *, size_t)>
+			process_cb);
+	void prefix(std::string &tbl_name, const std::string &prefix,
+		    std::function<void (char *, size_t, char *, size_t)>
+			process_cb);
+
+	void insert_async(std::string &tbl_name, size_t klen, size_t vlen,
+			  std::function<void (char *, char *)> placement_cb,
+			  DoneCb done_cb);
+	void query_async(std::string &tbl_name, const std::string &key,
+			 RecCb process_cb, DoneCb done_cb);
+	void remove_async(std::string &tbl_name, const std::string &key,
+			  DoneCb done_cb);
+	size_t poll_async(int timeout);
+	void wait_async();
+	size_t async_pending() const noexcept;
 
 	std::string last_status() noexcept;
 
@@ -104,11 +151,31 @@ private:
 	void advance_frame_offset(unsigned int &off) noexcept;
 	void lazy_buffer_alloc();
 	void alloc_trx_frame() noexcept;
+	void trx_frame_done() noexcept;
+	void trx_flush();
 	void send_to_kernel();
+	size_t build_keys_msg(nlmsghdr *nlh, unsigned int type,
+			      std::string &tbl_name,
+			      const std::vector<std::string> &keys, size_t i);
+	void recv_status(unsigned int type, const char *what);
+	void recv_recs(unsigned int type,
+		       std::function<void (char *, size_t, char *, size_t)>
+			&process_cb);
+	void query_keys(std::string &tbl_name,
+			const std::vector<std::string> &keys, size_t &i,
+			std::function<void (char *, size_t, char *, size_t)>
+				process_cb);
 
 	void msg_recv(std::function<bool (nlmsghdr *)> msg_cb);
 	void msg_send(std::function<void (nlmsghdr *)> msg_build_cb);
 
+	void check_sync() const;
+	void async_submit(AsyncOp &&op);
+	void async_requeue(unsigned int seq);
+	void async_flush();
+	size_t async_recv_msg(nlmsghdr *nlh);
+	size_t async_recv();
+
 private:
 	int fd_;
 	size_t ring_sz_;
@@ -117,6 +184,56 @@ private:
 	char *buf_;
 	Trx trx_;
 	LastOpStatus last_status_;
+	// Asynchronous operations by sequence numbers of their requests.
+	std::unordered_map<unsigned int, AsyncOp> ops_;
+	// Requests to send, in the order of their sequence numbers.
+	std::deque<unsigned int> txq_;
+	unsigned int seq_;
+	// Number of sent requests, which got no response message yet.
+	unsigned int inflight_;
+	// Request with multi-message response in progress.
+	unsigned int dump_seq_;
+};
+
+/**
+ * Read-only zero-copy access to a table mapped from the kernel.
+ *
+ * The table is walked in the mapped memory without any locking, so each
+ * bucket is validated by its sequence counter and the table generation of
+ * released buckets: records are passed to the callback only if the bucket
+ * wasn't changed while they were read, otherwise the bucket is reread.
+ * Records which are being inserted can be seen partially written, just like
+ * for the kernel lockless lookups.
+ */
+class TdbMap {
+public:
+	TdbMap(const std::string &tbl_name);
+	~TdbMap() noexcept;
+
+	bool varlen_recs() const noexcept;
+
+	size_t for_each(std::function<void (unsigned long, const char *,
+					    size_t)> rec_cb);
+
+private:
+	struct Rec {
+		unsigned long	key;
+		std::string	data;
+	};
+
+	bool in_map(unsigned long off, size_t len) const noexcept;
+	unsigned int read_shift(unsigned long node, int i) const noexcept;
+	bool read_bucket(unsigned long off, std::vector<Rec> &recs,
+			 unsigned int &coll_next) const;
+	bool read_vrec(unsigned long off, Rec &rec) const;
+	void walk_node(unsigned long off, int bits, size_t &n,
+		       std::function<void (unsigned long, const char *,
+					   size_t)> &rec_cb);
+
+private:
+	int fd_;
+	size_t sz_;
+	char *map_;
 };
 
 #endif // __LIBTDB_H__
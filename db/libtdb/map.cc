@@ -0,0 +1,330 @@
+/**
+ *		Tempesta DB User-space Library
+ *
+ * Read-only access to tables mapped from the kernel.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "libtdb.h"
+
+namespace {
+
+/*
+ * The kernel structures of the table, see tdb.h and htrie.h in db/core.
+ * The kernel structures use kernel types, so they're mirrored here for
+ * x86-64 kernels with 64-byte cache lines and without lock debugging.
+ */
+const size_t CL_SZ = 64;
+const size_t MINDREC = CL_SZ * 2;
+const unsigned long MAGIC = 0x334947414D424454UL;
+const int HTRIE_BITS = 4;
+const int HTRIE_FANOUT = 1 << HTRIE_BITS;
+const unsigned int HTRIE_DBIT = 1U << 31;
+const unsigned int VRFREED = HTRIE_DBIT;
+// Rereads of a bucket before giving up.
+const int MAX_RETRIES = 1000;
+
+struct Hdr {
+	unsigned long	magic;
+	unsigned long	dbsz;
+	unsigned long	nwb;
+	unsigned long	pcpu;
+	unsigned int	rec_len;
+	unsigned long	blk_ref;
+	unsigned long	gen;
+	unsigned int	flags;
+	unsigned long	free_gen;
+	unsigned long	ext_bmp[0];
+} __attribute__((packed));
+
+struct Ext {
+	unsigned long	b_bmp[TDB_EXT_SZ / 4096 / 64];
+} __attribute__((packed));
+
+struct Node {
+	unsigned int	shifts[HTRIE_FANOUT];
+} __attribute__((packed));
+
+struct Bucket {
+	unsigned char	tags[MINDREC / 8];
+	unsigned int	coll_next;
+	unsigned int	flags;
+	unsigned int	lock;
+	unsigned int	seq;
+} __attribute__((packed));
+
+struct VRec {
+	unsigned long	key;
+	unsigned int	chunk_next;
+	unsigned int	len;
+	char		data[0];
+} __attribute__((packed));
+
+static_assert(sizeof(Hdr) == CL_SZ, "bad table header layout");
+static_assert(sizeof(Node) == CL_SZ, "bad index node layout");
+static_assert(sizeof(Bucket) == 32, "bad bucket layout");
+
+inline const Hdr *
+hdr(const char *map) noexcept
+{
+	return reinterpret_cast<const Hdr *>(map);
+}
+
+inline unsigned long
+root_off(const Hdr *h) noexcept
+{
+	// The extents bitmap covers the largest table, 2^31 blocks.
+	size_t ext_bmp = (1UL << 31) * CL_SZ / TDB_EXT_SZ / 64;
+
+	return sizeof(Hdr) + ext_bmp * sizeof(long) + sizeof(Ext);
+}
+
+inline unsigned long
+free_gen(const Hdr *h) noexcept
+{
+	return __atomic_load_n(&h->free_gen, __ATOMIC_ACQUIRE);
+}
+
+} // namespace
+
+TdbMap::TdbMap(const std::string &tbl_name)
+	: fd_(-1), sz_(0), map_(nullptr)
+{
+	char name[TDB_TBLNAME_LEN + 1] = {};
+	void *p;
+
+	if (tbl_name.size() > TDB_TBLNAME_LEN)
+		throw TdbExcept("too long table name %s", tbl_name.c_str());
+	tbl_name.copy(name, TDB_TBLNAME_LEN);
+
+	fd_ = open("/dev/" TDB_DEV_NAME, O_RDONLY);
+	if (fd_ < 0)
+		throw TdbExcept("cannot open /dev/" TDB_DEV_NAME);
+	if (ioctl(fd_, TDB_IOC_TABLE, name)) {
+		close(fd_);
+		throw TdbExcept("cannot bind to table %s", name);
+	}
+
+	// Map the first page to get the table size.
+	p = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, fd_, 0);
+	if (p == MAP_FAILED) {
+		close(fd_);
+		throw TdbExcept("cannot map table %s", name);
+	}
+	if (hdr((char *)p)->magic != MAGIC) {
+		munmap(p, getpagesize());
+		close(fd_);
+		errno = 0;
+		throw TdbExcept("table %s has unknown layout", name);
+	}
+	sz_ = hdr((char *)p)->dbsz;
+	munmap(p, getpagesize());
+
+	p = mmap(NULL, sz_, PROT_READ, MAP_SHARED, fd_, 0);
+	if (p == MAP_FAILED) {
+		close(fd_);
+		throw TdbExcept("cannot map %lu bytes of table %s", sz_, name);
+	}
+	map_ = (char *)p;
+}
+
+TdbMap::~TdbMap() noexcept
+{
+	munmap(map_, sz_);
+	close(fd_);
+}
+
+bool
+TdbMap::varlen_recs() const noexcept
+{
+	return !hdr(map_)->rec_len;
+}
+
+bool
+TdbMap::in_map(unsigned long off, size_t len) const noexcept
+{
+	return off >= sizeof(Hdr) && off < sz_ && len <= sz_ - off;
+}
+
+unsigned int
+TdbMap::read_shift(unsigned long node, int i) const noexcept
+{
+	const Node *n = reinterpret_cast<const Node *>(map_ + node);
+
+	return __atomic_load_n(&n->shifts[i], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Copy all the chunks of variable-length record at @off. The data can be
+ * garbage if the record is concurrently removed, so only bounds are checked
+ * here and the bucket sequence tells whether the copy is valid.
+ */
+bool
+TdbMap::read_vrec(unsigned long off, Rec &rec) const
+{
+	const VRec *r = reinterpret_cast<const VRec *>(map_ + off);
+	unsigned int len;
+
+	rec.key = r->key;
+	rec.data.clear();
+	for ( ; ; ) {
+		len = r->len & ~VRFREED;
+		if (!in_map(off, sizeof(*r) + len)
+		    || rec.data.size() + len > sz_)
+			return false;
+		rec.data.append(r->data, len);
+		if (!r->chunk_next)
+			return true;
+		off = (unsigned long)r->chunk_next * MINDREC;
+		if (!in_map(off, sizeof(*r)))
+			return false;
+		r = reinterpret_cast<const VRec *>(map_ + off);
+	}
+}
+
+/**
+ * Copy live records of bucket at @off to @recs.
+ * @return false if the bucket was changed while it was read.
+ */
+bool
+TdbMap::read_bucket(unsigned long off, std::vector<Rec> &recs,
+		    unsigned int &coll_next) const
+{
+	const Bucket *b = reinterpret_cast<const Bucket *>(map_ + off);
+	const Hdr *h = hdr(map_);
+	size_t n = recs.size();
+	unsigned int s, seq;
+	Bucket bh;
+
+	seq = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1)
+		return false;
+	memcpy(&bh, b, sizeof(bh));
+
+	for (s = sizeof(Bucket) / 8; s < MINDREC / 8; ++s) {
+		unsigned long roff = off + s * 8;
+
+		if (!bh.tags[s] || (bh.flags & (1U << s)))
+			continue;
+		recs.emplace_back();
+		if (h->rec_len) {
+			if (!in_map(roff, sizeof(long) + h->rec_len))
+				goto changed;
+			recs.back().key = *(const unsigned long *)(map_ + roff);
+			recs.back().data.assign(map_ + roff + sizeof(long),
+						h->rec_len);
+			continue;
+		}
+		const VRec *r = reinterpret_cast<const VRec *>(map_ + roff);
+		if (!r->len || (r->len & VRFREED)) {
+			recs.pop_back();
+			continue;
+		}
+		if (!read_vrec(roff, recs.back()))
+			goto changed;
+	}
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&b->seq, __ATOMIC_RELAXED) != seq)
+		goto changed;
+	coll_next = bh.coll_next;
+	return true;
+changed:
+	recs.resize(n);
+	return false;
+}
+
+/**
+ * Walk records of index node at @off. Records of each index slot, including
+ * the collision chain, are passed to @rec_cb only after the slot was read
+ * consistently: neither the buckets nor the slot itself were changed and
+ * compaction didn't release any bucket while they were read.
+ */
+void
+TdbMap::walk_node(unsigned long off, int bits, size_t &n,
+		  std::function<void (unsigned long, const char *, size_t)>
+			&rec_cb)
+{
+	const Hdr *h = hdr(map_);
+
+	if (bits + HTRIE_BITS > (int)sizeof(long) * 8)
+		return;
+
+	for (int i = 0; i < HTRIE_FANOUT; ++i) {
+		std::vector<Rec> recs;
+		unsigned long g, chain;
+		unsigned int o;
+		int retry = 0;
+		bool ok;
+	reread:
+		if (++retry > MAX_RETRIES) {
+			errno = EAGAIN;
+			throw TdbExcept("table is updated too frequently to"
+					" read it");
+		}
+		o = read_shift(off, i);
+		if (!o)
+			continue;
+		if (!(o & HTRIE_DBIT)) {
+			unsigned long node = (unsigned long)o * CL_SZ;
+			if (in_map(node, sizeof(Node)))
+				walk_node(node, bits + HTRIE_BITS, n, rec_cb);
+			continue;
+		}
+
+		g = free_gen(h);
+		recs.clear();
+		ok = true;
+		chain = (unsigned long)(o & ~HTRIE_DBIT) * MINDREC;
+		for (size_t c = 0; ok && chain; ++c) {
+			unsigned int next = 0;
+
+			ok = c < sz_ / MINDREC && in_map(chain, MINDREC)
+			     && read_bucket(chain, recs, next);
+			chain = (unsigned long)next * MINDREC;
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (!ok || read_shift(off, i) != o || free_gen(h) != g)
+			goto reread;
+
+		for (auto &r : recs)
+			rec_cb(r.key, r.data.data(), r.data.size());
+		n += recs.size();
+	}
+}
+
+/**
+ * Call @rec_cb for each record of the table with the record key hash and
+ * the record body. Variable-length records are passed as the concatenation
+ * of all their chunks.
+ * @return number of the walked records.
+ */
+size_t
+TdbMap::for_each(std::function<void (unsigned long, const char *, size_t)>
+			rec_cb)
+{
+	size_t n = 0;
+
+	walk_node(root_off(hdr(map_)), 0, n, rec_cb);
+
+	return n;
+}
@@ -0,0 +1,465 @@
+/**
+ *		Tempesta DB
+ *
+ * Scaling benchmark for HTrie: concurrent inserts and lookups of fixed and
+ * variable-size records with uniform and Zipf distributed keys for growing
+ * table sizes. Results are printed as CSV, one line per run.
+ *
+ * The kernel locks and RCU are emulated by ktest, so absolute numbers differ
+ * from the kernel ones, but the benchmark is suitable to compare HTrie
+ * changes, e.g. the bucket layout or the lookup algorithms.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#define _GNU_SOURCE
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NR_CPUS			64
+#include "ktest.h"
+#include "../core/htrie.c"
+
+#define MB			(1024UL * 1024)
+/* Zipf exponent typical for web caches. */
+#define ZIPF_S			0.99
+/* Part of the table memory filled by the records. */
+#define FILL_DIV		8
+
+enum {
+	PH_INSERT,
+	PH_LOOKUP,
+	PH_EXIT,
+};
+
+typedef struct {
+	unsigned int	id;
+	unsigned long	miss;
+	size_t		lat_n;
+	unsigned int	*lat;
+} BenchThr;
+
+static struct {
+	/* Configuration. */
+	unsigned int	thr_max;
+	size_t		tbl_max;
+	size_t		ops;
+	unsigned int	frec_len;
+	unsigned int	vrec_len;
+	bool		uniform, zipf;
+	/* Current run. */
+	TdbHdr		*dbh;
+	int		phase;
+	unsigned int	thr_n;
+	unsigned int	rec_len;
+	size_t		keys_n;
+	double		*cdf;
+	/* Workers. */
+	pthread_barrier_t start, done;
+	BenchThr	thr[NR_CPUS];
+	pthread_t	tid[NR_CPUS];
+} bench;
+
+static unsigned long *keys;
+static char *data;
+
+static inline unsigned long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static inline unsigned long
+splitmix64(unsigned long *s)
+{
+	unsigned long z = (*s += 0x9e3779b97f4a7c15UL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+	return z ^ (z >> 31);
+}
+
+static size_t
+next_key(unsigned long *rng)
+{
+	double p;
+	size_t lo = 0, hi = bench.keys_n - 1;
+
+	if (!bench.cdf)
+		return splitmix64(rng) % bench.keys_n;
+
+	p = (double)(splitmix64(rng) >> 11) / (1UL << 53);
+	while (lo < hi) {
+		size_t m = (lo + hi) / 2;
+		if (bench.cdf[m] < p)
+			lo = m + 1;
+		else
+			hi = m;
+	}
+	return lo;
+}
+
+static bool
+insert_rec(unsigned long key)
+{
+	size_t copied, len = bench.rec_len;
+	TdbVRec *rec;
+
+	rec = (TdbVRec *)tdb_htrie_insert(bench.dbh, key, data, &len);
+	if (!rec)
+		return false;
+	if (!TDB_HTRIE_VARLENRECS(bench.dbh))
+		return true;
+
+	for (copied = len; copied < bench.rec_len; copied += rec->len) {
+		rec = tdb_htrie_extend_rec(bench.dbh, rec,
+					   bench.rec_len - copied);
+		if (!rec)
+			return false;
+		memcpy(rec + 1, data + copied, rec->len);
+	}
+	return true;
+}
+
+static bool
+lookup_rec(unsigned long key)
+{
+	TdbBucket *b;
+	TdbRec *r;
+
+	b = tdb_htrie_lookup(bench.dbh, key);
+	if (!b)
+		return false;
+	r = tdb_htrie_bscan_for_rec(bench.dbh, &b, key);
+	if (!r)
+		return false;
+	/* Leave the RCU section as tdb_rec_put() does. */
+	rcu_read_unlock_bh();
+
+	return true;
+}
+
+static void
+run_insert(BenchThr *t)
+{
+	size_t i = t->id * bench.keys_n / bench.thr_n;
+	size_t end = (t->id + 1) * bench.keys_n / bench.thr_n;
+
+	for ( ; i < end; ++i) {
+		unsigned long t0 = now_ns();
+
+		t->miss += !insert_rec(keys[i]);
+		t->lat[t->lat_n++] = now_ns() - t0;
+	}
+}
+
+static void
+run_lookup(BenchThr *t)
+{
+	size_t i;
+	unsigned long rng = t->id + 1;
+
+	for (i = 0; i < bench.ops; ++i) {
+		unsigned long k = keys[next_key(&rng)], t0 = now_ns();
+
+		t->miss += !lookup_rec(k);
+		t->lat[t->lat_n++] = now_ns() - t0;
+	}
+}
+
+/*
+ * ktest assigns emulated CPU identifiers to threads once, so the workers
+ * live for the whole benchmark and synchronize on the barriers.
+ */
+static void *
+worker(void *arg)
+{
+	BenchThr *t = arg;
+
+	for ( ; ; ) {
+		pthread_barrier_wait(&bench.start);
+		if (bench.phase == PH_EXIT)
+			break;
+		if (t->id < bench.thr_n) {
+			if (bench.phase == PH_INSERT)
+				run_insert(t);
+			else
+				run_lookup(t);
+		}
+		pthread_barrier_wait(&bench.done);
+	}
+
+	return NULL;
+}
+
+static int
+cmp_lat(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Run the current phase on bench.thr_n threads and print the results.
+ */
+static void
+run_phase(int phase, const char *dist, size_t tbl_sz)
+{
+	unsigned int i;
+	unsigned long t0, t1, miss = 0;
+	size_t n = 0;
+	unsigned int *lat;
+
+	for (i = 0; i < bench.thr_n; ++i) {
+		bench.thr[i].miss = 0;
+		bench.thr[i].lat_n = 0;
+	}
+	bench.phase = phase;
+
+	t0 = now_ns();
+	pthread_barrier_wait(&bench.start);
+	pthread_barrier_wait(&bench.done);
+	t1 = now_ns();
+
+	for (i = 0; i < bench.thr_n; ++i)
+		n += bench.thr[i].lat_n;
+	if (!n)
+		return;
+	lat = malloc(n * sizeof(*lat));
+	if (!lat) {
+		TDB_ERR("not enough memory\n");
+		exit(1);
+	}
+	for (i = 0, n = 0; i < bench.thr_n; ++i) {
+		memcpy(lat + n, bench.thr[i].lat,
+		       bench.thr[i].lat_n * sizeof(*lat));
+		n += bench.thr[i].lat_n;
+		miss += bench.thr[i].miss;
+	}
+	qsort(lat, n, sizeof(*lat), cmp_lat);
+
+	printf("%s,%s,%u,%s,%lu,%u,%lu,%lu,%.0f,%u,%u\n",
+	       phase == PH_INSERT ? "insert" : "lookup",
+	       TDB_HTRIE_VARLENRECS(bench.dbh) ? "var" : "fixed",
+	       bench.rec_len, dist, tbl_sz / MB, bench.thr_n, n, miss,
+	       n * 1e9 / (t1 - t0), lat[n / 2], lat[n * 99 / 100]);
+	fflush(stdout);
+
+	free(lat);
+}
+
+static void
+init_zipf_cdf(void)
+{
+	size_t i;
+	double sum = 0;
+
+	bench.cdf = malloc(bench.keys_n * sizeof(double));
+	if (!bench.cdf) {
+		TDB_ERR("not enough memory\n");
+		exit(1);
+	}
+	for (i = 0; i < bench.keys_n; ++i) {
+		sum += 1 / pow((double)(i + 1), ZIPF_S);
+		bench.cdf[i] = sum;
+	}
+	for (i = 0; i < bench.keys_n; ++i)
+		bench.cdf[i] /= sum;
+}
+
+/**
+ * Fill a new table of @tbl_sz bytes by @thr_n threads and look it up with
+ * all the key distributions.
+ */
+static void
+run_table(size_t tbl_sz, unsigned int rec_len, bool varlen, unsigned int thr_n)
+{
+	char *p, *addr;
+	size_t rec_sz;
+
+	/* HTrie requires extent-aligned address. */
+	p = mmap(NULL, tbl_sz + TDB_EXT_SZ, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("ERROR: cannot map table memory");
+		exit(1);
+	}
+	addr = (char *)TDB_EXT_O(p + TDB_EXT_SZ - 1);
+
+	bench.dbh = tdb_htrie_init(addr, tbl_sz, tbl_sz, varlen ? 0 : rec_len);
+	if (!bench.dbh) {
+		TDB_ERR("cannot initialize htrie\n");
+		exit(1);
+	}
+	bench.rec_len = rec_len;
+	bench.thr_n = thr_n;
+	rec_sz = varlen
+		 ? TDB_HTRIE_DALIGN(TDB_HTRIE_BCKT_HDR_SZ + sizeof(TdbVRec)
+				    + rec_len)
+		 : TDB_HTRIE_MINDREC;
+	bench.keys_n = tbl_sz / FILL_DIV / rec_sz;
+
+	run_phase(PH_INSERT, "seq", tbl_sz);
+	if (bench.uniform) {
+		bench.cdf = NULL;
+		run_phase(PH_LOOKUP, "uniform", tbl_sz);
+	}
+	if (bench.zipf) {
+		init_zipf_cdf();
+		run_phase(PH_LOOKUP, "zipf", tbl_sz);
+		free(bench.cdf);
+		bench.cdf = NULL;
+	}
+
+	tdb_htrie_exit(bench.dbh);
+	munmap(p, tbl_sz + TDB_EXT_SZ);
+}
+
+static void
+run_tables(unsigned int rec_len, bool varlen)
+{
+	size_t sz;
+	unsigned int t;
+
+	for (sz = 16 * MB; sz <= bench.tbl_max; sz *= 2) {
+		for (t = 1; t < bench.thr_max; t *= 2)
+			run_table(sz, rec_len, varlen, t);
+		run_table(sz, rec_len, varlen, bench.thr_max);
+	}
+}
+
+static void
+usage(const char *name)
+{
+	printf("\nUsage: %s [options]\n"
+	       "  -t <n>      maximum number of threads, runs are done for"
+	       " 1, 2, 4... threads\n"
+	       "  -m <MB>     maximum table size, tables grow from 16MB by"
+	       " powers of 2\n"
+	       "  -o <n>      number of lookups done by each thread\n"
+	       "  -f <bytes>  fixed-size records length, 0 to skip them\n"
+	       "  -v <bytes>  variable-size records length, 0 to skip them\n"
+	       "  -d <dist>   lookup keys distribution: uniform, zipf or"
+	       " both\n\n"
+	       "Output columns: phase, records type, record length, keys"
+	       " distribution, table size in MB, threads, operations,"
+	       " failed operations, operations per second, p50 and p99"
+	       " latencies in nanoseconds.\n\n", name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int c;
+	unsigned int i;
+	size_t max_keys;
+	unsigned long rng = 0;
+	const char *dist = "both";
+
+	bench.thr_max = sysconf(_SC_NPROCESSORS_ONLN);
+	bench.tbl_max = 256 * MB;
+	bench.ops = 200000;
+	bench.frec_len = 16;
+	bench.vrec_len = 256;
+
+	while ((c = getopt(argc, argv, "t:m:o:f:v:d:h")) != -1) {
+		switch (c) {
+		case 't':
+			bench.thr_max = atoi(optarg);
+			break;
+		case 'm':
+			bench.tbl_max = atol(optarg) * MB;
+			break;
+		case 'o':
+			bench.ops = atol(optarg);
+			break;
+		case 'f':
+			bench.frec_len = atoi(optarg);
+			break;
+		case 'v':
+			bench.vrec_len = atoi(optarg);
+			break;
+		case 'd':
+			dist = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return c != 'h';
+		}
+	}
+	bench.uniform = !strcmp(dist, "uniform") || !strcmp(dist, "both");
+	bench.zipf = !strcmp(dist, "zipf") || !strcmp(dist, "both");
+	/* The main thread shares the emulated CPU with the first worker. */
+	if (bench.thr_max >= NR_CPUS)
+		bench.thr_max = NR_CPUS - 1;
+	if (!bench.thr_max || bench.tbl_max < 16 * MB
+	    || (!bench.uniform && !bench.zipf))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* Enough keys to fill the largest table by the smallest records. */
+	max_keys = bench.tbl_max / FILL_DIV / TDB_HTRIE_MINDREC;
+	keys = malloc(max_keys * sizeof(*keys));
+	data = malloc(bench.frec_len + bench.vrec_len + 1);
+	if (!keys || !data) {
+		TDB_ERR("not enough memory\n");
+		return 1;
+	}
+	for (i = 0; i < max_keys; ++i)
+		keys[i] = splitmix64(&rng);
+	/* Fixed-size records with zero bytes aren't live. */
+	memset(data, 0xa5, bench.frec_len + bench.vrec_len + 1);
+
+	pthread_barrier_init(&bench.start, NULL, bench.thr_max + 1);
+	pthread_barrier_init(&bench.done, NULL, bench.thr_max + 1);
+	for (i = 0; i < bench.thr_max; ++i) {
+		BenchThr *t = &bench.thr[i];
+
+		t->id = i;
+		t->lat = malloc((max_keys + bench.ops) * sizeof(*t->lat));
+		if (!t->lat || spawn_thread(&bench.tid[i], worker, t)) {
+			TDB_ERR("cannot start benchmark thread\n");
+			return 1;
+		}
+	}
+
+	printf("phase,recs,rec_len,dist,table_mb,threads,ops,failed,"
+	       "ops_per_sec,p50_ns,p99_ns\n");
+	if (bench.frec_len)
+		run_tables(bench.frec_len, false);
+	if (bench.vrec_len)
+		run_tables(bench.vrec_len, true);
+
+	bench.phase = PH_EXIT;
+	pthread_barrier_wait(&bench.start);
+	for (i = 0; i < bench.thr_max; ++i)
+		pthread_join(bench.tid[i], NULL);
+
+	return 0;
+}
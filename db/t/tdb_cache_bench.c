@@ -0,0 +1,576 @@
+/**
+ *		Tempesta DB
+ *
+ * Web cache workload benchmark for HTrie. Cache entries of log-uniformly
+ * distributed sizes are stored as Tempesta FW cache stores responses:
+ * a variable-size record with the entry descriptor and the key string
+ * followed by the headers and the body. The entries are looked up with
+ * Zipf distributed keys as cache hits are served: the record is found by
+ * the key hash, the key string is compared and the body chunks are walked
+ * to reference them in the response.
+ *
+ * The sharded and the replicated cache modes, 'cache 1' and 'cache 2' in
+ * the configuration, are compared side by side. Threads are split between
+ * emulated NUMA nodes, each node has its own table of the same size. In the
+ * sharded mode an entry is stored only in the table of the node selected
+ * by the key, as tfw_cache_key_node() does, in the replicated mode it's
+ * stored in all the tables and the lookups are always local. The lookups
+ * of entries from other nodes are counted as remote, Tempesta FW passes
+ * them to a CPU of the owner node through the cache work queue. Neither
+ * the work queue nor the NUMA memory access costs are emulated, so the
+ * remote ratio and the memory use must be weighed against the hit rates.
+ *
+ * The kernel locks and RCU are emulated by ktest, so absolute numbers differ
+ * from the kernel ones. Results are printed as CSV, one line per run.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#define _GNU_SOURCE
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NR_CPUS			64
+#include "ktest.h"
+#include "../core/htrie.c"
+
+#define MB			(1024UL * 1024)
+#define NODES_MAX		8
+#define KEY_MAX			48
+
+enum {
+	MODE_SHARD,
+	MODE_REPLICA,
+};
+
+enum {
+	PH_INSERT,
+	PH_LOOKUP,
+	PH_EXIT,
+};
+
+/**
+ * Cache entry descriptor at the beginning of a record, the key string
+ * follows it.
+ *
+ * @key_len	- length of the key string;
+ * @len		- total entry length;
+ * @expires	- the entry freshness, always in the future;
+ */
+typedef struct {
+	unsigned int	key_len;
+	unsigned int	len;
+	unsigned long	expires;
+} BenchCe;
+
+typedef struct {
+	unsigned int	id;
+	unsigned long	hits;
+	unsigned long	remote;
+	unsigned long	failed;
+	size_t		lat_n;
+	unsigned int	*lat;
+	char		*buf;
+} BenchThr;
+
+static struct {
+	/* Configuration. */
+	unsigned int	thr_max;
+	unsigned int	nodes;
+	size_t		tbl_sz;
+	size_t		objs;
+	size_t		ops;
+	unsigned int	size_min;
+	unsigned int	size_max;
+	double		zipf_s;
+	/* Current run. */
+	int		mode;
+	unsigned long	now;
+	TdbHdr		*dbh[NODES_MAX];
+	char		*mem[NODES_MAX];
+	int		phase;
+	unsigned int	thr_n;
+	double		*cdf;
+	/* Workers. */
+	pthread_barrier_t start, done;
+	BenchThr	thr[NR_CPUS];
+	pthread_t	tid[NR_CPUS];
+} bench;
+
+static unsigned long *keys;
+static char (*key_str)[KEY_MAX];
+static unsigned int *key_len;
+static unsigned int *sizes;
+
+static inline unsigned long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static inline unsigned long
+splitmix64(unsigned long *s)
+{
+	unsigned long z = (*s += 0x9e3779b97f4a7c15UL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+	return z ^ (z >> 31);
+}
+
+static inline double
+rand_unit(unsigned long *rng)
+{
+	return (double)(splitmix64(rng) >> 11) / (1UL << 53);
+}
+
+static size_t
+next_obj(unsigned long *rng)
+{
+	double p = rand_unit(rng);
+	size_t lo = 0, hi = bench.objs - 1;
+
+	while (lo < hi) {
+		size_t m = (lo + hi) / 2;
+		if (bench.cdf[m] < p)
+			lo = m + 1;
+		else
+			hi = m;
+	}
+	return lo;
+}
+
+/* The node storing entry @key in the sharded mode. */
+static inline unsigned int
+key_node(unsigned long key)
+{
+	return key % bench.nodes;
+}
+
+static inline unsigned int
+thr_node(BenchThr *t)
+{
+	return t->id % bench.nodes;
+}
+
+static bool
+insert_ce(TdbHdr *dbh, size_t obj, char *buf)
+{
+	size_t copied, len = sizes[obj];
+	BenchCe *ce = (BenchCe *)buf;
+	TdbVRec *rec;
+
+	ce->key_len = key_len[obj];
+	ce->len = sizes[obj];
+	ce->expires = ~0UL;
+	memcpy(ce + 1, key_str[obj], key_len[obj]);
+
+	rec = (TdbVRec *)tdb_htrie_insert(dbh, keys[obj], buf, &len);
+	if (!rec)
+		return false;
+	for (copied = len; copied < sizes[obj]; copied += rec->len) {
+		rec = tdb_htrie_extend_rec(dbh, rec, sizes[obj] - copied);
+		if (!rec)
+			return false;
+		memcpy(rec + 1, buf + copied, rec->len);
+	}
+	return true;
+}
+
+/**
+ * Find entry @obj and walk its chunks as building a response from the cache
+ * does. Returns false on a miss.
+ */
+static bool
+lookup_ce(TdbHdr *dbh, size_t obj)
+{
+	unsigned long key = keys[obj];
+	unsigned int n = 0;
+	TdbBucket *b;
+	TdbVRec *r, *c;
+	BenchCe *ce;
+
+	if (!(b = tdb_htrie_lookup(dbh, key)))
+		return false;
+	r = (TdbVRec *)tdb_htrie_bscan_for_rec(dbh, &b, key);
+	for ( ; r; r = (TdbVRec *)tdb_htrie_next_rec(dbh, (TdbRec *)r, &b,
+						       key))
+	{
+		ce = (BenchCe *)r->data;
+		if (ce->key_len == key_len[obj] && ce->expires > bench.now
+		    && !memcmp(ce + 1, key_str[obj], key_len[obj]))
+			break;
+	}
+	if (!r)
+		return false;
+
+	for (c = r; c; c = c->chunk_next
+			   ? TDB_PTR(dbh, TDB_DI2O(c->chunk_next)) : NULL)
+		n += c->len;
+	/* Leave the RCU section as tdb_rec_put() does. */
+	rcu_read_unlock_bh();
+
+	return n >= ce->len;
+}
+
+static void
+run_insert(BenchThr *t)
+{
+	size_t i = t->id * bench.objs / bench.thr_n;
+	size_t end = (t->id + 1) * bench.objs / bench.thr_n;
+	unsigned int n;
+
+	for ( ; i < end; ++i) {
+		if (bench.mode == MODE_SHARD) {
+			n = key_node(keys[i]);
+			t->failed += !insert_ce(bench.dbh[n], i, t->buf);
+			continue;
+		}
+		for (n = 0; n < bench.nodes; ++n)
+			t->failed += !insert_ce(bench.dbh[n], i, t->buf);
+	}
+}
+
+static void
+run_lookup(BenchThr *t)
+{
+	size_t i;
+	unsigned long rng = t->id + 1;
+	unsigned int n, node = thr_node(t);
+
+	for (i = 0; i < bench.ops; ++i) {
+		size_t obj = next_obj(&rng);
+		unsigned long t0 = now_ns();
+
+		n = node;
+		if (bench.mode == MODE_SHARD) {
+			n = key_node(keys[obj]);
+			t->remote += n != node;
+		}
+		t->hits += lookup_ce(bench.dbh[n], obj);
+		t->lat[t->lat_n++] = now_ns() - t0;
+	}
+}
+
+/*
+ * ktest assigns emulated CPU identifiers to threads once, so the workers
+ * live for the whole benchmark and synchronize on the barriers.
+ */
+static void *
+worker(void *arg)
+{
+	BenchThr *t = arg;
+
+	for ( ; ; ) {
+		pthread_barrier_wait(&bench.start);
+		if (bench.phase == PH_EXIT)
+			break;
+		if (t->id < bench.thr_n) {
+			if (bench.phase == PH_INSERT)
+				run_insert(t);
+			else
+				run_lookup(t);
+		}
+		pthread_barrier_wait(&bench.done);
+	}
+
+	return NULL;
+}
+
+static int
+cmp_lat(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Memory allocated by the tables, in extents. */
+static size_t
+tables_mem(void)
+{
+	unsigned int n;
+	size_t i, ext = 0;
+
+	for (n = 0; n < bench.nodes; ++n) {
+		TdbHdr *dbh = bench.dbh[n];
+
+		for (i = 0; i < TDB_EXT_BMP_2L; ++i)
+			ext += __builtin_popcountl(dbh->ext_bmp[i]);
+	}
+
+	return ext * TDB_EXT_SZ;
+}
+
+static unsigned long
+run_phase(int phase, unsigned int thr_n)
+{
+	unsigned int i;
+	unsigned long t0;
+
+	bench.phase = phase;
+	bench.thr_n = thr_n;
+	for (i = 0; i < thr_n; ++i) {
+		bench.thr[i].hits = 0;
+		bench.thr[i].remote = 0;
+		bench.thr[i].failed = 0;
+		bench.thr[i].lat_n = 0;
+	}
+
+	t0 = now_ns();
+	pthread_barrier_wait(&bench.start);
+	pthread_barrier_wait(&bench.done);
+
+	return now_ns() - t0;
+}
+
+/**
+ * Look the entries up from @thr_n threads and print the results.
+ */
+static void
+run_lookups(unsigned int thr_n, unsigned long failed, size_t mem)
+{
+	unsigned int i;
+	unsigned long t, hits = 0, remote = 0;
+	size_t n = 0;
+	unsigned int *lat;
+
+	t = run_phase(PH_LOOKUP, thr_n);
+
+	for (i = 0; i < thr_n; ++i)
+		n += bench.thr[i].lat_n;
+	lat = malloc(n * sizeof(*lat));
+	if (!lat) {
+		TDB_ERR("not enough memory\n");
+		exit(1);
+	}
+	for (i = 0, n = 0; i < thr_n; ++i) {
+		memcpy(lat + n, bench.thr[i].lat,
+		       bench.thr[i].lat_n * sizeof(*lat));
+		n += bench.thr[i].lat_n;
+		hits += bench.thr[i].hits;
+		remote += bench.thr[i].remote;
+	}
+	qsort(lat, n, sizeof(*lat), cmp_lat);
+
+	printf("%s,%u,%u,%zu,%lu,%zu,%zu,%lu,%lu,%.0f,%u,%u\n",
+	       bench.mode == MODE_SHARD ? "shard" : "replica", bench.nodes,
+	       thr_n, bench.objs, failed, mem / MB, n, hits, remote,
+	       hits * 1e9 / t, lat[n / 2], lat[n * 99 / 100]);
+	fflush(stdout);
+
+	free(lat);
+}
+
+/**
+ * Fill new node tables in @mode by all the threads and look the entries up
+ * by the growing number of threads.
+ */
+static void
+run_mode(int mode)
+{
+	unsigned int i, t;
+	unsigned long failed = 0;
+	size_t mem;
+
+	bench.mode = mode;
+	bench.now = now_ns();
+	for (i = 0; i < bench.nodes; ++i) {
+		char *p = mmap(NULL, bench.tbl_sz + TDB_EXT_SZ,
+			       PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			       -1, 0);
+		if (p == MAP_FAILED) {
+			perror("ERROR: cannot map table memory");
+			exit(1);
+		}
+		bench.mem[i] = p;
+		/* HTrie requires extent-aligned address. */
+		bench.dbh[i] = tdb_htrie_init((char *)TDB_EXT_O(p + TDB_EXT_SZ
+								- 1),
+					      bench.tbl_sz, bench.tbl_sz,
+					      0);
+		if (!bench.dbh[i]) {
+			TDB_ERR("cannot initialize htrie\n");
+			exit(1);
+		}
+	}
+
+	run_phase(PH_INSERT, bench.thr_max);
+	for (i = 0; i < bench.thr_max; ++i)
+		failed += bench.thr[i].failed;
+	mem = tables_mem();
+
+	for (t = 1; t < bench.thr_max; t *= 2)
+		run_lookups(t, failed, mem);
+	run_lookups(bench.thr_max, failed, mem);
+
+	for (i = 0; i < bench.nodes; ++i) {
+		tdb_htrie_exit(bench.dbh[i]);
+		munmap(bench.mem[i], bench.tbl_sz + TDB_EXT_SZ);
+	}
+}
+
+static void
+init_objs(void)
+{
+	size_t i;
+	double sum = 0, r = (double)bench.size_max / bench.size_min;
+	unsigned long rng = 0;
+
+	keys = malloc(bench.objs * sizeof(*keys));
+	key_str = malloc(bench.objs * sizeof(*key_str));
+	key_len = malloc(bench.objs * sizeof(*key_len));
+	sizes = malloc(bench.objs * sizeof(*sizes));
+	bench.cdf = malloc(bench.objs * sizeof(double));
+	if (!keys || !key_str || !key_len || !sizes || !bench.cdf) {
+		TDB_ERR("not enough memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < bench.objs; ++i) {
+		key_len[i] = snprintf(key_str[i], KEY_MAX,
+				      "www.example.com/static/%zu.js", i);
+		keys[i] = splitmix64(&rng);
+		/* Web objects sizes are heavy tailed. */
+		sizes[i] = bench.size_min * pow(r, rand_unit(&rng));
+		sum += 1 / pow((double)(i + 1), bench.zipf_s);
+		bench.cdf[i] = sum;
+	}
+	for (i = 0; i < bench.objs; ++i)
+		bench.cdf[i] /= sum;
+}
+
+static void
+usage(const char *name)
+{
+	printf("\nUsage: %s [options]\n"
+	       "  -t <n>      maximum number of threads, lookups are done by"
+	       " 1, 2, 4... threads\n"
+	       "  -n <n>      number of emulated NUMA nodes, at most %d\n"
+	       "  -m <MB>     size of a node table\n"
+	       "  -k <n>      number of cache entries\n"
+	       "  -o <n>      number of lookups done by each thread\n"
+	       "  -s <bytes>  minimum entry size\n"
+	       "  -S <bytes>  maximum entry size, the sizes are log-uniformly"
+	       " distributed\n"
+	       "  -z <s>      Zipf exponent of the lookup keys\n\n"
+	       "Output columns: cache mode, nodes, threads, entries, failed"
+	       " insertions, memory used by the tables in MB, lookups, hits,"
+	       " remote lookups, hits per second, p50 and p99 lookup latencies"
+	       " in nanoseconds.\n\n", name, NODES_MAX);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int c;
+	unsigned int i;
+
+	bench.thr_max = sysconf(_SC_NPROCESSORS_ONLN);
+	bench.nodes = 2;
+	bench.tbl_sz = 512 * MB;
+	bench.objs = 50000;
+	bench.ops = 200000;
+	bench.size_min = 512;
+	bench.size_max = 64 * 1024;
+	bench.zipf_s = 0.99;
+
+	while ((c = getopt(argc, argv, "t:n:m:k:o:s:S:z:h")) != -1) {
+		switch (c) {
+		case 't':
+			bench.thr_max = atoi(optarg);
+			break;
+		case 'n':
+			bench.nodes = atoi(optarg);
+			break;
+		case 'm':
+			bench.tbl_sz = atol(optarg) * MB;
+			break;
+		case 'k':
+			bench.objs = atol(optarg);
+			break;
+		case 'o':
+			bench.ops = atol(optarg);
+			break;
+		case 's':
+			bench.size_min = atoi(optarg);
+			break;
+		case 'S':
+			bench.size_max = atoi(optarg);
+			break;
+		case 'z':
+			bench.zipf_s = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return c != 'h';
+		}
+	}
+	/* The main thread shares the emulated CPU with the first worker. */
+	if (bench.thr_max >= NR_CPUS)
+		bench.thr_max = NR_CPUS - 1;
+	if (!bench.thr_max || !bench.nodes || bench.nodes > NODES_MAX
+	    || bench.tbl_sz < 16 * MB || !bench.objs
+	    || bench.size_min < sizeof(BenchCe) + KEY_MAX
+	    || bench.size_max < bench.size_min)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	init_objs();
+
+	pthread_barrier_init(&bench.start, NULL, bench.thr_max + 1);
+	pthread_barrier_init(&bench.done, NULL, bench.thr_max + 1);
+	for (i = 0; i < bench.thr_max; ++i) {
+		BenchThr *t = &bench.thr[i];
+
+		t->id = i;
+		t->lat = malloc(bench.ops * sizeof(*t->lat));
+		/* Entries headers and bodies of the thread insertions. */
+		t->buf = malloc(bench.size_max);
+		if (!t->lat || !t->buf
+		    || spawn_thread(&bench.tid[i], worker, t))
+		{
+			TDB_ERR("cannot start benchmark thread\n");
+			return 1;
+		}
+		memset(t->buf, 0xa5, bench.size_max);
+	}
+
+	printf("mode,nodes,threads,entries,failed,mem_mb,lookups,hits,remote,"
+	       "hits_per_sec,p50_ns,p99_ns\n");
+	run_mode(MODE_SHARD);
+	run_mode(MODE_REPLICA);
+
+	bench.phase = PH_EXIT;
+	pthread_barrier_wait(&bench.start);
+	for (i = 0; i < bench.thr_max; ++i)
+		pthread_join(bench.tid[i], NULL);
+
+	return 0;
+}
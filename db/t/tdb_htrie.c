@@ -35,6 +35,7 @@
 #include <unistd.h>
 
 /* Include HTrie for test. */
+#include "ktest.h"
 #include "../core/htrie.c"
 
 /*
@@ -426,7 +427,7 @@ tdb_htrie_test_varsz(const char *fname)
 	printf("\n----------- Variable size records test -------------\n");
 
 	addr = tdb_htrie_open(TDB_MAP_ADDR1, fname, TDB_VSF_SZ, &fd);
-	dbh = tdb_htrie_init(addr, TDB_VSF_SZ, 0);
+	dbh = tdb_htrie_init(addr, TDB_VSF_SZ, TDB_VSF_SZ, 0);
 	if (!dbh)
 		TDB_ERR("cannot initialize htrie for urls");
 
@@ -451,7 +452,7 @@ tdb_htrie_test_varsz(const char *fname)
 	printf("\n	**** Variable size records test reopen ****\n");
 
 	addr = tdb_htrie_open(TDB_MAP_ADDR2, fname, TDB_VSF_SZ, &fd);
-	dbh = tdb_htrie_init(addr, TDB_VSF_SZ, 0);
+	dbh = tdb_htrie_init(addr, TDB_VSF_SZ, TDB_VSF_SZ, 0);
 	if (!dbh)
 		TDB_ERR("cannot initialize htrie for urls");
 
@@ -474,7 +475,7 @@ tdb_htrie_test_fixsz(const char *fname)
 	printf("\n----------- Fixed size records test -------------\n");
 
 	addr = tdb_htrie_open(TDB_MAP_ADDR1, fname, TDB_FSF_SZ, &fd);
-	dbh = tdb_htrie_init(addr, TDB_FSF_SZ, sizeof(ints[0]));
+	dbh = tdb_htrie_init(addr, TDB_FSF_SZ, TDB_FSF_SZ, sizeof(ints[0]));
 	if (!dbh)
 		TDB_ERR("cannot initialize htrie for ints");
 
@@ -499,7 +500,7 @@ tdb_htrie_test_fixsz(const char *fname)
 	printf("\n	**** Fixed size records test reopen ****\n");
 
 	addr = tdb_htrie_open(TDB_MAP_ADDR2, fname, TDB_FSF_SZ, &fd);
-	dbh = tdb_htrie_init(addr, TDB_FSF_SZ, sizeof(ints[0]));
+	dbh = tdb_htrie_init(addr, TDB_FSF_SZ, TDB_FSF_SZ, sizeof(ints[0]));
 	if (!dbh)
 		TDB_ERR("cannot initialize htrie for ints");
 
@@ -509,11 +510,90 @@ tdb_htrie_test_fixsz(const char *fname)
 	tdb_htrie_pure_close(addr, TDB_FSF_SZ, fd);
 }
 
+/**
+ * Get the largest offset of an index node under @node.
+ */
+static unsigned long
+tdb_htrie_max_node_off(TdbHdr *dbh, TdbHtrieNode *node)
+{
+	int i;
+	unsigned long max = TDB_HTRIE_OFF(dbh, node);
+
+	for (i = 0; i < TDB_HTRIE_FANOUT; ++i) {
+		unsigned long o = node->shifts[i];
+
+		if (o && !(o & TDB_HTRIE_DBIT)) {
+			unsigned long n = tdb_htrie_max_node_off(dbh,
+							TDB_PTR(dbh, TDB_II2O(o)));
+			if (n > max)
+				max = n;
+		}
+	}
+
+	return max;
+}
+
+static int
+tdb_htrie_rec_visit(void *data)
+{
+	return 0;
+}
+
+/**
+ * Fill the table up, so index nodes are placed in the upper half of the
+ * table. Index nodes are addressed in smaller units than data buckets, so
+ * their shifts must not be checked against the data block bound.
+ */
+void
+tdb_htrie_test_full(const char *fname)
+{
+	int fd;
+	char *addr;
+	unsigned long i, n;
+	TdbHdr *dbh;
+
+	printf("\n----------- Full table test -------------\n");
+
+	unlink(fname);
+	addr = tdb_htrie_open(TDB_MAP_ADDR1, fname, TDB_FSF_SZ, &fd);
+	dbh = tdb_htrie_init(addr, TDB_FSF_SZ, TDB_FSF_SZ, sizeof(ints[0]));
+	if (!dbh)
+		TDB_ERR("cannot initialize htrie for full table");
+
+	srand(1);
+	for (n = 0; ; ++n) {
+		unsigned int k = rand();
+		size_t copied = sizeof(k);
+
+		if (!tdb_htrie_insert(dbh, k, &k, &copied))
+			break;
+	}
+	printf("inserted %lu records\n", n);
+
+	BUG_ON(tdb_htrie_max_node_off(dbh, TDB_HTRIE_ROOT(dbh))
+	       < tdb_htrie_size(dbh) / 2);
+
+	srand(1);
+	for (i = 0; i < n; ++i) {
+		unsigned int k = rand();
+		TdbBucket *b = tdb_htrie_lookup(dbh, k);
+
+		BUG_ON(!b || !tdb_htrie_bscan_for_rec(dbh, &b, k));
+	}
+	BUG_ON(tdb_htrie_walk(dbh, tdb_htrie_rec_visit));
+
+	tdb_htrie_exit(dbh);
+	tdb_htrie_pure_close(addr, TDB_FSF_SZ, fd);
+	/* Don't leave the full table for the next fixed size records test. */
+	unlink(fname);
+}
+
 static void
 tdb_htrie_test(const char *vsf, const char *fsf)
 {
 	tdb_htrie_test_varsz(vsf);
 	tdb_htrie_test_fixsz(fsf);
+	tdb_htrie_test_full(fsf);
 }
 
 static void
@@ -0,0 +1,228 @@
+/**
+ *		Tempesta DB Query Tool
+ *
+ * Benchmark of a table: concurrent inserts and selects of random keys.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <libtdb.h>
+
+#include "bench.h"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+// Zipf exponent typical for web caches.
+const double ZIPF_S = 0.99;
+
+/**
+ * Key generator: uniform or Zipf distribution, key 0 is the most popular
+ * one for the latter.
+ */
+class KeyGen {
+public:
+	KeyGen(const BenchCfg &cfg)
+		: cfg_(cfg)
+	{
+		if (!cfg.zipf)
+			return;
+		double sum = 0;
+		cdf_.reserve(cfg.keys);
+		for (size_t i = 1; i <= cfg.keys; ++i) {
+			sum += 1 / std::pow((double)i, ZIPF_S);
+			cdf_.push_back(sum);
+		}
+		for (auto &p : cdf_)
+			p /= sum;
+	}
+
+	size_t
+	next(std::mt19937_64 &rng) const
+	{
+		if (!cfg_.zipf)
+			return std::uniform_int_distribution<size_t>
+					(0, cfg_.keys - 1)(rng);
+		double p = std::uniform_real_distribution<double>(0, 1)(rng);
+		auto i = std::lower_bound(cdf_.begin(), cdf_.end(), p);
+		return std::min<size_t>(i - cdf_.begin(), cfg_.keys - 1);
+	}
+
+private:
+	const BenchCfg &cfg_;
+	std::vector<double> cdf_;
+};
+
+struct ThrStat {
+	ThrStat()
+		: hits(0), selects(0)
+	{}
+
+	size_t			hits;
+	size_t			selects;
+	std::vector<unsigned long> lat; // nanoseconds
+	std::string		err;
+};
+
+unsigned long
+since(Clock::time_point t0)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>
+		(Clock::now() - t0).count();
+}
+
+/**
+ * Keep up to @cfg.depth operations in flight using the asynchronous API,
+ * the latency of an operation is the time from its submission until its
+ * completion.
+ */
+void
+bench_async(TdbHndl &th, std::string &table, const BenchCfg &cfg,
+	    const KeyGen &kg, std::mt19937_64 &rng, ThrStat &st)
+{
+	std::uniform_int_distribution<unsigned int> pct(0, 99);
+	std::string val(cfg.val_sz, 'v');
+
+	for (size_t i = 0; i < cfg.ops; ++i) {
+		std::string key = "key" + std::to_string(kg.next(rng));
+		auto t0 = Clock::now();
+		auto done_cb = [&st, t0](bool ok, size_t) {
+			if (!ok)
+				throw TdbExcept("operation failed, see dmesg");
+			st.lat.push_back(since(t0));
+		};
+
+		while (th.async_pending() >= cfg.depth)
+			th.poll_async(-1);
+
+		if (pct(rng) < cfg.reads) {
+			th.query_async(table, key,
+				       [&](char *, size_t, char *, size_t) {
+						++st.hits;
+				       }, done_cb);
+			++st.selects;
+		} else {
+			th.insert_async(table, key.length(), val.length(),
+					[&](char *k, char *v) {
+						key.copy(k, key.length());
+						val.copy(v, val.length());
+					}, done_cb);
+		}
+	}
+	th.wait_async();
+}
+
+void
+bench_thread(std::string table, const BenchCfg &cfg, const KeyGen &kg,
+	     unsigned int id, ThrStat &st)
+{
+	std::mt19937_64 rng(id + 1);
+	std::uniform_int_distribution<unsigned int> pct(0, 99);
+	std::string val(cfg.val_sz, 'v');
+
+	st.lat.reserve(cfg.ops);
+	try {
+		TdbHndl th(cfg.mm_sz);
+
+		if (cfg.depth > 1) {
+			bench_async(th, table, cfg, kg, rng, st);
+			return;
+		}
+
+		for (size_t i = 0; i < cfg.ops; ++i) {
+			std::string key = "key" + std::to_string(kg.next(rng));
+			bool read = pct(rng) < cfg.reads;
+			auto t0 = Clock::now();
+
+			if (read) {
+				th.query(table, key,
+					 [&](char *, size_t, char *, size_t) {
+						++st.hits;
+					 });
+				++st.selects;
+			} else {
+				th.insert(table, key.length(), val.length(),
+					  [&](char *k, char *v) {
+						key.copy(k, key.length());
+						val.copy(v, val.length());
+					  });
+			}
+
+			st.lat.push_back(since(t0));
+		}
+	}
+	catch (std::exception &e) {
+		st.err = e.what();
+	}
+}
+
+} // namespace
+
+/**
+ * Run the benchmark and print throughput and latency percentiles of all
+ * the operations.
+ */
+void
+bench(std::string &table, const BenchCfg &cfg)
+{
+	static const double PCT[] = { 50, 90, 99, 99.9 };
+	KeyGen kg(cfg);
+	std::vector<ThrStat> st(cfg.threads);
+	std::vector<std::thread> thr;
+	std::vector<unsigned long> lat;
+	size_t hits = 0, selects = 0;
+
+	auto t0 = Clock::now();
+	for (unsigned int i = 0; i < cfg.threads; ++i)
+		thr.emplace_back(bench_thread, table, std::cref(cfg),
+				 std::cref(kg), i, std::ref(st[i]));
+	for (auto &t : thr)
+		t.join();
+	double sec = std::chrono::duration<double>(Clock::now() - t0).count();
+
+	for (auto &s : st) {
+		if (!s.err.empty())
+			throw TdbExcept("benchmark thread failed: %s",
+					s.err.c_str());
+		lat.insert(lat.end(), s.lat.begin(), s.lat.end());
+		hits += s.hits;
+		selects += s.selects;
+	}
+	if (lat.empty())
+		return;
+	std::sort(lat.begin(), lat.end());
+
+	std::cout << "threads=" << cfg.threads << " depth=" << cfg.depth
+		  << " ops=" << lat.size()
+		  << " selects=" << selects << " hits=" << hits
+		  << " inserts=" << lat.size() - selects << std::endl;
+	std::cout << "throughput: " << (size_t)(lat.size() / sec) << " ops/s"
+		  << std::endl;
+	std::cout << "latency (us):";
+	for (auto p : PCT)
+		std::cout << " p" << p << "="
+			  << lat[(size_t)(p / 100 * (lat.size() - 1))] / 1000.0;
+	std::cout << " max=" << lat.back() / 1000.0 << std::endl;
+}
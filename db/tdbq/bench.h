@@ -0,0 +1,51 @@
+/**
+ *		Tempesta DB Query Tool
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <string>
+
+/**
+ * Benchmark parameters.
+ *
+ * @threads	- number of threads, each one with its own TDB handler;
+ * @ops		- number of operations done by each thread;
+ * @depth	- number of outstanding operations of each thread, the
+ *		  asynchronous API is used if it's greater than 1;
+ * @keys	- number of distinct keys;
+ * @zipf	- Zipf distribution of keys if true, uniform otherwise;
+ * @reads	- percentage of selects, other operations are inserts;
+ * @val_sz	- size of inserted values;
+ * @mm_sz	- size of netlink rings of each handler;
+ */
+struct BenchCfg {
+	unsigned int	threads;
+	size_t		ops;
+	size_t		depth;
+	size_t		keys;
+	bool		zipf;
+	unsigned int	reads;
+	size_t		val_sz;
+	size_t		mm_sz;
+};
+
+void bench(std::string &table, const BenchCfg &cfg);
+
+#endif // __BENCH_H__
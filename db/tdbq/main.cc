@@ -17,6 +17,9 @@
  * this program; if not, write to the Free Software Foundation, Inc., 59
  * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
+#include <unistd.h>
+
+#include <fstream>
 #include <iostream>
 #include <string>
 
@@ -24,12 +27,21 @@
 
 #include <libtdb.h>
 
+#include "bench.h"
+
 enum {
 	ACT_INFO,
 	ACT_OPEN,
 	ACT_CLOSE,
 	ACT_INSERT,
 	ACT_SELECT,
+	ACT_REMOVE,
+	ACT_SCAN,
+	ACT_LOAD,
+	ACT_BENCH,
+	ACT_RANGE,
+	ACT_PREFIX,
+	ACT_STAT,
 };
 
 namespace po = boost::program_options;
@@ -43,6 +55,10 @@ struct Cfg {
 	std::string	table;
 	std::string	key;
 	std::string	val;
+	std::string	file;
+	std::string	to;
+	bool		ordered;
+	BenchCfg	bench;
 
 	Cfg &
 	operator=(po::variables_map &&vm)
@@ -53,6 +69,11 @@ struct Cfg {
 			key = std::move(vm["key"].as<std::string>());
 		if (vm.count("value"))
 			val = std::move(vm["value"].as<std::string>());
+		if (vm.count("file"))
+			file = std::move(vm["file"].as<std::string>());
+		if (vm.count("to"))
+			to = std::move(vm["to"].as<std::string>());
+		ordered = vm.count("ordered");
 		table = std::move(vm["table"].as<std::string>());
 		tbl_sz = vm["tbl_size"].as<size_t>();
 		rec_sz = vm["rec_size"].as<size_t>();
@@ -64,6 +85,17 @@ struct Cfg {
 					sizeof(TdbMsgRec) + 2);
 		}
 		mm_sz = vm["mmap"].as<size_t>();
+		bench.threads = vm["threads"].as<unsigned int>();
+		bench.ops = vm["ops"].as<size_t>();
+		bench.depth = vm["depth"].as<size_t>();
+		bench.keys = vm["keys"].as<size_t>();
+		bench.reads = vm["reads"].as<unsigned int>();
+		bench.val_sz = vm["val_size"].as<size_t>();
+		bench.mm_sz = mm_sz;
+		std::string d = vm["dist"].as<std::string>();
+		if (d != "uniform" && d != "zipf")
+			throw TdbExcept("bad key distribution: %s", d.c_str());
+		bench.zipf = d == "zipf";
 
 		if (!vm.count("action"))
 			throw TdbExcept("please specify an action to do");
@@ -78,6 +110,20 @@ struct Cfg {
 			action = ACT_INSERT;
 		} else if (a == "select") {
 			action = ACT_SELECT;
+		} else if (a == "remove") {
+			action = ACT_REMOVE;
+		} else if (a == "scan") {
+			action = ACT_SCAN;
+		} else if (a == "load") {
+			action = ACT_LOAD;
+		} else if (a == "bench") {
+			action = ACT_BENCH;
+		} else if (a == "range") {
+			action = ACT_RANGE;
+		} else if (a == "prefix") {
+			action = ACT_PREFIX;
+		} else if (a == "stat") {
+			action = ACT_STAT;
 		} else {
 			throw TdbExcept("bad action: %s", a.c_str());
 		}
@@ -91,6 +137,16 @@ struct Cfg {
 					" inserted item");
 		if (action == ACT_INSERT && key == "*")
 			throw TdbExcept("please specify exact key");
+		if (action == ACT_REMOVE && (key.empty() || key == "*"))
+			throw TdbExcept("please specify key of removed items");
+		if (action == ACT_PREFIX && key.empty())
+			throw TdbExcept("please specify key prefix");
+		if (action == ACT_LOAD && file.empty())
+			throw TdbExcept("please specify file to load");
+		if (action == ACT_BENCH
+		    && (!bench.threads || !bench.keys || !bench.depth
+			|| bench.reads > 100))
+			throw TdbExcept("bad benchmark parameters");
 		if (table == "*" && action != ACT_INFO)
 			throw TdbExcept("please specify a table");
 		if (action == ACT_OPEN && db_path.empty())
@@ -104,6 +160,58 @@ struct Cfg {
 	}
 };
 
+static void
+print_rec(char *key, size_t klen, char *val, size_t vlen)
+{
+	std::cout << "'";
+	std::cout.write(key, klen);
+	std::cout << "' -> '";
+	std::cout.write(val, vlen);
+	std::cout << "'" << std::endl;
+}
+
+static void
+print_stat(const TdbStat &st)
+{
+	size_t n;
+
+	std::cout << "size:             " << st.size << std::endl
+		  << "max size:         " << st.max_size << std::endl
+		  << "used extents:     " << st.ext_used << std::endl
+		  << "used blocks:      " << st.blk_used << std::endl
+		  << "free blocks:      " << st.blk_free << std::endl
+		  << "free block runs:  " << st.free_runs << std::endl
+		  << "longest free run: " << st.free_run_max << std::endl
+		  << "index nodes:      " << st.nodes << std::endl
+		  << "buckets:          " << st.buckets << std::endl
+		  << "records:          " << st.recs << std::endl
+		  << "records bytes:    " << st.rec_bytes << std::endl
+		  << "blocks fill:      "
+		  << (st.blk_used ? st.rec_bytes * 100
+				    / (st.blk_used * getpagesize()) : 0)
+		  << "%" << std::endl;
+
+	for (n = TDB_STAT_DEPTH; n > 1 && !st.depth[n - 1]; --n)
+		;
+	std::cout << "buckets by depth:";
+	for (size_t i = 0; i < n; ++i)
+		std::cout << " " << st.depth[i];
+	std::cout << std::endl << "collision chains:";
+	for (size_t i = 0; i < TDB_STAT_CHAIN; ++i)
+		std::cout << " " << i + 1
+			  << (i == TDB_STAT_CHAIN - 1 ? "+" : "") << "="
+			  << st.chain[i];
+	std::cout << std::endl
+		  << "lookups:          " << st.lookups << ", "
+		  << st.lookup_rate << "/s, avg "
+		  << (st.lookups ? st.lookup_ns / st.lookups : 0) << " ns"
+		  << std::endl
+		  << "inserts:          " << st.inserts << ", "
+		  << st.insert_rate << "/s, avg "
+		  << (st.inserts ? st.insert_ns / st.inserts : 0) << " ns"
+		  << std::endl;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -122,9 +230,41 @@ main(int argc, char *argv[])
 		 "  open    - open and create a new table if necessary;\n"
 		 "  close   - close a table;\n"
 		 "  insert  - insert a record to a table;\n"
-		 "  select  - select from a table")
+		 "  select  - select from a table;\n"
+		 "  remove  - remove records with the key from a table;\n"
+		 "  scan    - print all records of a table mapped to memory,"
+		 " or only records with the key prefix if the key is"
+		 " specified, the table is specified by its full name from"
+		 " 'info';\n"
+		 "  load    - insert records from a file of lines"
+		 " '<key>\\t<value>', '-' for standard input;\n"
+		 "  bench   - run concurrent selects and inserts of random"
+		 " keys and report throughput and latencies;\n"
+		 "  range   - select records with keys from the key, if"
+		 " specified, and less than the 'to' key, if specified, in"
+		 " the order of the keys, the table must be opened with"
+		 " the ordered index;\n"
+		 "  prefix  - select records with the key prefix in the order"
+		 " of the keys, the table must be opened with the ordered"
+		 " index;\n"
+		 "  stat    - index depth, collision chains, blocks usage and"
+		 " operations rates and latencies of a table")
+		("depth", po::value<size_t>()->default_value(1),
+		 "Number of outstanding operations of each benchmark thread,"
+		 " pipelined by the asynchronous API if greater than 1")
+		("dist", po::value<std::string>()->default_value("uniform"),
+		 "Benchmark keys distribution: uniform or zipf")
+		("file,f", po::value<std::string>(), "File of records to load")
 		("key,k", po::value<std::string>(), "The record key")
+		("keys", po::value<size_t>()->default_value(10000),
+		 "Number of distinct benchmark keys")
+		("ops,o", po::value<size_t>()->default_value(100000),
+		 "Number of operations of each benchmark thread")
+		("ordered", "Maintain ordered index of the opened table for"
+		 " range and prefix selects")
 		("path,p", po::value<std::string>(), "Path to database files")
+		("reads", po::value<unsigned int>()->default_value(90),
+		 "Percentage of selects in the benchmark, the rest are inserts")
 		("rec_size,r", po::value<size_t>()->default_value(0),
 		 "Table record size. Specify this for fixed-size records"
 		 " (including key and data lengths plus 8 bytes)"
@@ -133,6 +273,12 @@ main(int argc, char *argv[])
 		 "The table to operate on or '*' for all tables")
 		("tbl_size,s", po::value<size_t>()->default_value(512),
 		 "Table size in pages")
+		("threads,n", po::value<unsigned int>()->default_value(1),
+		 "Number of benchmark threads")
+		("to", po::value<std::string>(),
+		 "The key to stop range select at, not included")
+		("val_size", po::value<size_t>()->default_value(64),
+		 "Size of benchmark values")
 		("value,v", po::value<std::string>(), "The record value");
 	try {
 		// Parse config options
@@ -164,7 +310,7 @@ main(int argc, char *argv[])
 			break;
 		case ACT_OPEN:
 			th.open_table(cfg.db_path, cfg.table, cfg.tbl_sz,
-				      cfg.rec_sz);
+				      cfg.rec_sz, cfg.ordered);
 			std::cout << "table " << cfg.table << " opened"
 				  << std::endl;
 			break;
@@ -184,17 +330,95 @@ main(int argc, char *argv[])
 			th.trx_commit();
 			break;
 		case ACT_SELECT:
-			th.query(cfg.table, cfg.key,
-				 [=](char *key, size_t klen,
-				     char *val, size_t vlen)
-				 {
+			th.query(cfg.table, cfg.key, print_rec);
+			break;
+		case ACT_RANGE:
+			th.range(cfg.table, cfg.key, cfg.to, print_rec);
+			break;
+		case ACT_PREFIX:
+			th.prefix(cfg.table, cfg.key, print_rec);
+			break;
+		case ACT_REMOVE:
+			th.remove(cfg.table, std::vector<std::string>{cfg.key});
+			break;
+		case ACT_STAT: {
+			TdbStat st;
+
+			th.get_stat(cfg.table, st);
+			print_stat(st);
+			break;
+		}
+		case ACT_SCAN: {
+			TdbMap tm(cfg.table);
+			size_t n = 0;
+			tm.for_each([&](unsigned long key, const char *data,
+					size_t len)
+				{
+					auto r = (const TdbMsgRec *)data;
+
+					if (!cfg.key.empty()
+					    && (len < sizeof(*r)
+						|| len < TDB_MSGREC_LEN(r)
+						|| r->klen < cfg.key.length()
+						|| cfg.key.compare(0,
+							cfg.key.length(),
+							r->data,
+							cfg.key.length())))
+						return;
+					++n;
+					std::cout << std::hex << key << std::dec
+						  << ": ";
+					if (len < sizeof(*r)
+					    || len < TDB_MSGREC_LEN(r))
+					{
+						std::cout << len << " bytes"
+							  << std::endl;
+						return;
+					}
 					std::cout << "'";
-					std::cout.write(key, klen);
+					std::cout.write(r->data, r->klen);
 					std::cout << "' -> '";
-					std::cout.write(val, vlen);
+					std::cout.write(TDB_MSGREC_DATA(r),
+							r->dlen);
 					std::cout << "'" << std::endl;
-				 });
+				});
+			std::cout << n << " records" << std::endl;
+			return 0;
+		}
+		case ACT_LOAD: {
+			std::ifstream f;
+			std::istream &in = cfg.file == "-" ? std::cin : f;
+			std::string line;
+			size_t n = 0;
+
+			if (cfg.file != "-") {
+				f.open(cfg.file);
+				if (!f)
+					throw TdbExcept("cannot open %s",
+							cfg.file.c_str());
+			}
+			th.trx_begin();
+			while (std::getline(in, line)) {
+				size_t sep = line.find('\t'), vlen;
+
+				++n;
+				if (!sep || sep == std::string::npos)
+					throw TdbExcept("bad record at line"
+							" %lu", n);
+				vlen = line.length() - sep - 1;
+				th.insert(cfg.table, sep, vlen,
+					  [&] (char *key, char *val)
+					  {
+						line.copy(key, sep);
+						line.copy(val, vlen, sep + 1);
+					  });
+			}
+			th.trx_commit();
 			break;
+		}
+		case ACT_BENCH:
+			bench(cfg.table, cfg.bench);
+			return 0;
 		default:
 			throw TdbExcept("bad action number %d", cfg.action);
 		}
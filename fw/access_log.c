@@ -0,0 +1,349 @@
+/**
+ *		Tempesta FW
+ *
+ * Access log of the sent responses, see access_log_if.h for the interface.
+ *
+ * The rings of all the CPUs are allocated as a set which is replaced as
+ * a whole if the ring size is reconfigured. Each open file of the device
+ * holds a reference to the set, and each mapping holds the file, so the
+ * rings live while a shipper can read them. The softirqs take records
+ * under RCU and a ring has the only writer: the CPU which owns it with
+ * bottom halves disabled.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <linux/fs.h>
+#include <linux/kref.h>
+#include <linux/log2.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+
+#include "access_log.h"
+#include "cfg.h"
+#include "client.h"
+#include "log.h"
+#include "server.h"
+
+/* Maximum number of records in a ring. */
+#define TFW_ALOG_REC_MAX	(1 << 20)
+
+/**
+ * @kref	- References by the running configuration and open files;
+ * @size	- Size of a ring with the header;
+ * @rec_n	- Number of records in a ring;
+ * @ring	- Rings of the possible CPUs.
+ */
+typedef struct {
+	struct kref	kref;
+	unsigned long	size;
+	unsigned int	rec_n;
+	TfwAccLogHdr	*ring[];
+} TfwAccLog;
+
+DEFINE_STATIC_KEY_FALSE(tfw_alog_enabled);
+
+static TfwAccLog __rcu *tfw_alog;
+/* Serializes the rings replacement with opening of the device. */
+static DEFINE_MUTEX(tfw_alog_mtx);
+static int tfw_alog_rec_n_reconfig;
+
+static void
+tfw_alog_release(struct kref *kref)
+{
+	TfwAccLog *alog = container_of(kref, TfwAccLog, kref);
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		vfree(alog->ring[cpu]);
+	kfree(alog);
+}
+
+static TfwAccLog *
+tfw_alog_alloc(unsigned int rec_n)
+{
+	TfwAccLog *alog;
+	int cpu;
+
+	BUILD_BUG_ON(sizeof(TfwAccLogHdr) > TFW_ALOG_HDR_SZ);
+
+	alog = kzalloc(struct_size(alog, ring, nr_cpu_ids), GFP_KERNEL);
+	if (!alog)
+		return NULL;
+	kref_init(&alog->kref);
+	alog->rec_n = rec_n;
+	alog->size = PAGE_ALIGN(TFW_ALOG_HDR_SZ
+				+ (unsigned long)rec_n * sizeof(TfwAccLogRec));
+
+	for_each_possible_cpu(cpu) {
+		TfwAccLogHdr *hdr;
+
+		/* Zeroed and suitable for remap_vmalloc_range(). */
+		if (!(hdr = vmalloc_user(alog->size))) {
+			kref_put(&alog->kref, tfw_alog_release);
+			return NULL;
+		}
+		hdr->magic = TFW_ALOG_MAGIC;
+		hdr->version = TFW_ALOG_VERSION;
+		hdr->size = alog->size;
+		hdr->rec_len = sizeof(TfwAccLogRec);
+		hdr->rec_n = rec_n;
+		hdr->cpu_n = nr_cpu_ids;
+		alog->ring[cpu] = hdr;
+	}
+
+	return alog;
+}
+
+/**
+ * Replace the current rings by @alog and release the old ones. The shippers
+ * still can drain the old rings until they close the device.
+ */
+static void
+tfw_alog_replace(TfwAccLog *alog)
+{
+	TfwAccLog *old;
+	int cpu;
+
+	mutex_lock(&tfw_alog_mtx);
+	old = rcu_dereference_protected(tfw_alog,
+					lockdep_is_held(&tfw_alog_mtx));
+	rcu_assign_pointer(tfw_alog, alog);
+	mutex_unlock(&tfw_alog_mtx);
+
+	if (!old)
+		return;
+	synchronize_rcu();
+	for_each_possible_cpu(cpu)
+		WRITE_ONCE(old->ring[cpu]->flags, TFW_ALOG_F_CLOSED);
+	kref_put(&old->kref, tfw_alog_release);
+}
+
+void
+__tfw_access_log(TfwHttpReq *req, TfwHttpResp *resp, unsigned long bytes)
+{
+	TfwAccLog *alog;
+	TfwAccLogHdr *hdr;
+	TfwAccLogRec *rec;
+	const TfwAddr *addr;
+	u64 head;
+
+	rcu_read_lock_bh();
+
+	if (unlikely(!(alog = rcu_dereference_bh(tfw_alog))))
+		goto out;
+	hdr = alog->ring[smp_processor_id()];
+	head = hdr->head;
+	/* Pairs with the release of @tail by the shipper. */
+	if (head - smp_load_acquire(&hdr->tail) >= alog->rec_n) {
+		WRITE_ONCE(hdr->drops, hdr->drops + 1);
+		goto out;
+	}
+	rec = (TfwAccLogRec *)((char *)hdr + TFW_ALOG_HDR_SZ)
+	      + (head & (alog->rec_n - 1));
+
+	rec->ts = ktime_get_real_ns();
+	addr = &req->conn->peer->addr;
+	memcpy(rec->client, &addr->sin6_addr, sizeof(rec->client));
+	rec->client_port = ntohs(addr->sin6_port);
+	if (resp->conn && (TFW_CONN_TYPE(resp->conn) & Conn_Srv)) {
+		addr = &resp->conn->peer->addr;
+		memcpy(rec->upstream, &addr->sin6_addr, sizeof(rec->upstream));
+		rec->upstream_port = ntohs(addr->sin6_port);
+		rec->srv_time = jiffies_to_usecs(resp->jsrvtime);
+	} else {
+		memset(rec->upstream, 0, sizeof(rec->upstream));
+		rec->upstream_port = 0;
+		rec->srv_time = 0;
+	}
+	rec->status = resp->status;
+	rec->method = req->method;
+	rec->version = req->version;
+	rec->bytes = bytes;
+	rec->req_time = jiffies_to_usecs(jiffies - req->jrxtstamp);
+	if (req->vhost)
+		strncpy(rec->vhost, req->vhost->name.data, sizeof(rec->vhost));
+	else
+		memset(rec->vhost, 0, sizeof(rec->vhost));
+
+	/* Publish the record, pairs with the acquire by the shipper. */
+	smp_store_release(&hdr->head, head + 1);
+out:
+	rcu_read_unlock_bh();
+}
+
+/*
+ * ------------------------------------------------------------------------
+ *	User-space interface
+ * ------------------------------------------------------------------------
+ */
+static int
+tfw_alog_dev_open(struct inode *inode, struct file *filp)
+{
+	TfwAccLog *alog;
+
+	mutex_lock(&tfw_alog_mtx);
+	alog = rcu_dereference_protected(tfw_alog,
+					 lockdep_is_held(&tfw_alog_mtx));
+	if (alog)
+		kref_get(&alog->kref);
+	mutex_unlock(&tfw_alog_mtx);
+
+	if (!alog)
+		return -ENODATA;
+	filp->private_data = alog;
+
+	return 0;
+}
+
+/**
+ * Map the ring of the CPU selected by the offset. The shipper writes @tail,
+ * so the mapping is writable.
+ */
+static int
+tfw_alog_dev_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	TfwAccLog *alog = filp->private_data;
+	unsigned long pages = alog->size >> PAGE_SHIFT;
+	unsigned long cpu = vma->vm_pgoff / pages;
+
+	if (vma->vm_pgoff % pages || vma->vm_end - vma->vm_start > alog->size)
+		return -EINVAL;
+	if (cpu >= nr_cpu_ids || !cpu_possible(cpu))
+		return -ENXIO;
+
+	return remap_vmalloc_range(vma, alog->ring[cpu], 0);
+}
+
+static int
+tfw_alog_dev_release(struct inode *inode, struct file *filp)
+{
+	TfwAccLog *alog = filp->private_data;
+
+	kref_put(&alog->kref, tfw_alog_release);
+
+	return 0;
+}
+
+static const struct file_operations tfw_alog_dev_fops = {
+	.owner		= THIS_MODULE,
+	.open		= tfw_alog_dev_open,
+	.mmap		= tfw_alog_dev_mmap,
+	.release	= tfw_alog_dev_release,
+};
+
+static struct miscdevice tfw_alog_dev = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= TFW_ALOG_DEV_NAME,
+	.fops		= &tfw_alog_dev_fops,
+	.mode		= 0600,
+};
+
+/*
+ * ------------------------------------------------------------------------
+ *	Configuration
+ * ------------------------------------------------------------------------
+ */
+static int
+tfw_alog_start(void)
+{
+	TfwAccLog *alog, *cur;
+	unsigned int rec_n = 0;
+
+	if (tfw_alog_rec_n_reconfig)
+		rec_n = roundup_pow_of_two(tfw_alog_rec_n_reconfig);
+
+	rcu_read_lock();
+	cur = rcu_dereference(tfw_alog);
+	alog = cur && cur->rec_n == rec_n ? cur : NULL;
+	rcu_read_unlock();
+
+	if (!rec_n) {
+		static_branch_disable(&tfw_alog_enabled);
+		tfw_alog_replace(NULL);
+		return 0;
+	}
+	if (!alog) {
+		if (!(alog = tfw_alog_alloc(rec_n))) {
+			T_ERR_NL("access_log: cannot allocate %u records per"
+				 " CPU\n", rec_n);
+			return -ENOMEM;
+		}
+		tfw_alog_replace(alog);
+	}
+	static_branch_enable(&tfw_alog_enabled);
+
+	return 0;
+}
+
+/**
+ * Keep the rings on stop, so the shipper can read the last records.
+ */
+static void
+tfw_alog_stop(void)
+{
+	static_branch_disable(&tfw_alog_enabled);
+}
+
+static TfwCfgSpec tfw_alog_specs[] = {
+	{
+		.name = "access_log_buffer",
+		.deflt = "0",
+		.handler = tfw_cfg_set_int,
+		.dest = &tfw_alog_rec_n_reconfig,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, TFW_ALOG_REC_MAX },
+		},
+		.allow_reconfig = true,
+	},
+	{ 0 }
+};
+
+TfwMod tfw_access_log_mod = {
+	.name	= "access_log",
+	.start	= tfw_alog_start,
+	.stop	= tfw_alog_stop,
+	.specs	= tfw_alog_specs,
+};
+
+/*
+ * ------------------------------------------------------------------------
+ *	Init/exit routines.
+ * ------------------------------------------------------------------------
+ */
+int
+tfw_access_log_init(void)
+{
+	int r;
+
+	if ((r = misc_register(&tfw_alog_dev))) {
+		T_ERR_NL("access_log: cannot register /dev/%s\n",
+			 TFW_ALOG_DEV_NAME);
+		return r;
+	}
+	tfw_mod_register(&tfw_access_log_mod);
+
+	return 0;
+}
+
+void
+tfw_access_log_exit(void)
+{
+	tfw_mod_unregister(&tfw_access_log_mod);
+	misc_deregister(&tfw_alog_dev);
+	tfw_alog_replace(NULL);
+}
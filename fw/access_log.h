@@ -0,0 +1,43 @@
+/**
+ *		Tempesta FW
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __TFW_ACCESS_LOG_H__
+#define __TFW_ACCESS_LOG_H__
+
+#include <linux/jump_label.h>
+
+#include "access_log_if.h"
+#include "http.h"
+
+DECLARE_STATIC_KEY_FALSE(tfw_alog_enabled);
+
+void __tfw_access_log(TfwHttpReq *req, TfwHttpResp *resp, unsigned long bytes);
+
+/**
+ * Log @resp of @bytes length sent to the client of @req. The call is patched
+ * out if the access log isn't configured.
+ */
+static inline void
+tfw_access_log(TfwHttpReq *req, TfwHttpResp *resp, unsigned long bytes)
+{
+	if (static_branch_unlikely(&tfw_alog_enabled))
+		__tfw_access_log(req, resp, bytes);
+}
+
+#endif /* __TFW_ACCESS_LOG_H__ */
@@ -0,0 +1,114 @@
+/**
+ *		Tempesta FW
+ *
+ * Access log ring buffers shared with user space.
+ *
+ * Each CPU writes fixed-size records of the sent responses to its own ring,
+ * so there is no locking between the CPUs, and a user-space shipper maps
+ * the rings of /dev/tempesta_log and reads the records in place. The ring
+ * of CPU N starts at offset N * @size of the device, where @size is from
+ * the header of the first ring.
+ *
+ * The kernel is the only writer of @head and @drops, the shipper is the only
+ * writer of @tail. Records in [@tail, @head) are ready to read: the shipper
+ * reads @head with acquire semantics, processes the records and then
+ * advances @tail with release semantics. If the ring is full, a record is
+ * dropped and @drops is incremented, so a slow shipper never slows down
+ * the traffic processing.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __TFW_ACCESS_LOG_IF_H__
+#define __TFW_ACCESS_LOG_IF_H__
+
+#include <linux/types.h>
+
+#define TFW_ALOG_DEV_NAME	"tempesta_log"
+#define TFW_ALOG_MAGIC		0x474f4c54	/* "TLOG" */
+#define TFW_ALOG_VERSION	1
+/* Records start at this offset from the ring beginning. */
+#define TFW_ALOG_HDR_SZ		4096
+#define TFW_ALOG_VHOST_LEN	32
+
+/*
+ * The rings were replaced on reconfiguration and aren't written any more,
+ * the shipper must drain them and reopen the device.
+ */
+#define TFW_ALOG_F_CLOSED	0x0001
+
+/**
+ * Ring header. @tail is on its own cache line to not bounce the line with
+ * @head between the CPUs of the kernel and the shipper.
+ *
+ * @magic	- TFW_ALOG_MAGIC;
+ * @version	- TFW_ALOG_VERSION;
+ * @size	- Size of the ring with the header, multiple of the page size;
+ * @rec_len	- Size of a record;
+ * @rec_n	- Number of records in the ring, a power of two;
+ * @cpu_n	- Number of the rings, i.e. the possible CPUs;
+ * @flags	- TFW_ALOG_F_* flags;
+ * @head	- Number of records ever written to the ring;
+ * @drops	- Number of records dropped because the ring was full;
+ * @tail	- Number of records ever read from the ring.
+ */
+typedef struct {
+	__u32		magic;
+	__u32		version;
+	__u64		size;
+	__u32		rec_len;
+	__u32		rec_n;
+	__u32		cpu_n;
+	__u32		flags;
+	__u64		head;
+	__u64		drops;
+	__u64		tail __attribute__((aligned(64)));
+} TfwAccLogHdr;
+
+/**
+ * Record of a response sent to a client.
+ *
+ * @ts		- Send time, nanoseconds since the Epoch;
+ * @client	- IPv6 or IPv4-mapped client address;
+ * @upstream	- Address of the server which has sent the response, zeroes
+ *		  if the response was built by Tempesta, e.g. from the cache;
+ * @client_port	- Client port in host byte order;
+ * @upstream_port - Server port in host byte order;
+ * @status	- Response status code;
+ * @method	- Request method, TFW_HTTP_METH_* of http.h;
+ * @version	- Request HTTP version, TFW_HTTP_VER_* of http.h;
+ * @bytes	- Size of the response on the wire;
+ * @req_time	- Microseconds from the request receipt to the response send;
+ * @srv_time	- Microseconds from the request forwarding to the first byte
+ *		  of the response, zero for responses built by Tempesta;
+ * @vhost	- Virtual host name, truncated and not terminated if it's long.
+ */
+typedef struct {
+	__u64		ts;
+	__u8		client[16];
+	__u8		upstream[16];
+	__u16		client_port;
+	__u16		upstream_port;
+	__u16		status;
+	__u8		method;
+	__u8		version;
+	__u64		bytes;
+	__u32		req_time;
+	__u32		srv_time;
+	char		vhost[TFW_ALOG_VHOST_LEN];
+} TfwAccLogRec;
+
+#endif /* __TFW_ACCESS_LOG_IF_H__ */
@@ -19,6 +19,8 @@
  * Prototype for fast percentiles calculation.
  */
 #include <linux/atomic.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
 #include <linux/kernel.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
@@ -31,6 +33,7 @@
 #include "lib/str.h"
 #include "apm.h"
 #include "cfg.h"
+#include "cpu_role.h"
 #include "log.h"
 #include "pool.h"
 #include "procfs.h"
@@ -378,6 +381,58 @@ totals:
 	return;
 }
 
+/*
+ * Mergeable latency sketch.
+ *
+ * The ranges above give rough percentiles only, especially for the tail.
+ * The sketch is a log-bucketed (HDR-style) histogram: each power of two
+ * range of response times is split into TFW_APM_SK_SUB linear buckets, so
+ * the relative error of a percentile is within 1 / TFW_APM_SK_SUB for any
+ * response time, while the memory is fixed. Each CPU updates its own
+ * histogram of monotonic counters without any locks or resets, and the APM
+ * timer merges the per-CPU histograms by the counter deltas.
+ */
+#define TFW_APM_SK_SUB_BITS	4
+#define TFW_APM_SK_SUB		(1 << TFW_APM_SK_SUB_BITS)
+#define TFW_APM_SK_MAX_ORDER	20	/* up to 17 minutes */
+#define TFW_APM_SK_BCKTS	\
+	((TFW_APM_SK_MAX_ORDER - TFW_APM_SK_SUB_BITS + 1) * TFW_APM_SK_SUB)
+
+typedef struct {
+	unsigned int	cnt[TFW_APM_SK_BCKTS];
+} TfwApmSketch;
+
+static inline unsigned int
+tfw_apm_sk_bucket(unsigned int r_time)
+{
+	unsigned int o;
+
+	if (r_time < TFW_APM_SK_SUB)
+		return r_time;
+	o = fls(r_time) - 1;
+	if (unlikely(o >= TFW_APM_SK_MAX_ORDER))
+		return TFW_APM_SK_BCKTS - 1;
+
+	return (o - TFW_APM_SK_SUB_BITS + 1) * TFW_APM_SK_SUB
+	       + ((r_time >> (o - TFW_APM_SK_SUB_BITS)) & (TFW_APM_SK_SUB - 1));
+}
+
+/*
+ * The middle response time of bucket @b.
+ */
+static inline unsigned int
+tfw_apm_sk_value(unsigned int b)
+{
+	unsigned int shift;
+
+	if (b < 2 * TFW_APM_SK_SUB)
+		return b;
+	shift = b / TFW_APM_SK_SUB - 1;
+
+	return ((TFW_APM_SK_SUB + b % TFW_APM_SK_SUB) << shift)
+	       + (1 << (shift - 1));
+}
+
 /* Time granularity for HTTP codes accounting during health monitoring. */
 #define HM_FREQ		10
 
@@ -461,6 +516,10 @@ typedef struct {
  * @jtmstamp	- time in jiffies of last @timer call (for procfs);
  * @timer	- timer for sending health monitoring request;
  * @rearm	- flag for graceful stopping of @timer;
+ * @probe	- ring of controllers of the servers with the same address and
+ *		  health monitor, which share the health monitoring requests;
+ * @hentry	- entry in @tfw_hm_probes if the server is the probe leader;
+ * @leader	- the server sends health monitoring requests for the ring;
  */
 typedef struct {
 	TfwApmHM		*hm;
@@ -469,6 +528,9 @@ typedef struct {
 	unsigned long		jtmstamp;
 	struct timer_list	timer;
 	atomic_t		rearm;
+	struct list_head	probe;
+	struct hlist_node	hentry;
+	bool			leader;
 } TfwApmHMCtl;
 
 /* Entry for configuration of separate health monitors. */
@@ -483,6 +545,18 @@ static unsigned int		tfw_hm_codes_cnt;
 static LIST_HEAD(tfw_hm_list);
 static LIST_HEAD(tfw_hm_codes_list);
 
+/*
+ * The same backend server is often listed in many server groups, e.g. one
+ * per tenant. Servers with the same address and health monitor share the
+ * health monitoring requests: only the probe leader sends them, and a good
+ * response marks all the servers alive. The leaders are hashed by the
+ * address and the health monitor.
+ */
+#define TFW_HM_PROBE_HBITS	10
+
+static DEFINE_HASHTABLE(tfw_hm_probes, TFW_HM_PROBE_HBITS);
+static DEFINE_SPINLOCK(tfw_hm_probe_lock);
+
 /*
  * APM ring buffer.
  *
@@ -621,6 +695,17 @@ typedef struct {
  * @ubuf	- The buffer that holds data for updates, per CPU.
  * @timer	- The periodic timer handle.
  * @flags	- The atomic flags (see below).
+ * @qtime	- The total time requests spent in Tempesta before they were
+ *		  forwarded to the server, in milliseconds.
+ * @qcnt	- The number of requests accounted in @qtime.
+ * @sk		- The latency sketch, per CPU.
+ * @sk_last	- Sum of @sk counters at the last merge.
+ * @sk_win	- Merged sketch counters for the previous and the current
+ *		  time windows.
+ * @sk_cur	- Index of the current time window in @sk_win.
+ * @sk_jtmwstamp - The start of the current time window.
+ * @sk_val	- The latest tail percentiles from the sketch.
+ * @load	- EWMA of the load reported by the server, 1/256 of percent.
  */
 #define TFW_APM_DATA_F_REARM	(0x0001)	/* Re-arm the timer. */
 
@@ -635,6 +720,9 @@ typedef struct {
 
 #define TFW_APM_MIN_TMINTRVL	5	/* Minimum time interval (secs). */
 
+#define TFW_APM_LOAD_HDR_MAX	64	/* Maximum header name length. */
+#define TFW_APM_LOAD_SHIFT	8	/* Fixed point of the load EWMA. */
+
 #define TFW_APM_HM_AUTO		"auto"
 #define TFW_APM_DFLT_REQ	"\"GET / HTTTP/1.0\r\n\r\n\""
 #define TFW_APM_DFLT_URL	"\"/\""
@@ -648,6 +736,15 @@ typedef struct {
 	struct timer_list	timer;
 	unsigned long		flags;
 	TfwApmHMCtl		hmctl;
+	atomic64_t		qtime;
+	atomic64_t		qcnt;
+	TfwApmSketch __percpu	*sk;
+	unsigned int		sk_last[TFW_APM_SK_BCKTS];
+	unsigned int		sk_win[2][TFW_APM_SK_BCKTS];
+	unsigned int		sk_cur;
+	unsigned long		sk_jtmwstamp;
+	unsigned int		sk_val[TFW_APM_SK_PSZ];
+	unsigned int		load;
 } TfwApmData;
 
 /*
@@ -665,6 +762,16 @@ static int tfw_apm_jtmwindow;		/* Time window in jiffies. */
 static int tfw_apm_jtmintrvl;		/* Time interval in jiffies. */
 static int tfw_apm_tmwscale;		/* Time window scale. */
 
+/*
+ * The response header, in which servers report their load, the load
+ * smoothing factor and the load weight in the server response time,
+ * both in percents.
+ */
+static char tfw_apm_load_name[TFW_APM_LOAD_HDR_MAX];
+static TfwStr tfw_apm_load_str = { .data = tfw_apm_load_name };
+static unsigned int tfw_apm_load_alpha;
+static unsigned int tfw_apm_load_weight;
+
 /*
  * Get the next bucket in the ring buffer entry that has a non-zero
  * hits count. Set the bucket's sequential number, the range number,
@@ -978,6 +1085,74 @@ tfw_apm_pstats_verify(TfwPrcntlStats *pstats)
 	return 0;
 }
 
+/*
+ * Merge the per-CPU sketches and calculate the tail percentiles.
+ *
+ * The percentiles are for a sliding time window approximated by two fixed
+ * windows: the previous window is accounted with the weight of its part
+ * which is still in the sliding window.
+ */
+static void
+tfw_apm_sk_calc(TfwApmData *data)
+{
+	int b, icpu, p = 0;
+	unsigned int sum, *cur, *prev;
+	unsigned long elapsed, jtmnow = jiffies;
+	u64 total = 0, cnt = 0, pval;
+
+	if (jtmnow - data->sk_jtmwstamp >= tfw_apm_jtmwindow) {
+		data->sk_cur ^= 1;
+		memset(data->sk_win[data->sk_cur], 0,
+		       sizeof(data->sk_win[0]));
+		data->sk_jtmwstamp = jtmnow;
+	}
+	cur = data->sk_win[data->sk_cur];
+	prev = data->sk_win[data->sk_cur ^ 1];
+
+	for (b = 0; b < TFW_APM_SK_BCKTS; ++b) {
+		sum = 0;
+		for_each_possible_cpu(icpu)
+			sum += READ_ONCE(per_cpu_ptr(data->sk, icpu)->cnt[b]);
+		/* Unsigned arithmetic handles the counters wrapping. */
+		cur[b] += sum - data->sk_last[b];
+		data->sk_last[b] = sum;
+	}
+
+	elapsed = jtmnow - data->sk_jtmwstamp;
+	for (b = 0; b < TFW_APM_SK_BCKTS; ++b)
+		total += (u64)cur[b] * tfw_apm_jtmwindow
+			 + (u64)prev[b] * (tfw_apm_jtmwindow - elapsed);
+	if (!total) {
+		memset(data->sk_val, 0, sizeof(data->sk_val));
+		return;
+	}
+
+	for (b = 0; b < TFW_APM_SK_BCKTS && p < TFW_APM_SK_PSZ; ++b) {
+		cnt += (u64)cur[b] * tfw_apm_jtmwindow
+		       + (u64)prev[b] * (tfw_apm_jtmwindow - elapsed);
+		for ( ; p < TFW_APM_SK_PSZ; ++p) {
+			pval = div_u64(total * tfw_apm_sk_ith[p], 10000);
+			if (cnt < pval)
+				break;
+			WRITE_ONCE(data->sk_val[p], tfw_apm_sk_value(b));
+		}
+	}
+}
+
+/*
+ * Get the latest tail percentiles from the latency sketch, see
+ * tfw_apm_sk_ith[] for the percentiles list.
+ */
+void
+tfw_apm_sketch_stats(void *apmref, unsigned int *val)
+{
+	TfwApmData *data = apmref;
+	int i;
+
+	for (i = 0; i < TFW_APM_SK_PSZ; ++i)
+		val[i] = READ_ONCE(data->sk_val[i]);
+}
+
 /*
  * Calculate the latest percentiles if necessary.
  * Runs periodically on timer.
@@ -1011,10 +1186,101 @@ tfw_apm_prcntl_tmfn(struct timer_list *t)
 		}
 	}
 	tfw_apm_calc(data);
+	tfw_apm_sk_calc(data);
 
 	smp_mb();
 	if (test_bit(TFW_APM_DATA_F_REARM, &data->flags))
-		mod_timer(&data->timer, jiffies + TFW_APM_TIMER_INTVL);
+		tfw_cpu_role_timer(&data->timer,
+				   jiffies + TFW_APM_TIMER_INTVL);
+}
+
+static inline TfwServer *
+tfw_apm_hm_srv(TfwApmHMCtl *hmctl)
+{
+	return container_of(hmctl, TfwApmData, hmctl)->srv;
+}
+
+static inline u32
+tfw_apm_hm_probe_key(TfwServer *srv, TfwApmHM *hm)
+{
+	return jhash(&srv->addr.sin6_addr, sizeof(srv->addr.sin6_addr),
+		     srv->addr.sin6_port ^ (u32)(unsigned long)hm);
+}
+
+/*
+ * Add the server of @hmctl to the probe with the same address and health
+ * monitor, or make it the leader of a new probe.
+ */
+static void
+tfw_apm_hm_probe_join(TfwApmHMCtl *hmctl)
+{
+	TfwApmHMCtl *pos;
+	TfwServer *srv = tfw_apm_hm_srv(hmctl);
+	u32 key = tfw_apm_hm_probe_key(srv, hmctl->hm);
+
+	spin_lock_bh(&tfw_hm_probe_lock);
+	hash_for_each_possible(tfw_hm_probes, pos, hentry, key) {
+		if (pos->hm == hmctl->hm
+		    && tfw_addr_eq(&tfw_apm_hm_srv(pos)->addr, &srv->addr))
+		{
+			list_add_tail(&hmctl->probe, &pos->probe);
+			goto out;
+		}
+	}
+	hmctl->leader = true;
+	hash_add(tfw_hm_probes, &hmctl->hentry, key);
+out:
+	spin_unlock_bh(&tfw_hm_probe_lock);
+}
+
+/*
+ * Remove the server of @hmctl from its probe. If the server is the leader,
+ * then the next server in the ring takes over the health monitoring.
+ */
+static void
+tfw_apm_hm_probe_leave(TfwApmHMCtl *hmctl)
+{
+	TfwApmHMCtl *next;
+	u32 key;
+
+	spin_lock_bh(&tfw_hm_probe_lock);
+	if (hmctl->leader) {
+		hash_del(&hmctl->hentry);
+		hmctl->leader = false;
+		if (!list_empty(&hmctl->probe)) {
+			next = list_first_entry(&hmctl->probe, TfwApmHMCtl,
+						probe);
+			key = tfw_apm_hm_probe_key(tfw_apm_hm_srv(next),
+						   next->hm);
+			next->leader = true;
+			hash_add(tfw_hm_probes, &next->hentry, key);
+		}
+	}
+	list_del_init(&hmctl->probe);
+	spin_unlock_bh(&tfw_hm_probe_lock);
+}
+
+/*
+ * Tell if a health monitoring request must be sent to the server of
+ * @hmctl: the server is the probe leader and no server of the probe got
+ * requests to the monitored URL during the last period. Counters of the
+ * other servers are reset by their own timers, so this is approximate.
+ */
+static bool
+tfw_apm_hm_probe_send(TfwApmHMCtl *hmctl)
+{
+	TfwApmHMCtl *pos;
+	bool send;
+
+	spin_lock_bh(&tfw_hm_probe_lock);
+	if ((send = hmctl->leader)) {
+		send = !atomic64_read(&hmctl->rcount);
+		list_for_each_entry(pos, &hmctl->probe, probe)
+			send = send && !atomic64_read(&pos->rcount);
+	}
+	spin_unlock_bh(&tfw_hm_probe_lock);
+
+	return send;
 }
 
 /*
@@ -1031,7 +1297,7 @@ tfw_apm_hm_timer_cb(struct timer_list *t)
 	unsigned long now;
 
 	BUG_ON(!hm);
-	if (!atomic64_read(&apmdata->hmctl.rcount))
+	if (tfw_apm_hm_probe_send(hmctl))
 		tfw_http_hm_srv_send(srv, hm->req, hm->reqsz);
 
 	atomic64_set(&apmdata->hmctl.rcount, 0);
@@ -1039,7 +1305,8 @@ tfw_apm_hm_timer_cb(struct timer_list *t)
 	smp_mb();
 	if (atomic_read(&apmdata->hmctl.rearm)) {
 		now = jiffies;
-		mod_timer(&apmdata->hmctl.timer, now + hm->tmt * HZ);
+		tfw_cpu_role_timer(&apmdata->hmctl.timer,
+				   now + hm->tmt * HZ);
 		WRITE_ONCE(apmdata->hmctl.jtmstamp, now);
 		return;
 	}
@@ -1058,6 +1325,8 @@ __tfw_apm_update(TfwApmData *data, unsigned long jtstamp, unsigned int rtt)
 
 	tfw_apm_rbent_checkreset(&data->rbuf.rbent[centry], jtmistart);
 	WRITE_ONCE(ubent[jtstamp % ubuf->ubufsz].data, rtt_data.data);
+
+	this_cpu_inc(data->sk->cnt[tfw_apm_sk_bucket(rtt)]);
 }
 
 void
@@ -1067,6 +1336,93 @@ tfw_apm_update(void *apmref, unsigned long jtstamp, unsigned long jrtt)
 	__tfw_apm_update(apmref, jtstamp, jiffies_to_msecs(jrtt));
 }
 
+/*
+ * Account the time @jqtime a request spent in Tempesta, i.e. in parsing and
+ * in the forwarding queues, before it was forwarded to the server. The time
+ * isn't a part of the server response time used for load balancing.
+ */
+void
+tfw_apm_update_qtime(void *apmref, unsigned long jqtime)
+{
+	TfwApmData *data = apmref;
+
+	BUG_ON(!apmref);
+	atomic64_add(jiffies_to_msecs(jqtime), &data->qtime);
+	atomic64_inc(&data->qcnt);
+}
+
+/*
+ * Average time requests spent in Tempesta before forwarding, in milliseconds.
+ */
+unsigned int
+tfw_apm_qtime(void *apmref)
+{
+	TfwApmData *data = apmref;
+	s64 cnt = atomic64_read(&data->qcnt);
+
+	return cnt ? div64_s64(atomic64_read(&data->qtime), cnt) : 0;
+}
+
+/*
+ * The latest calculated average server response time, in milliseconds.
+ * Lockless and cheap enough for per-request scheduling decisions: a racing
+ * percentiles recalculation may only give us the previous value.
+ */
+unsigned int
+tfw_apm_rtime(void *apmref)
+{
+	TfwApmData *data = apmref;
+	unsigned int rdidx = atomic_read(&data->stats.rdidx);
+
+	return READ_ONCE(data->stats.asent[rdidx % 2]
+				.pstats.val[TFW_PSTATS_IDX_AVG]);
+}
+
+/*
+ * The response header carrying the server load, or NULL if the load
+ * feedback isn't configured.
+ */
+const TfwStr *
+tfw_apm_load_hdr(void)
+{
+	return READ_ONCE(tfw_apm_load_str.len) ? &tfw_apm_load_str : NULL;
+}
+
+/*
+ * Account the @load, in percents, reported by the server in a response.
+ * Concurrent updates from different CPUs may lose one of the samples, which
+ * doesn't matter for the moving average.
+ */
+void
+tfw_apm_update_load(void *apmref, unsigned int load)
+{
+	TfwApmData *data = apmref;
+	int old = READ_ONCE(data->load);
+	int cur = min(load, 100U) << TFW_APM_LOAD_SHIFT;
+	int alpha = tfw_apm_load_alpha;
+
+	BUG_ON(!apmref);
+	WRITE_ONCE(data->load, old + (cur - old) * alpha / 100);
+}
+
+/*
+ * Raise the server response time @rtime by the reported server load, so
+ * a saturated server gets less requests before its response time grows.
+ * The fully loaded server looks slower by the configured weight percents.
+ */
+unsigned int
+tfw_apm_load_adjust(void *apmref, unsigned int rtime)
+{
+	TfwApmData *data = apmref;
+	u64 add;
+
+	if (!tfw_apm_load_hdr())
+		return rtime;
+	add = (u64)rtime * READ_ONCE(data->load) * tfw_apm_load_weight;
+
+	return rtime + div_u64(add, 100 * 100 << TFW_APM_LOAD_SHIFT);
+}
+
 static void
 tfw_apm_destroy(TfwApmData *data)
 {
@@ -1077,6 +1433,7 @@ tfw_apm_destroy(TfwApmData *data)
 		kfree(ubuf->ubent[0]);
 	}
 	free_percpu(data->ubuf);
+	free_percpu(data->sk);
 	kfree(data);
 }
 
@@ -1127,6 +1484,14 @@ tfw_apm_create(void)
 		kfree(data);
 		return NULL;
 	}
+	data->sk = alloc_percpu(TfwApmSketch);
+	if (!data->sk) {
+		free_percpu(data->ubuf);
+		kfree(data);
+		return NULL;
+	}
+	data->sk_jtmwstamp = jiffies;
+	INIT_LIST_HEAD(&data->hmctl.probe);
 
 	/* Set up memory areas. */
 	rbent = (TfwApmRBEnt *)(data + 1);
@@ -1200,8 +1565,8 @@ tfw_apm_add_srv(TfwServer *srv)
 
 	/* Start the timer for the percentile calculation. */
 	set_bit(TFW_APM_DATA_F_REARM, &data->flags);
-	timer_setup(&data->timer, tfw_apm_prcntl_tmfn, 0);
-	mod_timer(&data->timer, jiffies + TFW_APM_TIMER_INTVL);
+	timer_setup(&data->timer, tfw_apm_prcntl_tmfn, TIMER_PINNED);
+	tfw_cpu_role_timer(&data->timer, jiffies + TFW_APM_TIMER_INTVL);
 
 	data->srv = srv;
 	srv->apmref = data;
@@ -1348,13 +1713,14 @@ tfw_apm_hm_enable_srv(TfwServer *srv, void *hmref)
 	hmctl = &((TfwApmData *)srv->apmref)->hmctl;
 	WRITE_ONCE(hmctl->hm, hm);
 	atomic64_set(&hmctl->rcount, 0);
+	tfw_apm_hm_probe_join(hmctl);
 
 	/* Start server's health monitoring timer. */
 	atomic_set(&hmctl->rearm, 1);
 	smp_mb__after_atomic();
-	timer_setup(&hmctl->timer, tfw_apm_hm_timer_cb, 0);
+	timer_setup(&hmctl->timer, tfw_apm_hm_timer_cb, TIMER_PINNED);
 	now = jiffies;
-	mod_timer(&hmctl->timer, now + hm->tmt * HZ);
+	tfw_cpu_role_timer(&hmctl->timer, now + hm->tmt * HZ);
 	WRITE_ONCE(hmctl->jtmstamp, now);
 
 	/* Activate server's health monitor. */
@@ -1367,6 +1733,23 @@ tfw_apm_hm_disable_srv(TfwServer *srv)
 	clear_bit(TFW_SRV_B_HMONITOR, &srv->flags);
 	tfw_srv_mark_alive(srv);
 	tfw_apm_hm_stop_timer((TfwApmData *)srv->apmref);
+	tfw_apm_hm_probe_leave(&((TfwApmData *)srv->apmref)->hmctl);
+}
+
+/*
+ * Mark alive @srv and all the servers sharing the health monitoring
+ * requests with it.
+ */
+void
+tfw_apm_hm_srv_mark_alive(TfwServer *srv)
+{
+	TfwApmHMCtl *pos, *hmctl = &((TfwApmData *)srv->apmref)->hmctl;
+
+	tfw_srv_mark_alive(srv);
+	spin_lock_bh(&tfw_hm_probe_lock);
+	list_for_each_entry(pos, &hmctl->probe, probe)
+		tfw_srv_mark_alive(tfw_apm_hm_srv(pos));
+	spin_unlock_bh(&tfw_hm_probe_lock);
 }
 
 bool
@@ -1668,6 +2051,55 @@ tfw_cfgop_apm_stats(TfwCfgSpec *cs, TfwCfgEntry *ce)
 	return 0;
 }
 
+static int
+tfw_cfgop_apm_load_header(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	int i, r;
+	size_t len;
+	const char *key, *val;
+
+	if (tfw_cfg_check_val_n(ce, 1))
+		return -EINVAL;
+	len = strlen(ce->vals[0]);
+	if (!len || len >= TFW_APM_LOAD_HDR_MAX) {
+		T_ERR_NL("%s: invalid header name length: '%s'.\n", cs->name,
+			 ce->vals[0]);
+		return -EINVAL;
+	}
+
+	tfw_apm_load_alpha = 20;
+	tfw_apm_load_weight = 100;
+	TFW_CFG_ENTRY_FOR_EACH_ATTR(ce, i, key, val) {
+		if (!strcasecmp(key, "alpha")) {
+			if ((r = tfw_cfg_parse_uint(val, &tfw_apm_load_alpha)))
+				return r;
+			if (!tfw_apm_load_alpha || tfw_apm_load_alpha > 100) {
+				T_ERR_NL("%s: 'alpha' must be in [1, 100].\n",
+					 cs->name);
+				return -EINVAL;
+			}
+		} else if (!strcasecmp(key, "weight")) {
+			if ((r = tfw_cfg_parse_uint(val, &tfw_apm_load_weight)))
+				return r;
+		} else {
+			T_ERR_NL("%s: unsupported argument: '%s=%s'.\n",
+				 cs->name, key, val);
+			return -EINVAL;
+		}
+	}
+
+	memcpy(tfw_apm_load_name, ce->vals[0], len);
+	WRITE_ONCE(tfw_apm_load_str.len, len);
+
+	return 0;
+}
+
+static void
+tfw_cfgop_apm_cleanup_load_header(TfwCfgSpec *cs)
+{
+	WRITE_ONCE(tfw_apm_load_str.len, 0);
+}
+
 static int
 tfw_cfgop_apm_server_failover(TfwCfgSpec *cs, TfwCfgEntry *ce)
 {
@@ -1922,6 +2354,14 @@ static TfwCfgSpec tfw_apm_specs[] = {
 		.allow_none	= true,
 		.allow_repeat	= false,
 	},
+	{
+		.name		= "server_load_header",
+		.deflt		= NULL,
+		.handler	= tfw_cfgop_apm_load_header,
+		.allow_none	= true,
+		.allow_repeat	= false,
+		.cleanup	= tfw_cfgop_apm_cleanup_load_header,
+	},
 	{
 		.name		= "server_failover_http",
 		.deflt		= NULL,
@@ -59,6 +59,13 @@ static const unsigned int tfw_pstats_ith[] = {
 
 #define T_PSZ	_TFW_PSTATS_IDX_COUNT
 
+/* Tail percentiles from the latency sketch, in 1/100 of percent. */
+static const unsigned int tfw_apm_sk_ith[] = {
+	5000, 9000, 9900, 9990, 9999
+};
+
+#define TFW_APM_SK_PSZ	ARRAY_SIZE(tfw_apm_sk_ith)
+
 /*
  * Structures for health monitoring statistics accountings
  * in procfs.
@@ -82,6 +89,13 @@ typedef struct {
 int tfw_apm_add_srv(TfwServer *srv);
 void tfw_apm_del_srv(TfwServer *srv);
 void tfw_apm_update(void *apmref, unsigned long jtstamp, unsigned long jrtime);
+void tfw_apm_update_qtime(void *apmref, unsigned long jqtime);
+unsigned int tfw_apm_qtime(void *apmref);
+unsigned int tfw_apm_rtime(void *apmref);
+const TfwStr *tfw_apm_load_hdr(void);
+void tfw_apm_update_load(void *apmref, unsigned int load);
+unsigned int tfw_apm_load_adjust(void *apmref, unsigned int rtime);
+void tfw_apm_sketch_stats(void *apmref, unsigned int *val);
 int tfw_apm_stats(void *apmref, TfwPrcntlStats *pstats);
 int tfw_apm_stats_bh(void *apmref, TfwPrcntlStats *pstats);
 int tfw_apm_pstats_verify(TfwPrcntlStats *pstats);
@@ -90,6 +104,7 @@ bool tfw_apm_hm_srv_alive(int status, TfwStr *body, void *apmref);
 bool tfw_apm_hm_srv_limit(int status, void *apmref);
 void tfw_apm_hm_enable_srv(TfwServer *srv, void *hmref);
 void tfw_apm_hm_disable_srv(TfwServer *srv);
+void tfw_apm_hm_srv_mark_alive(TfwServer *srv);
 bool tfw_apm_hm_srv_eq(const char *name, TfwServer *srv);
 TfwHMStats *tfw_apm_hm_stats(void *apmref);
 void *tfw_apm_get_hm(const char *name);
@@ -20,23 +20,33 @@
  * this program; if not, write to the Free Software Foundation, Inc., 59
  * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
+#include <linux/crc32.h>
 #include <linux/freezer.h>
+#include <linux/hash.h>
 #include <linux/irq_work.h>
 #include <linux/ipv6.h>
 #include <linux/kthread.h>
 #include <linux/tcp.h>
 #include <linux/topology.h>
+#include <linux/vmalloc.h>
+#include <linux/zlib.h>
 
 #include "tdb.h"
 
+#include "lib/hash.h"
 #include "lib/str.h"
 #include "tempesta_fw.h"
 #include "vhost.h"
 #include "cache.h"
+#include "cache_fetch.h"
+#include "cache_range.h"
+#include "cpu_role.h"
 #include "http_msg.h"
 #include "http_sess.h"
 #include "procfs.h"
+#include "stress.h"
 #include "sync_socket.h"
+#include "trace.h"
 #include "work_queue.h"
 #include "lib/common.h"
 
@@ -51,7 +61,7 @@ static const int tfw_cache_spec_headers_304[] = {
 static const TfwStr tfw_cache_raw_headers_304[] = {
 	TFW_STR_STRING("cache-control:"),
 	TFW_STR_STRING("content-location:"),
-	TFW_STR_STRING("date:"),
+	/* Date isn't stored, see tfw_cache_hdr_skip(). */
 	TFW_STR_STRING("expires:"),
 	TFW_STR_STRING("last-modified:"),
 	TFW_STR_STRING("vary:"),
@@ -65,59 +75,128 @@ static const TfwStr tfw_cache_raw_headers_304[] = {
 /* Flags stored in a Cache Entry. */
 #define TFW_CE_MUST_REVAL	0x0001		/* MUST revalidate if stale. */
 
+/* States of a Cache Entry body written behind, see TfwCacheBodyWork. */
+#define TFW_CE_BODY_PENDING	1		/* The body is being written. */
+#define TFW_CE_BODY_FAILED	2		/* The body can't be written. */
+
+/* Max number of purge index keys (tags and URI prefixes) of a Cache Entry. */
+#define TFW_CACHE_TAGS_MAX	16
+/* Max number of URI prefixes of a Cache Entry in the purge index. */
+#define TFW_CACHE_PREFIX_MAX	8
+
+/* Max lifetime of negatively cached error responses, in seconds. */
+#define TFW_CACHE_NEGATIVE_TTL_MAX	3600
+
+/* Content-codings of compressed variants of a Cache Entry. */
+#define TFW_CE_CODING_GZIP	1
+
 /*
  * @trec	- Database record descriptor;
  * @key_len	- length of key (URI + Host header);
+ * @vary_len	- length of secondary key;
+ * @hints_len	- length of preload links for 103 (Early Hints) responses;
+ * @ctype_len	- length of the Content-Type value;
  * @status_len	- length of response status code;
  * @rph_len	- length of response reason phrase;
  * @hdr_num	- number of headers;
  * @hdr_len	- length of whole headers data;
  * @hdr_h2_off	- start of http/2-only headers in the headers list;
  * @body_len	- length of the response body;
+ * @h1_len	- length of prebuilt HTTP/1.1 status line and headers;
+ * @h2_len	- length of prebuilt HTTP/2 header block;
  * @method	- request method, part of the key;
  * @flags	- various cache entry flags;
+ * @fresh_seq	- sequence counter of the freshness information updates, see
+ *		  tfw_cache_fresh_read_begin();
  * @age		- the value of response Age: header field;
  * @date	- the value of response Date: header field;
  * @req_time	- the time the request was issued;
  * @resp_time	- the time the response was received;
  * @lifetime	- the cache entry's current lifetime;
  * @last_modified - the value of response Last-Modified: header field;
+ * @atime	- the time (in jiffies) the entry was served last time;
+ * @refresh	- the time (in jiffies) the entry refresh was started;
+ * @stale_reval	- RFC 5861 stale-while-revalidate window, seconds;
+ * @stale_err	- RFC 5861 stale-if-error window, seconds;
  * @key		- the cache entry key (URI + Host header);
+ * @vary	- secondary key built from request headers listed in Vary;
+ * @hints	- preload links of the response Link headers, separated by
+ *		  commas, see tfw_cache_hints();
+ * @ctype	- the Content-Type value sent in multipart/byteranges body
+ *		  parts, see tfw_cache_ranges_init();
  * @status	- pointer to status line;
  * @hdrs	- pointer to list of HTTP headers;
  * @body	- pointer to response body;
+ * @h1		- pointer to prebuilt HTTP/1.1 status line and headers;
+ * @h2		- pointer to prebuilt HTTP/2 header block;
  * @hdrs_304	- pointers to headers used to build 304 response;
  * @version	- HTTP version of the response;
  * @resp_status - Http status of the cached response.
  * @hmflags	- flags of the response after parsing and post-processing.
+ * @referenced	- the entry was served since the last pass of CLOCK hand;
+ * @body_state	- zero if the entry is complete or TFW_CE_BODY_* state;
+ * @coding	- TFW_CE_CODING_* of a compressed variant or zero for identity;
+ * @tag_n	- number of the entry references in the purge index;
+ * @quota	- vhost quota the entry is accounted in, see tfw_cache_quota();
+ * @size	- size of the entry accounted in @quota;
+ * @clock	- index of the entry slot in the node CLOCK ring;
+ * @slice	- offset plus one of the slice stored in the entry, zero if the
+ *		  entry isn't a slice, see tfw_cache_slice_init();
+ * @slice_total	- length of the whole representation the slice belongs to;
+ * @id		- unique entry identifier referenced by the purge index;
  * @etag	- entity-tag, stored as a pointer to ETag header in @hdrs.
  */
 typedef struct {
 	TdbVRec		trec;
 #define ce_body		key_len
 	unsigned int	key_len;
+	unsigned int	vary_len;
+	unsigned int	hints_len;
+	unsigned int	ctype_len;
 	unsigned int	status_len;
 	unsigned int	rph_len;
 	unsigned int	hdr_num;
 	unsigned int	hdr_h2_off;
 	unsigned int	hdr_len;
 	unsigned int	body_len;
+	unsigned int	h1_len;
+	unsigned int	h2_len;
 	unsigned int	method: 4;
 	unsigned int	flags: 28;
+	unsigned int	fresh_seq;
 	long		age;
 	long		date;
 	long		req_time;
 	long		resp_time;
 	long		lifetime;
 	long		last_modified;
+	unsigned long	atime;
+	unsigned long	refresh;
+	long		stale_reval;
+	long		stale_err;
 	long		key;
+	long		vary;
+	long		hints;
+	long		ctype;
 	long		status;
 	long		hdrs;
 	long		body;
+	long		h1;
+	long		h2;
 	long		hdrs_304[TFW_CACHE_304_HDRS_NUM];
 	DECLARE_BITMAP	(hmflags, _TFW_HTTP_FLAGS_NUM);
 	unsigned char	version;
 	unsigned short	resp_status;
+	unsigned char	referenced;
+	unsigned char	body_state;
+	unsigned char	coding;
+	unsigned char	tag_n;
+	unsigned char	quota;
+	unsigned int	size;
+	unsigned int	clock;
+	unsigned long	slice;
+	unsigned long	slice_total;
+	unsigned long	id;
 	TfwStr		etag;
 } TfwCacheEntry;
 
@@ -138,13 +217,34 @@ typedef struct {
 #define TFW_CSTR_MAXLEN		(1UL << 56)
 #define TFW_CSTR_HDRLEN		(sizeof(TfwCStr))
 
-/* Work to copy response body to database. */
+/* Max length of Range request header processed by cache. */
+#define TFW_CACHE_RANGE_HDR_MAX	256
+/* Max length of secondary key and of request headers it's built from. */
+#define TFW_CACHE_VARY_MAX	512
+/* Max length of preload links sent in 103 (Early Hints) responses. */
+#define TFW_CACHE_HINTS_MAX	1024
+/*
+ * Max body size to compress: compression is done in softirq context, so
+ * larger bodies are stored as is only.
+ */
+#define TFW_CACHE_COMPRESS_MAX	(1 << 20)
+
+typedef struct tfw_cache_body_work_t TfwCacheBodyWork;
+
+/*
+ * Work to process a message by the cache on a remote node or, if @bw is set,
+ * to copy response body to database.
+ */
 typedef struct {
 	TfwHttpMsg		*msg;
 	tfw_http_cache_cb_t	action;
-	unsigned long		__unused[2];
+	TfwCacheBodyWork	*bw;
+	unsigned long		__unused;
 } TfwCWork;
 
+/* Works fetched from the work queue at once by tfw_wq_tasklet(). */
+#define TFW_CACHE_WQ_BATCH	8
+
 typedef struct {
 	struct tasklet_struct	tasklet;
 	struct irq_work		ipi_work;
@@ -153,37 +253,182 @@ typedef struct {
 
 static struct {
 	int cache;
+	bool resp_prebuilt;
+	bool range_fetch_full;
+	bool early_hints;
 	unsigned int methods;
+	int collapse_timeout;
+	int warmup_resync;
+	int write_behind;
+	int compress;
+	bool purge_index;
+	int negative_4xx;
+	int negative_5xx;
+	int hybrid_hot;
+	int slice;
 	unsigned long db_size;
+	unsigned long db_size_max;
 	const char *db_path;
+	const char *warmup_list;
 } cache_cfg __read_mostly;
 
-/* Cache modes. */
+/*
+ * Cache modes. In hybrid mode entries are sharded like TFW_CACHE_SHARD, but
+ * the entries frequently requested from other nodes are replicated to all
+ * the nodes like TFW_CACHE_REPLICA, see tfw_cache_promote().
+ */
 enum {
 	TFW_CACHE_NONE = 0,
 	TFW_CACHE_SHARD,
 	TFW_CACHE_REPLICA,
+	TFW_CACHE_HYBRID,
+};
+
+/*
+ * Request lookups: in the local node database, in the shard node database
+ * on behalf of other node, and in the local replica of hybrid cache.
+ */
+enum {
+	TFW_CACHE_LOOKUP_LOCAL,
+	TFW_CACHE_LOOKUP_REMOTE,
+	TFW_CACHE_LOOKUP_REPLICA,
 };
 
+/*
+ * Cache entries are evicted by CLOCK replacement: entries stored in a node
+ * database are kept in a ring and the hand gives a second chance to the
+ * entries which were served since the last pass.
+ *
+ * Bodies of responses served from the cache reference the database pages,
+ * so entries served during TFW_CACHE_EVICT_GRACE aren't evicted to let the
+ * pages leave transmission queues before they're reused.
+ */
+#define TFW_CACHE_EVICT_GRACE	(30 * HZ)
+/* Max number of entries evicted at once to get room for a new entry. */
+#define TFW_CACHE_EVICT_BATCH	8
+/* Max number of ring slots scanned for a single eviction. */
+#define TFW_CACHE_CLOCK_SCAN	1024
+/* Minimal expected cache entry size used to calculate the ring size. */
+#define TFW_CACHE_ENTRY_MIN_SZ	2048
+/* Max number of vhosts with cache quotas. */
+#define TFW_CACHE_QUOTA_MAX	64
+/* Max number of ring slots scanned to fit an entry into its quota. */
+#define TFW_CACHE_QUOTA_SCAN	(TFW_CACHE_CLOCK_SCAN * 4)
+/* Number of slices looked up to find a purged sliced resource. */
+#define TFW_CACHE_SLICE_SCAN	64
+/* Min time between background refreshes of the same stale entry. */
+#define TFW_CACHE_REFRESH_TIMEOUT	(5 * HZ)
+
+#define TFW_CACHE_SKETCH_DEPTH	4
+#define TFW_CACHE_SKETCH_SHIFT	14
+#define TFW_CACHE_SKETCH_WIDTH	(1 << TFW_CACHE_SKETCH_SHIFT)
+/* Number of counted requests after which all the counters are halved. */
+#define TFW_CACHE_SKETCH_SAMPLE	(TFW_CACHE_SKETCH_WIDTH * 8)
+
+/*
+ * Count-min sketch of request frequencies for TinyLFU-like cache admission.
+ * Counters saturate at TFW_CACHE_ADMISSION_MAX and are halved each
+ * TFW_CACHE_SKETCH_SAMPLE requests, so old popularity fades out. Updates
+ * aren't synchronized: a lost increment doesn't matter for an estimation.
+ *
+ * @n		- number of requests counted since the last halving;
+ * @cnt		- the counters rows, one hash function per row;
+ */
+typedef struct {
+	atomic_t	n;
+	unsigned char	cnt[TFW_CACHE_SKETCH_DEPTH][TFW_CACHE_SKETCH_WIDTH];
+} TfwCacheSketch;
+
+/*
+ * Memory quota of a vhost in each node database, so a vhost with large
+ * objects doesn't evict the hot entries of other vhosts.
+ *
+ * @name	- the vhost name;
+ * @len		- length of @name;
+ * @limit	- max size of the vhost entries in a node database, bytes;
+ */
+typedef struct {
+	char		*name;
+	size_t		len;
+	unsigned long	limit;
+} TfwCacheQuota;
+
+static TfwCacheQuota cache_quotas[TFW_CACHE_QUOTA_MAX];
+static unsigned int cache_quota_n;
+
+/*
+ * Usage of a vhost quota in a node database, protected by the node
+ * @clock_lock.
+ *
+ * @used	- size of the vhost entries;
+ * @hand	- CLOCK hand to evict the vhost entries;
+ */
+typedef struct {
+	unsigned long	used;
+	unsigned int	hand;
+} TfwCacheQuotaUse;
+
+/*
+ * Per NUMA node cache descriptor.
+ *
+ * @cpu		- CPUs of the node to schedule works on;
+ * @cpu_idx	- round robin index in @cpu;
+ * @nr_cpus	- number of CPUs in @cpu;
+ * @db		- the node cache database;
+ * @clock_lock	- protects the CLOCK ring and hand;
+ * @clock_hand	- current CLOCK hand position in @clock;
+ * @clock_sz	- number of slots in @clock;
+ * @clock	- ring of entries stored in @db for CLOCK replacement;
+ * @sketch	- request frequencies for cache admission;
+ * @quota	- usage of the vhost quotas in @db;
+ */
 typedef struct {
 	int		cpu[NR_CPUS];
 	atomic_t	cpu_idx;
 	unsigned int	nr_cpus;
 	TDB		*db;
+	spinlock_t	clock_lock;
+	unsigned int	clock_hand;
+	unsigned int	clock_sz;
+	TfwCacheEntry	**clock;
+	TfwCacheSketch	*sketch;
+	TfwCacheQuotaUse quota[TFW_CACHE_QUOTA_MAX];
 } CaNode;
 
 static CaNode c_nodes[MAX_NUMNODES];
 
 typedef int tfw_cache_write_actor_t(TDB *, TdbVRec **, TfwHttpResp *, char **,
 				    size_t, TfwDecodeCacheIter *);
+
+/*
+ * Per-CPU direct-mapped micro-cache of the recently served entries in front
+ * of the local node database. The hot entries carrying most of the traffic
+ * are found in a single slot w/o the index descent and the bucket scan.
+ *
+ * @key		- key of the entry, zero for an empty slot;
+ * @ce		- the entry;
+ * @gen		- the database generation when @ce was found, see
+ *		  tdb_rec_revalidate();
+ * @gzip	- @ce is selected for clients accepting gzip coding;
+ */
+typedef struct {
+	unsigned long	key;
+	TfwCacheEntry	*ce;
+	unsigned long	gen;
+	bool		gzip;
+} __aligned(32) TfwCacheL1;
+
+#define TFW_CACHE_L1_BITS	12
+
+static DEFINE_PER_CPU(TfwCacheL1 *, cache_l1);
 /*
  * TODO the thread doesn't do anything for now, however, kthread_stop() crashes
  * on restarts, so comment to logic out.
  */
-#if 0
 static struct task_struct *cache_mgr_thr;
-#endif
 static DEFINE_PER_CPU(TfwWorkTasklet, cache_wq);
+/* Deflate streams to compress bodies of cached responses. */
+static DEFINE_PER_CPU(z_stream, cache_zstrm);
 
 #define RESP_BUF_LEN		128
 
@@ -241,10 +486,15 @@ __cache_method_test(tfw_http_meth_t method)
 	return cache_cfg.methods & (1 << method);
 }
 
+/**
+ * A protocol upgrade request is never served from the cache and its response
+ * is processed locally, see tfw_http_tunnel_open().
+ */
 bool
 tfw_cache_msg_cacheable(TfwHttpReq *req)
 {
-	return cache_cfg.cache && __cache_method_test(req->method);
+	return cache_cfg.cache && __cache_method_test(req->method)
+	       && !test_bit(TFW_HTTP_B_CONN_UPGRADE, req->flags);
 }
 
 /**
@@ -260,6 +510,23 @@ tfw_cache_key_node(unsigned long key)
 	return key % num_online_nodes();
 }
 
+/**
+ * The cache key of @req. Slices of a large representation are stored under
+ * the keys derived from the resource key, the slice offset and the slice
+ * size, so the slices are spread over the database and the nodes like
+ * separate resources and aren't mixed up after reconfiguration of the size.
+ */
+static unsigned long
+tfw_cache_key(TfwHttpReq *req)
+{
+	unsigned long key = tfw_http_req_key_calc(req);
+
+	if (likely(!req->cache_slice))
+		return key;
+
+	return key ^ __hash_64(req->cache_slice) ^ __hash_64(~cache_cfg.slice);
+}
+
 /**
  * Just choose any CPU for each node to use queue_work_on() for
  * nodes scheduling. Reserve 0th CPU for other tasks.
@@ -281,6 +548,337 @@ node_db(void)
 	return c_nodes[numa_node_id()].db;
 }
 
+static TfwCacheL1 *
+tfw_cache_l1_slot(TfwCacheL1 *l1, unsigned long key, bool gzip)
+{
+	return &l1[hash_long(key ^ gzip, TFW_CACHE_L1_BITS)];
+}
+
+/*
+ * Drop entries with @key from the micro-caches of all the CPUs of @node,
+ * so a new entry replacing a still live one is found by the next lookups.
+ */
+static void
+tfw_cache_l1_inval(CaNode *node, unsigned long key)
+{
+	int i, gzip;
+
+	for (i = 0; i < node->nr_cpus; ++i) {
+		TfwCacheL1 *l1 = per_cpu(cache_l1, node->cpu[i]);
+
+		for (gzip = 0; gzip < 2; ++gzip) {
+			TfwCacheL1 *s = tfw_cache_l1_slot(l1, key, gzip);
+
+			if (READ_ONCE(s->key) == key)
+				WRITE_ONCE(s->key, 0);
+		}
+	}
+}
+
+static inline void
+tfw_cache_entry_touch(TfwCacheEntry *ce)
+{
+	unsigned long now = jiffies;
+
+	/* Don't write shared cache lines of frequently served entries. */
+	if (!READ_ONCE(ce->referenced))
+		WRITE_ONCE(ce->referenced, 1);
+	if (READ_ONCE(ce->atime) != now)
+		WRITE_ONCE(ce->atime, now);
+}
+
+/*
+ * Purge index: surrogate keys (tags) and URI prefixes of stored responses
+ * mapped to the entries, so PURGE for a tag or a prefix invalidates all the
+ * matching entries without walking the whole database. The index references
+ * the entries by the database key and the entry identifier, so a reference
+ * outliving its entry never matches a new one. References are hashed by the
+ * tag for purging and by the entry identifier for removal on eviction.
+ *
+ * @tentry	- entry in tfw_cache_tags hash table;
+ * @ientry	- entry in tfw_cache_tag_ids hash table;
+ * @tag		- hash of the tag or URI prefix;
+ * @key		- database key of the entry;
+ * @id		- identifier of the entry;
+ * @nid		- NUMA node of the entry database;
+ */
+typedef struct {
+	struct hlist_node	tentry;
+	struct hlist_node	ientry;
+	unsigned long		tag;
+	unsigned long		key;
+	unsigned long		id;
+	int			nid;
+} TfwCacheTagRef;
+
+#define TFW_CACHE_TAGS_HBITS	16
+
+/*
+ * The index is modified on insertion, eviction and purging of entries only,
+ * so a single lock is fine. The lock is acquired under the database bucket
+ * locks on eviction, so it must never be held while acquiring the latter.
+ */
+static DEFINE_SPINLOCK(tfw_cache_tags_lock);
+static struct hlist_head tfw_cache_tags[1 << TFW_CACHE_TAGS_HBITS];
+static struct hlist_head tfw_cache_tag_ids[1 << TFW_CACHE_TAGS_HBITS];
+static atomic64_t tfw_cache_ce_id;
+
+/**
+ * Remove the purge index references to @ce.
+ */
+static void
+tfw_cache_tags_del(TfwCacheEntry *ce)
+{
+	TfwCacheTagRef *ref;
+	struct hlist_node *tmp;
+	unsigned int h = hash_long(ce->id, TFW_CACHE_TAGS_HBITS);
+
+	if (!ce->tag_n)
+		return;
+
+	spin_lock_bh(&tfw_cache_tags_lock);
+	hlist_for_each_entry_safe(ref, tmp, &tfw_cache_tag_ids[h], ientry) {
+		if (ref->id != ce->id)
+			continue;
+		hlist_del(&ref->ientry);
+		hlist_del(&ref->tentry);
+		kfree(ref);
+	}
+	spin_unlock_bh(&tfw_cache_tags_lock);
+	ce->tag_n = 0;
+}
+
+/**
+ * Free the whole purge index on the cache shutdown.
+ */
+static void
+tfw_cache_tags_cleanup(void)
+{
+	int h;
+	TfwCacheTagRef *ref;
+	struct hlist_node *tmp;
+
+	spin_lock_bh(&tfw_cache_tags_lock);
+	for (h = 0; h < ARRAY_SIZE(tfw_cache_tag_ids); ++h)
+		hlist_for_each_entry_safe(ref, tmp, &tfw_cache_tag_ids[h],
+					  ientry)
+		{
+			hlist_del(&ref->ientry);
+			hlist_del(&ref->tentry);
+			kfree(ref);
+		}
+	spin_unlock_bh(&tfw_cache_tags_lock);
+}
+
+/**
+ * Called by TDB under the entry bucket lock, so the entry can't be removed
+ * concurrently. Lockless readers can still serve the entry, TDB releases its
+ * memory when they finish.
+ */
+static bool
+tfw_cache_entry_removable(TdbRec *rec)
+{
+	TfwCacheEntry *ce = (TfwCacheEntry *)rec;
+
+	/* The body is being written behind, see TfwCacheBodyWork. */
+	if (smp_load_acquire(&ce->body_state) == TFW_CE_BODY_PENDING)
+		return false;
+	tfw_cache_tags_del(ce);
+
+	return true;
+}
+
+static bool
+tfw_cache_entry_evictable(TdbRec *rec)
+{
+	TfwCacheEntry *ce = (TfwCacheEntry *)rec;
+
+	if (ce->referenced
+	    || time_before(jiffies, ce->atime + TFW_CACHE_EVICT_GRACE))
+		return false;
+
+	return tfw_cache_entry_removable(rec);
+}
+
+/**
+ * Remove the entry in ring @slot of @node if @may_remove allows it. The slot
+ * is freed along with the entry, so the ring never references removed
+ * entries. Called under @node->clock_lock.
+ */
+static bool
+__tfw_cache_clock_remove(CaNode *node, TfwCacheEntry **slot,
+			 bool (*may_remove)(TdbRec *))
+{
+	TfwCacheEntry *ce = *slot;
+	unsigned char q = ce->quota;
+	unsigned int size = ce->size;
+
+	if (!tdb_entry_remove(node->db, (TdbRec *)ce, may_remove))
+		return false;
+
+	if (q)
+		node->quota[q - 1].used -= size;
+	*slot = NULL;
+
+	return true;
+}
+
+/**
+ * Evict the entry in ring @slot of @node if it wasn't served recently.
+ * Called under @node->clock_lock.
+ */
+static bool
+tfw_cache_clock_evict(CaNode *node, TfwCacheEntry **slot)
+{
+	TfwCacheEntry *ce = *slot;
+
+	if (!__tfw_cache_clock_remove(node, slot, tfw_cache_entry_evictable))
+		return false;
+
+	T_DBG3("%s: evicted ce=[%p] key=%#lx\n", __func__, ce,
+	       ce->trec.key);
+	TFW_INC_STAT_BH(cache.evictions);
+
+	return true;
+}
+
+/**
+ * Remove entry @rec of table @db on behalf of other TDB users, e.g. the
+ * netlink interface, see tdb_set_owner(). The entry is only removed along
+ * with its CLOCK ring slot: an entry which isn't in the ring yet is being
+ * stored and an entry which isn't in the ring anymore is already removed.
+ */
+static bool
+tfw_cache_entry_remove(TDB *db, TdbRec *rec)
+{
+	CaNode *node = &c_nodes[db->node];
+	TfwCacheEntry *ce = (TfwCacheEntry *)rec;
+	bool r = false;
+
+	spin_lock_bh(&node->clock_lock);
+	if (ce->clock < node->clock_sz && node->clock[ce->clock] == ce)
+		r = __tfw_cache_clock_remove(node, &node->clock[ce->clock],
+					     tfw_cache_entry_removable);
+	spin_unlock_bh(&node->clock_lock);
+
+	return r;
+}
+
+/**
+ * Move CLOCK hand of @node to the next slot which can take a new entry
+ * evicting the entry in the slot. Empty slots are returned only if
+ * @empty_ok is true.
+ *
+ * @return the slot or NULL if all the scanned entries were served recently.
+ */
+static TfwCacheEntry **
+tfw_cache_clock_next(CaNode *node, bool empty_ok)
+{
+	int i;
+
+	for (i = 0; i < TFW_CACHE_CLOCK_SCAN; ++i) {
+		TfwCacheEntry **slot = &node->clock[node->clock_hand];
+		TfwCacheEntry *ce = *slot;
+
+		if (++node->clock_hand == node->clock_sz)
+			node->clock_hand = 0;
+
+		if (!ce) {
+			if (empty_ok)
+				return slot;
+			continue;
+		}
+		if (READ_ONCE(ce->referenced)) {
+			WRITE_ONCE(ce->referenced, 0);
+			continue;
+		}
+		if (tfw_cache_clock_evict(node, slot))
+			return slot;
+	}
+
+	return NULL;
+}
+
+/**
+ * Make room for @size bytes of a new entry in quota @q of @node evicting
+ * the entries of the same vhost only. The vhost entries are scanned by the
+ * own CLOCK hand of the quota.
+ *
+ * @return false if the vhost entries can't be evicted now.
+ */
+static bool
+tfw_cache_quota_fit(CaNode *node, unsigned char q, unsigned long size)
+{
+	int i;
+	bool fit;
+	TfwCacheQuotaUse *qu = &node->quota[q - 1];
+	unsigned long limit = cache_quotas[q - 1].limit;
+
+	if (size > limit)
+		return false;
+
+	spin_lock_bh(&node->clock_lock);
+	for (i = 0; qu->used + size > limit && i < TFW_CACHE_QUOTA_SCAN; ++i)
+	{
+		TfwCacheEntry **slot = &node->clock[qu->hand];
+		TfwCacheEntry *ce = *slot;
+
+		if (++qu->hand == node->clock_sz)
+			qu->hand = 0;
+
+		if (!ce || ce->quota != q)
+			continue;
+		if (READ_ONCE(ce->referenced)) {
+			WRITE_ONCE(ce->referenced, 0);
+			continue;
+		}
+		tfw_cache_clock_evict(node, slot);
+	}
+	fit = qu->used + size <= limit;
+	spin_unlock_bh(&node->clock_lock);
+
+	return fit;
+}
+
+/**
+ * Evict several entries from @node to get room for a new entry.
+ * @return number of evicted entries.
+ */
+static int
+tfw_cache_evict(CaNode *node)
+{
+	int n;
+
+	spin_lock_bh(&node->clock_lock);
+	for (n = 0; n < TFW_CACHE_EVICT_BATCH; ++n)
+		if (!tfw_cache_clock_next(node, false))
+			break;
+	spin_unlock_bh(&node->clock_lock);
+
+	return n;
+}
+
+/**
+ * Place just stored entry @ce to the CLOCK ring of @node. The entry is
+ * placed just behind the hand, so it gets a whole hand round to be served.
+ */
+static bool
+tfw_cache_clock_add(CaNode *node, TfwCacheEntry *ce)
+{
+	TfwCacheEntry **slot;
+
+	spin_lock_bh(&node->clock_lock);
+	if ((slot = tfw_cache_clock_next(node, true))) {
+		*slot = ce;
+		ce->clock = slot - node->clock;
+		if (ce->quota)
+			node->quota[ce->quota - 1].used += ce->size;
+	}
+	spin_unlock_bh(&node->clock_lock);
+
+	return slot;
+}
+
 /**
  * Get a CPU identifier from @node to schedule a work.
  * The request should be processed on remote node, use round robin strategy
@@ -291,14 +889,25 @@ node_db(void)
  * If this place becomes a hot spot, then @cpu_idx may be made per_cpu.
  */
 static int
-tfw_cache_sched_cpu(TfwHttpReq *req)
+tfw_cache_node_cpu(CaNode *node)
 {
-	CaNode *node = &c_nodes[req->node];
 	unsigned int idx = atomic_inc_return(&node->cpu_idx);
 
 	return node->cpu[idx % node->nr_cpus];
 }
 
+/**
+ * The request is served or forwarded by the work, so prefer the data path
+ * CPUs of the node.
+ */
+static inline int
+tfw_cache_sched_cpu(TfwHttpReq *req)
+{
+	int cpu = tfw_cpu_role_next(TFW_CPU_DATA, req->node);
+
+	return cpu < 0 ? tfw_cache_node_cpu(&c_nodes[req->node]) : cpu;
+}
+
 /*
  * Find caching policy in specific vhost and location.
  */
@@ -336,55 +945,146 @@ tfw_cache_policy(TfwVhost *vhost, TfwLocation *loc, TfwStr *arg)
 	return TFW_D_CACHE_BYPASS;
 }
 
-/*
- * Decide if the cache can be employed. For a request that means
- * that it can be served from cache if there's a cached response.
- * For a response it means that the response can be stored in cache.
- *
- * Various cache action/control directives are consulted when making
- * the resulting decision.
+/**
+ * Minimum frequency of requests to the resource of @req for the response to
+ * be admitted to the cache, the location settings are inherited the same way
+ * as for cache policies. Zero means that all the responses are admitted.
  */
-static bool
-tfw_cache_employ_req(TfwHttpReq *req)
+static unsigned int
+tfw_cache_admission(TfwHttpReq *req)
 {
-	int cmd = tfw_cache_policy(req->vhost, req->location, &req->uri_path);
+	TfwVhost *vhost = req->vhost;
 
-	if (cmd == TFW_D_CACHE_BYPASS) {
-		req->cache_ctl.flags |= TFW_HTTP_CC_CFG_CACHE_BYPASS;
-		return false;
-	}
-	/* cache_fulfill - work as usual in cache mode. */
-	BUG_ON(cmd != TFW_D_CACHE_FULFILL);
+	if (req->location && req->location->cache_admission)
+		return req->location->cache_admission;
+	if (!vhost)
+		return 0;
+	if (vhost->loc_dflt && vhost->loc_dflt->cache_admission)
+		return vhost->loc_dflt->cache_admission;
+	if (vhost->vhost_dflt)
+		return vhost->vhost_dflt->loc_dflt->cache_admission;
 
-	if (req->cache_ctl.flags & TFW_HTTP_CC_NO_CACHE)
-		/*
-		 * TODO: RFC 7234 4. "... a cache MUST NOT reuse a stored
-		 * response, unless... the request does not contain the no-cache
-		 * pragma, nor the no-cache cache directive unless the stored
-		 * response is successfully validated."
-		 *
-		 * We can validate the stored response and serve request from
-		 * cache. This reduces traffic to origin server.
-		 */
-		return false;
+	return 0;
+}
 
-	return true;
+static inline unsigned int
+tfw_cache_sketch_idx(unsigned long key, int row)
+{
+	return hash_64(key ^ (row * GOLDEN_RATIO_64), TFW_CACHE_SKETCH_SHIFT);
 }
 
-/**
- * Check whether the response status code is defined as cacheable by default
- * by RFC 7231 6.1.
+/*
+ * @return the quota of the vhost of @req plus one, or zero if the vhost
+ * has no quota.
  */
-static inline bool
+static unsigned char
+tfw_cache_quota(TfwHttpReq *req)
+{
+	int i;
+	TfwVhost *vhost = req->vhost;
+
+	if (!vhost)
+		return 0;
+	for (i = 0; i < cache_quota_n; ++i)
+		if (vhost->name.len == cache_quotas[i].len
+		    && !memcmp(vhost->name.data, cache_quotas[i].name,
+			       vhost->name.len))
+			return i + 1;
+
+	return 0;
+}
+
+static unsigned int
+tfw_cache_sketch_estimate(TfwCacheSketch *sk, unsigned long key)
+{
+	int i;
+	unsigned int c, min = TFW_CACHE_ADMISSION_MAX;
+
+	for (i = 0; i < TFW_CACHE_SKETCH_DEPTH; ++i) {
+		c = READ_ONCE(sk->cnt[i][tfw_cache_sketch_idx(key, i)]);
+		min = min(min, c);
+	}
+
+	return min;
+}
+
+/**
+ * Count a request for @key. Conservative update: only the minimal counters
+ * are incremented, which reduces overestimation of rare keys.
+ */
+static void
+tfw_cache_sketch_inc(TfwCacheSketch *sk, unsigned long key)
+{
+	int i, j;
+	unsigned int min = tfw_cache_sketch_estimate(sk, key);
+
+	if (min < TFW_CACHE_ADMISSION_MAX)
+		for (i = 0; i < TFW_CACHE_SKETCH_DEPTH; ++i) {
+			unsigned char *c;
+
+			c = &sk->cnt[i][tfw_cache_sketch_idx(key, i)];
+			if (READ_ONCE(*c) == min)
+				WRITE_ONCE(*c, min + 1);
+		}
+
+	if (atomic_inc_return(&sk->n) != TFW_CACHE_SKETCH_SAMPLE)
+		return;
+	for (i = 0; i < TFW_CACHE_SKETCH_DEPTH; ++i)
+		for (j = 0; j < TFW_CACHE_SKETCH_WIDTH; ++j)
+			sk->cnt[i][j] >>= 1;
+	atomic_sub(TFW_CACHE_SKETCH_SAMPLE, &sk->n);
+}
+
+/*
+ * Decide if the cache can be employed. For a request that means
+ * that it can be served from cache if there's a cached response.
+ * For a response it means that the response can be stored in cache.
+ *
+ * Various cache action/control directives are consulted when making
+ * the resulting decision.
+ */
+static bool
+tfw_cache_employ_req(TfwHttpReq *req)
+{
+	int cmd = tfw_cache_policy(req->vhost, req->location, &req->uri_path);
+
+	if (cmd == TFW_D_CACHE_BYPASS) {
+		req->cache_ctl.flags |= TFW_HTTP_CC_CFG_CACHE_BYPASS;
+		return false;
+	}
+	/* cache_fulfill - work as usual in cache mode. */
+	BUG_ON(cmd != TFW_D_CACHE_FULFILL);
+
+	if (req->cache_ctl.flags & TFW_HTTP_CC_NO_CACHE)
+		/*
+		 * TODO: RFC 7234 4. "... a cache MUST NOT reuse a stored
+		 * response, unless... the request does not contain the no-cache
+		 * pragma, nor the no-cache cache directive unless the stored
+		 * response is successfully validated."
+		 *
+		 * We can validate the stored response and serve request from
+		 * cache. This reduces traffic to origin server.
+		 */
+		return false;
+
+	return true;
+}
+
+/**
+ * Check whether the response status code is defined as cacheable by default
+ * by RFC 7231 6.1.
+ */
+static inline bool
 tfw_cache_status_bydef(TfwHttpResp *resp)
 {
 	/*
-	 * TODO: Add 206 (Partial Content) status. Requires support
-	 * of incomplete responses, Range: and Content-Range: header
-	 * fields, and RANGE request method.
+	 * 206 (Partial Content) is stored only as a slice of a large
+	 * representation, see tfw_cache_employ_resp(). Otherwise complete
+	 * representations are cached and byte ranges are served from them,
+	 * see tfw_cache_req_ranges().
 	 */
 	switch (resp->status) {
-	case 200: case 203: case 204:
+	case 200: case 203: case 204: case 206:
 	case 300: case 301:
 	case 404: case 405: case 410: case 414:
 	case 501:
@@ -393,6 +1093,23 @@ tfw_cache_status_bydef(TfwHttpResp *resp)
 	return false;
 }
 
+/**
+ * Negative caching: lifetime of client and server error responses without
+ * explicit freshness information. Zero if the errors of @resp status class
+ * aren't cached.
+ */
+static inline long
+tfw_cache_negative_ttl(TfwHttpResp *resp)
+{
+	if (resp->status >= 400 && resp->status < 500)
+		return cache_cfg.negative_4xx;
+	if (resp->status >= 500 && resp->status < 600)
+		return cache_cfg.negative_5xx;
+	return 0;
+}
+
+static unsigned long tfw_cache_slice_total(TfwHttpResp *resp);
+
 static bool
 tfw_cache_employ_resp(TfwHttpResp *resp)
 {
@@ -415,6 +1132,11 @@ tfw_cache_employ_resp(TfwHttpResp *resp)
 	 */
 	if (req->cache_ctl.flags & CC_REQ_DONTCACHE)
 		return false;
+	/* Partial responses are stored only as requested slices. */
+	if ((resp->status == 206) != !!req->cache_slice)
+		return false;
+	if (req->cache_slice && !tfw_cache_slice_total(resp))
+		return false;
 	if (resp->cache_ctl.flags & CC_RESP_DONTCACHE)
 		return false;
 	if (!(req->cache_ctl.flags & TFW_HTTP_CC_IS_PRESENT)
@@ -427,7 +1149,7 @@ tfw_cache_employ_resp(TfwHttpResp *resp)
 	    && !(req->cache_ctl.flags & CC_RESP_AUTHCAN))
 		return false;
 	if (!(resp->cache_ctl.flags & CC_RESP_CACHEIT)
-	    && !tfw_cache_status_bydef(resp))
+	    && !tfw_cache_status_bydef(resp) && !tfw_cache_negative_ttl(resp))
 		return false;
 #undef CC_RESP_AUTHCAN
 #undef CC_RESP_CACHEIT
@@ -451,6 +1173,8 @@ tfw_cache_calc_lifetime(TfwHttpResp *resp)
 		lifetime = resp->cache_ctl.max_age;
 	else if (resp->cache_ctl.flags & TFW_HTTP_CC_HDR_EXPIRES)
 		lifetime = resp->cache_ctl.expires - resp->date;
+	else if ((lifetime = tfw_cache_negative_ttl(resp)))
+		;
 	else
 		/* For now, set "unlimited" lifetime in this case. */
 		lifetime = UINT_MAX;	/* TODO: Heuristic lifetime. */
@@ -458,11 +1182,59 @@ tfw_cache_calc_lifetime(TfwHttpResp *resp)
 	return lifetime;
 }
 
+/*
+ * The freshness information of an entry, i.e. the MUST revalidate flag,
+ * @age, @date, @req_time, @resp_time, @lifetime and the RFC 5861 windows, is
+ * updated in place by tfw_cache_refresh_node() while lockless readers serve
+ * the entry. The readers take a consistent snapshot of the fields in
+ * tfw_cache_fresh_read_begin() and tfw_cache_fresh_read_retry() loop, just
+ * like seqcount_t readers. seqcount_t isn't used since the entries are
+ * loaded from the database file, while its lockdep map is valid only for the
+ * running kernel. There are no writer locks as well, so the writers are
+ * serialized by @fresh_seq itself.
+ */
+static unsigned int
+tfw_cache_fresh_read_begin(TfwCacheEntry *ce)
+{
+	unsigned int seq;
+
+	while ((seq = smp_load_acquire(&ce->fresh_seq)) & 1)
+		cpu_relax();
+
+	return seq;
+}
+
+static bool
+tfw_cache_fresh_read_retry(TfwCacheEntry *ce, unsigned int seq)
+{
+	smp_rmb();
+
+	return READ_ONCE(ce->fresh_seq) != seq;
+}
+
+static void
+tfw_cache_fresh_write_begin(TfwCacheEntry *ce)
+{
+	unsigned int seq;
+
+	for ( ; ; cpu_relax()) {
+		seq = READ_ONCE(ce->fresh_seq);
+		if (!(seq & 1) && cmpxchg(&ce->fresh_seq, seq, seq + 1) == seq)
+			break;
+	}
+}
+
+static void
+tfw_cache_fresh_write_end(TfwCacheEntry *ce)
+{
+	smp_store_release(&ce->fresh_seq, ce->fresh_seq + 1);
+}
+
 /*
  * Calculate the current entry age according to RFC 7234 4.2.3.
  */
 static long
-tfw_cache_entry_age(TfwCacheEntry *ce)
+__tfw_cache_entry_age(TfwCacheEntry *ce)
 {
 	long apparent_age = max_t(long, 0, ce->resp_time - ce->date);
 	long corrected_age = ce->age + ce->resp_time - ce->req_time;
@@ -470,6 +1242,20 @@ tfw_cache_entry_age(TfwCacheEntry *ce)
 	return (initial_age + tfw_current_timestamp() - ce->resp_time);
 }
 
+static long
+tfw_cache_entry_age(TfwCacheEntry *ce)
+{
+	unsigned int seq;
+	long age;
+
+	do {
+		seq = tfw_cache_fresh_read_begin(ce);
+		age = __tfw_cache_entry_age(ce);
+	} while (tfw_cache_fresh_read_retry(ce, seq));
+
+	return age;
+}
+
 /*
  * Given Cache Control arguments in the request and the response,
  * as well as the stored cache entry parameters, determine if the
@@ -486,9 +1272,9 @@ tfw_cache_entry_age(TfwCacheEntry *ce)
  * to a client, provided that the cache policy allows that.
  */
 static long
-tfw_cache_entry_is_live(TfwHttpReq *req, TfwCacheEntry *ce)
+__tfw_cache_entry_is_live(TfwHttpReq *req, TfwCacheEntry *ce)
 {
-	long ce_age = tfw_cache_entry_age(ce);
+	long ce_age = __tfw_cache_entry_age(ce);
 	long ce_lifetime, lt_fresh = UINT_MAX;
 
 	if (ce->lifetime <= 0)
@@ -514,6 +1300,110 @@ tfw_cache_entry_is_live(TfwHttpReq *req, TfwCacheEntry *ce)
 	return ce_lifetime > ce_age ? ce_lifetime : 0;
 }
 
+static long
+tfw_cache_entry_is_live(TfwHttpReq *req, TfwCacheEntry *ce)
+{
+	unsigned int seq;
+	long lifetime;
+
+	do {
+		seq = tfw_cache_fresh_read_begin(ce);
+		lifetime = __tfw_cache_entry_is_live(req, ce);
+	} while (tfw_cache_fresh_read_retry(ce, seq));
+
+	return lifetime;
+}
+
+/*
+ * RFC 5861: stale entry may be served within @window seconds after it
+ * became stale unless revalidation is required by must-revalidate or
+ * proxy-revalidate or the entry was purged.
+ *
+ * Returns the value of the stale lifetime like tfw_cache_entry_is_live() or
+ * zero if the entry may not be served.
+ */
+static long
+tfw_cache_entry_stale_lifetime(TfwCacheEntry *ce, long window)
+{
+	unsigned int seq;
+	long lifetime;
+
+	do {
+		seq = tfw_cache_fresh_read_begin(ce);
+		lifetime = ce->lifetime + window;
+		if (!window || ce->lifetime <= 0
+		    || (ce->flags & TFW_CE_MUST_REVAL)
+		    || lifetime <= __tfw_cache_entry_age(ce))
+			lifetime = 0;
+	} while (tfw_cache_fresh_read_retry(ce, seq));
+
+	return lifetime;
+}
+
+/*
+ * Only one refresh request for the entry @ce is issued per
+ * TFW_CACHE_REFRESH_TIMEOUT, tell if @req is the one to issue it.
+ */
+static bool
+tfw_cache_entry_refresh_own(TfwHttpReq *req, TfwCacheEntry *ce)
+{
+	unsigned long now = jiffies, t = READ_ONCE(ce->refresh);
+
+	if (req->method != TFW_HTTP_METH_GET)
+		return false;
+	if (t && time_before(now, t + TFW_CACHE_REFRESH_TIMEOUT))
+		return false;
+
+	return cmpxchg(&ce->refresh, t, now) == t;
+}
+
+/*
+ * Start revalidation of the stale entry @ce on behalf of @req. Other
+ * requests are served by the stale entry meantime.
+ */
+static void
+tfw_cache_entry_refresh(TfwHttpReq *req, TfwCacheEntry *ce)
+{
+	if (!tfw_cache_entry_refresh_own(req, ce))
+		return;
+
+	T_DBG2("Cache: refresh stale entry key=%lx\n", ce->key);
+	TFW_INC_STAT_BH(cache.refreshes);
+	tfw_http_cache_refresh(req);
+}
+
+/*
+ * Tell if the resource of @req with @key is requested often enough to be
+ * replicated to all the nodes in hybrid mode. The requests are counted in
+ * the shard node of the key.
+ */
+static bool
+tfw_cache_hot(TfwHttpReq *req, unsigned long key)
+{
+	return cache_cfg.cache == TFW_CACHE_HYBRID
+	       && tfw_cache_sketch_estimate(c_nodes[req->node].sketch, key)
+		  >= cache_cfg.hybrid_hot;
+}
+
+/*
+ * Hybrid cache: entry @ce of the shard node is served to @req from other
+ * node. Promote the entry to the replicas on all the nodes if it's hot.
+ * The entries reference the pages of their node databases, so they aren't
+ * copied between the nodes. Instead, the resource is fetched in background
+ * like a stale entry, and the response is stored on all the nodes, see
+ * tfw_cache_add().
+ */
+static void
+tfw_cache_promote(TfwHttpReq *req, TfwCacheEntry *ce)
+{
+	if (ce->slice || !tfw_cache_hot(req, tfw_cache_key(req))
+	    || !tfw_cache_entry_refresh_own(req, ce))
+		return;
+
+	T_DBG2("Cache: promote hot entry key=%lx\n", ce->key);
+	tfw_http_cache_refresh(req);
+}
+
 static bool
 tfw_cache_cond_none_match(TfwHttpReq *req, TfwCacheEntry *ce)
 {
@@ -540,102 +1430,446 @@ tfw_cache_cond_none_match(TfwHttpReq *req, TfwCacheEntry *ce)
 }
 
 /**
- * Add a new header with size of @len starting from @data to HTTP response @resp,
- * expanding the @resp with new skb/frags if needed.
+ * Find the chunk of @ce record which contains data at offset @off and set @p
+ * to the data.
  */
-static int
-tfw_cache_h2_write(TDB *db, TdbVRec **trec, TfwHttpResp *resp, char **data,
-		   size_t len, TfwDecodeCacheIter *dc_iter)
+static TdbVRec *
+tfw_cache_trec_at(TDB *db, TfwCacheEntry *ce, long off, char **p)
 {
-	TfwStr c = { 0 };
-	TdbVRec *tr = *trec;
-	TfwHttpTransIter *mit = &resp->mit;
-	TfwMsgIter *it = &mit->iter;
-	int r = 0, copied = 0;
-
-	while (1)  {
-		c.data = *data;
-		c.len = min(tr->data + tr->len - *data, (long)(len - copied));
-		if (!dc_iter->skip) {
-			r = tfw_http_msg_expand_data(it, &resp->msg.skb_head,
-						     &c, &mit->start_off);
-			if (unlikely(r))
-				break;
+	TdbVRec *trec = &ce->trec;
 
-			dc_iter->acc_len += c.len;
-		}
+	*p = TDB_PTR(db->hdr, off);
+	while (trec && (*p < trec->data || *p > trec->data + trec->len))
+		trec = tdb_next_rec_chunk(db, trec);
 
-		copied += c.len;
-		*data += c.len;
+	return trec;
+}
 
-		T_DBG3("%s: len='%zu', copied='%d', dc_iter->acc_len='%lu',"
-		       " dc_iter->skip='%d'\n", __func__, len, copied,
-		       dc_iter->acc_len, dc_iter->skip);
+/**
+ * Copy @len bytes of @ce record at offset @off, which can span several record
+ * chunks, to a buffer allocated from @pool.
+ *
+ * @return the buffer or NULL on failure.
+ */
+static char *
+tfw_cache_read_str(TDB *db, TfwPool *pool, TfwCacheEntry *ce, long off,
+		   unsigned int len)
+{
+	long n;
+	char *buf, *p;
+	unsigned int done = 0;
+	TdbVRec *trec;
 
-		if (copied == len)
-			break;
+	if (!(buf = tfw_pool_alloc(pool, len)))
+		return NULL;
 
-		tr = *trec = tdb_next_rec_chunk(db, tr);
-		BUG_ON(!tr);
-		*data = tr->data;
+	trec = tfw_cache_trec_at(db, ce, off, &p);
+	while (done < len) {
+		if (unlikely(!trec))
+			return NULL;
+		n = min_t(long, len - done, trec->data + trec->len - p);
+		memcpy_fast(buf + done, p, n);
+		done += n;
+		if ((trec = tdb_next_rec_chunk(db, trec)))
+			p = trec->data;
 	}
 
-	return r;
+	return buf;
 }
 
 /**
- * Same as @tfw_cache_h2_write(), but also decode the header from HTTP/2 format
- * before writing it into the response (used e.g. for HTTP/1.1-response creation
- * from cache).
+ * Calculate the 206 response payload length for ranges @rs of stored
+ * response @ce. Several ranges are sent as multipart/byteranges media type
+ * (RFC 7233 4.1), each body part carries Content-Type of the representation.
+ *
+ * @return false if the ranges can't be served and the full response must be
+ * sent.
  */
-static int
-tfw_cache_h2_decode_write(TDB *db, TdbVRec **trec, TfwHttpResp *resp,
-			  char **data, size_t len, TfwDecodeCacheIter *dc_iter)
+static bool
+tfw_cache_ranges_init(TfwHttpReq *req, TfwCacheRanges *rs, TfwCacheEntry *ce)
 {
-	unsigned long m_len;
-	TdbVRec *tr = *trec;
-	int r = 0, acc = 0;
-	TfwHPack hp = {};
+	int i;
 
-	while (1)  {
-		m_len = min(tr->data + tr->len - *data, (long)(len - acc));
-		if (!dc_iter->skip) {
-			r = tfw_hpack_cache_decode_expand(&hp, resp, *data,
-							  m_len, dc_iter);
-			if (unlikely(r))
-				break;
-		}
+	rs->clen = 0;
+	for (i = 0; i < rs->n; ++i)
+		rs->clen += rs->last[i] - rs->first[i] + 1;
+	if (rs->n == 1)
+		return true;
 
-		acc += m_len;
-		*data += m_len;
-		if (acc == len) {
-			bzero_fast(dc_iter->__off,
-				   sizeof(*dc_iter)
-				   - offsetof(TfwDecodeCacheIter, __off));
-			break;
-		}
+	rs->ctype = NULL;
+	rs->ctype_len = ce->ctype_len;
+	if (rs->ctype_len
+	    && (rs->ctype_len > TFW_CACHE_CTYPE_MAX
+		|| !(rs->ctype = tfw_cache_read_str(node_db(), req->pool, ce,
+						    ce->ctype,
+						    ce->ctype_len))))
+		return false;
 
-		tr = *trec = tdb_next_rec_chunk(db, tr);
-		BUG_ON(!tr);
-		*data = tr->data;
-	}
+	snprintf(rs->boundary, sizeof(rs->boundary), "%016lx",
+		 ce->trec.key ^ ce->resp_time);
+	for (i = 0; i < rs->n; ++i)
+		rs->clen += tfw_cache_range_part_hdr(NULL, 0, rs, i);
+	rs->clen += SLEN(S_CRLF "--" "--" S_CRLF) + TFW_CACHE_BOUNDARY_LEN;
 
-	return r;
+	return true;
 }
 
-static int
-tfw_cache_set_status(TDB *db, TfwCacheEntry *ce, TfwHttpResp *resp,
-		     TdbVRec **trec, char **p, unsigned long *acc_len)
+/**
+ * Copy the value of header @name of message @hm to @buf of
+ * TFW_CACHE_RANGE_HDR_MAX bytes and set @end to the value end.
+ *
+ * @return the value start in @buf or NULL if there is no such header, or
+ * it's duplicated or too long.
+ */
+static const char *
+tfw_cache_range_hdr(TfwHttpMsg *hm, const TfwStr *name, char *buf,
+		    const char **end)
 {
-	int r;
-	TfwMsgIter *it = &resp->mit.iter;
-	struct sk_buff **skb_head = &resp->msg.skb_head;
-	bool h2_mode = TFW_MSG_H2(resp->req);
-	TfwDecodeCacheIter dc_iter = {};
+	const char *p;
+	TfwStr *hdr;
+	size_t len;
+	unsigned int hid;
 
-	if (h2_mode)
-		resp->mit.start_off = FRAME_HEADER_SIZE;
-	else
+	hid = __http_hdr_lookup(hm, name);
+	if (hid == hm->h_tbl->off)
+		return NULL;
+	hdr = &hm->h_tbl->tbl[hid];
+	if (TFW_STR_DUP(hdr) || hdr->len >= TFW_CACHE_RANGE_HDR_MAX)
+		return NULL;
+
+	/*
+	 * The header name is followed by a colon and optional whitespace for
+	 * HTTP/1.1 and directly by the value for HTTP/2.
+	 */
+	len = tfw_str_to_cstr(hdr, buf, TFW_CACHE_RANGE_HDR_MAX);
+	p = buf + name->len;
+	*end = buf + len;
+	if (p < *end && *p == ':')
+		++p;
+	while (p < *end && (*p == ' ' || *p == '\t'))
+		++p;
+
+	return p;
+}
+
+/**
+ * Cut byte ranges @rs to the slice stored in @ce. The ranges must start
+ * within the slice, the ranges crossing the slice end are served up to the
+ * end, so the client requests the rest from the next slice.
+ */
+static bool
+tfw_cache_slice_ranges(TfwCacheRanges *rs, TfwCacheEntry *ce)
+{
+	unsigned long end = rs->off + ce->body_len;
+	int i;
+
+	for (i = 0; i < rs->n; ++i) {
+		if (rs->first[i] < rs->off || rs->first[i] >= end)
+			return false;
+		rs->last[i] = min(rs->last[i], end - 1);
+	}
+
+	return true;
+}
+
+/**
+ * Find Range request header (RFC 7233 3.1) and select the byte ranges of
+ * the stored response @ce to serve. Only complete 200 responses without
+ * chunked transfer coding and slices are served by ranges, compressed
+ * variants are always sent in full. If-Range requests are served with the
+ * full representation, which is always allowed by RFC 7233 3.2.
+ *
+ * Return value is the same as for tfw_cache_parse_ranges(), @0 means that
+ * the full response must be sent.
+ */
+static int
+tfw_cache_req_ranges(TfwHttpReq *req, TfwCacheEntry *ce, TfwCacheRanges *rs)
+{
+	static const TfwStr h_range = TFW_STR_STRING("range");
+	static const TfwStr h_if_range = TFW_STR_STRING("if-range");
+	char buf[TFW_CACHE_RANGE_HDR_MAX];
+	const char *p, *end;
+	int r;
+
+	rs->n = 0;
+	if (req->method != TFW_HTTP_METH_GET
+	    || (ce->resp_status != 200 && !ce->slice)
+	    || test_bit(TFW_HTTP_B_CHUNKED, ce->hmflags) || ce->coding)
+		return 0;
+
+	if (__http_hdr_lookup((TfwHttpMsg *)req, &h_if_range)
+	    != req->h_tbl->off)
+		return 0;
+	if (!(p = tfw_cache_range_hdr((TfwHttpMsg *)req, &h_range, buf, &end)))
+		return 0;
+
+	rs->off = ce->slice ? ce->slice - 1 : 0;
+	rs->total = ce->slice ? ce->slice_total : ce->body_len;
+	r = tfw_cache_parse_ranges(p, end, rs->total, rs);
+	if (r > 0 && ce->slice && !tfw_cache_slice_ranges(rs, ce))
+		r = 0;
+	if (r > 0 && !tfw_cache_ranges_init(req, rs, ce))
+		r = 0;
+	if (r <= 0)
+		rs->n = 0;
+
+	return r;
+}
+
+/**
+ * Remove Range header from the request @req before forwarding it upstream,
+ * so the complete response is fetched and stored in the cache, and the
+ * following range requests are served from the cache.
+ */
+static void
+tfw_cache_req_del_range(TfwHttpReq *req)
+{
+	static const TfwStr h_range = TFW_STR_STRING("range");
+	unsigned int hid;
+
+	if (req->method != TFW_HTTP_METH_GET)
+		return;
+	hid = __http_hdr_lookup((TfwHttpMsg *)req, &h_range);
+	if (hid == req->h_tbl->off)
+		return;
+
+	if (TFW_MSG_H2(req)) {
+		TfwStr *dup, *dup_end, *hdr = &req->h_tbl->tbl[hid];
+
+		/* Empty headers are skipped on HTTP/1.1 request building. */
+		TFW_STR_FOR_EACH_DUP(dup, hdr, dup_end) {
+			--req->pit.hdrs_cnt;
+			req->pit.hdrs_len -= dup->len;
+		}
+		TFW_STR_INIT(hdr);
+		return;
+	}
+	if (TFW_HTTP_MSG_HDR_DEL((TfwHttpMsg *)req, "range", TFW_HTTP_HDR_RAW))
+		T_WARN("Cache: cannot remove Range header from request\n");
+}
+
+/**
+ * Serve the byte range requested by @req from a slice of the representation
+ * if slicing is configured. Only GET requests of a single range with known
+ * first position are served by slices, since the representation length is
+ * unknown until a slice is fetched. The slice offset is saved in @req to
+ * calculate the cache key, see tfw_cache_key().
+ */
+static void
+tfw_cache_slice_init(TfwHttpReq *req)
+{
+	static const TfwStr h_range = TFW_STR_STRING("range");
+	static const TfwStr h_if_range = TFW_STR_STRING("if-range");
+	char buf[TFW_CACHE_RANGE_HDR_MAX];
+	const char *p, *end;
+	unsigned long first, last;
+	int nl;
+
+	if (!cache_cfg.slice || req->method != TFW_HTTP_METH_GET)
+		return;
+	if (__http_hdr_lookup((TfwHttpMsg *)req, &h_if_range)
+	    != req->h_tbl->off)
+		return;
+	if (!(p = tfw_cache_range_hdr((TfwHttpMsg *)req, &h_range, buf, &end)))
+		return;
+
+	if (end - p < SLEN("bytes=") || strncasecmp(p, "bytes=", 6))
+		return;
+	p += SLEN("bytes=");
+	if (__range_pos(&p, end, &first) <= 0 || p == end || *p++ != '-')
+		return;
+	if ((nl = __range_pos(&p, end, &last)) < 0 || (nl && last < first))
+		return;
+	while (p < end && (*p == ' ' || *p == '\t'))
+		++p;
+	if (p != end)
+		return;
+
+	req->cache_slice = first - first % cache_cfg.slice + 1;
+}
+
+/**
+ * Replace Range header of @req by the range of the whole slice before
+ * forwarding the request upstream, so the slice is fetched and stored.
+ */
+static void
+tfw_cache_req_slice_range(TfwHttpReq *req)
+{
+	static const TfwStr h_range = TFW_STR_STRING("range");
+	unsigned long off = req->cache_slice - 1;
+	TfwStr *hdr, *c;
+	unsigned int hid;
+	char *buf;
+	int n;
+
+	if (!(buf = tfw_pool_alloc(req->pool, TFW_CACHE_RANGE_HDR_MAX)))
+		goto err;
+	n = snprintf(buf, TFW_CACHE_RANGE_HDR_MAX, "bytes=%lu-%lu", off,
+		     off + cache_cfg.slice - 1);
+
+	if (!TFW_MSG_H2(req)) {
+		if (tfw_http_msg_hdr_xfrm((TfwHttpMsg *)req, "range",
+					  SLEN("range"), buf, n,
+					  TFW_HTTP_HDR_RAW, 0))
+			goto err;
+		return;
+	}
+
+	/*
+	 * HTTP/2 requests are converted to HTTP/1.1 from the headers table,
+	 * so just replace the header descriptor, see tfw_h2_adjust_req().
+	 */
+	hid = __http_hdr_lookup((TfwHttpMsg *)req, &h_range);
+	if (WARN_ON_ONCE(hid == req->h_tbl->off))
+		return;
+	if (!(c = tfw_pool_alloc(req->pool, sizeof(TfwStr) * 2)))
+		goto err;
+	c[0] = (TfwStr){ .data = "range", .len = SLEN("range") };
+	c[1] = (TfwStr){ .data = buf, .len = n, .flags = TFW_STR_HDR_VALUE };
+
+	hdr = &req->h_tbl->tbl[hid];
+	req->pit.hdrs_len -= hdr->len;
+	*hdr = (TfwStr){ .chunks = c, .len = SLEN("range") + n, .nchunks = 2 };
+	req->pit.hdrs_len += hdr->len;
+	return;
+err:
+	T_WARN("Cache: cannot set slice range in request\n");
+}
+
+/**
+ * Get the representation length from Content-Range header of 206 response
+ * @resp to a slice request. The response must contain exactly the requested
+ * slice, only the last slice of the representation is shorter.
+ *
+ * @return the representation length or zero if @resp isn't the slice.
+ */
+static unsigned long
+tfw_cache_slice_total(TfwHttpResp *resp)
+{
+	static const TfwStr h_crange = TFW_STR_STRING("content-range");
+	char buf[TFW_CACHE_RANGE_HDR_MAX];
+	const char *p, *end;
+	unsigned long first, last, total;
+	unsigned long off = resp->req->cache_slice - 1;
+
+	if (test_bit(TFW_HTTP_B_CHUNKED, resp->flags))
+		return 0;
+	if (!(p = tfw_cache_range_hdr((TfwHttpMsg *)resp, &h_crange, buf,
+				      &end)))
+		return 0;
+
+	if (end - p < SLEN("bytes ") || strncasecmp(p, "bytes ", 6))
+		return 0;
+	p += SLEN("bytes ");
+	if (__range_pos(&p, end, &first) <= 0 || p == end || *p++ != '-'
+	    || __range_pos(&p, end, &last) <= 0 || p == end || *p++ != '/'
+	    || __range_pos(&p, end, &total) <= 0)
+		return 0;
+
+	if (first != off || last != min(off + cache_cfg.slice, total) - 1
+	    || resp->body.len != last - first + 1)
+		return 0;
+
+	return total;
+}
+
+/**
+ * Add a new header with size of @len starting from @data to HTTP response @resp,
+ * expanding the @resp with new skb/frags if needed.
+ */
+static int
+tfw_cache_h2_write(TDB *db, TdbVRec **trec, TfwHttpResp *resp, char **data,
+		   size_t len, TfwDecodeCacheIter *dc_iter)
+{
+	TfwStr c = { 0 };
+	TdbVRec *tr = *trec;
+	TfwHttpTransIter *mit = &resp->mit;
+	TfwMsgIter *it = &mit->iter;
+	int r = 0, copied = 0;
+
+	while (1)  {
+		c.data = *data;
+		c.len = min(tr->data + tr->len - *data, (long)(len - copied));
+		if (!dc_iter->skip) {
+			r = tfw_http_msg_expand_data(it, &resp->msg.skb_head,
+						     &c, &mit->start_off);
+			if (unlikely(r))
+				break;
+
+			dc_iter->acc_len += c.len;
+		}
+
+		copied += c.len;
+		*data += c.len;
+
+		T_DBG3("%s: len='%zu', copied='%d', dc_iter->acc_len='%lu',"
+		       " dc_iter->skip='%d'\n", __func__, len, copied,
+		       dc_iter->acc_len, dc_iter->skip);
+
+		if (copied == len)
+			break;
+
+		tr = *trec = tdb_next_rec_chunk(db, tr);
+		BUG_ON(!tr);
+		*data = tr->data;
+	}
+
+	return r;
+}
+
+/**
+ * Same as @tfw_cache_h2_write(), but also decode the header from HTTP/2 format
+ * before writing it into the response (used e.g. for HTTP/1.1-response creation
+ * from cache).
+ */
+static int
+tfw_cache_h2_decode_write(TDB *db, TdbVRec **trec, TfwHttpResp *resp,
+			  char **data, size_t len, TfwDecodeCacheIter *dc_iter)
+{
+	unsigned long m_len;
+	TdbVRec *tr = *trec;
+	int r = 0, acc = 0;
+	TfwHPack hp = {};
+
+	while (1)  {
+		m_len = min(tr->data + tr->len - *data, (long)(len - acc));
+		if (!dc_iter->skip) {
+			r = tfw_hpack_cache_decode_expand(&hp, resp, *data,
+							  m_len, dc_iter);
+			if (unlikely(r))
+				break;
+		}
+
+		acc += m_len;
+		*data += m_len;
+		if (acc == len) {
+			bzero_fast(dc_iter->__off,
+				   sizeof(*dc_iter)
+				   - offsetof(TfwDecodeCacheIter, __off));
+			break;
+		}
+
+		tr = *trec = tdb_next_rec_chunk(db, tr);
+		BUG_ON(!tr);
+		*data = tr->data;
+	}
+
+	return r;
+}
+
+static int
+tfw_cache_set_status(TDB *db, TfwCacheEntry *ce, TfwHttpResp *resp,
+		     TdbVRec **trec, char **p, unsigned long *acc_len)
+{
+	int r;
+	TfwMsgIter *it = &resp->mit.iter;
+	struct sk_buff **skb_head = &resp->msg.skb_head;
+	bool h2_mode = TFW_MSG_H2(resp->req);
+	TfwDecodeCacheIter dc_iter = {};
+
+	if (h2_mode)
+		resp->mit.start_off = FRAME_HEADER_SIZE;
+	else
 		dc_iter.skip = true;
 
 
@@ -684,6 +1918,84 @@ tfw_cache_set_status(TDB *db, TfwCacheEntry *ce, TfwHttpResp *resp,
 	return 0;
 }
 
+/**
+ * Same as tfw_cache_set_status(), but skip the stored status and write
+ * 206 (Partial Content) status instead.
+ */
+static int
+tfw_cache_set_status_206(TDB *db, TfwCacheEntry *ce, TfwHttpResp *resp,
+			 TdbVRec **trec, char **p, unsigned long *acc_len)
+{
+	int r;
+	TfwHPackInt hp_idx;
+	TfwHttpTransIter *mit = &resp->mit;
+	TfwDecodeCacheIter dc_iter = { .skip = true };
+	TfwStr s_line = TFW_STR_STRING(S_0 "206 Partial Content" S_CRLF);
+
+	r = tfw_cache_h2_write(db, trec, resp, p, ce->status_len + ce->rph_len,
+			       &dc_iter);
+	if (unlikely(r))
+		return r;
+
+	if (!TFW_MSG_H2(resp->req))
+		return tfw_http_msg_expand_data(&mit->iter, &resp->msg.skb_head,
+						&s_line, NULL);
+
+	/* Fully indexed ':status' pseudo-header, as stored in cache. */
+	write_int(tfw_h2_pseudo_index(206), 0x7F, 0x80, &hp_idx);
+	s_line.data = hp_idx.buf;
+	s_line.len = hp_idx.sz;
+	mit->start_off = FRAME_HEADER_SIZE;
+	r = tfw_http_msg_expand_data(&mit->iter, &resp->msg.skb_head, &s_line,
+				     &mit->start_off);
+	if (likely(!r))
+		*acc_len += s_line.len;
+
+	return r;
+}
+
+/**
+ * Extend the response header modifications @h_mods by removal of the stored
+ * headers, which are rewritten in 206 response. The extra modifications are
+ * appended, so @mit->found bits of @h_mods are kept in place.
+ */
+static TfwHdrMods *
+tfw_cache_hdr_mods_206(TfwHttpResp *resp, TfwCacheEntry *ce,
+		       TfwHdrMods *h_mods, const TfwCacheRanges *rs)
+{
+	static TfwStr h_clen = TFW_STR_STRING("content-length");
+	static TfwStr h_ctype = TFW_STR_STRING("content-type");
+	static TfwStr h_crange = TFW_STR_STRING("content-range");
+	size_t n = h_mods ? h_mods->sz : 0;
+	TfwHdrMods *m;
+
+	if (unlikely(n + 3 > TFW_USRHDRS_ARRAY_SZ))
+		return NULL;
+	m = tfw_pool_alloc(resp->pool,
+			   sizeof(*m) + (n + 3) * sizeof(TfwHdrModsDesc));
+	if (unlikely(!m))
+		return NULL;
+
+	m->hdrs = (TfwHdrModsDesc *)(m + 1);
+	if (n)
+		memcpy_fast(m->hdrs, h_mods->hdrs, n * sizeof(TfwHdrModsDesc));
+	m->hdrs[n++] = (TfwHdrModsDesc){
+		.hdr = &h_clen, .hid = TFW_HTTP_HDR_CONTENT_LENGTH
+	};
+	if (rs->n > 1)
+		m->hdrs[n++] = (TfwHdrModsDesc){
+			.hdr = &h_ctype, .hid = TFW_HTTP_HDR_CONTENT_TYPE
+		};
+	/* Stored slices describe the whole slice by Content-Range. */
+	if (ce->slice)
+		m->hdrs[n++] = (TfwHdrModsDesc){
+			.hdr = &h_crange, .hid = TFW_HTTP_HDR_RAW
+		};
+	m->sz = n;
+
+	return m;
+}
+
 /**
  * Write HTTP header to skb data.
  */
@@ -793,9 +2105,11 @@ tfw_cache_send_304(TfwHttpReq *req, TfwCacheEntry *ce)
 			goto err_setup;
 		}
 	}
+	resp->date = READ_ONCE(ce->date);
 
 	if (!TFW_MSG_H2(req)) {
-		if (tfw_http_msg_expand_data(it, skb_head, &g_crlf, NULL))
+		if (tfw_http_expand_hdr_date(resp)
+		    || tfw_http_msg_expand_data(it, skb_head, &g_crlf, NULL))
 			goto err_setup;
 
 		tfw_http_resp_fwd(resp);
@@ -803,6 +2117,11 @@ tfw_cache_send_304(TfwHttpReq *req, TfwCacheEntry *ce)
 		return;
 	}
 
+	if (tfw_h2_add_hdr_date(resp, TFW_H2_TRANS_EXPAND, true))
+		goto err_setup;
+	/* The headers encoded on the fly, including ':status'. */
+	h_len += resp->mit.acc_len;
+
 	if (tfw_h2_frame_local_resp(resp, stream_id, h_len, NULL))
 		goto err_setup;
 
@@ -816,34 +2135,115 @@ err_create:
 	tfw_http_resp_build_error(req);
 }
 
+static int tfw_cache_expand_hdr(TfwHttpResp *resp, char *name, size_t nlen,
+				char *val, size_t vlen,
+				unsigned short hpack_idx);
+
 /**
- * Received request can contain validation information. Process it according to
- * RFC 7234 Section 4.3.2.
- *
- * Return value:
- *	@true: @req can be served from cache;
- *	@false: Response was sent to client (412 or 304).
+ * RFC 7233 Section 4.4: a server generating a 416 response to a byte-range
+ * request SHOULD send a Content-Range header field with an unsatisfied-range
+ * value, i.e. "bytes */" followed by the representation length @total.
  */
-static bool
-tfw_handle_validation_req(TfwHttpReq *req, TfwCacheEntry *ce)
+static void
+tfw_cache_send_416(TfwHttpReq *req, unsigned long total)
 {
-	if ((ce->resp_status != 200) && (ce->resp_status != 206))
-		return true;
-	/* RFC 7232 Section 5. */
-	/* TODO: Add CONNECT */
-	if ((req->method == TFW_HTTP_METH_OPTIONS)
-	    || (req->method == TFW_HTTP_METH_TRACE))
-		return true;
+	int n;
+	TfwMsgIter *it;
+	TfwHttpResp *resp;
+	struct sk_buff **skb_head;
+	unsigned int stream_id = 0;
+	char buf[TFW_CACHE_RANGE_HDR_MAX];
 
-	/* If-None-Match: */
-	if (!TFW_STR_EMPTY(&req->h_tbl->tbl[TFW_HTTP_HDR_IF_NONE_MATCH])) {
-		if (!tfw_cache_cond_none_match(req, ce)) {
-			if ((req->method == TFW_HTTP_METH_GET)
-			    || (req->method == TFW_HTTP_METH_HEAD))
-				tfw_cache_send_304(req, ce);
-			else
-				tfw_http_send_resp(req, 412,
-						   "request validation: "
+	WARN_ON_ONCE(!list_empty(&req->fwd_list));
+	WARN_ON_ONCE(!list_empty(&req->nip_list));
+
+	if (!(resp = tfw_http_msg_alloc_resp_light(req)))
+		goto err_create;
+
+	it = &resp->mit.iter;
+	skb_head = &resp->msg.skb_head;
+
+	if (!TFW_MSG_H2(req)) {
+		if (tfw_http_prep_416(req, skb_head, it))
+			goto err_setup;
+	} else {
+		stream_id = tfw_h2_stream_id_close(req, HTTP2_HEADERS,
+						   HTTP2_F_END_STREAM);
+		if (unlikely(!stream_id))
+			goto err_setup;
+
+		resp->mit.start_off = FRAME_HEADER_SIZE;
+
+		if (tfw_h2_resp_status_write(resp, 416, TFW_H2_TRANS_EXPAND,
+					     true))
+			goto err_setup;
+	}
+
+	n = snprintf(buf, sizeof(buf), "bytes */%lu", total);
+	if (tfw_cache_expand_hdr(resp, "content-range", SLEN("content-range"),
+				 buf, n, 30))
+		goto err_setup;
+	resp->date = tfw_current_timestamp();
+
+	if (!TFW_MSG_H2(req)) {
+		if (tfw_http_expand_hdr_date(resp)
+		    || tfw_http_msg_expand_data(it, skb_head, &g_crlf, NULL))
+			goto err_setup;
+
+		tfw_http_resp_fwd(resp);
+
+		return;
+	}
+
+	if (tfw_h2_add_hdr_date(resp, TFW_H2_TRANS_EXPAND, true))
+		goto err_setup;
+
+	/* All the headers are encoded on the fly. */
+	if (tfw_h2_frame_local_resp(resp, stream_id, resp->mit.acc_len, NULL))
+		goto err_setup;
+
+	tfw_h2_resp_fwd(resp);
+
+	return;
+err_setup:
+	T_WARN("Can't build 416 response\n");
+	tfw_http_msg_free((TfwHttpMsg *)resp);
+err_create:
+	tfw_http_resp_build_error(req);
+}
+
+/**
+ * Received request can contain validation information. Process it according to
+ * RFC 7234 Section 4.3.2.
+ *
+ * Byte ranges of the stored response to serve are saved in @rs.
+ *
+ * Return value:
+ *	@true: @req can be served from cache;
+ *	@false: Response was sent to client (412, 304 or 416).
+ */
+static bool
+tfw_handle_validation_req(TfwHttpReq *req, TfwCacheEntry *ce,
+			  TfwCacheRanges *rs)
+{
+	rs->n = 0;
+	if ((ce->resp_status != 200) && (ce->resp_status != 206))
+		return true;
+	/* RFC 7232 Section 5. */
+	/* TODO: Add CONNECT */
+	if ((req->method == TFW_HTTP_METH_OPTIONS)
+	    || (req->method == TFW_HTTP_METH_TRACE))
+		return true;
+
+	/* If-None-Match: */
+	if (!TFW_STR_EMPTY(&req->h_tbl->tbl[TFW_HTTP_HDR_IF_NONE_MATCH])) {
+		if (!tfw_cache_cond_none_match(req, ce)) {
+			if ((req->method == TFW_HTTP_METH_GET)
+			    || (req->method == TFW_HTTP_METH_HEAD))
+				tfw_cache_send_304(req, ce);
+			else
+				tfw_http_send_resp(req, 412,
+						   "request validation: "
 						   "precondition failed");
 
 			return false;
@@ -874,11 +2274,452 @@ tfw_handle_validation_req(TfwHttpReq *req, TfwCacheEntry *ce)
 			return false;
 		}
 	}
-	/* TODO #499: Range GET requests. RFC 7232 Section 6, step 5. */
+	/* Range GET requests. RFC 7232 Section 6, step 5. */
+	if (tfw_cache_req_ranges(req, ce, rs) == -ERANGE) {
+		tfw_cache_send_416(req, rs->total);
+		return false;
+	}
 
 	return true;
 }
 
+/*
+ * Accept-Encoding content-codings distinguished by secondary cache keys, in
+ * the order they're written to the normalized header value.
+ */
+static const TfwStr tfw_cache_codings[] = {
+	TFW_STR_STRING("*"),
+	TFW_STR_STRING("br"),
+	TFW_STR_STRING("compress"),
+	TFW_STR_STRING("deflate"),
+	TFW_STR_STRING("gzip"),
+	TFW_STR_STRING("identity"),
+	TFW_STR_STRING("zstd"),
+};
+
+/**
+ * Look up request header @name among special and raw headers of @req.
+ * Returns the header id or @req->h_tbl->off if the header is absent.
+ */
+static unsigned int
+tfw_cache_vary_hdr_lookup(TfwHttpReq *req, const TfwStr *name)
+{
+	unsigned int id;
+	TfwHttpHdrTbl *ht = req->h_tbl;
+
+	for (id = TFW_HTTP_HDR_REGULAR; id < ht->off; ++id) {
+		TfwStr *h = &ht->tbl[id];
+
+		if (h->flags & TFW_STR_DUPLICATE)
+			h = TFW_STR_CHUNK(h, 0);
+		if (!__hdr_name_cmp(h, name))
+			break;
+	}
+
+	return id;
+}
+
+/**
+ * Append header value @p..@end to the normalized value @out of length @n.
+ * Leading and trailing whitespace as well as whitespace around commas is
+ * removed, other whitespace sequences are replaced by a single space. Values
+ * of duplicate headers are combined with commas (RFC 7234 4.1).
+ */
+static int
+tfw_cache_vary_norm(char *out, int n, const char *p, const char *end)
+{
+	bool ws = false;
+
+	if (n && p < end) {
+		if (n == TFW_CACHE_VARY_MAX)
+			return -E2BIG;
+		out[n++] = ',';
+	}
+	for ( ; p < end; ++p) {
+		if (*p == ' ' || *p == '\t') {
+			ws = true;
+			continue;
+		}
+		if (n + 2 > TFW_CACHE_VARY_MAX)
+			return -E2BIG;
+		if (ws && n && out[n - 1] != ',' && *p != ',')
+			out[n++] = ' ';
+		out[n++] = *p;
+		ws = false;
+	}
+
+	return n;
+}
+
+/**
+ * Whether Accept-Encoding coding parameters @p..@end reject the coding, i.e.
+ * contain zero quality value.
+ */
+static bool
+tfw_cache_coding_rejected(const char *p, const char *end)
+{
+	while (p < end && (*p == ';' || *p == ' '))
+		++p;
+	if (end - p < 3 || (*p != 'q' && *p != 'Q') || p[1] != '=')
+		return false;
+	for (p += 2; p < end && (*p == '0' || *p == '.'); ++p)
+		;
+
+	return p == end;
+}
+
+/**
+ * Reduce normalized Accept-Encoding value @val of length @n to the ordered
+ * list of known content-codings acceptable by the client, so all the clients
+ * accepting the same codings share the same response variant regardless of
+ * the codings order, quality values and letter case. The result is never
+ * longer than @n, so it's written in place.
+ */
+static int
+tfw_cache_vary_codings(char *val, int n)
+{
+	int i, len, out = 0;
+	unsigned int mask = 0;
+	char *tok, *par, *p = val, *end = val + n;
+
+	for ( ; p < end; p = par + 1) {
+		tok = p;
+		par = memchr(tok, ',', end - tok) ? : end;
+		p = memchr(tok, ';', par - tok) ? : par;
+		len = p - tok;
+		while (len && tok[len - 1] == ' ')
+			--len;
+		/* RFC 7230 4.2.1 and 4.2.3: x-gzip and x-compress aliases. */
+		if (len > 2 && !tfw_cstricmp(tok, "x-", 2)) {
+			tok += 2;
+			len -= 2;
+		}
+		if (tfw_cache_coding_rejected(p, par))
+			continue;
+		for (i = 0; i < ARRAY_SIZE(tfw_cache_codings); ++i)
+			if (len == tfw_cache_codings[i].len
+			    && !tfw_cstricmp(tok, tfw_cache_codings[i].data,
+					     len))
+			{
+				mask |= 1 << i;
+				break;
+			}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(tfw_cache_codings); ++i) {
+		if (!(mask & (1 << i)))
+			continue;
+		if (out)
+			val[out++] = ',';
+		memcpy_fast(val + out, tfw_cache_codings[i].data,
+			    tfw_cache_codings[i].len);
+		out += tfw_cache_codings[i].len;
+	}
+
+	return out;
+}
+
+/**
+ * Write normalized value of header @name of length @nlen from request @req
+ * to @out using @buf as a temporary buffer. Both the buffers are of
+ * TFW_CACHE_VARY_MAX bytes. Absent header has empty value.
+ */
+static int
+tfw_cache_vary_val(TfwHttpReq *req, const char *name, int nlen, char *out,
+		   char *buf)
+{
+	static const TfwStr h_ae = TFW_STR_STRING("accept-encoding");
+	TfwStr *dup, *dup_end, *hdr;
+	TfwStr s_name = { .data = (char *)name, .len = nlen };
+	unsigned int hid;
+	int n = 0;
+
+	hid = tfw_cache_vary_hdr_lookup(req, &s_name);
+	if (hid == req->h_tbl->off)
+		return 0;
+	hdr = &req->h_tbl->tbl[hid];
+
+	TFW_STR_FOR_EACH_DUP(dup, hdr, dup_end) {
+		const char *p, *end;
+
+		if (dup->len >= TFW_CACHE_VARY_MAX)
+			return -E2BIG;
+		/*
+		 * The header name is followed by a colon for HTTP/1.1 and
+		 * directly by the value for HTTP/2.
+		 */
+		end = buf + tfw_str_to_cstr(dup, buf, TFW_CACHE_VARY_MAX);
+		p = buf + nlen;
+		if (p < end && *p == ':')
+			++p;
+		if ((n = tfw_cache_vary_norm(out, n, p, end)) < 0)
+			return n;
+	}
+
+	if (nlen == h_ae.len && !tfw_cstricmp(name, h_ae.data, nlen))
+		n = tfw_cache_vary_codings(out, n);
+
+	return n;
+}
+
+/**
+ * Build secondary key @skey for response @resp from the request header fields
+ * listed in the response Vary header, RFC 7234 4.1. The key is a sequence of
+ * "name:value\n" lines with lower case names and normalized values, so the
+ * request headers can be matched against the key without parsing of the
+ * stored response headers.
+ *
+ * Returns -EINVAL if the response must not be stored, e.g. for "Vary: *".
+ */
+static int
+tfw_cache_vary_key(TfwHttpResp *resp, TfwStr *skey)
+{
+	static const TfwStr h_vary = TFW_STR_STRING("vary");
+	TfwHttpReq *req = resp->req;
+	TfwStr *dup, *dup_end, *hdr;
+	char *names, *buf, *val, *key, *p, *end, *tok, *next;
+	unsigned int hid;
+	int n, len, off = 0;
+
+	TFW_STR_INIT(skey);
+	hid = __http_hdr_lookup((TfwHttpMsg *)resp, &h_vary);
+	if (hid == resp->h_tbl->off)
+		return 0;
+	hdr = &resp->h_tbl->tbl[hid];
+
+	if (!(names = tfw_pool_alloc(resp->pool, TFW_CACHE_VARY_MAX * 4)))
+		return -ENOMEM;
+	buf = names + TFW_CACHE_VARY_MAX;
+	val = buf + TFW_CACHE_VARY_MAX;
+	key = val + TFW_CACHE_VARY_MAX;
+
+	TFW_STR_FOR_EACH_DUP(dup, hdr, dup_end) {
+		TfwStr s_nm = {}, s_val = {};
+
+		tfw_http_hdr_split(dup, &s_nm, &s_val, true);
+		if (s_val.len >= TFW_CACHE_VARY_MAX)
+			return -E2BIG;
+		end = names + tfw_str_to_cstr(&s_val, names, TFW_CACHE_VARY_MAX);
+
+		for (p = names; p < end; p = next + 1) {
+			next = memchr(p, ',', end - p) ? : end;
+			for (tok = p; tok < next && (*tok == ' ' || *tok == '\t');
+			     ++tok)
+				;
+			len = next - tok;
+			while (len && (tok[len - 1] == ' ' || tok[len - 1] == '\t'))
+				--len;
+			if (!len)
+				continue;
+			if (len == 1 && *tok == '*')
+				return -EINVAL;
+
+			n = tfw_cache_vary_val(req, tok, len, val, buf);
+			if (n < 0 || off + len + n + 2 > TFW_CACHE_VARY_MAX)
+				return -E2BIG;
+			tfw_cstrtolower(key + off, tok, len);
+			off += len;
+			key[off++] = ':';
+			memcpy_fast(key + off, val, n);
+			off += n;
+			key[off++] = '\n';
+		}
+	}
+
+	skey->data = key;
+	skey->len = off;
+
+	return 0;
+}
+
+/* Delimiters of relation types in Link header "rel" parameter. */
+#define TFW_CACHE_REL_DLM(c)	((c) == ' ' || (c) == '\t' || (c) == '"')
+
+/**
+ * Whether Link header element @p of @len bytes has "preload" relation type,
+ * RFC 8288 3.3. The target URI reference is skipped, so its characters are
+ * not taken for the parameters.
+ */
+static bool
+tfw_cache_link_preload(const char *p, int len)
+{
+	const char *end = p + len, *tok;
+
+	if (*p != '<' || !(p = memchr(p, '>', end - p)))
+		return false;
+
+	while ((p = memchr(p, ';', end - p))) {
+		for (++p; p < end && (*p == ' ' || *p == '\t'); ++p)
+			;
+		if (end - p < 4 || strncasecmp(p, "rel", 3))
+			continue;
+		for (p += 3; p < end && (*p == ' ' || *p == '\t'); ++p)
+			;
+		if (p == end || *p++ != '=')
+			continue;
+		/* The value is a token or a quoted list of relation types. */
+		while (p < end && *p != ';') {
+			for ( ; p < end && TFW_CACHE_REL_DLM(*p); ++p)
+				;
+			for (tok = p; p < end && *p != ';'; ++p)
+				if (TFW_CACHE_REL_DLM(*p))
+					break;
+			if (p - tok == 7 && !strncasecmp(tok, "preload", 7))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Collect the preload links from Link headers of @resp to @hints, so they
+ * can be sent in 103 (Early Hints) responses to the following requests for
+ * the resource, which miss the cache, RFC 8297. The links are separated by
+ * commas, as in a combined Link header value. The links, which don't fit
+ * TFW_CACHE_HINTS_MAX, are skipped.
+ */
+static int
+tfw_cache_hints(TfwHttpResp *resp, TfwStr *hints)
+{
+	static const TfwStr h_link = TFW_STR_STRING("link");
+	TfwStr *dup, *dup_end, *hdr;
+	char *val, *out, *p, *end, *tok, *next;
+	unsigned int hid;
+	int len, off = 0;
+	bool uri;
+
+	TFW_STR_INIT(hints);
+	if (!cache_cfg.early_hints)
+		return 0;
+	hid = __http_hdr_lookup((TfwHttpMsg *)resp, &h_link);
+	if (hid == resp->h_tbl->off)
+		return 0;
+	hdr = &resp->h_tbl->tbl[hid];
+
+	if (!(val = tfw_pool_alloc(resp->pool, TFW_CACHE_HINTS_MAX * 2)))
+		return -ENOMEM;
+	out = val + TFW_CACHE_HINTS_MAX;
+
+	TFW_STR_FOR_EACH_DUP(dup, hdr, dup_end) {
+		TfwStr s_nm = {}, s_val = {};
+
+		tfw_http_hdr_split(dup, &s_nm, &s_val, true);
+		if (s_val.len >= TFW_CACHE_HINTS_MAX)
+			continue;
+		end = val + tfw_str_to_cstr(&s_val, val, TFW_CACHE_HINTS_MAX);
+
+		for (p = val; p < end; p = next + 1) {
+			/* Commas in target URIs don't separate the links. */
+			for (next = p, uri = false; next < end; ++next) {
+				if (*next == '<' || *next == '>')
+					uri = *next == '<';
+				else if (*next == ',' && !uri)
+					break;
+			}
+			for (tok = p; tok < next && (*tok == ' ' || *tok == '\t');
+			     ++tok)
+				;
+			len = next - tok;
+			while (len && (tok[len - 1] == ' ' || tok[len - 1] == '\t'))
+				--len;
+			if (!len || !tfw_cache_link_preload(tok, len)
+			    || off + len + 2 > TFW_CACHE_HINTS_MAX)
+				continue;
+			if (off) {
+				out[off++] = ',';
+				out[off++] = ' ';
+			}
+			memcpy_fast(out + off, tok, len);
+			off += len;
+		}
+	}
+
+	hints->data = out;
+	hints->len = off;
+
+	return 0;
+}
+
+/**
+ * Match the secondary key of @ce against the request @req headers.
+ */
+static bool
+tfw_cache_entry_vary_eq(TDB *db, TfwHttpReq *req, TfwCacheEntry *ce)
+{
+	int n;
+	bool eq = false;
+	unsigned int off = 0;
+	size_t sz = TFW_CACHE_VARY_MAX * 2 + ce->vary_len;
+	char *buf, *skey, *p, *end, *val, *eol;
+	TdbVRec *trec;
+
+	if (!(buf = tfw_pool_alloc(req->pool, sz)))
+		return false;
+	skey = buf + TFW_CACHE_VARY_MAX * 2;
+
+	/* The secondary key can be spread over several record chunks. */
+	trec = tfw_cache_trec_at(db, ce, ce->vary, &p);
+	while (off < ce->vary_len) {
+		if (unlikely(!trec))
+			goto out;
+		n = min_t(long, ce->vary_len - off, trec->data + trec->len - p);
+		memcpy_fast(skey + off, p, n);
+		off += n;
+		if ((trec = tdb_next_rec_chunk(db, trec)))
+			p = trec->data;
+	}
+
+	for (p = skey, end = skey + off; p < end; p = eol + 1) {
+		val = memchr(p, ':', end - p);
+		eol = memchr(p, '\n', end - p);
+		if (WARN_ON_ONCE(!val || !eol || val > eol))
+			goto out;
+		++val;
+		n = tfw_cache_vary_val(req, p, val - p - 1, buf,
+				       buf + TFW_CACHE_VARY_MAX);
+		if (n != eol - val || memcmp(buf, val, n))
+			goto out;
+	}
+	eq = true;
+out:
+	tfw_pool_free(req->pool, buf, sz);
+
+	return eq;
+}
+
+/**
+ * Whether the client accepts gzip-compressed variants of cached responses.
+ * Only explicitly listed gzip coding is considered, a wildcard can't make
+ * us to send a coding which the client can't decode.
+ */
+static bool
+tfw_cache_req_gzip(TfwHttpReq *req)
+{
+	static const char h_ae[] = "accept-encoding";
+	char *buf, *p, *end, *next;
+	bool r = false;
+	int n;
+
+	if (!cache_cfg.compress)
+		return false;
+	if (!(buf = tfw_pool_alloc(req->pool, TFW_CACHE_VARY_MAX * 2)))
+		return false;
+
+	n = tfw_cache_vary_val(req, h_ae, SLEN(h_ae), buf,
+			       buf + TFW_CACHE_VARY_MAX);
+	for (p = buf, end = buf + max(n, 0); p < end; p = next + 1) {
+		next = memchr(p, ',', end - p) ? : end;
+		if (next - p == SLEN("gzip") && !memcmp(p, "gzip", next - p)) {
+			r = true;
+			break;
+		}
+	}
+	tfw_pool_free(req->pool, buf, TFW_CACHE_VARY_MAX * 2);
+
+	return r;
+}
+
 static bool
 tfw_cache_entry_key_eq(TDB *db, TfwHttpReq *req, TfwCacheEntry *ce)
 {
@@ -887,9 +2728,13 @@ tfw_cache_entry_key_eq(TDB *db, TfwHttpReq *req, TfwCacheEntry *ce)
 	TdbVRec *trec = &ce->trec;
 	TfwStr *c, *h_start, *u_end, *h_end;
 	TfwStr host_val, *host = &req->h_tbl->tbl[TFW_HTTP_HDR_HOST];
+	TfwStr *uri = tfw_http_req_cache_uri(req);
 
 	if ((req->method != TFW_HTTP_METH_PURGE) && (ce->method != req->method))
 		return false;
+	/* Slices are looked up by their own keys, see tfw_cache_key(). */
+	if (ce->slice != req->cache_slice && req->method != TFW_HTTP_METH_PURGE)
+		return false;
 
 	/*
 	 * Get 'host' header value (from HTTP/2 or HTTP/1.1 request) for
@@ -897,12 +2742,11 @@ tfw_cache_entry_key_eq(TDB *db, TfwHttpReq *req, TfwCacheEntry *ce)
 	 */
 	tfw_http_msg_clnthdr_val(req, host, TFW_HTTP_HDR_HOST, &host_val);
 
-	if (req->uri_path.len + host_val.len != ce->key_len)
+	if (uri->len + host_val.len != ce->key_len)
 		return false;
 
 	t_off = CE_BODY_SIZE;
-	TFW_CACHE_REQ_KEYITER(c, &req->uri_path, &host_val, u_end, h_start,
-			      h_end)
+	TFW_CACHE_REQ_KEYITER(c, uri, &host_val, u_end, h_start, h_end)
 	{
 		if (!trec)
 			return false;
@@ -922,21 +2766,73 @@ this_chunk:
 		}
 	}
 
+	/* PURGE invalidates all the variants of the resource. */
+	if (ce->vary_len && req->method != TFW_HTTP_METH_PURGE)
+		return tfw_cache_entry_vary_eq(db, req, ce);
+
 	return true;
 }
 
+/*
+ * Get the entry for @req from the micro-cache of the current CPU, if it's
+ * still live and matches the request. Removed, evicted and moved entries are
+ * detected by TDB, purged entries aren't live. Called with disabled softirqs.
+ */
+static TfwCacheEntry *
+tfw_cache_l1_get(TDB *db, TfwHttpReq *req, unsigned long key, bool gzip)
+{
+	TfwCacheL1 *s = tfw_cache_l1_slot(this_cpu_read(cache_l1), key, gzip);
+	TfwCacheEntry *ce;
+
+	if (s->key != key || s->gzip != gzip)
+		return NULL;
+
+	if ((ce = tdb_rec_revalidate(db, s->ce, key, s->gen))) {
+		if (!smp_load_acquire(&ce->body_state)
+		    && tfw_cache_entry_key_eq(db, req, ce)
+		    && tfw_cache_entry_is_live(req, ce))
+			return ce;
+		tdb_rec_put(ce);
+	}
+	/* Another Vary variant or the entry has gone. */
+	s->key = 0;
+
+	return NULL;
+}
+
+static void
+tfw_cache_l1_set(unsigned long key, bool gzip, TfwCacheEntry *ce,
+		 unsigned long gen)
+{
+	TfwCacheL1 *s = tfw_cache_l1_slot(this_cpu_read(cache_l1), key, gzip);
+
+	s->key = key;
+	s->ce = ce;
+	s->gen = gen;
+	s->gzip = gzip;
+}
+
 /*
  * Select the most appropriate cache entry for this request.
+ * @db is the local node database, the selected live entry is remembered in
+ * the micro-cache of the current CPU.
  */
 static TfwCacheEntry *
 tfw_cache_dbce_get(TDB *db, TdbIter *iter, TfwHttpReq *req)
 {
 	TfwCacheEntry *ce, *ce_best;
-	unsigned long key = tfw_http_req_key_calc(req);
+	bool live, best_live = false, gzip = tfw_cache_req_gzip(req);
+	unsigned long gen, key = tfw_cache_key(req);
+
+	if ((ce = tfw_cache_l1_get(db, req, key, gzip)))
+		return ce;
 
+	/* Read the generation before the lookup, so it's conservative. */
+	gen = tdb_rec_gen(db);
 	*iter = tdb_rec_get(db, key);
 	if (TDB_ITER_BAD(*iter)) {
 		TFW_INC_STAT_BH(cache.misses);
+		trace_tfw_cache_lookup(req, false);
 		return NULL;
 	}
 	/*
@@ -953,9 +2849,13 @@ tfw_cache_dbce_get(TDB *db, TdbIter *iter, TfwHttpReq *req)
 	 *     full representation. This can reduce traffic to origin server.
 	 *     See RFC 7323 2.1 for the example.
 	 *
-	 * TODO: tfw_cache_entry_key_eq() should be extended to support
-	 * secondary keys (#508) and to skip not current representations.
-	 * Currently this function is used only to serve clients.
+	 * Variants selected by Vary request headers are stored under the same
+	 * key and distinguished by their secondary keys in
+	 * tfw_cache_entry_key_eq(). Compressed variants are stored beside the
+	 * identity ones and are preferred for clients accepting the coding.
+	 *
+	 * TODO: skip not current representations. Currently this function is
+	 * used only to serve clients.
 	 */
 	ce = (TfwCacheEntry *)iter->rec;
 	ce_best = NULL;
@@ -964,41 +2864,54 @@ tfw_cache_dbce_get(TDB *db, TdbIter *iter, TfwHttpReq *req)
 		 * Pick the best cache record. The "best" record is either the
 		 * first live record that we find, or the most recent stale
 		 * record. We have to iterate through the entire bucket, unless
-		 * we find a live record early, so we take an extra read lock
+		 * we find a live record early, so we take an extra reference
 		 * here.
 		 */
 		/* TODO #522: replace a cache entry on a new entry insertion
 		 * (e.g. the bucket can not contain both the stale and fresh
 		 * entries) and rework the loop. */
-		if (tfw_cache_entry_key_eq(db, req, ce)) {
-			if (tfw_cache_entry_is_live(req, ce)) {
+		if (!smp_load_acquire(&ce->body_state)
+		    && (gzip || !ce->coding)
+		    && tfw_cache_entry_key_eq(db, req, ce))
+		{
+			live = tfw_cache_entry_is_live(req, ce);
+			if (live && (ce->coding || !gzip)) {
 				if (ce_best)
 					tdb_rec_put(ce_best);
 				ce_best = ce;
+				tfw_cache_l1_set(key, gzip, ce, gen);
 				break;
 			}
-			else if (!ce_best
-				   || tfw_cache_entry_age(ce)
-				      < tfw_cache_entry_age(ce_best))
+			/*
+			 * A live identity variant is kept while looking for
+			 * a compressed one.
+			 */
+			else if (!best_live
+				 && (live || !ce_best
+				     || tfw_cache_entry_age(ce)
+					< tfw_cache_entry_age(ce_best)))
 			{
 				if (ce_best)
 					tdb_rec_put(ce_best);
 				/* It's possible that we end up iterating until
 				 * the end (while looking for a live entry), and
-				 * `ce_best` might be in a bucket that was
-				 * already read-unlocked by `tdb_rec_next`, so
-				 * we add an extra reference to it.
+				 * `tdb_rec_next` releases the iteration
+				 * reference, so we add an extra reference to
+				 * `ce_best`.
 				 */
 				tdb_rec_keep(ce);
 				ce_best = ce;
+				best_live = live;
 			}
 		}
 		tdb_rec_next(db, iter);
 		ce = (TfwCacheEntry *)iter->rec;
 	} while (ce);
 
-	if (!ce_best)
+	if (!ce_best) {
 		TFW_INC_STAT_BH(cache.misses);
+		trace_tfw_cache_lookup(req, false);
+	}
 
 	return ce_best;
 }
@@ -1151,6 +3064,74 @@ tfw_cache_h2_copy_int(unsigned int *acc_len, unsigned long src,
 	return 0;
 }
 
+/**
+ * Write ':status' pseudo-header with response status @status in HPACK format.
+ */
+static int
+tfw_cache_h2_copy_status(unsigned int *acc_len, int status, char **p,
+			 TdbVRec **trec, size_t *tot_len)
+{
+	char buf[H2_STAT_VAL_LEN];
+	TfwStr str = {};
+	TfwHPackInt hp_idx;
+	unsigned short status_idx = tfw_h2_pseudo_index(status);
+
+	if (status_idx) {
+		write_int(status_idx, 0x7F, 0x80, &hp_idx);
+		str.data = hp_idx.buf;
+		str.len = hp_idx.sz;
+
+		return tfw_cache_h2_copy_str(acc_len, p, trec, &str, tot_len);
+	}
+
+	/*
+	 * If the ':status' pseudo-header is not fully indexed, set the
+	 * default static index (8) just for the name.
+	 */
+	if (tfw_cache_h2_copy_int(acc_len, 8, 0xF, p, trec, tot_len)
+	    || tfw_cache_h2_copy_int(acc_len, H2_STAT_VAL_LEN, 0x7f, p, trec,
+				     tot_len))
+		return -ENOMEM;
+
+	if (!tfw_ultoa(status, buf, H2_STAT_VAL_LEN))
+		return -E2BIG;
+	str.data = buf;
+	str.len = H2_STAT_VAL_LEN;
+
+	return tfw_cache_h2_copy_str(acc_len, p, trec, &str, tot_len);
+}
+
+/**
+ * Write header with name @s_nm and value @s_val in HPACK literal without
+ * indexing representation. The name is written only if it isn't indexed
+ * in the static table, i.e. @st_index is zero.
+ */
+static int
+__cache_h2_copy_hdr(unsigned int *acc_len, unsigned short st_index,
+		    TfwStr *s_nm, TfwStr *s_val, char **p, TdbVRec **trec,
+		    size_t *tot_len)
+{
+	if (st_index) {
+		if (tfw_cache_h2_copy_int(acc_len, st_index, 0xF, p, trec,
+					  tot_len))
+			return -ENOMEM;
+	}
+	else {
+		if (tfw_cache_h2_copy_int(acc_len, 0, 0xF, p, trec, tot_len)
+		    || tfw_cache_h2_copy_int(acc_len, s_nm->len, 0x7f, p, trec,
+					     tot_len)
+		    || tfw_cache_h2_copy_str_lc(acc_len, p, trec, s_nm,
+						tot_len))
+			return -ENOMEM;
+	}
+
+	if (tfw_cache_h2_copy_int(acc_len, s_val->len, 0x7f, p, trec, tot_len)
+	    || tfw_cache_h2_copy_str(acc_len, p, trec, s_val, tot_len))
+		return -ENOMEM;
+
+	return 0;
+}
+
 /**
  * Deep HTTP header copy to TdbRec.
  * @hdr is copied in depth first fashion to speed up upcoming scans.
@@ -1208,25 +3189,8 @@ tfw_cache_h2_copy_hdr(TfwCacheEntry *ce, char **p, TdbVRec **trec, TfwStr *hdr,
 		CSTR_MOVE_HDR();
 		prev_len = ce->hdr_len;
 
-		if (st_index) {
-			if (tfw_cache_h2_copy_int(&ce->hdr_len, st_index, 0xF,
-						  p, trec, tot_len))
-				return -ENOMEM;
-		}
-		else {
-			if (tfw_cache_h2_copy_int(&ce->hdr_len, 0, 0xF, p, trec,
-						  tot_len)
-			    || tfw_cache_h2_copy_int(&ce->hdr_len, s_nm.len,
-						     0x7f, p, trec, tot_len)
-			    || tfw_cache_h2_copy_str_lc(&ce->hdr_len, p, trec,
-			                                &s_nm, tot_len))
-				return -ENOMEM;
-		}
-
-		if (tfw_cache_h2_copy_int(&ce->hdr_len, s_val.len, 0x7f, p,
-					  trec, tot_len)
-		    || tfw_cache_h2_copy_str(&ce->hdr_len, p, trec, &s_val,
-					     tot_len))
+		if (__cache_h2_copy_hdr(&ce->hdr_len, st_index, &s_nm, &s_val,
+					p, trec, tot_len))
 			return -ENOMEM;
 
 		CSTR_WRITE_HDR(0, ce->hdr_len - prev_len);
@@ -1297,7 +3261,7 @@ tfw_cache_h2_add_hdr(TfwCacheEntry *ce, char **p, TdbVRec **trec,
  */
 static int
 __set_etag(TfwCacheEntry *ce, TfwHttpResp *resp, long h_off, TdbVRec *h_trec,
-	   char *curr_p, TdbVRec **curr_trec)
+	   char **curr_p, TdbVRec **curr_trec)
 {
 	char *e_p;
 	size_t c_size;
@@ -1377,12 +3341,13 @@ __set_etag(TfwCacheEntry *ce, TfwHttpResp *resp, long h_off, TdbVRec *h_trec,
 	/* Compound string was allocated in resp->pool, move to cache entry. */
 	if (!TFW_STR_PLAIN(&ce->etag)) {
 		len = sizeof(TfwStr *) * ce->etag.nchunks;
-		curr_p = tdb_entry_get_room(node_db(), curr_trec, curr_p, len,
-					    len);
-		if (!curr_p)
+		e_p = tdb_entry_get_room(node_db(), curr_trec, *curr_p, len,
+					 len);
+		if (!e_p)
 			return -ENOMEM;
-		memcpy_fast(curr_p, ce->etag.data, len);
-		ce->etag.data = curr_p;
+		memcpy_fast(e_p, ce->etag.data, len);
+		ce->etag.data = e_p;
+		*curr_p = e_p + len;
 		/* Old ce->etag.data will be destroyed with resp. */
 	}
 
@@ -1434,28 +3399,245 @@ __save_hdr_304_off(TfwCacheEntry *ce, TfwHttpResp *resp, TfwStr *hdr, long off)
 	return false;
 }
 
+/**
+ * Whether header @hdr of @resp is skipped on storing to a cache entry. Skip
+ * hop-by-hop headers and 'Server' header (with possible duplicates), since we
+ * substitute it with our version of the header. Date is built on a hit from
+ * the entry freshness information, so it stays consistent with Age after the
+ * entry refresh. Compressed variants of @coding don't store the identity body
+ * length and entity-tag.
+ */
+static bool
+tfw_cache_hdr_skip(TfwHttpResp *resp, TfwStr *hdr, unsigned char coding)
+{
+	static const TfwStr h_date[] = { TFW_STR_STRING("date:") };
+	int hid = hdr - resp->h_tbl->tbl;
+
+	return (hdr->flags & TFW_STR_HBH_HDR)
+	       || hid == TFW_HTTP_HDR_SERVER
+	       || TFW_STR_EMPTY(hdr)
+	       || (hid >= TFW_HTTP_HDR_RAW && tfw_http_msg_find_hdr(hdr, h_date))
+	       || (coding && (hid == TFW_HTTP_HDR_CONTENT_LENGTH
+			      || hid == TFW_HTTP_HDR_ETAG));
+}
+
+/**
+ * Size of the prebuilt HTTP/1.1 status line and headers, see
+ * tfw_cache_h1_copy_prebuilt().
+ */
+static long
+__cache_h1_prebuilt_size(TfwHttpResp *resp, TfwStr *rph)
+{
+	TfwStr *hdr, *hdr_end, *d, *d_end;
+	long size = SLEN(S_0) + H2_STAT_VAL_LEN + rph->len + SLEN(S_CRLF);
+
+	FOR_EACH_HDR_FIELD_FROM(hdr, hdr_end, resp, TFW_HTTP_HDR_REGULAR) {
+		if (tfw_cache_hdr_skip(resp, hdr, 0))
+			continue;
+
+		TFW_STR_FOR_EACH_DUP(d, hdr, d_end) {
+			TfwStr s_nm = {}, s_val = {};
+
+			tfw_http_hdr_split(d, &s_nm, &s_val, true);
+			size += s_nm.len + SLEN(S_DLM) + s_val.len
+				+ SLEN(S_CRLF);
+		}
+	}
+	size += SLEN("server" S_DLM TFW_SERVER S_CRLF);
+
+	return size;
+}
+
+/**
+ * Store the status line and the headers of @resp in HTTP/1.1 wire format, so
+ * HTTP/1.1 clients can be served from the cache by referencing the TDB pages
+ * instead of decoding the HPACK representation header by header on each hit.
+ * Only the headers which don't depend on a particular request are stored,
+ * e.g. Age, Date, Via and hop-by-hop headers are still added on a hit.
+ */
+static int
+tfw_cache_h1_copy_prebuilt(TfwCacheEntry *ce, TfwHttpResp *resp, TfwStr *rph,
+			   char **p, TdbVRec **trec, size_t *tot_len)
+{
+	char buf[H2_STAT_VAL_LEN];
+	TfwStr *hdr, *hdr_end, *d, *d_end;
+	TfwStr s_ver = { .data = S_0, .len = SLEN(S_0) };
+	TfwStr s_code = { .data = buf, .len = H2_STAT_VAL_LEN };
+	TfwStr s_dlm = { .data = S_DLM, .len = SLEN(S_DLM) };
+	TfwStr s_srv = TFW_STR_STRING("server" S_DLM TFW_SERVER S_CRLF);
+
+	ce->h1 = TDB_OFF(node_db()->hdr, *p);
+	ce->h1_len = 0;
+
+	if (!tfw_ultoa(resp->status, buf, H2_STAT_VAL_LEN))
+		return -E2BIG;
+
+	if (tfw_cache_h2_copy_str(&ce->h1_len, p, trec, &s_ver, tot_len)
+	    || tfw_cache_h2_copy_str(&ce->h1_len, p, trec, &s_code, tot_len)
+	    || tfw_cache_h2_copy_str(&ce->h1_len, p, trec, rph, tot_len)
+	    || tfw_cache_h2_copy_str(&ce->h1_len, p, trec, &g_crlf, tot_len))
+		return -ENOMEM;
+
+	FOR_EACH_HDR_FIELD_FROM(hdr, hdr_end, resp, TFW_HTTP_HDR_REGULAR) {
+		if (tfw_cache_hdr_skip(resp, hdr, 0))
+			continue;
+
+		TFW_STR_FOR_EACH_DUP(d, hdr, d_end) {
+			TfwStr s_nm = {}, s_val = {};
+
+			tfw_http_hdr_split(d, &s_nm, &s_val, true);
+			if (tfw_cache_h2_copy_str_lc(&ce->h1_len, p, trec,
+						     &s_nm, tot_len)
+			    || tfw_cache_h2_copy_str(&ce->h1_len, p, trec,
+						     &s_dlm, tot_len)
+			    || tfw_cache_h2_copy_str(&ce->h1_len, p, trec,
+						     &s_val, tot_len)
+			    || tfw_cache_h2_copy_str(&ce->h1_len, p, trec,
+						     &g_crlf, tot_len))
+				return -ENOMEM;
+		}
+	}
+
+	return tfw_cache_h2_copy_str(&ce->h1_len, p, trec, &s_srv, tot_len);
+}
+
+static long
+__cache_h2_prebuilt_size(TfwHttpResp *resp, unsigned long via_sz)
+{
+	TfwStr *hdr, *hdr_end, *d, *d_end;
+	long size = 1;
+
+	size += (1 + H2_STAT_VAL_LEN) * !tfw_h2_pseudo_index(resp->status);
+
+	FOR_EACH_HDR_FIELD_FROM(hdr, hdr_end, resp, TFW_HTTP_HDR_REGULAR) {
+		if (tfw_cache_hdr_skip(resp, hdr, 0))
+			continue;
+
+		TFW_STR_FOR_EACH_DUP(d, hdr, d_end) {
+			TfwStr s_nm = {}, s_val = {};
+
+			tfw_http_hdr_split(d, &s_nm, &s_val, true);
+			size += tfw_h2_hdr_size(s_nm.len, s_val.len,
+						d->hpack_idx);
+		}
+	}
+	size += tfw_h2_hdr_size(0, SLEN(TFW_SERVER), 54);
+	size += tfw_h2_hdr_size(0, via_sz, 60);
+
+	return size;
+}
+
+/**
+ * Store the whole HPACK header block of @resp, i.e. the ':status'
+ * pseudo-header and the headers also stored one by one in @ce->hdrs, as a
+ * contiguous byte sequence. All the headers are in literal without indexing
+ * representation referencing only the static table, so the block is valid
+ * for any HTTP/2 connection and is written to HEADERS frames by plain copying
+ * on a cache hit. Headers depending on the request and on the connection
+ * dynamic table state, e.g. Age or Date, are still encoded on a hit.
+ */
+static int
+tfw_cache_h2_copy_prebuilt(TfwCacheEntry *ce, TfwHttpResp *resp,
+			   TfwStr *val_srv, TfwStr *val_via, char **p,
+			   TdbVRec **trec, size_t *tot_len)
+{
+	int r;
+	TfwStr *hdr, *hdr_end, *d, *d_end;
+
+	ce->h2 = TDB_OFF(node_db()->hdr, *p);
+	ce->h2_len = 0;
+
+	if ((r = tfw_cache_h2_copy_status(&ce->h2_len, resp->status, p, trec,
+					  tot_len)))
+		return r;
+
+	FOR_EACH_HDR_FIELD_FROM(hdr, hdr_end, resp, TFW_HTTP_HDR_REGULAR) {
+		if (tfw_cache_hdr_skip(resp, hdr, 0))
+			continue;
+
+		TFW_STR_FOR_EACH_DUP(d, hdr, d_end) {
+			TfwStr s_nm = {}, s_val = {};
+
+			tfw_http_hdr_split(d, &s_nm, &s_val, true);
+			if (__cache_h2_copy_hdr(&ce->h2_len, d->hpack_idx,
+						&s_nm, &s_val, p, trec,
+						tot_len))
+				return -ENOMEM;
+		}
+	}
+
+	if (__cache_h2_copy_hdr(&ce->h2_len, 54, NULL, val_srv, p, trec,
+				tot_len)
+	    || __cache_h2_copy_hdr(&ce->h2_len, 60, NULL, val_via, p, trec,
+				   tot_len))
+		return -ENOMEM;
+
+	return 0;
+}
+
+/**
+ * Set freshness information of @ce from @resp.
+ */
+static void
+tfw_cache_set_freshness(TfwCacheEntry *ce, TfwHttpResp *resp)
+{
+	if (resp->cache_ctl.flags
+	    & (TFW_HTTP_CC_MUST_REVAL | TFW_HTTP_CC_PROXY_REVAL))
+		ce->flags |= TFW_CE_MUST_REVAL;
+	else
+		ce->flags &= ~TFW_CE_MUST_REVAL;
+	ce->date = resp->date;
+	ce->age = resp->cache_ctl.age;
+	ce->req_time = resp->req->cache_ctl.timestamp;
+	ce->resp_time = resp->cache_ctl.timestamp;
+	ce->lifetime = tfw_cache_calc_lifetime(resp);
+	ce->stale_reval = (resp->cache_ctl.flags & TFW_HTTP_CC_STALE_REVAL)
+			  ? resp->cache_ctl.stale_reval : 0;
+	ce->stale_err = (resp->cache_ctl.flags & TFW_HTTP_CC_STALE_ERR)
+			? resp->cache_ctl.stale_err : 0;
+}
+
+/**
+ * Get the Content-Type value of @resp to @val, empty if there is no single
+ * Content-Type header.
+ */
+static void
+tfw_cache_ctype(TfwHttpResp *resp, TfwStr *val)
+{
+	TfwStr *h = &resp->h_tbl->tbl[TFW_HTTP_HDR_CONTENT_TYPE];
+
+	TFW_STR_INIT(val);
+	if (!TFW_STR_EMPTY(h) && !TFW_STR_DUP(h))
+		tfw_http_msg_srvhdr_val(h, TFW_HTTP_HDR_CONTENT_TYPE, val);
+}
+
 /**
  * Copy response skbs to database mapped area.
  * @tot_len	- total length of actual data to write w/o TfwCStr's etc;
- * @rph		- response reason-phrase to be saved in the cache.
+ * @rph		- response reason-phrase to be saved in the cache;
+ * @skey	- secondary key of the response variant;
+ * @bw		- if set, the body is written (or compressed to the variant
+ *		  of @bw->coding) later by the work.
  *
  * It's nasty to copy data on CPU, but we can't use DMA for mmaped file
  * as well as for unaligned memory areas.
  */
 static int
 tfw_cache_copy_resp(TfwCacheEntry *ce, TfwHttpResp *resp, TfwStr *rph,
+		    TfwStr *skey, TfwStr *hints, TfwCacheBodyWork *bw,
 		    size_t tot_len)
 {
 	int r, i;
 	char *p;
-	unsigned short status_idx;
-	TfwStr *field, *h, *end1, *end2;
+	unsigned char coding = bw ? bw->coding : 0;
+	TfwStr ctype, *field, *h, *end1, *end2;
 	TDB *db = node_db();
 	TdbVRec *trec = &ce->trec, *etag_trec = NULL;
 	long n, etag_off = 0;
 	TfwHttpReq *req = resp->req;
 	TfwGlobal *g_vhost = tfw_vhost_get_global();
 	TfwStr h_val, *host = &req->h_tbl->tbl[TFW_HTTP_HDR_HOST];
+	TfwStr *uri = tfw_http_req_cache_uri(req);
 	TfwStr val_srv = TFW_STR_STRING(TFW_SERVER);
 	TfwStr val_via = {
 		.chunks = (TfwStr []) {
@@ -1479,7 +3661,7 @@ tfw_cache_copy_resp(TfwCacheEntry *ce, TfwHttpResp *resp, TfwStr *rph,
 	 * strict comparison.
 	 */
 	tfw_http_msg_clnthdr_val(req, host, TFW_HTTP_HDR_HOST, &h_val);
-	TFW_CACHE_REQ_KEYITER(field, &req->uri_path, &h_val, end1, h, end2) {
+	TFW_CACHE_REQ_KEYITER(field, uri, &h_val, end1, h, end2) {
 		if ((n = tfw_cache_strcpy_lc(&p, &trec, field, tot_len)) < 0) {
 			T_ERR("Cache: cannot copy request key\n");
 			return -ENOMEM;
@@ -1496,45 +3678,53 @@ tfw_cache_copy_resp(TfwCacheEntry *ce, TfwHttpResp *resp, TfwStr *rph,
 	else
 		ce->method = req->method;
 
-	/* Write ':status' pseudo-header. */
-	ce->status = TDB_OFF(db->hdr, p);
-	status_idx = tfw_h2_pseudo_index(resp->status);
-	if (status_idx) {
-		TfwHPackInt hp_idx;
-		TfwStr str = {};
-
-		write_int(status_idx, 0x7F, 0x80, &hp_idx);
-		str.data = hp_idx.buf;
-		str.len = hp_idx.sz;
-
-		if (tfw_cache_h2_copy_str(&ce->status_len, &p, &trec, &str,
-					  &tot_len))
+	/* Write secondary key (normalized Vary request headers). */
+	ce->vary = TDB_OFF(db->hdr, p);
+	ce->vary_len = 0;
+	if (skey->len) {
+		if ((n = tfw_cache_strcpy(&p, &trec, skey, tot_len)) < 0) {
+			T_ERR("Cache: cannot copy secondary key\n");
 			return -ENOMEM;
-	} else {
-		char buf[H2_STAT_VAL_LEN];
-		TfwStr str = {
-			.data = buf,
-			.len = H2_STAT_VAL_LEN
-		};
+		}
+		BUG_ON(n > tot_len);
+		tot_len -= n;
+		ce->vary_len = n;
+	}
 
-		/*
-		 * If the ':status' pseudo-header is not fully indexed, set
-		 * the default static index (8) just for the name.
-		 */
-		if (tfw_cache_h2_copy_int(&ce->status_len, 8, 0xF, &p, &trec,
-					  &tot_len)
-		    || tfw_cache_h2_copy_int(&ce->status_len, H2_STAT_VAL_LEN,
-					     0x7f, &p, &trec, &tot_len))
+	/* Write preload links for 103 (Early Hints) responses. */
+	ce->hints = TDB_OFF(db->hdr, p);
+	ce->hints_len = 0;
+	if (hints->len) {
+		if ((n = tfw_cache_strcpy(&p, &trec, hints, tot_len)) < 0) {
+			T_ERR("Cache: cannot copy early hints\n");
 			return -ENOMEM;
+		}
+		BUG_ON(n > tot_len);
+		tot_len -= n;
+		ce->hints_len = n;
+	}
 
-		if (!tfw_ultoa(resp->status, str.data, H2_STAT_VAL_LEN))
-			return -E2BIG;
-
-		if (tfw_cache_h2_copy_str(&ce->status_len, &p, &trec, &str,
-					  &tot_len))
+	/* Write Content-Type value for multipart/byteranges responses. */
+	tfw_cache_ctype(resp, &ctype);
+	ce->ctype = TDB_OFF(db->hdr, p);
+	ce->ctype_len = 0;
+	if (ctype.len) {
+		if ((n = tfw_cache_strcpy(&p, &trec, &ctype, tot_len)) < 0) {
+			T_ERR("Cache: cannot copy content type\n");
 			return -ENOMEM;
+		}
+		BUG_ON(n > tot_len);
+		tot_len -= n;
+		ce->ctype_len = n;
 	}
 
+	/* Write ':status' pseudo-header. */
+	ce->status = TDB_OFF(db->hdr, p);
+	ce->status_len = 0;
+	if ((r = tfw_cache_h2_copy_status(&ce->status_len, resp->status, &p,
+					  &trec, &tot_len)))
+		return r;
+
 	if (tfw_cache_h2_copy_str(&ce->rph_len, &p, &trec, rph, &tot_len))
 		return -ENOMEM;
 
@@ -1543,15 +3733,8 @@ tfw_cache_copy_resp(TfwCacheEntry *ce, TfwHttpResp *resp, TfwStr *rph,
 	ce->hdr_num = resp->h_tbl->off;
 	FOR_EACH_HDR_FIELD_FROM(field, end1, resp, TFW_HTTP_HDR_REGULAR) {
 		int hid = field - resp->h_tbl->tbl;
-		/*
-		 * Skip hop-by-hop headers. Also skip 'Server' header (with
-		 * possible duplicates), since we will substitute it with our
-		 * version of this header.
-		 */
-		if ((field->flags & TFW_STR_HBH_HDR)
-		    || hid == TFW_HTTP_HDR_SERVER
-		    || TFW_STR_EMPTY(field))
-		{
+
+		if (tfw_cache_hdr_skip(resp, field, coding)) {
 			--ce->hdr_num;
 			continue;
 		}
@@ -1585,13 +3768,47 @@ tfw_cache_copy_resp(TfwCacheEntry *ce, TfwHttpResp *resp, TfwStr *rph,
 	ce->hdr_h2_off = ce->hdr_num + 1;
 	ce->hdr_num += 2;
 
-	/* Write HTTP response body. */
+	/* Compressed variants have their own headers added on the fly. */
+	if (cache_cfg.resp_prebuilt && !coding) {
+		r = tfw_cache_h1_copy_prebuilt(ce, resp, rph, &p, &trec,
+					       &tot_len);
+		if (unlikely(r)) {
+			T_ERR("Cache: cannot copy prebuilt HTTP/1.1 headers\n");
+			return r;
+		}
+		r = tfw_cache_h2_copy_prebuilt(ce, resp, &val_srv, &val_via,
+					       &p, &trec, &tot_len);
+		if (unlikely(r)) {
+			T_ERR("Cache: cannot copy prebuilt HTTP/2 headers\n");
+			return r;
+		}
+	}
+
+	if (!coding
+	    && (r = __set_etag(ce, resp, etag_off, etag_trec, &p, &trec)))
+	{
+		T_ERR("Cache: cannot copy entity-tag\n");
+		return r;
+	}
+
+	/*
+	 * Write HTTP response body. The body is the last part of the record,
+	 * so it can be written behind starting from the current position.
+	 */
 	ce->body = TDB_OFF(db->hdr, p);
-	r = tfw_cache_h2_copy_str(&ce->body_len, &p, &trec, &resp->body,
-				  &tot_len);
-	if (unlikely(r)) {
-		T_ERR("Cache: cannot copy HTTP body\n");
-		return -ENOMEM;
+	if (bw) {
+		bw->ce = ce;
+		bw->trec = trec;
+		bw->p = p;
+		ce->body_len = resp->body.len;
+		tot_len -= resp->body.len;
+	} else {
+		r = tfw_cache_h2_copy_str(&ce->body_len, &p, &trec, &resp->body,
+					  &tot_len);
+		if (unlikely(r)) {
+			T_ERR("Cache: cannot copy HTTP body\n");
+			return -ENOMEM;
+		}
 	}
 
 	if (WARN_ON_ONCE(tot_len != 0))
@@ -1599,23 +3816,13 @@ tfw_cache_copy_resp(TfwCacheEntry *ce, TfwHttpResp *resp, TfwStr *rph,
 
 	ce->version = resp->version;
 	tfw_http_copy_flags(ce->hmflags, resp->flags);
+	/* Date is added on a hit, see tfw_cache_hdr_skip(). */
+	__clear_bit(TFW_HTTP_B_HDR_DATE, ce->hmflags);
 
-	if (resp->cache_ctl.flags
-	    & (TFW_HTTP_CC_MUST_REVAL | TFW_HTTP_CC_PROXY_REVAL))
-		ce->flags |= TFW_CE_MUST_REVAL;
-	ce->date = resp->date;
-	ce->age = resp->cache_ctl.age;
-	ce->req_time = req->cache_ctl.timestamp;
-	ce->resp_time = resp->cache_ctl.timestamp;
-	ce->lifetime = tfw_cache_calc_lifetime(resp);
+	tfw_cache_set_freshness(ce, resp);
 	ce->last_modified = resp->last_modified;
 	ce->resp_status = resp->status;
 
-	if ((r = __set_etag(ce, resp, etag_off, etag_trec, p, &trec))) {
-		T_ERR("Cache: cannot copy entity-tag\n");
-		return r;
-	}
-
 	/* Update offsets of 304 headers to real values */
 	/* FIXME: #803 */
 	trec = &ce->trec;
@@ -1643,7 +3850,7 @@ tfw_cache_copy_resp(TfwCacheEntry *ce, TfwHttpResp *resp, TfwStr *rph,
 }
 
 static long
-__cache_entry_size(TfwHttpResp *resp)
+__cache_entry_size(TfwHttpResp *resp, unsigned char coding)
 {
 	TfwStr host_val, *hdr, *hdr_end;
 	TfwHttpReq *req = resp->req;
@@ -1653,7 +3860,7 @@ __cache_entry_size(TfwHttpResp *resp)
 		+ tfw_vhost_get_global()->hdr_via_len;
 
 	/* Add compound key size */
-	res_size += req->uri_path.len;
+	res_size += tfw_http_req_cache_uri(req)->len;
 	tfw_http_msg_clnthdr_val(req, host, TFW_HTTP_HDR_HOST, &host_val);
 	res_size += host_val.len;
 
@@ -1668,15 +3875,8 @@ __cache_entry_size(TfwHttpResp *resp)
 	/* Add all the headers size */
 	FOR_EACH_HDR_FIELD_FROM(hdr, hdr_end, resp, TFW_HTTP_HDR_REGULAR) {
 		TfwStr *d, *d_end;
-		int hid = hdr - resp->h_tbl->tbl;
-		/*
-		 * Skip hop-by-hop headers. Also skip 'Server' header (with
-		 * possible duplicates), since we will substitute it with our
-		 * version of this header.
-		 */
-		if ((hdr->flags & TFW_STR_HBH_HDR)
-		    || hid == TFW_HTTP_HDR_SERVER
-		    || TFW_STR_EMPTY(hdr))
+
+		if (tfw_cache_hdr_skip(resp, hdr, coding))
 			continue;
 
 		size = sizeof(TfwCStr);
@@ -1731,114 +3931,1156 @@ err:
 	return -E2BIG;
 }
 
-static void
-__cache_add_node(TDB *db, TfwHttpResp *resp, unsigned long key)
-{
-	size_t len;
-	TfwCacheEntry *ce;
-	TfwStr rph, *s_line;
-	long data_len = __cache_entry_size(resp);
-
-	if (unlikely(data_len < 0))
-		return;
+/**
+ * Response body to be copied to a cache entry behind the response forwarding.
+ *
+ * @ce		- the cache entry, invisible for lookups until the body is written;
+ * @node	- the NUMA node, owning the entry;
+ * @trec, @p	- the record chunk and position to write the body at;
+ * @key	- the entry key to resume collapsed requests with;
+ * @resume	- whether collapsed requests are resumed when the body is written;
+ * @coding	- TFW_CE_CODING_* to compress the body with or zero;
+ * @nr		- number of page pieces in @bv;
+ * @bv		- the body pieces, each holding a reference to its page.
+ *
+ * The work doesn't pin the entry: the body writer extends the record, while
+ * a TDB pin covers only the record chunks existing at the pin time. Instead
+ * an entry with TFW_CE_BODY_PENDING body can't be removed by any path, see
+ * tfw_cache_entry_removable(), and the cache stop drains the works before it
+ * closes the tables.
+ */
+struct tfw_cache_body_work_t {
+	TfwCacheEntry	*ce;
+	CaNode		*node;
+	TdbVRec		*trec;
+	char		*p;
+	unsigned long	key;
+	bool		resume;
+	unsigned char	coding;
+	unsigned int	nr;
+	struct bio_vec	bv[];
+};
 
-	/*
-	 * We need to save the reason-phrase for the case of HTTP/1.1-response
-	 * creation from cache. Note, that reason-phrase is always the last part
-	 * of status-line with the TFW_STR_VALUE flag set.
-	 */
-	s_line = &resp->h_tbl->tbl[TFW_HTTP_STATUS_LINE];
-	rph = tfw_str_next_str_val(s_line);
-	if (WARN_ON_ONCE(TFW_STR_EMPTY(&rph)))
-		return;
+static void tfw_cache_collapse_done(unsigned long key);
+static void tfw_cache_ipi(struct irq_work *work);
 
-	data_len += rph.len;
-	len = data_len;
+static void
+tfw_cache_body_free(TfwCacheBodyWork *bw)
+{
+	unsigned int i;
 
-	T_DBG3("%s: db=[%p] resp=[%p], req=[%p], key='%lu', data_len='%ld'\n",
-	       __func__, db, resp, resp->req, key, data_len);
+	for (i = 0; i < bw->nr; ++i)
+		put_page(bw->bv[i].bv_page);
+	kfree(bw);
+}
 
-	/* TODO #788: revalidate existing entries before inserting a new one. */
+/**
+ * Grab references to the pages of the response body, so the body can be
+ * copied to the cache after the response is forwarded and freed. Body data
+ * from skb linear parts is copied to new pages since the skb heads can be
+ * reused, paged data is referenced as is. SKBTX_SHARED_FRAG makes TLS encrypt
+ * the paged data to new pages, so the referenced data stays plain.
+ */
+static TfwCacheBodyWork *
+tfw_cache_body_alloc(TfwHttpResp *resp)
+{
+	unsigned int nr = 0;
+	TfwCacheBodyWork *bw;
+	struct sk_buff *skb;
+	TfwStr *c, *end;
 
-	/*
-	 * Try to place the cached response in single memory chunk.
-	 * TDB should provide enough space to place at least head of
-	 * the record key at first chunk.
-	 */
-	ce = (TfwCacheEntry *)tdb_entry_alloc(db, key, &len);
-	BUG_ON(len <= sizeof(TfwCacheEntry));
-	if (!ce)
-		return;
+	TFW_STR_FOR_EACH_CHUNK(c, &resp->body, end)
+		nr += DIV_ROUND_UP(offset_in_page(c->data) + c->len, PAGE_SIZE);
 
-	T_DBG3("%s: ce=[%p], alloc_len='%lu'\n", __func__, ce, len);
+	bw = kmalloc(struct_size(bw, bv, nr), GFP_ATOMIC);
+	if (!bw)
+		return NULL;
+	bw->coding = 0;
+	bw->nr = 0;
+
+	TFW_STR_FOR_EACH_CHUNK(c, &resp->body, end) {
+		char *data = c->data;
+		unsigned long len = c->len;
+		bool linear = !c->skb
+			      || (data >= (char *)c->skb->head
+				  && data < (char *)skb_end_pointer(c->skb));
+
+		while (len) {
+			struct bio_vec *bv = &bw->bv[bw->nr];
+			unsigned int off = offset_in_page(data);
+			unsigned int n = min_t(unsigned long, len,
+					       PAGE_SIZE - off);
+
+			if (linear) {
+				if (!(bv->bv_page = alloc_page(GFP_ATOMIC)))
+					goto err;
+				memcpy_fast(page_address(bv->bv_page) + off,
+					    data, n);
+			} else {
+				bv->bv_page = virt_to_page(data);
+				get_page(bv->bv_page);
+			}
+			bv->bv_offset = off;
+			bv->bv_len = n;
+			++bw->nr;
+			data += n;
+			len -= n;
+		}
+	}
 
-	if (tfw_cache_copy_resp(ce, resp, &rph, data_len)) {
-		/* TODO delete the probably partially built TDB entry. */
+	skb = resp->msg.skb_head;
+	if (skb) {
+		do {
+			skb_shinfo(skb)->tx_flags |= SKBTX_SHARED_FRAG;
+			skb = skb->next;
+		} while (skb != resp->msg.skb_head);
 	}
-}
+
+	return bw;
+err:
+	tfw_cache_body_free(bw);
+	return NULL;
+}
+
+/**
+ * Make the entry visible for lookups, or leave it for eviction if the body
+ * can't be written, and resume requests waiting for the entry.
+ */
+static void
+tfw_cache_body_done(TfwCacheBodyWork *bw, unsigned char state)
+{
+	smp_store_release(&bw->ce->body_state, state);
+	if (!state)
+		tfw_cache_l1_inval(bw->node, bw->key);
+	if (bw->resume)
+		tfw_cache_collapse_done(bw->key);
+	tfw_cache_body_free(bw);
+}
+
+/* Gzip member header (RFC 1952 2.3): no flags, no mtime, Unix OS. */
+static const char tfw_cache_gzip_hdr[] = {
+	0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3
+};
+#define TFW_CACHE_GZIP_OVERHEAD	(sizeof(tfw_cache_gzip_hdr) + 8)
+
+/**
+ * Run deflate on @zs writing the output to the cache entry of @bw. The
+ * compressed body must be shorter than the identity one of @len bytes.
+ */
+static int
+tfw_cache_gzip_deflate(TfwCacheBodyWork *bw, z_stream *zs, int flush,
+		       size_t len)
+{
+	int r;
+
+	for (;;) {
+		size_t room = bw->trec->data + bw->trec->len - bw->p;
+
+		if (!room) {
+			if (zs->total_out + TFW_CACHE_GZIP_OVERHEAD >= len)
+				return -E2BIG;
+			bw->trec = tdb_entry_add(node_db(), bw->trec,
+						 len - zs->total_out);
+			if (!bw->trec)
+				return -ENOMEM;
+			bw->p = bw->trec->data;
+			room = bw->trec->len;
+		}
+
+		zs->next_out = bw->p;
+		zs->avail_out = room;
+		r = zlib_deflate(zs, flush);
+		bw->p = zs->next_out;
+
+		if (r == Z_STREAM_END)
+			return 0;
+		if (r != Z_OK && r != Z_BUF_ERROR)
+			return -EINVAL;
+		if (flush != Z_FINISH && !zs->avail_in)
+			return 0;
+	}
+}
+
+/**
+ * Compress the deferred response body with gzip to the cache entry.
+ */
+static int
+tfw_cache_body_gzip(TfwCacheBodyWork *bw)
+{
+	int r;
+	unsigned int i;
+	u32 crc = ~0;
+	__le32 trailer[2];
+	size_t len = bw->ce->body_len;
+	z_stream *zs = this_cpu_ptr(&cache_zstrm);
+	TfwStr str = {
+		.data = (char *)tfw_cache_gzip_hdr,
+		.len = sizeof(tfw_cache_gzip_hdr)
+	};
+
+	/* Compression may be enabled on reconfiguration only. */
+	if (unlikely(!zs->workspace))
+		return -EINVAL;
+	if (tfw_cache_strcpy(&bw->p, &bw->trec, &str, len) < 0)
+		return -ENOMEM;
+
+	r = zlib_deflateInit2(zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+			      MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+	if (r != Z_OK)
+		return -EINVAL;
+
+	for (i = 0; i < bw->nr; ++i) {
+		struct bio_vec *bv = &bw->bv[i];
+		char *data = page_address(bv->bv_page) + bv->bv_offset;
+
+		crc = crc32_le(crc, data, bv->bv_len);
+		zs->next_in = data;
+		zs->avail_in = bv->bv_len;
+		if ((r = tfw_cache_gzip_deflate(bw, zs, Z_NO_FLUSH, len)))
+			goto out;
+	}
+	if ((r = tfw_cache_gzip_deflate(bw, zs, Z_FINISH, len)))
+		goto out;
+
+	trailer[0] = cpu_to_le32(~crc);
+	trailer[1] = cpu_to_le32(len);
+	str.data = (char *)trailer;
+	str.len = sizeof(trailer);
+	if (tfw_cache_strcpy(&bw->p, &bw->trec, &str, str.len) < 0) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	len = zs->total_out + TFW_CACHE_GZIP_OVERHEAD;
+	if (len >= bw->ce->body_len)
+		r = -E2BIG;
+	else
+		bw->ce->body_len = len;
+out:
+	zlib_deflateEnd(zs);
+
+	return r;
+}
+
+/**
+ * Copy the deferred response body to the cache entry, or compress it for
+ * the compressed variant. Called from the cache tasklet on a CPU of the node
+ * owning the entry.
+ */
+static void
+tfw_cache_body_write(TfwCacheBodyWork *bw)
+{
+	int r;
+	unsigned int i;
+	size_t tot_len = bw->ce->body_len;
+
+	if (bw->coding) {
+		r = tfw_cache_body_gzip(bw);
+		T_DBG3("Cache: compress response body, ce=%p r=%d\n", bw->ce, r);
+		tfw_cache_body_done(bw, r ? TFW_CE_BODY_FAILED : 0);
+		return;
+	}
+
+	for (i = 0; i < bw->nr; ++i) {
+		struct bio_vec *bv = &bw->bv[i];
+		TfwStr str = {
+			.data = page_address(bv->bv_page) + bv->bv_offset,
+			.len = bv->bv_len
+		};
+		long n = tfw_cache_strcpy(&bw->p, &bw->trec, &str, tot_len);
+
+		if (unlikely(n < 0)) {
+			T_WARN("Cache: cannot write behind response body\n");
+			tfw_cache_body_done(bw, TFW_CE_BODY_FAILED);
+			return;
+		}
+		tot_len -= n;
+	}
+
+	tfw_cache_body_done(bw, 0);
+}
+
+static void
+tfw_cache_body_queue(TfwCacheBodyWork *bw)
+{
+	TfwCWork cw = { .bw = bw };
+	int cpu = tfw_cpu_role_next(TFW_CPU_BG, bw->node - c_nodes);
+	TfwWorkTasklet *ct;
+
+	if (cpu < 0)
+		cpu = tfw_cache_node_cpu(bw->node);
+	ct = per_cpu_ptr(&cache_wq, cpu);
+
+	if (tfw_wq_push(&ct->wq, &cw, cpu, &ct->ipi_work, tfw_cache_ipi)) {
+		T_WARN("Cache: cannot schedule body write, drop the entry\n");
+		tfw_cache_body_done(bw, TFW_CE_BODY_FAILED);
+	}
+}
+
+/* Max length of a tag header or URI path processed by the purge index. */
+#define TFW_CACHE_TAG_BUF	1024
+
+/**
+ * Purge index key for tag or URI prefix @s of length @len on host @host.
+ * Tags and prefixes are hashed in different namespaces by @type.
+ */
+static unsigned long
+tfw_cache_tag_hash(char type, const char *host, size_t hlen, const char *s,
+		   size_t len)
+{
+	unsigned long h = hash_calc(&type, 1);
+
+	h = hash_calc_update(host, hlen, h);
+
+	return hash_calc_update(s, len, h);
+}
+
+/**
+ * Write lower case Host header value of @req to @host, the same value as
+ * used for the cache key. @host and the temporary buffer @buf are both of
+ * TFW_CACHE_TAG_BUF bytes.
+ */
+static size_t
+tfw_cache_tag_host(TfwHttpReq *req, char *host, char *buf)
+{
+	TfwStr h_val;
+	size_t n;
+
+	tfw_http_msg_clnthdr_val(req, &req->h_tbl->tbl[TFW_HTTP_HDR_HOST],
+				 TFW_HTTP_HDR_HOST, &h_val);
+	n = tfw_str_to_cstr(&h_val, buf, TFW_CACHE_TAG_BUF);
+	tfw_cstrtolower(host, buf, n);
+
+	return n;
+}
+
+/**
+ * Collect hashes of the tags listed in Surrogate-Key and Cache-Tag headers
+ * of @hm to @tags starting from @n up to @max. The tags are separated by
+ * whitespace or commas. @buf is a temporary buffer of TFW_CACHE_TAG_BUF bytes.
+ *
+ * @return new number of collected tags.
+ */
+static int
+tfw_cache_tags_collect(TfwHttpMsg *hm, const char *host, size_t hlen,
+		       char *buf, unsigned long *tags, int n, int max)
+{
+	static const TfwStr names[] = {
+		TFW_STR_STRING("surrogate-key"),
+		TFW_STR_STRING("cache-tag"),
+	};
+	TfwStr *dup, *dup_end;
+	const char *p, *t, *end;
+	unsigned int hid;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(names); ++i) {
+		hid = __http_hdr_lookup(hm, &names[i]);
+		if (hid == hm->h_tbl->off)
+			continue;
+
+		TFW_STR_FOR_EACH_DUP(dup, &hm->h_tbl->tbl[hid], dup_end) {
+			/* See tfw_cache_vary_val() for the value offset. */
+			end = buf + tfw_str_to_cstr(dup, buf, TFW_CACHE_TAG_BUF);
+			p = buf + names[i].len;
+			if (p < end && *p == ':')
+				++p;
+			while (p < end && n < max) {
+				while (p < end && (*p == ',' || isspace(*p)))
+					++p;
+				for (t = p; p < end && *p != ',' && !isspace(*p);
+				     ++p)
+					;
+				if (p > t)
+					tags[n++] = tfw_cache_tag_hash('T', host,
+								       hlen, t,
+								       p - t);
+			}
+		}
+	}
+
+	return n;
+}
+
+/**
+ * Add @ce stored for @resp in the database of node @nid to the purge index
+ * for its tags and for each slash-terminated prefix of the request URI.
+ */
+static void
+tfw_cache_tags_add(TfwHttpResp *resp, TfwCacheEntry *ce, int nid)
+{
+	int i, n = 0;
+	size_t hlen, plen;
+	char *host, *buf;
+	unsigned long tags[TFW_CACHE_TAGS_MAX];
+	TfwHttpReq *req = resp->req;
+
+	ce->tag_n = 0;
+	if (!(host = tfw_pool_alloc(resp->pool, TFW_CACHE_TAG_BUF * 2)))
+		return;
+	buf = host + TFW_CACHE_TAG_BUF;
+	hlen = tfw_cache_tag_host(req, host, buf);
+
+	/* Only the path is tagged, without the query and the fragment. */
+	plen = min_t(size_t, tfw_http_req_uri_path_len(req) + 1,
+		     TFW_CACHE_TAG_BUF);
+	plen = tfw_str_to_cstr(&req->uri_path, buf, plen);
+	for (i = 0; i < plen && n < TFW_CACHE_PREFIX_MAX; ++i)
+		if (buf[i] == '/')
+			tags[n++] = tfw_cache_tag_hash('P', host, hlen, buf,
+						       i + 1);
+
+	n = tfw_cache_tags_collect((TfwHttpMsg *)resp, host, hlen, buf, tags,
+				   n, TFW_CACHE_TAGS_MAX);
+
+	ce->id = atomic64_inc_return(&tfw_cache_ce_id);
+	for (i = 0; i < n; ++i) {
+		TfwCacheTagRef *ref = kmalloc(sizeof(*ref), GFP_ATOMIC);
+
+		if (!ref)
+			break;
+		ref->tag = tags[i];
+		ref->key = ce->trec.key;
+		ref->id = ce->id;
+		ref->nid = nid;
+
+		spin_lock_bh(&tfw_cache_tags_lock);
+		hlist_add_head(&ref->tentry, &tfw_cache_tags[
+				hash_long(ref->tag, TFW_CACHE_TAGS_HBITS)]);
+		hlist_add_head(&ref->ientry, &tfw_cache_tag_ids[
+				hash_long(ref->id, TFW_CACHE_TAGS_HBITS)]);
+		spin_unlock_bh(&tfw_cache_tags_lock);
+		ce->tag_n = i + 1;
+	}
+	tfw_pool_free(resp->pool, host, TFW_CACHE_TAG_BUF * 2);
+}
+
+/**
+ * Whether entity-tag of @resp is the same as the stored one of @ce.
+ */
+static bool
+tfw_cache_etag_eq(TfwHttpResp *resp, TfwCacheEntry *ce)
+{
+	TfwStr h_val, etag = {}, *c, *end;
+	TfwStr *h = &resp->h_tbl->tbl[TFW_HTTP_HDR_ETAG];
+
+	if (TFW_STR_EMPTY(h) || TFW_STR_EMPTY(&ce->etag))
+		return TFW_STR_EMPTY(h) && TFW_STR_EMPTY(&ce->etag);
+
+	/* Take the entity-tag value only, the same as __set_etag() does. */
+	tfw_http_msg_srvhdr_val(h, TFW_HTTP_HDR_ETAG, &h_val);
+	TFW_STR_FOR_EACH_CHUNK(c, &h_val, end)
+		if (c->flags & TFW_STR_VALUE)
+			break;
+	if (c == end
+	    || (c->flags & TFW_STR_ETAG_WEAK) != (ce->etag.flags
+						  & TFW_STR_ETAG_WEAK))
+		return false;
+	etag.chunks = c;
+	for ( ; c < end && (c->flags & TFW_STR_VALUE); ++c) {
+		etag.len += c->len;
+		++etag.nchunks;
+	}
+	if (etag.nchunks == 1)
+		etag = *etag.chunks;
+
+	return !tfw_strcmp(&etag, &ce->etag);
+}
+
+/**
+ * If @resp is the same representation as a complete entry stored in @db,
+ * i.e. it has the same status, body length and validators, then only update
+ * the stored freshness information instead of writing a new entry.
+ * Compressed variants don't have the identity validators, so they're
+ * refreshed along with the identity entry they were built from: @resp_time
+ * is set to the identity entry response time before the update and is used
+ * to find the variants.
+ *
+ * The stored response headers aren't updated. Date isn't stored, so Date
+ * and Age of served responses are built from the new response. The update
+ * is published to the lockless readers by @ce->fresh_seq.
+ *
+ * @return true if an entry was refreshed.
+ */
+static bool
+tfw_cache_refresh_node(TDB *db, TfwHttpResp *resp, unsigned long key,
+		       unsigned char coding, long *resp_time)
+{
+	TdbIter iter;
+	TfwCacheEntry *ce;
+	bool done = false;
+	TfwHttpReq *req = resp->req;
+
+	if (coding && !*resp_time)
+		return false;
+	/* The response doesn't identify the representation. */
+	if (!coding && TFW_STR_EMPTY(&resp->h_tbl->tbl[TFW_HTTP_HDR_ETAG])
+	    && !resp->last_modified)
+		return false;
+
+	iter = tdb_rec_get(db, key);
+	if (TDB_ITER_BAD(iter))
+		return false;
+
+	for (ce = (TfwCacheEntry *)iter.rec; ce; ce = (TfwCacheEntry *)iter.rec)
+	{
+		if (!done && ce->coding == coding
+		    && ce->resp_status == resp->status
+		    && !smp_load_acquire(&ce->body_state)
+		    && (coding ? ce->resp_time == *resp_time
+			       : ce->body_len == resp->body.len
+				 && ce->last_modified == resp->last_modified
+				 && tfw_cache_etag_eq(resp, ce))
+		    && tfw_cache_entry_key_eq(db, req, ce))
+		{
+			if (!coding)
+				*resp_time = ce->resp_time;
+			tfw_cache_fresh_write_begin(ce);
+			tfw_cache_set_freshness(ce, resp);
+			tfw_cache_fresh_write_end(ce);
+			WRITE_ONCE(ce->refresh, 0);
+			done = true;
+		}
+		tdb_rec_next(db, &iter);
+	}
+
+	return done;
+}
+
+/**
+ * Store @resp in the cache database of @node. Large response bodies are
+ * written behind by a cache tasklet of @node if configured, in which case
+ * requests collapsed on @key are resumed after the write if @resume is set.
+ * If @coding is set, then the compressed variant of @resp is stored and its
+ * body is always compressed by the tasklet.
+ *
+ * @return true if the body write is deferred.
+ */
+static bool
+__cache_add_node(CaNode *node, TfwHttpResp *resp, unsigned long key,
+		 TfwStr *skey, TfwStr *hints, unsigned char coding, bool resume)
+{
+	int r;
+	size_t len;
+	bool evicted = false;
+	unsigned char q;
+	TDB *db = node->db;
+	TfwCacheEntry *ce;
+	TfwCacheBodyWork *bw = NULL;
+	TfwStr rph, ctype, *s_line;
+	long data_len = __cache_entry_size(resp, coding);
+
+	if (unlikely(data_len < 0))
+		return false;
+
+	/*
+	 * We need to save the reason-phrase for the case of HTTP/1.1-response
+	 * creation from cache. Note, that reason-phrase is always the last part
+	 * of status-line with the TFW_STR_VALUE flag set.
+	 */
+	s_line = &resp->h_tbl->tbl[TFW_HTTP_STATUS_LINE];
+	rph = tfw_str_next_str_val(s_line);
+	if (WARN_ON_ONCE(TFW_STR_EMPTY(&rph)))
+		return false;
+
+	tfw_cache_ctype(resp, &ctype);
+	data_len += rph.len + skey->len + hints->len + ctype.len;
+	if (cache_cfg.resp_prebuilt && !coding) {
+		unsigned long via_sz = SLEN(S_VIA_H2_PROTO)
+			+ tfw_vhost_get_global()->hdr_via_len;
+
+		data_len += __cache_h1_prebuilt_size(resp, &rph);
+		data_len += __cache_h2_prebuilt_size(resp, via_sz);
+	}
+
+	/*
+	 * Chunked bodies are rewritten in place on forwarding, so copy them
+	 * right now. Fall back to synchronous copying on memory pressure.
+	 */
+	if (coding
+	    || (cache_cfg.write_behind
+		&& resp->body.len >= cache_cfg.write_behind
+		&& !test_bit(TFW_HTTP_B_CHUNKED, resp->flags)))
+		bw = tfw_cache_body_alloc(resp);
+	if (bw) {
+		bw->node = node;
+		bw->key = key;
+		bw->resume = resume;
+		bw->coding = coding;
+	} else if (coding) {
+		return false;
+	}
+
+	T_DBG3("%s: db=[%p] resp=[%p], req=[%p], key='%lu', data_len='%ld'\n",
+	       __func__, db, resp, resp->req, key, data_len);
+
+	/* Evict the entries of the same vhost first if it's over quota. */
+	if ((q = tfw_cache_quota(resp->req))
+	    && !tfw_cache_quota_fit(node, q, data_len))
+	{
+		T_DBG2("Cache: vhost quota is exceeded, key=%lx\n", key);
+		goto out;
+	}
+
+retry:
+	/*
+	 * Try to place the cached response in single memory chunk.
+	 * TDB should provide enough space to place at least head of
+	 * the record key at first chunk.
+	 */
+	len = data_len;
+	ce = (TfwCacheEntry *)tdb_entry_alloc(db, key, &len);
+	BUG_ON(len <= sizeof(TfwCacheEntry));
+	if (!ce)
+		goto evict;
+
+	T_DBG3("%s: ce=[%p], alloc_len='%lu'\n", __func__, ce, len);
+
+	/* The entry wasn't served yet and can be evicted right away. */
+	ce->atime = jiffies - TFW_CACHE_EVICT_GRACE;
+	ce->refresh = 0;
+	ce->fresh_seq = 0;
+	/* Hide the entry from lookups until the body is written. */
+	ce->body_state = bw ? TFW_CE_BODY_PENDING : 0;
+	ce->coding = coding;
+	ce->tag_n = 0;
+	ce->quota = q;
+	ce->size = data_len;
+	ce->slice = resp->req->cache_slice;
+	ce->slice_total = ce->slice ? tfw_cache_slice_total(resp) : 0;
+
+	if ((r = tfw_cache_copy_resp(ce, resp, &rph, skey, hints, bw,
+				     data_len)))
+	{
+		/* Delete the probably partially built TDB entry. */
+		tdb_entry_remove(db, (TdbRec *)ce, NULL);
+		if (r != -ENOMEM)
+			goto out;
+		goto evict;
+	}
+
+	/* Index the entry before it can be evicted. */
+	if (cache_cfg.purge_index)
+		tfw_cache_tags_add(resp, ce, node - c_nodes);
+
+	/*
+	 * All the entries in the ring were served just now, so there is
+	 * nothing to replace by the new entry and we can't track it.
+	 */
+	if (!tfw_cache_clock_add(node, ce)) {
+		tfw_cache_tags_del(ce);
+		tdb_entry_remove(db, (TdbRec *)ce, NULL);
+		goto out;
+	}
+	if (bw) {
+		tfw_cache_body_queue(bw);
+		return resume;
+	}
+	tfw_cache_l1_inval(node, key);
+	return false;
+evict:
+	if (!evicted && tfw_cache_evict(node)) {
+		evicted = true;
+		goto retry;
+	}
+out:
+	if (bw)
+		tfw_cache_body_free(bw);
+	return false;
+}
+
+static bool cache_req_process_node(TfwHttpReq *req,
+				   tfw_http_cache_cb_t action, int lookup);
+
+void
+tfw_cache_req_resume(TfwHttpReq *req, tfw_http_cache_cb_t action)
+{
+	cache_req_process_node(req, action, TFW_CACHE_LOOKUP_LOCAL);
+}
+
+/**
+ * Let cache missing @req wait for a response to a concurrent request for
+ * the same key, see cache_fetch.c.
+ */
+static bool
+tfw_cache_collapse(TfwHttpReq *req, tfw_http_cache_cb_t action)
+{
+	if (!cache_cfg.collapse_timeout || req->method != TFW_HTTP_METH_GET)
+		return false;
+	if (!tfw_cache_fetch_wait(req, tfw_cache_key(req), action,
+				  cache_cfg.collapse_timeout))
+		return false;
+	TFW_INC_STAT_BH(cache.collapsed);
+
+	return true;
+}
+
+/**
+ * A response to @key is received or it's known that it won't be stored.
+ */
+static void
+tfw_cache_collapse_done(unsigned long key)
+{
+	if (cache_cfg.collapse_timeout)
+		tfw_cache_fetch_done(key);
+}
+
+/**
+ * The response to @req isn't stored in the cache, e.g. it's streamed to the
+ * client: forward the requests collapsed on the request key right away
+ * instead of waiting for cache_collapse_timeout.
+ */
+void
+tfw_cache_fetch_bypass(TfwHttpReq *req)
+{
+	__clear_bit(TFW_HTTP_B_CACHE_FETCH, req->flags);
+	if (req->method == TFW_HTTP_METH_GET)
+		tfw_cache_collapse_done(tfw_cache_key(req));
+}
+
+/**
+ * Request @req, forwarded on a cache miss, is freed without a response, so
+ * the requests collapsed on it are forwarded right away.
+ */
+void
+tfw_cache_fetch_abort(TfwHttpReq *req)
+{
+	tfw_cache_fetch_release(req, tfw_cache_key(req));
+}
+
+static TfwHttpResp *tfw_cache_build_resp(TfwHttpReq *req, TfwCacheEntry *ce,
+					 long lifetime, unsigned int stream_id,
+					 TfwCacheRanges *rs);
+
+/**
+ * RFC 5861 4: replace the upstream error response @resp by a stale cache
+ * entry if the entry allows that with stale-if-error. The stale response is
+ * passed to @action instead of @resp.
+ *
+ * @return true if @resp was replaced.
+ */
+static bool
+tfw_cache_stale_if_error(TfwHttpResp *resp, tfw_http_cache_cb_t action)
+{
+	TdbIter iter;
+	long lifetime;
+	unsigned int id = 0;
+	TDB *db = node_db();
+	TfwCacheEntry *ce;
+	TfwCacheRanges rs = { 0 };
+	TfwHttpReq *req = resp->req;
+	TfwHttpResp *cresp;
+
+	if (resp->status < 500 || !req->conn || !tfw_cache_employ_req(req))
+		return false;
+	if (!(ce = tfw_cache_dbce_get(db, &iter, req)))
+		return false;
+	if (!(lifetime = tfw_cache_entry_stale_lifetime(ce, ce->stale_err))
+	    || (TFW_MSG_H2(req) && !(id = tfw_h2_stream_id(req))))
+	{
+		tdb_rec_put(ce);
+		return false;
+	}
+
+	T_DBG("Cache: serve stale entry key=%lx on upstream error %d\n",
+	      ce->key, resp->status);
+	TFW_INC_STAT_BH(cache.stale);
+
+	/* Unpair and free the error response, the stale one takes over. */
+	tfw_http_conn_msg_free((TfwHttpMsg *)resp);
+
+	if (!(cresp = tfw_cache_build_resp(req, ce, lifetime, id, &rs))) {
+		tfw_http_send_resp(req, 502, "response dropped: processing"
+				   " error");
+	} else if (TFW_MSG_H2(req)
+		   && !tfw_h2_stream_id_close(req, HTTP2_HEADERS,
+					      HTTP2_F_END_STREAM))
+	{
+		tfw_http_msg_free((TfwHttpMsg *)cresp);
+		tfw_http_conn_msg_free((TfwHttpMsg *)req);
+	} else {
+		action((TfwHttpMsg *)cresp);
+	}
+	tdb_rec_put(ce);
+
+	return true;
+}
+
+/**
+ * TinyLFU-like admission: a response is stored only if the resource was
+ * requested frequently enough recently, so one-hit wonders don't push hot
+ * entries out of the cache. Responses to internal requests, i.e. cache
+ * warm-up and background refreshes, are always admitted.
+ */
+static bool
+tfw_cache_admit(TfwHttpReq *req, unsigned long key)
+{
+	unsigned int min_freq;
+
+	if (!req->conn || !(min_freq = tfw_cache_admission(req)))
+		return true;
+
+	return tfw_cache_sketch_estimate(c_nodes[req->node].sketch, key)
+	       >= min_freq;
+}
+
+/**
+ * Whether a compressed variant should be stored for response @resp: only
+ * complete and not yet encoded 200 responses of textual media types are
+ * compressed. RFC 7234 5.2.2.4: no-transform forbids that.
+ */
+static bool
+tfw_cache_compressible(TfwHttpResp *resp)
+{
+	static const TfwStr h_ce = TFW_STR_STRING("content-encoding");
+	static const TfwStr types[] = {
+		TFW_STR_STRING("text/"),
+		TFW_STR_STRING("application/javascript"),
+		TFW_STR_STRING("application/json"),
+		TFW_STR_STRING("application/xml"),
+		TFW_STR_STRING("image/svg+xml"),
+	};
+	TfwStr val, *h = &resp->h_tbl->tbl[TFW_HTTP_HDR_CONTENT_TYPE];
+	int i;
+
+	if (!cache_cfg.compress || resp->status != 200
+	    || resp->body.len < cache_cfg.compress
+	    || resp->body.len > TFW_CACHE_COMPRESS_MAX
+	    || test_bit(TFW_HTTP_B_CHUNKED, resp->flags)
+	    || (resp->cache_ctl.flags & TFW_HTTP_CC_NO_TRANSFORM)
+	    || TFW_STR_EMPTY(h))
+		return false;
+	if (__http_hdr_lookup((TfwHttpMsg *)resp, &h_ce) != resp->h_tbl->off)
+		return false;
+
+	tfw_http_msg_srvhdr_val(h, TFW_HTTP_HDR_CONTENT_TYPE, &val);
+	for (i = 0; i < ARRAY_SIZE(types); ++i)
+		if (tfw_str_eq_cstr(&val, types[i].data, types[i].len,
+				    TFW_STR_EQ_PREFIX_CASEI))
+			return true;
+
+	return false;
+}
+
+/**
+ * Build secondary key @ckey of the compressed variant from the identity
+ * variant key @skey: the compressed variant is selected by Accept-Encoding
+ * on lookup, so the header line is removed from the key.
+ */
+static int
+tfw_cache_coding_key(TfwHttpResp *resp, TfwStr *skey, TfwStr *ckey)
+{
+	static const char h_ae[] = "accept-encoding:";
+	char *p, *end, *eol;
+
+	TFW_STR_INIT(ckey);
+	if (!skey->len)
+		return 0;
+	if (!(ckey->data = tfw_pool_alloc(resp->pool, skey->len)))
+		return -ENOMEM;
+
+	for (p = skey->data, end = p + skey->len; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p) ? : end - 1;
+		if (eol - p >= SLEN(h_ae) && !memcmp(p, h_ae, SLEN(h_ae)))
+			continue;
+		memcpy_fast(ckey->data + ckey->len, p, eol + 1 - p);
+		ckey->len += eol + 1 - p;
+	}
+
+	return 0;
+}
+
+/**
+ * Store @resp and its compressed variant of @coding, if any, with secondary
+ * keys @skey and @ckey correspondingly in the database of @node, or just
+ * refresh the stored entries if they're the same.
+ *
+ * @return true if the local body write resumes the collapsed requests.
+ */
+static bool
+tfw_cache_add_node(CaNode *node, TfwHttpResp *resp, unsigned long key,
+		   TfwStr *skey, TfwStr *ckey, TfwStr *hints,
+		   unsigned char coding, bool resume)
+{
+	bool deferred = false;
+	long resp_time = 0;
+
+	if (!tfw_cache_refresh_node(node->db, resp, key, 0, &resp_time))
+		deferred = __cache_add_node(node, resp, key, skey, hints, 0,
+					    resume);
+	if (coding
+	    && !tfw_cache_refresh_node(node->db, resp, key, coding, &resp_time))
+		__cache_add_node(node, resp, key, ckey, hints, coding, false);
+
+	return deferred;
+}
 
 static void
 tfw_cache_add(TfwHttpResp *resp, tfw_http_cache_cb_t action)
 {
-	unsigned long key;
-	bool keep_skb = false;
+	bool keep_skb = false, deferred = false;
+	unsigned char coding = 0;
+	TfwStr skey, ckey, hints;
 	TfwHttpReq *req = resp->req;
+	unsigned long key = tfw_cache_key(req);
+
+	/* The waiters are resumed below, they don't depend on @req anymore. */
+	__clear_bit(TFW_HTTP_B_CACHE_FETCH, req->flags);
+
+	if (tfw_cache_stale_if_error(resp, action))
+		goto fetch_done;
 
 	if (!tfw_cache_employ_resp(resp))
 		goto out;
+	if (!tfw_cache_admit(req, key)
+	    || tfw_mem_pressure() >= TFW_MEM_LOW)
+	{
+		TFW_INC_STAT_BH(cache.rejected);
+		goto out;
+	}
+	if (tfw_cache_vary_key(resp, &skey) || tfw_cache_hints(resp, &hints))
+		goto out;
+	if (tfw_cache_compressible(resp)
+	    && !tfw_cache_coding_key(resp, &skey, &ckey))
+		coding = TFW_CE_CODING_GZIP;
 
-	key = tfw_http_req_key_calc(req);
-
-	if (cache_cfg.cache == TFW_CACHE_SHARD) {
+	/*
+	 * Requests collapsed on the key are resumed by the local node body
+	 * write if it's deferred, so they're served from the complete entry.
+	 * The compressed variant is produced in background and served once
+	 * it's ready.
+	 */
+	if (cache_cfg.cache == TFW_CACHE_SHARD
+	    || (cache_cfg.cache == TFW_CACHE_HYBRID && !tfw_cache_hot(req, key)))
+	{
 		BUG_ON(req->node != numa_node_id());
-		__cache_add_node(node_db(), resp, key);
+		deferred = tfw_cache_add_node(&c_nodes[req->node], resp, key,
+					      &skey, &ckey, &hints, coding,
+					      true);
 	} else {
 		int nid;
-		/*
-		 * TODO probably it's better to do this in TDB per-node threads
-		 * rather than in softirq...
-		 */
+
 		for_each_node_with_cpus(nid)
-			__cache_add_node(c_nodes[nid].db, resp, key);
+			deferred |= tfw_cache_add_node(&c_nodes[nid], resp, key,
+						       &skey, &ckey, &hints,
+						       coding,
+						       nid == req->node);
 	}
 
 	/*
-	 * Cache population is synchronous now. Don't forget to set
-	 * @keep_skb properly in case of asynchronous operation is being
-	 * performed.
+	 * Deferred body writes hold references to the body pages, so the skbs
+	 * can be freed. Don't forget to set @keep_skb properly in case of
+	 * other asynchronous operation is being performed.
 	 */
 
-out:
-	resp->msg.ss_flags |= keep_skb ? SS_F_KEEP_SKB : 0;
-	action((TfwHttpMsg *)resp);
+out:
+	resp->msg.ss_flags |= keep_skb ? SS_F_KEEP_SKB : 0;
+	action((TfwHttpMsg *)resp);
+	if (deferred)
+		return;
+fetch_done:
+	tfw_cache_collapse_done(key);
+}
+
+/* Number of index references processed at once by a PURGE request. */
+#define TFW_CACHE_PURGE_BATCH	32
+
+/**
+ * Make stale all the entries indexed by purge index key @tag.
+ *
+ * Database locks may be acquired under tfw_cache_tags_lock on eviction, so
+ * unlink the references in batches and look the entries up with the index
+ * lock released.
+ */
+static void
+tfw_cache_purge_tag(unsigned long tag)
+{
+	int i, n;
+	TdbIter iter;
+	TfwCacheEntry *ce;
+	TfwCacheTagRef *ref, *refs[TFW_CACHE_PURGE_BATCH];
+	struct hlist_node *tmp;
+	struct hlist_head *head;
+
+	head = &tfw_cache_tags[hash_long(tag, TFW_CACHE_TAGS_HBITS)];
+	do {
+		n = 0;
+		spin_lock_bh(&tfw_cache_tags_lock);
+		hlist_for_each_entry_safe(ref, tmp, head, tentry) {
+			if (ref->tag != tag)
+				continue;
+			hlist_del(&ref->tentry);
+			hlist_del(&ref->ientry);
+			refs[n] = ref;
+			if (++n == TFW_CACHE_PURGE_BATCH)
+				break;
+		}
+		spin_unlock_bh(&tfw_cache_tags_lock);
+
+		for (i = 0; i < n; ++i) {
+			TDB *db = c_nodes[refs[i]->nid].db;
+
+			iter = tdb_rec_get(db, refs[i]->key);
+			for (ce = (TfwCacheEntry *)iter.rec; ce;
+			     ce = (TfwCacheEntry *)iter.rec)
+			{
+				if (ce->id == refs[i]->id)
+					ce->lifetime = 0;
+				tdb_rec_next(db, &iter);
+			}
+			kfree(refs[i]);
+		}
+	} while (n == TFW_CACHE_PURGE_BATCH);
+}
+
+/**
+ * Purge the entries by the purge index: by the tags listed in Surrogate-Key
+ * and Cache-Tag headers of @req or, if there are no such headers, by the URI
+ * prefix if the request path ends with "/*".
+ *
+ * @return true if @req is an index purge request.
+ */
+static bool
+tfw_cache_purge_index(TfwHttpReq *req)
+{
+	int i, n;
+	size_t hlen, plen;
+	char *host, *buf;
+	unsigned long tags[TFW_CACHE_TAGS_MAX];
+
+	if (!(host = tfw_pool_alloc(req->pool, TFW_CACHE_TAG_BUF * 2)))
+		return false;
+	buf = host + TFW_CACHE_TAG_BUF;
+	hlen = tfw_cache_tag_host(req, host, buf);
+
+	n = tfw_cache_tags_collect((TfwHttpMsg *)req, host, hlen, buf, tags, 0,
+				   TFW_CACHE_TAGS_MAX);
+	if (!n) {
+		plen = tfw_str_to_cstr(&req->uri_path, buf, TFW_CACHE_TAG_BUF);
+		if (plen >= 2 && buf[plen - 2] == '/' && buf[plen - 1] == '*')
+			tags[n++] = tfw_cache_tag_hash('P', host, hlen, buf,
+						       plen - 1);
+	}
+	tfw_pool_free(req->pool, host, TFW_CACHE_TAG_BUF * 2);
+
+	for (i = 0; i < n; ++i)
+		tfw_cache_purge_tag(tags[i]);
+
+	return n;
+}
+
+/*
+ * Invalidate all cache entries that match the request. This is implemented by
+ * making the entries stale.
+ *
+ * TODO #522 Review the invalidation logic.
+ *
+ */
+static void
+__tfw_cache_purge_invalidate(TDB *db, TfwHttpReq *req, unsigned long key)
+{
+	TdbIter iter;
+	TfwCacheEntry *ce;
+
+	iter = tdb_rec_get(db, key);
+	if (TDB_ITER_BAD(iter))
+		return;
+
+	ce = (TfwCacheEntry *)iter.rec;
+	do {
+		if (tfw_cache_entry_key_eq(db, req, ce))
+			ce->lifetime = 0;
+		tdb_rec_next(db, &iter);
+		ce = (TfwCacheEntry *)iter.rec;
+	} while (ce);
+}
+
+/**
+ * Invalidate slice @off of the resource purged by @req in database @db.
+ *
+ * @return length of the representation if the slice is found.
+ */
+static unsigned long
+__tfw_cache_purge_slice(TDB *db, TfwHttpReq *req, unsigned long key,
+			unsigned long off)
+{
+	unsigned long total = 0;
+	TfwCacheEntry *ce;
+	TdbIter iter;
+
+	iter = tdb_rec_get(db, key);
+	for (ce = (TfwCacheEntry *)iter.rec; ce; ce = (TfwCacheEntry *)iter.rec)
+	{
+		if (ce->slice == off + 1 && tfw_cache_entry_key_eq(db, req, ce)) {
+			ce->lifetime = 0;
+			total = max(total, ce->slice_total);
+		}
+		tdb_rec_next(db, &iter);
+	}
+
+	return total;
 }
 
-/*
- * Invalidate all cache entries that match the request. This is implemented by
- * making the entries stale.
- *
- * TODO #522 Review the invalidation logic.
- *
+/**
+ * Invalidate the slices of the resource purged by @req. The slices are
+ * stored under their own keys, so they're looked up one by one up to the
+ * representation length known from a found slice. If none of the first
+ * TFW_CACHE_SLICE_SCAN slices is cached, the rest aren't looked up.
  */
+static void
+tfw_cache_purge_slices(TfwHttpReq *req)
+{
+	unsigned long n, key, off, total = 0;
+	TDB *db;
+	int nid;
+
+	for (off = 0; total ? off < total
+			    : off < TFW_CACHE_SLICE_SCAN * cache_cfg.slice;
+	     off += cache_cfg.slice)
+	{
+		req->cache_slice = off + 1;
+		key = tfw_cache_key(req);
+		if (cache_cfg.cache == TFW_CACHE_HYBRID) {
+			/* Hot slices are replicated to all the nodes. */
+			for_each_node_with_cpus(nid) {
+				db = c_nodes[nid].db;
+				n = __tfw_cache_purge_slice(db, req, key, off);
+				total = max(total, n);
+			}
+			continue;
+		}
+		db = cache_cfg.cache == TFW_CACHE_SHARD
+		     ? c_nodes[tfw_cache_key_node(key)].db
+		     : node_db();
+		n = __tfw_cache_purge_slice(db, req, key, off);
+		total = max(total, n);
+	}
+	req->cache_slice = 0;
+}
+
 static int
 tfw_cache_purge_invalidate(TfwHttpReq *req)
 {
-	TdbIter iter;
-	TDB *db = node_db();
-	TfwCacheEntry *ce = NULL;
-	unsigned long key = tfw_http_req_key_calc(req);
+	unsigned long key;
+	int nid;
 
-	iter = tdb_rec_get(db, key);
-	if (TDB_ITER_BAD(iter))
+	if (cache_cfg.purge_index && tfw_cache_purge_index(req)) {
+		/* There is no single resource to refresh. */
+		clear_bit(TFW_HTTP_B_PURGE_GET, req->flags);
 		return 0;
+	}
 
-	ce = (TfwCacheEntry *)iter.rec;
-	do {
-		if (tfw_cache_entry_key_eq(db, req, ce))
-			ce->lifetime = 0;
-		tdb_rec_next(db, &iter);
-		ce = (TfwCacheEntry *)iter.rec;
-	} while (ce);
+	if (cache_cfg.slice)
+		tfw_cache_purge_slices(req);
+
+	key = tfw_cache_key(req);
+	if (cache_cfg.cache != TFW_CACHE_HYBRID) {
+		__tfw_cache_purge_invalidate(node_db(), req, key);
+		return 0;
+	}
+	/* The shard node entry and its replicas. */
+	for_each_node_with_cpus(nid)
+		__tfw_cache_purge_invalidate(c_nodes[nid].db, req, key);
 
 	return 0;
 }
@@ -1886,7 +5128,9 @@ tfw_cache_purge_method(TfwHttpReq *req)
 }
 
 /**
- * Add page from cache into response.
+ * Add page from cache into response. For HTTP/2 (@h2) data @p is copied to
+ * a new page after the DATA frame header @frame_hdr, that is used for small
+ * data generated on the fly, see tfw_cache_add_body_str().
  */
 static int
 tfw_cache_add_body_page(TfwMsgIter *it, char *p, int sz, TfwFrameHdr *frame_hdr,
@@ -1901,7 +5145,7 @@ tfw_cache_add_body_page(TfwMsgIter *it, char *p, int sz, TfwFrameHdr *frame_hdr,
 	 */
 	if (h2) {
 		char *new_p;
-		if (!(page = alloc_page(GFP_ATOMIC))) {
+		if (!(page = ss_skb_alloc_page())) {
 			return -ENOMEM;
 		}
 		new_p = page_address(page);
@@ -1926,34 +5170,71 @@ tfw_cache_add_body_page(TfwMsgIter *it, char *p, int sz, TfwFrameHdr *frame_hdr,
 }
 
 /**
- * Build the message body as paged fragments of skb.
- * See do_tcp_sendpages() as reference.
+ * Page for HTTP/2 DATA frame headers of a response built from cache.
  *
- * Different strategies are used to avoid extra data copying depending on
- * client connection type:
- * - for http connections - pages are reused in skbs and SKBTX_SHARED_FRAG is
- * set to avoid any data copies.
- * - for https connections - pages are reused in skbs and SKBTX_SHARED_FRAG is
- * set, but in-place crypto operations are not allowed, so data copy happens
- * right before data is pushed into network.
- * - for h2 connections - every response has unique frame header, so need to
- * copy on constructing response body from cache. SKBTX_SHARED_FRAG is left
- * unset to allow in-place crypto operations.
+ * @page	- the page, the frames reference it by their own page counts;
+ * @off		- offset of free space in the page;
+ */
+typedef struct {
+	struct page	*page;
+	unsigned int	off;
+} TfwCacheFrameHdrs;
+
+/**
+ * Add HTTP/2 DATA frame header @frame_hdr as a separate fragment preceding
+ * the frame payload referenced from the cache. Many frame headers share the
+ * single page @fh, so there is only one page allocation per response body.
+ */
+static int
+tfw_cache_add_frame_hdr(TfwMsgIter *it, TfwCacheFrameHdrs *fh,
+			TfwFrameHdr *frame_hdr)
+{
+	if (!fh->page || fh->off + FRAME_HEADER_SIZE > PAGE_SIZE) {
+		if (fh->page)
+			put_page(fh->page);
+		if (!(fh->page = ss_skb_alloc_page()))
+			return -ENOMEM;
+		fh->off = 0;
+	}
+
+	tfw_h2_pack_frame_header((char *)page_address(fh->page) + fh->off,
+				 frame_hdr);
+	++it->frag;
+	skb_fill_page_desc(it->skb, it->frag, fh->page, fh->off,
+			   FRAME_HEADER_SIZE);
+	skb_frag_ref(it->skb, it->frag);
+	ss_skb_adjust_data_len(it->skb, FRAME_HEADER_SIZE);
+	fh->off += FRAME_HEADER_SIZE;
+
+	return 0;
+}
+
+/**
+ * Build the message body (or prebuilt HTTP/1.1 headers) as paged fragments
+ * of skb. @last is set if the data ends the response, so the last HTTP/2 DATA
+ * frame must carry END_STREAM flag.
+ * See do_tcp_sendpages() as reference.
  *
- * Since we can't encrypt shared data in-place we always copy it, so we need
- * reserve some space in cached pages to avoid extra skb fragmentation. Since
- * body fragments are stored in cache by pages with at least cache record
- * header preceding, which is bigger than h2 frame header, it's always possible
- * to fit body fragment and h2 header into a single page. So there is no need
- * to actually reserve any space for h2 frame header.
+ * The cached pages are referenced by the skbs and never copied on the
+ * response building regardless of the client connection type, so
+ * SKBTX_SHARED_FRAG is set for the skbs:
+ * - for http connections the pages are sent as is;
+ * - for https connections in-place crypto operations are not allowed, so the
+ *   data is encrypted to new pages right before it's pushed into network;
+ * - for h2 connections every response has unique frame headers, so they're
+ *   written to separate fragments preceding each chunk of the cached body,
+ *   see tfw_cache_add_frame_hdr().
  */
 static int
 tfw_cache_build_resp_body(TDB *db, TdbVRec *trec, TfwMsgIter *it, char *p,
-			  unsigned long body_sz, bool h2, unsigned int stream_id)
+			  unsigned long body_sz, bool h2, unsigned int stream_id,
+			  bool last)
 {
-	int r;
+	int r = 0;
 	TfwFrameHdr frame_hdr = {.stream_id = stream_id, .type = HTTP2_DATA};
-	bool sh_frag = h2 ? false : true;
+	TfwCacheFrameHdrs fh = {};
+	/* HTTP/2 frames need one more fragment for the frame header. */
+	int nfrags = h2 ? 2 : 1;
 
 	if (WARN_ON_ONCE(!it->skb_head))
 		return -EINVAL;
@@ -1963,95 +5244,185 @@ tfw_cache_build_resp_body(TDB *db, TdbVRec *trec, TfwMsgIter *it, char *p,
 	 * otherwise, use next empty frag in current skb. Create a new skb, if
 	 * TX flags for headers and body differ.
 	 */
-	if (!it->skb || (it->frag + 1 >= MAX_SKB_FRAGS)
-	    || (sh_frag == !(skb_shinfo(it->skb)->tx_flags & SKBTX_SHARED_FRAG)))
+	if (!it->skb || (it->frag + nfrags >= MAX_SKB_FRAGS)
+	    || !(skb_shinfo(it->skb)->tx_flags & SKBTX_SHARED_FRAG))
 	{
 		if  ((r = tfw_msg_iter_append_skb(it)))
 			return r;
-		if (!sh_frag)
-			skb_shinfo(it->skb)->tx_flags &= ~SKBTX_SHARED_FRAG;
-		else
-			skb_shinfo(it->skb)->tx_flags |= SKBTX_SHARED_FRAG;
+		skb_shinfo(it->skb)->tx_flags |= SKBTX_SHARED_FRAG;
 	}
 
 	while (1) {
-		int off, f_size;
+		int f_size = trec->data + trec->len - p;
 
-		off = (unsigned long)p & ~PAGE_MASK;
-		f_size = trec->data + trec->len - p;
 		if (f_size) {
-			f_size = min(body_sz, (unsigned long)f_size);
+			/*
+			 * Large records are stored in contiguous block runs
+			 * within a TDB extent, which is a compound huge page,
+			 * so a fragment may span several pages. Split the
+			 * runs into fragments fitting the minimal HTTP/2
+			 * frame size.
+			 */
+			f_size = min3(body_sz, (unsigned long)f_size,
+				      (unsigned long)FRAME_DEF_LENGTH);
 			body_sz -= f_size;
-			r = tfw_cache_add_body_page(it, p, f_size, &frame_hdr,
-						    h2, !body_sz);
+			if (h2) {
+				frame_hdr.flags = last && !body_sz
+						  ? HTTP2_F_END_STREAM : 0;
+				frame_hdr.length = f_size;
+				r = tfw_cache_add_frame_hdr(it, &fh, &frame_hdr);
+				if (r)
+					break;
+			}
+			r = tfw_cache_add_body_page(it, p, f_size, NULL, false,
+						    false);
 			if (r)
-				return r;
+				break;
+			p += f_size;
 		}
-		if (!body_sz || !(trec = tdb_next_rec_chunk(db, trec)))
+		if (!body_sz)
 			break;
-		/*
-		 * Broken record: body is not fully copied yet, but there is
-		 * no data in the next record part.
-		 */
-		if (WARN_ON_ONCE(!trec->len))
-			return -EINVAL;
-		p = trec->data;
+		if (p == trec->data + trec->len) {
+			if (!(trec = tdb_next_rec_chunk(db, trec)))
+				break;
+			/*
+			 * Broken record: body is not fully copied yet, but
+			 * there is no data in the next record part.
+			 */
+			if (WARN_ON_ONCE(!trec->len)) {
+				r = -EINVAL;
+				break;
+			}
+			p = trec->data;
+		}
 
-		if (it->frag + 1 == MAX_SKB_FRAGS
+		if (it->frag + nfrags >= MAX_SKB_FRAGS
 		    && (r = tfw_msg_iter_append_skb(it)))
-		{
-			return r;
-		}
+			break;
+	}
+
+	if (fh.page)
+		put_page(fh.page);
+
+	return r;
+}
+
+/**
+ * Reference the prebuilt HTTP/1.1 status line and headers of @ce by paged
+ * fragments of the response skbs, the same way as the body is referenced.
+ * The headers depending on the request are written to a separate skb, so
+ * the cached pages are never modified.
+ */
+static int
+tfw_cache_h1_build_prebuilt(TDB *db, TfwCacheEntry *ce, TfwHttpResp *resp)
+{
+	int r;
+	char *p;
+	TfwMsgIter *it = &resp->mit.iter;
+	TdbVRec *trec = tfw_cache_trec_at(db, ce, ce->h1, &p);
+
+	if (unlikely(!trec)) {
+		T_WARN("Huh, partially stored cache entry (key=%lx)?\n",
+		       ce->key);
+		return -EINVAL;
 	}
 
+	r = ss_skb_alloc_data(&resp->msg.skb_head, 0, SKBTX_SHARED_FRAG);
+	if (unlikely(r))
+		return r;
+	it->skb_head = it->skb = resp->msg.skb_head;
+	it->frag = -1;
+
+	r = tfw_cache_build_resp_body(db, trec, it, p, ce->h1_len, false, 0,
+				      false);
+	if (unlikely(r))
+		return r;
+
+	if ((r = tfw_msg_iter_append_skb(it)))
+		return r;
+	skb_shinfo(it->skb)->tx_flags &= ~SKBTX_SHARED_FRAG;
+
 	return 0;
 }
 
+/**
+ * Copy the prebuilt HTTP/2 header block of @ce to the HEADERS frame of @resp.
+ * Unlike HTTP/1.1 prebuilt headers the block can't be referenced by fragments
+ * since HEADERS and CONTINUATION frames are split by the block data.
+ */
 static int
-tfw_cache_set_hdr_age(TfwHttpResp *resp, TfwCacheEntry *ce)
+tfw_cache_h2_build_prebuilt(TDB *db, TfwCacheEntry *ce, TfwHttpResp *resp,
+			    unsigned long *acc_len)
 {
 	int r;
-	size_t digs;
-	bool to_h2 = TFW_MSG_H2(resp->req);
-	TfwHttpTransIter *mit = &resp->mit;
-	struct sk_buff **skb_head = &resp->msg.skb_head;
-	long age = tfw_cache_entry_age(ce);
-	char cstr_age[TFW_ULTOA_BUF_SIZ] = {0};
-	char *name = to_h2 ? "age" : "age" S_DLM;
-	unsigned int nlen = to_h2 ? SLEN("age") : SLEN("age" S_DLM);
-	TfwStr h_age = {
+	char *p;
+	TfwDecodeCacheIter dc_iter = {};
+	TdbVRec *trec = tfw_cache_trec_at(db, ce, ce->h2, &p);
+
+	if (unlikely(!trec)) {
+		T_WARN("Huh, partially stored cache entry (key=%lx)?\n",
+		       ce->key);
+		return -EINVAL;
+	}
+
+	resp->mit.start_off = FRAME_HEADER_SIZE;
+	r = tfw_cache_h2_write(db, &trec, resp, &p, ce->h2_len, &dc_iter);
+	if (unlikely(r))
+		return r;
+	*acc_len += dc_iter.acc_len;
+
+	return 0;
+}
+
+/**
+ * Add header @name with value @val to HTTP/2 or HTTP/1.1 response @resp
+ * built from cache.
+ */
+static int
+tfw_cache_expand_hdr(TfwHttpResp *resp, char *name, size_t nlen, char *val,
+		     size_t vlen, unsigned short hpack_idx)
+{
+	TfwStr hdr = {
 		.chunks = (TfwStr []){
 			{ .data = name, .len = nlen },
-			{}
+			{ .data = S_DLM, .len = SLEN(S_DLM) },
+			{ .data = val, .len = vlen },
+			{ .data = S_CRLF, .len = SLEN(S_CRLF) }
 		},
-		.len = nlen,
-		.nchunks = 2
+		.len = nlen + SLEN(S_DLM) + vlen + SLEN(S_CRLF),
+		.nchunks = 4
 	};
 
-	if (!(digs = tfw_ultoa(age, cstr_age, TFW_ULTOA_BUF_SIZ))) {
-		r = -E2BIG;
-		goto err;
+	if (TFW_MSG_H2(resp->req)) {
+		/* HTTP/2 representation: just name and value. */
+		*__TFW_STR_CH(&hdr, 1) = *__TFW_STR_CH(&hdr, 2);
+		hdr.len = nlen + vlen;
+		hdr.nchunks = 2;
+		hdr.hpack_idx = hpack_idx;
+
+		return tfw_hpack_encode(resp, &hdr, TFW_H2_TRANS_EXPAND, false);
 	}
 
-	__TFW_STR_CH(&h_age, 1)->data = cstr_age;
-	__TFW_STR_CH(&h_age, 1)->len = digs;
-	h_age.len += digs;
+	return tfw_http_msg_expand_data(&resp->mit.iter, &resp->msg.skb_head,
+					&hdr, NULL);
+}
 
-	if (to_h2) {
-		h_age.hpack_idx = 21;
-		if ((r = tfw_hpack_encode(resp, &h_age, TFW_H2_TRANS_EXPAND,
-					  false)))
-			goto err;
-	} else {
-		if ((r = tfw_http_msg_expand_data(&mit->iter, skb_head,
-						  &h_age, NULL)))
-			goto err;
+static int
+tfw_cache_set_hdr_age(TfwHttpResp *resp, long age)
+{
+	int r;
+	size_t digs;
+	char cstr_age[TFW_ULTOA_BUF_SIZ] = {0};
 
-		if ((r = tfw_http_msg_expand_data(&mit->iter, skb_head,
-						  &g_crlf, NULL)))
-			goto err;
+	if (!(digs = tfw_ultoa(age, cstr_age, TFW_ULTOA_BUF_SIZ))) {
+		r = -E2BIG;
+		goto err;
 	}
 
+	if ((r = tfw_cache_expand_hdr(resp, "age", SLEN("age"), cstr_age, digs,
+				      21)))
+		goto err;
+
 	return 0;
 
 err:
@@ -2060,32 +5431,241 @@ err:
 	return r;
 }
 
+/**
+ * Add Content-Range (or multipart Content-Type) and Content-Length headers
+ * of 206 response for ranges @rs.
+ */
+static int
+tfw_cache_set_hdrs_206(TfwHttpResp *resp, const TfwCacheRanges *rs)
+{
+	int r;
+	size_t n;
+	char buf[TFW_CACHE_PART_HDR_MAX];
+
+	if (rs->n == 1) {
+		n = snprintf(buf, sizeof(buf), "bytes %lu-%lu/%lu",
+			     rs->first[0], rs->last[0], rs->total);
+		r = tfw_cache_expand_hdr(resp, "content-range",
+					 SLEN("content-range"), buf, n, 30);
+	} else {
+		n = snprintf(buf, sizeof(buf),
+			     "multipart/byteranges; boundary=%s",
+			     rs->boundary);
+		r = tfw_cache_expand_hdr(resp, "content-type",
+					 SLEN("content-type"), buf, n, 31);
+	}
+	if (unlikely(r))
+		return r;
+
+	if (!(n = tfw_ultoa(rs->clen, buf, TFW_ULTOA_BUF_SIZ)))
+		return -E2BIG;
+
+	return tfw_cache_expand_hdr(resp, "content-length",
+				    SLEN("content-length"), buf, n, 28);
+}
+
+/**
+ * Add Content-Encoding, Content-Length and Vary headers of the compressed
+ * variant @ce. The headers aren't stored in the entry since the compressed
+ * body length is known only after the entry is stored.
+ */
+static int
+tfw_cache_set_hdrs_coding(TfwHttpResp *resp, TfwCacheEntry *ce)
+{
+	int r;
+	size_t n;
+	char buf[TFW_ULTOA_BUF_SIZ];
+
+	if ((r = tfw_cache_expand_hdr(resp, "content-encoding",
+				      SLEN("content-encoding"), "gzip",
+				      SLEN("gzip"), 26)))
+		return r;
+	if ((r = tfw_cache_expand_hdr(resp, "vary", SLEN("vary"),
+				      "accept-encoding",
+				      SLEN("accept-encoding"), 59)))
+		return r;
+
+	if (!(n = tfw_ultoa(ce->body_len, buf, TFW_ULTOA_BUF_SIZ)))
+		return -E2BIG;
+
+	return tfw_cache_expand_hdr(resp, "content-length",
+				    SLEN("content-length"), buf, n, 28);
+}
+
+/**
+ * Add data @str generated on the fly into the body of response @resp. The
+ * data is copied, so the cached pages referenced by the response are never
+ * written to.
+ */
+static int
+tfw_cache_add_body_str(TfwHttpResp *resp, char *data, size_t len,
+		       unsigned int stream_id, bool last)
+{
+	int r;
+	TfwMsgIter *it = &resp->mit.iter;
+	TfwFrameHdr frame_hdr = {.stream_id = stream_id, .type = HTTP2_DATA};
+	TfwStr str = { .data = data, .len = len };
+
+	if (!TFW_MSG_H2(resp->req)) {
+		if (it->skb
+		    && (skb_shinfo(it->skb)->tx_flags & SKBTX_SHARED_FRAG))
+			it->skb = NULL;
+		return tfw_http_msg_expand_data(it, &resp->msg.skb_head, &str,
+						NULL);
+	}
+
+	if (it->frag + 1 >= MAX_SKB_FRAGS
+	    && (r = tfw_msg_iter_append_skb(it)))
+		return r;
+
+	return tfw_cache_add_body_page(it, data, len, &frame_hdr, true, last);
+}
+
+/**
+ * Find position @off of the response body starting at @p in record chunk
+ * @trec.
+ */
+static TdbVRec *
+tfw_cache_body_seek(TDB *db, TdbVRec *trec, char **p, unsigned long off)
+{
+	while (trec) {
+		unsigned long n = trec->data + trec->len - *p;
+
+		if (off < n) {
+			*p += off;
+			return trec;
+		}
+		off -= n;
+		if ((trec = tdb_next_rec_chunk(db, trec)))
+			*p = trec->data;
+	}
+
+	return NULL;
+}
+
+/**
+ * Build 206 response body for ranges @rs from the cached body starting at @p
+ * in record chunk @trec. As for the full response the body pages are
+ * referenced by the response without copying, only multipart boundaries are
+ * generated.
+ */
+static int
+tfw_cache_build_resp_ranges(TDB *db, TfwHttpResp *resp, TdbVRec *trec,
+			    char *p, const TfwCacheRanges *rs,
+			    unsigned int stream_id)
+{
+	int i, r;
+	size_t n;
+	char buf[TFW_CACHE_PART_HDR_MAX];
+	bool h2 = TFW_MSG_H2(resp->req), multi = rs->n > 1;
+
+	for (i = 0; i < rs->n; ++i) {
+		char *d = p;
+		TdbVRec *tr = tfw_cache_body_seek(db, trec, &d,
+						  rs->first[i] - rs->off);
+
+		if (WARN_ON_ONCE(!tr))
+			return -EINVAL;
+
+		if (multi) {
+			n = tfw_cache_range_part_hdr(buf, sizeof(buf), rs, i);
+			if ((r = tfw_cache_add_body_str(resp, buf, n,
+							stream_id, false)))
+				return r;
+		}
+
+		r = tfw_cache_build_resp_body(db, tr, &resp->mit.iter, d,
+					      rs->last[i] - rs->first[i] + 1,
+					      h2, stream_id, !multi);
+		if (unlikely(r))
+			return r;
+	}
+	if (!multi)
+		return 0;
+
+	n = snprintf(buf, sizeof(buf), S_CRLF "--%s--" S_CRLF, rs->boundary);
+
+	return tfw_cache_add_body_str(resp, buf, n, stream_id, true);
+}
+
+/**
+ * Zero-copy transmission of a response built from the cache.
+ *
+ * @uarg	- completion notification, @uarg.refcnt is the number of skbs
+ *		  referencing the cached data plus the builder reference;
+ * @db		- the cache table;
+ * @pin		- pin of the cache entry, so the data doesn't change until
+ *		  the skbs are freed when the client acknowledges the data;
+ */
+typedef struct {
+	struct ubuf_info	uarg;
+	TDB			*db;
+	void			*pin;
+} TfwCacheZc;
+
+static void
+tfw_cache_zc_complete(struct ubuf_info *uarg, bool success)
+{
+	TfwCacheZc *zc = container_of(uarg, TfwCacheZc, uarg);
+
+	if (!refcount_dec_and_test(&uarg->refcnt))
+		return;
+	tdb_rec_unpin(zc->db, zc->pin);
+	kfree(zc);
+}
+
+/**
+ * Pin cache entry @ce until all the skbs of @resp referencing the entry data
+ * are transmitted. Otherwise the entry can be evicted and its memory reused
+ * while the data is still in the socket retransmission queue.
+ */
+static int
+tfw_cache_zc_set(TDB *db, TfwCacheEntry *ce, TfwHttpResp *resp)
+{
+	TfwCacheZc *zc;
+
+	if (!(zc = kmalloc(sizeof(*zc), GFP_ATOMIC)))
+		return -ENOMEM;
+	if (!(zc->pin = tdb_rec_pin(db, ce))) {
+		kfree(zc);
+		return -ENOMEM;
+	}
+	zc->db = db;
+	zc->uarg.callback = tfw_cache_zc_complete;
+	zc->uarg.ctx = NULL;
+	zc->uarg.mmp.user = NULL;
+	zc->uarg.mmp.num_pg = 0;
+	refcount_set(&zc->uarg.refcnt, 1);
+
+	ss_skb_queue_zcopy_set(resp->msg.skb_head, &zc->uarg);
+	tfw_cache_zc_complete(&zc->uarg, true);
+
+	return 0;
+}
+
 /**
  * Build response that can be sent via TCP socket.
  *
  * We return skbs in the cache entry response w/o setting any
  * network headers - tcp_transmit_skb() will do it for us.
  *
- * TODO Prebuild the response and use clones/copies for sending
- * (copy the list of skbs is faster than scan TDB and build TfwHttpResp).
- * TLS should encrypt the data in already prepared skbs.
- *
- * Basically, skb copy/cloning involves skb creation, so it seems performance
- * of response body creation won't change since now we just reuse TDB pages.
- * Performance benchmarks and profiling shows that cache_req_process_node()
- * is the bottleneck, so the problem is either in tfw_cache_dbce_get() or this
- * function, in headers compilation.
- * Also it seems caching prebuilt responses requires introducing
- * TfwCacheEntry->resp pointer to avoid additional indexing data structure.
- * However, the pointer must be zeroed on TDB shutdown and recovery.
+ * HTTP/1.1 responses are built from the status line and headers prebuilt at
+ * the entry insertion time (see tfw_cache_h1_copy_prebuilt()), so only the
+ * request specific headers are compiled here. The prebuilt headers can't be
+ * used if there are response header modifications for the location, in this
+ * case and for HTTP/2 responses, which require per-stream framing, the headers
+ * are compiled from the HPACK representation stored in the entry.
  *
  * TODO use iterator and passed skbs to be called from net_tx_action.
  */
 static TfwHttpResp *
 tfw_cache_build_resp(TfwHttpReq *req, TfwCacheEntry *ce, long lifetime,
-		     unsigned int stream_id)
+		     unsigned int stream_id, const TfwCacheRanges *rs)
 {
 	int h;
+	bool prebuilt;
+	unsigned int seq;
+	long age, ce_lifetime;
 	TfwStr dummy_body = { 0 };
 	TfwMsgIter *it;
 	TfwHttpResp *resp;
@@ -2095,6 +5675,7 @@ tfw_cache_build_resp(TfwHttpReq *req, TfwCacheEntry *ce, long lifetime,
 	unsigned long h_len = 0;
 	struct sk_buff **skb_head;
 	TdbVRec *trec = &ce->trec;
+	TfwHdrMods *st_mods;
 	TfwHdrMods *h_mods = tfw_vhost_get_hdr_mods(req->location, req->vhost,
 						    TFW_VHOST_HDRMOD_RESP);
 	/*
@@ -2109,7 +5690,26 @@ tfw_cache_build_resp(TfwHttpReq *req, TfwCacheEntry *ce, long lifetime,
 	resp->version = ce->version;
 	tfw_http_copy_flags(resp->flags, ce->hmflags);
 
-	resp->date = ce->date;
+	/*
+	 * Date isn't stored, but is built from the same freshness information
+	 * as Age, so they are consistent after the entry refresh.
+	 */
+	do {
+		seq = tfw_cache_fresh_read_begin(ce);
+		resp->date = ce->date;
+		age = __tfw_cache_entry_age(ce);
+		ce_lifetime = ce->lifetime;
+	} while (tfw_cache_fresh_read_retry(ce, seq));
+
+	prebuilt = !h_mods && !rs->n
+		   && (TFW_MSG_H2(req) ? ce->h2_len : ce->h1_len);
+	if (prebuilt) {
+		if (TFW_MSG_H2(req)
+		    ? tfw_cache_h2_build_prebuilt(db, ce, resp, &h_len)
+		    : tfw_cache_h1_build_prebuilt(db, ce, resp))
+			goto free;
+		goto set_hdrs;
+	}
 
 	/* Skip record key until status line. */
 	for (p = TDB_PTR(db->hdr, ce->status);
@@ -2122,17 +5722,32 @@ tfw_cache_build_resp(TfwHttpReq *req, TfwCacheEntry *ce, long lifetime,
 		goto free;
 	}
 
-	if (tfw_cache_set_status(db, ce, resp, &trec, &p, &h_len))
-		goto free;
+	/*
+	 * 206 response is built from the stored 200 response or slice: the
+	 * status is replaced and the headers describing the whole stored body
+	 * are skipped.
+	 */
+	if (rs->n) {
+		if (tfw_cache_set_status_206(db, ce, resp, &trec, &p, &h_len))
+			goto free;
+		if (!(st_mods = tfw_cache_hdr_mods_206(resp, ce, h_mods, rs)))
+			goto free;
+	} else {
+		if (tfw_cache_set_status(db, ce, resp, &trec, &p, &h_len))
+			goto free;
+		st_mods = h_mods;
+	}
 
 	for (h = TFW_HTTP_HDR_REGULAR; h < ce->hdr_num; ++h) {
 		bool skip = !TFW_MSG_H2(req) && (h >= ce->hdr_h2_off);
 
-		if (tfw_cache_build_resp_hdr(db, resp, h_mods, &trec, &p,
+		if (tfw_cache_build_resp_hdr(db, resp, st_mods, &trec, &p,
 					     &h_len, skip))
 			goto free;
 	}
 
+set_hdrs:
+
 	mit = &resp->mit;
 	skb_head = &resp->msg.skb_head;
 	WARN_ON_ONCE(mit->acc_len);
@@ -2149,7 +5764,11 @@ tfw_cache_build_resp(TfwHttpReq *req, TfwCacheEntry *ce, long lifetime,
 	 * When a stored response is used to satisfy a request without
 	 * validation, a cache MUST generate an Age header field.
 	 */
-	if (tfw_cache_set_hdr_age(resp, ce))
+	if (tfw_cache_set_hdr_age(resp, age))
+		goto free;
+	if (rs->n && tfw_cache_set_hdrs_206(resp, rs))
+		goto free;
+	if (ce->coding && tfw_cache_set_hdrs_coding(resp, ce))
 		goto free;
 
 	if (!TFW_MSG_H2(req)) {
@@ -2160,7 +5779,7 @@ tfw_cache_build_resp(TfwHttpReq *req, TfwCacheEntry *ce, long lifetime,
 		if (tfw_http_expand_hbh(resp, ce->resp_status)
 		    || tfw_http_expand_hdr_via(resp)
 		    || tfw_h1_set_loc_hdrs((TfwHttpMsg *)resp, true, true)
-		    || (lifetime > ce->lifetime
+		    || (lifetime > ce_lifetime
 			&& tfw_http_expand_stale_warn(resp))
 		    || (!test_bit(TFW_HTTP_B_HDR_DATE, resp->flags)
 			&& tfw_http_expand_hdr_date(resp))
@@ -2174,7 +5793,7 @@ tfw_cache_build_resp(TfwHttpReq *req, TfwCacheEntry *ce, long lifetime,
 
 	/* Set additional headers for HTTP/2 response. */
 	if (tfw_h2_resp_add_loc_hdrs(resp, h_mods, true)
-	    || (lifetime > ce->lifetime
+	    || (lifetime > ce_lifetime
 		&& tfw_h2_set_stale_warn(resp))
 	    || (!test_bit(TFW_HTTP_B_HDR_DATE, resp->flags)
 		&& tfw_h2_add_hdr_date(resp, TFW_H2_TRANS_EXPAND, true)))
@@ -2186,24 +5805,33 @@ tfw_cache_build_resp(TfwHttpReq *req, TfwCacheEntry *ce, long lifetime,
 	 * Split response to h2 frames. Don't write body with generic function,
 	 * just indicate that we have body for correct framing.
 	 */
-	dummy_body.len = ce->body_len;
+	dummy_body.len = rs->n ? rs->clen : ce->body_len;
 	if (tfw_h2_frame_local_resp(resp, stream_id, h_len, &dummy_body))
 		goto free;
 	it->skb = ss_skb_peek_tail(&it->skb_head);
 	it->frag = skb_shinfo(it->skb)->nr_frags - 1;
 
 write_body:
+	/* The body is stored after the prebuilt headers. */
+	if (!(trec = tfw_cache_trec_at(db, ce, ce->body, &p)))
+		goto free;
 	/* Fill skb with body from cache for HTTP/2 or HTTP/1.1 response. */
-	BUG_ON(p != TDB_PTR(db->hdr, ce->body));
-	if (ce->body_len) {
+	if (rs->n) {
+		if (tfw_cache_build_resp_ranges(db, resp, trec, p, rs,
+						stream_id))
+			goto free;
+	} else if (ce->body_len) {
 		if (tfw_cache_build_resp_body(db, trec, it, p, ce->body_len,
-					      TFW_MSG_H2(req), stream_id))
+					      TFW_MSG_H2(req), stream_id,
+					      true))
 			goto free;
 		if (!TFW_MSG_H2(req)
 		    && test_bit(TFW_HTTP_B_CHUNKED, resp->flags)
 		    && tfw_http_msg_expand_data(it, skb_head, &g_crlf, NULL))
 			goto free;
 	}
+	if (tfw_cache_zc_set(db, ce, resp))
+		goto free;
 
 	return resp;
 free:
@@ -2215,22 +5843,82 @@ out:
 	return NULL;
 }
 
+/**
+ * Send 103 (Early Hints) response with the preload links stored in the stale
+ * entry @ce to the client, while @req is forwarded to a backend server.
+ */
 static void
-cache_req_process_node(TfwHttpReq *req, tfw_http_cache_cb_t action)
+tfw_cache_early_hints(TDB *db, TfwHttpReq *req, TfwCacheEntry *ce)
+{
+	char *buf;
+
+	if (!cache_cfg.early_hints || !ce->hints_len || !req->conn)
+		return;
+	if (!(buf = tfw_cache_read_str(db, req->pool, ce, ce->hints,
+				       ce->hints_len)))
+		return;
+
+	tfw_http_send_early_hints(req, buf, ce->hints_len);
+}
+
+/**
+ * Serve @req from the local node database, or pass it to @action on a miss.
+ * A miss of @lookup in the local replica of hybrid cache has no side effects,
+ * false is returned, so the request is looked up in its shard node then.
+ */
+static bool
+cache_req_process_node(TfwHttpReq *req, tfw_http_cache_cb_t action,
+		       int lookup)
 {
 	TfwCacheEntry *ce = NULL;
 	TfwHttpResp *resp = NULL;
 	unsigned int id = 0;
 	TDB *db = node_db();
 	TdbIter iter;
+	TfwCacheRanges rs;
 	long lifetime;
 
-	if (!(ce = tfw_cache_dbce_get(db, &iter, req)))
-		goto out;
+	if (lookup == TFW_CACHE_LOOKUP_REPLICA) {
+		/* Stale replicas are served by the shard node. */
+		if (!(ce = tfw_cache_dbce_get(db, &iter, req)))
+			return false;
+		if (!(lifetime = tfw_cache_entry_is_live(req, ce))) {
+			tdb_rec_put(ce);
+			return false;
+		}
+		goto hit;
+	}
+
+	/*
+	 * Internal requests aren't counted as clients' interest. Hybrid cache
+	 * counts the requests in the shard nodes to find hot entries.
+	 */
+	if (req->conn && (tfw_cache_admission(req)
+			  || cache_cfg.cache == TFW_CACHE_HYBRID))
+		tfw_cache_sketch_inc(c_nodes[req->node].sketch,
+				     tfw_cache_key(req));
 
-	if (!(lifetime = tfw_cache_entry_is_live(req, ce)))
+	if (!(ce = tfw_cache_dbce_get(db, &iter, req)))
 		goto out;
 
+	if (!(lifetime = tfw_cache_entry_is_live(req, ce))) {
+		/* Stale slices are fetched again instead of the refresh. */
+		if (ce->slice)
+			goto out;
+		lifetime = tfw_cache_entry_stale_lifetime(ce, ce->stale_reval);
+		if (!lifetime)
+			goto out;
+		TFW_INC_STAT_BH(cache.stale);
+		tfw_cache_entry_refresh(req, ce);
+	}
+	/* Cache warm-up request, the resource is cached already. */
+	if (unlikely(!req->conn)) {
+		tfw_http_msg_free((TfwHttpMsg *)req);
+		goto put;
+	}
+	if (lookup == TFW_CACHE_LOOKUP_REMOTE)
+		tfw_cache_promote(req, ce);
+hit:
 	T_DBG("Cache: service request w/ key=%lx, ce=%p (len=%u key_len=%u"
 	      " status_len=%u hdr_num=%u hdr_len=%u key_off=%ld"
 		" status_off=%ld hdrs_off=%ld body_off=%ld)\n",
@@ -2238,8 +5926,10 @@ cache_req_process_node(TfwHttpReq *req, tfw_http_cache_cb_t action)
 		ce->hdr_num, ce->hdr_len, ce->key, ce->status, ce->hdrs,
 		ce->body);
 	TFW_INC_STAT_BH(cache.hits);
+	trace_tfw_cache_lookup(req, true);
+	tfw_cache_entry_touch(ce);
 
-	if (!tfw_handle_validation_req(req, ce))
+	if (!tfw_handle_validation_req(req, ce, &rs))
 		goto put;
 
 	/*
@@ -2255,7 +5945,7 @@ cache_req_process_node(TfwHttpReq *req, tfw_http_cache_cb_t action)
 		}
 	}
 
-	resp = tfw_cache_build_resp(req, ce, lifetime, id);
+	resp = tfw_cache_build_resp(req, ce, lifetime, id, &rs);
 	/*
 	 * The stream of HTTP/2-request should be closed here since we have
 	 * successfully created the resulting response from cache and will
@@ -2272,22 +5962,31 @@ cache_req_process_node(TfwHttpReq *req, tfw_http_cache_cb_t action)
 		}
 	}
 out:
-	if (!resp && (req->cache_ctl.flags & TFW_HTTP_CC_OIFCACHED))
+	if (!resp && (req->cache_ctl.flags & TFW_HTTP_CC_OIFCACHED)) {
 		tfw_http_send_resp(req, 504, "resource not cached");
-	else
+	} else if (resp || !tfw_cache_collapse(req, action)) {
+		if (!resp && req->cache_slice)
+			tfw_cache_req_slice_range(req);
+		else if (!resp && cache_cfg.range_fetch_full)
+			tfw_cache_req_del_range(req);
+		if (!resp && ce)
+			tfw_cache_early_hints(db, req, ce);
 		/*
 		 * TODO: RFC 7234 4.3.2: Extend preconditional request headers
 		 * if any with values from cached entries to revalidate stored
 		 * stale responses for both: client and Tempesta.
 		 */
 		action((TfwHttpMsg *)req);
+	}
 put:
 	if (ce)
 		tdb_rec_put(ce);
+
+	return true;
 }
 
 static void
-tfw_cache_do_action(TfwHttpMsg *msg, tfw_http_cache_cb_t action)
+tfw_cache_do_action(TfwHttpMsg *msg, tfw_http_cache_cb_t action, int lookup)
 {
 	int ret;
 	TfwHttpReq *req;
@@ -2304,7 +6003,7 @@ tfw_cache_do_action(TfwHttpMsg *msg, tfw_http_cache_cb_t action)
 		if (!ret && test_bit(TFW_HTTP_B_PURGE_GET, req->flags))
 			action((TfwHttpMsg *)req);
 	} else
-		cache_req_process_node(req, action);
+		cache_req_process_node(req, action, lookup);
 }
 
 static void
@@ -2321,7 +6020,7 @@ tfw_cache_process(TfwHttpMsg *msg, tfw_http_cache_cb_t action)
 	int cpu;
 	unsigned long key;
 	TfwWorkTasklet *ct;
-	TfwCWork cw;
+	TfwCWork cw = {};
 	TfwHttpResp *resp = NULL;
 	TfwHttpReq *req = (TfwHttpReq *)msg;
 
@@ -2336,10 +6035,13 @@ tfw_cache_process(TfwHttpMsg *msg, tfw_http_cache_cb_t action)
 		goto dont_cache;
 	if (!resp && !tfw_cache_employ_req(req))
 		goto dont_cache;
+	if (!resp)
+		tfw_cache_slice_init(req);
 
 do_cache:
-	key = tfw_http_req_key_calc(req);
-	req->node = (cache_cfg.cache == TFW_CACHE_SHARD)
+	key = tfw_cache_key(req);
+	req->node = (cache_cfg.cache == TFW_CACHE_SHARD
+		     || cache_cfg.cache == TFW_CACHE_HYBRID)
 		    ? tfw_cache_key_node(key)
 		    : numa_node_id();
 
@@ -2352,9 +6054,14 @@ do_cache:
 	 * replaced by a local variable here.
 	 */
 	if (likely(req->node == numa_node_id())) {
-		tfw_cache_do_action(msg, action);
+		tfw_cache_do_action(msg, action, TFW_CACHE_LOOKUP_LOCAL);
 		return 0;
 	}
+	/* Hot entries of hybrid cache are served from the local replicas. */
+	if (cache_cfg.cache == TFW_CACHE_HYBRID && !resp && req->conn
+	    && req->method != TFW_HTTP_METH_PURGE
+	    && cache_req_process_node(req, action, TFW_CACHE_LOOKUP_REPLICA))
+		return 0;
 
 	cw.msg = msg;
 	cw.action = action;
@@ -2381,33 +6088,152 @@ tfw_wq_tasklet(unsigned long data)
 {
 	TfwWorkTasklet *ct = (TfwWorkTasklet *)data;
 	TfwRBQueue *wq = &ct->wq;
-	TfwCWork cw;
+	TfwCWork cw[TFW_CACHE_WQ_BATCH];
+	int i, n;
 
-	while (!tfw_wq_pop(wq, &cw))
-		tfw_cache_do_action(cw.msg, cw.action);
+	while ((n = tfw_wq_pop_bulk(wq, cw, TFW_CACHE_WQ_BATCH))) {
+		for (i = 0; i < n; ++i) {
+			if (cw[i].bw)
+				tfw_cache_body_write(cw[i].bw);
+			else
+				tfw_cache_do_action(cw[i].msg, cw[i].action,
+						    TFW_CACHE_LOOKUP_REMOTE);
+		}
+	}
 
 	TFW_WQ_IPI_SYNC(tfw_wq_size, wq);
 
 	tasklet_schedule(&ct->tasklet);
 }
 
+/*
+ * Cache warm-up. The cache manager thread requests URLs from the
+ * cache_warmup_list file, so the cache is filled before clients ask for the
+ * resources, e.g. after a restart. The URLs are requested only if they aren't
+ * cached yet and in small batches to not flood upstreams. The list is re-read
+ * each cache_warmup_resync seconds and the URLs are requested again if the
+ * list has changed.
+ *
+ * @path	- copy of cache_warmup_list, the configuration may be reloaded;
+ * @resync	- copy of cache_warmup_resync;
+ * @total	- number of URLs in the last loaded list;
+ * @sent	- number of URLs requested from the last loaded list;
+ */
+#define TFW_CACHE_WARMUP_BATCH		16
+#define TFW_CACHE_WARMUP_PAUSE		(HZ / 100)
+/* Wait for upstream connections after the start. */
+#define TFW_CACHE_WARMUP_DELAY		HZ
+
+static struct {
+	char		*path;
+	int		resync;
+	unsigned long	total;
+	unsigned long	sent;
+} cache_warmup;
+
+void
+tfw_cache_warmup_progress(unsigned long *sent, unsigned long *total)
+{
+	*sent = READ_ONCE(cache_warmup.sent);
+	*total = READ_ONCE(cache_warmup.total);
+}
+
+/*
+ * Parse a warm-up list line "[http[s]://]host[/path]". Empty lines and lines
+ * starting with '#' are skipped.
+ */
+static bool
+tfw_cache_warmup_url(char *line, TfwStr *host, TfwStr *uri)
+{
+	char *p;
+
+	line = strim(line);
+	if (!*line || *line == '#')
+		return false;
+	if (!strncasecmp(line, "http://", SLEN("http://")))
+		line += SLEN("http://");
+	else if (!strncasecmp(line, "https://", SLEN("https://")))
+		line += SLEN("https://");
+
+	p = strchrnul(line, '/');
+	*host = (TfwStr){ .data = line, .len = p - line };
+	*uri = *p ? (TfwStr){ .data = p, .len = strlen(p) }
+		  : (TfwStr){ .data = "/", .len = 1 };
+
+	return host->len;
+}
+
+static void
+tfw_cache_warmup_load(char *list)
+{
+	int r;
+	char *line, *p;
+	TfwStr host, uri;
+	unsigned long n = 0;
+
+	for (p = list; (line = strchr(p, '\n')); p = line + 1)
+		++n;
+	WRITE_ONCE(cache_warmup.total, n + !!*p);
+	WRITE_ONCE(cache_warmup.sent, 0);
+
+	n = 0;
+	while ((line = strsep(&list, "\n")) && !kthread_should_stop()) {
+		if (!tfw_cache_warmup_url(line, &host, &uri))
+			continue;
+
+		kernel_fpu_begin_mask(KFPU_MXCSR);
+		local_bh_disable();
+		r = tfw_http_cache_warmup(&host, &uri);
+		local_bh_enable();
+		kernel_fpu_end();
+
+		if (r) {
+			T_WARN_NL("Cache: can't warm up %.*s%.*s, %d\n",
+				  (int)host.len, host.data, (int)uri.len,
+				  uri.data, r);
+			continue;
+		}
+		WRITE_ONCE(cache_warmup.sent, cache_warmup.sent + 1);
+		if (!(++n % TFW_CACHE_WARMUP_BATCH))
+			schedule_timeout_interruptible(TFW_CACHE_WARMUP_PAUSE);
+	}
+}
+
 /**
  * Cache management thread.
- * The thread loads and preprocesses static Web content using inotify (TODO).
+ * The thread warms up the cache from the configured URL list.
  */
-#if 0
 static int
 tfw_cache_mgr(void *arg)
 {
+	size_t sz;
+	char *list;
+	u32 crc, list_crc = 0;
+
+	while (!tfw_runstate_is_started() && !kthread_should_stop())
+		schedule_timeout_interruptible(HZ / 10);
+	schedule_timeout_interruptible(TFW_CACHE_WARMUP_DELAY);
+
 	do {
-		/*
-		 * TODO wait while the thread is propagating disk Web data
-		 * to the cache when the server starts.
-		 */
+		if (!kthread_should_stop()
+		    && (list = tfw_cfg_read_file(cache_warmup.path, &sz)))
+		{
+			crc = crc32(0, list, sz);
+			if (crc != list_crc) {
+				T_LOG_NL("Cache: warming up from %s\n",
+					 cache_warmup.path);
+				list_crc = crc;
+				tfw_cache_warmup_load(list);
+			}
+			kfree(list);
+		}
 
 		if (!freezing(current)) {
 			set_current_state(TASK_INTERRUPTIBLE);
-			schedule();
+			if (!kthread_should_stop())
+				schedule_timeout(cache_warmup.resync
+						 ? cache_warmup.resync * HZ
+						 : MAX_SCHEDULE_TIMEOUT);
 			__set_current_state(TASK_RUNNING);
 		}
 		else
@@ -2416,7 +6242,93 @@ tfw_cache_mgr(void *arg)
 
 	return 0;
 }
-#endif
+
+static int
+tfw_cache_mgr_start(void)
+{
+	if (!cache_cfg.warmup_list)
+		return 0;
+
+	if (!(cache_warmup.path = kstrdup(cache_cfg.warmup_list, GFP_KERNEL)))
+		return -ENOMEM;
+	cache_warmup.resync = cache_cfg.warmup_resync;
+	cache_warmup.total = cache_warmup.sent = 0;
+
+	cache_mgr_thr = kthread_run(tfw_cache_mgr, NULL, "tfw_cache_mgr");
+	if (IS_ERR(cache_mgr_thr)) {
+		int r = PTR_ERR(cache_mgr_thr);
+
+		T_ERR_NL("Can't start cache manager, %d\n", r);
+		cache_mgr_thr = NULL;
+		kfree(cache_warmup.path);
+		return r;
+	}
+
+	return 0;
+}
+
+static void
+tfw_cache_mgr_stop(void)
+{
+	if (!cache_mgr_thr)
+		return;
+
+	kthread_stop(cache_mgr_thr);
+	cache_mgr_thr = NULL;
+	kfree(cache_warmup.path);
+	cache_warmup.path = NULL;
+}
+
+static void
+tfw_cache_zstrm_free(void)
+{
+	int cpu;
+
+	for_each_online_cpu(cpu) {
+		z_stream *zs = per_cpu_ptr(&cache_zstrm, cpu);
+
+		vfree(zs->workspace);
+		zs->workspace = NULL;
+	}
+}
+
+/**
+ * Allocate deflate workspaces for the cache tasklets if compressed variants
+ * are enabled. The workspaces are large, so they're allocated per CPU once.
+ */
+static int
+tfw_cache_zstrm_alloc(void)
+{
+	int cpu;
+	size_t sz;
+
+	if (!cache_cfg.cache || !cache_cfg.compress)
+		return 0;
+
+	sz = zlib_deflate_workspacesize(MAX_WBITS, MAX_MEM_LEVEL);
+	for_each_online_cpu(cpu) {
+		z_stream *zs = per_cpu_ptr(&cache_zstrm, cpu);
+
+		if (!(zs->workspace = vzalloc_node(sz, cpu_to_node(cpu)))) {
+			T_ERR_NL("Can't allocate cache compression workspace\n");
+			tfw_cache_zstrm_free();
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static void
+tfw_cache_l1_free(void)
+{
+	int i;
+
+	for_each_online_cpu(i) {
+		kvfree(per_cpu(cache_l1, i));
+		per_cpu(cache_l1, i) = NULL;
+	}
+}
 
 static int
 tfw_cache_start(void)
@@ -2430,21 +6342,57 @@ tfw_cache_start(void)
 		return 0;
 
 	for_each_node_with_cpus(i) {
-		c_nodes[i].db = tdb_open(cache_cfg.db_path,
-					 cache_cfg.db_size, 0, i);
-		if (!c_nodes[i].db)
+		CaNode *node = &c_nodes[i];
+
+		node->db = tdb_open(cache_cfg.db_path, cache_cfg.db_size,
+				    cache_cfg.db_size_max, 0, i);
+		if (!node->db)
 			goto close_db;
+		/* The entries are referenced by the eviction ring. */
+		tdb_set_owner(node->db, NULL);
+
+		spin_lock_init(&node->clock_lock);
+		node->clock_hand = 0;
+		memset(node->quota, 0, sizeof(node->quota));
+		/* The ring must cover the table extended up to its maximum. */
+		node->clock_sz = max(cache_cfg.db_size, cache_cfg.db_size_max)
+				 / TFW_CACHE_ENTRY_MIN_SZ;
+		node->clock = vzalloc_node(node->clock_sz * sizeof(*node->clock),
+					   i);
+		if (!node->clock) {
+			T_ERR_NL("Can't allocate cache eviction ring\n");
+			r = -ENOMEM;
+			goto close_db;
+		}
+		/* Admission is configured per vhost, so always allocate. */
+		node->sketch = vzalloc_node(sizeof(TfwCacheSketch), i);
+		if (!node->sketch) {
+			T_ERR_NL("Can't allocate cache admission sketch\n");
+			r = -ENOMEM;
+			goto close_db;
+		}
+		tdb_set_owner(node->db, tfw_cache_entry_remove);
 	}
-#if 0
-	cache_mgr_thr = kthread_run(tfw_cache_mgr, NULL, "tfw_cache_mgr");
-	if (IS_ERR(cache_mgr_thr)) {
-		r = PTR_ERR(cache_mgr_thr);
-		T_ERR_NL("Can't start cache manager, %d\n", r);
-		goto close_db;
-	}
-#endif
 	tfw_init_node_cpus();
 
+	tfw_cache_fetch_init();
+	/*
+	 * The database may survive the restart, so don't reuse identifiers
+	 * of the entries stored before.
+	 */
+	atomic64_set(&tfw_cache_ce_id, ktime_get_real_ns());
+
+	for_each_online_cpu(i) {
+		TfwCacheL1 *l1 = kvzalloc_node(sizeof(*l1) << TFW_CACHE_L1_BITS,
+					       GFP_KERNEL, cpu_to_node(i));
+		if (!l1) {
+			T_ERR_NL("Can't allocate cache micro-cache\n");
+			r = -ENOMEM;
+			goto free_l1;
+		}
+		per_cpu(cache_l1, i) = l1;
+	}
+
 	TFW_WQ_CHECKSZ(TfwCWork);
 	for_each_online_cpu(i) {
 		TfwWorkTasklet *ct = &per_cpu(cache_wq, i);
@@ -2453,10 +6401,35 @@ tfw_cache_start(void)
 		tasklet_init(&ct->tasklet, tfw_wq_tasklet, (unsigned long)ct);
 	}
 
+	if ((r = tfw_cache_zstrm_alloc()))
+		goto kill_tasklets;
+	if (cache_cfg.cache && (r = tfw_cache_mgr_start()))
+		goto free_zstrm;
+
 	return 0;
+free_zstrm:
+	tfw_cache_zstrm_free();
+kill_tasklets:
+	for_each_online_cpu(i) {
+		TfwWorkTasklet *ct = &per_cpu(cache_wq, i);
+		tasklet_kill(&ct->tasklet);
+		irq_work_sync(&ct->ipi_work);
+		tfw_wq_destroy(&ct->wq);
+	}
+free_l1:
+	tfw_cache_l1_free();
 close_db:
-	for_each_node_with_cpus(i)
+	for_each_node_with_cpus(i) {
+		/* Wait for removals through the ring, see tdb_set_owner(). */
+		if (c_nodes[i].db)
+			tdb_set_owner(c_nodes[i].db, NULL);
+		vfree(c_nodes[i].clock);
+		c_nodes[i].clock = NULL;
+		vfree(c_nodes[i].sketch);
+		c_nodes[i].sketch = NULL;
 		tdb_close(c_nodes[i].db);
+		c_nodes[i].db = NULL;
+	}
 	return r;
 }
 
@@ -2470,18 +6443,34 @@ tfw_cache_stop(void)
 	if (!cache_cfg.cache)
 		return;
 
+	tfw_cache_mgr_stop();
 	for_each_online_cpu(i) {
+		TfwCWork cw;
 		TfwWorkTasklet *ct = &per_cpu(cache_wq, i);
 		tasklet_kill(&ct->tasklet);
 		irq_work_sync(&ct->ipi_work);
+		/* Drop bodies which weren't written behind. */
+		while (!tfw_wq_pop(&ct->wq, &cw))
+			if (cw.bw)
+				tfw_cache_body_free(cw.bw);
 		tfw_wq_destroy(&ct->wq);
 	}
-#if 0
-	kthread_stop(cache_mgr_thr);
-#endif
+	tfw_cache_zstrm_free();
+	tfw_cache_fetch_cleanup();
+	tfw_cache_tags_cleanup();
+	tfw_cache_l1_free();
 
-	for_each_node_with_cpus(i)
+	for_each_node_with_cpus(i) {
+		/* Wait for removals through the ring, see tdb_set_owner(). */
+		if (c_nodes[i].db)
+			tdb_set_owner(c_nodes[i].db, NULL);
+		vfree(c_nodes[i].clock);
+		c_nodes[i].clock = NULL;
+		vfree(c_nodes[i].sketch);
+		c_nodes[i].sketch = NULL;
 		tdb_close(c_nodes[i].db);
+		c_nodes[i].db = NULL;
+	}
 }
 
 static const TfwCfgEnum cache_http_methods_enum[] = {
@@ -2542,6 +6531,60 @@ tfw_cfgop_cleanup_cache_methods(TfwCfgSpec *cs)
 	cache_cfg.methods = 0;
 }
 
+static int
+tfw_cfgop_cache_quota(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	int i;
+	long limit;
+	size_t len;
+	TfwCacheQuota *q = &cache_quotas[cache_quota_n];
+
+	if (tfw_cfg_check_val_n(ce, 2))
+		return -EINVAL;
+	if (ce->attr_n) {
+		T_ERR_NL("%s: Arguments may not have the '=' sign\n",
+			 cs->name);
+		return -EINVAL;
+	}
+	if (cache_quota_n == TFW_CACHE_QUOTA_MAX) {
+		T_ERR_NL("%s: too many quotas, %d are supported\n", cs->name,
+			 TFW_CACHE_QUOTA_MAX);
+		return -EINVAL;
+	}
+	if (tfw_cfg_parse_long(ce->vals[1], &limit) || limit <= 0) {
+		T_ERR_NL("%s: \"%s\" isn't a valid size\n", cs->name,
+			 ce->vals[1]);
+		return -EINVAL;
+	}
+	len = strlen(ce->vals[0]);
+	for (i = 0; i < cache_quota_n; ++i)
+		if (cache_quotas[i].len == len
+		    && !memcmp(cache_quotas[i].name, ce->vals[0], len))
+		{
+			T_ERR_NL("%s: duplicate vhost '%s'\n", cs->name,
+				 ce->vals[0]);
+			return -EINVAL;
+		}
+
+	if (!(q->name = kstrdup(ce->vals[0], GFP_KERNEL)))
+		return -ENOMEM;
+	q->len = len;
+	q->limit = limit;
+	++cache_quota_n;
+
+	return 0;
+}
+
+static void
+tfw_cfgop_cleanup_cache_quota(TfwCfgSpec *cs)
+{
+	int i;
+
+	for (i = 0; i < cache_quota_n; ++i)
+		kfree(cache_quotas[i].name);
+	cache_quota_n = 0;
+}
+
 static TfwCfgSpec tfw_cache_specs[] = {
 	{
 		.name = "cache",
@@ -2549,8 +6592,18 @@ static TfwCfgSpec tfw_cache_specs[] = {
 		.handler = tfw_cfg_set_int,
 		.dest = &cache_cfg.cache,
 		.spec_ext = &(TfwCfgSpecInt) {
-			.range = { 0, 2 },
+			.range = { 0, 3 },
+		},
+	},
+	{
+		.name = "cache_hybrid_hot",
+		.deflt = "8",
+		.handler = tfw_cfg_set_int,
+		.dest = &cache_cfg.hybrid_hot,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 1, TFW_CACHE_ADMISSION_MAX },
 		},
+		.allow_repeat = false,
 	},
 	{
 		.name = "cache_methods",
@@ -2560,6 +6613,112 @@ static TfwCfgSpec tfw_cache_specs[] = {
 		.allow_repeat = false,
 		.cleanup = tfw_cfgop_cleanup_cache_methods,
 	},
+	{
+		.name = "cache_quota",
+		.deflt = NULL,
+		.handler = tfw_cfgop_cache_quota,
+		.allow_none = true,
+		.allow_repeat = true,
+		.cleanup = tfw_cfgop_cleanup_cache_quota,
+	},
+	{
+		.name = "cache_resp_prebuilt",
+		.deflt = "on",
+		.handler = tfw_cfg_set_bool,
+		.dest = &cache_cfg.resp_prebuilt,
+	},
+	{
+		.name = "cache_range_fetch_full",
+		.deflt = "off",
+		.handler = tfw_cfg_set_bool,
+		.dest = &cache_cfg.range_fetch_full,
+	},
+	{
+		.name = "cache_early_hints",
+		.deflt = "off",
+		.handler = tfw_cfg_set_bool,
+		.dest = &cache_cfg.early_hints,
+	},
+	{
+		.name = "cache_slice",
+		.deflt = "0",
+		.handler = tfw_cfg_set_int,
+		.dest = &cache_cfg.slice,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.multiple_of = PAGE_SIZE,
+			.range = { 0, 1 << 30 },
+		},
+	},
+	{
+		.name = "cache_collapse_timeout",
+		.deflt = "0",
+		.handler = tfw_cfg_set_int,
+		.dest = &cache_cfg.collapse_timeout,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, 60000 },
+		},
+	},
+	{
+		.name = "cache_write_behind",
+		.deflt = "0",
+		.handler = tfw_cfg_set_int,
+		.dest = &cache_cfg.write_behind,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, INT_MAX },
+		},
+	},
+	{
+		.name = "cache_compress",
+		.deflt = "0",
+		.handler = tfw_cfg_set_int,
+		.dest = &cache_cfg.compress,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, TFW_CACHE_COMPRESS_MAX },
+		},
+	},
+	{
+		.name = "cache_negative_4xx",
+		.deflt = "0",
+		.handler = tfw_cfg_set_int,
+		.dest = &cache_cfg.negative_4xx,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, TFW_CACHE_NEGATIVE_TTL_MAX },
+		},
+	},
+	{
+		.name = "cache_negative_5xx",
+		.deflt = "0",
+		.handler = tfw_cfg_set_int,
+		.dest = &cache_cfg.negative_5xx,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, TFW_CACHE_NEGATIVE_TTL_MAX },
+		},
+	},
+	{
+		.name = "cache_purge_index",
+		.deflt = "off",
+		.handler = tfw_cfg_set_bool,
+		.dest = &cache_cfg.purge_index,
+	},
+	{
+		.name = "cache_warmup_list",
+		.deflt = NULL,
+		.handler = tfw_cfg_set_str,
+		.dest = &cache_cfg.warmup_list,
+		.allow_none = true,
+		.spec_ext = &(TfwCfgSpecStr) {
+			.len_range = { 1, PATH_MAX },
+		}
+	},
+	{
+		.name = "cache_warmup_resync",
+		.deflt = "0",
+		.handler = tfw_cfg_set_int,
+		.dest = &cache_cfg.warmup_resync,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, 86400 },
+		},
+	},
 	{
 		.name = "cache_size",
 		.deflt = "268435456",
@@ -2570,6 +6729,16 @@ static TfwCfgSpec tfw_cache_specs[] = {
 			.range = { 16 * 1024 * 1024, (1UL << 37) },
 		}
 	},
+	{
+		.name = "cache_size_max",
+		.deflt = "0",
+		.handler = tfw_cfg_set_long,
+		.dest = &cache_cfg.db_size_max,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.multiple_of = 2 * 1024 * 1024,
+			.range = { 0, (1UL << 37) },
+		}
+	},
 	{
 		.name = "cache_db",
 		.deflt = "/opt/tempesta/db/cache.tdb",
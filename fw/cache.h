@@ -25,5 +25,8 @@
 
 bool tfw_cache_msg_cacheable(TfwHttpReq *req);
 int tfw_cache_process(TfwHttpMsg *msg, tfw_http_cache_cb_t action);
+void tfw_cache_fetch_bypass(TfwHttpReq *req);
+void tfw_cache_fetch_abort(TfwHttpReq *req);
+void tfw_cache_warmup_progress(unsigned long *sent, unsigned long *total);
 
 #endif /* __TFW_CACHE_H__ */
@@ -0,0 +1,238 @@
+/**
+ *		Tempesta FW
+ *
+ * Collapsed forwarding. Only the first request, missing a cache entry, is
+ * forwarded to a backend server while next requests for the same key wait
+ * for the response. When the response is stored in the cache, the waiting
+ * requests are served from the cache. If the response isn't cacheable, it
+ * doesn't come in cache_collapse_timeout or the forwarded request fails,
+ * then the requests are forwarded as usual.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <linux/hash.h>
+#include <linux/slab.h>
+#include <linux/timer.h>
+#include <asm/fpu/api.h>
+
+#include "cache_fetch.h"
+#include "log.h"
+
+/**
+ * @hentry	- entry in tfw_cache_fetches hash table;
+ * @timer	- timer for the waiting timeout;
+ * @waiters	- requests waiting for the response, linked by @fwd_list;
+ * @leader	- the forwarded request or NULL if it's gone;
+ * @action	- callback to resume the waiting requests;
+ * @key		- cache key of the requests;
+ */
+typedef struct {
+	struct hlist_node	hentry;
+	struct timer_list	timer;
+	struct list_head	waiters;
+	TfwHttpReq		*leader;
+	tfw_http_cache_cb_t	action;
+	unsigned long		key;
+} TfwCacheFetch;
+
+#define TFW_CACHE_FETCH_HBITS	10
+
+static struct {
+	struct hlist_head	list;
+	spinlock_t		lock;
+} tfw_cache_fetches[1 << TFW_CACHE_FETCH_HBITS];
+
+static TfwCacheFetch *
+__tfw_cache_fetch_lookup(unsigned int h, unsigned long key)
+{
+	TfwCacheFetch *f;
+
+	hlist_for_each_entry(f, &tfw_cache_fetches[h].list, hentry)
+		if (f->key == key)
+			return f;
+
+	return NULL;
+}
+
+/**
+ * Serve the waiting requests from the cache if the response was stored,
+ * or forward them otherwise. The requests are marked, so they don't wait
+ * for a response again.
+ */
+static void
+tfw_cache_fetch_resume(TfwCacheFetch *f)
+{
+	TfwHttpReq *req, *tmp;
+
+	list_for_each_entry_safe(req, tmp, &f->waiters, fwd_list) {
+		list_del_init(&req->fwd_list);
+		tfw_cache_req_resume(req, f->action);
+	}
+	kfree(f);
+}
+
+static void
+tfw_cache_fetch_timer_cb(struct timer_list *t)
+{
+	bool owner;
+	TfwCacheFetch *f = from_timer(f, t, timer);
+	unsigned int h = hash_long(f->key, TFW_CACHE_FETCH_HBITS);
+
+	spin_lock(&tfw_cache_fetches[h].lock);
+	if ((owner = !hlist_unhashed(&f->hentry)))
+		hlist_del_init(&f->hentry);
+	spin_unlock(&tfw_cache_fetches[h].lock);
+	/* The response just came and it's processed by other CPU. */
+	if (!owner)
+		return;
+
+	T_DBG2("Cache: collapsed forwarding %s for key=%lx\n",
+	       f->leader ? "timeout" : "failed", f->key);
+
+	/* Timer softirq doesn't save FPU context unlike the network one. */
+	kernel_fpu_begin_mask(KFPU_MXCSR);
+	tfw_cache_fetch_resume(f);
+	kernel_fpu_end();
+}
+
+/**
+ * Link cache missing @req with a response fetched by a previous request
+ * for the same @key or let next requests for the key wait for response to
+ * @req for @timeout milliseconds.
+ *
+ * @return true if the request waits for a response.
+ */
+bool
+tfw_cache_fetch_wait(TfwHttpReq *req, unsigned long key,
+		     tfw_http_cache_cb_t action, unsigned int timeout)
+{
+	TfwCacheFetch *f;
+	bool wait = false;
+	unsigned int h = hash_long(key, TFW_CACHE_FETCH_HBITS);
+
+	if (test_bit(TFW_HTTP_B_CACHE_WAITED, req->flags))
+		return false;
+
+	spin_lock_bh(&tfw_cache_fetches[h].lock);
+
+	if ((f = __tfw_cache_fetch_lookup(h, key))) {
+		__set_bit(TFW_HTTP_B_CACHE_WAITED, req->flags);
+		list_add_tail(&req->fwd_list, &f->waiters);
+		wait = true;
+	} else if ((f = kmalloc(sizeof(*f), GFP_ATOMIC))) {
+		__set_bit(TFW_HTTP_B_CACHE_FETCH, req->flags);
+		f->key = key;
+		f->leader = req;
+		f->action = action;
+		INIT_LIST_HEAD(&f->waiters);
+		timer_setup(&f->timer, tfw_cache_fetch_timer_cb, 0);
+		hlist_add_head(&f->hentry, &tfw_cache_fetches[h].list);
+		mod_timer(&f->timer, jiffies + msecs_to_jiffies(timeout));
+	}
+
+	spin_unlock_bh(&tfw_cache_fetches[h].lock);
+
+	return wait;
+}
+
+/**
+ * A response for @key is received: resume requests waiting for it.
+ */
+void
+tfw_cache_fetch_done(unsigned long key)
+{
+	TfwCacheFetch *f;
+	unsigned int h = hash_long(key, TFW_CACHE_FETCH_HBITS);
+
+	spin_lock_bh(&tfw_cache_fetches[h].lock);
+	if ((f = __tfw_cache_fetch_lookup(h, key)))
+		hlist_del_init(&f->hentry);
+	spin_unlock_bh(&tfw_cache_fetches[h].lock);
+
+	if (!f)
+		return;
+
+	del_timer_sync(&f->timer);
+	tfw_cache_fetch_resume(f);
+}
+
+/**
+ * Forwarded request @req is freed before its response reached the cache,
+ * e.g. the server failed or the client went away. Fire the timer right away,
+ * so the requests waiting for @key are forwarded in the timer context with
+ * FPU saved whatever context the request is freed in.
+ */
+void
+tfw_cache_fetch_release(TfwHttpReq *req, unsigned long key)
+{
+	TfwCacheFetch *f;
+	unsigned int h = hash_long(key, TFW_CACHE_FETCH_HBITS);
+
+	__clear_bit(TFW_HTTP_B_CACHE_FETCH, req->flags);
+
+	spin_lock_bh(&tfw_cache_fetches[h].lock);
+	/*
+	 * The fetch may belong to a next request for the key if the fetch of
+	 * @req timed out. The expired timer releases the waiters by itself.
+	 */
+	if ((f = __tfw_cache_fetch_lookup(h, key)) && f->leader == req) {
+		f->leader = NULL;
+		mod_timer_pending(&f->timer, jiffies);
+	}
+	spin_unlock_bh(&tfw_cache_fetches[h].lock);
+}
+
+void
+tfw_cache_fetch_init(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(tfw_cache_fetches); ++i) {
+		INIT_HLIST_HEAD(&tfw_cache_fetches[i].list);
+		spin_lock_init(&tfw_cache_fetches[i].lock);
+	}
+}
+
+/**
+ * Forward all the waiting requests on the cache shutdown.
+ */
+void
+tfw_cache_fetch_cleanup(void)
+{
+	int h;
+	TfwCacheFetch *f;
+	struct hlist_node *tmp;
+
+	for (h = 0; h < ARRAY_SIZE(tfw_cache_fetches); ++h) {
+		HLIST_HEAD(list);
+
+		spin_lock_bh(&tfw_cache_fetches[h].lock);
+		hlist_move_list(&tfw_cache_fetches[h].list, &list);
+		spin_unlock_bh(&tfw_cache_fetches[h].lock);
+
+		hlist_for_each_entry_safe(f, tmp, &list, hentry) {
+			hlist_del_init(&f->hentry);
+			del_timer_sync(&f->timer);
+
+			kernel_fpu_begin_mask(KFPU_MXCSR);
+			local_bh_disable();
+			tfw_cache_fetch_resume(f);
+			local_bh_enable();
+			kernel_fpu_end();
+		}
+	}
+}
@@ -0,0 +1,35 @@
+/**
+ *		Tempesta FW
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __TFW_CACHE_FETCH_H__
+#define __TFW_CACHE_FETCH_H__
+
+#include "http.h"
+
+void tfw_cache_fetch_init(void);
+void tfw_cache_fetch_cleanup(void);
+bool tfw_cache_fetch_wait(TfwHttpReq *req, unsigned long key,
+			  tfw_http_cache_cb_t action, unsigned int timeout);
+void tfw_cache_fetch_done(unsigned long key);
+void tfw_cache_fetch_release(TfwHttpReq *req, unsigned long key);
+
+/* Defined by the cache: look up a resumed request once again. */
+void tfw_cache_req_resume(TfwHttpReq *req, tfw_http_cache_cb_t action);
+
+#endif /* __TFW_CACHE_FETCH_H__ */
@@ -0,0 +1,139 @@
+/**
+ *		Tempesta FW
+ *
+ * Byte ranges requests (RFC 7233) served from the cache.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <linux/ctype.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+
+#include "cache_range.h"
+#include "http_msg.h"
+
+/**
+ * Parse decimal byte position from @p to @end. Returns number of parsed
+ * digits or -ERANGE on overflow.
+ */
+static int
+__range_pos(const char **p, const char *end, unsigned long *pos)
+{
+	int n = 0;
+
+	for (*pos = 0; *p < end && isdigit(**p); ++*p, ++n) {
+		if (*pos > (ULONG_MAX - 9) / 10)
+			return -ERANGE;
+		*pos = *pos * 10 + **p - '0';
+	}
+
+	return n;
+}
+
+/**
+ * Parse byte ranges set (RFC 7233 2.1) from @p to @end against the stored
+ * representation of length @len.
+ *
+ * Return value:
+ *	@0: the ranges are invalid and must be ignored;
+ *	@-ERANGE: none of the ranges is satisfiable;
+ *	number of satisfiable ranges saved in @rs otherwise.
+ */
+int
+tfw_cache_parse_ranges(const char *p, const char *end, unsigned long len,
+		       TfwCacheRanges *rs)
+{
+	unsigned long first, last;
+	int nf, nl, specs = 0;
+
+	if (end - p < SLEN("bytes=") || strncasecmp(p, "bytes=", 6))
+		return 0;
+	p += SLEN("bytes=");
+
+	rs->n = 0;
+	while (1) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+			++p;
+		if (p == end)
+			break;
+
+		if ((nf = __range_pos(&p, end, &first)) < 0)
+			return 0;
+		if (p == end || *p++ != '-')
+			return 0;
+		if ((nl = __range_pos(&p, end, &last)) < 0)
+			return 0;
+		if (!nf && !nl)
+			return 0;
+		++specs;
+
+		if (!nf) {
+			/* Suffix byte range: the last @last bytes. */
+			if (!last || !len)
+				goto next;
+			first = last < len ? len - last : 0;
+			last = len - 1;
+		} else {
+			if (nl && last < first)
+				return 0;
+			if (first >= len)
+				goto next;
+			if (!nl || last >= len)
+				last = len - 1;
+		}
+
+		/* Many small ranges are cheaper to serve by full response. */
+		if (rs->n == TFW_CACHE_RANGES_MAX)
+			return 0;
+		rs->first[rs->n] = first;
+		rs->last[rs->n] = last;
+		++rs->n;
+next:
+		while (p < end && (*p == ' ' || *p == '\t'))
+			++p;
+		if (p < end && *p != ',')
+			return 0;
+	}
+	/* The set must contain at least one range: "bytes=," is invalid. */
+	if (!specs)
+		return 0;
+
+	return rs->n ? rs->n : -ERANGE;
+}
+
+/**
+ * Format multipart/byteranges body part header for @i'th range of @rs to
+ * @buf of @sz bytes. Returns the header length, so the length is calculated
+ * for zero @sz.
+ */
+int
+tfw_cache_range_part_hdr(char *buf, size_t sz, const TfwCacheRanges *rs,
+			 int i)
+{
+	if (!rs->ctype_len)
+		return snprintf(buf, sz, S_CRLF "--%s" S_CRLF
+				"content-range: bytes %lu-%lu/%lu"
+				S_CRLF S_CRLF,
+				rs->boundary, rs->first[i], rs->last[i],
+				rs->total);
+
+	return snprintf(buf, sz, S_CRLF "--%s" S_CRLF
+			"content-type: %.*s" S_CRLF
+			"content-range: bytes %lu-%lu/%lu" S_CRLF S_CRLF,
+			rs->boundary, (int)rs->ctype_len, rs->ctype,
+			rs->first[i], rs->last[i], rs->total);
+}
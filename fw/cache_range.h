@@ -0,0 +1,65 @@
+/**
+ *		Tempesta FW
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __TFW_CACHE_RANGE_H__
+#define __TFW_CACHE_RANGE_H__
+
+#include <linux/types.h>
+
+/* Max number of byte ranges served from cache in a single response. */
+#define TFW_CACHE_RANGES_MAX	8
+#define TFW_CACHE_BOUNDARY_LEN	16
+/* Max length of Content-Type sent in multipart/byteranges body parts. */
+#define TFW_CACHE_CTYPE_MAX	128
+/* Max length of multipart/byteranges body part header. */
+#define TFW_CACHE_PART_HDR_MAX	(128 + TFW_CACHE_CTYPE_MAX)
+
+/*
+ * Byte ranges requested by a client and satisfiable by a cache entry.
+ *
+ * @n		- number of ranges;
+ * @clen	- length of the 206 response payload;
+ * @off		- offset of the stored body in the representation,
+ *		  non-zero for slices;
+ * @total	- length of the whole representation;
+ * @first	- first byte position of each range;
+ * @last	- last byte position of each range, inclusive;
+ * @ctype	- Content-Type of the representation, sent in each body part
+ *		  if there are several ranges;
+ * @ctype_len	- length of @ctype, zero if there is no Content-Type;
+ * @boundary	- multipart/byteranges boundary if there are several ranges;
+ */
+typedef struct {
+	unsigned int	n;
+	unsigned long	clen;
+	unsigned long	off;
+	unsigned long	total;
+	unsigned long	first[TFW_CACHE_RANGES_MAX];
+	unsigned long	last[TFW_CACHE_RANGES_MAX];
+	const char	*ctype;
+	unsigned int	ctype_len;
+	char		boundary[TFW_CACHE_BOUNDARY_LEN + 1];
+} TfwCacheRanges;
+
+int tfw_cache_parse_ranges(const char *p, const char *end, unsigned long len,
+			   TfwCacheRanges *rs);
+int tfw_cache_range_part_hdr(char *buf, size_t sz, const TfwCacheRanges *rs,
+			     int i);
+
+#endif /* __TFW_CACHE_RANGE_H__ */
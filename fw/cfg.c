@@ -394,6 +394,8 @@ typedef enum {
 	TOKEN_EQSIGN,
 	TOKEN_DEQSIGN,
 	TOKEN_NEQSIGN,
+	TOKEN_MATCHSIGN,
+	TOKEN_NMATCHSIGN,
 	TOKEN_SEMICOLON,
 	TOKEN_LITERAL,
 	TOKEN_ARROW,
@@ -588,10 +590,16 @@ read_next_token(TfwCfgParserState *ps)
 				    TOKEN_NEQSIGN);
 		TFSM_COND_MOVE_EXIT(ps->c == '>' && ps->prev_c == '-',
 				    TOKEN_ARROW);
+		TFSM_COND_MOVE_EXIT(ps->c == '~' && ps->prev_c == '!',
+				    TOKEN_NMATCHSIGN);
 
 		/* Special case to differ single equal sign from double one. */
 		TFSM_COND_MOVE(ps->c == '=', TS_EQSIGN);
 
+		/* Regular expression match sign or a literal starting with
+		 * the tilde. */
+		TFSM_COND_MOVE(ps->c == '~', TS_TILDE);
+
 		/* Everything else is not a special character and therefore
 		 * it starts a literal. */
 		FSM_JMP(TS_LITERAL_FIRST_CHAR);
@@ -606,6 +614,19 @@ read_next_token(TfwCfgParserState *ps)
 				    TOKEN_NEQSIGN);
 		TFSM_COND_MOVE_EXIT(ps->c == '>' && ps->prev_c == '-',
 				    TOKEN_ARROW);
+		TFSM_COND_MOVE_EXIT(ps->c == '~' && ps->prev_c == '!',
+				    TOKEN_NMATCHSIGN);
+		ps->lit = ps->pos - 1;
+		++ps->lit_len;
+		FSM_JMP(TS_LITERAL_ACCUMULATE);
+	}
+
+	FSM_STATE(TS_TILDE) {
+		TFSM_COND_JMP_EXIT(!ps->c, TOKEN_NA);
+
+		/* The sign is a separate token, e.g. 'uri ~ "^/a/[0-9]+$"'. */
+		TFSM_COND_JMP_EXIT(isspace(ps->c) || ps->c == '"',
+				   TOKEN_MATCHSIGN);
 		ps->lit = ps->pos - 1;
 		++ps->lit_len;
 		FSM_JMP(TS_LITERAL_ACCUMULATE);
@@ -695,6 +716,8 @@ read_next_token(TfwCfgParserState *ps)
 				   TOKEN_LITERAL);
 		TFSM_COND_JMP_EXIT(ps->c == '=' && ps->prev_c == '!',
 				   TOKEN_LITERAL);
+		TFSM_COND_JMP_EXIT(ps->c == '~' && ps->prev_c == '!',
+				   TOKEN_LITERAL);
 		++ps->lit_len;
 		FSM_JMP(TS_LITERAL_ACCUMULATE);
 	}
@@ -732,7 +755,10 @@ entry_set_cond(TfwCfgEntry *e, token_t cond_type, const char *src, int len)
 	if (!(e->name = alloc_and_copy_literal(name, name_len)))
 		return -ENOMEM;
 
-	rule->inv = cond_type == TOKEN_DEQSIGN ? false : true;
+	rule->inv = cond_type == TOKEN_NEQSIGN
+		    || cond_type == TOKEN_NMATCHSIGN;
+	rule->regex = cond_type == TOKEN_MATCHSIGN
+		      || cond_type == TOKEN_NMATCHSIGN;
 	return 0;
 }
 
@@ -806,7 +832,9 @@ parse_cfg_entry(TfwCfgParserState *ps)
 
 	FSM_STATE(PS_PLAIN_OR_RULE) {
 		PFSM_COND_MOVE(ps->t == TOKEN_DEQSIGN ||
-			       ps->t == TOKEN_NEQSIGN,
+			       ps->t == TOKEN_NEQSIGN ||
+			       ps->t == TOKEN_MATCHSIGN ||
+			       ps->t == TOKEN_NMATCHSIGN,
 			       PS_RULE_COND);
 		PFSM_COND_MOVE(ps->t == TOKEN_LITERAL, PS_PLAIN_OR_LONG_RULE);
 
@@ -819,7 +847,9 @@ parse_cfg_entry(TfwCfgParserState *ps)
 
 	FSM_STATE(PS_PLAIN_OR_LONG_RULE) {
 		FSM_COND_JMP(ps->t == TOKEN_DEQSIGN ||
-			     ps->t == TOKEN_NEQSIGN,
+			     ps->t == TOKEN_NEQSIGN ||
+			     ps->t == TOKEN_MATCHSIGN ||
+			     ps->t == TOKEN_NMATCHSIGN,
 			     PS_LONG_RULE_COND);
 
 		/* This is not rule (simple or extended), so jump to
@@ -969,6 +999,151 @@ parse_cfg_entry(TfwCfgParserState *ps)
 	}
 }
 
+/*
+ * ------------------------------------------------------------------------
+ *	Configuration digests.
+ * ------------------------------------------------------------------------
+ *
+ * Live reconfiguration needs to know which parts of the configuration
+ * haven't changed to keep the objects built from them. Each versioned
+ * section (see TfwCfgSpecChild) gets the digest of its text and the files
+ * read by its directives, and the rest of the configuration is covered by
+ * the common digest: all the other top level entries, texts of their
+ * sections and the files they read.
+ *
+ * The digests are compared only with the digests of the same section in the
+ * previous configuration, so FNV-1a is good enough.
+ */
+#define TFW_CFG_DIGEST_INIT	0xcbf29ce484222325ULL
+
+static u64 tfw_cfg_digest_all;
+/* Digest to account files being read, NULL if not parsing. */
+static u64 *tfw_cfg_digest_cur;
+
+static u64
+tfw_cfg_digest_upd(u64 d, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--) {
+		d ^= *p++;
+		d *= 0x100000001b3ULL;
+	}
+
+	return d;
+}
+
+static void
+tfw_cfg_digest_str(u64 *d, const char *s)
+{
+	/* Including the terminator delimits adjacent strings. */
+	if (s)
+		*d = tfw_cfg_digest_upd(*d, s, strlen(s) + 1);
+}
+
+static void
+tfw_cfg_digest_entry(u64 *d, const TfwCfgEntry *e)
+{
+	size_t i;
+
+	tfw_cfg_digest_str(d, e->name);
+	*d = tfw_cfg_digest_upd(*d, &e->val_n, sizeof(e->val_n));
+	for (i = 0; i < e->val_n; ++i)
+		tfw_cfg_digest_str(d, e->vals[i]);
+	*d = tfw_cfg_digest_upd(*d, &e->attr_n, sizeof(e->attr_n));
+	for (i = 0; i < e->attr_n; ++i) {
+		tfw_cfg_digest_str(d, e->attrs[i].key);
+		tfw_cfg_digest_str(d, e->attrs[i].val);
+	}
+}
+
+/**
+ * Digest of the last parsed configuration except versioned sections.
+ */
+u64
+tfw_cfg_digest(void)
+{
+	return tfw_cfg_digest_all;
+}
+
+/*
+ * ------------------------------------------------------------------------
+ *	Configuration sources.
+ * ------------------------------------------------------------------------
+ *
+ * The configuration file and the files read by its directives, e.g. TLS
+ * certificates and keys or templates, with the digests of their contents.
+ * The sources of the running configuration are kept, so live reconfiguration
+ * is skipped at all if none of the sources has changed: the new configuration
+ * would be the same, but building it from scratch for a large configuration
+ * takes a while.
+ */
+typedef struct {
+	struct list_head	list;
+	u64			digest;
+	char			path[0];
+} TfwCfgSrc;
+
+/* Sources of the running configuration. */
+static LIST_HEAD(tfw_cfg_srcs);
+/* Sources of the configuration being parsed. */
+static LIST_HEAD(tfw_cfg_srcs_new);
+/* A source of the parsed configuration can't be remembered. */
+static bool tfw_cfg_srcs_lost;
+
+static void
+tfw_cfg_src_add(const char *path, const char *data, size_t len)
+{
+	size_t plen = strlen(path) + 1;
+	TfwCfgSrc *src;
+
+	if (!(src = kmalloc(sizeof(*src) + plen, GFP_KERNEL))) {
+		tfw_cfg_srcs_lost = true;
+		return;
+	}
+	src->digest = tfw_cfg_digest_upd(TFW_CFG_DIGEST_INIT, data, len);
+	memcpy(src->path, path, plen);
+	list_add_tail(&src->list, &tfw_cfg_srcs_new);
+}
+
+static void
+tfw_cfg_srcs_free(struct list_head *srcs)
+{
+	TfwCfgSrc *src, *tmp;
+
+	list_for_each_entry_safe(src, tmp, srcs, list)
+		kfree(src);
+	INIT_LIST_HEAD(srcs);
+}
+
+/**
+ * Check whether the configuration file and all the files read by the running
+ * configuration are the same as they were when the configuration was loaded.
+ */
+bool
+tfw_cfg_unchanged(void)
+{
+	TfwCfgSrc *src;
+	size_t sz;
+	char *data;
+	bool r;
+
+	if (list_empty(&tfw_cfg_srcs))
+		return false;
+
+	list_for_each_entry(src, &tfw_cfg_srcs, list) {
+		if (!(data = tfw_cfg_read_file(src->path, &sz)))
+			return false;
+		r = tfw_cfg_digest_upd(TFW_CFG_DIGEST_INIT, data, sz - 1)
+		    == src->digest;
+		kfree(data);
+		if (!r)
+			return false;
+	}
+
+	return true;
+}
+
 /*
  * ------------------------------------------------------------------------
  *	Configuration Parser - TfwCfgSpec helpers.
@@ -980,6 +1155,26 @@ parse_cfg_entry(TfwCfgParserState *ps)
  * logic between these two cases.
  */
 
+/*
+ * Large configurations consist mostly of long runs of the same directive,
+ * e.g. thousands of 'vhost' sections or 'rule' entries in a chain, so the
+ * previously matched spec is checked before walking over the specs.
+ */
+static inline bool
+spec_match_last(const TfwCfgSpec *last, const char *name)
+{
+	return last && !strcmp(last->name, name);
+}
+
+static bool
+spec_is_versioned(const TfwCfgSpec *spec)
+{
+	const TfwCfgSpecChild *cse = spec->spec_ext;
+
+	return spec->handler == &tfw_cfg_handle_children && cse
+	       && cse->versioned;
+}
+
 static TfwCfgSpec *
 spec_find(TfwCfgSpec specs[], const char *name)
 {
@@ -1487,7 +1682,9 @@ tfw_cfg_handle_children(TfwCfgSpec *cs, TfwCfgEntry *e)
 	TfwCfgParserState *ps = container_of(e, TfwCfgParserState, e);
 	TfwCfgSpecChild *cse = cs->spec_ext;
 	TfwCfgSpec *nested_specs = cs->dest;
-	TfwCfgSpec *matching_spec;
+	TfwCfgSpec *matching_spec = NULL;
+	const char *body;
+	u64 *digest = tfw_cfg_digest_cur;
 	int ret;
 	bool run_hooks = !tfw_runstate_is_reconfig() || cs->allow_reconfig;
 
@@ -1513,6 +1710,13 @@ tfw_cfg_handle_children(TfwCfgSpec *cs, TfwCfgEntry *e)
 	 * an opening brace. Confirm we have a '{' here.
 	 */
 	BUG_ON(ps->t != TOKEN_LBRACE);
+	body = ps->pos;
+
+	/* Only top level sections are versioned. */
+	if (cse && cse->versioned && digest == &tfw_cfg_digest_all) {
+		cse->digest = TFW_CFG_DIGEST_INIT;
+		tfw_cfg_digest_cur = &cse->digest;
+	}
 
 	read_next_token(ps);
 	if (ps->err)
@@ -1526,7 +1730,8 @@ tfw_cfg_handle_children(TfwCfgSpec *cs, TfwCfgEntry *e)
 			return ps->err;
 		}
 
-		matching_spec = spec_find(nested_specs, ps->e.name);
+		if (!spec_match_last(matching_spec, ps->e.name))
+			matching_spec = spec_find(nested_specs, ps->e.name);
 		if (!matching_spec) {
 			T_ERR_NL("don't know how to handle: %s\n", ps->e.name);
 			return -EINVAL;
@@ -1547,6 +1752,10 @@ tfw_cfg_handle_children(TfwCfgSpec *cs, TfwCfgEntry *e)
 		T_ERR_NL("%s: Missing closing brace.\n", cs->name);
 		return -EINVAL;
 	}
+	if (tfw_cfg_digest_cur)
+		*tfw_cfg_digest_cur = tfw_cfg_digest_upd(*tfw_cfg_digest_cur,
+							 body, ps->pos - body);
+	tfw_cfg_digest_cur = digest;
 
 	read_next_token(ps);
 	if (ps->err)
@@ -1834,6 +2043,8 @@ tfw_cfg_parse_mods(const char *cfg_text, struct list_head *mod_list)
 	MOD_FOR_EACH(mod, mod_list) {
 		spec_start_handling(mod->specs);
 	}
+	tfw_cfg_digest_all = TFW_CFG_DIGEST_INIT;
+	tfw_cfg_digest_cur = &tfw_cfg_digest_all;
 
 	do {
 		parse_cfg_entry(&ps);
@@ -1844,15 +2055,19 @@ tfw_cfg_parse_mods(const char *cfg_text, struct list_head *mod_list)
 		if (!ps.e.name)
 			break; /* EOF - nothing is parsed and no error. */
 
-		MOD_FOR_EACH(mod, mod_list) {
-			matching_spec = spec_find(mod->specs, ps.e.name);
-			if (matching_spec)
-				break;
+		if (!spec_match_last(matching_spec, ps.e.name)) {
+			MOD_FOR_EACH(mod, mod_list) {
+				matching_spec = spec_find(mod->specs, ps.e.name);
+				if (matching_spec)
+					break;
+			}
 		}
 		if (!matching_spec) {
 			T_ERR_NL("don't know how to handle: '%s'\n", ps.e.name);
 			goto err;
 		}
+		if (!spec_is_versioned(matching_spec))
+			tfw_cfg_digest_entry(&tfw_cfg_digest_all, &ps.e);
 
 		r = spec_handle_entry(matching_spec, &ps.e);
 		if (r)
@@ -1867,9 +2082,11 @@ tfw_cfg_parse_mods(const char *cfg_text, struct list_head *mod_list)
 		if (r)
 			goto err;
 	}
+	tfw_cfg_digest_cur = NULL;
 
 	return 0;
 err:
+	tfw_cfg_digest_cur = NULL;
 	print_parse_error(&ps);
 	entry_reset(&ps.e);
 	return -EINVAL;
@@ -1884,6 +2101,9 @@ tfw_cfg_cleanup(struct list_head *mod_list)
 	TfwMod *mod;
 
 	T_DBG3("Configuration cleanup...\n");
+	tfw_cfg_srcs_free(&tfw_cfg_srcs_new);
+	if (!tfw_runstate_is_reconfig())
+		tfw_cfg_srcs_free(&tfw_cfg_srcs);
 	MOD_FOR_EACH_REVERSE(mod, mod_list) {
 		spec_cleanup(mod->specs);
 		if (mod->cfgclean)
@@ -1902,6 +2122,9 @@ tfw_cfg_parse(struct list_head *mod_list)
 	T_DBG3("reading configuration file...\n");
 	if (!(cfg_text_buf = tfw_cfg_read_file(tfw_cfg_path, &file_size)))
 		return -ENOENT;
+	tfw_cfg_srcs_free(&tfw_cfg_srcs_new);
+	tfw_cfg_srcs_lost = false;
+	tfw_cfg_src_add(tfw_cfg_path, cfg_text_buf, file_size - 1);
 
 	T_DBG2("parsing configuration and pushing it to modules...\n");
 	if ((ret = tfw_cfg_parse_mods(cfg_text_buf, mod_list)))
@@ -1933,6 +2156,11 @@ tfw_cfg_conclude(struct list_head *mod_list)
 
 	MOD_FOR_EACH(mod, mod_list)
 		tfw_cfg_migrate_state(mod->specs);
+
+	tfw_cfg_srcs_free(&tfw_cfg_srcs);
+	if (!tfw_cfg_srcs_lost)
+		list_splice_init(&tfw_cfg_srcs_new, &tfw_cfg_srcs);
+	tfw_cfg_srcs_free(&tfw_cfg_srcs_new);
 }
 
 /*
@@ -1996,6 +2224,13 @@ tfw_cfg_read_file(const char *path, size_t *file_size)
 
 	filp_close(fp, NULL);
 
+	/* A file read by a directive is a part of the configuration. */
+	if (tfw_cfg_digest_cur) {
+		*tfw_cfg_digest_cur = tfw_cfg_digest_upd(*tfw_cfg_digest_cur,
+							 out_buf, off);
+		tfw_cfg_src_add(path, out_buf, off);
+	}
+
 	out_buf[off] = '\0';
 	return out_buf;
 
@@ -110,6 +110,10 @@
  * comparison sign interpretation in rule condition part:
  *                     "==" => false / "!=" => true
  *
+ * The @regex field is set if the second operand is a regular expression,
+ * i.e. the comparison sign is "~" or "!~" (inverted):
+ *               uri ~ "^/img/[0-9]+\.png$" -> static;
+ *
  * Also extended rule form is used in case of specifying HTTP headers. Following
  * rule:
  *               hdr "Referer" == "*example.com" -> mark = 7;
@@ -149,6 +153,7 @@ typedef struct {
 	const char *act;
 	const char *val;
 	bool inv;
+	bool regex;
 } TfwCfgRule;
 
 typedef struct {
@@ -364,10 +369,18 @@ typedef struct {
  *
  * The @begin_hook is called before any children are parsed.
  * The @finish_hook is called after all children entries are parsed.
+ *
+ * A top level section with @versioned set is tracked separately from the
+ * rest of the configuration to find out on live reconfiguration whether
+ * it has changed: @digest is set to the digest of the section text and
+ * the files read by its directives before @finish_hook is called, and the
+ * section isn't a part of tfw_cfg_digest().
  */
 typedef struct {
 	int (*begin_hook)(TfwCfgSpec *self, TfwCfgEntry *parent_entry);
 	int (*finish_hook)(TfwCfgSpec *self);
+	bool versioned;
+	u64 digest;
 } TfwCfgSpecChild;
 
 static inline bool
@@ -430,6 +443,8 @@ int tfw_cfg_parse_mods(const char *cfg_text, struct list_head *mod_list);
 void *tfw_cfg_read_file(const char *path, size_t *file_size);
 
 int tfw_cfg_parse(struct list_head *mod_list);
+u64 tfw_cfg_digest(void);
+bool tfw_cfg_unchanged(void);
 void tfw_cfg_cleanup(struct list_head *mod_list);
 void tfw_cfg_conclude(struct list_head *mod_list);
 
@@ -21,7 +21,9 @@
  * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 #include <linux/hashtable.h>
+#include <linux/random.h>
 #include <linux/slab.h>
+#include <linux/timer.h>
 
 #include "lib/hash.h"
 #include "hash.h"
@@ -36,8 +38,28 @@
 /* Length of comparison of clients entry by User-Agent. */
 #define UA_CMP_LEN	256
 
+/*
+ * Granularity of the client LRU updates, a client w/o requests during
+ * TFW_CLIENT_LRU_IDLE is considered idle. Each shrink call evicts up to
+ * TFW_CLIENT_SHRINK_BATCH clients scanning no more than
+ * TFW_CLIENT_SHRINK_SCAN LRU entries.
+ */
+#define TFW_CLIENT_LRU_GRAN	(HZ / 4)
+#define TFW_CLIENT_LRU_IDLE	(10 * HZ)
+#define TFW_CLIENT_SHRINK_BATCH	16
+#define TFW_CLIENT_SHRINK_SCAN	256
+
+/*
+ * Number of slots in the per-CPU cache of recently obtained clients and the
+ * time a client stays in the cache, see tfw_client_pcpu_get(). The aged
+ * clients are released by client_pcpu_timer each TFW_CLIENT_PCPU_TTL.
+ */
+#define TFW_CLIENT_PCPU_N	64
+#define TFW_CLIENT_PCPU_TTL	HZ
+
 static struct {
 	unsigned int	db_size;
+	unsigned int	db_size_max;
 	const char	*db_path;
 	unsigned int	expires_time;
 } client_cfg __read_mostly;
@@ -48,11 +70,17 @@ static struct {
  * @cli			- client descriptor;
  * @xff_addr		- peer IPv6 address from X-Forwarded-For;
  * @expires		- expiration time for the client descriptor after all;
- *			  connections are closed;
+ *			  connections are closed, zero if the entry is evicted;
+ * @timer		- removes the entry from the table after @expires;
  * @lock		- lock for atomic change @expires and @users;
  * @users		- reference counter.
  * 			  Expiration state will begind, when the counter reaches
  *			  zero;
+ * @lru		- entry in the clients LRU list;
+ * @lru_id		- @client_lru.id if the entry is linked into the LRU list,
+ *			  the list pointers are invalid in persistent entries
+ *			  left from the previous run;
+ * @jtouch		- last time the client was obtained or sent a request;
  * @user_agent_len	- Length of @user_agent
  * @user_agent		- UA_CMP_LEN first characters of User-Agent
  */
@@ -60,14 +88,157 @@ typedef struct {
 	TfwClient	cli;
 	TfwAddr		xff_addr;
 	long		expires;
+	TdbTimer	timer;
 	spinlock_t	lock;
 	atomic_t	users;
+	struct list_head lru;
+	unsigned int	lru_id;
+	unsigned long	jtouch;
 	unsigned long	user_agent_len;
 	char		user_agent[UA_CMP_LEN];
 } TfwClientEntry;
 
 static TDB *client_db;
 
+/**
+ * Clients LRU, the least recently used clients are at the list head.
+ *
+ * @lock	- protects the list, nests into TDB bucket and entry locks;
+ * @list	- the list of TfwClientEntry;
+ * @id		- identifier of the current list, see TfwClientEntry->lru_id;
+ * @n		- number of clients in the list;
+ * @cap		- estimated number of clients fitting the database.
+ */
+static struct {
+	spinlock_t		lock;
+	struct list_head	list;
+	unsigned int		id;
+	unsigned int		n;
+	unsigned int		cap;
+} client_lru = {
+	.lock	= __SPIN_LOCK_UNLOCKED(client_lru.lock),
+	.list	= LIST_HEAD_INIT(client_lru.list),
+};
+
+/**
+ * Per-CPU cache of clients obtained by address only, i.e. w/o X-Forwarded-For
+ * and User-Agent, on new connections. Each cached client holds a reference,
+ * so the entry can't expire while it's in the cache. The slots are accessed
+ * by xchg() only, so the cache can be flushed from any CPU.
+ *
+ * @ent		- cached client entries, indexed by the client key;
+ * @jts		- time when the entries were put to the cache;
+ */
+typedef struct {
+	TfwClientEntry	*ent[TFW_CLIENT_PCPU_N];
+	unsigned long	jts[TFW_CLIENT_PCPU_N];
+} TfwClientPcpu;
+
+static DEFINE_PER_CPU(TfwClientPcpu, client_pcpu);
+static struct timer_list client_pcpu_timer;
+
+static void
+__tfw_client_lru_touch(TfwClientEntry *ent)
+{
+	WRITE_ONCE(ent->jtouch, jiffies);
+
+	spin_lock_bh(&client_lru.lock);
+	if (ent->lru_id == client_lru.id) {
+		list_move_tail(&ent->lru, &client_lru.list);
+	} else {
+		ent->lru_id = client_lru.id;
+		list_add_tail(&ent->lru, &client_lru.list);
+		client_lru.n++;
+	}
+	spin_unlock_bh(&client_lru.lock);
+}
+
+static void
+__tfw_client_lru_del(TfwClientEntry *ent)
+{
+	spin_lock_bh(&client_lru.lock);
+	if (ent->lru_id == client_lru.id) {
+		list_del(&ent->lru);
+		client_lru.n--;
+	}
+	ent->lru_id = 0;
+	spin_unlock_bh(&client_lru.lock);
+}
+
+/**
+ * Move the client to the LRU tail on a new request. The global LRU lock isn't
+ * taken more often than once in TFW_CLIENT_LRU_GRAN for a client.
+ */
+void
+tfw_client_touch(TfwClient *cli)
+{
+	TfwClientEntry *ent = (TfwClientEntry *)cli;
+
+	if (time_before(jiffies, READ_ONCE(ent->jtouch) + TFW_CLIENT_LRU_GRAN))
+		return;
+	__tfw_client_lru_touch(ent);
+}
+
+static int
+__tfw_client_conn_abort_cb(TfwConn *conn)
+{
+	tfw_connection_abort(conn, false);
+	return 0;
+}
+
+/**
+ * Evict up to @n least recently used clients to free space in the clients
+ * database and memory occupied by their connections. Clients w/o connections,
+ * including blocked ones which connections were closed on blocking, are
+ * evicted first: their entries are expired by TDB on the next timer tick.
+ * Next, connections of clients idle for TFW_CLIENT_LRU_IDLE are aborted, so
+ * the entries are released and expire after client_cfg.expires_time.
+ *
+ * Eviction is asynchronous, so the evicted clients are moved to the LRU tail
+ * to not scan them again on the next call.
+ */
+void
+tfw_client_shrink(unsigned int n)
+{
+	TfwClientEntry *ent, *tmp;
+	TfwConn *conn;
+	unsigned long now = jiffies;
+	unsigned int scan = TFW_CLIENT_SHRINK_SCAN;
+	LIST_HEAD(evicted);
+	int pass;
+
+	if (!client_db)
+		return;
+
+	spin_lock_bh(&client_lru.lock);
+	for (pass = 0; pass < 2; ++pass) {
+		list_for_each_entry_safe(ent, tmp, &client_lru.list, lru) {
+			if (!n || !scan)
+				goto out;
+			scan--;
+			if (!atomic_read(&ent->users)) {
+				if (pass)
+					continue;
+				tdb_timer_add(client_db, &ent->timer, now);
+			} else {
+				if (!pass)
+					continue;
+				if (time_before(now, ent->jtouch
+						     + TFW_CLIENT_LRU_IDLE))
+					break;
+				tfw_peer_for_each_conn(&ent->cli, conn, list,
+						       __tfw_client_conn_abort_cb);
+			}
+			WRITE_ONCE(ent->jtouch, now);
+			list_move_tail(&ent->lru, &evicted);
+			n--;
+		}
+	}
+out:
+	list_splice_tail(&evicted, &client_lru.list);
+	spin_unlock_bh(&client_lru.lock);
+}
+
 /**
  * Called when a client socket is closed.
  */
@@ -91,6 +262,8 @@ tfw_client_put(TfwClient *cli)
 	BUG_ON(!list_empty(&cli->conn_list));
 
 	ent->expires = tfw_current_timestamp() + client_cfg.expires_time;
+	tdb_timer_add(client_db, &ent->timer,
+		      jiffies + (unsigned long)client_cfg.expires_time * HZ);
 
 	spin_unlock(&ent->lock);
 
@@ -98,6 +271,89 @@ tfw_client_put(TfwClient *cli)
 	TFW_DEC_STAT_BH(clnt.online);
 }
 
+/*
+ * Look up a client by @addr and @key in the per-CPU cache. The cache slot is
+ * emptied while it's checked, so a concurrent flush doesn't put the cache
+ * reference.
+ */
+static TfwClient *
+tfw_client_pcpu_get(const TfwAddr *addr, unsigned long key)
+{
+	TfwClientPcpu *pc = this_cpu_ptr(&client_pcpu);
+	unsigned int i = key % TFW_CLIENT_PCPU_N;
+	TfwClientEntry *ent, *old;
+
+	if (!(ent = xchg(&pc->ent[i], NULL)))
+		return NULL;
+
+	if (memcmp_fast(&ent->cli.addr.sin6_addr, &addr->sin6_addr,
+			sizeof(addr->sin6_addr))
+	    || ent->user_agent_len
+	    || !ipv6_addr_any(&ent->xff_addr.sin6_addr)
+	    || time_after(jiffies, pc->jts[i] + TFW_CLIENT_PCPU_TTL))
+	{
+		tfw_client_put(&ent->cli);
+		return NULL;
+	}
+
+	/* The cache reference keeps the entry from expiration. */
+	atomic_inc(&ent->users);
+	tfw_client_touch(&ent->cli);
+
+	if ((old = xchg(&pc->ent[i], ent)))
+		tfw_client_put(&old->cli);
+
+	return &ent->cli;
+}
+
+static void
+tfw_client_pcpu_put(TfwClientEntry *ent, unsigned long key)
+{
+	TfwClientPcpu *pc = this_cpu_ptr(&client_pcpu);
+	unsigned int i = key % TFW_CLIENT_PCPU_N;
+
+	atomic_inc(&ent->users);
+	WRITE_ONCE(pc->jts[i], jiffies);
+	if ((ent = xchg(&pc->ent[i], ent)))
+		tfw_client_put(&ent->cli);
+}
+
+/*
+ * Release the cached clients, so they can expire and be evicted: all of them
+ * or only the ones put to the cache more than TFW_CLIENT_PCPU_TTL ago if
+ * @aged. A slot can be refilled between the time check and xchg(), so a
+ * fresh client may be released early, which is just a cache miss.
+ */
+static void
+tfw_client_pcpu_flush(bool aged)
+{
+	TfwClientEntry *ent;
+	TfwClientPcpu *pc;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		pc = per_cpu_ptr(&client_pcpu, cpu);
+		for (i = 0; i < TFW_CLIENT_PCPU_N; ++i) {
+			if (aged && !time_after(jiffies, READ_ONCE(pc->jts[i])
+							 + TFW_CLIENT_PCPU_TTL))
+				continue;
+			if ((ent = xchg(&pc->ent[i], NULL)))
+				tfw_client_put(&ent->cli);
+		}
+	}
+}
+
+/*
+ * Clients w/o new connections mustn't stay in the per-CPU caches, so release
+ * the aged ones periodically rather than on lookups of the same CPU.
+ */
+static void
+tfw_client_pcpu_timer_cb(struct timer_list *t)
+{
+	tfw_client_pcpu_flush(true);
+	mod_timer(t, jiffies + TFW_CLIENT_PCPU_TTL);
+}
+
 typedef struct {
 	TfwAddr		addr;
 	TfwAddr		xff_addr;
@@ -136,6 +392,13 @@ tfw_client_addr_eq(TdbRec *rec, void *data)
 
 	spin_lock(&ent->lock);
 
+	if (unlikely(!ent->expires)) {
+		/* The entry is evicted and is being removed from the table. */
+		spin_unlock(&ent->lock);
+		return false;
+	}
+	if (!atomic_read(&ent->users))
+		tdb_timer_del(client_db, &ent->timer);
 	if (curr_time > ent->expires) {
 		bzero_fast(&cli->class_prvt, sizeof(cli->class_prvt));
 		if (ctx->init)
@@ -150,6 +413,8 @@ tfw_client_addr_eq(TdbRec *rec, void *data)
 
 	spin_unlock(&ent->lock);
 
+	__tfw_client_lru_touch(ent);
+
 	T_DBG("client was found in tdb\n");
 	T_DBG2("client %p, users=%d\n", cli, users);
 
@@ -166,6 +431,7 @@ tfw_client_ent_init(TdbRec *rec, void *data)
 	spin_lock_init(&ent->lock);
 
 	ent->expires = LONG_MAX;
+	tdb_timer_init(&ent->timer, rec);
 	bzero_fast(&cli->class_prvt, sizeof(cli->class_prvt));
 	if (ctx->init)
 		ctx->init(cli);
@@ -179,18 +445,43 @@ tfw_client_ent_init(TdbRec *rec, void *data)
 			sizeof(ent->user_agent));
 	ent->user_agent_len = min(ctx->user_agent.len, sizeof(ent->user_agent));
 
+	ent->lru_id = 0;
+	__tfw_client_lru_touch(ent);
+
 	T_DBG("new client: cli=%p\n", cli);
 	T_DBG_ADDR("client address", &cli->addr, TFW_NO_PORT);
 	T_DBG2("client %p, users=%d\n", cli, 1);
 }
 
+/**
+ * Called by TDB under the bucket lock when the client entry timer expires.
+ * The entry can be removed only if nobody obtained it again.
+ */
+static bool
+tfw_client_expire(TdbRec *rec)
+{
+	TfwClientEntry *ent = (TfwClientEntry *)rec->data;
+	bool r;
+
+	spin_lock(&ent->lock);
+	if ((r = !atomic_read(&ent->users))) {
+		ent->expires = 0;
+		__tfw_client_lru_del(ent);
+	}
+	spin_unlock(&ent->lock);
+
+	T_DBG("client %p is %sevicted\n", &ent->cli, r ? "" : "not ");
+
+	return r;
+}
+
 /**
  * Find a client corresponding to @addr, @xff_addr (e.g. from X-Forwarded-For)
  * and @user_agent.
  *
  * The returned TfwClient reference must be released via tfw_client_put()
- * when the @sk is closed.
- * TODO #515 employ eviction strategy for the table.
+ * when the @sk is closed. The client entry is removed from the table if it
+ * isn't obtained again in client_cfg.expires_time seconds after that.
  */
 TfwClient *
 tfw_client_obtain(TfwAddr addr, TfwAddr *xff_addr, TfwStr *user_agent,
@@ -207,6 +498,9 @@ tfw_client_obtain(TfwAddr addr, TfwAddr *xff_addr, TfwStr *user_agent,
 
 	key = hash_calc((const char *)&addr.sin6_addr,
 			sizeof(addr.sin6_addr));
+	/* Repeated connections from the same address skip TDB. */
+	if (!xff_addr && !user_agent && (cli = tfw_client_pcpu_get(&addr, key)))
+		return cli;
 
 	if (xff_addr) {
 		key ^= hash_calc((const char *)&xff_addr->sin6_addr,
@@ -231,8 +525,14 @@ tfw_client_obtain(TfwAddr addr, TfwAddr *xff_addr, TfwStr *user_agent,
 	BUG_ON(tdb_ctx.len < sizeof(TfwClientEntry));
 	if (!rec) {
 		T_WARN("cannot allocate TDB space for client\n");
+		tfw_client_pcpu_flush(false);
+		tfw_client_shrink(TFW_CLIENT_SHRINK_BATCH);
 		return NULL;
 	}
+	/* Make room for new clients in advance if the database is 7/8 full. */
+	if (tdb_ctx.is_new
+	    && READ_ONCE(client_lru.n) > client_lru.cap - client_lru.cap / 8)
+		tfw_client_shrink(TFW_CLIENT_SHRINK_BATCH);
 
 	if (!tdb_ctx.is_new)
 		/*
@@ -244,6 +544,9 @@ tfw_client_obtain(TfwAddr addr, TfwAddr *xff_addr, TfwStr *user_agent,
 
 	ent = (TfwClientEntry *)rec->data;
 	cli = &ent->cli;
+	if (!xff_addr && !user_agent)
+		tfw_client_pcpu_put(ent, key);
+
 	return cli;
 }
 EXPORT_SYMBOL(tfw_client_obtain);
@@ -287,9 +590,28 @@ tfw_client_start(void)
 	 */
 	BUILD_BUG_ON(sizeof(TfwClientEntry) <= TDB_HTRIE_MINDREC);
 	client_db = tdb_open(client_cfg.db_path, client_cfg.db_size,
-			     sizeof(TfwClientEntry), numa_node_id());
+			     client_cfg.db_size_max, sizeof(TfwClientEntry),
+			     numa_node_id());
 	if (!client_db)
 		return -EINVAL;
+	if (tdb_timers_init(client_db, tfw_client_expire)) {
+		tdb_close(client_db);
+		client_db = NULL;
+		return -ENOMEM;
+	}
+	/* The entries are linked into the LRU list and referenced by peers. */
+	tdb_set_owner(client_db, NULL);
+
+	spin_lock_bh(&client_lru.lock);
+	INIT_LIST_HEAD(&client_lru.list);
+	client_lru.id = get_random_u32() | 1;
+	client_lru.n = 0;
+	client_lru.cap = max(client_cfg.db_size, client_cfg.db_size_max)
+			 / sizeof(TfwClientEntry);
+	spin_unlock_bh(&client_lru.lock);
+
+	timer_setup(&client_pcpu_timer, tfw_client_pcpu_timer_cb, 0);
+	mod_timer(&client_pcpu_timer, jiffies + TFW_CLIENT_PCPU_TTL);
 
 	return 0;
 }
@@ -299,8 +621,14 @@ tfw_client_stop(void)
 {
 	if (tfw_runstate_is_reconfig())
 		return;
-	if (client_db)
-		tdb_close(client_db);
+	if (!client_db)
+		return;
+
+	del_timer_sync(&client_pcpu_timer);
+	local_bh_disable();
+	tfw_client_pcpu_flush(false);
+	local_bh_enable();
+	tdb_close(client_db);
 }
 
 static TfwCfgSpec tfw_client_specs[] = {
@@ -314,6 +642,16 @@ static TfwCfgSpec tfw_client_specs[] = {
 			.range = { PAGE_SIZE, (1 << 30) },
 		}
 	},
+	{
+		.name = "client_tbl_size_max",
+		.deflt = "0",
+		.handler = tfw_cfg_set_int,
+		.dest = &client_cfg.db_size_max,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.multiple_of = 2 * 1024 * 1024,
+			.range = { 0, (1 << 30) },
+		}
+	},
 	{
 		.name = "client_db",
 		.deflt = "/opt/tempesta/db/client.tdb",
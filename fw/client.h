@@ -41,8 +41,11 @@ TfwClient *tfw_client_obtain(TfwAddr addr, TfwAddr *cli_addr,
 void tfw_client_put(TfwClient *cli);
 int tfw_client_for_each(int (*fn)(void *));
 void tfw_client_set_expires_time(unsigned int expires_time);
+void tfw_client_touch(TfwClient *cli);
+void tfw_client_shrink(unsigned int n);
 void tfw_cli_conn_release(TfwCliConn *cli_conn);
 int tfw_cli_conn_send(TfwCliConn *cli_conn, TfwMsg *msg);
+void tfw_cli_conn_rx_throttle(TfwCliConn *cli_conn, TfwSrvConn *srv_conn);
 int tfw_cli_conn_close_all_sync(TfwClient *cli);
 
 void tfw_tls_connection_lost(TfwConn *conn);
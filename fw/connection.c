@@ -23,7 +23,9 @@
 #include "connection.h"
 #include "gfsm.h"
 #include "log.h"
+#include "procfs.h"
 #include "sync_socket.h"
+#include "trace.h"
 
 TfwConnHooks *conn_hooks[TFW_CONN_MAX_PROTOS];
 
@@ -52,7 +54,12 @@ tfw_connection_link_peer(TfwConn *conn, TfwPeer *peer)
 int
 tfw_connection_new(TfwConn *conn)
 {
-	return TFW_CONN_HOOK_CALL(conn, conn_init);
+	int r;
+
+	if (!(r = TFW_CONN_HOOK_CALL(conn, conn_init)))
+		trace_tfw_conn_open(conn);
+
+	return r;
 }
 
 /**
@@ -83,12 +90,32 @@ tfw_connection_close(TfwConn *conn, bool sync)
 	return r;
 }
 
+/**
+ * Close the connection aggressively: reset it and free the socket with all
+ * the queued data immediately. The connection closing hook isn't called,
+ * so no TLS alert or any other data is sent to the peer.
+ */
+int
+tfw_connection_abort(TfwConn *conn, bool sync)
+{
+	int r;
+
+	kernel_fpu_begin_mask(KFPU_MXCSR);
+
+	r = ss_close(conn->sk, SS_F_ABORT | (sync ? SS_F_SYNC : 0));
+
+	kernel_fpu_end();
+
+	return r;
+}
+
 /**
  * Publish the "connection is dropped" event via TfwConnHooks.
  */
 void
 tfw_connection_drop(TfwConn *conn)
 {
+	trace_tfw_conn_close(conn);
 	/* Ask higher levels to free resources at connection close. */
 	TFW_CONN_HOOK_CALL(conn, conn_drop);
 	BUG_ON(conn->stream.msg);
@@ -130,8 +157,13 @@ tfw_connection_recv(void *cdata, struct sk_buff *skb)
 	TfwFsmData fsm_data = {
 		.skb = skb,
 	};
+	u64 t0 = tfw_lat_start();
+	int r;
 
-	return tfw_gfsm_dispatch(&conn->state, conn, &fsm_data);
+	r = tfw_gfsm_dispatch(&conn->state, conn, &fsm_data);
+	tfw_lat_end(TFW_LAT_RECV, t0);
+
+	return r;
 }
 
 void
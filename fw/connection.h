@@ -23,6 +23,7 @@
 #ifndef __TFW_CONNECTION_H__
 #define __TFW_CONNECTION_H__
 
+#include <linux/llist.h>
 #include <net/sock.h>
 
 #include "gfsm.h"
@@ -83,7 +84,8 @@ enum {
  * @state	- connection processing state;
  * @list	- member in the list of connections with @peer;
  * @refcnt	- number of users of the connection structure instance;
- * @timer	- The keep-alive/retry timer for the connection;
+ * @hdr_n	- size hint for headers tables of new HTTP messages, the number
+ *		  of headers table items of the last message freed;
  * @stream	- instance for control messages processing;
  * @peer	- TfwClient or TfwServer handler. Hop-by-hop peer;
  * @sk		- an appropriate sock handler;
@@ -94,7 +96,7 @@ enum {
 	TfwGState		state;			\
 	struct list_head	list;			\
 	atomic_t		refcnt;			\
-	struct timer_list	timer;			\
+	unsigned int		hdr_n;			\
 	TfwStream		stream;			\
 	TfwPeer 		*peer;			\
 	struct sock		*sk;			\
@@ -147,14 +149,32 @@ typedef struct {
  * @seq_queue	- queue of client's messages in the order they came;
  * @seq_qlock	- lock for accessing @seq_queue;
  * @ret_qlock	- lock for serializing sets of responses;
- * @timer_lock	- lock for serializing of deleting/modifing keep-alive timer
+ * @ka_list	- member in a slot of the keep-alive timer wheel;
+ * @ka_ts	- time of the last response sent, in jiffies;
+ * @ka_cpu	- CPU of the keep-alive timer wheel, -1 if the connection is
+ *		  dropped;
+ * @xff_len	- length of @xff;
+ * @xff		- the client address formatted once on the connection accept
+ *		  for X-Forwarded-For header of the forwarded requests;
+ * @tunnel	- server connection the client data is passed to as is after
+ *		  a protocol switch, see tfw_http_tunnel_open();
+ * @rx_paused	- server connections paused until the client reads the data
+ *		  sent to it, see tfw_cli_conn_rx_throttle();
+ * @rx_plock	- lock for @rx_paused;
  */
 typedef struct {
 	TFW_CONN_COMMON;
 	struct list_head	seq_queue;
 	spinlock_t		seq_qlock;
 	spinlock_t		ret_qlock;
-	spinlock_t		timer_lock;
+	struct list_head	ka_list;
+	unsigned long		ka_ts;
+	int			ka_cpu;
+	unsigned int		xff_len;
+	char			xff[TFW_ADDR_STR_BUF_SIZE];
+	TfwConn			*tunnel;
+	struct list_head	rx_paused;
+	spinlock_t		rx_plock;
 } TfwCliConn;
 
 /*
@@ -164,23 +184,45 @@ typedef struct {
  * @fwd_queue	- queue of messages to be sent to a back-end server;
  * @nip_queue	- queue of non-idempotent messages in server's @fwd_queue;
  * @fwd_qlock	- lock for accessing @fwd_queue and @nip_queue;
+ * @fwd_inq	- lockless queue of requests to be added to @fwd_queue;
+ * @timer	- the connection retry timer;
  * @flags	- atomic flags related to server connection's state;
  * @qsize	- current number of requests in server's @fwd_queue;
  * @recns	- the number of reconnect attempts;
  * @msg_sent	- request that was sent last in a server connection;
  * @jbusytstamp - timestamp (in jiffies) until which connection is considered
  *		  as inactive due to busy corresponding work queue;
+ * @cpu		- CPU processing ingress data of the connection, -1 if it's
+ *		  unknown yet;
+ * @h2		- HTTP/2 context, allocated on the first connection to the
+ *		  server speaking HTTP/2;
+ * @hedge_timer	- timer hedging slow requests, see tfw_http_hedge_timer_cb();
+ * @jhedge	- last response time of the server after which requests are
+ *		  hedged, in jiffies;
+ * @jresp	- time the last response started to come, in jiffies;
+ * @tunnel	- client connection the server data is passed to as is after
+ *		  a protocol switch;
+ * @rx_plist	- member in @rx_paused list of a client connection;
  */
 typedef struct {
 	TFW_CONN_COMMON;
 	struct list_head	fwd_queue;
 	struct list_head	nip_queue;
 	spinlock_t		fwd_qlock;
+	struct llist_head	fwd_inq;
+	struct timer_list	timer;
 	unsigned long		flags;
 	unsigned int		qsize;
 	unsigned int		recns;
 	TfwMsg			*msg_sent;
 	unsigned long		jbusytstamp;
+	int			cpu;
+	TfwH2SrvCtx		*h2;
+	struct timer_list	hedge_timer;
+	unsigned long		jhedge;
+	unsigned long		jresp;
+	TfwConn			*tunnel;
+	struct list_head	rx_plist;
 } TfwSrvConn;
 
 #define TFW_CONN_DEATHCNT	(INT_MIN / 2)
@@ -193,21 +235,47 @@ enum {
 	TFW_CONN_B_QFORWD,
 	/* Has non-idempotent requests. */
 	TFW_CONN_B_HASNIP,
+	/* Requests are forwarded over HTTP/2. */
+	TFW_CONN_B_H2,
 
 	/* Remove connection */
 	TFW_CONN_B_DEL,
 	/* Connection is in use or at least scheduled to be established. */
 	TFW_CONN_B_ACTIVE,
 	/* Connection is disconnected and stopped. */
-	TFW_CONN_B_STOPPED
+	TFW_CONN_B_STOPPED,
+	/* Idle connection is closed to shrink the connection pool. */
+	TFW_CONN_B_SHRINK,
+	/* Connection is closed and kept in the pool for a load growth. */
+	TFW_CONN_B_PARKED,
+	/* Connection is switched to another protocol and tunneled to a client. */
+	TFW_CONN_B_TUNNEL,
+	/* Reading is paused until a client reads the forwarded data. */
+	TFW_CONN_B_RXPAUSE
 };
 
 /**
  * TLS hardened connection.
+ *
+ * @hs_cpu	- CPU processing the TLS handshake of the connection;
+ * @hs_pending	- number of skbs queued to @hs_cpu and not processed yet,
+ *		  protected by the TLS context lock;
+ * @hs_drop	- the connection was dropped on @hs_cpu, just free the
+ *		  rest of the queued skbs;
+ * @hs_admitted	- the handshake passed the admission checks;
+ * @rec_bytes	- bytes sent in small TLS records since the handshake or
+ *		  the last idle period;
+ * @rec_ts	- time of the last TLS record transmission, jiffies;
  */
 typedef struct {
 	TfwCliConn	cli_conn;
 	TlsCtx		tls;
+	int		hs_cpu;
+	unsigned int	hs_pending;
+	bool		hs_drop;
+	bool		hs_admitted;
+	unsigned int	rec_bytes;
+	unsigned long	rec_ts;
 } TfwTlsConn;
 
 #define tfw_tls_context(conn)	((TlsCtx *)(&((TfwTlsConn *)conn)->tls))
@@ -290,11 +358,16 @@ extern TfwConnHooks *conn_hooks[TFW_CONN_MAX_PROTOS];
  * be re-sent to a back-end server. The new connection is not available
  * to schedulers (restricted) until all messages in the forwarding queue
  * are re-sent.
+ *
+ * The flag TUNNEL is set when the connection is switched to another
+ * protocol, e.g. WebSocket, and belongs to a single client until it's
+ * closed.
  */
 static inline bool
 tfw_srv_conn_restricted(TfwSrvConn *srv_conn)
 {
-	return test_bit(TFW_CONN_B_RESEND, &srv_conn->flags);
+	return test_bit(TFW_CONN_B_RESEND, &srv_conn->flags)
+	       || test_bit(TFW_CONN_B_TUNNEL, &srv_conn->flags);
 }
 
 /*
@@ -306,6 +379,26 @@ tfw_srv_conn_hasnip(TfwSrvConn *srv_conn)
 	return test_bit(TFW_CONN_B_HASNIP, &srv_conn->flags);
 }
 
+/*
+ * Tell if requests are forwarded to the server over HTTP/2.
+ */
+static inline bool
+tfw_srv_conn_h2(TfwSrvConn *srv_conn)
+{
+	return test_bit(TFW_CONN_B_H2, &srv_conn->flags);
+}
+
+/*
+ * Peer connection of the tunnel @conn belongs to, NULL if @conn isn't a tunnel.
+ */
+static inline TfwConn **
+tfw_conn_tunnel(TfwConn *conn)
+{
+	if (TFW_CONN_TYPE(conn) & Conn_Clnt)
+		return &((TfwCliConn *)conn)->tunnel;
+	return &((TfwSrvConn *)conn)->tunnel;
+}
+
 /*
  * Tell if connection is temporary inactive due to full work queue.
  */
@@ -328,6 +421,30 @@ tfw_srv_set_busy_delay(TfwSrvConn *conn)
 	WRITE_ONCE(conn->jbusytstamp, jiffies + msecs_to_jiffies(30));
 }
 
+/* Locality of a server connection to the current CPU. */
+enum {
+	TFW_SRV_CONN_REMOTE = 0,
+	TFW_SRV_CONN_NODE,
+	TFW_SRV_CONN_CPU,
+};
+
+/*
+ * Tell if ingress data of the connection, i.e. responses, are processed by
+ * the current CPU or NUMA node. Forwarding to such a connection doesn't
+ * move the request and the response between CPUs.
+ */
+static inline int
+tfw_srv_conn_locality(TfwSrvConn *conn)
+{
+	int cpu = READ_ONCE(conn->cpu);
+
+	if (cpu == raw_smp_processor_id())
+		return TFW_SRV_CONN_CPU;
+	if (cpu >= 0 && cpu_to_node(cpu) == numa_node_id())
+		return TFW_SRV_CONN_NODE;
+	return TFW_SRV_CONN_REMOTE;
+}
+
 static inline bool
 tfw_connection_live(TfwConn *conn)
 {
@@ -443,6 +560,7 @@ tfw_connection_unlink_from_sk(struct sock *sk)
 
 	sk->sk_data_ready = NULL;
 	sk->sk_state_change = NULL;
+	sk->sk_write_space = NULL;
 	sk->sk_write_xmit = NULL;
 
 	sk->sk_user_data = NULL;
@@ -505,6 +623,7 @@ void tfw_connection_link_peer(TfwConn *conn, TfwPeer *peer);
 int tfw_connection_new(TfwConn *conn);
 void tfw_connection_repair(TfwConn *conn);
 int tfw_connection_close(TfwConn *conn, bool sync);
+int tfw_connection_abort(TfwConn *conn, bool sync);
 void tfw_connection_drop(TfwConn *conn);
 void tfw_connection_release(TfwConn *conn);
 
@@ -0,0 +1,264 @@
+/**
+ *		Tempesta FW
+ *
+ * Partitioning of the CPUs by roles. Softirqs of the data path land on the
+ * CPUs chosen by RSS and IRQ affinity, but the work which Tempesta FW moves
+ * to other CPUs by itself, i.e. TLS handshakes, cache write-behind and
+ * service timers, is placed to the dedicated CPU sets, so it doesn't delay
+ * forwarding of HTTP messages.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <linux/kernel_stat.h>
+#include <linux/topology.h>
+
+#include "tempesta_fw.h"
+#include "cpu_role.h"
+#include "log.h"
+
+const char *tfw_cpu_role_names[_TFW_CPU_ROLE_NUM] = {
+	[TFW_CPU_DATA]	= "data_path",
+	[TFW_CPU_HS]	= "handshake",
+	[TFW_CPU_BG]	= "background",
+};
+
+cpumask_t tfw_cpu_roles[_TFW_CPU_ROLE_NUM];
+static cpumask_t tfw_cpu_roles_reconfig[_TFW_CPU_ROLE_NUM];
+
+/*
+ * The last chosen CPU of each role. Each CPU walks the role sets from its own
+ * position, so no shared state is updated on the fast path.
+ */
+typedef struct {
+	int	last[_TFW_CPU_ROLE_NUM];
+} TfwCpuRoleRr;
+
+static DEFINE_PER_CPU(TfwCpuRoleRr, tfw_cpu_role_rr);
+
+/**
+ * Choose a CPU with @role on NUMA @node, or on any node for NUMA_NO_NODE,
+ * in round-robin manner. Return -1 if there is no such CPU.
+ *
+ * The function may be called with enabled preemption, a lost update of
+ * the round-robin position just makes the distribution a bit less even.
+ */
+int
+tfw_cpu_role_next(int role, int node)
+{
+	int cpu, *last = &raw_cpu_ptr(&tfw_cpu_role_rr)->last[role];
+	const struct cpumask *nm = node == NUMA_NO_NODE
+				   ? cpu_online_mask
+				   : cpumask_of_node(node);
+
+	cpu = cpumask_next_and(*last, &tfw_cpu_roles[role], nm);
+	if (cpu >= nr_cpu_ids) {
+		cpu = cpumask_first_and(&tfw_cpu_roles[role], nm);
+		if (cpu >= nr_cpu_ids)
+			return -1;
+	}
+	*last = cpu;
+
+	return cpu;
+}
+
+/**
+ * Arm a TIMER_PINNED service timer @t on a background CPU. The timer stays on
+ * the current CPU if it's a background one or there are no background CPUs.
+ * The caller must own the timer arming, i.e. call the function on timer
+ * creation or from the timer callback.
+ */
+void
+tfw_cpu_role_timer(struct timer_list *t, unsigned long expires)
+{
+	int cpu;
+
+	if (tfw_cpu_role_empty(TFW_CPU_BG)
+	    || tfw_cpu_role_test(TFW_CPU_BG, raw_smp_processor_id())
+	    || timer_pending(t)
+	    || (cpu = tfw_cpu_role_next(TFW_CPU_BG, NUMA_NO_NODE)) < 0)
+	{
+		mod_timer(t, expires);
+		return;
+	}
+
+	t->expires = expires;
+	add_timer_on(t, cpu);
+}
+
+/**
+ * Collect the number of CPUs and the kernel time spent by the CPUs of each
+ * role into @st, which must have _TFW_CPU_ROLE_NUM entries. User time isn't
+ * accounted since all Tempesta FW work runs in the kernel.
+ */
+void
+tfw_cpu_role_stat(TfwCpuRoleStat *st)
+{
+	int cpu, r;
+
+	memset(st, 0, sizeof(*st) * _TFW_CPU_ROLE_NUM);
+
+	for_each_online_cpu(cpu) {
+		u64 *ct = kcpustat_cpu(cpu).cpustat;
+
+		for (r = 0; r < _TFW_CPU_ROLE_NUM; ++r) {
+			if (!tfw_cpu_role_test(r, cpu))
+				continue;
+			st[r].cpus++;
+			st[r].busy += ct[CPUTIME_SYSTEM] + ct[CPUTIME_IRQ]
+				      + ct[CPUTIME_SOFTIRQ];
+		}
+	}
+}
+
+static int
+tfw_cpu_role_cfgstart(void)
+{
+	int r;
+
+	for (r = 0; r < _TFW_CPU_ROLE_NUM; ++r)
+		cpumask_clear(&tfw_cpu_roles_reconfig[r]);
+
+	return 0;
+}
+
+/**
+ * The roles are checked when all the sets are parsed since the handshake
+ * CPUs are configured by the TLS module.
+ */
+static int
+tfw_cpu_role_cfgend(void)
+{
+	int r, i;
+	cpumask_t *m = tfw_cpu_roles_reconfig;
+
+	for (r = 0; r < _TFW_CPU_ROLE_NUM; ++r)
+		for (i = r + 1; i < _TFW_CPU_ROLE_NUM; ++i) {
+			if (!cpumask_intersects(&m[r], &m[i]))
+				continue;
+			T_ERR_NL("CPU roles '%s' and '%s' have the same CPUs\n",
+				 tfw_cpu_role_names[r], tfw_cpu_role_names[i]);
+			return -EINVAL;
+		}
+
+	if (cpumask_empty(&m[TFW_CPU_DATA])) {
+		cpumask_andnot(&m[TFW_CPU_DATA], cpu_online_mask,
+			       &m[TFW_CPU_HS]);
+		cpumask_andnot(&m[TFW_CPU_DATA], &m[TFW_CPU_DATA],
+			       &m[TFW_CPU_BG]);
+	}
+	if (cpumask_empty(&m[TFW_CPU_DATA])) {
+		T_ERR_NL("No CPUs left for the data path, reduce the handshake"
+			 " or background CPU sets\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int
+tfw_cpu_role_start(void)
+{
+	int r;
+
+	for (r = 0; r < _TFW_CPU_ROLE_NUM; ++r)
+		cpumask_copy(&tfw_cpu_roles[r], &tfw_cpu_roles_reconfig[r]);
+
+	return 0;
+}
+
+/**
+ * Parse the CPU list of @role, the list must contain online CPUs only.
+ */
+int
+tfw_cpu_role_cfg(TfwCfgSpec *cs, TfwCfgEntry *ce, int role)
+{
+	int r;
+	cpumask_t *m = &tfw_cpu_roles_reconfig[role];
+
+	if ((r = tfw_cfg_check_single_val(ce)))
+		return r;
+
+	if (cpulist_parse(ce->vals[0], m)) {
+		T_ERR_NL("%s: invalid CPU list '%s'\n", cs->name, ce->vals[0]);
+		return -EINVAL;
+	}
+	if (cpumask_empty(m) || !cpumask_subset(m, cpu_online_mask)) {
+		T_ERR_NL("%s: CPU list '%s' must contain online CPUs only\n",
+			 cs->name, ce->vals[0]);
+		cpumask_clear(m);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int
+tfw_cfgop_cpu_data_path(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	return tfw_cpu_role_cfg(cs, ce, TFW_CPU_DATA);
+}
+
+static int
+tfw_cfgop_cpu_background(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	return tfw_cpu_role_cfg(cs, ce, TFW_CPU_BG);
+}
+
+static TfwCfgSpec tfw_cpu_role_specs[] = {
+	{
+		.name = "cpu_data_path",
+		.deflt = NULL,
+		.handler = tfw_cfgop_cpu_data_path,
+		.allow_none = true,
+		.allow_reconfig = true,
+	},
+	{
+		.name = "cpu_background",
+		.deflt = NULL,
+		.handler = tfw_cfgop_cpu_background,
+		.allow_none = true,
+		.allow_reconfig = true,
+	},
+	{ 0 }
+};
+
+TfwMod tfw_cpu_role_mod = {
+	.name		= "cpu_role",
+	.cfgstart	= tfw_cpu_role_cfgstart,
+	.cfgend		= tfw_cpu_role_cfgend,
+	.start		= tfw_cpu_role_start,
+	.specs		= tfw_cpu_role_specs,
+};
+
+int __init
+tfw_cpu_role_init(void)
+{
+	int cpu, r;
+
+	for_each_possible_cpu(cpu)
+		for (r = 0; r < _TFW_CPU_ROLE_NUM; ++r)
+			per_cpu(tfw_cpu_role_rr, cpu).last[r] = -1;
+	tfw_mod_register(&tfw_cpu_role_mod);
+
+	return 0;
+}
+
+void
+tfw_cpu_role_exit(void)
+{
+	tfw_mod_unregister(&tfw_cpu_role_mod);
+}
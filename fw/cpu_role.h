@@ -0,0 +1,74 @@
+/**
+ *		Tempesta FW
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __TFW_CPU_ROLE_H__
+#define __TFW_CPU_ROLE_H__
+
+#include <linux/cpumask.h>
+#include <linux/timer.h>
+
+#include "cfg.h"
+
+/*
+ * Roles of the CPUs. The sets don't intersect.
+ *
+ * TFW_CPU_DATA	- forwarding of HTTP messages, all the CPUs which have no
+ *		  other role if the set isn't configured explicitly;
+ * TFW_CPU_HS	- TLS handshakes offloaded from the data path CPUs;
+ * TFW_CPU_BG	- background work: cache write-behind and service timers.
+ */
+enum {
+	TFW_CPU_DATA,
+	TFW_CPU_HS,
+	TFW_CPU_BG,
+	_TFW_CPU_ROLE_NUM
+};
+
+extern const char *tfw_cpu_role_names[_TFW_CPU_ROLE_NUM];
+extern cpumask_t tfw_cpu_roles[_TFW_CPU_ROLE_NUM];
+
+/**
+ * Per role CPU time statistics for perfstat.
+ *
+ * @cpus	- number of the online CPUs with the role;
+ * @busy	- system, IRQ and softirq time of the CPUs in nanoseconds;
+ */
+typedef struct {
+	unsigned int	cpus;
+	u64		busy;
+} TfwCpuRoleStat;
+
+static inline bool
+tfw_cpu_role_empty(int role)
+{
+	return cpumask_empty(&tfw_cpu_roles[role]);
+}
+
+static inline bool
+tfw_cpu_role_test(int role, int cpu)
+{
+	return cpumask_test_cpu(cpu, &tfw_cpu_roles[role]);
+}
+
+int tfw_cpu_role_next(int role, int node);
+void tfw_cpu_role_timer(struct timer_list *t, unsigned long expires);
+int tfw_cpu_role_cfg(TfwCfgSpec *cs, TfwCfgEntry *ce, int role);
+void tfw_cpu_role_stat(TfwCpuRoleStat *st);
+
+#endif /* __TFW_CPU_ROLE_H__ */
@@ -36,6 +36,7 @@
 #include <linux/netfilter.h>
 #include <linux/netfilter_ipv4.h>
 #include <linux/netfilter_ipv6.h>
+#include <linux/vmalloc.h>
 #include <net/tcp.h>
 
 #include "tdb.h"
@@ -55,12 +56,63 @@ typedef struct {
 	int		action;
 } TfwFRule;
 
+/*
+ * Blocked networks are stored in multibit tries with controlled prefix
+ * expansion, DIR-16-8-8 for IPv4 and 16-8-...-8 for IPv6, so an IPv4 lookup
+ * reads at most 3 entries. The entries are either indexes of child nodes or
+ * leaves of blocked prefixes with TFW_FNET_LEAF bit set and the prefix
+ * length in the lower bits.
+ *
+ * The nodes are allocated from a preallocated pool, so the memory is bounded
+ * and networks can be blocked from softirq context. A prefix covering
+ * already blocked longer prefixes replaces their subtrees by leaves and the
+ * subtree nodes aren't reused until restart: lockless readers can still
+ * walk them.
+ */
+#define TFW_FNET_ROOT_BITS	16
+#define TFW_FNET_BITS		8
+#define TFW_FNET_LEAF		0x80000000U
+
+enum {
+	TFW_FNET_V4,
+	TFW_FNET_V6,
+	_TFW_FNET_NUM
+};
+
+typedef struct {
+	u32		e[1 << TFW_FNET_BITS];
+} TfwFNetNode;
+
+/**
+ * Tries of blocked networks.
+ *
+ * @root	- root tables of IPv4 and IPv6 tries;
+ * @lock	- serializes the trie updates;
+ * @nodes_n	- number of used nodes, the node 0 is never used;
+ * @nodes_max	- size of the nodes pool;
+ * @nodes	- the nodes pool;
+ */
+typedef struct {
+	u32		root[_TFW_FNET_NUM][1 << TFW_FNET_ROOT_BITS];
+	spinlock_t	lock;
+	unsigned int	nodes_n;
+	unsigned int	nodes_max;
+	TfwFNetNode	nodes[0];
+} TfwFNet;
+
 static struct {
 	unsigned int	db_size;
 	const char	*db_path;
+	unsigned int	net_size;
+	unsigned int	nets_n;
+	TfwAddr		*nets;
 } filter_cfg __read_mostly;
 
-static TDB *ip_filter_db;
+/* Blocked addresses are looked up on each packet, so use local memory. */
+static TdbRepl *ip_filter_db;
+static TfwFNet *ip_filter_net;
+/* Whether there are any blocked networks. */
+static bool ip_filter_net_used __read_mostly;
 
 static unsigned long
 tfw_ipv6_hash(const struct in6_addr *addr)
@@ -83,14 +135,116 @@ tfw_filter_block_ip(const TfwAddr *addr)
 
 	T_DBG_ADDR("filter: block", addr, TFW_NO_PORT);
 
-	/* TODO create records on all NUMA nodes. */
-	if (!tdb_entry_create(ip_filter_db, key, &rule, &len)) {
+	if (!tdb_repl_create(ip_filter_db, key, &rule, &len)) {
 		T_WARN_ADDR("cannot create blocking rule", addr, TFW_NO_PORT);
 	} else {
 		T_DBG_ADDR("block client", addr, TFW_NO_PORT);
 	}
 }
 
+static void
+__fnet_set(u32 *e, unsigned int plen)
+{
+	u32 v = READ_ONCE(*e);
+
+	/* A shorter or the same prefix is already blocked. */
+	if ((v & TFW_FNET_LEAF) && (v & ~TFW_FNET_LEAF) <= plen)
+		return;
+	WRITE_ONCE(*e, TFW_FNET_LEAF | plen);
+}
+
+/**
+ * Insert prefix of @plen bits of address @a to trie @f of IPv4 or IPv6
+ * addresses. The longer prefixes inside a blocked one aren't stored.
+ */
+static int
+tfw_fnet_insert(TfwFNet *fn, int f, const u8 *a, unsigned int plen)
+{
+	u32 *t = fn->root[f];
+	unsigned int idx = (a[0] << 8) | a[1];
+	unsigned int bits = TFW_FNET_ROOT_BITS, off = 0, i, span;
+	int r = 0;
+
+	spin_lock_bh(&fn->lock);
+	for ( ; ; ) {
+		u32 e;
+
+		if (plen <= off + bits) {
+			span = 1 << (off + bits - plen);
+			idx &= ~(span - 1);
+			for (i = 0; i < span; ++i)
+				__fnet_set(&t[idx + i], plen);
+			break;
+		}
+		e = t[idx];
+		if (e & TFW_FNET_LEAF)
+			break;
+		if (!e) {
+			if (fn->nodes_n == fn->nodes_max) {
+				r = -ENOMEM;
+				break;
+			}
+			e = fn->nodes_n++;
+			bzero_fast(&fn->nodes[e], sizeof(TfwFNetNode));
+			/* Publish the initialized node. */
+			smp_store_release(&t[idx], e);
+		}
+		t = fn->nodes[e].e;
+		off += bits;
+		bits = TFW_FNET_BITS;
+		idx = a[off / 8];
+	}
+	spin_unlock_bh(&fn->lock);
+
+	return r;
+}
+
+static bool
+tfw_fnet_match(TfwFNet *fn, int f, const u8 *a)
+{
+	u32 e = READ_ONCE(fn->root[f][(a[0] << 8) | a[1]]);
+
+	for (a += 2; e && !(e & TFW_FNET_LEAF); ++a)
+		e = READ_ONCE(fn->nodes[e].e[*a]);
+
+	return e;
+}
+
+/**
+ * Block network @addr/@prefix, where @prefix is the prefix length of IPv6
+ * or v4-mapped address. If the network can't be blocked, only the address
+ * itself is blocked.
+ */
+void
+tfw_filter_block_net(const TfwAddr *addr, unsigned int prefix)
+{
+	const struct in6_addr *a = &addr->sin6_addr;
+	int r;
+
+	if (prefix >= 128) {
+		tfw_filter_block_ip(addr);
+		return;
+	}
+
+	T_DBG_ADDR("filter: block network", addr, TFW_NO_PORT);
+
+	if (ipv6_addr_v4mapped(a)) {
+		if (WARN_ON_ONCE(prefix <= 96))
+			return;
+		r = tfw_fnet_insert(ip_filter_net, TFW_FNET_V4, &a->s6_addr[12],
+				    prefix - 96);
+	} else {
+		r = tfw_fnet_insert(ip_filter_net, TFW_FNET_V6, a->s6_addr,
+				    prefix);
+	}
+	if (r) {
+		T_WARN_ADDR("no space for blocked network", addr, TFW_NO_PORT);
+		tfw_filter_block_ip(addr);
+		return;
+	}
+	WRITE_ONCE(ip_filter_net_used, true);
+}
+
 /**
  * Drop early IP layer filtering.
  * The check is run against each ingress packet - if application layer filter
@@ -101,15 +255,26 @@ static int
 tfw_filter_check_ip(struct in6_addr *addr)
 {
 	TdbIter iter;
+	TDB *db = tdb_repl_local(ip_filter_db);
+
+	if (READ_ONCE(ip_filter_net_used)) {
+		bool m = ipv6_addr_v4mapped(addr)
+			 ? tfw_fnet_match(ip_filter_net, TFW_FNET_V4,
+					  &addr->s6_addr[12])
+			 : tfw_fnet_match(ip_filter_net, TFW_FNET_V6,
+					  addr->s6_addr);
+		if (m)
+			return TFW_BLOCK;
+	}
 
-	iter = tdb_rec_get(ip_filter_db, tfw_ipv6_hash(addr));
+	iter = tdb_rec_get(db, tfw_ipv6_hash(addr));
 	while (!TDB_ITER_BAD(iter)) {
 		const TfwFRule *rule = (TfwFRule *)iter.rec->data;
 		if (!memcmp_fast(&rule->addr, addr, sizeof(*addr))) {
 			tdb_rec_put(iter.rec);
 			return rule->action == TFW_F_DROP ? TFW_BLOCK : TFW_PASS;
 		}
-		tdb_rec_next(ip_filter_db, &iter);
+		tdb_rec_next(db, &iter);
 	}
 
 	return TFW_PASS;
@@ -287,6 +452,26 @@ static struct pernet_operations tfw_net_ops = {
 	.exit = tfw_nf_unregister,
 };
 
+static int
+tfw_filter_net_init(void)
+{
+	unsigned int i, n = filter_cfg.net_size / sizeof(TfwFNetNode);
+
+	ip_filter_net = vzalloc(sizeof(TfwFNet) + n * sizeof(TfwFNetNode));
+	if (!ip_filter_net)
+		return -ENOMEM;
+	spin_lock_init(&ip_filter_net->lock);
+	ip_filter_net->nodes_n = 1;
+	ip_filter_net->nodes_max = n;
+	ip_filter_net_used = false;
+
+	for (i = 0; i < filter_cfg.nets_n; ++i)
+		tfw_filter_block_net(&filter_cfg.nets[i],
+				     filter_cfg.nets[i].in6_prefix);
+
+	return 0;
+}
+
 static int
 tfw_filter_start(void)
 {
@@ -295,18 +480,26 @@ tfw_filter_start(void)
 	if (tfw_runstate_is_reconfig())
 		return 0;
 
-	ip_filter_db = tdb_open(filter_cfg.db_path, filter_cfg.db_size,
-				sizeof(TfwFRule), numa_node_id());
+	ip_filter_db = tdb_repl_open(filter_cfg.db_path, filter_cfg.db_size,
+				     sizeof(TfwFRule));
 	if (!ip_filter_db)
 		return -EINVAL;
+	if ((r = tfw_filter_net_init()))
+		goto err_net;
 
 	if ((r = register_pernet_subsys(&tfw_net_ops)))	{
 		T_ERR_NL("can't register netfilter hooks\n");
-		tdb_close(ip_filter_db);
-		return r;
+		goto err_nf;
 	}
 
 	return 0;
+err_nf:
+	vfree(ip_filter_net);
+	ip_filter_net = NULL;
+err_net:
+	tdb_repl_close(ip_filter_db);
+	ip_filter_db = NULL;
+	return r;
 }
 
 static void
@@ -316,10 +509,63 @@ tfw_filter_stop(void)
 		return;
 	if (ip_filter_db) {
 		unregister_pernet_subsys(&tfw_net_ops);
-		tdb_close(ip_filter_db);
+		tdb_repl_close(ip_filter_db);
+		ip_filter_db = NULL;
+		synchronize_net();
+		vfree(ip_filter_net);
+		ip_filter_net = NULL;
 	}
 }
 
+/**
+ * Process 'filter_block' directive: the networks are blocked on start.
+ */
+static int
+tfw_cfgop_filter_block(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	size_t i;
+	const char *val;
+	TfwAddr *nets;
+
+	if (ce->attr_n) {
+		T_ERR_NL("%s: Arguments may not have the '=' sign\n",
+			 cs->name);
+		return -EINVAL;
+	}
+	if (!ce->val_n)
+		return -EINVAL;
+
+	nets = krealloc(filter_cfg.nets, (filter_cfg.nets_n + ce->val_n)
+				 * sizeof(TfwAddr), GFP_KERNEL);
+	if (!nets)
+		return -ENOMEM;
+	filter_cfg.nets = nets;
+
+	TFW_CFG_ENTRY_FOR_EACH_VAL(ce, i, val) {
+		TfwAddr *addr = &filter_cfg.nets[filter_cfg.nets_n];
+
+		memset(addr, 0, sizeof(*addr));
+		if (tfw_addr_pton_cidr(val, addr)
+		    || (tfw_addr_is_v4mapped(addr) && addr->in6_prefix <= 96))
+		{
+			T_ERR_NL("%s: Invalid address or network: '%s'\n",
+				 cs->name, val);
+			return -EINVAL;
+		}
+		++filter_cfg.nets_n;
+	}
+
+	return 0;
+}
+
+static void
+tfw_cfgop_cleanup_filter_block(TfwCfgSpec *cs)
+{
+	kfree(filter_cfg.nets);
+	filter_cfg.nets = NULL;
+	filter_cfg.nets_n = 0;
+}
+
 static TfwCfgSpec tfw_filter_specs[] = {
 	{
 		.name = "filter_tbl_size",
@@ -340,6 +586,23 @@ static TfwCfgSpec tfw_filter_specs[] = {
 			.len_range = { 1, PATH_MAX },
 		}
 	},
+	{
+		.name = "filter_net_tbl_size",
+		.deflt = "4194304",
+		.handler = tfw_cfg_set_int,
+		.dest = &filter_cfg.net_size,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.multiple_of = PAGE_SIZE,
+			.range = { PAGE_SIZE, (1 << 30) },
+		}
+	},
+	{
+		.name = "filter_block",
+		.handler = tfw_cfgop_filter_block,
+		.allow_none = true,
+		.allow_repeat = true,
+		.cleanup = tfw_cfgop_cleanup_filter_block,
+	},
 	{ 0 }
 };
 
@@ -24,5 +24,6 @@
 #include "addr.h"
 
 void tfw_filter_block_ip(const TfwAddr *addr);
+void tfw_filter_block_net(const TfwAddr *addr, unsigned int prefix);
 
 #endif /* __TFW_FILTER_H__ */
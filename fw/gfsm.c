@@ -56,6 +56,11 @@
  * A subroutine yields it's control flow by moving to the next state using
  * tfw_gfsm_move().
  *
+ * The registered hooks are compiled into per-state arrays ordered by priority,
+ * so moving to a state only walks the hooks which are actually set for the
+ * state. Hooks switching to disabled FSMs, e.g. security modules without
+ * configured limits, aren't compiled into the arrays at all.
+ *
  * Copyright (C) 2014 NatSys Lab. (info@natsys-lab.com).
  * Copyright (C) 2015-2018 Tempesta Technologies, Inc.
  *
@@ -73,6 +78,9 @@
  * this program; if not, write to the Free Software Foundation, Inc., 59
  * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+
 #include "gfsm.h"
 #include "log.h"
 
@@ -102,6 +110,32 @@ static TfwFsmHook fsm_hooks[TFW_FSM_NUM][GFSM_HOOK_N] __read_mostly;
  * For each FSM there are 16 priorities by 32 states, see gfsm.h.
  */
 static unsigned int fsm_hooks_bm[TFW_FSM_NUM][TFW_GFSM_WC_BMAP_SZ];
+/* Bitmap of FSMs hooks switching to which are skipped. */
+static unsigned long fsm_disabled;
+
+/**
+ * Hooks set for a state of an FSM.
+ *
+ * @n		- number of the hooks;
+ * @hooks	- the hooks in the order of their priorities;
+ */
+typedef struct {
+	unsigned int	n;
+	TfwFsmHook	hooks[TFW_GFSM_PRIO_N];
+} TfwFsmDisp;
+
+typedef struct {
+	TfwFsmDisp	st[TFW_FSM_NUM][TFW_GFSM_STATE_N];
+} TfwFsmDispTbl;
+
+/*
+ * Hooks dispatch tables used by tfw_gfsm_move(). A table is rebuilt in the
+ * copy which isn't in use on each change of the registered hooks, which
+ * happens rarely and in process context only.
+ */
+static TfwFsmDispTbl fsm_disp[2] __read_mostly;
+static TfwFsmDispTbl __rcu *fsm_disp_cur = RCU_INITIALIZER(&fsm_disp[0]);
+static DEFINE_MUTEX(fsm_disp_mtx);
 
 /**
  * The function must be called by first FSM processing @obj or
@@ -135,11 +169,10 @@ __gfsm_fsm_lookup(TfwGState *st, int fsm_id, int *free_slot)
  * Context switch from current FSM at state @state to next FSM.
  */
 static int
-tfw_gfsm_switch(TfwGState *st, int state, int prio)
+tfw_gfsm_switch(TfwGState *st, int state, const TfwFsmHook *hook)
 {
-	int shift = prio * TFW_GFSM_STATE_N + (state & TFW_GFSM_STATE_MASK);
 	int fsm_curr = state >> TFW_GFSM_FSM_SHIFT;
-	int fsm_next = fsm_hooks[fsm_curr][shift].fsm_id;
+	int fsm_next = hook->fsm_id;
 	int free_slot;
 
 	st->curr = __gfsm_fsm_lookup(st, fsm_next, &free_slot);
@@ -147,7 +180,7 @@ tfw_gfsm_switch(TfwGState *st, int state, int prio)
 		/* Create new clear state for the next FSM. */
 		BUG_ON(free_slot < 0);
 		st->curr = free_slot;
-		FSM_STATE(st) = fsm_hooks[fsm_curr][shift].st0;
+		FSM_STATE(st) = hook->st0;
 	}
 
 	T_DBG3("GFSM switch from fsm %d at state %d to fsm %d at state %#x\n",
@@ -208,40 +241,31 @@ tfw_gfsm_dispatch(TfwGState *st, void *obj, TfwFsmData *data)
  * Move the FSM with descriptor @st to new the state @state and call all
  * registered hooks for it.
  *
- * Iterates over all priorities for current state of top (current) FSM and
- * switch to the registered FSMs.
- *
- * Currently there is TFW_GFSM_WC_BMAP_SZ priorities (and each priority
- * has 32-bit states bitmap), so we use this fact to speedup the iteration.
+ * Iterates over the hooks for current state of top (current) FSM, starting
+ * from the highest priority, and switch to the registered FSMs.
  */
 int
 tfw_gfsm_move(TfwGState *st, unsigned short state, TfwFsmData *data)
 {
-	int r = TFW_PASS, p, fsm;
-	unsigned int *hooks = fsm_hooks_bm[FSM(st)];
-	unsigned long mask = 1 << (state & TFW_GFSM_STATE_MASK);
+	int r = TFW_PASS, fsm;
+	unsigned int i;
+	const TfwFsmDisp *disp;
 	unsigned char curr_st = st->curr;
 
 	T_DBG3("GFSM move %#x -> %#x: skb=%pK req=%pK resp=%pK\n",
 	       FSM_STATE(st), state, data->skb, data->req, data->resp);
 
+	rcu_read_lock();
+	disp = &rcu_dereference(fsm_disp_cur)->st[FSM(st)]
+						  [state & TFW_GFSM_STATE_MASK];
+
 	/* Remember current FSM context. */
 	FSM_STATE(st) = (FSM_STATE(st) & ~TFW_GFSM_STATE_MASK) |
 			(state & TFW_GFSM_STATE_MASK);
 
-	/* Start from highest priority. */
-	for (p = TFW_GFSM_HOOK_PRIORITY_HIGH;
-	     p < TFW_GFSM_HOOK_PRIORITY_NUM; ++p)
-	{
-		/*
-		 * TODO Handle different priorities by ordering the hooks,
-		 * rather than fixed priority levels to avoid spinning in vain.
-		 */
-		if (!(hooks[p] & mask))
-			goto done;
-
+	for (i = 0; i < disp->n; ++i) {
 		/* Switch context to other FSM. */
-		fsm = tfw_gfsm_switch(st, state, p);
+		fsm = tfw_gfsm_switch(st, state, &disp->hooks[i]);
 
 		/*
 		 * Don't execute FSM handler who executed us,
@@ -264,6 +288,7 @@ tfw_gfsm_move(TfwGState *st, unsigned short state, TfwFsmData *data)
 		}
 	}
 done:
+	rcu_read_unlock();
 	/* Restore current FSM context. */
 	st->curr = curr_st;
 
@@ -283,6 +308,62 @@ tfw_gfsm_debug_state(TfwGState *st, const char *msg)
 }
 #endif
 
+/**
+ * Compile the registered hooks of enabled FSMs into the dispatch table which
+ * isn't in use and switch to it.
+ */
+static void
+__tfw_gfsm_disp_build(void)
+{
+	TfwFsmDispTbl *tbl;
+	int fsm, p, s;
+
+	lockdep_assert_held(&fsm_disp_mtx);
+
+	tbl = rcu_dereference_protected(fsm_disp_cur,
+					lockdep_is_held(&fsm_disp_mtx));
+	tbl = tbl == &fsm_disp[0] ? &fsm_disp[1] : &fsm_disp[0];
+	memset(tbl, 0, sizeof(*tbl));
+
+	for (fsm = 0; fsm < TFW_FSM_NUM; ++fsm)
+		for (p = TFW_GFSM_HOOK_PRIORITY_HIGH;
+		     p < TFW_GFSM_HOOK_PRIORITY_NUM; ++p)
+			for (s = 1; s < TFW_GFSM_STATE_N; ++s) {
+				TfwFsmHook *h;
+				TfwFsmDisp *d = &tbl->st[fsm][s];
+
+				if (!(fsm_hooks_bm[fsm][p] & (1U << s)))
+					continue;
+				h = &fsm_hooks[fsm][p * TFW_GFSM_STATE_N + s];
+				if (test_bit(h->fsm_id, &fsm_disabled))
+					continue;
+				d->hooks[d->n++] = *h;
+			}
+
+	rcu_assign_pointer(fsm_disp_cur, tbl);
+	/* The previous table can be rebuilt next time. */
+	synchronize_rcu();
+}
+
+/**
+ * Enable or disable all the hooks switching to FSM @fsm_id, so modules
+ * which have nothing to do with current configuration don't cost anything
+ * on the hot path. All FSMs are enabled by default.
+ */
+void
+tfw_gfsm_enable_fsm(int fsm_id, bool enable)
+{
+	mutex_lock(&fsm_disp_mtx);
+	if (enable != !test_bit(fsm_id, &fsm_disabled)) {
+		if (enable)
+			__clear_bit(fsm_id, &fsm_disabled);
+		else
+			__set_bit(fsm_id, &fsm_disabled);
+		__tfw_gfsm_disp_build();
+	}
+	mutex_unlock(&fsm_disp_mtx);
+}
+
 /**
  * Register a hook which will be called with priority @prio when FSM @fsm_id
  * reaches state @state. The hooks switches calling FSM to FSM represented by
@@ -303,6 +384,7 @@ tfw_gfsm_register_hook(int fsm_id, int prio, int state,
 	/* Initial FSM state isn't hookable. */
 	BUG_ON(!st);
 
+	mutex_lock(&fsm_disp_mtx);
 	if (prio == TFW_GFSM_HOOK_PRIORITY_ANY) {
 		/*
 		 * Try to register the hook with highest priority.
@@ -316,21 +398,28 @@ tfw_gfsm_register_hook(int fsm_id, int prio, int state,
 		if (prio == TFW_GFSM_HOOK_PRIORITY_NUM) {
 			T_ERR_NL("All hook slots for FSM %d are acquired\n",
 				   fsm_id);
-			return -EBUSY;
+			prio = -EBUSY;
+			goto out;
 		}
 	}
 	shift = prio * TFW_GFSM_STATE_N + st;
 
-	if (fsm_hooks[fsm_id][shift].fsm_id)
-		return -EBUSY;
+	if (fsm_hooks_bm[fsm_id][prio] & st_bit) {
+		prio = -EBUSY;
+		goto out;
+	}
 	if (!fsm_htbl[fsm_id]) {
 		T_ERR_NL("gfsm: fsm %d is not registered\n", fsm_id);
-		return -ENOENT;
+		prio = -ENOENT;
+		goto out;
 	}
 
 	fsm_hooks[fsm_id][shift].st0 = st0;
 	fsm_hooks[fsm_id][shift].fsm_id = hndl_fsm_id;
 	fsm_hooks_bm[fsm_id][prio] |= st_bit;
+	__tfw_gfsm_disp_build();
+out:
+	mutex_unlock(&fsm_disp_mtx);
 
 	return prio;
 }
@@ -347,8 +436,11 @@ tfw_gfsm_unregister_hook(int fsm_id, int prio, int state)
 	int st = state & TFW_GFSM_STATE_MASK;
 	int shift = prio * TFW_GFSM_STATE_N + st;
 
+	mutex_lock(&fsm_disp_mtx);
 	memset(&fsm_hooks[fsm_id][shift], 0, sizeof(TfwFsmHook));
 	fsm_hooks_bm[fsm_id][prio] &= ~(1 << st);
+	__tfw_gfsm_disp_build();
+	mutex_unlock(&fsm_disp_mtx);
 }
 
 int
@@ -195,6 +195,7 @@ void tfw_gfsm_debug_state(TfwGState *st, const char *msg);
 int tfw_gfsm_register_hook(int fsm_id, int prio, int state,
 			   unsigned short hndl_fsm_id, int st0);
 void tfw_gfsm_unregister_hook(int fsm_id, int prio, int state);
+void tfw_gfsm_enable_fsm(int fsm_id, bool enable);
 int tfw_gfsm_register_fsm(int fsm_id, tfw_gfsm_handler_t handler);
 void tfw_gfsm_unregister_fsm(int fsm_id);
 
@@ -27,8 +27,10 @@
 #include "str.h"
 #include "http_msg.h"
 #include "hpack.h"
+#include "procfs.h"
 
 #include "hpack_tbl.h"
+#include "hpack_names.h"
 
 #define HP_HDR_NAME(name)						\
 	(&(TfwStr){							\
@@ -131,6 +133,88 @@ static const TfwHPackEntry static_table[] ____cacheline_aligned = {
 
 #define HPACK_STATIC_ENTRIES (sizeof(static_table) / sizeof(static_table[0]))
 
+/*
+ * Hash of header name @name of @len bytes, see hpack/hngen.c. Names of 8 and
+ * more bytes are read by two overlapping 8-byte loads.
+ */
+static inline unsigned int
+hn_hash(const char *name, unsigned long len)
+{
+	unsigned long w0 = 0, w1;
+
+	if (len >= 8) {
+		w0 = *(unsigned long *)name;
+		w1 = *(unsigned long *)(name + len - 8);
+	} else {
+		memcpy(&w0, name, len);
+		w1 = w0;
+	}
+	/* Convert to lower case, as TFW_LC_LONG in the HTTP parser. */
+	w0 |= 0x2020202020202020UL;
+	w1 = (w1 | 0x2020202020202020UL) ^ len;
+
+	return (w0 * HN_M0 ^ w1 * HN_M1) >> (64 - HN_BITS);
+}
+
+/**
+ * Find HPACK static table index of regular header name @name of @len bytes
+ * using the perfect hash of the table names: there is only one name for
+ * the hash value, so it's enough to compare @name with only that name.
+ *
+ * @return the index or 0 if there is no such a header name in the table.
+ */
+unsigned short
+tfw_hpack_name_idx(const char *name, unsigned long len)
+{
+	unsigned int idx;
+	const TfwStr *n;
+
+	if (len < HN_MIN_LEN || len > HN_MAX_LEN)
+		return 0;
+
+	idx = hn_slots[hn_hash(name, len)];
+	if (!idx)
+		return 0;
+	n = TFW_STR_CHUNK(static_table[idx - 1].hdr, 0);
+	if (n->len != len || tfw_cstricmp_2lc(name, n->data, len))
+		return 0;
+
+	return idx;
+}
+
+/**
+ * As tfw_hpack_name_idx(), but for HTTP/1.1 or HTTP/2 header @hdr, which
+ * can be compound and must not be duplicate.
+ */
+unsigned short
+tfw_hpack_hdr_name_idx(const TfwStr *hdr)
+{
+	char buf[HN_MAX_LEN];
+	const TfwStr *c, *end;
+	unsigned long len = 0;
+
+	if (TFW_STR_PLAIN(hdr))
+		return tfw_hpack_name_idx(hdr->data, hdr->len);
+
+	/* Most of the names are in the first chunk. */
+	c = hdr->chunks;
+	end = c + hdr->nchunks;
+	if (c + 1 == end || (c + 1)->flags & TFW_STR_HDR_VALUE
+	    || *(c + 1)->data == ':')
+		return tfw_hpack_name_idx(c->data, c->len);
+
+	for ( ; c < end; ++c) {
+		if (c->flags & TFW_STR_HDR_VALUE || *c->data == ':')
+			break;
+		if (len + c->len > HN_MAX_LEN)
+			return 0;
+		memcpy_fast(buf + len, c->data, c->len);
+		len += c->len;
+	}
+
+	return tfw_hpack_name_idx(buf, len);
+}
+
 /* Limit for the HPACK variable-length integer. */
 #define HPACK_LIMIT			(1 << 20)
 
@@ -256,122 +340,118 @@ do {								\
 	       last - src);					\
 } while (0)
 
-#define	BUFFER_HDR_INIT(length, it)				\
-do {								\
-	(it)->hdr.data = (it)->pos;				\
-	(it)->hdr.len = length;					\
-	(it)->next = &(it)->hdr;				\
-} while (0)
+/*
+ * Maximum number of symbols decoded from @n bytes of a Huffman-encoded string:
+ * the shortest code is 5 bits and up to 16 bits of the previous fragment can
+ * be pending in @hp->hctx.
+ */
+#define HT_DEC_MAX(n)		(((n) * 8 + 16) / 5)
 
-#define	BUFFER_NAME_OPEN(length)				\
+#define	BUFFER_NAME_OPEN()					\
 do {								\
-	WARN_ON_ONCE(!TFW_STR_EMPTY(&it->hdr));			\
-	if (state & HPACK_FLAGS_HUFFMAN_NAME) {			\
-		BUFFER_GET(length, it);				\
-		if (!it->pos) {					\
-			r = T_DROP;				\
-			goto out;				\
-		}						\
-		BUFFER_HDR_INIT(length, it);			\
-	}							\
+	it->data = it->pos;					\
 } while (0)
 
-#define	BUFFER_VAL_OPEN(length)					\
+#define	BUFFER_VAL_OPEN()					\
 do {								\
 	WARN_ON_ONCE(TFW_STR_EMPTY(it->parsed_hdr));		\
 	it->nm_len = it->parsed_hdr->len;			\
 	it->nm_num = it->parsed_hdr->nchunks			\
 		? it->parsed_hdr->nchunks			\
 		: 1;						\
-	if (state & HPACK_FLAGS_HUFFMAN_VALUE) {		\
-		BUFFER_GET(length, it);				\
-		if (!it->pos) {					\
-			r = T_DROP;				\
-			goto out;				\
-		}						\
-		if (!TFW_STR_EMPTY(&it->hdr))			\
-			it->next = tfw_hpack_exp_hdr(req->pool,	\
-						     length, it); \
-		else						\
-			BUFFER_HDR_INIT(length, it);		\
-	}							\
+	it->data = it->pos;					\
 } while (0)
 
-static inline int
-__hpack_process_hdr_name(TfwHttpReq *req)
+/*
+ * Reserve @n bytes after @it->pos for the Huffman-decoded data. The buffer
+ * grows with the fragments of the header block, so no memory is allocated
+ * for the declared string length in advance. The decoded data, which isn't
+ * passed to the parser yet, is moved if the buffer can't grow in place, so
+ * the data is always contiguous.
+ */
+static int
+tfw_hpack_buf_get(TfwMsgParseIter *__restrict it, unsigned long n)
 {
-	const TfwStr *c, *end;
-	TfwMsgParseIter *it = &req->pit;
-	const TfwStr *hdr = &it->hdr, *next = it->next;
-	int ret = T_BAD;
+	bool np;
+	char *p;
+	unsigned long pend = it->pos - it->data;
 
-	WARN_ON_ONCE(next != hdr);
-	TFW_STR_FOR_EACH_CHUNK(c, next, end) {
-		bool last = c + 1 == end;
+	if (likely(it->rspace >= n))
+		return 0;
+	if (!(p = __tfw_pool_alloc(it->pool, n + pend, false, &np)))
+		return -ENOMEM;
 
-		WARN_ON_ONCE(ret == T_OK);
-		ret = tfw_h2_parse_req_hdr(c->data, c->len, req, last, false);
-		if (unlikely(ret < T_POSTPONE))
-			return ret;
+	T_DBG3("%s: get buffer, n=%lu, pend=%lu, p=[%p], it->pos=[%p]\n",
+	       __func__, n, pend, p, it->pos);
+
+	if (p == it->pos + it->rspace) {
+		it->rspace += n + pend;
+		return 0;
 	}
-	return ret ? T_DROP : T_OK;
+	memcpy_fast(p, it->data, pend);
+	it->data = p;
+	it->pos = p + pend;
+	it->rspace = n;
+
+	return 0;
 }
 
-static inline int
-__hpack_process_hdr_value(TfwHttpReq *req)
+/*
+ * Pass the Huffman-decoded data of the current string to the parser right
+ * after each fragment of the header block is decoded, so the parser and
+ * Frang see the header growing as it comes. The last decoded byte is held
+ * back until the string is complete (@fin), so the parser gets the string
+ * end with some data.
+ */
+static int
+tfw_hpack_huffman_parse(TfwHttpReq *__restrict req, bool fin,
+			bool value_stage)
 {
-	const TfwStr *chunk, *end;
+	int r;
 	TfwMsgParseIter *it = &req->pit;
-	const TfwStr *hdr = &it->hdr, *next = it->next;
-	int ret = T_BAD;
-
-	BUG_ON(TFW_STR_DUP(hdr));
-	if (TFW_STR_PLAIN(hdr)) {
-		WARN_ON_ONCE(hdr != next);
-		chunk = hdr;
-		end = hdr + 1;
-	} else {
-		/*
-		 * In case of compound @hdr the @next can point either to the
-		 * @hdr itself (if only header's value has been Huffman-decoded,
-		 * i.e. in case of indexed or raw header's name), or to some
-		 * chunk inside the @hdr (if both, the name and the value, has
-		 * been Huffman-decoded).
-		 */
-		chunk = (hdr != next) ? next : next->chunks;
-		end = hdr->chunks + hdr->nchunks;
-	}
+	unsigned long n = it->pos - it->data;
 
-	while (chunk < end) {
-		bool last = chunk + 1 == end;
+	if (unlikely(n <= !fin))
+		return fin ? T_DROP : T_POSTPONE;
+	n -= !fin;
 
-		WARN_ON_ONCE(ret == T_OK);
-		ret = tfw_h2_parse_req_hdr(chunk->data, chunk->len,
-					   req, last, true);
-		if (unlikely(ret < T_POSTPONE))
-			return ret;
-		++chunk;
-	}
-	return ret ? T_DROP : T_OK;
+	r = tfw_h2_parse_req_hdr(it->data, n, req, fin, value_stage);
+	it->data += n;
+	if (!fin)
+		return r == T_OK ? T_POSTPONE : r;
+
+	return r == T_POSTPONE ? T_DROP : r;
 }
 
-#define	HPACK_DECODE_PROCESS_STRING(field, len)			\
+#define	HPACK_DECODE_PROCESS_STRING(len, value_stage)		\
 do {								\
 	T_DBG3("%s: decoding, len=%lu, n=%lu, tail=%lu\n",	\
 	       __func__, len, n, last - src);			\
+	if (tfw_hpack_buf_get(it, HT_DEC_MAX(len))) {		\
+		r = T_DROP;					\
+		goto out;					\
+	}							\
 	r = tfw_huffman_decode(hp, req, src, len);		\
 	src += len;						\
-	if (r)							\
+	if (r && r != T_POSTPONE)				\
 		goto out;					\
-	WARN_ON_ONCE(hp->length);				\
-	hp->hctx = 0;						\
-	tfw_huffman_init(hp);					\
-	if ((r = __hpack_process_hdr_##field(req)))		\
+	if (!r) {						\
+		WARN_ON_ONCE(hp->length);			\
+		hp->hctx = 0;					\
+		tfw_huffman_init(hp);				\
+	}							\
+	if ((r = tfw_hpack_huffman_parse(req, !r, value_stage)))	\
 		goto out;					\
 	T_DBG3("%s: processed decoded, tail=%lu\n", __func__,	\
 	       last - src);					\
 } while (0)
 
+/*
+ * Plain (not Huffman-encoded) strings are passed to the parser as is, so
+ * the header chunks reference the skb data directly, as for HTTP/1.1, also
+ * if a string spans several frames. The data is copied only to the dynamic
+ * table, see tfw_hpack_add_index().
+ */
 #define HPACK_PROCESS_STRING(len, value_stage)			\
 do {								\
 	hp->length -= len;					\
@@ -412,57 +492,111 @@ write_int(unsigned long index, unsigned short max, unsigned short mask,
 	res_idx->sz = size;
 }
 
-static inline TfwStr *
-tfw_hpack_exp_hdr(TfwPool *__restrict pool, unsigned long len,
-		  TfwMsgParseIter *__restrict it)
+static inline int
+tfw_hpack_huffman_write(char sym, TfwHttpReq *__restrict req)
 {
-	TfwStr *new;
+	TfwMsgParseIter *it = &req->pit;
 
-	if (!(new = tfw_str_add_compound(pool, &it->hdr)))
-		return NULL;
+	/* The space is reserved for the whole fragment in advance. */
+	if (unlikely(!it->rspace) && tfw_hpack_buf_get(it, 1))
+		return -ENOMEM;
 
-	new->data = it->pos;
-	new->len = len;
-	it->hdr.len += len;
+	--it->rspace;
+	*it->pos++ = sym;
 
-	return new;
+	return 0;
 }
 
-static inline int
-tfw_hpack_huffman_write(char sym, TfwHttpReq *__restrict req)
+/*
+ * Canonical Huffman decoding tables: the codes of the same length are
+ * consecutive and are assigned in the order of the symbols, so a code of @len
+ * bits is decoded by its offset from the first code of the length.
+ */
+#define HT_MAX_LEN	30
+
+static unsigned int ht_dec_first[HT_MAX_LEN + 1];
+static unsigned int ht_dec_cnt[HT_MAX_LEN + 1];
+static unsigned int ht_dec_off[HT_MAX_LEN + 1];
+static unsigned char ht_dec_sym[ARRAY_SIZE(ht_length)];
+
+/*
+ * Multi-symbol decoding table for the first HT_FBITS bits of the input: all
+ * the symbols, up to two, whose codes fit the bits entirely. The shortest
+ * code is 5 bits, so the most frequent symbols of paths, cookies and other
+ * header values are decoded by pairs. The entries with no symbols are for the
+ * longer codes.
+ *
+ * @sym		- decoded symbols;
+ * @n		- number of the decoded symbols;
+ * @bits	- total length of the symbols codes.
+ */
+#define HT_FBITS	12
+#define HT_FMAX_SYM	2
+
+typedef struct {
+	unsigned char	sym[HT_FMAX_SYM];
+	unsigned char	n;
+	unsigned char	bits;
+} HTFast;
+
+static HTFast ht_fast[1 << HT_FBITS] __page_aligned_data;
+
+/*
+ * Decode a symbol of at least @min_len bits from the first @bits bits of
+ * @code. Returns the code length or zero if there is no such symbol.
+ */
+static unsigned int
+ht_decode_sym(unsigned long code, unsigned int bits, unsigned int min_len,
+	      unsigned char *sym)
 {
-	bool np;
-	TfwMsgParseIter *it = &req->pit;
+	unsigned int l;
 
-	if (it->rspace) {
-		--it->rspace;
-		*it->pos++ = sym;
-		return 0;
+	for (l = min_len; l <= min_t(unsigned int, bits, HT_MAX_LEN); ++l) {
+		unsigned int c = (code >> (bits - l)) & ((1U << l) - 1);
+
+		if (c - ht_dec_first[l] >= ht_dec_cnt[l])
+			continue;
+		/* EOS has the last code and must not be met in the string. */
+		if (ht_dec_off[l] + c - ht_dec_first[l] >= 256)
+			return 0;
+		*sym = ht_dec_sym[ht_dec_off[l] + c - ht_dec_first[l]];
+		return l;
 	}
 
-	if (!(it->pos = __tfw_pool_alloc(it->pool, 1, false, &np)))
-		return -ENOMEM;
+	return 0;
+}
 
-	*it->pos = sym;
+void
+tfw_hpack_huffman_init(void)
+{
+	unsigned int i, off = 0, pos[HT_MAX_LEN + 1];
 
-	T_DBG3("%s: it->rspace=%lu, sym=%c, np=%d\n", __func__,
-	       it->rspace, sym, np);
+	for (i = 0; i < ARRAY_SIZE(ht_length); ++i)
+		++ht_dec_cnt[ht_length[i]];
+	for (i = 1; i <= HT_MAX_LEN; ++i) {
+		ht_dec_off[i] = pos[i] = off;
+		off += ht_dec_cnt[i];
+	}
+	for (i = 0; i < ARRAY_SIZE(ht_length); ++i) {
+		unsigned int l = ht_length[i];
 
-	if (!np) {
-		TfwStr *hdr = &it->hdr;
-		TfwStr *last = TFW_STR_LAST(hdr);
+		if (pos[l] == ht_dec_off[l])
+			ht_dec_first[l] = ht_encode[i];
+		ht_dec_sym[pos[l]++] = i;
+	}
 
-		T_DBG3("%s: add to hdr, hdr->len=%lu, last->len=%lu,"
-		       " last->data=%.*s\n", __func__, hdr->len, last->len,
-		       (int)last->len, last->data);
+	for (i = 0; i < ARRAY_SIZE(ht_fast); ++i) {
+		HTFast *f = &ht_fast[i];
 
-		++hdr->len;
-		if (!TFW_STR_PLAIN(hdr))
-			++last->len;
-		return 0;
+		while (f->n < HT_FMAX_SYM) {
+			unsigned int l = ht_decode_sym(i, HT_FBITS - f->bits, 1,
+						       &f->sym[f->n]);
+			if (!l)
+				break;
+			f->bits += l;
+			++f->n;
+		}
 	}
-
-	return tfw_hpack_exp_hdr(req->pool, 1, it) ? 0 : -ENOMEM;
 }
 
 static int
@@ -577,20 +711,104 @@ huffman_decode_tail_s(TfwHPack *__restrict hp, TfwHttpReq *__restrict req,
 	return T_DROP;
 }
 
+/*
+ * Decode the string by HT_FBITS bits at once while it's at the symbols
+ * boundary and there are enough bits, the rest of the string, if any, is
+ * handed over to the state machine with less than 8 bits in @hp->hctx, as if
+ * it had consumed the same bytes. The longer codes are decoded by the
+ * canonical tables.
+ */
+static int
+tfw_huffman_decode_fast(TfwHPack *__restrict hp, TfwHttpReq *__restrict req,
+			const unsigned char **__restrict src,
+			const unsigned char *__restrict last)
+{
+	unsigned long acc = 0;
+	unsigned int bits = 0;
+	const unsigned char *p = *src;
+
+	for (;;) {
+		const HTFast *f;
+		unsigned int i;
+
+		while (bits <= BITS_PER_LONG - 8 && p < last) {
+			acc = acc << 8 | *p++;
+			bits += 8;
+		}
+		if (bits < HT_FBITS)
+			break;
+
+		f = &ht_fast[(acc >> (bits - HT_FBITS)) & ((1 << HT_FBITS) - 1)];
+		if (unlikely(!f->n)) {
+			unsigned char sym;
+			unsigned int l = ht_decode_sym(acc, bits, HT_FBITS + 1,
+						       &sym);
+			if (!l) {
+				/* EOS or a broken code. */
+				if (bits >= HT_MAX_LEN)
+					return T_DROP;
+				break;
+			}
+			if (tfw_hpack_huffman_write(sym, req))
+				return T_DROP;
+			bits -= l;
+			continue;
+		}
+
+		for (i = 0; i < f->n; ++i)
+			if (tfw_hpack_huffman_write(f->sym[i], req))
+				return T_DROP;
+		bits -= f->bits;
+	}
+
+	/* Return the whole unprocessed bytes to the input. */
+	p -= bits >> 3;
+	acc >>= bits & ~7U;
+	bits &= 7;
+
+	hp->length -= p - *src;
+	hp->hctx = acc & ((1U << bits) - 1);
+	hp->curr = (int)bits - HT_NBITS;
+	*src = p;
+
+	T_DBG3("%s: hp->curr=%d, hp->hctx=%hx, hp->length=%lu, to_parse=%lu\n",
+	       __func__, hp->curr, hp->hctx, hp->length, last - p);
+
+	return T_OK;
+}
+
 static int
 tfw_huffman_decode(TfwHPack *__restrict hp, TfwHttpReq *__restrict req,
 		   const unsigned char *__restrict src, unsigned long n)
 {
-	unsigned int offset;
+	unsigned int offset = hp->hoff;
 	const unsigned char *last = src + n;
 
 	WARN_ON_ONCE(n > hp->length);
 	if (unlikely(!n))
 		return T_OK;
 
+	/*
+	 * No bits are pending in the decoding context at the string beginning
+	 * and after the symbols boundary, so the fast path can be used.
+	 */
+	if (hp->curr == -HT_NBITS && !offset) {
+		if (tfw_huffman_decode_fast(hp, req, &src, last))
+			return T_DROP;
+		if (src == last)
+			return hp->length
+				? T_POSTPONE
+				: huffman_decode_tail(hp, req, 0);
+	}
+
 	SET_NEXT();
+	/*
+	 * The previous fragment ended in the middle of a code: continue from
+	 * the saved decoding table.
+	 */
+	if (offset >= HT_SMALL)
+		goto short_tbl;
 	for (;;) {
-		offset = 0;
 		for (;;) {
 			int shift;
 			unsigned int i;
@@ -599,6 +817,7 @@ tfw_huffman_decode(TfwHPack *__restrict hp, TfwHttpReq *__restrict req,
 				if (likely(src < last)) {
 					SET_NEXT();
 				} else if (hp->length) {
+					hp->hoff = offset;
 					return T_POSTPONE;
 				} else {
 					/*
@@ -639,6 +858,7 @@ tfw_huffman_decode(TfwHPack *__restrict hp, TfwHttpReq *__restrict req,
 			}
 		}
 		hp->curr += HT_NBITS - HT_MBITS;
+short_tbl:
 		/*
 		 * With various optimization options, the anonymous block here
 		 * leads to the generation of more efficient code.
@@ -651,6 +871,7 @@ tfw_huffman_decode(TfwHPack *__restrict hp, TfwHttpReq *__restrict req,
 				if (likely(src < last)) {
 					SET_NEXT();
 				} else if (hp->length) {
+					hp->hoff = offset;
 					return T_POSTPONE;
 				} else {
 					return huffman_decode_tail_s(hp, req,
@@ -669,6 +890,7 @@ tfw_huffman_decode(TfwHPack *__restrict hp, TfwHttpReq *__restrict req,
 				if (tfw_hpack_huffman_write((char)offset, req))
 					return T_DROP;
 				hp->curr -= shift;
+				offset = 0;
 			}
 			else {
 				/*
@@ -1015,12 +1237,26 @@ static inline void
 tfw_huffman_init(TfwHPack *__restrict hp)
 {
 	hp->curr = -HT_NBITS;
+	hp->hoff = 0;
+}
+
+static int
+tfw_hpack_enc_rbuf_alloc(TfwHPackETbl *__restrict tbl)
+{
+	bool np;
+
+	if (!(tbl->pool = __tfw_pool_new(HPACK_ENC_TABLE_MAX_SIZE)))
+		return -ENOMEM;
+	tbl->rbuf = __tfw_pool_alloc(tbl->pool, HPACK_ENC_TABLE_MAX_SIZE,
+				     true, &np);
+	BUG_ON(np || !tbl->rbuf);
+
+	return 0;
 }
 
 int
 tfw_hpack_init(TfwHPack *__restrict hp, unsigned int htbl_sz)
 {
-	bool np;
 	TfwHPackETbl *et = &hp->enc_tbl;
 	TfwHPackDTbl *dt = &hp->dec_tbl;
 
@@ -1035,14 +1271,12 @@ tfw_hpack_init(TfwHPack *__restrict hp, unsigned int htbl_sz)
 	if (!(dt->h_pool = __tfw_pool_new(0)))
 		goto err_dt;
 
-	et->window = htbl_sz;
+	et->window = et->lim = htbl_sz;
 	spin_lock_init(&et->lock);
+	memset(et->hbuckets, 0xFF, sizeof(et->hbuckets));
 	et->rb_size = HPACK_ENC_TABLE_MAX_SIZE;
-	if (!(et->pool = __tfw_pool_new(HPACK_ENC_TABLE_MAX_SIZE)))
+	if (tfw_hpack_enc_rbuf_alloc(et))
 		goto err_et;
-	et->rbuf = __tfw_pool_alloc(et->pool, HPACK_ENC_TABLE_MAX_SIZE,
-				    true, &np);
-	BUG_ON(np || !et->rbuf);
 
 	return 0;
 
@@ -1095,9 +1329,6 @@ tfw_hpack_hdr_name_set(TfwHPack *__restrict hp, TfwHttpReq *__restrict req,
 	if (WARN_ON_ONCE(!num || num > s_hdr->nchunks))
 		return -EINVAL;
 
-	if (!(data = tfw_pool_alloc_not_align(it->pool, sz)))
-		return T_BAD;
-
 	d_hdr->len = sz;
 	d_hdr->nchunks = num;
 	d_hdr->flags = s_hdr->flags;
@@ -1115,6 +1346,13 @@ tfw_hpack_hdr_name_set(TfwHPack *__restrict hp, TfwHttpReq *__restrict req,
 		goto done;
 	}
 
+	/*
+	 * The dynamic table entry can be evicted by the next headers of the
+	 * block, so the name must outlive it.
+	 */
+	if (!(data = tfw_pool_alloc_not_align(it->pool, sz)))
+		return T_BAD;
+
 	for (s = s_hdr->chunks, end = s_hdr->chunks + num; s < end; ++s) {
 		*d = *s;
 		d->data = data;
@@ -1320,6 +1558,12 @@ index:
 					T_DBG3("%s: decoded index: %lu\n",
 					       __func__, hp->index);
 					NEXT_STATE(HPACK_STATE_INDEXED_NAME_TEXT);
+					/*
+					 * The value length may come in the next
+					 * fragment of the header block.
+					 */
+					if (unlikely(src >= last))
+						goto out;
 					goto get_indexed_name;
 				}
 
@@ -1402,7 +1646,7 @@ index:
 
 			NEXT_STATE(HPACK_STATE_NAME_TEXT);
 
-			BUFFER_NAME_OPEN(hp->length);
+			BUFFER_NAME_OPEN();
 
 			if (unlikely(src >= last))
 				goto out;
@@ -1416,7 +1660,7 @@ get_name_text:
 			T_DBG3("%s: decode header name...\n", __func__);
 			m_len = min((unsigned long)(last - src), hp->length);
 			if (state & HPACK_FLAGS_HUFFMAN_NAME)
-				HPACK_DECODE_PROCESS_STRING(name, m_len);
+				HPACK_DECODE_PROCESS_STRING(m_len, false);
 			else
 				HPACK_PROCESS_STRING(m_len, false);
 
@@ -1465,7 +1709,7 @@ get_value:
 
 			NEXT_STATE(HPACK_STATE_VALUE_TEXT);
 
-			BUFFER_VAL_OPEN(hp->length);
+			BUFFER_VAL_OPEN();
 
 			if (unlikely(src >= last))
 				goto out;
@@ -1486,7 +1730,7 @@ get_value_text:
 			T_DBG3("%s: decode header value...\n", __func__);
 			m_len = min((unsigned long)(last - src), hp->length);
 			if (state & HPACK_FLAGS_HUFFMAN_VALUE)
-				HPACK_DECODE_PROCESS_STRING(value, m_len);
+				HPACK_DECODE_PROCESS_STRING(m_len, true);
 			else
 				HPACK_PROCESS_STRING(m_len, true);
 
@@ -1585,7 +1829,7 @@ set_window:
 
 			NEXT_STATE(HPACK_STATE_NAME_TEXT);
 
-			BUFFER_NAME_OPEN(hp->length);
+			BUFFER_NAME_OPEN();
 
 			if (unlikely(src >= last))
 				goto out;
@@ -1599,7 +1843,7 @@ set_window:
 
 			NEXT_STATE(HPACK_STATE_VALUE_TEXT);
 
-			BUFFER_VAL_OPEN(hp->length);
+			BUFFER_VAL_OPEN();
 
 			if (unlikely(src >= last))
 				goto out;
@@ -2058,6 +2302,13 @@ out:
  * last (i.e. the newest) entry in the ring buffer, and @root field which is the
  * pointer to the root entry of red-black tree.
  *
+ * The tree compares the header strings on each step of the search, so the
+ * entries are also linked into short hash chains by the @hnext offsets, with
+ * heads in @hbuckets of the table. The @hash of the header name (in lower case)
+ * and value is computed once on the entry addition and the whole header is
+ * looked up in its chain first; the tree is descended only if the header isn't
+ * indexed, to find an entry with the same name and the place for the new entry.
+ *
  * For instance, if the encoder table has 3 headers stored in it - e.g.
  * 'accept-encoding', 'accept-range' and 'referer', which had been added exactly
  * in the given order - they should have the following layout in the ring buffer
@@ -2274,6 +2525,43 @@ typedef enum {
 	idx;								\
 })
 
+#define HPACK_HASH_INIT			0x811c9dc5U
+#define HPACK_HASH_MULT			0x01000193U
+
+static unsigned int
+tfw_hpack_hash_str(const TfwStr *__restrict s, unsigned int hash, bool lc)
+{
+	const TfwStr *c, *end;
+
+	TFW_STR_FOR_EACH_CHUNK(c, s, end) {
+		const unsigned char *p = c->data, *e = p + c->len;
+
+		for ( ; p < e; ++p) {
+			unsigned char ch = lc ? tolower(*p) : *p;
+
+			hash = (hash ^ ch) * HPACK_HASH_MULT;
+		}
+	}
+
+	return hash;
+}
+
+/*
+ * Hash of the header split into @s_nm and @s_val, it doesn't depend on the
+ * chunks layout of the header, so the same header from a client request, a
+ * server response or the configuration has the same hash.
+ */
+static inline unsigned int
+tfw_hpack_hdr_hash(const TfwStr *__restrict s_nm,
+		   const TfwStr *__restrict s_val)
+{
+	unsigned int hash = tfw_hpack_hash_str(s_nm, HPACK_HASH_INIT, true);
+
+	hash = (hash ^ ':') * HPACK_HASH_MULT;
+
+	return tfw_hpack_hash_str(s_val, hash, false);
+}
+
 static int
 tfw_hpack_node_compare(const TfwStr *__restrict hdr,
 		       const TfwHPackNode *__restrict node,
@@ -2889,6 +3177,70 @@ tfw_hpack_rbtree_erase(TfwHPackETbl *__restrict tbl,
 		tfw_hpack_rbtree_del_rebalance(tbl, nchild, parent);
 }
 
+static inline short *
+tfw_hpack_hash_bucket(TfwHPackETbl *__restrict tbl, unsigned int hash)
+{
+	return &tbl->hbuckets[hash & (HPACK_ENC_HASH_SIZE - 1)];
+}
+
+static inline void
+tfw_hpack_hash_add(TfwHPackETbl *__restrict tbl, TfwHPackNode *__restrict new)
+{
+	short *head = tfw_hpack_hash_bucket(tbl, new->hash);
+
+	new->hnext = *head;
+	*head = HPACK_NODE_OFF(tbl, new);
+}
+
+/*
+ * Find the node with the whole header @hdr in the hash chain of @hash. Only
+ * the nodes with the same hash are compared with the header.
+ */
+static const TfwHPackNode *
+tfw_hpack_hash_find(TfwHPackETbl *__restrict tbl, const TfwStr *__restrict hdr,
+		    unsigned int hash)
+{
+	short off = *tfw_hpack_hash_bucket(tbl, hash);
+
+	while (!HPACK_NODE_EMPTY(off)) {
+		const TfwHPackNode *node = HPACK_NODE(tbl, off);
+		const TfwHPackNode *nm_node = NULL;
+
+		if (node->hash == hash
+		    && !tfw_hpack_node_compare(hdr, node, &nm_node))
+			return node;
+		off = node->hnext;
+	}
+
+	return NULL;
+}
+
+static void
+tfw_hpack_hash_erase(TfwHPackETbl *__restrict tbl,
+		     TfwHPackNode *__restrict node)
+{
+	short off = HPACK_NODE_OFF(tbl, node);
+	short *poff = tfw_hpack_hash_bucket(tbl, node->hash);
+
+	while (*poff != off) {
+		if (WARN_ON_ONCE(HPACK_NODE_EMPTY(*poff)))
+			return;
+		poff = &HPACK_NODE(tbl, *poff)->hnext;
+	}
+	*poff = node->hnext;
+}
+
+/*
+ * Remove specified node from both the red-black tree and the hash table.
+ */
+static inline void
+tfw_hpack_node_erase(TfwHPackETbl *__restrict tbl,
+		     TfwHPackNode *__restrict node)
+{
+	tfw_hpack_hash_erase(tbl, node);
+	tfw_hpack_rbtree_erase(tbl, node);
+}
+
 static inline void
 tfw_hpack_rbuf_iter(TfwHPackETbl *__restrict tbl,
 		    TfwHPackETblIter *__restrict iter)
@@ -2921,6 +3273,11 @@ tfw_hpack_rbuf_calc(TfwHPackETbl *__restrict tbl, unsigned short new_size,
 			return -E2BIG;
 
 		if (last == first) {
+			/* The only node is evicted, the table gets empty. */
+			if (del_list)
+				del_list[i] = (TfwHPackNode *)first;
+			else
+				tfw_hpack_node_erase(tbl, (TfwHPackNode *)first);
 			it->first = it->last = NULL;
 			it->rb_len = it->size = 0;
 			WARN_ON_ONCE(it->rb_size != HPACK_ENC_TABLE_MAX_SIZE);
@@ -2940,7 +3297,7 @@ tfw_hpack_rbuf_calc(TfwHPackETbl *__restrict tbl, unsigned short new_size,
 		if (del_list)
 			del_list[i++] = (TfwHPackNode *)first;
 		else
-			tfw_hpack_rbtree_erase(tbl, (TfwHPackNode *)first);
+			tfw_hpack_node_erase(tbl, (TfwHPackNode *)first);
 
 		if (last < first && rb_len - f_len == last - rbuf + last_len) {
 			it->rb_size = HPACK_ENC_TABLE_MAX_SIZE;
@@ -2964,7 +3321,7 @@ tfw_hpack_rbuf_calc(TfwHPackETbl *__restrict tbl, unsigned short new_size,
 
 static inline void
 tfw_hpack_rbuf_commit(TfwHPackETbl *__restrict tbl,
-		      TfwStr *__restrict hdr,
+		      TfwStr *__restrict hdr, unsigned int hash,
 		      TfwHPackNode *__restrict del_list[],
 		      TfwHPackNodeIter *__restrict place,
 		      TfwHPackETblIter *__restrict iter)
@@ -2979,7 +3336,7 @@ tfw_hpack_rbuf_commit(TfwHPackETbl *__restrict tbl,
 
 		if (!del_node)
 			break;
-		tfw_hpack_rbtree_erase(tbl, del_node);
+		tfw_hpack_node_erase(tbl, del_node);
 		was_del = true;
 	}
 
@@ -2994,6 +3351,8 @@ tfw_hpack_rbuf_commit(TfwHPackETbl *__restrict tbl,
 	}
 
 	tfw_hpack_rbtree_add(tbl, iter->last, place);
+	iter->last->hash = hash;
+	tfw_hpack_hash_add(tbl, iter->last);
 
 	tbl->first = iter->first;
 	tbl->last = iter->last;
@@ -3112,19 +3471,82 @@ tfw_hpack_add_node(TfwHPackETbl *__restrict tbl, TfwStr *__restrict hdr,
 commit:
 	it.size += node_size;
 	it.rb_len += node_len;
+
+	/*
+	 * The new node may overlap the evicted ones, so it's written only after
+	 * they are unlinked from the tree and the hash chains.
+	 */
+	tfw_hpack_rbuf_commit(tbl, hdr, tfw_hpack_hdr_hash(&s_nm, &s_val),
+			      del_list, place, &it);
+
 	it.last->hdr_len = hdr_len;
 	it.last->rindex = ++tbl->idx_acc;
 
 	ptr = tfw_hpack_write(&s_nm, it.last->hdr);
 	tfw_hpack_write(&s_val, ptr);
 
-	tfw_hpack_rbuf_commit(tbl, hdr, del_list, place, &it);
-
 	WARN_ON_ONCE(tbl->rb_len > tbl->size);
 
 	return 0;
 }
 
+/*
+ * The encoder dynamic index pays off only if the same headers are sent in the
+ * connection repeatedly. So the table @window, within the size allowed by the
+ * peer, is halved if less than 1/8 of the headers are found in the index in an
+ * adaptation period, and is doubled if more than a half of the headers are
+ * found while the table is mostly filled. The ring buffer is released if the
+ * window drops below HPACK_ENC_WND_MIN, then the indexing is probed again with
+ * the minimum window after HPACK_ENC_PROBE_PERIODS periods. The encoder may
+ * use a smaller table than the decoder without a dynamic table size update:
+ * the decoder keeps a superset of the encoder entries with the same indexes.
+ *
+ * Called under @tbl->lock when no message uses the index.
+ */
+#define HPACK_ENC_ADAPT_PERIOD		64
+#define HPACK_ENC_PROBE_PERIODS		16
+#define HPACK_ENC_WND_MIN		512
+
+static void
+tfw_hpack_enc_adapt(TfwHPackETbl *__restrict tbl)
+{
+	unsigned int window = tbl->window;
+
+	if (!window) {
+		if (tbl->adapt_n < HPACK_ENC_ADAPT_PERIOD
+				   * HPACK_ENC_PROBE_PERIODS)
+			return;
+		if (!tfw_hpack_enc_rbuf_alloc(tbl))
+			window = min_t(unsigned int, tbl->lim,
+				       HPACK_ENC_WND_MIN);
+	}
+	else if (tbl->adapt_hits < HPACK_ENC_ADAPT_PERIOD / 8) {
+		window /= 2;
+		if (window < HPACK_ENC_WND_MIN)
+			window = 0;
+	}
+	else if (tbl->adapt_hits > HPACK_ENC_ADAPT_PERIOD / 2
+		 && tbl->size > window / 2)
+	{
+		window = min_t(unsigned int, window * 2, tbl->lim);
+	}
+
+	T_DBG3("%s: window=%hu, new window=%u, size=%hu, hits=%hu/%hu\n",
+	       __func__, tbl->window, window, tbl->size, tbl->adapt_hits,
+	       tbl->adapt_n);
+
+	if (tbl->size > window)
+		tfw_hpack_rbuf_calc(tbl, window, NULL, (TfwHPackETblIter *)tbl);
+	if (!window && tbl->rbuf) {
+		WARN_ON_ONCE(tbl->first || tbl->root);
+		tfw_pool_destroy(tbl->pool);
+		tbl->pool = NULL;
+		tbl->rbuf = NULL;
+	}
+	tbl->window = window;
+	tbl->adapt_n = tbl->adapt_hits = 0;
+}
+
 /*
  * HPACK encoder index determination procedure. Operates with connection-wide
  * encoder dynamic table with potentially concurrent access from different
@@ -3138,7 +3560,9 @@ tfw_hpack_encoder_index(TfwHPackETbl *__restrict tbl,
 			unsigned long *__restrict flags,
 			TfwH2TransOp op)
 {
+	unsigned int hash;
 	TfwHPackNodeIter place = {};
+	TfwStr s_nm = {}, s_val = {};
 	const TfwHPackNode *node = NULL;
 	TfwHPackETblRes res = HPACK_IDX_ST_NOT_FOUND;
 
@@ -3146,13 +3570,41 @@ tfw_hpack_encoder_index(TfwHPackETbl *__restrict tbl,
 	if (WARN_ON_ONCE(!hdr))
 		return -EINVAL;
 
+	tfw_http_hdr_split(hdr, &s_nm, &s_val, op == TFW_H2_TRANS_INPLACE);
+	hash = tfw_hpack_hdr_hash(&s_nm, &s_val);
+
 	spin_lock(&tbl->lock);
 
-	if (!test_bit(TFW_HTTP_B_H2_TRANS_ENTERED, flags)
-	    && atomic64_read(&tbl->guard) < 0)
-		goto out;
+	if (!test_bit(TFW_HTTP_B_H2_TRANS_ENTERED, flags)) {
+		if (atomic64_read(&tbl->guard) < 0)
+			goto out;
+		/* Evictions change the indexes, so the index must be unused. */
+		if (!atomic64_read(&tbl->guard)
+		    && tbl->adapt_n >= HPACK_ENC_ADAPT_PERIOD)
+			tfw_hpack_enc_adapt(tbl);
+	}
 
-	res = tfw_hpack_rbtree_find(tbl, hdr, &node, &place);
+	/*
+	 * The tree is descended only for the headers which aren't indexed yet:
+	 * to find the name-only match and the place for the new node.
+	 */
+	if ((node = tfw_hpack_hash_find(tbl, hdr, hash)))
+		res = HPACK_IDX_ST_FOUND;
+	else
+		res = tfw_hpack_rbtree_find(tbl, hdr, &node, &place);
+
+	++tbl->adapt_n;
+	if (res == HPACK_IDX_ST_FOUND) {
+		++tbl->adapt_hits;
+		++tbl->hits;
+		TFW_INC_STAT_BH(clnt.hpack_hits);
+	} else {
+		if (res == HPACK_IDX_ST_NM_FOUND)
+			++tbl->nm_hits;
+		else
+			++tbl->misses;
+		TFW_INC_STAT_BH(clnt.hpack_misses);
+	}
 
 	WARN_ON_ONCE(!node && res != HPACK_IDX_ST_NOT_FOUND);
 
@@ -3825,6 +4277,39 @@ tfw_hpack_encode(TfwHttpResp *__restrict resp, TfwStr *__restrict hdr,
 	return tfw_hpack_hdr_expand(resp, hdr, &idx, false);
 }
 
+/**
+ * Add data @data, which is already in HPACK format, into the response @resp:
+ * the data is written to the free space of the message for TFW_H2_TRANS_ADD
+ * operation if there is enough room, or the message is expanded, just like
+ * tfw_hpack_encode() does for a header.
+ */
+int
+tfw_hpack_add_raw(TfwHttpResp *__restrict resp, const TfwStr *__restrict data,
+		  TfwH2TransOp op)
+{
+	int r;
+	TfwHttpTransIter *mit = &resp->mit;
+	TfwHttpTransIter mit_save = *mit;
+
+	if (op == TFW_H2_TRANS_ADD) {
+		r = tfw_h2_msg_rewrite_data(mit, data, mit->bnd);
+		if (r != -ENOSPC)
+			return r;
+		*mit = mit_save;
+	}
+	else if (WARN_ON_ONCE(op != TFW_H2_TRANS_EXPAND)) {
+		return -EINVAL;
+	}
+
+	r = tfw_http_msg_expand_data(&mit->iter, &resp->msg.skb_head, data,
+				     &mit->start_off);
+	if (unlikely(r))
+		return r;
+	mit->acc_len += data->len;
+
+	return 0;
+}
+
 void
 tfw_hpack_set_rbuf_size(TfwHPackETbl *__restrict tbl, unsigned short new_size)
 {
@@ -3837,6 +4322,7 @@ tfw_hpack_set_rbuf_size(TfwHPackETbl *__restrict tbl, unsigned short new_size)
 	       " new_size=%hu\n", __func__, tbl->rb_len, tbl->size,
 	       tbl->window, new_size);
 
+	tbl->lim = new_size;
 	if (tbl->window > new_size) {
 		if (tbl->size > new_size)
 			tfw_hpack_rbuf_calc(tbl, new_size, NULL,
@@ -3848,3 +4334,479 @@ tfw_hpack_set_rbuf_size(TfwHPackETbl *__restrict tbl, unsigned short new_size)
 
 	spin_unlock(&tbl->lock);
 }
+
+static long
+tfw_hpack_srv_huffman(const unsigned char *src, unsigned long n,
+		      char *dst, unsigned long size)
+{
+	unsigned long i, out = 0;
+	unsigned int code = 0, len = 0;
+
+	for (i = 0; i < n; ++i) {
+		int b;
+
+		for (b = 7; b >= 0; --b) {
+			unsigned int sym;
+
+			code = (code << 1) | ((src[i] >> b) & 1);
+			if (++len > HT_MAX_LEN)
+				return -EINVAL;
+			if (code - ht_dec_first[len] >= ht_dec_cnt[len])
+				continue;
+			sym = ht_dec_off[len] + code - ht_dec_first[len];
+			/* RFC 7541 5.2: EOS in the string is a decoding error. */
+			if (sym >= 256)
+				return -EINVAL;
+			if (out == size)
+				return -ENOMEM;
+			dst[out++] = ht_dec_sym[sym];
+			code = len = 0;
+		}
+	}
+	/* RFC 7541 5.2: the padding is the shortest prefix of EOS. */
+	if (len > 7 || code != (1U << len) - 1)
+		return -EINVAL;
+
+	return out;
+}
+
+static int
+tfw_hpack_srv_int(const unsigned char **p, const unsigned char *end,
+		  unsigned int prefix, unsigned long *val)
+{
+	unsigned int m = 0;
+	unsigned char c;
+	unsigned long max = (1UL << prefix) - 1;
+
+	*val = *(*p)++ & max;
+	if (*val < max)
+		return 0;
+	do {
+		if (*p == end || m > 28)
+			return -EINVAL;
+		c = *(*p)++;
+		*val += (unsigned long)(c & 0x7F) << m;
+		m += 7;
+	} while (c & 0x80);
+
+	return 0;
+}
+
+/*
+ * Read string literal of @prefix bits length prefix, the Huffman flag is the
+ * next bit after the prefix: 7 for HPACK, RFC 7541 5.2, and all QPACK values,
+ * 3 for QPACK literal names, RFC 9204 4.5.6.
+ */
+static int
+tfw_hpack_srv_str(const unsigned char **p, const unsigned char *end,
+		  unsigned int prefix, char **pos, const char *lim,
+		  const char **str, unsigned long *len)
+{
+	long n;
+	bool huffman;
+
+	if (*p == end)
+		return -EINVAL;
+	huffman = **p & (1 << prefix);
+	if (tfw_hpack_srv_int(p, end, prefix, len) || *len > end - *p)
+		return -EINVAL;
+	if (!huffman) {
+		*str = (const char *)*p;
+		*p += *len;
+		return 0;
+	}
+	n = tfw_hpack_srv_huffman(*p, *len, *pos, lim - *pos);
+	if (n < 0)
+		return n;
+	*p += *len;
+	*str = *pos;
+	*len = n;
+	*pos += n;
+
+	return 0;
+}
+
+/**
+ * Decode header block @src of @n bytes received from HTTP/2 upstream server
+ * and call @cb with each header name and value. Tempesta FW announces zero
+ * size of the dynamic table to the servers, so only the static table can be
+ * referenced. Huffman encoded strings are decoded into @buf of @size bytes,
+ * which must be twice as large as @n.
+ */
+int
+tfw_hpack_srv_decode(const unsigned char *src, unsigned long n, char *buf,
+		     unsigned long size, tfw_hpack_srv_cb_t cb, void *data)
+{
+	int r;
+	const unsigned char *p = src, *end = src + n;
+	char *pos = buf;
+	const char *name, *val;
+	unsigned long idx, nlen, vlen;
+	const TfwStr *h;
+
+	while (p < end) {
+		if (*p & 0x80) {
+			/* Indexed header field, RFC 7541 6.1. */
+			if (tfw_hpack_srv_int(&p, end, 7, &idx)
+			    || !idx || idx > HPACK_STATIC_ENTRIES)
+				return -EINVAL;
+			h = static_table[idx - 1].hdr;
+			if (h->nchunks != 2)
+				return -EINVAL;
+			name = TFW_STR_CHUNK(h, 0)->data;
+			nlen = TFW_STR_CHUNK(h, 0)->len;
+			val = TFW_STR_CHUNK(h, 1)->data;
+			vlen = TFW_STR_CHUNK(h, 1)->len;
+		}
+		else if ((*p & 0xE0) == 0x20) {
+			/* Dynamic table size update, RFC 7541 6.3. */
+			if (tfw_hpack_srv_int(&p, end, 5, &idx) || idx)
+				return -EINVAL;
+			continue;
+		}
+		else {
+			/*
+			 * Literal header field, RFC 7541 6.2. The headers with
+			 * incremental indexing don't fit the zero size dynamic
+			 * table, so they aren't indexed.
+			 */
+			if (tfw_hpack_srv_int(&p, end, (*p & 0x40) ? 6 : 4,
+					      &idx)
+			    || idx > HPACK_STATIC_ENTRIES)
+				return -EINVAL;
+			if (idx) {
+				h = static_table[idx - 1].hdr;
+				name = TFW_STR_CHUNK(h, 0)->data;
+				nlen = TFW_STR_CHUNK(h, 0)->len;
+			}
+			else if (tfw_hpack_srv_str(&p, end, 7, &pos,
+						   buf + size, &name, &nlen))
+			{
+				return -EINVAL;
+			}
+			if (tfw_hpack_srv_str(&p, end, 7, &pos, buf + size,
+					      &val, &vlen))
+				return -EINVAL;
+		}
+		if ((r = cb(data, name, nlen, val, vlen)))
+			return r;
+	}
+
+	return 0;
+}
+
+/*
+ * Static table index of pseudo-header @name of @len bytes which can be sent
+ * with arbitrary values, zero if the name isn't such pseudo-header.
+ */
+static unsigned short
+tfw_hpack_srv_pseudo_idx(const char *name, unsigned long len)
+{
+	if (len < 5 || *name != ':')
+		return 0;
+	if (len == 10 && !memcmp(name, ":authority", 10))
+		return 1;
+	if (len == 7 && !memcmp(name, ":method", 7))
+		return 2;
+	if (len == 5 && !memcmp(name, ":path", 5))
+		return 4;
+
+	return 0;
+}
+
+/**
+ * Write header @name of @nlen bytes with value @val of @vlen bytes to @p as
+ * literal header field without indexing, RFC 7541 6.2.2. The name is taken
+ * from the static table if it's found there. Return the end of the written
+ * data or NULL if there is no room for it before @end.
+ */
+unsigned char *
+tfw_hpack_srv_write(unsigned char *p, const unsigned char *end,
+		    const char *name, unsigned long nlen, const char *val,
+		    unsigned long vlen)
+{
+	TfwHPackInt i;
+	unsigned short idx = tfw_hpack_srv_pseudo_idx(name, nlen);
+
+	if (!idx)
+		idx = tfw_hpack_name_idx(name, nlen);
+	write_int(idx, 15, 0, &i);
+	if (end - p < i.sz)
+		return NULL;
+	memcpy_fast(p, i.buf, i.sz);
+	p += i.sz;
+	if (!idx) {
+		write_int(nlen, 127, 0, &i);
+		if (end - p < i.sz + nlen)
+			return NULL;
+		memcpy_fast(p, i.buf, i.sz);
+		memcpy_fast(p + i.sz, name, nlen);
+		p += i.sz + nlen;
+	}
+	write_int(vlen, 127, 0, &i);
+	if (end - p < i.sz + vlen)
+		return NULL;
+	memcpy_fast(p, i.buf, i.sz);
+	memcpy_fast(p + i.sz, val, vlen);
+
+	return p + i.sz + vlen;
+}
+
+/*
+ * ------------------------------------------------------------------------
+ *	QPACK static table coding, RFC 9204.
+ * ------------------------------------------------------------------------
+ *
+ * Tempesta FW announces zero QPACK dynamic table capacity, so the field
+ * sections reference only the static table, as the HTTP/2 upstream header
+ * blocks do, and the coding reuses the HPACK integer and Huffman routines.
+ */
+#define QP_ENTRY(n, v)	{ .name = n, .val = v, .nlen = SLEN(n), .vlen = SLEN(v) }
+
+static const struct {
+	const char	*name;
+	const char	*val;
+	unsigned char	nlen;
+	unsigned char	vlen;
+} qpack_static_table[] = {
+	QP_ENTRY(":authority", ""),
+	QP_ENTRY(":path", "/"),
+	QP_ENTRY("age", "0"),
+	QP_ENTRY("content-disposition", ""),
+	QP_ENTRY("content-length", "0"),
+	QP_ENTRY("cookie", ""),
+	QP_ENTRY("date", ""),
+	QP_ENTRY("etag", ""),
+	QP_ENTRY("if-modified-since", ""),
+	QP_ENTRY("if-none-match", ""),
+	QP_ENTRY("last-modified", ""),
+	QP_ENTRY("link", ""),
+	QP_ENTRY("location", ""),
+	QP_ENTRY("referer", ""),
+	QP_ENTRY("set-cookie", ""),
+	QP_ENTRY(":method", "CONNECT"),
+	QP_ENTRY(":method", "DELETE"),
+	QP_ENTRY(":method", "GET"),
+	QP_ENTRY(":method", "HEAD"),
+	QP_ENTRY(":method", "OPTIONS"),
+	QP_ENTRY(":method", "POST"),
+	QP_ENTRY(":method", "PUT"),
+	QP_ENTRY(":scheme", "http"),
+	QP_ENTRY(":scheme", "https"),
+	QP_ENTRY(":status", "103"),
+	QP_ENTRY(":status", "200"),
+	QP_ENTRY(":status", "304"),
+	QP_ENTRY(":status", "404"),
+	QP_ENTRY(":status", "503"),
+	QP_ENTRY("accept", "*/*"),
+	QP_ENTRY("accept", "application/dns-message"),
+	QP_ENTRY("accept-encoding", "gzip, deflate, br"),
+	QP_ENTRY("accept-ranges", "bytes"),
+	QP_ENTRY("access-control-allow-headers", "cache-control"),
+	QP_ENTRY("access-control-allow-headers", "content-type"),
+	QP_ENTRY("access-control-allow-origin", "*"),
+	QP_ENTRY("cache-control", "max-age=0"),
+	QP_ENTRY("cache-control", "max-age=2592000"),
+	QP_ENTRY("cache-control", "max-age=604800"),
+	QP_ENTRY("cache-control", "no-cache"),
+	QP_ENTRY("cache-control", "no-store"),
+	QP_ENTRY("cache-control", "public, max-age=31536000"),
+	QP_ENTRY("content-encoding", "br"),
+	QP_ENTRY("content-encoding", "gzip"),
+	QP_ENTRY("content-type", "application/dns-message"),
+	QP_ENTRY("content-type", "application/javascript"),
+	QP_ENTRY("content-type", "application/json"),
+	QP_ENTRY("content-type", "application/x-www-form-urlencoded"),
+	QP_ENTRY("content-type", "image/gif"),
+	QP_ENTRY("content-type", "image/jpeg"),
+	QP_ENTRY("content-type", "image/png"),
+	QP_ENTRY("content-type", "text/css"),
+	QP_ENTRY("content-type", "text/html; charset=utf-8"),
+	QP_ENTRY("content-type", "text/plain"),
+	QP_ENTRY("content-type", "text/plain;charset=utf-8"),
+	QP_ENTRY("range", "bytes=0-"),
+	QP_ENTRY("strict-transport-security", "max-age=31536000"),
+	QP_ENTRY("strict-transport-security",
+		 "max-age=31536000; includesubdomains"),
+	QP_ENTRY("strict-transport-security",
+		 "max-age=31536000; includesubdomains; preload"),
+	QP_ENTRY("vary", "accept-encoding"),
+	QP_ENTRY("vary", "origin"),
+	QP_ENTRY("x-content-type-options", "nosniff"),
+	QP_ENTRY("x-xss-protection", "1; mode=block"),
+	QP_ENTRY(":status", "100"),
+	QP_ENTRY(":status", "204"),
+	QP_ENTRY(":status", "206"),
+	QP_ENTRY(":status", "302"),
+	QP_ENTRY(":status", "400"),
+	QP_ENTRY(":status", "403"),
+	QP_ENTRY(":status", "421"),
+	QP_ENTRY(":status", "425"),
+	QP_ENTRY(":status", "500"),
+	QP_ENTRY("accept-language", ""),
+	QP_ENTRY("access-control-allow-credentials", "FALSE"),
+	QP_ENTRY("access-control-allow-credentials", "TRUE"),
+	QP_ENTRY("access-control-allow-headers", "*"),
+	QP_ENTRY("access-control-allow-methods", "get"),
+	QP_ENTRY("access-control-allow-methods", "get, post, options"),
+	QP_ENTRY("access-control-allow-methods", "options"),
+	QP_ENTRY("access-control-expose-headers", "content-length"),
+	QP_ENTRY("access-control-request-headers", "content-type"),
+	QP_ENTRY("access-control-request-method", "get"),
+	QP_ENTRY("access-control-request-method", "post"),
+	QP_ENTRY("alt-svc", "clear"),
+	QP_ENTRY("authorization", ""),
+	QP_ENTRY("content-security-policy",
+		 "script-src 'none'; object-src 'none'; base-uri 'none'"),
+	QP_ENTRY("early-data", "1"),
+	QP_ENTRY("expect-ct", ""),
+	QP_ENTRY("forwarded", ""),
+	QP_ENTRY("if-range", ""),
+	QP_ENTRY("origin", ""),
+	QP_ENTRY("purpose", "prefetch"),
+	QP_ENTRY("server", ""),
+	QP_ENTRY("timing-allow-origin", "*"),
+	QP_ENTRY("upgrade-insecure-requests", "1"),
+	QP_ENTRY("user-agent", ""),
+	QP_ENTRY("x-forwarded-for", ""),
+	QP_ENTRY("x-frame-options", "deny"),
+	QP_ENTRY("x-frame-options", "sameorigin")
+};
+
+#define QPACK_STATIC_ENTRIES	ARRAY_SIZE(qpack_static_table)
+
+/**
+ * Decode field section @src of @n bytes, RFC 9204 4.5, and call @cb with
+ * each field name and value. The references to the dynamic table are
+ * errors since its capacity is zero. Huffman encoded strings are decoded
+ * into @buf of @size bytes, which must be twice as large as @n.
+ */
+int
+tfw_qpack_decode(const unsigned char *src, unsigned long n, char *buf,
+		 unsigned long size, tfw_hpack_srv_cb_t cb, void *data)
+{
+	int r;
+	const unsigned char *p = src, *end = src + n;
+	char *pos = buf;
+	const char *name, *val;
+	unsigned long idx, nlen, vlen;
+
+	/* Required Insert Count must be zero, Base is meaningless then. */
+	if (n < 2 || tfw_hpack_srv_int(&p, end, 8, &idx) || idx
+	    || p == end || tfw_hpack_srv_int(&p, end, 7, &idx))
+		return -EINVAL;
+
+	while (p < end) {
+		if (*p & 0x80) {
+			/* Indexed field line, RFC 9204 4.5.2. */
+			if (!(*p & 0x40)
+			    || tfw_hpack_srv_int(&p, end, 6, &idx)
+			    || idx >= QPACK_STATIC_ENTRIES)
+				return -EINVAL;
+			name = qpack_static_table[idx].name;
+			nlen = qpack_static_table[idx].nlen;
+			val = qpack_static_table[idx].val;
+			vlen = qpack_static_table[idx].vlen;
+		}
+		else if (*p & 0x40) {
+			/* Literal field line with name reference, 4.5.4. */
+			if (!(*p & 0x10)
+			    || tfw_hpack_srv_int(&p, end, 4, &idx)
+			    || idx >= QPACK_STATIC_ENTRIES)
+				return -EINVAL;
+			name = qpack_static_table[idx].name;
+			nlen = qpack_static_table[idx].nlen;
+			if (tfw_hpack_srv_str(&p, end, 7, &pos, buf + size,
+					      &val, &vlen))
+				return -EINVAL;
+		}
+		else if (*p & 0x20) {
+			/* Literal field line with literal name, 4.5.6. */
+			if (tfw_hpack_srv_str(&p, end, 3, &pos, buf + size,
+					      &name, &nlen)
+			    || tfw_hpack_srv_str(&p, end, 7, &pos, buf + size,
+						 &val, &vlen))
+				return -EINVAL;
+		}
+		else {
+			/* Post-Base references to the dynamic table. */
+			return -EINVAL;
+		}
+		if ((r = cb(data, name, nlen, val, vlen)))
+			return r;
+	}
+
+	return 0;
+}
+
+/**
+ * Write field section prefix, RFC 9204 4.5.1, for a section referencing only
+ * the static table: zero Required Insert Count and zero Delta Base. Return
+ * the end of the written data or NULL if there's no room for it before @end.
+ */
+unsigned char *
+tfw_qpack_write_prefix(unsigned char *p, const unsigned char *end)
+{
+	if (end - p < 2)
+		return NULL;
+	*p++ = 0;
+	*p++ = 0;
+
+	return p;
+}
+
+/**
+ * Write field @name of @nlen bytes with value @val of @vlen bytes to @p as
+ * indexed field line, if the static table has the same field, or as literal
+ * field line with the static name reference or with the literal name.
+ * @name must be in lower case. The names of the table aren't grouped, so
+ * the whole table is scanned, but the lengths mismatch for the most entries.
+ * Return the end of the written data or NULL if there is no room for it
+ * before @end.
+ */
+unsigned char *
+tfw_qpack_write(unsigned char *p, const unsigned char *end, const char *name,
+		unsigned long nlen, const char *val, unsigned long vlen)
+{
+	TfwHPackInt i;
+	unsigned int idx, n_idx = QPACK_STATIC_ENTRIES;
+
+	for (idx = 0; idx < QPACK_STATIC_ENTRIES; ++idx) {
+		if (qpack_static_table[idx].nlen != nlen
+		    || memcmp(qpack_static_table[idx].name, name, nlen))
+			continue;
+		if (qpack_static_table[idx].vlen == vlen
+		    && !memcmp(qpack_static_table[idx].val, val, vlen))
+		{
+			write_int(idx, 0x3F, 0xC0, &i);
+			if (end - p < i.sz)
+				return NULL;
+			memcpy_fast(p, i.buf, i.sz);
+			return p + i.sz;
+		}
+		if (n_idx == QPACK_STATIC_ENTRIES)
+			n_idx = idx;
+	}
+
+	if (n_idx < QPACK_STATIC_ENTRIES) {
+		write_int(n_idx, 0xF, 0x50, &i);
+		if (end - p < i.sz)
+			return NULL;
+		memcpy_fast(p, i.buf, i.sz);
+		p += i.sz;
+	} else {
+		write_int(nlen, 0x7, 0x20, &i);
+		if (end - p < i.sz + nlen)
+			return NULL;
+		memcpy_fast(p, i.buf, i.sz);
+		memcpy_fast(p + i.sz, name, nlen);
+		p += i.sz + nlen;
+	}
+	write_int(vlen, 0x7F, 0, &i);
+	if (end - p < i.sz + vlen)
+		return NULL;
+	memcpy_fast(p, i.buf, i.sz);
+	memcpy_fast(p + i.sz, val, vlen);
+
+	return p + i.sz + vlen;
+}
@@ -29,6 +29,19 @@
  */
 #define HPACK_TABLE_DEF_SIZE		4096
 #define HPACK_ENC_TABLE_MAX_SIZE	HPACK_TABLE_DEF_SIZE
+/*
+ * Number of hash buckets of the encoder dynamic index. Each entry takes at
+ * least HPACK_ENTRY_OVERHEAD (32) bytes of the table, so the table can't
+ * hold more than 128 entries and the chains are short.
+ */
+#define HPACK_ENC_HASH_BITS		6
+#define HPACK_ENC_HASH_SIZE		(1 << HPACK_ENC_HASH_BITS)
+
+/*
+ * Static table index of the first regular header. Header names with the
+ * greater indexes are unique, so the names differ if their indexes differ.
+ */
+#define HPACK_STATIC_REGULAR_IDX	15
 
 /**
  * Red-black tree node representation in the ring buffer.
@@ -46,6 +59,8 @@
  * @parent	- parent node offset in the ring buffer (in bytes);
  * @left	- left child offset in the ring buffer (in bytes);
  * @right	- right child offset in the ring buffer (in bytes);
+ * @hnext	- offset of the next node in the same hash bucket (in bytes);
+ * @hash	- hash of the header name (in lower case) and value;
  * @hdr		- pointer to header string.
  */
 typedef struct {
@@ -55,6 +70,8 @@ typedef struct {
 	short			parent;
 	short			left;
 	short			right;
+	short			hnext;
+	unsigned int		hash;
 	char			hdr[0];
 } TfwHPackNode;
 
@@ -76,28 +93,44 @@ typedef struct {
 
 /**
  * HPack encoder dynamic index, implemented as ring buffer with entries
- * organized in form of binary tree.
+ * organized in form of binary tree and hash table.
  *
  * @window	- maximum pseudo-length of the dynamic table (in bytes); this
  *		  value used as threshold to flushing old entries;
+ * @lim		- maximum size of the dynamic table allowed by the peer,
+ *		  the @window is adapted within it;
+ * @adapt_n	- number of the lookups in the current adaptation period;
+ * @adapt_hits	- number of the headers found in the current period;
  * @rbuf	- pointer to the ring buffer;
  * @root	- pointer to the root node of binary tree;
+ * @hbuckets	- offsets of the first nodes of hash chains in the ring buffer
+ *		  (in bytes), full headers are looked up here before the tree;
  * @pool	- memory pool for dynamic table;
  * @idx_acc	- current accumulated index, intended for real indexes
  *		  calculation;
  * @guard	- atomic protection against races during entries
  *		  addition/eviction in encoder dynamic index;
- * @lock	- spinlock to synchronize concurrent access to encoder index.
+ * @lock	- spinlock to synchronize concurrent access to encoder index;
+ * @hits	- number of the headers found in the index;
+ * @nm_hits	- number of the headers with only the name found in the index;
+ * @misses	- number of the headers not found in the index.
  */
 typedef struct {
 	TFW_HPACK_ETBL_COMMON;
 	unsigned short		window;
+	unsigned short		lim;
+	unsigned short		adapt_n;
+	unsigned short		adapt_hits;
 	char			*rbuf;
 	TfwHPackNode		*root;
+	short			hbuckets[HPACK_ENC_HASH_SIZE];
 	TfwPool			*pool;
 	unsigned long		idx_acc;
 	atomic64_t		guard;
 	spinlock_t		lock;
+	unsigned long		hits;
+	unsigned long		nm_hits;
+	unsigned long		misses;
 } TfwHPackETbl;
 
 /**
@@ -192,6 +225,8 @@ typedef struct {
  * @max_window	- maximum allowed size for the decoder dynamic table;
  * @curr	- current shift in Huffman decoding context;
  * @hctx	- current Huffman decoding context;
+ * @hoff	- offset of the current Huffman decoding table, used when a code
+ *		  is interrupted due to absence of the next fragment;
  * @__off	- offset to reinitialize processing context;
  * @state	- current state;
  * @shift	- current shift, used when integer decoding interrupted due
@@ -206,6 +241,7 @@ typedef struct {
 	unsigned int		max_window;
 	int			curr;
 	unsigned short		hctx;
+	unsigned short		hoff;
 	char			__off[0];
 	unsigned int		state;
 	unsigned int		shift;
@@ -250,23 +286,14 @@ typedef struct {
 	TfwStr			h2_data;
 } TfwDecodeCacheIter;
 
-#define	BUFFER_GET(len, it)					\
-do {								\
-	BUG_ON(!(len));						\
-	WARN_ON_ONCE((it)->rspace);				\
-	(it)->rspace = len;					\
-	(it)->pos = tfw_pool_alloc_not_align((it)->pool, len);	\
-	T_DBG3("%s: get buffer, len=%lu, it->pos=[%p],"		\
-	       " it->pos=%lu\n", __func__, (unsigned long)len,	\
-	       (it)->pos, (unsigned long)(it)->pos);		\
-} while (0)
-
 void write_int(unsigned long index, unsigned short max, unsigned short mask,
 	       TfwHPackInt *__restrict res_idx);
 int tfw_hpack_init(TfwHPack *__restrict hp, unsigned int htbl_sz);
 void tfw_hpack_clean(TfwHPack *__restrict hp);
 int tfw_hpack_encode(TfwHttpResp *__restrict resp, TfwStr *__restrict hdr,
 		     TfwH2TransOp op, bool dyn_indexing);
+int tfw_hpack_add_raw(TfwHttpResp *__restrict resp, const TfwStr *__restrict data,
+		      TfwH2TransOp op);
 void tfw_hpack_set_rbuf_size(TfwHPackETbl *__restrict tbl,
 			     unsigned short new_size);
 int tfw_hpack_decode(TfwHPack *__restrict hp, unsigned char *__restrict src,
@@ -277,6 +304,26 @@ int tfw_hpack_cache_decode_expand(TfwHPack *__restrict hp,
 				  unsigned char *__restrict src, unsigned long n,
 				  TfwDecodeCacheIter *__restrict cd_iter);
 void tfw_hpack_enc_release(TfwHPack *__restrict hp, unsigned long *flags);
+unsigned short tfw_hpack_name_idx(const char *name, unsigned long len);
+unsigned short tfw_hpack_hdr_name_idx(const TfwStr *hdr);
+void tfw_hpack_huffman_init(void);
+
+typedef int (*tfw_hpack_srv_cb_t)(void *data, const char *name,
+				  unsigned long nlen, const char *val,
+				  unsigned long vlen);
+
+int tfw_hpack_srv_decode(const unsigned char *src, unsigned long n, char *buf,
+			 unsigned long size, tfw_hpack_srv_cb_t cb, void *data);
+unsigned char *tfw_hpack_srv_write(unsigned char *p, const unsigned char *end,
+				   const char *name, unsigned long nlen,
+				   const char *val, unsigned long vlen);
+int tfw_qpack_decode(const unsigned char *src, unsigned long n, char *buf,
+		     unsigned long size, tfw_hpack_srv_cb_t cb, void *data);
+unsigned char *tfw_qpack_write_prefix(unsigned char *p,
+				      const unsigned char *end);
+unsigned char *tfw_qpack_write(unsigned char *p, const unsigned char *end,
+			       const char *name, unsigned long nlen,
+			       const char *val, unsigned long vlen);
 
 static inline unsigned int
 tfw_hpack_int_size(unsigned long index, unsigned short max)
@@ -0,0 +1,179 @@
+/**
+ *		Tempesta FW
+ *
+ * Perfect hash generator for header names of HPACK static table.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+/* Number of bits in the hash value, i.e. the slots table has 128 entries. */
+#define NBITS		7
+#define CASE		0x2020202020202020ULL
+/* Index of the first regular header in the static table. */
+#define FIRST		15
+/* Number of tries to find the multipliers. */
+#define TRIES		100000000
+
+/*
+ * Regular header names of HPACK static table, RFC 7541 Appendix A,
+ * starting from index 15. Pseudo-headers have no regular names.
+ */
+static const char *names[] = {
+	"accept-charset",
+	"accept-encoding",
+	"accept-language",
+	"accept-ranges",
+	"accept",
+	"access-control-allow-origin",
+	"age",
+	"allow",
+	"authorization",
+	"cache-control",
+	"content-disposition",
+	"content-encoding",
+	"content-language",
+	"content-length",
+	"content-location",
+	"content-range",
+	"content-type",
+	"cookie",
+	"date",
+	"etag",
+	"expect",
+	"expires",
+	"from",
+	"host",
+	"if-match",
+	"if-modified-since",
+	"if-none-match",
+	"if-range",
+	"if-unmodified-since",
+	"last-modified",
+	"link",
+	"location",
+	"max-forwards",
+	"proxy-authenticate",
+	"proxy-authorization",
+	"range",
+	"referer",
+	"refresh",
+	"retry-after",
+	"server",
+	"set-cookie",
+	"strict-transport-security",
+	"transfer-encoding",
+	"user-agent",
+	"vary",
+	"via",
+	"www-authenticate",
+};
+
+#define N	(sizeof(names) / sizeof(names[0]))
+
+/*
+ * The hash function, must be the same as hn_hash() in hpack.c: the first and
+ * the last 8 bytes of the name, or the whole name padded by zeros if it's
+ * shorter than 8 bytes, converted to lower case, and the name length.
+ */
+static unsigned int
+hash(const char *name, size_t len, uint64_t m0, uint64_t m1)
+{
+	uint64_t w0 = 0, w1;
+
+	if (len >= 8) {
+		memcpy(&w0, name, 8);
+		memcpy(&w1, name + len - 8, 8);
+	} else {
+		memcpy(&w0, name, len);
+		w1 = w0;
+	}
+	w0 |= CASE;
+	w1 = (w1 | CASE) ^ len;
+
+	return (w0 * m0 ^ w1 * m1) >> (64 - NBITS);
+}
+
+/* xorshift64* to get reproducible multipliers. */
+static uint64_t
+rnd(void)
+{
+	static uint64_t x = 0x9e3779b97f4a7c15ULL;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned char slots[1 << NBITS];
+	size_t i, min_len = ~0UL, max_len = 0;
+	uint64_t m0, m1;
+	long t;
+
+	for (i = 0; i < N; ++i) {
+		size_t len = strlen(names[i]);
+
+		if (len < min_len)
+			min_len = len;
+		if (len > max_len)
+			max_len = len;
+	}
+
+	for (t = 0; t < TRIES; ++t) {
+		m0 = rnd() | 1;
+		m1 = rnd() | 1;
+		memset(slots, 0, sizeof(slots));
+		for (i = 0; i < N; ++i) {
+			unsigned int h = hash(names[i], strlen(names[i]),
+					      m0, m1);
+			if (slots[h])
+				break;
+			slots[h] = FIRST + i;
+		}
+		if (i == N)
+			break;
+	}
+	if (t == TRIES) {
+		fprintf(stderr, "cannot find perfect hash in %d tries\n",
+			TRIES);
+		return 1;
+	}
+
+	printf("#define HN_BITS\t\t%u\n", NBITS);
+	printf("#define HN_M0\t\t0x%016" PRIx64 "UL\n", m0);
+	printf("#define HN_M1\t\t0x%016" PRIx64 "UL\n", m1);
+	printf("#define HN_MIN_LEN\t%zu\n", min_len);
+	printf("#define HN_MAX_LEN\t%zu\n\n", max_len);
+
+	printf("static const unsigned char hn_slots[1 << HN_BITS]"
+	       " ____cacheline_aligned = {\n");
+	for (i = 0; i < sizeof(slots); ++i) {
+		if (slots[i])
+			printf("\t[%3zu] = %2u, /* %s */\n", i, slots[i],
+			       names[slots[i] - FIRST]);
+	}
+	printf("};\n");
+
+	return 0;
+}
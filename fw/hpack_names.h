@@ -0,0 +1,96 @@
+/**
+ *		Tempesta FW
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __TFW_HTTP_HPACK_NAMES_H__
+#define __TFW_HTTP_HPACK_NAMES_H__
+
+/**
+ * Perfect hash of regular header names of HPACK static table.
+ *
+ * |HN_M0|, |HN_M1|	- multipliers of the first and the last 8 bytes of
+ *			  a header name, see hn_hash();
+ * |hn_slots|		- static table index of the header name for each hash
+ *			  value or zero for unused slots;
+ */
+
+/*
+ * All the below is generated by hpack/hngen.c. DO NOT EDIT IT BY HANDS!
+ * If you need to change the header names or the hash function, then update
+ * the generation program, remove all the below the comment and run:
+ *
+ *	$ cd hpack && make && hngen >> ../hpack_names.h
+ */
+
+#define HN_BITS		7
+#define HN_M0		0x0ac52f03c2359f29UL
+#define HN_M1		0x91ce0286a88afebfUL
+#define HN_MIN_LEN	3
+#define HN_MAX_LEN	27
+
+static const unsigned char hn_slots[1 << HN_BITS] ____cacheline_aligned = {
+	[  1] = 16, /* accept-encoding */
+	[  4] = 34, /* etag */
+	[  5] = 60, /* via */
+	[  7] = 49, /* proxy-authorization */
+	[  9] = 43, /* if-unmodified-since */
+	[ 12] = 23, /* authorization */
+	[ 13] = 30, /* content-range */
+	[ 14] = 53, /* retry-after */
+	[ 17] = 26, /* content-encoding */
+	[ 19] = 61, /* www-authenticate */
+	[ 21] = 15, /* accept-charset */
+	[ 24] = 37, /* from */
+	[ 25] = 51, /* referer */
+	[ 27] = 35, /* expect */
+	[ 31] = 50, /* range */
+	[ 33] = 55, /* set-cookie */
+	[ 38] = 20, /* access-control-allow-origin */
+	[ 41] = 52, /* refresh */
+	[ 42] = 29, /* content-location */
+	[ 53] = 46, /* location */
+	[ 54] = 44, /* last-modified */
+	[ 55] = 56, /* strict-transport-security */
+	[ 56] = 58, /* user-agent */
+	[ 57] = 45, /* link */
+	[ 58] = 25, /* content-disposition */
+	[ 60] = 41, /* if-none-match */
+	[ 61] = 22, /* allow */
+	[ 68] = 59, /* vary */
+	[ 70] = 31, /* content-type */
+	[ 73] = 18, /* accept-ranges */
+	[ 74] = 38, /* host */
+	[ 75] = 19, /* accept */
+	[ 77] = 32, /* cookie */
+	[ 79] = 33, /* date */
+	[ 81] = 48, /* proxy-authenticate */
+	[ 86] = 40, /* if-modified-since */
+	[100] = 17, /* accept-language */
+	[102] = 28, /* content-length */
+	[104] = 24, /* cache-control */
+	[110] = 57, /* transfer-encoding */
+	[111] = 21, /* age */
+	[112] = 36, /* expires */
+	[114] = 54, /* server */
+	[118] = 47, /* max-forwards */
+	[119] = 42, /* if-range */
+	[120] = 27, /* content-language */
+	[127] = 39, /* if-match */
+};
+
+#endif /* __TFW_HTTP_HPACK_NAMES_H__ */
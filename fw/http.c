@@ -89,6 +89,7 @@
 
 #include "lib/hash.h"
 #include "lib/str.h"
+#include "access_log.h"
 #include "cache.h"
 #include "hash.h"
 #include "http_limits.h"
@@ -102,6 +103,7 @@
 #include "procfs.h"
 #include "server.h"
 #include "tls.h"
+#include "trace.h"
 #include "apm.h"
 
 #include "sync_socket.h"
@@ -119,6 +121,8 @@
 				 msg, status, addr_str))
 
 #define RESP_BUF_LEN		128
+/* Longest compound request strings copied into a single chunk. */
+#define TFW_HTTP_STR_LINEAR_MAX	256
 
 static DEFINE_PER_CPU(char[RESP_BUF_LEN], g_buf);
 int ghprio; /* GFSM hook priority. */
@@ -132,6 +136,11 @@ static struct {
 	unsigned int	sz;
 } tfw_wl_marks;
 
+/* Minimum body length of streamed responses, zero disables streaming. */
+static int tfw_resp_stream_thr;
+/* Minimum body length of streamed requests, zero disables streaming. */
+static int tfw_req_stream_thr;
+
 #define S_CRLFCRLF		"\r\n\r\n"
 #define S_HTTP			"http://"
 #define S_HTTPS			"https://"
@@ -143,6 +152,7 @@ static struct {
 #define S_403			"HTTP/1.1 403 Forbidden"
 #define S_404			"HTTP/1.1 404 Not Found"
 #define S_412			"HTTP/1.1 412 Precondition Failed"
+#define S_416			"HTTP/1.1 416 Range Not Satisfiable"
 #define S_500			"HTTP/1.1 500 Internal Server Error"
 #define S_502			"HTTP/1.1 502 Bad Gateway"
 #define S_503			"HTTP/1.1 503 Service Unavailable"
@@ -182,6 +192,8 @@ static struct {
 #define S_404_PART_02		S_CRLF S_F_CONTENT_LENGTH "0" S_CRLF
 #define S_412_PART_01		S_412 S_CRLF S_F_DATE
 #define S_412_PART_02		S_CRLF S_F_CONTENT_LENGTH "0" S_CRLF
+#define S_416_PART_01		S_416 S_CRLF S_F_DATE
+#define S_416_PART_02		S_CRLF S_F_CONTENT_LENGTH "0" S_CRLF
 #define S_500_PART_01		S_500 S_CRLF S_F_DATE
 #define S_500_PART_02		S_CRLF S_F_CONTENT_LENGTH "0" S_CRLF
 #define S_502_PART_01		S_502 S_CRLF S_F_DATE
@@ -266,6 +278,20 @@ static TfwStr http_predef_resps[RESP_NUM] = {
 			    S_CRLF),
 		.nchunks = 6
 	},
+	/* None of the requested byte ranges overlaps the representation. */
+	[RESP_416] = {
+		.chunks = (TfwStr []){
+			{ .data = S_416_PART_01, .len = SLEN(S_416_PART_01) },
+			{ .data = NULL, .len = SLEN(S_V_DATE) },
+			{ .data = S_416_PART_02, .len = SLEN(S_416_PART_02) },
+			{ .data = S_DEF_PART_03, .len = SLEN(S_DEF_PART_03) },
+			{ .data = S_CRLF, .len = SLEN(S_CRLF) },
+			{ .data = NULL, .len = 0 },
+		},
+		.len = SLEN(S_416_PART_01 S_V_DATE S_416_PART_02 S_DEF_PART_03
+			    S_CRLF),
+		.nchunks = 6
+	},
 	/* Internal error in TempestaFW. */
 	[RESP_500] = {
 		.chunks = (TfwStr []){
@@ -414,10 +440,42 @@ tfw_http_prep_date_from(char *buf, long date)
 #undef PRINT_2DIGIT
 }
 
+/*
+ * 'Date' header value formatted for the second @date, cached per CPU, since
+ * usually all the responses during the second have the same value. @hpack is
+ * the header prefix in HPACK format: literal header field without indexing
+ * with static table index 33 as the name and the value length, so @hpack and
+ * @val constitute the whole header in HPACK format.
+ */
+typedef struct {
+	long		date;
+	unsigned char	hpack[3];
+	char		val[SLEN(S_V_DATE)];
+} TfwHttpDate;
+
+static DEFINE_PER_CPU(TfwHttpDate, tfw_http_date_cache);
+
+static const TfwHttpDate *
+tfw_http_date(long date)
+{
+	TfwHttpDate *hd = this_cpu_ptr(&tfw_http_date_cache);
+
+	if (unlikely(hd->date != date || !hd->hpack[0])) {
+		tfw_http_prep_date_from(hd->val, date);
+		hd->hpack[0] = 0x0f;
+		hd->hpack[1] = 33 - 0x0f;
+		hd->hpack[2] = SLEN(S_V_DATE);
+		hd->date = date;
+	}
+
+	return hd;
+}
+
 static inline void
 tfw_http_prep_date(char *buf)
 {
-	tfw_http_prep_date_from(buf, tfw_current_timestamp());
+	memcpy_fast(buf, tfw_http_date(tfw_current_timestamp())->val,
+		    SLEN(S_V_DATE));
 }
 
 int
@@ -527,19 +585,18 @@ tfw_h2_prep_redirect(TfwHttpResp *resp, unsigned short status, TfwStr *rmark,
 #define S_REDIR_GEN	" Redirection" S_CRLF
 #define S_REDIR_P_01	S_F_DATE
 #define S_REDIR_P_02	S_CRLF S_F_LOCATION
-#define S_REDIR_P_03	S_CRLF S_F_SET_COOKIE
-#define S_REDIR_KEEP	S_CRLF S_F_CONNECTION S_V_CONN_KA S_CRLF
-#define S_REDIR_CLOSE	S_CRLF S_F_CONNECTION S_V_CONN_CLOSE S_CRLF
 
 /**
  * The response redirects the client to the same URI as the original request,
  * but it includes 'Set-Cookie:' header field that sets Tempesta sticky cookie.
- * If JS challenge is enabled, then body contained JS challenge is provided.
- * Body string contains the 'Content-Length' header, CRLF and body itself.
+ * Only the status line, 'Date' and 'Location' header fields depend on the
+ * request, the rest of the response starting from CRLF before 'Set-Cookie'
+ * is pre-rendered by the sticky cookie module and is passed in @tail with the
+ * cookie value and JS challenge body already patched in.
  */
 int
 tfw_h1_prep_redirect(TfwHttpResp *resp, unsigned short status, TfwStr *rmark,
-		     TfwStr *cookie, TfwStr *body)
+		     TfwStr *tail)
 {
 	TfwHttpReq *req = resp->req;
 	size_t data_len;
@@ -568,31 +625,12 @@ tfw_h1_prep_redirect(TfwHttpResp *resp, unsigned short status, TfwStr *rmark,
 		.len = SLEN(S_REDIR_P_01 S_V_DATE S_REDIR_P_02),
 		.nchunks = 3
 	};
-	static TfwStr h_common_2 = {
-		.data = S_REDIR_P_03, .len = SLEN(S_REDIR_P_03) };
-	static TfwStr crlf = {
-		.data = S_CRLF, .len = SLEN(S_CRLF) };
-	static TfwStr crlf_keep = {
-		.data = S_REDIR_KEEP, .len = SLEN(S_REDIR_KEEP) };
-	static TfwStr crlf_close = {
-		.data = S_REDIR_CLOSE, .len = SLEN(S_REDIR_CLOSE) };
-	TfwStr c_len_crlf = {
-		.chunks = (TfwStr []){
-			{ .data = S_F_CONTENT_LENGTH,
-			  .len = SLEN(S_F_CONTENT_LENGTH) },
-			{ .data = (*this_cpu_ptr(&g_buf) + RESP_BUF_LEN / 2 + 3),
-			  .len = 0 },
-			{ .data = S_CRLFCRLF, .len = SLEN(S_CRLFCRLF) }
-		},
-		.len = SLEN(S_F_CONTENT_LENGTH S_CRLFCRLF),
-		.nchunks = 3
-	};
 	static TfwStr protos[] = {
 		{ .data = S_HTTP, .len = SLEN(S_HTTP) },
 		{ .data = S_HTTPS, .len = SLEN(S_HTTPS) },
 	};
 	TfwStr *proto = &protos[TFW_CONN_PROTO(req->conn) == TFW_FSM_HTTPS];
-	TfwStr host, *rh, *cookie_crlf = &crlf;
+	TfwStr host, *rh;
 
 	if (status == 302) {
 		rh = &rh_302;
@@ -602,10 +640,6 @@ tfw_h1_prep_redirect(TfwHttpResp *resp, unsigned short status, TfwStr *rmark,
 		tfw_ultoa(status, __TFW_STR_CH(&rh_gen, 1)->data, 3);
 		rh = &rh_gen;
 	}
-	__TFW_STR_CH(&c_len_crlf, 1)->len += tfw_ultoa(
-		body ? body->len : 0, __TFW_STR_CH(&c_len_crlf, 1)->data,
-		RESP_BUF_LEN / 2 - 3);
-	c_len_crlf.len += __TFW_STR_CH(&c_len_crlf, 1)->len;
 
 	if (req->host.len)
 		host = req->host;
@@ -614,19 +648,11 @@ tfw_h1_prep_redirect(TfwHttpResp *resp, unsigned short status, TfwStr *rmark,
 					 &req->h_tbl->tbl[TFW_HTTP_HDR_HOST],
 					 TFW_HTTP_HDR_HOST, &host);
 
-	/* Set "Connection:" header field if needed. */
-	if (test_bit(TFW_HTTP_B_CONN_CLOSE, req->flags))
-		cookie_crlf = &crlf_close;
-	else if (test_bit(TFW_HTTP_B_CONN_KA, req->flags))
-		cookie_crlf = &crlf_keep;
-
 	/* Add variable part of data length to get the total */
 	data_len = rh->len + h_common_1.len;
 	data_len += host.len ? host.len + proto->len : 0;
 	data_len += rmark->len;
-	data_len += req->uri_path.len + h_common_2.len + cookie->len;
-	data_len += cookie_crlf->len + c_len_crlf.len;
-	data_len += body ? body->len : 0;
+	data_len += req->uri_path.len + tail->len;
 
 	if (tfw_http_msg_setup((TfwHttpMsg *)resp, &it, data_len, 0))
 		return TFW_BLOCK;
@@ -648,12 +674,7 @@ tfw_h1_prep_redirect(TfwHttpResp *resp, unsigned short status, TfwStr *rmark,
 		ret |= tfw_msg_write(&it, rmark);
 
 	ret |= tfw_msg_write(&it, &req->uri_path);
-	ret |= tfw_msg_write(&it, &h_common_2);
-	ret |= tfw_msg_write(&it, cookie);
-	ret |= tfw_msg_write(&it, cookie_crlf);
-	ret |= tfw_msg_write(&it, &c_len_crlf);
-	if (body)
-		ret |= tfw_msg_write(&it, body);
+	ret |= tfw_msg_write(&it, tail);
 
 	return ret;
 }
@@ -661,16 +682,17 @@ tfw_h1_prep_redirect(TfwHttpResp *resp, unsigned short status, TfwStr *rmark,
 #define S_304_PART_01	S_304 S_CRLF
 #define S_304_KEEP	S_F_CONNECTION S_V_CONN_KA S_CRLF
 #define S_304_CLOSE	S_F_CONNECTION S_V_CONN_CLOSE S_CRLF
+#define S_416_CACHE	S_416 S_CRLF S_F_CONTENT_LENGTH "0" S_CRLF
 
 /*
- * Preparing 304 response (Not Modified) for HTTP/1.1-client.
+ * Write the status line and the headers @rh of a response built by the cache
+ * for HTTP/1.1-client, the caller adds the rest of the headers.
  */
-int
-tfw_http_prep_304(TfwHttpReq *req, struct sk_buff **skb_head, TfwMsgIter *it)
+static int
+__tfw_http_prep_cache_resp(TfwHttpReq *req, struct sk_buff **skb_head,
+			   TfwMsgIter *it, TfwStr *rh)
 {
 	int ret = 0;
-	static TfwStr rh = {
-		.data = S_304_PART_01, .len = SLEN(S_304_PART_01) };
 	static TfwStr crlf_keep = {
 		.data = S_304_KEEP, .len = SLEN(S_304_KEEP) };
 	static TfwStr crlf_close = {
@@ -683,7 +705,7 @@ tfw_http_prep_304(TfwHttpReq *req, struct sk_buff **skb_head, TfwMsgIter *it)
 	else if (test_bit(TFW_HTTP_B_CONN_KA, req->flags))
 		end = &crlf_keep;
 
-	ret = tfw_http_msg_expand_data(it, skb_head, &rh, NULL);
+	ret = tfw_http_msg_expand_data(it, skb_head, rh, NULL);
 	if (unlikely(ret))
 		return ret;
 
@@ -693,9 +715,36 @@ tfw_http_prep_304(TfwHttpReq *req, struct sk_buff **skb_head, TfwMsgIter *it)
 			return ret;
 	}
 
+	return 0;
+}
+
+/*
+ * Preparing 304 response (Not Modified) for HTTP/1.1-client.
+ */
+int
+tfw_http_prep_304(TfwHttpReq *req, struct sk_buff **skb_head, TfwMsgIter *it)
+{
+	static TfwStr rh = {
+		.data = S_304_PART_01, .len = SLEN(S_304_PART_01) };
+
 	T_DBG("Send HTTP 304 response\n");
 
-	return 0;
+	return __tfw_http_prep_cache_resp(req, skb_head, it, &rh);
+}
+
+/*
+ * Preparing 416 response (Range Not Satisfiable) without a body for
+ * HTTP/1.1-client.
+ */
+int
+tfw_http_prep_416(TfwHttpReq *req, struct sk_buff **skb_head, TfwMsgIter *it)
+{
+	static TfwStr rh = {
+		.data = S_416_CACHE, .len = SLEN(S_416_CACHE) };
+
+	T_DBG("Send HTTP 416 response\n");
+
+	return __tfw_http_prep_cache_resp(req, skb_head, it, &rh);
 }
 
 /*
@@ -720,6 +769,14 @@ tfw_http_conn_msg_free(TfwHttpMsg *hm)
 {
 	if (unlikely(!hm))
 		return;
+	/*
+	 * Streamed request is used by both the client connection receiving
+	 * the request body and the server side processing the response, so
+	 * the request is freed by the one which releases it last.
+	 */
+	if (unlikely(test_bit(TFW_HTTP_B_REQ_STREAM, hm->flags))
+	    && !test_and_set_bit(TFW_HTTP_B_REQ_STREAM_FREE, hm->flags))
+		return;
 
 	if (hm->conn) {
 		/*
@@ -728,6 +785,13 @@ tfw_http_conn_msg_free(TfwHttpMsg *hm)
 		 */
 		WARN_ON_ONCE((TFW_CONN_TYPE(hm->conn) & Conn_Clnt) && hm->pair);
 
+		/*
+		 * Size headers tables of the next messages on the connection
+		 * by the message history to avoid the tables reallocations.
+		 */
+		if (hm->h_tbl)
+			WRITE_ONCE(hm->conn->hdr_n, hm->h_tbl->off);
+
 		/*
 		 * Unlink the connection while there is at least one
 		 * reference. Use atomic exchange to avoid races with
@@ -741,6 +805,11 @@ tfw_http_conn_msg_free(TfwHttpMsg *hm)
 		 */
 		__cmpxchg((unsigned long *)&hm->conn->stream.msg,
 			  (unsigned long)hm, 0UL, sizeof(long));
+		/* Responses received on HTTP/2 streams of servers. */
+		if (!(TFW_CONN_TYPE(hm->conn) & Conn_Clnt) && hm->stream
+		    && hm->stream != &hm->conn->stream)
+			__cmpxchg((unsigned long *)&hm->stream->msg,
+				  (unsigned long)hm, 0UL, sizeof(long));
 		tfw_connection_put(hm->conn);
 	}
 
@@ -816,6 +885,8 @@ tfw_http_enum_resp_code(int status)
 		return RESP_404;
 	case 412:
 		return RESP_412;
+	case 416:
+		return RESP_416;
 	case 500:
 		return RESP_500;
 	case 502:
@@ -870,6 +941,42 @@ tfw_h2_resp_status_write(TfwHttpResp *resp, unsigned short status,
 	return 0;
 }
 
+/**
+ * Per-CPU traffic counters of the @req location or NULL if the request
+ * was answered before its vhost was resolved.
+ */
+static inline TfwVhostStat *
+tfw_http_loc_stat(TfwHttpReq *req)
+{
+	TfwLocation *loc;
+
+	if (unlikely(!req->vhost))
+		return NULL;
+	loc = req->location ? : req->vhost->loc_dflt;
+
+	return this_cpu_ptr(loc->stat);
+}
+
+/**
+ * Account @resp of @bytes length sent to the client of @req.
+ */
+static void
+tfw_http_loc_stat_resp(TfwHttpReq *req, TfwHttpResp *resp, unsigned long bytes)
+{
+	TfwVhostStat *stat;
+	unsigned int c = resp->status / 100;
+	unsigned int us;
+
+	if (!(stat = tfw_http_loc_stat(req)))
+		return;
+	stat->requests++;
+	stat->bytes_in += req->msg.len;
+	stat->bytes_out += bytes;
+	stat->status[c >= 1 && c <= 5 ? c - 1 : TFW_VHOST_STATUS_N - 1]++;
+	us = jiffies_to_usecs(jiffies - req->jrxtstamp);
+	stat->lat[min_t(unsigned int, fls(us), TFW_VHOST_LAT_BUCKETS - 1)]++;
+}
+
 void
 tfw_h2_resp_fwd(TfwHttpResp *resp)
 {
@@ -878,12 +985,14 @@ tfw_h2_resp_fwd(TfwHttpResp *resp)
 
 	tfw_connection_get(req->conn);
 
-	if (tfw_cli_conn_send((TfwCliConn *)req->conn, (TfwMsg *)resp)) {
+	if (tfw_h2_stream_xmit(ctx, (TfwMsg *)resp)) {
 		T_DBG("%s: cannot send data to client via HTTP/2\n", __func__);
 		TFW_INC_STAT_BH(serv.msgs_otherr);
 		tfw_connection_close(req->conn, true);
 	}
 	else {
+		tfw_access_log(req, resp, resp->msg.len);
+		tfw_http_loc_stat_resp(req, resp, resp->msg.len);
 		TFW_INC_STAT_BH(serv.msgs_forwarded);
 	}
 
@@ -948,8 +1057,7 @@ tfw_h2_send_resp(TfwHttpReq *req, int status, unsigned int stream_id)
 	date = TFW_STR_DATE_CH(msg);
 	__TFW_STR_CH(&hdr, 0)->data = start->data + start->len - SLEN(S_F_DATE);
 	__TFW_STR_CH(&hdr, 0)->len = nlen = SLEN(S_F_DATE) - 2;
-	date_val = *this_cpu_ptr(&g_buf);
-	tfw_http_prep_date(date_val);
+	date_val = (char *)tfw_http_date(tfw_current_timestamp())->val;
 	__TFW_STR_CH(&hdr, 1)->data = date_val;
 	__TFW_STR_CH(&hdr, 1)->len = vlen = date->len;
 	hdr.len = nlen + vlen;
@@ -1056,8 +1164,7 @@ tfw_h1_send_resp(TfwHttpReq *req, int status)
 
 	body = TFW_STR_BODY_CH(&msg);
 	date = TFW_STR_DATE_CH(&msg);
-	date->data = *this_cpu_ptr(&g_buf);
-	tfw_http_prep_date(date->data);
+	date->data = (char *)tfw_http_date(tfw_current_timestamp())->val;
 	if (!body->data)
 		msg.nchunks = 5;
 
@@ -1083,10 +1190,12 @@ err:
  * However, at this time requests may always be re-sent in case of
  * a connection failure. There's no option to prohibit re-sending.
  * Thus, request's SKB can't be passed to the network layer until
- * certain changes are implemented. For now there's no choice but
- * make a copy of request's SKBs in SS layer.
+ * certain changes are implemented. For now SS layer sends twins of the
+ * request's SKBs, which refer the request data by paged fragments, see
+ * ss_skb_twin(). Only the SKB descriptors are allocated, the data is
+ * copied only for small SKBs with kmalloc()'ed linear data.
  *
- * TODO: Making a copy of each SKB _IS BAD_. See issues #391 and #488.
+ * TODO: Pass SKBs to the network layer as is. See issues #391 and #488.
  */
 static inline void
 tfw_http_req_init_ss_flags(TfwSrvConn *srv_conn, TfwHttpReq *req)
@@ -1110,6 +1219,34 @@ tfw_http_req_is_nip(TfwHttpReq *req)
 	return test_bit(TFW_HTTP_B_NON_IDEMP, req->flags);
 }
 
+/*
+ * Check if non-idempotent request @req may be re-sent or re-scheduled.
+ * Streamed requests are never re-sent since their bodies aren't kept.
+ */
+static inline bool
+tfw_http_req_nip_retry(TfwServer *srv, TfwHttpReq *req)
+{
+	return (srv->sg->flags & TFW_SRV_RETRY_NIP)
+	       && !test_bit(TFW_HTTP_B_REQ_STREAM, req->flags);
+}
+
+/*
+ * The server side is done with streamed request @req: the response is
+ * received or the request is evicted. If the request body isn't forwarded in
+ * full yet, then the client can't send further requests through the same
+ * connection, so the connection is closed after the response.
+ */
+static inline bool
+tfw_http_req_stream_cut(TfwHttpReq *req)
+{
+	if (likely(!test_bit(TFW_HTTP_B_REQ_STREAM, req->flags))
+	    || test_bit(TFW_HTTP_B_REQ_STREAM_DONE, req->flags))
+		return false;
+	set_bit(TFW_HTTP_B_CONN_CLOSE, req->flags);
+
+	return true;
+}
+
 /*
  * Reset the flag saying that @srv_conn has non-idempotent requests.
  */
@@ -1170,7 +1307,8 @@ tfw_http_conn_nip_adjust(TfwSrvConn *srv_conn)
 
 /*
  * Tell if the server connection's forwarding queue is on hold.
- * It's on hold if the request that was sent last was non-idempotent.
+ * It's on hold if the request that was sent last was non-idempotent,
+ * or if the connection is switched to a tunnel.
  */
 static inline bool
 tfw_http_conn_on_hold(TfwSrvConn *srv_conn)
@@ -1178,6 +1316,11 @@ tfw_http_conn_on_hold(TfwSrvConn *srv_conn)
 	TfwHttpReq *req_sent = (TfwHttpReq *)srv_conn->msg_sent;
 
 	BUG_ON(!(TFW_CONN_TYPE(srv_conn) & Conn_Srv));
+	if (unlikely(READ_ONCE(srv_conn->tunnel)))
+		return true;
+	/* Non-idempotent requests don't hold HTTP/2 streams. */
+	if (tfw_srv_conn_h2(srv_conn))
+		return !tfw_h2_srv_stream_room(srv_conn->h2);
 	return (req_sent && tfw_http_req_is_nip(req_sent));
 }
 
@@ -1257,6 +1400,23 @@ tfw_http_req_enlist(TfwSrvConn *srv_conn, TfwHttpReq *req)
 		tfw_http_req_nip_enlist(srv_conn, req);
 }
 
+/**
+ * Move requests from @srv_conn->fwd_inq to the forwarding queue in the order
+ * they were added. Must be called under @srv_conn->fwd_qlock.
+ */
+static void
+tfw_http_conn_fwd_drain(TfwSrvConn *srv_conn)
+{
+	TfwHttpReq *req, *tmp;
+	struct llist_node *list;
+
+	if (llist_empty(&srv_conn->fwd_inq))
+		return;
+	list = llist_reverse_order(llist_del_all(&srv_conn->fwd_inq));
+	llist_for_each_entry_safe(req, tmp, list, fwd_node)
+		tfw_http_req_enlist(srv_conn, req);
+}
+
 /**
  * Remove @req from the server connection's forwarding queue.
  * Caller must care about @srv_conn->msg_sent on it's own to keep the
@@ -1308,10 +1468,17 @@ tfw_http_nip_req_resched_err(TfwSrvConn *srv_conn, TfwHttpReq *req,
 void
 tfw_http_send_resp(TfwHttpReq *req, int status, const char *reason)
 {
+	/* Requests created by Tempesta itself have nobody to reply. */
+	if (unlikely(!req->conn)) {
+		tfw_http_msg_free((TfwHttpMsg *)req);
+		return;
+	}
+
 	if (!(tfw_blk_flags & TFW_BLK_ERR_NOLOG)) {
 		T_WARN_ADDR_STATUS(reason, &req->conn->peer->addr,
 				   TFW_WITH_PORT, status);
 	}
+	tfw_http_req_stream_cut(req);
 
 	if (TFW_MSG_H2(req))
 		tfw_h2_send_resp(req, status, 0);
@@ -1319,6 +1486,69 @@ tfw_http_send_resp(TfwHttpReq *req, int status, const char *reason)
 		tfw_h1_send_resp(req, status);
 }
 
+#define S_103_PART_01	S_0 "103 Early Hints" S_CRLF "link" S_DLM
+#define S_103_PART_02	S_CRLF S_CRLF
+
+/**
+ * Send 103 (Early Hints) interim response with Link header value @link of
+ * @len bytes to the client while @req is forwarded to a backend, RFC 8297.
+ * HTTP/1.0 clients can't get interim responses, RFC 9110 15.2. HTTP/1.1
+ * interim response is sent only if @req is the first request in the client
+ * connection queue, i.e. there are no responses to send before it.
+ */
+void
+tfw_http_send_early_hints(TfwHttpReq *req, const char *link,
+			  unsigned long len)
+{
+	TfwMsg msg = {};
+	TfwMsgIter it;
+	TfwCliConn *cli_conn = (TfwCliConn *)req->conn;
+	TfwStr data = {
+		.chunks = (TfwStr []){
+			{ .data = S_103_PART_01, .len = SLEN(S_103_PART_01) },
+			{ .data = (char *)link, .len = len },
+			{ .data = S_103_PART_02, .len = SLEN(S_103_PART_02) }
+		},
+		.len = SLEN(S_103_PART_01 S_103_PART_02) + len,
+		.nchunks = 3
+	};
+
+	if (TFW_MSG_H2(req)) {
+		if (tfw_h2_send_early_hints(req, link, len))
+			T_DBG("Cannot send early hints for req=[%p]\n", req);
+		return;
+	}
+	if (req->version < TFW_HTTP_VER_11)
+		return;
+
+	msg.len = data.len;
+	if (tfw_msg_iter_setup(&it, &msg.skb_head, msg.len, 0)
+	    || tfw_msg_write(&it, &data))
+		goto out;
+
+	/*
+	 * Responses cut from @seq_queue are sent under @ret_qlock, which is
+	 * taken before @seq_qlock is released, see tfw_http_resp_fwd(). So
+	 * the previous responses are sent before the interim one.
+	 */
+	spin_lock_bh(&cli_conn->seq_qlock);
+	if (list_first_entry_or_null(&cli_conn->seq_queue, TfwHttpReq,
+				     msg.seq_list) != req)
+	{
+		spin_unlock_bh(&cli_conn->seq_qlock);
+		goto out;
+	}
+	spin_lock_bh(&cli_conn->ret_qlock);
+	spin_unlock_bh(&cli_conn->seq_qlock);
+
+	if (!tfw_cli_conn_send(cli_conn, &msg))
+		msg.skb_head = NULL;
+
+	spin_unlock_bh(&cli_conn->ret_qlock);
+out:
+	ss_skb_queue_purge(&msg.skb_head);
+}
+
 static bool
 tfw_http_hm_suspend(TfwHttpResp *resp, TfwServer *srv)
 {
@@ -1346,6 +1576,10 @@ tfw_http_hm_suspend(TfwHttpResp *resp, TfwServer *srv)
 	return true;
 }
 
+/*
+ * A response to a health monitoring request is always verified since it
+ * also restores the servers in other groups sharing the same probe.
+ */
 static void
 tfw_http_hm_control(TfwHttpResp *resp)
 {
@@ -1354,11 +1588,12 @@ tfw_http_hm_control(TfwHttpResp *resp)
 	if (tfw_http_hm_suspend(resp, srv))
 		return;
 
-	if (!tfw_srv_suspended(srv) ||
-	    !tfw_apm_hm_srv_alive(resp->status, &resp->body, srv->apmref))
+	if ((!test_bit(TFW_SRV_B_SUSPEND, &srv->flags)
+	     && !test_bit(TFW_HTTP_B_HMONITOR, resp->req->flags))
+	    || !tfw_apm_hm_srv_alive(resp->status, &resp->body, srv->apmref))
 		return;
 
-	tfw_srv_mark_alive(srv);
+	tfw_apm_hm_srv_mark_alive(srv);
 }
 
 static inline void
@@ -1521,6 +1756,65 @@ tfw_http_req_evict(TfwSrvConn *srv_conn, TfwServer *srv, TfwHttpReq *req,
 	       || tfw_http_req_evict_retries(srv_conn, srv, req, eq);
 }
 
+/*
+ * Tell if @req may be hedged: it's a safe idempotent client request, which
+ * is still waited for, and which isn't hedged yet. Hedged copies are sent
+ * as HTTP/1.1 messages, so HTTP/2 server connections aren't hedged.
+ */
+static inline bool
+tfw_http_req_hedgeable(TfwHttpReq *req)
+{
+	return req->conn && !req->hedge && !req->pair
+	       && (req->method == TFW_HTTP_METH_GET
+		   || req->method == TFW_HTTP_METH_HEAD)
+	       && !tfw_http_req_is_nip(req)
+	       && !test_bit(TFW_HTTP_B_REQ_STREAM, req->flags)
+	       && (TFW_MSG_H2(req)
+		   ? !!req->stream
+		   : !test_bit(TFW_HTTP_B_REQ_DROP, req->flags));
+}
+
+/*
+ * Arm the hedging timer of @srv_conn for the just forwarded request @req if
+ * the timer isn't armed for a preceding request yet.
+ */
+static inline void
+tfw_http_hedge_arm(TfwSrvConn *srv_conn, TfwHttpReq *req)
+{
+	TfwSrvGroup *sg = ((TfwServer *)srv_conn->peer)->sg;
+
+	if (likely(!sg->hedge_ith)
+	    || timer_pending(&srv_conn->hedge_timer)
+	    || tfw_srv_conn_h2(srv_conn)
+	    || !tfw_http_req_hedgeable(req))
+		return;
+	mod_timer(&srv_conn->hedge_timer,
+		  req->jtxtstamp + max(READ_ONCE(srv_conn->jhedge), 1UL));
+}
+
+/*
+ * Send request @req to HTTP/2 server connection @srv_conn on a new stream.
+ * The request frames are built for each sending, so they aren't kept.
+ */
+static int
+tfw_http_req_fwd_send_h2(TfwSrvConn *srv_conn, TfwHttpReq *req)
+{
+	int r;
+	TfwMsg msg = {};
+
+	/* The request is being forwarded on its stream. */
+	if (req->sid)
+		return 0;
+	if ((r = tfw_h2_srv_req_frames(srv_conn, req, &msg.skb_head)))
+		return r;
+	if ((r = tfw_connection_send((TfwConn *)srv_conn, &msg))) {
+		ss_skb_queue_purge(&msg.skb_head);
+		tfw_h2_srv_req_abort(srv_conn, req);
+	}
+
+	return r;
+}
+
 /*
  * If forwarding of @req in @srv_conn is not successful, then move
  * it to the error queue @eq for sending an error response later.
@@ -1536,9 +1830,15 @@ tfw_http_req_fwd_send(TfwSrvConn *srv_conn, TfwServer *srv, TfwHttpReq *req,
 
 	req->jtxtstamp = jiffies;
 	tfw_http_req_init_ss_flags(srv_conn, req);
+	tfw_http_hedge_arm(srv_conn, req);
 
-	if (!(r = tfw_connection_send((TfwConn *)srv_conn, (TfwMsg *)req)))
+	r = tfw_srv_conn_h2(srv_conn)
+	    ? tfw_http_req_fwd_send_h2(srv_conn, req)
+	    : tfw_connection_send((TfwConn *)srv_conn, (TfwMsg *)req);
+	if (!r) {
+		trace_tfw_http_req_fwd(req, srv_conn);
 		return 0;
+	}
 
 	T_DBG2("%s: Forwarding error: conn=[%p] req=[%p] error=[%d]\n",
 	       __func__, srv_conn, req, r);
@@ -1561,37 +1861,137 @@ tfw_http_req_fwd_send(TfwSrvConn *srv_conn, TfwServer *srv, TfwHttpReq *req,
 }
 
 /*
- * Forward one request @req to server connection @srv_conn. Return 0 if
- * request has been sent successfully, or error code otherwise.
+ * Add copy of @req to the batch of requests @skb_head, which are sent to
+ * server connection @srv_conn by one send operation. If the request can't be
+ * copied, then it's removed from @fwd_queue and an error is returned.
  */
 static inline int
-tfw_http_req_fwd_single(TfwSrvConn *srv_conn, TfwServer *srv,
-			TfwHttpReq *req, struct list_head *eq)
+tfw_http_req_fwd_copy(TfwSrvConn *srv_conn, TfwHttpReq *req,
+		      struct sk_buff **skb_head, struct list_head *eq)
 {
 	int r;
 
-	if (tfw_http_req_evict_stale_req(srv_conn, srv, req, eq))
-		return -EINVAL;
-	if ((r = tfw_http_req_fwd_send(srv_conn, srv, req, eq)))
+	req->jtxtstamp = jiffies;
+	tfw_http_hedge_arm(srv_conn, req);
+	r = tfw_srv_conn_h2(srv_conn)
+	    ? tfw_h2_srv_req_frames(srv_conn, req, skb_head)
+	    : ss_skb_queue_copy(skb_head, req->msg.skb_head);
+	if (!r)
+		return 0;
+
+	T_DBG2("%s: Forwarding error: conn=[%p] req=[%p] error=[%d]\n",
+	       __func__, srv_conn, req, r);
+
+	if (test_bit(TFW_HTTP_B_HMONITOR, req->flags)) {
+		tfw_http_req_delist(srv_conn, req);
+		WARN_ON_ONCE(req->pair);
+		tfw_http_msg_free((TfwHttpMsg *)req);
+		T_WARN_ADDR("Unable to send health monitoring request to server",
+			    &srv_conn->peer->addr, TFW_WITH_PORT);
+	} else {
+		tfw_http_req_err(srv_conn, req, eq, 500,
+				 "request dropped: forwarding error");
+	}
+
+	return r;
+}
+
+/*
+ * Send the batch of requests @skb_head to server connection @srv_conn. The
+ * batch contains copies of all the requests following @srv_conn->msg_sent
+ * up to @last. Return 0 if the requests have been sent successfully, or
+ * error code otherwise. The requests are left unsent in @fwd_queue on
+ * an error.
+ */
+static int
+tfw_http_req_fwd_batch(TfwSrvConn *srv_conn, TfwHttpReq *last,
+		       struct sk_buff **skb_head)
+{
+	int r;
+	TfwHttpReq *req;
+	TfwMsg msg = { .skb_head = *skb_head };
+
+	*skb_head = NULL;
+	req = srv_conn->msg_sent
+	    ? list_next_entry((TfwHttpReq *)srv_conn->msg_sent, fwd_list)
+	    : list_first_entry(&srv_conn->fwd_queue, TfwHttpReq, fwd_list);
+	if ((r = tfw_connection_send((TfwConn *)srv_conn, &msg))) {
+		T_DBG2("%s: Forwarding error: conn=[%p] error=[%d]\n",
+		       __func__, srv_conn, r);
+		/* The streams are opened for unsent requests. */
+		if (tfw_srv_conn_h2(srv_conn)) {
+			for ( ; ; req = list_next_entry(req, fwd_list)) {
+				tfw_h2_srv_req_abort(srv_conn, req);
+				if (req == last)
+					break;
+			}
+		}
 		return r;
-	srv_conn->msg_sent = (TfwMsg *)req;
-	TFW_INC_STAT_BH(clnt.msgs_forwarded);
+	}
+
+	for ( ; ; req = list_next_entry(req, fwd_list)) {
+		TFW_INC_STAT_BH(clnt.msgs_forwarded);
+		trace_tfw_http_req_fwd(req, srv_conn);
+		/* See if the idempotent request was non-idempotent. */
+		if (!tfw_http_req_is_nip(req))
+			tfw_http_req_nip_delist(srv_conn, req);
+		if (req == last)
+			break;
+	}
+	srv_conn->msg_sent = (TfwMsg *)last;
+
 	return 0;
 }
 
+/*
+ * The number of requests, which may be sent to HTTP/1.1 server connection
+ * @srv_conn before the responses to the sent ones, within the pipelining
+ * depth of the server. The sent requests are at the head of the forwarding
+ * queue up to @srv_conn->msg_sent.
+ */
+static unsigned int
+tfw_http_conn_pipe_room(TfwSrvConn *srv_conn)
+{
+	TfwHttpReq *req, *req_sent = (TfwHttpReq *)srv_conn->msg_sent;
+	unsigned int n = 0;
+	unsigned int depth = tfw_srv_pipe_depth((TfwServer *)srv_conn->peer);
+
+	if (likely(!depth))
+		return UINT_MAX;
+	if (!req_sent)
+		return depth;
+	list_for_each_entry(req, &srv_conn->fwd_queue, fwd_list) {
+		if (++n >= depth)
+			return 0;
+		if (req == req_sent)
+			break;
+	}
+
+	return depth - n;
+}
+
 /*
  * Forward unsent requests in server connection @srv_conn. The requests
- * are forwarded until a non-idempotent request is found in the queue.
- * It's assumed that the forwarding queue in @srv_conn is locked and
- * NOT drained. Returns 0 if forwarding has been finished or error code
- * otherwise (e.g. the case of hanged connection with busy work queue).
+ * are forwarded until a non-idempotent request is found in the queue or
+ * the pipelining depth of the server is reached. It's assumed that
+ * the forwarding queue in @srv_conn is locked and NOT drained. Returns 0
+ * if forwarding has been finished or error code otherwise (e.g. the case
+ * of hanged connection with busy work queue).
+ *
+ * Pipelined requests are sent to the server by one send operation. Sync
+ * Sockets propagate the mark of the first skb to the whole sent data, so
+ * requests with different marks are sent separately.
  */
 static int
 tfw_http_conn_fwd_unsent(TfwSrvConn *srv_conn, struct list_head *eq)
 {
-	TfwHttpReq *req, *tmp;
+	int r = 0;
+	TfwHttpReq *req, *tmp, *last = NULL;
 	TfwServer *srv = (TfwServer *)srv_conn->peer;
 	struct list_head *fwd_queue = &srv_conn->fwd_queue;
+	struct sk_buff *skb_head = NULL;
+	bool h2 = tfw_srv_conn_h2(srv_conn);
+	unsigned int room = h2 ? UINT_MAX : tfw_http_conn_pipe_room(srv_conn);
 
 	T_DBG2("%s: conn=%pK\n", __func__, srv_conn);
 	WARN_ON(!spin_is_locked(&srv_conn->fwd_qlock));
@@ -1602,35 +2002,45 @@ tfw_http_conn_fwd_unsent(TfwSrvConn *srv_conn, struct list_head *eq)
 	    : list_first_entry(fwd_queue, TfwHttpReq, fwd_list);
 
 	list_for_each_entry_safe_from(req, tmp, fwd_queue, fwd_list) {
-		int ret = tfw_http_req_fwd_single(srv_conn, srv, req, eq);
-		/*
-		 * In case of busy work queue and absence of forwarded but
-		 * unanswered request(s) in connection, the forwarding procedure
-		 * is considered failed and the error is returned to the caller.
-		 */
-		if (ret == -EBUSY && srv_conn->msg_sent == NULL)
-			return ret;
-		/*
-		 * If connection is broken or work queue is busy and connection
-		 * has request(s) forwarded but unanswered, we can leave all
-		 * requests in @fwd_queue: another attempt to send them will
-		 * be made when connection will be repaired or when response(s)
-		 * for unanswered request(s) will arrive from backend.
-		 */
-		if (ret == -EBADF || ret == -EBUSY)
+		/* Stop forwarding if the server can't open more streams. */
+		if (h2 && !tfw_h2_srv_stream_room(srv_conn->h2))
+			break;
+		/* Or if the pipelining depth is reached. */
+		if (!room)
+			break;
+		if (tfw_http_req_evict_stale_req(srv_conn, srv, req, eq))
+			continue;
+		if (skb_head && skb_head->mark != req->msg.skb_head->mark
+		    && (r = tfw_http_req_fwd_batch(srv_conn, last, &skb_head)))
 			break;
 		/*
 		 * Connection is alive, but request has been removed from
 		 * @fwd_queue due to some error.
 		 */
-		if (ret)
+		if (tfw_http_req_fwd_copy(srv_conn, req, &skb_head, eq))
 			continue;
+		last = req;
+		--room;
 		/* Stop forwarding if the request is non-idempotent. */
-		if (tfw_http_req_is_nip(req))
+		if (!h2 && tfw_http_req_is_nip(req))
 			break;
-		/* See if the idempotent request was non-idempotent. */
-		tfw_http_req_nip_delist(srv_conn, req);
 	}
+	if (skb_head && !r)
+		r = tfw_http_req_fwd_batch(srv_conn, last, &skb_head);
+	ss_skb_queue_purge(&skb_head);
+	/*
+	 * In case of busy work queue and absence of forwarded but
+	 * unanswered request(s) in connection, the forwarding procedure
+	 * is considered failed and the error is returned to the caller.
+	 *
+	 * If connection is broken or work queue is busy and connection
+	 * has request(s) forwarded but unanswered, we can leave all
+	 * requests in @fwd_queue: another attempt to send them will
+	 * be made when connection will be repaired or when response(s)
+	 * for unanswered request(s) will arrive from backend.
+	 */
+	if (r == -EBUSY && srv_conn->msg_sent == NULL)
+		return r;
 
 	return 0;
 }
@@ -1657,15 +2067,10 @@ tfw_http_conn_fwd_unsent(TfwSrvConn *srv_conn, struct list_head *eq)
  * After that CPU-1 and CPU-2 are fully concurrent. If CPU-2 happens
  * to proceed first with forwarding, then pairing gets broken.
  *
- * TODO: In current design @fwd_queue is locked until after a request
- * is submitted to SS for sending. It shouldn't be necessary to lock
- * @fwd_queue for that. There's the ordered @fwd_queue. Also there's
- * the ordered work queue in SS layer. Perhaps the right way of ordering
- * these actions is to use message tickets according to the ordering of
- * requests in @fwd_queue. Typically tfw_connection_send() or its pure
- * server variant must care about ticket ordering. Backoff and per-cpu
- * lock data structures could be used just like in Linux MCS locking.
- * Please see the issue #687.
+ * New client requests aren't forwarded by the function, they're added to
+ * the lockless @fwd_inq queue and forwarded by the current lock holder, see
+ * tfw_http_conn_fwd_inq(). The function is used for rescheduled and health
+ * monitoring requests.
  */
 static int
 tfw_http_req_fwd(TfwSrvConn *srv_conn, TfwHttpReq *req, struct list_head *eq,
@@ -1677,6 +2082,7 @@ tfw_http_req_fwd(TfwSrvConn *srv_conn, TfwHttpReq *req, struct list_head *eq,
 	BUG_ON(!(TFW_CONN_TYPE(srv_conn) & Conn_Srv));
 
 	spin_lock_bh(&srv_conn->fwd_qlock);
+	tfw_http_conn_fwd_drain(srv_conn);
 	tfw_http_req_enlist(srv_conn, req);
 	/*
 	 * If we are rescheduling request and connection is on hold or
@@ -1691,24 +2097,51 @@ tfw_http_req_fwd(TfwSrvConn *srv_conn, TfwHttpReq *req, struct list_head *eq,
 		tfw_http_req_delist(srv_conn, req);
 		ret = -1;
 	}
-	spin_unlock_bh(&srv_conn->fwd_qlock);
+	tfw_http_fwdq_unlock(srv_conn);
 
 	return ret;
 }
 
 /*
- * Treat a possible non-idempotent request in case of a connection
- * repair (re-send or re-schedule).
- *
- * A non-idempotent request that was forwarded but not responded to
- * is not re-sent or re-scheduled by default. Configuration option
- * can be used to have that request re-sent or re-scheduled.
- *
- * As forwarding is paused after a non-idempotent request is sent,
- * there can be only one such request among forwarded requests, and
- * that's @srv_conn->msg_sent.
- *
- * Note: @srv_conn->msg_sent may change in result.
+ * Forwarding isn't paused after non-idempotent requests in HTTP/2
+ * connections, so any of the forwarded requests may be non-idempotent.
+ */
+static void
+tfw_http_conn_treatnip_h2(TfwSrvConn *srv_conn, struct list_head *eq)
+{
+	TfwServer *srv = (TfwServer *)srv_conn->peer;
+	TfwHttpReq *req, *tmp, *req_sent = (TfwHttpReq *)srv_conn->msg_sent;
+
+	if (!req_sent)
+		return;
+	list_for_each_entry_safe(req, tmp, &srv_conn->fwd_queue, fwd_list) {
+		bool last = req == req_sent;
+
+		if (tfw_http_req_is_nip(req) && !tfw_http_req_nip_retry(srv, req))
+		{
+			if (last)
+				srv_conn->msg_sent =
+					__tfw_http_conn_msg_sent_prev(srv_conn);
+			tfw_http_nip_req_resched_err(srv_conn, req, eq);
+		}
+		if (last)
+			break;
+	}
+}
+
+/*
+ * Treat a possible non-idempotent request in case of a connection
+ * repair (re-send or re-schedule).
+ *
+ * A non-idempotent request that was forwarded but not responded to
+ * is not re-sent or re-scheduled by default. Configuration option
+ * can be used to have that request re-sent or re-scheduled.
+ *
+ * As forwarding is paused after a non-idempotent request is sent,
+ * there can be only one such request among forwarded requests, and
+ * that's @srv_conn->msg_sent.
+ *
+ * Note: @srv_conn->msg_sent may change in result.
  */
 static inline void
 tfw_http_conn_treatnip(TfwSrvConn *srv_conn, struct list_head *eq)
@@ -1716,8 +2149,12 @@ tfw_http_conn_treatnip(TfwSrvConn *srv_conn, struct list_head *eq)
 	TfwServer *srv = (TfwServer *)srv_conn->peer;
 	TfwHttpReq *req_sent = (TfwHttpReq *)srv_conn->msg_sent;
 
+	if (tfw_srv_conn_h2(srv_conn)) {
+		tfw_http_conn_treatnip_h2(srv_conn, eq);
+		return;
+	}
 	if (tfw_http_conn_on_hold(srv_conn)
-	    && !(srv->sg->flags & TFW_SRV_RETRY_NIP))
+	    && !tfw_http_req_nip_retry(srv, req_sent))
 	{
 		BUG_ON(list_empty(&req_sent->nip_list));
 		srv_conn->msg_sent = __tfw_http_conn_msg_sent_prev(srv_conn);
@@ -1893,13 +2330,16 @@ static TfwSrvConn *
 tfw_http_get_srv_conn(TfwMsg *msg)
 {
 	TfwHttpReq *req = (TfwHttpReq *)msg;
-	TfwHttpSess *sess = req->sess;
+	TfwSrvConn *srv_conn;
 
 	/* Sticky cookies are disabled or client doesn't support cookies. */
-	if (!sess)
-		return tfw_vhost_get_srv_conn(msg);
+	if (!req->sess)
+		srv_conn = tfw_vhost_get_srv_conn(msg);
+	else
+		srv_conn = tfw_http_sess_get_srv_conn(msg);
+	trace_tfw_http_srv_selected(req, srv_conn);
 
-	return tfw_http_sess_get_srv_conn(msg);
+	return srv_conn;
 }
 
 /*
@@ -1971,10 +2411,15 @@ tfw_http_fwdq_resched(TfwSrvConn *srv_conn, struct list_head *resch_queue,
 	list_for_each_entry_safe(req, tmp, resch_queue, fwd_list) {
 		INIT_LIST_HEAD(&req->nip_list);
 		INIT_LIST_HEAD(&req->fwd_list);
+		/* Hedged copies aren't worth another try. */
+		if (test_bit(TFW_HTTP_B_HEDGE, req->flags)) {
+			tfw_http_msg_free((TfwHttpMsg *)req);
+			continue;
+		}
 		if (tfw_http_req_evict_stale_req(NULL, srv, req, eq))
 			continue;
 		if (unlikely(tfw_http_req_is_nip(req)
-			     && !(srv->sg->flags & TFW_SRV_RETRY_NIP)))
+			     && !tfw_http_req_nip_retry(srv, req)))
 		{
 			tfw_http_nip_req_resched_err(NULL, req, eq);
 			continue;
@@ -1987,34 +2432,264 @@ tfw_http_fwdq_resched(TfwSrvConn *srv_conn, struct list_head *resch_queue,
 }
 
 /*
- * Forward @req into server connection @srv_conn. Timed-out and dropped
- * requests are evicted to error queue @eq for sending an error response
- * later. If forwarding procedure returns error, then it considered
- * unfinished; in this case the connection's @fwd_queue will be reset
- * and all requests from it will be rescheduled to other connections.
+ * Forward requests added to @srv_conn->fwd_inq.
+ *
+ * Many CPUs forward requests to the same server connection, so the requests
+ * are added to the lockless @fwd_inq queue and the CPU that takes
+ * @srv_conn->fwd_qlock moves all of them to @fwd_queue and forwards them at
+ * once. Other CPUs don't spin on the lock: the lock holder forwards their
+ * requests before it leaves, see tfw_http_fwdq_unlock(). If @wait is true,
+ * then the requests must be in @fwd_queue on return, so the lock is waited
+ * for.
+ *
+ * Timed-out and dropped requests are evicted to error queue @eq for sending
+ * an error response later. If forwarding procedure returns error, then it
+ * considered unfinished; in this case the connection's @fwd_queue will be
+ * reset and all requests from it will be rescheduled to other connections.
  */
 static void
-tfw_http_req_fwd_resched(TfwSrvConn *srv_conn, TfwHttpReq *req,
-			 struct list_head *eq)
+tfw_http_conn_fwd_inq(TfwSrvConn *srv_conn, struct list_head *eq, bool wait)
 {
 	LIST_HEAD(reschq);
 
-	T_DBG2("%s: srv_conn=[%p], req=[%p]\n", __func__, srv_conn, req);
+	while (!llist_empty(&srv_conn->fwd_inq)) {
+		if (wait)
+			spin_lock_bh(&srv_conn->fwd_qlock);
+		else if (!spin_trylock_bh(&srv_conn->fwd_qlock))
+			return;
+		wait = false;
+
+		tfw_http_conn_fwd_drain(srv_conn);
+		if (unlikely(test_bit(TFW_CONN_B_TUNNEL, &srv_conn->flags))) {
+			/* Scheduled before the connection became a tunnel. */
+			tfw_http_fwdq_reset(srv_conn, &reschq);
+			spin_unlock_bh(&srv_conn->fwd_qlock);
+			tfw_http_fwdq_resched(srv_conn, &reschq, eq);
+		} else if (!tfw_http_conn_need_fwd(srv_conn)
+			   || !tfw_http_conn_fwd_unsent(srv_conn, eq))
+		{
+			spin_unlock_bh(&srv_conn->fwd_qlock);
+		} else {
+			tfw_srv_set_busy_delay(srv_conn);
+			tfw_http_fwdq_reset(srv_conn, &reschq);
+			spin_unlock_bh(&srv_conn->fwd_qlock);
+			tfw_http_fwdq_resched(srv_conn, &reschq, eq);
+		}
+		/*
+		 * Requests added by other CPUs while the lock was held.
+		 * Paired with the barrier of llist_add_batch() and the failed
+		 * spin_trylock_bh() of the producers.
+		 */
+		smp_mb();
+	}
+}
+
+/*
+ * Forward requests @reqq, linked by @fwd_list, into server connection
+ * @srv_conn, see tfw_http_conn_fwd_inq().
+ */
+static void
+tfw_http_req_fwd_resched(TfwSrvConn *srv_conn, struct list_head *reqq,
+			 struct list_head *eq)
+{
+	TfwHttpReq *req, *tmp;
+	struct llist_node *first = NULL, *last = NULL;
+	bool wait = false;
+
+	T_DBG2("%s: srv_conn=[%p]\n", __func__, srv_conn);
 	BUG_ON(!(TFW_CONN_TYPE(srv_conn) & Conn_Srv));
 
-	spin_lock_bh(&srv_conn->fwd_qlock);
-	tfw_http_req_enlist(srv_conn, req);
-	if (tfw_http_conn_on_hold(srv_conn)
-	    || !tfw_http_conn_fwd_unsent(srv_conn, eq))
-	{
-		spin_unlock_bh(&srv_conn->fwd_qlock);
+	/* Link the requests in reverse order, @fwd_inq is a stack. */
+	list_for_each_entry_safe(req, tmp, reqq, fwd_list) {
+		list_del_init(&req->fwd_list);
+		req->fwd_node.next = first;
+		first = &req->fwd_node;
+		if (!last)
+			last = first;
+		/* Next body parts of streamed request need it in @fwd_queue. */
+		wait |= test_bit(TFW_HTTP_B_REQ_STREAM, req->flags);
+	}
+	if (unlikely(!first))
 		return;
-	}
-	tfw_srv_set_busy_delay(srv_conn);
-	tfw_http_fwdq_reset(srv_conn, &reschq);
+	llist_add_batch(first, last, &srv_conn->fwd_inq);
+
+	tfw_http_conn_fwd_inq(srv_conn, eq, wait);
+}
+
+/*
+ * Unlock @srv_conn->fwd_qlock taken not for forwarding of new requests, and
+ * forward the requests added to @srv_conn->fwd_inq while the lock was held.
+ */
+void
+tfw_http_fwdq_unlock(TfwSrvConn *srv_conn)
+{
+	LIST_HEAD(eq);
+
 	spin_unlock_bh(&srv_conn->fwd_qlock);
+	/* Paired with the barrier of llist_add_batch(). */
+	smp_mb();
+	if (likely(llist_empty(&srv_conn->fwd_inq)))
+		return;
 
-	tfw_http_fwdq_resched(srv_conn, &reschq, eq);
+	tfw_http_conn_fwd_inq(srv_conn, &eq, false);
+	tfw_http_req_zap_error(&eq);
+}
+
+/*
+ * Request hedging.
+ *
+ * If a response to a safe idempotent request isn't received from a server
+ * within the configured percentile of the server response time, then a copy
+ * of the request is forwarded to another server of the same group, and the
+ * first response wins. The copy has no client connection just like health
+ * monitoring requests, so the response to the copy is discarded unless it
+ * comes before the response to the original request, see
+ * tfw_http_hedge_resp(). A request is hedged only once, and non-idempotent
+ * requests are never hedged since they're unsafe to repeat.
+ *
+ * Each server connection has a timer, which is armed for the oldest
+ * hedgeable request in the connection only, so there are no per-request
+ * timers.
+ */
+#define TFW_HTTP_HEDGE_BATCH	8
+
+/*
+ * The response time of server @srv, after which requests are hedged, in
+ * jiffies. Zero is returned if there are no statistics yet.
+ */
+static unsigned long
+tfw_http_hedge_jthr(TfwServer *srv)
+{
+	int i;
+	unsigned int val[T_PSZ] = { 0 };
+	TfwPrcntlStats pstats = {
+		.ith = tfw_pstats_ith,
+		.val = val,
+	};
+
+	if (!srv->apmref)
+		return 0;
+	tfw_apm_stats(srv->apmref, &pstats);
+	for (i = TFW_PSTATS_IDX_ITH; i < T_PSZ; ++i)
+		if (tfw_pstats_ith[i] == srv->sg->hedge_ith)
+			return val[i] ? msecs_to_jiffies(val[i]) : 0;
+
+	return 0;
+}
+
+/*
+ * Allocate a hedged copy of request @req forwarded through @srv_conn.
+ * Called with @srv_conn->fwd_qlock held, so @req can't go away.
+ */
+static TfwHttpReq *
+tfw_http_hedge_alloc(TfwSrvConn *srv_conn, TfwHttpReq *req)
+{
+	TfwHttpReq *hreq;
+
+	if (!(hreq = (TfwHttpReq *)__tfw_http_msg_alloc(Conn_Clnt, true)))
+		return NULL;
+	/* The request is adjusted for HTTP/1.1 server already. */
+	if (ss_skb_queue_copy(&hreq->msg.skb_head, req->msg.skb_head)) {
+		tfw_http_msg_free((TfwHttpMsg *)hreq);
+		return NULL;
+	}
+	hreq->msg.len = req->msg.len;
+	hreq->method = req->method;
+	hreq->version = TFW_HTTP_VER_11;
+	hreq->jrxtstamp = req->jrxtstamp;
+	hreq->hash = tfw_http_req_key_calc(req);
+	hreq->vhost = req->vhost;
+	tfw_vhost_get(hreq->vhost);
+	hreq->location = req->location;
+	__set_bit(TFW_HTTP_B_HEDGE, hreq->flags);
+
+	tfw_connection_get((TfwConn *)srv_conn);
+	hreq->hedge_conn = srv_conn;
+	hreq->hedge = req;
+	req->hedge = hreq;
+
+	return hreq;
+}
+
+/*
+ * Forward hedged copy @hreq of a request forwarded to server @srv to another
+ * server of the same group. Schedulers can't exclude a server, so give them
+ * one more try if they choose @srv again.
+ */
+static void
+tfw_http_hedge_fwd(TfwServer *srv, TfwHttpReq *hreq)
+{
+	int i;
+	TfwSrvConn *srv_conn;
+	LIST_HEAD(eq);
+
+	for (i = 0; i < 2; ++i) {
+		srv_conn = srv->sg->sched->sched_sg_conn((TfwMsg *)hreq,
+							 srv->sg);
+		if (!srv_conn)
+			break;
+		if (srv_conn->peer != (TfwPeer *)srv
+		    && !tfw_srv_conn_h2(srv_conn))
+		{
+			tfw_http_req_fwd(srv_conn, hreq, &eq, false);
+			tfw_http_req_zap_error(&eq);
+			/*
+			 * Paired with tfw_srv_conn_get_if_live() via
+			 * sched_sg_conn callback.
+			 */
+			tfw_srv_conn_put(srv_conn);
+			return;
+		}
+		tfw_srv_conn_put(srv_conn);
+	}
+
+	T_DBG2("%s: no server to hedge request: req=[%p]\n", __func__,
+	       hreq->hedge);
+	tfw_http_msg_free((TfwHttpMsg *)hreq);
+}
+
+/**
+ * Hedge the requests of server connection which wait for responses for too
+ * long, and re-arm the timer for the oldest request which doesn't wait long
+ * enough yet. The requests are forwarded in the order they're sent, so
+ * the scan stops on the first such request.
+ */
+void
+tfw_http_hedge_timer_cb(struct timer_list *t)
+{
+	TfwSrvConn *srv_conn = from_timer(srv_conn, t, hedge_timer);
+	TfwServer *srv = (TfwServer *)srv_conn->peer;
+	TfwHttpReq *req, *hreq[TFW_HTTP_HEDGE_BATCH];
+	unsigned long jthr, jnext = 0;
+	int i, n = 0;
+
+	if (!srv->sg->hedge_ith || !(jthr = tfw_http_hedge_jthr(srv)))
+		return;
+	WRITE_ONCE(srv_conn->jhedge, jthr);
+
+	spin_lock_bh(&srv_conn->fwd_qlock);
+	list_for_each_entry(req, &srv_conn->fwd_queue, fwd_list) {
+		if (tfw_http_req_hedgeable(req)) {
+			if (time_before(jiffies, req->jtxtstamp + jthr)) {
+				jnext = req->jtxtstamp + jthr;
+				break;
+			}
+			if (n == TFW_HTTP_HEDGE_BATCH) {
+				jnext = jiffies + 1;
+				break;
+			}
+			if ((hreq[n] = tfw_http_hedge_alloc(srv_conn, req)))
+				++n;
+		}
+		if ((TfwMsg *)req == srv_conn->msg_sent)
+			break;
+	}
+	if (jnext)
+		mod_timer(&srv_conn->hedge_timer, jnext);
+	tfw_http_fwdq_unlock(srv_conn);
+
+	for (i = 0; i < n; ++i)
+		tfw_http_hedge_fwd(srv, hreq[i]);
 }
 
 /**
@@ -2039,8 +2714,9 @@ tfw_http_conn_shrink_fwdq(TfwSrvConn *srv_conn)
 	T_DBG2("%s: conn=[%p]\n", __func__, srv_conn);
 
 	spin_lock_bh(&srv_conn->fwd_qlock);
+	tfw_http_conn_fwd_drain(srv_conn);
 	if (list_empty(fwdq)) {
-		spin_unlock_bh(&srv_conn->fwd_qlock);
+		tfw_http_fwdq_unlock(srv_conn);
 		return;
 	}
 
@@ -2082,7 +2758,7 @@ tfw_http_conn_shrink_fwdq(TfwSrvConn *srv_conn)
 	list_for_each_entry_safe_from(req, tmp, fwdq, fwd_list)
 		tfw_http_req_evict_stale_req(srv_conn, srv, req, &eq);
 
-	spin_unlock_bh(&srv_conn->fwd_qlock);
+	tfw_http_fwdq_unlock(srv_conn);
 
 	tfw_http_req_zap_error(&eq);
 }
@@ -2101,12 +2777,13 @@ tfw_http_conn_shrink_fwdq_resched(TfwSrvConn *srv_conn)
 	T_DBG2("%s: conn=[%p]\n", __func__, srv_conn);
 
 	spin_lock_bh(&srv_conn->fwd_qlock);
+	tfw_http_conn_fwd_drain(srv_conn);
 	if (list_empty(&srv_conn->fwd_queue)) {
-		spin_unlock_bh(&srv_conn->fwd_qlock);
+		tfw_http_fwdq_unlock(srv_conn);
 		return;
 	}
 	tfw_http_fwdq_reset(srv_conn, &schq);
-	spin_unlock_bh(&srv_conn->fwd_qlock);
+	tfw_http_fwdq_unlock(srv_conn);
 
 	tfw_http_fwdq_resched(srv_conn, &schq, &eq);
 
@@ -2153,8 +2830,9 @@ tfw_http_conn_repair(TfwConn *conn)
 	}
 
 	spin_lock_bh(&srv_conn->fwd_qlock);
+	tfw_http_conn_fwd_drain(srv_conn);
 	if (list_empty(&srv_conn->fwd_queue)) {
-		spin_unlock_bh(&srv_conn->fwd_qlock);
+		tfw_http_fwdq_unlock(srv_conn);
 		return;
 	}
 
@@ -2164,7 +2842,7 @@ tfw_http_conn_repair(TfwConn *conn)
 	/* Re-send only the first unanswered request. */
 	err = tfw_http_conn_resend(srv_conn, true, &eq);
 	if (err == -EBADF) {
-		spin_unlock_bh(&srv_conn->fwd_qlock);
+		tfw_http_fwdq_unlock(srv_conn);
 		goto out;
 	}
 	/*
@@ -2184,7 +2862,7 @@ tfw_http_conn_repair(TfwConn *conn)
 	 * passed without errors.
 	 */
 	if (!err) {
-		spin_unlock_bh(&srv_conn->fwd_qlock);
+		tfw_http_fwdq_unlock(srv_conn);
 		goto out;
 	}
 
@@ -2200,7 +2878,7 @@ tfw_http_conn_repair(TfwConn *conn)
 	__tfw_srv_conn_clear_restricted(srv_conn);
 	tfw_srv_set_busy_delay(srv_conn);
 	tfw_http_fwdq_reset(srv_conn, &reschq);
-	spin_unlock_bh(&srv_conn->fwd_qlock);
+	tfw_http_fwdq_unlock(srv_conn);
 	tfw_http_fwdq_resched(srv_conn, &reschq, &eq);
 out:
 	tfw_http_req_zap_error(&eq);
@@ -2218,12 +2896,24 @@ tfw_http_req_destruct(void *msg)
 	WARN_ON_ONCE(!list_empty(&req->fwd_list));
 	WARN_ON_ONCE(!list_empty(&req->nip_list));
 
+	if (unlikely(test_bit(TFW_HTTP_B_CACHE_FETCH, req->flags)))
+		tfw_cache_fetch_abort(req);
 	tfw_vhost_put(req->vhost);
 	if (req->sess)
 		tfw_http_sess_put(req->sess);
 
 	if (req->peer)
 		tfw_client_put(req->peer);
+
+	ss_skb_queue_purge(&req->stream_skb);
+	if (req->srv_conn)
+		tfw_srv_conn_put(req->srv_conn);
+	if (req->hedge_conn)
+		tfw_srv_conn_put(req->hedge_conn);
+	if (req->climit_sg) {
+		tfw_sg_climit_put(req->climit_sg, 0, 0);
+		tfw_sg_put(req->climit_sg);
+	}
 }
 
 /**
@@ -2246,18 +2936,26 @@ tfw_http_resp_pair(TfwHttpMsg *hmresp)
 	TfwHttpReq *req;
 	TfwSrvConn *srv_conn = (TfwSrvConn *)hmresp->conn;
 
-	spin_lock(&srv_conn->fwd_qlock);
+	spin_lock_bh(&srv_conn->fwd_qlock);
 	list_for_each_entry(req, &srv_conn->fwd_queue, fwd_list) {
+		/* HTTP/2 responses are paired by their streams. */
+		if (hmresp->stream != &srv_conn->stream
+		    && req->sid != hmresp->stream->id)
+			goto next;
 		if (!req->pair) {
 			tfw_http_msg_pair((TfwHttpResp *)hmresp, req);
-			spin_unlock(&srv_conn->fwd_qlock);
+			/* The response is paired on its first data. */
+			((TfwHttpResp *)hmresp)->jsrvtime = jiffies
+				- tfw_http_req_jsent(srv_conn, req);
+			tfw_http_fwdq_unlock(srv_conn);
 
 			return 0;
 		}
+next:
 		if (req == (TfwHttpReq *)srv_conn->msg_sent)
 			break;
 	}
-	spin_unlock(&srv_conn->fwd_qlock);
+	tfw_http_fwdq_unlock(srv_conn);
 
 	T_WARN("Paired request missing, HTTP Response Splitting attack?\n");
 	TFW_INC_STAT_BH(serv.msgs_otherr);
@@ -2265,6 +2963,22 @@ tfw_http_resp_pair(TfwHttpMsg *hmresp)
 	return -EINVAL;
 }
 
+/*
+ * Time @req was actually passed to TCP of @srv_conn. The connection keeps
+ * the time of the last sending only, so it's used for the last sent request
+ * only: sending of requests following @req moves the time forward.
+ */
+static inline unsigned long
+tfw_http_req_jsent(TfwSrvConn *srv_conn, TfwHttpReq *req)
+{
+	unsigned long jtx = READ_ONCE(srv_conn->proto.jtxtstamp);
+
+	if (req != (TfwHttpReq *)srv_conn->msg_sent
+	    || time_before(jtx, req->jtxtstamp))
+		return req->jtxtstamp;
+	return jtx;
+}
+
 /*
  * Allocate a new HTTP message structure and link it with the connection
  * instance. Increment the number of users of the instance. Initialize
@@ -2274,7 +2988,9 @@ static TfwMsg *
 tfw_http_conn_msg_alloc(TfwConn *conn, TfwStream *stream)
 {
 	int type = TFW_CONN_TYPE(conn);
-	TfwHttpMsg *hm = __tfw_http_msg_alloc(type, true);
+	unsigned int hdr_n = max_t(unsigned int, READ_ONCE(conn->hdr_n),
+				   TFW_HTTP_HDR_RAW);
+	TfwHttpMsg *hm = __tfw_http_msg_alloc_hdrs(type, hdr_n);
 	if (unlikely(!hm))
 		return NULL;
 
@@ -2290,7 +3006,7 @@ tfw_http_conn_msg_alloc(TfwConn *conn, TfwStream *stream)
 	if (TFW_CONN_H2(conn)) {
 		TfwHttpReq *req = (TfwHttpReq *)hm;
 
-		if(!(req->pit.pool = __tfw_pool_new(0)))
+		if(!(req->pit.pool = __tfw_pool_new_cls(0, TFW_POOL_H2)))
 			goto clean;
 		req->pit.parsed_hdr = &req->stream->parser.hdr;
 		__set_bit(TFW_HTTP_B_H2, req->flags);
@@ -2300,6 +3016,7 @@ tfw_http_conn_msg_alloc(TfwConn *conn, TfwStream *stream)
 
 	if (type & Conn_Clnt) {
 		TFW_INC_STAT_BH(clnt.rx_messages);
+		tfw_client_touch((TfwClient *)conn->peer);
 	} else {
 		if (unlikely(tfw_http_resp_pair(hm)))
 			goto clean;
@@ -2341,6 +3058,16 @@ tfw_http_conn_init(TfwConn *conn)
 
 	if (TFW_CONN_TYPE(conn) & Conn_Srv) {
 		TfwSrvConn *srv_conn = (TfwSrvConn *)conn;
+		TfwServer *srv = (TfwServer *)conn->peer;
+
+		if (srv->sg->flags & TFW_SRV_HTTP2) {
+			int r = tfw_h2_srv_conn_init(srv_conn);
+			if (r)
+				return r;
+			set_bit(TFW_CONN_B_H2, &srv_conn->flags);
+		} else {
+			clear_bit(TFW_CONN_B_H2, &srv_conn->flags);
+		}
 		if (!list_empty(&srv_conn->fwd_queue)) {
 			set_bit(TFW_CONN_B_RESEND, &srv_conn->flags);
 			TFW_INC_STAT_BH(serv.conn_restricted);
@@ -2401,6 +3128,7 @@ tfw_http_conn_release(TfwConn *conn)
 	 * Move all requests from them to @zap_queue.
 	 */
 	spin_lock_bh(&srv_conn->fwd_qlock);
+	tfw_http_conn_fwd_drain(srv_conn);
 	tfw_http_conn_snip_fwd_queue(srv_conn, &zap_queue);
 	spin_unlock_bh(&srv_conn->fwd_qlock);
 
@@ -2477,6 +3205,24 @@ tfw_http_conn_cli_drop(TfwCliConn *cli_conn)
 	spin_unlock(&cli_conn->seq_qlock);
 }
 
+/*
+ * Close the peer connection of tunnel @conn. The tunnel pointers are cleared
+ * only in the context of their connections, so the tunneled data never goes
+ * to a freed connection.
+ */
+static void
+tfw_http_tunnel_close(TfwConn *conn)
+{
+	TfwConn **tunnel = tfw_conn_tunnel(conn);
+	TfwConn *pair = *tunnel;
+
+	if (likely(!pair))
+		return;
+	WRITE_ONCE(*tunnel, NULL);
+	tfw_connection_close(pair, false);
+	tfw_connection_put(pair);
+}
+
 /*
  * Connection with a peer is dropped.
  *
@@ -2484,6 +3230,8 @@ tfw_http_conn_cli_drop(TfwCliConn *cli_conn)
  * resources that are needed while there are users of the connection.
  */
 static void tfw_http_resp_terminate(TfwHttpMsg *hm);
+static void tfw_http_resp_stream_abort(TfwHttpMsg *hm);
+static void tfw_http_req_stream_drop(TfwHttpReq *req);
 
 static void
 tfw_http_conn_drop(TfwConn *conn)
@@ -2493,20 +3241,51 @@ tfw_http_conn_drop(TfwConn *conn)
 	T_DBG2("%s: conn=[%p]\n", __func__, conn);
 
 	if (TFW_CONN_TYPE(conn) & Conn_Clnt) {
+		TfwHttpMsg *hm = (TfwHttpMsg *)conn->stream.msg;
+
 		if (h2_mode)
 			tfw_h2_conn_streams_cleanup(tfw_h2_context(conn));
 		else
 			tfw_http_conn_cli_drop((TfwCliConn *)conn);
+		if (hm && test_bit(TFW_HTTP_B_REQ_STREAM, hm->flags))
+			tfw_http_req_stream_drop((TfwHttpReq *)hm);
 	}
-	else if (conn->stream.msg) { /* server connection */
-		if (!tfw_http_parse_terminate((TfwHttpMsg *)conn->stream.msg))
-			tfw_http_resp_terminate((TfwHttpMsg *)conn->stream.msg);
+	else { /* server connection */
+		TfwHttpMsg *hm = (TfwHttpMsg *)conn->stream.msg;
+
+		/* Responses which are being received on the streams. */
+		if (tfw_srv_conn_h2((TfwSrvConn *)conn))
+			tfw_h2_srv_conn_drop((TfwSrvConn *)conn);
+		if (hm && test_bit(TFW_HTTP_B_RESP_STREAM, hm->flags))
+			tfw_http_resp_stream_abort(hm);
+		else if (hm && !tfw_http_parse_terminate(hm))
+			tfw_http_resp_terminate(hm);
+		clear_bit(TFW_CONN_B_TUNNEL, &((TfwSrvConn *)conn)->flags);
 	}
+	tfw_http_tunnel_close(conn);
 
 	if (!h2_mode)
 		tfw_http_conn_msg_free((TfwHttpMsg *)conn->stream.msg);
 }
 
+/**
+ * HTTP/2 stream @stream of a server connection is closed: drop the response
+ * which is being received on the stream.
+ */
+void
+tfw_http_srv_stream_drop(TfwStream *stream)
+{
+	TfwHttpMsg *hm = (TfwHttpMsg *)stream->msg;
+
+	if (!hm)
+		return;
+	if (test_bit(TFW_HTTP_B_RESP_STREAM, hm->flags))
+		tfw_http_resp_stream_abort(hm);
+	else
+		tfw_http_conn_msg_free(hm);
+	stream->msg = NULL;
+}
+
 /*
  * Send a message through the connection.
  *
@@ -2558,11 +3337,10 @@ static int
 tfw_http_set_hdr_date(TfwHttpMsg *hm)
 {
 	int r;
-	char *s_date = *this_cpu_ptr(&g_buf);
+	const TfwHttpDate *hd = tfw_http_date(((TfwHttpResp *)hm)->date);
 
-	tfw_http_prep_date_from(s_date, ((TfwHttpResp *)hm)->date);
 	r = tfw_http_msg_hdr_xfrm(hm, "date", sizeof("date") - 1,
-				  s_date, SLEN(S_V_DATE),
+				  (char *)hd->val, SLEN(S_V_DATE),
 				  TFW_HTTP_HDR_RAW, 0);
 	if (r)
 		T_ERR("Unable to add Date: header to msg [%p]\n", hm);
@@ -2580,18 +3358,17 @@ tfw_http_expand_hdr_date(TfwHttpResp *resp)
 	int r;
 	struct sk_buff **skb_head = &resp->msg.skb_head;
 	TfwHttpTransIter *mit = &resp->mit;
-	char *date = *this_cpu_ptr(&g_buf);
+	const TfwHttpDate *hd = tfw_http_date(resp->date);
 	TfwStr h_date = {
 		.chunks = (TfwStr []){
 			{ .data = S_F_DATE, .len = SLEN(S_F_DATE) },
-			{ .data = date, .len = SLEN(S_V_DATE) },
+			{ .data = (char *)hd->val, .len = SLEN(S_V_DATE) },
 			{ .data = S_CRLF, .len = SLEN(S_CRLF) }
 		},
 		.len = SLEN(S_F_DATE) + SLEN(S_V_DATE) + SLEN(S_CRLF),
 		.nchunks = 3
 	};
 
-	tfw_http_prep_date_from(date, resp->date);
 	r = tfw_http_msg_expand_data(&mit->iter, skb_head, &h_date, NULL);
 	if (r)
 		T_ERR("Unable to expand resp [%p] with 'Date:' header\n", resp);
@@ -2689,6 +3466,9 @@ tfw_http_set_hdr_connection(TfwHttpMsg *hm, unsigned long conn_flg)
 	case BIT(TFW_HTTP_B_CONN_KA):
 		return TFW_HTTP_MSG_HDR_XFRM(hm, "Connection", "keep-alive",
 					     TFW_HTTP_HDR_CONNECTION, 0);
+	case BIT(TFW_HTTP_B_CONN_UPGRADE):
+		return TFW_HTTP_MSG_HDR_XFRM(hm, "Connection", "upgrade",
+					     TFW_HTTP_HDR_CONNECTION, 0);
 	default:
 		return TFW_HTTP_MSG_HDR_DEL(hm, "Connection",
 					    TFW_HTTP_HDR_CONNECTION);
@@ -2780,7 +3560,7 @@ __tfw_http_add_hdr_via(TfwHttpMsg *hm, int http_version, bool from_cache)
 			{ .data = S_F_VIA, .len = SLEN(S_F_VIA) },
 			{ .data = (void *)s_http_version[http_version],
 			  .len = 4 },
-			{ .data = *this_cpu_ptr(&g_buf),
+			{ .data = (char *)g_vhost->hdr_via,
 			  .len = g_vhost->hdr_via_len },
 		},
 		.len = SLEN(S_F_VIA) + 4 + g_vhost->hdr_via_len,
@@ -2788,9 +3568,6 @@ __tfw_http_add_hdr_via(TfwHttpMsg *hm, int http_version, bool from_cache)
 		.nchunks = 3
 	};
 
-	memcpy_fast(__TFW_STR_CH(&rh, 2)->data, g_vhost->hdr_via,
-		    g_vhost->hdr_via_len);
-
 	if (!from_cache) {
 		r = tfw_http_msg_hdr_add(hm, &rh);
 	}
@@ -2823,23 +3600,44 @@ tfw_http_add_hdr_via(TfwHttpMsg *hm)
 	return __tfw_http_add_hdr_via(hm, hm->version, false);
 }
 
+/**
+ * Get the client address for X-Forwarded-For header of @req. The address is
+ * formatted once when the client connection is accepted, the message source
+ * address is formatted only for requests not coming from a client.
+ */
+static void
+tfw_http_req_xff(TfwHttpReq *req, TfwStr *xff)
+{
+	TfwCliConn *cli_conn = (TfwCliConn *)req->conn;
+	char *buf;
+
+	if (likely(cli_conn && (TFW_CONN_TYPE(cli_conn) & Conn_Clnt))) {
+		xff->data = cli_conn->xff;
+		xff->len = cli_conn->xff_len;
+		return;
+	}
+	buf = *this_cpu_ptr(&g_buf);
+	xff->data = buf;
+	xff->len = ss_skb_fmt_src_addr(req->msg.skb_head, buf) - buf;
+}
+
 static int
 tfw_http_add_x_forwarded_for(TfwHttpMsg *hm)
 {
 	int r;
-	char *p, *buf = *this_cpu_ptr(&g_buf);
+	TfwStr xff = {};
 
-	p = ss_skb_fmt_src_addr(hm->msg.skb_head, buf);
+	tfw_http_req_xff((TfwHttpReq *)hm, &xff);
 
 	r = tfw_http_msg_hdr_xfrm(hm, "X-Forwarded-For",
-				  sizeof("X-Forwarded-For") - 1, buf, p - buf,
-				  TFW_HTTP_HDR_X_FORWARDED_FOR, 0);
+				  sizeof("X-Forwarded-For") - 1, xff.data,
+				  xff.len, TFW_HTTP_HDR_X_FORWARDED_FOR, 0);
 	if (r)
 		T_ERR("can't add X-Forwarded-For header for %.*s to msg %p",
-		      (int)(p - buf), buf, hm);
+		      (int)xff.len, xff.data, hm);
 	else
 		T_DBG2("added X-Forwarded-For header for %.*s\n",
-		       (int)(p - buf), buf);
+		       (int)xff.len, xff.data);
 	return r;
 }
 
@@ -2895,6 +3693,62 @@ tfw_http_should_validate_post_req(TfwHttpReq *req)
 	return false;
 }
 
+/*
+ * Get the next run @run of the configured headers @h_mods precompiled in
+ * HTTP/1.1 or HTTP/2 (if @h2 is true) block, which aren't in @found set,
+ * starting from the header @*i. @run must be initialized with the block
+ * start and zero length before the first call.
+ *
+ * @return false if there are no more headers to add.
+ */
+static bool
+tfw_http_hdr_mods_run(const TfwHdrMods *h_mods, const unsigned long *found,
+		      bool h2, unsigned int *i, TfwStr *run)
+{
+	run->data += run->len;
+	run->len = 0;
+
+	for ( ; *i < h_mods->sz; ++*i) {
+		const TfwHdrModsDesc *d = &h_mods->hdrs[*i];
+		unsigned int len = h2 ? d->h2_len : d->h1_len;
+
+		if (!test_bit(*i, found)) {
+			run->len += len;
+			continue;
+		}
+		if (run->len)
+			break;
+		run->data += len;
+	}
+
+	return run->len;
+}
+
+/*
+ * Add precompiled local headers, except already processed ones, to the end of
+ * http/1 response @resp being built from cache.
+ */
+static int
+tfw_h1_add_loc_hdrs_cache(TfwHttpResp *resp, const TfwHdrMods *h_mods)
+{
+	int r;
+	unsigned int i = 0;
+	TfwHttpTransIter *mit = &resp->mit;
+	TfwStr run = { .data = h_mods->h1_blk.data };
+
+	while (tfw_http_hdr_mods_run(h_mods, mit->found, false, &i, &run)) {
+		r = tfw_http_msg_expand_data(&mit->iter, &resp->msg.skb_head,
+					     &run, NULL);
+		if (unlikely(r)) {
+			T_ERR("can't add location-specific headers to"
+			      " response %p\n", resp);
+			return r;
+		}
+	}
+
+	return 0;
+}
+
 /**
  * Add local headers (defined by administrator in configuration file) to http/1
  * message.
@@ -2916,6 +3770,13 @@ tfw_h1_set_loc_hdrs(TfwHttpMsg *hm, bool is_resp, bool from_cache)
 		return -EINVAL;
 	if (!h_mods)
 		return 0;
+	/*
+	 * A response is built from cache. Response is stored in cache
+	 * optimised for h2 and it's being created header-by-header right
+	 * away, so the configured headers are just added at the end.
+	 */
+	if (from_cache)
+		return tfw_h1_add_loc_hdrs_cache((TfwHttpResp *)hm, h_mods);
 
 	for (i = 0; i < h_mods->sz; ++i) {
 		int r;
@@ -2944,32 +3805,7 @@ tfw_h1_set_loc_hdrs(TfwHttpMsg *hm, bool is_resp, bool from_cache)
 		h_mdf.flags = d->hdr->flags;
 		h_mdf.eolen += d->hdr->eolen;
 
-		/*
-		 * A response is built from cache. Response is stored in
-		 * cache optimised for h2 and it's being created
-		 * header-by-header right away.
-		 */
-		if (from_cache) {
-			TfwHttpResp *resp = (TfwHttpResp *)hm;
-			struct sk_buff **skb_head = &resp->msg.skb_head;
-			TfwHttpTransIter *mit = &resp->mit;
-			TfwStr crlf = { .data = S_CRLF, .len = SLEN(S_CRLF) };
-			/*
-			 * Skip the configured header if we have already
-			 * processed it during cache reading, or if the header
-			 * is configured for deletion (without value chunk).
-			 */
-			if (test_bit(i, mit->found) || h_mdf.nchunks < 3)
-				continue;
-			/* h_mdf->eolen is ignored, add explicit CRLF. */
-			r = tfw_http_msg_expand_data(&mit->iter, skb_head,
-						     &h_mdf, NULL);
-			r |= tfw_http_msg_expand_data(&mit->iter, skb_head,
-						     &crlf, NULL);
-		} else {
-			r = tfw_http_msg_hdr_xfrm_str(hm, &h_mdf, d->hid,
-						      d->append);
-		}
+		r = tfw_http_msg_hdr_xfrm_str(hm, &h_mdf, d->hid, d->append);
 
 		if (r) {
 			T_ERR("can't update location-specific header in msg %p\n",
@@ -3116,6 +3952,10 @@ tfw_h1_adjust_req(TfwHttpReq *req)
 			return r;
 	}
 
+	if (test_bit(TFW_HTTP_B_CONN_UPGRADE, req->flags))
+		return tfw_http_set_hdr_connection(hm,
+						   BIT(TFW_HTTP_B_CONN_UPGRADE));
+
 	return tfw_http_set_hdr_connection(hm, BIT(TFW_HTTP_B_CONN_KA));
 }
 
@@ -3281,8 +4121,8 @@ tfw_h2_req_set_loc_hdrs(TfwHttpReq *req)
  * Note, that we keep original headers in h_tbl untouched, since the response
  * may want to access the request headers: the cache subsystem reads `Host`
  * header and `uri` part, also if 'Vary' header controls response
- * representation, any header listed inside 'Vary' one may be also read on
- * response processing (not implemented yet).
+ * representation, any header listed inside 'Vary' one is also read on
+ * response processing to build the cache secondary key.
  */
 static int
 tfw_h2_adjust_req(TfwHttpReq *req)
@@ -3301,16 +4141,13 @@ tfw_h2_adjust_req(TfwHttpReq *req)
 	const DEFINE_TFW_STR(dlm, S_DLM);
 	const DEFINE_TFW_STR(crlf, S_CRLF);
 	const DEFINE_TFW_STR(fl_end, " " S_VERSION11 S_CRLF S_F_HOST);
-	char *buf = *this_cpu_ptr(&g_buf);
-	char *xff_end = ss_skb_fmt_src_addr(req->msg.skb_head, buf);
-	const TfwStr h_xff = {
+	TfwStr h_xff = {
 		.chunks = (TfwStr []){
 			{ .data = S_XFF, .len = SLEN(S_XFF) },
 			{ .data = S_DLM, .len = SLEN(S_DLM) },
-			{ .data = buf, .len = xff_end - buf },
+			{},
 			{ .data = S_CRLF, .len = SLEN(S_CRLF) },
 		},
-		.len = SLEN(S_XFF) + SLEN(S_DLM) + xff_end - buf + SLEN(S_CRLF),
 		.nchunks = 4
 	};
 	TfwGlobal *g_vhost = tfw_vhost_get_global();
@@ -3445,6 +4282,9 @@ tfw_h2_adjust_req(TfwHttpReq *req)
 			h1_hdrs_sz -= dup->len + SLEN(S_DLM) + SLEN(S_CRLF);
 		}
 	}
+	tfw_http_req_xff(req, &h_xff.chunks[2]);
+	h_xff.len = SLEN(S_XFF) + SLEN(S_DLM) + h_xff.chunks[2].len
+		    + SLEN(S_CRLF);
 	h1_hdrs_sz += h_xff.len;
 	h1_hdrs_sz += h_via.len;
 	if (need_cl)
@@ -3634,7 +4474,7 @@ tfw_h1_purge_resp_clean(TfwHttpResp *resp)
  * Adjust the response before proxying it to real client.
  */
 static int
-tfw_http_adjust_resp(TfwHttpResp *resp)
+__tfw_http_adjust_resp(TfwHttpResp *resp)
 {
 	TfwHttpReq *req = resp->req;
 	TfwHttpMsg *hm = (TfwHttpMsg *)resp;
@@ -3657,6 +4497,10 @@ tfw_http_adjust_resp(TfwHttpResp *resp)
 	{
 		if (unlikely(test_bit(TFW_HTTP_B_CONN_CLOSE, req->flags)))
 			conn_flg = BIT(TFW_HTTP_B_CONN_CLOSE);
+		/* The tunnel is opened, see tfw_http_tunnel_open(). */
+		else if (resp->status == 101
+			 && test_bit(TFW_HTTP_B_CONN_UPGRADE, req->flags))
+			conn_flg = BIT(TFW_HTTP_B_CONN_UPGRADE);
 		else if (test_bit(TFW_HTTP_B_CONN_KA, req->flags))
 			conn_flg = BIT(TFW_HTTP_B_CONN_KA);
 	}
@@ -3701,9 +4545,55 @@ tfw_http_adjust_resp(TfwHttpResp *resp)
 				     TFW_HTTP_HDR_SERVER, 0);
 }
 
+static int
+tfw_http_adjust_resp(TfwHttpResp *resp)
+{
+	u64 t0 = tfw_lat_start();
+	int r;
+
+	r = __tfw_http_adjust_resp(resp);
+	tfw_lat_end(TFW_LAT_ADJUST, t0);
+
+	return r;
+}
+
+/*
+ * Append skbs of @resp to @msg gathering the responses to be sent at once.
+ * The skbs of a response, which are kept by the cache, are copied.
+ */
+static int
+tfw_http_resp_gather(TfwMsg *msg, TfwHttpResp *resp)
+{
+	struct sk_buff *skb_head = resp->msg.skb_head;
+
+	msg->ss_flags |= resp->msg.ss_flags & ~SS_F_KEEP_SKB;
+	msg->len += resp->msg.len;
+	if (!skb_head)
+		return 0;
+
+	if (resp->msg.ss_flags & SS_F_KEEP_SKB) {
+		skb_head = NULL;
+		if (ss_skb_queue_copy(&skb_head, resp->msg.skb_head))
+			return -ENOMEM;
+	} else {
+		resp->msg.skb_head = NULL;
+	}
+
+	if (msg->skb_head)
+		ss_skb_queue_append(&msg->skb_head, skb_head);
+	else
+		msg->skb_head = skb_head;
+
+	return 0;
+}
+
 /*
  * Forward responses in @ret_queue to the client in correct order.
  *
+ * The ready responses are gathered and sent by a single ss_send() call, so
+ * pipelined responses are encrypted and pushed to the client socket at once.
+ * A response closing the connection ends the gathered responses.
+ *
  * In case of error the client connection must be closed immediately.
  * Otherwise, the correct order of responses will be broken. Unsent
  * responses are taken care of by the caller.
@@ -3712,18 +4602,38 @@ static void
 __tfw_http_resp_fwd(TfwCliConn *cli_conn, struct list_head *ret_queue)
 {
 	TfwHttpReq *req, *tmp;
+	TfwMsg msg;
+	LIST_HEAD(sent);
 
-	list_for_each_entry_safe(req, tmp, ret_queue, msg.seq_list) {
-		BUG_ON(!req->resp);
-		tfw_http_resp_init_ss_flags(req->resp);
-		if (tfw_cli_conn_send(cli_conn, (TfwMsg *)req->resp)) {
-			tfw_connection_close((TfwConn *)cli_conn, true);
-			return;
+	while (!list_empty(ret_queue)) {
+		memset(&msg, 0, sizeof(msg));
+		list_for_each_entry_safe(req, tmp, ret_queue, msg.seq_list) {
+			BUG_ON(!req->resp);
+			tfw_http_resp_init_ss_flags(req->resp);
+			if (tfw_http_resp_gather(&msg, req->resp))
+				goto err;
+			list_move_tail(&req->msg.seq_list, &sent);
+			if (msg.ss_flags & SS_F_CONN_CLOSE)
+				break;
+		}
+		if (tfw_cli_conn_send(cli_conn, &msg))
+			goto err;
+
+		list_for_each_entry_safe(req, tmp, &sent, msg.seq_list) {
+			tfw_access_log(req, req->resp, req->resp->msg.len);
+			tfw_http_loc_stat_resp(req, req->resp,
+					       req->resp->msg.len);
+			list_del_init(&req->msg.seq_list);
+			tfw_http_resp_pair_free(req);
+			TFW_INC_STAT_BH(serv.msgs_forwarded);
 		}
-		list_del_init(&req->msg.seq_list);
-		tfw_http_resp_pair_free(req);
-		TFW_INC_STAT_BH(serv.msgs_forwarded);
 	}
+
+	return;
+err:
+	ss_skb_queue_purge(&msg.skb_head);
+	list_splice(&sent, ret_queue);
+	tfw_connection_close((TfwConn *)cli_conn, true);
 }
 
 /*
@@ -3886,23 +4796,12 @@ tfw_h2_add_hdr_via(TfwHttpResp *resp)
 {
 	int r;
 	TfwGlobal *g_vhost = tfw_vhost_get_global();
-	TfwStr via = {
-		.chunks = (TfwStr []) {
-			{ .data = S_VIA, .len = SLEN(S_VIA) },
-			{ .data = S_VIA_H2_PROTO, .len = SLEN(S_VIA_H2_PROTO) },
-			{ .data = *this_cpu_ptr(&g_buf),
-			  .len = g_vhost->hdr_via_len },
-		},
-		.len = SLEN(S_VIA) + SLEN(S_VIA_H2_PROTO) + g_vhost->hdr_via_len,
-		.nchunks = 3
+	const TfwStr via = {
+		.data = (char *)g_vhost->hdr_via_h2,
+		.len = g_vhost->hdr_via_h2_len
 	};
 
-	memcpy_fast(__TFW_STR_CH(&via, 2)->data, g_vhost->hdr_via,
-		    g_vhost->hdr_via_len);
-
-	via.hpack_idx = 60;
-
-	r = tfw_hpack_encode(resp, &via, TFW_H2_TRANS_ADD, true);
+	r = tfw_hpack_add_raw(resp, &via, TFW_H2_TRANS_ADD);
 	if (unlikely(r))
 		T_ERR("HTTP/2: unable to add 'via' header (resp=[%p])\n", resp);
 	else
@@ -3918,21 +4817,13 @@ int
 tfw_h2_add_hdr_date(TfwHttpResp *resp, TfwH2TransOp op, bool cache)
 {
 	int r;
-	char *s_date = *this_cpu_ptr(&g_buf);
-	TfwStr hdr = {
-		.chunks = (TfwStr []){
-			{ .data = "date", .len = SLEN("date") },
-			{ .data = s_date, .len = SLEN(S_V_DATE) },
-		},
-		.len = SLEN("date") + SLEN(S_V_DATE),
-		.nchunks = 2
+	const TfwHttpDate *hd = tfw_http_date(resp->date);
+	const TfwStr hdr = {
+		.data = (char *)hd->hpack,
+		.len = sizeof(hd->hpack) + SLEN(S_V_DATE)
 	};
 
-	tfw_http_prep_date_from(s_date, resp->date);
-
-	hdr.hpack_idx = 33;
-
-	r = tfw_hpack_encode(resp, &hdr, op, !cache);
+	r = tfw_hpack_add_raw(resp, &hdr, op);
 	if (unlikely(r))
 		T_ERR("HTTP/2: unable to add 'date' header to response"
 			" [%p]\n", resp);
@@ -4095,25 +4986,28 @@ tfw_h2_hdr_size(unsigned long n_len, unsigned long v_len,
 	return size;
 }
 
+/**
+ * Add the configured headers @h_mods, which haven't been processed yet, to
+ * the end of the response @resp headers. The headers are precompiled into
+ * HPACK block at configuration time, so usually the whole block is added at
+ * once, and only the headers found in the response are cut out of it.
+ */
 int
 tfw_h2_resp_add_loc_hdrs(TfwHttpResp *resp, const TfwHdrMods *h_mods,
 			 bool cache)
 {
-	unsigned int i;
+	int r;
+	unsigned int i = 0;
+	TfwStr run = {};
 	TfwHttpTransIter *mit = &resp->mit;
 	TfwH2TransOp op = cache ? TFW_H2_TRANS_EXPAND : TFW_H2_TRANS_ADD;
 
 	if (!h_mods)
 		return 0;
 
-	for (i = 0; i < h_mods->sz; ++i) {
-		const TfwHdrModsDesc *desc = &h_mods->hdrs[i];
-		int r;
-
-		if (test_bit(i, mit->found) || !TFW_STR_CHUNK(desc->hdr, 1))
-			continue;
-
-		r = tfw_hpack_encode(resp, desc->hdr, op, !cache);
+	run.data = h_mods->h2_blk.data;
+	while (tfw_http_hdr_mods_run(h_mods, mit->found, true, &i, &run)) {
+		r = tfw_hpack_add_raw(resp, &run, op);
 		if (unlikely(r))
 			return r;
 	}
@@ -4300,6 +5194,167 @@ do {									\
 		return r;						\
 } while ((len));
 
+static inline unsigned int
+__tfw_h2_data_seg_size(const TfwMsgIter *it)
+{
+	return it->frag < 0
+		? skb_headlen(it->skb)
+		: skb_frag_size(&skb_shinfo(it->skb)->frags[it->frag]);
+}
+
+static inline char *
+__tfw_h2_data_seg_addr(const TfwMsgIter *it)
+{
+	return it->frag < 0
+		? (char *)it->skb->data
+		: (char *)skb_frag_address(&skb_shinfo(it->skb)->frags[it->frag]);
+}
+
+/**
+ * Move @it to the next data segment, i.e. linear data or paged fragment,
+ * of the message.
+ */
+static inline int
+__tfw_h2_data_seg_next(TfwMsgIter *it)
+{
+	if (it->frag + 1 < skb_shinfo(it->skb)->nr_frags) {
+		++it->frag;
+		return 0;
+	}
+	if (WARN_ON_ONCE(it->skb->next == it->skb_head))
+		return -EINVAL;
+	it->skb = it->skb->next;
+	it->frag = -1;
+
+	return 0;
+}
+
+/**
+ * Move the data position @it and @off forward by @len bytes. If the position
+ * is at the end of a data segment, then move it to the start of the next
+ * non-empty segment.
+ */
+static int
+__tfw_h2_data_skip(TfwMsgIter *it, unsigned int *off, unsigned long len)
+{
+	int r;
+	unsigned int seg;
+
+	while (true) {
+		seg = __tfw_h2_data_seg_size(it) - *off;
+		if (len < seg) {
+			*off += len;
+			return 0;
+		}
+		len -= seg;
+		if ((r = __tfw_h2_data_seg_next(it)))
+			return r;
+		*off = 0;
+	}
+}
+
+/**
+ * Choose the length of the next DATA frame with @len bytes of the body left.
+ * The frame ends at a boundary of the data segments, so its header can be
+ * placed in a separate fragment and no body data is split. The frame is split
+ * at @max_sz only if the current data segment is larger than @max_sz.
+ */
+static unsigned long
+tfw_h2_data_frame_len(const TfwMsgIter *iter, unsigned int off,
+		      unsigned long len, unsigned long max_sz)
+{
+	TfwMsgIter it = *iter;
+	unsigned long n = 0, seg;
+
+	if (len <= max_sz)
+		return len;
+
+	seg = __tfw_h2_data_seg_size(&it) - off;
+	while (n + seg <= max_sz) {
+		n += seg;
+		if (__tfw_h2_data_seg_next(&it))
+			break;
+		seg = __tfw_h2_data_seg_size(&it);
+	}
+
+	return n ? : max_sz;
+}
+
+/**
+ * Put DATA frame header @hdr in front of the body data at @it and @off.
+ *
+ * If the data starts a paged fragment, then the header is added as a new
+ * fragment just before it. If the data starts linear data of an skb, then
+ * the header is added as the last fragment of the previous skb. Only if the
+ * frame boundary is in the middle of a data segment, the segment is split.
+ * On return @it and @off point at the end of the inserted header or at the
+ * same data, so __tfw_h2_data_skip() gets to the data in both cases.
+ */
+static int
+tfw_h2_data_hdr_insert(TfwMsgIter *it, unsigned int *off, const TfwStr *hdr)
+{
+	int r;
+	char *p;
+
+	if (*off) {
+		p = __tfw_h2_data_seg_addr(it) + *off;
+		if ((r = tfw_http_msg_insert(it, &p, hdr)))
+			return r;
+	}
+	else if (it->frag >= 0) {
+		r = ss_skb_add_frag(it->skb_head, &it->skb, &it->frag,
+				    hdr->data, hdr->len);
+		if (r)
+			return r;
+	}
+	else {
+		struct sk_buff *skb = it->skb->prev;
+		int i = skb_shinfo(skb)->nr_frags;
+
+		if (WARN_ON_ONCE(it->skb == it->skb_head))
+			return -EINVAL;
+		return ss_skb_add_frag(it->skb_head, &skb, &i, hdr->data,
+				       hdr->len);
+	}
+	*off = hdr->len;
+
+	return 0;
+}
+
+/**
+ * Frame @b_len bytes of response body starting at @it and @off. The header of
+ * the first DATA frame with @flen bytes of data is already in place.
+ *
+ * Frame lengths are chosen by tfw_h2_data_frame_len() to end at boundaries of
+ * skb fragments, so that the frame headers are added as separate fragments and
+ * the body is not moved. Since TLS records are built from whole skbs, that also
+ * keeps frames from crossing TLS records when the body skbs are full.
+ */
+static int
+tfw_h2_make_data_frames(TfwMsgIter *it, unsigned int off, unsigned long b_len,
+			unsigned long flen, TfwFrameHdr *frame_hdr,
+			unsigned char flags, unsigned long max_sz)
+{
+	int r;
+	unsigned char buf[FRAME_HEADER_SIZE];
+	const TfwStr frame_hdr_str = { .data = buf, .len = sizeof(buf)};
+
+	while ((b_len -= flen)) {
+		if ((r = __tfw_h2_data_skip(it, &off, flen)))
+			return r;
+
+		flen = tfw_h2_data_frame_len(it, off, b_len, max_sz);
+		frame_hdr->length = flen;
+		frame_hdr->flags = (flen == b_len) ? flags : 0;
+		tfw_h2_pack_frame_header(buf, frame_hdr);
+
+		if ((r = tfw_h2_data_hdr_insert(it, &off, &frame_hdr_str)))
+			return r;
+	}
+
+	return 0;
+}
+
 /**
  * Split response body stored locally. Allocate a new skb and put body there
  * by fragments. Every skb fragment has size of single page and has frame
@@ -4348,7 +5403,7 @@ tfw_h2_append_predefined_body(TfwHttpResp *resp, unsigned int stream_id,
 		frame_hdr.flags = len ? 0 : HTTP2_F_END_STREAM;
 		frame_hdr.length = copy;
 
-		if (!(page = alloc_page(GFP_ATOMIC))) {
+		if (!(page = ss_skb_alloc_page())) {
 			return -ENOMEM;
 		}
 		p = page_address(page);
@@ -4372,6 +5427,24 @@ tfw_h2_append_predefined_body(TfwHttpResp *resp, unsigned int stream_id,
 	return 0;
 }
 
+/**
+ * Set @it and @off at the first byte of the body of forwarded response @resp.
+ */
+static int
+tfw_h2_data_body_iter(TfwHttpResp *resp, TfwMsgIter *it, unsigned int *off)
+{
+	int r;
+	char *data = TFW_STR_CHUNK(&resp->body, 0)->data;
+
+	it->skb_head = resp->msg.skb_head;
+	it->skb = resp->body.skb;
+	if ((r = tfw_http_iter_set_at(it, data)))
+		return r;
+	*off = data - __tfw_h2_data_seg_addr(it);
+
+	return __tfw_h2_data_skip(it, off, 0);
+}
+
 /**
  * Split response into http/2 frames with respect to remote peer MAX_FRAME_SIZE
  * settings. Both HEADERS and DATA frames require framing or peer will reject
@@ -4404,15 +5477,19 @@ tfw_h2_make_frames(TfwHttpResp *resp, unsigned int stream_id,
 {
 	int r;
 	char *data;
-	unsigned long b_len = resp->body.len;
+	unsigned long b_len = resp->body.len, b_flen = 0;
+	unsigned int b_off = 0;
 	unsigned char buf[FRAME_HEADER_SIZE];
 	TfwFrameHdr frame_hdr = {.stream_id = stream_id};
 	const TfwStr frame_hdr_str = { .data = buf, .len = sizeof(buf)};
 	TfwHttpTransIter *mit = &resp->mit;
-	TfwMsgIter *iter = &mit->iter;
+	TfwMsgIter *iter = &mit->iter, b_it;
 	TfwH2Ctx *ctx = tfw_h2_context(resp->req->conn);
 	unsigned long max_sz = ctx->rsettings.max_frame_sz;
-	unsigned char fr_flags = (b_len || local_body)
+	/* The rest of streamed response body is framed on its receiving. */
+	unsigned char b_flags = test_bit(TFW_HTTP_B_RESP_STREAM, resp->flags)
+			? 0 : HTTP2_F_END_STREAM;
+	unsigned char fr_flags = (b_len || local_body || !b_flags)
 			? HTTP2_F_END_HEADERS
 			: HTTP2_F_END_HEADERS | HTTP2_F_END_STREAM;
 
@@ -4443,10 +5520,15 @@ tfw_h2_make_frames(TfwHttpResp *resp, unsigned int stream_id,
 	 */
 	if (!local_response) {
 		if (b_len) {
-			frame_hdr.length = min(max_sz, b_len);
+			r = tfw_h2_data_body_iter(resp, &b_it, &b_off);
+			if (unlikely(r))
+				return r;
+			b_flen = tfw_h2_data_frame_len(&b_it, b_off, b_len,
+						       max_sz);
+			frame_hdr.length = b_flen;
 			frame_hdr.type = HTTP2_DATA;
 			frame_hdr.flags = (frame_hdr.length == b_len)
-					? HTTP2_F_END_STREAM : 0;
+					? b_flags : 0;
 			tfw_h2_pack_frame_header(buf, &frame_hdr);
 
 			r = tfw_h2_msg_rewrite_data(mit, &frame_hdr_str,
@@ -4477,18 +5559,18 @@ tfw_h2_make_frames(TfwHttpResp *resp, unsigned int stream_id,
 	if (local_response)
 		return 0;
 
-	/* Add more frame headers for DATA block. */
-	if (b_len > max_sz) {
-		unsigned long skew = 0;
-
-		iter->skb = resp->body.skb;
-		data = TFW_STR_CHUNK(&resp->body, 0)->data;
-		if ((r = tfw_http_iter_set_at(iter, data)))
+	/*
+	 * Add more frame headers for DATA block. The cut above may move the
+	 * body data to another fragment, but it doesn't change the data
+	 * segments the first frame consists of, so only the body position
+	 * must be found again.
+	 */
+	if (b_len > b_flen) {
+		if ((r = tfw_h2_data_body_iter(resp, &b_it, &b_off)))
 			return r;
-
-		b_len -= max_sz;
 		frame_hdr.type = HTTP2_DATA;
-		__tfw_h2_make_frames(b_len, HTTP2_F_END_STREAM);
+		return tfw_h2_make_data_frames(&b_it, b_off, b_len, b_flen,
+					       &frame_hdr, b_flags, max_sz);
 	}
 
 	return 0;
@@ -4521,6 +5603,56 @@ tfw_h2_frame_local_resp(TfwHttpResp *resp, unsigned int stream_id,
 	return tfw_h2_append_predefined_body(resp, stream_id, body);
 }
 
+/**
+ * Frame next @b_len bytes of streamed response body. The data is received
+ * after the response headers were forwarded, so all the skbs of the response
+ * contain the body only. The DATA frame headers are inserted just like in
+ * tfw_h2_make_frames(), END_STREAM flag is set for the @last response part.
+ */
+static int
+tfw_h2_frame_stream_data(TfwHttpResp *resp, unsigned long b_len, bool last)
+{
+	int r;
+	char *data;
+	unsigned int off = 0;
+	unsigned long flen;
+	unsigned char buf[FRAME_HEADER_SIZE];
+	TfwFrameHdr frame_hdr = {
+		.stream_id = resp->stream_id,
+		.type = HTTP2_DATA
+	};
+	const TfwStr frame_hdr_str = { .data = buf, .len = sizeof(buf)};
+	TfwMsgIter *iter = &resp->mit.iter;
+	TfwH2Ctx *ctx = tfw_h2_context(resp->req->conn);
+	unsigned long max_sz = ctx->rsettings.max_frame_sz;
+	unsigned char flags = last ? HTTP2_F_END_STREAM : 0;
+	struct sk_buff *skb = resp->msg.skb_head;
+
+	iter->skb_head = iter->skb = skb;
+	iter->frag = skb_headlen(skb) ? -1 : 0;
+
+	flen = tfw_h2_data_frame_len(iter, 0, b_len, max_sz);
+	frame_hdr.length = flen;
+	frame_hdr.flags = (flen == b_len) ? flags : 0;
+	tfw_h2_pack_frame_header(buf, &frame_hdr);
+	/*
+	 * There is no previous skb for the linear data of the first skb, so
+	 * the data is moved to a fragment behind the header in that case.
+	 */
+	if (iter->frag < 0) {
+		data = skb->data;
+		if ((r = tfw_http_msg_insert(iter, &data, &frame_hdr_str)))
+			return r;
+		off = sizeof(buf);
+	}
+	else if ((r = tfw_h2_data_hdr_insert(iter, &off, &frame_hdr_str))) {
+		return r;
+	}
+
+	return tfw_h2_make_data_frames(iter, off, b_len, flen, &frame_hdr,
+				       flags, max_sz);
+}
+
 static void
 tfw_h1_resp_adjust_fwd(TfwHttpResp *resp)
 {
@@ -4737,6 +5869,11 @@ tfw_http_cli_error_resp_and_log(TfwHttpReq *req, int status, const char *msg,
 	 */
 	tfw_http_conn_msg_free(req->pair);
 
+	if (unlikely(!req->conn)) {
+		tfw_http_msg_free((TfwHttpMsg *)req);
+		return;
+	}
+
 	if (attack) {
 		reply = tfw_blk_flags & TFW_BLK_ATT_REPLY;
 		nolog = tfw_blk_flags & TFW_BLK_ATT_NOLOG;
@@ -4808,27 +5945,17 @@ tfw_http_req_block(TfwHttpReq *req, int status, const char *msg)
  * Major browsers and curl ignore that RFC requirement an work well. But
  * that is definitely an RFC violation and implementation specific behaviour.
  */
-static void
-tfw_h2_resp_adjust_fwd(TfwHttpResp *resp)
+static int
+tfw_h2_resp_adjust(TfwHttpResp *resp, unsigned int stream_id)
 {
 	int r;
-	unsigned int stream_id;
 	bool hdrs_end = false;
 	TfwHttpReq *req = resp->req;
-	TfwH2Ctx *ctx = tfw_h2_context(req->conn);
 	TfwHttpTransIter *mit = &resp->mit;
 	TfwNextHdrOp *next = &mit->next;
 	const TfwHdrMods *h_mods = tfw_vhost_get_hdr_mods(req->location,
 							  req->vhost,
 							  TFW_VHOST_HDRMOD_RESP);
-	/*
-	 * Get ID of corresponding stream to prepare/send HTTP/2 response, and
-	 * unlink request from the stream.
-	 */
-	stream_id = tfw_h2_stream_id_close(req, HTTP2_HEADERS,
-					   HTTP2_F_END_STREAM);
-	if (unlikely(!stream_id))
-		goto out;
 
 	/*
 	 * Transform HTTP/1.1 headers into HTTP/2 form, in parallel with
@@ -4840,15 +5967,15 @@ tfw_h2_resp_adjust_fwd(TfwHttpResp *resp)
 
 	r = tfw_h2_resp_next_hdr(resp, h_mods);
 	if (unlikely(r))
-		goto clean;
+		return r;
 
 	r = tfw_h2_resp_status_write(resp, resp->status, TFW_H2_TRANS_SUB,
 				     false);
 	if (unlikely(r))
-		goto clean;
+		return r;
 
 	if (WARN_ON_ONCE(!mit->bnd))
-		goto clean;
+		return -EINVAL;
 
 	do {
 		TfwStr *last;
@@ -4857,7 +5984,7 @@ tfw_h2_resp_adjust_fwd(TfwHttpResp *resp)
 
 		r = tfw_h2_resp_next_hdr(resp, h_mods);
 		if (unlikely(r))
-			goto clean;
+			return r;
 
 		if (!mit->bnd) {
 			last = TFW_STR_LAST(&resp->crlf);
@@ -4867,7 +5994,7 @@ tfw_h2_resp_adjust_fwd(TfwHttpResp *resp)
 
 		r = tfw_hpack_encode(resp, &hdr, op, true);
 		if (unlikely(r))
-			goto clean;
+			return r;
 
 	} while (!hdrs_end);
 
@@ -4879,27 +6006,50 @@ tfw_h2_resp_adjust_fwd(TfwHttpResp *resp)
 	 */
 	r = tfw_http_sess_resp_process(resp, false);
 	if (unlikely(r))
-		goto clean;
+		return r;
 
 	r = tfw_h2_add_hdr_via(resp);
 	if (unlikely(r))
-		goto clean;
+		return r;
 
 	if (!test_bit(TFW_HTTP_B_HDR_DATE, resp->flags)) {
 		r = tfw_h2_add_hdr_date(resp, TFW_H2_TRANS_ADD, false);
 		if (unlikely(r))
-			goto clean;
+			return r;
 	}
 
 	r = TFW_H2_MSG_HDR_ADD(resp, "server", TFW_SERVER, 54);
 	if (unlikely(r))
-		goto clean;
+		return r;
 
 	r = tfw_h2_resp_add_loc_hdrs(resp, h_mods, false);
 	if (unlikely(r))
-		goto clean;
+		return r;
+
+	return tfw_h2_frame_fwd_resp(resp, stream_id, mit->acc_len);
+}
+
+static void
+tfw_h2_resp_adjust_fwd(TfwHttpResp *resp)
+{
+	unsigned int stream_id;
+	TfwHttpReq *req = resp->req;
+	TfwH2Ctx *ctx = tfw_h2_context(req->conn);
+	u64 t0;
+	int r;
+
+	/*
+	 * Get ID of corresponding stream to prepare/send HTTP/2 response, and
+	 * unlink request from the stream.
+	 */
+	stream_id = tfw_h2_stream_id_close(req, HTTP2_HEADERS,
+					   HTTP2_F_END_STREAM);
+	if (unlikely(!stream_id))
+		goto out;
 
-	r = tfw_h2_frame_fwd_resp(resp, stream_id, mit->acc_len);
+	t0 = tfw_lat_start();
+	r = tfw_h2_resp_adjust(resp, stream_id);
+	tfw_lat_end(TFW_LAT_ADJUST, t0);
 	if (unlikely(r))
 		goto clean;
 
@@ -4929,10 +6079,15 @@ static void
 tfw_http_req_cache_service(TfwHttpResp *resp)
 {
 	TfwHttpReq *req = resp->req;
+	TfwVhostStat *stat;
 
 	WARN_ON_ONCE(!list_empty(&req->fwd_list));
 	WARN_ON_ONCE(!list_empty(&req->nip_list));
 
+	/* The request may be freed on the response sending. */
+	if ((stat = tfw_http_loc_stat(req)))
+		stat->cache_hits++;
+
 	if (TFW_MSG_H2(req))
 		tfw_h2_resp_fwd(resp);
 	else
@@ -4941,60 +6096,200 @@ tfw_http_req_cache_service(TfwHttpResp *resp)
 	TFW_INC_STAT_BH(clnt.msgs_fromcache);
 }
 
+/* Maximum number of server connections in a batch of requests. */
+#define TFW_HTTP_REQ_BATCH	8
+
 /**
- * Depending on results of processing of a request, either send the request
- * to an appropriate server, or return the cached response. If none of that
- * can be done for any reason, return HTTP 500 or 502 error to the client.
+ * Requests parsed from the same ingress data of a client connection, which
+ * are forwarded to servers together: pipelined requests scheduled to the same
+ * server connection are forwarded under one lock of the forwarding queue and
+ * sent by one send operation.
+ *
+ * @on		- requests are collected to the batch;
+ * @n		- number of server connections in the batch;
+ * @conn	- server connections the requests are scheduled to;
+ * @reqq	- requests to forward through each of the connections;
  */
+typedef struct {
+	bool			on;
+	unsigned int		n;
+	TfwSrvConn		*conn[TFW_HTTP_REQ_BATCH];
+	struct list_head	reqq[TFW_HTTP_REQ_BATCH];
+} TfwHttpReqBatch;
+
+static DEFINE_PER_CPU(TfwHttpReqBatch, tfw_req_batch);
+
 static void
-tfw_http_req_cache_cb(TfwHttpMsg *msg)
+tfw_http_req_batch_flush(TfwHttpReqBatch *b)
 {
-	int r;
-	TfwHttpReq *req = (TfwHttpReq *)msg;
-	TfwSrvConn *srv_conn = NULL;
+	unsigned int i;
 	LIST_HEAD(eq);
 
-	T_DBG2("%s: req = %p, resp = %p\n", __func__, req, req->resp);
-
-	if (req->resp) {
-		tfw_http_req_cache_service(req->resp);
-		return;
+	for (i = 0; i < b->n; ++i) {
+		tfw_http_req_fwd_resched(b->conn[i], &b->reqq[i], &eq);
+		/* Paired with tfw_http_get_srv_conn() on adding to the batch. */
+		tfw_srv_conn_put(b->conn[i]);
 	}
+	b->n = 0;
+	tfw_http_req_zap_error(&eq);
+}
 
-	/*
-	 * Dispatch request to an appropriate server. Schedulers should
-	 * make a decision based on an unmodified request, so this must
-	 * be done before any request mangling.
-	 *
-	 * The code below is usually called on a remote NUMA node. That's
-	 * not good, but TDB lookup must be run on the node before it is
-	 * executed, to avoid unnecessary work in SoftIRQ and to speed up
-	 * the cache operation. At the same time, cache hits are expected
-	 * to prevail over cache misses, so this is not a frequent path.
-	 */
-	if (!(srv_conn = tfw_http_get_srv_conn((TfwMsg *)req))) {
-		T_DBG("Unable to find a backend server\n");
-		goto send_502;
-	}
+/**
+ * Start collecting requests for forwarding, called in SoftIRQ only.
+ */
+static inline void
+tfw_http_req_batch_start(void)
+{
+	this_cpu_ptr(&tfw_req_batch)->on = true;
+}
 
-	r = TFW_MSG_H2(req)
-		? tfw_h2_adjust_req(req)
-		: tfw_h1_adjust_req(req);
-	if (r)
-		goto send_500;
+/**
+ * Forward all the collected requests and stop collecting them.
+ */
+static void
+tfw_http_req_batch_stop(void)
+{
+	TfwHttpReqBatch *b = this_cpu_ptr(&tfw_req_batch);
 
-	/* Account current request in APM health monitoring statistics */
+	b->on = false;
+	tfw_http_req_batch_flush(b);
+}
+
+/**
+ * Add request @req scheduled to server connection @srv_conn to the batch.
+ * The batch takes the reference to @srv_conn. Returns false if requests
+ * aren't collected at the moment.
+ */
+static bool
+tfw_http_req_batch_add(TfwSrvConn *srv_conn, TfwHttpReq *req)
+{
+	unsigned int i;
+	TfwHttpReqBatch *b = this_cpu_ptr(&tfw_req_batch);
+
+	if (!b->on)
+		return false;
+
+	for (i = 0; i < b->n; ++i) {
+		if (b->conn[i] == srv_conn) {
+			list_add_tail(&req->fwd_list, &b->reqq[i]);
+			/* The batch already holds the connection. */
+			tfw_srv_conn_put(srv_conn);
+			return true;
+		}
+	}
+	if (unlikely(b->n == TFW_HTTP_REQ_BATCH))
+		tfw_http_req_batch_flush(b);
+
+	b->conn[b->n] = srv_conn;
+	INIT_LIST_HEAD(&b->reqq[b->n]);
+	list_add_tail(&req->fwd_list, &b->reqq[b->n]);
+	b->n++;
+
+	return true;
+}
+
+/*
+ * Account @req in the adaptive concurrency limit of the group of @srv the
+ * request is scheduled to. Health monitor requests aren't limited. Return
+ * -EBUSY if the request must be rejected.
+ */
+static int
+tfw_http_req_climit(TfwHttpReq *req, TfwServer *srv)
+{
+	TfwSrvGroup *sg = srv->sg;
+
+	if (likely(!tfw_sg_climit_enabled(sg)) || !req->conn)
+		return 0;
+	if (!tfw_sg_climit_get(sg))
+		return -EBUSY;
+	tfw_sg_get(sg);
+	req->climit_sg = sg;
+
+	return 0;
+}
+
+/**
+ * Depending on results of processing of a request, either send the request
+ * to an appropriate server, or return the cached response. If none of that
+ * can be done for any reason, return HTTP 500 or 502 error to the client.
+ */
+static void
+tfw_http_req_cache_cb(TfwHttpMsg *msg)
+{
+	int r;
+	TfwHttpReq *req = (TfwHttpReq *)msg;
+	TfwSrvConn *srv_conn = NULL;
+	LIST_HEAD(reqq);
+	LIST_HEAD(eq);
+	u64 t0;
+
+	T_DBG2("%s: req = %p, resp = %p\n", __func__, req, req->resp);
+
+	if (req->resp) {
+		tfw_http_req_cache_service(req->resp);
+		return;
+	}
+	t0 = tfw_lat_start();
+
+	/*
+	 * Dispatch request to an appropriate server. Schedulers should
+	 * make a decision based on an unmodified request, so this must
+	 * be done before any request mangling.
+	 *
+	 * The code below is usually called on a remote NUMA node. That's
+	 * not good, but TDB lookup must be run on the node before it is
+	 * executed, to avoid unnecessary work in SoftIRQ and to speed up
+	 * the cache operation. At the same time, cache hits are expected
+	 * to prevail over cache misses, so this is not a frequent path.
+	 */
+	if (!(srv_conn = tfw_http_get_srv_conn((TfwMsg *)req))) {
+		T_DBG("Unable to find a backend server\n");
+		goto send_502;
+	}
+	if (tfw_http_req_climit(req, (TfwServer *)srv_conn->peer))
+		goto send_503;
+
+	r = TFW_MSG_H2(req)
+		? tfw_h2_adjust_req(req)
+		: tfw_h1_adjust_req(req);
+	if (r)
+		goto send_500;
+
+	/* Account current request in APM health monitoring statistics */
 	tfw_http_hm_srv_update((TfwServer *)srv_conn->peer, req);
 
+	/*
+	 * The next body parts of streamed request are forwarded through the
+	 * same connection, so the request keeps the reference till it's freed.
+	 */
+	if (test_bit(TFW_HTTP_B_REQ_STREAM, req->flags)) {
+		tfw_connection_get((TfwConn *)srv_conn);
+		req->srv_conn = srv_conn;
+		/* Don't let the preceding requests fall behind. */
+		if (this_cpu_ptr(&tfw_req_batch)->on)
+			tfw_http_req_batch_flush(this_cpu_ptr(&tfw_req_batch));
+	}
+	/* Forward the request with the next pipelined requests. */
+	else if (tfw_http_req_batch_add(srv_conn, req)) {
+		tfw_lat_end(TFW_LAT_FWD, t0);
+		return;
+	}
+
 	/* Forward request to the server. */
-	tfw_http_req_fwd_resched(srv_conn, req, &eq);
+	list_add_tail(&req->fwd_list, &reqq);
+	tfw_http_req_fwd_resched(srv_conn, &reqq, &eq);
 	tfw_http_req_zap_error(&eq);
+	tfw_lat_end(TFW_LAT_FWD, t0);
 	goto conn_put;
 
 send_502:
 	tfw_http_send_resp(req, 502, "request dropped: processing error");
 	TFW_INC_STAT_BH(clnt.msgs_otherr);
 	return;
+send_503:
+	tfw_http_send_resp(req, 503, "request dropped: server group overloaded");
+	TFW_INC_STAT_BH(clnt.msgs_otherr);
+	goto conn_put;
 send_500:
 	tfw_http_send_resp(req, 500, "request dropped: processing error");
 	TFW_INC_STAT_BH(clnt.msgs_otherr);
@@ -5006,6 +6301,18 @@ conn_put:
 	tfw_srv_conn_put(srv_conn);
 }
 
+static int
+tfw_http_req_cache_process(TfwHttpReq *req)
+{
+	u64 t0 = tfw_lat_start();
+	int r;
+
+	r = tfw_cache_process((TfwHttpMsg *)req, tfw_http_req_cache_cb);
+	tfw_lat_end(TFW_LAT_CACHE, t0);
+
+	return r;
+}
+
 static void
 tfw_http_req_mark_nip(TfwHttpReq *req)
 {
@@ -5020,6 +6327,12 @@ tfw_http_req_mark_nip(TfwHttpReq *req)
 	BUILD_BUG_ON(sizeof(safe_methods) * BITS_PER_BYTE
 		     < _TFW_HTTP_METH_COUNT);
 
+	/* Streamed request can't be re-sent, hold forwarding after it. */
+	if (test_bit(TFW_HTTP_B_REQ_STREAM, req->flags))
+		goto nip_match;
+	/* Nothing can follow a protocol switch in the server connection. */
+	if (test_bit(TFW_HTTP_B_CONN_UPGRADE, req->flags))
+		goto nip_match;
 	if (!req->vhost)
 		return;
 	/*
@@ -5061,7 +6374,8 @@ nip_match:
  * Set the flag if @req is non-idempotent. Add the request to the list
  * of the client connection to preserve the correct order of responses.
  * If the request follows a non-idempotent request in flight, then the
- * preceding request becomes idempotent.
+ * preceding request becomes idempotent, unless its body is streamed or
+ * it's a protocol upgrade request.
  */
 static void
 tfw_http_req_add_seq_queue(TfwHttpReq *req)
@@ -5075,8 +6389,12 @@ tfw_http_req_add_seq_queue(TfwHttpReq *req)
 	spin_lock(&cli_conn->seq_qlock);
 	req_prev = list_empty(seq_queue) ?
 		   NULL : list_last_entry(seq_queue, TfwHttpReq, msg.seq_list);
-	if (req_prev && tfw_http_req_is_nip(req_prev))
+	if (req_prev && tfw_http_req_is_nip(req_prev)
+	    && !test_bit(TFW_HTTP_B_REQ_STREAM, req_prev->flags)
+	    && !test_bit(TFW_HTTP_B_CONN_UPGRADE, req_prev->flags))
+	{
 		clear_bit(TFW_HTTP_B_NON_IDEMP, req_prev->flags);
+	}
 	list_add_tail(&req->msg.seq_list, seq_queue);
 	spin_unlock(&cli_conn->seq_qlock);
 }
@@ -5106,12 +6424,24 @@ tfw_http_check_wildcard_status(const char c, int *out)
 	return true;
 }
 
+/*
+ * HTTP/2 stream of a server may be closed before the response is freed,
+ * so the response must not refer the stream after the unlinking.
+ */
+static inline void
+tfw_http_resp_unlink_stream(TfwHttpMsg *hmresp)
+{
+	tfw_stream_unlink_msg(hmresp->stream);
+	if (hmresp->stream != &hmresp->conn->stream)
+		hmresp->stream = NULL;
+}
+
 static inline void
 tfw_http_hm_drop_resp(TfwHttpResp *resp)
 {
 	TfwHttpReq *req = resp->req;
 
-	tfw_stream_unlink_msg(resp->stream);
+	tfw_http_resp_unlink_stream((TfwHttpMsg *)resp);
 	tfw_http_conn_msg_free((TfwHttpMsg *)resp);
 	tfw_http_msg_free((TfwHttpMsg *)req);
 }
@@ -5200,6 +6530,18 @@ tfw_h1_req_process(TfwStream *stream, struct sk_buff *skb)
 		__set_bit(TFW_HTTP_B_CONN_CLOSE, req->flags);
 	}
 
+	/*
+	 * Streamed request is forwarded while its body is still being
+	 * received, so only the order of responses can be set up now. The
+	 * rest is done when the request is received in full.
+	 */
+	if (test_bit(TFW_HTTP_B_REQ_STREAM, req->flags)
+	    && !tfw_http_parse_is_done((TfwHttpMsg *)req))
+	{
+		tfw_http_req_add_seq_queue(req);
+		return NULL;
+	}
+
 	/*
 	 * The request has been successfully parsed and processed.
 	 * If the connection will be closed after the response to
@@ -5255,11 +6597,162 @@ tfw_h1_req_process(TfwStream *stream, struct sk_buff *skb)
 	 * Add the request to the list of the client connection
 	 * to preserve the correct order of responses to requests.
 	 */
-	tfw_http_req_add_seq_queue(req);
+	if (!test_bit(TFW_HTTP_B_REQ_STREAM, req->flags))
+		tfw_http_req_add_seq_queue(req);
 
 	return hmsib;
 }
 
+/*
+ * Request streaming.
+ *
+ * A request with a body of request_stream_threshold bytes or longer isn't
+ * assembled in full before forwarding: once the request headers are parsed,
+ * the request is processed and forwarded to a server with the part of the
+ * body received so far, and the next body parts are forwarded as soon as
+ * they're parsed and passed Frang checks. Only requests which can't be served
+ * from the cache are streamed. A streamed request is non-idempotent and is
+ * never re-sent: if the server connection fails, the client receives an
+ * error response and the client connection is closed, since the rest of the
+ * request body can't be forwarded anywhere.
+ *
+ * A body part is forwarded only if the server socket has free write buffer
+ * space, otherwise the data waits in the request for the next body part.
+ * The headers of a request waiting behind a non-idempotent request in the
+ * server connection are sent with all the body received till that time.
+ *
+ * Both the client connection and the server side hold a streamed request,
+ * see tfw_http_conn_msg_free(): the client connection till the whole body
+ * is received and the server side till the response is forwarded.
+ */
+
+static bool
+tfw_http_req_stream_need(TfwHttpReq *req)
+{
+	return tfw_req_stream_thr
+	       && !TFW_MSG_H2(req)
+	       && test_bit(TFW_HTTP_B_HEADERS_PARSED, req->flags)
+	       && !test_bit(TFW_HTTP_B_CHUNKED, req->flags)
+	       && req->content_length >= tfw_req_stream_thr
+	       && req->method != TFW_HTTP_METH_PURGE
+	       && !req->method_override
+	       && !test_bit(TFW_HTTP_B_CONN_UPGRADE, req->flags)
+	       && !tfw_cache_msg_cacheable(req);
+}
+
+/**
+ * Forward body part @skb of streamed request @req to the server, the whole
+ * rest of the body is forwarded if it's the @last part.
+ */
+static void
+tfw_http_req_stream_fwd(TfwHttpReq *req, struct sk_buff *skb, bool last)
+{
+	int r = 0;
+	struct sock *sk;
+	TfwSrvConn *srv_conn = req->srv_conn;
+
+	/* The request is answered by Tempesta FW itself. */
+	if (!srv_conn) {
+		__kfree_skb(skb);
+		return;
+	}
+
+	spin_lock_bh(&srv_conn->fwd_qlock);
+	if (list_empty(&req->fwd_list)) {
+		/* The server side is done with the request. */
+		tfw_http_fwdq_unlock(srv_conn);
+		__kfree_skb(skb);
+		return;
+	}
+	if (tfw_srv_conn_h2(srv_conn) ? !req->sid
+	    : srv_conn->msg_sent != (TfwMsg *)req)
+	{
+		/* The part is forwarded with the request headers. */
+		ss_skb_queue_tail(&req->msg.skb_head, skb);
+	}
+	else if (tfw_srv_conn_h2(srv_conn)) {
+		r = tfw_h2_srv_req_body(srv_conn, req, skb, last);
+	}
+	else {
+		ss_skb_queue_tail(&req->stream_skb, skb);
+		sk = srv_conn->sk;
+		if (unlikely(!sk))
+			ss_skb_queue_purge(&req->stream_skb);
+		else if (last
+			 || READ_ONCE(sk->sk_wmem_queued)
+			    < READ_ONCE(sk->sk_sndbuf))
+			r = ss_send(sk, &req->stream_skb, 0);
+	}
+	if (last)
+		set_bit(TFW_HTTP_B_REQ_STREAM_DONE, req->flags);
+	tfw_http_fwdq_unlock(srv_conn);
+
+	if (unlikely(r)) {
+		T_DBG("%s: cannot forward request body, r=%d\n", __func__, r);
+		tfw_connection_close((TfwConn *)srv_conn, false);
+	}
+}
+
+/**
+ * The body of streamed request @req can't be received on an error in body
+ * part @skb. A part of the request may be forwarded already, so no error
+ * response is sent and the client connection is closed: the caller must
+ * return TFW_BLOCK.
+ */
+static int
+tfw_http_req_stream_abort(TfwHttpReq *req, struct sk_buff *skb,
+			  const char *msg)
+{
+	if (!(tfw_blk_flags & TFW_BLK_ATT_NOLOG))
+		T_WARN_ADDR(msg, &req->conn->peer->addr, TFW_WITH_PORT);
+	__kfree_skb(skb);
+
+	return TFW_BLOCK;
+}
+
+/**
+ * The client connection receiving streamed request @req is closed. If the
+ * server has received only a part of the request, then the server connection
+ * is closed as well, the request is evicted on the connection repair.
+ */
+static void
+tfw_http_req_stream_drop(TfwHttpReq *req)
+{
+	bool partial;
+	TfwSrvConn *srv_conn = req->srv_conn;
+
+	if (!srv_conn)
+		return;
+
+	spin_lock_bh(&srv_conn->fwd_qlock);
+	partial = !list_empty(&req->fwd_list)
+		  && !test_bit(TFW_HTTP_B_REQ_STREAM_DONE, req->flags);
+	tfw_http_fwdq_unlock(srv_conn);
+
+	if (partial)
+		tfw_connection_close((TfwConn *)srv_conn, false);
+}
+
+/**
+ * Streamed request @req is received in full: run the final Frang checks for
+ * the request and forward the rest of the body.
+ */
+static int
+tfw_http_req_stream_end(TfwConn *conn, TfwHttpReq *req, TfwFsmData *data)
+{
+	int r = tfw_gfsm_move(&conn->state, TFW_HTTP_FSM_REQ_MSG, data);
+
+	T_DBG3("TFW_HTTP_FSM_REQ_MSG return code %d\n", r);
+	if (r == TFW_BLOCK) {
+		TFW_INC_STAT_BH(clnt.msgs_filtout);
+		return tfw_http_req_stream_abort(req, data->skb,
+			"streamed request has been filtered out");
+	}
+	tfw_http_req_stream_fwd(req, data->skb, true);
+
+	return TFW_PASS;
+}
+
 /**
  * @return zero on success and negative value otherwise.
  * TODO enter the function depending on current GFSM state.
@@ -5275,6 +6768,7 @@ tfw_http_req_process(TfwConn *conn, TfwStream *stream, const TfwFsmData *data)
 	TfwHttpMsg *hmsib;
 	TfwFsmData data_up;
 	int r = TFW_BLOCK;
+	u64 t0;
 
 	BUG_ON(!stream->msg);
 
@@ -5292,7 +6786,9 @@ next_msg:
 	req = (TfwHttpReq *)stream->msg;
 	actor = TFW_MSG_H2(req) ? tfw_h2_parse_req : tfw_http_parse_req;
 
+	t0 = tfw_lat_start();
 	r = ss_skb_process(skb, actor, req, &req->chunk_cnt, &parsed);
+	tfw_lat_end(TFW_LAT_PARSE, t0);
 	req->msg.len += parsed;
 	TFW_ADD_STAT_BH(parsed, clnt.rx_bytes);
 
@@ -5316,6 +6812,9 @@ next_msg:
 	case TFW_BLOCK:
 		T_DBG2("Block invalid HTTP request\n");
 		TFW_INC_STAT_BH(clnt.msgs_parserr);
+		if (test_bit(TFW_HTTP_B_REQ_STREAM, req->flags))
+			return tfw_http_req_stream_abort(req, skb,
+				"failed to parse request");
 		tfw_http_req_parse_drop(req, 400, "failed to parse request");
 		return TFW_BLOCK;
 	case TFW_POSTPONE:
@@ -5325,34 +6824,59 @@ next_msg:
 			 * all available data, but that weren't enough.
 			 */
 			TFW_INC_STAT_BH(clnt.msgs_otherr);
+			if (test_bit(TFW_HTTP_B_REQ_STREAM, req->flags))
+				return tfw_http_req_stream_abort(req, skb,
+					"Request parsing inconsistency");
 			tfw_http_req_parse_block(req, 500,
 				"Request parsing inconsistency");
 			return TFW_BLOCK;
 		}
 		if (TFW_MSG_H2(req)) {
 			TfwH2Ctx *ctx;
+			bool hdrs = test_bit(TFW_HTTP_B_HEADERS_PARSED,
+					     req->flags);
 
 			if (tfw_h2_stream_req_complete(req->stream)) {
-				if (likely(!tfw_h2_parse_req_finish(req)))
+				if (likely(!tfw_h2_parse_req_finish(req))) {
+					if (!hdrs)
+						tfw_h2_req_set_prio(req);
 					break;
+				}
 				TFW_INC_STAT_BH(clnt.msgs_otherr);
 				tfw_http_req_parse_block(req, 500,
 					"Request parsing inconsistency");
 				return TFW_BLOCK;
 			}
 			ctx = tfw_h2_context(conn);
-			if (ctx->hdr.flags & HTTP2_F_END_HEADERS)
-				__set_bit(TFW_HTTP_B_HEADERS_PARSED, req->flags);
+			if ((ctx->hdr.flags & HTTP2_F_END_HEADERS)
+			    && !__test_and_set_bit(TFW_HTTP_B_HEADERS_PARSED,
+						   req->flags))
+				tfw_h2_req_set_prio(req);
 		}
 
 		r = tfw_gfsm_move(&conn->state, TFW_HTTP_FSM_REQ_CHUNK, &data_up);
 		T_DBG3("TFW_HTTP_FSM_REQ_CHUNK return code %d\n", r);
 		if (r == TFW_BLOCK) {
 			TFW_INC_STAT_BH(clnt.msgs_filtout);
+			if (test_bit(TFW_HTTP_B_REQ_STREAM, req->flags))
+				return tfw_http_req_stream_abort(req, skb,
+					"postponed request has been filtered out");
 			tfw_http_req_parse_block(req, 403,
 				"postponed request has been filtered out");
 			return TFW_BLOCK;
 		}
+		if (test_bit(TFW_HTTP_B_REQ_STREAM, req->flags)) {
+			tfw_http_req_stream_fwd(req, skb, false);
+			return TFW_PASS;
+		}
+		/*
+		 * Start forwarding of a large request as soon as its headers
+		 * are parsed, see the request streaming description above.
+		 */
+		if (tfw_http_req_stream_need(req)) {
+			skb = NULL;
+			goto stream_start;
+		}
 		/*
 		 * TFW_POSTPONE status means that parsing succeeded
 		 * but more data is needed to complete it. Lower layers
@@ -5372,6 +6896,7 @@ next_msg:
 		{
 			return TFW_BLOCK;
 		}
+		trace_tfw_http_req_parsed(req);
 	}
 
 	/*
@@ -5386,6 +6911,10 @@ next_msg:
 		skb = ss_skb_split(skb, parsed);
 		if (unlikely(!skb)) {
 			TFW_INC_STAT_BH(clnt.msgs_otherr);
+			if (test_bit(TFW_HTTP_B_REQ_STREAM, req->flags))
+				return tfw_http_req_stream_abort(req,
+					data_up.skb,
+					"Can't split pipelined requests");
 			tfw_http_req_parse_block(req, 500,
 						 "Can't split pipelined requests");
 			return TFW_BLOCK;
@@ -5394,6 +6923,19 @@ next_msg:
 		skb = NULL;
 	}
 
+	if (unlikely(test_bit(TFW_HTTP_B_REQ_STREAM, req->flags))) {
+		if ((r = tfw_http_req_stream_end(conn, req, &data_up))) {
+			if (skb)
+				__kfree_skb(skb);
+			return r;
+		}
+		hmsib = tfw_h1_req_process(stream, skb);
+		/* The client connection is done with the request. */
+		tfw_http_conn_msg_free((TfwHttpMsg *)req);
+		goto next_sib;
+	}
+
+stream_start:
 	if ((r = tfw_http_req_client_link(conn, req)))
 		return r;
 	/*
@@ -5417,7 +6959,17 @@ next_msg:
 	 * rules, such as `mark` rule. Even if http_chains is the
 	 * slowest method we have, we can't simply skip it.
 	 */
+	/*
+	 * Short URI and host split among skbs are copied into single chunks,
+	 * so the matching, hashing and cache lookups take the plain string
+	 * paths. The raw headers can't be copied, they're edited in-place.
+	 */
+	tfw_str_linearize(req->pool, &req->uri_path, TFW_HTTP_STR_LINEAR_MAX);
+	tfw_str_linearize(req->pool, &req->host, TFW_HTTP_STR_LINEAR_MAX);
+
+	t0 = tfw_lat_start();
 	req->vhost = tfw_http_tbl_vhost((TfwMsg *)req, &block);
+	tfw_lat_end(TFW_LAT_TBL, t0);
 	if (unlikely(block)) {
 		TFW_INC_STAT_BH(clnt.msgs_filtout);
 		tfw_http_req_parse_block(req, 403,
@@ -5525,8 +7077,12 @@ next_msg:
 	if (unlikely(req->method_override))
 		req->method = req->method_override;
 
-	if (!TFW_MSG_H2(req))
+	if (!TFW_MSG_H2(req)) {
+		/* The request body is still being received. */
+		if (!tfw_http_parse_is_done((TfwHttpMsg *)req))
+			__set_bit(TFW_HTTP_B_REQ_STREAM, req->flags);
 		hmsib = tfw_h1_req_process(stream, skb);
+	}
 
 	/*
 	 * Response is already prepared for the client by sticky module.
@@ -5553,7 +7109,7 @@ next_msg:
 	 * will be linked to this request. Then our callback will either return
 	 * a cached response, or forward the request to an upstream.
 	 */
-	else if (tfw_cache_process((TfwHttpMsg *)req, tfw_http_req_cache_cb)) {
+	else if (tfw_http_req_cache_process(req)) {
 		/*
 		 * The request should either be stored or released.
 		 * Otherwise we lose the reference to it and get a leak.
@@ -5573,6 +7129,7 @@ next_msg:
 	 * Note: This connection's @conn must not be dereferenced
 	 * from this point on.
 	 */
+next_sib:
 	if (hmsib) {
 		/*
 		 * No sibling messages should appear in processing
@@ -5603,8 +7160,21 @@ static void
 tfw_http_resp_cache_cb(TfwHttpMsg *msg)
 {
 	TfwHttpResp *resp = (TfwHttpResp *)msg;
+	TfwHttpReq *req = resp->req;
+
+	T_DBG2("%s: req = %p, resp = %p\n", __func__, req, resp);
 
-	T_DBG2("%s: req = %p, resp = %p\n", __func__, resp->req, resp);
+	/* Stale response from the cache replaces an upstream error. */
+	if (!resp->conn) {
+		tfw_http_req_cache_service(resp);
+		return;
+	}
+	/* The response is stored in the cache, nobody waits for it. */
+	if (test_bit(TFW_HTTP_B_CACHE_REFRESH, req->flags)) {
+		tfw_http_conn_msg_free((TfwHttpMsg *)resp);
+		tfw_http_msg_free((TfwHttpMsg *)req);
+		return;
+	}
 
 	tfw_http_sess_learn(resp);
 
@@ -5614,6 +7184,43 @@ tfw_http_resp_cache_cb(TfwHttpMsg *msg)
 		tfw_h1_resp_adjust_fwd(resp);
 }
 
+/*
+ * Forward pending requests to the server, or run special processing if
+ * the connection is in repair mode. Called with @fwd_qlock held, which
+ * is released on return.
+ */
+static void
+tfw_http_conn_fwd_pending(TfwSrvConn *srv_conn, struct list_head *eq)
+{
+	int err = 0;
+	LIST_HEAD(reschq);
+
+	tfw_http_conn_fwd_drain(srv_conn);
+	if (unlikely(tfw_srv_conn_restricted(srv_conn)))
+		err = tfw_http_conn_fwd_repair(srv_conn, eq);
+	else if (tfw_http_conn_need_fwd(srv_conn))
+		err = tfw_http_conn_fwd_unsent(srv_conn, eq);
+	if (!err) {
+		tfw_http_fwdq_unlock(srv_conn);
+		return;
+	}
+	/*
+	 * If error occurred during repairing or forwarding procedures
+	 * (-EBUSY and @msg_sent is NULL) the rescheduling is started;
+	 * Since @msg_sent is definitely NULL here, there must not be
+	 * pending sibling responses attached to requests, so it is
+	 * safe to cut all remaining requests from @fwd_queue for
+	 * rescheduling.
+	 */
+	WARN_ON(srv_conn->msg_sent);
+	__tfw_srv_conn_clear_restricted(srv_conn);
+	tfw_srv_set_busy_delay(srv_conn);
+	tfw_http_fwdq_reset(srv_conn, &reschq);
+	tfw_http_fwdq_unlock(srv_conn);
+
+	tfw_http_fwdq_resched(srv_conn, &reschq, eq);
+}
+
 /**
  * Just received response is parsed and processed. The corresponding
  * request is the first one in the connection forwarding
@@ -5629,74 +7236,119 @@ tfw_http_resp_cache_cb(TfwHttpMsg *msg)
  * server. Delist the request to prevent future errors. The server connection
  * is about to be closed and there is no sense in forwarding unsent requests.
  *
- * TODO: When a response is received and a paired request is found,
- * pending (unsent) requests in the connection are forwarded to the
- * server right away. In current design, @fwd_queue is locked until
- * after a request is submitted to SS for sending. It shouldn't be
- * necessary to lock @fwd_queue for that. Please see a similar TODO
- * comment to tfw_http_req_fwd(). Also, please see the issue #687.
+ * When a response is received and a paired request is found, pending
+ * (unsent) requests in the connection, including the requests from
+ * @fwd_inq, are forwarded to the server right away. CPUs forwarding new
+ * requests to the connection meantime don't wait for the lock, see
+ * tfw_http_conn_fwd_inq().
  */
 static void
 tfw_http_popreq(TfwHttpMsg *hmresp, bool fwd_unsent)
 {
-	int err = 0;
 	TfwHttpReq *req = hmresp->req;
 	TfwSrvConn *srv_conn = (TfwSrvConn *)hmresp->conn;
-	LIST_HEAD(reschq);
 	LIST_HEAD(eq);
 
-	spin_lock(&srv_conn->fwd_qlock);
+	spin_lock_bh(&srv_conn->fwd_qlock);
+	/* HTTP/2 responses may come in any order. */
 	if ((TfwMsg *)req == srv_conn->msg_sent)
-		srv_conn->msg_sent = NULL;
+		srv_conn->msg_sent = __tfw_http_conn_msg_sent_prev(srv_conn);
 	tfw_http_req_delist(srv_conn, req);
 	tfw_http_conn_nip_adjust(srv_conn);
+	/*
+	 * The server responded before the whole body of streamed request was
+	 * forwarded, so the server can't tell the rest of the body from the
+	 * next requests in the connection. HTTP/2 streams are independent.
+	 */
+	if (unlikely(tfw_http_req_stream_cut(req))
+	    && !tfw_srv_conn_h2(srv_conn))
+	{
+		tfw_http_fwdq_unlock(srv_conn);
+		tfw_connection_close((TfwConn *)srv_conn, false);
+		return;
+	}
 
 	if (unlikely(!fwd_unsent)) {
-		spin_unlock(&srv_conn->fwd_qlock);
+		tfw_http_fwdq_unlock(srv_conn);
 		return;
 	}
 	/*
-	 * Run special processing if the connection is in repair
-	 * mode. Otherwise, forward pending requests to the server.
-	 *
 	 * @hmresp is holding a reference to the server connection
 	 * while forwarding is done, so there's no need to take an
 	 * additional reference.
 	 */
-	if (unlikely(tfw_srv_conn_restricted(srv_conn)))
-		err = tfw_http_conn_fwd_repair(srv_conn, &eq);
-	else if (tfw_http_conn_need_fwd(srv_conn))
-		err = tfw_http_conn_fwd_unsent(srv_conn, &eq);
-	if (!err) {
-		spin_unlock(&srv_conn->fwd_qlock);
-		goto out;
-	}
-	/*
-	 * If error occurred during repairing or forwarding procedures
-	 * (-EBUSY and @msg_sent is NULL) the rescheduling is started;
-	 * Since @msg_sent is definitely NULL here, there must not be
-	 * pending sibling responses attached to requests, so it is
-	 * safe to cut all remaining requests from @fwd_queue for
-	 * rescheduling.
-	 */
-	WARN_ON(srv_conn->msg_sent);
-	__tfw_srv_conn_clear_restricted(srv_conn);
-	tfw_srv_set_busy_delay(srv_conn);
-	tfw_http_fwdq_reset(srv_conn, &reschq);
-	spin_unlock(&srv_conn->fwd_qlock);
-
-	tfw_http_fwdq_resched(srv_conn, &reschq, &eq);
-out:
+	tfw_http_conn_fwd_pending(srv_conn, &eq);
 	tfw_http_req_zap_error(&eq);
 }
 
-/*
- * Post-process the response. Pass it to modules registered with GFSM
- * for further processing. Finish the request/response exchange properly
- * in case of an error.
+/**
+ * Forward pending requests of HTTP/2 connection @srv_conn, for which the
+ * server allowed new streams.
  */
-static int
-tfw_http_resp_gfsm(TfwHttpMsg *hmresp, TfwFsmData *data)
+void
+tfw_http_conn_fwd_kick(TfwSrvConn *srv_conn)
+{
+	LIST_HEAD(eq);
+
+	spin_lock_bh(&srv_conn->fwd_qlock);
+	tfw_http_conn_fwd_pending(srv_conn, &eq);
+	tfw_http_req_zap_error(&eq);
+}
+
+/**
+ * The server reset HTTP/2 stream @id of connection @srv_conn. The request
+ * is re-sent if the server @refused to process it, RFC 7540 8.1.4.
+ */
+void
+tfw_http_srv_stream_reset(TfwSrvConn *srv_conn, unsigned int id, bool refused)
+{
+	TfwHttpReq *req, *found = NULL;
+	TfwServer *srv = (TfwServer *)srv_conn->peer;
+	LIST_HEAD(eq);
+
+	spin_lock_bh(&srv_conn->fwd_qlock);
+	list_for_each_entry(req, &srv_conn->fwd_queue, fwd_list) {
+		if (req->sid == id) {
+			found = req;
+			break;
+		}
+		if (req == (TfwHttpReq *)srv_conn->msg_sent)
+			break;
+	}
+	if (!found) {
+		tfw_http_fwdq_unlock(srv_conn);
+		return;
+	}
+
+	req = found;
+	req->sid = 0;
+	if ((TfwMsg *)req == srv_conn->msg_sent)
+		srv_conn->msg_sent = __tfw_http_conn_msg_sent_prev(srv_conn);
+	if (refused && !test_bit(TFW_HTTP_B_REQ_STREAM, req->flags)
+	    && req->retries++ < srv->sg->max_refwd)
+	{
+		/* The request is the first one to be sent now. */
+		if (srv_conn->msg_sent)
+			list_move(&req->fwd_list,
+				  &((TfwHttpReq *)srv_conn->msg_sent)->fwd_list);
+		else
+			list_move(&req->fwd_list, &srv_conn->fwd_queue);
+	} else {
+		tfw_http_req_err(srv_conn, req, &eq, 502,
+				 "request dropped: stream reset by server");
+		tfw_http_conn_nip_adjust(srv_conn);
+	}
+	tfw_http_conn_fwd_pending(srv_conn, &eq);
+	tfw_http_req_zap_error(&eq);
+}
+
+/*
+ * Post-process the response. Pass it to modules registered with GFSM
+ * for further processing. Finish the request/response exchange properly
+ * in case of an error.
+ */
+static int
+tfw_http_resp_gfsm(TfwHttpMsg *hmresp, TfwFsmData *data)
 {
 	int r;
 	TfwHttpReq *req = hmresp->req;
@@ -5722,6 +7374,116 @@ error:
 	return r;
 }
 
+/*
+ * Feed APM with the load, which the server reports in percents of its
+ * capacity in the configured response header, e.g. "X-Backend-Load: 73".
+ * Malformed values are ignored. The last header wins if there are several.
+ */
+static void
+tfw_http_apm_load(TfwHttpResp *resp, TfwServer *srv)
+{
+	const TfwStr *name = tfw_apm_load_hdr();
+	TfwStr *hdr, s_nm = {}, s_val = {};
+	unsigned int hid, load;
+	char buf[8];
+
+	if (likely(!name))
+		return;
+	hid = __http_hdr_lookup((TfwHttpMsg *)resp, name);
+	if (hid == resp->h_tbl->off)
+		return;
+	hdr = &resp->h_tbl->tbl[hid];
+	if (TFW_STR_DUP(hdr))
+		hdr = TFW_STR_LAST(hdr);
+
+	tfw_http_hdr_split(hdr, &s_nm, &s_val, true);
+	if (!s_val.len || s_val.len >= sizeof(buf))
+		return;
+	tfw_str_to_cstr(&s_val, buf, sizeof(buf));
+	if (kstrtouint(buf, 10, &load))
+		return;
+
+	tfw_apm_update_load(srv->apmref, load);
+}
+
+/*
+ * Account the server time and the local queueing time of the request, which
+ * the received response @resp is paired with, in APM. The response status
+ * and the server time also feed the passive outlier detection, the adaptive
+ * concurrency limit and the adaptive pipelining depth.
+ */
+static void
+tfw_http_apm_update(TfwHttpResp *resp)
+{
+	TfwHttpReq *req = resp->req;
+	TfwServer *srv = (TfwServer *)resp->conn->peer;
+
+	tfw_apm_update(srv->apmref, resp->jrxtstamp, resp->jsrvtime);
+	tfw_apm_update_qtime(srv->apmref, req->jtxtstamp - req->jrxtstamp);
+	tfw_http_apm_load(resp, srv);
+	tfw_srv_outlier_update(srv, resp->status, resp->jsrvtime);
+	tfw_srv_pipe_update((TfwSrvConn *)resp->conn, req->jtxtstamp,
+			    resp->jsrvtime);
+	if (req->climit_sg) {
+		tfw_sg_climit_put(req->climit_sg, resp->status,
+				  resp->jsrvtime);
+		tfw_sg_put(req->climit_sg);
+		req->climit_sg = NULL;
+	}
+}
+
+/*
+ * Response @resp to a hedged copy of a request is received in full. If the
+ * original request still waits for a response, then the copy takes its place
+ * in the original server connection, so the response to the original request
+ * is discarded when it comes, and @resp is paired with the original request.
+ * Error responses don't win since the original request may still succeed.
+ * Return false if @resp is discarded.
+ */
+static bool
+tfw_http_hedge_resp(TfwHttpResp *resp)
+{
+	TfwHttpReq *req, *hreq = resp->req;
+	TfwSrvConn *srv_conn = hreq->hedge_conn;
+	bool found = false;
+
+	if (!hreq->hedge || resp->status >= 500)
+		goto drop;
+
+	/*
+	 * The original request may be freed already, so it's just looked up
+	 * by the address and checked to be hedged by @hreq.
+	 */
+	spin_lock_bh(&srv_conn->fwd_qlock);
+	list_for_each_entry(req, &srv_conn->fwd_queue, fwd_list) {
+		if (req == hreq->hedge) {
+			found = req->hedge == hreq && !req->pair;
+			break;
+		}
+		if ((TfwMsg *)req == srv_conn->msg_sent)
+			break;
+	}
+	if (!found) {
+		tfw_http_fwdq_unlock(srv_conn);
+		goto drop;
+	}
+	list_replace_init(&req->fwd_list, &hreq->fwd_list);
+	if (srv_conn->msg_sent == (TfwMsg *)req)
+		srv_conn->msg_sent = (TfwMsg *)hreq;
+	hreq->jtxtstamp = req->jtxtstamp;
+	hreq->hedge = NULL;
+	tfw_http_fwdq_unlock(srv_conn);
+
+	hreq->resp = NULL;
+	resp->req = NULL;
+	tfw_http_msg_pair(resp, req);
+
+	return true;
+drop:
+	tfw_http_hm_drop_resp(resp);
+	return false;
+}
+
 /*
  * Set up the response @hmresp with data needed down the road,
  * get the paired request, and then pass the response to cache
@@ -5749,19 +7511,31 @@ tfw_http_resp_cache(TfwHttpMsg *hmresp)
 		((TfwHttpResp *)hmresp)->date = timestamp;
 	/*
 	 * Response is fully received, delist corresponding request from
-	 * fwd_queue.
+	 * fwd_queue. Nothing is forwarded into a tunnel.
 	 */
-	tfw_http_popreq(hmresp, true);
+	tfw_http_popreq(hmresp, !((TfwSrvConn *)hmresp->conn)->tunnel);
+	/*
+	 * APM holds the pure server time from the time a request is passed
+	 * to TCP to the time the first byte of the response is received, so
+	 * our own queueing and the response transfer time don't penalize the
+	 * server. The time the request spent in Tempesta is accounted
+	 * separately.
+	 *
+	 * TODO: Perhaps it makes sense to penalize server connections which
+	 * get broken too often. What would be a fast and simple algorithm
+	 * for that? Keep in mind, that the value of RTT has an upper boundary
+	 * in the APM.
+	 */
+	tfw_http_apm_update(resp);
 	/*
-	 * TODO: Currently APM holds the pure roundtrip time (RTT) from
-	 * the time a request is forwarded to the time a response to it
-	 * is received and parsed. Perhaps it makes sense to penalize
-	 * server connections which get broken too often. What would be
-	 * a fast and simple algorithm for that? Keep in mind, that the
-	 * value of RTT has an upper boundary in the APM.
+	 * The response to a hedged copy replaces the response to the original
+	 * request if it's the first one, or it's discarded.
 	 */
-	tfw_apm_update(((TfwServer *)resp->conn->peer)->apmref,
-		       resp->jrxtstamp, resp->jrxtstamp - req->jtxtstamp);
+	if (test_bit(TFW_HTTP_B_HEDGE, req->flags)) {
+		if (!tfw_http_hedge_resp(resp))
+			return;
+		req = hmresp->req;
+	}
 	/*
 	 * Health monitor request means that its response need not to
 	 * send anywhere.
@@ -5790,7 +7564,7 @@ tfw_http_resp_cache(TfwHttpMsg *hmresp)
 	 * further handling of @conn depends on that. Future SKBs
 	 * will be put in a new message.
 	 */
-	tfw_stream_unlink_msg(hmresp->stream);
+	tfw_http_resp_unlink_stream(hmresp);
 	if (tfw_cache_process(hmresp, tfw_http_resp_cache_cb))
 	{
 		tfw_http_conn_msg_free(hmresp);
@@ -5801,6 +7575,317 @@ tfw_http_resp_cache(TfwHttpMsg *hmresp)
 	}
 }
 
+/*
+ * Response streaming.
+ *
+ * A response with a body of response_stream_threshold bytes or longer isn't
+ * assembled in full before forwarding: once the response headers are parsed,
+ * the response is adjusted and forwarded to the client with the part of the
+ * body received so far, and the next body parts are forwarded as soon as
+ * they're parsed. Streamed responses aren't cached, also an upstream failure
+ * can't be hidden from the client by sending the request to other server:
+ * the client connection (HTTP/1) or the stream (HTTP/2) is reset instead.
+ *
+ * A body part is forwarded only if the client socket has free write buffer
+ * space and, for HTTP/2, the connection flow control window allows the data.
+ * Otherwise the data waits in the response for the next body part, so slow
+ * clients are served just like without streaming, but fast clients receive
+ * the data with minimal delay and memory consumption. With client_notsent_lowat
+ * reading from HTTP/1 server connection is also paused while the client is
+ * behind, so slow clients don't make us buffer the whole response either.
+ */
+
+static bool
+tfw_http_resp_stream_need(TfwHttpMsg *hmresp)
+{
+	TfwHttpReq *req = hmresp->req;
+
+	if (!tfw_resp_stream_thr
+	    || !test_bit(TFW_HTTP_B_HEADERS_PARSED, hmresp->flags)
+	    || test_bit(TFW_HTTP_B_CHUNKED, hmresp->flags)
+	    || test_bit(TFW_HTTP_B_UNLIMITED, hmresp->flags)
+	    || hmresp->content_length < tfw_resp_stream_thr)
+		return false;
+
+	/* Tempesta FW itself needs full bodies of these responses. */
+	return !(test_bit(TFW_HTTP_B_HMONITOR, req->flags)
+		 || test_bit(TFW_HTTP_B_CACHE_REFRESH, req->flags)
+		 || test_bit(TFW_HTTP_B_HEDGE, req->flags)
+		 || test_bit(TFW_HTTP_B_PURGE_GET, req->flags)
+		 || test_bit(TFW_HTTP_B_REQ_DROP, req->flags));
+}
+
+static unsigned long
+tfw_http_resp_stream_len(TfwHttpResp *resp)
+{
+	unsigned long len = 0;
+	struct sk_buff *skb = resp->msg.skb_head;
+
+	if (!skb)
+		return 0;
+	do {
+		len += skb->len;
+		skb = skb->next;
+	} while (skb != resp->msg.skb_head);
+
+	return len;
+}
+
+/**
+ * Check that the client can accept more data of streamed response @resp,
+ * i.e. the previous data is sent already. The whole rest of the response is
+ * sent with @last set.
+ */
+static bool
+tfw_http_resp_stream_room(TfwHttpResp *resp, bool last)
+{
+	TfwConn *conn = resp->req->conn;
+	struct sock *sk = READ_ONCE(conn->sk);
+
+	if (!last
+	    && (!sk
+		|| READ_ONCE(sk->sk_wmem_queued) >= READ_ONCE(sk->sk_sndbuf)))
+	{
+		return false;
+	}
+
+	return !TFW_MSG_H2(resp->req) || last
+		|| !tfw_h2_stream_xmit_pending(tfw_h2_context(conn),
+					       resp->stream_id);
+}
+
+/*
+ * Send the received part of streamed response @resp to HTTP/1 client if all
+ * the previous responses are sent already. The same locking as in
+ * tfw_http_resp_fwd() keeps the responses order.
+ */
+static void
+tfw_h1_resp_stream_xmit(TfwHttpResp *resp)
+{
+	int r;
+	TfwHttpReq *req = resp->req;
+	TfwCliConn *cli_conn = (TfwCliConn *)req->conn;
+
+	spin_lock_bh(&cli_conn->seq_qlock);
+	if (cli_conn->seq_queue.next != &req->msg.seq_list) {
+		spin_unlock_bh(&cli_conn->seq_qlock);
+		return;
+	}
+	tfw_connection_get((TfwConn *)cli_conn);
+	spin_lock_bh(&cli_conn->ret_qlock);
+	spin_unlock_bh(&cli_conn->seq_qlock);
+
+	r = tfw_cli_conn_send(cli_conn, (TfwMsg *)resp);
+
+	spin_unlock_bh(&cli_conn->ret_qlock);
+	if (r)
+		tfw_connection_close((TfwConn *)cli_conn, true);
+	tfw_connection_put((TfwConn *)cli_conn);
+}
+
+/*
+ * Send the received part of streamed response @resp to HTTP/2 client, @len
+ * bytes of the body are framed into DATA frames. The stream is reset if the
+ * data can't be sent.
+ */
+static void
+tfw_h2_resp_stream_xmit(TfwHttpResp *resp, unsigned long len, bool last)
+{
+	TfwConn *conn = resp->req->conn;
+
+	if (len && tfw_h2_frame_stream_data(resp, len, last)) {
+		ss_skb_queue_purge(&resp->msg.skb_head);
+		tfw_h2_send_rst_stream(tfw_h2_context(conn), resp->stream_id,
+				       HTTP2_ECODE_INTERNAL);
+		resp->stream_id = 0;
+		TFW_INC_STAT_BH(serv.msgs_otherr);
+		return;
+	}
+
+	tfw_connection_get(conn);
+	if (tfw_h2_stream_xmit(tfw_h2_context(conn), (TfwMsg *)resp)) {
+		T_DBG("%s: cannot send data to client via HTTP/2\n", __func__);
+		tfw_connection_close(conn, true);
+		resp->stream_id = 0;
+	}
+	tfw_connection_put(conn);
+}
+
+/**
+ * Forward the received part of streamed response @resp if the client can
+ * accept it, or unconditionally if it's the @last part of HTTP/2 response.
+ * The last part of HTTP/1 response goes through tfw_http_resp_fwd().
+ */
+static void
+tfw_http_resp_stream_fwd(TfwHttpResp *resp, bool last)
+{
+	unsigned long len;
+	TfwHttpReq *req = resp->req;
+
+	if (TFW_MSG_H2(req) ? !resp->stream_id
+			    : test_bit(TFW_HTTP_B_REQ_DROP, req->flags))
+	{
+		/* The client has gone, nobody needs the data. */
+		ss_skb_queue_purge(&resp->msg.skb_head);
+		return;
+	}
+	if ((len = tfw_http_resp_stream_len(resp))
+	    && tfw_http_resp_stream_room(resp, last))
+	{
+		if (TFW_MSG_H2(req))
+			tfw_h2_resp_stream_xmit(resp, len, last);
+		else
+			tfw_h1_resp_stream_xmit(resp);
+	}
+
+	/*
+	 * Don't receive more data than the client can take. HTTP/2 server
+	 * connections serve many clients, so they aren't paused.
+	 */
+	if (!last && !tfw_srv_conn_h2((TfwSrvConn *)resp->conn))
+		tfw_cli_conn_rx_throttle((TfwCliConn *)req->conn,
+					 (TfwSrvConn *)resp->conn);
+}
+
+/**
+ * Start streaming of response @hmresp which headers are just parsed: pass the
+ * response to GFSM, adjust the headers and forward them with the part of the
+ * body received so far.
+ *
+ * @return TFW_BLOCK if the response is dropped and the server connection must
+ * be closed, TFW_PASS otherwise.
+ */
+static int
+tfw_http_resp_stream_start(TfwHttpMsg *hmresp, TfwFsmData *data)
+{
+	TfwHttpResp *resp = (TfwHttpResp *)hmresp;
+	TfwHttpReq *req = hmresp->req;
+	TfwFsmData data_fwd = {
+		.req	= (TfwMsg *)req,
+		.resp	= (TfwMsg *)hmresp,
+	};
+	TfwH2Ctx *ctx;
+	unsigned int stream_id = 0;
+
+	/* The response is freed on errors, so nothing to stream further. */
+	if (tfw_http_resp_gfsm(hmresp, data) != TFW_PASS)
+		return TFW_BLOCK;
+	if (tfw_gfsm_move(&hmresp->conn->state, TFW_HTTP_FSM_RESP_MSG_FWD,
+			  &data_fwd))
+	{
+		tfw_http_popreq(hmresp, false);
+		/* The response is freed by tfw_http_req_block(). */
+		tfw_http_req_block(req, 403, "response blocked: filtered out");
+		TFW_INC_STAT_BH(serv.msgs_filtout);
+		return TFW_BLOCK;
+	}
+
+	T_DBG2("%s: stream resp=[%p] content_length=%lu\n",
+	       __func__, resp, hmresp->content_length);
+
+	__set_bit(TFW_HTTP_B_RESP_STREAM, hmresp->flags);
+	tfw_cache_fetch_bypass(req);
+	tfw_http_sess_learn(resp);
+
+	if (!TFW_MSG_H2(req)) {
+		if (tfw_http_adjust_resp(resp))
+			goto err;
+		tfw_h1_resp_stream_xmit(resp);
+		return TFW_PASS;
+	}
+
+	ctx = tfw_h2_context(req->conn);
+	stream_id = tfw_h2_stream_id_close(req, HTTP2_HEADERS,
+					   HTTP2_F_END_STREAM);
+	if (unlikely(!stream_id)) {
+		/* The stream is closed by the client, drop the data. */
+		ss_skb_queue_purge(&hmresp->msg.skb_head);
+		return TFW_PASS;
+	}
+	resp->stream_id = stream_id;
+	if (tfw_h2_resp_adjust(resp, stream_id)) {
+		tfw_hpack_enc_release(&ctx->hpack, resp->flags);
+		goto err;
+	}
+	tfw_h2_resp_stream_xmit(resp, 0, false);
+	tfw_hpack_enc_release(&ctx->hpack, resp->flags);
+
+	return TFW_PASS;
+err:
+	tfw_http_popreq(hmresp, false);
+	tfw_http_conn_msg_free(hmresp);
+	if (TFW_MSG_H2(req))
+		tfw_h2_send_resp(req, 500, stream_id);
+	else
+		tfw_http_send_resp(req, 500, "response dropped:"
+				   " processing error");
+	TFW_INC_STAT_BH(serv.msgs_otherr);
+
+	return TFW_BLOCK;
+}
+
+/**
+ * Streamed response @hmresp is received in full: forward the rest of the
+ * body and finish the request/response exchange like tfw_http_resp_cache()
+ * does for assembled responses.
+ */
+static void
+tfw_http_resp_stream_end(TfwHttpMsg *hmresp)
+{
+	TfwHttpResp *resp = (TfwHttpResp *)hmresp;
+	TfwHttpReq *req = hmresp->req;
+
+	resp->jrxtstamp = jiffies;
+	tfw_http_popreq(hmresp, true);
+	tfw_http_apm_update(resp);
+	tfw_http_resp_unlink_stream(hmresp);
+
+	if (TFW_MSG_H2(req)) {
+		tfw_http_resp_stream_fwd(resp, true);
+		if (resp->stream_id)
+			TFW_INC_STAT_BH(serv.msgs_forwarded);
+		tfw_http_resp_pair_free(req);
+	}
+	else if (unlikely(test_bit(TFW_HTTP_B_REQ_DROP, req->flags))) {
+		tfw_http_resp_pair_free(req);
+	}
+	else {
+		tfw_http_resp_fwd(resp);
+	}
+}
+
+/**
+ * Streamed response @hmresp can't be completed, e.g. the server connection is
+ * closed. The client has already received a part of the response, so only
+ * the HTTP/2 stream or the whole HTTP/1 connection can be reset.
+ */
+static void
+tfw_http_resp_stream_abort(TfwHttpMsg *hmresp)
+{
+	TfwHttpResp *resp = (TfwHttpResp *)hmresp;
+	TfwHttpReq *req = hmresp->req;
+	TfwCliConn *cli_conn = (TfwCliConn *)req->conn;
+
+	T_DBG2("%s: abort streamed resp=[%p]\n", __func__, resp);
+
+	tfw_http_popreq(hmresp, false);
+	ss_skb_queue_purge(&hmresp->msg.skb_head);
+
+	if (TFW_MSG_H2(req)) {
+		if (resp->stream_id)
+			tfw_h2_send_rst_stream(tfw_h2_context(req->conn),
+					       resp->stream_id,
+					       HTTP2_ECODE_INTERNAL);
+	} else {
+		spin_lock_bh(&cli_conn->seq_qlock);
+		list_del_init(&req->msg.seq_list);
+		spin_unlock_bh(&cli_conn->seq_qlock);
+		tfw_connection_close(req->conn, true);
+	}
+	tfw_http_resp_pair_free(req);
+	TFW_INC_STAT_BH(serv.msgs_otherr);
+}
+
 /*
  * Finish a response that is terminated by closing the connection.
  */
@@ -5823,31 +7908,157 @@ tfw_http_resp_terminate(TfwHttpMsg *hm)
 	else
 		set_bit(TFW_HTTP_B_CONN_CLOSE, hm->req->flags);
 
-	if (r) {
-		TfwHttpReq *req = hm->req;
+	if (r) {
+		TfwHttpReq *req = hm->req;
+
+		tfw_http_popreq(hm, false);
+		/* The response is freed by tfw_http_req_block(). */
+		tfw_http_req_block(req, 502, "response blocked: filtered out");
+		TFW_INC_STAT_BH(serv.msgs_filtout);
+		return;
+	}
+
+	/*
+	 * Note that in this case we don't have data to process.
+	 * All data has been processed already. The response needs
+	 * to go through Tempesta's post-processing, and then be
+	 * sent to the client. The full skb->len is used as the
+	 * offset to mark this case in the post-processing phase.
+	 */
+	data.skb = ss_skb_peek_tail(&hm->msg.skb_head);
+	BUG_ON(!data.skb);
+	data.req = NULL;
+	data.resp = (TfwMsg *)hm;
+
+	if (tfw_http_resp_gfsm(hm, &data) != TFW_PASS)
+		return;
+	tfw_http_resp_cache(hm);
+}
+
+/*
+ * Tunnels.
+ *
+ * When a server accepts a protocol upgrade of an HTTP/1.1 request, e.g. to
+ * WebSocket (RFC 6455), with 101 (Switching Protocols) response, the client
+ * and the server connections are paired: since then their data is passed to
+ * the peer connection as is, without parsing and copying, see
+ * tfw_http_tunnel_fwd(). The server connection is restricted, so it leaves
+ * the pool until the tunnel is closed, and nothing else is forwarded to it.
+ * Closing of either connection closes the other one, idle tunnels are closed
+ * by the client connections keep-alive timers with 'tunnel_timeout'.
+ *
+ * The upgrade request holds forwarding after it in the server connection just
+ * like non-idempotent requests, and an upgrade is refused with 502 if the
+ * client has other requests in flight, so the data of other messages never
+ * goes to a tunnel. HTTP/2 (RFC 8441) upgrades aren't supported.
+ */
+
+static bool
+tfw_http_resp_upgrade(TfwHttpMsg *hmresp)
+{
+	TfwHttpReq *req = hmresp->req;
+
+	return ((TfwHttpResp *)hmresp)->status == 101
+	       && req->conn
+	       && test_bit(TFW_HTTP_B_CONN_UPGRADE, req->flags)
+	       && !TFW_MSG_H2(req)
+	       && hmresp->stream == &hmresp->conn->stream;
+}
+
+/**
+ * Pass @skb, a list of skbs linked by @next, received on tunnel @conn to the
+ * peer connection.
+ */
+static int
+tfw_http_tunnel_fwd(TfwConn *conn, struct sk_buff *skb)
+{
+	TfwConn *pair = READ_ONCE(*tfw_conn_tunnel(conn));
+	TfwMsg msg = {};
+	struct sk_buff *next;
+	int r;
+
+	for ( ; skb; skb = next) {
+		next = skb->next;
+		skb->next = skb->prev = NULL;
+		msg.len += skb->len;
+		ss_skb_queue_tail(&msg.skb_head, skb);
+	}
+
+	if (TFW_CONN_TYPE(conn) & Conn_Clnt) {
+		TFW_ADD_STAT_BH(msg.len, clnt.rx_bytes);
+		/* Postpone the tunnel timeout, see tfw_ka_sweep(). */
+		WRITE_ONCE(((TfwCliConn *)conn)->ka_ts, jiffies);
+		r = tfw_connection_send(pair, &msg);
+	} else {
+		TFW_ADD_STAT_BH(msg.len, serv.rx_bytes);
+		r = tfw_cli_conn_send((TfwCliConn *)pair, &msg);
+		if (likely(!r))
+			tfw_cli_conn_rx_throttle((TfwCliConn *)pair,
+						 (TfwSrvConn *)conn);
+	}
+	if (unlikely(r)) {
+		ss_skb_queue_purge(&msg.skb_head);
+		return TFW_BLOCK;
+	}
+
+	return TFW_PASS;
+}
+
+/**
+ * Forward 101 response @hmresp to the client and switch the client and the
+ * server connections to a tunnel. @skb is the tunneled data received right
+ * after the response, if any.
+ */
+static int
+tfw_http_tunnel_open(TfwHttpMsg *hmresp, struct sk_buff *skb)
+{
+	TfwHttpReq *req = hmresp->req;
+	TfwSrvConn *srv_conn = (TfwSrvConn *)hmresp->conn;
+	TfwCliConn *cli_conn = (TfwCliConn *)req->conn;
+	LIST_HEAD(reschq);
+	LIST_HEAD(eq);
+	bool ok;
+
+	/*
+	 * The client connection can't be dropped concurrently with the check
+	 * under the lock, see tfw_http_conn_cli_drop().
+	 */
+	spin_lock(&cli_conn->seq_qlock);
+	ok = !test_bit(TFW_HTTP_B_REQ_DROP, req->flags)
+	     && list_is_singular(&cli_conn->seq_queue);
+	if (ok) {
+		tfw_connection_get((TfwConn *)srv_conn);
+		WRITE_ONCE(cli_conn->tunnel, (TfwConn *)srv_conn);
+	}
+	spin_unlock(&cli_conn->seq_qlock);
 
-		tfw_http_popreq(hm, false);
-		/* The response is freed by tfw_http_req_block(). */
-		tfw_http_req_block(req, 502, "response blocked: filtered out");
-		TFW_INC_STAT_BH(serv.msgs_filtout);
-		return;
+	if (unlikely(!ok)) {
+		if (skb)
+			__kfree_skb(skb);
+		tfw_http_popreq(hmresp, false);
+		/* The response is freed by tfw_http_req_drop(). */
+		tfw_http_req_drop(req, 502, "response dropped:"
+				  " can't switch protocols");
+		TFW_INC_STAT_BH(serv.msgs_otherr);
+		return TFW_BLOCK;
 	}
 
-	/*
-	 * Note that in this case we don't have data to process.
-	 * All data has been processed already. The response needs
-	 * to go through Tempesta's post-processing, and then be
-	 * sent to the client. The full skb->len is used as the
-	 * offset to mark this case in the post-processing phase.
-	 */
-	data.skb = ss_skb_peek_tail(&hm->msg.skb_head);
-	BUG_ON(!data.skb);
-	data.req = NULL;
-	data.resp = (TfwMsg *)hm;
+	/* Hold forwarding to the server connection from now on. */
+	tfw_connection_get((TfwConn *)cli_conn);
+	WRITE_ONCE(srv_conn->tunnel, (TfwConn *)cli_conn);
 
-	if (tfw_http_resp_gfsm(hm, &data) != TFW_PASS)
-		return;
-	tfw_http_resp_cache(hm);
+	tfw_http_resp_cache(hmresp);
+
+	/* Reschedule the requests held by the upgrade request. */
+	set_bit(TFW_CONN_B_TUNNEL, &srv_conn->flags);
+	spin_lock_bh(&srv_conn->fwd_qlock);
+	tfw_http_conn_fwd_drain(srv_conn);
+	tfw_http_fwdq_reset(srv_conn, &reschq);
+	spin_unlock_bh(&srv_conn->fwd_qlock);
+	tfw_http_fwdq_resched(srv_conn, &reschq, &eq);
+	tfw_http_req_zap_error(&eq);
+
+	return skb ? tfw_http_tunnel_fwd((TfwConn *)srv_conn, skb) : TFW_PASS;
 }
 
 /**
@@ -5863,14 +8074,15 @@ tfw_http_resp_process(TfwConn *conn, TfwStream *stream, const TfwFsmData *data)
 	TfwHttpReq *bad_req;
 	TfwHttpMsg *hmresp, *hmsib;
 	TfwFsmData data_up;
-	bool conn_stop, filtout = false;
+	bool conn_stop, upgrade, filtout = false;
+	u64 t0;
 
 	BUG_ON(!stream->msg);
 	/*
 	 * #769: There is no client side TLS, so we don't read HTTP responses
 	 * through TLS connection, so trail and off should be zero.
 	 * However, TCP overlapping segments still may produce non-zero offset
-	 * in ss_tcp_process_skb().
+	 * in ss_tcp_collect_skb().
 	 */
 
 	T_DBG2("Received %u server data bytes on conn=%p msg=%p\n",
@@ -5885,8 +8097,10 @@ next_msg:
 	hmsib = NULL;
 	hmresp = (TfwHttpMsg *)stream->msg;
 
+	t0 = tfw_lat_start();
 	r = ss_skb_process(skb, tfw_http_parse_resp, hmresp, &chunks_unused,
 			   &parsed);
+	tfw_lat_end(TFW_LAT_RESP_PARSE, t0);
 	hmresp->msg.len += parsed;
 	TFW_ADD_STAT_BH(parsed, serv.rx_bytes);
 
@@ -5935,6 +8149,16 @@ next_msg:
 			filtout = true;
 			goto bad_msg;
 		}
+		/* Forward the body as it comes if the response is large. */
+		if (test_bit(TFW_HTTP_B_RESP_STREAM, hmresp->flags)) {
+			tfw_http_resp_stream_fwd((TfwHttpResp *)hmresp, false);
+		}
+		else if (tfw_http_resp_stream_need(hmresp)
+			 && tfw_http_resp_stream_start(hmresp, &data_up)
+			    != TFW_PASS)
+		{
+			return TFW_BLOCK;
+		}
 		/*
 		 * TFW_POSTPONE status means that parsing succeeded
 		 * but more data is needed to complete it. Lower layers
@@ -5954,6 +8178,7 @@ next_msg:
 		{
 			goto bad_msg;
 		}
+		trace_tfw_http_resp_received((TfwHttpResp *)hmresp);
 	}
 
 	/*
@@ -5986,23 +8211,51 @@ next_msg:
 	 * connections with buggy applications. Now we stop scheduling
 	 * new requests to the server and forward all, probably error
 	 * responses, for queued requests to clients.
+	 *
+	 * Body of streamed response is already forwarded, so the response
+	 * can't be verified.
 	 */
-	tfw_http_hm_control((TfwHttpResp *)hmresp);
+	if (!test_bit(TFW_HTTP_B_RESP_STREAM, hmresp->flags))
+		tfw_http_hm_control((TfwHttpResp *)hmresp);
 
 	/*
 	 * Pass the response to GFSM for further processing.
 	 * Drop server connection in case of serious error or security
-	 * event.
+	 * event. Streamed responses are passed to GFSM when their
+	 * headers are parsed.
+	 */
+	upgrade = tfw_http_resp_upgrade(hmresp);
+	if (!test_bit(TFW_HTTP_B_RESP_STREAM, hmresp->flags)) {
+		r = tfw_http_resp_gfsm(hmresp, &data_up);
+		if (unlikely(r < TFW_PASS))
+			return TFW_BLOCK;
+	}
+
+	/*
+	 * The data after 101 response belongs to the new protocol. If the
+	 * response wasn't forwarded, then the server connection state is
+	 * unknown, so close it.
 	 */
-	r = tfw_http_resp_gfsm(hmresp, &data_up);
-	if (unlikely(r < TFW_PASS))
+	if (unlikely(upgrade)) {
+		if (r == TFW_PASS)
+			return tfw_http_tunnel_open(hmresp, skb);
+		if (skb)
+			__kfree_skb(skb);
 		return TFW_BLOCK;
+	}
 
 	/*
 	 * If @skb's data has not been processed in full, then
 	 * we have pipelined responses. Create a sibling message.
 	 * @skb is replaced with a pointer to a new SKB.
+	 *
+	 * HTTP/2 stream of a server carries exactly one response, so the
+	 * data after it is ignored.
 	 */
+	if (skb && stream != &conn->stream) {
+		__kfree_skb(skb);
+		skb = NULL;
+	}
 	if (skb) {
 		hmsib = tfw_http_msg_create_sibling(hmresp, skb);
 		/*
@@ -6034,7 +8287,10 @@ next_msg:
 	 * In the end, the response is sent on to the client.
 	 * @hmsib is not attached to the connection yet.
 	 */
-	tfw_http_resp_cache(hmresp);
+	if (test_bit(TFW_HTTP_B_RESP_STREAM, hmresp->flags))
+		tfw_http_resp_stream_end(hmresp);
+	else
+		tfw_http_resp_cache(hmresp);
 
 next_resp:
 	if (hmsib) {
@@ -6063,6 +8319,10 @@ bad_msg:
 	 * situation will happen once again if the request will be re-sent.
 	 * Send error or drop the request.
 	 */
+	if (test_bit(TFW_HTTP_B_RESP_STREAM, hmresp->flags)) {
+		tfw_http_resp_stream_abort(hmresp);
+		return TFW_BLOCK;
+	}
 	bad_req = hmresp->req;
 	tfw_http_popreq(hmresp, false);
 	/* The response is freed by tfw_http_req_block/drop(). */
@@ -6096,7 +8356,10 @@ tfw_http_msg_process_generic(TfwConn *conn, TfwStream *stream, TfwFsmData *data)
 	}
 
 	T_DBG2("Add skb %p to message %p\n", data->skb, stream->msg);
-	ss_skb_queue_tail(&stream->msg->skb_head, data->skb);
+	/* Body parts of streamed request are forwarded on their own. */
+	if (likely(!test_bit(TFW_HTTP_B_REQ_STREAM,
+			     ((TfwHttpMsg *)stream->msg)->flags)))
+		ss_skb_queue_tail(&stream->msg->skb_head, data->skb);
 
 	return (TFW_CONN_TYPE(conn) & Conn_Clnt)
 		? tfw_http_req_process(conn, stream, data)
@@ -6117,21 +8380,36 @@ tfw_http_msg_process(void *conn, TfwFsmData *data)
 	int r = T_OK;
 	TfwStream *stream = &((TfwConn *)conn)->stream;
 	struct sk_buff *next;
+	bool batch = TFW_CONN_TYPE((TfwConn *)conn) & Conn_Clnt;
 
 	if (data->skb->prev)
 		data->skb->prev->next = NULL;
+	if (batch)
+		tfw_http_req_batch_start();
 	for (next = data->skb->next; data->skb;
 	     data->skb = next, next = next ? next->next : NULL)
 	{
 		if (likely(r == T_OK || r == T_POSTPONE)) {
+			/* The rest of the data is passed to the tunnel. */
+			if (unlikely(READ_ONCE(*tfw_conn_tunnel(conn)))) {
+				r = tfw_http_tunnel_fwd(conn, data->skb);
+				break;
+			}
 			data->skb->next = data->skb->prev = NULL;
-			r = TFW_CONN_H2(conn)
-				? tfw_h2_frame_process(conn, data)
-				: tfw_http_msg_process_generic(conn, stream, data);
+			if (!batch && tfw_srv_conn_h2((TfwSrvConn *)conn))
+				r = tfw_h2_srv_frame_process((TfwSrvConn *)conn,
+							     data->skb);
+			else
+				r = TFW_CONN_H2(conn)
+				    ? tfw_h2_frame_process(conn, data)
+				    : tfw_http_msg_process_generic(conn, stream,
+								   data);
 		} else {
 			__kfree_skb(data->skb);
 		}
 	}
+	if (batch)
+		tfw_http_req_batch_stop();
 
 	return r;
 }
@@ -6209,25 +8487,439 @@ cleanup:
 	tfw_http_msg_free(hmreq);
 }
 
+/**
+ * Allocate a GET request to @host and @uri created by the cache itself. The
+ * request has no client connection, so its response is stored in the cache
+ * and dropped afterwards, just like responses to health monitoring requests.
+ */
+static TfwHttpReq *
+tfw_http_cache_req_alloc(const TfwStr *host, const TfwStr *uri)
+{
+	char *p;
+	TfwMsgIter it;
+	TfwHttpReq *req;
+	TfwStr *hdr, chunks[5] = {};
+	TfwStr msg = { .chunks = chunks, .nchunks = 4 };
+
+	if (!(req = (TfwHttpReq *)__tfw_http_msg_alloc(Conn_Clnt, true)))
+		return NULL;
+	p = tfw_pool_alloc(req->pool, sizeof(TfwStr) * 2 + uri->len
+			   + host->len);
+	if (!p)
+		goto err;
+
+	/*
+	 * The strings may be freed before the response comes, so copy them.
+	 * Host header is split into name and value chunks like the parser
+	 * does.
+	 */
+	hdr = &req->h_tbl->tbl[TFW_HTTP_HDR_HOST];
+	hdr->chunks = (TfwStr *)p;
+	p += sizeof(TfwStr) * 2;
+	req->uri_path = (TfwStr){ .data = p, .len = uri->len };
+	if (tfw_strcpy(&req->uri_path, uri))
+		goto err;
+	p += uri->len;
+
+	chunks[0] = (TfwStr){ .data = "GET ", .len = SLEN("GET ") };
+	chunks[1] = req->uri_path;
+	chunks[2] = (TfwStr){ .data = " " S_VERSION11 S_CRLF "Host:",
+			      .len = SLEN(" " S_VERSION11 S_CRLF "Host:") };
+	chunks[3] = (TfwStr){ .data = S_CRLF S_CRLF,
+			      .len = SLEN(S_CRLF S_CRLF) };
+	if (host->len) {
+		hdr->chunks[0] = (TfwStr){ .data = "Host:",
+					   .len = SLEN("Host:") };
+		hdr->chunks[1] = (TfwStr){ .data = p, .len = host->len,
+					   .flags = TFW_STR_VALUE };
+		hdr->nchunks = 2;
+		hdr->len = SLEN("Host:") + host->len;
+		if (tfw_strcpy(&hdr->chunks[1], host))
+			goto err;
+		req->host = hdr->chunks[1];
+		chunks[4] = chunks[3];
+		chunks[3] = hdr->chunks[1];
+		msg.nchunks = 5;
+	}
+	msg.len = chunks[0].len + chunks[1].len + chunks[2].len
+		  + chunks[3].len + chunks[4].len;
+	if (tfw_http_msg_setup((TfwHttpMsg *)req, &it, msg.len, 0)
+	    || tfw_msg_write(&it, &msg))
+		goto err;
+
+	req->method = TFW_HTTP_METH_GET;
+	req->version = TFW_HTTP_VER_11;
+	req->jrxtstamp = jiffies;
+	req->cache_ctl.timestamp = tfw_current_timestamp();
+	__set_bit(TFW_HTTP_B_CACHE_REFRESH, req->flags);
+
+	return req;
+err:
+	tfw_http_msg_free((TfwHttpMsg *)req);
+	return NULL;
+}
+
+static void
+tfw_http_cache_req_fwd(TfwHttpReq *req)
+{
+	TfwSrvConn *srv_conn;
+	LIST_HEAD(equeue);
+
+	if (!(srv_conn = tfw_http_get_srv_conn((TfwMsg *)req))) {
+		T_DBG("Unable to find a backend server to fill the cache\n");
+		tfw_http_msg_free((TfwHttpMsg *)req);
+		return;
+	}
+
+	tfw_http_req_fwd(srv_conn, req, &equeue, false);
+	tfw_http_req_zap_error(&equeue);
+
+	/*
+	 * Paired with tfw_srv_conn_get_if_live() via tfw_http_get_srv_conn()
+	 * which increments the reference counter.
+	 */
+	tfw_srv_conn_put(srv_conn);
+}
+
+/**
+ * Send a request to refresh a stale cache entry in background, RFC 5861 3.
+ * The request has the same Host and cache key as the client request @creq,
+ * its URI is the normalized URI of the key.
+ */
+void
+tfw_http_cache_refresh(TfwHttpReq *creq)
+{
+	TfwStr host;
+	TfwHttpReq *req;
+
+	tfw_http_msg_clnthdr_val(creq, &creq->h_tbl->tbl[TFW_HTTP_HDR_HOST],
+				 TFW_HTTP_HDR_HOST, &host);
+	if (!(req = tfw_http_cache_req_alloc(&host,
+					     tfw_http_req_cache_uri(creq))))
+		return;
+
+	req->hash = tfw_http_req_key_calc(creq);
+	req->vhost = creq->vhost;
+	tfw_vhost_get(req->vhost);
+	req->location = creq->location;
+
+	tfw_http_cache_req_fwd(req);
+}
+
+/*
+ * Cache warm-up requests get here on cache misses only.
+ */
+static void
+tfw_http_cache_warmup_cb(TfwHttpMsg *msg)
+{
+	tfw_http_cache_req_fwd((TfwHttpReq *)msg);
+}
+
+/**
+ * Request @uri at @host to populate the cache if the resource isn't cached
+ * yet. Must be called with disabled softirqs.
+ */
+int
+tfw_http_cache_warmup(const TfwStr *host, const TfwStr *uri)
+{
+	bool block = false;
+	TfwHttpReq *req;
+
+	if (!(req = tfw_http_cache_req_alloc(host, uri)))
+		return -ENOMEM;
+
+	req->vhost = tfw_http_tbl_vhost((TfwMsg *)req, &block);
+	if (unlikely(!req->vhost || block)) {
+		tfw_http_msg_free((TfwHttpMsg *)req);
+		return -ENOENT;
+	}
+	req->location = tfw_location_match(req->vhost, &req->uri_path);
+	tfw_http_req_key_calc(req);
+
+	if (tfw_cache_process((TfwHttpMsg *)req, tfw_http_cache_warmup_cb)) {
+		tfw_http_msg_free((TfwHttpMsg *)req);
+		return -EBUSY;
+	}
+
+	return 0;
+}
+
+/**
+ * Find the query and the fragment of @req URI, unless the parser has found
+ * them already.
+ */
+void
+tfw_http_req_uri_split(TfwHttpReq *req)
+{
+	const TfwStr *c, *end;
+	size_t off = 0;
+
+	if (test_bit(TFW_HTTP_B_URI_SPLIT, req->flags))
+		return;
+	__set_bit(TFW_HTTP_B_URI_SPLIT, req->flags);
+
+	TFW_STR_FOR_EACH_CHUNK(c, &req->uri_path, end) {
+		if (!tfw_http_req_uri_scan(req, c->data, c->len, off))
+			break;
+		off += c->len;
+	}
+}
+
+/* Copy @len bytes of @s starting from offset @off to @out. */
+static void
+tfw_http_str_copy(const TfwStr *s, size_t off, size_t len, char *out)
+{
+	const TfwStr *c, *end;
+
+	TFW_STR_FOR_EACH_CHUNK(c, s, end) {
+		size_t n;
+
+		if (off >= c->len) {
+			off -= c->len;
+			continue;
+		}
+		n = min(c->len - off, len);
+		memcpy(out, c->data + off, n);
+		out += n;
+		len -= n;
+		if (!len)
+			break;
+		off = 0;
+	}
+}
+
+/**
+ * Get the query arguments of @req URI. The query is copied and split to
+ * the arguments only on the first call, so different consumers don't scan
+ * the URI again.
+ * @return NULL if there is no query or on memory allocation failure.
+ */
+const TfwHttpArgs *
+tfw_http_req_args(TfwHttpReq *req)
+{
+	TfwHttpArgs *qa;
+	size_t len, n = 1;
+	char *q, *p, *a, *end;
+
+	if (req->args)
+		return req->args;
+
+	tfw_http_req_uri_split(req);
+	if (!req->uri_query)
+		return NULL;
+	len = (req->uri_frag ? req->uri_frag - 1 : req->uri_path.len)
+	      - req->uri_query;
+	if (!(q = tfw_pool_alloc(req->pool, len + 1)))
+		return NULL;
+	tfw_http_str_copy(&req->uri_path, req->uri_query, len, q);
+	end = q + len;
+	for (p = q; (p = memchr(p, '&', end - p)); ++p)
+		++n;
+
+	qa = tfw_pool_alloc(req->pool, sizeof(*qa) + n * sizeof(qa->args[0]));
+	if (!qa)
+		return NULL;
+	qa->n = 0;
+	for (a = q; a < end; a = p + 1) {
+		TfwHttpArg *arg = &qa->args[qa->n];
+
+		p = memchr(a, '&', end - a) ? : end;
+		if (p == a)
+			continue;
+		arg->data = a;
+		arg->len = p - a;
+		arg->nlen = (char *)(memchr(a, '=', p - a) ? : p) - a;
+		++qa->n;
+	}
+	req->args = qa;
+
+	return qa;
+}
+
+/**
+ * Find the first query argument @name of @len bytes of @req URI and set
+ * @val to its value, the value is empty if the argument has no '='.
+ * The names are case sensitive.
+ */
+bool
+tfw_http_req_arg(TfwHttpReq *req, const char *name, size_t len, TfwStr *val)
+{
+	const TfwHttpArgs *qa = tfw_http_req_args(req);
+	unsigned int i;
+
+	if (!qa)
+		return false;
+	for (i = 0; i < qa->n; ++i) {
+		const TfwHttpArg *a = &qa->args[i];
+
+		if (a->nlen != len || memcmp(a->data, name, len))
+			continue;
+		TFW_STR_INIT(val);
+		val->data = (char *)a->data + min(a->len, a->nlen + 1);
+		val->len = a->len - min(a->len, a->nlen + 1);
+		return true;
+	}
+
+	return false;
+}
+
+/* Max number of query arguments sorted for the cache key. */
+#define TFW_CACHE_KEY_ARGS_MAX	32
+
+static const TfwCacheKeyNorm *
+tfw_http_req_cache_key_norm(TfwHttpReq *req)
+{
+	TfwVhost *vhost = req->vhost;
+
+	if (req->location && req->location->cache_key)
+		return req->location->cache_key;
+	if (!vhost)
+		return NULL;
+	if (vhost->loc_dflt && vhost->loc_dflt->cache_key)
+		return vhost->loc_dflt->cache_key;
+	if (vhost->vhost_dflt)
+		return vhost->vhost_dflt->loc_dflt->cache_key;
+
+	return NULL;
+}
+
+/* Query argument @arg is excluded from the key. */
+static bool
+tfw_http_cache_key_drop(const TfwCacheKeyNorm *kn, const TfwHttpArg *arg)
+{
+	size_t n = arg->nlen;
+	int i;
+
+	for (i = 0; i < kn->drop_n; ++i) {
+		const TfwStr *d = &kn->drop[i];
+
+		if (d->data[d->len - 1] == '*') {
+			if (n >= d->len - 1
+			    && !strncasecmp(arg->data, d->data, d->len - 1))
+				return true;
+		} else if (n == d->len && !strncasecmp(arg->data, d->data, n)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static int
+tfw_http_cache_key_arg_cmp(const void *a, const void *b)
+{
+	const TfwHttpArg *x = *(const TfwHttpArg **)a;
+	const TfwHttpArg *y = *(const TfwHttpArg **)b;
+	int r = memcmp(x->data, y->data, min(x->len, y->len));
+
+	return r ? : (x->len > y->len) - (x->len < y->len);
+}
+
+/**
+ * Normalize URI of @req for the cache key by @kn: drop the fragment and the
+ * query arguments listed in @kn, sort the rest of the arguments. The URI is
+ * used as is if there is nothing to change, or if there are too many
+ * arguments to sort.
+ */
+static void
+tfw_http_req_cache_uri_norm(TfwHttpReq *req, const TfwCacheKeyNorm *kn)
+{
+	const TfwHttpArg *args[TFW_CACHE_KEY_ARGS_MAX];
+	const TfwHttpArgs *qa = NULL;
+	size_t plen, n = 0, len = req->uri_path.len;
+	bool frag;
+	char *out, *o;
+	int i;
+
+	plen = tfw_http_req_uri_path_len(req);
+	frag = req->uri_frag && !(kn->flags & TFW_CACHE_KEY_FRAGMENT);
+	if (!req->uri_query && (!req->uri_frag || frag))
+		return;
+	if (req->uri_query && !(qa = tfw_http_req_args(req)))
+		return;
+
+	for (i = 0; qa && i < qa->n; ++i) {
+		if (tfw_http_cache_key_drop(kn, &qa->args[i]))
+			continue;
+		if (n == TFW_CACHE_KEY_ARGS_MAX) {
+			T_DBG2("%s: too many query arguments\n", __func__);
+			return;
+		}
+		args[n++] = &qa->args[i];
+	}
+	if (kn->flags & TFW_CACHE_KEY_SORT_ARGS)
+		sort(args, n, sizeof(args[0]), tfw_http_cache_key_arg_cmp,
+		     NULL);
+
+	/* The arguments are separated as in the URI, so it can only shrink. */
+	if (!(out = tfw_pool_alloc(req->pool, len)))
+		return;
+	tfw_http_str_copy(&req->uri_path, 0, plen, out);
+	o = out + plen;
+	for (i = 0; i < n; ++i) {
+		*o++ = i ? '&' : '?';
+		memcpy(o, args[i]->data, args[i]->len);
+		o += args[i]->len;
+	}
+	if (frag) {
+		tfw_http_str_copy(&req->uri_path, req->uri_frag - 1,
+				  len - req->uri_frag + 1, o);
+		o += len - req->uri_frag + 1;
+	}
+
+	req->cache_uri.data = out;
+	req->cache_uri.len = o - out;
+}
+
+/* Hash of @host in lower case. */
+static unsigned long
+tfw_http_req_host_hash_lc(TfwHttpReq *req, const TfwStr *host)
+{
+	TfwStr lc = { .len = host->len };
+	char *p;
+	size_t i;
+
+	if (!(p = tfw_pool_alloc(req->pool, host->len + 1)))
+		return tfw_hash_str(host);
+	tfw_str_to_cstr(host, p, host->len + 1);
+	for (i = 0; i < host->len; ++i)
+		p[i] = tolower(p[i]);
+	lc.data = p;
+
+	return tfw_hash_str(&lc);
+}
+
 /**
  * Calculate the key of an HTTP request by hashing URI and Host header values.
+ * The URI and Host are normalized first if it's configured for the request
+ * location, the normalized URI is used by the cache instead of the request
+ * URI then.
  */
 unsigned long
 tfw_http_req_key_calc(TfwHttpReq *req)
 {
 	TfwStr host;
+	const TfwCacheKeyNorm *kn;
 
 	if (req->hash)
 		return req->hash;
 
-	req->hash = tfw_hash_str(&req->uri_path);
+	kn = tfw_http_req_cache_key_norm(req);
+	if (kn && ((kn->flags & ~TFW_CACHE_KEY_HOST) || kn->drop_n))
+		tfw_http_req_cache_uri_norm(req, kn);
+
+	req->hash = tfw_hash_str(tfw_http_req_cache_uri(req));
 
 	if (test_bit(TFW_HTTP_B_HMONITOR, req->flags))
 		return req->hash;
 
 	tfw_http_msg_clnthdr_val(req, &req->h_tbl->tbl[TFW_HTTP_HDR_HOST],
 				 TFW_HTTP_HDR_HOST, &host);
-	if (!TFW_STR_EMPTY(&host))
+	if (TFW_STR_EMPTY(&host))
+		return req->hash;
+	if (kn && (kn->flags & TFW_CACHE_KEY_HOST))
+		req->hash ^= tfw_http_req_host_hash_lc(req, &host);
+	else
 		req->hash ^= tfw_hash_str(&host);
 
 	return req->hash;
@@ -6566,6 +9258,9 @@ tfw_cfgop_resp_body_restore_clen(TfwStr *hdr, int resp_num)
 	case RESP_412:
 		CLEN_STR_INIT(S_412_PART_02);
 		break;
+	case RESP_416:
+		CLEN_STR_INIT(S_416_PART_02);
+		break;
 	case RESP_500:
 		CLEN_STR_INIT(S_500_PART_02);
 		break;
@@ -6798,6 +9493,15 @@ static TfwCfgSpec tfw_http_specs[] = {
 		.allow_none = true,
 		.cleanup = tfw_cfgop_cleanup_block_action,
 	},
+	{
+		.name = "request_stream_threshold",
+		.deflt = "0",
+		.handler = tfw_cfg_set_int,
+		.dest = &tfw_req_stream_thr,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, INT_MAX },
+		},
+	},
 	{
 		.name = "response_body",
 		.deflt = NULL,
@@ -6806,6 +9510,15 @@ static TfwCfgSpec tfw_http_specs[] = {
 		.allow_none = true,
 		.cleanup = tfw_cfgop_cleanup_resp_body,
 	},
+	{
+		.name = "response_stream_threshold",
+		.deflt = "0",
+		.handler = tfw_cfg_set_int,
+		.dest = &tfw_resp_stream_thr,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, INT_MAX },
+		},
+	},
 	{
 		.name = "whitelist_mark",
 		.deflt = NULL,
@@ -139,6 +139,9 @@ enum {
 #define TFW_HTTP_CC_PUBLIC		0x00000400
 #define TFW_HTTP_CC_PRIVATE		0x00000800
 #define TFW_HTTP_CC_S_MAXAGE		0x00001000
+/* RFC 5861 extensions. */
+#define TFW_HTTP_CC_STALE_REVAL		0x00002000
+#define TFW_HTTP_CC_STALE_ERR		0x00004000
 /* Unknown flag */
 #define TFW_HTTP_CC_OTHER		0x00008000
 /* Mask to indicate that CC header is present. */
@@ -157,6 +160,8 @@ typedef struct {
 	unsigned int	s_maxage;
 	unsigned int	max_stale;
 	unsigned int	min_fresh;
+	unsigned int	stale_reval;
+	unsigned int	stale_err;
 	long		timestamp;
 	long		age;
 	long		expires;
@@ -230,12 +235,16 @@ enum {
 	 * CONN_KA: 'Connection:' header contains 'keep-alive' term. The flag
 	 * is not set for HTTP/1.1 connections which are persistent by default.
 	 * CONN_EXTRA: 'Connection:' header contains additional terms.
+	 * CONN_UPGRADE: 'Connection:' header contains 'upgrade' term, the
+	 * Upgrade header is passed end-to-end and the connection is switched
+	 * to a tunnel if a server accepts the upgrade, see tfw_http_tunnel_open().
 	 *
 	 * CONN_CLOSE and CONN_KA flags are mutual exclusive.
 	 */
 	TFW_HTTP_B_CONN_CLOSE	= TFW_HTTP_FLAGS_COMMON,
 	TFW_HTTP_B_CONN_KA,
 	TFW_HTTP_B_CONN_EXTRA,
+	TFW_HTTP_B_CONN_UPGRADE,
 	/* Chunked is last transfer encoding. */
 	TFW_HTTP_B_CHUNKED,
 	/* Chunked in the middle of applied transfer encodings. */
@@ -277,10 +286,26 @@ enum {
 	TFW_HTTP_B_REQ_DROP,
 	/* Request is PURGE with an 'X-Tempesta-Cache: get' header. */
 	TFW_HTTP_B_PURGE_GET,
+	/* Request waited for a response to a concurrent cache miss. */
+	TFW_HTTP_B_CACHE_WAITED,
+	/* Request is forwarded while next requests for its key wait. */
+	TFW_HTTP_B_CACHE_FETCH,
+	/* Request is created by cache to refresh a stale entry. */
+	TFW_HTTP_B_CACHE_REFRESH,
 	/* Need strip 1 leading CR */
 	TFW_HTTP_B_NEED_STRIP_LEADING_CR,
 	/* Need strip 1 leading LF */
 	TFW_HTTP_B_NEED_STRIP_LEADING_LF,
+	/* Request body is forwarded to the server while it's being received. */
+	TFW_HTTP_B_REQ_STREAM,
+	/* The whole body of streamed request is forwarded. */
+	TFW_HTTP_B_REQ_STREAM_DONE,
+	/* Streamed request is released by the client or the server side. */
+	TFW_HTTP_B_REQ_STREAM_FREE,
+	/* Request is a hedged copy of a slow client request. */
+	TFW_HTTP_B_HEDGE,
+	/* Offsets of the URI query and fragment are found. */
+	TFW_HTTP_B_URI_SPLIT,
 
 	/* Response flags */
 	TFW_HTTP_FLAGS_RESP,
@@ -292,6 +317,8 @@ enum {
 	TFW_HTTP_B_HDR_LMODIFIED,
 	/* Response is fully processed and ready to be forwarded to the client. */
 	TFW_HTTP_B_RESP_READY,
+	/* Response body is forwarded to the client while it's being received. */
+	TFW_HTTP_B_RESP_STREAM,
 
 	_TFW_HTTP_FLAGS_NUM
 };
@@ -397,6 +424,31 @@ typedef struct {
 	long		m_date;
 } TfwHttpCond;
 
+/**
+ * Query argument "name[=value]" of a request URI.
+ *
+ * @data	- the argument;
+ * @len		- length of the argument;
+ * @nlen	- length of the argument name;
+ */
+typedef struct {
+	const char	*data;
+	unsigned int	len;
+	unsigned int	nlen;
+} TfwHttpArg;
+
+/**
+ * Query arguments of a request URI in the order of the query, empty
+ * arguments are skipped.
+ *
+ * @n		- number of arguments;
+ * @args	- the arguments;
+ */
+typedef struct {
+	unsigned int	n;
+	TfwHttpArg	args[];
+} TfwHttpArgs;
+
 /**
  * HTTP Request.
  *
@@ -414,15 +466,39 @@ typedef struct {
  * @mark	- special hash mark for redirects handling in session module;
  * @multipart_boundary_raw - multipart boundary as is, maybe with escaped chars;
  * @multipart_boundary - decoded multipart boundary;
+ * @cache_uri	- @uri_path normalized for the cache key, empty if @uri_path
+ *		  is used as is;
+ * @args	- index of the URI query arguments, built on the first access;
+ * @srv_conn	- server connection the body of streamed request is forwarded
+ *		  through;
+ * @hedge	- hedged copy of the request, or the original request for the
+ *		  copy until the copy's response is used or discarded;
+ * @hedge_conn	- server connection the original request of the hedged copy
+ *		  is forwarded through;
+ * @climit_sg	- server group the request is accounted in by the adaptive
+ *		  concurrency limit until it's answered;
+ * @stream_skb	- body parts of streamed request waiting for room in the server
+ *		  socket;
  * @fwd_list	- member in the queue of forwarded/backlogged requests;
  * @nip_list	- member in the queue of non-idempotent requests;
+ * @fwd_node	- member in the queue of requests being added to @fwd_queue;
  * @jtxtstamp	- time the request is forwarded to a server, in jiffies;
  * @jrxtstamp	- time the request is received from a client, in jiffies;
  * @tm_header	- time HTTP header started coming;
  * @tm_bchunk	- time previous chunk of HTTP body had come at;
  * @hash	- hash value for caching calculated for the request;
+ * @cache_slice	- offset plus one of the cache slice the requested byte range
+ *		  is served from, zero if the range isn't served by slices;
+ * @uri_hash	- case-insensitive hash of @uri_path for the HTTP tables;
+ * @host_hash	- case-insensitive hash of the host for the HTTP tables;
+ * @uri_query	- offset of the query in @uri_path, following '?', or zero if
+ *		  there is no query;
+ * @uri_frag	- offset of the fragment in @uri_path, following '#', or zero
+ *		  if there is no fragment;
  * @frang_st	- current state of FRANG classifier;
  * @chunk_cnt	- header or body chunk count for Frang classifier;
+ * @sid		- ID of HTTP/2 stream the request is forwarded on to the
+ *		  server, zero if the request isn't forwarded over HTTP/2;
  * @node	- NUMA node where request is serviced;
  * @retries	- the number of re-send attempts;
  * @method	- HTTP request method, one of GET/PORT/HEAD/etc;
@@ -444,16 +520,30 @@ struct tfw_http_req_t {
 	TfwStr			mark;
 	TfwStr			multipart_boundary_raw;
 	TfwStr			multipart_boundary;
+	TfwStr			cache_uri;
+	TfwHttpArgs		*args;
+	TfwSrvConn		*srv_conn;
+	TfwHttpReq		*hedge;
+	TfwSrvConn		*hedge_conn;
+	TfwSrvGroup		*climit_sg;
+	struct sk_buff		*stream_skb;
 	struct list_head	fwd_list;
 	struct list_head	nip_list;
+	struct llist_node	fwd_node;
 	unsigned long		jtxtstamp;
 	unsigned long		jrxtstamp;
 	unsigned long		tm_header;
 	unsigned long		tm_bchunk;
 	unsigned long		hash;
+	unsigned long		cache_slice;
+	unsigned long		uri_hash;
+	unsigned long		host_hash;
+	unsigned int		uri_query;
+	unsigned int		uri_frag;
 	unsigned int		frang_st;
 	unsigned int		chunk_cnt;
 	unsigned int		host_port;
+	unsigned int		sid;
 	unsigned short		node;
 	unsigned short		retries;
 	unsigned char		method;
@@ -542,6 +632,10 @@ typedef struct {
  * TfwStr members must be the first for efficient scanning.
  *
  * @jrxtstamp	- time the message has been received, in jiffies;
+ * @jsrvtime	- time from sending of the paired request to the server till
+ *		  the first byte of the response, in jiffies;
+ * @stream_id	- HTTP/2 stream ID to send DATA frames of streamed response,
+ *		  zero if the stream was closed by the client;
  * @mit		- iterator for controlling HTTP/1.1 => HTTP/2 message
  *		  transformation process (applicable for HTTP/2 mode only).
  */
@@ -551,6 +645,8 @@ struct tfw_http_resp_t {
 	long			date;
 	long			last_modified;
 	unsigned long		jrxtstamp;
+	unsigned long		jsrvtime;
+	unsigned int		stream_id;
 	TfwHttpTransIter	mit;
 };
 
@@ -594,6 +690,7 @@ typedef enum {
 	RESP_403,
 	RESP_404,
 	RESP_412,
+	RESP_416,
 	RESP_4XX_END,
 	RESP_5XX_BEGIN	= RESP_4XX_END,
 	RESP_500	= RESP_5XX_BEGIN,
@@ -649,6 +746,55 @@ tfw_h2_pseudo_index(unsigned short status)
 	}
 }
 
+void tfw_http_req_uri_split(TfwHttpReq *req);
+
+/**
+ * Find the query and the fragment in @n bytes at @p, which are at offset
+ * @off of the URI of @req. The scan stops at the end of the URI, i.e. at
+ * a space, or at the fragment.
+ * @return false if the rest of the URI doesn't need to be scanned.
+ */
+static inline bool
+tfw_http_req_uri_scan(TfwHttpReq *req, const char *p, size_t n, size_t off)
+{
+	size_t i;
+
+	for (i = 0; i < n && p[i] != ' '; ++i) {
+		if (p[i] == '?' && !req->uri_query) {
+			req->uri_query = off + i + 1;
+		} else if (p[i] == '#') {
+			req->uri_frag = off + i + 1;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Length of the path of @req URI, without the query and the fragment.
+ */
+static inline size_t
+tfw_http_req_uri_path_len(TfwHttpReq *req)
+{
+	tfw_http_req_uri_split(req);
+
+	if (req->uri_query)
+		return req->uri_query - 1;
+	if (req->uri_frag)
+		return req->uri_frag - 1;
+	return req->uri_path.len;
+}
+
+/*
+ * URI of the cache key of @req, it's normalized by tfw_http_req_key_calc().
+ */
+static inline TfwStr *
+tfw_http_req_cache_uri(TfwHttpReq *req)
+{
+	return req->cache_uri.len ? &req->cache_uri : &req->uri_path;
+}
+
 typedef void (*tfw_http_cache_cb_t)(TfwHttpMsg *);
 
 /* External HTTP functions. */
@@ -656,11 +802,16 @@ int tfw_http_msg_process(void *conn, TfwFsmData *data);
 int tfw_http_msg_process_generic(TfwConn *conn, TfwStream *stream,
 				 TfwFsmData *data);
 unsigned long tfw_http_req_key_calc(TfwHttpReq *req);
+const TfwHttpArgs *tfw_http_req_args(TfwHttpReq *req);
+bool tfw_http_req_arg(TfwHttpReq *req, const char *name, size_t len,
+		      TfwStr *val);
 void tfw_http_req_destruct(void *msg);
 void tfw_http_resp_fwd(TfwHttpResp *resp);
 void tfw_http_resp_build_error(TfwHttpReq *req);
 int tfw_cfgop_parse_http_status(const char *status, int *out);
 void tfw_http_hm_srv_send(TfwServer *srv, char *data, unsigned long len);
+void tfw_http_cache_refresh(TfwHttpReq *req);
+int tfw_http_cache_warmup(const TfwStr *host, const TfwStr *uri);
 int tfw_h1_set_loc_hdrs(TfwHttpMsg *hm, bool is_resp, bool from_cache);
 int tfw_http_expand_stale_warn(TfwHttpResp *resp);
 int tfw_http_expand_hdr_date(TfwHttpResp *resp);
@@ -680,11 +831,15 @@ int tfw_h2_resp_status_write(TfwHttpResp *resp, unsigned short status,
 int tfw_h2_prep_redirect(TfwHttpResp *resp, unsigned short status,
 			 TfwStr *rmark, TfwStr *cookie, TfwStr *body);
 int tfw_h1_prep_redirect(TfwHttpResp *resp, unsigned short status,
-			 TfwStr *rmark, TfwStr *cookie, TfwStr *body);
+			 TfwStr *rmark, TfwStr *tail);
 int tfw_http_prep_304(TfwHttpReq *req, struct sk_buff **skb_head,
 		      TfwMsgIter *it);
+int tfw_http_prep_416(TfwHttpReq *req, struct sk_buff **skb_head,
+		      TfwMsgIter *it);
 void tfw_http_conn_msg_free(TfwHttpMsg *hm);
 void tfw_http_send_resp(TfwHttpReq *req, int status, const char *reason);
+void tfw_http_send_early_hints(TfwHttpReq *req, const char *link,
+			       unsigned long len);
 
 /* Helper functions */
 char *tfw_http_msg_body_dup(const char *filename, size_t *len);
@@ -697,4 +852,20 @@ int tfw_h2_frame_fwd_resp(TfwHttpResp *resp, unsigned int stream_id,
 int tfw_h2_frame_local_resp(TfwHttpResp *resp, unsigned int stream_id,
 			    unsigned long h_len, const TfwStr *body);
 
+/* HTTP/2 connections with upstream servers. */
+void tfw_http_srv_stream_drop(TfwStream *stream);
+void tfw_http_srv_stream_reset(TfwSrvConn *srv_conn, unsigned int id,
+			       bool refused);
+void tfw_http_conn_fwd_kick(TfwSrvConn *srv_conn);
+void tfw_http_fwdq_unlock(TfwSrvConn *srv_conn);
+void tfw_http_hedge_timer_cb(struct timer_list *t);
+int tfw_h2_srv_conn_init(TfwSrvConn *srv_conn);
+void tfw_h2_srv_conn_drop(TfwSrvConn *srv_conn);
+int tfw_h2_srv_frame_process(TfwSrvConn *srv_conn, struct sk_buff *skb);
+int tfw_h2_srv_req_frames(TfwSrvConn *srv_conn, TfwHttpReq *req,
+			  struct sk_buff **skb_head);
+void tfw_h2_srv_req_abort(TfwSrvConn *srv_conn, TfwHttpReq *req);
+int tfw_h2_srv_req_body(TfwSrvConn *srv_conn, TfwHttpReq *req,
+			struct sk_buff *skb, bool last);
+
 #endif /* __TFW_HTTP_H__ */
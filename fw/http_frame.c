@@ -22,11 +22,16 @@
 #define DEBUG DBG_HTTP_FRAME
 #endif
 
+#include <net/tcp.h>
+
 #include "lib/fsm.h"
 #include "lib/str.h"
 #include "procfs.h"
+#include "stress.h"
 #include "http.h"
 #include "http_frame.h"
+#include "http_limits.h"
+#include "http_msg.h"
 
 #define FRAME_PREFACE_CLI_MAGIC		"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
 #define FRAME_PREFACE_CLI_MAGIC_LEN	24
@@ -45,6 +50,9 @@
 
 #define MAX_WND_SIZE			((1U << 31) - 1)
 #define DEF_WND_SIZE			((1U << 16) - 1)
+/* Initial and maximum sizes of auto-tuned receive windows of the streams. */
+#define STREAM_WND_INIT_SIZE		(1U << 18)
+#define STREAM_WND_MAX_SIZE		(1U << 24)
 
 #define TFW_MAX_CLOSED_STREAMS		5
 
@@ -61,6 +69,7 @@ typedef enum {
 	HTTP2_RECV_FRAME_RST_STREAM,
 	HTTP2_RECV_FRAME_SETTINGS,
 	HTTP2_RECV_FRAME_GOAWAY,
+	HTTP2_RECV_FRAME_PRIO_UPDATE,
 	HTTP2_RECV_FRAME_PADDED,
 	HTTP2_RECV_HEADER_PRI,
 	HTTP2_IGNORE_FRAME_DATA,
@@ -189,6 +198,8 @@ do {									\
 int
 tfw_h2_init(void)
 {
+	tfw_hpack_huffman_init();
+
 	return tfw_h2_stream_cache_create();
 }
 
@@ -209,7 +220,10 @@ tfw_h2_context_init(TfwH2Ctx *ctx)
 
 	ctx->state = HTTP2_RECV_CLI_START_SEQ;
 	ctx->loc_wnd = MAX_WND_SIZE;
+	ctx->rem_wnd = DEF_WND_SIZE;
 	spin_lock_init(&ctx->lock);
+	spin_lock_init(&ctx->xmit_lock);
+	tfw_h2_sched_init(&ctx->sched);
 	INIT_LIST_HEAD(&hclosed_streams->list);
 
 	lset->hdr_tbl_sz = rset->hdr_tbl_sz = HPACK_TABLE_DEF_SIZE;
@@ -218,10 +232,13 @@ tfw_h2_context_init(TfwH2Ctx *ctx)
 	lset->max_frame_sz = rset->max_frame_sz = FRAME_DEF_LENGTH;
 	lset->max_lhdr_sz = rset->max_lhdr_sz = UINT_MAX;
 	/*
-	 * We ignore client's window size until #498, so currently
-	 * we set it to maximum allowed value.
+	 * The streams receive windows start from the initial size and grow
+	 * if they limit the client, see tfw_h2_stream_wnd_tune().
 	 */
-	lset->wnd_sz = rset->wnd_sz = MAX_WND_SIZE;
+	lset->wnd_sz = STREAM_WND_INIT_SIZE;
+	rset->wnd_sz = DEF_WND_SIZE;
+
+	frang_h2_rates_init(&ctx->frate);
 
 	return tfw_hpack_init(&ctx->hpack, HPACK_TABLE_DEF_SIZE);
 }
@@ -230,6 +247,8 @@ void
 tfw_h2_context_clear(TfwH2Ctx *ctx)
 {
 	WARN_ON_ONCE(ctx->streams_num);
+	ss_skb_queue_purge(&ctx->ctrl);
+	tfw_h2_sched_release(&ctx->sched);
 	tfw_hpack_clean(&ctx->hpack);
 }
 
@@ -253,10 +272,54 @@ tfw_h2_unpack_priority(TfwFramePri *pri, const unsigned char *buf)
 	pri->weight = buf[4] + 1;
 }
 
+/*
+ * Move the control frames, accumulated while the received frames are
+ * processed, to the head of @msg, so they are sent in the same TLS record with
+ * the rest of @msg. Called under @ctx->lock.
+ */
+static void
+__tfw_h2_ctrl_take(TfwH2Ctx *ctx, TfwMsg *msg)
+{
+	if (!ctx->ctrl)
+		return;
+	if (msg->skb_head)
+		ss_skb_queue_append(&ctx->ctrl, msg->skb_head);
+	msg->skb_head = ctx->ctrl;
+	msg->len += ctx->ctrl_len;
+	ctx->ctrl = NULL;
+	ctx->ctrl_len = 0;
+}
+
+/*
+ * Send the accumulated control frames and stop the accumulation at the end of
+ * the received data processing.
+ */
+static int
+tfw_h2_ctrl_flush(TfwH2Ctx *ctx)
+{
+	int r = 0;
+	TfwMsg msg = {};
+	TfwConn *conn = (TfwConn *)container_of(ctx, TfwH2Conn, h2);
+
+	spin_lock(&ctx->lock);
+	ctx->ctrl_defer = false;
+	__tfw_h2_ctrl_take(ctx, &msg);
+	spin_unlock(&ctx->lock);
+
+	if (msg.skb_head && (r = tfw_connection_send(conn, &msg)))
+		ss_skb_queue_purge(&msg.skb_head);
+
+	return r;
+}
+
 /**
  * Prepare and send HTTP/2 frame to the client; @hdr must contain
  * the valid data to fill in the frame's header; @data may carry
- * additional data as frame's payload.
+ * additional data as frame's payload. While the received frames are
+ * processed, the frame is accumulated with the other control frames,
+ * which are sent at the end of the processing or with the response data.
+ * GOAWAY frame, which closes the connection, is sent right away after the
+ * accumulated frames.
  *
  * NOTE: Caller must leave first chunk of @data unoccupied - to
  * provide the place for frame's header which will be packed and
@@ -290,6 +353,22 @@ __tfw_h2_send_frame(TfwH2Ctx *ctx, TfwFrameHdr *hdr, TfwStr *data, bool close)
 	if ((r = tfw_msg_write(&it, data)))
 		goto err;
 
+	spin_lock(&ctx->lock);
+	if (close) {
+		__tfw_h2_ctrl_take(ctx, &msg);
+		ctx->ctrl_defer = false;
+	}
+	else if (ctx->ctrl_defer) {
+		if (ctx->ctrl)
+			ss_skb_queue_append(&ctx->ctrl, msg.skb_head);
+		else
+			ctx->ctrl = msg.skb_head;
+		ctx->ctrl_len += msg.len;
+		spin_unlock(&ctx->lock);
+		return 0;
+	}
+	spin_unlock(&ctx->lock);
+
 	if (close)
 		msg.ss_flags |= SS_F_CONN_CLOSE;
 
@@ -373,6 +452,45 @@ tfw_h2_send_wnd_update(TfwH2Ctx *ctx, unsigned int id, unsigned int wnd_incr)
 	return tfw_h2_send_frame(ctx, &hdr, &data);
 }
 
+/*
+ * Send WINDOW_UPDATE frames for stream @id and for the connection in one
+ * message: the stream frame is packed right after the payload of the
+ * connection frame. Zero increment means that the frame isn't needed.
+ */
+static int
+tfw_h2_send_wnd_updates(TfwH2Ctx *ctx, unsigned int id, unsigned int s_incr,
+			unsigned int c_incr)
+{
+	unsigned char buf[WND_INCREMENT_SIZE * 2 + FRAME_HEADER_SIZE];
+	TfwStr data = {
+		.chunks = (TfwStr []){
+			{},
+			{ .data = buf, .len = sizeof(buf) }
+		},
+		.len = sizeof(buf),
+		.nchunks = 2
+	};
+	TfwFrameHdr hdr = {
+		.length = WND_INCREMENT_SIZE,
+		.stream_id = id,
+		.type = HTTP2_WINDOW_UPDATE,
+		.flags = 0
+	};
+
+	if (!c_incr)
+		return tfw_h2_send_wnd_update(ctx, id, s_incr);
+	if (!s_incr)
+		return tfw_h2_send_wnd_update(ctx, 0, c_incr);
+
+	*(unsigned int *)buf = htonl(c_incr);
+	tfw_h2_pack_frame_header(buf + WND_INCREMENT_SIZE, &hdr);
+	*(unsigned int *)(buf + WND_INCREMENT_SIZE + FRAME_HEADER_SIZE)
+		= htonl(s_incr);
+	hdr.stream_id = 0;
+
+	return tfw_h2_send_frame(ctx, &hdr, &data);
+}
+
 static inline int
 tfw_h2_send_settings_init(TfwH2Ctx *ctx)
 {
@@ -451,8 +569,8 @@ tfw_h2_send_goaway(TfwH2Ctx *ctx, TfwH2Err err_code)
 	return tfw_h2_send_frame_close(ctx, &hdr, &data);
 }
 
-int
-tfw_h2_send_rst_stream(TfwH2Ctx *ctx, unsigned int id, TfwH2Err err_code)
+static int
+__tfw_h2_send_rst_stream(TfwH2Ctx *ctx, unsigned int id, TfwH2Err err_code)
 {
 	unsigned char buf[ERR_CODE_SIZE];
 	TfwStr data = {
@@ -475,6 +593,84 @@ tfw_h2_send_rst_stream(TfwH2Ctx *ctx, unsigned int id, TfwH2Err err_code)
 	return tfw_h2_send_frame(ctx, &hdr, &data);
 }
 
+static void __tfw_h2_stream_xmit_drop(TfwStream *stream);
+
+/*
+ * Reset stream @id. Response data queued in the stream must not follow
+ * the RST_STREAM frame, so it's dropped.
+ */
+int
+tfw_h2_send_rst_stream(TfwH2Ctx *ctx, unsigned int id, TfwH2Err err_code)
+{
+	int r;
+	TfwStream *stream;
+
+	spin_lock(&ctx->xmit_lock);
+
+	spin_lock(&ctx->lock);
+	if ((stream = tfw_h2_find_stream(&ctx->sched, id)))
+		__tfw_h2_stream_xmit_drop(stream);
+	spin_unlock(&ctx->lock);
+
+	r = __tfw_h2_send_rst_stream(ctx, id, err_code);
+
+	spin_unlock(&ctx->xmit_lock);
+
+	return r;
+}
+
+/**
+ * Send 103 (Early Hints) interim response with Link header value @link of
+ * @len bytes on the stream of @req, RFC 8297. The header block consists of
+ * literal fields without indexing only, so it doesn't change the HPACK
+ * encoder state and can be sent aside of the responses. The stream is left
+ * open for the final response.
+ */
+int
+tfw_h2_send_early_hints(TfwHttpReq *req, const char *link, unsigned long len)
+{
+	int r;
+	unsigned int id;
+	unsigned char *buf, *p, *end;
+	TfwH2Ctx *ctx = tfw_h2_context(req->conn);
+	/* ':status: 103', the name is indexed by the static table. */
+	static const unsigned char status[] = { 0x08, 0x03, '1', '0', '3' };
+	TfwStr data = {
+		.chunks = (TfwStr []){ {}, {} },
+		.nchunks = 2
+	};
+	TfwFrameHdr hdr = {
+		.type = HTTP2_HEADERS,
+		.flags = HTTP2_F_END_HEADERS
+	};
+
+	if (!(id = tfw_h2_stream_id(req)))
+		return 0;
+	/* The header block and the length prefixes of the link value. */
+	if (!(buf = tfw_pool_alloc(req->pool, len + 16)))
+		return -ENOMEM;
+	end = buf + len + 16;
+
+	memcpy_fast(buf, status, sizeof(status));
+	p = tfw_hpack_srv_write(buf + sizeof(status), end, "link", 4, link,
+				len);
+	if (WARN_ON_ONCE(!p) || p - buf > ctx->rsettings.max_frame_sz)
+		return -E2BIG;
+
+	__TFW_STR_CH(&data, 1)->data = (char *)buf;
+	__TFW_STR_CH(&data, 1)->len = p - buf;
+	data.len = p - buf;
+	hdr.length = data.len;
+	hdr.stream_id = id;
+
+	/* Don't break a header block of a response being sent. */
+	spin_lock(&ctx->xmit_lock);
+	r = tfw_h2_send_frame(ctx, &hdr, &data);
+	spin_unlock(&ctx->xmit_lock);
+
+	return r;
+}
+
 void
 tfw_h2_conn_terminate_close(TfwH2Ctx *ctx, TfwH2Err err_code, bool close)
 {
@@ -542,9 +738,10 @@ tfw_h2_headers_pri_process(TfwH2Ctx *ctx)
 
 /*
  * Create a new stream and add it to the streams storage and to the dependency
- * tree. Note, that we do not need to protect the streams storage in @sched from
- * concurrent access, since all operations with it (adding, searching and
- * deletion) are done only in receiving flow of Frame layer.
+ * tree. The streams storage in @sched is modified only in receiving flow of
+ * Frame layer, so the flow searches the streams without locking, but the
+ * modifications are done under @ctx->lock, since the responses sending flow
+ * looks up the streams and schedules them, see tfw_h2_stream_xmit().
  */
 static TfwStream *
 tfw_h2_stream_create(TfwH2Ctx *ctx, unsigned int id)
@@ -552,17 +749,32 @@ tfw_h2_stream_create(TfwH2Ctx *ctx, unsigned int id)
 	TfwStream *stream, *dep = NULL;
 	TfwFramePri *pri = &ctx->priority;
 	bool excl = pri->exclusive;
+	unsigned short weight = pri->weight;
 
 	if (tfw_h2_find_stream_dep(&ctx->sched, pri->stream_id, &dep))
 		return NULL;
+	/* Dependency on a stream, which isn't in the tree, RFC 7540 5.3.1. */
+	if (pri->stream_id && !dep) {
+		weight = 0;
+		excl = false;
+	}
+
+	spin_lock(&ctx->lock);
+
+	stream = tfw_h2_add_stream(&ctx->sched, id, weight,
+				   ctx->lsettings.wnd_sz);
+	if (stream) {
+		stream->rem_wnd = ctx->rsettings.wnd_sz;
+		stream->loc_wnd_sz = ctx->lsettings.wnd_sz;
+		stream->wnd_ts = ktime_get_ns();
+		tfw_h2_add_stream_dep(&ctx->sched, stream, dep, excl);
+	}
+
+	spin_unlock(&ctx->lock);
 
-	stream = tfw_h2_add_stream(&ctx->sched, id, pri->weight,
-				      ctx->lsettings.wnd_sz);
 	if (!stream)
 		return NULL;
 
-	tfw_h2_add_stream_dep(&ctx->sched, stream, dep, excl);
-
 	++ctx->streams_num;
 
 	T_DBG3("%s: stream added, id=%u, stream=[%p] weight=%hu,"
@@ -576,8 +788,12 @@ tfw_h2_stream_create(TfwH2Ctx *ctx, unsigned int id)
 static inline void
 tfw_h2_stream_clean(TfwH2Ctx *ctx, TfwStream *stream)
 {
+	spin_lock(&ctx->lock);
 	tfw_h2_stop_stream(&ctx->sched, stream);
-	tfw_h2_delete_stream(stream);
+	ss_skb_queue_purge(&stream->xmit);
+	tfw_h2_sched_free_stream(&ctx->sched, stream);
+	spin_unlock(&ctx->lock);
+
 	--ctx->streams_num;
 }
 
@@ -752,148 +968,612 @@ tfw_h2_stream_id_close(TfwHttpReq *req, unsigned char type,
 	return id;
 }
 
-/*
- * Clean the queue of closed streams if its size has exceeded a certain
- * value.
+/**
+ * Whether DATA frames of stream @id still wait for room in the flow control
+ * windows or in the socket. The next part of a streamed response waits for
+ * more response data or the response end, whichever comes first, so the
+ * upstream data isn't accumulated in the stream.
  */
-static void
-tfw_h2_closed_streams_shrink(TfwH2Ctx *ctx)
+bool
+tfw_h2_stream_xmit_pending(TfwH2Ctx *ctx, unsigned int id)
 {
-	TfwStream *cur;
-	unsigned int max_streams = ctx->lsettings.max_streams;
-	TfwClosedQueue *hclosed_streams = &ctx->hclosed_streams;
+	bool r;
+	TfwStream *stream;
 
-	while (1)
-	{
-		spin_lock(&ctx->lock);
+	spin_lock(&ctx->lock);
+	stream = tfw_h2_find_stream(&ctx->sched, id);
+	r = stream && stream->xmit;
+	spin_unlock(&ctx->lock);
 
-		if (hclosed_streams->num <= TFW_MAX_CLOSED_STREAMS
-		    || (max_streams == ctx->streams_num
-			&& hclosed_streams->num))
-		{
-			spin_unlock(&ctx->lock);
-			break;
-		}
+	return r;
+}
 
-		BUG_ON(list_empty(&hclosed_streams->list));
-		cur = list_first_entry(&hclosed_streams->list, TfwStream,
-				       hcl_node);
-		__tfw_h2_stream_unlink(ctx, cur);
+/*
+ * ------------------------------------------------------------------------
+ *	Responses sending
+ * ------------------------------------------------------------------------
+ */
 
-		spin_unlock(&ctx->lock);
+/* Copy @len bytes at offset @off of skb list @skb_head to @buf. */
+static int
+tfw_h2_skb_peek(struct sk_buff *skb_head, unsigned long off,
+		unsigned char *buf, unsigned int len)
+{
+	unsigned int n;
+	struct sk_buff *skb = skb_head;
+
+	do {
+		if (off < skb->len) {
+			n = min_t(unsigned long, len, skb->len - off);
+			if (skb_copy_bits(skb, off, buf, n))
+				return -EFAULT;
+			buf += n;
+			len -= n;
+			off = 0;
+		} else {
+			off -= skb->len;
+		}
+		skb = skb->next;
+	} while (len && skb != skb_head);
 
-		tfw_h2_stream_clean(ctx, cur);
-	}
+	return len ? -EINVAL : 0;
 }
 
-static inline void
-tfw_h2_check_closed_stream(TfwH2Ctx *ctx)
+/*
+ * Move the first @n bytes of skb list @from to the tail of list @to, the skb
+ * containing the boundary is split.
+ */
+static int
+tfw_h2_skb_queue_move(struct sk_buff **from, struct sk_buff **to,
+		      unsigned long n)
 {
-	BUG_ON(!ctx->cur_stream);
-
-	T_DBG3("%s: stream->id=%u, stream->state=%d, stream=[%p], streams_num="
-	       "%lu\n", __func__, ctx->cur_stream->id, ctx->cur_stream->state,
-	       ctx->cur_stream, ctx->streams_num);
+	struct sk_buff *skb, *tail;
+
+	while (n) {
+		if (WARN_ON_ONCE(!(skb = ss_skb_dequeue(from))))
+			return -EINVAL;
+		if (skb->len > n) {
+			if (!(tail = ss_skb_split(skb, n))) {
+				ss_skb_queue_tail(from, skb);
+				*from = skb;
+				return -ENOMEM;
+			}
+			ss_skb_queue_tail(from, tail);
+			*from = tail;
+		}
+		n -= skb->len;
+		ss_skb_queue_tail(to, skb);
+	}
 
-	if (tfw_h2_stream_is_closed(ctx->cur_stream))
-		tfw_h2_current_stream_remove(ctx);
+	return 0;
 }
 
-static inline int
-tfw_h2_stream_state_process(TfwH2Ctx *ctx)
+/* Put DATA frame header @hdr in a new skb at the head or the tail of a list. */
+static int
+tfw_h2_skb_queue_data_hdr(struct sk_buff **skb_head, const TfwFrameHdr *hdr,
+			  bool head)
 {
-	TfwFrameHdr *hdr = &ctx->hdr;
+	struct sk_buff *skb = ss_skb_alloc(FRAME_HEADER_SIZE);
 
-	STREAM_RECV_PROCESS(ctx, hdr);
-
-	tfw_h2_check_closed_stream(ctx);
+	if (unlikely(!skb))
+		return -ENOMEM;
+	tfw_h2_pack_frame_header(skb_put(skb, FRAME_HEADER_SIZE), hdr);
+	ss_skb_queue_tail(skb_head, skb);
+	if (head)
+		*skb_head = skb;
 
-	return T_OK;
+	return 0;
 }
 
+/*
+ * Move first @len bytes of the payload of DATA frame @hdr, which doesn't fit
+ * the flow control windows, from the head of list @from to list @to. The
+ * frame header is replaced by the headers of the moved part and of the rest
+ * of the frame, only the last one keeps END_STREAM flag. @hdr is updated to
+ * the moved frame.
+ */
 static int
-tfw_h2_headers_process(TfwH2Ctx *ctx)
+tfw_h2_data_split(struct sk_buff **from, struct sk_buff **to,
+		  TfwFrameHdr *hdr, unsigned int len)
 {
-	TfwFrameHdr *hdr = &ctx->hdr;
+	int r;
+	struct sk_buff *skb = NULL;
+	TfwFrameHdr rest = *hdr;
+
+	r = tfw_h2_skb_queue_move(from, &skb, FRAME_HEADER_SIZE);
+	ss_skb_queue_purge(&skb);
+	if (unlikely(r))
+		return r;
+
+	hdr->length = len;
+	hdr->flags &= ~HTTP2_F_END_STREAM;
+	rest.length -= len;
+	if ((r = tfw_h2_skb_queue_data_hdr(to, hdr, false))
+	    || (r = tfw_h2_skb_queue_move(from, to, len)))
+		return r;
+
+	return tfw_h2_skb_queue_data_hdr(from, &rest, true);
+}
 
-	T_DBG3("%s: stream->id=%u, cur_stream=[%p]\n", __func__,
-	       hdr->stream_id, ctx->cur_stream);
-	/*
-	 * Stream cannot depend on itself (see RFC 7540 section 5.1.2 for
-	 * details).
-	 */
-	if (ctx->priority.stream_id == hdr->stream_id) {
-		T_DBG("Invalid dependency: new stream with %u depends on"
-		      " itself\n", hdr->stream_id);
+/* Drop the response data queued in @stream. Called under @ctx->lock. */
+static void
+__tfw_h2_stream_xmit_drop(TfwStream *stream)
+{
+	ss_skb_queue_purge(&stream->xmit);
+	stream->xmit_len = 0;
+	tfw_h2_sched_deactivate(stream);
+}
 
-		ctx->state = HTTP2_IGNORE_FRAME_DATA;
+/*
+ * Send @msg to the client and account its bytes in flight until the client
+ * acknowledges them. sk_wmem_queued can't be used for that, since ss_send()
+ * passes the data to the socket asynchronously, through the work queue, so
+ * it lags behind the sent data. Called under @ctx->xmit_lock.
+ */
+static int
+__tfw_h2_xmit_send(TfwH2Ctx *ctx, TfwMsg *msg)
+{
+	TfwConn *conn = (TfwConn *)container_of(ctx, TfwH2Conn, h2);
+	struct sock *sk = READ_ONCE(conn->sk);
+	struct sk_buff *skb = msg->skb_head;
+	unsigned long len = 0;
+	int r;
 
-		if (!STREAM_SEND_PROCESS(ctx->cur_stream, HTTP2_RST_STREAM, 0))
-			return tfw_h2_stream_close(ctx, hdr->stream_id,
-						   &ctx->cur_stream,
-						   HTTP2_ECODE_PROTO);
-		return T_OK;
+	if (skb) {
+		do {
+			len += skb->len;
+			skb = skb->next;
+		} while (skb != msg->skb_head);
 	}
 
-	if (!ctx->cur_stream) {
-		ctx->cur_stream = tfw_h2_stream_create(ctx, hdr->stream_id);
-		if (!ctx->cur_stream)
-			return T_DROP;
-		ctx->lstream_id = hdr->stream_id;
-	}
-	/*
-	 * Since the same received HEADERS frame can cause the stream to become
-	 * 'open' (i.e. created) and right away become 'half-closed (remote)'
-	 * (in case of both END_STREAM and END_HEADERS flags set in initial
-	 * HEADERS frame), we should process its state here - when frame is
-	 * fully received and new stream is created.
-	 */
-	return tfw_h2_stream_state_process(ctx);
+	if ((r = tfw_cli_conn_send((TfwCliConn *)conn, msg)) || !sk || !len)
+		return r;
+	if (!ctx->xmit_inflight)
+		ctx->xmit_una = READ_ONCE(tcp_sk(sk)->snd_una);
+	ctx->xmit_inflight += len;
+
+	return 0;
 }
 
+/*
+ * Send the DATA frames queued in the streams, in the order defined by the
+ * streams scheduler, while the socket has room for them. The rest of the data
+ * waits until the client acknowledges the data in flight, so the data of the
+ * streams with higher priorities, which come later, doesn't wait behind the
+ * data already sent to the socket. The frames are sent within the client's
+ * flow control windows, the streams, which exhausted their windows, are
+ * deactivated until WINDOW_UPDATE frames. Called under @ctx->xmit_lock.
+ */
 static int
-tfw_h2_wnd_update_process(TfwH2Ctx *ctx)
+__tfw_h2_xmit_flush(TfwH2Ctx *ctx)
 {
-	unsigned int wnd_incr;
-	TfwFrameHdr *hdr = &ctx->hdr;
+	int r = 0;
+	long room, wnd;
+	unsigned long n;
+	TfwStream *stream;
+	TfwFrameHdr hdr;
+	TfwMsg msg = {};
+	unsigned char buf[FRAME_HEADER_SIZE];
+	TfwConn *conn = (TfwConn *)container_of(ctx, TfwH2Conn, h2);
+	struct sock *sk = READ_ONCE(conn->sk);
 
-	wnd_incr = ntohl(*(unsigned int *)ctx->rbuf) & ((1U << 31) - 1);
-	if (wnd_incr) {
-		/*
-		 * TODO #498: apply new window size for entire connection or
-		 * particular stream.
-		 */
-		return T_OK;
-	}
+	if (!sk)
+		return 0;
+	room = READ_ONCE(sk->sk_sndbuf) - ctx->xmit_inflight;
 
-	if (!ctx->cur_stream) {
-		tfw_h2_conn_terminate(ctx, HTTP2_ECODE_PROTO);
-		return T_DROP;
+	spin_lock(&ctx->lock);
+
+	__tfw_h2_ctrl_take(ctx, &msg);
+	room -= msg.len;
+
+	while (room > 0 && (stream = tfw_h2_sched_next(&ctx->sched))) {
+		r = tfw_h2_skb_peek(stream->xmit, 0, buf, sizeof(buf));
+		if (unlikely(r))
+			break;
+		tfw_h2_unpack_frame_header(&hdr, buf);
+		n = FRAME_HEADER_SIZE + hdr.length;
+
+		if (hdr.type != HTTP2_DATA || !hdr.length) {
+			r = tfw_h2_skb_queue_move(&stream->xmit,
+						  &msg.skb_head, n);
+		} else {
+			wnd = min(stream->rem_wnd, ctx->rem_wnd);
+			if (wnd <= 0) {
+				if (ctx->rem_wnd <= 0)
+					break;
+				tfw_h2_sched_deactivate(stream);
+				continue;
+			}
+			if (hdr.length > wnd) {
+				r = tfw_h2_data_split(&stream->xmit,
+						      &msg.skb_head, &hdr, wnd);
+				/* The rest of the frame got its own header. */
+				stream->xmit_len += FRAME_HEADER_SIZE;
+				n = FRAME_HEADER_SIZE + hdr.length;
+			} else {
+				r = tfw_h2_skb_queue_move(&stream->xmit,
+							  &msg.skb_head, n);
+			}
+			stream->rem_wnd -= hdr.length;
+			ctx->rem_wnd -= hdr.length;
+		}
+		if (unlikely(r))
+			break;
+
+		msg.len += n;
+		room -= n;
+		stream->xmit_len -= n;
+		tfw_h2_sched_account(stream, n);
+		if (!stream->xmit)
+			tfw_h2_sched_deactivate(stream);
 	}
+	/* WINDOW_UPDATE resumes sending, if the flow control blocked it. */
+	ctx->xmit_wait = room <= 0 && !list_empty(&ctx->sched.root.active);
 
-	if (STREAM_SEND_PROCESS(ctx->cur_stream, HTTP2_RST_STREAM, 0))
-		return T_OK;
+	spin_unlock(&ctx->lock);
 
-	return tfw_h2_stream_close(ctx, hdr->stream_id, &ctx->cur_stream,
-				   HTTP2_ECODE_PROTO);
+	if (msg.skb_head && !r)
+		r = __tfw_h2_xmit_send(ctx, &msg);
+	ss_skb_queue_purge(&msg.skb_head);
+
+	return r;
 }
 
-static inline int
-tfw_h2_priority_process(TfwH2Ctx *ctx)
+static int
+tfw_h2_xmit_flush(TfwH2Ctx *ctx)
 {
-	TfwFrameHdr *hdr = &ctx->hdr;
-	TfwFramePri *pri = &ctx->priority;
+	int r;
 
-	tfw_h2_unpack_priority(pri, ctx->rbuf);
+	spin_lock(&ctx->xmit_lock);
+	r = __tfw_h2_xmit_flush(ctx);
+	spin_unlock(&ctx->xmit_lock);
 
-	if (pri->stream_id != hdr->stream_id) {
-		T_DBG3("%s: parsed, stream_id=%u, dep_stream_id=%u, weight=%hu,"
-		       " excl=%hhu\n", __func__, hdr->stream_id, pri->stream_id,
-		       pri->weight, pri->exclusive);
+	return r;
+}
 
-		tfw_h2_change_stream_dep(&ctx->sched, hdr->stream_id,
+/**
+ * Called by the client socket write space callback, when TCP sends data or
+ * the client acknowledges it. Release the acknowledged bytes from the bytes
+ * in flight and send the queued response data, if it waits for the room.
+ * TLS records overhead is acknowledged as well, so the bytes in flight are
+ * released slightly faster than they're accounted.
+ *
+ * The caller must close the connection on an error.
+ */
+int
+tfw_h2_xmit_wspace(TfwH2Ctx *ctx, struct sock *sk)
+{
+	int r = 0;
+	u32 una = READ_ONCE(tcp_sk(sk)->snd_una);
+
+	spin_lock(&ctx->xmit_lock);
+
+	if (ctx->xmit_inflight) {
+		ctx->xmit_inflight -= (u32)(una - ctx->xmit_una);
+		if (ctx->xmit_inflight < 0)
+			ctx->xmit_inflight = 0;
+		ctx->xmit_una = una;
+	}
+	if (ctx->xmit_wait)
+		r = __tfw_h2_xmit_flush(ctx);
+
+	spin_unlock(&ctx->xmit_lock);
+
+	return r;
+}
+
+/**
+ * Send HTTP/2 frames of a response, or of a part of a streamed response, in
+ * @msg to the client. The header blocks are sent right away, since they must
+ * reach the client in the order of their HPACK encoding, while the DATA
+ * frames are queued in the stream and sent by the streams scheduler. The
+ * DATA frames, which are still queued in the stream, are sent before the
+ * header block, e.g. trailers, to keep the order of the stream frames. The
+ * whole message is sent as is if the stream is already removed or the
+ * connection is being closed. If the caller keeps the message skbs, then
+ * their copy is sent.
+ *
+ * The caller must close the connection on an error.
+ */
+int
+tfw_h2_stream_xmit(TfwH2Ctx *ctx, TfwMsg *msg)
+{
+	int r = 0;
+	TfwStream *stream = NULL;
+	TfwFrameHdr hdr;
+	TfwMsg head = { .ss_flags = msg->ss_flags }, copy = {};
+	unsigned long off = 0, len = 0;
+	struct sk_buff *skb = msg->skb_head;
+	unsigned char buf[FRAME_HEADER_SIZE];
+
+	if (!skb || (msg->ss_flags & SS_F_CONN_CLOSE))
+		goto send;
+	if (msg->ss_flags & SS_F_KEEP_SKB) {
+		/* The data may be queued, so work with its copy. */
+		if ((r = ss_skb_queue_copy(&copy.skb_head, skb)))
+			return r;
+		copy.ss_flags = head.ss_flags = msg->ss_flags & ~SS_F_KEEP_SKB;
+		copy.len = msg->len;
+		msg = &copy;
+		skb = msg->skb_head;
+	}
+	do {
+		len += skb->len;
+		skb = skb->next;
+	} while (skb != msg->skb_head);
+
+	while (off < len) {
+		r = tfw_h2_skb_peek(msg->skb_head, off, buf, sizeof(buf));
+		if (unlikely(r))
+			goto err;
+		tfw_h2_unpack_frame_header(&hdr, buf);
+		if (hdr.type == HTTP2_DATA)
+			break;
+		off += FRAME_HEADER_SIZE + hdr.length;
+	}
+
+	spin_lock(&ctx->xmit_lock);
+
+	spin_lock(&ctx->lock);
+	if ((stream = tfw_h2_find_stream(&ctx->sched, hdr.stream_id))) {
+		if (off && stream->xmit) {
+			head.skb_head = stream->xmit;
+			head.len = stream->xmit_len;
+			stream->xmit = NULL;
+			stream->xmit_len = 0;
+			tfw_h2_sched_deactivate(stream);
+		}
+		r = tfw_h2_skb_queue_move(&msg->skb_head, &head.skb_head, off);
+		head.len += off;
+		if (likely(!r) && msg->skb_head) {
+			if (stream->xmit)
+				ss_skb_queue_append(&stream->xmit,
+						    msg->skb_head);
+			else
+				stream->xmit = msg->skb_head;
+			msg->skb_head = NULL;
+			stream->xmit_len += len - off;
+			tfw_h2_sched_activate(stream);
+		}
+	}
+	__tfw_h2_ctrl_take(ctx, &head);
+	spin_unlock(&ctx->lock);
+
+	if (unlikely(r))
+		goto out;
+	if (head.skb_head)
+		r = __tfw_h2_xmit_send(ctx, &head);
+	if (!r && !stream)
+		r = __tfw_h2_xmit_send(ctx, msg);
+	if (!r)
+		r = __tfw_h2_xmit_flush(ctx);
+out:
+	spin_unlock(&ctx->xmit_lock);
+	ss_skb_queue_purge(&head.skb_head);
+err:
+	ss_skb_queue_purge(&copy.skb_head);
+
+	return r;
+send:
+	/* Keep the order with the DATA frames, which could be sent earlier. */
+	spin_lock(&ctx->xmit_lock);
+	spin_lock(&ctx->lock);
+	__tfw_h2_ctrl_take(ctx, &head);
+	spin_unlock(&ctx->lock);
+	if (head.skb_head)
+		r = __tfw_h2_xmit_send(ctx, &head);
+	if (!r)
+		r = __tfw_h2_xmit_send(ctx, msg);
+	spin_unlock(&ctx->xmit_lock);
+	ss_skb_queue_purge(&head.skb_head);
+
+	return r;
+}
+
+/**
+ * Apply RFC 9218 'priority' header of request @req to its stream. Called in
+ * the receiving flow as soon as the request headers are parsed.
+ */
+void
+tfw_h2_req_set_prio(TfwHttpReq *req)
+{
+	static const TfwStr h_prio = TFW_STR_STRING("priority");
+	bool incr;
+	unsigned char urg;
+	unsigned int hid;
+	unsigned long len;
+	const TfwStr *hdr;
+	char buf[64];
+	TfwH2Ctx *ctx = tfw_h2_context(req->conn);
+
+	hid = __http_hdr_lookup((TfwHttpMsg *)req, &h_prio);
+	if (hid == req->h_tbl->off || !req->stream)
+		return;
+	hdr = &req->h_tbl->tbl[hid];
+	if (TFW_STR_DUP(hdr))
+		hdr = TFW_STR_CHUNK(hdr, 0);
+
+	/* HTTP/2 header name is directly followed by the value. */
+	len = tfw_str_to_cstr(hdr, buf, sizeof(buf));
+	if (len < SLEN("priority")
+	    || tfw_h2_sched_parse_prio(buf + SLEN("priority"), buf + len,
+				       &urg, &incr))
+		return;
+
+	spin_lock(&ctx->lock);
+	tfw_h2_sched_set_prio(req->stream, urg, incr);
+	spin_unlock(&ctx->lock);
+}
+
+/*
+ * Clean the queue of closed streams if its size has exceeded a certain
+ * value.
+ */
+static void
+tfw_h2_closed_streams_shrink(TfwH2Ctx *ctx)
+{
+	TfwStream *cur;
+	unsigned int max_streams = ctx->lsettings.max_streams;
+	TfwClosedQueue *hclosed_streams = &ctx->hclosed_streams;
+
+	while (1)
+	{
+		spin_lock(&ctx->lock);
+
+		if (hclosed_streams->num <= TFW_MAX_CLOSED_STREAMS
+		    || (max_streams == ctx->streams_num
+			&& hclosed_streams->num))
+		{
+			spin_unlock(&ctx->lock);
+			break;
+		}
+
+		BUG_ON(list_empty(&hclosed_streams->list));
+		/* Streams with queued response data are removed later. */
+		list_for_each_entry(cur, &hclosed_streams->list, hcl_node)
+			if (!cur->xmit)
+				break;
+		if (&cur->hcl_node == &hclosed_streams->list) {
+			spin_unlock(&ctx->lock);
+			break;
+		}
+		__tfw_h2_stream_unlink(ctx, cur);
+
+		spin_unlock(&ctx->lock);
+
+		tfw_h2_stream_clean(ctx, cur);
+	}
+}
+
+static inline void
+tfw_h2_check_closed_stream(TfwH2Ctx *ctx)
+{
+	BUG_ON(!ctx->cur_stream);
+
+	T_DBG3("%s: stream->id=%u, stream->state=%d, stream=[%p], streams_num="
+	       "%lu\n", __func__, ctx->cur_stream->id, ctx->cur_stream->state,
+	       ctx->cur_stream, ctx->streams_num);
+
+	if (tfw_h2_stream_is_closed(ctx->cur_stream))
+		tfw_h2_current_stream_remove(ctx);
+}
+
+static inline int
+tfw_h2_stream_state_process(TfwH2Ctx *ctx)
+{
+	TfwFrameHdr *hdr = &ctx->hdr;
+
+	STREAM_RECV_PROCESS(ctx, hdr);
+
+	tfw_h2_check_closed_stream(ctx);
+
+	return T_OK;
+}
+
+static int
+tfw_h2_headers_process(TfwH2Ctx *ctx)
+{
+	TfwFrameHdr *hdr = &ctx->hdr;
+
+	T_DBG3("%s: stream->id=%u, cur_stream=[%p]\n", __func__,
+	       hdr->stream_id, ctx->cur_stream);
+	/*
+	 * Stream cannot depend on itself (see RFC 7540 section 5.1.2 for
+	 * details).
+	 */
+	if (ctx->priority.stream_id == hdr->stream_id) {
+		T_DBG("Invalid dependency: new stream with %u depends on"
+		      " itself\n", hdr->stream_id);
+
+		ctx->state = HTTP2_IGNORE_FRAME_DATA;
+
+		if (!STREAM_SEND_PROCESS(ctx->cur_stream, HTTP2_RST_STREAM, 0))
+			return tfw_h2_stream_close(ctx, hdr->stream_id,
+						   &ctx->cur_stream,
+						   HTTP2_ECODE_PROTO);
+		return T_OK;
+	}
+
+	if (!ctx->cur_stream) {
+		ctx->cur_stream = tfw_h2_stream_create(ctx, hdr->stream_id);
+		if (!ctx->cur_stream)
+			return T_DROP;
+		ctx->lstream_id = hdr->stream_id;
+	}
+	/*
+	 * Since the same received HEADERS frame can cause the stream to become
+	 * 'open' (i.e. created) and right away become 'half-closed (remote)'
+	 * (in case of both END_STREAM and END_HEADERS flags set in initial
+	 * HEADERS frame), we should process its state here - when frame is
+	 * fully received and new stream is created.
+	 */
+	return tfw_h2_stream_state_process(ctx);
+}
+
+/*
+ * Apply WINDOW_UPDATE frame to the connection or to the stream send window
+ * and send the data, which waits for the window (RFC 7540 section 6.9).
+ */
+static int
+tfw_h2_wnd_update_process(TfwH2Ctx *ctx)
+{
+	long wnd = 0;
+	unsigned int wnd_incr;
+	TfwFrameHdr *hdr = &ctx->hdr;
+	TfwStream *stream = ctx->cur_stream;
+	TfwH2Err err_code = HTTP2_ECODE_PROTO;
+
+	wnd_incr = ntohl(*(unsigned int *)ctx->rbuf) & ((1U << 31) - 1);
+	if (!wnd_incr)
+		goto err;
+
+	spin_lock(&ctx->lock);
+	if (!hdr->stream_id) {
+		wnd = ctx->rem_wnd += wnd_incr;
+	} else if (stream) {
+		wnd = stream->rem_wnd += wnd_incr;
+		if (stream->xmit && wnd > 0)
+			tfw_h2_sched_activate(stream);
+	}
+	spin_unlock(&ctx->lock);
+
+	if (unlikely(wnd > MAX_WND_SIZE)) {
+		err_code = HTTP2_ECODE_FLOW;
+		goto err;
+	}
+
+	return tfw_h2_xmit_flush(ctx) ? T_DROP : T_OK;
+err:
+	if (!stream) {
+		tfw_h2_conn_terminate(ctx, err_code);
+		return T_DROP;
+	}
+
+	if (STREAM_SEND_PROCESS(stream, HTTP2_RST_STREAM, 0))
+		return T_OK;
+
+	return tfw_h2_stream_close(ctx, hdr->stream_id, &ctx->cur_stream,
+				   err_code);
+}
+
+static inline int
+tfw_h2_priority_process(TfwH2Ctx *ctx)
+{
+	TfwFrameHdr *hdr = &ctx->hdr;
+	TfwFramePri *pri = &ctx->priority;
+
+	tfw_h2_unpack_priority(pri, ctx->rbuf);
+
+	if (pri->stream_id != hdr->stream_id) {
+		T_DBG3("%s: parsed, stream_id=%u, dep_stream_id=%u, weight=%hu,"
+		       " excl=%hhu\n", __func__, hdr->stream_id, pri->stream_id,
+		       pri->weight, pri->exclusive);
+
+		spin_lock(&ctx->lock);
+		tfw_h2_change_stream_dep(&ctx->sched, hdr->stream_id,
 					 pri->stream_id, pri->weight,
 					 pri->exclusive);
+		spin_unlock(&ctx->lock);
 		return T_OK;
 	}
 
@@ -926,6 +1606,10 @@ static int
 tfw_h2_apply_settings_entry(TfwH2Ctx *ctx, unsigned short id,
 			    unsigned int val)
 {
+	int r = T_OK;
+	long delta;
+	TfwStream *stream;
+	struct rb_node *node;
 	TfwSettings *dest = &ctx->rsettings;
 
 	switch (id) {
@@ -948,8 +1632,21 @@ tfw_h2_apply_settings_entry(TfwH2Ctx *ctx, unsigned short id,
 	case HTTP2_SETTINGS_INIT_WND_SIZE:
 		if (val > MAX_WND_SIZE)
 			return T_BAD;
+		/* Adjust the send windows of all the streams, RFC 7540 6.9.2. */
+		delta = (long)val - dest->wnd_sz;
+		spin_lock(&ctx->lock);
+		for (node = rb_first(&ctx->sched.streams); node;
+		     node = rb_next(node))
+		{
+			stream = rb_entry(node, TfwStream, node);
+			if ((stream->rem_wnd += delta) > MAX_WND_SIZE)
+				r = T_BAD;
+			if (stream->xmit && stream->rem_wnd > 0)
+				tfw_h2_sched_activate(stream);
+		}
 		dest->wnd_sz = val;
-		break;
+		spin_unlock(&ctx->lock);
+		return r;
 
 	case HTTP2_SETTINGS_MAX_FRAME_SIZE:
 		if (val < FRAME_DEF_LENGTH || val > FRAME_MAX_LENGTH)
@@ -1031,6 +1728,38 @@ tfw_h2_goaway_process(TfwH2Ctx *ctx)
 	return T_OK;
 }
 
+/*
+ * PRIORITY_UPDATE frame (RFC 9218 section 7.1) reprioritizes an open stream.
+ * The frames for the streams, which aren't opened yet, are ignored.
+ */
+static int
+tfw_h2_prio_update_process(TfwH2Ctx *ctx)
+{
+	bool incr;
+	unsigned char urg;
+	TfwStream *stream;
+	unsigned int id = ntohl(*(unsigned int *)ctx->rbuf)
+			  & FRAME_STREAM_ID_MASK;
+
+	T_DBG3("%s: parsed, prioritized stream_id=%u\n", __func__, id);
+
+	if (!id) {
+		tfw_h2_conn_terminate(ctx, HTTP2_ECODE_PROTO);
+		return T_DROP;
+	}
+	if (!tfw_h2_sched_parse_prio(ctx->rbuf + STREAM_ID_SIZE,
+				     ctx->rbuf + ctx->to_read, &urg, &incr))
+	{
+		spin_lock(&ctx->lock);
+		if ((stream = tfw_h2_find_stream(&ctx->sched, id)))
+			tfw_h2_sched_set_prio(stream, urg, incr);
+		spin_unlock(&ctx->lock);
+	}
+
+	SET_TO_READ(ctx);
+	return T_OK;
+}
+
 static inline int
 tfw_h2_first_settings_verify(TfwH2Ctx *ctx)
 {
@@ -1107,43 +1836,70 @@ tfw_h2_stream_id_verify(TfwH2Ctx *ctx)
 	return T_OK;
 }
 
+/*
+ * Receive window auto-tuning, similar to TCP receive buffer auto-tuning: if
+ * the client sent a half of the stream window faster than in 2 RTTs, then the
+ * window limits the upload rate and it's doubled. The connection receive
+ * window is kept at the maximum size, so it never limits the streams.
+ */
+static void
+tfw_h2_stream_wnd_tune(TfwH2Ctx *ctx, TfwStream *stream)
+{
+	u64 rtt, now = ktime_get_ns();
+	TfwConn *conn = (TfwConn *)container_of(ctx, TfwH2Conn, h2);
+	struct sock *sk = READ_ONCE(conn->sk);
+
+	/* Don't buffer much of uploaded data if memory is short. */
+	if (unlikely(tfw_mem_pressure() >= TFW_MEM_SHORT)) {
+		stream->loc_wnd_sz = max_t(unsigned int,
+					   stream->loc_wnd_sz / 2,
+					   STREAM_WND_INIT_SIZE);
+	} else if (sk && stream->loc_wnd_sz < STREAM_WND_MAX_SIZE) {
+		rtt = (u64)(tcp_sk(sk)->srtt_us >> 3) * NSEC_PER_USEC;
+		if (now - stream->wnd_ts < 2 * rtt)
+			stream->loc_wnd_sz = min(stream->loc_wnd_sz * 2,
+						 STREAM_WND_MAX_SIZE);
+	}
+	stream->wnd_ts = now;
+}
+
 static inline int
 tfw_h2_flow_control(TfwH2Ctx *ctx)
 {
+	unsigned int s_incr = 0, c_incr = 0;
 	TfwFrameHdr *hdr = &ctx->hdr;
 	TfwStream *stream = ctx->cur_stream;
-	TfwSettings *lset = &ctx->lsettings;
 
 	BUG_ON(!stream);
-	if (hdr->length > stream->loc_wnd)
-		T_WARN("Stream flow control window exceeded: frame payload %d,"
-		       " current window %u\n", hdr->length, stream->loc_wnd);
-
-	if(hdr->length > ctx->loc_wnd)
-		T_WARN("Connection flow control window exceeded: frame payload"
-		       " %d, current window %u\n", hdr->length, ctx->loc_wnd);
+	if (hdr->length > stream->loc_wnd || hdr->length > ctx->loc_wnd) {
+		T_WARN("Flow control window exceeded: frame payload %d,"
+		       " stream window %u, connection window %u\n",
+		       hdr->length, stream->loc_wnd, ctx->loc_wnd);
+		tfw_h2_conn_terminate(ctx, HTTP2_ECODE_FLOW);
+		return T_DROP;
+	}
 
 	stream->loc_wnd -= hdr->length;
 	ctx->loc_wnd -= hdr->length;
 
-	if (stream->loc_wnd <= lset->wnd_sz / 2) {
-		if( tfw_h2_send_wnd_update(ctx, stream->id,
-					   lset->wnd_sz - stream->loc_wnd))
-		{
-			return T_DROP;
-		}
-		stream->loc_wnd = lset->wnd_sz;
+	/* The client doesn't send data in the stream after END_STREAM. */
+	if (!(hdr->flags & HTTP2_F_END_STREAM)
+	    && stream->loc_wnd <= stream->loc_wnd_sz / 2)
+	{
+		tfw_h2_stream_wnd_tune(ctx, stream);
+		s_incr = stream->loc_wnd_sz - stream->loc_wnd;
+		stream->loc_wnd = stream->loc_wnd_sz;
 	}
-
-
 	if (ctx->loc_wnd <= MAX_WND_SIZE / 2) {
-		if (tfw_h2_send_wnd_update(ctx, 0, MAX_WND_SIZE - ctx->loc_wnd))
-		{
-			return T_DROP;
-		}
+		c_incr = MAX_WND_SIZE - ctx->loc_wnd;
 		ctx->loc_wnd = MAX_WND_SIZE;
 	}
 
+	/* Both the window updates are sent in one message. */
+	if ((s_incr || c_incr)
+	    && tfw_h2_send_wnd_updates(ctx, stream->id, s_incr, c_incr))
+		return T_DROP;
+
 	return T_OK;
 }
 
@@ -1242,6 +1998,10 @@ tfw_h2_frame_type_process(TfwH2Ctx *ctx)
 			goto conn_term;
 		}
 
+		if (!hdr->length && !(hdr->flags & HTTP2_F_END_STREAM)
+		    && frang_h2_frame_limit(ctx, HTTP2_FLIM_EMPTY))
+			goto flood;
+
 		if (tfw_h2_flow_control(ctx))
 			return T_DROP;
 
@@ -1274,6 +2034,9 @@ tfw_h2_frame_type_process(TfwH2Ctx *ctx)
 		if (!ctx->cur_stream) {
 			unsigned int max_streams = ctx->lsettings.max_streams;
 
+			if (frang_h2_frame_limit(ctx, HTTP2_FLIM_STREAM))
+				goto flood;
+
 			WARN_ON_ONCE(max_streams < ctx->streams_num);
 			tfw_h2_closed_streams_shrink(ctx);
 
@@ -1354,6 +2117,8 @@ tfw_h2_frame_type_process(TfwH2Ctx *ctx)
 		{
 			goto conn_term;
 		}
+		if (frang_h2_frame_limit(ctx, HTTP2_FLIM_SETTINGS))
+			goto flood;
 
 		if (hdr->flags & HTTP2_F_ACK)
 			tfw_h2_settings_ack_process(ctx);
@@ -1384,6 +2149,8 @@ tfw_h2_frame_type_process(TfwH2Ctx *ctx)
 		}
 		if (hdr->length != FRAME_PING_SIZE)
 			goto conn_term;
+		if (frang_h2_frame_limit(ctx, HTTP2_FLIM_PING))
+			goto flood;
 
 		ctx->state = HTTP2_RECV_FRAME_PING;
 		SET_TO_READ(ctx);
@@ -1397,6 +2164,8 @@ tfw_h2_frame_type_process(TfwH2Ctx *ctx)
 		}
 		if (hdr->length != FRAME_RST_STREAM_SIZE)
 			goto conn_term;
+		if (frang_h2_frame_limit(ctx, HTTP2_FLIM_RST))
+			goto flood;
 		/*
 		 * RST_STREAM frames are not allowed for idle streams (see RFC
 		 * 7540 section 5.1 and section 6.4 for details).
@@ -1432,14 +2201,28 @@ tfw_h2_frame_type_process(TfwH2Ctx *ctx)
 		hdr->length -= ctx->to_read;
 		return T_OK;
 
-	case HTTP2_CONTINUATION:
-		if (!hdr->stream_id) {
+	case HTTP2_PRIORITY_UPDATE:
+		/* RFC 9218 section 7.1. */
+		if (hdr->stream_id) {
 			err_code = HTTP2_ECODE_PROTO;
 			goto conn_term;
 		}
-		/*
-		 * CONTINUATION frames are not allowed for idle streams (see
-		 * RFC 7540 section 5.1 and section 6.4 for details).
+		if (hdr->length < STREAM_ID_SIZE)
+			goto conn_term;
+
+		ctx->state = HTTP2_RECV_FRAME_PRIO_UPDATE;
+		ctx->to_read = min_t(int, hdr->length, FRAME_RBUF_SIZE);
+		hdr->length -= ctx->to_read;
+		return T_OK;
+
+	case HTTP2_CONTINUATION:
+		if (!hdr->stream_id) {
+			err_code = HTTP2_ECODE_PROTO;
+			goto conn_term;
+		}
+		/*
+		 * CONTINUATION frames are not allowed for idle streams (see
+		 * RFC 7540 section 5.1 and section 6.4 for details).
 		 */
 		if (hdr->stream_id > ctx->lstream_id) {
 			err_code = HTTP2_ECODE_PROTO;
@@ -1453,6 +2236,10 @@ tfw_h2_frame_type_process(TfwH2Ctx *ctx)
 			goto conn_term;
 		}
 
+		if (!hdr->length && !(hdr->flags & HTTP2_F_END_HEADERS)
+		    && frang_h2_frame_limit(ctx, HTTP2_FLIM_EMPTY))
+			goto flood;
+
 		ctx->data_off = FRAME_HEADER_SIZE;
 		ctx->plen = ctx->hdr.length;
 
@@ -1471,6 +2258,9 @@ tfw_h2_frame_type_process(TfwH2Ctx *ctx)
 		return T_OK;
 	}
 
+flood:
+	TFW_INC_STAT_BH(clnt.msgs_filtout);
+	err_code = HTTP2_ECODE_ENHANCE_YOUR_CALM;
 conn_term:
 	BUG_ON(!err_code);
 	tfw_h2_conn_terminate(ctx, err_code);
@@ -1597,7 +2387,7 @@ tfw_h2_frame_recv(void *data, unsigned char *buf, size_t len,
 		if (ctx->to_read)
 			FRAME_FSM_MOVE(HTTP2_RECV_FRAME_SETTINGS);
 
-		if (tfw_h2_send_settings_ack(ctx))
+		if (tfw_h2_send_settings_ack(ctx) || tfw_h2_xmit_flush(ctx))
 			FRAME_FSM_EXIT(T_DROP);
 
 		FRAME_FSM_EXIT(T_OK);
@@ -1615,6 +2405,18 @@ tfw_h2_frame_recv(void *data, unsigned char *buf, size_t len,
 		FRAME_FSM_EXIT(T_OK);
 	}
 
+	T_FSM_STATE(HTTP2_RECV_FRAME_PRIO_UPDATE) {
+		FRAME_FSM_READ_SRVC(ctx->to_read);
+
+		if (tfw_h2_prio_update_process(ctx))
+			FRAME_FSM_EXIT(T_DROP);
+
+		if (ctx->to_read)
+			FRAME_FSM_MOVE(HTTP2_IGNORE_FRAME_DATA);
+
+		FRAME_FSM_EXIT(T_OK);
+	}
+
 	T_FSM_STATE(HTTP2_RECV_HEADER_PRI) {
 		FRAME_FSM_READ_SRVC(ctx->to_read);
 
@@ -1697,8 +2499,8 @@ tfw_h2_context_reinit(TfwH2Ctx *ctx, bool postponed)
 	}
 }
 
-int
-tfw_h2_frame_process(void *c, TfwFsmData *data)
+static int
+__tfw_h2_frame_process(void *c, TfwFsmData *data)
 {
 	int r;
 	bool postponed;
@@ -1819,3 +2621,1730 @@ out:
 	ss_skb_queue_purge(&h2->skb_head);
 	return r;
 }
+
+/*
+ * Process the frames received in @data. The control frames sent in reply,
+ * e.g. SETTINGS and PING acknowledgements, WINDOW_UPDATE and RST_STREAM, are
+ * accumulated and sent in one message, and so in one TLS record, at the end
+ * of the processing, unless response data is sent earlier.
+ */
+int
+tfw_h2_frame_process(void *c, TfwFsmData *data)
+{
+	int r;
+	TfwH2Ctx *h2 = tfw_h2_context(c);
+
+	spin_lock(&h2->lock);
+	h2->ctrl_defer = true;
+	spin_unlock(&h2->lock);
+
+	r = __tfw_h2_frame_process(c, data);
+
+	if (tfw_h2_ctrl_flush(h2) && r != T_DROP) {
+		TFW_INC_STAT_BH(clnt.msgs_otherr);
+		r = T_DROP;
+	}
+
+	return r;
+}
+
+/*
+ * ------------------------------------------------------------------------
+ *	HTTP/2 connections with upstream servers
+ * ------------------------------------------------------------------------
+ *
+ * Tempesta FW speaks HTTP/2 with prior knowledge (h2c) to the servers. The
+ * requests, adjusted to HTTP/1.1 for forwarding, are converted to HEADERS and
+ * DATA frames, and the response frames of each stream are converted back to
+ * HTTP/1.1 and passed to the response parser of the stream, so the rest of
+ * the responses processing doesn't differ from HTTP/1.1 servers. Only the
+ * static HPACK table is used in both directions: the encoder never indexes
+ * the header fields and the servers are asked for zero size dynamic table.
+ */
+
+/* Maximum size of response header block. */
+#define TFW_H2_SRV_BLK_MAX	(16 << 10)
+/* Maximum size of HTTP/1.1 head of response or request. */
+#define TFW_H2_SRV_HEAD_MAX	(64 << 10)
+/* Size of data in linear skbs which fit a page. */
+#define TFW_H2_SRV_SKB_LEN	(SKB_WITH_OVERHEAD(PAGE_SIZE) - MAX_TCP_HEADER)
+
+/**
+ * FSM states for HTTP/2 frames received from servers.
+ */
+typedef enum {
+	HTTP2_SRV_HDR,
+	HTTP2_SRV_PADLEN,
+	HTTP2_SRV_PRI,
+	HTTP2_SRV_HBLK,
+	HTTP2_SRV_DATA,
+	HTTP2_SRV_SRVC,
+	HTTP2_SRV_SETTINGS,
+	HTTP2_SRV_PAD,
+	HTTP2_SRV_SKIP,
+} TfwH2SrvState;
+
+/**
+ * Copy @len bytes of @data to the end of skb list @skb_head, linear skbs are
+ * allocated as needed.
+ */
+static int
+tfw_h2_srv_skb_copy(struct sk_buff **skb_head, const void *data,
+		    unsigned long len)
+{
+	unsigned int n;
+	const char *p = data;
+	struct sk_buff *skb = ss_skb_peek_tail(skb_head);
+
+	while (len) {
+		if (!skb || skb_is_nonlinear(skb) || !skb_tailroom(skb)) {
+			if (!(skb = ss_skb_alloc(TFW_H2_SRV_SKB_LEN)))
+				return -ENOMEM;
+			ss_skb_queue_tail(skb_head, skb);
+		}
+		n = min_t(unsigned long, len, skb_tailroom(skb));
+		memcpy_fast(skb_put(skb, n), p, n);
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * Send a frame of @type with @flags and payload @data of @len bytes for
+ * stream @id to the server.
+ */
+static int
+tfw_h2_srv_send_frame(TfwSrvConn *srv_conn, unsigned char type,
+		      unsigned char flags, unsigned int id, const void *data,
+		      unsigned int len)
+{
+	int r;
+	TfwMsg msg = {};
+	unsigned char buf[FRAME_HEADER_SIZE];
+	TfwFrameHdr hdr = {
+		.length		= len,
+		.stream_id	= id,
+		.type		= type,
+		.flags		= flags
+	};
+
+	tfw_h2_pack_frame_header(buf, &hdr);
+	if (!(r = tfw_h2_srv_skb_copy(&msg.skb_head, buf, sizeof(buf)))
+	    && !(r = tfw_h2_srv_skb_copy(&msg.skb_head, data, len)))
+		r = tfw_connection_send((TfwConn *)srv_conn, &msg);
+	ss_skb_queue_purge(&msg.skb_head);
+
+	return r;
+}
+
+static inline int
+tfw_h2_srv_send_wnd(TfwSrvConn *srv_conn, unsigned int id, unsigned int incr)
+{
+	__be32 val = htonl(incr);
+
+	return tfw_h2_srv_send_frame(srv_conn, HTTP2_WINDOW_UPDATE, 0, id,
+				     &val, sizeof(val));
+}
+
+static inline int
+tfw_h2_srv_send_rst(TfwSrvConn *srv_conn, unsigned int id, TfwH2Err err)
+{
+	__be32 val = htonl(err);
+
+	return tfw_h2_srv_send_frame(srv_conn, HTTP2_RST_STREAM, 0, id,
+				     &val, sizeof(val));
+}
+
+static inline unsigned char *
+tfw_h2_srv_put_setting(unsigned char *p, unsigned short id, unsigned int val)
+{
+	*(__be16 *)p = htons(id);
+	*(__be32 *)(p + SETTINGS_KEY_SIZE) = htonl(val);
+
+	return p + FRAME_SETTINGS_ENTRY_SIZE;
+}
+
+/**
+ * Grow buffer @buf of @sz bytes to contain at least @len bytes, but not more
+ * than @max bytes.
+ */
+static int
+tfw_h2_srv_buf_grow(char **buf, unsigned int *sz, unsigned long len,
+		    unsigned long max)
+{
+	char *p;
+	unsigned long n;
+
+	if (len <= *sz)
+		return 0;
+	if (len > max)
+		return -E2BIG;
+	n = max_t(unsigned long, roundup_pow_of_two(len), 1024);
+	if (!(p = krealloc(*buf, n, GFP_ATOMIC)))
+		return -ENOMEM;
+	*buf = p;
+	*sz = n;
+
+	return 0;
+}
+
+/*
+ * Streams of server connection are erased from the streams storage under
+ * @fwd_qlock of the connection. The frames receiving side frees them on its
+ * own, others pass the closed streams to it, see tfw_h2_srv_reap().
+ */
+static void
+__tfw_h2_srv_stream_erase(TfwH2SrvCtx *ctx, TfwStream *stream)
+{
+	tfw_h2_stop_stream(&ctx->sched, stream);
+	--ctx->streams_num;
+	ss_skb_queue_purge(&stream->xmit);
+	stream->xmit_len = 0;
+}
+
+static inline void
+tfw_h2_srv_stream_close(TfwH2SrvCtx *ctx, TfwStream *stream)
+{
+	__tfw_h2_srv_stream_erase(ctx, stream);
+	list_add_tail(&stream->hcl_node, &ctx->closed);
+}
+
+/**
+ * Free the streams closed on forwarding errors. The stream the current
+ * frame belongs to may be one of them.
+ */
+static void
+tfw_h2_srv_reap(TfwSrvConn *srv_conn, TfwH2SrvCtx *ctx)
+{
+	TfwStream *stream, *tmp;
+	LIST_HEAD(closed);
+
+	if (likely(list_empty(&ctx->closed)))
+		return;
+
+	spin_lock_bh(&srv_conn->fwd_qlock);
+	list_splice_init(&ctx->closed, &closed);
+	tfw_http_fwdq_unlock(srv_conn);
+
+	list_for_each_entry_safe(stream, tmp, &closed, hcl_node) {
+		if (stream == ctx->cur_stream)
+			ctx->cur_stream = NULL;
+		tfw_h2_delete_stream(stream);
+	}
+}
+
+void
+tfw_h2_srv_context_free(TfwH2SrvCtx *ctx)
+{
+	if (!ctx)
+		return;
+	WARN_ON_ONCE(ctx->streams_num || !list_empty(&ctx->closed));
+	kfree(ctx->hblk);
+	kfree(ctx->hout);
+	kfree(ctx->hreq);
+	kfree(ctx);
+}
+
+/**
+ * Initialize HTTP/2 context of server connection @srv_conn on a new
+ * connection to the server and send the connection preface. The buffers of
+ * the previous connection are reused.
+ */
+int
+tfw_h2_srv_conn_init(TfwSrvConn *srv_conn)
+{
+	int r;
+	TfwMsg msg = {};
+	TfwH2SrvCtx *ctx = srv_conn->h2;
+	TfwSettings *rset;
+	TfwFrameHdr hdr = {
+		.length	= FRAME_SETTINGS_ENTRY_SIZE * 3,
+		.type	= HTTP2_SETTINGS
+	};
+	unsigned char buf[FRAME_PREFACE_CLI_MAGIC_LEN + FRAME_HEADER_SIZE * 2
+			  + FRAME_SETTINGS_ENTRY_SIZE * 3
+			  + FRAME_WND_UPDATE_SIZE];
+	unsigned char *p = buf;
+
+	if (!ctx) {
+		if (!(ctx = kzalloc(sizeof(*ctx), GFP_ATOMIC)))
+			return -ENOMEM;
+		srv_conn->h2 = ctx;
+	} else {
+		unsigned char *hblk = ctx->hblk;
+		char *hout = ctx->hout, *hreq = ctx->hreq;
+		unsigned int hblk_sz = ctx->hblk_sz, hout_sz = ctx->hout_sz;
+		unsigned int hreq_sz = ctx->hreq_sz;
+
+		WARN_ON_ONCE(ctx->streams_num);
+		bzero_fast(ctx, sizeof(*ctx));
+		ctx->hblk = hblk;
+		ctx->hblk_sz = hblk_sz;
+		ctx->hout = hout;
+		ctx->hout_sz = hout_sz;
+		ctx->hreq = hreq;
+		ctx->hreq_sz = hreq_sz;
+	}
+	INIT_LIST_HEAD(&ctx->closed);
+	tfw_h2_sched_init(&ctx->sched);
+	ctx->next_id = 1;
+	ctx->loc_wnd = MAX_WND_SIZE;
+	ctx->rem_wnd = DEF_WND_SIZE;
+
+	/* Initial values of server settings, RFC 7540 6.5.2. */
+	rset = &ctx->rsettings;
+	rset->hdr_tbl_sz = HPACK_TABLE_DEF_SIZE;
+	rset->push = 1;
+	/* Don't open too many streams until the server tells its limit. */
+	rset->max_streams = 100;
+	rset->wnd_sz = DEF_WND_SIZE;
+	rset->max_frame_sz = FRAME_DEF_LENGTH;
+	rset->max_lhdr_sz = UINT_MAX;
+
+	memcpy_fast(p, FRAME_PREFACE_CLI_MAGIC, FRAME_PREFACE_CLI_MAGIC_LEN);
+	p += FRAME_PREFACE_CLI_MAGIC_LEN;
+	tfw_h2_pack_frame_header(p, &hdr);
+	p += FRAME_HEADER_SIZE;
+	p = tfw_h2_srv_put_setting(p, HTTP2_SETTINGS_TABLE_SIZE, 0);
+	p = tfw_h2_srv_put_setting(p, HTTP2_SETTINGS_ENABLE_PUSH, 0);
+	p = tfw_h2_srv_put_setting(p, HTTP2_SETTINGS_INIT_WND_SIZE,
+				   MAX_WND_SIZE);
+	hdr.length = FRAME_WND_UPDATE_SIZE;
+	hdr.type = HTTP2_WINDOW_UPDATE;
+	tfw_h2_pack_frame_header(p, &hdr);
+	p += FRAME_HEADER_SIZE;
+	*(__be32 *)p = htonl(MAX_WND_SIZE - DEF_WND_SIZE);
+	p += FRAME_WND_UPDATE_SIZE;
+
+	if ((r = tfw_h2_srv_skb_copy(&msg.skb_head, buf, p - buf))
+	    || (r = tfw_connection_send((TfwConn *)srv_conn, &msg)))
+		ss_skb_queue_purge(&msg.skb_head);
+
+	return r;
+}
+
+/**
+ * The connection with the server is closed. Responses which are being
+ * received are dropped, and the requests forwarded on the open streams are
+ * re-sent with the zero stream ID on the connection repair.
+ */
+void
+tfw_h2_srv_conn_drop(TfwSrvConn *srv_conn)
+{
+	struct rb_root streams;
+	struct rb_node *node;
+	TfwHttpReq *req;
+	TfwStream *stream;
+	TfwH2SrvCtx *ctx = srv_conn->h2;
+
+	if (!ctx)
+		return;
+
+	tfw_h2_srv_reap(srv_conn, ctx);
+
+	spin_lock_bh(&srv_conn->fwd_qlock);
+	streams = ctx->sched.streams;
+	ctx->sched.streams = RB_ROOT;
+	bzero_fast(ctx->sched.slots, sizeof(ctx->sched.slots));
+	ctx->streams_num = 0;
+	list_for_each_entry(req, &srv_conn->fwd_queue, fwd_list)
+		req->sid = 0;
+	tfw_http_fwdq_unlock(srv_conn);
+
+	while ((node = rb_first(&streams))) {
+		stream = rb_entry(node, TfwStream, node);
+		rb_erase(node, &streams);
+		tfw_http_srv_stream_drop(stream);
+		ss_skb_queue_purge(&stream->xmit);
+		tfw_h2_delete_stream(stream);
+	}
+
+	ctx->cur_stream = NULL;
+	ctx->blk_id = 0;
+	ctx->hblk_len = 0;
+	ctx->state = HTTP2_SRV_HDR;
+	ctx->rlen = 0;
+}
+
+/*
+ * ------------------------------------------------------------------------
+ *	Requests forwarding
+ * ------------------------------------------------------------------------
+ */
+
+/**
+ * Move data of request body queued in stream @stream to DATA frames in
+ * @skb_head as long as the flow controlled windows allow. The last frame
+ * ends the stream if the whole body is queued. Called under @fwd_qlock.
+ */
+static int
+tfw_h2_srv_stream_xmit(TfwH2SrvCtx *ctx, TfwStream *stream,
+		       struct sk_buff **skb_head)
+{
+	int r;
+	long wnd;
+	unsigned long n;
+	unsigned char buf[FRAME_HEADER_SIZE];
+	TfwFrameHdr hdr = {
+		.stream_id	= stream->id,
+		.type		= HTTP2_DATA
+	};
+
+	while (!(stream->srv_flags & TFW_H2_SRV_F_END)) {
+		wnd = min(stream->rem_wnd, ctx->rem_wnd);
+		n = min3(stream->xmit_len, (unsigned long)max(wnd, 0L),
+			 (unsigned long)min_t(unsigned int, FRAME_DEF_LENGTH,
+					      ctx->rsettings.max_frame_sz));
+		/* An empty frame is sent only to end the stream. */
+		if (!n && (stream->xmit_len
+			   || !(stream->srv_flags & TFW_H2_SRV_F_BODY)))
+			break;
+
+		hdr.length = n;
+		hdr.flags = ((stream->srv_flags & TFW_H2_SRV_F_BODY)
+			     && n == stream->xmit_len)
+			    ? HTTP2_F_END_STREAM : 0;
+		tfw_h2_pack_frame_header(buf, &hdr);
+		if ((r = tfw_h2_srv_skb_copy(skb_head, buf, sizeof(buf))))
+			return r;
+		/* The body skbs are moved after the frame header. */
+		if ((r = tfw_h2_skb_queue_move(&stream->xmit, skb_head, n)))
+			return r;
+		stream->xmit_len -= hdr.length;
+		stream->rem_wnd -= hdr.length;
+		ctx->rem_wnd -= hdr.length;
+		if (hdr.flags)
+			stream->srv_flags |= TFW_H2_SRV_F_END;
+	}
+
+	return 0;
+}
+
+/**
+ * Send the queued request bodies of stream @stream, or all the streams if
+ * @stream is NULL. Called under @fwd_qlock, the caller must close the
+ * connection on an error.
+ */
+static int
+tfw_h2_srv_xmit_flush(TfwSrvConn *srv_conn, TfwStream *stream)
+{
+	int r = 0;
+	struct rb_node *node;
+	TfwMsg msg = {};
+	TfwH2SrvCtx *ctx = srv_conn->h2;
+
+	if (stream) {
+		r = tfw_h2_srv_stream_xmit(ctx, stream, &msg.skb_head);
+	} else {
+		for (node = rb_first(&ctx->sched.streams); node && !r;
+		     node = rb_next(node))
+			r = tfw_h2_srv_stream_xmit(ctx, rb_entry(node, TfwStream,
+								 node),
+						   &msg.skb_head);
+	}
+	if (!r && msg.skb_head)
+		r = tfw_connection_send((TfwConn *)srv_conn, &msg);
+	ss_skb_queue_purge(&msg.skb_head);
+
+	return r;
+}
+
+/*
+ * Header fields which are specific for HTTP/1.1 connections and must not
+ * be sent over HTTP/2, RFC 7540 8.1.2.2.
+ */
+static bool
+tfw_h2_srv_hop_hdr(const char *name, unsigned long len)
+{
+#define HDR_EQ(n)	(len == SLEN(n) && !memcmp(name, n, SLEN(n)))
+	return HDR_EQ("connection") || HDR_EQ("keep-alive")
+	       || HDR_EQ("proxy-connection") || HDR_EQ("transfer-encoding")
+	       || HDR_EQ("upgrade");
+#undef HDR_EQ
+}
+
+/**
+ * Copying of request message to HTTP/2 frames: the head is copied to
+ * @ctx->hreq and the body is queued in @stream, chunked body is decoded.
+ *
+ * @ctx		- HTTP/2 context of the server connection;
+ * @stream	- stream the request is forwarded on;
+ * @hlen	- length of the head in @ctx->hreq;
+ * @eoh		- state of the end of the head matching;
+ * @body	- the head is copied;
+ * @chunked	- the body is chunked;
+ * @cst		- state of chunked body decoding;
+ * @csz		- the rest of the current chunk or the chunk size being read;
+ */
+typedef struct {
+	TfwH2SrvCtx	*ctx;
+	TfwStream	*stream;
+	unsigned int	hlen;
+	unsigned char	eoh;
+	bool		body;
+	bool		chunked;
+	unsigned char	cst;
+	unsigned long	csz;
+} TfwH2SrvReqCopy;
+
+enum {
+	TFW_H2_SRV_CS_SIZE,
+	TFW_H2_SRV_CS_EXT,
+	TFW_H2_SRV_CS_DATA,
+	TFW_H2_SRV_CS_CRLF,
+	TFW_H2_SRV_CS_TRL_START,
+	TFW_H2_SRV_CS_TRL,
+	TFW_H2_SRV_CS_DONE,
+};
+
+static inline int
+tfw_h2_srv_body_add(TfwStream *stream, const unsigned char *data,
+		    unsigned long len)
+{
+	int r;
+
+	if ((r = tfw_h2_srv_skb_copy(&stream->xmit, data, len)))
+		return r;
+	stream->xmit_len += len;
+
+	return 0;
+}
+
+/*
+ * Decode the chunked body of the request. The body is validated by the
+ * request parser, so the FSM just looks for the chunks data. Trailers
+ * aren't forwarded.
+ */
+static int
+tfw_h2_srv_dechunk(TfwH2SrvReqCopy *rc, const unsigned char *p,
+		   unsigned long len)
+{
+	int r;
+	unsigned long n;
+	const unsigned char *end = p + len;
+
+	while (p < end) {
+		switch (rc->cst) {
+		case TFW_H2_SRV_CS_SIZE:
+			if (!isxdigit(*p)) {
+				rc->cst = TFW_H2_SRV_CS_EXT;
+				break;
+			}
+			rc->csz = (rc->csz << 4) | hex_to_bin(*p++);
+			break;
+		case TFW_H2_SRV_CS_EXT:
+			if (*p++ == '\n')
+				rc->cst = rc->csz ? TFW_H2_SRV_CS_DATA
+						  : TFW_H2_SRV_CS_TRL_START;
+			break;
+		case TFW_H2_SRV_CS_DATA:
+			n = min_t(unsigned long, rc->csz, end - p);
+			if ((r = tfw_h2_srv_body_add(rc->stream, p, n)))
+				return r;
+			p += n;
+			if (!(rc->csz -= n))
+				rc->cst = TFW_H2_SRV_CS_CRLF;
+			break;
+		case TFW_H2_SRV_CS_CRLF:
+			if (*p++ == '\n')
+				rc->cst = TFW_H2_SRV_CS_SIZE;
+			break;
+		case TFW_H2_SRV_CS_TRL_START:
+			if (*p == '\n')
+				rc->cst = TFW_H2_SRV_CS_DONE;
+			else if (*p != '\r')
+				rc->cst = TFW_H2_SRV_CS_TRL;
+			++p;
+			break;
+		case TFW_H2_SRV_CS_TRL:
+			if (*p++ == '\n')
+				rc->cst = TFW_H2_SRV_CS_TRL_START;
+			break;
+		default:
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
+static int
+tfw_h2_srv_req_copy(void *data, unsigned char *buf, size_t len,
+		    unsigned int *read)
+{
+	int r;
+	TfwH2SrvReqCopy *rc = data;
+	TfwH2SrvCtx *ctx = rc->ctx;
+	unsigned char c, *p = buf, *end = buf + len;
+
+	/* The head ends with an empty line, bare LF is allowed by parser. */
+	while (!rc->body && p < end) {
+		if (rc->hlen == ctx->hreq_sz
+		    && tfw_h2_srv_buf_grow(&ctx->hreq, &ctx->hreq_sz,
+					   rc->hlen + 1, TFW_H2_SRV_HEAD_MAX))
+			return T_DROP;
+		c = *p++;
+		ctx->hreq[rc->hlen++] = c;
+		if (c == '\n')
+			rc->body = rc->eoh;
+		rc->eoh = (c == '\n') || (c == '\r' && rc->eoh);
+	}
+	if (p < end) {
+		r = rc->chunked ? tfw_h2_srv_dechunk(rc, p, end - p)
+				: tfw_h2_srv_body_add(rc->stream, p, end - p);
+		if (r)
+			return T_DROP;
+	}
+	*read = len;
+
+	return T_POSTPONE;
+}
+
+/*
+ * Get the next line of the head ending at @end, the line starts at @*p and
+ * @*p is moved to the next line. Return the line length without CRLF.
+ */
+static unsigned long
+tfw_h2_srv_line(char **p, const char *end, char **line)
+{
+	char *eol = memchr(*p, '\n', end - *p);
+	unsigned long n;
+
+	if (!eol)
+		eol = (char *)end;
+	*line = *p;
+	n = eol - *p;
+	*p = eol < end ? eol + 1 : eol;
+	if (n && (*line)[n - 1] == '\r')
+		--n;
+
+	return n;
+}
+
+/**
+ * Encode HTTP/1.1 head of @len bytes in @ctx->hreq to header block placed
+ * after the head in the buffer. Return the block length or negative error
+ * code.
+ */
+static long
+tfw_h2_srv_req_encode(TfwH2SrvCtx *ctx, TfwHttpReq *req, unsigned long len)
+{
+	char *p = ctx->hreq, *end = p + len, *line, *sp, *name, *val;
+	char *meth, *target, *auth = NULL, *path;
+	unsigned long n, mlen, tlen, alen = 0, plen, nlen, vlen;
+	unsigned char *o = (unsigned char *)end, *b = o;
+	const unsigned char *oend = (unsigned char *)ctx->hreq + ctx->hreq_sz;
+
+	/* Request line. */
+	n = tfw_h2_srv_line(&p, end, &line);
+	meth = line;
+	if (!(sp = memchr(line, ' ', n)))
+		return -EINVAL;
+	mlen = sp - line;
+	target = sp + 1;
+	if (!(sp = memchr(target, ' ', line + n - target)))
+		return -EINVAL;
+	tlen = sp - target;
+	path = target;
+	plen = tlen;
+	if (tlen && *target != '/' && *target != '*') {
+		/* Absolute form, the authority is taken from the target. */
+		char *s = strnstr(target, "://", tlen);
+
+		if (!s)
+			return -EINVAL;
+		auth = s + 3;
+		path = memchr(auth, '/', target + tlen - auth);
+		if (!path)
+			path = auth + (target + tlen - auth);
+		alen = path - auth;
+		plen = target + tlen - path;
+	}
+
+	/* Find Host header for the authority. */
+	while (!auth && p < end) {
+		if (!(n = tfw_h2_srv_line(&p, end, &line)))
+			break;
+		if (n > 5 && !strncasecmp(line, "host:", 5)) {
+			auth = line + 5;
+			alen = n - 5;
+			while (alen && (*auth == ' ' || *auth == '\t')) {
+				++auth;
+				--alen;
+			}
+			while (alen && (auth[alen - 1] == ' '
+					|| auth[alen - 1] == '\t'))
+				--alen;
+		}
+	}
+
+#define WRITE_HDR(n, nl, v, vl)						\
+do {									\
+	if (!(o = tfw_hpack_srv_write(o, oend, n, nl, v, vl)))		\
+		return -E2BIG;						\
+} while (0)
+
+	if (req->method == TFW_HTTP_METH_GET)
+		*o++ = 0x82;
+	else if (req->method == TFW_HTTP_METH_POST)
+		*o++ = 0x83;
+	else
+		WRITE_HDR(":method", 7, meth, mlen);
+	/* :scheme http */
+	*o++ = 0x86;
+	if (auth)
+		WRITE_HDR(":authority", 10, auth, alen);
+	if (plen == 1 && *path == '/')
+		*o++ = 0x84;
+	else if (plen)
+		WRITE_HDR(":path", 5, path, plen);
+	else
+		WRITE_HDR(":path", 5, "/", 1);
+
+	/* Header fields. */
+	p = ctx->hreq;
+	tfw_h2_srv_line(&p, end, &line);
+	while (p < end) {
+		if (!(n = tfw_h2_srv_line(&p, end, &line)))
+			break;
+		name = line;
+		if (!(sp = memchr(line, ':', n)))
+			return -EINVAL;
+		nlen = sp - name;
+		while (nlen && (name[nlen - 1] == ' ' || name[nlen - 1] == '\t'))
+			--nlen;
+		val = sp + 1;
+		vlen = line + n - val;
+		while (vlen && (*val == ' ' || *val == '\t')) {
+			++val;
+			--vlen;
+		}
+		while (vlen && (val[vlen - 1] == ' ' || val[vlen - 1] == '\t'))
+			--vlen;
+		tfw_cstrtolower_wo_avx2(name, name, nlen);
+		if (tfw_h2_srv_hop_hdr(name, nlen)
+		    || (nlen == 4 && !memcmp(name, "host", 4))
+		    || (nlen == 2 && !memcmp(name, "te", 2)
+			&& (vlen != 8 || strncasecmp(val, "trailers", 8))))
+			continue;
+		WRITE_HDR(name, nlen, val, vlen);
+	}
+#undef WRITE_HDR
+
+	return o - b;
+}
+
+/**
+ * Open a new stream in server connection @srv_conn for request @req, and
+ * add HEADERS, CONTINUATION and DATA frames for the request to @skb_head.
+ * The request body which doesn't fit the flow controlled windows is sent by
+ * WINDOW_UPDATE frames from the server. Called under @fwd_qlock.
+ */
+int
+tfw_h2_srv_req_frames(TfwSrvConn *srv_conn, TfwHttpReq *req,
+		      struct sk_buff **skb_head)
+{
+	int r = -EINVAL;
+	long blen;
+	unsigned long off, n, flen;
+	struct sk_buff *skb, *head = NULL;
+	TfwH2SrvCtx *ctx = srv_conn->h2;
+	TfwStream *stream;
+	unsigned char buf[FRAME_HEADER_SIZE];
+	TfwFrameHdr hdr = { .type = HTTP2_HEADERS };
+	TfwH2SrvReqCopy rc = {
+		.ctx		= ctx,
+		.chunked	= test_bit(TFW_HTTP_B_CHUNKED, req->flags)
+	};
+
+	if (WARN_ON_ONCE(req->sid))
+		return -EINVAL;
+	if (unlikely(ctx->next_id > FRAME_STREAM_ID_MASK)) {
+		/* Stream IDs are exhausted, the connection must be reopened. */
+		tfw_connection_close((TfwConn *)srv_conn, false);
+		return -EBADF;
+	}
+	stream = tfw_h2_add_stream(&ctx->sched, ctx->next_id, 0, MAX_WND_SIZE);
+	if (!stream)
+		return -ENOMEM;
+	ctx->next_id += 2;
+	++ctx->streams_num;
+	stream->rem_wnd = ctx->rsettings.wnd_sz;
+	if (req->method == TFW_HTTP_METH_HEAD)
+		stream->srv_flags |= TFW_H2_SRV_F_HEAD;
+	if (!test_bit(TFW_HTTP_B_REQ_STREAM, req->flags)
+	    || test_bit(TFW_HTTP_B_REQ_STREAM_DONE, req->flags))
+		stream->srv_flags |= TFW_H2_SRV_F_BODY;
+	rc.stream = stream;
+
+	skb = req->msg.skb_head;
+	do {
+		unsigned int chunks = 0, read = 0;
+
+		if (skb->len
+		    && ss_skb_process(skb, tfw_h2_srv_req_copy, &rc, &chunks,
+				      &read) != T_POSTPONE)
+			goto err;
+		skb = skb->next;
+	} while (skb != req->msg.skb_head);
+	if (!rc.body)
+		goto err;
+
+	/* Room for the header block after the head. */
+	if ((r = tfw_h2_srv_buf_grow(&ctx->hreq, &ctx->hreq_sz,
+				     rc.hlen * 3 + 64,
+				     TFW_H2_SRV_HEAD_MAX * 3)))
+		goto err;
+	if ((blen = tfw_h2_srv_req_encode(ctx, req, rc.hlen)) < 0) {
+		r = blen;
+		goto err;
+	}
+
+	flen = min_t(unsigned int, FRAME_DEF_LENGTH,
+		     ctx->rsettings.max_frame_sz);
+	hdr.stream_id = stream->id;
+	for (off = 0; off < blen; off += n) {
+		n = min_t(unsigned long, blen - off, flen);
+		hdr.length = n;
+		hdr.flags = (off + n == blen) ? HTTP2_F_END_HEADERS : 0;
+		if (!off && (stream->srv_flags & TFW_H2_SRV_F_BODY)
+		    && !stream->xmit_len)
+		{
+			hdr.flags |= HTTP2_F_END_STREAM;
+			stream->srv_flags |= TFW_H2_SRV_F_END;
+		}
+		tfw_h2_pack_frame_header(buf, &hdr);
+		if ((r = tfw_h2_srv_skb_copy(&head, buf, sizeof(buf)))
+		    || (r = tfw_h2_srv_skb_copy(&head, ctx->hreq + rc.hlen + off,
+						n)))
+			goto err;
+		hdr.type = HTTP2_CONTINUATION;
+	}
+	if ((r = tfw_h2_srv_stream_xmit(ctx, stream, &head)))
+		goto err;
+
+	/* See tfw_http_conn_fwd_unsent() for the marks. */
+	skb = head;
+	do {
+		skb->mark = req->msg.skb_head->mark;
+		skb = skb->next;
+	} while (skb != head);
+	if (*skb_head)
+		ss_skb_queue_append(skb_head, head);
+	else
+		*skb_head = head;
+	req->sid = stream->id;
+
+	T_DBG3("%s: req=[%p] stream=%u hblk=%ld body=%lu\n", __func__, req,
+	       stream->id, blen, stream->xmit_len);
+	return 0;
+err:
+	T_DBG2("%s: cannot make frames for req=[%p], r=%d\n", __func__, req, r);
+	ss_skb_queue_purge(&head);
+	tfw_h2_srv_stream_close(ctx, stream);
+
+	return r;
+}
+
+/**
+ * Close the stream opened for request @req, which can't be sent to the
+ * server. Called under @fwd_qlock.
+ */
+void
+tfw_h2_srv_req_abort(TfwSrvConn *srv_conn, TfwHttpReq *req)
+{
+	TfwStream *stream;
+	TfwH2SrvCtx *ctx = srv_conn->h2;
+
+	if (!req->sid)
+		return;
+	if ((stream = tfw_h2_find_stream(&ctx->sched, req->sid)))
+		tfw_h2_srv_stream_close(ctx, stream);
+	req->sid = 0;
+}
+
+/**
+ * Forward body part @skb of streamed request @req, the whole body is
+ * forwarded if it's the @last part. Called under @fwd_qlock, the caller
+ * must close the connection on an error.
+ */
+int
+tfw_h2_srv_req_body(TfwSrvConn *srv_conn, TfwHttpReq *req,
+		    struct sk_buff *skb, bool last)
+{
+	TfwStream *stream = NULL;
+
+	if (req->sid)
+		stream = tfw_h2_find_stream(&srv_conn->h2->sched, req->sid);
+	/* The server is done with the stream. */
+	if (!stream || (stream->srv_flags & TFW_H2_SRV_F_END)) {
+		__kfree_skb(skb);
+		return 0;
+	}
+	stream->xmit_len += skb->len;
+	ss_skb_queue_tail(&stream->xmit, skb);
+	if (last)
+		stream->srv_flags |= TFW_H2_SRV_F_BODY;
+
+	return tfw_h2_srv_xmit_flush(srv_conn, stream);
+}
+
+/*
+ * ------------------------------------------------------------------------
+ *	Responses receiving
+ * ------------------------------------------------------------------------
+ */
+
+/**
+ * Pass skb @skb of the response to the HTTP/1.1 parser of stream @stream.
+ * The skb is consumed.
+ */
+static int
+tfw_h2_srv_resp_skb(TfwSrvConn *srv_conn, TfwStream *stream,
+		    struct sk_buff *skb)
+{
+	int r;
+	TfwFsmData data_up = { .skb = skb };
+
+	r = tfw_http_msg_process_generic((TfwConn *)srv_conn, stream, &data_up);
+
+	return (r == T_OK || r == T_POSTPONE) ? T_OK : T_DROP;
+}
+
+/**
+ * Pass @len bytes of HTTP/1.1 response data @data to the response parser of
+ * stream @stream.
+ */
+static int
+tfw_h2_srv_resp_write(TfwSrvConn *srv_conn, TfwStream *stream,
+		      const char *data, unsigned long len)
+{
+	int r;
+	struct sk_buff *skb_head = NULL, *skb;
+
+	if (tfw_h2_srv_skb_copy(&skb_head, data, len)) {
+		ss_skb_queue_purge(&skb_head);
+		return T_DROP;
+	}
+	while ((skb = ss_skb_dequeue(&skb_head))) {
+		if ((r = tfw_h2_srv_resp_skb(srv_conn, stream, skb))) {
+			ss_skb_queue_purge(&skb_head);
+			return r;
+		}
+	}
+
+	return T_OK;
+}
+
+static int
+tfw_h2_srv_hout(TfwH2SrvCtx *ctx, const char *data, unsigned long len)
+{
+	int r;
+
+	if ((r = tfw_h2_srv_buf_grow(&ctx->hout, &ctx->hout_sz,
+				     ctx->hout_len + len, TFW_H2_SRV_HEAD_MAX)))
+		return r;
+	memcpy_fast(ctx->hout + ctx->hout_len, data, len);
+	ctx->hout_len += len;
+
+	return 0;
+}
+
+/*
+ * The response parser needs a reason phrase in the status line, while
+ * HTTP/2 doesn't carry it.
+ */
+static const char *
+tfw_h2_srv_reason(unsigned int status)
+{
+	switch (status) {
+	case 200: return "OK";
+	case 201: return "Created";
+	case 204: return "No Content";
+	case 206: return "Partial Content";
+	case 301: return "Moved Permanently";
+	case 302: return "Found";
+	case 304: return "Not Modified";
+	case 307: return "Temporary Redirect";
+	case 308: return "Permanent Redirect";
+	case 400: return "Bad Request";
+	case 401: return "Unauthorized";
+	case 403: return "Forbidden";
+	case 404: return "Not Found";
+	case 500: return "Internal Server Error";
+	case 502: return "Bad Gateway";
+	case 503: return "Service Unavailable";
+	case 504: return "Gateway Timeout";
+	}
+	switch (status / 100) {
+	case 1: return "Informational";
+	case 2: return "Success";
+	case 3: return "Redirection";
+	case 4: return "Client Error";
+	}
+	return "Server Error";
+}
+
+/**
+ * State of response header block conversion to HTTP/1.1.
+ *
+ * @ctx		- HTTP/2 context of the server connection;
+ * @status	- response status code;
+ * @cl		- Content-Length header is present;
+ */
+typedef struct {
+	TfwH2SrvCtx	*ctx;
+	unsigned int	status;
+	bool		cl;
+} TfwH2SrvResp;
+
+static int
+tfw_h2_srv_resp_hdr(void *data, const char *name, unsigned long nlen,
+		    const char *val, unsigned long vlen)
+{
+	int n;
+	unsigned long i;
+	char buf[64];
+	TfwH2SrvResp *rs = data;
+
+	/* Don't let the header fields split the response. */
+	for (i = 0; i < vlen; ++i)
+		if (val[i] == '\r' || val[i] == '\n' || !val[i])
+			return -EINVAL;
+
+	if (nlen && *name == ':') {
+		/* :status is the only response pseudo-header. */
+		if (rs->status || nlen != SLEN(":status")
+		    || memcmp(name, ":status", nlen) || vlen != 3)
+			return -EINVAL;
+		for (i = 0; i < vlen; ++i) {
+			if (!isdigit(val[i]))
+				return -EINVAL;
+			rs->status = rs->status * 10 + val[i] - '0';
+		}
+		if (rs->status < 100)
+			return -EINVAL;
+		n = snprintf(buf, sizeof(buf), "HTTP/1.1 %u %s\r\n",
+			     rs->status, tfw_h2_srv_reason(rs->status));
+		return tfw_h2_srv_hout(rs->ctx, buf, n);
+	}
+
+	/* Pseudo-headers go first, names are in lower case. */
+	if (!rs->status || !nlen)
+		return -EINVAL;
+	for (i = 0; i < nlen; ++i)
+		if (name[i] <= ' ' || name[i] >= 0x7f || name[i] == ':'
+		    || isupper(name[i]))
+			return -EINVAL;
+	if (tfw_h2_srv_hop_hdr(name, nlen))
+		return 0;
+	if (nlen == SLEN("content-length")
+	    && !memcmp(name, "content-length", nlen))
+		rs->cl = true;
+
+	if (tfw_h2_srv_hout(rs->ctx, name, nlen)
+	    || tfw_h2_srv_hout(rs->ctx, ": ", 2)
+	    || tfw_h2_srv_hout(rs->ctx, val, vlen)
+	    || tfw_h2_srv_hout(rs->ctx, "\r\n", 2))
+		return -ENOMEM;
+
+	return 0;
+}
+
+/**
+ * The header block of the current stream is received, convert it to
+ * HTTP/1.1 response head. Interim responses and trailers aren't forwarded.
+ * The response body is chunked if its length isn't known.
+ */
+static int
+tfw_h2_srv_headers(TfwSrvConn *srv_conn, TfwH2SrvCtx *ctx, bool end)
+{
+	unsigned short flags = TFW_H2_SRV_F_RESP;
+	unsigned int n = ctx->hblk_len;
+	TfwStream *stream = ctx->cur_stream;
+	TfwH2SrvResp rs = { .ctx = ctx };
+
+	ctx->blk_id = 0;
+	ctx->hblk_len = 0;
+	/* The stream is closed by Tempesta FW. */
+	if (!stream)
+		return T_OK;
+	/* Trailers must end the stream. */
+	if (stream->srv_flags & TFW_H2_SRV_F_RESP)
+		return end ? T_OK : T_DROP;
+
+	ctx->hout_len = 0;
+	if (tfw_hpack_srv_decode(ctx->hblk, n, (char *)ctx->hblk + n,
+				 ctx->hblk_sz - n, tfw_h2_srv_resp_hdr, &rs)
+	    || !rs.status)
+	{
+		T_DBG2("%s: bad header block of stream %u\n", __func__,
+		       stream->id);
+		return T_DROP;
+	}
+	if (rs.status < 200)
+		return end ? T_DROP : T_OK;
+
+	if ((stream->srv_flags & TFW_H2_SRV_F_HEAD)
+	    || rs.status == 204 || rs.status == 304)
+	{
+		flags |= TFW_H2_SRV_F_VOID;
+	}
+	else if (!rs.cl) {
+		if (end) {
+			if (tfw_h2_srv_hout(ctx, "content-length: 0\r\n",
+					    SLEN("content-length: 0\r\n")))
+				return T_DROP;
+		}
+		else {
+			if (tfw_h2_srv_hout(ctx, "transfer-encoding: chunked\r\n",
+					    SLEN("transfer-encoding: chunked"
+						 "\r\n")))
+				return T_DROP;
+			flags |= TFW_H2_SRV_F_CHUNKED;
+		}
+	}
+	if (tfw_h2_srv_hout(ctx, "\r\n", 2))
+		return T_DROP;
+
+	spin_lock_bh(&srv_conn->fwd_qlock);
+	stream->srv_flags |= flags;
+	tfw_http_fwdq_unlock(srv_conn);
+
+	return tfw_h2_srv_resp_write(srv_conn, stream, ctx->hout,
+				     ctx->hout_len);
+}
+
+/**
+ * Pass the payload @skb of DATA frame to the response parser of the current
+ * stream. The skb is consumed.
+ */
+static int
+tfw_h2_srv_data(TfwSrvConn *srv_conn, TfwH2SrvCtx *ctx, struct sk_buff *skb)
+{
+	int r, n;
+	char buf[20];
+	TfwStream *stream = ctx->cur_stream;
+
+	if (!stream || (stream->srv_flags & TFW_H2_SRV_F_VOID)) {
+		__kfree_skb(skb);
+		return T_OK;
+	}
+	if (!(stream->srv_flags & TFW_H2_SRV_F_RESP)) {
+		__kfree_skb(skb);
+		return T_DROP;
+	}
+	if (!(stream->srv_flags & TFW_H2_SRV_F_CHUNKED))
+		return tfw_h2_srv_resp_skb(srv_conn, stream, skb);
+
+	n = snprintf(buf, sizeof(buf), "%x\r\n", skb->len);
+	if ((r = tfw_h2_srv_resp_write(srv_conn, stream, buf, n))) {
+		__kfree_skb(skb);
+		return r;
+	}
+	if ((r = tfw_h2_srv_resp_skb(srv_conn, stream, skb)))
+		return r;
+
+	return tfw_h2_srv_resp_write(srv_conn, stream, "\r\n", 2);
+}
+
+/**
+ * Erase stream @stream of the connection, and tell if END_STREAM was sent
+ * for the stream.
+ */
+static bool
+tfw_h2_srv_stream_erase(TfwSrvConn *srv_conn, TfwH2SrvCtx *ctx,
+			TfwStream *stream)
+{
+	bool end;
+
+	spin_lock_bh(&srv_conn->fwd_qlock);
+	__tfw_h2_srv_stream_erase(ctx, stream);
+	end = stream->srv_flags & TFW_H2_SRV_F_END;
+	tfw_http_fwdq_unlock(srv_conn);
+
+	return end;
+}
+
+/**
+ * The server ended the current stream. The response must be complete.
+ * The stream is reset if the request isn't sent in full, RFC 7540 8.1.
+ */
+static int
+tfw_h2_srv_stream_end(TfwSrvConn *srv_conn, TfwH2SrvCtx *ctx)
+{
+	int r = T_OK;
+	TfwStream *stream = ctx->cur_stream;
+
+	if (!(stream->srv_flags & TFW_H2_SRV_F_RESP))
+		r = T_DROP;
+	else if (stream->srv_flags & TFW_H2_SRV_F_CHUNKED)
+		r = tfw_h2_srv_resp_write(srv_conn, stream, "0\r\n\r\n", 5);
+	if (!r && stream->msg) {
+		T_DBG2("%s: incomplete response on stream %u\n", __func__,
+		       stream->id);
+		r = T_DROP;
+	}
+
+	ctx->cur_stream = NULL;
+	if (!tfw_h2_srv_stream_erase(srv_conn, ctx, stream) && !r
+	    && tfw_h2_srv_send_rst(srv_conn, stream->id, HTTP2_ECODE_NO_ERROR))
+		r = T_DROP;
+	tfw_http_srv_stream_drop(stream);
+	tfw_h2_delete_stream(stream);
+	if (!r)
+		tfw_http_conn_fwd_kick(srv_conn);
+
+	return r;
+}
+
+/**
+ * The server reset the current stream. If the server refused the stream,
+ * then the request can be safely re-sent, RFC 7540 8.1.4.
+ */
+static int
+tfw_h2_srv_rst_stream(TfwSrvConn *srv_conn, TfwH2SrvCtx *ctx)
+{
+	TfwStream *stream = ctx->cur_stream;
+	unsigned int err = ntohl(*(__be32 *)ctx->rbuf);
+
+	if (!stream)
+		return T_OK;
+	T_DBG2("%s: stream %u is reset, error %u\n", __func__, stream->id, err);
+
+	ctx->cur_stream = NULL;
+	tfw_h2_srv_stream_erase(srv_conn, ctx, stream);
+	tfw_http_srv_stream_drop(stream);
+	tfw_http_srv_stream_reset(srv_conn, stream->id,
+				  err == HTTP2_ECODE_REFUSED);
+	tfw_h2_delete_stream(stream);
+
+	return T_OK;
+}
+
+static int
+tfw_h2_srv_wnd_update(TfwSrvConn *srv_conn, TfwH2SrvCtx *ctx)
+{
+	int r = T_OK;
+	TfwStream *stream = NULL;
+	unsigned int incr = ntohl(*(__be32 *)ctx->rbuf) & FRAME_STREAM_ID_MASK;
+
+	if (!incr)
+		return T_DROP;
+
+	spin_lock_bh(&srv_conn->fwd_qlock);
+	if (ctx->hdr.stream_id) {
+		stream = tfw_h2_find_stream(&ctx->sched, ctx->hdr.stream_id);
+		if (stream && (stream->rem_wnd += incr) > MAX_WND_SIZE)
+			r = T_DROP;
+	}
+	else if ((ctx->rem_wnd += incr) > MAX_WND_SIZE) {
+		r = T_DROP;
+	}
+	if (!r && (stream || !ctx->hdr.stream_id)
+	    && tfw_h2_srv_xmit_flush(srv_conn, stream))
+		r = T_DROP;
+	tfw_http_fwdq_unlock(srv_conn);
+
+	return r;
+}
+
+/**
+ * Apply setting entry from @ctx->rbuf.
+ */
+static int
+tfw_h2_srv_setting(TfwSrvConn *srv_conn, TfwH2SrvCtx *ctx)
+{
+	int r = T_OK;
+	long delta;
+	struct rb_node *node;
+	TfwSettings *rset = &ctx->rsettings;
+	unsigned short id = ntohs(*(__be16 *)ctx->rbuf);
+	unsigned int val = ntohl(*(__be32 *)&ctx->rbuf[SETTINGS_KEY_SIZE]);
+
+	T_DBG3("%s: setting %hu=%u\n", __func__, id, val);
+
+	spin_lock_bh(&srv_conn->fwd_qlock);
+	switch (id) {
+	case HTTP2_SETTINGS_TABLE_SIZE:
+		/* The dynamic table isn't used by the encoder. */
+		rset->hdr_tbl_sz = val;
+		break;
+	case HTTP2_SETTINGS_ENABLE_PUSH:
+		break;
+	case HTTP2_SETTINGS_MAX_STREAMS:
+		rset->max_streams = val;
+		break;
+	case HTTP2_SETTINGS_INIT_WND_SIZE:
+		if (val > MAX_WND_SIZE) {
+			r = T_DROP;
+			break;
+		}
+		delta = (long)val - rset->wnd_sz;
+		for (node = rb_first(&ctx->sched.streams); node;
+		     node = rb_next(node))
+			rb_entry(node, TfwStream, node)->rem_wnd += delta;
+		rset->wnd_sz = val;
+		break;
+	case HTTP2_SETTINGS_MAX_FRAME_SIZE:
+		if (val < FRAME_DEF_LENGTH || val > FRAME_MAX_LENGTH)
+			r = T_DROP;
+		else
+			rset->max_frame_sz = val;
+		break;
+	case HTTP2_SETTINGS_MAX_HDR_LIST_SIZE:
+		rset->max_lhdr_sz = val;
+		break;
+	}
+	tfw_http_fwdq_unlock(srv_conn);
+
+	return r;
+}
+
+/**
+ * SETTINGS frame is applied: acknowledge it and send the streams data
+ * blocked by the previous settings.
+ */
+static int
+tfw_h2_srv_settings_done(TfwSrvConn *srv_conn, TfwH2SrvCtx *ctx)
+{
+	int r;
+
+	if (tfw_h2_srv_send_frame(srv_conn, HTTP2_SETTINGS, HTTP2_F_ACK, 0,
+				  NULL, 0))
+		return T_DROP;
+
+	spin_lock_bh(&srv_conn->fwd_qlock);
+	r = tfw_h2_srv_xmit_flush(srv_conn, NULL);
+	tfw_http_fwdq_unlock(srv_conn);
+	if (r)
+		return T_DROP;
+	tfw_http_conn_fwd_kick(srv_conn);
+
+	return T_OK;
+}
+
+static int
+tfw_h2_srv_frame_end(TfwSrvConn *srv_conn, TfwH2SrvCtx *ctx)
+{
+	int r = T_OK;
+	bool end;
+	TfwFrameHdr *hdr = &ctx->hdr;
+
+	ctx->state = HTTP2_SRV_HDR;
+	switch (hdr->type) {
+	case HTTP2_HEADERS:
+	case HTTP2_CONTINUATION:
+		if (!(hdr->flags & HTTP2_F_END_HEADERS))
+			break;
+		end = ctx->blk_flags & HTTP2_F_END_STREAM;
+		r = tfw_h2_srv_headers(srv_conn, ctx, end);
+		if (!r && end && ctx->cur_stream)
+			r = tfw_h2_srv_stream_end(srv_conn, ctx);
+		break;
+	case HTTP2_DATA:
+		if ((hdr->flags & HTTP2_F_END_STREAM) && ctx->cur_stream)
+			r = tfw_h2_srv_stream_end(srv_conn, ctx);
+		break;
+	case HTTP2_SETTINGS:
+		if (!(hdr->flags & HTTP2_F_ACK))
+			r = tfw_h2_srv_settings_done(srv_conn, ctx);
+		break;
+	case HTTP2_PING:
+		if (!(hdr->flags & HTTP2_F_ACK)
+		    && tfw_h2_srv_send_frame(srv_conn, HTTP2_PING, HTTP2_F_ACK,
+					     0, ctx->rbuf, FRAME_PING_SIZE))
+			r = T_DROP;
+		break;
+	case HTTP2_WINDOW_UPDATE:
+		r = tfw_h2_srv_wnd_update(srv_conn, ctx);
+		break;
+	case HTTP2_RST_STREAM:
+		r = tfw_h2_srv_rst_stream(srv_conn, ctx);
+		break;
+	case HTTP2_GOAWAY:
+		/*
+		 * The streams which aren't processed by the server are
+		 * re-sent through a new connection.
+		 */
+		T_DBG("%s: GOAWAY from server, error %u\n", __func__,
+		      ntohl(*(__be32 *)&ctx->rbuf[STREAM_ID_SIZE]));
+		r = T_DROP;
+		break;
+	}
+	ctx->cur_stream = NULL;
+	ctx->rlen = 0;
+
+	return r;
+}
+
+/**
+ * Account DATA frame of the current stream in the flow controlled windows,
+ * and open the windows back when half of a window is consumed.
+ */
+static int
+tfw_h2_srv_flow(TfwSrvConn *srv_conn, TfwH2SrvCtx *ctx)
+{
+	unsigned int len = ctx->hdr.length;
+	TfwStream *stream = ctx->cur_stream;
+
+	if (len > ctx->loc_wnd || (stream && len > stream->loc_wnd))
+		return T_DROP;
+	ctx->loc_wnd -= len;
+	if (ctx->loc_wnd <= MAX_WND_SIZE / 2) {
+		if (tfw_h2_srv_send_wnd(srv_conn, 0,
+					MAX_WND_SIZE - ctx->loc_wnd))
+			return T_DROP;
+		ctx->loc_wnd = MAX_WND_SIZE;
+	}
+	if (!stream)
+		return T_OK;
+	stream->loc_wnd -= len;
+	if (stream->loc_wnd <= MAX_WND_SIZE / 2) {
+		if (tfw_h2_srv_send_wnd(srv_conn, stream->id,
+					MAX_WND_SIZE - stream->loc_wnd))
+			return T_DROP;
+		stream->loc_wnd = MAX_WND_SIZE;
+	}
+
+	return T_OK;
+}
+
+static inline TfwStream *
+tfw_h2_srv_stream(TfwSrvConn *srv_conn, TfwH2SrvCtx *ctx, unsigned int id)
+{
+	TfwStream *stream;
+
+	spin_lock_bh(&srv_conn->fwd_qlock);
+	stream = tfw_h2_find_stream(&ctx->sched, id);
+	tfw_http_fwdq_unlock(srv_conn);
+
+	return stream;
+}
+
+/*
+ * Start reading the payload of HEADERS or DATA frame after the padding
+ * length and the priority.
+ */
+static int
+tfw_h2_srv_payload(TfwH2SrvCtx *ctx)
+{
+	TfwFrameHdr *hdr = &ctx->hdr;
+
+	if (hdr->type == HTTP2_HEADERS && (hdr->flags & HTTP2_F_PRIORITY)
+	    && ctx->state != HTTP2_SRV_PRI)
+	{
+		if (hdr->length < FRAME_PRIORITY_SIZE)
+			return T_DROP;
+		ctx->state = HTTP2_SRV_PRI;
+		ctx->to_read = FRAME_PRIORITY_SIZE;
+		hdr->length -= FRAME_PRIORITY_SIZE;
+		return T_OK;
+	}
+	ctx->state = hdr->type == HTTP2_DATA ? HTTP2_SRV_DATA : HTTP2_SRV_HBLK;
+	ctx->to_read = hdr->length;
+
+	return T_OK;
+}
+
+static int
+tfw_h2_srv_padded(TfwH2SrvCtx *ctx)
+{
+	TfwFrameHdr *hdr = &ctx->hdr;
+
+	if (!(hdr->flags & HTTP2_F_PADDED))
+		return tfw_h2_srv_payload(ctx);
+	if (!hdr->length)
+		return T_DROP;
+	ctx->state = HTTP2_SRV_PADLEN;
+	ctx->to_read = 1;
+	hdr->length -= 1;
+
+	return T_OK;
+}
+
+/**
+ * The frame header is read, check the frame and set up reading of its
+ * payload.
+ */
+static int
+tfw_h2_srv_frame_start(TfwSrvConn *srv_conn, TfwH2SrvCtx *ctx)
+{
+	TfwFrameHdr *hdr = &ctx->hdr;
+
+	T_DBG3("%s: frame type=%hhu flags=0x%hhx stream=%u len=%d\n",
+	       __func__, hdr->type, hdr->flags, hdr->stream_id, hdr->length);
+
+	ctx->padlen = 0;
+	ctx->cur_stream = NULL;
+	/* Larger frames aren't allowed by the settings we sent. */
+	if (hdr->length > FRAME_DEF_LENGTH)
+		return T_DROP;
+	/* Header block is a contiguous sequence of frames, RFC 7540 6.10. */
+	if (ctx->blk_id && (hdr->type != HTTP2_CONTINUATION
+			    || hdr->stream_id != ctx->blk_id))
+		return T_DROP;
+
+	switch (hdr->type) {
+	case HTTP2_DATA:
+		if (!hdr->stream_id)
+			return T_DROP;
+		ctx->cur_stream = tfw_h2_srv_stream(srv_conn, ctx,
+						    hdr->stream_id);
+		if (tfw_h2_srv_flow(srv_conn, ctx))
+			return T_DROP;
+		return tfw_h2_srv_padded(ctx);
+	case HTTP2_HEADERS:
+		if (!hdr->stream_id)
+			return T_DROP;
+		ctx->cur_stream = tfw_h2_srv_stream(srv_conn, ctx,
+						    hdr->stream_id);
+		ctx->blk_id = hdr->stream_id;
+		ctx->blk_flags = hdr->flags;
+		ctx->hblk_len = 0;
+		return tfw_h2_srv_padded(ctx);
+	case HTTP2_CONTINUATION:
+		if (!ctx->blk_id)
+			return T_DROP;
+		ctx->cur_stream = tfw_h2_srv_stream(srv_conn, ctx,
+						    hdr->stream_id);
+		ctx->state = HTTP2_SRV_HBLK;
+		ctx->to_read = hdr->length;
+		return T_OK;
+	case HTTP2_SETTINGS:
+		if (hdr->stream_id || hdr->length % FRAME_SETTINGS_ENTRY_SIZE
+		    || ((hdr->flags & HTTP2_F_ACK) && hdr->length))
+			return T_DROP;
+		ctx->state = HTTP2_SRV_SETTINGS;
+		ctx->to_read = hdr->length;
+		return T_OK;
+	case HTTP2_PING:
+		if (hdr->stream_id || hdr->length != FRAME_PING_SIZE)
+			return T_DROP;
+		break;
+	case HTTP2_WINDOW_UPDATE:
+		if (hdr->length != FRAME_WND_UPDATE_SIZE)
+			return T_DROP;
+		break;
+	case HTTP2_RST_STREAM:
+		if (!hdr->stream_id || hdr->length != FRAME_RST_STREAM_SIZE)
+			return T_DROP;
+		ctx->cur_stream = tfw_h2_srv_stream(srv_conn, ctx,
+						    hdr->stream_id);
+		break;
+	case HTTP2_GOAWAY:
+		if (hdr->stream_id || hdr->length < FRAME_GOAWAY_SIZE)
+			return T_DROP;
+		/* The connection is closed, so debug data isn't read. */
+		hdr->length = FRAME_GOAWAY_SIZE;
+		break;
+	case HTTP2_PUSH_PROMISE:
+		/* Server push is disabled by our settings. */
+		return T_DROP;
+	default:
+		/* PRIORITY and unknown frames are ignored. */
+		ctx->state = HTTP2_SRV_SKIP;
+		ctx->to_read = hdr->length;
+		return T_OK;
+	}
+	ctx->state = HTTP2_SRV_SRVC;
+	ctx->to_read = hdr->length;
+	ctx->rlen = 0;
+
+	return T_OK;
+}
+
+/**
+ * Current FSM state is done, move to the next one.
+ */
+static int
+tfw_h2_srv_state_done(TfwSrvConn *srv_conn, TfwH2SrvCtx *ctx)
+{
+	switch (ctx->state) {
+	case HTTP2_SRV_PADLEN:
+		if (ctx->padlen > ctx->hdr.length)
+			return T_DROP;
+		ctx->hdr.length -= ctx->padlen;
+		return tfw_h2_srv_payload(ctx);
+	case HTTP2_SRV_PRI:
+		return tfw_h2_srv_payload(ctx);
+	case HTTP2_SRV_HBLK:
+	case HTTP2_SRV_DATA:
+		if (ctx->padlen) {
+			ctx->state = HTTP2_SRV_PAD;
+			ctx->to_read = ctx->padlen;
+			return T_OK;
+		}
+		fallthrough;
+	default:
+		return tfw_h2_srv_frame_end(srv_conn, ctx);
+	}
+}
+
+static int
+tfw_h2_srv_states_done(TfwSrvConn *srv_conn, TfwH2SrvCtx *ctx)
+{
+	int r;
+
+	while (ctx->state != HTTP2_SRV_HDR && !ctx->to_read)
+		if ((r = tfw_h2_srv_state_done(srv_conn, ctx)))
+			return r;
+
+	return T_OK;
+}
+
+static int
+tfw_h2_srv_hblk(TfwH2SrvCtx *ctx, const unsigned char *data, unsigned int len)
+{
+	unsigned long n = ctx->hblk_len + len;
+
+	if (n > TFW_H2_SRV_BLK_MAX)
+		return T_DROP;
+	/* Leave room for Huffman decoding, see tfw_hpack_srv_decode(). */
+	if (tfw_h2_srv_buf_grow((char **)&ctx->hblk, &ctx->hblk_sz, n * 3,
+				TFW_H2_SRV_BLK_MAX * 3))
+		return T_DROP;
+	memcpy_fast(ctx->hblk + ctx->hblk_len, data, len);
+	ctx->hblk_len = n;
+
+	return T_OK;
+}
+
+/**
+ * Read frames from @buf. Processing stops at the beginning of DATA frame
+ * payload, which is passed to the response parser as is.
+ */
+static int
+tfw_h2_srv_frame_recv(void *data, unsigned char *buf, size_t len,
+		      unsigned int *read)
+{
+	int r;
+	unsigned int n;
+	TfwSrvConn *srv_conn = data;
+	TfwH2SrvCtx *ctx = srv_conn->h2;
+	unsigned char *p = buf, *end = buf + len;
+
+	while (p < end) {
+		switch (ctx->state) {
+		case HTTP2_SRV_HDR:
+			n = min_t(unsigned int, FRAME_HEADER_SIZE - ctx->rlen,
+				  end - p);
+			memcpy_fast(ctx->rbuf + ctx->rlen, p, n);
+			p += n;
+			if ((ctx->rlen += n) < FRAME_HEADER_SIZE)
+				break;
+			ctx->rlen = 0;
+			tfw_h2_unpack_frame_header(&ctx->hdr, ctx->rbuf);
+			if ((r = tfw_h2_srv_frame_start(srv_conn, ctx)))
+				goto out;
+			break;
+		case HTTP2_SRV_PADLEN:
+			ctx->padlen = *p++;
+			ctx->to_read = 0;
+			break;
+		case HTTP2_SRV_DATA:
+			r = T_OK;
+			goto out;
+		case HTTP2_SRV_HBLK:
+			n = min_t(unsigned int, ctx->to_read, end - p);
+			/* Header blocks of closed streams are dropped. */
+			if (ctx->cur_stream
+			    && (r = tfw_h2_srv_hblk(ctx, p, n)))
+				goto out;
+			p += n;
+			ctx->to_read -= n;
+			break;
+		case HTTP2_SRV_SRVC:
+			n = min_t(unsigned int, ctx->to_read, end - p);
+			memcpy_fast(ctx->rbuf + ctx->rlen, p, n);
+			p += n;
+			ctx->rlen += n;
+			ctx->to_read -= n;
+			break;
+		case HTTP2_SRV_SETTINGS:
+			n = min3(ctx->to_read,
+				 FRAME_SETTINGS_ENTRY_SIZE - ctx->rlen,
+				 (int)(end - p));
+			memcpy_fast(ctx->rbuf + ctx->rlen, p, n);
+			p += n;
+			ctx->to_read -= n;
+			if ((ctx->rlen += n) < FRAME_SETTINGS_ENTRY_SIZE)
+				break;
+			ctx->rlen = 0;
+			if ((r = tfw_h2_srv_setting(srv_conn, ctx)))
+				goto out;
+			break;
+		default:
+			n = min_t(unsigned int, ctx->to_read, end - p);
+			p += n;
+			ctx->to_read -= n;
+		}
+		if ((r = tfw_h2_srv_states_done(srv_conn, ctx)))
+			goto out;
+	}
+	*read = len;
+
+	return T_POSTPONE;
+out:
+	*read = p - buf;
+
+	return r;
+}
+
+/**
+ * Process skb @skb received from HTTP/2 server connection @srv_conn. Payload
+ * of DATA frames is split from the skb and passed to the response parser,
+ * other data is freed.
+ */
+int
+tfw_h2_srv_frame_process(TfwSrvConn *srv_conn, struct sk_buff *skb)
+{
+	int r = T_OK;
+	unsigned int n, chunks, parsed;
+	struct sk_buff *next;
+	TfwH2SrvCtx *ctx = srv_conn->h2;
+
+	tfw_h2_srv_reap(srv_conn, ctx);
+
+	while (skb) {
+		next = NULL;
+		if (ctx->state == HTTP2_SRV_DATA) {
+			n = min_t(unsigned int, ctx->to_read, skb->len);
+			if (n < skb->len && !(next = ss_skb_split(skb, n))) {
+				r = T_DROP;
+				break;
+			}
+			ctx->to_read -= n;
+			if ((r = tfw_h2_srv_data(srv_conn, ctx, skb))
+			    || (r = tfw_h2_srv_states_done(srv_conn, ctx)))
+			{
+				skb = next;
+				break;
+			}
+			skb = next;
+			continue;
+		}
+
+		chunks = parsed = 0;
+		r = ss_skb_process(skb, tfw_h2_srv_frame_recv, srv_conn,
+				   &chunks, &parsed);
+		if (r == T_POSTPONE) {
+			r = T_OK;
+		}
+		else if (!r && parsed < skb->len
+			 && !(next = ss_skb_split(skb, parsed)))
+		{
+			r = T_DROP;
+		}
+		__kfree_skb(skb);
+		skb = next;
+		if (r)
+			break;
+	}
+	if (skb)
+		__kfree_skb(skb);
+
+	return r;
+}
@@ -30,6 +30,13 @@
 #define FRAME_RESERVED_BIT_MASK		(~FRAME_STREAM_ID_MASK)
 #define FRAME_MAX_LENGTH		((1U << 24) - 1)
 #define FRAME_DEF_LENGTH		(16384)
+/*
+ * Maximum size of the service data accumulated from a frame: the frame
+ * header or a payload of a service frame. PRIORITY_UPDATE frames have
+ * variable length, only the first bytes of their Priority Field Value,
+ * enough for the urgency and incremental parameters, are interpreted.
+ */
+#define FRAME_RBUF_SIZE			16
 
 /**
  * HTTP/2 frame types (RFC 7540 section 6).
@@ -45,7 +52,9 @@ typedef enum {
 	HTTP2_GOAWAY,
 	HTTP2_WINDOW_UPDATE,
 	HTTP2_CONTINUATION,
-	_HTTP2_UNDEFINED
+	_HTTP2_UNDEFINED,
+	/* RFC 9218 section 7.1. */
+	HTTP2_PRIORITY_UPDATE		= 0x10
 } TfwFrameType;
 
 /**
@@ -133,10 +142,53 @@ typedef struct {
 	unsigned long		num;
 } TfwClosedQueue;
 
+/**
+ * Types of the received frames, which rates are limited by Frang per
+ * connection.
+ */
+typedef enum {
+	HTTP2_FLIM_STREAM,
+	HTTP2_FLIM_RST,
+	HTTP2_FLIM_PING,
+	HTTP2_FLIM_SETTINGS,
+	HTTP2_FLIM_EMPTY,
+	_HTTP2_FLIM_NUM
+} TfwFrameLim;
+
+/**
+ * Per-connection rates of the received frames.
+ *
+ * @ts		- second, in which the frames are accounted;
+ * @cnt		- number of frames of each type received during @ts;
+ * @lim		- maximum number of frames of each type per second, copied
+ *		  from Frang configuration on the connection start, zero
+ *		  means unlimited;
+ * @ip_block	- block the client by IP address on a limit violation;
+ * @ip_prefix4	- prefix length of IPv4 network of the blocked client;
+ * @ip_prefix6	- prefix length of IPv6 network of the blocked client;
+ */
+typedef struct {
+	unsigned long	ts;
+	unsigned int	cnt[_HTTP2_FLIM_NUM];
+	unsigned int	lim[_HTTP2_FLIM_NUM];
+	bool		ip_block;
+	unsigned char	ip_prefix4;
+	unsigned char	ip_prefix6;
+} TfwFrameRates;
+
 /**
  * Context for HTTP/2 frames processing.
  *
- * @lock		- spinlock to protect stream-request linkage;
+ * @lock		- spinlock to protect stream-request linkage, the streams
+ *			  dependency tree and the queued response data;
+ * @xmit_lock		- serializes sending of the response frames, so the
+ *			  frames of each stream are sent in order;
+ * @xmit_inflight	- bytes sent to the socket, which the client hasn't
+ *			  acknowledged yet, under @xmit_lock;
+ * @xmit_una		- TCP sequence number, up to which the acknowledged
+ *			  bytes are released from @xmit_inflight;
+ * @xmit_wait		- the queued response data waits for the client to
+ *			  acknowledge the data in flight;
  * @lsettings		- local settings for HTTP/2 connection;
  * @rsettings		- settings for HTTP/2 connection received from the
  *			  remote endpoint;
@@ -148,8 +200,16 @@ typedef struct {
  * @lstream_id		- ID of last stream initiated by client and processed on
  *			  the server side;
  * @loc_wnd		- connection's current flow controlled window;
+ * @rem_wnd		- peer's connection flow controlled window, consumed
+ *			  by DATA frames of the responses under @lock;
  * @hpack		- HPACK context, used in processing of
  *			  HEADERS/CONTINUATION frames;
+ * @ctrl		- control frames, accumulated under @lock while the
+ *			  received frames are processed, to be sent at once;
+ * @ctrl_len		- length of the frames in @ctrl;
+ * @ctrl_defer		- the received frames are being processed, so the
+ *			  control frames are accumulated in @ctrl;
+ * @frate		- rates of the received frames limited by Frang;
  * @__off		- offset to reinitialize processing context;
  * @skb_head		- collected list of processed skbs containing HTTP/2
  *			  frames;
@@ -178,6 +238,10 @@ typedef struct {
  */
 typedef struct {
 	spinlock_t	lock;
+	spinlock_t	xmit_lock;
+	long		xmit_inflight;
+	u32		xmit_una;
+	bool		xmit_wait;
 	TfwSettings	lsettings;
 	TfwSettings	rsettings;
 	unsigned long	streams_num;
@@ -185,7 +249,12 @@ typedef struct {
 	TfwClosedQueue	hclosed_streams;
 	unsigned int	lstream_id;
 	unsigned int	loc_wnd;
+	long		rem_wnd;
 	TfwHPack	hpack;
+	struct sk_buff	*ctrl;
+	unsigned int	ctrl_len;
+	bool		ctrl_defer;
+	TfwFrameRates	frate;
 	char		__off[0];
 	struct sk_buff	*skb_head;
 	TfwStream	*cur_stream;
@@ -195,11 +264,76 @@ typedef struct {
 	int		state;
 	int		to_read;
 	int		rlen;
-	unsigned char	rbuf[FRAME_HEADER_SIZE];
+	unsigned char	rbuf[FRAME_RBUF_SIZE];
 	unsigned char	padlen;
 	unsigned char	data_off;
 } TfwH2Ctx;
 
+/**
+ * Context of HTTP/2 connection with upstream server. Tempesta FW opens the
+ * streams, so the egress parts are used under @fwd_qlock of the connection,
+ * while the frames are received in the connection's softirq only. Header
+ * blocks are accumulated in @hblk, which also provides the room for Huffman
+ * decoding, and are converted to HTTP/1.1 message head in @hout to be passed
+ * to the HTTP/1.1 response parser.
+ *
+ * @rsettings		- settings received from the server;
+ * @sched		- storage of open streams;
+ * @closed		- streams closed on forwarding errors, they're freed by
+ *			  the frames receiving side which may refer them;
+ * @streams_num		- number of the open streams;
+ * @next_id		- ID of the next stream opened by Tempesta FW;
+ * @loc_wnd		- connection's current flow controlled window;
+ * @rem_wnd		- server's connection flow controlled window, consumed
+ *			  by DATA frames of requests;
+ * @hblk		- buffer for header block of the current response;
+ * @hblk_len		- length of the header block in @hblk;
+ * @hblk_sz		- size of @hblk;
+ * @hout		- buffer for HTTP/1.1 head of the current response;
+ * @hout_len		- length of the data in @hout;
+ * @hout_sz		- size of @hout;
+ * @hreq		- buffer for HTTP/1.1 head and header block of request
+ *			  being forwarded;
+ * @hreq_sz		- size of @hreq;
+ * @blk_id		- ID of the stream sending the header block, zero
+ *			  if no CONTINUATION is expected;
+ * @blk_flags		- flags of HEADERS frame starting the header block;
+ * @cur_stream		- stream of the frame currently being processed;
+ * @hdr			- header of the frame currently being processed;
+ * @state		- current FSM state of the frames processing;
+ * @to_read		- payload bytes of the frame left to read in @state;
+ * @rlen		- length of accumulated data in @rbuf;
+ * @padlen		- length of current frame's padding;
+ * @rbuf		- buffer for frame headers and payloads of service
+ *			  frames;
+ */
+typedef struct {
+	TfwSettings	rsettings;
+	TfwStreamSched	sched;
+	struct list_head closed;
+	unsigned long	streams_num;
+	unsigned int	next_id;
+	unsigned int	loc_wnd;
+	long		rem_wnd;
+	unsigned char	*hblk;
+	unsigned int	hblk_len;
+	unsigned int	hblk_sz;
+	char		*hout;
+	unsigned int	hout_len;
+	unsigned int	hout_sz;
+	char		*hreq;
+	unsigned int	hreq_sz;
+	unsigned int	blk_id;
+	unsigned char	blk_flags;
+	TfwStream	*cur_stream;
+	TfwFrameHdr	hdr;
+	int		state;
+	int		to_read;
+	int		rlen;
+	unsigned char	padlen;
+	unsigned char	rbuf[FRAME_HEADER_SIZE];
+} TfwH2SrvCtx;
+
 int tfw_h2_init(void);
 void tfw_h2_cleanup(void);
 int tfw_h2_context_init(TfwH2Ctx *ctx);
@@ -211,6 +345,22 @@ unsigned int tfw_h2_stream_id_close(TfwHttpReq *req, unsigned char type,
 				    unsigned char flags);
 void tfw_h2_conn_terminate_close(TfwH2Ctx *ctx, TfwH2Err err_code, bool close);
 int tfw_h2_send_rst_stream(TfwH2Ctx *ctx, unsigned int id, TfwH2Err err_code);
+int tfw_h2_send_early_hints(TfwHttpReq *req, const char *link,
+			    unsigned long len);
+bool tfw_h2_stream_xmit_pending(TfwH2Ctx *ctx, unsigned int id);
+int tfw_h2_stream_xmit(TfwH2Ctx *ctx, TfwMsg *msg);
+int tfw_h2_xmit_wspace(TfwH2Ctx *ctx, struct sock *sk);
+void tfw_h2_req_set_prio(TfwHttpReq *req);
+void tfw_h2_srv_context_free(TfwH2SrvCtx *ctx);
+
+/*
+ * Tell if one more stream can be opened in HTTP/2 server connection.
+ */
+static inline bool
+tfw_h2_srv_stream_room(TfwH2SrvCtx *ctx)
+{
+	return ctx->streams_num < ctx->rsettings.max_streams;
+}
 
 static inline void
 tfw_h2_pack_frame_header(unsigned char *p, const TfwFrameHdr *hdr)
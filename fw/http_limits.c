@@ -27,6 +27,7 @@
 #include <linux/spinlock.h>
 
 #include "lib/fsm.h"
+#include "lib/hash.h"
 #include "tdb.h"
 
 #include "tempesta_fw.h"
@@ -40,6 +41,7 @@
 #include "vhost.h"
 #include "log.h"
 #include "hash.h"
+#include "trace.h"
 
 /*
  * ------------------------------------------------------------------------
@@ -54,6 +56,9 @@ static struct {
 
 static TfwClassifier __rcu *classifier = NULL;
 
+/* Number of clients evicted on each memory pressure event. */
+#define TFW_CLASSIFY_SHRINK_BATCH	64
+
 /**
  * Shrink client connections hash and/or reduce QoS for blocked clients to
  * lower back-end servers or local system load.
@@ -61,7 +66,7 @@ static TfwClassifier __rcu *classifier = NULL;
 void
 tfw_classify_shrink(void)
 {
-	/* TODO: delete a connection from the LRU */
+	tfw_client_shrink(TFW_CLASSIFY_SHRINK_BATCH);
 }
 
 int
@@ -201,11 +206,21 @@ static TempestaOps tempesta_ops = {
 typedef struct {
 	unsigned long	ts;
 	unsigned int	conn_new;
-	unsigned int	req;
 	unsigned int	tls_sess_new;
 	unsigned int	tls_sess_incomplete;
+	unsigned int	sticky_fail;
 } FrangRates;
 
+/*
+ * Request history slot packs the time quantum in the high bits and the number
+ * of requests during the quantum in the low bits, so a slot of an outdated
+ * quantum is reset and accounted by a single atomic operation. The counter
+ * saturates at FRANG_REQ_CNT_MASK, which is far above any sane limit.
+ */
+#define FRANG_REQ_CNT_BITS	20
+#define FRANG_REQ_CNT_MASK	((1UL << FRANG_REQ_CNT_BITS) - 1)
+#define FRANG_REQ_TS_MASK	((1UL << (64 - FRANG_REQ_CNT_BITS)) - 1)
+
 /**
  * Response code record.
  *
@@ -219,21 +234,47 @@ typedef struct {
 	unsigned int	ts;
 } __attribute__((packed)) FrangRespCodeStat;
 
+/*
+ * Number of locations with request limits, see FrangVhostCfg->loc_req_rate,
+ * which a client is accounted for at once.
+ */
+#define FRANG_LOC_N		4
+
+/**
+ * Requests accounting for location request limits.
+ *
+ * @id		- FrangVhostCfg->loc_id of the accounted location;
+ * @rate	- requests during the current second, see FRANG_REQ_CNT_BITS;
+ * @burst	- requests during the current 1/FRANG_FREQ of second;
+ */
+typedef struct {
+	unsigned int	id;
+	atomic64_t	rate;
+	atomic64_t	burst;
+} FrangLocAcc;
+
 /**
  * Main descriptor of client resource accounting.
  * @lock can be removed if RSS is tuned to schedule packets based on
  * <proto, src_ip> tuple. However, the hashing could produce bad CPU load
- * balancing so, such settings are not desirable.
+ * balancing so, such settings are not desirable. The lock is taken on
+ * connection events and for limited response codes only: requests, which
+ * may come from many CPUs at high rate for clients behind NAT, are accounted
+ * in lock-free @req_hist.
  *
  * @conn_curr		- current connections number;
  * @history		- bursts history organized as a ring-buffer;
+ * @req_hist		- requests history, see FRANG_REQ_CNT_BITS;
  * @resp_code_stat	- response code record
+ * @loc_acc		- requests to locations with request limits
  */
 typedef struct {
 	unsigned int		conn_curr;
 	spinlock_t		lock;
 	FrangRates		history[FRANG_FREQ];
+	atomic64_t		req_hist[FRANG_FREQ];
 	FrangRespCodeStat	resp_code_stat[FRANG_FREQ];
+	FrangLocAcc		loc_acc[FRANG_LOC_N];
 } FrangAcc;
 
 #define FRANG_CLI2ACC(c)	((FrangAcc *)(&(c)->class_prvt))
@@ -241,7 +282,10 @@ typedef struct {
 					     TfwClient, class_prvt)
 
 #define frang_msg(check, addr, fmt, ...)				\
-	T_WARN_MOD_ADDR(frang, check, addr, TFW_NO_PORT, fmt, ##__VA_ARGS__)
+do {									\
+	trace_tfw_frang_block(addr, check);				\
+	T_WARN_MOD_ADDR(frang, check, addr, TFW_NO_PORT, fmt, ##__VA_ARGS__);\
+} while (0)
 
 /*
  * Client actions has triggered a security event. Log the client addr and
@@ -259,6 +303,17 @@ typedef struct {
 	       "%ld (lim=%ld)\n",					\
 	       system, (long)curr_val, (long)lim)
 
+/*
+ * Block the client address, or the network of the client if Frang is
+ * configured to block networks of misbehaving clients.
+ */
+static void
+frang_block_ip(const TfwAddr *addr, unsigned int prefix4, unsigned int prefix6)
+{
+	tfw_filter_block_net(addr, tfw_addr_is_v4mapped(addr)
+				   ? prefix4 + 96 : prefix6);
+}
+
 #ifdef DEBUG
 #define frang_dbg(fmt_msg, addr, ...)					\
 do {									\
@@ -383,7 +438,9 @@ frang_conn_new(struct sock *sk)
 	 */
 	r = frang_conn_limit(ra, dflt_vh->frang_gconf);
 	if (r == TFW_BLOCK && dflt_vh->frang_gconf->ip_block) {
-		tfw_filter_block_ip(&cli->addr);
+		frang_block_ip(&cli->addr,
+			       dflt_vh->frang_gconf->ip_block_prefix4,
+			       dflt_vh->frang_gconf->ip_block_prefix6);
 		tfw_client_put(cli);
 	}
 
@@ -424,32 +481,55 @@ frang_time_in_frame(const unsigned long tcur, const unsigned long tprev)
 	return tprev + FRANG_FREQ > tcur;
 }
 
+/*
+ * Account a request in history slot @slot for time quantum @ts and return
+ * the number of requests during the quantum.
+ */
+static unsigned long
+frang_req_slot_inc(atomic64_t *slot, unsigned long ts)
+{
+	s64 old = atomic64_read(slot), new;
+
+	do {
+		if ((unsigned long)old >> FRANG_REQ_CNT_BITS != ts)
+			new = (ts << FRANG_REQ_CNT_BITS) | 1;
+		else if ((old & FRANG_REQ_CNT_MASK) == FRANG_REQ_CNT_MASK)
+			return FRANG_REQ_CNT_MASK;
+		else
+			new = old + 1;
+	} while (!atomic64_try_cmpxchg(slot, &old, new));
+
+	return new & FRANG_REQ_CNT_MASK;
+}
+
+/*
+ * Requests are accounted w/o the client lock, so concurrent requests from
+ * other CPUs may be missed in the sum, but never lost in the history.
+ */
 static int
 frang_req_limit(FrangAcc *ra, unsigned int req_burst, unsigned int req_rate)
 {
-	unsigned long ts = jiffies * FRANG_FREQ / HZ;
-	unsigned int rsum = 0;
+	unsigned long ts = (jiffies * FRANG_FREQ / HZ) & FRANG_REQ_TS_MASK;
+	unsigned long cnt, rsum = 0;
 	int i = ts % FRANG_FREQ;
 
 	if (!req_burst && !req_rate)
 		return TFW_PASS;
 
-	if (ra->history[i].ts != ts) {
-		ra->history[i].ts = ts;
-		ra->history[i].conn_new = 0;
-		ra->history[i].req = 0;
-	}
-	ra->history[i].req++;
-
-	if (req_burst && ra->history[i].req > req_burst) {
-		frang_limmsg("requests burst", ra->history[i].req,
-			     req_burst, &FRANG_ACC2CLI(ra)->addr);
+	cnt = frang_req_slot_inc(&ra->req_hist[i], ts);
+	if (req_burst && cnt > req_burst) {
+		frang_limmsg("requests burst", cnt, req_burst,
+			     &FRANG_ACC2CLI(ra)->addr);
 		return TFW_BLOCK;
 	}
 	/* Collect current request sum. */
-	for (i = 0; i < FRANG_FREQ; i++)
-		if (frang_time_in_frame(ts, ra->history[i].ts))
-			rsum += ra->history[i].req;
+	for (i = 0; i < FRANG_FREQ; i++) {
+		s64 v = atomic64_read(&ra->req_hist[i]);
+
+		if (frang_time_in_frame(ts, (unsigned long)v
+					    >> FRANG_REQ_CNT_BITS))
+			rsum += v & FRANG_REQ_CNT_MASK;
+	}
 	if (req_rate && rsum > req_rate) {
 		frang_limmsg("request rate", rsum, req_rate,
 			     &FRANG_ACC2CLI(ra)->addr);
@@ -459,6 +539,55 @@ frang_req_limit(FrangAcc *ra, unsigned int req_burst, unsigned int req_rate)
 	return TFW_PASS;
 }
 
+/*
+ * Account a request to the location with @f_cfg limits. The location counters
+ * are looked up by the location identifier in the client accounting data, and
+ * the counters of the location with the oldest requests are reused for a new
+ * location. As for @req_hist, no lock is taken, so concurrent requests may be
+ * missed, and a client requesting more than FRANG_LOC_N limited locations at
+ * the same second may be accounted not in full.
+ */
+static int
+frang_loc_req_limit(FrangAcc *ra, const FrangVhostCfg *f_cfg)
+{
+	unsigned long ts = (jiffies * FRANG_FREQ / HZ) & FRANG_REQ_TS_MASK;
+	unsigned long sec = (jiffies / HZ) & FRANG_REQ_TS_MASK;
+	unsigned long cnt, t, old_ts = ULONG_MAX;
+	FrangLocAcc *la, *old = NULL;
+	int i;
+
+	for (i = 0; i < FRANG_LOC_N; ++i) {
+		la = &ra->loc_acc[i];
+		if (READ_ONCE(la->id) == f_cfg->loc_id)
+			goto found;
+		t = (unsigned long)atomic64_read(&la->rate)
+		    >> FRANG_REQ_CNT_BITS;
+		if (t < old_ts) {
+			old_ts = t;
+			old = la;
+		}
+	}
+	la = old;
+	WRITE_ONCE(la->id, f_cfg->loc_id);
+	atomic64_set(&la->rate, 0);
+	atomic64_set(&la->burst, 0);
+found:
+	cnt = frang_req_slot_inc(&la->burst, ts);
+	if (f_cfg->loc_req_burst && cnt > f_cfg->loc_req_burst) {
+		frang_limmsg("location requests burst", cnt,
+			     f_cfg->loc_req_burst, &FRANG_ACC2CLI(ra)->addr);
+		return TFW_BLOCK;
+	}
+	cnt = frang_req_slot_inc(&la->rate, sec);
+	if (f_cfg->loc_req_rate && cnt > f_cfg->loc_req_rate) {
+		frang_limmsg("location request rate", cnt,
+			     f_cfg->loc_req_rate, &FRANG_ACC2CLI(ra)->addr);
+		return TFW_BLOCK;
+	}
+
+	return TFW_PASS;
+}
+
 static int
 frang_http_uri_len(const TfwHttpReq *req, FrangAcc *ra, unsigned int uri_len)
 {
@@ -564,11 +693,52 @@ frang_http_methods_override(const TfwHttpReq *req, FrangAcc *ra,
 	return TFW_PASS;
 }
 
+unsigned int
+frang_ct_hash(const char *str, size_t len)
+{
+	return hash_calc(str, len);
+}
+
+/**
+ * Look up the media type of Content-Type @field in @ct_vals. Only one
+ * media type copy and hash calculation is required regardless the number
+ * of allowed values.
+ */
+static bool
+frang_ct_lookup(const TfwStr *field, FrangCtVals *ct_vals)
+{
+	char buf[FRANG_CT_MAX_LEN];
+	const TfwStr *c, *end;
+	unsigned int i, n = 0, mask = (1U << ct_vals->hbits) - 1;
+
+	TFW_STR_FOR_EACH_CHUNK(c, field, end) {
+		for (i = 0; i < c->len; ++i) {
+			char ch = c->data[i];
+
+			if (ch == ';' || ch == ' ' || ch == '\t')
+				goto done;
+			if (n == ct_vals->max_len)
+				return false;
+			buf[n++] = tolower(ch);
+		}
+	}
+done:
+	for (i = frang_ct_hash(buf, n) & mask; ct_vals->htbl[i];
+	     i = (i + 1) & mask)
+	{
+		FrangCtVal *val = &ct_vals->vals[ct_vals->htbl[i] - 1];
+
+		if (val->len == n && !memcmp(val->str, buf, n))
+			return true;
+	}
+
+	return false;
+}
+
 static int
 frang_http_ct_check(const TfwHttpReq *req, FrangAcc *ra, FrangCtVals *ct_vals)
 {
 	TfwStr field, *s;
-	FrangCtVal *curr;
 
 	if (req->method != TFW_HTTP_METH_POST)
 		return TFW_PASS;
@@ -584,29 +754,16 @@ frang_http_ct_check(const TfwHttpReq *req, FrangAcc *ra, FrangCtVals *ct_vals)
 				 TFW_HTTP_HDR_CONTENT_TYPE, &field);
 
 	/*
-	 * Verify that Content-Type value is on the list of allowed values.
-	 * Use prefix match to allow parameters, see RFC 7231 3.1.1:
+	 * Verify that Content-Type media type is on the list of allowed
+	 * values, parameters aren't matched, see RFC 7231 3.1.1:
 	 *
 	 *	Content-Type = media-type
 	 *	media-type = type "/" subtype *( OWS ";" OWS parameter )
 	 *
-	 * FIXME this matching is too permissive, e.g. we can pass
-	 * "text/plain1", which isn't a correct subtype. Strong FSM processing
-	 * is required. Or HTTP parser must pass only known types and Frang
-	 * decides which of them are allowed.
-	 * See also comment in frang_set_ct_vals().
-	 *
-	 * TODO: possible improvement: binary search.
-	 * Generally binary search is more efficient, but linear search
-	 * is usually faster for small sets of values. Perhaps we should
-	 * switch between the two if performance is critical here,
-	 * but benchmarks should be done to measure the impact.
+	 * Media types are case-insensitive, so they're stored in lower case.
 	 */
-	for (curr = ct_vals->vals; curr->str; ++curr) {
-		if (tfw_str_eq_cstr(&field, curr->str, curr->len,
-				    TFW_STR_EQ_PREFIX_CASEI))
-			return TFW_PASS;
-	}
+	if (!ct_vals || frang_ct_lookup(&field, ct_vals))
+		return TFW_PASS;
 
 	/* Take first chunk only for logging. */
 	s = TFW_STR_CHUNK(&field, 0);
@@ -1100,9 +1257,11 @@ frang_http_req_process(FrangAcc *ra, TfwConn *conn, TfwFsmData *data,
 	if (WARN_ON_ONCE(!fg_cfg || !f_cfg))
 		return TFW_BLOCK;
 
-	spin_lock(&ra->lock);
-
 	/*
+	 * The checks use the request state only, which is serialized by the
+	 * connection, and the request rate accounting is lock-free, so the
+	 * client lock isn't taken.
+	 *
 	 * Detect slowloris attack first, and then proceed with more precise
 	 * checks. This is not an FSM state, because the checks are required
 	 * every time a new request chunk is received and will be present in
@@ -1113,10 +1272,8 @@ frang_http_req_process(FrangAcc *ra, TfwConn *conn, TfwFsmData *data,
 	else
 		r = frang_http_req_incomplete_body_check(ra, data, fg_cfg,
 							 f_cfg);
-	if (r) {
-		spin_unlock(&ra->lock);
+	if (r)
 		return r;
-	}
 
 	T_FSM_START(req->frang_st) {
 
@@ -1195,6 +1352,18 @@ frang_http_req_process(FrangAcc *ra, TfwConn *conn, TfwFsmData *data,
 		*/
 		if (f_cfg->http_ct_required || f_cfg->http_ct_vals)
 			r = frang_http_ct_check(req, ra, f_cfg->http_ct_vals);
+		/*
+		 * Streamed request body is forwarded by parts, so block too
+		 * long body before any part of it is forwarded.
+		 */
+		if (!r && f_cfg->http_body_len
+		    && req->content_length > f_cfg->http_body_len)
+		{
+			frang_limmsg("HTTP body length", req->content_length,
+				     f_cfg->http_body_len,
+				     &FRANG_ACC2CLI(ra)->addr);
+			r = TFW_BLOCK;
+		}
 
 		__FRANG_FSM_MOVE(Frang_Req_Body_Start);
 	}
@@ -1230,6 +1399,12 @@ frang_http_req_process(FrangAcc *ra, TfwConn *conn, TfwFsmData *data,
 
 	/* All limits are verified for current request. */
 	T_FSM_STATE(Frang_Req_Done) {
+		/* The request location is known for the complete request. */
+		if ((f_cfg->loc_req_rate || f_cfg->loc_req_burst)
+		    && (r = frang_loc_req_limit(ra, f_cfg)))
+		{
+			T_FSM_EXIT();
+		}
 		frang_dbg("checks done for client %s\n",
 			  &FRANG_ACC2CLI(ra)->addr);
 		tfw_gfsm_move(&conn->state, TFW_FRANG_REQ_FSM_DONE, data);
@@ -1239,8 +1414,6 @@ frang_http_req_process(FrangAcc *ra, TfwConn *conn, TfwFsmData *data,
 	}
 	T_FSM_FINISH(r, req->frang_st);
 
-	spin_unlock(&ra->lock);
-
 	return r;
 }
 
@@ -1264,7 +1437,9 @@ frang_http_req_handler(void *obj, TfwFsmData *data)
 		return TFW_BLOCK;
 	r = frang_http_req_process(ra, conn, data, dvh);
 	if (r == TFW_BLOCK && dvh->frang_gconf->ip_block)
-		tfw_filter_block_ip(&FRANG_ACC2CLI(ra)->addr);
+		frang_block_ip(&FRANG_ACC2CLI(ra)->addr,
+			       dvh->frang_gconf->ip_block_prefix4,
+			       dvh->frang_gconf->ip_block_prefix6);
 	tfw_vhost_put(dvh);
 
 	return r;
@@ -1404,12 +1579,62 @@ frang_resp_fwd_process(TfwHttpResp *resp)
 				? req->vhost->vhost_dflt->frang_gconf
 				: req->vhost->frang_gconf;
 		if (fg_cfg->ip_block)
-			tfw_filter_block_ip(&FRANG_ACC2CLI(ra)->addr);
+			frang_block_ip(&FRANG_ACC2CLI(ra)->addr,
+				       fg_cfg->ip_block_prefix4,
+				       fg_cfg->ip_block_prefix6);
 	}
 
 	return r;
 }
 
+/**
+ * Account a failed sticky cookie verification for the client of @req. Each
+ * invalid cookie costs an HMAC calculation and, probably, a redirect or
+ * JS challenge response, so the clients replaying invalid cookies are
+ * limited by http_sticky_fail_rate.
+ */
+int
+frang_sticky_fail(TfwHttpReq *req)
+{
+	TfwClient *cli = req->peer ? : (TfwClient *)req->conn->peer;
+	FrangAcc *ra = FRANG_CLI2ACC(cli);
+	/* Default vhost has no 'vhost_dflt' member set. */
+	FrangGlobCfg *fg_cfg = req->vhost->vhost_dflt
+			? req->vhost->vhost_dflt->frang_gconf
+			: req->vhost->frang_gconf;
+	unsigned long ts = jiffies * FRANG_FREQ / HZ;
+	unsigned int sum = 0;
+	int i = ts % FRANG_FREQ;
+
+	if (!fg_cfg->http_sticky_fail_rate)
+		return TFW_PASS;
+
+	spin_lock(&ra->lock);
+
+	if (ra->history[i].ts != ts) {
+		bzero_fast(&ra->history[i], sizeof(ra->history[i]));
+		ra->history[i].ts = ts;
+	}
+	ra->history[i].sticky_fail++;
+
+	for (i = 0; i < FRANG_FREQ; i++)
+		if (ra->history[i].ts + FRANG_FREQ >= ts)
+			sum += ra->history[i].sticky_fail;
+
+	spin_unlock(&ra->lock);
+
+	if (sum <= fg_cfg->http_sticky_fail_rate)
+		return TFW_PASS;
+
+	frang_limmsg("invalid sticky cookies rate", sum,
+		     fg_cfg->http_sticky_fail_rate, &cli->addr);
+	if (fg_cfg->ip_block)
+		frang_block_ip(&cli->addr, fg_cfg->ip_block_prefix4,
+			       fg_cfg->ip_block_prefix6);
+
+	return TFW_BLOCK;
+}
+
 static int
 frang_resp_handler(void *obj, TfwFsmData *data)
 {
@@ -1526,7 +1751,9 @@ frang_tls_handler(void *obj, TfwFsmData *data)
 
 	r = frang_tls_conn_limit(ra, dflt_vh->frang_gconf, hs_state);
 	if (r == TFW_BLOCK && dflt_vh->frang_gconf->ip_block)
-		tfw_filter_block_ip(&FRANG_ACC2CLI(ra)->addr);
+		frang_block_ip(&FRANG_ACC2CLI(ra)->addr,
+			       dflt_vh->frang_gconf->ip_block_prefix4,
+			       dflt_vh->frang_gconf->ip_block_prefix6);
 
 	spin_unlock(&ra->lock);
 	tfw_vhost_put(dflt_vh);
@@ -1534,6 +1761,74 @@ frang_tls_handler(void *obj, TfwFsmData *data)
 	return r;
 }
 
+/**
+ * Copy the HTTP/2 frame limits from the global configuration to a new
+ * connection, so the default vhost isn't looked up for each received frame.
+ * Configuration reload affects only new connections.
+ */
+void
+frang_h2_rates_init(TfwFrameRates *fr)
+{
+	TfwVhost *dflt_vh = tfw_vhost_lookup_default();
+	FrangGlobCfg *conf;
+
+	if (WARN_ON_ONCE(!dflt_vh))
+		return;
+	conf = dflt_vh->frang_gconf;
+
+	fr->lim[HTTP2_FLIM_STREAM] = conf->http_strm_rate;
+	fr->lim[HTTP2_FLIM_RST] = conf->http_rst_rate;
+	fr->lim[HTTP2_FLIM_PING] = conf->http_ping_rate;
+	fr->lim[HTTP2_FLIM_SETTINGS] = conf->http_settings_rate;
+	fr->lim[HTTP2_FLIM_EMPTY] = conf->http_empty_frame_rate;
+	fr->ip_block = conf->ip_block;
+	fr->ip_prefix4 = conf->ip_block_prefix4;
+	fr->ip_prefix6 = conf->ip_block_prefix6;
+
+	tfw_vhost_put(dflt_vh);
+}
+
+/**
+ * Skip the TLS handshake hook if there are no TLS limits in the global
+ * configuration @conf, and the response hooks if no location limits
+ * responses, see frang_resp_process() and frang_resp_fwd_process().
+ * Called on the configuration applying.
+ */
+void
+frang_hooks_enable(const FrangGlobCfg *conf, bool resp)
+{
+	tfw_gfsm_enable_fsm(TFW_FSM_FRANG_TLS,
+			    conf->tls_new_conn_rate || conf->tls_new_conn_burst
+			    || conf->tls_incomplete_conn_rate);
+	tfw_gfsm_enable_fsm(TFW_FSM_FRANG_RESP, resp);
+}
+
+/**
+ * Slow path of frang_h2_frame_limit(): the client exceeded a frame rate.
+ */
+int
+__frang_h2_frame_block(TfwH2Ctx *ctx, TfwFrameLim type)
+{
+	static const char *const names[_HTTP2_FLIM_NUM] = {
+		[HTTP2_FLIM_STREAM]	= "streams",
+		[HTTP2_FLIM_RST]	= "RST_STREAM frames",
+		[HTTP2_FLIM_PING]	= "PING frames",
+		[HTTP2_FLIM_SETTINGS]	= "SETTINGS frames",
+		[HTTP2_FLIM_EMPTY]	= "empty frames",
+	};
+	TfwConn *conn = (TfwConn *)container_of(ctx, TfwH2Conn, h2);
+	TfwFrameRates *fr = &ctx->frate;
+
+	frang_msg("HTTP/2 frame rate exceeded", &conn->peer->addr,
+		  ": %u %s per second (lim=%u)\n", fr->cnt[type],
+		  names[type], fr->lim[type]);
+	if (fr->ip_block)
+		frang_block_ip(&conn->peer->addr, fr->ip_prefix4,
+			       fr->ip_prefix6);
+
+	return TFW_BLOCK;
+}
+
 static TfwClassifier frang_class_ops = {
 	.name			= "frang",
 	.classify_conn_estab	= frang_conn_new,
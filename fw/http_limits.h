@@ -36,9 +36,9 @@
 
 /* Size of classifier private client accounting data. */
 #ifdef CONFIG_DEBUG_LOCK_ALLOC
-#define TFW_CLASSIFIER_ACCSZ	512
+#define TFW_CLASSIFIER_ACCSZ	672
 #else
-#define TFW_CLASSIFIER_ACCSZ	264
+#define TFW_CLASSIFIER_ACCSZ	424
 #endif
 
 typedef struct { char _[TFW_CLASSIFIER_ACCSZ]; } TfwClassifierPrvt;
@@ -134,30 +134,42 @@ typedef struct {
 	size_t		len;
 } FrangCtVal;
 
+/* Maximum length of a media type, RFC 6838 4.2. */
+#define FRANG_CT_MAX_LEN	255
+
 /**
  * Variable-sized array of allowed Content-Type values. It's allocated by single
  * memory piece to keep all the data as close as possible.
  * @alloc_sz		- Full size of the structure;
+ * @max_len		- Maximum length of the allowed values;
+ * @hbits		- log2 of @htbl size;
  * @vals		- Variable array of allowed values;
+ * @htbl		- Open addressing hash table of the lower case values,
+ *			  stores indexes in @vals plus one, zero for empty slots;
  * @data		- Variable sized data area where @vals points to.
  *
  * Basically that will look like:
- *   [@vals                                   ][@data               ]
- *   [FrangCtVal, FrangCtVal, FrangCtVal, NULL][str1\0\str2\0\str3\0]
- *           +         +         +              ^      ^      ^
- *           |         |         |              |      |      |
- *           +----------------------------------+      |      |
- *                     |         |                     |      |
- *                     +-------------------------------+      |
- *                               |                            |
- *                               +----------------------------+
+ *   [@vals                                   ][@htbl  ][@data               ]
+ *   [FrangCtVal, FrangCtVal, FrangCtVal, NULL][3,0,1,2][str1\0\str2\0\str3\0]
+ *           +         +         +                       ^      ^      ^
+ *           |         |         |                       |      |      |
+ *           +-------------------------------------------+      |      |
+ *                     |         |                              |      |
+ *                     +----------------------------------------+      |
+ *                               |                                     |
+ *                               +-------------------------------------+
  */
 typedef struct {
 	size_t		alloc_sz;
+	unsigned int	max_len;
+	unsigned int	hbits;
 	FrangCtVal	*vals;
+	unsigned short	*htbl;
 	char		*data;
 } FrangCtVals;
 
+unsigned int frang_ct_hash(const char *str, size_t len);
+
 /**
  * Global Frang limits. As a request is received, it's not possible to determine
  * its target vhost or/and location until all the headers are parsed. Thus some
@@ -180,8 +192,24 @@ typedef struct {
  * @tls_incomplete_conn_rate - Maximum rate of uncompleted tls connections;
  * @http_hchunk_cnt	- Maximum number of chunks in header part;
  * @http_bchunk_cnt	- Maximum number of chunks in body part;
+ * @http_strm_rate	- Maximum number of HTTP/2 streams opened per second
+ *			  on the same connection;
+ * @http_rst_rate	- Maximum number of RST_STREAM frames per second on the
+ *			  same HTTP/2 connection;
+ * @http_ping_rate	- Maximum number of PING frames per second on the same
+ *			  HTTP/2 connection;
+ * @http_settings_rate	- Maximum number of SETTINGS frames per second on the
+ *			  same HTTP/2 connection;
+ * @http_empty_frame_rate - Maximum number of empty DATA and CONTINUATION
+ *			  frames, which don't end a stream or a header block,
+ *			  per second on the same HTTP/2 connection;
+ * @http_sticky_fail_rate - Maximum number of requests with invalid sticky
+ *			  cookies per second from the same client;
  * @ip_block		- Block clients by IP address if set, if not - just
  *			  close the client connection.
+ * @ip_block_prefix4	- Prefix length of IPv4 networks blocked along with
+ *			  blocked clients, 32 blocks only the client address;
+ * @ip_block_prefix6	- The same for IPv6 networks;
  *
  * Zero value means unlimited value.
  */
@@ -201,7 +229,16 @@ struct frang_global_cfg_t {
 	unsigned int		http_hchunk_cnt;
 	unsigned int		http_bchunk_cnt;
 
+	unsigned int		http_strm_rate;
+	unsigned int		http_rst_rate;
+	unsigned int		http_ping_rate;
+	unsigned int		http_settings_rate;
+	unsigned int		http_empty_frame_rate;
+	unsigned int		http_sticky_fail_rate;
+
 	bool			ip_block;
+	unsigned int		ip_block_prefix4;
+	unsigned int		ip_block_prefix6;
 };
 
 /**
@@ -221,6 +258,11 @@ struct frang_global_cfg_t {
  * @http_ct_required	- Header 'Content-Type:' is required;
  * @http_host_required	- Header 'Host:' is required;
  * @http_method_override - Allow method override in request headers.
+ * @loc_req_rate	- Maximum requests per second from the same client to
+ *			  the location;
+ * @loc_req_burst	- Allowed rate burst of requests to the location;
+ * @loc_id		- Unique identifier of the location for accounting of
+ *			  @loc_req_rate and @loc_req_burst.
  */
 struct frang_vhost_cfg_t {
 	unsigned long		http_methods_mask;
@@ -236,6 +278,38 @@ struct frang_vhost_cfg_t {
 	bool			http_host_required;
 	bool			http_trailer_split;
 	bool			http_method_override;
+
+	unsigned int		loc_req_rate;
+	unsigned int		loc_req_burst;
+	unsigned int		loc_id;
 };
 
+void frang_h2_rates_init(TfwFrameRates *fr);
+void frang_hooks_enable(const FrangGlobCfg *conf, bool resp);
+int frang_sticky_fail(TfwHttpReq *req);
+int __frang_h2_frame_block(TfwH2Ctx *ctx, TfwFrameLim type);
+
+/**
+ * Account a received HTTP/2 frame of @type in a fixed one second window.
+ * Called for each received frame before any allocations for it, so only
+ * a limit violation leaves the fast path.
+ */
+static inline int
+frang_h2_frame_limit(TfwH2Ctx *ctx, TfwFrameLim type)
+{
+	TfwFrameRates *fr = &ctx->frate;
+	unsigned long ts = jiffies / HZ;
+
+	if (!fr->lim[type])
+		return TFW_PASS;
+	if (unlikely(fr->ts != ts)) {
+		fr->ts = ts;
+		memset(fr->cnt, 0, sizeof(fr->cnt));
+	}
+	if (likely(++fr->cnt[type] <= fr->lim[type]))
+		return TFW_PASS;
+
+	return __frang_h2_frame_block(ctx, type);
+}
+
 #endif /* __HTTP_LIMITS__ */
@@ -20,6 +20,8 @@
  *    existence in @arg:
  *    "==": "arg" => eq / "arg*" => eq_prefix / "*arg" => eq_suffix.
  *    "!=": "arg" => non_eq / "arg*" => non_eq_prefix / "*arg" => non_eq_suffix.
+ *    "~" ("!~"): "arg" is a regular expression compiled into a DFA, see
+ *    regex.c; only uri, host and special headers can be matched this way.
  *  - @act is a rule action with appropriate type (examples specified above);
  *    possible types are: reference to virtual host (defined before), reference
  *    to other HTTP chain (defined before and not the same), "mark" action for
@@ -32,6 +34,12 @@
  * all rules in all chains in the table and stops on a first matching rule (the
  * rule is returned).
  *
+ * Each rule has a single condition, so rules comparing URI, host, method or
+ * mark for equality are indexed by the compared value at the end of
+ * configuration, see tfw_http_chain_compile(). A request is evaluated only
+ * against the rules having the same values as the request and the rules
+ * which can't be indexed, in the order of the rules in the chain.
+ *
  * Internally, each @field is dispatched to a corresponding match_* function.
  * For example:
  *  TFW_HTTP_MATCH_F_METHOD => match_method
@@ -68,6 +76,9 @@
  * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 #include <linux/ctype.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+
 #include "http_match.h"
 #include "http_msg.h"
 #include "cfg.h"
@@ -127,6 +138,9 @@ hdr_val_eq(const TfwHttpReq *req, const TfwHttpMatchRule *rule,
 
 	tfw_http_msg_clnthdr_val(req, hdr, id, &hdr_val);
 
+	if (op == TFW_HTTP_MATCH_O_REGEX)
+		return tfw_regex_match(rule->re, &hdr_val);
+
 	flags = map_op_to_str_eq_flags(rule->op);
 	/*
 	 * There is no general rule, but most headers are case-insensitive.
@@ -161,6 +175,8 @@ match_uri(const TfwHttpReq *req, const TfwHttpMatchRule *rule)
 
 	if (rule->op == TFW_HTTP_MATCH_O_WILDCARD)
 		return true;
+	if (rule->op == TFW_HTTP_MATCH_O_REGEX)
+		return tfw_regex_match(rule->re, uri_path);
 
 	flags = map_op_to_str_eq_flags(rule->op);
 	/* RFC 7230:
@@ -190,6 +206,8 @@ match_host(const TfwHttpReq *req, const TfwHttpMatchRule *rule)
 
 	if (rule->op == TFW_HTTP_MATCH_O_WILDCARD)
 		return true;
+	if (rule->op == TFW_HTTP_MATCH_O_REGEX)
+		return tfw_regex_match(rule->re, host);
 
 	flags = map_op_to_str_eq_flags(rule->op);
 	/*
@@ -497,6 +515,283 @@ tfw_http_match_req(const TfwHttpReq *req, struct list_head *mlst)
 	return NULL;
 }
 
+/**
+ * Index of a list of rules.
+ *
+ * @generic	- Rules which can't be indexed, NULL-terminated;
+ * @htbl	- Hash table of NULL-terminated arrays of indexed rules;
+ * @bits	- Order of @htbl size;
+ * @fields	- Bitmask of indexed fields.
+ *
+ * Rules in all the arrays are in the same order as in the list.
+ */
+struct tfw_http_match_idx_t {
+	TfwHttpMatchRule	**generic;
+	TfwHttpMatchRule	***htbl;
+	unsigned int		bits;
+	unsigned int		fields;
+};
+
+/* Generic rules and rules of each indexed field. */
+#define TFW_HTTP_MATCH_IDX_STREAMS	5
+
+static unsigned long
+tfw_http_match_hash_str(const TfwStr *str)
+{
+	const TfwStr *c, *end;
+	unsigned long h = 0;
+	size_t i;
+
+	/* The same case-insensitive comparison as for the rules. */
+	TFW_STR_FOR_EACH_CHUNK(c, str, end)
+		for (i = 0; i < c->len; ++i)
+			h = h * 31 + tolower((unsigned char)c->data[i]);
+
+	return h;
+}
+
+static unsigned long
+tfw_http_match_idx_slot(const TfwHttpMatchIdx *idx, tfw_http_match_fld_t field,
+			unsigned long key)
+{
+	return hash_long(key * _TFW_HTTP_MATCH_F_COUNT + field, idx->bits);
+}
+
+/*
+ * Only rules with equality conditions on the fields below are indexed. Mark
+ * rules are indexed only if no rule of the list changes the mark, since the
+ * index is looked up by the mark before the rules are evaluated.
+ */
+static bool
+tfw_http_match_idx_key(const TfwHttpMatchRule *rule, bool mark_act,
+		       unsigned long *key)
+{
+	TfwStr arg;
+
+	if (rule->inv || rule->op != TFW_HTTP_MATCH_O_EQ)
+		return false;
+
+	switch (rule->field) {
+	case TFW_HTTP_MATCH_F_URI:
+	case TFW_HTTP_MATCH_F_HOST:
+		arg = (TfwStr){ .data = (char *)rule->arg.str,
+				.len = rule->arg.len };
+		*key = tfw_http_match_hash_str(&arg);
+		return true;
+	case TFW_HTTP_MATCH_F_METHOD:
+		*key = rule->arg.method;
+		return true;
+	case TFW_HTTP_MATCH_F_MARK:
+		*key = rule->arg.num;
+		return !mark_act;
+	default:
+		return false;
+	}
+}
+
+static TfwHttpMatchIdx *
+tfw_http_match_idx_build(struct list_head *mlst, TfwPool *pool)
+{
+	TfwHttpMatchIdx *idx;
+	TfwHttpMatchRule *rule, **p;
+	unsigned int n = 0, ni = 0, *cnt, i;
+	unsigned long key;
+	bool mark_act = false;
+	size_t sz;
+
+	list_for_each_entry(rule, mlst, list)
+		mark_act |= rule->act.type == TFW_HTTP_MATCH_ACT_MARK;
+	list_for_each_entry(rule, mlst, list) {
+		rule->seq = n++;
+		ni += tfw_http_match_idx_key(rule, mark_act, &key);
+	}
+	/* Nothing to index, linear matching is used. */
+	if (!ni)
+		return NULL;
+
+	i = roundup_pow_of_two(ni * 2);
+	sz = sizeof(TfwHttpMatchIdx)
+	     + sizeof(TfwHttpMatchRule **) * i
+	     + sizeof(TfwHttpMatchRule *) * (n - ni + 1 + ni + i);
+	if (!(idx = tfw_pool_alloc(pool, sz)))
+		return ERR_PTR(-ENOMEM);
+	if (!(cnt = kcalloc(i, sizeof(*cnt), GFP_KERNEL)))
+		return ERR_PTR(-ENOMEM);
+	memset(idx, 0, sz);
+	idx->bits = ilog2(i);
+	idx->htbl = (TfwHttpMatchRule ***)(idx + 1);
+	idx->generic = (TfwHttpMatchRule **)(idx->htbl + i);
+
+	list_for_each_entry(rule, mlst, list)
+		if (tfw_http_match_idx_key(rule, mark_act, &key))
+			++cnt[tfw_http_match_idx_slot(idx, rule->field, key)];
+
+	/* Place NULL-terminated buckets after the generic rules. */
+	p = idx->generic + n - ni + 1;
+	for (i = 0; i < (1U << idx->bits); ++i) {
+		if (!cnt[i])
+			continue;
+		idx->htbl[i] = p;
+		p += cnt[i] + 1;
+		cnt[i] = 0;
+	}
+
+	p = idx->generic;
+	list_for_each_entry(rule, mlst, list) {
+		if (tfw_http_match_idx_key(rule, mark_act, &key)) {
+			i = tfw_http_match_idx_slot(idx, rule->field, key);
+			idx->htbl[i][cnt[i]++] = rule;
+			idx->fields |= BIT(rule->field);
+		} else {
+			*p++ = rule;
+		}
+	}
+	kfree(cnt);
+
+	return idx;
+}
+
+/**
+ * Build indexes of the rules in @chain. The indexes are allocated from the
+ * table pool and freed with the table.
+ */
+int
+tfw_http_chain_compile(TfwHttpChain *chain)
+{
+	chain->mark_idx = tfw_http_match_idx_build(&chain->mark_list,
+						   chain->pool);
+	if (IS_ERR(chain->mark_idx))
+		goto err;
+	chain->match_idx = tfw_http_match_idx_build(&chain->match_list,
+						    chain->pool);
+	if (IS_ERR(chain->match_idx))
+		goto err;
+
+	return 0;
+err:
+	chain->mark_idx = chain->match_idx = NULL;
+	T_ERR_NL("http_tbl: can't allocate memory for index of HTTP chain\n");
+	return -ENOMEM;
+}
+
+static void
+tfw_http_match_idx_add(const TfwHttpMatchIdx *idx, tfw_http_match_fld_t field,
+		       unsigned long key, TfwHttpMatchRule ***s, int *n)
+{
+	TfwHttpMatchRule **b;
+
+	if (!(idx->fields & BIT(field)))
+		return;
+	if ((b = idx->htbl[tfw_http_match_idx_slot(idx, field, key)]))
+		s[(*n)++] = b;
+}
+
+/*
+ * The request is looked up in the indexes of several lists of rules, so the
+ * hashes of its fields are memoized in the request. The memoized values don't
+ * change the request, so the const qualifier is dropped.
+ */
+static unsigned long
+tfw_http_match_uri_hash(const TfwHttpReq *req)
+{
+	TfwHttpReq *r = (TfwHttpReq *)req;
+
+	if (!r->uri_hash)
+		r->uri_hash = tfw_http_match_hash_str(&req->uri_path);
+
+	return r->uri_hash;
+}
+
+/* Return false if the request has no host to match. */
+static bool
+tfw_http_match_host_hash(const TfwHttpReq *req)
+{
+	TfwHttpReq *r = (TfwHttpReq *)req;
+	const TfwStr *host = &req->host;
+	TfwStr *hdr = &req->h_tbl->tbl[TFW_HTTP_HDR_HOST], hdr_val;
+
+	if (r->host_hash)
+		return true;
+
+	/* The same value as match_host() compares. */
+	if (!host->len && !TFW_STR_EMPTY(hdr)) {
+		tfw_http_msg_clnthdr_val(req, hdr, TFW_HTTP_HDR_HOST,
+					 &hdr_val);
+		host = &hdr_val;
+	}
+	if (!host->len)
+		return false;
+	r->host_hash = tfw_http_match_hash_str(host);
+
+	return true;
+}
+
+/**
+ * Evaluate the rules from @idx which may match @req in the order of the
+ * rules in the list, so the result is the same as with linear matching.
+ */
+static TfwHttpMatchRule *
+tfw_http_match_idx(const TfwHttpReq *req, const TfwHttpMatchIdx *idx)
+{
+	TfwHttpMatchRule **s[TFW_HTTP_MATCH_IDX_STREAMS];
+	int i, n = 0;
+
+	if (*idx->generic)
+		s[n++] = idx->generic;
+	if (idx->fields & BIT(TFW_HTTP_MATCH_F_URI))
+		tfw_http_match_idx_add(idx, TFW_HTTP_MATCH_F_URI,
+				       tfw_http_match_uri_hash(req), s, &n);
+	if ((idx->fields & BIT(TFW_HTTP_MATCH_F_HOST))
+	    && tfw_http_match_host_hash(req))
+		tfw_http_match_idx_add(idx, TFW_HTTP_MATCH_F_HOST,
+				       req->host_hash, s, &n);
+	tfw_http_match_idx_add(idx, TFW_HTTP_MATCH_F_METHOD, req->method, s,
+			       &n);
+	if (idx->fields & BIT(TFW_HTTP_MATCH_F_MARK)) {
+		unsigned int mark = req->msg.skb_head->mark;
+
+		if (mark)
+			tfw_http_match_idx_add(idx, TFW_HTTP_MATCH_F_MARK,
+					       mark, s, &n);
+	}
+
+	while (n) {
+		TfwHttpMatchRule *rule;
+		int min = 0;
+
+		for (i = 1; i < n; ++i)
+			if ((*s[i])->seq < (*s[min])->seq)
+				min = i;
+		rule = *s[min]++;
+		if (!*s[min])
+			s[min] = s[--n];
+		if (do_eval(req, rule))
+			return rule;
+	}
+
+	return NULL;
+}
+
+/**
+ * Match a HTTP request against mark rules and then against match rules of
+ * @chain. Return a first matching rule.
+ */
+TfwHttpMatchRule *
+tfw_http_match_chain(const TfwHttpReq *req, TfwHttpChain *chain)
+{
+	TfwHttpMatchRule *rule;
+
+	rule = chain->mark_idx
+	       ? tfw_http_match_idx(req, chain->mark_idx)
+	       : tfw_http_match_req(req, &chain->mark_list);
+	if (rule)
+		return rule;
+
+	return chain->match_idx
+	       ? tfw_http_match_idx(req, chain->match_idx)
+	       : tfw_http_match_req(req, &chain->match_list);
+}
+
 /**
  * Allocate an empty HTTP chain.
  */
@@ -519,8 +814,12 @@ tfw_http_chain_add(const char *name, TfwHttpTable *table)
 	chain->pool = table->pool;
 
 	if (name) {
+		TfwStr s = TFW_STR_FROM_CSTR(name);
+
 		chain->name = (char *)(chain + 1);
 		memcpy((void *)chain->name, (void *)name, name_sz);
+		hash_add(table->chain_hash, &chain->hlist,
+			 tfw_http_match_hash_str(&s));
 	}
 
 	list_add(&chain->list, &table->head);
@@ -528,6 +827,23 @@ tfw_http_chain_add(const char *name, TfwHttpTable *table)
 	return chain;
 }
 
+/**
+ * Find a named HTTP chain in @table. Chain names are case-insensitive.
+ */
+TfwHttpChain *
+tfw_http_chain_lookup(const char *name, TfwHttpTable *table)
+{
+	TfwHttpChain *chain;
+	TfwStr s = TFW_STR_FROM_CSTR(name);
+
+	hash_for_each_possible(table->chain_hash, chain, hlist,
+			       tfw_http_match_hash_str(&s))
+		if (!strcasecmp(chain->name, name))
+			return chain;
+
+	return NULL;
+}
+
 /**
  * Free http table (together with all elements allocated from its pool).
  */
@@ -697,6 +1013,37 @@ tfw_http_arg_adjust(const char *arg, tfw_http_match_fld_t field,
 	return arg_out;
 }
 
+/**
+ * Same as tfw_http_arg_adjust(), but for regular expression arguments which
+ * are copied as is. Raw headers are matched by prefix over the whole header
+ * line, so they can't be matched against a regular expression.
+ */
+const char *
+tfw_http_arg_regex(const char *arg, tfw_http_match_fld_t field,
+		   unsigned int hid, size_t *size_out,
+		   tfw_http_match_arg_t *type_out, tfw_http_match_op_t *op_out)
+{
+	char *arg_out;
+
+	if (field != TFW_HTTP_MATCH_F_URI && field != TFW_HTTP_MATCH_F_HOST
+	    && (field != TFW_HTTP_MATCH_F_HDR || hid == TFW_HTTP_HDR_RAW))
+	{
+		T_ERR_NL("http_match: regular expressions are supported only"
+			 " for uri, host and special headers: '%s'\n", arg);
+		return ERR_PTR(-EINVAL);
+	}
+
+	if (!(arg_out = kstrdup(arg, GFP_KERNEL))) {
+		T_ERR_NL("http_match: unable to allocate rule argument.\n");
+		return ERR_PTR(-ENOMEM);
+	}
+	*size_out = strlen(arg_out) + 1;
+	*type_out = TFW_HTTP_MATCH_A_STR;
+	*op_out = TFW_HTTP_MATCH_O_REGEX;
+
+	return arg_out;
+}
+
 int
 tfw_http_verify_hdr_field(tfw_http_match_fld_t field, const char **hdr_name,
 			  unsigned int *hid_out)
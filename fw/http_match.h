@@ -26,6 +26,7 @@
 #include "addr.h"
 #include "http.h"
 #include "http_tbl.h"
+#include "regex.h"
 
 typedef enum {
 	TFW_HTTP_MATCH_F_NA = 0,
@@ -44,6 +45,7 @@ typedef enum {
 	TFW_HTTP_MATCH_O_EQ,
 	TFW_HTTP_MATCH_O_PREFIX,
 	TFW_HTTP_MATCH_O_SUFFIX,
+	TFW_HTTP_MATCH_O_REGEX,
 	_TFW_HTTP_MATCH_O_COUNT
 } tfw_http_match_op_t;
 
@@ -95,6 +97,8 @@ typedef struct {
 	TfwHttpAction		act;   /* Rule action. */
 	unsigned int		hid;   /* Header ID. */
 	unsigned int		inv;   /* Comparison inversion (inequality) flag.*/
+	unsigned int		seq;   /* Position of the rule in its list. */
+	TfwRegex		*re;   /* Compiled @arg for regex operator. */
 	TfwHttpMatchArg 	arg;   /* A value to be compared with the field.
 					  note: the @arg has variable length. */
 } TfwHttpMatchRule;
@@ -108,6 +112,7 @@ typedef struct {
 	(offsetof(TfwHttpMatchRule, arg.str) + arg_len)
 
 TfwHttpChain *tfw_http_chain_add(const char *name, TfwHttpTable *table);
+TfwHttpChain *tfw_http_chain_lookup(const char *name, TfwHttpTable *table);
 void tfw_http_table_free(TfwHttpTable *table);
 
 /**
@@ -116,6 +121,9 @@ void tfw_http_table_free(TfwHttpTable *table);
  */
 TfwHttpMatchRule *tfw_http_match_req(const TfwHttpReq *req,
 				     struct list_head *mlst);
+TfwHttpMatchRule *tfw_http_match_chain(const TfwHttpReq *req,
+				       TfwHttpChain *chain);
+int tfw_http_chain_compile(TfwHttpChain *chain);
 
 /**
  * Allocate a new rule in a given chain.
@@ -130,6 +138,10 @@ const char *tfw_http_arg_adjust(const char *arg, tfw_http_match_fld_t field,
 				const char *raw_hdr_name, size_t *size_out,
 				tfw_http_match_arg_t *type_out,
 				tfw_http_match_op_t *op_out);
+const char *tfw_http_arg_regex(const char *arg, tfw_http_match_fld_t field,
+			       unsigned int hid, size_t *size_out,
+			       tfw_http_match_arg_t *type_out,
+			       tfw_http_match_op_t *op_out);
 int tfw_http_verify_hdr_field(tfw_http_match_fld_t field, const char **h_name,
 			      unsigned int *hid_out);
 
@@ -31,6 +31,7 @@
 #include "gfsm.h"
 #include "http_msg.h"
 #include "http_parser.h"
+#include "procfs.h"
 #include "ss_skb.h"
 
 /**
@@ -339,6 +340,17 @@ __hdr_is_singular(const TfwStr *hdr)
 	return tfw_http_msg_find_hdr(hdr, hdr_singular);
 }
 
+/*
+ * Names of headers @a and @b are determined by their HPACK static indexes,
+ * set by the parsers, so the names needn't be compared.
+ */
+static inline bool
+__hdr_idx_known(const TfwStr *a, const TfwStr *b)
+{
+	return a->hpack_idx >= HPACK_STATIC_REGULAR_IDX
+	       && b->hpack_idx >= HPACK_STATIC_REGULAR_IDX;
+}
+
 /**
  * Lookup for the header @hdr in already collected headers table @ht,
  * i.e. check whether the header is duplicate.
@@ -356,6 +368,11 @@ tfw_http_msg_hdr_lookup(TfwHttpMsg *hm, const TfwStr *hdr)
 		/* There is no sense to compare against all duplicates. */
 		if (h->flags & TFW_STR_DUPLICATE)
 			h = TFW_STR_CHUNK(h, 0);
+		if (__hdr_idx_known(hdr, h)) {
+			if (hdr->hpack_idx == h->hpack_idx)
+				break;
+			continue;
+		}
 		if (!tfw_stricmpspn(hdr, h, ':'))
 			break;
 	}
@@ -406,6 +423,8 @@ __hdr_name_cmp(const TfwStr *hdr, const TfwStr *cmp_hdr)
 
 	if (cmp_hdr->hpack_idx && cmp_hdr->hpack_idx == hdr->hpack_idx)
 		return 0;
+	if (__hdr_idx_known(hdr, cmp_hdr))
+		return 1;
 
 	if (unlikely(!hdr->len))
 		return 1;
@@ -567,8 +586,12 @@ tfw_http_msg_hdr_close(TfwHttpMsg *hm)
 	 * A new raw header is to be stored, but it can be a duplicate of some
 	 * existing header and we must find appropriate index for it.
 	 * Both the headers, the new one and existing one, can already be
-	 * compound.
+	 * compound. Identify the header name once by the HPACK static table,
+	 * so the name isn't compared with the names of the other well-known
+	 * headers here and in further lookups.
 	 */
+	if (!parser->hdr.hpack_idx)
+		parser->hdr.hpack_idx = tfw_hpack_hdr_name_idx(&parser->hdr);
 	id = __http_hdr_lookup(hm, &parser->hdr);
 
 	/* Allocate some more room if not enough to store the header. */
@@ -943,6 +966,8 @@ tfw_http_msg_del_str(TfwHttpMsg *hm, TfwStr *str)
 	int r;
 
 	BUG_ON(TFW_STR_DUP(str));
+	if (WARN_ON_ONCE(str->flags & TFW_STR_COPY))
+		return -EINVAL;
 
 	if ((r = ss_skb_cutoff_data(hm->msg.skb_head, str, 0, 0)))
 		return r;
@@ -1233,27 +1258,40 @@ tfw_http_msg_free(TfwHttpMsg *m)
 
 /**
  * Allocate a new HTTP message.
- * @full indicates how complex a message object is needed. When @full
- * is true, the message is set up and initialized with full support
- * for parsing and subsequent adjustment.
+ * @hdr_n indicates how complex a message object is needed. When @hdr_n
+ * isn't zero, the message is set up and initialized with full support
+ * for parsing and subsequent adjustment, and the headers table has room
+ * for @hdr_n items at least, special headers included. The table still
+ * grows on parsing of more headers.
  */
 TfwHttpMsg *
-__tfw_http_msg_alloc(int type, bool full)
+__tfw_http_msg_alloc_hdrs(int type, unsigned int hdr_n)
 {
+	unsigned int order;
+
 	TfwHttpMsg *hm = (type & Conn_Clnt)
-			 ? (TfwHttpMsg *)tfw_pool_new(TfwHttpReq,
-						      TFW_POOL_ZERO)
-			 : (TfwHttpMsg *)tfw_pool_new(TfwHttpResp,
-						      TFW_POOL_ZERO);
+			 ? (TfwHttpMsg *)tfw_pool_new_cls(TfwHttpReq,
+							  TFW_POOL_REQ,
+							  TFW_POOL_ZERO)
+			 : (TfwHttpMsg *)tfw_pool_new_cls(TfwHttpResp,
+							  TFW_POOL_RESP,
+							  TFW_POOL_ZERO);
 	if (!hm) {
 		T_WARN("Insufficient memory to create %s message\n",
 		       ((type & Conn_Clnt) ? "request" : "response"));
 		return NULL;
 	}
+	tfw_numa_stat_inc(TFW_NUMA_MSG, hm);
 
-	if (full) {
-		hm->h_tbl = (TfwHttpHdrTbl *)tfw_pool_alloc(hm->pool,
-							    TFW_HHTBL_SZ(1));
+	if (hdr_n) {
+		/*
+		 * Leave a free item over @hdr_n, so a message with the same
+		 * headers as the previous one doesn't reallocate the table.
+		 */
+		order = clamp_t(unsigned int,
+				DIV_ROUND_UP(hdr_n + 1, TFW_HTTP_HDR_NUM),
+				1, TFW_HHTBL_ORDER_MAX);
+		hm->h_tbl = tfw_pool_alloc(hm->pool, TFW_HHTBL_SZ(order));
 		if (unlikely(!hm->h_tbl)) {
 			T_WARN("Insufficient memory to create header table"
 			       " for %s\n",
@@ -1261,9 +1299,9 @@ __tfw_http_msg_alloc(int type, bool full)
 			tfw_pool_destroy(hm->pool);
 			return NULL;
 		}
-		hm->h_tbl->size = __HHTBL_SZ(1);
+		hm->h_tbl->size = __HHTBL_SZ(order);
 		hm->h_tbl->off = TFW_HTTP_HDR_RAW;
-		bzero_fast(hm->h_tbl->tbl, __HHTBL_SZ(1) * sizeof(TfwStr));
+		bzero_fast(hm->h_tbl->tbl, __HHTBL_SZ(order) * sizeof(TfwStr));
 	}
 
 	hm->msg.skb_head = NULL;
@@ -1278,6 +1316,12 @@ __tfw_http_msg_alloc(int type, bool full)
 	return hm;
 }
 
+TfwHttpMsg *
+__tfw_http_msg_alloc(int type, bool full)
+{
+	return __tfw_http_msg_alloc_hdrs(type, full ? TFW_HTTP_HDR_RAW : 0);
+}
+
 int
 tfw_http_msg_expand_data(TfwMsgIter *it, struct sk_buff **skb_head,
 			 const TfwStr *src, unsigned int *start_off)
@@ -1334,7 +1378,7 @@ this_chunk:
 				it->frag = -1;
 			}
 			else if (cur_len != f_room || c + 1 < end) {
-				struct page *page = alloc_page(GFP_ATOMIC);
+				struct page *page = ss_skb_alloc_page();
 				if (!page)
 					return -ENOMEM;
 				++it->frag;
@@ -81,6 +81,7 @@ tfw_http_msg_srvhdr_val(TfwStr *hdr, unsigned id, TfwStr *val)
 }
 
 void tfw_http_msg_pair(TfwHttpResp *resp, TfwHttpReq *req);
+TfwHttpMsg *__tfw_http_msg_alloc_hdrs(int type, unsigned int hdr_n);
 TfwHttpMsg *__tfw_http_msg_alloc(int type, bool full);
 
 static inline TfwHttpReq *
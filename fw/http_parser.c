@@ -1213,10 +1213,11 @@ __FSM_STATE(RGen_BodyInit) {						\
 	}								\
 	/* Process the body until the connection is closed. */		\
 	/*								\
-	 * TODO: Currently Tempesta fully assembles response before	\
-	 * transmitting it to a client. This behaviour is considered	\
-	 * dangerous and the issue must be solved in generic way:	\
-	 * Tempesta must use chunked transfer encoding for proxied	\
+	 * TODO: Currently Tempesta fully assembles response w/o	\
+	 * length before transmitting it to a client, only responses	\
+	 * with Content-Length can be streamed. This behaviour is	\
+	 * considered dangerous and the issue must be solved in generic	\
+	 * way: Tempesta must use chunked transfer encoding for proxied	\
 	 * responses w/o lengths. Refer issues #534 and #498 for more	\
 	 * information.							\
 	 */								\
@@ -1397,10 +1398,9 @@ __parse_connection(TfwHttpMsg *hm, unsigned char *data, size_t len)
 	 * Other headers listed in the header will be compared with names of
 	 * end-to-end headers during saving in __hbh_parser_add_data().
 	 *
-	 * TODO: RFC 6455 WebSocket Protocol
-	 * During handshake client sets "Connection: update" and "Update" header.
-	 * This headers should be passed to server unchanged to allow
-	 * WebSocket protocol.
+	 * The "upgrade" token isn't saved as a hop-by-hop header name, so
+	 * the Upgrade header of a WebSocket handshake (RFC 6455) reaches the
+	 * server unchanged.
 	 */
 	__FSM_STATE(I_Conn) {
 		WARN_ON_ONCE(parser->_acc);
@@ -1412,6 +1412,9 @@ __parse_connection(TfwHttpMsg *hm, unsigned char *data, size_t len)
 		TRY_CONN_TOKEN("keep-alive", {
 			__set_bit(TFW_HTTP_B_CONN_KA, &parser->_acc);
 		});
+		TRY_CONN_TOKEN("upgrade", {
+			__set_bit(TFW_HTTP_B_CONN_UPGRADE, &parser->_acc);
+		});
 		TRY_STR_INIT();
 		__FSM_I_JMP(I_ConnOther);
 	}
@@ -1439,6 +1442,9 @@ __parse_connection(TfwHttpMsg *hm, unsigned char *data, size_t len)
 				return CSTR_NEQ;
 			__set_bit(TFW_HTTP_B_CONN_CLOSE, msg->flags);
 		}
+		else if (test_bit(TFW_HTTP_B_CONN_UPGRADE, &parser->_acc)) {
+			__set_bit(TFW_HTTP_B_CONN_UPGRADE, msg->flags);
+		}
 
 		__FSM_I_JMP(I_EoT);
 	}
@@ -1745,7 +1751,7 @@ __req_parse_content_type(TfwHttpMsg *hm, unsigned char *data, size_t len)
 
 	__FSM_STATE(I_ContTypeBoundaryValueQuoted) {
 		__fsm_n = __data_remain(p);
-		__fsm_sz = tfw_match_token(p, __fsm_n);
+		__fsm_sz = tfw_match_qdtext(p, __fsm_n);
 		if (__fsm_sz > 0) {
 			__msg_hdr_chunk_fixup(p, __fsm_sz);
 			__FSM_I_chunk_flags(TFW_STR_VALUE);
@@ -1767,13 +1773,9 @@ __req_parse_content_type(TfwHttpMsg *hm, unsigned char *data, size_t len)
 			/* Missing closing '"'. */
 			return CSTR_NEQ;
 		}
-		if (*p != '"') {
-			/* TODO: faster qdtext/quoted-pair matcher. */
-			req->multipart_boundary_raw.len += 1;
-			req->multipart_boundary.len += 1;
-			__FSM_I_MOVE_fixup(I_ContTypeBoundaryValueQuoted, 1,
-					   TFW_STR_VALUE);
-		}
+		/* Control characters aren't allowed in quoted-string. */
+		if (*p != '"')
+			return CSTR_NEQ;
 
 		/* *p == '"' */
 		__msg_hdr_chunk_fixup(p, 1);
@@ -1821,7 +1823,7 @@ __req_parse_content_type(TfwHttpMsg *hm, unsigned char *data, size_t len)
 	}
 
 	__FSM_STATE(I_ContTypeParamValueQuoted) {
-		__FSM_I_MATCH_MOVE_fixup(token, I_ContTypeParamValueQuoted,
+		__FSM_I_MATCH_MOVE_fixup(qdtext, I_ContTypeParamValueQuoted,
 					 TFW_STR_VALUE);
 		if (__fsm_sz > 0) {
 			__msg_hdr_chunk_fixup(p, __fsm_sz);
@@ -1837,8 +1839,8 @@ __req_parse_content_type(TfwHttpMsg *hm, unsigned char *data, size_t len)
 			/* Missing closing '"'. */
 			return CSTR_NEQ;
 		}
-		/* TODO: faster qdtext/quoted-pair matcher. */
-		__FSM_I_MOVE_fixup(I_ContTypeParamValueQuoted, 1, 0);
+		/* Control characters aren't allowed in quoted-string. */
+		return CSTR_NEQ;
 	}
 
 	__FSM_STATE(I_ContTypeParamValueEscapedChar) {
@@ -3514,6 +3516,24 @@ done:
 }
 STACK_FRAME_NON_STANDARD(__parse_uri_mark);
 
+/*
+ * Find the query and the fragment in the URI data at @p, which is going to
+ * be added to @req->uri_path, so consumers of the query don't rescan the URI.
+ */
+static inline void
+__req_uri_scan(TfwHttpReq *req, const char *p, size_t n)
+{
+	size_t off = req->uri_path.len;
+
+	__set_bit(TFW_HTTP_B_URI_SPLIT, req->flags);
+	if (req->uri_frag)
+		return;
+	/* The field is opened in this chunk and has no data fixed up yet. */
+	if (!off)
+		off = p - (char *)req->uri_path.data;
+	tfw_http_req_uri_scan(req, p, n, off);
+}
+
 /* Parse method override request headers. */
 static int
 __parse_m_override(TfwHttpReq *req, unsigned char *data, size_t len)
@@ -3953,13 +3973,17 @@ tfw_http_parse_req(void *req_data, unsigned char *data, size_t len,
 	 *
 	 * Meantime it's unclear whether we really need to distinguish these two
 	 * string types, probably this work is for application layer...
+	 * The offsets of the query and the fragment are recorded on the way,
+	 * see tfw_http_req_args().
 	 */
 	__FSM_STATE(Req_UriAbsPath) {
 		/* Optimize single '/' case. */
 		if (c == ' ') {
+			__set_bit(TFW_HTTP_B_URI_SPLIT, req->flags);
 			__msg_field_finish_pos(&req->uri_path, p, 0);
 			__FSM_MOVE_nofixup(Req_HttpVer);
 		}
+		__req_uri_scan(req, p, __data_remain(p));
 		__FSM_MATCH_MOVE_pos_f(uri, Req_UriAbsPath, &req->uri_path, 0);
 		if (unlikely(*(p + __fsm_sz) != ' '))
 			TFW_PARSER_BLOCK(Req_UriAbsPath);
@@ -6295,7 +6319,7 @@ __h2_req_parse_content_type(TfwHttpMsg *hm, unsigned char *data, size_t len,
 
 	__FSM_STATE(I_ContTypeBoundaryValueQuoted) {
 		__fsm_n = __data_remain(p);
-		__fsm_sz = tfw_match_token(p, __fsm_n);
+		__fsm_sz = tfw_match_qdtext(p, __fsm_n);
 		if (__fsm_sz > 0) {
 			__msg_hdr_chunk_fixup(p, __fsm_sz);
 			__FSM_I_chunk_flags(TFW_STR_HDR_VALUE | TFW_STR_VALUE);
@@ -6321,13 +6345,9 @@ __h2_req_parse_content_type(TfwHttpMsg *hm, unsigned char *data, size_t len,
 			/* Missing closing '"'. */
 			return CSTR_NEQ;
 		}
-		if (*p != '"') {
-			/* TODO: faster qdtext/quoted-pair matcher. */
-			req->multipart_boundary_raw.len += 1;
-			req->multipart_boundary.len += 1;
-			__FSM_H2_I_MOVE_NEQ_fixup(I_ContTypeBoundaryValueQuoted,
-						  1, TFW_STR_VALUE);
-		}
+		/* Control characters aren't allowed in quoted-string. */
+		if (*p != '"')
+			return CSTR_NEQ;
 
 		/* *p == '"' */
 		__msg_hdr_chunk_fixup(p, 1);
@@ -6378,7 +6398,7 @@ __h2_req_parse_content_type(TfwHttpMsg *hm, unsigned char *data, size_t len,
 	}
 
 	__FSM_STATE(I_ContTypeParamValueQuoted) {
-		__FSM_H2_I_MATCH_MOVE_NEQ_fixup(token,
+		__FSM_H2_I_MATCH_MOVE_NEQ_fixup(qdtext,
 						I_ContTypeParamValueQuoted,
 						TFW_STR_VALUE);
 		if (__fsm_sz > 0) {
@@ -6397,8 +6417,8 @@ __h2_req_parse_content_type(TfwHttpMsg *hm, unsigned char *data, size_t len,
 			/* Missing closing '"'. */
 			return CSTR_NEQ;
 		}
-		/* TODO: faster qdtext/quoted-pair matcher. */
-		__FSM_H2_I_MOVE_NEQ_fixup(I_ContTypeParamValueQuoted, 1, 0);
+		/* Control characters aren't allowed in quoted-string. */
+		return CSTR_NEQ;
 	}
 
 	__FSM_STATE(I_ContTypeParamValueEscapedChar) {
@@ -8789,6 +8809,10 @@ __resp_parse_cache_control(TfwHttpResp *resp, unsigned char *data, size_t len)
 			__FSM_EXIT(TFW_BLOCK);
 		TRY_STR_fixup(&TFW_STR_STRING("s-maxage="), Resp_I_CC_s,
 			      Resp_I_CC_SMaxAgeVBeg);
+		TRY_STR_fixup(&TFW_STR_STRING("stale-while-revalidate="),
+			      Resp_I_CC_s, Resp_I_CC_StaleRevalVBeg);
+		TRY_STR_fixup(&TFW_STR_STRING("stale-if-error="), Resp_I_CC_s,
+			      Resp_I_CC_StaleErrVBeg);
 		TRY_STR_INIT();
 		__FSM_I_JMP(Resp_I_Ext);
 	}
@@ -8847,6 +8871,48 @@ __resp_parse_cache_control(TfwHttpResp *resp, unsigned char *data, size_t len)
 		__FSM_I_MOVE_fixup(Resp_I_EoT, __fsm_n, 0);
 	}
 
+	__FSM_REQUIRE_FIRST_DIGIT(Resp_I_CC_StaleRevalVBeg, Resp_I_CC_StaleRevalV);
+
+	__FSM_STATE(Resp_I_CC_StaleRevalV) {
+		/* RFC 5861 3, the same rules as for max-age apply. */
+		if (unlikely(resp->cache_ctl.flags & TFW_HTTP_CC_STALE_REVAL))
+			__FSM_EXIT(TFW_BLOCK);
+
+		parser->cache_flags.filled = true;
+		parser->cache_flags.flag_allowed = false;
+
+		__fsm_sz = __data_remain(p);
+		__fsm_n = parse_uint_list(p, __fsm_sz, &parser->_acc);
+		if (__fsm_n == CSTR_POSTPONE)
+			__msg_hdr_chunk_fixup(p, __fsm_sz);
+		if (__fsm_n < 0)
+			__FSM_EXIT(__fsm_n);
+		resp->cache_ctl.stale_reval = parser->_acc;
+		resp->cache_ctl.flags |= TFW_HTTP_CC_STALE_REVAL;
+		__FSM_I_MOVE_fixup(Resp_I_EoT, __fsm_n, 0);
+	}
+
+	__FSM_REQUIRE_FIRST_DIGIT(Resp_I_CC_StaleErrVBeg, Resp_I_CC_StaleErrV);
+
+	__FSM_STATE(Resp_I_CC_StaleErrV) {
+		/* RFC 5861 4. */
+		if (unlikely(resp->cache_ctl.flags & TFW_HTTP_CC_STALE_ERR))
+			__FSM_EXIT(TFW_BLOCK);
+
+		parser->cache_flags.filled = true;
+		parser->cache_flags.flag_allowed = false;
+
+		__fsm_sz = __data_remain(p);
+		__fsm_n = parse_uint_list(p, __fsm_sz, &parser->_acc);
+		if (__fsm_n == CSTR_POSTPONE)
+			__msg_hdr_chunk_fixup(p, __fsm_sz);
+		if (__fsm_n < 0)
+			__FSM_EXIT(__fsm_n);
+		resp->cache_ctl.stale_err = parser->_acc;
+		resp->cache_ctl.flags |= TFW_HTTP_CC_STALE_ERR;
+		__FSM_I_MOVE_fixup(Resp_I_EoT, __fsm_n, 0);
+	}
+
 	__FSM_STATE(Resp_I_Ext) {
 		/* Any flag we don't understand.
 		 * Here we just skip all the tokens, double quotes and equal signs.
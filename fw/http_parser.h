@@ -33,6 +33,11 @@ typedef struct {
 #define TFW_HHTBL_EXACTSZ(s)		(sizeof(TfwHttpHdrTbl)		\
 					 + sizeof(TfwStr) * (s))
 #define TFW_HHTBL_SZ(o)			TFW_HHTBL_EXACTSZ(__HHTBL_SZ(o))
+/*
+ * Maximum order of a headers table preallocated by the connection history,
+ * so a single header-heavy message doesn't inflate all the next messages.
+ */
+#define TFW_HHTBL_ORDER_MAX		8
 
 /** Maximum of hop-by-hop tokens listed in Connection header. */
 #define TFW_HBH_TOKENS_MAX		16
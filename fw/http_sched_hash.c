@@ -18,6 +18,13 @@
  * TfwSrver hash which is chosen, and thus any request always goes to its home
  * server unless it is offline.
  *
+ * Requests scheduled to a server group are mapped to the connections by a
+ * Maglev lookup table built from the connection hashes, so a lookup is one
+ * array index. If the connection is dead or overfilled, then the table is
+ * probed with a per-request step, so requests of a dead connection spread
+ * evenly over all the rest connections instead of spilling onto a single
+ * neighbour. Adding or removing a server remaps only about 1/N of the keys.
+ *
  * Copyright (C) 2014 NatSys Lab. (info@natsys-lab.com).
  * Copyright (C) 2015-2021 Tempesta Technologies, Inc.
  *
@@ -37,6 +44,7 @@
  */
 #include <linux/hash.h>
 #include <linux/module.h>
+#include <linux/slab.h>
 
 #include "lib/hash.h"
 #include "tempesta_fw.h"
@@ -49,8 +57,26 @@ typedef struct {
 	TfwSrvConn		*conn;
 } TfwHashConn;
 
+/*
+ * The Maglev lookup table has at least TFW_HASH_TBL_FACTOR entries per
+ * connection, which keeps the difference in connection loads within a few
+ * percents.
+ */
+#define TFW_HASH_TBL_FACTOR	64
+
+/**
+ * Connections list sorted by the connection hashes.
+ *
+ * @rcu		- RCU control structure;
+ * @tbl		- Maglev lookup table of indexes in @conns, only for a group;
+ * @tbl_sz	- size of @tbl, a prime number;
+ * @conn_n	- number of connections in @conns;
+ * @conns	- the connections with their hashes;
+ */
 typedef struct {
 	struct rcu_head		rcu;
+	unsigned int		*tbl;
+	unsigned int		tbl_sz;
 	size_t			conn_n;
 	TfwHashConn		conns[0];
 } TfwHashConnList;
@@ -205,6 +231,82 @@ __find_best_conn(TfwMsg *msg, TfwHashConnList *cl)
 	return NULL;
 }
 
+/**
+ * Find a connection for the HTTP request @msg in the Maglev lookup table of
+ * the group connections list @cl. If the connection from the table can't be
+ * used, then the table is probed with a step derived from the request hash,
+ * so different requests of the connection go to different connections.
+ * Fall back to the nearest live neighbour search if there are too many dead
+ * connections.
+ */
+static TfwSrvConn *
+__find_tbl_conn(TfwMsg *msg, TfwHashConnList *cl)
+{
+	unsigned int i, idx, step;
+	TfwSrvConn *conn;
+	bool hmonitor = test_bit(TFW_HTTP_B_HMONITOR,
+				 ((TfwHttpReq *)msg)->flags);
+	unsigned long hash = __hash_64(tfw_http_req_key_calc((TfwHttpReq *)msg));
+
+	if (unlikely(!cl->tbl))
+		return __find_best_conn(msg, cl);
+
+	idx = hash % cl->tbl_sz;
+	step = (hash >> 32) % (cl->tbl_sz - 1) + 1;
+	for (i = 0; i < cl->conn_n * 2; ++i) {
+		conn = cl->conns[cl->tbl[idx]].conn;
+		if (likely(__is_conn_suitable(conn, hmonitor)))
+			return conn;
+		idx = (idx + step) % cl->tbl_sz;
+	}
+
+	return __find_best_conn(msg, cl);
+}
+
+/**
+ * The server of @conn chosen by the hash may have other connections processed
+ * by the current CPU or NUMA node. Prefer them to @conn, so responses don't
+ * migrate between CPUs. Requests stick to the same server anyway.
+ */
+static TfwSrvConn *
+__find_local_conn(TfwMsg *msg, TfwHashConnList *cl, TfwSrvConn *conn)
+{
+	size_t i;
+	TfwSrvConn *c, *node_conn = NULL;
+	int loc = tfw_srv_conn_locality(conn);
+	bool hmonitor = test_bit(TFW_HTTP_B_HMONITOR,
+				 ((TfwHttpReq *)msg)->flags);
+
+	if (loc == TFW_SRV_CONN_CPU)
+		return conn;
+
+	for (i = 0; i < cl->conn_n; ++i) {
+		c = cl->conns[i].conn;
+		if (c == conn || c->peer != conn->peer)
+			continue;
+		switch (tfw_srv_conn_locality(c)) {
+		case TFW_SRV_CONN_CPU:
+			if (!__is_conn_suitable(c, hmonitor))
+				break;
+			tfw_srv_conn_put(node_conn);
+			tfw_srv_conn_put(conn);
+			return c;
+		case TFW_SRV_CONN_NODE:
+			if (node_conn || loc == TFW_SRV_CONN_NODE
+			    || !__is_conn_suitable(c, hmonitor))
+				break;
+			node_conn = c;
+			break;
+		}
+	}
+	if (node_conn) {
+		tfw_srv_conn_put(conn);
+		return node_conn;
+	}
+
+	return conn;
+}
+
 static TfwSrvConn *
 tfw_sched_hash_get_sg_conn(TfwMsg *msg, TfwSrvGroup *sg)
 {
@@ -214,8 +316,8 @@ tfw_sched_hash_get_sg_conn(TfwMsg *msg, TfwSrvGroup *sg)
 	rcu_read_lock_bh();
 	cl = rcu_dereference_bh(sg->sched_data);
 
-	if (likely(cl))
-		srv_conn = __find_best_conn(msg, cl);
+	if (likely(cl) && (srv_conn = __find_tbl_conn(msg, cl)))
+		srv_conn = __find_local_conn(msg, cl, srv_conn);
 
 	rcu_read_unlock_bh();
 
@@ -235,8 +337,8 @@ tfw_sched_hash_get_srv_conn(TfwMsg *msg, TfwServer *srv)
 	rcu_read_lock_bh();
 	cl = rcu_dereference_bh(srv->sched_data);
 
-	if (likely(cl))
-		srv_conn = __find_best_conn(msg, cl);
+	if (likely(cl) && (srv_conn = __find_best_conn(msg, cl)))
+		srv_conn = __find_local_conn(msg, cl, srv_conn);
 
 	rcu_read_unlock_bh();
 
@@ -247,6 +349,7 @@ static void
 tfw_sched_hash_cleanup_rcu_cb(struct rcu_head *rcu)
 {
 	TfwHashConnList *cl = container_of(rcu, TfwHashConnList, rcu);
+	kvfree(cl->tbl);
 	kfree(cl);
 }
 
@@ -324,6 +427,71 @@ __fill_srv_lists(TfwHashConnList *cl, size_t srv_n, TfwHashSrvConnList *srv_cls)
 	}
 }
 
+static unsigned int
+__tbl_size(size_t conn_n)
+{
+	unsigned int n, d;
+
+	/* Find the next prime, there are plenty of them in a small range. */
+	for (n = conn_n * TFW_HASH_TBL_FACTOR + 1; ; n += 2) {
+		for (d = 3; d * d <= n; d += 2)
+			if (!(n % d))
+				break;
+		if (d * d > n)
+			return n;
+	}
+}
+
+/**
+ * Build the Maglev lookup table for the group connections list @cl: each
+ * connection has its own permutation of the table slots defined by the
+ * connection hash, and the connections take turns in filling their next
+ * preferred free slots. A connection hash depends on its server address
+ * only, so servers keep most of their slots on reconfiguration.
+ */
+static int
+tfw_sched_hash_build_tbl(TfwHashConnList *cl)
+{
+	size_t i, filled = 0;
+	unsigned int *tbl, *pos, *skip, sz;
+
+	if (cl->conn_n > UINT_MAX / TFW_HASH_TBL_FACTOR / 2)
+		return -EINVAL;
+
+	sz = __tbl_size(cl->conn_n);
+	if (!(tbl = kvmalloc_array(sz, sizeof(*tbl), GFP_KERNEL)))
+		return -ENOMEM;
+	if (!(pos = kvmalloc_array(cl->conn_n * 2, sizeof(*pos), GFP_KERNEL))) {
+		kvfree(tbl);
+		return -ENOMEM;
+	}
+	skip = pos + cl->conn_n;
+
+	memset(tbl, 0xff, sz * sizeof(*tbl));
+	for (i = 0; i < cl->conn_n; ++i) {
+		unsigned long h = cl->conns[i].hash;
+
+		pos[i] = h % sz;
+		skip[i] = __hash_64(h) % (sz - 1) + 1;
+	}
+	while (filled < sz) {
+		for (i = 0; i < cl->conn_n && filled < sz; ++i) {
+			while (tbl[pos[i]] != UINT_MAX)
+				pos[i] = (pos[i] + skip[i]) % sz;
+			tbl[pos[i]] = i;
+			pos[i] = (pos[i] + skip[i]) % sz;
+			++filled;
+		}
+		cond_resched();
+	}
+	kvfree(pos);
+
+	cl->tbl = tbl;
+	cl->tbl_sz = sz;
+
+	return 0;
+}
+
 static void
 tfw_sched_hash_add_conns(TfwServer *srv, TfwHashConnList *cl, size_t *seed,
 			 size_t seed_inc)
@@ -343,7 +511,7 @@ tfw_sched_hash_add_conns(TfwServer *srv, TfwHashConnList *cl, size_t *seed,
 static int
 tfw_sched_hash_add_grp(TfwSrvGroup *sg, void *data)
 {
-	size_t size, conn_n = 0, offset = 0, seed, seed_inc, i = 0;
+	size_t size, conn_n = 0, offset = 0, seed, i = 0;
 	TfwServer *srv;
 	TfwHashConnList *cl;
 	TfwHashSrvConnList *srv_cls;
@@ -351,9 +519,6 @@ tfw_sched_hash_add_grp(TfwSrvGroup *sg, void *data)
 	if (unlikely(!sg->srv_n || list_empty(&sg->srv_list)))
 		return -EINVAL;
 
-	seed = get_random_long();
-	seed_inc = get_random_int();
-
 	list_for_each_entry(srv, &sg->srv_list, list)
 		conn_n += srv->conn_n;
 
@@ -381,7 +546,17 @@ tfw_sched_hash_add_grp(TfwSrvGroup *sg, void *data)
 				+ sizeof(TfwHashConn) * srv->conn_n;
 		++i;
 
-		tfw_sched_hash_add_conns(srv, cl, &seed, seed_inc);
+		/*
+		 * Connection hashes depend on the server only, so the lookup
+		 * table of a reconfigured group keeps most of the mappings.
+		 */
+		seed = 0;
+		tfw_sched_hash_add_conns(srv, cl, &seed, 1);
+	}
+	if (tfw_sched_hash_build_tbl(cl)) {
+		kfree(srv_cls);
+		kfree(cl);
+		return -ENOMEM;
 	}
 	/* Create per-server connection lists. */
 	__fill_srv_lists(cl, sg->srv_n, srv_cls);
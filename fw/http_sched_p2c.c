@@ -0,0 +1,414 @@
+/**
+ *		Tempesta FW
+ *
+ * Power of two choices (P2C) HTTP request scheduler.
+ *
+ * The scheduler samples two random connections of a server group and
+ * forwards a request to the less loaded one. The load of a connection is
+ * the number of outstanding requests in its forwarding queue scaled by the
+ * average response time of the server, as reported by APM, and divided by
+ * the static server weight. Thus a briefly slow server, which accumulates
+ * requests in its queues, stops receiving new requests immediately, while
+ * the Ratio scheduler keeps sending it the server's share until the next
+ * ratios recalculation.
+ *
+ * A decision takes constant time and doesn't need any shared state except
+ * the queue sizes, so there are no locks and no periodic recalculations.
+ *
+ * Copyright (C) 2015-2021 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <linux/module.h>
+#include <linux/random.h>
+
+#include "tempesta_fw.h"
+#include "apm.h"
+#include "log.h"
+#include "server.h"
+#include "http.h"
+
+/*
+ * Maximum number of random probes to find two suitable connections. If
+ * there are no suitable connections among the probed ones, then the server
+ * group is likely overloaded and all its connections are scanned.
+ */
+#define TFW_P2C_PROBES		8
+/* Maximum static server weight, keeps precision of the load division. */
+#define TFW_P2C_WEIGHT_SCALE	100
+
+/**
+ * Connections of a server.
+ *
+ * @rcu		- RCU control structure for a standalone server;
+ * @conn	- array of pointers to the server connections;
+ * @conn_n	- number of connections to the server;
+ */
+typedef struct {
+	struct rcu_head		rcu;
+	TfwSrvConn		**conn;
+	size_t			conn_n;
+} TfwP2cSrvDesc;
+
+/**
+ * Scheduler data of a server group.
+ *
+ * @rcu		- RCU control structure;
+ * @srvdesc	- per-server descriptors, their connections arrays are slices
+ *		  of @conn;
+ * @conn_n	- number of connections of all the servers in the group;
+ * @conn	- array of pointers to connections of all the servers;
+ */
+typedef struct {
+	struct rcu_head		rcu;
+	TfwP2cSrvDesc		*srvdesc;
+	size_t			conn_n;
+	TfwSrvConn		*conn[0];
+} TfwP2c;
+
+/**
+ * The load of @srv_conn: outstanding requests (including the one being
+ * scheduled) times the server response time per a weight unit.
+ */
+static inline u64
+__p2c_load(TfwSrvConn *srv_conn)
+{
+	TfwServer *srv = (TfwServer *)srv_conn->peer;
+	u64 load = (u64)(READ_ONCE(srv_conn->qsize) + 1)
+		   * (tfw_apm_rtime(srv->apmref) + 1) * TFW_P2C_WEIGHT_SCALE;
+
+	return div_u64(load, srv->weight ? : 1);
+}
+
+/*
+ * Consider the same restrictions as the Ratio scheduler does, see
+ * __sched_srv() in http_sched_ratio.c.
+ */
+static inline bool
+__p2c_conn_suitable(TfwSrvConn *srv_conn, bool hmonitor, int skipnip,
+		    int *nipconn)
+{
+	if (unlikely(!hmonitor
+		     && tfw_srv_suspended((TfwServer *)srv_conn->peer)))
+		return false;
+	if (unlikely(tfw_srv_conn_restricted(srv_conn)
+		     || tfw_srv_conn_busy(srv_conn)
+		     || tfw_srv_conn_queue_full(srv_conn)))
+		return false;
+	if (skipnip && (tfw_srv_conn_hasnip(srv_conn)
+			|| tfw_srv_conn_pipe_full(srv_conn)))
+	{
+		if (likely(tfw_srv_conn_live(srv_conn)))
+			++(*nipconn);
+		return false;
+	}
+
+	return tfw_srv_conn_live(srv_conn);
+}
+
+/**
+ * Whether @a is a better choice than @b. Connections of equal load are
+ * compared by locality, so responses don't migrate between CPUs.
+ */
+static inline bool
+__p2c_better(TfwSrvConn *a, u64 a_load, TfwSrvConn *b, u64 b_load)
+{
+	if (a_load != b_load)
+		return a_load < b_load;
+
+	return tfw_srv_conn_locality(a) > tfw_srv_conn_locality(b);
+}
+
+/**
+ * Choose the less loaded one of two random suitable connections from @conn.
+ * All the connections are scanned only if the random probes didn't find
+ * any suitable connection.
+ */
+static TfwSrvConn *
+__p2c_sched(TfwSrvConn **conn, size_t conn_n, bool hmonitor, int skipnip,
+	    int *nipconn)
+{
+	size_t i;
+	unsigned int cand = 0;
+	u64 load, best_load = 0;
+	TfwSrvConn *srv_conn, *best = NULL;
+
+	if (unlikely(!conn_n))
+		return NULL;
+
+	for (i = 0; i < TFW_P2C_PROBES && cand < 2; ++i) {
+		srv_conn = conn[prandom_u32_max(conn_n)];
+		if (!__p2c_conn_suitable(srv_conn, hmonitor, skipnip, nipconn))
+			continue;
+		++cand;
+		load = __p2c_load(srv_conn);
+		if (!best || __p2c_better(srv_conn, load, best, best_load)) {
+			best = srv_conn;
+			best_load = load;
+		}
+	}
+	if (unlikely(!best)) {
+		for (i = 0; i < conn_n; ++i) {
+			srv_conn = conn[i];
+			if (!__p2c_conn_suitable(srv_conn, hmonitor, skipnip,
+						 nipconn))
+				continue;
+			load = __p2c_load(srv_conn);
+			if (!best
+			    || __p2c_better(srv_conn, load, best, best_load))
+			{
+				best = srv_conn;
+				best_load = load;
+			}
+		}
+	}
+
+	if (best && likely(tfw_srv_conn_get_if_live(best)))
+		return best;
+
+	return NULL;
+}
+
+/**
+ * Same as @tfw_sched_p2c_sched_sg_conn(), but schedule a connection to
+ * a specific server in a group.
+ */
+static TfwSrvConn *
+tfw_sched_p2c_sched_srv_conn(TfwMsg *msg, TfwServer *srv)
+{
+	int skipnip = 1, nipconn = 0;
+	TfwP2cSrvDesc *srvdesc;
+	TfwSrvConn *srv_conn = NULL;
+
+	/*
+	 * Bypass the suspend checking if connection is needed for
+	 * health monitoring of backend server.
+	 */
+	if (!test_bit(TFW_HTTP_B_HMONITOR, ((TfwHttpReq *)msg)->flags)
+	    && tfw_srv_suspended(srv))
+		return NULL;
+
+	rcu_read_lock_bh();
+	srvdesc = rcu_dereference_bh(srv->sched_data);
+	if (unlikely(!srvdesc))
+		goto done;
+
+rerun:
+	srv_conn = __p2c_sched(srvdesc->conn, srvdesc->conn_n, true, skipnip,
+			       &nipconn);
+	if (!srv_conn && skipnip && nipconn) {
+		skipnip = 0;
+		goto rerun;
+	}
+done:
+	rcu_read_unlock_bh();
+	return srv_conn;
+}
+
+/**
+ * Schedule a request to the less loaded one of two random connections of
+ * the group @sg. Connections with non-idempotent requests are skipped
+ * unless all live connections have them, just like in the Ratio scheduler.
+ */
+static TfwSrvConn *
+tfw_sched_p2c_sched_sg_conn(TfwMsg *msg, TfwSrvGroup *sg)
+{
+	int skipnip = 1, nipconn = 0;
+	TfwP2c *p2c;
+	TfwSrvConn *srv_conn = NULL;
+	bool hmonitor = test_bit(TFW_HTTP_B_HMONITOR,
+				 ((TfwHttpReq *)msg)->flags);
+
+	rcu_read_lock_bh();
+	p2c = rcu_dereference_bh(sg->sched_data);
+	if (unlikely(!p2c))
+		goto done;
+
+rerun:
+	srv_conn = __p2c_sched(p2c->conn, p2c->conn_n, hmonitor, skipnip,
+			       &nipconn);
+	if (!srv_conn && skipnip && nipconn) {
+		skipnip = 0;
+		goto rerun;
+	}
+done:
+	rcu_read_unlock_bh();
+	return srv_conn;
+}
+
+/**
+ * Copy connections of @srv to @conn, which must have room for @srv->conn_n
+ * pointers.
+ */
+static int
+tfw_sched_p2c_srvdesc_setup(TfwServer *srv, TfwP2cSrvDesc *srvdesc,
+			    TfwSrvConn **conn)
+{
+	size_t ci = 0;
+	TfwSrvConn *srv_conn;
+
+	list_for_each_entry(srv_conn, &srv->conn_list, list) {
+		if (unlikely(ci == srv->conn_n))
+			return -EINVAL;
+		conn[ci++] = srv_conn;
+	}
+	if (unlikely(ci != srv->conn_n))
+		return -EINVAL;
+
+	srvdesc->conn = conn;
+	srvdesc->conn_n = ci;
+
+	return 0;
+}
+
+static void
+tfw_sched_p2c_cleanup_rcu_cb(struct rcu_head *rcu)
+{
+	TfwP2c *p2c = container_of(rcu, TfwP2c, rcu);
+	kfree(p2c);
+}
+
+static void
+tfw_sched_p2c_del_grp(TfwSrvGroup *sg)
+{
+	TfwServer *srv;
+	TfwP2c *p2c = rcu_dereference_bh_check(sg->sched_data, 1);
+
+	RCU_INIT_POINTER(sg->sched_data, NULL);
+	list_for_each_entry(srv, &sg->srv_list, list) {
+		WARN_ON_ONCE(rcu_dereference_bh_check(srv->sched_data, 1)
+			     && !p2c);
+		RCU_INIT_POINTER(srv->sched_data, NULL);
+	}
+	if (!p2c)
+		return;
+
+	call_rcu(&p2c->rcu, tfw_sched_p2c_cleanup_rcu_cb);
+}
+
+static int
+tfw_sched_p2c_add_grp(TfwSrvGroup *sg, void *data)
+{
+	int r;
+	size_t size, si = 0, conn_n = 0;
+	TfwServer *srv;
+	TfwP2c *p2c;
+
+	if (unlikely(!sg->srv_n || list_empty(&sg->srv_list)))
+		return -EINVAL;
+
+	list_for_each_entry(srv, &sg->srv_list, list)
+		conn_n += srv->conn_n;
+
+	size = sizeof(TfwP2c) + sizeof(TfwSrvConn *) * conn_n
+	       + sizeof(TfwP2cSrvDesc) * sg->srv_n;
+	if (!(p2c = kzalloc(size, GFP_KERNEL)))
+		return -ENOMEM;
+	p2c->srvdesc = (TfwP2cSrvDesc *)(p2c->conn + conn_n);
+
+	list_for_each_entry(srv, &sg->srv_list, list) {
+		if (unlikely(si == sg->srv_n || !srv->conn_n)) {
+			r = -EINVAL;
+			goto err;
+		}
+		r = tfw_sched_p2c_srvdesc_setup(srv, &p2c->srvdesc[si],
+						p2c->conn + p2c->conn_n);
+		if (r)
+			goto err;
+		p2c->conn_n += srv->conn_n;
+		++si;
+	}
+
+	/*
+	 * The add_group() function can be called during live reconfiguration,
+	 * assign srv->sched_data after the data is fully prepared and valid.
+	 */
+	si = 0;
+	list_for_each_entry(srv, &sg->srv_list, list)
+		rcu_assign_pointer(srv->sched_data, &p2c->srvdesc[si++]);
+	rcu_assign_pointer(sg->sched_data, p2c);
+
+	return 0;
+err:
+	kfree(p2c);
+	return r;
+}
+
+static int
+tfw_sched_p2c_add_srv(TfwServer *srv)
+{
+	int r;
+	TfwP2cSrvDesc *srvdesc = rcu_dereference_bh_check(srv->sched_data, 1);
+
+	if (unlikely(srvdesc))
+		return -EEXIST;
+
+	srvdesc = kzalloc(sizeof(TfwP2cSrvDesc)
+			  + sizeof(TfwSrvConn *) * srv->conn_n, GFP_KERNEL);
+	if (!srvdesc)
+		return -ENOMEM;
+	if ((r = tfw_sched_p2c_srvdesc_setup(srv, srvdesc,
+					     (TfwSrvConn **)(srvdesc + 1))))
+	{
+		kfree(srvdesc);
+		return r;
+	}
+
+	rcu_assign_pointer(srv->sched_data, srvdesc);
+
+	return 0;
+}
+
+static void
+tfw_sched_p2c_put_srv_data(struct rcu_head *rcu)
+{
+	TfwP2cSrvDesc *srvdesc = container_of(rcu, TfwP2cSrvDesc, rcu);
+	kfree(srvdesc);
+}
+
+static void
+tfw_sched_p2c_del_srv(TfwServer *srv)
+{
+	TfwP2cSrvDesc *srvdesc = rcu_dereference_bh_check(srv->sched_data, 1);
+
+	RCU_INIT_POINTER(srv->sched_data, NULL);
+	if (srvdesc)
+		call_rcu(&srvdesc->rcu, tfw_sched_p2c_put_srv_data);
+}
+
+static TfwScheduler tfw_sched_p2c = {
+	.name		= "p2c",
+	.list		= LIST_HEAD_INIT(tfw_sched_p2c.list),
+	.add_grp	= tfw_sched_p2c_add_grp,
+	.del_grp	= tfw_sched_p2c_del_grp,
+	.add_srv	= tfw_sched_p2c_add_srv,
+	.del_srv	= tfw_sched_p2c_del_srv,
+	.sched_sg_conn	= tfw_sched_p2c_sched_sg_conn,
+	.sched_srv_conn	= tfw_sched_p2c_sched_srv_conn,
+};
+
+int
+tfw_sched_p2c_init(void)
+{
+	T_DBG("%s: init\n", tfw_sched_p2c.name);
+	return tfw_sched_register(&tfw_sched_p2c);
+}
+
+void
+tfw_sched_p2c_exit(void)
+{
+	T_DBG("%s: exit\n", tfw_sched_p2c.name);
+	tfw_sched_unregister(&tfw_sched_p2c);
+}
@@ -42,6 +42,7 @@
  * @counter	- monotonic counter for choosing the next connection.
  * @conn_n	- number of connections to server.
  * @seq		- current sequence number for APM stats.
+ * @wgt		- dynamic weight used in the current ratios.
  */
 typedef struct {
 	struct rcu_head		rcu;
@@ -50,6 +51,7 @@ typedef struct {
 	atomic64_t		counter;
 	size_t			conn_n;
 	unsigned int		seq;
+	unsigned int		wgt;
 } TfwRatioSrvDesc;
 
 /**
@@ -113,7 +115,9 @@ typedef struct {
  * @cnt_avg_rtt_avg	- avg(cnt) * avg(rtt).
  * @cnt_sq_avg		- avg(cnt * cnt).
  * @cnt_avg_sq		- avg(cnt) * avg(cnt).
- * @hist		- array of history data units.
+ * @level		- smoothed rtt for EWMA and Holt models.
+ * @trend		- smoothed rtt change per @intvl for Holt model.
+ * @hist		- array of history data units (linear model only).
  */
 typedef struct {
 	long		coeff_a;
@@ -124,6 +128,8 @@ typedef struct {
 	long		cnt_avg_rtt_avg;
 	long		cnt_sq_avg;
 	long		cnt_avg_sq;
+	long		level;
+	long		trend;
 	TfwRatioHstUnit	*hist;
 } TfwRatioHstDesc;
 
@@ -131,12 +137,18 @@ typedef struct {
  * Historic (past) data for predictive scheduler.
  *
  * @ahead	- predict for this number of @intvl ahead.
+ * @model	- prediction model, TFW_SCHED_PREDICT_*.
+ * @alpha	- level smoothing factor, percents.
+ * @beta	- trend smoothing factor, percents.
  * @slot_n	- total number of slots for past data.
  * @counter	- slot that is available for storing past data.
  * @hstdesc	- past data for each server (@hstdesc[@srv_n]).
  */
 typedef struct {
 	unsigned int	ahead;
+	unsigned int	model;
+	unsigned int	alpha;
+	unsigned int	beta;
 	size_t		slot_n;
 	unsigned long	counter;
 	TfwRatioHstDesc	*hstdesc;
@@ -165,6 +177,8 @@ typedef struct {
  * @srv_n	- number of upstream servers.
  * @psidx	- APM pstats[] value index for dynamic ratios.
  * @intvl	- interval for re-arming the timer.
+ * @hyst	- minimum change of a dynamic weight (percents) to take it
+ *		  into account.
  * @rearm	- indicates if the timer can be re-armed.
  * @timer	- periodic timer for dynamic APM data.
  * @hstdata	- historic data for predictive scheduler.
@@ -176,6 +190,7 @@ typedef struct {
 	size_t			srv_n;
 	size_t			psidx;
 	unsigned int		intvl;
+	unsigned int		hyst;
 	atomic_t		rearm;
 	struct timer_list	timer;
 	TfwRatioHstData		*hstdata;
@@ -434,7 +449,9 @@ __tfw_sched_ratio_calc_dynamic(TfwRatio *ratio, TfwRatioData *rtodata,
  *
  * While all stats values are returned by the APM, only one specific
  * value is taken as the current RTT. That is the configured value,
- * one of MIN, MAX, AVG, or a specific percentile.
+ * one of MIN, MAX, AVG, or a specific percentile. The RTT is raised
+ * by the load the server reports in responses, if that is configured,
+ * so a saturated server gets a lesser ratio before its RTT grows.
  *
  * Return 0 if there is no new APM data.
  * Return a non-zero value otherwise.
@@ -468,11 +485,36 @@ __tfw_sched_ratio_get_rtt(size_t si, TfwRatio *ratio, TfwRatioData *rtodata)
 	srvdesc[si].seq = pstats.seq;
 
 	srvdata[si].sdidx = si;
-	srvdata[si].weight = pstats.val[ratio->psidx] ? : 1;
+	srvdata[si].weight = pstats.val[ratio->psidx];
+	srvdata[si].weight = tfw_apm_load_adjust(srvdesc[si].srv->apmref,
+						 srvdata[si].weight) ? : 1;
 
 	return recalc;
 }
 
+/**
+ * Keep the weight of a server used in the current ratios if the new weight
+ * @wgt differs from it by no more than @ratio->hyst percents, so the ratios
+ * don't oscillate on small fluctuations of response times.
+ *
+ * Return true if the server weight changed.
+ */
+static inline bool
+__tfw_sched_ratio_hyst(TfwRatio *ratio, size_t si, unsigned int *wgt)
+{
+	TfwRatioSrvDesc *srvdesc = &ratio->srvdesc[si];
+	unsigned int old = srvdesc->wgt;
+	unsigned long diff = *wgt > old ? *wgt - old : old - *wgt;
+
+	if (old && diff * 100 <= (unsigned long)old * ratio->hyst) {
+		*wgt = old;
+		return false;
+	}
+	srvdesc->wgt = *wgt;
+
+	return true;
+}
+
 /**
  * Calculate ratios for each server in a group based on dynamic data.
  * Latest dynamic data is provided by APM module and represent RTT values
@@ -480,12 +522,16 @@ __tfw_sched_ratio_get_rtt(size_t si, TfwRatio *ratio, TfwRatioData *rtodata)
  *
  * The function runs periodically on timer and provides the data that is
  * used by the ratio scheduler for outgoing requests.
+ *
+ * Return false if no server weight changed and the current ratios may be
+ * used further.
  */
-static void
+static bool
 tfw_sched_ratio_calc_dynamic(TfwRatio *ratio, TfwRatioData *rtodata)
 {
 	size_t si, max_val_idx = 0;
 	unsigned long sum_wgt = 0;
+	bool changed = false;
 	TfwRatioSrvData *srvdata = rtodata->srvdata;
 
 	/*
@@ -495,12 +541,114 @@ tfw_sched_ratio_calc_dynamic(TfwRatio *ratio, TfwRatioData *rtodata)
 	 */
 	for (si = 0; si < ratio->srv_n; ++si) {
 		__tfw_sched_ratio_get_rtt(si, ratio, rtodata);
+		changed |= __tfw_sched_ratio_hyst(ratio, si,
+						  &srvdata[si].weight);
 		if (srvdata[max_val_idx].weight < srvdata[si].weight)
 			max_val_idx = si;
 		sum_wgt += srvdata[si].weight;
 	}
+	if (!changed)
+		return false;
 
 	__tfw_sched_ratio_calc_dynamic(ratio, rtodata, sum_wgt, max_val_idx);
+
+	return true;
+}
+
+/**
+ * Predict RTT of a server by simple linear regression calculation on
+ * a sliding data window. @rtt is an RTT value from APM multiplied by @mul,
+ * and @cnt is the current number of invocations of the timer function
+ * (every @intvl msecs) multiplied by @mul. Essentially, @cnt is a measure
+ * of time.
+ *
+ * The POC (proof of concept) implementation of this algorithm can be
+ * found in t/unit/user_space/slr.cc. @cnt corresponds to @x in the POC,
+ * and @rtt corresponds to @y.
+ */
+static long
+__tfw_sched_ratio_predict_linear(TfwRatioHstData *hstdata,
+				 TfwRatioHstDesc *hd, long rtt, long mul)
+{
+	int ni, sz;
+	long cnt, ahead;
+
+	ni = hstdata->counter % hstdata->slot_n;
+	cnt = hstdata->counter * mul;
+	ahead = hstdata->counter + hstdata->ahead;
+
+	/*
+	 * The calculations are slightly different for the case
+	 * in the beginning where there's insufficient data for
+	 * a whole window into the historic data set.
+	 */
+	if (unlikely(hstdata->counter < hstdata->slot_n)) {
+		sz = ni + 1;
+		hd->cnt_avg = (hd->cnt_avg * ni + cnt) / sz;
+		hd->rtt_avg = (hd->rtt_avg * ni + rtt) / sz;
+		hd->cnt_rtt_avg = (hd->cnt_rtt_avg * ni + cnt * rtt) / sz;
+		hd->cnt_avg_rtt_avg = hd->cnt_avg * hd->rtt_avg;
+		hd->cnt_sq_avg = (hd->cnt_sq_avg * ni + cnt * cnt) / sz;
+		hd->cnt_avg_sq = hd->cnt_avg * hd->cnt_avg;
+	} else {
+		long h_cnt = hd->hist[ni].cnt;
+		long h_rtt = hd->hist[ni].rtt;
+		sz = hstdata->slot_n;
+		hd->cnt_avg = hd->cnt_avg - (h_cnt - cnt) / sz;
+		hd->rtt_avg = hd->rtt_avg - (h_rtt - rtt) / sz;
+		hd->cnt_rtt_avg = hd->cnt_rtt_avg
+				  - (h_cnt * h_rtt - cnt * rtt) / sz;
+		hd->cnt_avg_rtt_avg = hd->cnt_avg * hd->rtt_avg;
+		hd->cnt_sq_avg = hd->cnt_sq_avg
+				 - (h_cnt * h_cnt - cnt * cnt) / sz;
+		hd->cnt_avg_sq = hd->cnt_avg * hd->cnt_avg;
+	}
+
+	hd->hist[ni].cnt = cnt;
+	hd->hist[ni].rtt = rtt;
+
+	if (hd->cnt_sq_avg == hd->cnt_avg_sq) {
+		hd->coeff_a = 0;
+		hd->coeff_b = hd->cnt_avg ? hd->rtt_avg / hd->cnt_avg : 1;
+	} else {
+		hd->coeff_b = (hd->cnt_rtt_avg - hd->cnt_avg_rtt_avg)
+			      / (hd->cnt_sq_avg - hd->cnt_avg_sq);
+		hd->coeff_a = (hd->rtt_avg - hd->coeff_b * hd->cnt_avg) / mul;
+	}
+
+	return hd->coeff_a + hd->coeff_b * ahead;
+}
+
+/**
+ * Predict RTT of a server by exponential smoothing. EWMA just smooths out
+ * bursts of RTT, while Holt's double exponential smoothing also tracks the
+ * trend of RTT and extrapolates it for @hstdata->ahead intervals. Unlike
+ * the linear regression, both of them follow a change of the trend within
+ * a few intervals instead of the whole window and don't overshoot on bursts.
+ */
+static long
+__tfw_sched_ratio_predict_smooth(TfwRatioHstData *hstdata,
+				 TfwRatioHstDesc *hd, long rtt, long mul)
+{
+	long level, alpha = hstdata->alpha, beta = hstdata->beta;
+
+	if (unlikely(!hstdata->counter)) {
+		hd->level = rtt;
+		hd->trend = 0;
+		return rtt / mul;
+	}
+
+	if (hstdata->model == TFW_SCHED_PREDICT_EWMA) {
+		hd->level += alpha * (rtt - hd->level) / 100;
+		return hd->level / mul;
+	}
+
+	level = (alpha * rtt + (100 - alpha) * (hd->level + hd->trend)) / 100;
+	hd->trend = (beta * (level - hd->level) + (100 - beta) * hd->trend)
+		    / 100;
+	hd->level = level;
+
+	return (hd->level + hd->trend * (long)hstdata->ahead) / mul;
 }
 
 /**
@@ -512,34 +660,26 @@ tfw_sched_ratio_calc_dynamic(TfwRatio *ratio, TfwRatioData *rtodata)
  * the next run of this function. Server ratios are calculated on those
  * predicted RTT values.
  *
- * A simple linear regression calculation on a sliding data window is
- * used to predict future RTT values for each server. @rtt is an RTT
- * value from APM, and @cnt is the current number of invocations of
- * this timer function (every @intvl msecs). Essentially, @cnt is
- * a measure of time.
- *
- * The POC (proof of concept) implementation of this algorithm can be
- * found in t/unit/user_space/slr.cc. @cnt corresponds to @x in the POC,
- * and @rtt corresponds to @y.
+ * The prediction model is either the linear regression on a sliding data
+ * window, or EWMA, or Holt's trend-aware smoothing, see the functions above.
  *
  * The function runs periodically on timer and provides the data that
  * is used by the ratio scheduler for outgoing requests.
+ *
+ * Return false if no predicted server weight changed and the current
+ * ratios may be used further.
  */
-static void
+static bool
 tfw_sched_ratio_calc_predict(TfwRatio *ratio, TfwRatioData *rtodata)
 {
 	static const long MUL = 1000;
-	int ni, sz;
 	size_t si, max_val_idx;
 	unsigned long sum_wgt;
-	long cnt, rtt, ahead, prediction;
+	long rtt, prediction;
+	bool changed = false;
 	TfwRatioHstData *hstdata = ratio->hstdata;
 	TfwRatioSrvData *srvdata = rtodata->srvdata;
 
-	ni = hstdata->counter % hstdata->slot_n;
-	cnt = hstdata->counter * MUL;
-	ahead = hstdata->counter + hstdata->ahead;
-
 	sum_wgt = max_val_idx = 0;
 	for (si = 0; si < ratio->srv_n; ++si) {
 		TfwRatioHstDesc *hd = &hstdata->hstdesc[si];
@@ -547,52 +687,17 @@ tfw_sched_ratio_calc_predict(TfwRatio *ratio, TfwRatioData *rtodata)
 		__tfw_sched_ratio_get_rtt(si, ratio, rtodata);
 
 		rtt = srvdata[si].weight * MUL;
-
-		/*
-		 * The calculations are slightly different for the case
-		 * in the beginning where there's insufficient data for
-		 * a whole window into the historic data set.
-		 */
-		if (unlikely(hstdata->counter < hstdata->slot_n)) {
-			sz = ni + 1;
-			hd->cnt_avg = (hd->cnt_avg * ni + cnt) / sz;
-			hd->rtt_avg = (hd->rtt_avg * ni + rtt) / sz;
-			hd->cnt_rtt_avg =
-				(hd->cnt_rtt_avg * ni + cnt * rtt) / sz;
-			hd->cnt_avg_rtt_avg = hd->cnt_avg * hd->rtt_avg;
-			hd->cnt_sq_avg =
-				(hd->cnt_sq_avg * ni + cnt * cnt) / sz;
-			hd->cnt_avg_sq = hd->cnt_avg * hd->cnt_avg;
-		} else {
-			long h_cnt = hd->hist[ni].cnt;
-			long h_rtt = hd->hist[ni].rtt;
-			sz = hstdata->slot_n;
-			hd->cnt_avg = hd->cnt_avg - (h_cnt - cnt) / sz;
-			hd->rtt_avg = hd->rtt_avg - (h_rtt - rtt) / sz;
-			hd->cnt_rtt_avg = hd->cnt_rtt_avg
-					  - (h_cnt * h_rtt - cnt * rtt) / sz;
-			hd->cnt_avg_rtt_avg = hd->cnt_avg * hd->rtt_avg;
-			hd->cnt_sq_avg = hd->cnt_sq_avg
-					 - (h_cnt * h_cnt - cnt * cnt) / sz;
-			hd->cnt_avg_sq = hd->cnt_avg * hd->cnt_avg;
-		}
-
-		hd->hist[ni].cnt = cnt;
-		hd->hist[ni].rtt = rtt;
-
-		if (hd->cnt_sq_avg == hd->cnt_avg_sq) {
-			hd->coeff_a = 0;
-			hd->coeff_b = hd->cnt_avg
-				    ? hd->rtt_avg / hd->cnt_avg : 1;
-		} else {
-			hd->coeff_b = (hd->cnt_rtt_avg - hd->cnt_avg_rtt_avg)
-				      / (hd->cnt_sq_avg - hd->cnt_avg_sq);
-			hd->coeff_a = (hd->rtt_avg - hd->coeff_b * hd->cnt_avg)
-				      / MUL;
-		}
-
-		prediction = hd->coeff_a + hd->coeff_b * ahead;
+		if (hstdata->model == TFW_SCHED_PREDICT_LINEAR)
+			prediction = __tfw_sched_ratio_predict_linear(hstdata,
+								      hd, rtt,
+								      MUL);
+		else
+			prediction = __tfw_sched_ratio_predict_smooth(hstdata,
+								      hd, rtt,
+								      MUL);
 		srvdata[si].weight = prediction <= 0 ? 1 : prediction;
+		changed |= __tfw_sched_ratio_hyst(ratio, si,
+						  &srvdata[si].weight);
 
 		if (srvdata[max_val_idx].weight < srvdata[si].weight)
 			max_val_idx = si;
@@ -601,7 +706,12 @@ tfw_sched_ratio_calc_predict(TfwRatio *ratio, TfwRatioData *rtodata)
 
 	++hstdata->counter;
 
+	if (!changed)
+		return false;
+
 	__tfw_sched_ratio_calc_dynamic(ratio, rtodata, sum_wgt, max_val_idx);
+
+	return true;
 }
 
 /**
@@ -638,11 +748,13 @@ tfw_sched_ratio_rtodata_put(struct rcu_head *rcup)
  * RCU is used to avoid locks. When recalculation is in order, the new
  * data is placed in a new allocated entry. The new entry is seamlessly
  * set as the current entry by using RCU. The formerly active entry is
- * released in due time when all users of it are done and gone.
+ * released in due time when all users of it are done and gone. If no
+ * server weight changed, then the new entry is dropped and the scheduler
+ * keeps running on the current data without any disruption.
  */
 static void
 tfw_sched_ratio_calc_tmfn(TfwRatio *ratio,
-			  void (*calc_fn)(TfwRatio *, TfwRatioData *))
+			  bool (*calc_fn)(TfwRatio *, TfwRatioData *))
 {
 	TfwRatioData *crtodata, *nrtodata;
 
@@ -658,7 +770,10 @@ tfw_sched_ratio_calc_tmfn(TfwRatio *ratio,
 	}
 
 	/* Calculate dynamic ratios. */
-	calc_fn(ratio, nrtodata);
+	if (!calc_fn(ratio, nrtodata)) {
+		kfree(nrtodata);
+		goto rearm;
+	}
 
 	/*
 	 * Substitute the current ratio data entry with the new one for
@@ -819,31 +934,50 @@ retry:
  * 1. connection is not in recovery mode.
  * 2. connection's queue is not be full.
  * 3. connection doesn't have active non-idempotent requests.
+ * 4. connection has less queued requests than the pipelining depth.
  *
- * The restriction #3 is controlled by @skipnip and can be removed
+ * The restrictions #3 and #4 are controlled by @skipnip and can be removed
  * to get a wider selection of available connections.
+ *
+ * Connections processed by the current CPU are preferred, and then the ones
+ * processed by the current NUMA node, so responses don't migrate between
+ * CPUs. The connections are still rotated in round-robin fashion, starting
+ * from the next connection on each call.
  */
 static inline TfwSrvConn *
 __sched_srv(TfwRatioSrvDesc *srvdesc, int skipnip, int *nipconn)
 {
 	size_t ci;
+	int loc;
+	TfwSrvConn *cand[TFW_SRV_CONN_CPU] = { NULL };
+	unsigned long idxval = atomic64_inc_return(&srvdesc->counter);
 
 	for (ci = 0; ci < srvdesc->conn_n; ++ci) {
-		unsigned long idxval = atomic64_inc_return(&srvdesc->counter);
-		TfwSrvConn *srv_conn = srvdesc->conn[idxval % srvdesc->conn_n];
+		size_t idx = (idxval + ci) % srvdesc->conn_n;
+		TfwSrvConn *srv_conn = srvdesc->conn[idx];
 
 		if (unlikely(tfw_srv_conn_restricted(srv_conn)
 			     || tfw_srv_conn_busy(srv_conn)
 			     || tfw_srv_conn_queue_full(srv_conn)))
 			continue;
-		if (skipnip && tfw_srv_conn_hasnip(srv_conn)) {
+		if (skipnip && (tfw_srv_conn_hasnip(srv_conn)
+				|| tfw_srv_conn_pipe_full(srv_conn)))
+		{
 			if (likely(tfw_srv_conn_live(srv_conn)))
 				++(*nipconn);
 			continue;
 		}
-		if (likely(tfw_srv_conn_get_if_live(srv_conn)))
-			return srv_conn;
+		loc = tfw_srv_conn_locality(srv_conn);
+		if (loc == TFW_SRV_CONN_CPU) {
+			if (likely(tfw_srv_conn_get_if_live(srv_conn)))
+				return srv_conn;
+		} else if (!cand[loc] && likely(tfw_srv_conn_live(srv_conn))) {
+			cand[loc] = srv_conn;
+		}
 	}
+	for (loc = TFW_SRV_CONN_NODE; loc >= TFW_SRV_CONN_REMOTE; --loc)
+		if (cand[loc] && likely(tfw_srv_conn_get_if_live(cand[loc])))
+			return cand[loc];
 
 	return NULL;
 }
@@ -907,6 +1041,7 @@ static TfwSrvConn *
 tfw_sched_ratio_sched_sg_conn(TfwMsg *msg, TfwSrvGroup *sg)
 {
 	unsigned int attempts, skipnip = 1, nipconn = 0;
+	unsigned int skipwarm = 1, warm = 0;
 	TfwRatio *ratio;
 	TfwRatioSrvDesc *srvdesc;
 	TfwSrvConn *srv_conn;
@@ -955,6 +1090,11 @@ rerun:
 		srvdesc = tfw_sched_ratio_next_srv(ratio, rtodata);
 		if (tfw_srv_suspended(srvdesc->srv))
 			continue;
+		/* Don't overload a server just restored after an outage. */
+		if (skipwarm && tfw_srv_warming(srvdesc->srv)) {
+			warm = 1;
+			continue;
+		}
 
 		if ((srv_conn = __sched_srv(srvdesc, skipnip, &nipconn))) {
 			rcu_read_unlock_bh();
@@ -962,6 +1102,10 @@ rerun:
 		}
 	}
 	/* Relax the restrictions and re-run the search cycle. */
+	if (skipwarm && warm) {
+		skipwarm = 0;
+		goto rerun;
+	}
 	if (skipnip && nipconn) {
 		skipnip = 0;
 		goto rerun;
@@ -1163,7 +1307,9 @@ tfw_sched_ratio_add_grp_dynamic(TfwSrvGroup *sg, void *arg)
 
 		BUG_ON(!schref);
 
-		slot_n = schref->past * schref->rate;
+		/* Only the linear regression needs the past data window. */
+		slot_n = schref->model == TFW_SCHED_PREDICT_LINEAR
+			 ? schref->past * schref->rate : 0;
 		size = sizeof(TfwRatioHstData)
 		       + sizeof(TfwRatioHstDesc) * sg->srv_n
 		       + sizeof(TfwRatioHstUnit) * sg->srv_n * slot_n;
@@ -1174,6 +1320,10 @@ tfw_sched_ratio_add_grp_dynamic(TfwSrvGroup *sg, void *arg)
 		hdata->hstdesc = (TfwRatioHstDesc *)(hdata + 1);
 		hdata->slot_n = slot_n;
 		hdata->ahead = schref->ahead * schref->rate;
+		hdata->model = schref->model;
+		hdata->alpha = schref->alpha;
+		hdata->beta = schref->beta;
+		ratio->hyst = schref->hyst;
 
 		hdesc_end = hdata->hstdesc + sg->srv_n;
 		hunit = (TfwRatioHstUnit *)hdesc_end;
@@ -35,6 +35,7 @@
  */
 #include <crypto/hash.h>
 #include <linux/ctype.h>
+#include <linux/hash.h>
 #include <linux/slab.h>
 #include <linux/time.h>
 #include <linux/vmalloc.h>
@@ -45,6 +46,7 @@
 #include "cfg.h"
 #include "client.h"
 #include "hash.h"
+#include "http_limits.h"
 #include "http_msg.h"
 #include "http_sess.h"
 #include "http_sess_conf.h"
@@ -54,6 +56,7 @@
 
 static struct {
 	unsigned int	db_size;
+	unsigned int	db_size_max;
 	const char	*db_path;
 } sess_db_cfg __read_mostly;
 
@@ -174,16 +177,177 @@ tfw_http_redir_mark_prepare(RedirMarkVal *mv, char *buf, unsigned int buf_len,
 	rmark->nchunks = 3;
 }
 
+#define S_STICKY_TPL_COOKIE	S_CRLF S_F_SET_COOKIE
+#define S_STICKY_TPL_KEEP	S_CRLF S_F_CONNECTION S_V_CONN_KA S_CRLF
+#define S_STICKY_TPL_CLOSE	S_CRLF S_F_CONNECTION S_V_CONN_CLOSE S_CRLF
+
+/* Lengths of the cookie and redirection mark values in hex. */
+#define TFW_STICKY_COOKIE_LEN	(sizeof(StickyVal) * 2)
+#define TFW_STICKY_RMARK_LEN	(sizeof(RedirMarkVal) * 2)
+
+static inline char *
+tfw_http_sticky_tpl_put(char *p, const char *data, size_t len)
+{
+	memcpy(p, data, len);
+	return p + len;
+}
+
+static int
+tfw_http_sticky_tpl_render(TfwStickyCookie *sticky, TfwStickyTpl *tpl,
+			   const TfwStr *conn_hdr, int body)
+{
+	TfwCfgJsCh *js_ch = sticky->js_challenge;
+	char cl_buf[TFW_ULTOA_BUF_SIZ];
+	size_t cl_len, body_len = 0;
+	char *p;
+
+	if (body != TFW_STICKY_TPL_BODY_NONE)
+		body_len = js_ch->body.len;
+	if (body == TFW_STICKY_TPL_BODY_JSCH_MARK)
+		body_len += SLEN("/") + redir_mark_eq.len + TFW_STICKY_RMARK_LEN;
+	cl_len = tfw_ultoa(body_len, cl_buf, sizeof(cl_buf));
+
+	tpl->len = SLEN(S_STICKY_TPL_COOKIE) + sticky->name_eq.len
+		   + TFW_STICKY_COOKIE_LEN + sticky->options.len
+		   + conn_hdr->len + SLEN(S_F_CONTENT_LENGTH) + cl_len
+		   + SLEN(S_CRLFCRLF) + body_len;
+	if (!(p = tpl->data = kmalloc(tpl->len, GFP_KERNEL)))
+		return -ENOMEM;
+
+	p = tfw_http_sticky_tpl_put(p, S_STICKY_TPL_COOKIE,
+				    SLEN(S_STICKY_TPL_COOKIE));
+	p = tfw_http_sticky_tpl_put(p, sticky->name_eq.data,
+				    sticky->name_eq.len);
+	tpl->cookie_off = p - tpl->data;
+	memset(p, '0', TFW_STICKY_COOKIE_LEN);
+	p += TFW_STICKY_COOKIE_LEN;
+	p = tfw_http_sticky_tpl_put(p, sticky->options.data,
+				    sticky->options.len);
+	p = tfw_http_sticky_tpl_put(p, conn_hdr->data, conn_hdr->len);
+	p = tfw_http_sticky_tpl_put(p, S_F_CONTENT_LENGTH,
+				    SLEN(S_F_CONTENT_LENGTH));
+	p = tfw_http_sticky_tpl_put(p, cl_buf, cl_len);
+	p = tfw_http_sticky_tpl_put(p, S_CRLFCRLF, SLEN(S_CRLFCRLF));
+
+	if (body == TFW_STICKY_TPL_BODY_NONE)
+		goto done;
+	p = tfw_http_sticky_tpl_put(p, js_ch->body.chunks[0].data,
+				    js_ch->body.chunks[0].len);
+	if (body == TFW_STICKY_TPL_BODY_JSCH_MARK) {
+		p = tfw_http_sticky_tpl_put(p, "/", SLEN("/"));
+		p = tfw_http_sticky_tpl_put(p, redir_mark_eq.data,
+					    redir_mark_eq.len);
+		tpl->rmark_off = p - tpl->data;
+		memset(p, '0', TFW_STICKY_RMARK_LEN);
+		p += TFW_STICKY_RMARK_LEN;
+	}
+	p = tfw_http_sticky_tpl_put(p, js_ch->body.chunks[1].data,
+				    js_ch->body.chunks[1].len);
+done:
+	BUG_ON(p != tpl->data + tpl->len);
+
+	return 0;
+}
+
+/**
+ * Pre-render the HTTP/1 redirect response tails for @sticky:
+ *
+ *	CRLF Set-Cookie: <name>=<COOKIE><options>CRLF [Connection: ...CRLF]
+ *	Content-Length: <N>CRLF
+ *	CRLF
+ *	<JS challenge body with /__tfw=<RMARK> redirection mark>
+ *
+ * The cookie and the redirection mark values have fixed length, so the only
+ * per-response work is writing the template with the values in their slots.
+ */
+int
+tfw_http_sticky_tpl_build(TfwStickyCookie *sticky)
+{
+	static const TfwStr conn_hdr[_TFW_STICKY_TPL_CONN_NUM] = {
+		[TFW_STICKY_TPL_CONN_NONE] = TFW_STR_STRING(S_CRLF),
+		[TFW_STICKY_TPL_CONN_KA] = TFW_STR_STRING(S_STICKY_TPL_KEEP),
+		[TFW_STICKY_TPL_CONN_CLOSE] = TFW_STR_STRING(S_STICKY_TPL_CLOSE),
+	};
+	TfwCfgJsCh *js_ch = sticky->js_challenge;
+	int i, c, b;
+
+	tfw_http_sticky_tpl_free(sticky);
+	if (sticky->learn || TFW_STR_EMPTY(&sticky->name))
+		return 0;
+
+	sticky->h1_tpl = kcalloc(TFW_STICKY_TPL_NUM, sizeof(TfwStickyTpl),
+				 GFP_KERNEL);
+	if (!sticky->h1_tpl)
+		return -ENOMEM;
+
+	for (i = 0; i < TFW_STICKY_TPL_NUM; ++i) {
+		c = i / _TFW_STICKY_TPL_BODY_NUM;
+		b = i % _TFW_STICKY_TPL_BODY_NUM;
+		if (b != TFW_STICKY_TPL_BODY_NONE
+		    && (!js_ch || js_ch->body.nchunks != 2))
+			continue;
+		if (tfw_http_sticky_tpl_render(sticky, &sticky->h1_tpl[i],
+					       &conn_hdr[c], b))
+		{
+			tfw_http_sticky_tpl_free(sticky);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+void
+tfw_http_sticky_tpl_free(TfwStickyCookie *sticky)
+{
+	int i;
+
+	if (!sticky->h1_tpl)
+		return;
+	for (i = 0; i < TFW_STICKY_TPL_NUM; ++i)
+		kfree(sticky->h1_tpl[i].data);
+	kfree(sticky->h1_tpl);
+	sticky->h1_tpl = NULL;
+}
+
+/**
+ * Build the HTTP/1 redirect response tail from the pre-rendered template
+ * @tpl and the cookie value @c_buf and redirection mark value @m_buf.
+ */
+static void
+tfw_http_sticky_tpl_fill(const TfwStickyTpl *tpl, char *c_buf, char *m_buf,
+			 TfwStr *chunks, TfwStr *tail)
+{
+	unsigned int off = tpl->cookie_off + TFW_STICKY_COOKIE_LEN;
+
+	chunks[0] = (TfwStr){ .data = tpl->data, .len = tpl->cookie_off };
+	chunks[1] = (TfwStr){ .data = c_buf, .len = TFW_STICKY_COOKIE_LEN };
+	tail->nchunks = 3;
+	if (tpl->rmark_off) {
+		chunks[2] = (TfwStr){ .data = tpl->data + off,
+				      .len = tpl->rmark_off - off };
+		chunks[3] = (TfwStr){ .data = m_buf,
+				      .len = TFW_STICKY_RMARK_LEN };
+		off = tpl->rmark_off + TFW_STICKY_RMARK_LEN;
+		tail->nchunks = 5;
+	}
+	chunks[tail->nchunks - 1] = (TfwStr){ .data = tpl->data + off,
+					      .len = tpl->len - off };
+	tail->chunks = chunks;
+	tail->len = tpl->len;
+}
+
 static int
 tfw_http_sticky_build_redirect(TfwHttpReq *req, StickyVal *sv, RedirMarkVal *mv,
                                bool jsch_allow)
 {
 	unsigned long ts_be64 = cpu_to_be64(sv->ts);
-	TfwStr c_chunks[3], m_chunks[3], r_chunks[5], cookie = { 0 }, rmark = { 0 };
+	TfwStr c_chunks[5], m_chunks[3], r_chunks[5], cookie = { 0 }, rmark = { 0 };
 	TfwHttpResp *resp;
-	char c_buf[sizeof(*sv) * 2], m_buf[sizeof(*mv) * 2];
+	char c_buf[TFW_STICKY_COOKIE_LEN], m_buf[TFW_STICKY_RMARK_LEN];
 	TfwStr body = { 0 };
 	TfwStickyCookie *sticky;
+	bool jsch;
 	int r, code;
 
 	WARN_ON_ONCE(!list_empty(&req->fwd_list));
@@ -191,14 +355,14 @@ tfw_http_sticky_build_redirect(TfwHttpReq *req, StickyVal *sv, RedirMarkVal *mv,
 	if (WARN_ON_ONCE(!req->vhost))
 		return TFW_HTTP_SESS_FAILURE;
 
-	/*
-	 * TODO: #598 rate limit requests with invalid cookie value.
-	 * Non-challengeable requests also must be rate limited.
-	 */
-
 	if (!tfw_http_sticky_redirect_applied(req))
 		return TFW_HTTP_SESS_JS_NOT_SUPPORTED;
 
+	sticky = req->vhost->cookie;
+	jsch = sticky->js_challenge && jsch_allow;
+	if (jsch && mv && sticky->js_challenge->body.nchunks != 2)
+		return TFW_HTTP_SESS_FAILURE;
+
 	if (!(resp = tfw_http_msg_alloc_resp_light(req)))
 		return TFW_HTTP_SESS_FAILURE;
 
@@ -206,12 +370,45 @@ tfw_http_sticky_build_redirect(TfwHttpReq *req, StickyVal *sv, RedirMarkVal *mv,
 		tfw_http_redir_mark_prepare(mv, m_buf, sizeof(m_buf), m_chunks,
 					    sizeof(m_chunks), &rmark);
 
-	sticky = req->vhost->cookie;
-	if (sticky->js_challenge && jsch_allow) {
-		if (mv) {
-			if (sticky->js_challenge->body.nchunks != 2)
-				return TFW_HTTP_SESS_FAILURE;
+	/*
+	 * Form the cookie as:
+	 *
+	 * 	<timestamp> | HMAC(Secret, User-Agent, timestamp, Client IP)
+	 *
+	 * Open <timestamp> is required to be able to recalculate secret HMAC.
+	 * Since the secret is unknown for the attackers, they're still unable
+	 * to recalculate HMAC while we don't need to store session information
+	 * until we receive correct cookie value.
+	 */
+	bin2hex(c_buf, &ts_be64, sizeof(ts_be64));
+	bin2hex(&c_buf[sizeof(ts_be64) * 2], sv->hmac, sizeof(sv->hmac));
+
+	code = jsch_allow ? sticky->redirect_code: TFW_REDIR_STATUS_CODE_DFLT;
+
+	if (!TFW_MSG_H2(req)) {
+		int c = TFW_STICKY_TPL_CONN_NONE, b = TFW_STICKY_TPL_BODY_NONE;
+
+		if (test_bit(TFW_HTTP_B_CONN_CLOSE, req->flags))
+			c = TFW_STICKY_TPL_CONN_CLOSE;
+		else if (test_bit(TFW_HTTP_B_CONN_KA, req->flags))
+			c = TFW_STICKY_TPL_CONN_KA;
+		if (jsch)
+			b = mv ? TFW_STICKY_TPL_BODY_JSCH_MARK
+			       : TFW_STICKY_TPL_BODY_JSCH;
+		if (WARN_ON_ONCE(!sticky->h1_tpl)) {
+			tfw_http_msg_free((TfwHttpMsg *)resp);
+			return TFW_HTTP_SESS_FAILURE;
+		}
+		tfw_http_sticky_tpl_fill(
+			&sticky->h1_tpl[c * _TFW_STICKY_TPL_BODY_NUM + b],
+			c_buf, m_buf, c_chunks, &cookie);
+
+		r = tfw_h1_prep_redirect(resp, code, &rmark, &cookie);
+		goto done;
+	}
 
+	if (jsch) {
+		if (mv) {
 			r_chunks[0] = sticky->js_challenge->body.chunks[0];
 			r_chunks[1] = rmark.chunks[0];
 			r_chunks[2] = rmark.chunks[1];
@@ -225,23 +422,10 @@ tfw_http_sticky_build_redirect(TfwHttpReq *req, StickyVal *sv, RedirMarkVal *mv,
 		}
 	}
 
-	/*
-	 * Form the cookie as:
-	 *
-	 * 	<timestamp> | HMAC(Secret, User-Agent, timestamp, Client IP)
-	 *
-	 * Open <timestamp> is required to be able to recalculate secret HMAC.
-	 * Since the secret is unknown for the attackers, they're still unable
-	 * to recalculate HMAC while we don't need to store session information
-	 * until we receive correct cookie value.
-	 */
-	bin2hex(c_buf, &ts_be64, sizeof(ts_be64));
-	bin2hex(&c_buf[sizeof(ts_be64) * 2], sv->hmac, sizeof(sv->hmac));
-
 	bzero_fast(c_chunks, sizeof(c_chunks));
 	c_chunks[0] = sticky->name_eq;
 	c_chunks[1].data = c_buf;
-	c_chunks[1].len = sizeof(*sv) * 2;
+	c_chunks[1].len = sizeof(c_buf);
 	c_chunks[2] = sticky->options;
 
 	cookie.chunks = c_chunks;
@@ -252,10 +436,8 @@ tfw_http_sticky_build_redirect(TfwHttpReq *req, StickyVal *sv, RedirMarkVal *mv,
 		cookie.nchunks++;
 	}
 
-	code = jsch_allow ? sticky->redirect_code: TFW_REDIR_STATUS_CODE_DFLT;
-	r = TFW_MSG_H2(req)
-		? tfw_h2_prep_redirect(resp, code, &rmark, &cookie, &body)
-		: tfw_h1_prep_redirect(resp, code, &rmark, &cookie, &body);
+	r = tfw_h2_prep_redirect(resp, code, &rmark, &cookie, &body);
+done:
 	if (r) {
 		tfw_http_msg_free((TfwHttpMsg *)resp);
 		return TFW_HTTP_SESS_FAILURE;
@@ -405,10 +587,26 @@ __sticky_calc(TfwHttpReq *req, StickyVal *sv)
 		tfw_http_msg_clnthdr_val(req, hdr, TFW_HTTP_HDR_USER_AGENT,
 					 &ua_value);
 
-	shash_desc->tfm = sticky->shash;
-
 	T_DBG_PRINT_STICKY_COOKIE(addr, &ua_value, sv);
 
+	if (sticky->mac == TFW_STICKY_MAC_BLAKE2S) {
+		struct blake2s_state st;
+
+		blake2s_init_key(&st, STICKY_KEY_HMAC_LEN, sticky->mac_key,
+				 sizeof(sticky->mac_key));
+		blake2s_update(&st, (u8 *)tfw_addr_sa(addr),
+			       tfw_addr_sa_len(addr));
+		if (ua_value.len)
+			TFW_STR_FOR_EACH_CHUNK(c, &ua_value, end)
+				blake2s_update(&st, c->data, c->len);
+		blake2s_update(&st, (u8 *)&sv->ts, sizeof(sv->ts));
+		blake2s_final(&st, sv->hmac);
+
+		return 0;
+	}
+
+	shash_desc->tfm = sticky->shash;
+
 	if ((r = crypto_shash_init(shash_desc)))
 		return r;
 
@@ -516,11 +714,23 @@ __redir_hmac_calc(TfwHttpReq *req, RedirMarkVal *mv)
 	TfwStickyCookie *sticky = req->vhost->cookie;
 	SHASH_DESC_ON_STACK(shash_desc, sticky->shash);
 
-	shash_desc->tfm = sticky->shash;
-
 	T_DBG("http_sess: calculate redirection mark: ts=%#lx(now=%#lx),"
 	      " att_no=%#x\n", mv->ts, jiffies, mv->att_no);
 
+	if (sticky->mac == TFW_STICKY_MAC_BLAKE2S) {
+		struct blake2s_state st;
+
+		blake2s_init_key(&st, STICKY_KEY_HMAC_LEN, sticky->mac_key,
+				 sizeof(sticky->mac_key));
+		blake2s_update(&st, (u8 *)&mv->att_no, sizeof(mv->att_no));
+		blake2s_update(&st, (u8 *)&mv->ts, sizeof(mv->ts));
+		blake2s_final(&st, mv->hmac);
+
+		return 0;
+	}
+
+	shash_desc->tfm = sticky->shash;
+
 	if ((r = crypto_shash_init(shash_desc)))
 		return r;
 	r = crypto_shash_update(shash_desc, (u8 *)&mv->att_no, sizeof(mv->att_no));
@@ -840,14 +1050,17 @@ tfw_http_sticky_req_process(TfwHttpReq *req, StickyVal *sv, TfwStr *cookie_val)
 		/*
 		 * Verify sticky cookie value: if it's wrong, then this can be
 		 * an attack as well as changed Tempesta or whatever else.
-		 * The first case must be properly handled by Frang limit
-		 * (TODO #598), your ever can limit number of invalid sticky
-		 * cookie tries to 1. While we just send normal 302 redirect to
-		 * keep user experience intact.
+		 * The first case is handled by Frang http_sticky_fail_rate
+		 * limit, you ever can limit number of invalid sticky cookie
+		 * tries to 1. While we just send normal 302 redirect to keep
+		 * user experience intact.
 		 */
-		if (tfw_http_sticky_verify(req, cookie_val, sv))
+		if (tfw_http_sticky_verify(req, cookie_val, sv)) {
+			if (frang_sticky_fail(req))
+				return TFW_HTTP_SESS_VIOLATE;
 			return tfw_http_sticky_challenge_start(
 						req, req->vhost->cookie, sv);
+		}
 		return TFW_HTTP_SESS_SUCCESS;
 	}
 	T_WARN("Multiple Tempesta sticky cookies found: %d\n", r);
@@ -1015,12 +1228,12 @@ tfw_http_sess_check_jsch(StickyVal *sv, TfwHttpReq* req)
 	return TFW_HTTP_SESS_VIOLATE;
 }
 
+/**
+ * Check that @sess is alive and identified by the cookie from @ctx.
+ */
 static bool
-tfw_http_sess_eq(TdbRec *rec, void *data)
+tfw_http_sess_match(TfwHttpSess *sess, TfwSessEqCtx *ctx)
 {
-	TfwSessEntry *ent = (TfwSessEntry *)rec->data;
-	TfwHttpSess *sess = &ent->sess;
-	TfwSessEqCtx *ctx = (TfwSessEqCtx *)data;
 	TfwStickyCookie *sticky = ctx->req->vhost->cookie;
 
 	/*
@@ -1043,6 +1256,75 @@ tfw_http_sess_eq(TdbRec *rec, void *data)
 			return false;
 	}
 
+	return true;
+}
+
+/*
+ * Per-CPU direct mapped cache of recently used sessions in front of sess_db.
+ * The session records are never removed from sess_db while it's open and
+ * don't change their location, so a cached pointer is always valid and the
+ * session only needs the same checks as on the table lookup. Sessions with
+ * removed or reconfigured vhosts aren't matched by the cache, so the table
+ * lookup handles them.
+ */
+#define TFW_SESS_CACHE_BITS	8
+
+typedef struct {
+	struct {
+		unsigned long	key;
+		TfwHttpSess	*sess;
+	} ent[1 << TFW_SESS_CACHE_BITS];
+} TfwSessCache;
+
+static DEFINE_PER_CPU(TfwSessCache, sess_cache);
+
+static TfwHttpSess *
+tfw_http_sess_cache_get(unsigned long key, TfwSessEqCtx *ctx)
+{
+	TfwSessCache *sc = this_cpu_ptr(&sess_cache);
+	unsigned int i = hash_min(key, TFW_SESS_CACHE_BITS);
+	TfwHttpSess *sess = sc->ent[i].sess;
+
+	if (!sess || sc->ent[i].key != key
+	    || READ_ONCE(sess->vhost) != ctx->req->vhost
+	    || !tfw_http_sess_match(sess, ctx))
+		return NULL;
+	/* The session is being released. */
+	if (!atomic_inc_not_zero(&sess->users))
+		return NULL;
+
+	return sess;
+}
+
+static void
+tfw_http_sess_cache_put(unsigned long key, TfwHttpSess *sess)
+{
+	TfwSessCache *sc = this_cpu_ptr(&sess_cache);
+	unsigned int i = hash_min(key, TFW_SESS_CACHE_BITS);
+
+	sc->ent[i].key = key;
+	sc->ent[i].sess = sess;
+}
+
+static void
+tfw_http_sess_cache_flush(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		bzero_fast(per_cpu_ptr(&sess_cache, cpu), sizeof(TfwSessCache));
+}
+
+static bool
+tfw_http_sess_eq(TdbRec *rec, void *data)
+{
+	TfwSessEntry *ent = (TfwSessEntry *)rec->data;
+	TfwHttpSess *sess = &ent->sess;
+	TfwSessEqCtx *ctx = (TfwSessEqCtx *)data;
+
+	if (!tfw_http_sess_match(sess, ctx))
+		return false;
+
 	read_lock(&sess->lock);
 	/*
 	 * Vhosts are removed and added at runtime, so can't
@@ -1182,6 +1464,11 @@ tfw_http_sess_obtain(TfwHttpReq *req)
 		key = hash_calc(sv->hmac, sizeof(sv->hmac));
 	}
 	ctx.req = req;
+	if ((sess = tfw_http_sess_cache_get(key, &ctx))) {
+		T_DBG("http_sess was found in the cache, %pK\n", sess);
+		goto found;
+	}
+
 	tdb_ctx.eq_rec = tfw_http_sess_eq;
 	tdb_ctx.precreate_rec = tfw_http_sess_precreate;
 	tdb_ctx.init_rec = tfw_sess_ent_init;
@@ -1203,8 +1490,6 @@ tfw_http_sess_obtain(TfwHttpReq *req)
 	sess = &((TfwSessEntry *)rec->data)->sess;
 
 	atomic_inc(&sess->users);
-	req->sess = sess;
-	tfw_http_sess_prolong(sess, req->vhost->cookie);
 
 	if (!tdb_ctx.is_new)
 		/*
@@ -1214,6 +1499,11 @@ tfw_http_sess_obtain(TfwHttpReq *req)
 		 */
 		tdb_rec_put(rec);
 
+	tfw_http_sess_cache_put(key, sess);
+found:
+	req->sess = sess;
+	tfw_http_sess_prolong(sess, req->vhost->cookie);
+
 	if (tfw_http_redir_mark_get(req, &mark_val))
 		return tfw_http_sticky_build_redirect(req, sv, NULL, false);
 
@@ -1352,6 +1642,7 @@ __try_conn(TfwMsg *msg, TfwSrvConn *srv_conn)
 	    && !tfw_srv_conn_busy(srv_conn)
 	    && !tfw_srv_conn_queue_full(srv_conn)
 	    && !tfw_srv_conn_hasnip(srv_conn)
+	    && !tfw_srv_conn_pipe_full(srv_conn)
 	    && tfw_srv_conn_get_if_live(srv_conn))
 	{
 		return srv_conn;
@@ -1525,9 +1816,12 @@ tfw_http_sess_start(void)
 	 */
 	BUILD_BUG_ON(sizeof(TfwSessEntry) <= TDB_HTRIE_MINDREC);
 	sess_db = tdb_open(sess_db_cfg.db_path, sess_db_cfg.db_size,
-			   sizeof(TfwSessEntry), numa_node_id());
+			   sess_db_cfg.db_size_max, sizeof(TfwSessEntry),
+			   numa_node_id());
 	if (!sess_db)
 		return -EINVAL;
+	/* The sessions are referenced by the clients and the requests. */
+	tdb_set_owner(sess_db, NULL);
 
 	return 0;
 }
@@ -1548,6 +1842,7 @@ tfw_http_sess_stop(void)
 	if (!sess_db)
 		return;
 
+	tfw_http_sess_cache_flush();
 	tdb_entry_walk(sess_db, tfw_http_sess_release_entry);
 	tdb_close(sess_db);
 }
@@ -1563,6 +1858,16 @@ static TfwCfgSpec tfw_http_sess_specs_table[] = {
 			.range = { PAGE_SIZE, (1 << 30) },
 		}
 	},
+	{
+		.name = "sessions_tbl_size_max",
+		.deflt = "0",
+		.handler = tfw_cfg_set_int,
+		.dest = &sess_db_cfg.db_size_max,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.multiple_of = 2 * 1024 * 1024,
+			.range = { 0, (1 << 30) },
+		}
+	},
 	{
 		.name = "sessions_db",
 		.deflt = "/opt/tempesta/db/sessions.tdb",
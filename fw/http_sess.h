@@ -20,6 +20,8 @@
 #ifndef __TFW_HTTP_SESS_H__
 #define __TFW_HTTP_SESS_H__
 
+#include <crypto/blake2s.h>
+
 #include "http.h"
 
 /**
@@ -64,6 +66,12 @@
 /* Size of binary representation of HMAC. */
 #define STICKY_KEY_HMAC_LEN	(SHA1_DIGEST_SIZE)
 
+/* Message authentication codes for sticky cookies and redirection marks. */
+enum {
+	TFW_STICKY_MAC_HMAC_SHA1,
+	TFW_STICKY_MAC_BLAKE2S,
+};
+
 /**
  * JavaScript challenge.
  *
@@ -89,6 +97,44 @@ typedef struct {
 	refcount_t		users;
 } TfwCfgJsCh;
 
+/*
+ * Pre-rendered HTTP/1 sticky redirect response tails, one for each
+ * 'Connection' header field and response body variant.
+ */
+enum {
+	TFW_STICKY_TPL_CONN_NONE,
+	TFW_STICKY_TPL_CONN_KA,
+	TFW_STICKY_TPL_CONN_CLOSE,
+	_TFW_STICKY_TPL_CONN_NUM
+};
+
+enum {
+	TFW_STICKY_TPL_BODY_NONE,
+	TFW_STICKY_TPL_BODY_JSCH,
+	TFW_STICKY_TPL_BODY_JSCH_MARK,
+	_TFW_STICKY_TPL_BODY_NUM
+};
+
+#define TFW_STICKY_TPL_NUM	(_TFW_STICKY_TPL_CONN_NUM		\
+				 * _TFW_STICKY_TPL_BODY_NUM)
+
+/**
+ * Pre-rendered tail of HTTP/1 sticky redirect response.
+ *
+ * @data	- the response starting from CRLF before 'Set-Cookie' header
+ *		  field up to the end of the body;
+ * @len		- length of @data;
+ * @cookie_off	- offset of the cookie value slot in @data;
+ * @rmark_off	- offset of the redirection mark value slot in the JS
+ *		  challenge body, zero if there is no the slot.
+ */
+typedef struct {
+	char		*data;
+	unsigned int	len;
+	unsigned int	cookie_off;
+	unsigned int	rmark_off;
+} TfwStickyTpl;
+
 /**
  * Sticky cookie configuration.
  *
@@ -96,6 +142,11 @@ typedef struct {
  *			  identifiers.
  * @key			- string representation of secret key for shash,
  *			  used only for debugging.
+ * @mac_key		- the secret key for keyed BLAKE2s, derived from
+ *			  the secret string;
+ * @mac			- message authentication code, TFW_STICKY_MAC_*;
+ * @h1_tpl		- TFW_STICKY_TPL_NUM pre-rendered HTTP/1 redirect
+ *			  response tails;
  * @name		- name of sticky cookie;
  * @name_eq		- @name plus "=" to make some operations faster;
  * @js_challenge	- JS challenge configuration;
@@ -115,6 +166,9 @@ struct tfw_http_cookie_t {
 #ifdef DEBUG
 	char			key[STICKY_KEY_HMAC_LEN];
 #endif
+	unsigned char		mac_key[BLAKE2S_KEY_SIZE];
+	unsigned int		mac;
+	TfwStickyTpl		*h1_tpl;
 	char			sticky_name[STICKY_NAME_MAXLEN + 1];
 	char			options_str[STICKY_OPT_MAXLEN];
 	TfwStr			options;
@@ -181,6 +235,8 @@ void tfw_http_sess_put(TfwHttpSess *sess);
 void tfw_http_sess_pin_vhost(TfwHttpSess *sess, TfwVhost *vhost);
 
 void tfw_http_sess_redir_enable(void);
+int tfw_http_sticky_tpl_build(TfwStickyCookie *sticky);
+void tfw_http_sticky_tpl_free(TfwStickyCookie *sticky);
 bool tfw_http_sess_max_misses(void);
 unsigned int tfw_http_sess_mark_size(void);
 const TfwStr *tfw_http_sess_mark_name(void);
@@ -38,7 +38,8 @@ struct {
 	int			cookie_set:1,
 				learn_set:1,
 				st_sessions_set:1,
-				lifetime_set:1;
+				lifetime_set:1,
+				mac_set:1;
 	char			secret[1024];
 } defaults_override;
 
@@ -49,6 +50,8 @@ __tfw_http_sess_cookie_clean(TfwStickyCookie *sticky)
 
 	if (sticky->shash)
 		crypto_free_shash(sticky->shash);
+	tfw_http_sticky_tpl_free(sticky);
+	memzero_explicit(sticky->mac_key, sizeof(sticky->mac_key));
 
 	if (!sticky->js_challenge ||
 	    !refcount_dec_and_test(&sticky->js_challenge->users))
@@ -217,7 +220,7 @@ tfw_http_sess_cfgop_finish(TfwVhost *vhost, TfwCfgSpec *cs)
 	if (sticky->max_misses && vhost)
 		tfw_http_sess_redir_enable();
 
-	return 0;
+	return vhost ? tfw_http_sticky_tpl_build(sticky) : 0;
 }
 
 void
@@ -550,7 +553,15 @@ tfw_cfgop_sticky_secret_set(TfwStickyCookie *sticky, const char *secret_str,
 	const char *secret_buf;
 	int r;
 
-	sticky->shash = crypto_alloc_shash("hmac(sha1)", 0, 0);
+	/*
+	 * The HMAC transform precomputes the inner and outer hash states on
+	 * setkey(), so only the message is hashed for each cookie. Request
+	 * the SHA-NI implementation explicitly to load it even if the generic
+	 * SHA-1 is built into the kernel.
+	 */
+	sticky->shash = crypto_alloc_shash("hmac(sha1-ni)", 0, 0);
+	if (IS_ERR(sticky->shash))
+		sticky->shash = crypto_alloc_shash("hmac(sha1)", 0, 0);
 	if (IS_ERR(sticky->shash)) {
 		T_ERR_NL("http_sess: shash allocation failed\n");
 		r = (int)PTR_ERR(sticky->shash);
@@ -579,6 +590,8 @@ tfw_cfgop_sticky_secret_set(TfwStickyCookie *sticky, const char *secret_str,
 	r = crypto_shash_setkey(sticky->shash, secret_buf, len);
 	if (r)
 		T_ERR_NL("http_sess: can't set shash secret key");
+	blake2s(sticky->mac_key, secret_buf, NULL, sizeof(sticky->mac_key),
+		len, 0);
 	memset(secret, 0, sizeof(secret));
 
 	return r;
@@ -620,6 +633,43 @@ tfw_cfgop_sticky_secret(TfwCfgSpec *cs, TfwCfgEntry *ce)
 	return tfw_cfgop_sticky_secret_set(sticky, secret, len);
 }
 
+static TfwCfgEnum tfw_sticky_mac_enum[] = {
+	{ "hmac_sha1",	TFW_STICKY_MAC_HMAC_SHA1 },
+	{ "blake2s",	TFW_STICKY_MAC_BLAKE2S },
+	{ 0 }
+};
+
+static int
+tfw_cfgop_sticky_mac(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	int r;
+	TfwStickyCookie *sticky = cur_vhost ? cur_vhost->cookie
+					    : &defaults_override.sticky;
+
+	if (tfw_cfg_is_dflt_value(ce)) {
+		if (!cur_vhost)
+			return 0;
+		if (defaults_override.mac_set) {
+			sticky->mac = defaults_override.sticky.mac;
+			return 0;
+		}
+	}
+
+	if ((r = tfw_cfg_check_single_val(ce)))
+		return r;
+	if ((r = tfw_cfg_map_enum(tfw_sticky_mac_enum, ce->vals[0],
+				  &sticky->mac)))
+	{
+		T_ERR_NL("%s: unsupported MAC '%s'\n", cs->name, ce->vals[0]);
+		return r;
+	}
+
+	if (!cur_vhost)
+		defaults_override.mac_set = 1;
+
+	return 0;
+}
+
 static inline int
 tfw_cfgop_jsch_parse(TfwCfgSpec *cs, const char *key, const char *val,
 		     unsigned int *uint_val)
@@ -836,9 +886,11 @@ tfw_http_sess_cfg_finish(TfwVhost *vhost)
 	sticky->sess_lifetime = defaults_override.lifetime_set
 			? defaults_override.sticky.sess_lifetime
 			: UINT_MAX;
+	sticky->mac = defaults_override.mac_set
+			? defaults_override.sticky.mac
+			: TFW_STICKY_MAC_HMAC_SHA1;
 
-
-	return 0;
+	return tfw_http_sticky_tpl_build(sticky);
 }
 
 /**
@@ -890,6 +942,13 @@ TfwCfgSpec tfw_http_sess_specs[] = {
 		.allow_none = true,
 		.allow_reconfig = true,
 	},
+	{
+		.name = "mac",
+		.deflt = "hmac_sha1",
+		.handler = tfw_cfgop_sticky_mac,
+		.allow_none = true,
+		.allow_reconfig = true,
+	},
 	{
 		/* Value is parsed as int, set max to INT_MAX*/
 		.name = "sess_lifetime",
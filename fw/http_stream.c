@@ -17,15 +17,19 @@
  * this program; if not, write to the Free Software Foundation, Inc., 59
  * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
+#include <linux/ctype.h>
 #include <linux/slab.h>
 
 #undef DEBUG
 #if DBG_HTTP_STREAM > 0
 #define DEBUG DBG_HTTP_STREAM
 #endif
+#include "lib/str.h"
 #include "http_frame.h"
+#include "procfs.h"
 
 #define HTTP2_DEF_WEIGHT	16
+#define HTTP2_MAX_WEIGHT	256
 
 static struct kmem_cache *stream_cache;
 
@@ -304,11 +308,58 @@ done:
 	return res;
 }
 
+/*
+ * Streams without RFC 9218 priority signals are incremental, so they share
+ * the connection according to their RFC 7540 weights.
+ */
+static void
+tfw_h2_sched_entry_init(TfwStreamSchedEntry *e)
+{
+	e->parent = NULL;
+	INIT_LIST_HEAD(&e->children);
+	INIT_LIST_HEAD(&e->sibling);
+	INIT_LIST_HEAD(&e->active);
+	INIT_LIST_HEAD(&e->act_node);
+	e->pass = e->vtime = 0;
+	e->urgency = TFW_H2_URGENCY_DEF;
+	e->incremental = 1;
+	e->ready = 0;
+}
+
+void
+tfw_h2_sched_init(TfwStreamSched *sched)
+{
+	sched->streams = RB_ROOT;
+	tfw_h2_sched_entry_init(&sched->root);
+	bzero_fast(sched->slots, sizeof(sched->slots));
+	INIT_LIST_HEAD(&sched->free);
+	sched->free_num = 0;
+}
+
+/* Free the streams cached by the connection. */
+void
+tfw_h2_sched_release(TfwStreamSched *sched)
+{
+	TfwStream *stream, *tmp;
+
+	list_for_each_entry_safe(stream, tmp, &sched->free, hcl_node)
+		tfw_h2_delete_stream(stream);
+	INIT_LIST_HEAD(&sched->free);
+	sched->free_num = 0;
+}
+
+static inline TfwStream **
+tfw_h2_stream_slot(TfwStreamSched *sched, unsigned int id)
+{
+	return &sched->slots[(id >> 1) & (TFW_H2_STREAM_SLOTS - 1)];
+}
+
 static inline void
 tfw_h2_init_stream(TfwStream *stream, unsigned int id, unsigned short weight,
 		   unsigned int wnd)
 {
 	RB_CLEAR_NODE(&stream->node);
+	tfw_h2_sched_entry_init(&stream->sched);
 	INIT_LIST_HEAD(&stream->hcl_node);
 	spin_lock_init(&stream->st_lock);
 	stream->id = id;
@@ -320,9 +371,13 @@ tfw_h2_init_stream(TfwStream *stream, unsigned int id, unsigned short weight,
 TfwStream *
 tfw_h2_find_stream(TfwStreamSched *sched, unsigned int id)
 {
-	struct rb_node *node = sched->streams.rb_node;
+	struct rb_node *node;
+	TfwStream *stream = *tfw_h2_stream_slot(sched, id);
+
+	if (likely(stream && stream->id == id))
+		return stream;
 
-	while (node) {
+	for (node = sched->streams.rb_node; node; ) {
 		TfwStream *stream = rb_entry(node, TfwStream, node);
 
 		if (id < stream->id)
@@ -358,14 +413,27 @@ tfw_h2_add_stream(TfwStreamSched *sched, unsigned int id, unsigned short weight,
 		}
 	}
 
-	new_stream = kmem_cache_alloc(stream_cache, GFP_ATOMIC | __GFP_ZERO);
-	if (unlikely(!new_stream))
-		return NULL;
+	if (!list_empty(&sched->free)) {
+		new_stream = list_first_entry(&sched->free, TfwStream,
+					      hcl_node);
+		list_del(&new_stream->hcl_node);
+		--sched->free_num;
+		bzero_fast(new_stream, sizeof(*new_stream));
+	} else {
+		new_stream = kmem_cache_alloc_node(stream_cache,
+						   GFP_ATOMIC | __GFP_ZERO,
+						   numa_node_id());
+		if (unlikely(!new_stream))
+			return NULL;
+		tfw_numa_stat_inc(TFW_NUMA_STREAM, new_stream);
+	}
 
 	tfw_h2_init_stream(new_stream, id, weight, wnd);
 
 	rb_link_node(&new_stream->node, parent, new);
 	rb_insert_color(&new_stream->node, &sched->streams);
+	/* A newer stream replaces the older one in the slot. */
+	*tfw_h2_stream_slot(sched, id) = new_stream;
 
 	return new_stream;
 }
@@ -376,49 +444,377 @@ tfw_h2_delete_stream(TfwStream *stream)
 	kmem_cache_free(stream_cache, stream);
 }
 
+/*
+ * Free @stream, which is removed from @sched already: a few free streams are
+ * kept for the new streams of the connection. The caller must serialize the
+ * call with tfw_h2_add_stream().
+ */
+void
+tfw_h2_sched_free_stream(TfwStreamSched *sched, TfwStream *stream)
+{
+	if (sched->free_num < TFW_H2_STREAM_FREE_MAX) {
+		list_add(&stream->hcl_node, &sched->free);
+		++sched->free_num;
+		return;
+	}
+	tfw_h2_delete_stream(stream);
+}
+
+/*
+ * ------------------------------------------------------------------------
+ *	Streams dependency tree and scheduling
+ * ------------------------------------------------------------------------
+ */
+
+static inline TfwStream *
+tfw_h2_sched_stream(TfwStreamSchedEntry *e)
+{
+	return container_of(e, TfwStream, sched);
+}
+
+/* Whether active node @a must be scheduled before its sibling @b. */
+static bool
+__sched_before(TfwStreamSchedEntry *a, TfwStreamSchedEntry *b)
+{
+	if (a->urgency != b->urgency)
+		return a->urgency < b->urgency;
+	if (a->incremental != b->incremental)
+		return !a->incremental;
+	if (!a->incremental)
+		return tfw_h2_sched_stream(a)->id < tfw_h2_sched_stream(b)->id;
+
+	return a->pass < b->pass;
+}
+
+/*
+ * Put node @e into the active nodes of @parent. Nodes with the same virtual
+ * time are served in the order of activation.
+ */
+static void
+__sched_enqueue(TfwStreamSchedEntry *parent, TfwStreamSchedEntry *e)
+{
+	TfwStreamSchedEntry *pos;
+
+	list_for_each_entry(pos, &parent->active, act_node)
+		if (__sched_before(e, pos))
+			break;
+	list_add_tail(&e->act_node, &pos->act_node);
+}
+
+/*
+ * Activate node @e and its inactive ancestors. A node, which was idle, gets
+ * the current virtual time of its parent, so it doesn't get the bandwidth,
+ * which it didn't use, at the expense of its siblings.
+ */
+static void
+__sched_activate(TfwStreamSchedEntry *e)
+{
+	TfwStreamSchedEntry *parent;
+
+	for ( ; (parent = e->parent) && list_empty(&e->act_node); e = parent) {
+		e->pass = max(e->pass, parent->vtime);
+		__sched_enqueue(parent, e);
+	}
+}
+
+/* Deactivate node @e and its ancestors having nothing to send. */
+static void
+__sched_deactivate(TfwStreamSchedEntry *e)
+{
+	for ( ; e->parent && !list_empty(&e->act_node)
+		&& !e->ready && list_empty(&e->active); e = e->parent)
+		list_del_init(&e->act_node);
+}
+
+static void
+__sched_link(TfwStreamSchedEntry *parent, TfwStreamSchedEntry *e)
+{
+	e->parent = parent;
+	e->pass = 0;
+	list_add_tail(&e->sibling, &parent->children);
+	if (e->ready || !list_empty(&e->active))
+		__sched_activate(e);
+}
+
+static void
+__sched_unlink(TfwStreamSchedEntry *e)
+{
+	TfwStreamSchedEntry *parent = e->parent;
+
+	if (!list_empty(&e->act_node)) {
+		list_del_init(&e->act_node);
+		__sched_deactivate(parent);
+	}
+	list_del_init(&e->sibling);
+	e->parent = NULL;
+}
+
+/* Make all the dependent nodes of @parent dependent on @e. */
+static void
+__sched_adopt(TfwStreamSchedEntry *e, TfwStreamSchedEntry *parent)
+{
+	TfwStreamSchedEntry *c, *tmp;
+
+	list_for_each_entry_safe(c, tmp, &parent->children, sibling) {
+		__sched_unlink(c);
+		__sched_link(e, c);
+	}
+}
+
+static bool
+__sched_is_descendant(TfwStreamSchedEntry *e, TfwStreamSchedEntry *anc)
+{
+	for (e = e->parent; e; e = e->parent)
+		if (e == anc)
+			return true;
+
+	return false;
+}
+
+/*
+ * Find the stream @id, which a new stream depends on. A stream depending on
+ * a stream, which is not in the tree, gets the default priority (RFC 7540
+ * section 5.3.1), i.e. depends on stream 0.
+ */
 int
 tfw_h2_find_stream_dep(TfwStreamSched *sched, unsigned int id, TfwStream **dep)
 {
-	/*
-	 * TODO: implement dependency/priority logic (according to RFC 7540
-	 * section 5.3) in context of #1196.
-	 */
+	*dep = id ? tfw_h2_find_stream(sched, id) : NULL;
+
 	return 0;
 }
 
+/*
+ * Add new @stream to the dependency tree as dependent on @dep, or on stream 0
+ * if @dep is NULL. An exclusive dependency makes all the former dependent
+ * streams of @dep dependent on @stream (RFC 7540 section 5.3.1).
+ */
 void
 tfw_h2_add_stream_dep(TfwStreamSched *sched, TfwStream *stream, TfwStream *dep,
 		      bool excl)
 {
-	/*
-	 * TODO: implement dependency/priority logic (according to RFC 7540
-	 * section 5.3) in context of #1196.
-	 */
+	TfwStreamSchedEntry *parent = dep ? &dep->sched : &sched->root;
+
+	if (excl)
+		__sched_adopt(&stream->sched, parent);
+	__sched_link(parent, &stream->sched);
 }
 
+/*
+ * Reprioritization of stream @stream_id by PRIORITY frame (RFC 7540 section
+ * 5.3.3). If the new parent depends on the stream, then the parent is moved
+ * to the former parent of the stream first.
+ */
 void
 tfw_h2_change_stream_dep(TfwStreamSched *sched, unsigned int stream_id,
 			 unsigned int new_dep, unsigned short new_weight,
 			 bool excl)
 {
-	/*
-	 * TODO: implement dependency/priority logic (according to RFC 7540
-	 * section 5.3) in context of #1196.
-	 */
+	TfwStream *stream, *dep = NULL;
+	TfwStreamSchedEntry *e, *parent, *old;
+
+	stream = tfw_h2_find_stream(sched, stream_id);
+	if (!stream || !stream->sched.parent)
+		return;
+	if (new_dep && !(dep = tfw_h2_find_stream(sched, new_dep))) {
+		new_weight = HTTP2_DEF_WEIGHT;
+		excl = false;
+	}
+
+	e = &stream->sched;
+	parent = dep ? &dep->sched : &sched->root;
+	if (__sched_is_descendant(parent, e)) {
+		old = e->parent;
+		__sched_unlink(parent);
+		__sched_link(old, parent);
+	}
+
+	__sched_unlink(e);
+	stream->weight = new_weight;
+	if (excl)
+		__sched_adopt(e, parent);
+	__sched_link(parent, e);
 }
 
+/*
+ * Remove @stream from the dependency tree: its dependent streams become
+ * dependent on its parent and share the weight of the stream proportionally
+ * to their weights (RFC 7540 section 5.3.4).
+ */
 static void
 tfw_h2_remove_stream_dep(TfwStreamSched *sched, TfwStream *stream)
 {
-	/*
-	 * TODO: implement dependency/priority logic (according to RFC 7540
-	 * section 5.3) in context of #1196.
-	 */
+	unsigned int total = 0;
+	TfwStreamSchedEntry *c, *tmp, *e = &stream->sched;
+	TfwStreamSchedEntry *parent = e->parent;
+
+	if (!parent)
+		return;
+
+	list_for_each_entry(c, &e->children, sibling)
+		total += tfw_h2_sched_stream(c)->weight;
+	list_for_each_entry_safe(c, tmp, &e->children, sibling) {
+		TfwStream *s = tfw_h2_sched_stream(c);
+
+		__sched_unlink(c);
+		s->weight = max(1U, (unsigned int)stream->weight * s->weight
+				    / total);
+		__sched_link(parent, c);
+	}
+
+	e->ready = 0;
+	__sched_unlink(e);
+}
+
+/*
+ * Set RFC 9218 priority parameters of @stream received in 'priority' request
+ * header or in PRIORITY_UPDATE frame.
+ */
+void
+tfw_h2_sched_set_prio(TfwStream *stream, unsigned char urgency,
+		      bool incremental)
+{
+	TfwStreamSchedEntry *e = &stream->sched;
+
+	e->urgency = urgency;
+	e->incremental = incremental;
+	if (!list_empty(&e->act_node)) {
+		list_del(&e->act_node);
+		__sched_enqueue(e->parent, e);
+	}
+}
+
+static inline bool
+__prio_key_char(char c)
+{
+	return islower(c) || isdigit(c) || c == '_' || c == '-' || c == '.'
+	       || c == '*';
+}
+
+/**
+ * Parse Priority Field Value (RFC 9218 section 4), i.e. a Structured Field
+ * Dictionary (RFC 8941 section 3.2), from @p to @end. Only urgency 'u' and
+ * incremental 'i' parameters are interpreted, other members as well as the
+ * parameters of the members are skipped. The parameters, which aren't
+ * specified or have invalid values, get their default values.
+ */
+int
+tfw_h2_sched_parse_prio(const char *p, const char *end, unsigned char *urgency,
+			bool *incremental)
+{
+	const char *k;
+	unsigned int v;
+
+	*urgency = TFW_H2_URGENCY_DEF;
+	*incremental = false;
+
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t'))
+			++p;
+		for (k = p; p < end && __prio_key_char(*p); ++p)
+			;
+		if (p == k)
+			return -EINVAL;
+
+		if (p - k == 1 && *k == 'u') {
+			if (end - p > 1 && *p == '=' && isdigit(p[1])) {
+				for (v = 0, ++p; p < end && isdigit(*p); ++p)
+					v = min(v * 10 + *p - '0', 100U);
+				if (v <= TFW_H2_URGENCY_MAX)
+					*urgency = v;
+			}
+		}
+		else if (p - k == 1 && *k == 'i') {
+			if (p == end || *p != '=') {
+				*incremental = true;
+			}
+			else if (end - p >= 3 && p[1] == '?'
+				 && (p[2] == '0' || p[2] == '1'))
+			{
+				*incremental = p[2] == '1';
+				p += 3;
+			}
+		}
+
+		/* Skip the rest of the member and its parameters. */
+		while (p < end && *p != ',')
+			++p;
+		if (p < end)
+			++p;
+	}
+
+	return 0;
+}
+
+/*
+ * @stream has data to send. The caller is responsible for synchronization
+ * of all the scheduling functions.
+ */
+void
+tfw_h2_sched_activate(TfwStream *stream)
+{
+	TfwStreamSchedEntry *e = &stream->sched;
+
+	e->ready = 1;
+	if (e->parent)
+		__sched_activate(e);
+}
+
+/* All the data of @stream is sent. */
+void
+tfw_h2_sched_deactivate(TfwStream *stream)
+{
+	stream->sched.ready = 0;
+	__sched_deactivate(&stream->sched);
+}
+
+/*
+ * Get the stream, which data must be sent next: the first active node on
+ * each level of the tree, which has data itself, since its descendants can't
+ * make progress until the stream is done.
+ */
+TfwStream *
+tfw_h2_sched_next(TfwStreamSched *sched)
+{
+	TfwStreamSchedEntry *e = &sched->root;
+
+	while (!list_empty(&e->active)) {
+		e = list_first_entry(&e->active, TfwStreamSchedEntry,
+				     act_node);
+		if (e->ready)
+			return tfw_h2_sched_stream(e);
+	}
+
+	return NULL;
+}
+
+/*
+ * Account @len bytes sent from @stream: advance the virtual time of the stream
+ * and all its ancestors inversely proportionally to their weights and
+ * reschedule them among their siblings.
+ */
+void
+tfw_h2_sched_account(TfwStream *stream, unsigned long len)
+{
+	TfwStreamSchedEntry *parent, *e = &stream->sched;
+
+	for ( ; (parent = e->parent) && !list_empty(&e->act_node); e = parent)
+	{
+		parent->vtime = e->pass;
+		e->pass += len * HTTP2_MAX_WEIGHT
+			   / tfw_h2_sched_stream(e)->weight;
+		list_del(&e->act_node);
+		__sched_enqueue(parent, e);
+	}
 }
 
 void
 tfw_h2_stop_stream(TfwStreamSched *sched, TfwStream *stream)
 {
+	TfwStream **slot = tfw_h2_stream_slot(sched, stream->id);
+
 	tfw_h2_remove_stream_dep(sched, stream);
 	rb_erase(&stream->node, &sched->streams);
+	if (*slot == stream)
+		*slot = NULL;
 }
@@ -80,41 +80,127 @@ typedef enum {
 	HTTP2_ECODE_HTTP_1_1_REQUIRED
 } TfwH2Err;
 
+/*
+ * Default RFC 9218 urgency of a response, 0 is the highest urgency and 7 is
+ * the lowest one.
+ */
+#define TFW_H2_URGENCY_DEF	3
+#define TFW_H2_URGENCY_MAX	7
+
+/**
+ * Node of the streams dependency tree (RFC 7540 section 5.3) scheduling the
+ * streams data. A node is active if its stream or any of its descendants has
+ * data to send. RFC 7540 doesn't allocate resources to a dependent stream,
+ * while its parent can make progress, and shares the resources among the
+ * siblings proportionally to their weights, so data of the first active node
+ * is sent and the active siblings are ordered by virtual time advanced
+ * by each sent portion of data inversely proportionally to the weight,
+ * i.e. weighted fair queueing. RFC 9218 extensible priorities order the
+ * siblings by urgency first: non-incremental responses of the same urgency
+ * are sent one by one in the order of the stream IDs, while incremental ones
+ * are interleaved.
+ *
+ * @parent	- parent node, the tree root for the streams depending on
+ *		  stream 0, NULL if the node isn't in the tree;
+ * @children	- the dependent nodes;
+ * @sibling	- entry in @children of the parent;
+ * @active	- the active dependent nodes in the order of scheduling;
+ * @act_node	- entry in @active of the parent;
+ * @pass	- virtual time of the node among its siblings;
+ * @vtime	- virtual time of the dependent nodes, i.e. @pass of the last
+ *		  served one;
+ * @urgency	- RFC 9218 urgency of the stream;
+ * @incremental	- RFC 9218 incremental delivery of the response;
+ * @ready	- the stream has data to send;
+ */
+typedef struct tfw_stream_sched_entry_t TfwStreamSchedEntry;
+struct tfw_stream_sched_entry_t {
+	TfwStreamSchedEntry	*parent;
+	struct list_head	children;
+	struct list_head	sibling;
+	struct list_head	active;
+	struct list_head	act_node;
+	u64			pass;
+	u64			vtime;
+	unsigned char		urgency;
+	unsigned char		incremental;
+	unsigned char		ready;
+};
+
 /**
  * Representation of HTTP/2 stream entity.
  *
  * @node	- entry in per-connection storage of streams (red-black tree);
+ * @sched	- node of the streams dependency tree;
  * @hcl_node	- entry in queue of half-closed streams;
  * @id		- stream ID;
  * @state	- stream's current state;
  * @st_lock	- spinlock to synchronize concurrent access to stream FSM;
  * @loc_wnd	- stream's current flow controlled window;
+ * @loc_wnd_sz	- size of the auto-tuned receive window of client stream;
  * @weight	- stream's priority weight;
+ * @srv_flags	- TFW_H2_SRV_F_* flags of a stream of server connection;
+ * @rem_wnd	- peer's stream flow controlled window;
+ * @wnd_ts	- time of the last receive window update of client stream, ns;
+ * @xmit_len	- length of the data in @xmit;
+ * @xmit	- request body waiting for room in the flow controlled windows
+ *		  for streams of server connections, or DATA frames of the
+ *		  response waiting for their turn to be sent to the client;
  * @msg		- message that is currently being processed;
  * @parser	- the state of message processing;
  */
 typedef struct {
 	struct rb_node		node;
+	TfwStreamSchedEntry	sched;
 	struct list_head	hcl_node;
 	unsigned int		id;
 	int			state;
 	spinlock_t		st_lock;
 	unsigned int		loc_wnd;
+	unsigned int		loc_wnd_sz;
 	unsigned short		weight;
+	unsigned short		srv_flags;
+	long			rem_wnd;
+	u64			wnd_ts;
+	unsigned long		xmit_len;
+	struct sk_buff		*xmit;
 	TfwMsg			*msg;
 	TfwHttpParser		parser;
 } TfwStream;
 
+/* Flags of streams of HTTP/2 server connections. */
+#define TFW_H2_SRV_F_BODY	0x0001	/* The whole request body is queued. */
+#define TFW_H2_SRV_F_END	0x0002	/* END_STREAM is sent. */
+#define TFW_H2_SRV_F_HEAD	0x0004	/* The request is HEAD. */
+#define TFW_H2_SRV_F_RESP	0x0008	/* Final response headers received. */
+#define TFW_H2_SRV_F_CHUNKED	0x0010	/* The response body is chunked. */
+#define TFW_H2_SRV_F_VOID	0x0020	/* The response has no body. */
+
+/*
+ * Number of slots in the ring of streams for the lookups by stream ID, must be
+ * a power of 2, and the maximum number of free streams kept by a connection.
+ */
+#define TFW_H2_STREAM_SLOTS	128
+#define TFW_H2_STREAM_FREE_MAX	16
+
 /**
  * Scheduler for stream's processing distribution based on dependency/priority
  * values.
- * TODO: the structure is not completed yet and should be finished in context
- * of #1196.
  *
  * @streams	- root red-black tree entry for per-connection streams' storage;
+ * @root	- root of the streams dependency tree, i.e. stream 0;
+ * @slots	- ring of the streams indexed by (ID >> 1), i.e. the streams
+ *		  with the closest IDs, which are the most of the active
+ *		  streams, are found without the tree walk;
+ * @free	- list of free streams for the new streams of the connection;
+ * @free_num	- number of the streams in @free;
  */
 typedef struct {
-	struct rb_root streams;
+	struct rb_root		streams;
+	TfwStreamSchedEntry	root;
+	TfwStream		*slots[TFW_H2_STREAM_SLOTS];
+	struct list_head	free;
+	unsigned int		free_num;
 } TfwStreamSched;
 
 int tfw_h2_stream_cache_create(void);
@@ -134,6 +220,17 @@ void tfw_h2_change_stream_dep(TfwStreamSched *sched, unsigned int stream_id,
 			      unsigned int new_dep, unsigned short new_weight,
 			      bool excl);
 void tfw_h2_stop_stream(TfwStreamSched *sched, TfwStream *stream);
+void tfw_h2_sched_init(TfwStreamSched *sched);
+void tfw_h2_sched_release(TfwStreamSched *sched);
+void tfw_h2_sched_free_stream(TfwStreamSched *sched, TfwStream *stream);
+void tfw_h2_sched_set_prio(TfwStream *stream, unsigned char urgency,
+			   bool incremental);
+int tfw_h2_sched_parse_prio(const char *p, const char *end,
+			    unsigned char *urgency, bool *incremental);
+void tfw_h2_sched_activate(TfwStream *stream);
+void tfw_h2_sched_deactivate(TfwStream *stream);
+TfwStream *tfw_h2_sched_next(TfwStreamSched *sched);
+void tfw_h2_sched_account(TfwStream *stream, unsigned long len);
 
 static inline bool
 tfw_h2_stream_req_complete(TfwStream *stream)
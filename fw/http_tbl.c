@@ -129,10 +129,7 @@ tfw_http_tbl_scan(TfwMsg *msg, TfwHttpTable *table, bool *block)
 	chain = list_first_entry_or_null(&table->head, TfwHttpChain, list);
 	BUG_ON(!chain || chain->name);
 	while (chain) {
-		rule = tfw_http_match_req((TfwHttpReq *)msg, &chain->mark_list);
-		if (!rule)
-			rule = tfw_http_match_req((TfwHttpReq *)msg,
-						  &chain->match_list);
+		rule = tfw_http_match_chain((TfwHttpReq *)msg, chain);
 		if (unlikely(!rule)) {
 			T_DBG("http_tbl: No rule found in HTTP chain '%s'\n",
 			      chain->name);
@@ -231,13 +228,7 @@ tfw_http_tbl_method(const char *arg, tfw_http_meth_t *method)
 static TfwHttpChain *
 tfw_chain_lookup(const char *name)
 {
-	TfwHttpChain *chain;
-
-	list_for_each_entry(chain, &tfw_table_reconfig->head, list) {
-		if (chain->name && !strcasecmp(chain->name, name))
-			return chain;
-	}
-	return NULL;
+	return tfw_http_chain_lookup(name, tfw_table_reconfig);
 }
 
 static inline bool
@@ -306,12 +297,9 @@ tfw_cfgop_http_tbl_chain_begin(TfwCfgSpec *cs, TfwCfgEntry *ce)
 	}
 	if (ce->val_n) {
 		name = ce->vals[0];
-		list_for_each_entry(chain, &tfw_table_reconfig->head, list) {
-			if (!strcasecmp(chain->name, name)) {
-				T_ERR_NL("Duplicate http chain entry: '%s'\n",
-					 name);
-				return -EINVAL;
-			}
+		if (tfw_http_chain_lookup(name, tfw_table_reconfig)) {
+			T_ERR_NL("Duplicate http chain entry: '%s'\n", name);
+			return -EINVAL;
 		}
 	}
 
@@ -337,6 +325,7 @@ tfw_cfgop_http_tbl_chain_finish(TfwCfgSpec *cs)
  *       uri == "*.php" -> static;
  *       mark == 2 -> waf_chain;
  *       referer != "*hacked.com" -> mark = 7;
+ *       uri ~ "^/api/v[0-9]+/" -> api;
  *       -> mark = 3;
  *   }
  *
@@ -348,7 +337,8 @@ tfw_cfgop_http_tbl_chain_finish(TfwCfgSpec *cs)
  *            +------------------------ First operand of rule's condition part
  *            |                         (HTTP request field or 'mark');
  *            |   +-------------------- Condition type: equal ('==') or not
- *            |   |                     equal ('!=');
+ *            |   |                     equal ('!='), matches ('~') or not
+ *            |   |                     matches ('!~') a regular expression;
  *            |   |     +-------------- Second operand of rule's condition part
  *            |   |     |               (argument for the rule - any string);
  *            |   |     |         +---- Action part of the rule (reference to
@@ -409,8 +399,12 @@ tfw_cfgop_http_rule(TfwCfgSpec *cs, TfwCfgEntry *e)
 		if ((r = tfw_http_verify_hdr_field(field, &hdr, &hid)))
 			return r;
 
-		arg = tfw_http_arg_adjust(in_arg, field, hdr, &arg_size,
-					  &type, &op);
+		if (cfg_rule->regex)
+			arg = tfw_http_arg_regex(in_arg, field, hid, &arg_size,
+						 &type, &op);
+		else
+			arg = tfw_http_arg_adjust(in_arg, field, hdr, &arg_size,
+						  &type, &op);
 		if (IS_ERR(arg))
 			return PTR_ERR(arg);
 	}
@@ -433,6 +427,13 @@ tfw_cfgop_http_rule(TfwCfgSpec *cs, TfwCfgEntry *e)
 		if ((r = tfw_http_rule_arg_init(rule, arg, arg_size - 1)))
 			goto err;
 		kfree(arg);
+		if (op == TFW_HTTP_MATCH_O_REGEX) {
+			rule->re = tfw_regex_compile(rule->arg.str,
+						     rule->arg.len,
+						     tfw_chain_entry->pool);
+			if (IS_ERR(rule->re))
+				return PTR_ERR(rule->re);
+		}
 	}
 
 	/* Interpret action part of the rule. */
@@ -522,7 +523,7 @@ tfw_http_tbl_start(void)
 }
 
 static int
-tfw_http_tbl_cfgend(void)
+tfw_http_tbl_main_chain_add(void)
 {
 	int r;
 	TfwVhost *vhost_dflt;
@@ -571,6 +572,47 @@ err:
 	return r;
 }
 
+/**
+ * Vhosts which are unchanged since the running configuration replace the
+ * just parsed copies at the end of vhosts configuration, so rules must refer
+ * to the vhosts which are actually used.
+ */
+static int
+tfw_cfgop_rule_vhost_update(TfwHttpMatchRule *rule)
+{
+	TfwVhost *vhost;
+
+	if (rule->act.type != TFW_HTTP_MATCH_ACT_VHOST
+	    || !test_bit(TFW_VHOST_B_REMOVED, &rule->act.vhost->flags))
+		return 0;
+	if (!(vhost = tfw_vhost_lookup_reconfig(rule->act.vhost->name.data)))
+		return -EINVAL;
+	tfw_vhost_put(rule->act.vhost);
+	rule->act.vhost = vhost;
+
+	return 0;
+}
+
+static int
+tfw_http_tbl_cfgend(void)
+{
+	int r;
+	TfwHttpChain *chain;
+
+	if ((r = tfw_http_tbl_main_chain_add()))
+		return r;
+
+	list_for_each_entry(chain, &tfw_table_reconfig->head, list) {
+		if (tfw_http_chain_rules_for_each(chain,
+						  tfw_cfgop_rule_vhost_update))
+			return -EINVAL;
+		if ((r = tfw_http_chain_compile(chain)))
+			return r;
+	}
+
+	return 0;
+}
+
 /**
  * Delete all rules parsed out of all "http_chain" sections for current (if
  * this is not live reconfiguration) and reconfig HTTP tables.
@@ -617,9 +659,11 @@ static TfwCfgSpec tfw_http_tbl_specs[] = {
 		.handler = tfw_cfg_handle_children,
 		.cleanup = tfw_cfgop_rules_cleanup,
 		.dest = tfw_http_tbl_rules_specs,
+		/* Chains are always rebuilt, nothing depends on them. */
 		.spec_ext = &(TfwCfgSpecChild) {
 			.begin_hook = tfw_cfgop_http_tbl_chain_begin,
-			.finish_hook = tfw_cfgop_http_tbl_chain_finish
+			.finish_hook = tfw_cfgop_http_tbl_chain_finish,
+			.versioned = true
 		},
 		.allow_none = true,
 		.allow_repeat = true,
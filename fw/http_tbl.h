@@ -21,21 +21,33 @@
 #ifndef __HTTP_TBL__
 #define __HTTP_TBL__
 
+#include <linux/hashtable.h>
+
 #include "http.h"
 
+#define TFW_HTTP_CHAIN_HBITS	12
+
+typedef struct tfw_http_match_idx_t TfwHttpMatchIdx;
+
 /**
  * HTTP chain. Contains list of rules for matching.
  *
  * @list	- Entry in list of all HTTP chains in current HTTP table.
+ * @hlist	- Entry in hash table of named HTTP chains.
  * @mark_list	- List of configured mark rules (processed primarily).
  * @match_list	- List of configured match rules (processed after mark rules).
+ * @mark_idx	- Index of @mark_list compiled at the end of configuration.
+ * @match_idx	- Index of @match_list compiled at the end of configuration.
  * @name	- Name of HTTP chain.
  * @pool	- Pointer to parent table's pool for rules allocations.
  */
 typedef struct {
 	struct list_head list;
+	struct hlist_node hlist;
 	struct list_head mark_list;
 	struct list_head match_list;
+	TfwHttpMatchIdx *mark_idx;
+	TfwHttpMatchIdx *match_idx;
 	const char *name;
 	TfwPool *pool;
 } TfwHttpChain;
@@ -47,11 +59,13 @@ typedef struct {
  * @chain_dflt	- Flag to indicate whether the chain with default rule is
  *		  present in configuration or not.
  * @pool	- Allocation pool for HTTP table (and all its chains and rules).
+ * @chain_hash	- Named HTTP chains hashed by their names.
  */
 typedef struct {
 	struct list_head head;
 	bool chain_dflt;
 	TfwPool *pool;
+	DECLARE_HASHTABLE(chain_hash, TFW_HTTP_CHAIN_HBITS);
 } TfwHttpTable;
 
 TfwVhost *tfw_http_tbl_vhost(TfwMsg *msg, bool *block);
@@ -33,6 +33,9 @@
 #include "server.h"
 #include "vhost.h"
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
 MODULE_AUTHOR(TFW_AUTHOR);
 MODULE_DESCRIPTION(TFW_NAME);
 MODULE_VERSION(TFW_VERSION);
@@ -282,6 +285,11 @@ tfw_ctlfn_state_change(const char *old_state, const char *new_state)
 		int r;
 
 		if (READ_ONCE(tfw_started)) {
+			if (tfw_cfg_unchanged()) {
+				T_LOG("Configuration is unchanged, skip live "
+				      "reconfiguration.\n");
+				return 0;
+			}
 			WRITE_ONCE(tfw_reconfig, true);
 			T_LOG("Live reconfiguration of Tempesta.\n");
 		}
@@ -456,6 +464,7 @@ tfw_init(void)
 	/* The order of initialization is highly important. */
 	DO_INIT(pool);
 	DO_INIT(cfg);
+	DO_INIT(cpu_role);
 	DO_INIT(apm);
 	DO_INIT(vhost);
 
@@ -473,12 +482,16 @@ tfw_init(void)
 	DO_INIT(sync_socket);
 	DO_INIT(server);
 	DO_INIT(client);
+	DO_INIT(stress);
+	DO_INIT(tls_sess);
 	DO_INIT(sock_srv);
 	DO_INIT(sock_clnt);
 	DO_INIT(procfs);
+	DO_INIT(access_log);
 	DO_INIT(http_tbl);
 	DO_INIT(sched_hash);
 	DO_INIT(sched_ratio);
+	DO_INIT(sched_p2c);
 
 	return 0;
 err:
@@ -0,0 +1,314 @@
+/**
+ *		Tempesta FW
+ *
+ * Multi-pattern matching of HTTP strings against configured patterns.
+ *
+ * Locations, cache policies and non-idempotent request definitions are
+ * anchored patterns: a string is matched for equality, by prefix or by
+ * suffix. All the prefix and equality patterns of a list are compiled into
+ * a single case-insensitive trie walked forward over the string, and all the
+ * suffix patterns into a trie walked backward, so matching is a single pass
+ * over the string in each direction regardless of the number of patterns.
+ *
+ * The tries are deterministic automata with transition tables indexed by
+ * character classes: only characters met in the patterns have own classes,
+ * all other characters lead to the dead state. Each trie node keeps indexes
+ * of the patterns accepted at the node, so the first pattern in the
+ * configuration order wins just like with sequential matching.
+ *
+ * Copyright (C) 2024 Tempesta Technologies, INC.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <linux/ctype.h>
+#include <linux/slab.h>
+
+#include "http_match.h"
+#include "mpm.h"
+
+/* No pattern, greater than any pattern index. */
+#define TFW_MPM_NONE		UINT_MAX
+/* Dead and root states of a trie. */
+#define TFW_MPM_S_DEAD		0
+#define TFW_MPM_S_ROOT		1
+
+/**
+ * Trie node.
+ *
+ * @acc		- First prefix (or suffix) pattern ending at the node;
+ * @acc_eq	- First equality pattern ending at the node.
+ */
+typedef struct {
+	unsigned int	acc;
+	unsigned int	acc_eq;
+} TfwMpmNode;
+
+/**
+ * @next	- Transition table, @n rows of @ncls states;
+ * @node	- Trie nodes;
+ * @n		- Number of states;
+ * @pats_n	- Number of patterns compiled into the trie.
+ */
+typedef struct {
+	unsigned short	*next;
+	TfwMpmNode	*node;
+	unsigned int	n;
+	unsigned int	pats_n;
+} TfwMpmTrie;
+
+/**
+ * @fwd		- Trie of prefix and equality patterns;
+ * @rev		- Trie of reversed suffix patterns;
+ * @wild	- First wildcard pattern;
+ * @ncls	- Number of character classes;
+ * @chain	- Next pattern accepted at the same node, in ascending order;
+ * @mask	- Masks of the patterns;
+ * @cls		- Character classes.
+ */
+struct tfw_mpm_t {
+	TfwMpmTrie	fwd;
+	TfwMpmTrie	rev;
+	unsigned int	wild;
+	unsigned int	ncls;
+	unsigned int	*chain;
+	unsigned int	*mask;
+	unsigned char	cls[256];
+};
+
+static void
+tfw_mpm_chain_add(TfwMpm *mpm, unsigned int *head, unsigned int idx)
+{
+	while (*head != TFW_MPM_NONE)
+		head = &mpm->chain[*head];
+	*head = idx;
+	mpm->chain[idx] = TFW_MPM_NONE;
+}
+
+static TfwMpmNode *
+tfw_mpm_trie_insert(TfwMpm *mpm, TfwMpmTrie *t, const char *s, size_t len,
+		    bool rev)
+{
+	unsigned int st = TFW_MPM_S_ROOT;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		unsigned char c = rev ? s[len - 1 - i] : s[i];
+		unsigned short *next = &t->next[st * mpm->ncls + mpm->cls[c]];
+
+		if (*next == TFW_MPM_S_DEAD)
+			*next = t->n++;
+		st = *next;
+	}
+	t->pats_n++;
+
+	return &t->node[st];
+}
+
+static void
+tfw_mpm_trie_init(TfwMpmTrie *t, char **p, size_t states, unsigned int ncls)
+{
+	t->node = (TfwMpmNode *)*p;
+	*p += states * sizeof(TfwMpmNode);
+	t->next = (unsigned short *)*p;
+	*p += states * ncls * sizeof(unsigned short);
+	/* All the pattern indexes are TFW_MPM_NONE. */
+	memset(t->node, 0xff, states * sizeof(TfwMpmNode));
+	t->n = TFW_MPM_S_ROOT + 1;
+}
+
+/**
+ * Compile @n patterns into a matcher. Returns NULL if there is no memory or
+ * the patterns are too long.
+ */
+TfwMpm *
+tfw_mpm_build(const TfwMpmPattern *pats, unsigned int n)
+{
+	TfwMpm *mpm;
+	unsigned char cls[256] = { 0 };
+	size_t fwd_n = TFW_MPM_S_ROOT + 1, rev_n = TFW_MPM_S_ROOT + 1, sz;
+	unsigned int i, c, ncls = 1;
+	char *p;
+
+	for (i = 0; i < n; ++i) {
+		const TfwMpmPattern *pat = &pats[i];
+		size_t j;
+
+		switch (pat->op) {
+		case TFW_HTTP_MATCH_O_EQ:
+		case TFW_HTTP_MATCH_O_PREFIX:
+			fwd_n += pat->len;
+			break;
+		case TFW_HTTP_MATCH_O_SUFFIX:
+			rev_n += pat->len;
+			break;
+		default:
+			continue;
+		}
+		for (j = 0; j < pat->len; ++j) {
+			c = tolower((unsigned char)pat->arg[j]);
+			if (!cls[c])
+				cls[c] = ncls++;
+		}
+	}
+	if (fwd_n > USHRT_MAX || rev_n > USHRT_MAX)
+		return NULL;
+
+	sz = sizeof(TfwMpm) + n * sizeof(unsigned int) * 2
+	     + (fwd_n + rev_n) * (sizeof(TfwMpmNode)
+				  + ncls * sizeof(unsigned short));
+	if (!(mpm = kvzalloc(sz, GFP_KERNEL)))
+		return NULL;
+
+	for (c = 0; c < 256; ++c)
+		mpm->cls[c] = cls[tolower(c)];
+	mpm->ncls = ncls;
+	mpm->wild = TFW_MPM_NONE;
+
+	p = (char *)(mpm + 1);
+	mpm->chain = (unsigned int *)p;
+	p += n * sizeof(unsigned int);
+	mpm->mask = (unsigned int *)p;
+	p += n * sizeof(unsigned int);
+	tfw_mpm_trie_init(&mpm->fwd, &p, fwd_n, ncls);
+	tfw_mpm_trie_init(&mpm->rev, &p, rev_n, ncls);
+	BUG_ON(p != (char *)mpm + sz);
+
+	for (i = 0; i < n; ++i) {
+		const TfwMpmPattern *pat = &pats[i];
+		TfwMpmNode *node;
+
+		mpm->mask[i] = pat->mask;
+		switch (pat->op) {
+		case TFW_HTTP_MATCH_O_WILDCARD:
+			/* Only '*' matches anything, see __tfw_match_wildcard(). */
+			if (pat->len == 1 && *pat->arg == '*')
+				tfw_mpm_chain_add(mpm, &mpm->wild, i);
+			break;
+		case TFW_HTTP_MATCH_O_EQ:
+			node = tfw_mpm_trie_insert(mpm, &mpm->fwd, pat->arg,
+						   pat->len, false);
+			tfw_mpm_chain_add(mpm, &node->acc_eq, i);
+			break;
+		case TFW_HTTP_MATCH_O_PREFIX:
+			node = tfw_mpm_trie_insert(mpm, &mpm->fwd, pat->arg,
+						   pat->len, false);
+			tfw_mpm_chain_add(mpm, &node->acc, i);
+			break;
+		case TFW_HTTP_MATCH_O_SUFFIX:
+			node = tfw_mpm_trie_insert(mpm, &mpm->rev, pat->arg,
+						   pat->len, true);
+			tfw_mpm_chain_add(mpm, &node->acc, i);
+			break;
+		default:
+			break;
+		}
+	}
+
+	return mpm;
+}
+
+void
+tfw_mpm_free(TfwMpm *mpm)
+{
+	kvfree(mpm);
+}
+
+/**
+ * Return the first pattern in chain @i which is less than @best and matches
+ * @mask, or @best if there is no such pattern.
+ */
+static inline unsigned int
+tfw_mpm_first(const TfwMpm *mpm, unsigned int i, unsigned int mask,
+	      unsigned int best)
+{
+	for ( ; i < best; i = mpm->chain[i])
+		if (mpm->mask[i] & mask)
+			return i;
+	return best;
+}
+
+static inline unsigned int
+tfw_mpm_next(const TfwMpm *mpm, const TfwMpmTrie *t, unsigned int st,
+	     unsigned char c)
+{
+	return t->next[st * mpm->ncls + mpm->cls[c]];
+}
+
+static unsigned int
+tfw_mpm_match_fwd(const TfwMpm *mpm, const TfwStr *str, unsigned int mask,
+		  unsigned int best)
+{
+	const TfwMpmTrie *t = &mpm->fwd;
+	const TfwStr *c, *end;
+	unsigned int st = TFW_MPM_S_ROOT;
+	size_t i;
+
+	best = tfw_mpm_first(mpm, t->node[st].acc, mask, best);
+	TFW_STR_FOR_EACH_CHUNK(c, str, end) {
+		for (i = 0; i < c->len; ++i) {
+			st = tfw_mpm_next(mpm, t, st, c->data[i]);
+			if (st == TFW_MPM_S_DEAD)
+				return best;
+			best = tfw_mpm_first(mpm, t->node[st].acc, mask, best);
+		}
+	}
+
+	return tfw_mpm_first(mpm, t->node[st].acc_eq, mask, best);
+}
+
+static unsigned int
+tfw_mpm_match_rev(const TfwMpm *mpm, const TfwStr *str, unsigned int mask,
+		  unsigned int best)
+{
+	const TfwMpmTrie *t = &mpm->rev;
+	unsigned int st = TFW_MPM_S_ROOT;
+	unsigned int n = TFW_STR_PLAIN(str) ? 1 : str->nchunks;
+	size_t i;
+
+	best = tfw_mpm_first(mpm, t->node[st].acc, mask, best);
+	while (n--) {
+		const TfwStr *c = TFW_STR_CHUNK(str, n);
+
+		for (i = c->len; i; ) {
+			st = tfw_mpm_next(mpm, t, st, c->data[--i]);
+			if (st == TFW_MPM_S_DEAD)
+				return best;
+			best = tfw_mpm_first(mpm, t->node[st].acc, mask, best);
+		}
+	}
+
+	return best;
+}
+
+/**
+ * Find the first pattern, in the order they were passed to tfw_mpm_build(),
+ * matching @str and having a common bit with @mask. Returns the pattern
+ * index or -1 if there is no match.
+ */
+int
+tfw_mpm_match(const TfwMpm *mpm, const TfwStr *str, unsigned int mask)
+{
+	unsigned int best;
+
+	BUG_ON(TFW_STR_DUP(str));
+
+	best = tfw_mpm_first(mpm, mpm->wild, mask, TFW_MPM_NONE);
+	if (best && mpm->fwd.pats_n)
+		best = tfw_mpm_match_fwd(mpm, str, mask, best);
+	if (best && mpm->rev.pats_n)
+		best = tfw_mpm_match_rev(mpm, str, mask, best);
+
+	return best == TFW_MPM_NONE ? -1 : best;
+}
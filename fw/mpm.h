@@ -0,0 +1,49 @@
+/**
+ *		Tempesta FW
+ *
+ * Multi-pattern matching of HTTP strings against configured patterns.
+ *
+ * Copyright (C) 2024 Tempesta Technologies, INC.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __TFW_MPM_H__
+#define __TFW_MPM_H__
+
+#include "str.h"
+
+/**
+ * A pattern to compile into a matcher.
+ *
+ * @op		- Match operator: eq, prefix, suffix or wildcard;
+ * @mask	- Pattern is matched only if @mask intersects with the mask
+ *		  passed to tfw_mpm_match();
+ * @len		- Length of the string in @arg;
+ * @arg		- String for the match operator.
+ */
+typedef struct {
+	short		op;
+	unsigned int	mask;
+	size_t		len;
+	const char	*arg;
+} TfwMpmPattern;
+
+typedef struct tfw_mpm_t TfwMpm;
+
+TfwMpm *tfw_mpm_build(const TfwMpmPattern *pats, unsigned int n);
+void tfw_mpm_free(TfwMpm *mpm);
+int tfw_mpm_match(const TfwMpm *mpm, const TfwStr *str, unsigned int mask);
+
+#endif /* __TFW_MPM_H__ */
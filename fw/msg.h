@@ -70,12 +70,10 @@ typedef struct {
  * @hdrs_cnt	- count of all headers from message headers block;
  * @__off	- offset for iterator reinitializing before next processing
  *		  stage;
- * @hdr		- descriptor of currently decoded header in target buffer;
- * @pos		- pointer to the currently allocated chunk of decoded headers'
- *		  buffer;
- * @rspace	- space remained in the allocated chunk;
- * @next	- pointer to the decoded header part (name/value) to be
- *		- parsed next;
+ * @data	- Huffman-decoded data of the current string, which isn't
+ *		  passed to the parser yet, up to @pos;
+ * @pos		- end of the decoded data in the target buffer;
+ * @rspace	- space remained in the target buffer after @pos;
  * @nm_len	- length of the decoded header's name;
  * @nm_num	- chunks number of the decoded header's name;
  * @hdr_tag	- tag of currently processed decoded header.
@@ -86,10 +84,9 @@ typedef struct {
 	unsigned long	hdrs_len;
 	unsigned int	hdrs_cnt;
 	char		__off[0];
-	TfwStr		hdr;
+	char		*data;
 	char		*pos;
 	unsigned long	rspace;
-	TfwStr		*next;
 	unsigned long	nm_len;
 	unsigned int	nm_num;
 	unsigned int	tag;
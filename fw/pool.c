@@ -42,6 +42,7 @@
  * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 #include <linux/gfp.h>
+#include <linux/mm.h>
 
 #include "lib/str.h"
 #include "pool.h"
@@ -52,9 +53,49 @@
 #define TFW_POOL_ALIGN_SZ(n)	(((n) + 7) & ~7UL)
 #define TFW_POOL_HEAD_OFF	(TFW_POOL_ALIGN_SZ(sizeof(TfwPool))	\
 				 + TFW_POOL_ALIGN_SZ(sizeof(TfwPoolChunk)))
-#define TFW_POOL_PGCACHE_SZ	512
+/*
+ * Per-order capacities of the page cache, the cache keeps chunks of orders
+ * below TFW_POOL_PGCACHE_ORDERS.
+ */
+#define TFW_POOL_PGCACHE_ORDERS	4
+#define TFW_POOL_PGCACHE_SZ	(512 + 64 + 32 + 16)
+/* Recompute the initial chunk order of a class after the number of pools. */
+#define TFW_POOL_ADAPT_WIN	256
+/* Percent of the pools fitting the initial chunk. */
+#define TFW_POOL_ADAPT_PCT	90
+
+static const unsigned int pg_cache_off[TFW_POOL_PGCACHE_ORDERS + 1] = {
+	0, 512, 576, 608, TFW_POOL_PGCACHE_SZ
+};
+
+/**
+ * Initial chunk order adaptation for a pool class.
+ *
+ * @hist	- decaying histogram of the chunk orders sufficient for
+ *		  the destroyed pools;
+ * @n		- number of pools since the last @order computation;
+ * @order	- initial chunk order for new pools;
+ */
+typedef struct {
+	unsigned int	hist[TFW_POOL_PGCACHE_ORDERS];
+	unsigned int	n;
+	unsigned int	order;
+} TfwPoolAdapt;
+
+/**
+ * Per-CPU pool allocator state.
+ *
+ * @pg_next	- number of cached chunks of each order;
+ * @adapt	- initial chunk order adaptation for each pool class;
+ * @stat	- memory statistics for each pool class;
+ */
+typedef struct {
+	unsigned int	pg_next[TFW_POOL_PGCACHE_ORDERS];
+	TfwPoolAdapt	adapt[_TFW_POOL_CLS_NUM];
+	TfwPoolStat	stat[_TFW_POOL_CLS_NUM];
+} TfwPoolPcpu;
 
-static DEFINE_PER_CPU(unsigned int, pg_next);
+static DEFINE_PER_CPU(TfwPoolPcpu, tfw_pool_pcpu);
 static unsigned long __percpu (*pg_cache)[TFW_POOL_PGCACHE_SZ];
 
 /*
@@ -63,12 +104,14 @@ static unsigned long __percpu (*pg_cache)[TFW_POOL_PGCACHE_SZ];
  * The buddy allocator does relatively heavy things, so the cache makes
  * memory allocations faster.
  *
- * It caches small number of pages and return free pages to buddy allocator,
- * which are out of the space.
- * Multi-page chunks can be coalesced with buddies, so that we'll be able to
- * satisfy large realloc (i.e. if the we called from realloc(), then it's
- * likely that the next request will be of doubled size and we typically grow
- * through buddies coalescing). So we never cache multi-pages.
+ * It caches small number of chunks of each small order and return free
+ * chunks to buddy allocator, which are out of the space. The initial
+ * chunks of message pools can be multi-page, see tfw_pool_adapt(), and they
+ * are reused through the cache as well. Larger chunks can be coalesced with
+ * buddies, so that we'll be able to satisfy large realloc (i.e. if the we
+ * called from realloc(), then it's likely that the next request will be of
+ * doubled size and we typically grow through buddies coalescing). So we
+ * never cache them.
  */
 static unsigned long
 tfw_pool_alloc_pages(unsigned int order)
@@ -76,13 +119,17 @@ tfw_pool_alloc_pages(unsigned int order)
 	unsigned int *pgn;
 	unsigned long pg_res;
 
+	if (unlikely(order >= TFW_POOL_PGCACHE_ORDERS))
+		return __get_free_pages(GFP_ATOMIC, order);
+
 	preempt_disable();
 
-	pgn = this_cpu_ptr(&pg_next);
+	pgn = &this_cpu_ptr(&tfw_pool_pcpu)->pg_next[order];
 
-	if (likely(*pgn && !order)) {
+	if (likely(*pgn)) {
 		--*pgn;
-		pg_res = ((unsigned long *)this_cpu_ptr(pg_cache))[*pgn];
+		pg_res = ((unsigned long *)this_cpu_ptr(pg_cache))
+			 [pg_cache_off[order] + *pgn];
 
 		preempt_enable();
 
@@ -98,12 +145,25 @@ tfw_pool_free_pages(unsigned long addr, unsigned int order)
 {
 	unsigned int *pgn;
 
+	/*
+	 * Messages can be freed on a CPU of other NUMA node, e.g. after
+	 * a cache lookup on the node of the cache shard. Return the pages
+	 * to their node rather than spreading them across the caches.
+	 */
+	if (unlikely(order >= TFW_POOL_PGCACHE_ORDERS
+		     || page_to_nid(virt_to_page(addr)) != numa_node_id()))
+	{
+		free_pages(addr, order);
+		return;
+	}
+
 	preempt_disable();
 
-	pgn = this_cpu_ptr(&pg_next);
+	pgn = &this_cpu_ptr(&tfw_pool_pcpu)->pg_next[order];
 
-	if (likely(*pgn < TFW_POOL_PGCACHE_SZ && !order)) {
-		((unsigned long *)this_cpu_ptr(pg_cache))[*pgn] = addr;
+	if (likely(*pgn < pg_cache_off[order + 1] - pg_cache_off[order])) {
+		((unsigned long *)this_cpu_ptr(pg_cache))
+			[pg_cache_off[order] + *pgn] = addr;
 		++*pgn;
 
 		preempt_enable();
@@ -115,6 +175,54 @@ tfw_pool_free_pages(unsigned long addr, unsigned int order)
 	free_pages(addr, order);
 }
 
+/**
+ * Account a destroyed pool of class @cls, which used @used bytes of @chunks
+ * chunks of @bytes total size. Pools of the message classes also set the
+ * initial chunk order to fit TFW_POOL_ADAPT_PCT percents of the recent
+ * pools of the class into one chunk, so typical messages don't reallocate
+ * and small messages don't take the pages they don't need.
+ */
+static void
+tfw_pool_adapt(unsigned int cls, unsigned int chunks, unsigned long bytes,
+	       unsigned long used)
+{
+	TfwPoolPcpu *pc;
+	TfwPoolAdapt *a;
+	unsigned int o, need, total = 0, cum = 0;
+
+	preempt_disable();
+
+	pc = this_cpu_ptr(&tfw_pool_pcpu);
+	pc->stat[cls].pools++;
+	pc->stat[cls].chunks += chunks;
+	pc->stat[cls].bytes += bytes;
+	pc->stat[cls].used += used;
+
+	if (cls == TFW_POOL_OTHER)
+		goto out;
+
+	a = &pc->adapt[cls];
+	need = min_t(unsigned int, get_order(used), TFW_POOL_PGCACHE_ORDERS - 1);
+	a->hist[need]++;
+	if (++a->n < TFW_POOL_ADAPT_WIN)
+		goto out;
+
+	for (o = 0; o < TFW_POOL_PGCACHE_ORDERS; ++o)
+		total += a->hist[o];
+	for (o = 0; o < TFW_POOL_PGCACHE_ORDERS - 1; ++o) {
+		cum += a->hist[o];
+		if (cum * 100 >= total * TFW_POOL_ADAPT_PCT)
+			break;
+	}
+	a->order = o;
+	/* Halve the history, so the order follows the workload changes. */
+	for (o = 0; o < TFW_POOL_PGCACHE_ORDERS; ++o)
+		a->hist[o] >>= 1;
+	a->n = 0;
+out:
+	preempt_enable();
+}
+
 void *
 __tfw_pool_alloc(TfwPool *p, size_t n, bool align, bool *new_page)
 {
@@ -242,16 +350,19 @@ tfw_pool_clean(TfwPool *pool, void *ptr)
 }
 
 /**
- * Allocate bit more pages than we need.
+ * Allocate bit more pages than we need: at least the adapted initial chunk
+ * for the pool class @cls.
  */
 TfwPool *
-__tfw_pool_new(size_t n)
+__tfw_pool_new_cls(size_t n, unsigned int cls)
 {
 	TfwPool *p;
 	TfwPoolChunk *c;
 	unsigned int order;
 
 	order = get_order(TFW_POOL_ALIGN_SZ(n) + TFW_POOL_HEAD_OFF);
+	if (cls != TFW_POOL_OTHER)
+		order = max(order, this_cpu_read(tfw_pool_pcpu.adapt[cls].order));
 
 	c = (TfwPoolChunk *)tfw_pool_alloc_pages(order);
 	if (unlikely(!c))
@@ -263,6 +374,7 @@ __tfw_pool_new(size_t n)
 	p->order = c->order = order;
 	p->off = c->off = TFW_POOL_HEAD_OFF;
 	p->curr = c;
+	p->cls = cls;
 
 	return p;
 }
@@ -271,14 +383,50 @@ void
 tfw_pool_destroy(TfwPool *p)
 {
 	TfwPoolChunk *c, *next;
+	unsigned int cls, chunks = 0;
+	unsigned long bytes = 0, used = 0;
 
 	if (!p)
 		return;
 
+	/* The pool descriptor is freed with the last chunk. */
+	cls = p->cls;
+	p->curr->off = p->off;
 	for (c = p->curr; c; c = next) {
 		next = c->next;
+		++chunks;
+		bytes += PAGE_SIZE << c->order;
+		used += c->off;
 		tfw_pool_free_pages(TFW_POOL_CHUNK_BASE(c), c->order);
 	}
+
+	tfw_pool_adapt(cls, chunks, bytes, used);
+}
+
+/**
+ * Collect the statistics of all the pool classes into @st array of
+ * _TFW_POOL_CLS_NUM entries.
+ */
+void
+tfw_pool_stat(TfwPoolStat *st)
+{
+	int cpu, cls;
+
+	memset(st, 0, sizeof(*st) * _TFW_POOL_CLS_NUM);
+	for_each_online_cpu(cpu) {
+		TfwPoolPcpu *pc = per_cpu_ptr(&tfw_pool_pcpu, cpu);
+
+		for (cls = 0; cls < _TFW_POOL_CLS_NUM; ++cls) {
+			TfwPoolStat *s = &pc->stat[cls];
+
+			st[cls].pools += READ_ONCE(s->pools);
+			st[cls].chunks += READ_ONCE(s->chunks);
+			st[cls].bytes += READ_ONCE(s->bytes);
+			st[cls].used += READ_ONCE(s->used);
+			st[cls].order = max(st[cls].order,
+					    READ_ONCE(pc->adapt[cls].order));
+		}
+	}
 }
 
 int
@@ -296,10 +444,14 @@ tfw_pool_exit(void)
 	int i;
 
 	for_each_online_cpu(i) {
-		unsigned int pgn = per_cpu(pg_next, i);
+		unsigned int o, pgn;
 		unsigned long *pgc = (unsigned long *)per_cpu_ptr(pg_cache, i);
-		while (pgn--)
-			free_page(pgc[pgn]);
+
+		for (o = 0; o < TFW_POOL_PGCACHE_ORDERS; ++o) {
+			pgn = per_cpu(tfw_pool_pcpu, i).pg_next[o];
+			while (pgn--)
+				free_pages(pgc[pg_cache_off[o] + pgn], o);
+		}
 	}
 
 	free_percpu(pg_cache);
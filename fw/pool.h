@@ -28,6 +28,35 @@
 
 #define TFW_POOL_ZERO	0x1
 
+/*
+ * Pool classes by the type of the owning message. The initial chunk size of
+ * the pools of a class adapts to the sizes of the recent messages.
+ */
+enum {
+	TFW_POOL_OTHER,
+	TFW_POOL_REQ,
+	TFW_POOL_RESP,
+	TFW_POOL_H2,
+	_TFW_POOL_CLS_NUM
+};
+
+/**
+ * Memory statistics of the destroyed pools of a class.
+ *
+ * @pools	- number of pools;
+ * @chunks	- number of chunks allocated for the pools;
+ * @bytes	- memory allocated for the pools;
+ * @used	- memory used in the chunks, the rest of @bytes is waste;
+ * @order	- the largest initial chunk order over all the CPUs;
+ */
+typedef struct {
+	u64		pools;
+	u64		chunks;
+	u64		bytes;
+	u64		used;
+	unsigned int	order;
+} TfwPoolStat;
+
 /**
  * Memory pool chunk descriptor.
  *
@@ -46,17 +75,19 @@ typedef struct tfw_pool_chunk_t {
  *
  * @curr	- current chunk to allocate memory from;
  * @order,@off	- cached members of @curr;
+ * @cls		- the pool class, TFW_POOL_*;
  */
 typedef struct {
 	TfwPoolChunk	*curr;
 	unsigned int	order;
 	unsigned int	off;
+	unsigned int	cls;
 } TfwPool;
 
-#define tfw_pool_new(struct_name, mask)					\
+#define tfw_pool_new_cls(struct_name, cls, mask)			\
 ({									\
  	struct_name *s = NULL;						\
-	TfwPool *p = __tfw_pool_new(sizeof(struct_name));		\
+	TfwPool *p = __tfw_pool_new_cls(sizeof(struct_name), cls);	\
 	if (likely(p)) {						\
  		s = tfw_pool_alloc(p, sizeof(struct_name));		\
  		BUG_ON(!s);						\
@@ -69,13 +100,23 @@ typedef struct {
  	s;								\
  })
 
-TfwPool *__tfw_pool_new(size_t n);
+#define tfw_pool_new(struct_name, mask)					\
+	tfw_pool_new_cls(struct_name, TFW_POOL_OTHER, mask)
+
+TfwPool *__tfw_pool_new_cls(size_t n, unsigned int cls);
 void *__tfw_pool_alloc(TfwPool *p, size_t n, bool align, bool *new_page);
 void tfw_pool_free(TfwPool *p, void *ptr, size_t n);
 void tfw_pool_clean(TfwPool *p, void *ptr);
 void tfw_pool_destroy(TfwPool *p);
 void *__tfw_pool_realloc(TfwPool *p, void *ptr, size_t old_n, size_t new_n,
 			 bool copy);
+void tfw_pool_stat(TfwPoolStat *st);
+
+static inline TfwPool *
+__tfw_pool_new(size_t n)
+{
+	return __tfw_pool_new_cls(n, TFW_POOL_OTHER);
+}
 
 static inline void *
 tfw_pool_alloc(TfwPool *p, size_t n)
@@ -21,13 +21,38 @@
 #include <linux/seq_file.h>
 
 #include "apm.h"
+#include "cache.h"
+#include "cpu_role.h"
+#include "pool.h"
 #include "server.h"
+#include "stress.h"
 #include "procfs.h"
+#include "tls.h"
+#include "vhost.h"
 
 /*
  * Common Tempesta statistics.
  */
 DEFINE_PER_CPU_ALIGNED(TfwPerfStat, tfw_perfstat);
+DEFINE_PER_CPU_ALIGNED(TfwLatStat, tfw_lat_stat);
+DEFINE_PER_CPU_ALIGNED(TfwNumaStat, tfw_numa_stat);
+DEFINE_STATIC_KEY_FALSE(tfw_lat_enabled);
+
+static bool tfw_lat_enabled_reconfig;
+
+static const char *const tfw_lat_names[_TFW_LAT_NUM] = {
+	[TFW_LAT_RECV]		= "receive",
+	[TFW_LAT_PARSE]		= "request parsing",
+	[TFW_LAT_TBL]		= "http tables",
+	[TFW_LAT_CACHE]		= "cache",
+	[TFW_LAT_FWD]		= "forwarding",
+	[TFW_LAT_RESP_PARSE]	= "response parsing",
+	[TFW_LAT_ADJUST]	= "response adjusting",
+	[TFW_LAT_ENCRYPT]	= "TLS encryption",
+	[TFW_LAT_SEND]		= "send",
+};
+/* Percentiles of the latency histograms, in tenths of percent. */
+static const unsigned int tfw_lat_ith[] = { 500, 900, 990, 999 };
 
 void
 tfw_perfstat_collect(TfwPerfStat *stat)
@@ -48,10 +73,16 @@ tfw_perfstat_collect(TfwPerfStat *stat)
 		SADD(ss.pfl_hits);
 		SADD(ss.pfl_misses);
 		SADD(ss.wq_full);
+		SADD(ss.pg_recycled);
 
 		/* Cache statistics. */
 		SADD(cache.hits);
 		SADD(cache.misses);
+		SADD(cache.evictions);
+		SADD(cache.collapsed);
+		SADD(cache.stale);
+		SADD(cache.refreshes);
+		SADD(cache.rejected);
 
 		/* Client related statistics. */
 		SADD(clnt.rx_messages);
@@ -65,6 +96,8 @@ tfw_perfstat_collect(TfwPerfStat *stat)
 		SADD(clnt.conn_disconnects);
 		SADD(clnt.conn_established);
 		SADD(clnt.rx_bytes);
+		SADD(clnt.hpack_hits);
+		SADD(clnt.hpack_misses);
 
 		/* Server related statistics. */
 		SADD(serv.rx_messages);
@@ -81,14 +114,148 @@ tfw_perfstat_collect(TfwPerfStat *stat)
 #undef SADD
 }
 
+/**
+ * Merge the stage latency histograms of all the CPUs into zeroed @lat.
+ */
+static void
+tfw_lat_collect(TfwLatStat *lat)
+{
+	int cpu, s, b;
+
+	for_each_online_cpu(cpu) {
+		TfwLatStat *ls = per_cpu_ptr(&tfw_lat_stat, cpu);
+
+		for (s = 0; s < _TFW_LAT_NUM; ++s)
+			for (b = 0; b < TFW_LAT_BUCKETS; ++b)
+				lat->hist[s][b] += READ_ONCE(ls->hist[s][b]);
+	}
+}
+
+/**
+ * Show the number of samples and the percentiles of log2 histogram @hist of
+ * @nb buckets. The values are upper bounds of the buckets.
+ */
+static void
+tfw_hist_ith_show(struct seq_file *seq, const u64 *hist, int nb)
+{
+	u64 n, sum;
+	int b, i;
+
+	for (b = 0, n = 0; b < nb; ++b)
+		n += hist[b];
+
+	seq_printf(seq, "n=%llu", n);
+	for (i = 0, b = 0, sum = 0; n && i < ARRAY_SIZE(tfw_lat_ith); ++i) {
+		u64 lim = div_u64(n * tfw_lat_ith[i] + 999, 1000);
+
+		for ( ; b < nb - 1 && sum + hist[b] < lim; ++b)
+			sum += hist[b];
+		seq_printf(seq, " p%u.%u=%llu", tfw_lat_ith[i] / 10,
+			   tfw_lat_ith[i] % 10, 1ULL << b);
+	}
+	seq_putc(seq, '\n');
+}
+
+/**
+ * Show the percentiles of the stage latencies merged from all the CPUs in
+ * CPU cycles.
+ */
+static void
+tfw_perfstat_lat_show(struct seq_file *seq)
+{
+	TfwLatStat *lat;
+	int s;
+
+	if (!static_branch_unlikely(&tfw_lat_enabled))
+		return;
+	if (!(lat = kzalloc(sizeof(*lat), GFP_KERNEL)))
+		return;
+
+	tfw_lat_collect(lat);
+	for (s = 0; s < _TFW_LAT_NUM; ++s) {
+		seq_printf(seq, "Latency of %-18s\t: ", tfw_lat_names[s]);
+		tfw_hist_ith_show(seq, lat->hist[s], TFW_LAT_BUCKETS);
+	}
+
+	kfree(lat);
+}
+
+/**
+ * Show the allocations of the connection lifetime objects by the CPUs of each
+ * NUMA node.
+ */
+static void
+tfw_perfstat_numa_show(struct seq_file *seq)
+{
+	static const char *names[_TFW_NUMA_OBJ_NUM] = {
+		[TFW_NUMA_CONN]		= "conns",
+		[TFW_NUMA_STREAM]	= "streams",
+		[TFW_NUMA_MSG]		= "messages",
+	};
+	TfwNumaStat *ns;
+	int cpu, nid, o;
+
+	if (!(ns = kcalloc(nr_node_ids, sizeof(*ns), GFP_KERNEL)))
+		return;
+
+	for_each_online_cpu(cpu) {
+		TfwNumaStat *cs = per_cpu_ptr(&tfw_numa_stat, cpu);
+
+		nid = cpu_to_node(cpu);
+		for (o = 0; o < _TFW_NUMA_OBJ_NUM; ++o) {
+			ns[nid].cnt[o][0] += READ_ONCE(cs->cnt[o][0]);
+			ns[nid].cnt[o][1] += READ_ONCE(cs->cnt[o][1]);
+		}
+	}
+	for_each_online_node(nid)
+		for (o = 0; o < _TFW_NUMA_OBJ_NUM; ++o) {
+			seq_printf(seq, "NUMA node %d %-8s local\t\t: %llu\n",
+				   nid, names[o], ns[nid].cnt[o][0]);
+			seq_printf(seq, "NUMA node %d %-8s remote\t\t: %llu\n",
+				   nid, names[o], ns[nid].cnt[o][1]);
+		}
+
+	kfree(ns);
+}
+
+/**
+ * Show the number of CPUs of each role and their cumulative kernel time in
+ * milliseconds, the utilization is the time difference between two reads.
+ */
+static void
+tfw_perfstat_cpu_role_show(struct seq_file *seq)
+{
+	TfwCpuRoleStat st[_TFW_CPU_ROLE_NUM];
+	int r;
+
+	tfw_cpu_role_stat(st);
+	for (r = 0; r < _TFW_CPU_ROLE_NUM; ++r) {
+		seq_printf(seq, "CPU role %-10s CPUs\t\t\t: %u\n",
+			   tfw_cpu_role_names[r], st[r].cpus);
+		seq_printf(seq, "CPU role %-10s busy ms\t\t: %llu\n",
+			   tfw_cpu_role_names[r], div_u64(st[r].busy,
+							 NSEC_PER_MSEC));
+	}
+}
+
 static int
 tfw_perfstat_seq_show(struct seq_file *seq, void *off)
 {
 #define SPRNE(m, e)	seq_printf(seq, m": %llu\n", e)
 #define SPRN(m, c)	seq_printf(seq, m": %llu\n", stat.c)
 
+	static const char *pool_names[_TFW_POOL_CLS_NUM] = {
+		[TFW_POOL_OTHER]	= "other",
+		[TFW_POOL_REQ]		= "request",
+		[TFW_POOL_RESP]		= "response",
+		[TFW_POOL_H2]		= "h2",
+	};
 	TfwPerfStat stat;
+	TlsMemStat tls_mem;
+	TfwPoolStat pool[_TFW_POOL_CLS_NUM];
+	int i;
 	u64 serv_conn_active, serv_conn_sched;
+	unsigned long warmup_sent, warmup_total;
 	SsStat *ss_stat = kmalloc(sizeof(SsStat) * num_online_cpus(),
 				  GFP_KERNEL);
 	if (!ss_stat)
@@ -101,6 +268,7 @@ tfw_perfstat_seq_show(struct seq_file *seq, void *off)
 	SPRN("SS pfl hits\t\t\t\t", ss.pfl_hits);
 	SPRN("SS pfl misses\t\t\t\t", ss.pfl_misses);
 	SPRN("SS work queue full\t\t\t", ss.wq_full);
+	SPRN("SS pages recycled\t\t\t", ss.pg_recycled);
 	if (ss_stat) {
 		int cpu;
 
@@ -111,11 +279,19 @@ tfw_perfstat_seq_show(struct seq_file *seq, void *off)
 		seq_printf(seq, "\nSS backlog's sizes\t\t\t:");
 		for_each_online_cpu(cpu)
 			seq_printf(seq, " %u", ss_stat[cpu].backlog_sz);
+		seq_printf(seq, "\nSS IPIs sent\t\t\t\t:");
+		for_each_online_cpu(cpu)
+			seq_printf(seq, " %lu", ss_stat[cpu].ipi_sent);
+		seq_printf(seq, "\nSS IPIs coalesced\t\t\t:");
+		for_each_online_cpu(cpu)
+			seq_printf(seq, " %lu", ss_stat[cpu].ipi_coalesced);
 		seq_printf(seq, "\n");
 		kfree(ss_stat);
 	} else {
 		seq_printf(seq, "SS work queues' sizes\t\t\t: n/a\n");
 		seq_printf(seq, "SS backlog's sizes\t\t\t: n/a\n");
+		seq_printf(seq, "SS IPIs sent\t\t\t\t: n/a\n");
+		seq_printf(seq, "SS IPIs coalesced\t\t\t: n/a\n");
 	}
 
 	/* Socket buffers kernel statistics. */
@@ -125,6 +301,14 @@ tfw_perfstat_seq_show(struct seq_file *seq, void *off)
 	/* Cache statistics. */
 	SPRN("Cache hits\t\t\t\t", cache.hits);
 	SPRN("Cache misses\t\t\t\t", cache.misses);
+	SPRN("Cache evictions\t\t\t\t", cache.evictions);
+	SPRN("Cache collapsed misses\t\t\t", cache.collapsed);
+	SPRN("Cache stale responses\t\t\t", cache.stale);
+	SPRN("Cache background refreshes\t\t", cache.refreshes);
+	SPRN("Cache admission rejections\t\t", cache.rejected);
+	tfw_cache_warmup_progress(&warmup_sent, &warmup_total);
+	seq_printf(seq, "Cache warm-up URLs requested\t\t: %lu/%lu\n",
+		   warmup_sent, warmup_total);
 
 	/* Client related statistics. */
 	SPRN("Client messages received\t\t", clnt.rx_messages);
@@ -139,6 +323,36 @@ tfw_perfstat_seq_show(struct seq_file *seq, void *off)
 	SPRNE("Client connections active\t\t",
 	      stat.clnt.conn_established - stat.clnt.conn_disconnects);
 	SPRN("Client RX bytes\t\t\t\t", clnt.rx_bytes);
+	SPRN("Client HPACK index hits\t\t\t", clnt.hpack_hits);
+	SPRN("Client HPACK index misses\t\t", clnt.hpack_misses);
+
+	/* TLS memory statistics. */
+	ttls_mem_stat(&tls_mem);
+	SPRNE("TLS context size per connection\t\t", (u64)tls_mem.ctx_sz);
+	SPRNE("TLS handshakes in progress\t\t", (u64)tls_mem.hs_active);
+	SPRNE("TLS handshakes memory\t\t\t",
+	      (u64)(tls_mem.hs_active * tls_mem.hs_sz));
+
+	SPRNE("Memory pressure level\t\t\t", (u64)tfw_mem_pressure());
+
+	/* Memory pools statistics. */
+	tfw_pool_stat(pool);
+	for (i = 0; i < _TFW_POOL_CLS_NUM; ++i) {
+		TfwPoolStat *ps = &pool[i];
+
+		seq_printf(seq, "Pool %-8s pools\t\t\t: %llu\n",
+			   pool_names[i], ps->pools);
+		seq_printf(seq, "Pool %-8s chunks\t\t\t: %llu\n",
+			   pool_names[i], ps->chunks);
+		seq_printf(seq, "Pool %-8s memory\t\t\t: %llu\n",
+			   pool_names[i], ps->bytes);
+		seq_printf(seq, "Pool %-8s waste\t\t\t: %llu\n",
+			   pool_names[i], ps->bytes - ps->used);
+		seq_printf(seq, "Pool %-8s initial order\t\t: %u\n",
+			   pool_names[i], ps->order);
+	}
+	tfw_perfstat_numa_show(seq);
+	tfw_perfstat_cpu_role_show(seq);
 
 	/* Server related statistics. */
 	serv_conn_active = stat.serv.conn_established
@@ -156,6 +370,8 @@ tfw_perfstat_seq_show(struct seq_file *seq, void *off)
 	SPRNE("Server connections schedulable\t\t", serv_conn_sched);
 	SPRN("Server RX bytes\t\t\t\t", serv.rx_bytes);
 
+	tfw_perfstat_lat_show(seq);
+
 	return 0;
 #undef SPRN
 #undef SPRNE
@@ -172,12 +388,13 @@ tfw_srvstats_seq_show(struct seq_file *seq, void *off)
 {
 #define SPRNE(m, e)	seq_printf(seq, m": %dms\n", e)
 
-	size_t i, rc;
+	size_t i, rc, pc, tc;
 	TfwSrvConn *srv_conn;
 	TfwServer *srv = seq->private;
 	unsigned int *qsize;
 	bool hm = test_bit(TFW_SRV_B_HMONITOR, &srv->flags);
 	unsigned int val[ARRAY_SIZE(tfw_pstats_ith)] = { 0 };
+	unsigned int skval[TFW_APM_SK_PSZ];
 	TfwPrcntlStats pstats = {
 		.ith = tfw_pstats_ith,
 		.val = val,
@@ -192,17 +409,28 @@ tfw_srvstats_seq_show(struct seq_file *seq, void *off)
 	SPRNE("Average response time\t\t", pstats.val[TFW_PSTATS_IDX_AVG]);
 	SPRNE("Median  response time\t\t", pstats.val[TFW_PSTATS_IDX_P50]);
 	SPRNE("Maximum response time\t\t", pstats.val[TFW_PSTATS_IDX_MAX]);
+	SPRNE("Average local queue time\t", tfw_apm_qtime(srv->apmref));
 
 	seq_printf(seq, "Percentiles\n");
 	for (i = TFW_PSTATS_IDX_ITH; i < ARRAY_SIZE(tfw_pstats_ith); ++i)
 		seq_printf(seq, "%02d%%:\t%dms\n",
 				pstats.ith[i], pstats.val[i]);
 
-	i = rc = 0;
+	tfw_apm_sketch_stats(srv->apmref, skval);
+	seq_printf(seq, "Tail percentiles\n");
+	for (i = 0; i < TFW_APM_SK_PSZ; ++i)
+		seq_printf(seq, "%u.%02u%%:\t%ums\n", tfw_apm_sk_ith[i] / 100,
+			   tfw_apm_sk_ith[i] % 100, skval[i]);
+
+	i = rc = pc = tc = 0;
 	list_for_each_entry(srv_conn, &srv->conn_list, list) {
 		qsize[i++] = READ_ONCE(srv_conn->qsize);
 		if (tfw_srv_conn_restricted(srv_conn))
 			rc++;
+		if (test_bit(TFW_CONN_B_PARKED, &srv_conn->flags))
+			pc++;
+		if (test_bit(TFW_CONN_B_TUNNEL, &srv_conn->flags))
+			tc++;
 	}
 
 #ifdef DEBUG
@@ -212,7 +440,19 @@ tfw_srvstats_seq_show(struct seq_file *seq, void *off)
 	seq_printf(seq, "Total pinned sessions\t\t: %lld\n",
 			atomic64_read(&srv->sess_n));
 	seq_printf(seq, "Total schedulable connections\t: %zd\n",
-			srv->conn_n - rc);
+			srv->conn_n - rc - pc);
+	seq_printf(seq, "Parked connections\t\t: %zd\n", pc);
+	seq_printf(seq, "Tunneled connections\t\t: %zd\n", tc);
+	seq_printf(seq, "Ejected as outlier\t\t: %d\n",
+			test_bit(TFW_SRV_B_EJECT, &srv->flags));
+	if (tfw_sg_climit_enabled(srv->sg))
+		seq_printf(seq, "Group in-flight/limit		: %d/%u\n",
+			   atomic_read(&srv->sg->climit_st.inflight),
+			   READ_ONCE(srv->sg->climit_st.limit)
+			   ? : srv->sg->climit.max);
+	if (tfw_srv_pipe_depth(srv))
+		seq_printf(seq, "Pipelining depth\t\t: %u\n",
+			   tfw_srv_pipe_depth(srv));
 
 	seq_printf(seq, "HTTP health monitor is enabled\t: %d\n", hm);
 	if (hm) {
@@ -261,6 +501,238 @@ tfw_srvstats_seq_open(struct inode *inode, struct file *file)
 	return single_open(file, tfw_srvstats_seq_reconfig, PDE_DATA(inode));
 }
 
+/**
+ * Write a binary record of @srv statistics, see TfwStatsSrv. Stop the servers
+ * iteration if the record doesn't fit the buffer: seq_file retries the whole
+ * snapshot with a larger buffer.
+ */
+static int
+tfw_stats_srv_write(TfwSrvGroup *sg, TfwServer *srv, void *data)
+{
+	struct seq_file *seq = data;
+	TfwStatsSrv rec = { 0 };
+	TfwSrvConn *srv_conn;
+	TfwPrcntlStats pstats = {
+		.ith = tfw_pstats_ith,
+		.val = rec.rtime,
+	};
+
+	BUILD_BUG_ON(TFW_STATS_RTIME_N != ARRAY_SIZE(tfw_pstats_ith));
+	BUILD_BUG_ON(TFW_STATS_RTAIL_N != TFW_APM_SK_PSZ);
+
+	strscpy(rec.sg_name, sg->name, sizeof(rec.sg_name));
+	memcpy(rec.addr, &srv->addr.sin6_addr, sizeof(rec.addr));
+	rec.port = ntohs(srv->addr.sin6_port);
+
+	if (test_bit(TFW_SRV_B_HMONITOR, &srv->flags)) {
+		rec.flags |= TFW_STATS_SRV_F_HMONITOR;
+		if (tfw_srv_suspended(srv))
+			rec.flags |= TFW_STATS_SRV_F_SUSPENDED;
+	}
+	if (test_bit(TFW_SRV_B_EJECT, &srv->flags))
+		rec.flags |= TFW_STATS_SRV_F_EJECTED;
+
+	rec.conn_n = srv->conn_n;
+	rec.conn_sched = srv->conn_n;
+	list_for_each_entry(srv_conn, &srv->conn_list, list) {
+		rec.qsize += READ_ONCE(srv_conn->qsize);
+		if (test_bit(TFW_CONN_B_PARKED, &srv_conn->flags)) {
+			rec.conn_parked++;
+			rec.conn_sched--;
+		} else if (tfw_srv_conn_restricted(srv_conn)) {
+			rec.conn_sched--;
+		}
+	}
+	rec.max_qsize = sg->max_qsize;
+	rec.sess_n = atomic64_read(&srv->sess_n);
+
+	tfw_apm_stats_bh(srv->apmref, &pstats);
+	tfw_apm_sketch_stats(srv->apmref, rec.rtail);
+	rec.qtime = tfw_apm_qtime(srv->apmref);
+
+	seq_write(seq, &rec, sizeof(rec));
+
+	return seq_has_overflowed(seq);
+}
+
+/**
+ * Context of the vhost locations iteration.
+ *
+ * @seq		- Output file;
+ * @vhost	- Vhost of the previous location;
+ * @total	- Traffic of the @vhost locations seen so far;
+ * @rec		- Record of the current location.
+ */
+typedef struct {
+	struct seq_file	*seq;
+	TfwVhost	*vhost;
+	TfwVhostStat	total;
+	TfwStatsVhost	rec;
+} TfwVhostStatCtx;
+
+static void
+tfw_vhost_stat_fill(TfwStatsVhost *rec, TfwVhost *vhost, TfwLocation *loc)
+{
+	memset(rec, 0, sizeof(*rec));
+	strscpy(rec->vhost, vhost->name.data, sizeof(rec->vhost));
+	if (loc != vhost->loc_dflt)
+		snprintf(rec->loc, sizeof(rec->loc), "%s %s",
+			 tfw_location_op_name(loc), loc->arg);
+	tfw_location_stat_collect(loc, &rec->stat);
+}
+
+static void
+tfw_vhost_stat_show(struct seq_file *seq, const char *name,
+		    const TfwVhostStat *st)
+{
+	seq_printf(seq, "\t%s\t: requests=%llu bytes_in=%llu bytes_out=%llu"
+		   " cache_hits=%llu 1xx=%llu 2xx=%llu 3xx=%llu 4xx=%llu"
+		   " 5xx=%llu other=%llu\n",
+		   name, st->requests, st->bytes_in, st->bytes_out,
+		   st->cache_hits, st->status[0], st->status[1], st->status[2],
+		   st->status[3], st->status[4], st->status[5]);
+	seq_printf(seq, "\t%s latency, us\t: ", name);
+	tfw_hist_ith_show(seq, st->lat, TFW_VHOST_LAT_BUCKETS);
+}
+
+static void
+tfw_vhost_stat_total_show(TfwVhostStatCtx *ctx)
+{
+	if (!ctx->vhost)
+		return;
+	tfw_vhost_stat_show(ctx->seq, "total", &ctx->total);
+	memset(&ctx->total, 0, sizeof(ctx->total));
+}
+
+static int
+tfw_vhost_stat_loc_show(TfwVhost *vhost, TfwLocation *loc, void *data)
+{
+	TfwVhostStatCtx *ctx = data;
+
+	if (vhost != ctx->vhost) {
+		tfw_vhost_stat_total_show(ctx);
+		ctx->vhost = vhost;
+		seq_printf(ctx->seq, "vhost %s\n", vhost->name.data);
+	}
+	tfw_vhost_stat_fill(&ctx->rec, vhost, loc);
+	tfw_location_stat_collect(loc, &ctx->total);
+	tfw_vhost_stat_show(ctx->seq, *ctx->rec.loc ? ctx->rec.loc : "default",
+			    &ctx->rec.stat);
+
+	return 0;
+}
+
+/**
+ * Show the traffic of each location of each vhost and the vhost totals.
+ */
+static int
+tfw_vhoststats_seq_show(struct seq_file *seq, void *off)
+{
+	TfwVhostStatCtx *ctx;
+
+	if (tfw_runstate_is_reconfig()) {
+		seq_printf(seq, "Per-Vhost statistics is unavailable during"
+			   " reconfiguration\n");
+		return 0;
+	}
+	if (!(ctx = kzalloc(sizeof(*ctx), GFP_KERNEL)))
+		return -ENOMEM;
+
+	ctx->seq = seq;
+	tfw_vhost_for_each_loc(tfw_vhost_stat_loc_show, ctx);
+	tfw_vhost_stat_total_show(ctx);
+	kfree(ctx);
+
+	return 0;
+}
+
+static int
+tfw_vhoststats_seq_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tfw_vhoststats_seq_show, NULL);
+}
+
+/**
+ * Write a binary record of @loc statistics, see TfwStatsVhost. Stop the
+ * iteration if the record doesn't fit the buffer.
+ */
+static int
+tfw_stats_vhost_write(TfwVhost *vhost, TfwLocation *loc, void *data)
+{
+	TfwVhostStatCtx *ctx = data;
+
+	tfw_vhost_stat_fill(&ctx->rec, vhost, loc);
+	seq_write(ctx->seq, &ctx->rec, sizeof(ctx->rec));
+
+	return seq_has_overflowed(ctx->seq);
+}
+
+/**
+ * Write a binary snapshot of all the statistics, see procfs_if.h.
+ */
+static int
+tfw_stats_seq_show(struct seq_file *seq, void *off)
+{
+	TfwStatsHdr *hdr;
+	TfwVhostStatCtx *ctx;
+	unsigned long warmup_sent, warmup_total;
+	unsigned int srv_n, vhost_n;
+	size_t srv_end;
+
+	if (!(hdr = kzalloc(sizeof(*hdr), GFP_KERNEL)))
+		return -ENOMEM;
+
+	hdr->magic = TFW_STATS_MAGIC;
+	hdr->version = TFW_STATS_VERSION;
+	hdr->hdr_len = sizeof(*hdr);
+	hdr->srv_len = sizeof(TfwStatsSrv);
+	hdr->vhost_len = sizeof(TfwStatsVhost);
+	hdr->ts = ktime_get_real_ns();
+	tfw_perfstat_collect(&hdr->perf);
+	if (static_branch_unlikely(&tfw_lat_enabled)) {
+		hdr->lat_enabled = 1;
+		tfw_lat_collect(&hdr->lat);
+	}
+	hdr->skb_in_flight = __get_skb_count();
+	tfw_cache_warmup_progress(&warmup_sent, &warmup_total);
+	hdr->warmup_sent = warmup_sent;
+	hdr->warmup_total = warmup_total;
+
+	seq_write(seq, hdr, sizeof(*hdr));
+	kfree(hdr);
+
+	/* Server groups and vhosts are replaced during reconfiguration. */
+	if (tfw_runstate_is_reconfig())
+		return 0;
+
+	tfw_sg_for_each_srv_data(tfw_stats_srv_write, seq);
+	if (seq_has_overflowed(seq))
+		return 0;
+	srv_end = seq->count;
+
+	if (!(ctx = kzalloc(sizeof(*ctx), GFP_KERNEL)))
+		return -ENOMEM;
+	ctx->seq = seq;
+	tfw_vhost_for_each_loc(tfw_stats_vhost_write, ctx);
+	kfree(ctx);
+	if (seq_has_overflowed(seq))
+		return 0;
+
+	/* The header is at the beginning of the buffer. */
+	srv_n = (srv_end - sizeof(*hdr)) / sizeof(TfwStatsSrv);
+	vhost_n = (seq->count - srv_end) / sizeof(TfwStatsVhost);
+	((TfwStatsHdr *)seq->buf)->srv_n = srv_n;
+	((TfwStatsHdr *)seq->buf)->vhost_n = vhost_n;
+
+	return 0;
+}
+
+static int
+tfw_stats_seq_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tfw_stats_seq_show, NULL);
+}
+
 static int
 tfw_state_seq_show(struct seq_file *seq, void *off)
 {
@@ -286,6 +758,8 @@ tfw_state_seq_open(struct inode *inode, struct file *file)
 static struct proc_dir_entry *tfw_procfs_tempesta;
 static struct proc_dir_entry *tfw_procfs_state;
 static struct proc_dir_entry *tfw_procfs_perfstat;
+static struct proc_dir_entry *tfw_procfs_stats;
+static struct proc_dir_entry *tfw_procfs_vhoststats;
 static struct proc_dir_entry *tfw_procfs_srvstats;
 static struct proc_dir_entry *tfw_procfs_sgstats;
 
@@ -343,9 +817,23 @@ tfw_procfs_cleanup(void)
 static int
 tfw_procfs_start(void)
 {
+	int cpu;
+
 	if (!tfw_procfs_tempesta)
 		return -ENOENT;
 
+	if (tfw_lat_enabled_reconfig
+	    && !static_key_enabled(&tfw_lat_enabled))
+	{
+		/* Start with clean histograms. */
+		for_each_possible_cpu(cpu)
+			memset(per_cpu_ptr(&tfw_lat_stat, cpu), 0,
+			       sizeof(TfwLatStat));
+		static_branch_enable(&tfw_lat_enabled);
+	} else if (!tfw_lat_enabled_reconfig) {
+		static_branch_disable(&tfw_lat_enabled);
+	}
+
 	tfw_procfs_cleanup();
 	if (!(tfw_procfs_srvstats = proc_mkdir("servers", tfw_procfs_tempesta)))
 		return -ENOENT;
@@ -356,10 +844,18 @@ tfw_procfs_start(void)
 static void
 tfw_procfs_stop(void)
 {
+	static_branch_disable(&tfw_lat_enabled);
 	tfw_procfs_cleanup();
 }
 
 static TfwCfgSpec tfw_procfs_specs[] = {
+	{
+		.name = "perfstat_latency",
+		.deflt = "off",
+		.handler = tfw_cfg_set_bool,
+		.dest = &tfw_lat_enabled_reconfig,
+		.allow_reconfig = true,
+	},
 	{ 0 },
 };
 
@@ -382,6 +878,22 @@ static struct proc_ops tfw_perfstat_fops = {
 	.proc_release	= single_release,
 };
 
+static struct proc_ops tfw_stats_fops = {
+	.proc_flags	= PROC_ENTRY_PERMANENT,
+	.proc_open	= tfw_stats_seq_open,
+	.proc_read	= seq_read,
+	.proc_lseek	= seq_lseek,
+	.proc_release	= single_release,
+};
+
+static struct proc_ops tfw_vhoststats_fops = {
+	.proc_flags	= PROC_ENTRY_PERMANENT,
+	.proc_open	= tfw_vhoststats_seq_open,
+	.proc_read	= seq_read,
+	.proc_lseek	= seq_lseek,
+	.proc_release	= single_release,
+};
+
 static struct proc_ops tfw_state_fops = {
 	.proc_flags	= PROC_ENTRY_PERMANENT,
 	.proc_open	= tfw_state_seq_open,
@@ -409,10 +921,25 @@ tfw_procfs_init(void)
 	if (!tfw_procfs_perfstat)
 		goto out_state;
 
+	tfw_procfs_stats = proc_create("stats", S_IRUGO, tfw_procfs_tempesta,
+				       &tfw_stats_fops);
+	if (!tfw_procfs_stats)
+		goto out_perfstat;
+
+	tfw_procfs_vhoststats = proc_create("vhosts", S_IRUGO,
+					    tfw_procfs_tempesta,
+					    &tfw_vhoststats_fops);
+	if (!tfw_procfs_vhoststats)
+		goto out_stats;
+
 	tfw_mod_register(&tfw_procfs_mod);
 
 	return 0;
 
+out_stats:
+	remove_proc_entry("stats", tfw_procfs_tempesta);
+out_perfstat:
+	remove_proc_entry("perfstat", tfw_procfs_tempesta);
 out_state:
 	remove_proc_entry("state", NULL);
 out_tempesta:
@@ -425,6 +952,8 @@ void
 tfw_procfs_exit(void)
 {
 	tfw_mod_unregister(&tfw_procfs_mod);
+	remove_proc_entry("vhosts", tfw_procfs_tempesta);
+	remove_proc_entry("stats", tfw_procfs_tempesta);
 	remove_proc_entry("perfstat", tfw_procfs_tempesta);
 	remove_proc_entry("state", tfw_procfs_tempesta);
 	remove_proc_entry("tempesta", NULL);
@@ -20,91 +20,84 @@
 #ifndef __TFW_PROCFS_H__
 #define __TFW_PROCFS_H__
 
+#include <linux/jump_label.h>
+#include <linux/mm.h>
+#include <linux/timex.h>
+
+#include "procfs_if.h"
 #include "tempesta_fw.h"
 
+DECLARE_PER_CPU_ALIGNED(TfwPerfStat, tfw_perfstat);
+
 /*
- * @pfl_hits		- The number of page frag lookup hits.
- * @pfl_misses		- The number of page frag lookup misses.
- * @wq_full		- How many times we faced work queue full.
+ * this_cpu_inc/add() macros are implemented via "do {} while(0)" code
+ * block. (see <linux/percpu-defs.h>) Note that it is not a statement
+ * expression, and so it can not be evaluated to a value. For that
+ * reason the definitions below cannot be used with ?: operator.
  */
-typedef struct {
-	u64	pfl_hits;
-	u64	pfl_misses;
-	u64	wq_full;
-} TfwSsStat;
+#define TFW_INC_STAT_BH(...)	this_cpu_inc(tfw_perfstat.__VA_ARGS__)
+#define TFW_DEC_STAT_BH(...)	this_cpu_dec(tfw_perfstat.__VA_ARGS__)
+#define TFW_ADD_STAT_BH(val, ...)	\
+		this_cpu_add(tfw_perfstat.__VA_ARGS__, val)
+
+DECLARE_PER_CPU_ALIGNED(TfwLatStat, tfw_lat_stat);
+DECLARE_STATIC_KEY_FALSE(tfw_lat_enabled);
 
 /*
- * @rx_messages		- The number of messages received from peers.
- * @msgs_forwarded	- The number of forwarded messages.
- * @msgs_parserr	- The number of messages with parsing errors.
- * @msgs_filtout	- The number of messages that were filtered out
- *			  in accordance with the rules in configuration.
- * @msgs_otherr		- The number of messages not accepted due to
- *			  other errors.
- *
- * @conn_attempts	- The number of connect attempts.
- * @conn_established	- The number of connections ever established
- *			  with peers while Tempesta is active.
- * @conn_disconnects	- The number of disconnects for any reason.
+ * Measure a stage time if 'perfstat_latency' is on, the code is patched out
+ * otherwise:
  *
- * @rx_bytes		- The number of bytes received from peers and
- *			  processed by Tempesta.
+ *	u64 t0 = tfw_lat_start();
+ *	...stage...
+ *	tfw_lat_end(TFW_LAT_PARSE, t0);
  */
-#define TFW_STAT_COMMON							\
-	u64	rx_messages;						\
-	u64	msgs_forwarded;						\
-	u64	msgs_parserr;						\
-	u64	msgs_filtout;						\
-	u64	msgs_otherr;						\
-	u64	conn_attempts;						\
-	u64	conn_established;					\
-	u64	conn_disconnects;					\
-	u64	rx_bytes;
+static inline u64
+tfw_lat_start(void)
+{
+	if (static_branch_unlikely(&tfw_lat_enabled))
+		return get_cycles();
+	return 0;
+}
 
-typedef struct {
-	TFW_STAT_COMMON;
-	u64	conn_restricted;
-} TfwSrvStat;
+static inline void
+tfw_lat_end(int stage, u64 t0)
+{
+	unsigned int b;
+
+	/* Skip the stage if the measurement was switched on in the middle. */
+	if (!static_branch_unlikely(&tfw_lat_enabled) || !t0)
+		return;
+	b = min_t(unsigned int, fls64(get_cycles() - t0), TFW_LAT_BUCKETS - 1);
+	this_cpu_inc(tfw_lat_stat.hist[stage][b]);
+}
 
 /*
- * @msgs_fromcache	- The number of messages served from cache.
- * @online		- The number of clients online.
+ * Objects living as long as a connection, they're allocated on the NUMA node
+ * of the CPU processing the connection softirq.
  */
-typedef struct {
-	TFW_STAT_COMMON;
-	u64	msgs_fromcache;
-	u64	online;
-} TfwClntStat;
+enum {
+	TFW_NUMA_CONN,
+	TFW_NUMA_STREAM,
+	TFW_NUMA_MSG,
+	_TFW_NUMA_OBJ_NUM
+};
 
-/*
- * If cache is enabled, the following stats are produced.
- *
- * @hits	- The number of cache hits.
- * @misses	- The number of cache misses.
+/**
+ * Allocations of the objects by the CPU, @cnt[obj][0] counts the objects
+ * allocated on the node of the CPU and @cnt[obj][1] - on a remote node.
  */
 typedef struct {
-	u64	hits;
-	u64	misses;
-} TfwCacheStat;
+	u64	cnt[_TFW_NUMA_OBJ_NUM][2];
+} TfwNumaStat;
 
-typedef struct {
-	TfwSsStat	ss;
-	TfwClntStat	clnt;
-	TfwSrvStat	serv;
-	TfwCacheStat	cache;
-} TfwPerfStat;
+DECLARE_PER_CPU_ALIGNED(TfwNumaStat, tfw_numa_stat);
 
-DECLARE_PER_CPU_ALIGNED(TfwPerfStat, tfw_perfstat);
+static inline void
+tfw_numa_stat_inc(int obj, const void *p)
+{
+	bool remote = page_to_nid(virt_to_page(p)) != numa_node_id();
 
-/*
- * this_cpu_inc/add() macros are implemented via "do {} while(0)" code
- * block. (see <linux/percpu-defs.h>) Note that it is not a statement
- * expression, and so it can not be evaluated to a value. For that
- * reason the definitions below cannot be used with ?: operator.
- */
-#define TFW_INC_STAT_BH(...)	this_cpu_inc(tfw_perfstat.__VA_ARGS__)
-#define TFW_DEC_STAT_BH(...)	this_cpu_dec(tfw_perfstat.__VA_ARGS__)
-#define TFW_ADD_STAT_BH(val, ...)	\
-		this_cpu_add(tfw_perfstat.__VA_ARGS__, val)
+	this_cpu_inc(tfw_numa_stat.cnt[obj][remote]);
+}
 
 #endif /* __TFW_PROCFS_H__ */
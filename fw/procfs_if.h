@@ -0,0 +1,275 @@
+/**
+ *		Tempesta FW
+ *
+ * Binary statistics interface shared with user space.
+ *
+ * /proc/tempesta/stats exports the same statistics as the text files of
+ * /proc/tempesta, but as fixed binary structures, so collectors don't need
+ * to format and parse text on each scrape. A read of the file returns
+ * a consistent snapshot: TfwStatsHdr followed by @srv_n TfwStatsSrv records
+ * and @vhost_n TfwStatsVhost records. Readers must locate the records by
+ * @hdr_len, @srv_len and @vhost_len: new fields are appended to the end of
+ * the structures without version change, while TFW_STATS_VERSION is
+ * increased on any other layout change, including the structures embedded
+ * into the header.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __TFW_PROCFS_IF_H__
+#define __TFW_PROCFS_IF_H__
+
+#include <linux/types.h>
+
+/*
+ * @pfl_hits		- The number of page frag lookup hits.
+ * @pfl_misses		- The number of page frag lookup misses.
+ * @wq_full		- How many times we faced work queue full.
+ * @pg_recycled		- The number of pages reused from the page ring.
+ */
+typedef struct {
+	__u64	pfl_hits;
+	__u64	pfl_misses;
+	__u64	wq_full;
+	__u64	pg_recycled;
+} TfwSsStat;
+
+/*
+ * @rx_messages		- The number of messages received from peers.
+ * @msgs_forwarded	- The number of forwarded messages.
+ * @msgs_parserr	- The number of messages with parsing errors.
+ * @msgs_filtout	- The number of messages that were filtered out
+ *			  in accordance with the rules in configuration.
+ * @msgs_otherr		- The number of messages not accepted due to
+ *			  other errors.
+ *
+ * @conn_attempts	- The number of connect attempts.
+ * @conn_established	- The number of connections ever established
+ *			  with peers while Tempesta is active.
+ * @conn_disconnects	- The number of disconnects for any reason.
+ *
+ * @rx_bytes		- The number of bytes received from peers and
+ *			  processed by Tempesta.
+ */
+#define TFW_STAT_COMMON							\
+	__u64	rx_messages;						\
+	__u64	msgs_forwarded;						\
+	__u64	msgs_parserr;						\
+	__u64	msgs_filtout;						\
+	__u64	msgs_otherr;						\
+	__u64	conn_attempts;						\
+	__u64	conn_established;					\
+	__u64	conn_disconnects;					\
+	__u64	rx_bytes;
+
+typedef struct {
+	TFW_STAT_COMMON;
+	__u64	conn_restricted;
+} TfwSrvStat;
+
+/*
+ * @msgs_fromcache	- The number of messages served from cache.
+ * @online		- The number of clients online.
+ * @hpack_hits		- The number of response headers found in HPACK
+ *			  encoder dynamic tables of the connections.
+ * @hpack_misses	- The number of response headers not found in the
+ *			  tables, including the ones with only the name found.
+ */
+typedef struct {
+	TFW_STAT_COMMON;
+	__u64	msgs_fromcache;
+	__u64	online;
+	__u64	hpack_hits;
+	__u64	hpack_misses;
+} TfwClntStat;
+
+/*
+ * If cache is enabled, the following stats are produced.
+ *
+ * @hits	- The number of cache hits.
+ * @misses	- The number of cache misses.
+ * @evictions	- The number of entries evicted to store new ones.
+ * @collapsed	- The number of misses waited for a concurrent request.
+ * @stale	- The number of stale entries served according to RFC 5861.
+ * @refreshes	- The number of background refreshes of stale entries.
+ * @rejected	- The number of responses not admitted to the cache.
+ */
+typedef struct {
+	__u64	hits;
+	__u64	misses;
+	__u64	evictions;
+	__u64	collapsed;
+	__u64	stale;
+	__u64	refreshes;
+	__u64	rejected;
+} TfwCacheStat;
+
+typedef struct {
+	TfwSsStat	ss;
+	TfwClntStat	clnt;
+	TfwSrvStat	serv;
+	TfwCacheStat	cache;
+} TfwPerfStat;
+
+/*
+ * Processing stages with latency histograms. A stage time includes the time
+ * of the stages called from it, e.g. cache lookup includes forwarding of
+ * a request on a cache miss.
+ */
+enum {
+	TFW_LAT_RECV,
+	TFW_LAT_PARSE,
+	TFW_LAT_TBL,
+	TFW_LAT_CACHE,
+	TFW_LAT_FWD,
+	TFW_LAT_RESP_PARSE,
+	TFW_LAT_ADJUST,
+	TFW_LAT_ENCRYPT,
+	TFW_LAT_SEND,
+	_TFW_LAT_NUM
+};
+
+/* Bucket i counts the stage times of [2^(i-1), 2^i) CPU cycles. */
+#define TFW_LAT_BUCKETS		40
+
+typedef struct {
+	__u64	hist[_TFW_LAT_NUM][TFW_LAT_BUCKETS];
+} TfwLatStat;
+
+/* Bucket i counts the request times of [2^(i-1), 2^i) microseconds. */
+#define TFW_VHOST_LAT_BUCKETS	32
+/* Response status classes: 1xx to 5xx and the rest. */
+#define TFW_VHOST_STATUS_N	6
+
+/**
+ * Traffic of a vhost location.
+ *
+ * @requests	- Requests answered by a response;
+ * @bytes_in	- Size of the requests;
+ * @bytes_out	- Size of the responses on the wire;
+ * @cache_hits	- Requests served from the cache;
+ * @status	- Responses by status class, see TFW_VHOST_STATUS_N;
+ * @lat		- Histogram of times from a request receipt to the response.
+ */
+typedef struct {
+	__u64	requests;
+	__u64	bytes_in;
+	__u64	bytes_out;
+	__u64	cache_hits;
+	__u64	status[TFW_VHOST_STATUS_N];
+	__u64	lat[TFW_VHOST_LAT_BUCKETS];
+} TfwVhostStat;
+
+#define TFW_STATS_MAGIC		0x53574654	/* "TFWS" */
+#define TFW_STATS_VERSION	2
+#define TFW_STATS_SG_NAME_LEN	64
+#define TFW_STATS_VHOST_NAME_LEN 64
+#define TFW_STATS_LOC_NAME_LEN	128
+/* Minimal, maximal, average response times and 50-99 percentiles. */
+#define TFW_STATS_RTIME_N	8
+/* Response time tail percentiles: 50, 90, 99, 99.9 and 99.99. */
+#define TFW_STATS_RTAIL_N	5
+
+/* The server is monitored by the HTTP health monitor. */
+#define TFW_STATS_SRV_F_HMONITOR	0x0001
+/* The health monitor considers the server unavailable. */
+#define TFW_STATS_SRV_F_SUSPENDED	0x0002
+/* The server is ejected as an outlier. */
+#define TFW_STATS_SRV_F_EJECTED		0x0004
+
+/**
+ * @magic		- TFW_STATS_MAGIC;
+ * @version		- TFW_STATS_VERSION;
+ * @hdr_len		- Size of the header, the first record follows it;
+ * @srv_len		- Size of a server record;
+ * @srv_n		- Number of server records;
+ * @vhost_len		- Size of a vhost location record;
+ * @vhost_n		- Number of vhost location records, they follow
+ *			  the server records;
+ * @lat_enabled		- 'perfstat_latency' is on and @lat is collected;
+ * @ts			- Snapshot time, nanoseconds since the Epoch;
+ * @perf		- Common statistics summed over all the CPUs;
+ * @lat			- Stage latency histograms summed over all the CPUs;
+ * @skb_in_flight	- Socket buffers allocated in the system;
+ * @warmup_sent		- Cache warm-up URLs requested;
+ * @warmup_total	- Cache warm-up URLs in the list.
+ */
+typedef struct {
+	__u32		magic;
+	__u32		version;
+	__u32		hdr_len;
+	__u32		srv_len;
+	__u32		srv_n;
+	__u32		vhost_len;
+	__u32		vhost_n;
+	__u32		lat_enabled;
+	__u64		ts;
+	TfwPerfStat	perf;
+	TfwLatStat	lat;
+	__u64		skb_in_flight;
+	__u64		warmup_sent;
+	__u64		warmup_total;
+} TfwStatsHdr;
+
+/**
+ * Statistics of a server, the response and queue times are in milliseconds.
+ *
+ * @sg_name	- Server group name, truncated if it's longer;
+ * @addr	- IPv6 or IPv4-mapped server address;
+ * @port	- Server port in host byte order;
+ * @flags	- TFW_STATS_SRV_F_* flags;
+ * @conn_n	- Number of connections to the server;
+ * @conn_sched	- Number of connections available for scheduling;
+ * @conn_parked	- Number of parked connections;
+ * @max_qsize	- Maximum forwarding queue size of a connection;
+ * @qsize	- Total size of the connection forwarding queues;
+ * @qtime	- Average time of requests in the local queues;
+ * @rtime	- Response times, see TFW_STATS_RTIME_N;
+ * @rtail	- Tail percentiles of response times, see TFW_STATS_RTAIL_N;
+ * @sess_n	- Number of sessions pinned to the server.
+ */
+typedef struct {
+	char		sg_name[TFW_STATS_SG_NAME_LEN];
+	__u8		addr[16];
+	__u16		port;
+	__u16		flags;
+	__u32		conn_n;
+	__u32		conn_sched;
+	__u32		conn_parked;
+	__u32		max_qsize;
+	__u32		qsize;
+	__u32		qtime;
+	__u32		rtime[TFW_STATS_RTIME_N];
+	__u32		rtail[TFW_STATS_RTAIL_N];
+	__u64		sess_n;
+} TfwStatsSrv;
+
+/**
+ * Statistics of a vhost location. The vhost totals are the sum of its
+ * location records.
+ *
+ * @vhost	- Vhost name, truncated if it's longer;
+ * @loc		- Location as "<op> <arg>", e.g. "prefix /static", truncated
+ *		  if it's longer, empty for the vhost default location;
+ * @stat	- Traffic of the location summed over all the CPUs.
+ */
+typedef struct {
+	char		vhost[TFW_STATS_VHOST_NAME_LEN];
+	char		loc[TFW_STATS_LOC_NAME_LEN];
+	TfwVhostStat	stat;
+} TfwStatsVhost;
+
+#endif /* __TFW_PROCFS_IF_H__ */
@@ -0,0 +1,799 @@
+/**
+ *		Tempesta FW
+ *
+ * Regular expressions compiled to DFA.
+ *
+ * A regular expression is parsed into a Thompson NFA which is converted into
+ * a DFA by subset construction at configuration time. The DFA transition
+ * table is indexed by byte equivalence classes, so it's compact, and is
+ * walked over chunks of a TfwStr without copying them. Matching is linear in
+ * the string length and doesn't depend on the expression, since the number
+ * of DFA states is bounded at compilation time: expressions producing too
+ * many states are rejected, so there are no backtracking or state explosion
+ * at run time whatever the input is.
+ *
+ * Supported syntax is a subset of POSIX ERE:
+ *   - literal characters and escapes: \t, \n, \r, \f, \v, \xHH, \<punct>;
+ *   - any character '.', bracket expressions '[a-z_]', '[^0-9]';
+ *   - character classes \d, \D, \w, \W, \s, \S;
+ *   - groups '(...)' and '(?:...)', alternation '|';
+ *   - quantifiers '*', '+', '?', '{m}', '{m,}', '{m,n}';
+ *   - anchors '^' and '$' at the beginning and the end of the expression.
+ * The expression matches a substring of a string unless it's anchored.
+ * Matching is case-insensitive as all other HTTP table comparisons.
+ *
+ * Copyright (C) 2024 Tempesta Technologies, INC.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <linux/bitmap.h>
+#include <linux/ctype.h>
+#include <linux/jhash.h>
+#include <linux/slab.h>
+
+#include "log.h"
+#include "regex.h"
+
+/* Limits of NFA and DFA sizes. */
+#define TFW_RE_NFA_MAX		2048
+#define TFW_RE_DFA_MAX		1024
+/* Max bound of '{m,n}' quantifier. */
+#define TFW_RE_REP_MAX		64
+/* Max nesting of groups. */
+#define TFW_RE_DEPTH_MAX	32
+
+/* Dead and start states of DFA. */
+#define TFW_RE_S_DEAD		0
+#define TFW_RE_S_START		1
+
+enum {
+	TFW_RE_N_EPS,
+	TFW_RE_N_SPLIT,
+	TFW_RE_N_SET,
+	TFW_RE_N_MATCH,
+};
+
+/**
+ * NFA node.
+ *
+ * @set		- Bytes leading to @out for TFW_RE_N_SET node;
+ * @out		- Next node;
+ * @out1	- Alternative next node for TFW_RE_N_SPLIT node;
+ * @type	- Node type.
+ */
+typedef struct {
+	DECLARE_BITMAP(set, 256);
+	int		out;
+	int		out1;
+	int		type;
+} TfwReNode;
+
+/* NFA fragment with the start node and the end node to be patched. */
+typedef struct {
+	int		s;
+	int		e;
+} TfwReFrag;
+
+typedef struct {
+	const char	*p;
+	const char	*end;
+	const char	*err;
+	TfwReNode	*nfa;
+	int		n;
+	int		depth;
+} TfwReParser;
+
+/**
+ * Compiled expression.
+ *
+ * @next	- Transition table, @ncls states for each DFA state;
+ * @acc		- Accepting DFA states;
+ * @ncls	- Number of byte equivalence classes;
+ * @eol		- The expression is anchored at the end of a string;
+ * @cls		- Byte equivalence classes.
+ */
+struct tfw_regex_t {
+	unsigned short	*next;
+	unsigned char	*acc;
+	unsigned int	ncls;
+	bool		eol;
+	unsigned char	cls[256];
+};
+
+static int tfw_re_parse_alt(TfwReParser *rp, TfwReFrag *f);
+
+static int
+tfw_re_err(TfwReParser *rp, const char *err)
+{
+	rp->err = err;
+	return -EINVAL;
+}
+
+static int
+tfw_re_node(TfwReParser *rp, int type, int out, int out1)
+{
+	TfwReNode *nd;
+
+	if (rp->n == TFW_RE_NFA_MAX)
+		return tfw_re_err(rp, "the expression is too large");
+
+	nd = &rp->nfa[rp->n];
+	bitmap_zero(nd->set, 256);
+	nd->type = type;
+	nd->out = out;
+	nd->out1 = out1;
+
+	return rp->n++;
+}
+
+static int
+tfw_re_frag_empty(TfwReParser *rp, TfwReFrag *f)
+{
+	int e;
+
+	if ((e = tfw_re_node(rp, TFW_RE_N_EPS, -1, -1)) < 0)
+		return e;
+	f->s = f->e = e;
+
+	return 0;
+}
+
+static int
+tfw_re_frag_set(TfwReParser *rp, const unsigned long *set, TfwReFrag *f)
+{
+	int s, e;
+
+	if ((e = tfw_re_node(rp, TFW_RE_N_EPS, -1, -1)) < 0)
+		return e;
+	if ((s = tfw_re_node(rp, TFW_RE_N_SET, e, -1)) < 0)
+		return s;
+	bitmap_copy(rp->nfa[s].set, set, 256);
+	f->s = s;
+	f->e = e;
+
+	return 0;
+}
+
+static void
+tfw_re_frag_cat(TfwReParser *rp, TfwReFrag *a, const TfwReFrag *b)
+{
+	rp->nfa[a->e].out = b->s;
+	a->e = b->e;
+}
+
+static int
+tfw_re_frag_alt(TfwReParser *rp, TfwReFrag *a, const TfwReFrag *b)
+{
+	int s, e;
+
+	if ((e = tfw_re_node(rp, TFW_RE_N_EPS, -1, -1)) < 0)
+		return e;
+	if ((s = tfw_re_node(rp, TFW_RE_N_SPLIT, a->s, b->s)) < 0)
+		return s;
+	rp->nfa[a->e].out = e;
+	rp->nfa[b->e].out = e;
+	a->s = s;
+	a->e = e;
+
+	return 0;
+}
+
+/* '*', '+' and '?' quantifiers. */
+static int
+tfw_re_frag_rep(TfwReParser *rp, TfwReFrag *a, char q)
+{
+	int s, e;
+
+	if ((e = tfw_re_node(rp, TFW_RE_N_EPS, -1, -1)) < 0)
+		return e;
+	if ((s = tfw_re_node(rp, TFW_RE_N_SPLIT, a->s, e)) < 0)
+		return s;
+	rp->nfa[a->e].out = q == '?' ? e : s;
+	if (q != '+')
+		a->s = s;
+	a->e = e;
+
+	return 0;
+}
+
+static void
+tfw_re_set_add(unsigned long *set, unsigned char c)
+{
+	__set_bit(c, set);
+	__set_bit(tolower(c), set);
+	__set_bit(toupper(c), set);
+}
+
+static void
+tfw_re_set_range(unsigned long *set, unsigned char lo, unsigned char hi)
+{
+	unsigned int c;
+
+	for (c = lo; c <= hi; ++c)
+		tfw_re_set_add(set, c);
+}
+
+static int
+tfw_re_hex(char c)
+{
+	if (isdigit(c))
+		return c - '0';
+	c = tolower(c);
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/**
+ * Parse an escape sequence after a backslash. Returns the escaped character
+ * or -1 if the sequence is a character class, which is added to @set.
+ */
+static int
+tfw_re_parse_escape(TfwReParser *rp, unsigned long *set)
+{
+	DECLARE_BITMAP(cls, 256);
+	int c, h, l;
+	bool neg;
+
+	if (rp->p == rp->end)
+		return tfw_re_err(rp, "trailing backslash") - 256;
+
+	c = (unsigned char)*rp->p++;
+	neg = isupper(c);
+	bitmap_zero(cls, 256);
+	switch (tolower(c)) {
+	case 'd':
+		tfw_re_set_range(cls, '0', '9');
+		break;
+	case 'w':
+		tfw_re_set_range(cls, '0', '9');
+		tfw_re_set_range(cls, 'a', 'z');
+		__set_bit('_', cls);
+		break;
+	case 's':
+		__set_bit(' ', cls);
+		tfw_re_set_range(cls, '\t', '\r');
+		break;
+	case 't':
+		return c == 't' ? '\t' : c;
+	case 'n':
+		return c == 'n' ? '\n' : c;
+	case 'r':
+		return c == 'r' ? '\r' : c;
+	case 'f':
+		return c == 'f' ? '\f' : c;
+	case 'v':
+		return c == 'v' ? '\v' : c;
+	case 'x':
+		if (c != 'x')
+			return c;
+		if (rp->end - rp->p < 2
+		    || (h = tfw_re_hex(rp->p[0])) < 0
+		    || (l = tfw_re_hex(rp->p[1])) < 0)
+			return tfw_re_err(rp, "bad \\x escape") - 256;
+		rp->p += 2;
+		return (h << 4) | l;
+	default:
+		if (isalnum(c))
+			return tfw_re_err(rp, "unsupported escape") - 256;
+		return c;
+	}
+
+	if (neg)
+		bitmap_complement(cls, cls, 256);
+	bitmap_or(set, set, cls, 256);
+
+	return -1;
+}
+
+/* Parse a bracket expression after '['. */
+static int
+tfw_re_parse_class(TfwReParser *rp, unsigned long *set)
+{
+	bool neg = false, first = true;
+	int lo, hi;
+
+	if (rp->p < rp->end && *rp->p == '^') {
+		neg = true;
+		rp->p++;
+	}
+	while (rp->p < rp->end && (*rp->p != ']' || first)) {
+		first = false;
+		lo = (unsigned char)*rp->p++;
+		if (lo == '\\' && (lo = tfw_re_parse_escape(rp, set)) < 0) {
+			if (lo < -1)
+				return -EINVAL;
+			continue;
+		}
+		if (rp->end - rp->p < 2 || rp->p[0] != '-' || rp->p[1] == ']') {
+			tfw_re_set_add(set, lo);
+			continue;
+		}
+		rp->p++;
+		hi = (unsigned char)*rp->p++;
+		if (hi == '\\' && (hi = tfw_re_parse_escape(rp, set)) < 0)
+			return hi < -1 ? -EINVAL
+				       : tfw_re_err(rp, "bad range end");
+		if (hi < lo)
+			return tfw_re_err(rp, "bad range");
+		tfw_re_set_range(set, lo, hi);
+	}
+	if (rp->p == rp->end)
+		return tfw_re_err(rp, "unterminated bracket expression");
+	rp->p++;
+
+	if (neg)
+		bitmap_complement(set, set, 256);
+
+	return 0;
+}
+
+static int
+tfw_re_parse_atom(TfwReParser *rp, TfwReFrag *f)
+{
+	DECLARE_BITMAP(set, 256);
+	int c, r;
+
+	bitmap_zero(set, 256);
+	c = (unsigned char)*rp->p++;
+	switch (c) {
+	case '(':
+		if (++rp->depth > TFW_RE_DEPTH_MAX)
+			return tfw_re_err(rp, "too deep nesting of groups");
+		if (rp->end - rp->p >= 2 && rp->p[0] == '?' && rp->p[1] == ':')
+			rp->p += 2;
+		if ((r = tfw_re_parse_alt(rp, f)))
+			return r;
+		if (rp->p == rp->end || *rp->p != ')')
+			return tfw_re_err(rp, "missing ')'");
+		rp->p++;
+		rp->depth--;
+		return 0;
+	case '[':
+		if ((r = tfw_re_parse_class(rp, set)))
+			return r;
+		break;
+	case '.':
+		bitmap_fill(set, 256);
+		break;
+	case '\\':
+		if ((c = tfw_re_parse_escape(rp, set)) < -1)
+			return -EINVAL;
+		if (c >= 0)
+			tfw_re_set_add(set, c);
+		break;
+	case '*':
+	case '+':
+	case '?':
+	case '{':
+		return tfw_re_err(rp, "quantifier without an operand");
+	case '^':
+	case '$':
+		return tfw_re_err(rp, "anchors are allowed only at the "
+				      "beginning and the end");
+	default:
+		tfw_re_set_add(set, c);
+	}
+
+	return tfw_re_frag_set(rp, set, f);
+}
+
+static int
+tfw_re_parse_num(TfwReParser *rp, int *n)
+{
+	*n = 0;
+	if (rp->p == rp->end || !isdigit(*rp->p))
+		return -EINVAL;
+	while (rp->p < rp->end && isdigit(*rp->p)) {
+		*n = *n * 10 + *rp->p++ - '0';
+		if (*n > TFW_RE_REP_MAX)
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* Parse a bounded quantifier after '{'. @max is -1 for infinity. */
+static int
+tfw_re_parse_bounds(TfwReParser *rp, int *min, int *max)
+{
+	if (tfw_re_parse_num(rp, min))
+		goto err;
+	*max = *min;
+	if (rp->p < rp->end && *rp->p == ',') {
+		rp->p++;
+		if (rp->p < rp->end && *rp->p == '}')
+			*max = -1;
+		else if (tfw_re_parse_num(rp, max) || *max < *min)
+			goto err;
+	}
+	if (rp->p == rp->end || *rp->p != '}')
+		goto err;
+	rp->p++;
+
+	return 0;
+err:
+	return tfw_re_err(rp, "bad bounded quantifier");
+}
+
+/*
+ * Expand 'a{m,n}' into 'aa..a' (m times) followed by 'a?a?..' (n - m times)
+ * or by 'a*'. Each copy of the atom is parsed again from @atom.
+ */
+static int
+tfw_re_expand_bounds(TfwReParser *rp, const char *atom, int min, int max,
+		     TfwReFrag *f)
+{
+	const char *p = rp->p;
+	TfwReFrag a;
+	int i, r;
+
+	if ((r = tfw_re_frag_empty(rp, f)))
+		return r;
+	for (i = 0; i < (max < 0 ? min + 1 : max); ++i) {
+		rp->p = atom;
+		if ((r = tfw_re_parse_atom(rp, &a)))
+			return r;
+		if (i >= min && (r = tfw_re_frag_rep(rp, &a, max < 0 ? '*'
+								   : '?')))
+			return r;
+		tfw_re_frag_cat(rp, f, &a);
+	}
+	rp->p = p;
+
+	return 0;
+}
+
+static int
+tfw_re_parse_rep(TfwReParser *rp, TfwReFrag *f)
+{
+	const char *atom = rp->p;
+	int r, min, max;
+
+	if ((r = tfw_re_parse_atom(rp, f)))
+		return r;
+
+	while (rp->p < rp->end) {
+		switch (*rp->p) {
+		case '*':
+		case '+':
+		case '?':
+			if ((r = tfw_re_frag_rep(rp, f, *rp->p++)))
+				return r;
+			break;
+		case '{':
+			rp->p++;
+			if ((r = tfw_re_parse_bounds(rp, &min, &max)))
+				return r;
+			if ((r = tfw_re_expand_bounds(rp, atom, min, max, f)))
+				return r;
+			break;
+		default:
+			return 0;
+		}
+		/* Apply following quantifiers to the whole repetition. */
+		atom = NULL;
+		if (rp->p < rp->end && *rp->p == '{')
+			return tfw_re_err(rp, "nested bounded quantifiers");
+	}
+
+	return 0;
+}
+
+static int
+tfw_re_parse_cat(TfwReParser *rp, TfwReFrag *f)
+{
+	TfwReFrag a;
+	int r;
+
+	if ((r = tfw_re_frag_empty(rp, f)))
+		return r;
+	while (rp->p < rp->end && *rp->p != '|' && *rp->p != ')') {
+		if ((r = tfw_re_parse_rep(rp, &a)))
+			return r;
+		tfw_re_frag_cat(rp, f, &a);
+	}
+
+	return 0;
+}
+
+static int
+tfw_re_parse_alt(TfwReParser *rp, TfwReFrag *f)
+{
+	TfwReFrag a;
+	int r;
+
+	if ((r = tfw_re_parse_cat(rp, f)))
+		return r;
+	while (rp->p < rp->end && *rp->p == '|') {
+		rp->p++;
+		if ((r = tfw_re_parse_cat(rp, &a)))
+			return r;
+		if ((r = tfw_re_frag_alt(rp, f, &a)))
+			return r;
+	}
+
+	return 0;
+}
+
+/**
+ * Subset construction context.
+ *
+ * @sets	- NFA node sets of DFA states, @w words each;
+ * @htbl	- Hash table of DFA states by their sets, index + 1;
+ * @next	- DFA transition table;
+ * @visited	- Nodes visited by current epsilon closure;
+ * @stack	- Stack of epsilon closure traversal;
+ * @n		- Number of DFA states;
+ * @w		- Size of an NFA node set in words;
+ * @repr	- A byte of each equivalence class.
+ */
+typedef struct {
+	unsigned long	*sets;
+	unsigned int	*htbl;
+	unsigned short	*next;
+	unsigned long	*visited;
+	int		*stack;
+	unsigned int	n;
+	unsigned int	w;
+	unsigned char	repr[256];
+} TfwReDfa;
+
+#define TFW_RE_HTBL_SZ		(TFW_RE_DFA_MAX * 2)
+
+/* Add epsilon closure of node @s to @set. Only SET and MATCH nodes are kept. */
+static void
+tfw_re_closure(const TfwReNode *nfa, TfwReDfa *d, unsigned long *set, int s)
+{
+	int sp = 0;
+
+	d->stack[sp++] = s;
+	while (sp) {
+		s = d->stack[--sp];
+		if (s < 0 || __test_and_set_bit(s, d->visited))
+			continue;
+		switch (nfa[s].type) {
+		case TFW_RE_N_SPLIT:
+			d->stack[sp++] = nfa[s].out1;
+			fallthrough;
+		case TFW_RE_N_EPS:
+			d->stack[sp++] = nfa[s].out;
+			break;
+		default:
+			__set_bit(s, set);
+		}
+	}
+}
+
+/* Find or add a DFA state for NFA node @set. */
+static int
+tfw_re_dfa_state(TfwReDfa *d, const unsigned long *set)
+{
+	size_t sz = d->w * sizeof(long);
+	unsigned int h = jhash(set, sz, 0) % TFW_RE_HTBL_SZ;
+
+	for ( ; d->htbl[h]; h = (h + 1) % TFW_RE_HTBL_SZ)
+		if (!memcmp(&d->sets[(d->htbl[h] - 1) * d->w], set, sz))
+			return d->htbl[h] - 1;
+
+	if (d->n == TFW_RE_DFA_MAX)
+		return -E2BIG;
+	memcpy(&d->sets[d->n * d->w], set, sz);
+	d->htbl[h] = ++d->n;
+
+	return d->n - 1;
+}
+
+static int
+tfw_re_build_dfa(const TfwReNode *nfa, int nfa_n, int start, TfwRegex *re,
+		 TfwReDfa *d)
+{
+	unsigned long *set;
+	unsigned int i, k, x;
+	int s;
+
+	d->w = BITS_TO_LONGS(nfa_n);
+	set = kcalloc(d->w, sizeof(long), GFP_KERNEL);
+	d->sets = kvcalloc(TFW_RE_DFA_MAX, d->w * sizeof(long), GFP_KERNEL);
+	d->htbl = kvcalloc(TFW_RE_HTBL_SZ, sizeof(*d->htbl), GFP_KERNEL);
+	d->next = kvcalloc(TFW_RE_DFA_MAX, re->ncls * sizeof(*d->next),
+			   GFP_KERNEL);
+	d->visited = kcalloc(d->w, sizeof(long), GFP_KERNEL);
+	/* Each node is pushed at most twice: by EPS/SPLIT and by SPLIT. */
+	d->stack = kvcalloc(nfa_n * 2 + 1, sizeof(int), GFP_KERNEL);
+	if (!set || !d->sets || !d->htbl || !d->next || !d->visited
+	    || !d->stack)
+	{
+		s = -ENOMEM;
+		goto out;
+	}
+
+	/* The dead state has an empty set. */
+	tfw_re_dfa_state(d, set);
+	tfw_re_closure(nfa, d, set, start);
+	tfw_re_dfa_state(d, set);
+
+	for (i = TFW_RE_S_START; i < d->n; ++i) {
+		for (k = 0; k < re->ncls; ++k) {
+			const unsigned long *cur = &d->sets[i * d->w];
+
+			bitmap_zero(set, nfa_n);
+			bitmap_zero(d->visited, nfa_n);
+			for_each_set_bit(x, cur, nfa_n)
+				if (nfa[x].type == TFW_RE_N_SET
+				    && test_bit(d->repr[k], nfa[x].set))
+					tfw_re_closure(nfa, d, set, nfa[x].out);
+			if ((s = tfw_re_dfa_state(d, set)) < 0)
+				goto out;
+			d->next[i * re->ncls + k] = s;
+		}
+	}
+	s = 0;
+out:
+	kfree(set);
+	kfree(d->visited);
+
+	return s;
+}
+
+/*
+ * Split all bytes into classes such that bytes of a class are either all in
+ * or all out of any node set, so transitions are the same for them.
+ */
+static void
+tfw_re_build_classes(const TfwReNode *nfa, int n, TfwRegex *re, TfwReDfa *d)
+{
+	short map[256 * 2];
+	unsigned int c, k, ncls = 1;
+	int i;
+
+	memset(re->cls, 0, sizeof(re->cls));
+	for (i = 0; i < n; ++i) {
+		if (nfa[i].type != TFW_RE_N_SET)
+			continue;
+		memset(map, 0xff, sizeof(map));
+		for (c = 0, ncls = 0; c < 256; ++c) {
+			k = re->cls[c] * 2 + !!test_bit(c, nfa[i].set);
+			if (map[k] < 0)
+				map[k] = ncls++;
+			re->cls[c] = map[k];
+		}
+	}
+	re->ncls = ncls;
+	for (c = 256; c--; )
+		d->repr[re->cls[c]] = c;
+}
+
+/**
+ * Compile regular expression @re of length @len. The compiled expression is
+ * allocated from @pool. Returns an error pointer on failure.
+ */
+TfwRegex *
+tfw_regex_compile(const char *re, size_t len, TfwPool *pool)
+{
+	TfwReParser rp = { .p = re, .end = re + len };
+	TfwReDfa d = { 0 };
+	TfwRegex tmp = { 0 }, *rx = ERR_PTR(-EINVAL);
+	TfwReFrag f, any;
+	DECLARE_BITMAP(set, 256);
+	bool bol = false;
+	unsigned int i;
+	int r, m;
+
+	if (len && *rp.p == '^') {
+		bol = true;
+		rp.p++;
+	}
+	if (rp.end > rp.p && rp.end[-1] == '$'
+	    && (rp.end - rp.p < 2 || rp.end[-2] != '\\'))
+	{
+		tmp.eol = true;
+		rp.end--;
+	}
+
+	if (!(rp.nfa = kvmalloc_array(TFW_RE_NFA_MAX, sizeof(TfwReNode),
+				      GFP_KERNEL)))
+		return ERR_PTR(-ENOMEM);
+
+	if ((r = tfw_re_parse_alt(&rp, &f)))
+		goto err;
+	if (rp.p != rp.end) {
+		r = tfw_re_err(&rp, "unmatched ')'");
+		goto err;
+	}
+	if ((m = tfw_re_node(&rp, TFW_RE_N_MATCH, -1, -1)) < 0) {
+		r = m;
+		goto err;
+	}
+	rp.nfa[f.e].out = m;
+	/* Unanchored expression is prepended by '.*'. */
+	if (!bol) {
+		bitmap_fill(set, 256);
+		if ((r = tfw_re_frag_set(&rp, set, &any))
+		    || (r = tfw_re_frag_rep(&rp, &any, '*')))
+			goto err;
+		tfw_re_frag_cat(&rp, &any, &f);
+		f = any;
+	}
+
+	tfw_re_build_classes(rp.nfa, rp.n, &tmp, &d);
+	if ((r = tfw_re_build_dfa(rp.nfa, rp.n, f.s, &tmp, &d))) {
+		if (r == -E2BIG)
+			r = tfw_re_err(&rp, "too many DFA states");
+		goto err_dfa;
+	}
+
+	rx = tfw_pool_alloc(pool, sizeof(TfwRegex) + d.n
+				  + d.n * tmp.ncls * sizeof(*d.next));
+	if (!rx) {
+		rx = ERR_PTR(-ENOMEM);
+		goto err_dfa;
+	}
+	*rx = tmp;
+	rx->next = (unsigned short *)(rx + 1);
+	memcpy(rx->next, d.next, d.n * tmp.ncls * sizeof(*d.next));
+	rx->acc = (unsigned char *)(rx->next + d.n * tmp.ncls);
+	for (i = 0; i < d.n; ++i)
+		rx->acc[i] = test_bit(m, &d.sets[i * d.w]);
+	T_DBG("regex: '%.*s' compiled to %u states, %u classes\n",
+	      (int)len, re, d.n, tmp.ncls);
+err_dfa:
+	kvfree(d.sets);
+	kvfree(d.htbl);
+	kvfree(d.next);
+	kvfree(d.stack);
+err:
+	if (rp.err) {
+		T_ERR_NL("regex: bad expression '%.*s': %s\n", (int)len, re,
+			 rp.err);
+		rx = ERR_PTR(-EINVAL);
+	}
+	else if (r == -ENOMEM) {
+		rx = ERR_PTR(-ENOMEM);
+	}
+	kvfree(rp.nfa);
+
+	return rx;
+}
+
+/**
+ * Match @str against compiled expression @re. The string is scanned once,
+ * chunk by chunk.
+ */
+bool
+tfw_regex_match(const TfwRegex *re, const TfwStr *str)
+{
+	const TfwStr *c, *end;
+	unsigned int st = TFW_RE_S_START;
+	size_t i;
+
+	if (re->acc[st] && !re->eol)
+		return true;
+
+	TFW_STR_FOR_EACH_CHUNK(c, str, end) {
+		for (i = 0; i < c->len; ++i) {
+			unsigned char k = re->cls[(unsigned char)c->data[i]];
+
+			st = re->next[st * re->ncls + k];
+			if (st == TFW_RE_S_DEAD)
+				return false;
+			/* The rest of unanchored string doesn't matter. */
+			if (re->acc[st] && !re->eol)
+				return true;
+		}
+	}
+
+	return re->acc[st];
+}
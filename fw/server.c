@@ -22,12 +22,14 @@
  */
 #include <linux/slab.h>
 #include <linux/rwsem.h>
+#include <linux/sort.h>
 
 #include "lib/hash.h"
 #include "apm.h"
 #include "client.h"
 #include "log.h"
 #include "server.h"
+#include "stress.h"
 
 /* Use SLAB for frequent server allocations in forward proxy mode. */
 static struct kmem_cache *srv_cache;
@@ -63,7 +65,7 @@ static atomic64_t act_sg_n = ATOMIC64_INIT(0);
  * When a server connection is scheduled for connect it increments server's
  * reference count and decrements it after intended disconnect.
  */
-#define TFW_SG_HBITS	10
+#define TFW_SG_HBITS	14
 static DECLARE_HASHTABLE(sg_hash, TFW_SG_HBITS);
 static DECLARE_HASHTABLE(sg_hash_reconfig, TFW_SG_HBITS);
 /*
@@ -81,6 +83,7 @@ tfw_server_destroy(TfwServer *srv)
 	/* Close all connections before freeing the server! */
 	BUG_ON(!list_empty(&srv->conn_list));
 	BUG_ON(timer_pending(&srv->gs_timer));
+	BUG_ON(timer_pending(&srv->scale_timer));
 
 	tfw_apm_del_srv(srv);
 	if (srv->sg)
@@ -98,6 +101,7 @@ tfw_server_create(const TfwAddr *addr)
 	tfw_peer_init((TfwPeer *)srv, addr);
 	INIT_LIST_HEAD(&srv->list);
 	atomic64_set(&srv->refcnt, 1);
+	spin_lock_init(&srv->pipe.lock);
 
 	return srv;
 }
@@ -141,6 +145,407 @@ tfw_server_stop_sched(TfwServer *srv)
 		srv->sg->sched->del_srv(srv);
 }
 
+/*
+ * Passive outlier detection.
+ *
+ * Servers are ejected from scheduling, basing on live responses only, if
+ * they respond with 5xx errors @consec times in a row, or if the rate of
+ * 5xx responses during an interval is above @err_rate, or if the average
+ * response time during an interval is @latency times higher than the
+ * median among the group servers. The first check is done right in the
+ * response path, the others are done by a per-group work each interval.
+ *
+ * A server is ejected for @eject_time seconds, and the time is doubled on
+ * each subsequent ejection up to 2^TFW_SRV_OUTLIER_BACKOFF_MAX times. The
+ * backoff exponent is decreased if the server stays healthy for @eject_time
+ * seconds after the restoration. Not more than @max_eject percent of the
+ * group servers can be ejected at once, so a group of a single server is
+ * never ejected.
+ *
+ * The ejection is independent from the health monitor suspension: the
+ * health monitor never restores an ejected server and vice versa.
+ */
+#define TFW_SG_OUTLIER_INTVL		HZ
+#define TFW_SRV_OUTLIER_MIN_RESP	16
+#define TFW_SRV_OUTLIER_BACKOFF_MAX	5
+
+static bool
+tfw_srv_outlier_eject(TfwServer *srv, const char *reason)
+{
+	TfwSrvGroup *sg = srv->sg;
+	TfwSrvOutlier *ol = &srv->outlier;
+	unsigned int shift;
+	size_t max = sg->srv_n * sg->outlier.max_eject / 100;
+
+	if (test_bit(TFW_SRV_B_EJECT, &srv->flags))
+		return false;
+	if (atomic_inc_return(&sg->outlier_n) > max) {
+		atomic_dec(&sg->outlier_n);
+		return false;
+	}
+
+	shift = min_t(unsigned int, READ_ONCE(ol->eject_n),
+		      TFW_SRV_OUTLIER_BACKOFF_MAX);
+	WRITE_ONCE(ol->jtill, jiffies
+		   + ((unsigned long)sg->outlier.eject_time * HZ << shift));
+	if (test_and_set_bit(TFW_SRV_B_EJECT, &srv->flags)) {
+		atomic_dec(&sg->outlier_n);
+		return false;
+	}
+	WRITE_ONCE(ol->eject_n, shift + 1);
+	atomic_set(&ol->cons_err, 0);
+
+	T_WARN_ADDR(reason, &srv->addr, TFW_WITH_PORT);
+
+	return true;
+}
+
+static void
+tfw_srv_outlier_restore(TfwServer *srv)
+{
+	TfwSrvOutlier *ol = &srv->outlier;
+
+	atomic_set(&ol->cons_err, 0);
+	WRITE_ONCE(ol->jtill, jiffies
+		   + (unsigned long)srv->sg->outlier.eject_time * HZ);
+	clear_bit(TFW_SRV_B_EJECT, &srv->flags);
+	atomic_dec(&srv->sg->outlier_n);
+
+	T_LOG_ADDR("outlier server has been restored", &srv->addr,
+		   TFW_WITH_PORT);
+}
+
+void
+__tfw_srv_outlier_update(TfwServer *srv, int status, unsigned long jrtt)
+{
+	TfwSrvOutlier *ol = &srv->outlier;
+	unsigned int consec = READ_ONCE(srv->sg->outlier.consec);
+
+	atomic_inc(&ol->resp_n);
+	atomic_add(jrtt, &ol->jrtt);
+
+	if (status < 500) {
+		if (atomic_read(&ol->cons_err))
+			atomic_set(&ol->cons_err, 0);
+		return;
+	}
+
+	atomic_inc(&ol->err_n);
+	if (consec && atomic_inc_return(&ol->cons_err) >= consec)
+		tfw_srv_outlier_eject(srv, "outlier server has been ejected: "
+				      "too many subsequent 5xx responses");
+}
+
+static int
+tfw_srv_outlier_rtt_cmp(const void *l, const void *r)
+{
+	unsigned int a = *(unsigned int *)l, b = *(unsigned int *)r;
+
+	return a < b ? -1 : a > b;
+}
+
+/*
+ * Collect the interval statistics of all the group servers, compute the
+ * median response time and eject or restore the servers. Servers with too
+ * few responses during the interval aren't judged by the rates.
+ */
+static void
+__tfw_sg_outlier_check(TfwSrvGroup *sg)
+{
+	TfwSgOutlier *cfg = &sg->outlier;
+	TfwServer *srv;
+	unsigned int *rtt, n = 0, med = 0, ejected = 0;
+
+	rtt = kmalloc_array(sg->srv_n, sizeof(*rtt), GFP_KERNEL);
+
+	list_for_each_entry(srv, &sg->srv_list, list) {
+		TfwSrvOutlier *ol = &srv->outlier;
+		unsigned int resp_n = atomic_xchg(&ol->resp_n, 0);
+		unsigned int err_n = atomic_xchg(&ol->err_n, 0);
+		unsigned int jrtt = atomic_xchg(&ol->jrtt, 0);
+
+		ol->err_pct = ol->rtt = 0;
+		if (test_bit(TFW_SRV_B_EJECT, &srv->flags)) {
+			++ejected;
+			continue;
+		}
+		if (resp_n < TFW_SRV_OUTLIER_MIN_RESP)
+			continue;
+		ol->err_pct = err_n * 100 / resp_n;
+		ol->rtt = div_u64((u64)jrtt * USEC_PER_SEC / HZ, resp_n);
+		if (rtt && n < sg->srv_n)
+			rtt[n++] = ol->rtt;
+	}
+	atomic_set(&sg->outlier_n, ejected);
+
+	/* The median makes sense only among at least 3 servers. */
+	if (cfg->latency && n >= 3) {
+		sort(rtt, n, sizeof(*rtt), tfw_srv_outlier_rtt_cmp, NULL);
+		/* Don't eject servers for the jiffies resolution jitter. */
+		med = max(rtt[n / 2], jiffies_to_usecs(1));
+	}
+	kfree(rtt);
+
+	list_for_each_entry(srv, &sg->srv_list, list) {
+		TfwSrvOutlier *ol = &srv->outlier;
+
+		cond_resched();
+
+		if (test_bit(TFW_SRV_B_EJECT, &srv->flags)) {
+			if (!cfg->eject_time
+			    || time_after_eq(jiffies, READ_ONCE(ol->jtill)))
+				tfw_srv_outlier_restore(srv);
+			continue;
+		}
+		if (!cfg->eject_time)
+			continue;
+
+		if (cfg->err_rate && ol->err_pct >= cfg->err_rate
+		    && tfw_srv_outlier_eject(srv, "outlier server has been"
+					     " ejected: too high rate of 5xx"
+					     " responses"))
+			continue;
+		if (med && ol->rtt > (unsigned long)med * cfg->latency
+		    && tfw_srv_outlier_eject(srv, "outlier server has been"
+					     " ejected: too slow responses"))
+			continue;
+
+		/* The server is healthy long enough, decrease the backoff. */
+		if (ol->eject_n && time_after(jiffies, READ_ONCE(ol->jtill))) {
+			WRITE_ONCE(ol->eject_n, ol->eject_n - 1);
+			WRITE_ONCE(ol->jtill, jiffies
+				   + (unsigned long)cfg->eject_time * HZ);
+		}
+	}
+}
+
+static void
+tfw_sg_outlier_work(struct work_struct *work)
+{
+	TfwSrvGroup *sg = container_of(to_delayed_work(work), TfwSrvGroup,
+				       outlier_work);
+
+	/*
+	 * The group servers list is changed under the write lock, which is
+	 * also held while the work is cancelled, so don't wait for it.
+	 */
+	if (!down_read_trylock(&sg_sem))
+		goto resched;
+	__tfw_sg_outlier_check(sg);
+	up_read(&sg_sem);
+
+	if (!READ_ONCE(sg->outlier.eject_time))
+		return;
+resched:
+	schedule_delayed_work(&sg->outlier_work, TFW_SG_OUTLIER_INTVL);
+}
+
+/**
+ * Start passive outlier detection for the group if it's enabled, or restore
+ * servers ejected before the detection was disabled by reconfiguration.
+ */
+void
+tfw_sg_start_outlier(TfwSrvGroup *sg)
+{
+	if (sg->outlier.eject_time || atomic_read(&sg->outlier_n))
+		schedule_delayed_work(&sg->outlier_work, TFW_SG_OUTLIER_INTVL);
+}
+
+/*
+ * Adaptive concurrency limit.
+ *
+ * Requests are admitted to the group only while the number of requests
+ * forwarded to it and not answered yet is below the limit, the others are
+ * rejected, so backends aren't driven into collapse by the queues growing
+ * on their side. The limit is adjusted each TFW_SG_CLIMIT_INTVL by the
+ * AIMD rule against the baseline, the lowest average response time of an
+ * interval. The limit is cut by 10% if the average response time exceeds
+ * the baseline by more than @tolerance percent or if the servers report
+ * overload with 503 or 504 responses. Otherwise the limit grows by its
+ * square root, but only if the group has been loaded by at least a half
+ * of the limit during the interval, so an idle group doesn't raise it.
+ *
+ * The baseline is learnt again each TFW_SG_CLIMIT_RTT_RESET intervals to
+ * follow the changes of the backends. The intervals are closed right in
+ * the response path by the first CPU seeing the interval expired.
+ */
+#define TFW_SG_CLIMIT_INTVL		(HZ / 10)
+#define TFW_SG_CLIMIT_MIN_RESP		8
+#define TFW_SG_CLIMIT_RTT_RESET		300
+
+static void
+__tfw_sg_climit_update(TfwSrvGroup *sg)
+{
+	TfwSgClimit *cfg = &sg->climit;
+	TfwSgClimitState *st = &sg->climit_st;
+	unsigned int resp_n = atomic_xchg(&st->resp_n, 0);
+	unsigned int err_n = atomic_xchg(&st->err_n, 0);
+	unsigned int jrtt = atomic_xchg(&st->jrtt, 0);
+	unsigned int peak = atomic_xchg(&st->peak, 0);
+	unsigned int rtt = 0, limit = READ_ONCE(st->limit) ? : cfg->max;
+	u64 base;
+
+	WRITE_ONCE(st->jwin, jiffies + TFW_SG_CLIMIT_INTVL);
+	limit = clamp(limit, cfg->min, cfg->max);
+	if (resp_n < TFW_SG_CLIMIT_MIN_RESP && !err_n)
+		goto done;
+
+	if (resp_n) {
+		rtt = div_u64((u64)jrtt * USEC_PER_SEC / HZ, resp_n);
+		if (!st->min_rtt || rtt < st->min_rtt
+		    || ++st->win_n >= TFW_SG_CLIMIT_RTT_RESET)
+		{
+			st->min_rtt = rtt;
+			st->win_n = 0;
+		}
+	}
+	/* Don't cut the limit for the jiffies resolution jitter. */
+	base = max(st->min_rtt, jiffies_to_usecs(1));
+
+	if (err_n || rtt * 100ULL > base * (100 + cfg->tolerance)) {
+		if (limit > cfg->min) {
+			limit = max(cfg->min, limit * 9 / 10);
+			tfw_stress_account_srv();
+		}
+	} else if (peak >= limit / 2) {
+		limit = min_t(unsigned int, cfg->max,
+			      limit + max(int_sqrt(limit), 1UL));
+	}
+done:
+	WRITE_ONCE(st->limit, limit);
+}
+
+/**
+ * Account a request forwarded to @sg. Return false if the group is loaded
+ * up to the limit and the request must be rejected.
+ */
+bool
+tfw_sg_climit_get(TfwSrvGroup *sg)
+{
+	TfwSgClimitState *st = &sg->climit_st;
+	unsigned int limit = READ_ONCE(st->limit) ? : READ_ONCE(sg->climit.max);
+	int n = atomic_inc_return(&st->inflight);
+
+	if (n > min(limit, READ_ONCE(sg->climit.max))) {
+		atomic_dec(&st->inflight);
+		return false;
+	}
+	if (n > atomic_read(&st->peak))
+		atomic_set(&st->peak, n);
+
+	return true;
+}
+
+/**
+ * Account the end of a request accounted by tfw_sg_climit_get(). @status
+ * and @jrtt are the response status and the server time, @status is zero
+ * if the request isn't answered by the servers.
+ */
+void
+tfw_sg_climit_put(TfwSrvGroup *sg, int status, unsigned long jrtt)
+{
+	TfwSgClimitState *st = &sg->climit_st;
+
+	atomic_dec(&st->inflight);
+	if (!status)
+		return;
+
+	atomic_inc(&st->resp_n);
+	atomic_add(jrtt, &st->jrtt);
+	if (status == 503 || status == 504)
+		atomic_inc(&st->err_n);
+
+	if (time_before(jiffies, READ_ONCE(st->jwin))
+	    || !spin_trylock(&st->lock))
+		return;
+	if (time_after_eq(jiffies, st->jwin) && tfw_sg_climit_enabled(sg))
+		__tfw_sg_climit_update(sg);
+	spin_unlock(&st->lock);
+}
+
+/*
+ * Adaptive pipelining depth of HTTP/1.1 server connections.
+ *
+ * Pipelining saves round trips to fast servers, but a slow request delays
+ * all the requests pipelined after it in the same connection. So the number
+ * of requests in flight in a connection is limited per server, and the limit
+ * is adjusted each TFW_SRV_PIPE_INTVL by the AIMD rule. The depth is halved
+ * if the requests spend more than @hol percent of the server time waiting
+ * for the responses to the previous requests in the same connection, or if
+ * the APM 99th percentile of the server response time exceeds the median
+ * more than @tail times, i.e. the server has slow requests behind which
+ * the others get stuck. Otherwise the depth grows by one while connections
+ * of the server are loaded up to the depth. The intervals are closed right
+ * in the response path as for the concurrency limit.
+ */
+#define TFW_SRV_PIPE_INTVL		(HZ / 10)
+#define TFW_SRV_PIPE_MIN_RESP		8
+
+static void
+__tfw_srv_pipe_adapt(TfwServer *srv)
+{
+	TfwSgPipe *cfg = &srv->sg->pipe;
+	TfwSrvPipe *p = &srv->pipe;
+	unsigned int resp_n = atomic_xchg(&p->resp_n, 0);
+	unsigned int peak = atomic_xchg(&p->peak, 0);
+	unsigned int jsrv = atomic_xchg(&p->jsrv, 0);
+	unsigned int jhol = atomic_xchg(&p->jhol, 0);
+	unsigned int depth = min(p->depth ? : cfg->max, cfg->max);
+	unsigned int val[T_PSZ] = { 0 };
+	TfwPrcntlStats pstats = {
+		.ith = tfw_pstats_ith,
+		.val = val,
+	};
+
+	WRITE_ONCE(p->jwin, jiffies + TFW_SRV_PIPE_INTVL);
+	if (resp_n < TFW_SRV_PIPE_MIN_RESP)
+		goto done;
+
+	tfw_apm_stats(srv->apmref, &pstats);
+	if ((u64)jhol * 100 > (u64)jsrv * cfg->hol
+	    || val[TFW_PSTATS_IDX_P99]
+	       > (u64)max(val[TFW_PSTATS_IDX_P50], 1U) * cfg->tail)
+	{
+		depth = max(depth / 2, 1U);
+	} else if (peak >= depth) {
+		depth = min(depth + 1, cfg->max);
+	}
+done:
+	WRITE_ONCE(p->depth, depth);
+}
+
+/**
+ * Account a response to a request sent to @srv_conn at @jtx and answered
+ * within @jrtt jiffies. HTTP/1.1 responses come in the order of requests,
+ * so the server can't answer a request before the previous response, and
+ * the time before the previous response is the head-of-line delay of
+ * the request. Responses of a connection are processed one by one.
+ */
+void
+__tfw_srv_pipe_update(TfwServer *srv, TfwSrvConn *srv_conn,
+		      unsigned long jtx, unsigned long jrtt)
+{
+	TfwSrvPipe *p = &srv->pipe;
+	unsigned long jresp = srv_conn->jresp;
+	/* The answered request is removed from the queue already. */
+	int qsize = READ_ONCE(srv_conn->qsize) + 1;
+
+	srv_conn->jresp = jtx + jrtt;
+	atomic_inc(&p->resp_n);
+	atomic_add(jrtt, &p->jsrv);
+	if (jresp && time_after(jresp, jtx))
+		atomic_add(min(jresp - jtx, jrtt), &p->jhol);
+	if (qsize > atomic_read(&p->peak))
+		atomic_set(&p->peak, qsize);
+
+	if (time_before(jiffies, READ_ONCE(p->jwin))
+	    || !spin_trylock(&p->lock))
+		return;
+	if (time_after_eq(jiffies, p->jwin))
+		__tfw_srv_pipe_adapt(srv);
+	spin_unlock(&p->lock);
+}
+
 /**
  * Look up Server Group by name, and return it to caller.
  *
@@ -214,6 +619,8 @@ tfw_sg_new(const char *name, unsigned int len, gfp_t flags)
 	INIT_HLIST_NODE(&sg->list);
 	INIT_HLIST_NODE(&sg->list_reconfig);
 	INIT_LIST_HEAD(&sg->srv_list);
+	INIT_DELAYED_WORK(&sg->outlier_work, tfw_sg_outlier_work);
+	spin_lock_init(&sg->climit_st.lock);
 	atomic64_set(&sg->refcnt, 1);
 	sg->nlen = len;
 	memcpy(sg->name, name, name_size);
@@ -362,8 +769,12 @@ tfw_sg_start_sched(TfwSrvGroup *sg, TfwScheduler *sched, void *arg)
 {
 	T_DBG2("Start scheduler '%s' for group '%s'\n", sched->name, sg->name);
 	sg->sched = sched;
-	if (sched->add_grp)
-		return sched->add_grp(sg, arg);
+	if (sched->add_grp) {
+		int r = sched->add_grp(sg, arg);
+		if (r)
+			return r;
+	}
+	tfw_sg_start_outlier(sg);
 
 	return 0;
 }
@@ -373,6 +784,7 @@ tfw_sg_stop_sched(TfwSrvGroup *sg)
 {
 	T_DBG2("Stop scheduler '%s' for group '%s'\n",
 	       (sg->sched ? sg->sched->name : ""), sg->name);
+	cancel_delayed_work_sync(&sg->outlier_work);
 	if (sg->sched && sg->sched->del_grp)
 		sg->sched->del_grp(sg);
 }
@@ -432,6 +844,33 @@ end:
 	return r;
 }
 
+/**
+ * Same as tfw_sg_for_each_srv(), but @cb also gets the server group and @data.
+ */
+int
+tfw_sg_for_each_srv_data(int (*cb)(TfwSrvGroup *sg, TfwServer *srv,
+				   void *data),
+			 void *data)
+{
+	int i, r = 0;
+	TfwSrvGroup *sg;
+	TfwServer *srv, *tmp;
+
+	down_write(&sg_sem);
+	hash_for_each(sg_hash, i, sg, list) {
+		list_for_each_entry_safe(srv, tmp, &sg->srv_list, list) {
+			if ((r = cb(sg, srv, data)))
+				goto end;
+			tfw_srv_loop_sched_rcu();
+		}
+		tfw_srv_loop_sched_rcu();
+	}
+end:
+	up_write(&sg_sem);
+
+	return r;
+}
+
 /**
  * Same as tfw_sg_for_each_srv() but iterates over reconfig server group lists.
  */
@@ -21,6 +21,8 @@
 #ifndef __SERVER_H__
 #define __SERVER_H__
 
+#include <linux/workqueue.h>
+
 #include "addr.h"
 #include "connection.h"
 #include "peer.h"
@@ -38,33 +40,94 @@
 typedef struct tfw_srv_group_t TfwSrvGroup;
 typedef struct tfw_scheduler_t TfwScheduler;
 
+/**
+ * Passive outlier detection state of a server, see tfw_sg_outlier_work().
+ *
+ * @cons_err	- number of subsequent 5xx responses;
+ * @resp_n	- number of responses during the current interval;
+ * @err_n	- number of 5xx responses during the current interval;
+ * @jrtt	- sum of response times during the current interval, jiffies;
+ * @eject_n	- number of recent ejections, the backoff exponent;
+ * @err_pct	- percent of 5xx responses during the last interval;
+ * @rtt		- average response time during the last interval, usecs;
+ * @jtill	- time when the ejection ends or the backoff is decreased;
+ */
+typedef struct {
+	atomic_t		cons_err;
+	atomic_t		resp_n;
+	atomic_t		err_n;
+	atomic_t		jrtt;
+	unsigned int		eject_n;
+	unsigned int		err_pct;
+	unsigned int		rtt;
+	unsigned long		jtill;
+} TfwSrvOutlier;
+
+/**
+ * Adaptive pipelining depth state of a server, see __tfw_srv_pipe_adapt().
+ *
+ * @resp_n	- number of responses during the current interval;
+ * @peak	- highest number of queued requests in a server connection
+ *		  during the current interval;
+ * @jsrv	- sum of the server times during the current interval;
+ * @jhol	- sum of the times the requests waited for the responses to
+ *		  the previous requests in the same connection;
+ * @depth	- current depth, zero if it's not evaluated yet;
+ * @jwin	- end of the current interval, in jiffies;
+ * @lock	- serializes the interval closing;
+ */
+typedef struct {
+	atomic_t		resp_n;
+	atomic_t		peak;
+	atomic_t		jsrv;
+	atomic_t		jhol;
+	unsigned int		depth;
+	unsigned long		jwin;
+	spinlock_t		lock;
+} TfwSrvPipe;
+
 /**
  * Server descriptor, a TfwPeer successor.
  *
  * @list	- member pointer in the list of servers of a server group;
  * @gs_timer	- grace shutdown timer;
+ * @scale_timer	- timer scaling connection pool of the server;
  * @sg		- back-reference to the server group;
  * @sched_data	- private scheduler data for the server;
  * @apmref	- opaque handle for APM stats;
  * @conn_n	- configured number of connections to the server;
+ * @conn_min	- minimum number of connections if the pool is scaled;
+ * @scale_idle	- number of subsequent pool checks with idle connections;
  * @sess_n	- number of pinned sticky sessions;
  * @refcnt	- number of users of the server structure instance;
  * @weight	- static server weight for load balancers;
  * @flags	- server related flags: TFW_CFG_M_ACTION and HM atomic flags;
+ * @jconn_slot	- time of the next connect attempt allowed by the group
+ *		  @conn_rate;
+ * @jwarm	- time when the server warm-up ends, see tfw_srv_warming();
+ * @outlier	- passive outlier detection state;
+ * @pipe	- adaptive pipelining depth state;
  * @cleanup	- called right before server is destroyed;
  */
 typedef struct {
 	TFW_PEER_COMMON;
 	struct list_head	list;
 	struct timer_list	gs_timer;
+	struct timer_list	scale_timer;
 	TfwSrvGroup		*sg;
 	void __rcu		*sched_data;
 	void			*apmref;
 	size_t			conn_n;
+	size_t			conn_min;
+	unsigned int		scale_idle;
 	atomic64_t		sess_n;
 	atomic64_t		refcnt;
 	unsigned int		weight;
 	unsigned long		flags;
+	unsigned long		jconn_slot;
+	unsigned long		jwarm;
+	TfwSrvOutlier		outlier;
+	TfwSrvPipe		pipe;
 	void			(*cleanup)(void *);
 } TfwServer;
 
@@ -79,11 +142,98 @@ enum {
 	TFW_SRV_B_HMONITOR = 0x8,
 
 	/* Server is excluded from processing. */
-	TFW_SRV_B_SUSPEND
+	TFW_SRV_B_SUSPEND,
+
+	/* Server is temporary ejected from processing as an outlier. */
+	TFW_SRV_B_EJECT,
+
+	/* Server connections are being re-established after an outage. */
+	TFW_SRV_B_WARMUP
 };
 
 #define	TFW_SRV_F_HMONITOR	(1 << TFW_SRV_B_HMONITOR)
 #define	TFW_SRV_F_SUSPEND	(1 << TFW_SRV_B_SUSPEND)
+#define	TFW_SRV_F_EJECT		(1 << TFW_SRV_B_EJECT)
+#define	TFW_SRV_F_WARMUP	(1 << TFW_SRV_B_WARMUP)
+
+/**
+ * Passive outlier detection settings of a server group. The detection is
+ * disabled if @eject_time is zero, and each of the checks is disabled if
+ * its threshold is zero.
+ *
+ * @consec	- number of subsequent 5xx responses ejecting a server;
+ * @err_rate	- percent of 5xx responses during an interval;
+ * @latency	- times the average response time of a server during
+ *		  an interval exceeds the median among the group servers;
+ * @eject_time	- base ejection time, seconds;
+ * @max_eject	- maximum percent of the group servers which can be ejected;
+ */
+typedef struct {
+	unsigned int		consec;
+	unsigned int		err_rate;
+	unsigned int		latency;
+	unsigned int		eject_time;
+	unsigned int		max_eject;
+} TfwSgOutlier;
+
+/**
+ * Adaptive concurrency limit settings of a server group. The limit is
+ * disabled if @max is zero.
+ *
+ * @min		- lowest limit of concurrent requests to the group;
+ * @max		- highest limit of concurrent requests to the group;
+ * @tolerance	- percent the average response time may exceed the baseline
+ *		  by before the limit is decreased;
+ */
+typedef struct {
+	unsigned int		min;
+	unsigned int		max;
+	unsigned int		tolerance;
+} TfwSgClimit;
+
+/**
+ * Runtime state of the adaptive concurrency limit.
+ *
+ * @inflight	- number of requests forwarded to the group and not answered;
+ * @peak	- highest @inflight during the current interval;
+ * @resp_n	- number of responses during the current interval;
+ * @err_n	- number of overload responses during the current interval;
+ * @jrtt	- sum of the response times during the current interval;
+ * @limit	- current limit of concurrent requests;
+ * @min_rtt	- baseline response time, microseconds;
+ * @win_n	- intervals since the baseline is learnt;
+ * @jwin	- end of the current interval, in jiffies;
+ * @lock	- serializes the interval closing;
+ */
+typedef struct {
+	atomic_t		inflight;
+	atomic_t		peak;
+	atomic_t		resp_n;
+	atomic_t		err_n;
+	atomic_t		jrtt;
+	unsigned int		limit;
+	unsigned int		min_rtt;
+	unsigned int		win_n;
+	unsigned long		jwin;
+	spinlock_t		lock;
+} TfwSgClimitState;
+
+/**
+ * Adaptive pipelining depth settings of a server group. The depth is not
+ * limited if @max is zero.
+ *
+ * @max		- highest number of requests in flight in a connection;
+ * @tail	- times the 99th percentile of the server response time may
+ *		  exceed the median before the depth is decreased;
+ * @hol		- percent of the server time the requests may wait for
+ *		  the responses to the previous requests in the same
+ *		  connection before the depth is decreased;
+ */
+typedef struct {
+	unsigned int		max;
+	unsigned int		tail;
+	unsigned int		hol;
+} TfwSgPipe;
 
 /**
  * The servers group with the same load balancing, failovering and eviction
@@ -104,6 +254,16 @@ enum {
  * @max_refwd	- maximum number of tries for forwarding a request;
  * @max_jqage	- maximum age of a request in a server connection, in jiffies;
  * @max_recns	- maximum number of reconnect attempts;
+ * @scale_rtt	- response time (msecs) growing connection pools, or 0;
+ * @conn_rate	- maximum connect attempts per second to a server, or 0;
+ * @outlier	- passive outlier detection settings;
+ * @outlier_work - periodic outlier detection and servers restoration;
+ * @outlier_n	- number of currently ejected servers;
+ * @climit	- adaptive concurrency limit settings;
+ * @climit_st	- adaptive concurrency limit state;
+ * @pipe	- adaptive pipelining depth settings;
+ * @hedge_ith	- percentile of the server response time after which
+ *		  idempotent requests are hedged, or 0;
  * @flags	- server group related flags;
  * @nlen	- name length;
  * @name	- name of the group specified in the configuration;
@@ -120,20 +280,45 @@ struct tfw_srv_group_t {
 	unsigned int		max_refwd;
 	unsigned long		max_jqage;
 	unsigned int		max_recns;
+	unsigned int		scale_rtt;
+	unsigned int		conn_rate;
+	TfwSgOutlier		outlier;
+	struct delayed_work	outlier_work;
+	atomic_t		outlier_n;
+	TfwSgClimit		climit;
+	TfwSgClimitState	climit_st;
+	TfwSgPipe		pipe;
+	unsigned int		hedge_ith;
 	unsigned int		flags;
 	unsigned int		nlen;
 	char			name[0];
 };
 
+/* Prediction models of the predictive ratio scheduler. */
+enum {
+	TFW_SCHED_PREDICT_LINEAR,
+	TFW_SCHED_PREDICT_EWMA,
+	TFW_SCHED_PREDICT_HOLT,
+};
+
 /**
  * @past	- period of time (secs) to keep past APM values;
  * @rate	- rate (times per sec) of retrieval of past APM values;
  * @ahead	- period of time (secs) for a prediction;
+ * @model	- prediction model, TFW_SCHED_PREDICT_*;
+ * @alpha	- smoothing factor of the level, percents;
+ * @beta	- smoothing factor of the trend, percents;
+ * @hyst	- minimum change of a server weight, percents, which causes
+ *		  the ratios recalculation;
  */
 typedef struct {
 	unsigned int		past;
 	unsigned int		rate;
 	unsigned int		ahead;
+	unsigned int		model;
+	unsigned int		alpha;
+	unsigned int		beta;
+	unsigned int		hyst;
 } TfwSchrefPredict;
 
 /* Server and server group related flags.
@@ -148,6 +333,7 @@ typedef struct {
 					 | TFW_SG_F_SCHED_RATIO_PREDICT)
 
 #define TFW_SRV_RETRY_NIP		0x0100	/* Retry non-idempotent req. */
+#define TFW_SRV_HTTP2			0x0200	/* Speak HTTP/2 to servers. */
 
 /**
  * Requests scheduling algorithm handler.
@@ -242,8 +428,8 @@ tfw_server_unpin_sess(TfwServer *srv)
  * TODO: The function is racy: we can push into @srv_conn more requests than
  * allowed for the server group if @srv_conn is on hold due to non-idempotent
  * request forwarding. srv_conn->qsize is incremented during push, so values
- * close to UINT_MAX can be vulnerable to integer overflow.
- *
+ * close to UINT_MAX can be vulnerable to integer overflow. Requests in
+ * @srv_conn->fwd_inq aren't accounted until they're moved to @fwd_queue.
  */
 static inline bool
 tfw_srv_conn_queue_full(TfwSrvConn *srv_conn)
@@ -275,12 +461,90 @@ tfw_srv_mark_alive(TfwServer *srv)
 }
 
 /*
- * Tell if server is suspended.
+ * Tell if server is suspended by the health monitor or ejected as an outlier.
  */
 static inline bool
 tfw_srv_suspended(TfwServer *srv)
 {
-	return test_bit(TFW_SRV_B_SUSPEND, &srv->flags);
+	return READ_ONCE(srv->flags) & (TFW_SRV_F_SUSPEND | TFW_SRV_F_EJECT);
+}
+
+/*
+ * The server has just restored after an outage and only few of its
+ * connections are established, so schedulers should prefer other servers.
+ */
+static inline bool
+tfw_srv_warming(TfwServer *srv)
+{
+	return test_bit(TFW_SRV_B_WARMUP, &srv->flags)
+	       && time_before(jiffies, READ_ONCE(srv->jwarm));
+}
+
+void __tfw_srv_outlier_update(TfwServer *srv, int status, unsigned long jrtt);
+
+/*
+ * Account a response with @status received from @srv within @jrtt jiffies
+ * for the passive outlier detection.
+ */
+static inline void
+tfw_srv_outlier_update(TfwServer *srv, int status, unsigned long jrtt)
+{
+	if (likely(!READ_ONCE(srv->sg->outlier.eject_time)))
+		return;
+	__tfw_srv_outlier_update(srv, status, jrtt);
+}
+
+void __tfw_srv_pipe_update(TfwServer *srv, TfwSrvConn *srv_conn,
+			   unsigned long jtx, unsigned long jrtt);
+
+/*
+ * Account a response to a request sent to @srv_conn at @jtx and answered
+ * within @jrtt jiffies for the adaptive pipelining depth.
+ */
+static inline void
+tfw_srv_pipe_update(TfwSrvConn *srv_conn, unsigned long jtx,
+		    unsigned long jrtt)
+{
+	TfwServer *srv = (TfwServer *)srv_conn->peer;
+
+	if (likely(!READ_ONCE(srv->sg->pipe.max)) || tfw_srv_conn_h2(srv_conn))
+		return;
+	__tfw_srv_pipe_update(srv, srv_conn, jtx, jrtt);
+}
+
+/*
+ * The number of requests which may be in flight in an HTTP/1.1 connection
+ * of @srv, or zero if it's not limited.
+ */
+static inline unsigned int
+tfw_srv_pipe_depth(TfwServer *srv)
+{
+	unsigned int max = READ_ONCE(srv->sg->pipe.max);
+
+	return max ? min(READ_ONCE(srv->pipe.depth) ? : max, max) : 0;
+}
+
+/*
+ * Tell if @srv_conn has as many queued requests as the pipelining depth of
+ * the server allows, so schedulers should prefer other connections, like
+ * the ones with non-idempotent requests.
+ */
+static inline bool
+tfw_srv_conn_pipe_full(TfwSrvConn *srv_conn)
+{
+	unsigned int depth = tfw_srv_pipe_depth((TfwServer *)srv_conn->peer);
+
+	return depth && READ_ONCE(srv_conn->qsize) >= depth
+	       && !tfw_srv_conn_h2(srv_conn);
+}
+
+bool tfw_sg_climit_get(TfwSrvGroup *sg);
+void tfw_sg_climit_put(TfwSrvGroup *sg, int status, unsigned long jrtt);
+
+static inline bool
+tfw_sg_climit_enabled(TfwSrvGroup *sg)
+{
+	return READ_ONCE(sg->climit.max);
 }
 
 /* Server group routines. */
@@ -296,11 +560,14 @@ void __tfw_sg_del_srv(TfwSrvGroup *sg, TfwServer *srv, bool lock);
 #define tfw_sg_del_srv(sg, srv)	__tfw_sg_del_srv(sg, srv, true)
 int tfw_sg_start_sched(TfwSrvGroup *sg, TfwScheduler *sched, void *arg);
 void tfw_sg_stop_sched(TfwSrvGroup *sg);
+void tfw_sg_start_outlier(TfwSrvGroup *sg);
 int __tfw_sg_for_each_srv(TfwSrvGroup *sg,
 			  int (*cb)(TfwSrvGroup *, TfwServer *, void *),
 			  void *data);
 int tfw_sg_for_each_srv(int (*sg_cb)(TfwSrvGroup *sg),
 			int (*srv_cb)(TfwServer *srv));
+int tfw_sg_for_each_srv_data(int (*cb)(TfwSrvGroup *, TfwServer *, void *),
+			     void *data);
 int tfw_sg_for_each_srv_reconfig(int (*cb)(TfwServer *srv));
 void tfw_sg_destroy(TfwSrvGroup *sg);
 void tfw_sg_release(TfwSrvGroup *sg);
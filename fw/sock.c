@@ -18,9 +18,12 @@
  * this program; if not, write to the Free Software Foundation, Inc., 59
  * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
+#include <asm/fpu/api.h>
 #include <linux/irq_work.h>
+#include <linux/kthread.h>
 #include <linux/module.h>
 #include <linux/tempesta.h>
+#include <net/busy_poll.h>
 #include <net/protocol.h>
 #include <net/inet_common.h>
 #include <net/ip6_route.h>
@@ -40,6 +43,7 @@
 typedef enum {
 	SS_SEND,
 	SS_CLOSE,
+	SS_RESUME,
 } SsAction;
 
 typedef struct {
@@ -126,6 +130,45 @@ static DEFINE_PER_CPU(atomic64_t, __ss_act_cnt) ____cacheline_aligned
 	= ATOMIC_INIT(0);
 static DEFINE_PER_CPU(TfwRBQueue, si_wq);
 static DEFINE_PER_CPU(struct irq_work, ipi_work);
+
+/**
+ * IPIs to other CPUs are deferred to the end of the current softirq pass, so
+ * all the works queued to the same CPU during the pass cost one IPI.
+ *
+ * @n		- number of CPUs in @cpus;
+ * @cpus	- CPUs to send the IPI to;
+ * @sent	- number of IPIs sent by the CPU;
+ * @coalesced	- number of IPIs saved by the batching;
+ */
+typedef struct {
+	unsigned int	n;
+	cpumask_t	cpus;
+	unsigned long	sent;
+	unsigned long	coalesced;
+} SsIpiBatch;
+
+static DEFINE_PER_CPU(SsIpiBatch, ipi_batch);
+
+/**
+ * Busy polling state of a CPU. The polling thread spins on the CPU work
+ * queue and on the NAPI instance delivering segments to the CPU, so the
+ * producers don't need IPIs and the segments are fetched without waiting
+ * for an interrupt and softirq scheduling.
+ *
+ * @thr		- the polling thread bound to the CPU;
+ * @spin	- the thread is spinning and IPIs to the CPU are disabled;
+ * @napi_id	- NAPI instance which delivered the last segment to the CPU;
+ * @rx		- number of receive upcalls on the CPU;
+ */
+typedef struct {
+	struct task_struct	*thr;
+	bool			spin;
+	unsigned int		napi_id;
+	unsigned long		rx;
+} SsBusyPoll;
+
+static DEFINE_PER_CPU(SsBusyPoll, busy_poll);
+static unsigned int ss_bp_idle;
 /*
  * llist can not be used since llist_del_first() returns the newest added
  * item, while we need FIFO queue. Not a big deal - we use it only at slow
@@ -197,6 +240,59 @@ ss_ipi(struct irq_work *work)
 	raise_softirq(NET_TX_SOFTIRQ);
 }
 
+/**
+ * Wake up @cpu to process its work queue. In softirq context the IPI is only
+ * recorded and the local NET_TX softirq is raised to send the IPIs by
+ * ss_ipi_flush() when the current softirq processing is done.
+ */
+static void
+ss_ipi_raise(int cpu)
+{
+	SsIpiBatch *b = this_cpu_ptr(&ipi_batch);
+
+	if (cpu == smp_processor_id()) {
+		ss_ipi(NULL);
+		return;
+	}
+	if (unlikely(!in_serving_softirq())) {
+		irq_work_queue_on(&per_cpu(ipi_work, cpu), cpu);
+		b->sent++;
+		return;
+	}
+	if (cpumask_test_and_set_cpu(cpu, &b->cpus)) {
+		b->coalesced++;
+		return;
+	}
+	if (!b->n++)
+		raise_softirq(NET_TX_SOFTIRQ);
+}
+
+/**
+ * Send the deferred IPIs. A target CPU which cleared TFW_QUEUE_IPI since the
+ * works were queued is already processing its work queue, so it doesn't need
+ * the IPI.
+ */
+static void
+ss_ipi_flush(void)
+{
+	SsIpiBatch *b = this_cpu_ptr(&ipi_batch);
+	int cpu;
+
+	if (likely(!b->n))
+		return;
+
+	for_each_cpu(cpu, &b->cpus) {
+		if (test_bit(TFW_QUEUE_IPI, &per_cpu(si_wq, cpu).flags)) {
+			irq_work_queue_on(&per_cpu(ipi_work, cpu), cpu);
+			b->sent++;
+		} else {
+			b->coalesced++;
+		}
+	}
+	cpumask_clear(&b->cpus);
+	b->n = 0;
+}
+
 /**
  * The socket can move from one CPU to another, so we have to pass @cpu as
  * a parameter to guarantee that we use work queue and backlog for the same
@@ -205,7 +301,6 @@ ss_ipi(struct irq_work *work)
 static int
 ss_turnstile_push(long ticket, SsWork *sw, int cpu)
 {
-	struct irq_work *iw = &per_cpu(ipi_work, cpu);
 	SsCloseBacklog *cb = &per_cpu(close_backlog, cpu);
 	TfwRBQueue *wq = &per_cpu(si_wq, cpu);
 	SsCblNode *cn;
@@ -227,7 +322,7 @@ ss_turnstile_push(long ticket, SsWork *sw, int cpu)
 	 * spinlock operation.
 	 */
 	if (test_bit(TFW_QUEUE_IPI, &wq->flags))
-		tfw_raise_softirq(cpu, iw, ss_ipi);
+		ss_ipi_raise(cpu);
 
 	return 0;
 }
@@ -257,36 +352,48 @@ static long
 ss_wq_push(SsWork *sw, int cpu)
 {
 	TfwRBQueue *wq = &per_cpu(si_wq, cpu);
-	struct irq_work *iw = &per_cpu(ipi_work, cpu);
 	long r;
 
-	r = tfw_wq_push(wq, sw, cpu, iw, ss_ipi);
-	if (r)
+	if ((r = __tfw_wq_push(wq, sw))) {
 		TFW_INC_STAT_BH(ss.wq_full);
-	return r;
+		return r;
+	}
+	/* The atomic operation is atomic64_cmpxchg() in __tfw_wq_push(). */
+	smp_mb__after_atomic();
+
+	if (test_bit(TFW_QUEUE_IPI, &wq->flags))
+		ss_ipi_raise(cpu);
+
+	return 0;
 }
 
+/**
+ * Pop up to @n works to @sw array, return the number of the works.
+ */
 static int
-ss_wq_pop(TfwRBQueue *wq, SsWork *sw, long *ticket)
+ss_wq_pop(TfwRBQueue *wq, SsWork *sw, int n)
 {
 	SsCloseBacklog *cb = this_cpu_ptr(&close_backlog);
+	long tail = atomic64_read(&wq->tail);
+	long turn = READ_ONCE(cb->turn);
+	int k;
 
 	/*
 	 * Since backlog is used for closing only, items from the work queue
 	 * are fetched first.
-	 */
-	if (!*ticket && !tfw_wq_pop_ticket(wq, sw, ticket))
-		return 0;
-
-	/*
+	 *
 	 * @turn stores @wq->head value of a next item to insert (the position
-	 * was unavailable when we tried it), so if we fetched i'th item last
-	 * time, then now we should fetch (i + 1)'th item from the backlog.
-	 * While there are many producers, they have different head views and
-	 * they can put the items to the backlog with wrong order. Thus, we
-	 * should fetch all the items with small enough tickets.
+	 * was unavailable when we tried it), so the items before @turn are
+	 * fetched from the queue and the backlog items go next. While there
+	 * are many producers, they have different head views and they can put
+	 * the items to the backlog with wrong order. Thus, we should fetch all
+	 * the items with small enough tickets.
 	 */
-	if (*ticket + 1 >= cb->turn) {
+	if (tail < turn
+	    && (k = tfw_wq_pop_bulk(wq, sw, min_t(long, n, turn - tail))))
+		return k;
+
+	if (tail + 1 >= turn) {
 		SsCblNode *cn = NULL;
 
 		spin_lock(&cb->lock);
@@ -300,11 +407,11 @@ ss_wq_pop(TfwRBQueue *wq, SsWork *sw, long *ticket)
 		if (cn) {
 			memcpy_fast(sw, &cn->sw, sizeof(*sw));
 			kmem_cache_free(ss_cbacklog_cache, cn);
-			return 0;
+			return 1;
 		}
 	}
 
-	return tfw_wq_pop_ticket(wq, sw, ticket);
+	return tfw_wq_pop_bulk(wq, sw, 1);
 }
 
 static size_t
@@ -328,11 +435,14 @@ ss_wq_local_size(TfwRBQueue *wq)
  * Socket is in a usable state that allows processing
  * and sending of HTTP messages. This function must
  * be used consistently across all involved functions.
+ * A socket accepted with TCP Fast Open is usable before
+ * the handshake is finished.
  */
 static bool
 ss_sock_active(struct sock *sk)
 {
-	return (1 << sk->sk_state) & (TCPF_ESTABLISHED | TCPF_CLOSE_WAIT);
+	return (1 << sk->sk_state)
+	       & (TCPF_ESTABLISHED | TCPF_CLOSE_WAIT | TCPF_SYN_RECV);
 }
 
 /*
@@ -357,14 +467,75 @@ ss_forced_mem_schedule(struct sock *sk, int size)
 	sk_memory_allocated_add(sk, amt);
 }
 
+/*
+ * Sockets with TLS data queued by one ss_tx_action() pass. The data is pushed
+ * at the end of the pass, so tfw_tls_encrypt() packs all the skbs queued to
+ * a socket during the pass, e.g. HTTP/2 frames of several streams, into as
+ * few TLS records as possible.
+ */
+#define SS_TX_PUSH_N	32
+/* Works fetched from the work queue at once by ss_tx_action(). */
+#define SS_TX_BATCH	8
+
+typedef struct {
+	int		n;
+	struct sock	*sk[SS_TX_PUSH_N];
+} SsTxPush;
+
+/**
+ * Defer the push of @sk to the end of the current pass.
+ * Return false if the socket must be pushed right now.
+ */
+static bool
+ss_tx_push_defer(SsTxPush *push, struct sock *sk)
+{
+	int i;
+
+	for (i = 0; i < push->n; ++i)
+		if (push->sk[i] == sk)
+			return true;
+	if (push->n == SS_TX_PUSH_N)
+		return false;
+
+	sock_hold(sk);
+	push->sk[push->n++] = sk;
+
+	return true;
+}
+
+static void
+ss_tx_push(SsTxPush *push)
+{
+	int i, size, mss;
+
+	for (i = 0; i < push->n; ++i) {
+		struct sock *sk = push->sk[i];
+
+		bh_lock_sock(sk);
+		if (!sock_flag(sk, SOCK_DEAD) && ss_sock_active(sk)) {
+			/* See ss_tx_action(). */
+			sk->sk_lock.owned = 1;
+			mss = tcp_send_mss(sk, &size, MSG_DONTWAIT);
+			tcp_push(sk, MSG_DONTWAIT, mss,
+				 TCP_NAGLE_OFF|TCP_NAGLE_PUSH, size);
+			sk->sk_lock.owned = 0;
+		}
+		bh_unlock_sock(sk);
+		sock_put(sk);
+	}
+	push->n = 0;
+}
+
 /**
  * @skb_head can be invalid after the function call, don't try to use it.
  */
 static void
-ss_do_send(struct sock *sk, struct sk_buff **skb_head, int flags)
+ss_do_send(struct sock *sk, struct sk_buff **skb_head, int flags,
+	   SsTxPush *push)
 {
 	struct tcp_sock *tp = tcp_sk(sk);
 	struct sk_buff *skb;
+	SsProto *proto = sk->sk_user_data;
 	int size, mss = tcp_send_mss(sk, &size, MSG_DONTWAIT);
 	unsigned int mark = (*skb_head)->mark;
 
@@ -412,6 +583,12 @@ ss_do_send(struct sock *sk, struct sk_buff **skb_head, int flags)
 		tp->write_seq += skb->len;
 		TCP_SKB_CB(skb)->end_seq += skb->len;
 	}
+	/*
+	 * The time the data is actually passed to TCP, work queue latency
+	 * isn't the peer's latency. See tfw_http_req_jsent().
+	 */
+	if (likely(proto))
+		WRITE_ONCE(proto->jtxtstamp, jiffies);
 
 	T_DBG3("[%d]: %s: sk=%p send_head=%p sk_state=%d flags=%x\n",
 	       smp_processor_id(), __func__,
@@ -423,6 +600,8 @@ ss_do_send(struct sock *sk, struct sk_buff **skb_head, int flags)
 	 */
 	if (flags & SS_F_CONN_CLOSE)
 		return;
+	if ((flags & SS_F_ENCRYPT) && ss_tx_push_defer(push, sk))
+		return;
 
 	tcp_push(sk, MSG_DONTWAIT, mss, TCP_NAGLE_OFF|TCP_NAGLE_PUSH, size);
 }
@@ -437,8 +616,7 @@ ss_do_send(struct sock *sk, struct sk_buff **skb_head, int flags)
 int
 ss_send(struct sock *sk, struct sk_buff **skb_head, int flags)
 {
-	int cpu, r = 0;
-	struct sk_buff *skb, *twin_skb;
+	int cpu;
 	SsWork sw = {
 		.sk	= sk,
 		.flags  = flags,
@@ -472,18 +650,10 @@ ss_send(struct sock *sk, struct sk_buff **skb_head, int flags)
 	 * and after the transmission.
 	 */
 	if (flags & SS_F_KEEP_SKB) {
-		skb = *skb_head;
-		do {
-			/* tcp_transmit_skb() will clone the skb. */
-			twin_skb = pskb_copy_for_clone(skb, GFP_ATOMIC);
-			if (!twin_skb) {
-				T_WARN("Unable to copy an egress SKB.\n");
-				r = -ENOMEM;
-				goto err;
-			}
-			ss_skb_queue_tail(&sw.skb_head, twin_skb);
-			skb = skb->next;
-		} while (skb != *skb_head);
+		if (ss_skb_queue_copy(&sw.skb_head, *skb_head)) {
+			T_WARN("Unable to copy an egress SKB.\n");
+			return -ENOMEM;
+		}
 	} else {
 		sw.skb_head = *skb_head;
 		*skb_head = NULL;
@@ -506,14 +676,11 @@ ss_send(struct sock *sk, struct sk_buff **skb_head, int flags)
 		       " (queue size %d)\n", sk,
 		       tfw_wq_size(&per_cpu(si_wq, cpu)));
 		sock_put(sk);
-		r = -EBUSY;
-		goto err;
+		ss_skb_queue_purge(&sw.skb_head);
+		return -EBUSY;
 	}
 
 	return 0;
-err:
-	ss_skb_queue_purge(&sw.skb_head);
-	return r;
 }
 EXPORT_SYMBOL(ss_send);
 
@@ -532,16 +699,17 @@ EXPORT_SYMBOL(ss_send);
  * Note: it used to be called in process context as well, at the time when
  * Tempesta starts or stops. That's not the case right now, but it may change.
  *
- * TODO In some cases we need to close socket aggressively w/o FIN_WAIT_2 state,
- * e.g. by sending RST. So we need to add second parameter to the function
- * which says how to close the socket.
- * One of the examples is rcl_req_limit() (it should reset connections).
- * See tcp_sk(sk)->linger2 processing in standard tcp_close().
+ * SS_F_ABORT in @flags closes the socket aggressively, e.g. for blocked
+ * clients: RST is sent and the socket is destroyed immediately with all the
+ * queued skbs. If there is still pending data on the socket, e.g. a blocking
+ * response, it's sent with FIN and the socket is destroyed right after the
+ * FIN is acknowledged without FIN_WAIT2 and TIME_WAIT states (see
+ * tcp_sk(sk)->linger2 processing in standard tcp_close()).
  *
  * Called with locked socket.
  */
 static void
-ss_do_close(struct sock *sk)
+ss_do_close(struct sock *sk, int flags)
 {
 	struct sk_buff *skb;
 	int data_was_unread = 0;
@@ -588,6 +756,14 @@ ss_do_close(struct sock *sk)
 		tcp_set_state(sk, TCP_CLOSE);
 		tcp_send_active_reset(sk, sk->sk_allocation);
 	}
+	else if ((flags & SS_F_ABORT) && !tcp_send_head(sk)) {
+		/*
+		 * Nothing to send, just reset the connection. The write queue
+		 * is purged by inet_csk_destroy_sock() below.
+		 */
+		tcp_set_state(sk, TCP_CLOSE);
+		tcp_send_active_reset(sk, sk->sk_allocation);
+	}
 	else if (tcp_close_state(sk)) {
 		/* The code below is taken from tcp_send_fin(). */
 		struct tcp_sock *tp = tcp_sk(sk);
@@ -612,6 +788,9 @@ ss_do_close(struct sock *sk)
 				tcp_queue_skb(sk, skb);
 			}
 		}
+		/* Destroy the socket as soon as FIN is acknowledged. */
+		if (flags & SS_F_ABORT)
+			tp->linger2 = -1;
 		__tcp_push_pending_frames(sk, mss_now, TCP_NAGLE_OFF);
 	}
 
@@ -635,7 +814,12 @@ adjudge_to_death:
 
 	if (sk->sk_state == TCP_FIN_WAIT2) {
 		const int tmo = tcp_fin_time(sk);
-		if (tmo > TCP_TIMEWAIT_LEN) {
+		if (tcp_sk(sk)->linger2 < 0) {
+			tcp_set_state(sk, TCP_CLOSE);
+			tcp_send_active_reset(sk, GFP_ATOMIC);
+			__NET_INC_STATS(sock_net(sk),
+					LINUX_MIB_TCPABORTONLINGER);
+		} else if (tmo > TCP_TIMEWAIT_LEN) {
 			inet_csk_reset_keepalive_timer(sk,
 						tmo - TCP_TIMEWAIT_LEN);
 		} else {
@@ -672,7 +856,7 @@ adjudge_to_death:
 static void
 ss_linkerror(struct sock *sk)
 {
-	ss_do_close(sk);
+	ss_do_close(sk, 0);
 	SS_CALL_GUARD_EXIT(connection_drop, sk);
 	sock_put(sk);	/* paired with ss_do_close() */
 }
@@ -725,16 +909,85 @@ err:
 }
 EXPORT_SYMBOL(ss_close);
 
+/**
+ * Stop reading data from @sk, e.g. if the peer connection the data is
+ * forwarded to can't send it fast enough. Must be called in the receive
+ * context of the socket, e.g. from connection_recv() hook: the skbs already
+ * read from the socket are still passed to the hook.
+ */
+void
+ss_rx_pause(struct sock *sk)
+{
+	SS_CONN_TYPE(sk) |= Conn_RxPause;
+}
+EXPORT_SYMBOL(ss_rx_pause);
+
+/**
+ * Resume reading of data from @sk paused by ss_rx_pause() and process the
+ * data received in the meantime. The socket flag is changed in the socket
+ * context, so the work goes through the same queues as ss_close(), and can't
+ * be lost as a paused socket is never read otherwise.
+ */
+void
+ss_rx_resume(struct sock *sk)
+{
+	int cpu;
+	long ticket;
+	SsWork sw = {
+		.sk	= sk,
+		.action	= SS_RESUME,
+	};
+
+	ss_sk_incoming_cpu_update(sk);
+	cpu = sk->sk_incoming_cpu;
+
+	sock_hold(sk);
+	if (!(ticket = ss_wq_push(&sw, cpu)))
+		return;
+	if (ss_turnstile_push(ticket, &sw, cpu)) {
+		T_WARN("Cannot schedule socket %p for receive resume\n", sk);
+		sock_put(sk);
+	}
+}
+EXPORT_SYMBOL(ss_rx_resume);
+
 /*
- * Process a single SKB.
+ * Number of paged fragments left free in the skbs coalesced by the batch
+ * receive, HTTP adjustment logic uses the room to place new fragments.
+ */
+#define SS_RCV_SPARE_FRAGS	4
+
+/*
+ * Coalesce @from with preceding @to, so the upper layers process the data
+ * in larger contiguous runs. Heads of skbs from GRO chains are page
+ * fragments, so they're usually stolen by @to as paged fragments.
+ */
+static bool
+ss_tcp_coalesce(struct sk_buff *to, struct sk_buff *from)
+{
+	bool stolen;
+	int delta;
+
+	if (skb_shinfo(to)->nr_frags + skb_shinfo(from)->nr_frags + 1
+	    > MAX_SKB_FRAGS - SS_RCV_SPARE_FRAGS)
+		return false;
+	if (!skb_try_coalesce(to, from, &stolen, &delta))
+		return false;
+	kfree_skb_partial(from, stolen);
+
+	return true;
+}
+
+/*
+ * Unroll @skb taken from the receive queue and add the skbs with new data
+ * to @batch.
  */
 static int
-ss_tcp_process_skb(struct sock *sk, struct sk_buff *skb, int *processed)
+ss_tcp_collect_skb(struct sock *sk, struct sk_buff *skb,
+		   struct sk_buff **batch, int *processed)
 {
-	bool tcp_fin;
-	int r = 0, offset, count;
-	void *conn;
-	struct sk_buff *skb_head = NULL;
+	int offset, count;
+	struct sk_buff *skb_head = NULL, *tail;
 	struct tcp_sock *tp = tcp_sk(sk);
 
 	/* Calculate the offset into the SKB. */
@@ -742,9 +995,6 @@ ss_tcp_process_skb(struct sock *sk, struct sk_buff *skb, int *processed)
 	if (TCP_SKB_CB(skb)->tcp_flags & TCPHDR_SYN)
 		offset--;
 
-	/* SKB may be freed in processing. Save the flag. */
-	tcp_fin = TCP_SKB_CB(skb)->tcp_flags & TCPHDR_FIN;
-
 	if (ss_skb_unroll(&skb_head, skb)) {
 		__kfree_skb(skb);
 		return SS_DROP;
@@ -771,11 +1021,31 @@ ss_tcp_process_skb(struct sock *sk, struct sk_buff *skb, int *processed)
 		if (unlikely(offset > 0 &&
 			     ss_skb_chop_head_tail(NULL, skb, offset, 0) != 0))
 		{
-			r = SS_DROP;
-			goto out;
+			__kfree_skb(skb);
+			ss_skb_queue_purge(&skb_head);
+			return SS_DROP;
 		}
 		offset = 0;
 
+		tail = ss_skb_peek_tail(batch);
+		if (!tail || !ss_tcp_coalesce(tail, skb))
+			ss_skb_queue_tail(batch, skb);
+	}
+
+	return 0;
+}
+
+/*
+ * Pass all the skbs of @batch to the upper layer. The batch is consumed.
+ */
+static int
+ss_tcp_deliver(struct sock *sk, struct sk_buff **batch)
+{
+	int r;
+	void *conn;
+	struct sk_buff *skb;
+
+	while ((skb = ss_skb_dequeue(batch))) {
 		conn = sk->sk_user_data;
 		/*
 		 * If @sk_user_data is unset, then this connection
@@ -796,20 +1066,13 @@ ss_tcp_process_skb(struct sock *sk, struct sk_buff *skb, int *processed)
 		if (r < 0) {
 			T_DBG2("[%d]: Processing error: sk=%pK r=%d\n",
 			       smp_processor_id(), sk, r);
-			goto out; /* connection must be dropped */
+			/* The connection must be dropped. */
+			ss_skb_queue_purge(batch);
+			return r;
 		}
 	}
-	if (tcp_fin) {
-		T_DBG2("Received data FIN on sk=%p, cpu=%d\n",
-		       sk, smp_processor_id());
-		++tp->copied_seq;
-		r = SS_DROP;
-	}
-out:
-	if (skb_head)
-		ss_skb_queue_purge(&skb_head);
 
-	return r;
+	return 0;
 }
 
 /**
@@ -819,15 +1082,25 @@ out:
  * tcp_read_sock() calls __kfree_skb() through sk_eat_skb() which is good
  * for copying data from skb, but we need to manage skb's ourselves.
  *
+ * All the in-order skbs available on the socket are collected to a batch
+ * first, the skbs of GRO chains are coalesced back to fewer larger skbs,
+ * and the batch is passed to the upper layer at once. So TLS can decrypt
+ * a record received in many segments in one go and HTTP parser runs over
+ * longer contiguous data.
+ *
+ * Returns SS_OK if the connection is alive, SS_DROP if the upper layer
+ * blocked the connection and SS_BAD if it must be closed for other reasons,
+ * e.g. on FIN or internal errors.
+ *
  * TODO #873 process URG.
  */
-static bool
+static int
 ss_tcp_process_data(struct sock *sk)
 {
-	bool droplink = true;
-	int r, count, processed = 0;
+	bool tcp_fin = false;
+	int r = 0, rd, count, processed = 0;
 	unsigned int skb_len, skb_seq;
-	struct sk_buff *skb, *tmp;
+	struct sk_buff *skb, *tmp, *batch = NULL;
 	struct tcp_sock *tp = tcp_sk(sk);
 
 	skb_queue_walk_safe(&sk->sk_receive_queue, skb, tmp) {
@@ -835,7 +1108,8 @@ ss_tcp_process_data(struct sock *sk)
 			T_WARN("recvmsg bug: TCP sequence gap at seq %X"
 			       " recvnxt %X\n",
 			       tp->copied_seq, TCP_SKB_CB(skb)->seq);
-			goto out;
+			r = SS_DROP;
+			break;
 		}
 
 		__skb_unlink(skb, &sk->sk_receive_queue);
@@ -843,23 +1117,41 @@ ss_tcp_process_data(struct sock *sk)
 
 		WARN_ON_ONCE(skb_shared(skb));
 
-		/* Save the original len and seq for reporting. */
+		/* Save the original len, seq and FIN for reporting. */
 		skb_len = skb->len;
 		skb_seq = TCP_SKB_CB(skb)->seq;
+		tcp_fin = TCP_SKB_CB(skb)->tcp_flags & TCPHDR_FIN;
 
 		count = 0;
-		r = ss_tcp_process_skb(sk, skb, &count);
+		r = ss_tcp_collect_skb(sk, skb, &batch, &count);
 		processed += count;
 
 		if (r < 0)
-			goto out;
+			break;
 		else if (!count)
 			T_WARN("recvmsg bug: overlapping TCP segment at %X"
 			       " seq %X rcvnxt %X len %x\n",
 			       tp->copied_seq, skb_seq, tp->rcv_nxt,
 				 skb_len);
+		if (tcp_fin)
+			break;
+	}
+
+	/* The data received before an error is processed as previously. */
+	if ((rd = ss_tcp_deliver(sk, &batch)) < 0) {
+		r = rd == SS_DROP ? SS_DROP : SS_BAD;
+		goto out;
+	}
+	if (r < 0) {
+		r = SS_BAD;
+		goto out;
+	}
+	if (tcp_fin) {
+		T_DBG2("Received data FIN on sk=%p, cpu=%d\n",
+		       sk, smp_processor_id());
+		++tp->copied_seq;
+		r = SS_BAD;
 	}
-	droplink = false;
 out:
 	/*
 	 * Recalculate an appropriate TCP receive buffer space
@@ -869,7 +1161,7 @@ out:
 	if (processed)
 		tcp_cleanup_rbuf(sk, processed);
 
-	return droplink;
+	return r;
 }
 
 /*
@@ -877,6 +1169,24 @@ out:
  *  	Socket callbacks
  * ------------------------------------------------------------------------
  */
+/*
+ * Remember the NAPI instance delivering segments to the current CPU, so the
+ * busy polling thread of the CPU polls the same receive queue.
+ */
+static void
+ss_busy_poll_note(struct sock *sk)
+{
+	SsBusyPoll *bp = this_cpu_ptr(&busy_poll);
+
+	if (!bp->thr)
+		return;
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	if (READ_ONCE(sk->sk_napi_id) >= MIN_NAPI_ID)
+		WRITE_ONCE(bp->napi_id, READ_ONCE(sk->sk_napi_id));
+#endif
+	WRITE_ONCE(bp->rx, bp->rx + 1);
+}
+
 /*
  * Called when a new data received on the socket.
  * Called under bh_lock_sock(sk) (see tcp_v4_rcv()).
@@ -896,9 +1206,17 @@ ss_tcp_data_ready(struct sock *sk)
 		 */
 		T_ERR("error data in socket %p\n", sk);
 	}
+	else if (SS_CONN_TYPE(sk) & Conn_RxPause) {
+		/* The data is read on ss_rx_resume(). */
+		return;
+	}
 	else if (!skb_queue_empty(&sk->sk_receive_queue)) {
-		if (ss_tcp_process_data(sk) &&
-		    !(SS_CONN_TYPE(sk) & Conn_Stop)) {
+		int r;
+
+		ss_busy_poll_note(sk);
+		r = ss_tcp_process_data(sk);
+
+		if (r && !(SS_CONN_TYPE(sk) & Conn_Stop)) {
 			/*
 			 * Close connection in case of internal errors,
 			 * banned packets, or FIN in the received packet,
@@ -913,13 +1231,12 @@ ss_tcp_data_ready(struct sock *sk)
 			 * Closing a socket should go through the queue and
 			 * should be done after all pending data has been sent.
 			 *
-			 * TODO #861. ss_tcp_process_data() returns true/false
-			 * on all kind of problems: e.g. inability to unroll an
-			 * skb and a security event. However, the problems are
-			 * very different - we should send pending data in first
-			 * case (SS_BAD) and send RST in the second (SS_DROP).
+			 * Blocked clients (SS_DROP) are reset, while on
+			 * internal errors and FIN (SS_BAD) we gracefully send
+			 * the pending data first.
 			 */
-			ss_close(sk, SS_F_SYNC);
+			ss_close(sk, r == SS_DROP ? SS_F_SYNC | SS_F_ABORT
+						  : SS_F_SYNC);
 		}
 	}
 	else {
@@ -936,6 +1253,17 @@ ss_tcp_data_ready(struct sock *sk)
 	}
 }
 
+/*
+ * Called when data is sent from the socket write queue or acknowledged.
+ * Tempesta sockets have no struct socket, so the kernel calls the callback
+ * regardless SOCK_NOSPACE flag, see tcp_check_space().
+ */
+static void
+ss_tcp_write_space(struct sock *sk)
+{
+	SS_CALL(connection_wspace, sk);
+}
+
 /**
  * Socket state change callback.
  */
@@ -948,8 +1276,24 @@ ss_tcp_state_change(struct sock *sk)
 	assert_spin_locked(&sk->sk_lock.slock);
 	TFW_VALIDATE_SK_LOCK_OWNER(sk);
 
-	if (sk->sk_state == TCP_ESTABLISHED) {
-		/* Process the new TCP connection. */
+	if (sk->sk_state == TCP_ESTABLISHED
+	    && (SS_CONN_TYPE(sk) & Conn_FastOpen))
+	{
+		/*
+		 * The handshake of a connection accepted with TCP Fast Open
+		 * is finished, the connection is already processed.
+		 */
+		SS_CONN_TYPE(sk) &= ~Conn_FastOpen;
+	}
+	else if (sk->sk_state == TCP_ESTABLISHED
+		 || sk->sk_state == TCP_SYN_RECV)
+	{
+		/*
+		 * Process the new TCP connection. The callback is called in
+		 * SYN_RECV state for a connection accepted with TCP Fast Open
+		 * right after the SYN with data is received, see
+		 * tcp_conn_request().
+		 */
 		SsProto *proto = sk->sk_user_data;
 		struct sock *lsk = proto->listener;
 		int r;
@@ -966,7 +1310,7 @@ ss_tcp_state_change(struct sock *sk)
 		 * it on our own without calling upper layer hooks.
 		 */
 		if (ss_active_guard_enter(SS_V_ACT_NEWCONN)) {
-			ss_do_close(sk);
+			ss_do_close(sk, 0);
 			sock_put(sk);
 			/*
 			 * The case of a connect to an upstream server that
@@ -979,7 +1323,7 @@ ss_tcp_state_change(struct sock *sk)
 		}
 
 		if (lsk && ss_active_guard_enter(SS_V_ACT_LIVECONN)) {
-			ss_do_close(sk);
+			ss_do_close(sk, 0);
 			sock_put(sk);
 			ss_active_guard_exit(SS_V_ACT_NEWCONN);
 			return;
@@ -1014,6 +1358,12 @@ ss_tcp_state_change(struct sock *sk)
 			sk->sk_allocation = GFP_ATOMIC;
 		}
 		ss_active_guard_exit(SS_V_ACT_NEWCONN);
+
+		/* Process the data from the SYN, if any, right now. */
+		if (sk->sk_state == TCP_SYN_RECV) {
+			SS_CONN_TYPE(sk) |= Conn_FastOpen;
+			ss_tcp_data_ready(sk);
+		}
 	}
 	else if (sk->sk_state == TCP_CLOSE_WAIT) {
 		/*
@@ -1104,6 +1454,9 @@ ss_set_callbacks(struct sock *sk)
 
 	sk->sk_data_ready = ss_tcp_data_ready;
 	sk->sk_state_change = ss_tcp_state_change;
+	sk->sk_write_space = ss_tcp_write_space;
+	/* The connection might be paused on a previous socket. */
+	SS_CONN_TYPE(sk) &= ~Conn_RxPause;
 }
 EXPORT_SYMBOL(ss_set_callbacks);
 
@@ -1346,6 +1699,19 @@ ss_listen(struct sock *sk, int backlog)
 }
 EXPORT_SYMBOL(ss_listen);
 
+/*
+ * Enable cookie-based TCP Fast Open on the listening socket @sk with the
+ * queue of not yet finished handshakes up to @qlen. The server side of TCP
+ * Fast Open must be also enabled with net.ipv4.tcp_fastopen sysctl.
+ */
+int
+ss_fastopen(struct sock *sk, int qlen)
+{
+	return tcp_setsockopt(sk, SOL_TCP, TCP_FASTOPEN, KERNEL_SOCKPTR(&qlen),
+			      sizeof(qlen));
+}
+EXPORT_SYMBOL(ss_fastopen);
+
 /**
  * Mostly copy-pasted from inet_getname() and inet6_getname().
  * All Tempesta internal operations are with IPv6 addresses only,
@@ -1380,94 +1746,129 @@ ss_getpeername(struct sock *sk, TfwAddr *addr)
 }
 EXPORT_SYMBOL(ss_getpeername);
 
-#define __sk_close_locked(sk)					\
+#define __sk_close_locked(sk, flags)				\
 do {								\
-	ss_do_close(sk);					\
+	ss_do_close(sk, flags);					\
 	bh_unlock_sock(sk);					\
 	SS_CALL_GUARD_EXIT(connection_drop, sk);		\
 	sock_put(sk); /* paired with ss_do_close() */		\
 } while (0)
 
 static void
-ss_tx_action(void)
+ss_tx_work(SsWork *sw, SsTxPush *push)
 {
-	SsWork sw;
-	int budget;
+	struct sock *sk = sw->sk;
 	struct sk_buff *skb;
+	u64 t0;
+
+	bh_lock_sock(sk);
+	if (sock_flag(sk, SOCK_DEAD)) {
+		/* We've closed the socket on earlier job. */
+		bh_unlock_sock(sk);
+		goto dead_sock;
+	}
+
+	switch (sw->action) {
+	case SS_SEND:
+		/*
+		 * Don't make TSQ spin on the lock while we're working
+		 * with the socket.
+		 *
+		 * Socket is locked and this synchronizes possible socket
+		 * closing with tcp_tasklet_func(): we must clear the
+		 * TSQ deffered flag with sk->sk_lock.owned = 1.
+		 *
+		 * Set sk->sk_lock.owned = 0 if no closing is required,
+		 * otherwise ss_do_close() does this.
+		 */
+		sk->sk_lock.owned = 1;
+
+		t0 = tfw_lat_start();
+		ss_do_send(sk, &sw->skb_head, sw->flags, push);
+		tfw_lat_end(TFW_LAT_SEND, t0);
+		if (!(sw->flags & SS_F_CONN_CLOSE)) {
+			sk->sk_lock.owned = 0;
+			bh_unlock_sock(sk);
+			break;
+		}
+		/* paired with bh_lock_sock() */
+		__sk_close_locked(sk, sw->flags);
+		break;
+	case SS_CLOSE:
+		/*
+		 * We were asked to close the socket. If current state
+		 * is either ESTABLISHED, SYN_SENT or SYN_RECV (a TCP
+		 * Fast Open connection), we initiate the closing
+		 * process. If for some reason other side sent us FIN,
+		 * we are at CLOSE_WAIT, so the socket closing is in
+		 * progress, but still need to cleanup on our side. If
+		 * we get here while the socket in any other state,
+		 * resources were either already freed or were never
+		 * allocated.
+		 */
+		if (!((1 << sk->sk_state)
+		      & (TCPF_ESTABLISHED | TCPF_SYN_SENT | TCPF_SYN_RECV
+			 | TCPF_CLOSE_WAIT)))
+		{
+			T_DBG2("[%d]: %s: Socket inactive: sk %p\n",
+			       smp_processor_id(), __func__, sk);
+			bh_unlock_sock(sk);
+			break;
+		}
+		/* paired with bh_lock_sock() */
+		__sk_close_locked(sk, sw->flags);
+		break;
+	case SS_RESUME:
+		/* The connection can be dropped while it's paused. */
+		if (sk->sk_user_data) {
+			SS_CONN_TYPE(sk) &= ~Conn_RxPause;
+			ss_tcp_data_ready(sk);
+		}
+		bh_unlock_sock(sk);
+		break;
+	default:
+		BUG();
+	}
+dead_sock:
+	sock_put(sk); /* paired with push() calls */
+	while ((skb = ss_skb_dequeue(&sw->skb_head)))
+		kfree_skb(skb);
+}
+
+static void
+ss_tx_action(void)
+{
+	SsWork sw[SS_TX_BATCH];
+	int i, n, budget;
 	TfwRBQueue *wq = this_cpu_ptr(&si_wq);
-	long ticket = 0;
+	SsTxPush push = { .n = 0 };
+
+	/* Send IPIs for the works queued by the softirqs before. */
+	ss_ipi_flush();
 
 	/*
 	 * @budget limits the loop to prevent live lock on constantly arriving
 	 * new items. We use some small integer as a lower bound to catch just
-	 * arriving items.
+	 * arriving items. The works are fetched in batches to release the
+	 * queue slots to the producers at once.
 	 */
 	budget = max(10UL, ss_wq_local_size(wq));
-	while ((!ss_active() || budget--) && !ss_wq_pop(wq, &sw, &ticket)) {
-		struct sock *sk = sw.sk;
-
-		bh_lock_sock(sk);
-		if (sock_flag(sk, SOCK_DEAD)) {
-			/* We've closed the socket on earlier job. */
-			bh_unlock_sock(sk);
-			goto dead_sock;
-		}
-
-		switch (sw.action) {
-		case SS_SEND:
-			/*
-			 * Don't make TSQ spin on the lock while we're working
-			 * with the socket.
-			 *
-			 * Socket is locked and this synchronizes possible socket
-			 * closing with tcp_tasklet_func(): we must clear the
-			 * TSQ deffered flag with sk->sk_lock.owned = 1.
-			 *
-			 * Set sk->sk_lock.owned = 0 if no closing is required,
-			 * otherwise ss_do_close() does this.
-			 */
-			sk->sk_lock.owned = 1;
-
-			ss_do_send(sk, &sw.skb_head, sw.flags);
-			if (!(sw.flags & SS_F_CONN_CLOSE)) {
-				sk->sk_lock.owned = 0;
-				bh_unlock_sock(sk);
+	for ( ; ; budget -= n) {
+		n = SS_TX_BATCH;
+		if (ss_active()) {
+			if (budget <= 0)
 				break;
-			}
-			/* paired with bh_lock_sock() */
-			__sk_close_locked(sk);
-			break;
-		case SS_CLOSE:
-			/*
-			 * We were asked to close the socket. If current state
-			 * is either ESTABLISHED or SYN_SENT, we initiate the
-			 * closing process. If for some reason other side sent
-			 * us FIN, we are at CLOSE_WAIT, so the socket closing
-			 * is in progress, but still need to cleanup on our
-			 * side. If we get here while the socket in any other
-			 * state, resources were either already freed or were
-			 * never allocated.
-			 */
-			if (!((1 << sk->sk_state)
-			      & (TCPF_ESTABLISHED | TCPF_SYN_SENT | TCPF_CLOSE_WAIT)))
-			{
-				T_DBG2("[%d]: %s: Socket inactive: sk %p\n",
-				       smp_processor_id(), __func__, sk);
-				bh_unlock_sock(sk);
-				break;
-			}
-			/* paired with bh_lock_sock() */
-			__sk_close_locked(sk);
-			break;
-		default:
-			BUG();
+			n = min(n, budget);
 		}
-dead_sock:
-		sock_put(sk); /* paired with push() calls */
-		while ((skb = ss_skb_dequeue(&sw.skb_head)))
-			kfree_skb(skb);
+		if (!(n = ss_wq_pop(wq, sw, n)))
+			break;
+		for (i = 0; i < n; ++i)
+			ss_tx_work(&sw[i], &push);
 	}
 
+	ss_tx_push(&push);
+	ss_ipi_flush();
+
 	/*
 	 * Rearm softirq for local CPU if there are more jobs to do.
 	 * If all jobs are finished, and work queue and backlog are
@@ -1476,6 +1877,8 @@ dead_sock:
 	 * ss_synchronize() is responsible for raising the softirq
 	 * if there are more jobs in the work queue or the backlog.
 	 */
+	if (__this_cpu_read(busy_poll.spin))
+		return; /* the busy polling thread fetches the rest */
 	if (budget)
 		TFW_WQ_IPI_SYNC(ss_wq_local_size, wq);
 
@@ -1499,9 +1902,165 @@ ss_get_stat(SsStat *stat)
 	for_each_online_cpu(cpu) {
 		SsCloseBacklog *cb = &per_cpu(close_backlog, cpu);
 		TfwRBQueue *wq = &per_cpu(si_wq, cpu);
+		SsIpiBatch *b = &per_cpu(ipi_batch, cpu);
 
 		stat[cpu].rb_wq_sz = tfw_wq_size(wq);
 		stat[cpu].backlog_sz = cb->size;
+		stat[cpu].ipi_sent = READ_ONCE(b->sent);
+		stat[cpu].ipi_coalesced = READ_ONCE(b->coalesced);
+	}
+}
+
+/*
+ * Maximum sleep of an idle busy polling thread, microseconds.
+ */
+#define SS_BP_SLEEP_MAX		1000
+
+#ifdef CONFIG_NET_RX_BUSY_POLL
+/**
+ * Stop NAPI polling when there are jobs in the work queue or after @ss_bp_idle
+ * microseconds without jobs, @start is in the units of
+ * busy_loop_current_time(). Also stop if we must reschedule: the loop runs
+ * with saved FPU context, so napi_busy_loop() mustn't call cond_resched().
+ */
+static bool
+ss_busy_poll_end(void *arg, unsigned long start)
+{
+	TfwRBQueue *wq = arg;
+
+	return ss_wq_local_size(wq) || need_resched()
+	       || busy_loop_current_time() - start > ss_bp_idle;
+}
+#endif
+
+/**
+ * Return the CPU to the IPI-driven processing, see TFW_WQ_IPI_SYNC().
+ */
+static void
+ss_busy_poll_idle(SsBusyPoll *bp, TfwRBQueue *wq)
+{
+	local_bh_disable();
+	WRITE_ONCE(bp->spin, false);
+	set_bit(TFW_QUEUE_IPI, &wq->flags);
+	smp_mb__after_atomic();
+	if (ss_wq_local_size(wq))
+		raise_softirq(NET_TX_SOFTIRQ);
+	local_bh_enable();
+}
+
+/**
+ * The busy polling thread. In-place calls of ss_tx_action() and NAPI polling
+ * replace the IPIs and the interrupts while there is traffic for the CPU.
+ * After @ss_bp_idle microseconds without jobs and received segments the thread
+ * enables the IPIs and sleeps, doubling the sleep time while the CPU stays
+ * idle, so an idle CPU isn't burned at 100%.
+ */
+static int
+ss_busy_poll_thr(void *arg)
+{
+	SsBusyPoll *bp = arg;
+	TfwRBQueue *wq = raw_cpu_ptr(&si_wq); /* the thread is bound */
+	unsigned long rx, rx_old = 0;
+	unsigned int sleep = 0;
+	u64 now, last = local_clock();
+
+	set_user_nice(current, MIN_NICE);
+
+	while (!kthread_should_stop()) {
+		bool busy;
+
+		/*
+		 * We're in process context, so save FPU context to call the
+		 * vectorized TLS and HTTP code, softirq does this in
+		 * __do_softirq().
+		 */
+		kernel_fpu_begin_mask(KFPU_MXCSR);
+
+		local_bh_disable();
+		if (!bp->spin) {
+			WRITE_ONCE(bp->spin, true);
+			clear_bit(TFW_QUEUE_IPI, &wq->flags);
+		}
+		busy = ss_wq_local_size(wq);
+		if (busy)
+			ss_tx_action();
+		local_bh_enable();
+
+#ifdef CONFIG_NET_RX_BUSY_POLL
+		if (!busy && READ_ONCE(bp->napi_id) >= MIN_NAPI_ID)
+			napi_busy_loop(READ_ONCE(bp->napi_id),
+				       ss_busy_poll_end, wq);
+#endif
+		kernel_fpu_end();
+
+		rx = READ_ONCE(bp->rx);
+		now = local_clock();
+		if (busy || rx != rx_old) {
+			rx_old = rx;
+			last = now;
+			sleep = 0;
+		}
+		else if (now - last > ss_bp_idle * NSEC_PER_USEC) {
+			ss_busy_poll_idle(bp, wq);
+			sleep = sleep ? min_t(unsigned int, sleep * 2,
+					      SS_BP_SLEEP_MAX)
+				      : max(ss_bp_idle, 10U);
+			usleep_range(sleep, sleep * 2);
+			last = local_clock();
+		}
+		cond_resched();
+	}
+
+	ss_busy_poll_idle(bp, wq);
+
+	return 0;
+}
+
+/**
+ * Start busy polling threads on @cpus. A thread spins while there are jobs
+ * or received segments on its CPU and backs off after @idle microseconds
+ * without them.
+ */
+int
+ss_busy_poll_start(const cpumask_t *cpus, unsigned int idle)
+{
+	int cpu;
+
+	ss_bp_idle = idle;
+	for_each_cpu(cpu, cpus) {
+		SsBusyPoll *bp = &per_cpu(busy_poll, cpu);
+		struct task_struct *thr;
+
+		thr = kthread_create_on_node(ss_busy_poll_thr, bp,
+					     cpu_to_node(cpu),
+					     "tfw_busy_poll/%d", cpu);
+		if (IS_ERR(thr)) {
+			T_ERR_NL("Can't start busy polling thread on CPU %d,"
+				 " %ld\n", cpu, PTR_ERR(thr));
+			ss_busy_poll_stop();
+			return PTR_ERR(thr);
+		}
+		kthread_bind(thr, cpu);
+		bp->thr = thr;
+		wake_up_process(thr);
+	}
+
+	return 0;
+}
+
+void
+ss_busy_poll_stop(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		SsBusyPoll *bp = &per_cpu(busy_poll, cpu);
+
+		if (!bp->thr)
+			continue;
+		kthread_stop(bp->thr);
+		bp->thr = NULL;
+		bp->napi_id = 0;
 	}
 }
 
@@ -1673,5 +2232,6 @@ tfw_sync_socket_exit(void)
 		tfw_wq_destroy(&per_cpu(si_wq, cpu));
 		ss_backlog_validate_cleanup(cpu);
 	}
+	ss_skb_pg_ring_drain();
 	kmem_cache_destroy(ss_cbacklog_cache);
 }
@@ -20,6 +20,12 @@
  * this program; if not, write to the Free Software Foundation, Inc., 59
  * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
+#include <linux/netfilter.h>
+#include <linux/netfilter_ipv4.h>
+#include <linux/netfilter_ipv6.h>
+#include <net/inet6_hashtables.h>
+#include <net/ip.h>
+
 #include "tempesta_fw.h"
 #include "cfg.h"
 #include "client.h"
@@ -28,6 +34,7 @@
 #include "log.h"
 #include "procfs.h"
 #include "server.h"
+#include "stress.h"
 #include "sync_socket.h"
 #include "tls.h"
 
@@ -40,6 +47,9 @@
 static struct kmem_cache *tfw_cli_conn_cache;
 static struct kmem_cache *tfw_h2_conn_cache;
 static int tfw_cli_cfg_ka_timeout = -1;
+static int tfw_cli_cfg_tunnel_timeout;
+/* Not sent data of a client connection throttling servers, zero disables. */
+static int tfw_cli_cfg_notsent_lowat;
 
 static inline struct kmem_cache *
 tfw_cli_cache(int type)
@@ -52,20 +62,205 @@ tfw_cli_cache(int type)
 		tfw_h2_conn_cache : tfw_cli_conn_cache;
 }
 
+/*
+ * Keep-alive timers of client connections.
+ *
+ * Each CPU has a wheel of TFW_KA_SLOTS one second slots with the connections
+ * established on the CPU. A connection is linked to the slot of its
+ * expiration time and sending a response only updates @ka_ts of the
+ * connection, so there is no timer churn and no timer base lock contention
+ * on the hot path. The wheel is swept each second: the idle connections of
+ * the current slot are closed in batches of TFW_KA_BATCH, the active ones are
+ * moved to the slots of their new expiration times. The timeouts longer than
+ * the wheel range are rechecked each TFW_KA_SLOTS seconds. Connections
+ * switched to a tunnel, e.g. WebSocket, use the tunnel timeout and are
+ * postponed by the data passed in either direction.
+ *
+ * @lock	- protects the slots and @ka_cpu of the linked connections;
+ * @now		- the next tick to be swept;
+ * @timer	- the sweep timer pinned to the CPU;
+ * @slots	- lists of the connections by expiration ticks;
+ */
+#define TFW_KA_TICK		HZ
+#define TFW_KA_BITS		6
+#define TFW_KA_SLOTS		(1 << TFW_KA_BITS)
+#define TFW_KA_MASK		(TFW_KA_SLOTS - 1)
+#define TFW_KA_BATCH		64
+
+typedef struct {
+	spinlock_t		lock;
+	unsigned long		now;
+	struct timer_list	timer;
+	struct list_head	slots[TFW_KA_SLOTS];
+} TfwKaWheel;
+
+static DEFINE_PER_CPU(TfwKaWheel, tfw_ka_wheel);
+
+static inline unsigned long
+tfw_ka_timeout(void)
+{
+	return msecs_to_jiffies((long)READ_ONCE(tfw_cli_cfg_ka_timeout) * 1000);
+}
+
+static inline unsigned long
+tfw_ka_tunnel_timeout(void)
+{
+	return msecs_to_jiffies((long)READ_ONCE(tfw_cli_cfg_tunnel_timeout)
+				* 1000);
+}
+
+/*
+ * Link @cli_conn to the slot of expiration time @exp, not earlier than
+ * @min tick and within the wheel range.
+ */
+static void
+__tfw_ka_link(TfwKaWheel *w, TfwCliConn *cli_conn, unsigned long exp,
+	      unsigned long min)
+{
+	unsigned long t = clamp(exp / TFW_KA_TICK, min,
+				w->now + TFW_KA_SLOTS - 1);
+
+	list_add_tail(&cli_conn->ka_list, &w->slots[t & TFW_KA_MASK]);
+}
+
+static void
+tfw_ka_add(TfwCliConn *cli_conn)
+{
+	int cpu = smp_processor_id();
+	TfwKaWheel *w = per_cpu_ptr(&tfw_ka_wheel, cpu);
+
+	cli_conn->ka_ts = jiffies;
+
+	spin_lock(&w->lock);
+	cli_conn->ka_cpu = cpu;
+	__tfw_ka_link(w, cli_conn, cli_conn->ka_ts + tfw_ka_timeout(), w->now);
+	spin_unlock(&w->lock);
+}
+
 static void
-tfw_sock_cli_keepalive_timer_cb(struct timer_list *t)
+tfw_ka_del(TfwCliConn *cli_conn)
 {
-	TfwCliConn *cli_conn = from_timer(cli_conn, t, timer);
+	int cpu = READ_ONCE(cli_conn->ka_cpu);
+	TfwKaWheel *w;
+
+	if (cpu < 0)
+		return;
+	w = per_cpu_ptr(&tfw_ka_wheel, cpu);
+
+	spin_lock(&w->lock);
+	list_del_init(&cli_conn->ka_list);
+	cli_conn->ka_cpu = -1;
+	spin_unlock(&w->lock);
+}
+
+/**
+ * Close the idle connection. Close the socket (and the connection)
+ * asynchronously to not to take the socket lock in the timer context.
+ * In case of error try to close it on the next sweep.
+ *
+ * Idle connections don't deserve FIN_WAIT2 and TIME_WAIT states
+ * under memory pressure, so just reset them.
+ */
+static void
+tfw_ka_close(TfwKaWheel *w, TfwCliConn *cli_conn)
+{
+	struct sock *sk = cli_conn->sk;
+	int r;
 
 	T_DBG("Client timeout end\n");
 
-	/*
-	 * Close the socket (and the connection) asynchronously to avoid
-	 * a deadlock on del_timer_sync(). In case of error try to close
-	 * it one second later.
-	 */
-	if (tfw_connection_close((TfwConn *)cli_conn, false))
-		mod_timer(&cli_conn->timer, jiffies + msecs_to_jiffies(1000));
+	if (sk && tcp_under_memory_pressure(sk))
+		r = tfw_connection_abort((TfwConn *)cli_conn, false);
+	else
+		r = tfw_connection_close((TfwConn *)cli_conn, false);
+	if (r) {
+		spin_lock(&w->lock);
+		if (cli_conn->ka_cpu >= 0)
+			__tfw_ka_link(w, cli_conn, 0, w->now);
+		spin_unlock(&w->lock);
+	}
+}
+
+static void
+tfw_ka_sweep(struct timer_list *t)
+{
+	TfwKaWheel *w = from_timer(w, t, timer);
+	TfwCliConn *idle[TFW_KA_BATCH], *c, *tmp;
+	unsigned long tmt = tfw_ka_timeout(), now = jiffies;
+	unsigned long tun_tmt = tfw_ka_tunnel_timeout();
+	unsigned int i, n = 0;
+
+	spin_lock(&w->lock);
+	while (!time_after(w->now, now / TFW_KA_TICK)) {
+		struct list_head *slot = &w->slots[w->now & TFW_KA_MASK];
+
+		list_for_each_entry_safe(c, tmp, slot, ka_list) {
+			unsigned long exp = READ_ONCE(c->ka_ts);
+
+			exp += READ_ONCE(c->tunnel) ? tun_tmt : tmt;
+
+			list_del_init(&c->ka_list);
+			if (time_before(now, exp)) {
+				__tfw_ka_link(w, c, exp, w->now + 1);
+				continue;
+			}
+			tfw_connection_get((TfwConn *)c);
+			idle[n++] = c;
+			if (n == TFW_KA_BATCH)
+				break;
+		}
+		/* Continue the slot right after the batch is closed. */
+		if (n == TFW_KA_BATCH)
+			break;
+		++w->now;
+	}
+	spin_unlock(&w->lock);
+
+	for (i = 0; i < n; ++i) {
+		tfw_ka_close(w, idle[i]);
+		tfw_connection_put((TfwConn *)idle[i]);
+	}
+
+	mod_timer(&w->timer, n == TFW_KA_BATCH ? jiffies + 1
+					       : w->now * TFW_KA_TICK);
+}
+
+static void
+tfw_ka_start(void)
+{
+	int cpu;
+
+	for_each_online_cpu(cpu) {
+		TfwKaWheel *w = per_cpu_ptr(&tfw_ka_wheel, cpu);
+
+		w->now = jiffies / TFW_KA_TICK;
+		w->timer.expires = (w->now + 1) * TFW_KA_TICK;
+		add_timer_on(&w->timer, cpu);
+	}
+}
+
+static void
+tfw_ka_stop(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		del_timer_sync(&per_cpu_ptr(&tfw_ka_wheel, cpu)->timer);
+}
+
+static void
+tfw_ka_init(void)
+{
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		TfwKaWheel *w = per_cpu_ptr(&tfw_ka_wheel, cpu);
+
+		spin_lock_init(&w->lock);
+		timer_setup(&w->timer, tfw_ka_sweep, TIMER_PINNED);
+		for (i = 0; i < TFW_KA_SLOTS; ++i)
+			INIT_LIST_HEAD(&w->slots[i]);
+	}
 }
 
 static TfwCliConn *
@@ -73,14 +268,22 @@ tfw_cli_conn_alloc(int type)
 {
 	TfwCliConn *cli_conn;
 
-	if (!(cli_conn = kmem_cache_alloc(tfw_cli_cache(type), GFP_ATOMIC)))
+	/* We're in the softirq of the socket, so allocate on the local node. */
+	cli_conn = kmem_cache_alloc_node(tfw_cli_cache(type), GFP_ATOMIC,
+					 numa_node_id());
+	if (!cli_conn)
 		return NULL;
+	tfw_numa_stat_inc(TFW_NUMA_CONN, cli_conn);
 
 	tfw_connection_init((TfwConn *)cli_conn);
 	INIT_LIST_HEAD(&cli_conn->seq_queue);
 	spin_lock_init(&cli_conn->seq_qlock);
 	spin_lock_init(&cli_conn->ret_qlock);
-	spin_lock_init(&cli_conn->timer_lock);
+	INIT_LIST_HEAD(&cli_conn->ka_list);
+	cli_conn->ka_cpu = -1;
+	cli_conn->tunnel = NULL;
+	INIT_LIST_HEAD(&cli_conn->rx_paused);
+	spin_lock_init(&cli_conn->rx_plock);
 #ifdef CONFIG_LOCKDEP
 	/*
 	 * The lock is acquired at only one place where there is no conflict
@@ -92,15 +295,13 @@ tfw_cli_conn_alloc(int type)
 			 &__lockdep_no_validate__, 2);
 #endif
 
-	timer_setup(&cli_conn->timer, tfw_sock_cli_keepalive_timer_cb, 0);
-
 	return cli_conn;
 }
 
 static void
 tfw_cli_conn_free(TfwCliConn *cli_conn)
 {
-	BUG_ON(timer_pending(&cli_conn->timer));
+	BUG_ON(!list_empty(&cli_conn->ka_list));
 
 	/* Check that all nested resources are freed. */
 	tfw_connection_validate_cleanup((TfwConn *)cli_conn);
@@ -127,18 +328,8 @@ tfw_cli_conn_send(TfwCliConn *cli_conn, TfwMsg *msg)
 
 	r = tfw_connection_send((TfwConn *)cli_conn, msg);
 
-	/*
-	 * The lock is needed because the timer deletion was moved from release() to
-	 * drop(). While release() is called when there are no other users, there is
-	 * no such luxury with drop() and the connection can still be used due to
-	 * lingering threads.
-	 */
-	spin_lock(&cli_conn->timer_lock);
-	if (timer_pending(&cli_conn->timer))
-		mod_timer(&cli_conn->timer,
-		          jiffies +
-		          msecs_to_jiffies((long)tfw_cli_cfg_ka_timeout * 1000));
-	spin_unlock(&cli_conn->timer_lock);
+	/* Postpone the keep-alive timeout, see tfw_ka_sweep(). */
+	WRITE_ONCE(cli_conn->ka_ts, jiffies);
 
 	if (r)
 		/* Quite usual on system shutdown. */
@@ -147,6 +338,101 @@ tfw_cli_conn_send(TfwCliConn *cli_conn, TfwMsg *msg)
 	return r;
 }
 
+/*
+ * Send-side backpressure.
+ *
+ * Responses are pushed to the client socket write queue regardless its size,
+ * so a slow client makes us keep all the data received from the server in
+ * memory. If not sent data of the client connection exceeds
+ * client_notsent_lowat, reading from the server connection forwarding the data
+ * is paused, so the data stays in the server socket and the server is
+ * throttled by TCP flow control. The reading is resumed when the client
+ * socket sends enough data, or when the client connection is closed.
+ */
+static bool
+tfw_cli_conn_notsent_over(TfwCliConn *cli_conn)
+{
+	struct sock *sk = cli_conn->sk;
+
+	return ss_sock_live(sk)
+	       && ss_sock_notsent(sk) > READ_ONCE(tfw_cli_cfg_notsent_lowat);
+}
+
+static void
+tfw_cli_conn_rx_resume(TfwCliConn *cli_conn)
+{
+	TfwSrvConn *srv_conn, *tmp;
+	LIST_HEAD(list);
+
+	spin_lock_bh(&cli_conn->rx_plock);
+	list_splice_init(&cli_conn->rx_paused, &list);
+	spin_unlock_bh(&cli_conn->rx_plock);
+
+	list_for_each_entry_safe(srv_conn, tmp, &list, rx_plist) {
+		T_DBG3("resume server connection %pK for client connection"
+		       " %pK\n", srv_conn, cli_conn);
+		list_del_init(&srv_conn->rx_plist);
+		clear_bit_unlock(TFW_CONN_B_RXPAUSE, &srv_conn->flags);
+		/* The reference keeps @srv_conn->sk. */
+		ss_rx_resume(srv_conn->sk);
+		tfw_srv_conn_put(srv_conn);
+	}
+}
+
+/**
+ * Pause reading from server connection @srv_conn, which data is forwarded to
+ * client connection @cli_conn, if the client doesn't keep up with the data.
+ * Must be called in the receive context of @srv_conn.
+ */
+void
+tfw_cli_conn_rx_throttle(TfwCliConn *cli_conn, TfwSrvConn *srv_conn)
+{
+	if (!READ_ONCE(tfw_cli_cfg_notsent_lowat)
+	    || !tfw_cli_conn_notsent_over(cli_conn))
+		return;
+	/* Still in the list of a client, which hasn't resumed it yet. */
+	if (test_and_set_bit_lock(TFW_CONN_B_RXPAUSE, &srv_conn->flags))
+		return;
+
+	T_DBG3("pause server connection %pK for client connection %pK\n",
+	       srv_conn, cli_conn);
+	ss_rx_pause(srv_conn->sk);
+	tfw_connection_get((TfwConn *)srv_conn);
+	spin_lock_bh(&cli_conn->rx_plock);
+	list_add_tail(&srv_conn->rx_plist, &cli_conn->rx_paused);
+	spin_unlock_bh(&cli_conn->rx_plock);
+
+	/*
+	 * The client might send the data before we were added to the list.
+	 * Pairs with smp_mb() in tcp_check_space() before the write space
+	 * callback and with the lock in tfw_sock_clnt_drop().
+	 */
+	smp_mb();
+	if (!tfw_cli_conn_notsent_over(cli_conn))
+		tfw_cli_conn_rx_resume(cli_conn);
+}
+
+/*
+ * The hook is called when a client socket sends or the peer acknowledges
+ * data, i.e. on each ACK, so check the paused connections list first.
+ * HTTP/2 connections send here the response data queued by the streams
+ * scheduler.
+ */
+static void
+tfw_sock_clnt_wspace(struct sock *sk)
+{
+	TfwCliConn *cli_conn = sk->sk_user_data;
+
+	if (TFW_CONN_H2(cli_conn)
+	    && tfw_h2_xmit_wspace(tfw_h2_context(cli_conn), sk))
+		tfw_connection_close((TfwConn *)cli_conn, false);
+
+	if (likely(list_empty(&cli_conn->rx_paused))
+	    || tfw_cli_conn_notsent_over(cli_conn))
+		return;
+	tfw_cli_conn_rx_resume(cli_conn);
+}
+
 /**
  * This hook is called when a new client connection is established.
  */
@@ -156,6 +442,7 @@ tfw_sock_clnt_new(struct sock *sk)
 	int r = -ENOMEM;
 	TfwClient *cli;
 	TfwConn *conn;
+	TfwCliConn *cli_conn;
 	SsProto *listen_sock_proto;
 	TfwAddr addr;
 
@@ -171,6 +458,12 @@ tfw_sock_clnt_new(struct sock *sk)
 	listen_sock_proto = sk->sk_user_data;
 	tfw_connection_unlink_from_sk(sk);
 
+	/* Reset the connection before we spend any memory on it. */
+	if (unlikely(tfw_mem_pressure() >= TFW_MEM_SHORT)) {
+		T_DBG("reject new client connection on memory pressure\n");
+		return -ENOMEM;
+	}
+
 	ss_getpeername(sk, &addr);
 	cli = tfw_client_obtain(addr, NULL, NULL, NULL);
 	if (!cli) {
@@ -185,6 +478,9 @@ tfw_sock_clnt_new(struct sock *sk)
 	}
 
 	ss_proto_inherit(listen_sock_proto, &conn->proto, Conn_Clnt);
+	cli_conn = (TfwCliConn *)conn;
+	cli_conn->xff_len = tfw_addr_fmt(&addr, TFW_NO_PORT, cli_conn->xff)
+			    - cli_conn->xff;
 
 	conn->destructor = (void *)tfw_cli_conn_release;
 
@@ -213,10 +509,7 @@ tfw_sock_clnt_new(struct sock *sk)
 		 */
 		sk->sk_write_xmit = tfw_tls_encrypt;
 
-	/* Activate keepalive timer. */
-	mod_timer(&conn->timer,
-		  jiffies +
-		  msecs_to_jiffies((long)tfw_cli_cfg_ka_timeout * 1000));
+	tfw_ka_add((TfwCliConn *)conn);
 
 	T_DBG3("new client socket is accepted: sk=%p, conn=%p, cli=%p\n",
 	       sk, conn, cli);
@@ -243,9 +536,7 @@ tfw_sock_clnt_drop(struct sock *sk)
 	T_DBG3("connection lost: close client socket: sk=%p, conn=%p, "
 	       "client=%p\n", sk, conn, conn->peer);
 
-	spin_lock(&((TfwCliConn *)conn)->timer_lock);
-	del_timer_sync(&((TfwCliConn *)conn)->timer);
-	spin_unlock(&((TfwCliConn *)conn)->timer_lock);
+	tfw_ka_del((TfwCliConn *)conn);
 
 	/*
 	 * A TLS connection was lost during handshake processing. Call FSM
@@ -265,6 +556,8 @@ tfw_sock_clnt_drop(struct sock *sk)
 	tfw_connection_unlink_from_sk(sk);
 	tfw_connection_unlink_from_peer(conn);
 	tfw_connection_drop(conn);
+	/* Nobody reads the data anymore, let the servers finish it. */
+	tfw_cli_conn_rx_resume((TfwCliConn *)conn);
 
 	/*
 	 * Connection @conn, as well as @sk and @peer that make
@@ -278,6 +571,7 @@ static const SsHooks tfw_sock_clnt_ss_hooks = {
 	.connection_new		= tfw_sock_clnt_new,
 	.connection_drop	= tfw_sock_clnt_drop,
 	.connection_recv	= tfw_connection_recv,
+	.connection_wspace	= tfw_sock_clnt_wspace,
 };
 
 static int
@@ -334,18 +628,50 @@ int tfw_cli_conn_close_all_sync(TfwClient *cli)
 
 #define TFW_LISTEN_SOCK_BACKLOG_LEN 	1024
 
+/*
+ * Listening sockets modes: a single socket per address, or a group of
+ * SO_REUSEPORT sockets with a socket per CPU or per NUMA node.
+ */
+enum {
+	TFW_LISTEN_SINGLE,
+	TFW_LISTEN_PER_CPU,
+	TFW_LISTEN_PER_NODE,
+};
+
+static TfwCfgEnum tfw_listen_mode_enum[] = {
+	{ "off",	TFW_LISTEN_SINGLE },
+	{ "cpu",	TFW_LISTEN_PER_CPU },
+	{ "node",	TFW_LISTEN_PER_NODE },
+	{ 0 }
+};
+
+/* The configured and the running listening mode. */
+static int tfw_listen_mode_cfg;
+static int tfw_listen_mode = TFW_LISTEN_SINGLE;
+
+/* Queue length of TCP Fast Open handshakes, 0 if Fast Open is disabled. */
+static int tfw_listen_fastopen;
+
+/* CPUs dedicated to busy polling and their idle time before the backoff. */
+static cpumask_t tfw_busy_poll_cpus;
+static unsigned int tfw_busy_poll_idle;
+
 /**
  * The listening socket representation.
  * One such structure corresponds to one "listen" configuration entry.
  *
  * @proto	- protocol descriptor for the listening socket;
- * @sk		- The underlying networking representation.
+ * @sk		- The underlying networking representation, an array of the
+ *		  per-CPU or per-node sockets indexed by CPU or node id
+ *		  in TFW_LISTEN_PER_* modes;
+ * @sk_n	- number of entries in @sk array;
  * @list	- An entry in the tfw_listen_socks list.
  * @addr	- The IP address specified in the configuration.
  */
 typedef struct {
 	SsProto			proto;
-	struct sock		*sk;
+	struct sock		**sk;
+	unsigned int		sk_n;
 	struct list_head	list;
 	TfwAddr			addr;
 } TfwListenSock;
@@ -415,19 +741,16 @@ tfw_listen_sock_del_all(void)
 }
 
 /**
- * Start listening on a socket.
- * Create a new socket in @ls->sk that listens the @ls->addr.
+ * Create a new socket in @ls->sk[@i] that listens the @ls->addr.
  * This is similar to a classic socket()/bind()/listen() sequence.
  */
 static int
-tfw_listen_sock_start(TfwListenSock *ls)
+__tfw_listen_sock_start(TfwListenSock *ls, unsigned int i)
 {
 	int r;
 	struct sock *sk;
 	TfwAddr *addr = &ls->addr;
 
-	T_LOG_ADDR("Open listen socket on", addr, TFW_WITH_PORT);
-
 	r = ss_sock_create(tfw_addr_sa_family(addr), SOCK_STREAM, IPPROTO_TCP,
 	                   &sk);
 	if (r) {
@@ -438,8 +761,9 @@ tfw_listen_sock_start(TfwListenSock *ls)
 	/*
 	 * Link the new socket and TfwListenSock.
 	 * That must be done before calling ss_set_listen() that uses SsProto.
+	 * All the sockets of a reuseport group share the same SsProto.
 	 */
-	ls->sk = sk;
+	ls->sk[i] = sk;
 	sk->sk_user_data = ls;
 
 	/*
@@ -450,12 +774,19 @@ tfw_listen_sock_start(TfwListenSock *ls)
 
 	inet_sk(sk)->freebind = 1;
 	sk->sk_reuse = 1;
+	sk->sk_reuseport = tfw_listen_mode != TFW_LISTEN_SINGLE;
 	r = ss_bind(sk, addr);
 	if (r) {
 		T_ERR_ADDR("can't bind to", addr, TFW_WITH_PORT);
 		goto err;
 	}
 
+	if (tfw_listen_fastopen && (r = ss_fastopen(sk, tfw_listen_fastopen))) {
+		T_ERR_NL("can't enable TCP Fast Open on front-end socket sk=%p"
+			 " (%d)\n", sk, r);
+		goto err;
+	}
+
 	T_DBG("start listening on socket: sk=%p\n", sk);
 	r = ss_listen(sk, TFW_LISTEN_SOCK_BACKLOG_LEN);
 	if (r) {
@@ -467,11 +798,188 @@ tfw_listen_sock_start(TfwListenSock *ls)
 	return 0;
 
 err:
-	ss_release(ls->sk);
+	ss_release(sk);
+	ls->sk[i] = NULL;
+	return r;
+}
+
+static void
+tfw_listen_sock_stop(TfwListenSock *ls)
+{
+	unsigned int i;
+
+	if (!ls->sk)
+		return;
+	for (i = 0; i < ls->sk_n; ++i)
+		if (ls->sk[i])
+			ss_release(ls->sk[i]);
+	kfree(ls->sk);
 	ls->sk = NULL;
+}
+
+/**
+ * Start listening on a socket, or on a socket per CPU or per NUMA node
+ * depending on the listening mode.
+ */
+static int
+tfw_listen_sock_start(TfwListenSock *ls)
+{
+	int r, i;
+
+	T_LOG_ADDR("Open listen socket on", &ls->addr, TFW_WITH_PORT);
+
+	switch (tfw_listen_mode) {
+	case TFW_LISTEN_PER_CPU:
+		ls->sk_n = nr_cpu_ids;
+		break;
+	case TFW_LISTEN_PER_NODE:
+		ls->sk_n = nr_node_ids;
+		break;
+	default:
+		ls->sk_n = 1;
+	}
+	ls->sk = kcalloc(ls->sk_n, sizeof(struct sock *), GFP_KERNEL);
+	if (!ls->sk)
+		return -ENOMEM;
+
+	switch (tfw_listen_mode) {
+	case TFW_LISTEN_PER_CPU:
+		for_each_possible_cpu(i)
+			if ((r = __tfw_listen_sock_start(ls, i)))
+				goto err;
+		break;
+	case TFW_LISTEN_PER_NODE:
+		for_each_node_with_cpus(i)
+			if ((r = __tfw_listen_sock_start(ls, i)))
+				goto err;
+		break;
+	default:
+		if ((r = __tfw_listen_sock_start(ls, 0)))
+			goto err;
+	}
+
+	return 0;
+err:
+	tfw_listen_sock_stop(ls);
 	return r;
 }
 
+/**
+ * Find the listening socket for @daddr:@dport local to the current CPU in
+ * TFW_LISTEN_PER_* modes. An exact listening address is preferred to the
+ * wildcard ones.
+ */
+static struct sock *
+tfw_listen_sock_local(const struct in6_addr *daddr, __be16 dport)
+{
+	TfwListenSock *ls, *found = NULL;
+	unsigned int i;
+
+	list_for_each_entry(ls, &tfw_listen_socks, list) {
+		const struct in6_addr *a = &ls->addr.sin6_addr;
+
+		if (tfw_addr_port(&ls->addr) != dport)
+			continue;
+		if (ipv6_addr_equal(a, daddr)) {
+			found = ls;
+			break;
+		}
+		if (ipv6_addr_any(a)
+		    || (ipv6_addr_v4mapped(a) && ipv6_addr_v4mapped(daddr)
+			&& !a->s6_addr32[3]))
+			found = ls;
+	}
+	if (!found)
+		return NULL;
+
+	i = tfw_listen_mode == TFW_LISTEN_PER_CPU ? smp_processor_id()
+						  : numa_node_id();
+
+	return i < found->sk_n ? found->sk[i] : NULL;
+}
+
+/**
+ * Deliver SYN segments to the listening socket of the current CPU or NUMA
+ * node. Without the steering SO_REUSEPORT chooses a socket of the group by
+ * the connection hash, which doesn't match the RSS queues, so the listening
+ * socket would be shared by all the CPUs anyway.
+ *
+ * The hook runs at LOCAL_IN, so only locally delivered segments are steered.
+ * The socket is assigned to the skb just like TPROXY does, and the TCP layer
+ * takes it instead of the lookup. If there is a socket for the connection
+ * already, e.g. in TIME-WAIT state, it's assigned the same way as early demux
+ * does.
+ */
+static unsigned int
+tfw_listen_steer(void *priv, struct sk_buff *skb,
+		 const struct nf_hook_state *state)
+{
+	struct tcphdr _th;
+	const struct tcphdr *th;
+	struct in6_addr saddr, daddr;
+	struct sock *sk;
+	unsigned int off;
+
+	if (skb->sk)
+		return NF_ACCEPT;
+
+	if (state->pf == NFPROTO_IPV4) {
+		if (ip_hdr(skb)->protocol != IPPROTO_TCP
+		    || ip_is_fragment(ip_hdr(skb)))
+			return NF_ACCEPT;
+		off = ip_hdrlen(skb);
+		ipv6_addr_set_v4mapped(ip_hdr(skb)->saddr, &saddr);
+		ipv6_addr_set_v4mapped(ip_hdr(skb)->daddr, &daddr);
+	} else {
+		if (ipv6_hdr(skb)->nexthdr != IPPROTO_TCP)
+			return NF_ACCEPT;
+		off = sizeof(struct ipv6hdr);
+		saddr = ipv6_hdr(skb)->saddr;
+		daddr = ipv6_hdr(skb)->daddr;
+	}
+	th = skb_header_pointer(skb, off, sizeof(_th), &_th);
+	if (!th || !th->syn || th->ack || th->rst)
+		return NF_ACCEPT;
+
+	if (state->pf == NFPROTO_IPV4)
+		sk = __inet_lookup_established(state->net, &tcp_hashinfo,
+					       ip_hdr(skb)->saddr, th->source,
+					       ip_hdr(skb)->daddr,
+					       ntohs(th->dest),
+					       inet_iif(skb), inet_sdif(skb));
+	else
+		sk = __inet6_lookup_established(state->net, &tcp_hashinfo,
+						&saddr, th->source, &daddr,
+						ntohs(th->dest),
+						inet6_iif(skb),
+						inet6_sdif(skb));
+	if (!sk) {
+		sk = tfw_listen_sock_local(&daddr, th->dest);
+		if (!sk)
+			return NF_ACCEPT;
+		sock_hold(sk);
+	}
+	skb->sk = sk;
+	skb->destructor = sock_edemux;
+
+	return NF_ACCEPT;
+}
+
+static struct nf_hook_ops tfw_listen_nf_ops[] __read_mostly = {
+	{
+		.hook		= tfw_listen_steer,
+		.pf		= NFPROTO_IPV4,
+		.hooknum	= NF_INET_LOCAL_IN,
+		.priority	= NF_IP_PRI_LAST,
+	},
+	{
+		.hook		= tfw_listen_steer,
+		.pf		= NFPROTO_IPV6,
+		.hooknum	= NF_INET_LOCAL_IN,
+		.priority	= NF_IP6_PRI_LAST,
+	},
+};
+
 static int
 tfw_sock_check_lst(TfwServer *srv)
 {
@@ -585,6 +1093,40 @@ tfw_cfgop_keepalive_timeout(TfwCfgSpec *cs, TfwCfgEntry *ce)
 	return 0;
 }
 
+/**
+ * busy_poll <cpulist> [idle=<usecs>];
+ */
+static int
+tfw_cfgop_busy_poll(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	const char *in_str;
+
+	if (tfw_cfg_check_val_n(ce, 1))
+		return -EINVAL;
+
+	cpumask_clear(&tfw_busy_poll_cpus);
+	tfw_busy_poll_idle = 50;
+	if (!strcasecmp(ce->vals[0], "off"))
+		return 0;
+
+	if (cpulist_parse(ce->vals[0], &tfw_busy_poll_cpus)
+	    || !cpumask_subset(&tfw_busy_poll_cpus, cpu_online_mask))
+	{
+		T_ERR_NL("Bad 'busy_poll' CPU list: '%s'\n", ce->vals[0]);
+		cpumask_clear(&tfw_busy_poll_cpus);
+		return -EINVAL;
+	}
+	in_str = tfw_cfg_get_attr(ce, "idle", NULL);
+	if (in_str && (tfw_cfg_parse_uint(in_str, &tfw_busy_poll_idle)
+		       || !tfw_busy_poll_idle))
+	{
+		T_ERR_NL("Bad 'busy_poll' idle time: '%s'\n", in_str);
+		cpumask_clear(&tfw_busy_poll_cpus);
+		return -EINVAL;
+	}
+
+	return 0;
+}
 
 static void
 tfw_cfgop_cleanup_sock_clnt(TfwCfgSpec *cs)
@@ -621,6 +1163,8 @@ tfw_sock_clnt_start(void)
 	if (tfw_runstate_is_reconfig())
 		return 0;
 
+	tfw_ka_start();
+	tfw_listen_mode = tfw_listen_mode_cfg;
 	list_for_each_entry(ls, &tfw_listen_socks, list) {
 		if ((r = tfw_listen_sock_start(ls))) {
 			T_ERR_ADDR("can't start listening on", &ls->addr,
@@ -628,16 +1172,26 @@ tfw_sock_clnt_start(void)
 			goto err;
 		}
 	}
+	if (tfw_listen_mode != TFW_LISTEN_SINGLE
+	    && (r = nf_register_net_hooks(&init_net, tfw_listen_nf_ops,
+					  ARRAY_SIZE(tfw_listen_nf_ops))))
+	{
+		T_ERR_NL("can't register listening sockets steering hooks\n");
+		goto err;
+	}
+	if ((r = ss_busy_poll_start(&tfw_busy_poll_cpus, tfw_busy_poll_idle)))
+		goto err_bp;
 
 	return 0;
 
+err_bp:
+	if (tfw_listen_mode != TFW_LISTEN_SINGLE)
+		nf_unregister_net_hooks(&init_net, tfw_listen_nf_ops,
+					ARRAY_SIZE(tfw_listen_nf_ops));
 err:
-	list_for_each_entry(ls, &tfw_listen_socks, list) {
-		if (!ls->sk)
-			continue;
-		ss_release(ls->sk);
-		ls->sk = NULL;
-	}
+	list_for_each_entry(ls, &tfw_listen_socks, list)
+		tfw_listen_sock_stop(ls);
+	tfw_ka_stop();
 
 	return r;
 }
@@ -652,13 +1206,14 @@ tfw_sock_clnt_stop(void)
 
 	might_sleep();
 
+	ss_busy_poll_stop();
+
 	/* Stop listening sockets. */
-	list_for_each_entry(ls, &tfw_listen_socks, list) {
-		if (!ls->sk)
-			continue;
-		ss_release(ls->sk);
-		ls->sk = NULL;
-	}
+	if (tfw_listen_mode != TFW_LISTEN_SINGLE)
+		nf_unregister_net_hooks(&init_net, tfw_listen_nf_ops,
+					ARRAY_SIZE(tfw_listen_nf_ops));
+	list_for_each_entry(ls, &tfw_listen_socks, list)
+		tfw_listen_sock_stop(ls);
 	ss_wait_newconn();
 
 	/*
@@ -681,6 +1236,8 @@ tfw_sock_clnt_stop(void)
 		local_bh_disable();
 	}
 	local_bh_enable();
+
+	tfw_ka_stop();
 }
 
 static TfwCfgSpec tfw_sock_clnt_specs[] = {
@@ -698,6 +1255,53 @@ static TfwCfgSpec tfw_sock_clnt_specs[] = {
 		.cleanup = tfw_cfgop_cleanup_sock_clnt,
 		.allow_repeat = false,
 	},
+	{
+		.name = "tunnel_timeout",
+		.deflt = "3600",
+		.handler = tfw_cfg_set_int,
+		.dest = &tfw_cli_cfg_tunnel_timeout,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 1, INT_MAX },
+		},
+		.allow_repeat = false,
+	},
+	{
+		.name = "client_notsent_lowat",
+		.deflt = "0",
+		.handler = tfw_cfg_set_int,
+		.dest = &tfw_cli_cfg_notsent_lowat,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, INT_MAX },
+		},
+		.allow_repeat = false,
+	},
+	{
+		.name = "listen_reuseport",
+		.deflt = "off",
+		.handler = tfw_cfg_set_int,
+		.dest = &tfw_listen_mode_cfg,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.enums = tfw_listen_mode_enum,
+			.range = { TFW_LISTEN_SINGLE, TFW_LISTEN_PER_NODE },
+		},
+		.allow_repeat = false,
+	},
+	{
+		.name = "listen_fastopen",
+		.deflt = "0",
+		.handler = tfw_cfg_set_int,
+		.dest = &tfw_listen_fastopen,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, INT_MAX },
+		},
+		.allow_repeat = false,
+	},
+	{
+		.name = "busy_poll",
+		.deflt = "off",
+		.handler = tfw_cfgop_busy_poll,
+		.allow_repeat = false,
+	},
 	{ 0 }
 };
 
@@ -735,6 +1339,7 @@ tfw_sock_clnt_init(void)
 					       sizeof(TfwH2Conn), 0, 0, NULL);
 
 	if (tfw_cli_conn_cache && tfw_h2_conn_cache) {
+		tfw_ka_init();
 		tfw_mod_register(&tfw_sock_clnt_mod);
 		return 0;
 	}
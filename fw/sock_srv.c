@@ -23,6 +23,7 @@
 #include <linux/net.h>
 #include <linux/wait.h>
 #include <linux/freezer.h>
+#include <linux/random.h>
 #include <net/inet_sock.h>
 
 #include "apm.h"
@@ -126,6 +127,9 @@ static const unsigned long tfw_srv_tmo_vals[] = { 1, 10, 100, 250, 500, 1000 };
 	T_WARN_MOD_ADDR(sock_srv, check, addr, TFW_WITH_PORT, fmt,	\
 			##__VA_ARGS__)
 
+/* Time after which a restored server is scheduled as usual anyway. */
+#define TFW_SRV_WARMUP_TMO	HZ
+
 static inline void
 tfw_srv_conn_stop(TfwSrvConn *srv_conn)
 {
@@ -162,6 +166,29 @@ tfw_srv_conn_stop(TfwSrvConn *srv_conn)
  * respective servers. This may serve as a QoS feature that mitigates
  * some temporary short periods when servers are not available.
  */
+/*
+ * Reserve a time slot for a connect attempt to @srv not earlier than @jexp,
+ * so the connect attempts to the server don't exceed @conn_rate of its group.
+ * Rates above HZ are limited by one attempt per jiffy. Return the slot time.
+ */
+static unsigned long
+tfw_sock_srv_conn_slot(TfwServer *srv, unsigned long jexp)
+{
+	unsigned int rate = READ_ONCE(srv->sg->conn_rate);
+	unsigned long slot, old, cur, step;
+
+	if (!rate)
+		return jexp;
+	step = max_t(unsigned long, HZ / rate, 1);
+
+	for (old = READ_ONCE(srv->jconn_slot); ; old = cur) {
+		slot = time_after(old, jexp) ? old : jexp;
+		cur = cmpxchg(&srv->jconn_slot, old, slot + step);
+		if (cur == old)
+			return slot;
+	}
+}
+
 static inline void
 tfw_sock_srv_connect_try_later(TfwSrvConn *srv_conn)
 {
@@ -186,8 +213,16 @@ tfw_sock_srv_connect_try_later(TfwSrvConn *srv_conn)
 		timeout = tfw_srv_tmo_vals[ARRAY_SIZE(tfw_srv_tmo_vals) - 1];
 	}
 	srv_conn->recns++;
+	/*
+	 * Spread the backoff timeouts of the connections failed at once by
+	 * +/-25%, so they don't reconnect to a restarted server in a burst.
+	 */
+	if (timeout >= 100)
+		timeout += prandom_u32_max(timeout / 2 + 1) - timeout / 4;
 
-	mod_timer(&srv_conn->timer, jiffies + msecs_to_jiffies(timeout));
+	mod_timer(&srv_conn->timer,
+		  tfw_sock_srv_conn_slot((TfwServer *)srv_conn->peer,
+					 jiffies + msecs_to_jiffies(timeout)));
 }
 
 static void
@@ -204,13 +239,20 @@ tfw_srv_conn_release(TfwSrvConn *srv_conn)
 	/*
 	 * After a disconnect, new connect attempts are started
 	 * in deferred context after a short pause (in a timer
-	 * callback). The only reason not to start new reconnect
-	 * attempt is removing server from the current configuration.
+	 * callback). The only reasons not to start new reconnect
+	 * attempt are removing server from the current configuration
+	 * and shrinking of the connection pool. Requests might be
+	 * scheduled to the connection before it was closed to shrink
+	 * the pool, so the connection is restored to forward them.
 	 */
-	if (likely(!test_bit(TFW_CONN_B_DEL, &srv_conn->flags)))
-		tfw_sock_srv_connect_try_later(srv_conn);
-	else
+	if (unlikely(test_bit(TFW_CONN_B_DEL, &srv_conn->flags)))
 		tfw_srv_conn_stop(srv_conn);
+	else if (test_and_clear_bit(TFW_CONN_B_SHRINK, &srv_conn->flags)
+		 && list_empty(&srv_conn->fwd_queue)
+		 && llist_empty(&srv_conn->fwd_inq))
+		set_bit(TFW_CONN_B_PARKED, &srv_conn->flags);
+	else
+		tfw_sock_srv_connect_try_later(srv_conn);
 }
 
 /**
@@ -325,6 +367,56 @@ tfw_srv_reset_cfg_actions(TfwServer *srv)
 	} while (cmpxchg(&srv->flags, flags, new_flags) != flags);
 }
 
+/*
+ * Connection @cur to @srv is established. If it's the first live connection
+ * after all the server connections were down, e.g. the server is restarted,
+ * then reconnect the rest of the connections right away, paced by @conn_rate
+ * of the group, instead of waiting for their backoff timeouts. Until a half
+ * of the connections is established the server is warming up, so schedulers
+ * may prefer other servers instead of putting the whole load onto the few
+ * established connections.
+ */
+static void
+tfw_sock_srv_warmup(TfwServer *srv, TfwSrvConn *cur)
+{
+	TfwSrvConn *srv_conn;
+	unsigned long jexp;
+	unsigned int pool = 0, live = 1;
+
+	spin_lock_bh(&srv->conn_lock);
+
+	list_for_each_entry(srv_conn, &srv->conn_list, list) {
+		if (test_bit(TFW_CONN_B_PARKED, &srv_conn->flags)
+		    || test_bit(TFW_CONN_B_DEL, &srv_conn->flags))
+			continue;
+		++pool;
+		if (srv_conn != cur && tfw_srv_conn_live(srv_conn))
+			++live;
+	}
+
+	if (live == 1 && pool > 1) {
+		WRITE_ONCE(srv->jwarm, jiffies + TFW_SRV_WARMUP_TMO);
+		set_bit(TFW_SRV_B_WARMUP, &srv->flags);
+
+		list_for_each_entry(srv_conn, &srv->conn_list, list) {
+			if (test_bit(TFW_CONN_B_PARKED, &srv_conn->flags)
+			    || test_bit(TFW_CONN_B_DEL, &srv_conn->flags)
+			    || srv_conn == cur
+			    || !timer_pending(&srv_conn->timer)
+			    || !time_after(srv_conn->timer.expires, jiffies))
+				continue;
+			/* Only move pending reconnects earlier. */
+			jexp = tfw_sock_srv_conn_slot(srv, jiffies);
+			if (time_before(jexp, srv_conn->timer.expires))
+				mod_timer_pending(&srv_conn->timer, jexp);
+		}
+	}
+	if (live * 2 >= pool)
+		clear_bit(TFW_SRV_B_WARMUP, &srv->flags);
+
+	spin_unlock_bh(&srv->conn_lock);
+}
+
 /**
  * The hook is executed when a server connection is established.
  */
@@ -343,6 +435,8 @@ tfw_sock_srv_connect_complete(struct sock *sk)
 		return r;
 	}
 
+	/* Schedulers prefer connections processed by the current CPU. */
+	WRITE_ONCE(((TfwSrvConn *)conn)->cpu, sk->sk_incoming_cpu);
 	/* Let schedulers use the connection hereafter. */
 	tfw_connection_revive(conn);
 
@@ -351,6 +445,7 @@ tfw_sock_srv_connect_complete(struct sock *sk)
 		tfw_connection_repair(conn);
 
 	__reset_retry_timer((TfwSrvConn *)conn);
+	tfw_sock_srv_warmup(srv, (TfwSrvConn *)conn);
 
 	T_DBG_ADDR("connected", &srv->addr, TFW_WITH_PORT);
 	TFW_INC_STAT_BH(serv.conn_established);
@@ -468,7 +563,8 @@ tfw_sock_srv_disconnect(TfwConn *conn)
 	 * 2. Error occurred during failovering procedure and connection's
 	 *    destructor is called;
 	 * 3. Unrecoverable error occurred during failovering procedure and
-	 *    connection is stopped via @tfw_srv_conn_stop().
+	 *    connection is stopped via @tfw_srv_conn_stop();
+	 * 4. Connection is parked in the pool, see tfw_sock_srv_scale().
 	 * If connection's destructor will have any other result - the cycle
 	 * will last forever.
 	 */
@@ -481,7 +577,12 @@ tfw_sock_srv_disconnect(TfwConn *conn)
 		 * procedure, and server had not been put. See for details in
 		 * connection's destructor @tfw_srv_conn_release().
 		 */
-		if (del_timer_sync(&conn->timer)) {
+		if (del_timer_sync(&srv_conn->timer)) {
+			tfw_srv_conn_stop(srv_conn);
+			break;
+		}
+		/* The connection is closed and kept in the pool. */
+		if (test_and_clear_bit(TFW_CONN_B_PARKED, &srv_conn->flags)) {
 			tfw_srv_conn_stop(srv_conn);
 			break;
 		}
@@ -508,6 +609,140 @@ tfw_sock_srv_disconnect(TfwConn *conn)
 	return 0;
 }
 
+/*
+ * ------------------------------------------------------------------------
+ *	Connection pool scaling.
+ * ------------------------------------------------------------------------
+ *
+ * All @conn_n connections of a server are allocated at configuration time,
+ * but if @conn_min is less than @conn_n, then only @conn_min connections
+ * are established and the rest are parked. The pool is checked each
+ * TFW_SRV_SCALE_INTVL: parked connections are established if requests
+ * wait in the forwarding queues, i.e. there are more requests than
+ * connections, or if the server response time is higher than @scale_rtt
+ * of the server group. If there are idle connections for
+ * TFW_SRV_SCALE_IDLE_N subsequent checks, then one of them is closed and
+ * parked. Parked connections aren't live, so schedulers don't use them.
+ */
+#define TFW_SRV_SCALE_INTVL	HZ
+#define TFW_SRV_SCALE_IDLE_N	10
+
+typedef struct {
+	unsigned int	pool;
+	unsigned int	live;
+	unsigned int	idle;
+	unsigned int	qsize;
+	unsigned int	grow;
+	bool		shrink;
+} TfwSrvScale;
+
+static void
+tfw_sock_srv_scale_grow(TfwSrvConn *srv_conn, TfwSrvScale *sc)
+{
+	if (!sc->grow || test_bit(TFW_CONN_B_DEL, &srv_conn->flags)
+	    || !test_and_clear_bit(TFW_CONN_B_PARKED, &srv_conn->flags))
+		return;
+
+	__reset_retry_timer(srv_conn);
+	tfw_sock_srv_connect_try_later(srv_conn);
+	sc->grow--;
+}
+
+static void
+tfw_sock_srv_scale_shrink(TfwSrvConn *srv_conn, TfwSrvScale *sc)
+{
+	if (!sc->shrink || test_bit(TFW_CONN_B_TUNNEL, &srv_conn->flags)
+	    || !tfw_srv_conn_get_if_live(srv_conn))
+		return;
+
+	if (!READ_ONCE(srv_conn->qsize) && llist_empty(&srv_conn->fwd_inq)
+	    && !test_and_set_bit(TFW_CONN_B_SHRINK, &srv_conn->flags))
+	{
+		T_DBG_ADDR("shrink connection pool", &srv_conn->peer->addr,
+			   TFW_WITH_PORT);
+		if (tfw_connection_close((TfwConn *)srv_conn, false))
+			clear_bit(TFW_CONN_B_SHRINK, &srv_conn->flags);
+		else
+			sc->shrink = false;
+	}
+	tfw_srv_conn_put(srv_conn);
+}
+
+/**
+ * Tell if the response time of server @srv is too high.
+ */
+static bool
+tfw_sock_srv_scale_slow(TfwServer *srv)
+{
+	unsigned int val[T_PSZ] = { 0 };
+	TfwPrcntlStats pstats = {
+		.ith = tfw_pstats_ith,
+		.val = val,
+	};
+
+	if (!srv->sg->scale_rtt || !srv->apmref)
+		return false;
+	tfw_apm_stats(srv->apmref, &pstats);
+
+	return val[TFW_PSTATS_IDX_P90] > srv->sg->scale_rtt;
+}
+
+static void
+tfw_sock_srv_scale(struct timer_list *t)
+{
+	TfwServer *srv = from_timer(srv, t, scale_timer);
+	TfwSrvConn *srv_conn;
+	TfwSrvScale sc = { 0 };
+
+	spin_lock_bh(&srv->conn_lock);
+	/* Tunnels are out of the pool until they're closed. */
+	list_for_each_entry(srv_conn, &srv->conn_list, list) {
+		if (test_bit(TFW_CONN_B_PARKED, &srv_conn->flags)
+		    || test_bit(TFW_CONN_B_TUNNEL, &srv_conn->flags))
+			continue;
+		sc.pool++;
+		if (!tfw_srv_conn_live(srv_conn))
+			continue;
+		sc.live++;
+		sc.qsize += READ_ONCE(srv_conn->qsize);
+		if (!READ_ONCE(srv_conn->qsize))
+			sc.idle++;
+	}
+
+	if (sc.pool < srv->conn_min)
+		sc.grow = srv->conn_min - sc.pool;
+	else if (sc.qsize > sc.live)
+		sc.grow = sc.qsize - sc.live;
+	else if (sc.live == sc.pool && tfw_sock_srv_scale_slow(srv))
+		sc.grow = 1;
+
+	if (sc.grow || !sc.idle || sc.pool <= srv->conn_min)
+		srv->scale_idle = 0;
+	else if (++srv->scale_idle >= TFW_SRV_SCALE_IDLE_N)
+		sc.shrink = true;
+
+	list_for_each_entry(srv_conn, &srv->conn_list, list) {
+		if (!sc.grow && !sc.shrink)
+			break;
+		tfw_sock_srv_scale_grow(srv_conn, &sc);
+		tfw_sock_srv_scale_shrink(srv_conn, &sc);
+	}
+	spin_unlock_bh(&srv->conn_lock);
+
+	/* An idle connection is closed, count the idle checks again. */
+	if (!sc.shrink && srv->scale_idle >= TFW_SRV_SCALE_IDLE_N)
+		srv->scale_idle = 0;
+	if (srv->conn_min < srv->conn_n)
+		mod_timer(&srv->scale_timer, jiffies + TFW_SRV_SCALE_INTVL);
+}
+
+static void
+tfw_sock_srv_scale_start(TfwServer *srv)
+{
+	if (srv->conn_min < srv->conn_n && !timer_pending(&srv->scale_timer))
+		mod_timer(&srv->scale_timer, jiffies + TFW_SRV_SCALE_INTVL);
+}
+
 /*
  * ------------------------------------------------------------------------
  *	Global connect/disconnect routines.
@@ -538,6 +773,7 @@ tfw_sock_srv_conn_activate(TfwServer *srv, TfwSrvConn *srv_conn)
 static void
 tfw_sock_srv_connect_srv(TfwServer *srv)
 {
+	size_t i = 0;
 	TfwSrvConn *srv_conn;
 
 	/*
@@ -547,11 +783,17 @@ tfw_sock_srv_connect_srv(TfwServer *srv)
 	 * in parallel in both user and SoftIRQ contexts as the socket
 	 * is locked, and spews lots of warnings. LOCKDEP doesn't know
 	 * that parallel execution can't happen with the same socket.
+	 *
+	 * Connections above @conn_min are established on a load growth.
 	 */
 	list_for_each_entry(srv_conn, &srv->conn_list, list) {
 		tfw_sock_srv_conn_activate(srv, srv_conn);
-		tfw_sock_srv_connect_try_later(srv_conn);
+		if (i++ < srv->conn_min)
+			tfw_sock_srv_connect_try_later(srv_conn);
+		else
+			set_bit(TFW_CONN_B_PARKED, &srv_conn->flags);
 	}
+	tfw_sock_srv_scale_start(srv);
 }
 
 /**
@@ -568,6 +810,8 @@ tfw_sock_srv_disconnect_srv(TfwServer *srv)
 {
 	TfwConn *conn;
 
+	del_timer_sync(&srv->scale_timer);
+
 	return tfw_peer_for_each_conn(srv, conn, list,
 				      tfw_sock_srv_disconnect);
 }
@@ -605,6 +849,9 @@ tfw_srv_conn_alloc(void)
 	INIT_LIST_HEAD(&srv_conn->fwd_queue);
 	INIT_LIST_HEAD(&srv_conn->nip_queue);
 	spin_lock_init(&srv_conn->fwd_qlock);
+	init_llist_head(&srv_conn->fwd_inq);
+	INIT_LIST_HEAD(&srv_conn->rx_plist);
+	srv_conn->cpu = -1;
 
 	/*
 	 * Initialization into special value for force releasing
@@ -613,6 +860,7 @@ tfw_srv_conn_alloc(void)
 	atomic_set(&srv_conn->refcnt, TFW_CONN_DEATHCNT);
 
 	__setup_retry_timer(srv_conn);
+	timer_setup(&srv_conn->hedge_timer, tfw_http_hedge_timer_cb, 0);
 	ss_proto_init(&srv_conn->proto, &tfw_sock_srv_ss_hooks, Conn_HttpSrv);
 
 	return srv_conn;
@@ -622,12 +870,15 @@ static void
 tfw_srv_conn_free(TfwSrvConn *srv_conn)
 {
 	BUG_ON(timer_pending(&srv_conn->timer));
+	del_timer_sync(&srv_conn->hedge_timer);
 
 	/* Check that all nested resources are freed. */
 	tfw_connection_validate_cleanup((TfwConn *)srv_conn);
 	BUG_ON(!list_empty(&srv_conn->nip_queue));
+	BUG_ON(!llist_empty(&srv_conn->fwd_inq));
 	BUG_ON(READ_ONCE(srv_conn->qsize));
 
+	tfw_h2_srv_context_free(srv_conn->h2);
 	kmem_cache_free(tfw_srv_conn_cache, srv_conn);
 }
 
@@ -877,6 +1128,7 @@ static struct kmem_cache *tfw_sg_cfg_cache;
  * @list		- member pointer in the sg_cfg_list list;
  * @reconf_flags	- TFW_CFG_MDF_SG_* flags;
  * @nip_flags		- non-idempotent req related flags;
+ * @proto_flags		- upstream protocol flags;
  * @sched_flags		- scheduler flags;
  * @sched_arg		- scheduler init argument.
  * @hm_name		- name of group's health monitor;
@@ -888,6 +1140,7 @@ typedef struct {
 	struct list_head	list;
 	unsigned int		reconf_flags;
 	unsigned int		nip_flags;
+	unsigned int		proto_flags;
 	unsigned int		sched_flags;
 	void			*sched_arg;
 	char			*hm_name;
@@ -916,7 +1169,14 @@ static struct {
 	bool max_refwd		: 1;
 	bool max_jqage		: 1;
 	bool max_recns		: 1;
+	bool scale_rtt		: 1;
+	bool conn_rate		: 1;
+	bool outlier		: 1;
+	bool climit		: 1;
+	bool pipe		: 1;
+	bool hedge_ith		: 1;
 	bool nip_flags		: 1;
+	bool proto_flags	: 1;
 	bool sched		: 1;
 } __attribute__((packed)) tfw_cfg_is_set;
 
@@ -948,6 +1208,12 @@ tfw_cfgop_sg_copy_opts(TfwSrvGroup *to, TfwSrvGroup *from)
 	to->max_refwd = from->max_refwd;
 	to->max_jqage = from->max_jqage;
 	to->max_recns = from->max_recns;
+	to->scale_rtt = from->scale_rtt;
+	to->conn_rate = from->conn_rate;
+	to->outlier   = from->outlier;
+	to->climit    = from->climit;
+	to->pipe      = from->pipe;
+	to->hedge_ith = from->hedge_ith;
 	to->flags     = from->flags;
 }
 
@@ -1184,6 +1450,38 @@ tfw_cfgop_out_retry_nip(TfwCfgSpec *cs, TfwCfgEntry *ce)
 	return tfw_cfgop_retry_nip(cs, ce, &tfw_cfg_sg_opts->nip_flags);
 }
 
+static inline int
+tfw_cfgop_http2(TfwCfgSpec *cs, TfwCfgEntry *ce, unsigned int *sg_flags)
+{
+	if (ce->attr_n) {
+		T_ERR_NL("Arguments may not have the '=' sign\n");
+		return -EINVAL;
+	}
+	if (tfw_cfg_is_dflt_value(ce))
+		return 0;
+	if (ce->val_n) {
+		T_ERR_NL("Invalid number of arguments: %zu\n", ce->val_n);
+		return -EINVAL;
+	}
+	*sg_flags |= TFW_SRV_HTTP2;
+
+	return 0;
+}
+
+static int
+tfw_cfgop_in_http2(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	TFW_CFGOP_INHERIT_FLAGS(ce, proto_flags);
+	return tfw_cfgop_http2(cs, ce, &tfw_cfg_sg->proto_flags);
+}
+
+static int
+tfw_cfgop_out_http2(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	tfw_cfg_is_set.proto_flags = 1;
+	return tfw_cfgop_http2(cs, ce, &tfw_cfg_sg_opts->proto_flags);
+}
+
 static bool
 tfw_cfgop_sg_set_hm_name(TfwCfgSrvGroup *sg_cfg, const char *hname)
 {
@@ -1253,6 +1551,327 @@ tfw_cfgop_out_conn_retries(TfwCfgSpec *cs, TfwCfgEntry *ce)
 				      &tfw_cfg_sg_opts->parsed_sg->max_recns);
 }
 
+static int
+tfw_cfgop_in_scale_rtt(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	TFW_CFGOP_INHERIT_OPT(ce, scale_rtt);
+	return tfw_cfgop_intval(cs, ce, &tfw_cfg_sg->parsed_sg->scale_rtt);
+}
+
+static int
+tfw_cfgop_out_scale_rtt(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	tfw_cfg_is_set.scale_rtt = 1;
+	return tfw_cfgop_intval(cs, ce, &tfw_cfg_sg_opts->parsed_sg->scale_rtt);
+}
+
+static int
+tfw_cfgop_in_conn_rate(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	TFW_CFGOP_INHERIT_OPT(ce, conn_rate);
+	return tfw_cfgop_intval(cs, ce, &tfw_cfg_sg->parsed_sg->conn_rate);
+}
+
+static int
+tfw_cfgop_out_conn_rate(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	tfw_cfg_is_set.conn_rate = 1;
+	return tfw_cfgop_intval(cs, ce, &tfw_cfg_sg_opts->parsed_sg->conn_rate);
+}
+
+static int
+tfw_cfg_parse_percent(const char *key, const char *val, unsigned int min,
+		      unsigned int *out)
+{
+	if (tfw_cfg_parse_uint(val, out)) {
+		T_ERR_NL("Invalid value: '%s'\n", val);
+		return -EINVAL;
+	}
+	if (*out < min || *out > 100) {
+		T_ERR_NL("Out of range of [%u..100]: '%s=%u'\n", min, key,
+			 *out);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* Default values for "server_outlier_detection" options. */
+#define TFW_CFG_OUTLIER_CONSEC_DEF	5	/* 5 subsequent 5xx responses */
+#define TFW_CFG_OUTLIER_ERR_RATE_DEF	50	/* 50% of 5xx responses */
+#define TFW_CFG_OUTLIER_LATENCY_DEF	10	/* 10 times of the median */
+#define TFW_CFG_OUTLIER_EJECT_DEF	30	/* 30 secs of ejection */
+#define TFW_CFG_OUTLIER_MAX_EJECT_DEF	50	/* 50% of the group servers */
+
+static int
+tfw_cfgop_outlier(TfwCfgSpec *cs, TfwCfgEntry *ce, TfwSgOutlier *ol)
+{
+	int i;
+	const char *key, *val;
+
+	if (ce->val_n != 1 || ce->have_children) {
+		T_ERR_NL("%s: invalid number of arguments\n", cs->name);
+		return -EINVAL;
+	}
+
+	memset(ol, 0, sizeof(*ol));
+	if (!strcasecmp(ce->vals[0], "off")) {
+		if (ce->attr_n) {
+			T_ERR_NL("%s: arguments may not be used with 'off'\n",
+				 cs->name);
+			return -EINVAL;
+		}
+		return 0;
+	}
+	if (strcasecmp(ce->vals[0], "on")) {
+		T_ERR_NL("%s: unsupported argument: '%s'\n", cs->name,
+			 ce->vals[0]);
+		return -EINVAL;
+	}
+
+	ol->consec = TFW_CFG_OUTLIER_CONSEC_DEF;
+	ol->err_rate = TFW_CFG_OUTLIER_ERR_RATE_DEF;
+	ol->latency = TFW_CFG_OUTLIER_LATENCY_DEF;
+	ol->eject_time = TFW_CFG_OUTLIER_EJECT_DEF;
+	ol->max_eject = TFW_CFG_OUTLIER_MAX_EJECT_DEF;
+
+	TFW_CFG_ENTRY_FOR_EACH_ATTR(ce, i, key, val) {
+		if (!strcasecmp(key, "consecutive")) {
+			if (tfw_cfg_parse_uint(val, &ol->consec)) {
+				T_ERR_NL("Invalid value: '%s'\n", val);
+				return -EINVAL;
+			}
+		} else if (!strcasecmp(key, "error_rate")) {
+			if (tfw_cfg_parse_percent(key, val, 0, &ol->err_rate))
+				return -EINVAL;
+		} else if (!strcasecmp(key, "latency")) {
+			if (tfw_cfg_parse_uint(val, &ol->latency)) {
+				T_ERR_NL("Invalid value: '%s'\n", val);
+				return -EINVAL;
+			}
+		} else if (!strcasecmp(key, "eject_time")) {
+			if (tfw_cfg_parse_uint(val, &ol->eject_time)
+			    || !ol->eject_time)
+			{
+				T_ERR_NL("Invalid value: '%s'\n", val);
+				return -EINVAL;
+			}
+		} else if (!strcasecmp(key, "max_eject")) {
+			if (tfw_cfg_parse_percent(key, val, 0, &ol->max_eject))
+				return -EINVAL;
+		} else {
+			T_ERR_NL("%s: unsupported argument: '%s=%s'\n",
+				 cs->name, key, val);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static int
+tfw_cfgop_in_outlier(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	TFW_CFGOP_INHERIT_OPT(ce, outlier);
+	return tfw_cfgop_outlier(cs, ce, &tfw_cfg_sg->parsed_sg->outlier);
+}
+
+static int
+tfw_cfgop_out_outlier(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	tfw_cfg_is_set.outlier = 1;
+	return tfw_cfgop_outlier(cs, ce, &tfw_cfg_sg_opts->parsed_sg->outlier);
+}
+
+/* Default values for "server_concurrency_limit" options. */
+#define TFW_CFG_CLIMIT_MIN_DEF		8	/* 8 concurrent requests */
+#define TFW_CFG_CLIMIT_MAX_DEF		1000	/* 1000 concurrent requests */
+#define TFW_CFG_CLIMIT_TOLERANCE_DEF	100	/* twice the baseline */
+
+static int
+tfw_cfgop_climit(TfwCfgSpec *cs, TfwCfgEntry *ce, TfwSgClimit *cl)
+{
+	int i;
+	const char *key, *val;
+
+	if (ce->val_n != 1 || ce->have_children) {
+		T_ERR_NL("%s: invalid number of arguments\n", cs->name);
+		return -EINVAL;
+	}
+
+	memset(cl, 0, sizeof(*cl));
+	if (!strcasecmp(ce->vals[0], "off")) {
+		if (ce->attr_n) {
+			T_ERR_NL("%s: arguments may not be used with 'off'\n",
+				 cs->name);
+			return -EINVAL;
+		}
+		return 0;
+	}
+	if (strcasecmp(ce->vals[0], "on")) {
+		T_ERR_NL("%s: unsupported argument: '%s'\n", cs->name,
+			 ce->vals[0]);
+		return -EINVAL;
+	}
+
+	cl->min = TFW_CFG_CLIMIT_MIN_DEF;
+	cl->max = TFW_CFG_CLIMIT_MAX_DEF;
+	cl->tolerance = TFW_CFG_CLIMIT_TOLERANCE_DEF;
+
+	TFW_CFG_ENTRY_FOR_EACH_ATTR(ce, i, key, val) {
+		unsigned int *v;
+
+		if (!strcasecmp(key, "min")) {
+			v = &cl->min;
+		} else if (!strcasecmp(key, "max")) {
+			v = &cl->max;
+		} else if (!strcasecmp(key, "tolerance")) {
+			v = &cl->tolerance;
+		} else {
+			T_ERR_NL("%s: unsupported argument: '%s=%s'\n",
+				 cs->name, key, val);
+			return -EINVAL;
+		}
+		if (tfw_cfg_parse_uint(val, v) || *v > INT_MAX) {
+			T_ERR_NL("Invalid value: '%s'\n", val);
+			return -EINVAL;
+		}
+	}
+	if (!cl->min || cl->min > cl->max) {
+		T_ERR_NL("%s: invalid limits range: [%u..%u]\n", cs->name,
+			 cl->min, cl->max);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int
+tfw_cfgop_in_climit(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	TFW_CFGOP_INHERIT_OPT(ce, climit);
+	return tfw_cfgop_climit(cs, ce, &tfw_cfg_sg->parsed_sg->climit);
+}
+
+static int
+tfw_cfgop_out_climit(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	tfw_cfg_is_set.climit = 1;
+	return tfw_cfgop_climit(cs, ce, &tfw_cfg_sg_opts->parsed_sg->climit);
+}
+
+/* Default values for "server_pipeline_depth" options. */
+#define TFW_CFG_PIPE_MAX_DEF		32	/* 32 requests in flight */
+#define TFW_CFG_PIPE_TAIL_DEF		4	/* p99 is 4 times the median */
+#define TFW_CFG_PIPE_HOL_DEF		50	/* a half of the server time */
+
+static int
+tfw_cfgop_pipe(TfwCfgSpec *cs, TfwCfgEntry *ce, TfwSgPipe *pipe)
+{
+	int i;
+	const char *key, *val;
+
+	if (ce->val_n != 1 || ce->have_children) {
+		T_ERR_NL("%s: invalid number of arguments\n", cs->name);
+		return -EINVAL;
+	}
+
+	memset(pipe, 0, sizeof(*pipe));
+	if (!strcasecmp(ce->vals[0], "off")) {
+		if (ce->attr_n) {
+			T_ERR_NL("%s: arguments may not be used with 'off'\n",
+				 cs->name);
+			return -EINVAL;
+		}
+		return 0;
+	}
+	if (strcasecmp(ce->vals[0], "on")) {
+		T_ERR_NL("%s: unsupported argument: '%s'\n", cs->name,
+			 ce->vals[0]);
+		return -EINVAL;
+	}
+
+	pipe->max = TFW_CFG_PIPE_MAX_DEF;
+	pipe->tail = TFW_CFG_PIPE_TAIL_DEF;
+	pipe->hol = TFW_CFG_PIPE_HOL_DEF;
+
+	TFW_CFG_ENTRY_FOR_EACH_ATTR(ce, i, key, val) {
+		unsigned int *v;
+
+		if (!strcasecmp(key, "max")) {
+			v = &pipe->max;
+		} else if (!strcasecmp(key, "tail")) {
+			v = &pipe->tail;
+		} else if (!strcasecmp(key, "hol")) {
+			v = &pipe->hol;
+		} else {
+			T_ERR_NL("%s: unsupported argument: '%s=%s'\n",
+				 cs->name, key, val);
+			return -EINVAL;
+		}
+		if (tfw_cfg_parse_uint(val, v) || *v > INT_MAX) {
+			T_ERR_NL("Invalid value: '%s'\n", val);
+			return -EINVAL;
+		}
+	}
+	if (!pipe->max || !pipe->tail || pipe->hol > 100) {
+		T_ERR_NL("%s: invalid arguments: max=%u tail=%u hol=%u\n",
+			 cs->name, pipe->max, pipe->tail, pipe->hol);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int
+tfw_cfgop_in_pipe(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	TFW_CFGOP_INHERIT_OPT(ce, pipe);
+	return tfw_cfgop_pipe(cs, ce, &tfw_cfg_sg->parsed_sg->pipe);
+}
+
+static int
+tfw_cfgop_out_pipe(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	tfw_cfg_is_set.pipe = 1;
+	return tfw_cfgop_pipe(cs, ce, &tfw_cfg_sg_opts->parsed_sg->pipe);
+}
+
+/*
+ * The percentile must be one of those calculated by APM, see
+ * tfw_pstats_ith[].
+ */
+static int
+tfw_cfgop_hedge(TfwCfgSpec *cs, TfwCfgEntry *ce, unsigned int *ith)
+{
+	int i, r;
+
+	if ((r = tfw_cfgop_intval(cs, ce, ith)))
+		return r;
+	if (!*ith)
+		return 0;
+	for (i = TFW_PSTATS_IDX_ITH; i < T_PSZ; ++i)
+		if (tfw_pstats_ith[i] == *ith)
+			return 0;
+
+	T_ERR_NL("%s: unsupported percentile: '%u'\n", cs->name, *ith);
+	return -EINVAL;
+}
+
+static int
+tfw_cfgop_in_hedge(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	TFW_CFGOP_INHERIT_OPT(ce, hedge_ith);
+	return tfw_cfgop_hedge(cs, ce, &tfw_cfg_sg->parsed_sg->hedge_ith);
+}
+
+static int
+tfw_cfgop_out_hedge(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	tfw_cfg_is_set.hedge_ith = 1;
+	return tfw_cfgop_hedge(cs, ce, &tfw_cfg_sg_opts->parsed_sg->hedge_ith);
+}
+
 /**
  * Mark @sg_cfg as requiring scheduler update if the @srv wasn't present in
  * previous configuration or if it's options changed.
@@ -1270,7 +1889,8 @@ tfw_cfgop_server_orig_lookup(TfwCfgSrvGroup *sg_cfg, TfwServer *srv)
 		set_bit(TFW_CFG_B_ADD, &srv->flags);
 		goto done;
 	}
-	if (orig_srv->conn_n != srv->conn_n)
+	if (orig_srv->conn_n != srv->conn_n
+	    || orig_srv->conn_min != srv->conn_min)
 		goto changed;
 	if (srv->weight && (srv->weight != orig_srv->weight))
 		goto changed;
@@ -1304,8 +1924,8 @@ tfw_cfgop_server(TfwCfgSpec *cs, TfwCfgEntry *ce, TfwCfgSrvGroup *sg_cfg)
 {
 	TfwAddr addr;
 	TfwServer *srv;
-	int i, conns_n = 0, weight = 0;
-	bool has_conns_n = false, has_weight = false;
+	int i, conns_n = 0, conns_min = 0, weight = 0;
+	bool has_conns_n = false, has_conns_min = false, has_weight = false;
 	const char *key, *val;
 
 	if (ce->val_n != 1) {
@@ -1339,6 +1959,16 @@ tfw_cfgop_server(TfwCfgSpec *cs, TfwCfgEntry *ce, TfwCfgSrvGroup *sg_cfg)
 				return -EINVAL;
 			}
 			has_conns_n = true;
+		} else if (!strcasecmp(key, "conns_min")) {
+			if (has_conns_min) {
+				T_ERR_NL("Duplicate argument: '%s'\n", key);
+				return -EINVAL;
+			}
+			if (tfw_cfg_parse_int(val, &conns_min)) {
+				T_ERR_NL("Invalid value: '%s'\n", val);
+				return -EINVAL;
+			}
+			has_conns_min = true;
 		} else if (!strcasecmp(key, "weight")) {
 			if (has_weight) {
 				T_ERR_NL("Duplicate argument: '%s'\n", key);
@@ -1362,6 +1992,14 @@ tfw_cfgop_server(TfwCfgSpec *cs, TfwCfgEntry *ce, TfwCfgSrvGroup *sg_cfg)
 			 TFW_SRV_MAX_CONN_N, conns_n);
 		return -EINVAL;
 	}
+	/* The connection pool isn't scaled by default. */
+	if (!has_conns_min) {
+		conns_min = conns_n;
+	} else if ((conns_min < 1) || (conns_min > conns_n)) {
+		T_ERR_NL("Out of range of [1..%d]: 'conns_min=%d'\n",
+			 conns_n, conns_min);
+		return -EINVAL;
+	}
 	/* Default weight is set only for static ratio scheduler. */
 	if (has_weight && ((weight < TFW_CFG_SRV_WEIGHT_MIN)
 			   || (weight > TFW_CFG_SRV_WEIGHT_MAX)))
@@ -1380,6 +2018,8 @@ tfw_cfgop_server(TfwCfgSpec *cs, TfwCfgEntry *ce, TfwCfgSrvGroup *sg_cfg)
 	srv->cleanup = tfw_sock_srv_del_conns;
 	srv->weight = weight;
 	srv->conn_n = conns_n;
+	srv->conn_min = conns_min;
+	timer_setup(&srv->scale_timer, tfw_sock_srv_scale, 0);
 	tfw_sg_add_srv(sg_cfg->parsed_sg, srv);
 	tfw_cfgop_server_orig_lookup(sg_cfg, srv);
 
@@ -1576,7 +2216,8 @@ tfw_cfgop_setup_srv_group(TfwCfgSrvGroup *sg_cfg)
 		sg_cfg->reconf_flags |= TFW_CFG_MDF_SG_SRV;
 	}
 
-	sg->flags = sg_cfg->nip_flags | sg_cfg->sched_flags;
+	sg->flags = sg_cfg->nip_flags | sg_cfg->proto_flags
+		    | sg_cfg->sched_flags;
 	/*
 	 * Check 'ratio' scheduler configuration for incompatibilities.
 	 * Set weight to default value for each server in the group
@@ -1590,6 +2231,10 @@ tfw_cfgop_setup_srv_group(TfwCfgSrvGroup *sg_cfg)
 		if (tfw_cfg_sg_ratio_adjust(&sg->srv_list))
 			return -EINVAL;
 	}
+	/* P2C scheduler divides servers load by their static weights. */
+	if (!strcasecmp(sg->sched->name, "p2c")
+	    && tfw_cfg_sg_ratio_adjust(&sg->srv_list))
+		return -EINVAL;
 
 	if (tfw_cfgop_sched_changed(sg_cfg))
 		sg_cfg->reconf_flags |= TFW_CFG_MDF_SG_SCHED;
@@ -1673,6 +2318,8 @@ done:
 #define TFW_CFG_PAST_MAX	120	/* 120 secs of past APM vals */
 #define TFW_CFG_RATE_DEF	20	/* 20 times/sec */
 #define TFW_CFG_RATE_MAX	20	/* 20 times/sec */
+#define TFW_CFG_ALPHA_DEF	30	/* 30% of a new value in the level */
+#define TFW_CFG_BETA_DEF	10	/* 10% of a new value in the trend */
 
 static int
 tfw_cfg_handle_ratio_predict(TfwCfgEntry *ce,
@@ -1681,7 +2328,11 @@ tfw_cfg_handle_ratio_predict(TfwCfgEntry *ce,
 	int i, ret;
 	const char *key, *val;
 	bool has_past = false, has_rate = false, has_ahead = false;
-	TfwSchrefPredict arg = { 0 };
+	TfwSchrefPredict arg = {
+		.model	= TFW_SCHED_PREDICT_LINEAR,
+		.alpha	= TFW_CFG_ALPHA_DEF,
+		.beta	= TFW_CFG_BETA_DEF,
+	};
 
 	if ((ret = tfw_cfg_handle_ratio_predyn_opts(ce, arg_flags)))
 		return ret;
@@ -1717,6 +2368,26 @@ tfw_cfg_handle_ratio_predict(TfwCfgEntry *ce,
 				return -EINVAL;
 			}
 			has_ahead = true;
+		} else if (!strcasecmp(key, "model")) {
+			if (!strcasecmp(val, "linear")) {
+				arg.model = TFW_SCHED_PREDICT_LINEAR;
+			} else if (!strcasecmp(val, "ewma")) {
+				arg.model = TFW_SCHED_PREDICT_EWMA;
+			} else if (!strcasecmp(val, "holt")) {
+				arg.model = TFW_SCHED_PREDICT_HOLT;
+			} else {
+				T_ERR_NL("Invalid value: '%s'\n", val);
+				return -EINVAL;
+			}
+		} else if (!strcasecmp(key, "alpha")) {
+			if (tfw_cfg_parse_percent(key, val, 1, &arg.alpha))
+				return -EINVAL;
+		} else if (!strcasecmp(key, "beta")) {
+			if (tfw_cfg_parse_percent(key, val, 1, &arg.beta))
+				return -EINVAL;
+		} else if (!strcasecmp(key, "hysteresis")) {
+			if (tfw_cfg_parse_percent(key, val, 0, &arg.hyst))
+				return -EINVAL;
 		}
 	}
 	if (!has_past) {
@@ -1980,6 +2651,7 @@ tfw_sock_srv_cfgend(void)
 				    tfw_cfg_sg_opts->sched_arg);
 	tfw_cfg_sg_def->parsed_sg->sched = tfw_cfg_sg_opts->parsed_sg->sched;
 	tfw_cfg_sg_def->nip_flags = tfw_cfg_sg_opts->nip_flags;
+	tfw_cfg_sg_def->proto_flags = tfw_cfg_sg_opts->proto_flags;
 	tfw_cfg_sg_def->sched_flags = tfw_cfg_sg_opts->sched_flags;
 
 	if ((r = tfw_cfgop_setup_srv_group(tfw_cfg_sg_def)))
@@ -2013,9 +2685,11 @@ tfw_cfgop_update_srv(TfwServer *orig_srv, TfwCfgSrvGroup *sg_cfg)
 		/*
 		 * TODO #687: shrink number of connections. Disconnects are
 		 * performed asynchronously, can't destroy connection here and
-		 * now.
+		 * now. The pool can be scaled down with conns_min though.
 		 */
 	}
+	orig_srv->conn_min = min(srv->conn_min, orig_srv->conn_n);
+	tfw_sock_srv_scale_start(orig_srv);
 	tfw_server_put(srv);
 
 	return 0;
@@ -2129,6 +2803,7 @@ tfw_cfgop_update_sg_cfg(TfwCfgSrvGroup *sg_cfg)
 	{
 		tfw_cfgop_sg_copy_opts(sg_cfg->orig_sg, sg_cfg->parsed_sg);
 		tfw_cfgop_update_sg_health(sg_cfg);
+		tfw_sg_start_outlier(sg_cfg->orig_sg);
 		return 0;
 	}
 
@@ -2265,6 +2940,14 @@ static TfwCfgSpec tfw_srv_group_specs[] = {
 		.allow_repeat = false,
 		.allow_reconfig = true,
 	},
+	{
+		.name = "server_http2",
+		.deflt = TFW_CFG_DFLT_VAL,
+		.handler = tfw_cfgop_in_http2,
+		.allow_none = true,
+		.allow_repeat = false,
+		.allow_reconfig = true,
+	},
 	{
 		.name = "server_connect_retries",
 		.deflt = "10",
@@ -2276,6 +2959,63 @@ static TfwCfgSpec tfw_srv_group_specs[] = {
 		.allow_repeat = false,
 		.allow_reconfig = true,
 	},
+	{
+		.name = "server_scale_rtt",
+		.deflt = "0",
+		.handler = tfw_cfgop_in_scale_rtt,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, INT_MAX },
+		},
+		.allow_none = true,
+		.allow_repeat = false,
+		.allow_reconfig = true,
+	},
+	{
+		.name = "server_connect_rate",
+		.deflt = "0",
+		.handler = tfw_cfgop_in_conn_rate,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, INT_MAX },
+		},
+		.allow_none = true,
+		.allow_repeat = false,
+		.allow_reconfig = true,
+	},
+	{
+		.name = "server_outlier_detection",
+		.deflt = "off",
+		.handler = tfw_cfgop_in_outlier,
+		.allow_none = true,
+		.allow_repeat = false,
+		.allow_reconfig = true,
+	},
+	{
+		.name = "server_concurrency_limit",
+		.deflt = "off",
+		.handler = tfw_cfgop_in_climit,
+		.allow_none = true,
+		.allow_repeat = false,
+		.allow_reconfig = true,
+	},
+	{
+		.name = "server_pipeline_depth",
+		.deflt = "off",
+		.handler = tfw_cfgop_in_pipe,
+		.allow_none = true,
+		.allow_repeat = false,
+		.allow_reconfig = true,
+	},
+	{
+		.name = "server_hedge_percentile",
+		.deflt = "0",
+		.handler = tfw_cfgop_in_hedge,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, 99 },
+		},
+		.allow_none = true,
+		.allow_repeat = false,
+		.allow_reconfig = true,
+	},
 	{
 		.name = "health",
 		.deflt = NULL,
@@ -2351,6 +3091,15 @@ static TfwCfgSpec tfw_sock_srv_specs[] = {
 		.allow_repeat = false,
 		.allow_reconfig = true,
 	},
+	{
+		.name = "server_http2",
+		.deflt = TFW_CFG_DFLT_VAL,
+		.handler = tfw_cfgop_out_http2,
+		.cleanup = tfw_cfgop_cleanup_srv_groups,
+		.allow_none = true,
+		.allow_repeat = false,
+		.allow_reconfig = true,
+	},
 	{
 		.name = "server_connect_retries",
 		.deflt = "10",
@@ -2363,6 +3112,69 @@ static TfwCfgSpec tfw_sock_srv_specs[] = {
 		.allow_repeat = false,
 		.allow_reconfig = true,
 	},
+	{
+		.name = "server_scale_rtt",
+		.deflt = "0",
+		.handler = tfw_cfgop_out_scale_rtt,
+		.cleanup = tfw_cfgop_cleanup_srv_groups,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, INT_MAX },
+		},
+		.allow_none = true,
+		.allow_repeat = false,
+		.allow_reconfig = true,
+	},
+	{
+		.name = "server_connect_rate",
+		.deflt = "0",
+		.handler = tfw_cfgop_out_conn_rate,
+		.cleanup = tfw_cfgop_cleanup_srv_groups,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, INT_MAX },
+		},
+		.allow_none = true,
+		.allow_repeat = false,
+		.allow_reconfig = true,
+	},
+	{
+		.name = "server_outlier_detection",
+		.deflt = "off",
+		.handler = tfw_cfgop_out_outlier,
+		.cleanup = tfw_cfgop_cleanup_srv_groups,
+		.allow_none = true,
+		.allow_repeat = false,
+		.allow_reconfig = true,
+	},
+	{
+		.name = "server_concurrency_limit",
+		.deflt = "off",
+		.handler = tfw_cfgop_out_climit,
+		.cleanup = tfw_cfgop_cleanup_srv_groups,
+		.allow_none = true,
+		.allow_repeat = false,
+		.allow_reconfig = true,
+	},
+	{
+		.name = "server_pipeline_depth",
+		.deflt = "off",
+		.handler = tfw_cfgop_out_pipe,
+		.cleanup = tfw_cfgop_cleanup_srv_groups,
+		.allow_none = true,
+		.allow_repeat = false,
+		.allow_reconfig = true,
+	},
+	{
+		.name = "server_hedge_percentile",
+		.deflt = "0",
+		.handler = tfw_cfgop_out_hedge,
+		.cleanup = tfw_cfgop_cleanup_srv_groups,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, 99 },
+		},
+		.allow_none = true,
+		.allow_repeat = false,
+		.allow_reconfig = true,
+	},
 	{
 		.name = "health",
 		.deflt = NULL,
@@ -2378,9 +3190,14 @@ static TfwCfgSpec tfw_sock_srv_specs[] = {
 		.handler = tfw_cfg_handle_children,
 		.cleanup = tfw_cfgop_cleanup_srv_groups,
 		.dest = tfw_srv_group_specs,
+		/*
+		 * Groups are updated in place on reconfiguration, so
+		 * vhosts referring to them don't depend on their text.
+		 */
 		.spec_ext = &(TfwCfgSpecChild ) {
 			.begin_hook = tfw_cfgop_begin_srv_group,
-			.finish_hook = tfw_cfgop_finish_srv_group
+			.finish_hook = tfw_cfgop_finish_srv_group,
+			.versioned = true
 		},
 		.allow_none = true,
 		.allow_repeat = true,
@@ -63,6 +63,77 @@ ss_skb_fmt_src_addr(const struct sk_buff *skb, char *out_buf)
 	return tfw_addr_fmt(&addr, TFW_NO_PORT, out_buf);
 }
 
+/*
+ * Per-CPU ring of pages recycled for locally generated data. The ring holds
+ * a reference to each of its pages, so a page can be reused when the ring
+ * reference is the only one left. That happens when all the skbs referencing
+ * the page are freed, i.e. on TX completion, so it's the same page reuse as
+ * NIC drivers do in their RX rings. A page still in flight is left to its
+ * users and the ring slot is refilled from the page allocator.
+ */
+#define SS_PG_RING_SZ		256
+
+typedef struct {
+	unsigned int	next;
+	struct page	*pages[SS_PG_RING_SZ];
+} SsPgRing;
+
+static DEFINE_PER_CPU(SsPgRing, ss_pg_ring);
+
+/**
+ * Allocate an order-0 page for skb data. The ring is used in softirq only,
+ * which generates responses on hot paths.
+ */
+struct page *
+ss_skb_alloc_page(void)
+{
+	SsPgRing *ring;
+	struct page **slot, *page;
+
+	if (!in_serving_softirq())
+		return alloc_page(GFP_ATOMIC);
+
+	ring = this_cpu_ptr(&ss_pg_ring);
+	slot = &ring->pages[ring->next];
+	ring->next = (ring->next + 1) & (SS_PG_RING_SZ - 1);
+
+	if (likely(*slot) && page_ref_count(*slot) == 1) {
+		get_page(*slot);
+		TFW_INC_STAT_BH(ss.pg_recycled);
+		return *slot;
+	}
+	if (*slot)
+		put_page(*slot);
+
+	*slot = page = alloc_page(GFP_ATOMIC);
+	if (unlikely(!page))
+		return NULL;
+	/* Emergency reserves must be returned to the allocator. */
+	if (unlikely(page_is_pfmemalloc(page)))
+		*slot = NULL;
+	else
+		get_page(page);
+
+	return page;
+}
+EXPORT_SYMBOL(ss_skb_alloc_page);
+
+void
+ss_skb_pg_ring_drain(void)
+{
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		SsPgRing *ring = per_cpu_ptr(&ss_pg_ring, cpu);
+
+		for (i = 0; i < SS_PG_RING_SZ; ++i) {
+			if (ring->pages[i])
+				put_page(ring->pages[i]);
+			ring->pages[i] = NULL;
+		}
+	}
+}
+
 /**
  * Allocate a new skb that can hold @len bytes of data.
  *
@@ -89,7 +160,7 @@ ss_skb_alloc_pages(size_t len)
 		return NULL;
 
 	for (i = 0; i < nr_frags; ++i) {
-		struct page *page = alloc_page(GFP_ATOMIC);
+		struct page *page = ss_skb_alloc_page();
 		if (!page) {
 			kfree_skb(skb);
 			return NULL;
@@ -279,6 +350,18 @@ __skb_insert_after(struct sk_buff *skb, struct sk_buff *nskb)
 	nskb->next->prev = skb->next = nskb;
 }
 
+/*
+ * @to references paged fragments of @from, so the fragments must be
+ * transmitted by reference by @to as well.
+ */
+static inline void
+__skb_share_frags(struct sk_buff *to, struct sk_buff *from)
+{
+	skb_shinfo(to)->tx_flags |= skb_shinfo(from)->tx_flags
+				    & SKBTX_SHARED_FRAG;
+	skb_zcopy_set(to, skb_zcopy(from), NULL);
+}
+
 /**
  * Similar to skb_shift().
  * Make room for @n fragments starting with slot @from.
@@ -327,10 +410,12 @@ __extend_pgfrags(struct sk_buff *skb_head, struct sk_buff *skb, int from, int n)
 			nskb = ss_skb_alloc(0);
 			if (nskb == NULL)
 				return -ENOMEM;
-			skb_shinfo(nskb)->tx_flags = skb_shinfo(skb)->tx_flags;
+			skb_shinfo(nskb)->tx_flags = skb_shinfo(skb)->tx_flags
+						     & ~SKBTX_DEV_ZEROCOPY;
 			__skb_insert_after(skb, nskb);
 			skb_shinfo(nskb)->nr_frags = n_excess;
 		}
+		__skb_share_frags(nskb, skb);
 
 		/* No fragments to shift. */
 		if (!tail_frags)
@@ -393,7 +478,7 @@ __new_pgfrag(struct sk_buff *skb_head, struct sk_buff *skb, int size,
 		off = frag.bv_offset;
 		get_page(page);
 	} else {
-		page = alloc_page(GFP_ATOMIC);
+		page = ss_skb_alloc_page();
 		if (!page)
 			return -ENOMEM;
 	}
@@ -919,6 +1004,37 @@ ss_skb_get_room(struct sk_buff *skb_head, struct sk_buff *skb, char *pspt,
 	return ss_skb_get_room_w_frag(skb_head, skb, pspt, len, it, &_);
 }
 
+/**
+ * Add a new paged fragment with @len bytes of @data in slot @*i of @*skb.
+ * The fragments starting with slot @*i are shifted forward, so the new data
+ * is placed just before them and no data is split or copied. @*i can be equal
+ * to the number of fragments in @*skb to place the data after all the @*skb
+ * data.
+ *
+ * @return 0 on success, -errno on failure.
+ * @return SKB and the slot with the new fragment in @*skb and @*i.
+ */
+int
+ss_skb_add_frag(struct sk_buff *skb_head, struct sk_buff **skb, int *i,
+		const char *data, int len)
+{
+	skb_frag_t *frag;
+
+	if (WARN_ON_ONCE(len <= 0 || len > PAGE_SIZE))
+		return -EINVAL;
+	if (__new_pgfrag(skb_head, *skb, len, *i, 1))
+		return -ENOMEM;
+
+	if (*i == MAX_SKB_FRAGS) {
+		*i = 0;
+		*skb = (*skb)->next;
+	}
+	frag = &skb_shinfo(*skb)->frags[*i];
+	memcpy_fast(skb_frag_address(frag), data, len);
+
+	return 0;
+}
+
 /**
  * Expand the @skb data, including frags, by @head and @tail: the head is
  * reserved within TCP_MAX_HEADER, so skb->data is just moved, the tail
@@ -1206,6 +1322,54 @@ __copy_ip_header(struct sk_buff *to, const struct sk_buff *from)
 		memcpy_fast(skb_network_header(to), ip4, sizeof(*ip4));
 }
 
+/*
+ * Split @skb at offset @len inside its linear data allocated in a page
+ * fragment. The linear data tail of @n bytes becomes the first paged
+ * fragment of the new skb referencing the same page, and the paged fragments
+ * of @skb are moved to the new skb after it, so no data is copied.
+ */
+static struct sk_buff *
+__ss_skb_split_head(struct sk_buff *skb, int len, int n)
+{
+	int i;
+	skb_frag_t *frag;
+	struct sk_buff *buff;
+	struct skb_shared_info *si = skb_shinfo(skb), *bsi;
+	unsigned int tail_len = skb->len - len;
+
+	buff = alloc_skb_fclone(MAX_TCP_HEADER, GFP_ATOMIC);
+	if (!buff)
+		return NULL;
+	skb_reserve(buff, MAX_TCP_HEADER);
+	bsi = skb_shinfo(buff);
+
+	frag = &bsi->frags[0];
+	frag->bv_page = virt_to_page(skb->head);
+	frag->bv_offset = skb->data + len
+			  - (unsigned char *)page_address(frag->bv_page);
+	frag->bv_len = n;
+	__skb_frag_ref(frag);
+	for (i = 0; i < si->nr_frags; ++i)
+		bsi->frags[i + 1] = si->frags[i];
+	bsi->nr_frags = si->nr_frags + 1;
+	__skb_share_frags(buff, skb);
+	si->nr_frags = 0;
+
+	/* @buff already accounts its own head in truesize. */
+	ss_skb_adjust_data_len(buff, tail_len);
+	skb->truesize -= tail_len;
+	skb->len = len;
+	skb->data_len = 0;
+	skb_set_tail_pointer(skb, len);
+	/* The tail room is the data of @buff now. */
+	skb->tail_lock = 1;
+
+	tcp_skb_pcount_set(skb, 0);
+	__copy_ip_header(buff, skb);
+
+	return buff;
+}
+
 /*
  * Split @skb in two at a given offset. The original SKB is shrunk
  * to specified size @len, and the remaining data is put into a new SKB.
@@ -1214,6 +1378,10 @@ __copy_ip_header(struct sk_buff *to, const struct sk_buff *from)
  * in the Linux kernel. The major difference is that these SKBs were just
  * taken out of the receive queue, and they have been orphaned. They have
  * not been out to the write queue yet.
+ *
+ * The paged data is always shared between the two skbs. The linear data
+ * after @len is copied only if it's allocated by kmalloc(), which only small
+ * skbs usually have, or there is no free fragment slot to reference it.
  */
 struct sk_buff *
 ss_skb_split(struct sk_buff *skb, int len)
@@ -1223,6 +1391,9 @@ ss_skb_split(struct sk_buff *skb, int len)
 
 	if (len < skb_headlen(skb))
 		n = skb_headlen(skb) - len;
+	if (n && skb->head_frag && !skb_cloned(skb)
+	    && skb_shinfo(skb)->nr_frags < MAX_SKB_FRAGS)
+		return __ss_skb_split_head(skb, len, n);
 
 	buff = alloc_skb_fclone(ALIGN(n, 4) + MAX_TCP_HEADER, GFP_ATOMIC);
 	if (!buff)
@@ -1289,22 +1460,126 @@ ss_skb_init_for_xmit(struct sk_buff *skb)
 	skb->mac_header = (typeof(skb->mac_header))~0U;
 	skb->transport_header = (typeof(skb->transport_header))~0U;
 
-	shinfo->tx_flags = 0;
+	/*
+	 * Keep SKBTX_SHARED_FRAG and the zero-copy notification, the paged
+	 * data can be referenced by the cache, see ss_skb_queue_zcopy_set().
+	 */
+	shinfo->tx_flags &= SKBTX_ZEROCOPY_FRAG;
 	shinfo->gso_size = 0;
 	shinfo->gso_segs = 0;
 	shinfo->gso_type = 0;
 	shinfo->hwtstamps.hwtstamp = 0;
 	shinfo->tskey = 0;
-	shinfo->destructor_arg = NULL;
+	if (!skb_zcopy(skb))
+		shinfo->destructor_arg = NULL;
 
 	skb->ip_summed = CHECKSUM_PARTIAL;
 
 	secpath_reset(skb);
 }
 
+/**
+ * Transmit the paged data of all the skbs from @skb_head marked by
+ * SKBTX_SHARED_FRAG by reference. @uarg->callback is called when each of
+ * the skbs, as well as its clones and splits made by the TCP/IP stack, is
+ * freed, i.e. the data is acknowledged by the peer or the connection is
+ * closed. @uarg->refcnt is incremented for each skb.
+ */
+void
+ss_skb_queue_zcopy_set(struct sk_buff *skb_head, struct ubuf_info *uarg)
+{
+	struct sk_buff *skb = skb_head;
+
+	if (!skb)
+		return;
+	do {
+		if (skb_shinfo(skb)->tx_flags & SKBTX_SHARED_FRAG)
+			skb_zcopy_set(skb, uarg, NULL);
+		skb = skb->next;
+	} while (skb != skb_head);
+}
+
+/**
+ * Make a twin of @skb for transmission which refers the data of @skb by
+ * paged fragments. The linear data of @skb is referenced as a paged fragment
+ * as well if it's allocated in a page fragment, so no data is copied. A clone
+ * of @skb can't be used, since tcp_transmit_skb() copies cloned skbs, so @skb
+ * is copied by pskb_copy_for_clone() if it has linear data in kmalloc()'ed
+ * memory, which only small skbs usually have.
+ */
+static struct sk_buff *
+ss_skb_twin(struct sk_buff *skb)
+{
+	int i;
+	skb_frag_t *frag;
+	struct sk_buff *twin;
+	struct skb_shared_info *si = skb_shinfo(skb), *twin_si;
+	unsigned int headlen = skb_headlen(skb);
+
+	if ((headlen && !skb->head_frag) || si->frag_list
+	    || si->nr_frags + !!headlen > MAX_SKB_FRAGS)
+		return pskb_copy_for_clone(skb, GFP_ATOMIC);
+
+	/* tcp_transmit_skb() will clone the skb. */
+	if (!(twin = alloc_skb_fclone(MAX_TCP_HEADER, GFP_ATOMIC)))
+		return NULL;
+	skb_reserve(twin, MAX_TCP_HEADER);
+	twin_si = skb_shinfo(twin);
+
+	if (headlen) {
+		frag = &twin_si->frags[twin_si->nr_frags++];
+		frag->bv_len = headlen;
+		frag->bv_page = virt_to_page(skb->head);
+		frag->bv_offset = skb->data -
+			(unsigned char *)page_address(frag->bv_page);
+		__skb_frag_ref(frag);
+	}
+	for (i = 0; i < si->nr_frags; ++i) {
+		twin_si->frags[twin_si->nr_frags] = si->frags[i];
+		__skb_frag_ref(&twin_si->frags[twin_si->nr_frags++]);
+	}
+	ss_skb_adjust_data_len(twin, skb->len);
+
+	/* The linear data is still used by the original skb. */
+	twin_si->tx_flags = (si->tx_flags & ~SKBTX_DEV_ZEROCOPY)
+			    | (headlen ? SKBTX_SHARED_FRAG : 0);
+	__skb_share_frags(twin, skb);
+	twin->mark = skb->mark;
+
+	return twin;
+}
+
+/**
+ * Append twins of all the skbs from @skb_head to @dst, see ss_skb_twin().
+ * The data is shared with the original skbs, which are still used by the
+ * caller. @dst is left unchanged on an error.
+ */
+int
+ss_skb_queue_copy(struct sk_buff **dst, struct sk_buff *skb_head)
+{
+	struct sk_buff *skb = skb_head, *twin_skb, *copy = NULL;
+
+	do {
+		twin_skb = ss_skb_twin(skb);
+		if (!twin_skb) {
+			ss_skb_queue_purge(&copy);
+			return -ENOMEM;
+		}
+		ss_skb_queue_tail(&copy, twin_skb);
+		skb = skb->next;
+	} while (skb != skb_head);
+
+	if (*dst)
+		ss_skb_queue_append(dst, copy);
+	else
+		*dst = copy;
+
+	return 0;
+}
+
 static inline int
 __coalesce_frag(struct sk_buff **skb_head, skb_frag_t *frag,
-		const struct sk_buff *orig_skb)
+		struct sk_buff *orig_skb)
 {
 	struct sk_buff *skb = ss_skb_peek_tail(skb_head);
 
@@ -1312,11 +1587,13 @@ __coalesce_frag(struct sk_buff **skb_head, skb_frag_t *frag,
 		skb = ss_skb_alloc(0);
 		if (!skb)
 			return -ENOMEM;
-		skb_shinfo(skb)->tx_flags = skb_shinfo(orig_skb)->tx_flags;
+		skb_shinfo(skb)->tx_flags = skb_shinfo(orig_skb)->tx_flags
+					    & ~SKBTX_DEV_ZEROCOPY;
 		ss_skb_queue_tail(skb_head, skb);
 		skb->mark = orig_skb->mark;
 	}
 
+	__skb_share_frags(skb, orig_skb);
 	skb_shinfo(skb)->frags[skb_shinfo(skb)->nr_frags++] = *frag;
 	ss_skb_adjust_data_len(skb, frag->bv_len);
 	__skb_frag_ref(frag);
@@ -1325,7 +1602,7 @@ __coalesce_frag(struct sk_buff **skb_head, skb_frag_t *frag,
 }
 
 static int
-ss_skb_queue_coalesce_tail(struct sk_buff **skb_head, const struct sk_buff *skb)
+ss_skb_queue_coalesce_tail(struct sk_buff **skb_head, struct sk_buff *skb)
 {
 	int i;
 	skb_frag_t head_frag;
@@ -1505,7 +1782,11 @@ ss_skb_to_sgvec_with_new_pages(struct sk_buff *skb, struct scatterlist *sgl,
 	int remain = 0, offset = 0;
 	int i;
 
-	/* TODO: process of SKBTX_ZEROCOPY_FRAG for MSG_ZEROCOPY */
+	/*
+	 * The zero-copy notification, if any, is left on the skb: the old
+	 * pages are read by the encryption and they're released after it,
+	 * while the notification comes when the skb is freed.
+	 */
 	if (skb_shinfo(skb)->tx_flags & SKBTX_SHARED_FRAG) {
 		if (head_data_len) {
 			sg_set_buf(sgl + out_frags, skb->data, head_data_len);
@@ -212,6 +212,8 @@ int ss_skb_get_room(struct sk_buff *skb_head, struct sk_buff *skb,
 		    char *pspt, unsigned int len, TfwStr *it);
 int ss_skb_get_room_w_frag(struct sk_buff *skb_head, struct sk_buff *skb,
 			   char *pspt, unsigned int len, TfwStr *it, int *fragn);
+int ss_skb_add_frag(struct sk_buff *skb_head, struct sk_buff **skb, int *i,
+		    const char *data, int len);
 int ss_skb_expand_head_tail(struct sk_buff *skb_head, struct sk_buff *skb,
 			    size_t head, size_t tail);
 int ss_skb_chop_head_tail(struct sk_buff *skb_head, struct sk_buff *skb,
@@ -224,7 +226,11 @@ int ss_skb_process(struct sk_buff *skb, ss_skb_actor_t actor, void *objdata,
 		   unsigned int *chunks, unsigned int *processed);
 
 int ss_skb_unroll(struct sk_buff **skb_head, struct sk_buff *skb);
+struct page *ss_skb_alloc_page(void);
+void ss_skb_pg_ring_drain(void);
 void ss_skb_init_for_xmit(struct sk_buff *skb);
+void ss_skb_queue_zcopy_set(struct sk_buff *skb_head, struct ubuf_info *uarg);
+int ss_skb_queue_copy(struct sk_buff **dst, struct sk_buff *skb_head);
 void ss_skb_dump(struct sk_buff *skb);
 int ss_skb_to_sgvec_with_new_pages(struct sk_buff *skb, struct scatterlist *sgl,
                                    struct page ***old_pages);
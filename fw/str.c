@@ -371,6 +371,30 @@ static const unsigned char etag[] = {
 	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
 };
 
+/*
+ * ASCII codes for qdtext defined by RFC 7230 3.2.6 as
+ *
+ *	HTAB / SP / %x21 / %x23-5B / %x5D-7E / obs-text
+ */
+static const unsigned char qdtext[] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+};
+
 static size_t
 __tfw_match_slow(const char *str, size_t len, const unsigned char *tbl)
 {
@@ -412,6 +436,12 @@ TFW_MATCH(xff);
 TFW_MATCH(cookie);
 TFW_MATCH(etag);
 
+size_t
+tfw_match_qdtext(const char *str, size_t len)
+{
+	return __tfw_match_slow(str, len, qdtext);
+}
+
 TFW_INIT_CUSTOM_A(uri);
 TFW_INIT_CUSTOM_A(token);
 TFW_INIT_CUSTOM_A(qetoken);
@@ -843,6 +873,35 @@ tfw_strdup_desc(TfwPool *pool, const TfwStr *src)
 	return dst;
 }
 
+/**
+ * Copy compound @str of up to @max bytes into a single chunk allocated from
+ * @pool, so the string consumers take the plain string fast paths. The chunk
+ * flags are lost. Duplicate and longer strings are left intact, as well as
+ * @str if the allocation fails.
+ */
+void
+tfw_str_linearize(TfwPool *pool, TfwStr *str, unsigned long max)
+{
+	const TfwStr *c, *end;
+	char *data, *p;
+
+	if (TFW_STR_PLAIN(str) || TFW_STR_DUP(str) || !str->len
+	    || str->len > max)
+		return;
+	if (!(data = tfw_pool_alloc(pool, str->len)))
+		return;
+
+	p = data;
+	TFW_STR_FOR_EACH_CHUNK(c, str, end) {
+		memcpy_fast(p, c->data, c->len);
+		p += c->len;
+	}
+	str->data = data;
+	str->skb = NULL;
+	str->nchunks = 0;
+	str->flags |= TFW_STR_COPY;
+}
+
 static inline int
 __tfw_str_insert(TfwPool *pool, TfwStr *dst, TfwStr *src, unsigned int chunk)
 {
@@ -915,9 +974,16 @@ __tfw_strcmp(const TfwStr *s1, const TfwStr *s2, int cs)
 	if (unlikely(!s1->len || !s2->len))
 		goto out;
 
+	n = min(s1->len, s2->len);
+	if (TFW_STR_PLAIN(s1) && TFW_STR_PLAIN(s2)) {
+		int r = (*cmp)(s1->data, s2->data, n);
+		if (r)
+			return r;
+		goto out;
+	}
+
 	i1 = i2 = 0;
 	off1 = off2 = 0;
-	n = min(s1->len, s2->len);
 	c1 = TFW_STR_CHUNK(s1, 0);
 	c2 = TFW_STR_CHUNK(s2, 0);
 	while (n) {
@@ -87,6 +87,9 @@
  * conditional branches. However, they may load unnecessary data is the first
  * 32 bytes contain non-matching data.
  *
+ * AVX-512 BW versions of the routines process 64 bytes at once and are used
+ * instead of the AVX2 ones if the CPU supports them.
+ *
  * Fall back to slow legacy C implementations if there is no AVX2.
  * ------------------------------------------------------------------------
  */
@@ -98,6 +101,7 @@ size_t tfw_match_ctext_vchar(const char *s, size_t len);
 size_t tfw_match_xff(const char *s, size_t len);
 size_t tfw_match_cookie(const char *s, size_t len);
 size_t tfw_match_etag(const char *s, size_t len);
+size_t tfw_match_qdtext(const char *s, size_t len);
 
 void tfw_init_custom_uri(const unsigned char *a);
 void tfw_init_custom_token(const unsigned char *a);
@@ -225,6 +229,11 @@ size_t tfw_ultohex(unsigned long ai, char *buf, unsigned int len);
 
 /* The chunk contains only WS characters. */
 #define TFW_STR_OWS		0x100
+/*
+ * The string data is copied out of the message skbs, so the string can't be
+ * used to edit the message in-place.
+ */
+#define TFW_STR_COPY		0x200
 
 #define SLEN(s)			(sizeof(s) - 1)
 
@@ -404,6 +413,7 @@ int tfw_strcpy(TfwStr *dst, const TfwStr *src);
 TfwStr *tfw_strdup(TfwPool *pool, const TfwStr *src);
 int tfw_strcpy_desc(TfwStr *dst, TfwStr *src);
 TfwStr *tfw_strdup_desc(TfwPool *pool, const TfwStr *src);
+void tfw_str_linearize(TfwPool *pool, TfwStr *str, unsigned long max);
 int tfw_strcat(TfwPool *pool, TfwStr *dst, TfwStr *src);
 int tfw_str_insert(TfwPool *pool, TfwStr *dst, TfwStr *src, unsigned int chunk);
 
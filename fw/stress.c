@@ -21,26 +21,36 @@
  * this program; if not, write to the Free Software Foundation, Inc., 59
  * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
+#include <linux/mm.h>
+#include <linux/rculist.h>
+
 #include "tempesta_fw.h"
+#include "cfg.h"
+#include "client.h"
 #include "http_limits.h"
+#include "log.h"
 #include "stress.h"
 
-/* TODO replace by RCU list. */
+/*
+ * The handlers are called on each overload signal from softirq, so readers
+ * walk the list under RCU, while rare (un)registrations are serialized by
+ * the spinlock.
+ */
 static LIST_HEAD(stress_handlers);
-static DEFINE_RWLOCK(tfw_stress_lock);
+static DEFINE_SPINLOCK(tfw_stress_lock);
 
 void
 tfw_stress_account_srv(/* we need here a packet and connection */)
 {
 	TfwStress *s;
 
-	read_lock(&tfw_stress_lock);
-	list_for_each_entry(s, &stress_handlers, st_list) {
+	rcu_read_lock();
+	list_for_each_entry_rcu(s, &stress_handlers, st_list) {
 		if (s->type & TfwStress_Srv)
 			if (s->account_srv())
 				tfw_classify_shrink();
 	}
-	read_unlock(&tfw_stress_lock);
+	rcu_read_unlock();
 }
 
 void
@@ -48,36 +58,191 @@ tfw_stress_account_sys(void)
 {
 	TfwStress *s;
 
-	read_lock(&tfw_stress_lock);
-	list_for_each_entry(s, &stress_handlers, st_list) {
+	rcu_read_lock();
+	list_for_each_entry_rcu(s, &stress_handlers, st_list) {
 		if (s->type & TfwStress_Sys)
 			if (s->account_sys())
 				tfw_classify_shrink();
 	}
-	read_unlock(&tfw_stress_lock);
+	rcu_read_unlock();
 }
 
 int
 tfw_stress_register(TfwStress *mod)
 {
-	write_lock(&tfw_stress_lock);
-	list_add(&mod->st_list, &stress_handlers);
-	write_unlock(&tfw_stress_lock);
+	spin_lock(&tfw_stress_lock);
+	list_add_rcu(&mod->st_list, &stress_handlers);
+	spin_unlock(&tfw_stress_lock);
 
 	return 0;
 }
 
+/*
+ * The caller may free @mod right after the call, so wait for the readers
+ * which may still see it.
+ */
 void
 tfw_stress_unregister(TfwStress *mod)
 {
-	TfwStress *s, *tmp;
+	TfwStress *s;
 
-	write_lock(&tfw_stress_lock);
-	list_for_each_entry_safe(s, tmp, &stress_handlers, st_list) {
+	spin_lock(&tfw_stress_lock);
+	list_for_each_entry(s, &stress_handlers, st_list) {
 		if (s == mod) {
-			list_del(&s->st_list);
+			list_del_rcu(&s->st_list);
 			break;
 		}
 	}
-	write_unlock(&tfw_stress_lock);
+	spin_unlock(&tfw_stress_lock);
+
+	synchronize_rcu();
+}
+
+/*
+ * Memory pressure state machine.
+ *
+ * Available system memory is checked each TFW_MEM_CHECK_INTVL and compared
+ * against the configured thresholds of the levels. A level is left only if
+ * the available memory exceeds its threshold by a quarter, so the level
+ * doesn't flap around the threshold.
+ *
+ * @tfw_mem_cfg	- thresholds of the levels in percents of RAM, zero
+ *		  disables the level;
+ * @tfw_mem_thr	- thresholds of the levels in pages;
+ */
+#define TFW_MEM_CHECK_INTVL	(HZ / 10)
+/* Idle clients evicted by a check on critical memory pressure. */
+#define TFW_MEM_EVICT_BATCH	64
+
+int tfw_mem_level __read_mostly;
+static int tfw_mem_cfg[_TFW_MEM_LEVELS];
+static unsigned long tfw_mem_thr[_TFW_MEM_LEVELS];
+static struct timer_list tfw_mem_timer;
+
+static const char *tfw_mem_names[_TFW_MEM_LEVELS] = {
+	[TFW_MEM_NORMAL]	= "normal",
+	[TFW_MEM_LOW]		= "low",
+	[TFW_MEM_SHORT]		= "short",
+	[TFW_MEM_CRITICAL]	= "critical",
+};
+
+static void
+tfw_mem_check(struct timer_list *t)
+{
+	long avail = si_mem_available();
+	int l, level = tfw_mem_level;
+
+	/* Go up to the highest level with the threshold above @avail. */
+	for (l = _TFW_MEM_LEVELS - 1; l > level; --l)
+		if (tfw_mem_thr[l] && avail < tfw_mem_thr[l])
+			break;
+	/* Or go down while @avail is well above the threshold. */
+	if (l == level)
+		while (l > TFW_MEM_NORMAL
+		       && (!tfw_mem_thr[l]
+			   || avail > tfw_mem_thr[l] + tfw_mem_thr[l] / 4))
+			--l;
+
+	if (l != level) {
+		T_WARN_NL("memory pressure level changed from %s to %s,"
+			  " %ld pages available\n", tfw_mem_names[level],
+			  tfw_mem_names[l], avail);
+		WRITE_ONCE(tfw_mem_level, l);
+	}
+	if (l == TFW_MEM_CRITICAL)
+		tfw_client_shrink(TFW_MEM_EVICT_BATCH);
+
+	mod_timer(&tfw_mem_timer, jiffies + TFW_MEM_CHECK_INTVL);
+}
+
+static int
+tfw_stress_start(void)
+{
+	int l;
+	unsigned long ram = totalram_pages();
+
+	for (l = TFW_MEM_LOW; l < _TFW_MEM_LEVELS; ++l)
+		tfw_mem_thr[l] = ram * tfw_mem_cfg[l] / 100;
+
+	if (!timer_pending(&tfw_mem_timer))
+		mod_timer(&tfw_mem_timer, jiffies + TFW_MEM_CHECK_INTVL);
+
+	return 0;
+}
+
+static void
+tfw_stress_stop(void)
+{
+	if (tfw_runstate_is_reconfig())
+		return;
+
+	del_timer_sync(&tfw_mem_timer);
+	WRITE_ONCE(tfw_mem_level, TFW_MEM_NORMAL);
+}
+
+/**
+ * memory_pressure LOW SHORT CRITICAL;
+ */
+static int
+tfw_cfgop_memory_pressure(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	int l, v, prev = 100;
+
+	if (tfw_cfg_check_val_n(ce, _TFW_MEM_LEVELS - 1))
+		return -EINVAL;
+	if (ce->attr_n) {
+		T_ERR_NL("%s: arguments may not have the '=' sign\n", cs->name);
+		return -EINVAL;
+	}
+
+	for (l = TFW_MEM_LOW; l < _TFW_MEM_LEVELS; ++l) {
+		if (tfw_cfg_parse_int(ce->vals[l - 1], &v) || v < 0 || v > 100) {
+			T_ERR_NL("%s: invalid threshold: '%s'\n", cs->name,
+				 ce->vals[l - 1]);
+			return -EINVAL;
+		}
+		if (v && v > prev) {
+			T_ERR_NL("%s: threshold '%d' is above the threshold of"
+				 " a lower level\n", cs->name, v);
+			return -EINVAL;
+		}
+		if (v)
+			prev = v;
+		tfw_mem_cfg[l] = v;
+	}
+
+	return 0;
+}
+
+static TfwCfgSpec tfw_stress_specs[] = {
+	{
+		.name = "memory_pressure",
+		.deflt = "4 2 1",
+		.handler = tfw_cfgop_memory_pressure,
+		.allow_none = true,
+		.allow_repeat = false,
+	},
+	{ 0 }
+};
+
+TfwMod tfw_stress_mod = {
+	.name	= "stress",
+	.start	= tfw_stress_start,
+	.stop	= tfw_stress_stop,
+	.specs	= tfw_stress_specs,
+};
+
+int __init
+tfw_stress_init(void)
+{
+	timer_setup(&tfw_mem_timer, tfw_mem_check, 0);
+	tfw_mod_register(&tfw_stress_mod);
+
+	return 0;
+}
+
+void
+tfw_stress_exit(void)
+{
+	tfw_mod_unregister(&tfw_stress_mod);
 }
@@ -54,6 +54,33 @@ typedef struct {
 
 } TfwStress;
 
+/*
+ * System memory pressure levels. Each level includes the actions of the lower
+ * levels, so Tempesta degrades gracefully instead of failing allocations
+ * at random places.
+ *
+ * TFW_MEM_NORMAL	- no memory pressure;
+ * TFW_MEM_LOW		- responses aren't admitted to the cache;
+ * TFW_MEM_SHORT	- new client connections are rejected and HTTP/2
+ *			  receive windows of the streams shrink;
+ * TFW_MEM_CRITICAL	- idle clients are evicted with their connections.
+ */
+enum {
+	TFW_MEM_NORMAL,
+	TFW_MEM_LOW,
+	TFW_MEM_SHORT,
+	TFW_MEM_CRITICAL,
+	_TFW_MEM_LEVELS
+};
+
+extern int tfw_mem_level;
+
+static inline int
+tfw_mem_pressure(void)
+{
+	return READ_ONCE(tfw_mem_level);
+}
+
 void tfw_stress_account_srv(void);
 void tfw_stress_account_sys(void);
 
@@ -28,11 +28,17 @@
 #include "addr.h"
 #include "ss_skb.h"
 
-/* Protocol descriptor. */
+/*
+ * Protocol descriptor.
+ *
+ * @jtxtstamp	- time the data was last pushed to TCP write queue of the
+ *		  socket, in jiffies.
+ */
 typedef struct ss_proto_t {
 	const struct ss_hooks	*hooks;
 	struct sock		*listener;
 	int			type;
+	unsigned long		jtxtstamp;
 } SsProto;
 
 /*
@@ -51,6 +57,17 @@ enum {
 	 * only for client connections).
 	 */
 	Conn_Stop		= 0x1 << __Flag_Bits,
+	/*
+	 * Data isn't read from the socket until ss_rx_resume(): it stays in
+	 * the socket receive queue and the peer is throttled by the closing
+	 * TCP receive window.
+	 */
+	Conn_RxPause		= 0x2 << __Flag_Bits,
+	/*
+	 * The connection is accepted with TCP Fast Open and processes the
+	 * data from the SYN, but the handshake isn't finished yet.
+	 */
+	Conn_FastOpen		= 0x4 << __Flag_Bits,
 };
 
 /* Table of Synchronous Sockets connection callbacks. */
@@ -72,17 +89,24 @@ typedef struct ss_hooks {
 
 	/* Process data received on the socket. */
 	int (*connection_recv)(void *conn, struct sk_buff *skb);
+
+	/* Data is sent from the socket write queue or acknowledged. */
+	void (*connection_wspace)(struct sock *sk);
 } SsHooks;
 
 /**
  * Synchronous sockets per-CPU statistics.
  *
- * @rb_wq_sz	- number of items in ring-buffer work queue;
- * @backlog_sz	- size of backlog;
+ * @rb_wq_sz		- number of items in ring-buffer work queue;
+ * @backlog_sz		- size of backlog;
+ * @ipi_sent		- number of IPIs sent to other CPUs;
+ * @ipi_coalesced	- number of IPIs saved by batching;
  */
 typedef struct {
 	unsigned int	rb_wq_sz;
 	unsigned int	backlog_sz;
+	unsigned long	ipi_sent;
+	unsigned long	ipi_coalesced;
 } SsStat;
 
 static inline void
@@ -103,6 +127,15 @@ ss_sock_live(struct sock *sk)
 	return sk->sk_state == TCP_ESTABLISHED;
 }
 
+/* Number of bytes in the socket write queue not sent to the peer yet. */
+static inline unsigned int
+ss_sock_notsent(struct sock *sk)
+{
+	const struct tcp_sock *tp = tcp_sk(sk);
+
+	return READ_ONCE(tp->write_seq) - READ_ONCE(tp->snd_nxt);
+}
+
 /* Synchronous operation required. */
 #define SS_F_SYNC			0x01
 /* Keep SKBs (use clones) on sending. */
@@ -111,6 +144,8 @@ ss_sock_live(struct sock *sk)
 #define SS_F_CONN_CLOSE			0x04
 /* Call TLS encryption hook on the skb transmission. */
 #define SS_F_ENCRYPT			0x08
+/* Abort the connection: send RST instead of FIN, don't keep FIN_WAIT2. */
+#define SS_F_ABORT			0x10
 
 /* Conversion of skb type (flag) to/from TLS record type. */
 #define SS_SKB_TYPE2F(t)		(((int)(t)) << 8)
@@ -125,11 +160,14 @@ void ss_set_callbacks(struct sock *sk);
 void ss_set_listen(struct sock *sk);
 int ss_send(struct sock *sk, struct sk_buff **skb_head, int flags);
 int ss_close(struct sock *sk, int flags);
+void ss_rx_pause(struct sock *sk);
+void ss_rx_resume(struct sock *sk);
 int ss_sock_create(int family, int type, int protocol, struct sock **res);
 void ss_release(struct sock *sk);
 int ss_connect(struct sock *sk, const TfwAddr *addr, int flags);
 int ss_bind(struct sock *sk, const TfwAddr *addr);
 int ss_listen(struct sock *sk, int backlog);
+int ss_fastopen(struct sock *sk, int qlen);
 void ss_getpeername(struct sock *sk, TfwAddr *addr);
 void ss_wait_newconn(void);
 void ss_synchronize(void);
@@ -137,6 +175,8 @@ void ss_start(void);
 void ss_stop(void);
 bool ss_active(void);
 void ss_get_stat(SsStat *stat);
+int ss_busy_poll_start(const cpumask_t *cpus, unsigned int idle);
+void ss_busy_poll_stop(void);
 
 #define SS_CALL(f, ...)							\
 	(sk->sk_user_data && ((SsProto *)(sk)->sk_user_data)->hooks->f	\
@@ -109,6 +109,17 @@ test_resp_free(TfwHttpResp *resp)
  * environment.
  */
 struct {} *tfw_perfstat;
+struct {} *tfw_lat_stat;
+/* TfwNumaStat, it's updated on each message allocation. */
+DEFINE_PER_CPU_ALIGNED(struct { u64 cnt[3][2]; }, tfw_numa_stat);
+DEFINE_STATIC_KEY_FALSE(tfw_lat_enabled);
+int tfw_mem_level;
+DEFINE_STATIC_KEY_FALSE(tfw_alog_enabled);
+
+void
+__tfw_access_log(TfwHttpReq *req, TfwHttpResp *resp, unsigned long bytes)
+{
+}
 
 void
 tfw_apm_hm_srv_rcount_update(TfwStr *uri_path, void *apmref)
@@ -127,11 +138,32 @@ tfw_apm_hm_srv_limit(int status, void *apmref)
 	return false;
 }
 
+void
+tfw_apm_hm_srv_mark_alive(TfwServer *srv)
+{
+}
+
 void
 tfw_apm_update(void *apmref, unsigned long jtstamp, unsigned long jrtt)
 {
 }
 
+void
+tfw_apm_update_qtime(void *apmref, unsigned long jqtime)
+{
+}
+
+const TfwStr *
+tfw_apm_load_hdr(void)
+{
+	return NULL;
+}
+
+void
+tfw_apm_update_load(void *apmref, unsigned int load)
+{
+}
+
 bool
 ss_active(void)
 {
@@ -170,6 +202,11 @@ tfw_client_put(TfwClient *cli)
 {
 }
 
+void
+tfw_client_touch(TfwClient *cli)
+{
+}
+
 TfwClient *
 tfw_client_obtain(TfwAddr addr, TfwAddr *xff_addr, TfwStr *user_agent,
 		  void (*init)(void *))
@@ -183,6 +220,11 @@ tfw_cli_conn_send(TfwCliConn *cli_conn, TfwMsg *msg)
 	return 0;
 }
 
+void
+tfw_cli_conn_rx_throttle(TfwCliConn *cli_conn, TfwSrvConn *srv_conn)
+{
+}
+
 int
 tfw_gfsm_dispatch(TfwGState *st, void *obj, TfwFsmData *data)
 {
@@ -228,6 +270,23 @@ tfw_filter_block_ip(const TfwAddr *addr)
 {
 }
 
+void
+frang_h2_rates_init(TfwFrameRates *fr)
+{
+}
+
+int
+__frang_h2_frame_block(TfwH2Ctx *ctx, TfwFrameLim type)
+{
+	return TFW_BLOCK;
+}
+
+int
+frang_sticky_fail(TfwHttpReq *req)
+{
+	return TFW_PASS;
+}
+
 TfwCfgSpec tfw_http_sess_specs[0];
 
 int
@@ -273,6 +332,16 @@ tfw_cache_process(TfwHttpMsg *msg, tfw_http_cache_cb_t action)
 	return 0;
 }
 
+void
+tfw_cache_fetch_bypass(TfwHttpReq *req)
+{
+}
+
+void
+tfw_cache_fetch_abort(TfwHttpReq *req)
+{
+}
+
 void
 tfw_tls_cfg_configured(bool global)
 {
@@ -362,3 +431,25 @@ void
 tfw_server_destroy(TfwServer *srv)
 {
 }
+
+bool
+tfw_sg_climit_get(TfwSrvGroup *sg)
+{
+	return true;
+}
+
+void
+tfw_sg_climit_put(TfwSrvGroup *sg, int status, unsigned long jrtt)
+{
+}
+
+void
+__tfw_srv_outlier_update(TfwServer *srv, int status, unsigned long jrtt)
+{
+}
+
+void
+__tfw_srv_pipe_update(TfwServer *srv, TfwSrvConn *srv_conn,
+		      unsigned long jtx, unsigned long jrtt)
+{
+}
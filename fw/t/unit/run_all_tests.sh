@@ -44,7 +44,8 @@ insmod $root/../../../lib/tempesta_lib.ko || clean_exit 1
 insmod $root/../../../db/core/tempesta_db.ko || clean_exit 1
 
 insmod $root/../tfw_fuzzer.ko || clean_exit 1
-insmod $root/tfw_test.ko || clean_exit 1
+# The arguments are passed to tfw_test, e.g. bench=1 runs the benchmarks.
+insmod $root/tfw_test.ko "$@" || clean_exit 1
 
 clean_exit 0
 
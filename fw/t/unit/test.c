@@ -22,6 +22,10 @@
 #include <linux/module.h>
 #include "test.h"
 
+static bool bench;
+module_param(bench, bool, 0444);
+MODULE_PARM_DESC(bench, "Run the microbenchmarks after the tests");
+
 int test_fail_counter;
 test_fixture_fn_t test_setup_fn;
 test_fixture_fn_t test_teardown_fn;
@@ -92,8 +96,15 @@ TEST_SUITE(http_msg);
 TEST_SUITE(hash);
 TEST_SUITE(addr);
 TEST_SUITE(wq);
+TEST_SUITE(cache_fetch);
+TEST_SUITE(cache_range);
 TEST_SUITE(tls);
 TEST_SUITE(hpack);
+TEST_SUITE(qpack);
+TEST_SUITE(h2_sched);
+TEST_SUITE(str_perf);
+TEST_SUITE(http_parser_perf);
+TEST_SUITE(hpack_perf);
 
 extern int tfw_pool_init(void);
 extern void tfw_pool_exit(void);
@@ -111,6 +122,7 @@ test_run_all(void)
 	/* Run sleeping tests first. */
 	TEST_SUITE_RUN(cfg);
 	TEST_SUITE_RUN(wq);
+	TEST_SUITE_RUN(cache_fetch);
 
 	kernel_fpu_begin();
 
@@ -133,6 +145,9 @@ test_run_all(void)
 	TEST_SUITE_RUN(http_msg);
 	__fpu_schedule();
 
+	TEST_SUITE_RUN(cache_range);
+	__fpu_schedule();
+
 	TEST_SUITE_RUN(hash);
 	__fpu_schedule();
 
@@ -142,6 +157,23 @@ test_run_all(void)
 	TEST_SUITE_RUN(hpack);
 	__fpu_schedule();
 
+	TEST_SUITE_RUN(qpack);
+	__fpu_schedule();
+
+	TEST_SUITE_RUN(h2_sched);
+	__fpu_schedule();
+
+	if (bench) {
+		TEST_SUITE_RUN(str_perf);
+		__fpu_schedule();
+
+		TEST_SUITE_RUN(http_parser_perf);
+		__fpu_schedule();
+
+		TEST_SUITE_RUN(hpack_perf);
+		__fpu_schedule();
+	}
+
 	kernel_fpu_end();
 
 	tfw_pool_exit();
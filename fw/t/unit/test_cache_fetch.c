@@ -0,0 +1,146 @@
+/**
+ *		Tempesta FW
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <linux/delay.h>
+
+#include "test.h"
+
+#include "cache_fetch.c"
+
+#define KEY		0xdeadbeefUL
+/* Long enough to never expire while a test runs. */
+#define TIMEOUT		60000
+
+static TfwHttpReq reqs[4];
+static int resumed;
+
+void
+tfw_cache_req_resume(TfwHttpReq *req, tfw_http_cache_cb_t action)
+{
+	EXPECT_TRUE(test_bit(TFW_HTTP_B_CACHE_WAITED, req->flags));
+	WRITE_ONCE(resumed, resumed + 1);
+}
+
+static void
+test_fetch_action(TfwHttpMsg *msg)
+{
+}
+
+static void
+test_fetch_setup(void)
+{
+	int i;
+
+	memset(reqs, 0, sizeof(reqs));
+	for (i = 0; i < ARRAY_SIZE(reqs); ++i)
+		INIT_LIST_HEAD(&reqs[i].fwd_list);
+	resumed = 0;
+	tfw_cache_fetch_init();
+}
+
+static void
+test_fetch_teardown(void)
+{
+	tfw_cache_fetch_cleanup();
+}
+
+/* Wait for the fetch timer to resume @n requests. */
+static void
+test_fetch_wait_resumed(int n)
+{
+	int i;
+
+	for (i = 0; i < 100 && READ_ONCE(resumed) < n; ++i)
+		msleep(10);
+}
+
+TEST(cache_fetch, leader_done)
+{
+	EXPECT_FALSE(tfw_cache_fetch_wait(&reqs[0], KEY, test_fetch_action,
+					  TIMEOUT));
+	EXPECT_TRUE(test_bit(TFW_HTTP_B_CACHE_FETCH, reqs[0].flags));
+	EXPECT_TRUE(tfw_cache_fetch_wait(&reqs[1], KEY, test_fetch_action,
+					 TIMEOUT));
+	EXPECT_TRUE(tfw_cache_fetch_wait(&reqs[2], KEY, test_fetch_action,
+					 TIMEOUT));
+	/* Other keys aren't collapsed. */
+	EXPECT_FALSE(tfw_cache_fetch_wait(&reqs[3], ~KEY, test_fetch_action,
+					  TIMEOUT));
+
+	tfw_cache_fetch_done(KEY);
+	EXPECT_EQ(resumed, 2);
+	EXPECT_TRUE(list_empty(&reqs[1].fwd_list));
+	EXPECT_TRUE(list_empty(&reqs[2].fwd_list));
+
+	/* The resumed requests never wait again. */
+	EXPECT_FALSE(tfw_cache_fetch_wait(&reqs[1], ~KEY, test_fetch_action,
+					  TIMEOUT));
+}
+
+TEST(cache_fetch, leader_fail)
+{
+	EXPECT_FALSE(tfw_cache_fetch_wait(&reqs[0], KEY, test_fetch_action,
+					  TIMEOUT));
+	EXPECT_TRUE(tfw_cache_fetch_wait(&reqs[1], KEY, test_fetch_action,
+					 TIMEOUT));
+	EXPECT_TRUE(tfw_cache_fetch_wait(&reqs[2], KEY, test_fetch_action,
+					 TIMEOUT));
+
+	/* The leader is freed without a response. */
+	tfw_cache_fetch_release(&reqs[0], KEY);
+	EXPECT_FALSE(test_bit(TFW_HTTP_B_CACHE_FETCH, reqs[0].flags));
+	test_fetch_wait_resumed(2);
+	EXPECT_EQ(resumed, 2);
+
+	/* Next miss for the key is forwarded. */
+	EXPECT_FALSE(tfw_cache_fetch_wait(&reqs[3], KEY, test_fetch_action,
+					  TIMEOUT));
+	EXPECT_TRUE(test_bit(TFW_HTTP_B_CACHE_FETCH, reqs[3].flags));
+}
+
+TEST(cache_fetch, stale_leader)
+{
+	EXPECT_FALSE(tfw_cache_fetch_wait(&reqs[0], KEY, test_fetch_action,
+					  TIMEOUT));
+	tfw_cache_fetch_done(KEY);
+
+	/* A late release of the previous leader doesn't touch a new fetch. */
+	EXPECT_FALSE(tfw_cache_fetch_wait(&reqs[1], KEY, test_fetch_action,
+					  TIMEOUT));
+	EXPECT_TRUE(tfw_cache_fetch_wait(&reqs[2], KEY, test_fetch_action,
+					 TIMEOUT));
+	tfw_cache_fetch_release(&reqs[0], KEY);
+	msleep(20);
+	EXPECT_EQ(resumed, 0);
+	EXPECT_FALSE(list_empty(&reqs[2].fwd_list));
+
+	tfw_cache_fetch_release(&reqs[1], KEY);
+	test_fetch_wait_resumed(1);
+	EXPECT_EQ(resumed, 1);
+}
+
+TEST_SUITE(cache_fetch)
+{
+	TEST_SETUP(test_fetch_setup);
+	TEST_TEARDOWN(test_fetch_teardown);
+
+	TEST_RUN(cache_fetch, leader_done);
+	TEST_RUN(cache_fetch, leader_fail);
+	TEST_RUN(cache_fetch, stale_leader);
+}
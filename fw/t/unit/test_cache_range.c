@@ -0,0 +1,140 @@
+/**
+ *		Tempesta FW
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "test.h"
+
+#include "cache_range.c"
+
+static TfwCacheRanges rs;
+
+static int
+parse(const char *s, unsigned long len)
+{
+	memset(&rs, 0, sizeof(rs));
+
+	return tfw_cache_parse_ranges(s, s + strlen(s), len, &rs);
+}
+
+TEST(cache_range, single)
+{
+	EXPECT_EQ(parse("bytes=0-4", 10), 1);
+	EXPECT_EQ(rs.first[0], 0);
+	EXPECT_EQ(rs.last[0], 4);
+
+	/* Open and too long ranges are cut by the representation end. */
+	EXPECT_EQ(parse("bytes=3-", 10), 1);
+	EXPECT_EQ(rs.first[0], 3);
+	EXPECT_EQ(rs.last[0], 9);
+	EXPECT_EQ(parse("Bytes=3-100", 10), 1);
+	EXPECT_EQ(rs.last[0], 9);
+}
+
+TEST(cache_range, suffix)
+{
+	EXPECT_EQ(parse("bytes=-5", 10), 1);
+	EXPECT_EQ(rs.first[0], 5);
+	EXPECT_EQ(rs.last[0], 9);
+
+	/* Suffix longer than the representation selects the whole one. */
+	EXPECT_EQ(parse("bytes=-20", 10), 1);
+	EXPECT_EQ(rs.first[0], 0);
+	EXPECT_EQ(rs.last[0], 9);
+
+	EXPECT_EQ(parse("bytes=-0", 10), -ERANGE);
+	EXPECT_EQ(parse("bytes=-5", 0), -ERANGE);
+}
+
+TEST(cache_range, overlap)
+{
+	EXPECT_EQ(parse("bytes=0-5, 3-8", 10), 2);
+	EXPECT_EQ(rs.first[0], 0);
+	EXPECT_EQ(rs.last[0], 5);
+	EXPECT_EQ(rs.first[1], 3);
+	EXPECT_EQ(rs.last[1], 8);
+}
+
+TEST(cache_range, too_many)
+{
+	EXPECT_EQ(parse("bytes=0-0,1-1,2-2,3-3,4-4,5-5,6-6,7-7", 10), 8);
+	EXPECT_EQ(parse("bytes=0-0,1-1,2-2,3-3,4-4,5-5,6-6,7-7,8-8", 10), 0);
+}
+
+TEST(cache_range, unsatisfiable)
+{
+	EXPECT_EQ(parse("bytes=10-", 10), -ERANGE);
+	EXPECT_EQ(parse("bytes=10-20,30-40", 10), -ERANGE);
+
+	/* Unsatisfiable ranges are skipped if there are satisfiable ones. */
+	EXPECT_EQ(parse("bytes=10-20,2-3", 10), 1);
+	EXPECT_EQ(rs.first[0], 2);
+	EXPECT_EQ(rs.last[0], 3);
+}
+
+TEST(cache_range, empty_set)
+{
+	EXPECT_EQ(parse("bytes=", 10), 0);
+	EXPECT_EQ(parse("bytes= ", 10), 0);
+	EXPECT_EQ(parse("bytes=,,", 10), 0);
+	EXPECT_EQ(parse("bytes=, ,", 10), 0);
+}
+
+TEST(cache_range, invalid)
+{
+	EXPECT_EQ(parse("items=0-4", 10), 0);
+	EXPECT_EQ(parse("bytes=-", 10), 0);
+	EXPECT_EQ(parse("bytes=5-4", 10), 0);
+	EXPECT_EQ(parse("bytes=0-4;", 10), 0);
+	EXPECT_EQ(parse("bytes=0 4", 10), 0);
+	EXPECT_EQ(parse("bytes=99999999999999999999-", 10), 0);
+}
+
+TEST(cache_range, part_hdr)
+{
+	char buf[TFW_CACHE_PART_HDR_MAX];
+	int n;
+
+	EXPECT_EQ(parse("bytes=0-4,6-7", 10), 2);
+	rs.total = 10;
+	strscpy(rs.boundary, "0123456789abcdef", sizeof(rs.boundary));
+
+	n = tfw_cache_range_part_hdr(buf, sizeof(buf), &rs, 1);
+	EXPECT_EQ(n, tfw_cache_range_part_hdr(NULL, 0, &rs, 1));
+	EXPECT_STR_EQ(buf, "\r\n--0123456789abcdef\r\n"
+			   "content-range: bytes 6-7/10\r\n\r\n");
+
+	rs.ctype = "text/plain; charset=utf-8";
+	rs.ctype_len = strlen(rs.ctype);
+	n = tfw_cache_range_part_hdr(buf, sizeof(buf), &rs, 0);
+	EXPECT_EQ(n, tfw_cache_range_part_hdr(NULL, 0, &rs, 0));
+	EXPECT_STR_EQ(buf, "\r\n--0123456789abcdef\r\n"
+			   "content-type: text/plain; charset=utf-8\r\n"
+			   "content-range: bytes 0-4/10\r\n\r\n");
+}
+
+TEST_SUITE(cache_range)
+{
+	TEST_RUN(cache_range, single);
+	TEST_RUN(cache_range, suffix);
+	TEST_RUN(cache_range, overlap);
+	TEST_RUN(cache_range, too_many);
+	TEST_RUN(cache_range, unsatisfiable);
+	TEST_RUN(cache_range, empty_set);
+	TEST_RUN(cache_range, invalid);
+	TEST_RUN(cache_range, part_hdr);
+}
@@ -0,0 +1,113 @@
+/**
+ *		Tempesta FW
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "test.h"
+#include "http_stream.h"
+
+/* RFC 7540 6.9.2 default flow-control window. */
+#define TEST_WND_SIZE		((1U << 16) - 1)
+
+static TfwStreamSched test_sched;
+
+TEST(h2_sched, parse_prio)
+{
+	bool incr;
+	unsigned char urg;
+	const char *v;
+
+#define PARSE_PRIO(s)	tfw_h2_sched_parse_prio(s, s + strlen(s), &urg, &incr)
+
+	v = "u=1, i";
+	EXPECT_ZERO(PARSE_PRIO(v));
+	EXPECT_EQ(urg, 1);
+	EXPECT_TRUE(incr);
+
+	v = "i=?0;a=b, x=(1 2), u=7";
+	EXPECT_ZERO(PARSE_PRIO(v));
+	EXPECT_EQ(urg, 7);
+	EXPECT_FALSE(incr);
+
+	v = "u=8, i=?1";
+	EXPECT_ZERO(PARSE_PRIO(v));
+	EXPECT_EQ(urg, TFW_H2_URGENCY_DEF);
+	EXPECT_TRUE(incr);
+
+	v = "";
+	EXPECT_ZERO(PARSE_PRIO(v));
+	EXPECT_EQ(urg, TFW_H2_URGENCY_DEF);
+	EXPECT_FALSE(incr);
+
+	v = "U=1";
+	EXPECT_TRUE(PARSE_PRIO(v));
+
+#undef PARSE_PRIO
+}
+
+TEST(h2_sched, next)
+{
+	TfwStreamSched *sched = &test_sched;
+	TfwStream s1 = {}, s3 = {}, s5 = {};
+
+	tfw_h2_sched_init(sched);
+
+	tfw_h2_init_stream(&s1, 1, 256, TEST_WND_SIZE);
+	tfw_h2_init_stream(&s3, 3, 64, TEST_WND_SIZE);
+	tfw_h2_init_stream(&s5, 5, 16, TEST_WND_SIZE);
+	tfw_h2_add_stream_dep(sched, &s1, NULL, false);
+	tfw_h2_add_stream_dep(sched, &s3, NULL, false);
+	/* Stream 5 can't progress until stream 1 is done. */
+	tfw_h2_add_stream_dep(sched, &s5, &s1, false);
+
+	EXPECT_NULL(tfw_h2_sched_next(sched));
+	tfw_h2_sched_activate(&s5);
+	tfw_h2_sched_activate(&s3);
+	EXPECT_TRUE(tfw_h2_sched_next(sched) == &s5);
+
+	/* Stream 1 gets 4 times more bandwidth than stream 3. */
+	tfw_h2_sched_activate(&s1);
+	tfw_h2_sched_account(&s3, 1000);
+	EXPECT_TRUE(tfw_h2_sched_next(sched) == &s1);
+	tfw_h2_sched_account(&s1, 3000);
+	EXPECT_TRUE(tfw_h2_sched_next(sched) == &s1);
+	tfw_h2_sched_account(&s1, 2000);
+	EXPECT_TRUE(tfw_h2_sched_next(sched) == &s3);
+
+	/* RFC 9218 urgency takes precedence over the weights. */
+	tfw_h2_sched_set_prio(&s3, 0, false);
+	tfw_h2_sched_account(&s3, 10000);
+	EXPECT_TRUE(tfw_h2_sched_next(sched) == &s3);
+
+	tfw_h2_sched_deactivate(&s3);
+	tfw_h2_sched_deactivate(&s1);
+	EXPECT_TRUE(tfw_h2_sched_next(sched) == &s5);
+	tfw_h2_sched_deactivate(&s5);
+	EXPECT_NULL(tfw_h2_sched_next(sched));
+
+	tfw_h2_remove_stream_dep(sched, &s1);
+	EXPECT_TRUE(s5.sched.parent == &sched->root);
+	tfw_h2_remove_stream_dep(sched, &s5);
+	tfw_h2_remove_stream_dep(sched, &s3);
+	EXPECT_TRUE(list_empty(&sched->root.children));
+}
+
+TEST_SUITE(h2_sched)
+{
+	TEST_RUN(h2_sched, parse_prio);
+	TEST_RUN(h2_sched, next);
+}
@@ -200,6 +200,49 @@ TEST(tfw_hash_str, distributes_all_input_across_hash_bits)
 	}
 }
 
+/*
+ * Long data is hashed by stripes, but the hash must be the same as of the
+ * plain two lanes hashing, whatever the data is split into chunks.
+ */
+TEST(tfw_hash_str, hashes_long_data_as_two_lanes)
+{
+	static char buf[4096];
+	unsigned long crc0, crc1, h;
+	size_t i, len, n;
+	unsigned long *d = (unsigned long *)buf;
+
+	for (i = 0; i < sizeof(buf); ++i)
+		buf[i] = i * 7 + (i >> 8);
+
+	for (len = 700; len <= sizeof(buf); len += 333) {
+		TfwStr s = { .data = buf, .len = len };
+		TfwStr c[2] = {
+			{ .data = buf, .len = len / 3 + 5 },
+			{ .data = buf + len / 3 + 5, .len = len - len / 3 - 5 }
+		};
+		TfwStr sc = { .chunks = c, .len = len, .nchunks = 2 };
+
+		crc0 = crc1 = 0;
+		n = (len >> 3) & ~1UL;
+		for (i = 0; i < n; i += 2) {
+			CRCQ(crc0, d[i]);
+			CRCQ(crc1, d[i + 1]);
+		}
+		if (((n + 1) << 3) <= len) {
+			CRCQ(crc0, d[n]);
+			for (n = (n + 1) << 3; n < len; ++n)
+				CRCB(crc1, buf[n]);
+		} else {
+			for (n <<= 3; n < len; ++n)
+				CRCB(crc0, buf[n]);
+		}
+		h = (crc1 << 32) | crc0;
+
+		EXPECT_EQ(tfw_hash_str(&s), h);
+		EXPECT_EQ(tfw_hash_str(&sc), h);
+	}
+}
+
 TEST_SUITE(hash)
 {
 	TEST_RUN(tfw_hash_str, calcs_diff_hash_for_diff_str);
@@ -207,4 +250,5 @@ TEST_SUITE(hash)
 	TEST_RUN(tfw_hash_str, hashes_all_chars);
 	TEST_RUN(tfw_hash_str, doesnt_read_behind_end_of_buf);
 	TEST_RUN(tfw_hash_str, distributes_all_input_across_hash_bits);
+	TEST_RUN(tfw_hash_str, hashes_long_data_as_two_lanes);
 }
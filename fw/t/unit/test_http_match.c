@@ -28,6 +28,7 @@
 #include "tfw_str_helper.h"
 
 #include "http_match.c"
+#include "regex.c"
 
 typedef struct {
 	int test_id;
@@ -144,6 +145,40 @@ err:
 	kfree(arg);
 }
 
+static void
+test_chain_add_rule_regex(int test_id, tfw_http_match_fld_t field,
+			  const char *re)
+{
+	MatchEntry *e;
+	tfw_http_match_op_t op;
+	tfw_http_match_arg_t type;
+	size_t arg_size = 0;
+	const char *arg;
+
+	arg = tfw_http_arg_regex(re, field, TFW_HTTP_HDR_RAW, &arg_size, &type,
+				 &op);
+	EXPECT_FALSE(IS_ERR(arg));
+	if (IS_ERR(arg))
+		return;
+
+	e = test_rule_container_new(test_chain, MatchEntry, rule,
+				    type, arg_size);
+	EXPECT_NOT_NULL(e);
+	if (!e)
+		goto err;
+	e->rule.field = field;
+	e->rule.op = op;
+	e->rule.arg.type = type;
+	tfw_http_rule_arg_init(&e->rule, arg, arg_size - 1);
+	e->rule.re = tfw_regex_compile(e->rule.arg.str, e->rule.arg.len,
+				       test_chain->pool);
+	EXPECT_FALSE(IS_ERR(e->rule.re));
+	e->rule.act.type = TFW_HTTP_MATCH_ACT_CHAIN;
+	e->test_id = test_id;
+err:
+	kfree(arg);
+}
+
 int
 test_chain_match(void)
 {
@@ -157,6 +192,18 @@ test_chain_match(void)
 	return -1;
 }
 
+static int
+test_chain_match_compiled(void)
+{
+	TfwHttpMatchRule *r;
+
+	/* The request is reused with other fields, drop the memoized hashes. */
+	test_req->uri_hash = test_req->host_hash = 0;
+	r = tfw_http_match_chain(test_req, test_chain);
+
+	return r ? container_of(r, MatchEntry, rule)->test_id : -1;
+}
+
 static void
 set_tfw_str(TfwStr *str, const char *cstr)
 {
@@ -502,6 +549,94 @@ TEST(http_match, method_eq)
 	EXPECT_EQ(42, match_id);
 }
 
+TEST(http_match, compiled_chain)
+{
+	test_chain_add_rule_str(1, TFW_HTTP_MATCH_F_URI, NULL, "/foo/bar*");
+	test_chain_add_rule_str(2, TFW_HTTP_MATCH_F_URI, NULL, "/foo");
+	test_chain_add_rule_str(3, TFW_HTTP_MATCH_F_HOST, NULL, "example.com");
+	test_chain_add_rule_str(4, TFW_HTTP_MATCH_F_URI, NULL, "/FOO/baz");
+	test_chain_add_rule_str(5, TFW_HTTP_MATCH_F_URI, NULL, "*.html");
+
+	EXPECT_ZERO(tfw_http_chain_compile(test_chain));
+	EXPECT_NOT_NULL(test_chain->match_idx);
+
+	set_tfw_str(&test_req->uri_path, "/foo/bar/baz");
+	EXPECT_EQ(1, test_chain_match_compiled());
+
+	set_tfw_str(&test_req->uri_path, "/Foo");
+	EXPECT_EQ(2, test_chain_match_compiled());
+
+	set_tfw_str(&test_req->host, "Example.COM");
+	set_tfw_str(&test_req->uri_path, "/foo/baz");
+	EXPECT_EQ(3, test_chain_match_compiled());
+
+	set_tfw_str(&test_req->host, "tempesta-tech.com");
+	EXPECT_EQ(4, test_chain_match_compiled());
+
+	set_tfw_str(&test_req->uri_path, "/index.html");
+	EXPECT_EQ(5, test_chain_match_compiled());
+
+	set_tfw_str(&test_req->uri_path, "/foo/baz/");
+	EXPECT_EQ(-1, test_chain_match_compiled());
+}
+
+TEST(http_match, uri_regex)
+{
+	test_chain_add_rule_regex(1, TFW_HTTP_MATCH_F_URI,
+				  "^/api/v[0-9]{1,2}/(users|groups)/\\d+$");
+	test_chain_add_rule_regex(2, TFW_HTTP_MATCH_F_URI, "\\.(jpe?g|png)$");
+	test_chain_add_rule_regex(3, TFW_HTTP_MATCH_F_HOST, "^[^.]+\\.example");
+
+	set_tfw_str(&test_req->uri_path, "/API/v12/Users/42");
+	EXPECT_EQ(1, test_chain_match());
+
+	set_tfw_str(&test_req->uri_path, "/api/v123/users/42");
+	EXPECT_EQ(-1, test_chain_match());
+
+	set_tfw_str(&test_req->uri_path, "/img/a.b/pic.JPEG");
+	EXPECT_EQ(2, test_chain_match());
+
+	set_tfw_str(&test_req->uri_path, "/img/pic.jpeg/");
+	EXPECT_EQ(-1, test_chain_match());
+
+	set_tfw_str(&test_req->host, "www.example.com");
+	EXPECT_EQ(3, test_chain_match());
+
+	set_tfw_str(&test_req->host, "a.b.example.com");
+	EXPECT_EQ(-1, test_chain_match());
+}
+
+TEST(http_match, regex_chunked)
+{
+	TfwPool *pool = __tfw_pool_new(0);
+	TfwRegex *re;
+	TfwStr s = {
+		.chunks = (TfwStr []){
+			{ .data = "/fo",	.len = 3 },
+			{ .data = "o/ba",	.len = 4 },
+			{ .data = "r",		.len = 1 },
+		},
+		.len = 8,
+		.nchunks = 3
+	};
+
+	BUG_ON(!pool);
+
+	re = tfw_regex_compile("o+/(bar|baz)$", 13, pool);
+	EXPECT_FALSE(IS_ERR(re));
+	EXPECT_TRUE(tfw_regex_match(re, &s));
+
+	re = tfw_regex_compile("^/fo/", 5, pool);
+	EXPECT_FALSE(IS_ERR(re));
+	EXPECT_FALSE(tfw_regex_match(re, &s));
+
+	EXPECT_TRUE(IS_ERR(tfw_regex_compile("(a|b", 4, pool)));
+	EXPECT_TRUE(IS_ERR(tfw_regex_compile("a{2,1}", 6, pool)));
+	EXPECT_TRUE(IS_ERR(tfw_regex_compile("a^b", 3, pool)));
+
+	tfw_pool_destroy(pool);
+}
+
 TEST_SUITE(http_match)
 {
 	TEST_SETUP(http_match_suite_setup);
@@ -518,4 +653,7 @@ TEST_SUITE(http_match)
 	TEST_RUN(http_match, raw_header_eq);
 	TEST_RUN(http_match, raw_header_eq_ws);
 	TEST_RUN(http_match, method_eq);
+	TEST_RUN(http_match, compiled_chain);
+	TEST_RUN(http_match, uri_regex);
+	TEST_RUN(http_match, regex_chunked);
 }
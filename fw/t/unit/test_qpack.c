@@ -0,0 +1,103 @@
+/**
+ *		Tempesta FW
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "test.h"
+#include "hpack.h"
+
+typedef struct {
+	const char	*name;
+	const char	*val;
+} QpField;
+
+typedef struct {
+	const QpField	*exp;
+	unsigned int	cnt;
+	unsigned int	n;
+} QpFields;
+
+static int
+qpack_check_field(void *data, const char *name, unsigned long nlen,
+		  const char *val, unsigned long vlen)
+{
+	QpFields *f = data;
+	const QpField *e = &f->exp[f->n];
+
+	if (f->n++ == f->cnt)
+		return -E2BIG;
+	if (nlen != strlen(e->name) || memcmp(name, e->name, nlen)
+	    || vlen != strlen(e->val) || memcmp(val, e->val, vlen))
+		return -EINVAL;
+
+	return 0;
+}
+
+TEST(qpack, static_table)
+{
+	static const QpField fields[] = {
+		{ ":status", "200" },
+		{ "content-type", "text/html" },
+		{ "x-custom", "v" },
+	};
+	static const unsigned char exp[] =
+		"\x00\x00"				/* prefix */
+		"\xD9"					/* :status 200 */
+		"\x5F\x1D\x09text/html"			/* content-type */
+		"\x27\x01x-custom\x01v";		/* x-custom: v */
+	static const unsigned char bad[][3] = {
+		{ 0x01, 0x00, 0xD9 },
+		{ 0x00, 0x00, 0x81 },
+		{ 0x00, 0x00, 0x10 },
+	};
+	unsigned char buf[64], *p = buf, *end = buf + sizeof(buf);
+	char dbuf[128];
+	QpFields f = { .exp = fields, .cnt = ARRAY_SIZE(fields) };
+	int i;
+
+	p = tfw_qpack_write_prefix(p, end);
+	EXPECT_NOT_NULL(p);
+	for (i = 0; i < ARRAY_SIZE(fields); ++i) {
+		p = tfw_qpack_write(p, end, fields[i].name,
+				    strlen(fields[i].name), fields[i].val,
+				    strlen(fields[i].val));
+		EXPECT_NOT_NULL(p);
+		if (!p)
+			return;
+	}
+	EXPECT_EQ(p - buf, sizeof(exp) - 1);
+	EXPECT_ZERO(memcmp(buf, exp, sizeof(exp) - 1));
+
+	EXPECT_OK(tfw_qpack_decode(buf, p - buf, dbuf, sizeof(dbuf),
+				   qpack_check_field, &f));
+	EXPECT_EQ(f.n, ARRAY_SIZE(fields));
+
+	/* No room for the field. */
+	EXPECT_NULL(tfw_qpack_write(buf, buf + 4, "x-custom", 8, "v", 1));
+
+	/* Non-zero Required Insert Count and dynamic table references. */
+	f.n = 0;
+	for (i = 0; i < ARRAY_SIZE(bad); ++i)
+		EXPECT_EQ(tfw_qpack_decode(bad[i], 3, dbuf, sizeof(dbuf),
+					   qpack_check_field, &f), -EINVAL);
+	EXPECT_EQ(f.n, 0);
+}
+
+TEST_SUITE(qpack)
+{
+	TEST_RUN(qpack, static_table);
+}
@@ -0,0 +1,236 @@
+/**
+ *		Tempesta FW
+ *
+ * Microbenchmarks of the string routines used on the HTTP processing path:
+ * SIMD matching and comparison of C strings, comparison and hashing of
+ * chunked TfwStr. Each function is measured over a range of string lengths,
+ * numbers of chunks and data alignments, the time of a call and throughput
+ * in bytes per CPU cycle are reported, so parser and SIMD changes can be
+ * evaluated against a baseline.
+ *
+ * The suite is run only if tfw_test is loaded with bench=1.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/string.h>
+#include <linux/timex.h>
+
+#include "hash.h"
+#include "str.h"
+#include "test.h"
+
+#define BENCH_LEN_MAX		4096
+#define BENCH_ALIGN_MAX		64
+#define BENCH_CHUNKS_MAX	8
+/* Bytes processed by each measurement, enough to hide the timer costs. */
+#define BENCH_BYTES		(16UL << 20)
+#define BENCH_ITERS_MIN		1000UL
+
+static const size_t bench_len[] = { 8, 16, 32, 64, 128, 256, 1024, 4096 };
+static const unsigned int bench_chunks[] = { 1, 2, 4, 8 };
+static const size_t bench_align[] = { 0, 1, 7 };
+
+static char b1[BENCH_LEN_MAX + BENCH_ALIGN_MAX] ____cacheline_aligned;
+static char b2[BENCH_LEN_MAX + BENCH_ALIGN_MAX] ____cacheline_aligned;
+static TfwStr c1[BENCH_CHUNKS_MAX], c2[BENCH_CHUNKS_MAX];
+static TfwStr bs1, bs2;
+static volatile unsigned long bench_sink;
+
+/**
+ * A benchmarked function. @s1 and @s2 are the same strings of @len bytes,
+ * they're plain if the function works with C strings.
+ */
+typedef struct {
+	const char	*name;
+	unsigned long	(*fn)(const TfwStr *s1, const TfwStr *s2, size_t len);
+	bool		chunked;
+} TfwBench;
+
+static unsigned long
+bench_match_uri(const TfwStr *s1, const TfwStr *s2, size_t len)
+{
+	return tfw_match_uri(s1->data, len);
+}
+
+static unsigned long
+bench_match_token(const TfwStr *s1, const TfwStr *s2, size_t len)
+{
+	return tfw_match_token(s1->data, len);
+}
+
+static unsigned long
+bench_match_ctext_vchar(const TfwStr *s1, const TfwStr *s2, size_t len)
+{
+	return tfw_match_ctext_vchar(s1->data, len);
+}
+
+static unsigned long
+bench_match_cookie(const TfwStr *s1, const TfwStr *s2, size_t len)
+{
+	return tfw_match_cookie(s1->data, len);
+}
+
+static unsigned long
+bench_cstricmp(const TfwStr *s1, const TfwStr *s2, size_t len)
+{
+	return tfw_cstricmp(s1->data, s2->data, len);
+}
+
+static unsigned long
+bench_cstricmp_2lc(const TfwStr *s1, const TfwStr *s2, size_t len)
+{
+	return tfw_cstricmp_2lc(s1->data, s2->data, len);
+}
+
+static unsigned long
+bench_strcmp(const TfwStr *s1, const TfwStr *s2, size_t len)
+{
+	return tfw_strcmp(s1, s2);
+}
+
+static unsigned long
+bench_stricmp(const TfwStr *s1, const TfwStr *s2, size_t len)
+{
+	return tfw_stricmp(s1, s2);
+}
+
+/* The stop character isn't in the data, so the whole strings are compared. */
+static unsigned long
+bench_strcmpspn(const TfwStr *s1, const TfwStr *s2, size_t len)
+{
+	return tfw_strcmpspn(s1, s2, '=');
+}
+
+static unsigned long
+bench_str_eq_cstr(const TfwStr *s1, const TfwStr *s2, size_t len)
+{
+	return tfw_str_eq_cstr(s1, b2, len, TFW_STR_EQ_DEFAULT);
+}
+
+static unsigned long
+bench_str_eq_cstr_casei(const TfwStr *s1, const TfwStr *s2, size_t len)
+{
+	return tfw_str_eq_cstr(s1, b2, len, TFW_STR_EQ_CASEI);
+}
+
+static unsigned long
+bench_hash_str_len(const TfwStr *s1, const TfwStr *s2, size_t len)
+{
+	return tfw_hash_str_len(s1, len);
+}
+
+static const TfwBench benches[] = {
+	{ "tfw_match_uri",		bench_match_uri,		false },
+	{ "tfw_match_token",		bench_match_token,		false },
+	{ "tfw_match_ctext_vchar",	bench_match_ctext_vchar,	false },
+	{ "tfw_match_cookie",		bench_match_cookie,		false },
+	{ "tfw_cstricmp",		bench_cstricmp,			false },
+	{ "tfw_cstricmp_2lc",		bench_cstricmp_2lc,		false },
+	{ "tfw_strcmp",			bench_strcmp,			true },
+	{ "tfw_stricmp",		bench_stricmp,			true },
+	{ "tfw_strcmpspn",		bench_strcmpspn,		true },
+	{ "tfw_str_eq_cstr",		bench_str_eq_cstr,		true },
+	{ "tfw_str_eq_cstr casei",	bench_str_eq_cstr_casei,	true },
+	{ "tfw_hash_str_len",		bench_hash_str_len,		true },
+};
+
+/* Make @s of @n chunks of @data with nearly equal lengths. */
+static void
+bench_str(TfwStr *s, TfwStr *chunks, char *data, size_t len, unsigned int n)
+{
+	unsigned int i;
+
+	TFW_STR_INIT(s);
+	s->len = len;
+	if (n == 1) {
+		s->data = data;
+		return;
+	}
+	s->chunks = chunks;
+	s->nchunks = n;
+	for (i = 0; i < n; ++i) {
+		TFW_STR_INIT(&chunks[i]);
+		chunks[i].data = data + len * i / n;
+		chunks[i].len = len * (i + 1) / n - len * i / n;
+	}
+}
+
+static void
+bench_run(const TfwBench *b, size_t len, unsigned int n, size_t align)
+{
+	unsigned long i, iters = max(BENCH_BYTES / len, BENCH_ITERS_MIN);
+	unsigned long sink = 0;
+	u64 ns, cyc;
+
+	/* Only the first string is misaligned, the second one is the same. */
+	memcpy(b2, b1 + align, len);
+	bench_str(&bs1, c1, b1 + align, len, n);
+	bench_str(&bs2, c2, b2, len, n);
+
+	for (i = 0; i < iters / 16; ++i)
+		sink += b->fn(&bs1, &bs2, len);
+
+	ns = ktime_get_ns();
+	cyc = get_cycles();
+	for (i = 0; i < iters; ++i)
+		sink += b->fn(&bs1, &bs2, len);
+	cyc = max_t(u64, get_cycles() - cyc, 1);
+	ns = ktime_get_ns() - ns;
+	bench_sink = sink;
+
+	ns = ns * 100 / iters;
+	cyc = (u64)len * iters * 100 / cyc;
+	TEST_LOG("  %-22s len %4zu chunks %u align %zu: %5llu.%02llu ns/op"
+		 " %3llu.%02llu B/cycle\n", b->name, len, n, align,
+		 ns / 100, ns % 100, cyc / 100, cyc % 100);
+}
+
+TEST(str_perf, all)
+{
+	static const char alpha[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+	int f, l, c, a;
+
+	/*
+	 * Lower case alphanumerics are accepted by all the alphabets and by
+	 * tfw_cstricmp_2lc(), so the functions process the whole strings.
+	 */
+	for (l = 0; l < sizeof(b1); ++l)
+		b1[l] = alpha[l % (sizeof(alpha) - 1)];
+
+	for (f = 0; f < ARRAY_SIZE(benches); ++f) {
+		const TfwBench *b = &benches[f];
+
+		for (l = 0; l < ARRAY_SIZE(bench_len); ++l)
+			for (c = 0; c < ARRAY_SIZE(bench_chunks); ++c) {
+				if (!b->chunked && bench_chunks[c] > 1)
+					break;
+				for (a = 0; a < ARRAY_SIZE(bench_align); ++a)
+					bench_run(b, bench_len[l],
+						  bench_chunks[c],
+						  bench_align[a]);
+			}
+		/* Don't hold the CPU for long with preemption disabled. */
+		__fpu_schedule();
+	}
+}
+
+TEST_SUITE(str_perf)
+{
+	TEST_RUN(str_perf, all);
+}
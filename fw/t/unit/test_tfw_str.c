@@ -187,6 +187,43 @@ TEST(cstr, simd_match_ctext_vchar)
 #undef __S
 }
 
+TEST(cstr, simd_match_qdtext)
+{
+#define N	300
+#define P	23
+
+	int i;
+	char buf[N] = {[0 ... N - 1] = 0x80 }; /* fill in with valid chars */
+
+	BUILD_BUG_ON(N < P + 257 || P < 1);
+
+	/* All the allowed characters are matched. */
+	for (i = 0; i <= 0xff; ++i)
+		if (i == 9 || (i >= 0x20 && i != '"' && i != '\\'
+			       && i != 0x7f))
+			buf[P + i] = i;
+	EXPECT_TRUE(tfw_match_qdtext(buf, N) == N);
+	EXPECT_TRUE(tfw_match_qdtext(buf + P - 1, 4) == 4);
+	EXPECT_TRUE(tfw_match_qdtext(buf + P - 1, 15) == 15);
+	EXPECT_TRUE(tfw_match_qdtext(buf + P - 1, 29) == 29);
+
+	/* Check not allowed characters. */
+	buf[P + 0x7f] = 0x7f;
+	EXPECT_TRUE(tfw_match_qdtext(buf, N) == P + 0x7f);
+	buf[P + '\\'] = '\\';
+	EXPECT_TRUE(tfw_match_qdtext(buf, N) == P + '\\');
+	buf[P + '"'] = '"';
+	EXPECT_TRUE(tfw_match_qdtext(buf, N) == P + '"');
+	buf[P + 0x1f] = 0x1f;
+	EXPECT_TRUE(tfw_match_qdtext(buf, N) == P + 0x1f);
+	buf[P + 0xa] = 0xa;
+	EXPECT_TRUE(tfw_match_qdtext(buf, N) == P + 0xa);
+	buf[P + 0] = 0;
+	EXPECT_TRUE(tfw_match_qdtext(buf, N) == P);
+#undef P
+#undef N
+}
+
 static void
 __init_custom_a(unsigned char a[256])
 {
@@ -390,6 +427,9 @@ TEST(cstr, simd_stricmp)
 		      "0123456789_0123456789_0123456789_zxfghert");
 	__test_strcmp("0123456789_0123456789_0123456789_zXfGhERT",
 		      "0123456789_0123456789_0123456789t_zxfghert");
+	/* Mismatch beyond first 8 bytes of a tail after 32 byte block. */
+	__test_strcmp("0123456789_0123456789_0123456789_zXfGhERT_1",
+		      "0123456789_0123456789_0123456789_zxfghert_2");
 	__test_strcmp("MOZILLA!5.0_(windows_nt_6.1!_wow64)_applewebkit!535.11_"
 		      "(khtml._like_gecko)_chrome!17.0.963.56_safari!535.11",
 		      "mozilla!5.0_(windows_nt_6.1!_wow64)_applewebkit!535.11_"
@@ -772,6 +812,29 @@ TEST(tfw_strdup, compound)
 		EXPECT_EQ(tfw_strcmp(c, c_copy), 0);
 }
 
+TEST(tfw_str_linearize, compound)
+{
+	TFW_STR2(s, "abcdef", "ghijklmnop");
+	DEFINE_TFW_STR(expect, "abcdefghijklmnop");
+
+	tfw_str_linearize(str_pool, s, 256);
+
+	EXPECT_TRUE(TFW_STR_PLAIN(s));
+	EXPECT_TRUE(s->flags & TFW_STR_COPY);
+	EXPECT_EQ(s->len, expect.len);
+	EXPECT_EQ(tfw_strcmp(s, &expect), 0);
+}
+
+TEST(tfw_str_linearize, too_long)
+{
+	TFW_STR2(s, "abcdef", "ghijklmnop");
+
+	tfw_str_linearize(str_pool, s, 8);
+
+	EXPECT_EQ(s->nchunks, 2);
+	EXPECT_FALSE(s->flags & TFW_STR_COPY);
+}
+
 /* Case-insensitive comparison. */
 TEST(tfw_stricmp, returns_true_only_for_equal_tfw_strs)
 {
@@ -1686,6 +1749,7 @@ TEST_SUITE(tfw_str)
 	TEST_RUN(cstr, tolower);
 	TEST_RUN(cstr, simd_match);
 	TEST_RUN(cstr, simd_match_ctext_vchar);
+	TEST_RUN(cstr, simd_match_qdtext);
 	TEST_RUN(cstr, simd_match_custom);
 	TEST_RUN(cstr, simd_strtolower);
 	TEST_RUN(cstr, simd_stricmp);
@@ -1709,6 +1773,8 @@ TEST_SUITE(tfw_str)
 
 	TEST_RUN(tfw_strdup, plain);
 	TEST_RUN(tfw_strdup, compound);
+	TEST_RUN(tfw_str_linearize, compound);
+	TEST_RUN(tfw_str_linearize, too_long);
 
 	TEST_RUN(tfw_str_insert, plain_prepend);
 	TEST_RUN(tfw_str_insert, plain_append);
@@ -32,6 +32,7 @@
 #define QSZ	2048		/* From work_queue.c */
 #define N	QSZ * 100
 #define JOB_N	10		/* Jobs per core. */
+#define BULK_N	8		/* Items per bulk push and pop, divides N. */
 
 static const int X_EMPTY = 0;		/* The address skipped by producers. */
 static const int X_MISSED = 255;	/* The address skipped by consumers. */
@@ -65,6 +66,8 @@ typedef struct {
 
 static atomic_t active_prods;
 static atomic_t active_cons;
+/* Push and pop the items in bulks. */
+static bool bulk;
 
 static void
 tfw_test_wq_suite_setup(void)
@@ -92,7 +95,21 @@ tfw_test_wq_work_prod(void *data)
 
 	TFW_WQ_CHECKSZ(TfwTestWork);
 
-	while (work < N){
+	while (bulk && work < N) {
+		TfwTestWork wq_items[BULK_N];
+		int i;
+
+		for (i = 0; i < BULK_N; ++i) {
+			wq_items[i].work = &prod_data->ptr[work + i];
+			prod_data->ptr[work + i] = X_MISSED;
+		}
+		while (__tfw_wq_push_bulk(wq, wq_items, BULK_N))
+			schedule();
+		work += BULK_N;
+
+		schedule();
+	}
+	while (work < N) {
 		TfwTestWork wq_item = { &prod_data->ptr[work] };
 
 		prod_data->ptr[work] = X_MISSED;
@@ -110,6 +127,17 @@ tfw_test_wq_work_prod(void *data)
 static int
 tfw_test_wq_work_cons(void *data)
 {
+	while (bulk && (atomic_read(&active_prods) || tfw_wq_size(wq))) {
+		TfwTestWork wq_items[BULK_N];
+		int i, n;
+
+		schedule();
+		n = tfw_wq_pop_bulk(wq, wq_items, BULK_N);
+		for (i = 0; i < n; ++i) {
+			EXPECT_EQ(*wq_items[i].work, X_MISSED);
+			*wq_items[i].work = X_DONE;
+		}
+	}
 	while (atomic_read(&active_prods) || tfw_wq_size(wq)) {
 		TfwTestWork wq_item;
 
@@ -300,6 +328,13 @@ TEST(wq, many_prod_one_con)
 	tfw_test_wq_test(JOB_N * num_online_cpus(), 1);
 }
 
+TEST(wq, many_prod_one_con_bulk)
+{
+	bulk = true;
+	tfw_test_wq_test(JOB_N * num_online_cpus(), 1);
+	bulk = false;
+}
+
 TEST_SUITE(wq)
 {
 	TEST_SETUP(tfw_test_wq_suite_setup);
@@ -308,4 +343,5 @@ TEST_SUITE(wq)
 	/* The queue is MPSC queue, multiple consumers are not allowed. */
 	TEST_RUN(wq, one_prod_one_con);
 	TEST_RUN(wq, many_prod_one_con);
+	TEST_RUN(wq, many_prod_one_con_bulk);
 }
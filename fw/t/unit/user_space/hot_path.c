@@ -0,0 +1,1431 @@
+/**
+ *		Tempesta FW
+ *
+ * User-space build of the HTTP messages processing hot path for profiling
+ * with perf, valgrind and other tools unavailable or inconvenient for
+ * a kernel module.
+ *
+ * The real parsers, HPACK decoder, strings and pools are compiled against
+ * the ktest kernel shims and replay messages from a file as they come from
+ * the network: the data is cut into chunks of a TCP segment size and
+ * pipelined messages are parsed from the same chunk. The cache key
+ * calculation lives in http.c, which is too tied to the kernel to be compiled
+ * here, so it isn't profiled.
+ *
+ * The cost guided fuzzing mode looks for the inputs which are the most
+ * expensive to process, see hpf_fuzz() below. The string routines
+ * microbenchmarks of the kernel unit tests can also be run here.
+ *
+ * Usage:
+ *	hot_path [-r | -2] [-c <chunk>] [-n <iterations>] <file>
+ *	hot_path -F [-r | -2] [-n <inputs>] [-s <seed>] [-o <dir>] [<file>]
+ *	hot_path -S
+ *
+ *	-r	- the file contains HTTP/1.x responses instead of requests;
+ *	-2	- the file contains HTTP/2 frames sent by a client, optionally
+ *		  starting with the connection preface. HEADERS, CONTINUATION
+ *		  and DATA frames of one stream must not interleave with frames
+ *		  of other streams;
+ *	-c	- chunk size, 1448 bytes by default;
+ *	-n	- number of times to replay the file, 1 by default, or
+ *		  number of the inputs to try for fuzzing, 10000 by default;
+ *	-F	- cost guided fuzzing, the optional file is an additional seed;
+ *	-s	- random seed for fuzzing;
+ *	-o	- directory to write the most expensive inputs to, the files
+ *		  can be replayed in the first mode;
+ *	-S	- run the string routines microbenchmarks of test_str_perf.c.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The string routines are taken by address, so define real functions instead
+ * of the ktest macros.
+ */
+#define BANNER		"fw"
+#define memcpy_fast	memcpy_fast
+#include "ktest.h"
+
+/*
+ * Peer input reaches some warnings in the parsers, so report them once and
+ * go on like the kernel does instead of aborting like the unit tests.
+ */
+#undef WARN_ON_ONCE
+#define WARN_ON_ONCE(condition) ({					\
+	static bool __warned;						\
+	int __ret_warn_on = !!(condition);				\
+	if (unlikely(__ret_warn_on && !__warned)) {			\
+		__warned = true;					\
+		fprintf(stderr, "Warning at %s:%d\n", __FILE__, __LINE__);\
+	}								\
+	__ret_warn_on;							\
+})
+
+/* Blocked messages are expected on fuzzing, so the warnings can be muted. */
+static bool hp_quiet;
+
+#undef net_warn_ratelimited
+#define net_warn_ratelimited(fmt, ...)					\
+do {									\
+	if (!hp_quiet)							\
+		fprintf(stderr, fmt, ##__VA_ARGS__);			\
+} while (0)
+
+static inline void
+memcpy_fast(void *dst, const void *src, size_t n)
+{
+	memcpy(dst, src, n);
+}
+
+static inline int
+memcmp_fast(const void *a, const void *b, size_t n)
+{
+	return memcmp(a, b, n);
+}
+
+static inline void
+bzero_fast(void *p, size_t n)
+{
+	memset(p, 0, n);
+}
+
+#include "hash.h"
+#include "lib/hash.c"
+#include "pool.c"
+#include "str.c"
+#include "msg.c"
+#include "hash.c"
+#include "http_msg.c"
+#include "http_parser.c"
+#include "hpack.c"
+#include "http_match.c"
+#include "regex.c"
+#include "t/unit/test_str_perf.c"
+#include "t/fuzzer.h"
+
+/*
+ * Mocks of the symbols used by the message modification, configuration
+ * parsing and statistics code, which isn't reached on the parsing path.
+ */
+DEFINE_PER_CPU_ALIGNED(TfwPerfStat, tfw_perfstat);
+DEFINE_PER_CPU_ALIGNED(TfwLatStat, tfw_lat_stat);
+DEFINE_PER_CPU_ALIGNED(TfwNumaStat, tfw_numa_stat);
+DEFINE_STATIC_KEY_FALSE(tfw_lat_enabled);
+int tfw_mem_level;
+
+int
+ss_skb_alloc_data(struct sk_buff **skb_head, size_t len,
+		  unsigned int tx_flags)
+{
+	return -ENOMEM;
+}
+
+struct page *
+ss_skb_alloc_page(void)
+{
+	return NULL;
+}
+
+int
+ss_skb_cutoff_data(struct sk_buff *skb_head, const TfwStr *hdr, int skip,
+		   int tail)
+{
+	return -ENOMEM;
+}
+
+int
+ss_skb_get_room(struct sk_buff *skb_head, struct sk_buff *skb, char *pspt,
+		unsigned int len, TfwStr *it)
+{
+	return -ENOMEM;
+}
+
+int
+ss_skb_get_room_w_frag(struct sk_buff *skb_head, struct sk_buff *skb,
+		       char *pspt, unsigned int len, TfwStr *it, int *fragn)
+{
+	return -ENOMEM;
+}
+
+int
+tfw_h2_hdr_map(TfwHttpResp *resp, const TfwStr *hdr, unsigned int id)
+{
+	BUG();
+	return 0;
+}
+
+unsigned long
+tfw_http_hdr_split(TfwStr *hdr, TfwStr *name_out, TfwStr *val_out,
+		   bool inplace)
+{
+	BUG();
+	return 0;
+}
+
+void
+tfw_http_req_destruct(void *msg)
+{
+}
+
+int
+tfw_cfg_parse_uint(const char *s, unsigned int *out_uint)
+{
+	return -EINVAL;
+}
+
+int
+tfw_http_tbl_method(const char *arg, tfw_http_meth_t *method)
+{
+	return -EINVAL;
+}
+
+const TfwStr *
+tfw_http_sess_mark_name(void)
+{
+	return NULL;
+}
+
+unsigned int
+tfw_http_sess_mark_size(void)
+{
+	return 0;
+}
+
+bool
+tfw_http_sess_max_misses(void)
+{
+	return false;
+}
+
+/* The test suite functions are referenced by the included str_perf suite. */
+void
+test_call_setup_fn(void)
+{
+}
+
+void
+test_call_teardown_fn(void)
+{
+}
+
+#define HP_CHUNK_DEF	1448
+#define HP_H2_PREFACE	"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HP_FRAME_HDR	9
+
+static const char hp_sample_req[] = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+typedef struct {
+	unsigned long	msgs;
+	unsigned long	blocked;
+	unsigned long	bytes;
+} HpStat;
+
+static size_t hp_chunk = HP_CHUNK_DEF;
+static TfwH2Conn hp_conn;
+static TfwHttpReq *hp_req;
+
+static TfwHttpMsg *
+hp_msg_alloc(int type)
+{
+	TfwHttpMsg *hm = __tfw_http_msg_alloc(type, true);
+
+	BUG_ON(!hm);
+	hm->conn = (TfwConn *)&hp_conn;
+	hm->stream = &((TfwConn *)&hp_conn)->stream;
+
+	if (type & Conn_Clnt) {
+		tfw_http_init_parser_req((TfwHttpReq *)hm);
+	} else {
+		tfw_http_init_parser_resp((TfwHttpResp *)hm);
+		tfw_http_msg_pair((TfwHttpResp *)hm, hp_req);
+	}
+
+	return hm;
+}
+
+/*
+ * Copy @n bytes at @p to a new skb of message @hm like the network stack does,
+ * the parsers refer to the skbs from the parsed strings.
+ */
+static unsigned char *
+hp_skb_queue(TfwHttpMsg *hm, unsigned char *p, size_t n)
+{
+	struct sk_buff *skb = alloc_skb(n, GFP_ATOMIC);
+
+	BUG_ON(!skb);
+	memcpy_fast(skb_put(skb, n), p, n);
+	ss_skb_queue_tail(&hm->msg.skb_head, skb);
+
+	return skb->data;
+}
+
+static void
+hp_msg_done(TfwHttpMsg *hm, HpStat *st)
+{
+	st->msgs++;
+	st->bytes += hm->msg.len;
+	tfw_http_msg_free(hm);
+}
+
+/**
+ * Replay HTTP/1.x messages from @buf of @len bytes.
+ */
+static int
+hp_replay_h1(unsigned char *buf, size_t len, int type, HpStat *st)
+{
+	int r;
+	size_t off, n, rem;
+	unsigned int parsed;
+	unsigned char *p, *data;
+	TfwHttpMsg *hm = hp_msg_alloc(type);
+
+	for (off = 0; off < len; off += n) {
+		n = min(hp_chunk, len - off);
+		/*
+		 * The rest of the chunk after a pipelined message is moved to
+		 * a new skb of the next message as ss_skb_split() does.
+		 */
+		for (p = buf + off; p < buf + off + n; p += parsed) {
+			rem = buf + off + n - p;
+			data = hp_skb_queue(hm, p, rem);
+			parsed = 0;
+			r = (type & Conn_Clnt)
+			    ? tfw_http_parse_req(hm, data, rem, &parsed)
+			    : tfw_http_parse_resp(hm, data, rem, &parsed);
+			hm->msg.len += parsed;
+			if (r == TFW_POSTPONE)
+				break;
+			if (r != TFW_PASS) {
+				fprintf(stderr, "message %lu at offset %lu is"
+					" blocked\n", st->msgs + st->blocked,
+					(unsigned long)(p - buf));
+				st->blocked++;
+				tfw_http_msg_free(hm);
+				return -EINVAL;
+			}
+			hp_msg_done(hm, st);
+			hm = hp_msg_alloc(type);
+		}
+	}
+	tfw_http_msg_free(hm);
+
+	return 0;
+}
+
+static TfwHttpReq *
+hp_h2_req_alloc(TfwStream *stream)
+{
+	TfwHttpReq *req;
+
+	bzero_fast(stream, sizeof(*stream));
+	req = (TfwHttpReq *)__tfw_http_msg_alloc(Conn_HttpsClnt, true);
+	BUG_ON(!req);
+	req->conn = (TfwConn *)&hp_conn;
+	req->stream = stream;
+	tfw_http_init_parser_req(req);
+
+	req->pit.pool = __tfw_pool_new_cls(0, TFW_POOL_H2);
+	BUG_ON(!req->pit.pool);
+	req->pit.parsed_hdr = &req->stream->parser.hdr;
+	__set_bit(TFW_HTTP_B_H2, req->flags);
+	req->version = TFW_HTTP_VER_20;
+
+	return req;
+}
+
+/**
+ * Feed the frame payload to the HTTP/2 request parser by chunks.
+ */
+static int
+hp_h2_parse(TfwHttpReq *req, unsigned char *p, size_t len)
+{
+	int r = TFW_POSTPONE;
+	size_t n;
+	unsigned int parsed;
+
+	for ( ; len; p += n, len -= n) {
+		n = min(hp_chunk, len);
+		parsed = 0;
+		r = tfw_h2_parse_req(req, hp_skb_queue((TfwHttpMsg *)req, p, n),
+				     n, &parsed);
+		req->msg.len += parsed;
+		if (r != TFW_POSTPONE)
+			return r;
+	}
+
+	return r;
+}
+
+/**
+ * Replay HTTP/2 frames from @buf of @len bytes. The HPACK decoder state is
+ * kept for the whole file as for one connection.
+ */
+static int
+hp_replay_h2(unsigned char *buf, size_t len, HpStat *st)
+{
+	int r = 0;
+	TfwStream stream;
+	TfwHttpReq *req = NULL;
+	TfwH2Ctx *ctx = tfw_h2_context(&hp_conn);
+	TfwFrameHdr *hdr = &ctx->hdr;
+	unsigned char *p = buf, *end = buf + len, *pl;
+	size_t pl_len;
+	bool es = false;
+
+	bzero_fast(&ctx->hpack, sizeof(ctx->hpack));
+	if (tfw_hpack_init(&ctx->hpack, HPACK_TABLE_DEF_SIZE))
+		return -ENOMEM;
+
+	if (len >= SLEN(HP_H2_PREFACE)
+	    && !memcmp(buf, HP_H2_PREFACE, SLEN(HP_H2_PREFACE)))
+		p += SLEN(HP_H2_PREFACE);
+
+	for ( ; p + HP_FRAME_HDR <= end; p += HP_FRAME_HDR + hdr->length) {
+		hdr->length = (p[0] << 16) | (p[1] << 8) | p[2];
+		hdr->type = p[3];
+		hdr->flags = p[4];
+		hdr->stream_id = ntohl(*(unsigned int *)&p[5]) & 0x7fffffff;
+		if (p + HP_FRAME_HDR + hdr->length > end) {
+			fprintf(stderr, "truncated frame at offset %lu\n",
+				(unsigned long)(p - buf));
+			r = -EINVAL;
+			break;
+		}
+
+		pl = p + HP_FRAME_HDR;
+		pl_len = hdr->length;
+		switch (hdr->type) {
+		case HTTP2_HEADERS:
+			if (req)
+				goto err_seq;
+			if (hdr->flags & HTTP2_F_PADDED) {
+				if (!pl_len || pl[0] >= pl_len)
+					goto err_frame;
+				pl_len -= pl[0] + 1;
+				pl++;
+			}
+			if (hdr->flags & HTTP2_F_PRIORITY) {
+				if (pl_len < 5)
+					goto err_frame;
+				pl += 5;
+				pl_len -= 5;
+			}
+			req = hp_h2_req_alloc(&stream);
+			stream.id = hdr->stream_id;
+			es = hdr->flags & HTTP2_F_END_STREAM;
+			break;
+		case HTTP2_CONTINUATION:
+			if (!req || stream.id != hdr->stream_id)
+				goto err_seq;
+			break;
+		case HTTP2_DATA:
+			if (!req || stream.id != hdr->stream_id)
+				goto err_seq;
+			if (hdr->flags & HTTP2_F_PADDED) {
+				if (!pl_len || pl[0] >= pl_len)
+					goto err_frame;
+				pl_len -= pl[0] + 1;
+				pl++;
+			}
+			es = hdr->flags & HTTP2_F_END_STREAM;
+			break;
+		default:
+			continue;
+		}
+
+		if (pl_len && hp_h2_parse(req, pl, pl_len) != TFW_POSTPONE)
+			goto err_block;
+		/* END_STREAM of HEADERS takes effect after END_HEADERS. */
+		if (!es || (hdr->type != HTTP2_DATA
+			    && !(hdr->flags & HTTP2_F_END_HEADERS)))
+			continue;
+
+		stream.state = HTTP2_STREAM_REM_HALF_CLOSED;
+		if (tfw_h2_parse_req_finish(req))
+			goto err_block;
+		hp_msg_done((TfwHttpMsg *)req, st);
+		req = NULL;
+	}
+	goto out;
+
+err_frame:
+	fprintf(stderr, "bad frame at offset %lu\n", (unsigned long)(p - buf));
+	r = -EINVAL;
+	goto out;
+err_seq:
+	fprintf(stderr, "interleaved or unexpected frame of stream %u at"
+		" offset %lu\n", hdr->stream_id, (unsigned long)(p - buf));
+	r = -EINVAL;
+	goto out;
+err_block:
+	fprintf(stderr, "request of stream %u is blocked\n", stream.id);
+	st->blocked++;
+	r = -EINVAL;
+out:
+	if (req)
+		tfw_http_msg_free((TfwHttpMsg *)req);
+	tfw_hpack_clean(&ctx->hpack);
+
+	return r;
+}
+
+static unsigned char *
+hp_read_file(const char *name, size_t *len)
+{
+	FILE *f;
+	long sz;
+	unsigned char *buf = NULL;
+
+	if (!(f = fopen(name, "r"))) {
+		perror(name);
+		return NULL;
+	}
+	if (fseek(f, 0, SEEK_END) || (sz = ftell(f)) <= 0
+	    || fseek(f, 0, SEEK_SET))
+	{
+		fprintf(stderr, "%s: cannot get the file size\n", name);
+		goto out;
+	}
+	if (!(buf = malloc(sz)))
+		goto out;
+	if (fread(buf, 1, sz, f) != sz) {
+		fprintf(stderr, "%s: cannot read the file\n", name);
+		free(buf);
+		buf = NULL;
+		goto out;
+	}
+	*len = sz;
+out:
+	fclose(f);
+
+	return buf;
+}
+
+/*
+ * ------------------------------------------------------------------------
+ *	Cost guided fuzzing
+ * ------------------------------------------------------------------------
+ *
+ * Look for inputs on which the parsers, the HPACK decoder and the HTTP
+ * tables matching spend the most CPU cycles per input byte, i.e. the inputs
+ * which an attacker could use to make us do disproportionate work. The seeds
+ * are produced by the HTTP fuzzer from fw/t/fuzzer.c, the mutations are
+ * targeted at the known sources of superlinear work: small chunks, duplicate
+ * headers, many tokens in a header value, long Huffman codes and HPACK
+ * indexed references to large dynamic table entries. The inputs costing more
+ * than their parents stay in the corpus for further mutations.
+ *
+ * Fixed per message costs dominate in short inputs, so the cost is calculated
+ * per HPF_MIN_LEN bytes at least. The number of chunks of a message is
+ * limited by HPF_MAX_CHUNKS like Frang http_header_chunk_cnt and
+ * http_body_chunk_cnt limit it in production: the per chunk descriptors of
+ * the header values make memory usage quadratic in the number of chunks.
+ */
+#define HPF_MAX_LEN	(64 * 1024)
+#define HPF_MAX_CHUNKS	1024
+#define HPF_MIN_LEN	512
+#define HPF_SEEDS	64
+#define HPF_CORPUS	512
+#define HPF_WORST	16
+#define HPF_RUNS	3
+#define HPF_REPORT	1000
+
+/**
+ * Fuzzing input.
+ *
+ * @data	- the message or the HPACK header block for HTTP/2;
+ * @len	- length of @data;
+ * @chunk	- size of the chunks to feed the parser with;
+ * @cost	- cycles per input byte multiplied by 100;
+ * @res	- the parser verdict: TFW_PASS, TFW_BLOCK or TFW_POSTPONE for
+ *		  an incomplete message;
+ */
+typedef struct {
+	unsigned char	*data;
+	size_t		len;
+	size_t		chunk;
+	unsigned long	cost;
+	int		res;
+} HpfInput;
+
+static HpfInput hpf_corpus[HPF_CORPUS];
+static HpfInput hpf_worst[HPF_WORST];
+static unsigned int hpf_corpus_n, hpf_seeds_n;
+static unsigned long hpf_rnd;
+static TfwHttpTable *hpf_table;
+static TfwHttpChain *hpf_chain;
+
+/*
+ * The rules are evaluated in the order of the list, so the catch-all rule is
+ * the last one and all the other rules are evaluated for each request.
+ */
+static const struct {
+	tfw_http_match_fld_t	field;
+	const char		*hdr;
+	const char		*arg;
+	bool			regex;
+} hpf_rules[] = {
+	{ TFW_HTTP_MATCH_F_URI,		NULL,		"/static/*" },
+	{ TFW_HTTP_MATCH_F_URI,		NULL,		"*.php" },
+	{ TFW_HTTP_MATCH_F_URI,		NULL,		"/login" },
+	{ TFW_HTTP_MATCH_F_URI,		NULL,
+	  "^/api/v[0-9]+/(users|orders)/[0-9]+$", true },
+	{ TFW_HTTP_MATCH_F_HOST,	NULL,		"www.example.com" },
+	{ TFW_HTTP_MATCH_F_HOST,	NULL,	".*\\.example\\.(com|org)$",
+	  true },
+	{ TFW_HTTP_MATCH_F_HDR,		"referer",	"*example.com" },
+	{ TFW_HTTP_MATCH_F_HDR,		"user-agent",	"*bot*" },
+	{ TFW_HTTP_MATCH_F_HDR,		"x-custom",	"abc*" },
+	{ TFW_HTTP_MATCH_F_WILDCARD,	NULL,		NULL },
+};
+
+/* Separators and the other special characters for the parsers. */
+static const char *hpf_tokens[] = {
+	" ", "\t", ",", ";", "=", "\"", "%", "/", "\\", ":", "*", "?", "&",
+	"#", "..", "%00", "%2e", "\r\n", "\r\n ", "a", "0", "\xff", "\x7f",
+	", a", "; a=b", "q=0.5", "gzip, ", "/..",
+};
+
+static const size_t hpf_chunks[] = { 1, 2, 3, 7, 16, 1448 };
+
+static unsigned long
+hpf_rand(void)
+{
+	hpf_rnd ^= hpf_rnd >> 12;
+	hpf_rnd ^= hpf_rnd << 25;
+	hpf_rnd ^= hpf_rnd >> 27;
+
+	return hpf_rnd * 0x2545F4914F6CDD1DUL;
+}
+
+#define hpf_rand_n(n)	(hpf_rand() % (n))
+
+static void
+hpf_rules_init(void)
+{
+	int i;
+	size_t arg_size;
+	const char *arg, *hdr;
+	unsigned int hid;
+	tfw_http_match_arg_t type;
+	tfw_http_match_op_t op;
+	TfwHttpMatchRule *rule;
+
+	hpf_table = tfw_pool_new(TfwHttpTable, TFW_POOL_ZERO);
+	BUG_ON(!hpf_table);
+	INIT_LIST_HEAD(&hpf_table->head);
+	hpf_chain = tfw_http_chain_add(NULL, hpf_table);
+	BUG_ON(!hpf_chain);
+
+	for (i = 0; i < ARRAY_SIZE(hpf_rules); ++i) {
+		hdr = hpf_rules[i].hdr;
+		hid = TFW_HTTP_HDR_RAW;
+		arg = NULL;
+		arg_size = 0;
+		type = TFW_HTTP_MATCH_A_WILDCARD;
+		op = TFW_HTTP_MATCH_O_WILDCARD;
+
+		BUG_ON(tfw_http_verify_hdr_field(hpf_rules[i].field, &hdr,
+						 &hid));
+		if (hpf_rules[i].regex)
+			arg = tfw_http_arg_regex(hpf_rules[i].arg,
+						 hpf_rules[i].field, hid,
+						 &arg_size, &type, &op);
+		else if (hpf_rules[i].arg)
+			arg = tfw_http_arg_adjust(hpf_rules[i].arg,
+						  hpf_rules[i].field, hdr,
+						  &arg_size, &type, &op);
+		BUG_ON(IS_ERR(arg));
+
+		rule = tfw_http_rule_new(hpf_chain, type, arg_size);
+		BUG_ON(!rule);
+		rule->hid = hid;
+		rule->field = hpf_rules[i].field;
+		rule->op = op;
+		rule->arg.type = type;
+		rule->act.type = TFW_HTTP_MATCH_ACT_CHAIN;
+		BUG_ON(tfw_http_rule_arg_init(rule, arg, arg_size - 1));
+		kfree(arg);
+		if (op == TFW_HTTP_MATCH_O_REGEX) {
+			rule->re = tfw_regex_compile(rule->arg.str,
+						     rule->arg.len,
+						     hpf_chain->pool);
+			BUG_ON(IS_ERR(rule->re));
+		}
+	}
+
+	BUG_ON(tfw_http_chain_compile(hpf_chain));
+}
+
+/*
+ * Parsed requests go through the HTTP tables as on the data path.
+ */
+static unsigned long
+hpf_req_process(TfwHttpReq *req)
+{
+	unsigned long t = get_cycles();
+
+	tfw_http_match_chain(req, hpf_chain);
+
+	return get_cycles() - t;
+}
+
+static unsigned long
+hpf_run_h1(const HpfInput *in, int type, int *res)
+{
+	int r = TFW_POSTPONE;
+	size_t off, n;
+	unsigned int parsed;
+	unsigned long t, cycles = 0;
+	unsigned char *data;
+	TfwHttpMsg *hm = hp_msg_alloc(type);
+
+	for (off = 0; off < in->len && r == TFW_POSTPONE; off += n) {
+		n = min(in->chunk, in->len - off);
+		data = hp_skb_queue(hm, in->data + off, n);
+		parsed = 0;
+		t = get_cycles();
+		r = (type & Conn_Clnt)
+		    ? tfw_http_parse_req(hm, data, n, &parsed)
+		    : tfw_http_parse_resp(hm, data, n, &parsed);
+		cycles += get_cycles() - t;
+		hm->msg.len += parsed;
+	}
+	*res = r;
+	if (r == TFW_PASS && (type & Conn_Clnt))
+		cycles += hpf_req_process((TfwHttpReq *)hm);
+	tfw_http_msg_free(hm);
+
+	return cycles;
+}
+
+static unsigned long
+hpf_run_h2(const HpfInput *in, int *res)
+{
+	int r = TFW_POSTPONE;
+	size_t off, n;
+	unsigned int parsed;
+	unsigned long t, cycles = 0;
+	unsigned char *data;
+	TfwStream stream;
+	TfwH2Ctx *ctx = tfw_h2_context(&hp_conn);
+	TfwHttpReq *req;
+
+	bzero_fast(&ctx->hpack, sizeof(ctx->hpack));
+	BUG_ON(tfw_hpack_init(&ctx->hpack, HPACK_TABLE_DEF_SIZE));
+	ctx->hdr.type = HTTP2_HEADERS;
+	ctx->hdr.flags = HTTP2_F_END_HEADERS | HTTP2_F_END_STREAM;
+	req = hp_h2_req_alloc(&stream);
+
+	for (off = 0; off < in->len && r == TFW_POSTPONE; off += n) {
+		n = min(in->chunk, in->len - off);
+		data = hp_skb_queue((TfwHttpMsg *)req, in->data + off, n);
+		parsed = 0;
+		t = get_cycles();
+		r = tfw_h2_parse_req(req, data, n, &parsed);
+		cycles += get_cycles() - t;
+		req->msg.len += parsed;
+	}
+	if (r == TFW_POSTPONE) {
+		stream.state = HTTP2_STREAM_REM_HALF_CLOSED;
+		t = get_cycles();
+		r = tfw_h2_parse_req_finish(req) ? TFW_BLOCK : TFW_PASS;
+		cycles += get_cycles() - t;
+	}
+	*res = r;
+	if (r == TFW_PASS)
+		cycles += hpf_req_process(req);
+
+	tfw_http_msg_free((TfwHttpMsg *)req);
+	tfw_hpack_clean(&ctx->hpack);
+
+	return cycles;
+}
+
+/**
+ * Evaluate the cost of @in as the best of several runs to filter out noise.
+ */
+static void
+hpf_eval(HpfInput *in, int proto, int type)
+{
+	int i;
+	unsigned long c, cycles = ULONG_MAX;
+
+	in->chunk = max_t(size_t, in->chunk,
+			  DIV_ROUND_UP(in->len, HPF_MAX_CHUNKS));
+	for (i = 0; i < HPF_RUNS; ++i) {
+		c = proto == 2 ? hpf_run_h2(in, &in->res)
+			       : hpf_run_h1(in, type, &in->res);
+		cycles = min(cycles, c);
+	}
+	in->cost = cycles * 100 / max_t(size_t, in->len, HPF_MIN_LEN);
+}
+
+static void
+hpf_input_copy(HpfInput *dst, const HpfInput *src)
+{
+	unsigned char *data = dst->data;
+
+	*dst = *src;
+	dst->data = data;
+	memcpy_fast(dst->data, src->data, src->len);
+}
+
+static HpfInput *
+hpf_corpus_add(const HpfInput *in)
+{
+	HpfInput *c;
+
+	if (hpf_corpus_n < HPF_CORPUS)
+		c = &hpf_corpus[hpf_corpus_n++];
+	else
+		c = &hpf_corpus[hpf_seeds_n
+				+ hpf_rand_n(HPF_CORPUS - hpf_seeds_n)];
+	hpf_input_copy(c, in);
+
+	return c;
+}
+
+/**
+ * Keep the HPF_WORST most expensive inputs sorted by the cost.
+ */
+static void
+hpf_worst_add(const HpfInput *in)
+{
+	int i;
+	HpfInput last = hpf_worst[HPF_WORST - 1];
+
+	if (in->cost <= last.cost)
+		return;
+	for (i = 0; i < HPF_WORST; ++i)
+		if (hpf_worst[i].len == in->len
+		    && hpf_worst[i].chunk == in->chunk
+		    && !memcmp(hpf_worst[i].data, in->data, in->len))
+			return;
+	for (i = HPF_WORST - 1; i && hpf_worst[i - 1].cost < in->cost; --i)
+		hpf_worst[i] = hpf_worst[i - 1];
+	hpf_worst[i] = last;
+	hpf_input_copy(&hpf_worst[i], in);
+}
+
+/*
+ * Mutations, each of them returns false if it can't be applied to the input.
+ */
+static bool
+hpf_insert(HpfInput *in, size_t pos, const void *data, size_t n)
+{
+	if (in->len + n > HPF_MAX_LEN)
+		return false;
+	memmove(in->data + pos + n, in->data + pos, in->len - pos);
+	memcpy_fast(in->data + pos, data, n);
+	in->len += n;
+
+	return true;
+}
+
+static bool
+hpf_mut_byte(HpfInput *in)
+{
+	if (!in->len)
+		return false;
+	in->data[hpf_rand_n(in->len)] = hpf_rand();
+
+	return true;
+}
+
+static bool
+hpf_mut_token(HpfInput *in)
+{
+	const char *t = hpf_tokens[hpf_rand_n(ARRAY_SIZE(hpf_tokens))];
+
+	return hpf_insert(in, hpf_rand_n(in->len + 1), t, strlen(t));
+}
+
+static bool
+hpf_mut_delete(HpfInput *in)
+{
+	size_t pos, n;
+
+	if (!in->len)
+		return false;
+	pos = hpf_rand_n(in->len);
+	n = 1 + hpf_rand_n(min_t(size_t, 16, in->len - pos));
+	memmove(in->data + pos, in->data + pos + n, in->len - pos - n);
+	in->len -= n;
+
+	return true;
+}
+
+/**
+ * Repeat a short range many times, e.g. a token of a header value.
+ */
+static bool
+hpf_mut_repeat(HpfInput *in)
+{
+	unsigned char buf[64];
+	size_t pos, n, k;
+
+	if (!in->len)
+		return false;
+	pos = hpf_rand_n(in->len);
+	n = 1 + hpf_rand_n(min_t(size_t, sizeof(buf), in->len - pos));
+	memcpy_fast(buf, in->data + pos, n);
+	for (k = 1 + hpf_rand_n(256); k; --k)
+		if (!hpf_insert(in, pos, buf, n))
+			break;
+
+	return true;
+}
+
+/**
+ * Duplicate a header line, the first line of the message is never chosen.
+ */
+static bool
+hpf_mut_dup_hdr(HpfInput *in)
+{
+	unsigned char *p, *s, *e, *end = in->data + in->len;
+	unsigned char buf[512];
+	size_t k, n;
+
+	p = in->data + hpf_rand_n(in->len + 1);
+	if (!(s = memmem(p, end - p, "\r\n", 2)) || s + 2 == end)
+		return false;
+	s += 2;
+	if (!(e = memmem(s, end - s, "\r\n", 2)) || e == s)
+		return false;
+	e += 2;
+	if ((n = e - s) > sizeof(buf))
+		return false;
+	memcpy_fast(buf, s, n);
+	for (k = 1 + hpf_rand_n(64); k; --k)
+		if (!hpf_insert(in, s - in->data, buf, n))
+			break;
+
+	return true;
+}
+
+static bool
+hpf_mut_splice(HpfInput *in)
+{
+	const HpfInput *src = &hpf_corpus[hpf_rand_n(hpf_corpus_n)];
+	size_t pos, n;
+
+	if (!src->len)
+		return false;
+	pos = hpf_rand_n(src->len);
+	n = 1 + hpf_rand_n(src->len - pos);
+
+	return hpf_insert(in, hpf_rand_n(in->len + 1), src->data + pos, n);
+}
+
+static bool
+hpf_mut_chunk(HpfInput *in)
+{
+	in->chunk = hpf_rand_n(4)
+		    ? hpf_chunks[hpf_rand_n(ARRAY_SIZE(hpf_chunks))]
+		    : 1 + hpf_rand_n(HP_CHUNK_DEF);
+
+	return true;
+}
+
+/**
+ * Write HPACK integer @v with @prefix bits and first byte @mask to @p.
+ */
+static unsigned char *
+hpf_hpack_int(unsigned char *p, size_t v, unsigned int prefix,
+	      unsigned char mask)
+{
+	unsigned int max = (1 << prefix) - 1;
+
+	if (v < max) {
+		*p++ = mask | v;
+		return p;
+	}
+	*p++ = mask | max;
+	for (v -= max; v >= 0x80; v >>= 7)
+		*p++ = (v & 0x7f) | 0x80;
+	*p++ = v;
+
+	return p;
+}
+
+/**
+ * Write literal header field @name: @val without indexing, or with
+ * incremental indexing for @idx, to @p. The header value is Huffman encoded
+ * for @huff and the last byte padding is corrupted for @bad_pad.
+ */
+static unsigned char *
+hpf_hpack_hdr(unsigned char *p, const char *name, const unsigned char *val,
+	      size_t len, bool idx, bool huff, bool bad_pad)
+{
+	size_t i, n = strlen(name);
+	unsigned int bits = 0;
+	u64 acc = 0;
+	unsigned char *s;
+
+	p = hpf_hpack_int(p, 0, idx ? 6 : 4, idx ? 0x40 : 0);
+	p = hpf_hpack_int(p, n, 7, 0);
+	memcpy_fast(p, name, n);
+	p += n;
+
+	if (!huff) {
+		p = hpf_hpack_int(p, len, 7, 0);
+		memcpy_fast(p, val, len);
+		return p + len;
+	}
+
+	for (i = 0, n = 0; i < len; ++i)
+		n += ht_length[val[i]];
+	p = hpf_hpack_int(p, (n + 7) / 8, 7, 0x80);
+	for (s = p, i = 0; i < len; ++i) {
+		acc = (acc << ht_length[val[i]]) | ht_encode[val[i]];
+		for (bits += ht_length[val[i]]; bits >= 8; bits -= 8)
+			*p++ = acc >> (bits - 8);
+	}
+	if (bits)
+		*p++ = (acc << (8 - bits)) | (HT_EOS_HIGH >> bits);
+	if (bad_pad && p > s)
+		p[-1] &= 0xfe;
+
+	return p;
+}
+
+/**
+ * Append a header field with a Huffman encoded value of symbols with the
+ * longest codes.
+ */
+static bool
+hpf_mut_huffman(HpfInput *in)
+{
+	unsigned char val[512], hdr[sizeof(val) * 4 + 32], *e;
+	size_t i, n = 1 + hpf_rand_n(sizeof(val));
+
+	for (i = 0; i < n; ++i) {
+		do
+			val[i] = hpf_rand();
+		while (hpf_rand_n(4) && ht_length[val[i]] < 20);
+	}
+	e = hpf_hpack_hdr(hdr, "x-h", val, n, false, true, !hpf_rand_n(8));
+
+	return hpf_insert(in, in->len, hdr, e - hdr);
+}
+
+/**
+ * Add a large entry to the HPACK dynamic table and append many indexed
+ * references to it.
+ */
+static bool
+hpf_mut_indexed(HpfInput *in)
+{
+	unsigned char val[1024], hdr[sizeof(val) + 32], *e;
+	size_t n = 1 + hpf_rand_n(sizeof(val)), k;
+
+	memset(val, 'a' + hpf_rand_n(26), n);
+	e = hpf_hpack_hdr(hdr, "x-d", val, n, true, false, false);
+	if (!hpf_insert(in, in->len, hdr, e - hdr))
+		return false;
+	/* Index 62 is the newest entry of the dynamic table. */
+	for (k = 1 + hpf_rand_n(256); k; --k)
+		if (!hpf_insert(in, in->len, "\xbe", 1))
+			break;
+
+	return true;
+}
+
+/**
+ * Prepend dynamic table size updates.
+ */
+static bool
+hpf_mut_tbl_size(HpfInput *in)
+{
+	unsigned char buf[256], *p = buf;
+	size_t k;
+
+	for (k = 1 + hpf_rand_n(32); k; --k)
+		p = hpf_hpack_int(p, hpf_rand_n(HPACK_TABLE_DEF_SIZE + 1), 5,
+				  0x20);
+
+	return hpf_insert(in, 0, buf, p - buf);
+}
+
+typedef bool (*hpf_mut_t)(HpfInput *in);
+
+static const hpf_mut_t hpf_muts_h1[] = {
+	hpf_mut_byte, hpf_mut_token, hpf_mut_delete, hpf_mut_repeat,
+	hpf_mut_dup_hdr, hpf_mut_splice, hpf_mut_chunk,
+};
+
+static const hpf_mut_t hpf_muts_h2[] = {
+	hpf_mut_byte, hpf_mut_token, hpf_mut_delete, hpf_mut_repeat,
+	hpf_mut_splice, hpf_mut_chunk, hpf_mut_huffman, hpf_mut_indexed,
+	hpf_mut_tbl_size,
+};
+
+/**
+ * Convert HTTP/1.1 request @s to HPACK header block @p, the headers are
+ * encoded as literals. Return the end of the block or NULL if @s isn't
+ * a request.
+ */
+static unsigned char *
+hpf_h1_to_h2(unsigned char *p, const char *s)
+{
+	const char *sp1, *sp2, *e, *c;
+	char name[256];
+	size_t i, n;
+
+	if (!(sp1 = strchr(s, ' ')) || !(sp2 = strchr(sp1 + 1, ' '))
+	    || !(e = strstr(sp2, "\r\n")) || sp1 - s >= sizeof(name))
+		return NULL;
+	memcpy(name, s, sp1 - s);
+	name[sp1 - s] = '\0';
+
+	/* :method, :scheme https and :path with indexed names. */
+	p = hpf_hpack_int(p, 2, 4, 0);
+	p = hpf_hpack_int(p, sp1 - s, 7, 0);
+	memcpy_fast(p, s, sp1 - s);
+	p += sp1 - s;
+	*p++ = 0x87;
+	p = hpf_hpack_int(p, 4, 4, 0);
+	p = hpf_hpack_int(p, sp2 - sp1 - 1, 7, 0);
+	memcpy_fast(p, sp1 + 1, sp2 - sp1 - 1);
+	p += sp2 - sp1 - 1;
+
+	for (s = e + 2; (e = strstr(s, "\r\n")) && e != s; s = e + 2) {
+		if (!(c = memchr(s, ':', e - s)) || c - s >= sizeof(name))
+			return NULL;
+		for (i = 0; i < c - s; ++i)
+			name[i] = tolower(s[i]);
+		name[i] = '\0';
+		for (++c; c < e && (*c == ' ' || *c == '\t'); ++c)
+			;
+		n = e - c;
+		if (!strcmp(name, "host"))
+			strcpy(name, ":authority");
+		p = hpf_hpack_hdr(p, name, c, n, false, false, false);
+	}
+
+	return e ? p : NULL;
+}
+
+/**
+ * Generate the seeds by the HTTP fuzzer, both valid and invalid messages.
+ */
+static void
+hpf_seeds(int proto, int type)
+{
+	int r;
+	char *msg = malloc(HPF_MAX_LEN);
+	unsigned char *e;
+	HpfInput in = { .data = malloc(HPF_MAX_LEN), .chunk = HP_CHUNK_DEF };
+	TfwFuzzContext ctx;
+
+	BUG_ON(!msg || !in.data);
+	fuzz_init(&ctx, false);
+	while (hpf_corpus_n < HPF_SEEDS) {
+		r = fuzz_gen(&ctx, msg, msg + HPF_MAX_LEN, 0, 1,
+			     (type & Conn_Clnt) ? FUZZ_REQ : FUZZ_RESP);
+		if (r < 0 || r == FUZZ_END)
+			break;
+		if (proto == 2) {
+			if (!(e = hpf_h1_to_h2(in.data, msg)))
+				continue;
+			in.len = e - in.data;
+		} else {
+			in.len = strlen(msg);
+			memcpy_fast(in.data, msg, in.len);
+		}
+		hpf_eval(&in, proto, type);
+		hpf_corpus_add(&in);
+	}
+
+	free(in.data);
+	free(msg);
+}
+
+static void
+hpf_dump(FILE *f, const unsigned char *p, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		if (p[i] == '\r')
+			fputs("\\r", f);
+		else if (p[i] == '\n')
+			fputs("\\n", f);
+		else if (isprint(p[i]) && p[i] != '\\')
+			fputc(p[i], f);
+		else
+			fprintf(f, "\\x%02x", p[i]);
+	}
+}
+
+/**
+ * Write @in to @name in the replay format, HTTP/2 header blocks are written
+ * as HEADERS and CONTINUATION frames after the connection preface.
+ */
+static int
+hpf_write(const char *name, const HpfInput *in, int proto)
+{
+	FILE *f;
+	size_t off, n;
+	unsigned char fh[HP_FRAME_HDR] = { 0, 0, 0, HTTP2_HEADERS, 0, 0, 0, 0,
+					   1 };
+
+	if (!(f = fopen(name, "w"))) {
+		perror(name);
+		return -EINVAL;
+	}
+	if (proto == 1) {
+		fwrite(in->data, 1, in->len, f);
+		goto out;
+	}
+
+	fputs(HP_H2_PREFACE, f);
+	for (off = 0; !off || off < in->len; off += n) {
+		n = min_t(size_t, in->len - off, FRAME_DEF_LENGTH);
+		fh[0] = n >> 16;
+		fh[1] = n >> 8;
+		fh[2] = n;
+		fh[3] = off ? HTTP2_CONTINUATION : HTTP2_HEADERS;
+		fh[4] = (off ? 0 : HTTP2_F_END_STREAM)
+			| (off + n == in->len ? HTTP2_F_END_HEADERS : 0);
+		fwrite(fh, 1, sizeof(fh), f);
+		fwrite(in->data + off, 1, n, f);
+		if (!n)
+			break;
+	}
+out:
+	fclose(f);
+
+	return 0;
+}
+
+static void
+hpf_report(int proto, int type, const char *dir)
+{
+	int i;
+	char name[PATH_MAX];
+
+	printf("\nThe most expensive inputs:\n");
+	for (i = 0; i < HPF_WORST && hpf_worst[i].len; ++i) {
+		const HpfInput *in = &hpf_worst[i];
+
+		printf("%2d: %lu.%02lu cycles/byte, %lu bytes, chunk %lu, %s\n"
+		       "    ", i, in->cost / 100, in->cost % 100, in->len,
+		       in->chunk, in->res == TFW_PASS ? "passed"
+				  : in->res == TFW_BLOCK ? "blocked"
+				  : "incomplete");
+		hpf_dump(stdout, in->data, min_t(size_t, in->len, 96));
+		printf("%s\n", in->len > 96 ? "..." : "");
+		if (!dir)
+			continue;
+		snprintf(name, sizeof(name), "%s/worst-%02d.%s", dir, i,
+			 proto == 2 ? "h2" : "http");
+		if (!hpf_write(name, in, proto))
+			printf("    replay: hot_path%s -c %lu %s\n",
+			       proto == 2 ? " -2"
+			       : (type & Conn_Clnt) ? "" : " -r",
+			       in->chunk, name);
+	}
+}
+
+/**
+ * Run @n mutated inputs, seeded with the messages from the HTTP fuzzer and
+ * the optional input from @buf of @len bytes.
+ */
+static int
+hpf_fuzz(int proto, int type, unsigned long n, unsigned char *buf,
+	 size_t len, const char *dir)
+{
+	unsigned long i, m;
+	const hpf_mut_t *muts = proto == 2 ? hpf_muts_h2 : hpf_muts_h1;
+	size_t muts_n = proto == 2 ? ARRAY_SIZE(hpf_muts_h2)
+				   : ARRAY_SIZE(hpf_muts_h1);
+	HpfInput in = { .chunk = HP_CHUNK_DEF }, *parent;
+
+	for (i = 0; i < HPF_CORPUS; ++i)
+		if (!(hpf_corpus[i].data = malloc(HPF_MAX_LEN)))
+			return -ENOMEM;
+	for (i = 0; i < HPF_WORST; ++i)
+		if (!(hpf_worst[i].data = malloc(HPF_MAX_LEN)))
+			return -ENOMEM;
+	if (!(in.data = malloc(HPF_MAX_LEN)))
+		return -ENOMEM;
+
+	if (type & Conn_Clnt)
+		hpf_rules_init();
+	if (buf) {
+		in.len = min_t(size_t, len, HPF_MAX_LEN);
+		memcpy_fast(in.data, buf, in.len);
+		hpf_eval(&in, proto, type);
+		hpf_corpus_add(&in);
+	}
+	hpf_seeds(proto, type);
+	hpf_seeds_n = hpf_corpus_n;
+	if (!hpf_corpus_n) {
+		fprintf(stderr, "no seeds for fuzzing\n");
+		return -EINVAL;
+	}
+	for (i = 0; i < hpf_corpus_n; ++i)
+		hpf_worst_add(&hpf_corpus[i]);
+
+	for (i = 1; i <= n; ++i) {
+		/* Mutate the most expensive inputs more often. */
+		parent = hpf_rand_n(2) && hpf_worst[0].len
+			 ? &hpf_worst[hpf_rand_n(HPF_WORST)]
+			 : &hpf_corpus[hpf_rand_n(hpf_corpus_n)];
+		if (!parent->len)
+			parent = &hpf_corpus[0];
+		hpf_input_copy(&in, parent);
+		for (m = 1 + hpf_rand_n(4); m; --m)
+			muts[hpf_rand_n(muts_n)](&in);
+
+		hpf_eval(&in, proto, type);
+		if (in.cost > parent->cost)
+			hpf_corpus_add(&in);
+		hpf_worst_add(&in);
+
+		if (!(i % HPF_REPORT))
+			printf("inputs %lu, corpus %u, worst %lu.%02lu"
+			       " cycles/byte\n", i, hpf_corpus_n,
+			       hpf_worst[0].cost / 100,
+			       hpf_worst[0].cost % 100);
+	}
+
+	hpf_report(proto, type, dir);
+
+	return 0;
+}
+
+static void
+hp_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-r | -2] [-c <chunk>] [-n <iterations>]"
+		" <file>\n"
+		"       %s -F [-r | -2] [-n <inputs>] [-s <seed>] [-o <dir>]"
+		" [<file>]\n"
+		"       %s -S\n", prog, prog, prog);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int c, r = 0, proto = 1, type = Conn_HttpClnt;
+	unsigned long i, iter = 0, cycles;
+	unsigned char *buf = NULL, *p;
+	size_t len = 0;
+	bool fuzz = false, str_perf = false;
+	const char *dir = NULL;
+	struct timespec t0, t1;
+	HpStat st = {};
+	unsigned int parsed = 0;
+
+	hpf_rnd = 1;
+	while ((c = getopt(argc, argv, "r2c:n:Fs:o:S")) != -1) {
+		switch (c) {
+		case 'r':
+			type = Conn_HttpSrv;
+			break;
+		case '2':
+			proto = 2;
+			break;
+		case 'c':
+			hp_chunk = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			iter = strtoul(optarg, NULL, 10);
+			break;
+		case 'F':
+			fuzz = true;
+			break;
+		case 's':
+			hpf_rnd = strtoul(optarg, NULL, 10) | 1;
+			break;
+		case 'o':
+			dir = optarg;
+			break;
+		case 'S':
+			str_perf = true;
+			break;
+		default:
+			hp_usage(argv[0]);
+		}
+	}
+	if (str_perf) {
+		if (optind < argc)
+			hp_usage(argv[0]);
+		test__str_perf__all();
+		return 0;
+	}
+	if (!iter)
+		iter = fuzz ? 10000 : 1;
+	if (optind < argc - 1 || (!fuzz && optind == argc) || !hp_chunk
+	    || (proto == 2 && type == Conn_HttpSrv))
+		hp_usage(argv[0]);
+	if (optind < argc && !(buf = hp_read_file(argv[optind], &len)))
+		return 1;
+
+	if (tfw_pool_init())
+		return 1;
+	tfw_hpack_huffman_init();
+	TFW_CONN_TYPE((TfwConn *)&hp_conn) = Conn_HttpClnt;
+
+	/* The request to pair the responses with. */
+	hp_req = (TfwHttpReq *)hp_msg_alloc(Conn_HttpClnt);
+	p = hp_skb_queue((TfwHttpMsg *)hp_req, (unsigned char *)hp_sample_req,
+			 SLEN(hp_sample_req));
+	if (tfw_http_parse_req(hp_req, p, SLEN(hp_sample_req), &parsed)
+	    != TFW_PASS)
+		return 1;
+
+	if (fuzz) {
+		hp_quiet = true;
+		r = hpf_fuzz(proto, type, iter, buf, len, dir);
+		goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	cycles = get_cycles();
+	for (i = 0; i < iter && !r; ++i)
+		r = proto == 2
+		    ? hp_replay_h2(buf, len, &st)
+		    : hp_replay_h1(buf, len, type, &st);
+	cycles = get_cycles() - cycles;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	printf("messages %lu, blocked %lu, bytes %lu\n",
+	       st.msgs, st.blocked, st.bytes);
+	if (st.msgs)
+		printf("%.2f cycles/byte, %lu ns/message\n",
+		       (double)cycles / st.bytes,
+		       ((t1.tv_sec - t0.tv_sec) * 1000000000UL
+			+ t1.tv_nsec - t0.tv_nsec) / st.msgs);
+out:
+	tfw_http_msg_free((TfwHttpMsg *)hp_req);
+	tfw_pool_exit();
+	free(buf);
+
+	return r ? 1 : 0;
+}
@@ -24,14 +24,22 @@
 #define DEBUG DBG_TLS
 #endif
 
+#include <linux/hash.h>
+#include <linux/sched/clock.h>
+#include <linux/vmalloc.h>
+
 #include "cfg.h"
 #include "connection.h"
 #include "client.h"
+#include "cpu_role.h"
 #include "msg.h"
 #include "procfs.h"
 #include "http_frame.h"
 #include "tls.h"
+#include "tls_conf.h"
+#include "trace.h"
 #include "vhost.h"
+#include "work_queue.h"
 #include "lib/hash.h"
 
 /**
@@ -49,6 +57,69 @@ static struct {
 /* Temporal value for reconfiguration stage. */
 static bool allow_any_sni_reconfig;
 
+/*
+ * Handshakes are offloaded to the CPUs with TFW_CPU_HS role, they are
+ * processed by the current CPU if there are no such CPUs.
+ */
+static bool tfw_tls_hs_offload;
+
+/*
+ * Work to process a TLS record on a handshake CPU. The connection is
+ * referenced while the work is queued.
+ */
+typedef struct {
+	TfwConn			*conn;
+	struct sk_buff		*skb;
+	unsigned long		__unused[2];
+} TfwTlsHsWork;
+
+typedef struct {
+	struct tasklet_struct	tasklet;
+	struct irq_work		ipi_work;
+	TfwRBQueue		wq;
+} TfwTlsHsTasklet;
+
+static DEFINE_PER_CPU(TfwTlsHsTasklet, tls_hs_wq);
+
+/*
+ * Admission of new TLS handshakes.
+ *
+ * @pfx_rate	- new handshakes per second from a source prefix;
+ * @pfx_burst	- maximum burst of new handshakes from a source prefix;
+ * @cpu_budget	- percent of the handshake CPUs time available for handshakes;
+ */
+typedef struct {
+	unsigned int	pfx_rate;
+	unsigned int	pfx_burst;
+	unsigned int	cpu_budget;
+} TfwTlsHsLimits;
+
+static TfwTlsHsLimits tfw_tls_hs_lim, tfw_tls_hs_lim_reconfig;
+
+/*
+ * Token buckets of source prefixes, /24 for IPv4 and /64 for IPv6. A bucket
+ * keeps the last update time in milliseconds in the upper half and the
+ * number of tokens, scaled by 1000, in the lower half, so it's updated with
+ * a single cmpxchg. Prefixes with the same hash share a bucket, so no state
+ * is allocated per source.
+ */
+#define TFW_TLS_HS_PFX_BITS	16
+#define TFW_TLS_HS_TOKEN	1000
+
+static atomic64_t *tfw_tls_hs_pfx_tbl;
+
+/*
+ * Time spent by all CPUs in TLS handshakes during the current and the
+ * previous seconds, ns.
+ */
+static struct {
+	unsigned long	ts;
+	u64		prev;
+	atomic64_t	curr;
+} tfw_tls_hs_load ____cacheline_aligned;
+
+static u64 tfw_tls_hs_budget_ns;
+
 /**
  * Chop skb list with begin at @skb by TLS extra data at the begin and end of
  * the list after decryption and write the right pointer at the first skb and
@@ -104,6 +175,8 @@ tfw_tls_hs_over(TlsCtx *ctx, int state)
 	TfwCliConn *c = &container_of(ctx, TfwTlsConn, tls)->cli_conn;
 	TfwFsmData data_up = { .req = ERR_PTR(-state)};
 
+	trace_tfw_tls_hs_done((TfwConn *)c, state);
+
 	return tfw_gfsm_move(&c->state, TFW_TLS_FSM_HS_DONE, &data_up);
 }
 
@@ -124,9 +197,10 @@ tfw_tls_connection_lost(TfwConn *conn)
 }
 
 static int
-tfw_tls_msg_process(void *conn, TfwFsmData *data)
+__tfw_tls_msg_process(void *conn, TfwFsmData *data)
 {
 	int r, parsed;
+	u64 hs_t0 = 0;
 	struct sk_buff *nskb = NULL, *skb = data->skb;
 	TfwConn *c = conn;
 	TlsCtx *tls = tfw_tls_context(c);
@@ -143,7 +217,13 @@ next_msg:
 
 	/* Call TLS layer to place skb into a TLS record on top of skb_list. */
 	parsed = 0;
+	if (tfw_tls_hs_budget_ns && !ttls_hs_done(tls))
+		hs_t0 = local_clock();
 	r = ss_skb_process(skb, ttls_recv, tls, &tls->io_in.chunks, &parsed);
+	if (hs_t0) {
+		tfw_tls_hs_load_add(local_clock() - hs_t0);
+		hs_t0 = 0;
+	}
 	switch (r) {
 	default:
 		T_WARN("Unrecognized TLS receive return code -0x%X, drop packet\n",
@@ -235,6 +315,270 @@ next_msg:
 	return r;
 }
 
+static void
+tfw_tls_hs_ipi(struct irq_work *work)
+{
+	TfwTlsHsTasklet *ht = container_of(work, TfwTlsHsTasklet, ipi_work);
+	clear_bit(TFW_QUEUE_IPI, &ht->wq.flags);
+	tasklet_schedule(&ht->tasklet);
+}
+
+/**
+ * Public key operations of a full TLS handshake take much more time than
+ * processing of any HTTP message, so a handshake flood on the same CPUs
+ * delays the established connections. Queue the TLS records of connections
+ * with incomplete handshakes to the dedicated CPUs. All the later records of
+ * the connection follow the queued ones until the queue is drained, so
+ * the records are processed in order. The handshake replies are sent by
+ * ss_send() through the connection socket CPU as usual.
+ *
+ * Return T_OK if @skb must be processed by the current CPU, T_POSTPONE if
+ * it's queued, or T_DROP if the connection must be dropped.
+ */
+static int
+tfw_tls_hs_queue(TfwConn *c, struct sk_buff *skb)
+{
+	int cpu, r;
+	TfwTlsConn *tc = (TfwTlsConn *)c;
+	TlsCtx *tls = &tc->tls;
+	TfwTlsHsTasklet *ht;
+	TfwTlsHsWork w = { .conn = c, .skb = skb };
+
+	if (likely(!tfw_tls_hs_offload))
+		return T_OK;
+
+	spin_lock(&tls->lock);
+	if (likely(!tc->hs_pending)) {
+		if (ttls_hs_done(tls)
+		    || tfw_cpu_role_test(TFW_CPU_HS, smp_processor_id()))
+		{
+			spin_unlock(&tls->lock);
+			return T_OK;
+		}
+		tc->hs_cpu = tfw_cpu_role_next(TFW_CPU_HS, NUMA_NO_NODE);
+	}
+	++tc->hs_pending;
+	cpu = tc->hs_cpu;
+	spin_unlock(&tls->lock);
+
+	tfw_connection_get(c);
+	ht = &per_cpu(tls_hs_wq, cpu);
+	if (likely(!tfw_wq_push(&ht->wq, &w, cpu, &ht->ipi_work,
+				tfw_tls_hs_ipi)))
+		return T_POSTPONE;
+	tfw_connection_put(c);
+
+	/*
+	 * The handshake CPU is overloaded. We can process the record here only
+	 * if there are no previous records in the queue.
+	 */
+	spin_lock(&tls->lock);
+	r = --tc->hs_pending ? T_DROP : T_OK;
+	spin_unlock(&tls->lock);
+	if (r) {
+		T_WARN("TLS handshake work queue overrun on CPU %d\n", cpu);
+		TFW_INC_STAT_BH(clnt.msgs_otherr);
+		kfree_skb(skb);
+	}
+
+	return r;
+}
+
+static void
+tfw_tls_hs_do(TfwTlsHsWork *w)
+{
+	int r;
+	TfwConn *c = w->conn;
+	TfwTlsConn *tc = (TfwTlsConn *)c;
+	TfwFsmData data = { .skb = w->skb };
+
+	if (unlikely(tc->hs_drop)) {
+		kfree_skb(w->skb);
+		r = T_OK;
+	} else {
+		r = __tfw_tls_msg_process(c, &data);
+	}
+
+	spin_lock(&tc->tls.lock);
+	--tc->hs_pending;
+	spin_unlock(&tc->tls.lock);
+
+	if (unlikely(!tc->hs_drop && (r < 0 || r == TFW_BLOCK))) {
+		tc->hs_drop = true;
+		tfw_connection_close(c, false);
+	}
+	tfw_connection_put(c);
+}
+
+static void
+tfw_tls_hs_tasklet(unsigned long data)
+{
+	TfwTlsHsTasklet *ht = (TfwTlsHsTasklet *)data;
+	TfwRBQueue *wq = &ht->wq;
+	TfwTlsHsWork w;
+
+	while (!tfw_wq_pop(wq, &w))
+		tfw_tls_hs_do(&w);
+
+	TFW_WQ_IPI_SYNC(tfw_wq_size, wq);
+
+	tasklet_schedule(&ht->tasklet);
+}
+
+static void
+tfw_tls_hs_load_add(u64 ns)
+{
+	unsigned long ts = jiffies / HZ, last = READ_ONCE(tfw_tls_hs_load.ts);
+
+	if (unlikely(last != ts)) {
+		/* Concurrent updates on a second boundary lose few samples. */
+		u64 v = atomic64_xchg(&tfw_tls_hs_load.curr, 0);
+
+		WRITE_ONCE(tfw_tls_hs_load.prev, ts == last + 1 ? v : 0);
+		WRITE_ONCE(tfw_tls_hs_load.ts, ts);
+	}
+	atomic64_add(ns, &tfw_tls_hs_load.curr);
+}
+
+static bool
+tfw_tls_hs_overloaded(void)
+{
+	unsigned long ts = jiffies / HZ, last = READ_ONCE(tfw_tls_hs_load.ts);
+	u64 used = atomic64_read(&tfw_tls_hs_load.curr);
+
+	if (ts == last)
+		used = max(used, READ_ONCE(tfw_tls_hs_load.prev));
+	else if (ts != last + 1)
+		used = 0;
+
+	return used > tfw_tls_hs_budget_ns;
+}
+
+static bool
+tfw_tls_hs_pfx_take(const TfwAddr *addr)
+{
+	u64 key, old, new, tokens;
+	u32 now = jiffies_to_msecs(jiffies);
+	u64 burst = (u64)tfw_tls_hs_lim.pfx_burst * TFW_TLS_HS_TOKEN;
+	atomic64_t *b;
+
+	if (tfw_addr_is_v4mapped(addr))
+		key = ntohl(addr->sin6_addr.s6_addr32[3]) >> 8;
+	else
+		key = ((u64)addr->sin6_addr.s6_addr32[0] << 32)
+		      | addr->sin6_addr.s6_addr32[1];
+	b = &tfw_tls_hs_pfx_tbl[hash_64(key, TFW_TLS_HS_PFX_BITS)];
+
+	do {
+		old = atomic64_read(b);
+		if (!old) {
+			tokens = burst;
+		} else {
+			tokens = (u32)old + (u64)(now - (u32)(old >> 32))
+					    * tfw_tls_hs_lim.pfx_rate;
+			tokens = min(tokens, burst);
+		}
+		if (tokens < TFW_TLS_HS_TOKEN)
+			return false;
+		new = ((u64)now << 32) | (tokens - TFW_TLS_HS_TOKEN);
+	} while (atomic64_cmpxchg(b, old, new) != old);
+
+	return true;
+}
+
+/**
+ * Stateless admission of a new handshake on the first record of a connection,
+ * before the ClientHello is parsed and any public key operation is done for
+ * the handshake. Frang limits the handshakes of each client later.
+ */
+static int
+tfw_tls_hs_admit(TfwConn *c)
+{
+	TfwTlsConn *tc = (TfwTlsConn *)c;
+	TfwAddr *addr = &c->peer->addr;
+
+	tc->hs_admitted = true;
+
+	if (tfw_tls_hs_budget_ns && tfw_tls_hs_overloaded()) {
+		T_DBG("TLS: handshakes CPU budget is exceeded, drop"
+		      " connection\n");
+		return T_DROP;
+	}
+	if (tfw_tls_hs_lim.pfx_rate && !tfw_tls_hs_pfx_take(addr)) {
+		T_DBG_ADDR("TLS: handshakes rate of the client prefix is"
+			   " exceeded, drop connection", addr, TFW_NO_PORT);
+		return T_DROP;
+	}
+
+	return T_OK;
+}
+
+static int
+tfw_tls_msg_process(void *conn, TfwFsmData *data)
+{
+	int r;
+
+	if (unlikely(!((TfwTlsConn *)conn)->hs_admitted)
+	    && (r = tfw_tls_hs_admit(conn)))
+	{
+		TFW_INC_STAT_BH(clnt.msgs_filtout);
+		kfree_skb(data->skb);
+		return r;
+	}
+
+	r = tfw_tls_hs_queue(conn, data->skb);
+
+	if (likely(r == T_OK))
+		return __tfw_tls_msg_process(conn, data);
+	/* The handshake CPU owns the skb now. */
+	if (r == T_POSTPONE)
+		return TFW_PASS;
+
+	return r;
+}
+
+static void
+tfw_tls_hs_wq_cleanup(void)
+{
+	int cpu;
+
+	for_each_online_cpu(cpu) {
+		TfwTlsHsWork w;
+		TfwTlsHsTasklet *ht = &per_cpu(tls_hs_wq, cpu);
+
+		if (!ht->wq.array)
+			continue;
+		tasklet_kill(&ht->tasklet);
+		irq_work_sync(&ht->ipi_work);
+		while (!tfw_wq_pop(&ht->wq, &w)) {
+			kfree_skb(w.skb);
+			tfw_connection_put(w.conn);
+		}
+		tfw_wq_destroy(&ht->wq);
+	}
+}
+
+static int
+tfw_tls_hs_wq_init(void)
+{
+	int cpu;
+
+	TFW_WQ_CHECKSZ(TfwTlsHsWork);
+	for_each_online_cpu(cpu) {
+		TfwTlsHsTasklet *ht = &per_cpu(tls_hs_wq, cpu);
+
+		if (tfw_wq_init(&ht->wq, cpu_to_node(cpu))) {
+			tfw_tls_hs_wq_cleanup();
+			return -ENOMEM;
+		}
+		init_irq_work(&ht->ipi_work, tfw_tls_hs_ipi);
+		tasklet_init(&ht->tasklet, tfw_tls_hs_tasklet,
+			     (unsigned long)ht);
+	}
+
+	return 0;
+}
+
 /**
  * Add the TLS record overhead to current TCP socket control data.
  */
@@ -275,6 +619,89 @@ tfw_tls_tcp_propagate_dseq(struct sock *sk, struct sk_buff *skb)
 	tcb_next->end_seq = tcb_next->seq + next->len;
 }
 
+/*
+ * Dynamic TLS record sizing. A TLS record can be decrypted only when it's
+ * received completely, so a large record sent right after the handshake or
+ * an idle period, when the congestion window is small, delays the first bytes
+ * of a response for several round trips. Send records fitting one TCP segment
+ * for the first TFW_TLS_REC_SMALL_BYTES and the maximum size records after
+ * that to minimize the per-record overhead for bulk transfers. The small
+ * records are used again after TFW_TLS_REC_IDLE of the connection idle time.
+ */
+#define TFW_TLS_REC_SMALL_BYTES		(64 * 1024)
+#define TFW_TLS_REC_IDLE		HZ
+
+/**
+ * Get the TLS record payload limit for the current transmission @limit.
+ */
+static unsigned int
+tfw_tls_rec_limit(struct sock *sk, TfwTlsConn *tc, unsigned int limit)
+{
+	unsigned int mss;
+
+	if (time_after(jiffies, tc->rec_ts + TFW_TLS_REC_IDLE))
+		tc->rec_bytes = 0;
+	tc->rec_ts = jiffies;
+
+	if (tc->rec_bytes >= TFW_TLS_REC_SMALL_BYTES)
+		return limit;
+
+	mss = tcp_current_mss(sk);
+	if (unlikely(mss <= TLS_MAX_OVERHEAD))
+		return limit;
+
+	return min(limit, mss - TLS_MAX_OVERHEAD);
+}
+
+/**
+ * Split @skb, the head of the TCP write queue, to send only first @len bytes
+ * in the current TLS record. This is tso_fragment() without TSO segments
+ * calculation: tcp_write_xmit() sets them for both the skbs.
+ */
+static int
+tfw_tls_skb_fragment(struct sock *sk, struct sk_buff *skb, unsigned int len)
+{
+	unsigned int nlen = skb->len - len;
+	unsigned char flags;
+	struct sk_buff *buff;
+
+	/* The new skb has no linear data. */
+	if (len < skb_headlen(skb))
+		return -EINVAL;
+
+	buff = sk_stream_alloc_skb(sk, 0, GFP_ATOMIC, true);
+	if (unlikely(!buff))
+		return -ENOMEM;
+
+	sk_wmem_queued_add(sk, buff->truesize);
+	sk_mem_charge(sk, buff->truesize);
+	buff->truesize += nlen;
+	skb->truesize -= nlen;
+
+	TCP_SKB_CB(buff)->seq = TCP_SKB_CB(skb)->seq + len;
+	TCP_SKB_CB(buff)->end_seq = TCP_SKB_CB(skb)->end_seq;
+	TCP_SKB_CB(skb)->end_seq = TCP_SKB_CB(buff)->seq;
+
+	/* PSH and FIN should only be set in the second packet. */
+	flags = TCP_SKB_CB(skb)->tcp_flags;
+	TCP_SKB_CB(skb)->tcp_flags = flags & ~(TCPHDR_FIN | TCPHDR_PSH);
+	TCP_SKB_CB(buff)->tcp_flags = flags;
+	TCP_SKB_CB(buff)->sacked = 0;
+	TCP_SKB_CB(buff)->eor = TCP_SKB_CB(skb)->eor;
+	TCP_SKB_CB(skb)->eor = 0;
+
+	buff->ip_summed = CHECKSUM_PARTIAL;
+	skb_split(skb, buff, len);
+	tcp_skb_pcount_set(skb, 0);
+	tcp_skb_pcount_set(buff, 0);
+
+	__skb_header_release(buff);
+	tempesta_tls_skb_typecp(buff, skb);
+	__skb_queue_after(&sk->sk_write_queue, skb, buff);
+
+	return 0;
+}
+
 /**
  * The callback is called by tcp_write_xmit() if @skb must be encrypted by TLS.
  * @skb is current head of the TCP send queue. @limit defines how much data
@@ -285,8 +712,8 @@ tfw_tls_tcp_propagate_dseq(struct sock *sk, struct sk_buff *skb)
  * We extend the skbs on TCP transmission (when CWND is calculated), so we
  * also adjust TPC sequence numbers in the socket. See skb_entail().
  */
-int
-tfw_tls_encrypt(struct sock *sk, struct sk_buff *skb, unsigned int limit)
+static int
+__tfw_tls_encrypt(struct sock *sk, struct sk_buff *skb, unsigned int limit)
 {
 	/*
 	 * TODO #1103 currently even trivial 500-bytes HTTP message generates
@@ -299,6 +726,7 @@ tfw_tls_encrypt(struct sock *sk, struct sk_buff *skb, unsigned int limit)
 	unsigned char type;
 	struct sk_buff *next = skb, *skb_tail = skb;
 	struct tcp_skb_cb *tcb = TCP_SKB_CB(skb);
+	TfwTlsConn *tc;
 	TlsCtx *tls;
 	TlsIOCtx *io;
 	TlsXfrm *xfrm;
@@ -321,7 +749,8 @@ tfw_tls_encrypt(struct sock *sk, struct sk_buff *skb, unsigned int limit)
 		goto err_purge_tcp_write_queue;
 	}
 
-	tls = tfw_tls_context(sk->sk_user_data);
+	tc = (TfwTlsConn *)sk->sk_user_data;
+	tls = &tc->tls;
 	io = &tls->io_out;
 	xfrm = &tls->xfrm;
 
@@ -337,8 +766,6 @@ tfw_tls_encrypt(struct sock *sk, struct sk_buff *skb, unsigned int limit)
 	WARN_ON_ONCE(tcb->seq + skb->len + !!(tcb->tcp_flags & TCPHDR_FIN)
 		     != tcb->end_seq);
 
-	head_sz = ttls_payload_off(xfrm);
-	len = head_sz + skb->len + TTLS_TAG_LEN;
 	type = tempesta_tls_skb_type(skb);
 	if (!type) {
 		T_WARN("%s: bad skb type %u\n", __func__, type);
@@ -346,6 +773,19 @@ tfw_tls_encrypt(struct sock *sk, struct sk_buff *skb, unsigned int limit)
 		goto err_kill_sock;
 	}
 
+	/*
+	 * Send a smaller record if the connection is new or was idle. If @skb
+	 * can't be split, then just send it as is in a larger record.
+	 */
+	if (type == TTLS_MSG_APPLICATION_DATA) {
+		limit = tfw_tls_rec_limit(sk, tc, limit);
+		if (skb->len > limit)
+			tfw_tls_skb_fragment(sk, skb, limit);
+	}
+
+	head_sz = ttls_payload_off(xfrm);
+	len = head_sz + skb->len + TTLS_TAG_LEN;
+
 	/* TLS header is always allocated from the skb headroom. */
 	tcb->end_seq += head_sz;
 
@@ -527,6 +967,10 @@ tfw_tls_encrypt(struct sock *sk, struct sk_buff *skb, unsigned int limit)
 
 	spin_unlock(&tls->lock);
 
+	if (type == TTLS_MSG_APPLICATION_DATA
+	    && tc->rec_bytes < TFW_TLS_REC_SMALL_BYTES)
+		tc->rec_bytes += len;
+
 	for (p = pages; p < pages_end; ++p)
 		put_page(*p);
 
@@ -582,6 +1026,17 @@ err_purge_tcp_write_queue:
 #undef AUTO_SEGS_N
 }
 
+int
+tfw_tls_encrypt(struct sock *sk, struct sk_buff *skb, unsigned int limit)
+{
+	u64 t0 = tfw_lat_start();
+	int r = __tfw_tls_encrypt(sk, skb, limit);
+
+	tfw_lat_end(TFW_LAT_ENCRYPT, t0);
+
+	return r;
+}
+
 /**
  * Callback function which is called by TLS module under tls->lock when it
  * initiates a record transmission, e.g. alert or a handshake message.
@@ -698,11 +1153,18 @@ static int
 tfw_tls_conn_init(TfwConn *c)
 {
 	int r;
+	TfwTlsConn *tc = (TfwTlsConn *)c;
 	TlsCtx *tls = tfw_tls_context(c);
 	TfwH2Ctx *h2 = tfw_h2_context(c);
 
 	T_DBG2("%s: conn=[%p]\n", __func__, c);
 
+	tc->hs_pending = 0;
+	tc->hs_drop = false;
+	tc->hs_admitted = false;
+	tc->rec_bytes = 0;
+	tc->rec_ts = jiffies;
+
 	if ((r = ttls_ctx_init(tls, &tfw_tls.cfg))) {
 		T_ERR("TLS (%pK) setup failed (%x)\n", tls, -r);
 		return -EINVAL;
@@ -831,6 +1293,29 @@ tfw_tls_get_if_configured(TfwVhost *vhost)
 	return cfg;
 }
 
+/**
+ * Move the vhost reference to the owner of the TLS configuration @cfg chosen
+ * for the vhost by the SNI index.
+ */
+static TlsPeerCfg *
+tfw_tls_hold_cfg(TfwVhost *vhost, TlsPeerCfg *cfg)
+{
+	TfwVhost *owner;
+
+	if (unlikely(!cfg)) {
+		tfw_vhost_put(vhost);
+		return NULL;
+	}
+
+	owner = tfw_vhost_from_tls_conf(cfg);
+	if (owner != vhost) {
+		tfw_vhost_get(owner);
+		tfw_vhost_put(vhost);
+	}
+
+	return cfg;
+}
+
 #define SNI_WARN(fmt, ...)						\
 	TFW_WITH_ADDR_FMT(&cli_conn->peer->addr, TFW_NO_PORT, addr_str,	\
 			  T_WARN("TLS: sni ext: client %s requested "fmt, \
@@ -855,7 +1340,7 @@ tfw_tls_sni(TlsCtx *ctx, const unsigned char *data, size_t len)
 		return TTLS_ERR_BAD_HS_CLIENT_HELLO;
 
 	if (data && len) {
-		vhost = tfw_vhost_lookup(&srv_name);
+		vhost = tfw_vhost_lookup_sni(&srv_name, &peer_cfg);
 		if (unlikely(vhost && !vhost->vhost_dflt)) {
 			SNI_WARN(" '%s' vhost by name, reject connection.\n",
 				 TFW_VH_DFT_NAME);
@@ -872,12 +1357,14 @@ tfw_tls_sni(TlsCtx *ctx, const unsigned char *data, size_t len)
 	 * If accurate vhost is not found or client doesn't send sni extension,
 	 * map the connection to default vhost.
 	 */
-	if (!vhost)
+	if (!vhost) {
 		vhost = tfw_vhost_lookup_default();
-	if (unlikely(!vhost))
-		return TTLS_ERR_CERTIFICATE_REQUIRED;
-
-	peer_cfg = tfw_tls_get_if_configured(vhost);
+		if (unlikely(!vhost))
+			return TTLS_ERR_CERTIFICATE_REQUIRED;
+		peer_cfg = tfw_tls_get_if_configured(vhost);
+	} else {
+		peer_cfg = tfw_tls_hold_cfg(vhost, peer_cfg);
+	}
 	ctx->peer_conf = peer_cfg;
 	if (unlikely(!peer_cfg))
 		return TTLS_ERR_CERTIFICATE_REQUIRED;
@@ -1048,11 +1535,82 @@ static int
 tfw_tls_start(void)
 {
 	tfw_tls.allow_any_sni = allow_any_sni_reconfig;
+	tfw_tls_hs_offload = !tfw_cpu_role_empty(TFW_CPU_HS);
+	tfw_tls_ocsp_start();
+
+	if (tfw_tls_hs_lim_reconfig.pfx_rate && !tfw_tls_hs_pfx_tbl) {
+		tfw_tls_hs_pfx_tbl = vzalloc(sizeof(atomic64_t)
+					     << TFW_TLS_HS_PFX_BITS);
+		if (!tfw_tls_hs_pfx_tbl) {
+			T_ERR_NL("TLS: cannot allocate handshakes admission"
+				 " table\n");
+			return -ENOMEM;
+		}
+	}
+	tfw_tls_hs_lim = tfw_tls_hs_lim_reconfig;
+	if (!tfw_tls_hs_lim.pfx_burst)
+		tfw_tls_hs_lim.pfx_burst = tfw_tls_hs_lim.pfx_rate;
+	tfw_tls_hs_budget_ns = (u64)tfw_tls_hs_lim.cpu_budget
+			       * (tfw_tls_hs_offload
+				  ? cpumask_weight(&tfw_cpu_roles[TFW_CPU_HS])
+				  : num_online_cpus())
+			       * (NSEC_PER_SEC / 100);
 
 	return 0;
 }
 
+static void
+tfw_tls_stop(void)
+{
+	if (tfw_runstate_is_reconfig())
+		return;
+	tfw_tls_ocsp_stop();
+}
+
+static int
+tfw_cfgop_tls_hs_cpus(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	return tfw_cpu_role_cfg(cs, ce, TFW_CPU_HS);
+}
+
 static TfwCfgSpec tfw_tls_specs[] = {
+	{
+		.name = "tls_handshake_cpus",
+		.deflt = NULL,
+		.handler = tfw_cfgop_tls_hs_cpus,
+		.allow_none = true,
+		.allow_reconfig = true,
+	},
+	{
+		.name = "tls_handshake_prefix_rate",
+		.deflt = "0",
+		.handler = tfw_cfg_set_int,
+		.dest = &tfw_tls_hs_lim_reconfig.pfx_rate,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, 1000000 },
+		},
+		.allow_reconfig = true,
+	},
+	{
+		.name = "tls_handshake_prefix_burst",
+		.deflt = "0",
+		.handler = tfw_cfg_set_int,
+		.dest = &tfw_tls_hs_lim_reconfig.pfx_burst,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, 1000000 },
+		},
+		.allow_reconfig = true,
+	},
+	{
+		.name = "tls_handshake_cpu_budget",
+		.deflt = "0",
+		.handler = tfw_cfg_set_int,
+		.dest = &tfw_tls_hs_lim_reconfig.cpu_budget,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, 100 },
+		},
+		.allow_reconfig = true,
+	},
 	{ 0 }
 };
 
@@ -1061,6 +1619,7 @@ TfwMod tfw_tls_mod = {
 	.cfgend		= tfw_tls_cfgend,
 	.cfgstart	= tfw_tls_cfgstart,
 	.start		= tfw_tls_start,
+	.stop		= tfw_tls_stop,
 	.specs		= tfw_tls_specs,
 };
 
@@ -1085,6 +1644,9 @@ tfw_tls_init(void)
 	if ((r = tfw_h2_init()))
 		goto err_h2;
 
+	if ((r = tfw_tls_hs_wq_init()))
+		goto err_wq;
+
 	if ((r = tfw_gfsm_register_fsm(TFW_FSM_TLS, tfw_tls_msg_process)))
 		goto err_fsm;
 
@@ -1094,6 +1656,8 @@ tfw_tls_init(void)
 	return 0;
 
 err_fsm:
+	tfw_tls_hs_wq_cleanup();
+err_wq:
 	tfw_h2_cleanup();
 err_h2:
 	tfw_tls_do_cleanup();
@@ -1107,6 +1671,8 @@ tfw_tls_exit(void)
 	tfw_mod_unregister(&tfw_tls_mod);
 	tfw_connection_hooks_unregister(TFW_FSM_TLS);
 	tfw_gfsm_unregister_fsm(TFW_FSM_TLS);
+	tfw_tls_hs_wq_cleanup();
 	tfw_h2_cleanup();
 	tfw_tls_do_cleanup();
+	vfree(tfw_tls_hs_pfx_tbl);
 }
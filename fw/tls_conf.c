@@ -17,6 +17,11 @@
  * with this program; if not, write to the Free Software Foundation, Inc.,
  * 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
+#include <linux/cpu.h>
+#include <linux/hashtable.h>
+#include <linux/workqueue.h>
+
+#include "lib/hash.h"
 #include "tls_conf.h"
 #include "tls.h"
 #include "vhost.h"
@@ -26,11 +31,73 @@
 #define TFW_TLS_CFG_F_CKEY	2U
 
 #define TLS_CONF_CERT_NUM	8
+/* Period of rereading the stapled OCSP responses files. */
+#define TFW_TLS_OCSP_REFRESH	(60 * HZ)
+#define TFW_TLS_CHAIN_HBITS	10
+#define TFW_TLS_PEM_BEGIN	"-----BEGIN CERTIFICATE-----"
+
+/**
+ * Stapled OCSP response file of a certificate.
+ *
+ * @list	- entry in the list of all the stapled responses;
+ * @vhost	- the certificate vhost, the entry lives while it's alive;
+ * @kc		- the certificate;
+ * @path	- path to the DER encoded response;
+ */
+typedef struct {
+	struct list_head	list;
+	TfwVhost		*vhost;
+	TlsKeyCert		*kc;
+	char			*path;
+} TfwTlsOcsp;
 
+/**
+ * Intermediate certificates shared by all the vhosts certificate files of
+ * which have the same tail after the leaf certificate. Many vhosts are
+ * usually signed by the same CA, so the intermediates are parsed and stored
+ * only once.
+ *
+ * @hlist	- entry in the hash table of all the chains;
+ * @refcnt	- number of certificates using the chain;
+ * @key		- hash of @pem;
+ * @len		- length of @pem;
+ * @pem		- PEM text of the chain;
+ * @crt		- the parsed chain;
+ */
 typedef struct {
-	TlsX509Crt	crt;
-	TlsPkCtx	key;
-	unsigned int	conf_stage;
+	struct hlist_node	hlist;
+	unsigned int		refcnt;
+	unsigned long		key;
+	size_t			len;
+	char			*pem;
+	TlsX509Crt		crt;
+} TfwTlsChain;
+
+/**
+ * Certificate and key pair of a vhost.
+ *
+ * @crt		- the leaf certificate followed by the intermediates;
+ * @key		- the private key;
+ * @conf_stage	- directives met so far;
+ * @ocsp	- stapled OCSP response;
+ * @chain	- the shared intermediates chain linked to @crt;
+ * @load	- entry in the list of pairs to parse at the end of configuration;
+ * @vhost	- the vhost which the pair belongs to;
+ * @crt_data	- contents of the certificate file until it's parsed;
+ * @key_data	- contents of the key file until it's parsed;
+ */
+typedef struct {
+	TlsX509Crt		crt;
+	TlsPkCtx		key;
+	unsigned int		conf_stage;
+	TfwTlsOcsp		*ocsp;
+	TfwTlsChain		*chain;
+	struct list_head	load;
+	TfwVhost		*vhost;
+	unsigned char		*crt_data;
+	size_t			crt_size;
+	unsigned char		*key_data;
+	size_t			key_size;
 } TlsCertConf;
 
 typedef struct {
@@ -39,6 +106,28 @@ typedef struct {
 	unsigned int	init_done:1;
 } TlsConfEntry;
 
+static LIST_HEAD(tfw_tls_ocsp_list);
+static DEFINE_SPINLOCK(tfw_tls_ocsp_lock);
+static void tfw_tls_ocsp_refresh(struct work_struct *work);
+static DECLARE_DELAYED_WORK(tfw_tls_ocsp_work, tfw_tls_ocsp_refresh);
+
+static DEFINE_HASHTABLE(tfw_tls_chains, TFW_TLS_CHAIN_HBITS);
+static DEFINE_SPINLOCK(tfw_tls_chains_lock);
+
+/*
+ * Certificates and keys are only read while the configuration is parsed and
+ * are parsed at the end of it on all the online CPUs at once, see
+ * tfw_tls_cert_load_all().
+ */
+static LIST_HEAD(tfw_tls_load_list);
+static struct {
+	TlsCertConf	**confs;
+	unsigned int	n;
+	atomic_t	next;
+	atomic_t	err;
+} tfw_tls_load;
+static DEFINE_PER_CPU(struct work_struct, tfw_tls_load_work);
+
 size_t tfw_tls_vhost_priv_data_sz(void)
 {
 	return sizeof(TlsConfEntry);
@@ -124,34 +213,271 @@ tfw_tls_set_cert(TfwVhost *vhost, TfwCfgSpec *cs, TfwCfgEntry *ce)
 		return r;
 	if (!(conf = tfw_tls_get_cert_conf(vhost, TFW_TLS_CFG_F_CERT)))
 		return -EINVAL;
+	INIT_LIST_HEAD(&conf->load);
+	conf->vhost = vhost;
 
-	if (tfw_cfg_check_single_val(ce))
+	if (tfw_cfg_check_val_n(ce, 1) || ce->have_children)
 		return -EINVAL;
+	if (ce->attr_n > 1
+	    || (ce->attr_n && strcasecmp(ce->attrs[0].key, "ocsp")))
+	{
+		T_ERR_NL("%s: only 'ocsp' attribute is allowed\n", cs->name);
+		return -EINVAL;
+	}
+	if (ce->attr_n) {
+		if (!(conf->ocsp = kzalloc(sizeof(TfwTlsOcsp), GFP_KERNEL)))
+			return -ENOMEM;
+		INIT_LIST_HEAD(&conf->ocsp->list);
+		conf->ocsp->vhost = vhost;
+		conf->ocsp->path = kstrdup(ce->attrs[0].val, GFP_KERNEL);
+		if (!conf->ocsp->path)
+			return -ENOMEM;
+	}
 
 	ttls_x509_crt_init(&conf->crt);
-	/* Preserve 3 bytes for the certificate length. */
+	/* The certificate is parsed along with the key. */
 	crt_data = tfw_cfg_read_file(ce->vals[0], &crt_size);
 	if (!crt_data) {
 		T_ERR_NL("%s: Can't read certificate file '%s'\n",
 			 ce->name, ce->vals[0]);
 		return -EINVAL;
 	}
+	conf->crt_data = crt_data;
+	conf->crt_size = crt_size;
+
+	return 0;
+}
+
+/**
+ * Staple the OCSP response from the file. The file is updated by an external
+ * agent, so failures aren't fatal: the previous response is kept, or the
+ * certificate is sent without a response at all. The agent should replace
+ * the file atomically, e.g. by rename(2).
+ */
+static void
+tfw_tls_ocsp_load(TfwTlsOcsp *ocsp)
+{
+	unsigned char *data;
+	size_t sz;
+	int r;
+
+	if (!(data = tfw_cfg_read_file(ocsp->path, &sz))) {
+		T_WARN_NL("TLS: can't read OCSP response '%s'\n", ocsp->path);
+		return;
+	}
+	/* The buffer size includes the terminating zero. */
+	if ((r = ttls_key_cert_set_ocsp(ocsp->kc, data, sz - 1)))
+		T_WARN_NL("TLS: can't staple OCSP response '%s' (%d)\n",
+			  ocsp->path, r);
+	kfree(data);
+}
+
+/**
+ * Reread all the stapled responses. A vhost can be released concurrently, so
+ * each entry is processed only if its vhost is still alive, and the entries
+ * are moved to the end of the list, so tfw_tls_cert_clean() can unlink them
+ * any time.
+ */
+static void
+tfw_tls_ocsp_refresh(struct work_struct *work)
+{
+	TfwTlsOcsp *ocsp;
+	LIST_HEAD(todo);
+
+	spin_lock_bh(&tfw_tls_ocsp_lock);
+	list_splice_init(&tfw_tls_ocsp_list, &todo);
+	while (!list_empty(&todo)) {
+		ocsp = list_first_entry(&todo, TfwTlsOcsp, list);
+		list_move_tail(&ocsp->list, &tfw_tls_ocsp_list);
+		if (!atomic64_inc_not_zero(&ocsp->vhost->refcnt))
+			continue;
+		spin_unlock_bh(&tfw_tls_ocsp_lock);
+
+		tfw_tls_ocsp_load(ocsp);
+		tfw_vhost_put(ocsp->vhost);
+		cond_resched();
+
+		spin_lock_bh(&tfw_tls_ocsp_lock);
+	}
+	spin_unlock_bh(&tfw_tls_ocsp_lock);
+
+	schedule_delayed_work(&tfw_tls_ocsp_work, TFW_TLS_OCSP_REFRESH);
+}
+
+void
+tfw_tls_ocsp_start(void)
+{
+	schedule_delayed_work(&tfw_tls_ocsp_work, TFW_TLS_OCSP_REFRESH);
+}
+
+void
+tfw_tls_ocsp_stop(void)
+{
+	cancel_delayed_work_sync(&tfw_tls_ocsp_work);
+}
+
+static void
+tfw_tls_chain_put(TfwTlsChain *chain)
+{
+	spin_lock_bh(&tfw_tls_chains_lock);
+	if (--chain->refcnt) {
+		spin_unlock_bh(&tfw_tls_chains_lock);
+		return;
+	}
+	hash_del(&chain->hlist);
+	spin_unlock_bh(&tfw_tls_chains_lock);
+
+	ttls_x509_crt_free(&chain->crt);
+	kfree(chain->pem);
+	kfree(chain);
+}
+
+static TfwTlsChain *
+__tfw_tls_chain_lookup(const char *pem, size_t len, unsigned long key)
+{
+	TfwTlsChain *chain;
+
+	hash_for_each_possible(tfw_tls_chains, chain, hlist, key)
+		if (chain->key == key && chain->len == len
+		    && !memcmp(chain->pem, pem, len))
+		{
+			chain->refcnt++;
+			return chain;
+		}
+	return NULL;
+}
+
+/**
+ * Find the chain of intermediate certificates by the PEM text @pem of
+ * length @len, including the terminating zero, or parse a new one.
+ */
+static TfwTlsChain *
+tfw_tls_chain_get(char *pem, size_t len, int *r)
+{
+	TfwTlsChain *chain, *dup;
+	unsigned long key = hash_calc(pem, len);
+
+	spin_lock_bh(&tfw_tls_chains_lock);
+	chain = __tfw_tls_chain_lookup(pem, len, key);
+	spin_unlock_bh(&tfw_tls_chains_lock);
+	if (chain)
+		return chain;
+
+	*r = -ENOMEM;
+	if (!(chain = kzalloc(sizeof(TfwTlsChain), GFP_KERNEL)))
+		return NULL;
+	if (!(chain->pem = kmemdup(pem, len, GFP_KERNEL))) {
+		kfree(chain);
+		return NULL;
+	}
+	chain->key = key;
+	chain->len = len;
+	chain->refcnt = 1;
+	/* The text is decoded in place. */
+	if ((*r = ttls_x509_crt_parse(&chain->crt, (unsigned char *)pem,
+				      len)))
+	{
+		ttls_x509_crt_free(&chain->crt);
+		kfree(chain->pem);
+		kfree(chain);
+		return NULL;
+	}
+
+	/* The same chain might be parsed on another CPU concurrently. */
+	spin_lock_bh(&tfw_tls_chains_lock);
+	if (!(dup = __tfw_tls_chain_lookup(chain->pem, len, key)))
+		hash_add(tfw_tls_chains, &chain->hlist, key);
+	spin_unlock_bh(&tfw_tls_chains_lock);
+	if (dup) {
+		tfw_tls_chain_put(chain);
+		chain = dup;
+	}
 
-	r = ttls_x509_crt_parse(&conf->crt, crt_data, crt_size);
+	return chain;
+}
+
+/**
+ * Parse the certificate file. PEM files may have the intermediate
+ * certificates after the leaf one, they're shared with other certificates
+ * having the same intermediates.
+ */
+static int
+tfw_tls_cert_parse(TlsCertConf *conf)
+{
+	char *data = (char *)conf->crt_data, *tail;
+	size_t size = conf->crt_size;
+	int r = 0;
+
+	if (!size || data[size - 1]
+	    || !(tail = strstr(data, TFW_TLS_PEM_BEGIN))
+	    || !(tail = strstr(tail + 1, TFW_TLS_PEM_BEGIN)))
+	{
+		return ttls_x509_crt_parse(&conf->crt, conf->crt_data, size);
+	}
+
+	if (!(conf->chain = tfw_tls_chain_get(tail, data + size - tail, &r)))
+		return r;
+	*tail = '\0';
+	r = ttls_x509_crt_parse(&conf->crt, conf->crt_data, tail - data + 1);
 	if (r)
-		T_ERR_NL("%s: Invalid certificate specified (%x)\n",
-			 cs->name, -r);
+		return r;
+	conf->crt.next = &conf->chain->crt;
 
-	kfree(crt_data);
+	return 0;
+}
 
-	return r;
+/**
+ * Parse the certificate and the key read by the configuration handlers.
+ */
+static int
+tfw_tls_cert_load(TlsCertConf *conf)
+{
+	const char *vh_name = conf->vhost->name.data;
+	int r;
+
+	r = tfw_tls_cert_parse(conf);
+	kfree(conf->crt_data);
+	conf->crt_data = NULL;
+	if (r) {
+		T_ERR_NL("TLS: vhost '%s': invalid certificate specified (%x)\n",
+			 vh_name, -r);
+		return -EINVAL;
+	}
+
+	r = ttls_pk_parse_key(&conf->key, conf->key_data, conf->key_size);
+	/* The key is copied, so free the paged data. */
+	memzero_explicit(conf->key_data, conf->key_size);
+	kfree(conf->key_data);
+	conf->key_data = NULL;
+	if (r) {
+		T_ERR_NL("TLS: vhost '%s': invalid private key specified (%x)\n",
+			 vh_name, -r);
+		return -EINVAL;
+	}
+
+	return 0;
 }
 
-int
-tfw_tls_cert_cfg_finish_cert(TfwVhost *vhost)
+static void
+tfw_tls_load_work_fn(struct work_struct *work)
 {
-	TlsConfEntry *conf_entry = vhost->tls_cfg.priv;
-	TlsCertConf *conf = &conf_entry->certs[conf_entry->certs_num];
+	unsigned int i;
+
+	while (!atomic_read(&tfw_tls_load.err)
+	       && (i = atomic_inc_return(&tfw_tls_load.next) - 1)
+		  < tfw_tls_load.n)
+	{
+		if (tfw_tls_cert_load(tfw_tls_load.confs[i]))
+			atomic_set(&tfw_tls_load.err, 1);
+		cond_resched();
+	}
+}
+
+static int
+tfw_tls_cert_cfg_finish_cert(TlsCertConf *conf)
+{
+	TfwVhost *vhost = conf->vhost;
+	TlsKeyCert *kc;
 	int r;
 
 	r = ttls_conf_own_cert(&vhost->tls_cfg, &conf->crt, &conf->key,
@@ -160,7 +486,16 @@ tfw_tls_cert_cfg_finish_cert(TfwVhost *vhost)
 		T_ERR_NL("TLS: can't set own certificate (%x)\n", r);
 		return -EINVAL;
 	}
-	conf_entry->certs_num++;
+
+	if (conf->ocsp) {
+		for (kc = vhost->tls_cfg.key_cert; kc->next; kc = kc->next)
+			;
+		conf->ocsp->kc = kc;
+		tfw_tls_ocsp_load(conf->ocsp);
+		spin_lock_bh(&tfw_tls_ocsp_lock);
+		list_add_tail(&conf->ocsp->list, &tfw_tls_ocsp_list);
+		spin_unlock_bh(&tfw_tls_ocsp_lock);
+	}
 
 	return 0;
 }
@@ -197,17 +532,67 @@ tfw_tls_set_cert_key(TfwVhost *vhost, TfwCfgSpec *cs, TfwCfgEntry *ce)
 			 ce->name, ce->vals[0]);
 		return -EINVAL;
 	}
+	conf->key_data = key_data;
+	conf->key_size = key_size;
+	((TlsConfEntry *)vhost->tls_cfg.priv)->certs_num++;
+	list_add_tail(&conf->load, &tfw_tls_load_list);
 
-	r = ttls_pk_parse_key(&conf->key, key_data, key_size);
-	/* The key is copied, so free the paged data. */
-	kfree(key_data);
-	if (r) {
-		T_ERR_NL("%s: Invalid private key specified (%x)\n",
-			 cs->name, -r);
-		return -EINVAL;
+	return 0;
+}
+
+/**
+ * Parse all the certificates and keys of the configuration. Parsing keys and
+ * certificates involves heavy public key math, so it's done in parallel on
+ * all the online CPUs: there can be tens of thousands of vhosts. Works are
+ * bound to the CPUs since the math uses per-CPU memory pools. Then the pairs
+ * are bound to the vhosts in the configuration order.
+ */
+int
+tfw_tls_cert_load_all(void)
+{
+	TlsCertConf *conf, *tmp;
+	unsigned int n = 0;
+	int cpu, r = 0;
+
+	list_for_each_entry(conf, &tfw_tls_load_list, load)
+		++n;
+	if (!n)
+		return 0;
+
+	tfw_tls_load.confs = kvmalloc_array(n, sizeof(conf), GFP_KERNEL);
+	if (!tfw_tls_load.confs) {
+		r = -ENOMEM;
+		goto out;
+	}
+	tfw_tls_load.n = 0;
+	list_for_each_entry(conf, &tfw_tls_load_list, load)
+		tfw_tls_load.confs[tfw_tls_load.n++] = conf;
+	atomic_set(&tfw_tls_load.next, 0);
+	atomic_set(&tfw_tls_load.err, 0);
+
+	cpus_read_lock();
+	for_each_online_cpu(cpu) {
+		struct work_struct *w = per_cpu_ptr(&tfw_tls_load_work, cpu);
+
+		INIT_WORK(w, tfw_tls_load_work_fn);
+		queue_work_on(cpu, system_highpri_wq, w);
+	}
+	for_each_online_cpu(cpu)
+		flush_work(per_cpu_ptr(&tfw_tls_load_work, cpu));
+	cpus_read_unlock();
+
+	kvfree(tfw_tls_load.confs);
+	tfw_tls_load.confs = NULL;
+	if (atomic_read(&tfw_tls_load.err))
+		r = -EINVAL;
+out:
+	list_for_each_entry_safe(conf, tmp, &tfw_tls_load_list, load) {
+		list_del_init(&conf->load);
+		if (!r)
+			r = tfw_tls_cert_cfg_finish_cert(conf);
 	}
 
-	return tfw_tls_cert_cfg_finish_cert(vhost);
+	return r;
 }
 
 int
@@ -236,6 +621,13 @@ tfw_tls_cleanup_tls_cert(TlsCertConf *conf)
 {
 	if (!(conf->conf_stage & TFW_TLS_CFG_F_CERT))
 		return;
+	/* The vhost is released before the configuration is done. */
+	list_del(&conf->load);
+	kfree(conf->crt_data);
+	if (conf->chain) {
+		conf->crt.next = NULL;
+		tfw_tls_chain_put(conf->chain);
+	}
 	ttls_x509_crt_free(&conf->crt);
 }
 
@@ -244,15 +636,38 @@ tfw_tls_cleanup_tls_ckey(TlsCertConf *conf)
 {
 	if (!(conf->conf_stage & TFW_TLS_CFG_F_CKEY))
 		return;
+	if (conf->key_data) {
+		memzero_explicit(conf->key_data, conf->key_size);
+		kfree(conf->key_data);
+	}
 	ttls_pk_free(&conf->key);
 }
 
+/*
+ * Called before the certificates are freed. The vhost is dead, so the refresh
+ * work doesn't use the entry, but may still move it in the list.
+ */
+static void
+tfw_tls_cleanup_ocsp(TlsCertConf *conf)
+{
+	if (!conf->ocsp)
+		return;
+	spin_lock_bh(&tfw_tls_ocsp_lock);
+	list_del(&conf->ocsp->list);
+	spin_unlock_bh(&tfw_tls_ocsp_lock);
+	kfree(conf->ocsp->path);
+	kfree(conf->ocsp);
+	conf->ocsp = NULL;
+}
+
 void
 tfw_tls_cert_clean(TfwVhost *vhost)
 {
 	TlsConfEntry *conf = vhost->tls_cfg.priv;
 	int i;
 
+	for (i = 0; i < TLS_CONF_CERT_NUM; i++)
+		tfw_tls_cleanup_ocsp(&conf->certs[i]);
 	ttls_key_cert_free(vhost->tls_cfg.key_cert);
 	for (i = 0; i < TLS_CONF_CERT_NUM; i++) {
 		TlsCertConf *cconf = &conf->certs[i];
@@ -263,11 +678,39 @@ tfw_tls_cert_clean(TfwVhost *vhost)
 	ttls_config_peer_free(&vhost->tls_cfg);
 }
 
+/**
+ * Read a ticket secret shared by all the cluster nodes from @path. The file is
+ * distributed and rotated by the cluster management tools, so the secret
+ * doesn't appear in the configuration. Trailing white spaces, e.g. the new
+ * line, are ignored. Return the secret and its length in @len or NULL.
+ */
+static const char *
+tfw_tls_read_secret(const char *path, char **buf, size_t *len)
+{
+	size_t sz;
+
+	if (!(*buf = tfw_cfg_read_file(path, &sz)))
+		return NULL;
+
+	/* The buffer size includes the terminating zero. */
+	for (*len = sz - 1; *len && isspace((*buf)[*len - 1]); --*len)
+		;
+	if (!*len) {
+		memzero_explicit(*buf, sz);
+		kfree(*buf);
+		*buf = NULL;
+		return NULL;
+	}
+
+	return *buf;
+}
+
 int
 tfw_tls_set_tickets(TfwVhost *vhost, TfwCfgSpec *cs, TfwCfgEntry *ce)
 {
 	bool enabled = true;
 	const char *secret = NULL;
+	char *secret_buf = NULL;
 	size_t secret_len = 0;
 	unsigned long lifetime = 0;
 	TfwCfgEntry ce_tmp;
@@ -297,13 +740,25 @@ tfw_tls_set_tickets(TfwVhost *vhost, TfwCfgSpec *cs, TfwCfgEntry *ce)
 	if (enabled) {
 		TFW_CFG_ENTRY_FOR_EACH_ATTR(ce, i, key, val) {
 			if (!strcasecmp(key, "secret")) {
+				if (secret)
+					goto err_dup_secret;
 				secret = val;
 				secret_len = strlen(val);
+			} else if (!strcasecmp(key, "secret_file")) {
+				if (secret)
+					goto err_dup_secret;
+				secret = tfw_tls_read_secret(val, &secret_buf,
+							     &secret_len);
+				if (!secret) {
+					T_ERR_NL("%s: can't read secret from "
+						 "'%s'\n", cs->name, val);
+					return -EINVAL;
+				}
 			} else if (!strcasecmp(key, "lifetime")) {
 				if ((r = tfw_cfg_parse_long(val, &lifetime))) {
 					T_ERR_NL("%s: can't parse '%s' argument!"
 						 "\n", cs->name, key);
-					return r;
+					goto out;
 				}
 				if (lifetime > 5 * TTLS_DEFAULT_TICKET_LIFETIME)
 					T_WARN_NL("%s: setting too long ticket"
@@ -314,11 +769,23 @@ tfw_tls_set_tickets(TfwVhost *vhost, TfwCfgSpec *cs, TfwCfgEntry *ce)
 			} else {
 				T_ERR_NL("%s: unsupported argument: '%s=%s'.\n",
 					 cs->name, key, val);
-				return -EINVAL;
+				r = -EINVAL;
+				goto out;
 			}
 		}
 	}
 
-	return ttls_conf_tickets(&vhost->tls_cfg, enabled, lifetime, secret,
-				 secret_len, vhost->name.data, vhost->name.len);
+	r = ttls_conf_tickets(&vhost->tls_cfg, enabled, lifetime, secret,
+			      secret_len, vhost->name.data, vhost->name.len);
+out:
+	if (secret_buf) {
+		memzero_explicit(secret_buf, secret_len);
+		kfree(secret_buf);
+	}
+	return r;
+err_dup_secret:
+	T_ERR_NL("%s: only one of 'secret' and 'secret_file' can be set\n",
+		 cs->name);
+	r = -EINVAL;
+	goto out;
 }
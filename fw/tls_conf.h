@@ -29,7 +29,10 @@ int tfw_tls_set_cert_key(TfwVhost *vhost, TfwCfgSpec *cs, TfwCfgEntry *ce);
 int tfw_tls_set_tickets(TfwVhost *vhost, TfwCfgSpec *cs, TfwCfgEntry *ce);
 
 int tfw_tls_cert_cfg_finish(TfwVhost *vhost);
+int tfw_tls_cert_load_all(void);
 void tfw_tls_cert_clean(TfwVhost *vhost);
+void tfw_tls_ocsp_start(void);
+void tfw_tls_ocsp_stop(void);
 
 size_t tfw_tls_vhost_priv_data_sz(void);
 
@@ -0,0 +1,281 @@
+/**
+ *		Tempesta FW
+ *
+ * Server side TLS session cache for resumption by session ID.
+ *
+ * Full handshakes store their sessions in a TDB table, the sessions are keyed
+ * by the session ID and are evicted by the table timers after the configured
+ * lifetime. Each CPU keeps a small direct mapped front cache of the sessions
+ * in front of the table, so a client reconnecting through the same CPU, which
+ * is the common case with RSS, doesn't touch the shared table at all.
+ *
+ * The table entries are plain data, so the table can be shared between
+ * Tempesta FW nodes by copying the records through libtdb. Timers of copied
+ * records aren't armed, that's why the session age is checked on each lookup.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "lib/hash.h"
+#include "lib/common.h"
+#include "lib/str.h"
+#include "hash.h"
+#include "cfg.h"
+#include "log.h"
+#include "tempesta_fw.h"
+#include "tdb.h"
+#include "vhost.h"
+
+/* Number of sessions in the per-CPU front cache, must be a power of 2. */
+#define TFW_TLS_SESS_FRONT	64
+
+static struct {
+	unsigned int	db_size;
+	const char	*db_path;
+	unsigned int	lifetime;
+} tls_sess_cfg __read_mostly;
+
+/**
+ * Cached TLS session.
+ *
+ * @start	- the session start time, seconds;
+ * @vhost	- hash of the vhost name, a session can't be resumed for
+ *		  another vhost;
+ * @etm		- Encrypt-then-MAC flag of the session;
+ * @ciphersuite	- the session ciphersuite;
+ * @id		- the session ID;
+ * @master	- the master secret;
+ */
+typedef struct {
+	long		start;
+	unsigned long	vhost;
+	int		etm;
+	unsigned short	ciphersuite;
+	unsigned char	id[TTLS_SESS_ID_LEN];
+	unsigned char	master[TTLS_SESS_SECRET_LEN];
+} TfwTlsSessData;
+
+/**
+ * TLS session tdb entry.
+ *
+ * @d		- the session data;
+ * @timer	- removes the entry from the table after the session lifetime;
+ */
+typedef struct {
+	TfwTlsSessData	d;
+	TdbTimer	timer;
+} TfwTlsSessEntry;
+
+static TDB *tls_sess_db;
+static DEFINE_PER_CPU(TfwTlsSessData [TFW_TLS_SESS_FRONT], tls_sess_front);
+
+static unsigned long
+tfw_tls_sess_vhost(TlsCtx *tls)
+{
+	return tfw_hash_str(&tfw_vhost_from_tls_conf(tls->peer_conf)->name);
+}
+
+static bool
+tfw_tls_sess_match(const TfwTlsSessData *d, TlsCtx *tls, unsigned long vhost)
+{
+	long age = tfw_current_timestamp() - d->start;
+
+	return d->start && d->vhost == vhost
+	       && age >= 0 && age <= tls_sess_cfg.lifetime
+	       && !memcmp_fast(d->id, tls->sess.id, TTLS_SESS_ID_LEN);
+}
+
+static void
+tfw_tls_sess_copy(TlsSess *sess, const TfwTlsSessData *d)
+{
+	sess->start = d->start;
+	sess->etm = d->etm;
+	sess->ciphersuite = d->ciphersuite;
+	memcpy_fast(sess->master, d->master, sizeof(sess->master));
+}
+
+/**
+ * Look up the session ID sent by the client in the front cache of the
+ * current CPU and then in the table. A session found in the table is moved
+ * to the front cache.
+ */
+static int
+tfw_tls_sess_get(TlsCtx *tls, TlsSess *sess)
+{
+	TfwTlsSessData *fd;
+	TdbIter iter;
+	unsigned long key, vhost = tfw_tls_sess_vhost(tls);
+
+	key = hash_calc((const char *)tls->sess.id, TTLS_SESS_ID_LEN);
+	fd = this_cpu_ptr(&tls_sess_front[key & (TFW_TLS_SESS_FRONT - 1)]);
+	if (tfw_tls_sess_match(fd, tls, vhost)) {
+		tfw_tls_sess_copy(sess, fd);
+		return 0;
+	}
+
+	iter = tdb_rec_get(tls_sess_db, key);
+	while (!TDB_ITER_BAD(iter)) {
+		TfwTlsSessEntry *ent = (TfwTlsSessEntry *)iter.rec->data;
+
+		if (tfw_tls_sess_match(&ent->d, tls, vhost)) {
+			tfw_tls_sess_copy(sess, &ent->d);
+			*fd = ent->d;
+			tdb_rec_put(iter.rec);
+			return 0;
+		}
+		tdb_rec_next(tls_sess_db, &iter);
+	}
+
+	return -ENOENT;
+}
+
+/**
+ * Store the session of a full handshake. Session IDs are random, so there
+ * is no need to look for an existing entry with the same ID.
+ */
+static void
+tfw_tls_sess_put(TlsCtx *tls)
+{
+	TfwTlsSessEntry ent = {}, *e;
+	TfwTlsSessData *fd;
+	TdbRec *rec;
+	unsigned long key;
+	size_t len = sizeof(TfwTlsSessEntry);
+
+	key = hash_calc((const char *)tls->sess.id, TTLS_SESS_ID_LEN);
+	fd = this_cpu_ptr(&tls_sess_front[key & (TFW_TLS_SESS_FRONT - 1)]);
+	fd->start = tls->sess.start;
+	fd->vhost = tfw_tls_sess_vhost(tls);
+	fd->etm = tls->sess.etm;
+	fd->ciphersuite = tls->sess.ciphersuite;
+	memcpy_fast(fd->id, tls->sess.id, TTLS_SESS_ID_LEN);
+	memcpy_fast(fd->master, tls->sess.master, TTLS_SESS_SECRET_LEN);
+
+	/* Insert the complete entry, so lookups never see a partial one. */
+	ent.d = *fd;
+	rec = tdb_entry_create(tls_sess_db, key, &ent, &len);
+	memzero_explicit(&ent, sizeof(ent));
+	if (!rec) {
+		T_DBG("cannot allocate TDB space for TLS session\n");
+		return;
+	}
+	e = (TfwTlsSessEntry *)rec->data;
+	tdb_timer_init(&e->timer, rec);
+	tdb_timer_add(tls_sess_db, &e->timer,
+		      jiffies + (unsigned long)tls_sess_cfg.lifetime * HZ);
+}
+
+/**
+ * Wipe the master secrets from the front caches.
+ */
+static void
+tfw_tls_sess_front_clear(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memzero_explicit(per_cpu_ptr(tls_sess_front, cpu),
+				 sizeof(tls_sess_front));
+}
+
+static int
+tfw_tls_sess_start(void)
+{
+	if (tfw_runstate_is_reconfig() || !tls_sess_cfg.lifetime)
+		return 0;
+	/* Timers require the entries to never move. */
+	BUILD_BUG_ON(sizeof(TfwTlsSessEntry) <= TDB_HTRIE_MINDREC);
+	tls_sess_db = tdb_open(tls_sess_cfg.db_path, tls_sess_cfg.db_size,
+			       tls_sess_cfg.db_size, sizeof(TfwTlsSessEntry),
+			       numa_node_id());
+	if (!tls_sess_db)
+		return -EINVAL;
+	if (tdb_timers_init(tls_sess_db, NULL)) {
+		tdb_close(tls_sess_db);
+		tls_sess_db = NULL;
+		return -ENOMEM;
+	}
+	/* The entries are linked into the timer wheel. */
+	tdb_set_owner(tls_sess_db, NULL);
+	ttls_register_sess_cache_cb(tfw_tls_sess_get, tfw_tls_sess_put);
+
+	return 0;
+}
+
+static void
+tfw_tls_sess_stop(void)
+{
+	if (tfw_runstate_is_reconfig() || !tls_sess_db)
+		return;
+	ttls_register_sess_cache_cb(NULL, NULL);
+	synchronize_net();
+	tfw_tls_sess_front_clear();
+	tdb_close(tls_sess_db);
+	tls_sess_db = NULL;
+}
+
+static TfwCfgSpec tfw_tls_sess_specs[] = {
+	{
+		.name = "tls_sess_cache",
+		.deflt = "0",
+		.handler = tfw_cfg_set_int,
+		.dest = &tls_sess_cfg.lifetime,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, 86400 },
+		}
+	},
+	{
+		.name = "tls_sess_tbl_size",
+		.deflt = "16777216",
+		.handler = tfw_cfg_set_int,
+		.dest = &tls_sess_cfg.db_size,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.multiple_of = PAGE_SIZE,
+			.range = { PAGE_SIZE, (1 << 30) },
+		}
+	},
+	{
+		.name = "tls_sess_db",
+		.deflt = "/opt/tempesta/db/tls_sess.tdb",
+		.handler = tfw_cfg_set_str,
+		.dest = &tls_sess_cfg.db_path,
+		.spec_ext = &(TfwCfgSpecStr) {
+			.len_range = { 1, PATH_MAX },
+		}
+	},
+	{ 0 }
+};
+
+TfwMod tfw_tls_sess_mod = {
+	.name	= "tls_sess",
+	.start	= tfw_tls_sess_start,
+	.stop	= tfw_tls_sess_stop,
+	.specs	= tfw_tls_sess_specs,
+};
+
+int __init
+tfw_tls_sess_init(void)
+{
+	tfw_mod_register(&tfw_tls_sess_mod);
+
+	return 0;
+}
+
+void
+tfw_tls_sess_exit(void)
+{
+	tfw_mod_unregister(&tfw_tls_sess_mod);
+}
@@ -0,0 +1,203 @@
+/**
+ *		Tempesta FW
+ *
+ * Tracepoints on the proxy hot path. The disabled tracepoints cost only
+ * a patched out branch, so they're always compiled in and can be attached
+ * to by perf, ftrace or bpftrace, e.g.:
+ *
+ *	perf record -e 'tempesta:*' -a
+ *	bpftrace -e 'tracepoint:tempesta:tfw_cache_lookup { @[args->hit] = count(); }'
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM tempesta
+
+#if !defined(__TFW_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __TFW_TRACE_H__
+
+#include <linux/tracepoint.h>
+
+#include "http.h"
+
+/* Copy address of the @conn peer to @addr, zero it if there is no peer. */
+#define TFW_TRACE_PEER_ADDR(addr, conn)					\
+do {									\
+	if ((conn) && (conn)->peer)					\
+		memcpy(addr, &(conn)->peer->addr, sizeof(TfwAddr));	\
+	else								\
+		memset(addr, 0, sizeof(TfwAddr));			\
+} while (0)
+
+DECLARE_EVENT_CLASS(tfw_conn,
+	TP_PROTO(TfwConn *conn),
+	TP_ARGS(conn),
+	TP_STRUCT__entry(
+		__field(void *,		conn)
+		__field(int,		type)
+		__array(u8,		addr,	sizeof(TfwAddr))
+	),
+	TP_fast_assign(
+		__entry->conn = conn;
+		__entry->type = TFW_CONN_TYPE(conn);
+		TFW_TRACE_PEER_ADDR(__entry->addr, conn);
+	),
+	TP_printk("conn=%p type=%#x peer=%pISpc", __entry->conn, __entry->type,
+		  __entry->addr)
+);
+
+/* A client or server connection is established. */
+DEFINE_EVENT(tfw_conn, tfw_conn_open,
+	TP_PROTO(TfwConn *conn),
+	TP_ARGS(conn)
+);
+
+/* A client or server connection is dropped. */
+DEFINE_EVENT(tfw_conn, tfw_conn_close,
+	TP_PROTO(TfwConn *conn),
+	TP_ARGS(conn)
+);
+
+/* A TLS handshake is finished, @state is TTLS_HS_CB_* code. */
+TRACE_EVENT(tfw_tls_hs_done,
+	TP_PROTO(TfwConn *conn, int state),
+	TP_ARGS(conn, state),
+	TP_STRUCT__entry(
+		__field(void *,		conn)
+		__field(int,		state)
+		__array(u8,		addr,	sizeof(TfwAddr))
+	),
+	TP_fast_assign(
+		__entry->conn = conn;
+		__entry->state = state;
+		TFW_TRACE_PEER_ADDR(__entry->addr, conn);
+	),
+	TP_printk("conn=%p peer=%pISpc state=%d", __entry->conn,
+		  __entry->addr, __entry->state)
+);
+
+/* A request is fully parsed. */
+TRACE_EVENT(tfw_http_req_parsed,
+	TP_PROTO(TfwHttpReq *req),
+	TP_ARGS(req),
+	TP_STRUCT__entry(
+		__field(void *,		req)
+		__field(void *,		conn)
+		__field(unsigned char,	method)
+		__field(unsigned char,	version)
+		__field(unsigned long,	len)
+	),
+	TP_fast_assign(
+		__entry->req = req;
+		__entry->conn = req->conn;
+		__entry->method = req->method;
+		__entry->version = req->version;
+		__entry->len = req->msg.len;
+	),
+	TP_printk("req=%p conn=%p method=%u version=%u len=%lu",
+		  __entry->req, __entry->conn, __entry->method,
+		  __entry->version, __entry->len)
+);
+
+/* A cache lookup for a request has finished. */
+TRACE_EVENT(tfw_cache_lookup,
+	TP_PROTO(TfwHttpReq *req, bool hit),
+	TP_ARGS(req, hit),
+	TP_STRUCT__entry(
+		__field(void *,		req)
+		__field(bool,		hit)
+	),
+	TP_fast_assign(
+		__entry->req = req;
+		__entry->hit = hit;
+	),
+	TP_printk("req=%p hit=%d", __entry->req, __entry->hit)
+);
+
+DECLARE_EVENT_CLASS(tfw_http_req_srv,
+	TP_PROTO(TfwHttpReq *req, TfwSrvConn *srv_conn),
+	TP_ARGS(req, srv_conn),
+	TP_STRUCT__entry(
+		__field(void *,		req)
+		__field(void *,		srv_conn)
+		__array(u8,		addr,	sizeof(TfwAddr))
+	),
+	TP_fast_assign(
+		__entry->req = req;
+		__entry->srv_conn = srv_conn;
+		TFW_TRACE_PEER_ADDR(__entry->addr, srv_conn);
+	),
+	TP_printk("req=%p srv_conn=%p server=%pISpc", __entry->req,
+		  __entry->srv_conn, __entry->addr)
+);
+
+/* A server connection is scheduled for a request, NULL if there is none. */
+DEFINE_EVENT(tfw_http_req_srv, tfw_http_srv_selected,
+	TP_PROTO(TfwHttpReq *req, TfwSrvConn *srv_conn),
+	TP_ARGS(req, srv_conn)
+);
+
+/* A request is sent to a server. */
+DEFINE_EVENT(tfw_http_req_srv, tfw_http_req_fwd,
+	TP_PROTO(TfwHttpReq *req, TfwSrvConn *srv_conn),
+	TP_ARGS(req, srv_conn)
+);
+
+/* A response is fully parsed, it's not paired with the request yet. */
+TRACE_EVENT(tfw_http_resp_received,
+	TP_PROTO(TfwHttpResp *resp),
+	TP_ARGS(resp),
+	TP_STRUCT__entry(
+		__field(void *,		resp)
+		__field(unsigned short,	status)
+		__field(unsigned long,	len)
+		__array(u8,		addr,	sizeof(TfwAddr))
+	),
+	TP_fast_assign(
+		__entry->resp = resp;
+		__entry->status = resp->status;
+		__entry->len = resp->msg.len;
+		TFW_TRACE_PEER_ADDR(__entry->addr, resp->conn);
+	),
+	TP_printk("resp=%p server=%pISpc status=%u len=%lu", __entry->resp,
+		  __entry->addr, __entry->status, __entry->len)
+);
+
+/* Frang has detected a violation of the @check limit by a client. */
+TRACE_EVENT(tfw_frang_block,
+	TP_PROTO(const TfwAddr *addr, const char *check),
+	TP_ARGS(addr, check),
+	TP_STRUCT__entry(
+		__array(u8,		addr,	sizeof(TfwAddr))
+		__string(check,		check)
+	),
+	TP_fast_assign(
+		memcpy(__entry->addr, addr, sizeof(TfwAddr));
+		__assign_str(check, check);
+	),
+	TP_printk("client=%pISc check=\"%s\"", __entry->addr,
+		  __get_str(check))
+);
+
+#endif /* __TFW_TRACE_H__ */
+
+/* Resolved against the repository root in the include paths. */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH fw
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
@@ -17,11 +17,13 @@
  * with this program; if not, write to the Free Software Foundation, Inc.,
  * 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
+#include <linux/ctype.h>
 #include <linux/hashtable.h>
+#include <linux/log2.h>
 #include <linux/slab.h>
 
 #include "tempesta_fw.h"
-#include "hash.h"
+#include "hpack.h"
 #include "http.h"
 #include "http_limits.h"
 #include "http_match.h"
@@ -34,7 +36,27 @@
 #include "client.h"
 #include "tls_conf.h"
 
-#define TFW_VH_HBITS	10
+#define TFW_VH_HBITS	14
+/* Maximum length of a DNS name, RFC 1035 2.3.4. */
+#define TFW_SNI_MAX_LEN	255
+
+/**
+ * SNI index entry. Names of wildcard vhosts, e.g. '*.example.com', are
+ * indexed without the leading asterisk.
+ *
+ * @key		- hash of the lower case vhost name;
+ * @wildcard	- the vhost name is a wildcard;
+ * @vhost	- the vhost, NULL for an empty slot;
+ * @tls_cfg	- TLS configuration for the vhost, own one or the default
+ *		  vhost's one, NULL if there are no certificates for the vhost;
+ */
+typedef struct {
+	unsigned long	key;
+	bool		wildcard;
+	TfwVhost	*vhost;
+	TlsPeerCfg	*tls_cfg;
+} TfwSniEnt;
+
 /**
  * Control object for holding full set of virtual hosts specific for current
  * configuration/reconfiguration stage.
@@ -43,11 +65,21 @@
  *		  current configuration).
  * @expl_dflt	- Flag to indicate explicit configuration of default
  *		  virtual host.
+ * @sni_tbl	- Open addressing hash table built at the end of configuration
+ *		  to resolve TLS server names, it's at least twice as large as
+ *		  the number of vhosts, so the probe sequences are short.
+ * @sni_mask	- Mask of @sni_tbl slot index.
+ * @digest	- Digest of the configuration the vhosts depend on: all of it
+ *		  except vhosts, server groups and HTTP chains, plus the
+ *		  default vhost.
  * @vh_hash	- Hash table with configured virtual hosts.
  */
 typedef struct {
 	TfwVhost	*vhost_dflt;
 	bool		expl_dflt;
+	TfwSniEnt	*sni_tbl;
+	unsigned long	sni_mask;
+	u64		digest;
 	DECLARE_HASHTABLE(vh_hash, TFW_VH_HBITS);
 } TfwVhostList;
 
@@ -190,6 +222,10 @@ tfw_nipdef_match(TfwLocation *loc, unsigned char method, TfwStr *arg)
 	BUG_ON(!loc);
 	BUG_ON(!arg);
 
+	if (loc->nipdef_mpm) {
+		int r = tfw_mpm_match(loc->nipdef_mpm, arg, 1 << method);
+		return r < 0 ? NULL : loc->nipdef[r];
+	}
 	for (i = 0; i < loc->nipdef_sz; ++i) {
 		TfwNipDef *nipdef = loc->nipdef[i];
 		if ((nipdef->method & (1 << method))
@@ -204,8 +240,6 @@ tfw_nipdef_match(TfwLocation *loc, unsigned char method, TfwStr *arg)
  * according to the match operator in the directive. A pointer
  * to the matching TfwCaPolicy structure is returned if the
  * match is found. Null is returned if there's no match.
- *
- * TODO #732 use multi-pattern string matching.
  */
 static inline bool
 __tfw_capolicy_match_fn(TfwCaPolicy *capo, TfwStr *arg)
@@ -224,6 +258,10 @@ tfw_capolicy_match(TfwLocation *loc, TfwStr *arg)
 	BUG_ON(!loc);
 	BUG_ON(!arg);
 
+	if (loc->capo_mpm) {
+		int r = tfw_mpm_match(loc->capo_mpm, arg, ~0U);
+		return r < 0 ? NULL : loc->capo[r];
+	}
 	for (i = 0; i < loc->capo_sz; ++i) {
 		TfwCaPolicy *capo = loc->capo[i];
 		if (__tfw_capolicy_match_fn(capo, arg))
@@ -254,6 +292,10 @@ tfw_location_match(TfwVhost *vhost, TfwStr *arg)
 	BUG_ON(!vhost);
 	BUG_ON(!arg);
 
+	if (vhost->loc_mpm) {
+		int r = tfw_mpm_match(vhost->loc_mpm, arg, ~0U);
+		return r < 0 ? NULL : &vhost->loc[r];
+	}
 	for (i = 0; i < vhost->loc_sz; ++i) {
 		TfwLocation *loc = &vhost->loc[i];
 		if (__tfw_location_match(loc, arg))
@@ -342,6 +384,43 @@ tfw_vhost_get_hdr_mods(TfwLocation *loc, TfwVhost *vhost, int mod_type)
 	return &loc->mod_hdrs[mod_type];
 }
 
+/**
+ * Name of the @loc match operator as in the configuration.
+ */
+const char *
+tfw_location_op_name(const TfwLocation *loc)
+{
+	const TfwCfgEnum *e;
+
+	for (e = tfw_match_enum; e->name; ++e)
+		if (e->value == loc->op)
+			return e->name;
+	return "?";
+}
+
+/**
+ * Sum the per-CPU traffic of @loc into @stat. Only the readers pay for
+ * the aggregation, the counters are updated by their CPUs without locking.
+ */
+void
+tfw_location_stat_collect(const TfwLocation *loc, TfwVhostStat *stat)
+{
+	int cpu, i;
+
+	for_each_online_cpu(cpu) {
+		TfwVhostStat *pcp = per_cpu_ptr(loc->stat, cpu);
+
+		stat->requests += pcp->requests;
+		stat->bytes_in += pcp->bytes_in;
+		stat->bytes_out += pcp->bytes_out;
+		stat->cache_hits += pcp->cache_hits;
+		for (i = 0; i < TFW_VHOST_STATUS_N; ++i)
+			stat->status[i] += pcp->status[i];
+		for (i = 0; i < TFW_VHOST_LAT_BUCKETS; ++i)
+			stat->lat[i] += pcp->lat[i];
+	}
+}
+
 /*
  * ------------------------------------------------------------------------
  *	Configuration processing.
@@ -384,12 +463,23 @@ tfw_vhost_name_match(TfwVhost *vh, const TfwStr *name)
 }
 
 /**
- *  Match vhost to requested name. Can be called in softirq context only.
+ * Vhost names are case-insensitive, so is the hash used to look them up. Hash
+ * the lower case name the same way as the SNI index does.
  */
-static bool
-tfw_vhost_name_match_fast(TfwVhost *vh, const TfwStr *name)
+static unsigned long
+tfw_vhost_name_hash(const TfwStr *name)
 {
-	return !tfw_stricmp(&vh->name, name);
+	char buf[TFW_SNI_MAX_LEN];
+	unsigned long key = 0;
+	size_t off, n;
+
+	for (off = 0; off < name->len; off += n) {
+		n = min_t(size_t, name->len - off, sizeof(buf));
+		tfw_cstrtolower_wo_avx2(buf, name->data + off, n);
+		key = hash_calc_update(buf, n, key);
+	}
+
+	return key;
 }
 
 static inline TfwVhost *
@@ -397,7 +487,7 @@ __tfw_vhost_lookup(TfwVhostList *vh_list, const TfwStr *name,
 		   bool (*match_fn)(TfwVhost *, const TfwStr *))
 {
 	TfwVhost *vhost;
-	unsigned long key = tfw_hash_str(name);
+	unsigned long key = tfw_vhost_name_hash(name);
 
 	hash_for_each_possible(vh_list->vh_hash, vhost, hlist, key) {
 		if (match_fn(vhost, name)) {
@@ -422,26 +512,62 @@ tfw_vhost_lookup_reconfig(const char *name)
 				  tfw_vhost_name_match);
 }
 
+static TfwSniEnt *
+__tfw_vhost_sni_find(TfwVhostList *vh_list, const char *name, size_t len,
+		     bool wildcard)
+{
+	TfwSniEnt *e;
+	unsigned long i, key = hash_calc(name, len);
+
+	for (i = key; (e = &vh_list->sni_tbl[i & vh_list->sni_mask])->vhost;
+	     ++i)
+	{
+		if (e->key == key && e->wildcard == wildcard
+		    && e->vhost->name.len == len + wildcard
+		    && !tfw_cstricmp_2lc(e->vhost->name.data + wildcard, name,
+					 len))
+			return e;
+	}
+	return NULL;
+}
+
 /**
- * Find vhost in the _running_ configuration, matching name @name. The operation
- * involves fast avx2 operations and can be done only in softirq context.
- * If vhost is found, an additional reference is taken. Caller is responsible to
- * release the reference after use.
+ * Find vhost in the _running_ configuration for TLS server name @name, exact
+ * names have priority over wildcard ones. A wildcard matches the left-most
+ * label only, RFC 6125 6.4.3, so a miss costs just one more lookup of the
+ * name without the first label. The operation involves fast avx2 operations
+ * and can be done only in softirq context.
+ *
+ * If vhost is found, an additional reference is taken and @tls_cfg is set to
+ * the TLS configuration for the vhost. Caller is responsible to release the
+ * reference after use.
  */
 TfwVhost *
-tfw_vhost_lookup(const TfwStr *name)
+tfw_vhost_lookup_sni(const TfwStr *name, TlsPeerCfg **tls_cfg)
 {
-	TfwVhost *vhost;
+	char buf[TFW_SNI_MAX_LEN], *dot;
+	TfwVhost *vhost = NULL;
 	TfwVhostList *vhlist;
+	TfwSniEnt *e;
+	size_t len = name->len;
 
-	if (unlikely(TFW_STR_EMPTY(name)))
+	if (unlikely(TFW_STR_EMPTY(name) || len > TFW_SNI_MAX_LEN))
+		return NULL;
+	if (WARN_ON_ONCE(!TFW_STR_PLAIN(name)))
 		return NULL;
+	tfw_cstrtolower(buf, name->data, len);
 
 	rcu_read_lock_bh();
 	vhlist = rcu_dereference_bh(tfw_vhosts);
 	BUG_ON(!vhlist);
-	vhost = __tfw_vhost_lookup(vhlist, name,
-				   tfw_vhost_name_match_fast);
+	e = __tfw_vhost_sni_find(vhlist, buf, len, false);
+	if (!e && (dot = memchr(buf, '.', len)) && dot != buf)
+		e = __tfw_vhost_sni_find(vhlist, dot, buf + len - dot, true);
+	if (e) {
+		vhost = e->vhost;
+		*tls_cfg = e->tls_cfg;
+		tfw_vhost_get(vhost);
+	}
 	rcu_read_unlock_bh();
 
 	return vhost;
@@ -467,6 +593,52 @@ tfw_vhost_lookup_default(void)
 	return vhost;
 }
 
+static int
+__tfw_vhost_for_each_loc(TfwVhost *vhost,
+			 int (*fn)(TfwVhost *, TfwLocation *, void *),
+			 void *data)
+{
+	int i, r;
+
+	if ((r = fn(vhost, vhost->loc_dflt, data)))
+		return r;
+	for (i = 0; i < vhost->loc_sz; ++i)
+		if ((r = fn(vhost, &vhost->loc[i], data)))
+			return r;
+	return 0;
+}
+
+/**
+ * Call @fn for the default and the explicit locations of each vhost of
+ * the running configuration, stop on the first non-zero return code.
+ * @fn is called under RCU read lock and must not sleep. The vhosts are moved
+ * between the lists during reconfiguration, so the caller must not iterate
+ * them at the time.
+ */
+int
+tfw_vhost_for_each_loc(int (*fn)(TfwVhost *, TfwLocation *, void *),
+		       void *data)
+{
+	TfwVhostList *vhlist;
+	TfwVhost *vhost;
+	int b, r = 0;
+
+	rcu_read_lock();
+	if (!(vhlist = rcu_dereference(tfw_vhosts)))
+		goto out;
+	/* The implicit default vhost isn't in the hash table. */
+	if (!vhlist->expl_dflt
+	    && (r = __tfw_vhost_for_each_loc(vhlist->vhost_dflt, fn, data)))
+		goto out;
+	hash_for_each(vhlist->vh_hash, b, vhost, hlist)
+		if ((r = __tfw_vhost_for_each_loc(vhost, fn, data)))
+			break;
+out:
+	rcu_read_unlock();
+
+	return r;
+}
+
 TfwGlobal *
 tfw_vhost_get_global(void)
 {
@@ -671,6 +843,56 @@ tfw_cfgop_out_nonidempotent(TfwCfgSpec *cs, TfwCfgEntry *ce)
 	return tfw_cfgop_nonidempotent(cs, ce, vh_dflt->loc_dflt);
 }
 
+/**
+ * Append header @desc with a value to the precompiled blocks of headers
+ * @h_mods, so that applying of the modifications doesn't need any header
+ * formatting or encoding. The blocks are rebuilt on each added header: that
+ * is done at configuration time only and the number of headers is small.
+ */
+static int
+tfw_cfgop_mod_hdr_compile(TfwPool *pool, TfwHdrMods *h_mods,
+			  TfwHdrModsDesc *desc)
+{
+	char *h1, *p;
+	unsigned char *h2, *end;
+	const TfwStr *name = TFW_STR_CHUNK(desc->hdr, 0);
+	const TfwStr *val = TFW_STR_CHUNK(desc->hdr, 1);
+	size_t h1_len = name->len + SLEN(S_DLM) + val->len + SLEN(S_CRLF);
+	size_t h2_len = name->len + val->len + 3 * HPACK_MAX_INT;
+
+	h1 = tfw_pool_alloc(pool, h_mods->h1_blk.len + h1_len
+				  + h_mods->h2_blk.len + h2_len);
+	if (!h1)
+		return -ENOMEM;
+
+	p = h1 + h_mods->h1_blk.len;
+	memcpy(h1, h_mods->h1_blk.data, h_mods->h1_blk.len);
+	memcpy(p, name->data, name->len);
+	p += name->len;
+	memcpy(p, S_DLM, SLEN(S_DLM));
+	p += SLEN(S_DLM);
+	memcpy(p, val->data, val->len);
+	p += val->len;
+	memcpy(p, S_CRLF, SLEN(S_CRLF));
+
+	h2 = (unsigned char *)h1 + h_mods->h1_blk.len + h1_len;
+	memcpy(h2, h_mods->h2_blk.data, h_mods->h2_blk.len);
+	end = tfw_hpack_srv_write(h2 + h_mods->h2_blk.len,
+				  h2 + h_mods->h2_blk.len + h2_len,
+				  name->data, name->len, val->data, val->len);
+	if (WARN_ON_ONCE(!end))
+		return -EINVAL;
+
+	desc->h1_len = h1_len;
+	desc->h2_len = end - h2 - h_mods->h2_blk.len;
+	h_mods->h1_blk.data = h1;
+	h_mods->h1_blk.len += h1_len;
+	h_mods->h2_blk.data = h2;
+	h_mods->h2_blk.len += desc->h2_len;
+
+	return 0;
+}
+
 static int
 tfw_cfgop_mod_hdr_add(TfwLocation *loc, const char *name, const char *value,
 		      int mod_type, bool append)
@@ -693,6 +915,10 @@ tfw_cfgop_mod_hdr_add(TfwLocation *loc, const char *name, const char *value,
 	desc->hid = (mod_type == TFW_VHOST_HDRMOD_RESP)
 			? tfw_http_msg_resp_spec_hid(hdr)
 			: tfw_http_msg_req_spec_hid(hdr);
+	if (value && tfw_cfgop_mod_hdr_compile(loc->hdrs_pool, h_mods, desc)) {
+		T_WARN_NL("Can't compile header.\n");
+		return -ENOMEM;
+	}
 	++h_mods->sz;
 
 	return 0;
@@ -930,6 +1156,127 @@ tfw_cfgop_capolicy(TfwCfgSpec *cs, TfwCfgEntry *ce, TfwLocation *loc, int cmd)
 	return 0;
 }
 
+/*
+ * Set minimum frequency of requests to a resource for the response to be
+ * admitted to the cache for the location.
+ */
+static int
+tfw_cfgop_cache_admission(TfwCfgSpec *cs, TfwCfgEntry *ce, TfwLocation *loc)
+{
+	int n;
+
+	if (tfw_cfg_check_val_n(ce, 1))
+		return -EINVAL;
+	if (ce->attr_n) {
+		T_ERR_NL("%s: Arguments may not have the '=' sign\n",
+			 cs->name);
+		return -EINVAL;
+	}
+	if (tfw_cfg_parse_int(ce->vals[0], &n)) {
+		T_ERR_NL("%s: \"%s\" isn't a valid value\n", cs->name,
+			 ce->vals[0]);
+		return -EINVAL;
+	}
+	if (tfw_cfg_check_range(n, 0, TFW_CACHE_ADMISSION_MAX))
+		return -EINVAL;
+	loc->cache_admission = n;
+
+	return 0;
+}
+
+static TfwCacheKeyNorm *
+tfw_cfgop_cache_key_get(TfwLocation *loc)
+{
+	if (!loc->cache_key) {
+		loc->cache_key = tfw_pool_alloc(loc->hdrs_pool,
+						sizeof(TfwCacheKeyNorm));
+		if (!loc->cache_key)
+			return NULL;
+		memset(loc->cache_key, 0, sizeof(TfwCacheKeyNorm));
+	}
+
+	return loc->cache_key;
+}
+
+/*
+ * Set the normalization steps of the cache key for the location.
+ */
+static int
+tfw_cfgop_cache_key_normalize(TfwCfgSpec *cs, TfwCfgEntry *ce,
+			      TfwLocation *loc)
+{
+	static const TfwCfgEnum steps[] = {
+		{ "sort_args",		TFW_CACHE_KEY_SORT_ARGS },
+		{ "lowercase_host",	TFW_CACHE_KEY_HOST },
+		{ "strip_fragment",	TFW_CACHE_KEY_FRAGMENT },
+		{}
+	};
+	TfwCacheKeyNorm *kn;
+	int i, step;
+
+	if (!ce->val_n) {
+		T_ERR_NL("%s: at least one step is required\n", cs->name);
+		return -EINVAL;
+	}
+	if (ce->attr_n) {
+		T_ERR_NL("%s: Arguments may not have the '=' sign\n",
+			 cs->name);
+		return -EINVAL;
+	}
+	if (!(kn = tfw_cfgop_cache_key_get(loc)))
+		return -ENOMEM;
+
+	for (i = 0; i < ce->val_n; ++i) {
+		if (tfw_cfg_map_enum(steps, ce->vals[i], &step)) {
+			T_ERR_NL("%s: unknown step '%s'\n", cs->name,
+				 ce->vals[i]);
+			return -EINVAL;
+		}
+		kn->flags |= step;
+	}
+
+	return 0;
+}
+
+/*
+ * Set the names of query arguments excluded from the cache key for the
+ * location, e.g. marketing tracking arguments.
+ */
+static int
+tfw_cfgop_cache_key_drop_args(TfwCfgSpec *cs, TfwCfgEntry *ce,
+			      TfwLocation *loc)
+{
+	TfwCacheKeyNorm *kn;
+	size_t len;
+	char *name;
+	int i;
+
+	if (!ce->val_n || ce->val_n > TFW_CACHE_KEY_DROP_MAX) {
+		T_ERR_NL("%s: from 1 to %d argument names are allowed\n",
+			 cs->name, TFW_CACHE_KEY_DROP_MAX);
+		return -EINVAL;
+	}
+	if (ce->attr_n) {
+		T_ERR_NL("%s: Arguments may not have the '=' sign\n",
+			 cs->name);
+		return -EINVAL;
+	}
+	if (!(kn = tfw_cfgop_cache_key_get(loc)))
+		return -ENOMEM;
+
+	for (i = 0; i < ce->val_n; ++i) {
+		len = strlen(ce->vals[i]);
+		if (!(name = tfw_pool_alloc(loc->hdrs_pool, len)))
+			return -ENOMEM;
+		memcpy(name, ce->vals[i], len);
+		kn->drop[i].data = name;
+		kn->drop[i].len = len;
+	}
+	kn->drop_n = ce->val_n;
+
+	return 0;
+}
+
 /*
  * The configuration parser has recognized the cache policy directive
  * already, so there's no need to spend cycles and convert it again
@@ -939,6 +1286,27 @@ tfw_cfgop_capolicy(TfwCfgSpec *cs, TfwCfgEntry *ce, TfwLocation *loc, int cmd)
  * and for each directive outside of any vhost section (global
  * default location).
  */
+static int
+tfw_cfgop_loc_cache_admission(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	BUG_ON(!tfwcfg_this_location);
+	return tfw_cfgop_cache_admission(cs, ce, tfwcfg_this_location);
+}
+
+static int
+tfw_cfgop_loc_cache_key_normalize(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	BUG_ON(!tfwcfg_this_location);
+	return tfw_cfgop_cache_key_normalize(cs, ce, tfwcfg_this_location);
+}
+
+static int
+tfw_cfgop_loc_cache_key_drop_args(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	BUG_ON(!tfwcfg_this_location);
+	return tfw_cfgop_cache_key_drop_args(cs, ce, tfwcfg_this_location);
+}
+
 static int
 tfw_cfgop_loc_cache_fulfill(TfwCfgSpec *cs, TfwCfgEntry *ce)
 {
@@ -971,6 +1339,29 @@ tfw_cfgop_in_cache_bypass(TfwCfgSpec *cs, TfwCfgEntry *ce)
 				  TFW_D_CACHE_BYPASS);
 }
 
+static int
+tfw_cfgop_in_cache_admission(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	BUG_ON(!tfw_vhost_entry);
+	return tfw_cfgop_cache_admission(cs, ce, tfw_vhost_entry->loc_dflt);
+}
+
+static int
+tfw_cfgop_in_cache_key_normalize(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	BUG_ON(!tfw_vhost_entry);
+	return tfw_cfgop_cache_key_normalize(cs, ce,
+					     tfw_vhost_entry->loc_dflt);
+}
+
+static int
+tfw_cfgop_in_cache_key_drop_args(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	BUG_ON(!tfw_vhost_entry);
+	return tfw_cfgop_cache_key_drop_args(cs, ce,
+					     tfw_vhost_entry->loc_dflt);
+}
+
 static int
 tfw_cfgop_in_http_post_validate(TfwCfgSpec *cs, TfwCfgEntry *ce)
 {
@@ -994,6 +1385,27 @@ tfw_cfgop_out_cache_bypass(TfwCfgSpec *cs, TfwCfgEntry *ce)
 				  TFW_D_CACHE_BYPASS);
 }
 
+static int
+tfw_cfgop_out_cache_admission(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	TfwVhost *vh_dflt = tfw_vhosts_reconfig->vhost_dflt;
+	return tfw_cfgop_cache_admission(cs, ce, vh_dflt->loc_dflt);
+}
+
+static int
+tfw_cfgop_out_cache_key_normalize(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	TfwVhost *vh_dflt = tfw_vhosts_reconfig->vhost_dflt;
+	return tfw_cfgop_cache_key_normalize(cs, ce, vh_dflt->loc_dflt);
+}
+
+static int
+tfw_cfgop_out_cache_key_drop_args(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	TfwVhost *vh_dflt = tfw_vhosts_reconfig->vhost_dflt;
+	return tfw_cfgop_cache_key_drop_args(cs, ce, vh_dflt->loc_dflt);
+}
+
 static int
 tfw_cfgop_out_http_post_validate(TfwCfgSpec *cs, TfwCfgEntry *ce)
 {
@@ -1040,6 +1452,8 @@ tfw_frang_cfg_inherit(FrangVhostCfg *curr, const FrangVhostCfg *from)
 		memcpy(curr->http_ct_vals, from->http_ct_vals, sz);
 		curr->http_ct_vals->vals = (void *)curr->http_ct_vals
 				+ sizeof(FrangCtVals);
+		curr->http_ct_vals->htbl = (void *)curr->http_ct_vals->htbl
+					   - delta;
 		curr->http_ct_vals->data -= delta;
 		/* Restore data pointers. */
 		for (val = curr->http_ct_vals->vals; val->str; ++ val)
@@ -1078,6 +1492,11 @@ tfw_location_init(TfwLocation *loc, tfw_match_t op, const char *arg,
 		kfree(argmem);
 		return -ENOMEM;
 	}
+	if (!(loc->stat = alloc_percpu(TfwVhostStat))) {
+		kfree(data);
+		kfree(argmem);
+		return -ENOMEM;
+	}
 
 	loc->op = op;
 	loc->arg = argmem;
@@ -1271,6 +1690,8 @@ tfw_location_del(TfwLocation *loc)
 		kfree(loc->nipdef[i]);
 	}
 
+	tfw_mpm_free(loc->capo_mpm);
+	tfw_mpm_free(loc->nipdef_mpm);
 	__tfw_frang_clean(loc->frang_cfg);
 	/*
 	 * Free loc->arg and loc->frang_cfg, loc->capo,
@@ -1278,6 +1699,7 @@ tfw_location_del(TfwLocation *loc)
 	 */
 	kfree(loc->arg);
 	kfree(loc->frang_cfg);
+	free_percpu(loc->stat);
 
 	tfw_sg_put(loc->main_sg);
 	tfw_sg_put(loc->backup_sg);
@@ -1531,6 +1953,7 @@ tfw_vhost_destroy(TfwVhost *vhost)
 	for (i = 0; i < vhost->loc_sz; ++i)
 		tfw_location_del(&vhost->loc[i]);
 	tfw_location_del(vhost->loc_dflt);
+	tfw_mpm_free(vhost->loc_mpm);
 	tfw_http_sess_cookie_clean(vhost);
 	tfw_vhost_put(vhost->vhost_dflt);
 	tfw_pool_destroy(vhost->hdrs_pool);
@@ -1612,7 +2035,7 @@ tfw_vhost_new(const char *name)
 static inline void
 tfw_vhost_add(TfwVhost *vhost)
 {
-	unsigned long key = tfw_hash_str(&vhost->name);
+	unsigned long key = tfw_vhost_name_hash(&vhost->name);
 
 	hash_add(tfw_vhosts_reconfig->vh_hash, &vhost->hlist, key);
 	tfw_vhost_get(vhost);
@@ -1680,37 +2103,64 @@ __tfw_cfgop_frang_http_ct_vals(TfwCfgSpec *cs, TfwCfgEntry *ce,
 	char *strs_pos;
 	FrangCtVals *vals;
 	FrangCtVal *vals_pos;
-	size_t i, strs_size, vals_n, vals_size, alloc_sz;
+	size_t i, strs_size, vals_n, vals_size, htbl_size, alloc_sz;
+	unsigned int hbits, mask;
 
 	/* Allocate a single chunk of memory which is suitable to hold the
 	 * variable-sized list of variable-sized strings. See FrangCtVals
 	 * definition for details.
 	 */
 	vals_n = ce->val_n;
+	if (vals_n >= USHRT_MAX) {
+		T_ERR_NL("%s: too many values\n", cs->name);
+		return -EINVAL;
+	}
 	vals_size = sizeof(FrangCtVal) * (vals_n + 1);
+	/* Keep the hash table at most half full. */
+	hbits = order_base_2(vals_n * 2 + 1);
+	htbl_size = sizeof(unsigned short) << hbits;
 	strs_size = 0;
 	TFW_CFG_ENTRY_FOR_EACH_VAL(ce, i, in_str) {
-		strs_size += strlen(in_str) + 1;
+		size_t len = strlen(in_str);
+
+		if (!len || len > FRANG_CT_MAX_LEN
+		    || strpbrk(in_str, "; \t"))
+		{
+			T_ERR_NL("%s: '%s' isn't a media type\n", cs->name,
+				 in_str);
+			return -EINVAL;
+		}
+		strs_size += len + 1;
 	}
-	alloc_sz = vals_size + strs_size + sizeof(FrangCtVals);
+	alloc_sz = vals_size + htbl_size + strs_size + sizeof(FrangCtVals);
 	mem = kzalloc(alloc_sz, GFP_KERNEL);
 	if (!mem)
 		return -ENOMEM;
 	vals = mem;
 	vals->alloc_sz = alloc_sz;
+	vals->hbits = hbits;
 	vals->vals = mem + sizeof(FrangCtVals);
-	vals->data = mem + sizeof(FrangCtVals) + vals_size;
+	vals->htbl = mem + sizeof(FrangCtVals) + vals_size;
+	vals->data = mem + sizeof(FrangCtVals) + vals_size + htbl_size;
+	mask = (1U << hbits) - 1;
 
-	/* Copy tokens to the new vals/strs list. */
-	/* TODO: validate tokens, they should look like: "text/plain". */
+	/* Copy tokens in lower case to the new vals/strs list. */
 	vals_pos = vals->vals;
 	strs_pos = vals->data;
 	TFW_CFG_ENTRY_FOR_EACH_VAL(ce, i, in_str) {
-		size_t len = strlen(in_str) + 1;
+		size_t j, len = strlen(in_str) + 1;
+		unsigned int h;
 
-		memcpy(strs_pos, in_str, len);
+		for (j = 0; j < len; ++j)
+			strs_pos[j] = tolower(in_str[j]);
 		vals_pos->str = strs_pos;
 		vals_pos->len = (len - 1);
+		vals->max_len = max_t(unsigned int, vals->max_len, len - 1);
+
+		h = frang_ct_hash(strs_pos, len - 1) & mask;
+		while (vals->htbl[h])
+			h = (h + 1) & mask;
+		vals->htbl[h] = vals_pos - vals->vals + 1;
 
 		T_DBG3("parsed Content-Type value: '%s'\n", in_str);
 
@@ -1898,6 +2348,56 @@ tfw_cfgop_frang_field_len(TfwCfgSpec *cs, TfwCfgEntry *ce)
 	return r;
 }
 
+/*
+ * The location request limits are accounted by the location identifier, so
+ * they can be set for a particular location only and aren't inherited.
+ */
+static FrangVhostCfg *
+tfw_cfgop_frang_loc_cfg(TfwCfgSpec *cs)
+{
+	static unsigned int loc_id;
+	FrangVhostCfg *cfg;
+
+	if (!tfwcfg_this_location) {
+		T_ERR_NL("Directive '%s' from 'frang_limits' group can be used "
+			 "only inside 'location' directive.\n", cs->name);
+		return NULL;
+	}
+	cfg = tfwcfg_this_location->frang_cfg;
+	if (!cfg->loc_id && !(cfg->loc_id = ++loc_id))
+		cfg->loc_id = ++loc_id;
+
+	return cfg;
+}
+
+static int
+tfw_cfgop_frang_loc_req_rate(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	int r;
+	FrangVhostCfg *cfg = tfw_cfgop_frang_loc_cfg(cs);
+
+	if (!cfg)
+		return -EINVAL;
+	cs->dest = &cfg->loc_req_rate;
+	r = tfw_cfg_set_int(cs, ce);
+	cs->dest = NULL;
+	return r;
+}
+
+static int
+tfw_cfgop_frang_loc_req_burst(TfwCfgSpec *cs, TfwCfgEntry *ce)
+{
+	int r;
+	FrangVhostCfg *cfg = tfw_cfgop_frang_loc_cfg(cs);
+
+	if (!cfg)
+		return -EINVAL;
+	cs->dest = &cfg->loc_req_burst;
+	r = tfw_cfg_set_int(cs, ce);
+	cs->dest = NULL;
+	return r;
+}
+
 static int
 tfw_cfgop_frang_body_len(TfwCfgSpec *cs, TfwCfgEntry *ce)
 {
@@ -2149,13 +2649,14 @@ tfw_vhost_cfgstart(void)
 	TfwVhost *vh_dflt;
 
 	BUG_ON(tfw_vhosts_reconfig);
-	tfw_vhosts_reconfig = kmalloc(sizeof(TfwVhostList), GFP_KERNEL);
+	tfw_vhosts_reconfig = kvmalloc(sizeof(TfwVhostList), GFP_KERNEL);
 	if (!tfw_vhosts_reconfig) {
 		T_ERR_NL("Unable to allocate vhosts' list.\n");
 		return -ENOMEM;
 	}
 
 	tfw_vhosts_reconfig->expl_dflt = false;
+	tfw_vhosts_reconfig->sni_tbl = NULL;
 	hash_init(tfw_vhosts_reconfig->vh_hash);
 	if(!(vh_dflt = tfw_vhost_new(TFW_VH_DFT_NAME))) {
 		T_ERR_NL("Unable to create default vhost.\n");
@@ -2174,31 +2675,270 @@ tfw_vhost_cfgstart(void)
 	return 0;
 }
 
+/*
+ * Encode the whole 'Via' header for HTTP/2 responses once, as literal header
+ * field without indexing with the name from the static table (index 60), so
+ * it's just copied to each response. The value of 'hdr_via' directive can't
+ * be changed on reconfiguration, so the header is built only once.
+ */
 static int
-tfw_vhost_cfgend(void)
+tfw_vhost_hdr_via_h2_build(void)
 {
-	TfwSrvGroup *sg_def;
-	TfwVhost *vh_dflt;
-	int r = 0;
+	TfwHPackInt vlen;
+	size_t len = SLEN(S_VIA_H2_PROTO) + tfw_global.hdr_via_len;
+	char *p;
 
-	*tfw_vhosts_reconfig->vhost_dflt->frang_gconf = tfw_frang_glob_reconfig;
-	/*
-	 * Add default vhost into list if it hadn't been added yet explicitly
-	 * to keep default location policies.
-	 */
-	if (tfw_vhosts_reconfig->expl_dflt)
-		goto err;
-	/*
-	 * Implicit default vhost is still useful even if it's never used to
-	 * forward the traffic. It stores fallback location providing
-	 * default policies and options that can be used before incoming
-	 * request is parsed and assigned to any location.
-	 */
-	vh_dflt = tfw_vhosts_reconfig->vhost_dflt;
-	r = tfw_frang_cfg_inherit(vh_dflt->loc_dflt->frang_cfg,
-				  &tfw_frang_vhost_reconfig);
-	if (r)
-		goto err;
+	if (tfw_global.hdr_via_h2)
+		return 0;
+
+	write_int(len, 0x7F, 0, &vlen);
+	if (!(p = kmalloc(2 + vlen.sz + len, GFP_KERNEL)))
+		return -ENOMEM;
+	tfw_global.hdr_via_h2 = p;
+	tfw_global.hdr_via_h2_len = 2 + vlen.sz + len;
+
+	*p++ = 0x0F;
+	*p++ = 60 - 0x0F;
+	memcpy(p, vlen.buf, vlen.sz);
+	p += vlen.sz;
+	memcpy(p, S_VIA_H2_PROTO, SLEN(S_VIA_H2_PROTO));
+	memcpy(p + SLEN(S_VIA_H2_PROTO), tfw_global.hdr_via,
+	       tfw_global.hdr_via_len);
+
+	return 0;
+}
+
+static TlsPeerCfg *
+tfw_vhost_sni_tls_cfg(TfwVhost *vhost)
+{
+	if (vhost->tls_cfg.key_cert)
+		return &vhost->tls_cfg;
+	if (vhost->vhost_dflt && vhost->vhost_dflt->tls_cfg.key_cert)
+		return &vhost->vhost_dflt->tls_cfg;
+	return NULL;
+}
+
+static void
+tfw_vhost_sni_add(TfwVhostList *vh_list, TfwVhost *vhost)
+{
+	char buf[TFW_SNI_MAX_LEN];
+	TfwSniEnt *e;
+	unsigned long i, key;
+	bool wildcard = vhost->name.len > 2 && vhost->name.data[0] == '*'
+			&& vhost->name.data[1] == '.';
+	size_t len = vhost->name.len - wildcard;
+
+	/* Such a name can never be requested by a client. */
+	if (len > TFW_SNI_MAX_LEN)
+		return;
+	tfw_cstrtolower_wo_avx2(buf, vhost->name.data + wildcard, len);
+	key = hash_calc(buf, len);
+	for (i = key; vh_list->sni_tbl[i & vh_list->sni_mask].vhost; ++i)
+		;
+	e = &vh_list->sni_tbl[i & vh_list->sni_mask];
+	e->key = key;
+	e->wildcard = wildcard;
+	e->vhost = vhost;
+	e->tls_cfg = tfw_vhost_sni_tls_cfg(vhost);
+}
+
+/**
+ * Build the SNI index when all the vhosts and their certificates are
+ * configured, so the TLS handshakes resolve server names in time independent
+ * from the number of vhosts and don't choose the TLS configuration at run
+ * time. The index isn't changed after that and is freed with the vhosts list.
+ */
+static int
+tfw_vhost_sni_build(TfwVhostList *vh_list)
+{
+	TfwVhost *vhost;
+	unsigned long n = 0;
+	int i;
+
+	hash_for_each(vh_list->vh_hash, i, vhost, hlist)
+		++n;
+	n = roundup_pow_of_two(max(n * 2, 2UL));
+	vh_list->sni_tbl = kvcalloc(n, sizeof(TfwSniEnt), GFP_KERNEL);
+	if (!vh_list->sni_tbl)
+		return -ENOMEM;
+	vh_list->sni_mask = n - 1;
+
+	hash_for_each(vh_list->vh_hash, i, vhost, hlist)
+		tfw_vhost_sni_add(vh_list, vhost);
+
+	return 0;
+}
+
+/*
+ * Compile location patterns of a vhost and cache policy and non-idempotent
+ * request patterns of each its location into multi-pattern matchers, so
+ * a request is matched against all of them in a single pass. Patterns are
+ * matched in the order they are defined in the configuration.
+ */
+#define TFW_VHOST_MPM_PATS_MAX	64
+
+static TfwMpm *
+tfw_vhost_mpm_build(TfwMpmPattern *pats, size_t n)
+{
+	TfwMpm *mpm;
+
+	if (!n)
+		return NULL;
+	if (!(mpm = tfw_mpm_build(pats, n)))
+		T_ERR_NL("Unable to build pattern matcher.\n");
+
+	return mpm;
+}
+
+static int
+tfw_location_mpm_build(TfwLocation *loc, TfwMpmPattern *pats)
+{
+	size_t i;
+
+	for (i = 0; i < loc->capo_sz; ++i) {
+		TfwCaPolicy *capo = loc->capo[i];
+		pats[i] = (TfwMpmPattern){ capo->op, ~0U, capo->len, capo->arg };
+	}
+	loc->capo_mpm = tfw_vhost_mpm_build(pats, loc->capo_sz);
+	if (loc->capo_sz && !loc->capo_mpm)
+		return -ENOMEM;
+
+	for (i = 0; i < loc->nipdef_sz; ++i) {
+		TfwNipDef *nipdef = loc->nipdef[i];
+		pats[i] = (TfwMpmPattern){ nipdef->op, nipdef->method,
+					   nipdef->len, nipdef->arg };
+	}
+	loc->nipdef_mpm = tfw_vhost_mpm_build(pats, loc->nipdef_sz);
+	if (loc->nipdef_sz && !loc->nipdef_mpm)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static int
+tfw_vhost_mpm_build_all(TfwVhostList *vh_list)
+{
+	TfwVhost *vhost;
+	TfwMpmPattern *pats;
+	size_t i;
+	int b, r = 0;
+
+	BUILD_BUG_ON(TFW_CAPOLICY_ARRAY_SZ > TFW_VHOST_MPM_PATS_MAX
+		     || TFW_NIPDEF_ARRAY_SZ > TFW_VHOST_MPM_PATS_MAX
+		     || TFW_LOCATION_ARRAY_SZ > TFW_VHOST_MPM_PATS_MAX);
+
+	pats = kmalloc_array(TFW_VHOST_MPM_PATS_MAX, sizeof(*pats), GFP_KERNEL);
+	if (!pats)
+		return -ENOMEM;
+
+	hash_for_each(vh_list->vh_hash, b, vhost, hlist) {
+		/* Reused vhosts keep their matchers. */
+		if (test_bit(TFW_VHOST_B_REUSED, &vhost->flags))
+			continue;
+		for (i = 0; i < vhost->loc_sz; ++i) {
+			TfwLocation *loc = &vhost->loc[i];
+			pats[i] = (TfwMpmPattern){ loc->op, ~0U, loc->len,
+						   loc->arg };
+		}
+		vhost->loc_mpm = tfw_vhost_mpm_build(pats, vhost->loc_sz);
+		if (vhost->loc_sz && !vhost->loc_mpm) {
+			r = -ENOMEM;
+			break;
+		}
+		for (i = 0; i < vhost->loc_sz && !r; ++i)
+			r = tfw_location_mpm_build(&vhost->loc[i], pats);
+		if (r || (r = tfw_location_mpm_build(vhost->loc_dflt, pats)))
+			break;
+	}
+
+	kfree(pats);
+
+	return r;
+}
+
+/**
+ * Move vhosts which are unchanged since the running configuration from it to
+ * @vh_list instead of the just parsed copies, so live reconfiguration keeps
+ * their certificates, sessions secrets, matchers and cache policies. A vhost
+ * is unchanged if the text of its section and of all the files read from it
+ * is the same, and so is the rest of the configuration it may inherit from,
+ * see TfwCfgSpecChild.
+ *
+ * The moved vhosts keep referring to the previous default vhost, which is
+ * identical to the new one since it's covered by the list digest. They're
+ * flagged, so they're moved back on failed reconfiguration, see
+ * __tfw_cfgop_vhosts_cleanup().
+ */
+static void
+tfw_vhost_reuse(TfwVhostList *vh_list)
+{
+	TfwVhostList *old;
+	TfwVhost *vhost, *vh_old;
+	struct hlist_node *tmp;
+	int b;
+
+	if (!tfw_runstate_is_reconfig())
+		return;
+	rcu_read_lock();
+	old = rcu_dereference(tfw_vhosts);
+	rcu_read_unlock();
+	if (!old || old->digest != vh_list->digest)
+		return;
+
+	hash_for_each_safe(vh_list->vh_hash, b, tmp, vhost, hlist) {
+		if (vhost == vh_list->vhost_dflt
+		    || test_bit(TFW_VHOST_B_REUSED, &vhost->flags))
+			continue;
+		vh_old = __tfw_vhost_lookup(old, &vhost->name,
+					    tfw_vhost_name_match);
+		if (!vh_old)
+			continue;
+		tfw_vhost_put(vh_old);
+		if (vh_old->digest != vhost->digest)
+			continue;
+
+		T_DBG("Reuse unchanged vhost '%s'\n", vhost->name.data);
+		/* The list reference is moved along with the vhost. */
+		hash_del(&vh_old->hlist);
+		hash_add(vh_list->vh_hash, &vh_old->hlist,
+			 tfw_vhost_name_hash(&vh_old->name));
+		set_bit(TFW_VHOST_B_REUSED, &vh_old->flags);
+
+		hash_del(&vhost->hlist);
+		set_bit(TFW_VHOST_B_REMOVED, &vhost->flags);
+		tfw_vhost_put(vhost);
+	}
+}
+
+static int
+tfw_vhost_cfgend(void)
+{
+	TfwSrvGroup *sg_def;
+	TfwVhost *vh_dflt;
+	int r = 0, r_sess;
+
+	if ((r = tfw_vhost_hdr_via_h2_build())) {
+		T_ERR_NL("Unable to allocate 'via' header.\n");
+		return r;
+	}
+	*tfw_vhosts_reconfig->vhost_dflt->frang_gconf = tfw_frang_glob_reconfig;
+	/*
+	 * Add default vhost into list if it hadn't been added yet explicitly
+	 * to keep default location policies.
+	 */
+	if (tfw_vhosts_reconfig->expl_dflt)
+		goto sni;
+	/*
+	 * Implicit default vhost is still useful even if it's never used to
+	 * forward the traffic. It stores fallback location providing
+	 * default policies and options that can be used before incoming
+	 * request is parsed and assigned to any location.
+	 */
+	vh_dflt = tfw_vhosts_reconfig->vhost_dflt;
+	r = tfw_frang_cfg_inherit(vh_dflt->loc_dflt->frang_cfg,
+				  &tfw_frang_vhost_reconfig);
+	if (r)
+		goto err;
 	sg_def = tfw_sg_lookup_reconfig(TFW_VH_DFT_NAME, SLEN("default"));
 	vh_dflt->loc_dflt->main_sg = sg_def;
 	tfw_vhost_add(vh_dflt);
@@ -2212,16 +2952,25 @@ tfw_vhost_cfgend(void)
 			  "requires 'cache_purge_acl', but it wasn't "
 			  "provided. 'cache_purge' directive is ignored.\n");
 
+sni:
+	tfw_vhosts_reconfig->digest = tfw_cfg_digest()
+		+ 31 * tfw_vhosts_reconfig->vhost_dflt->digest;
+	tfw_vhost_reuse(tfw_vhosts_reconfig);
+	if ((r = tfw_tls_cert_load_all()))
+		goto err;
+	if ((r = tfw_vhost_mpm_build_all(tfw_vhosts_reconfig)))
+		goto err;
+	if ((r = tfw_vhost_sni_build(tfw_vhosts_reconfig)))
+		T_ERR_NL("Unable to allocate SNI index.\n");
 err:
-	r = tfw_http_sess_cfgend();
-	return r;
+	r_sess = tfw_http_sess_cfgend();
+	return r ? : r_sess;
 }
 
 static int
 tfw_cfgop_vhost_begin(TfwCfgSpec *cs, TfwCfgEntry *ce)
 {
 	TfwVhost *vhost;
-	int i;
 
 	BUG_ON(tfw_vhost_entry);
 
@@ -2231,12 +2980,10 @@ tfw_cfgop_vhost_begin(TfwCfgSpec *cs, TfwCfgEntry *ce)
 		T_ERR_NL("Unexpected attributes\n");
 		return -EINVAL;
 	}
-	hash_for_each(tfw_vhosts_reconfig->vh_hash, i, vhost, hlist) {
-		if (!strcasecmp(vhost->name.data, ce->vals[0])) {
-			T_ERR_NL("Duplicate vhost entry: '%s'\n",
-				 ce->vals[0]);
-			return -EINVAL;
-		}
+	if ((vhost = tfw_vhost_lookup_reconfig(ce->vals[0]))) {
+		tfw_vhost_put(vhost);
+		T_ERR_NL("Duplicate vhost entry: '%s'\n", ce->vals[0]);
+		return -EINVAL;
 	}
 	if (!strcasecmp(ce->vals[0], TFW_VH_DFT_NAME)) {
 		tfw_vhosts_reconfig->expl_dflt = true;
@@ -2278,6 +3025,7 @@ tfw_cfgop_vhost_finish(TfwCfgSpec *cs)
 		return r;
 	if ((r = tfw_http_sess_cfg_finish(tfw_vhost_entry)))
 		return r;
+	tfw_vhost_entry->digest = ((TfwCfgSpecChild *)cs->spec_ext)->digest;
 	tfw_vhost_entry = NULL;
 	return 0;
 }
@@ -2300,13 +3048,43 @@ tfw_cfgop_vhosts_list_free(TfwVhostList *vhosts)
 	}
 	set_bit(TFW_VHOST_B_REMOVED, &vhosts->vhost_dflt->flags);
 	tfw_vhost_put(vhosts->vhost_dflt);
-	kfree(vhosts);
+	kvfree(vhosts->sni_tbl);
+	kvfree(vhosts);
+}
+
+static bool
+tfw_location_frang_resp(const TfwLocation *loc)
+{
+	return loc->frang_cfg->http_body_len
+		|| loc->frang_cfg->http_resp_code_block;
+}
+
+/**
+ * Whether Frang should check responses for any location of @vh_list.
+ */
+static bool
+tfw_vhost_frang_resp(TfwVhostList *vh_list)
+{
+	TfwVhost *vhost;
+	size_t i;
+	int b;
+
+	hash_for_each(vh_list->vh_hash, b, vhost, hlist) {
+		if (tfw_location_frang_resp(vhost->loc_dflt))
+			return true;
+		for (i = 0; i < vhost->loc_sz; ++i)
+			if (tfw_location_frang_resp(&vhost->loc[i]))
+				return true;
+	}
+	return tfw_location_frang_resp(vh_list->vhost_dflt->loc_dflt);
 }
 
 static int
 tfw_vhost_start(void)
 {
 	TfwVhostList *vh_list;
+	TfwVhost *vhost;
+	int b;
 
 	rcu_read_lock();
 	vh_list = rcu_dereference(tfw_vhosts);
@@ -2314,15 +3092,46 @@ tfw_vhost_start(void)
 	rcu_assign_pointer(tfw_vhosts, tfw_vhosts_reconfig);
 	synchronize_rcu();
 
+	hash_for_each(tfw_vhosts_reconfig->vh_hash, b, vhost, hlist)
+		clear_bit(TFW_VHOST_B_REUSED, &vhost->flags);
+	frang_hooks_enable(tfw_vhosts_reconfig->vhost_dflt->frang_gconf,
+			   tfw_vhost_frang_resp(tfw_vhosts_reconfig));
 	tfw_cfgop_vhosts_list_free(vh_list);
 	tfw_vhosts_reconfig = NULL;
 
 	return 0;
 }
 
+/**
+ * Return vhosts taken by tfw_vhost_reuse() back to the running configuration.
+ */
+static void
+tfw_vhost_reuse_revert(void)
+{
+	TfwVhostList *old;
+	TfwVhost *vhost;
+	struct hlist_node *tmp;
+	int b;
+
+	if (!tfw_vhosts_reconfig)
+		return;
+	rcu_read_lock();
+	old = rcu_dereference(tfw_vhosts);
+	rcu_read_unlock();
+
+	hash_for_each_safe(tfw_vhosts_reconfig->vh_hash, b, tmp, vhost, hlist) {
+		if (!test_and_clear_bit(TFW_VHOST_B_REUSED, &vhost->flags))
+			continue;
+		hash_del(&vhost->hlist);
+		hash_add(old->vh_hash, &vhost->hlist,
+			 tfw_vhost_name_hash(&vhost->name));
+	}
+}
+
 static void
 __tfw_cfgop_vhosts_cleanup(void)
 {
+	tfw_vhost_reuse_revert();
 	tfw_cfgop_vhosts_list_free(tfw_vhosts_reconfig);
 	tfw_vhosts_reconfig = NULL;
 
@@ -2354,6 +3163,8 @@ tfw_vhost_cfgclean(void)
 	if (tfw_global.hdr_via && (tfw_global.hdr_via != s_hdr_via_dflt))
 		kfree(tfw_global.hdr_via);
 	tfw_global.hdr_via = s_hdr_via_dflt;
+	kfree(tfw_global.hdr_via_h2);
+	tfw_global.hdr_via_h2 = NULL;
 }
 
 /*
@@ -2375,6 +3186,26 @@ static TfwCfgSpec tfw_global_frang_specs[] = {
 		},
 		.allow_reconfig = true,
 	},
+	{
+		.name = "ip_block_prefix4",
+		.deflt = "32",
+		.handler = tfw_cfgop_frang_glob_set_int,
+		.dest = &tfw_frang_glob_reconfig.ip_block_prefix4,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 8, 32 },
+		},
+		.allow_reconfig = true,
+	},
+	{
+		.name = "ip_block_prefix6",
+		.deflt = "128",
+		.handler = tfw_cfgop_frang_glob_set_int,
+		.dest = &tfw_frang_glob_reconfig.ip_block_prefix6,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 16, 128 },
+		},
+		.allow_reconfig = true,
+	},
 	{
 		.name = "request_rate",
 		.deflt = "0",
@@ -2493,6 +3324,66 @@ static TfwCfgSpec tfw_global_frang_specs[] = {
 		},
 		.allow_reconfig = true,
 	},
+	{
+		.name = "http_stream_rate",
+		.deflt = "0",
+		.handler = tfw_cfgop_frang_glob_set_int,
+		.dest = &tfw_frang_glob_reconfig.http_strm_rate,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, INT_MAX },
+		},
+		.allow_reconfig = true,
+	},
+	{
+		.name = "http_rst_stream_rate",
+		.deflt = "0",
+		.handler = tfw_cfgop_frang_glob_set_int,
+		.dest = &tfw_frang_glob_reconfig.http_rst_rate,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, INT_MAX },
+		},
+		.allow_reconfig = true,
+	},
+	{
+		.name = "http_ping_rate",
+		.deflt = "0",
+		.handler = tfw_cfgop_frang_glob_set_int,
+		.dest = &tfw_frang_glob_reconfig.http_ping_rate,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, INT_MAX },
+		},
+		.allow_reconfig = true,
+	},
+	{
+		.name = "http_settings_rate",
+		.deflt = "0",
+		.handler = tfw_cfgop_frang_glob_set_int,
+		.dest = &tfw_frang_glob_reconfig.http_settings_rate,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, INT_MAX },
+		},
+		.allow_reconfig = true,
+	},
+	{
+		.name = "http_empty_frame_rate",
+		.deflt = "0",
+		.handler = tfw_cfgop_frang_glob_set_int,
+		.dest = &tfw_frang_glob_reconfig.http_empty_frame_rate,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, INT_MAX },
+		},
+		.allow_reconfig = true,
+	},
+	{
+		.name = "http_sticky_fail_rate",
+		.deflt = "0",
+		.handler = tfw_cfgop_frang_glob_set_int,
+		.dest = &tfw_frang_glob_reconfig.http_sticky_fail_rate,
+		.spec_ext = &(TfwCfgSpecInt) {
+			.range = { 0, INT_MAX },
+		},
+		.allow_reconfig = true,
+	},
 	/* Option can be redefined per vhost|location. */
 	{
 		.name = "http_uri_len",
@@ -2573,6 +3464,18 @@ static TfwCfgSpec tfw_vhost_frang_specs[] = {
 		.allow_reconfig = true,
 		.allow_none = true,
 	},
+	{
+		.name = "ip_block_prefix4",
+		.handler = tfw_cfgop_frang_glob_in_vhost,
+		.allow_reconfig = true,
+		.allow_none = true,
+	},
+	{
+		.name = "ip_block_prefix6",
+		.handler = tfw_cfgop_frang_glob_in_vhost,
+		.allow_reconfig = true,
+		.allow_none = true,
+	},
 	{
 		.name = "request_rate",
 		.handler = tfw_cfgop_frang_glob_in_vhost,
@@ -2645,6 +3548,55 @@ static TfwCfgSpec tfw_vhost_frang_specs[] = {
 		.allow_reconfig = true,
 		.allow_none = true,
 	},
+	{
+		.name = "http_stream_rate",
+		.handler = tfw_cfgop_frang_glob_in_vhost,
+		.allow_reconfig = true,
+		.allow_none = true,
+	},
+	{
+		.name = "http_rst_stream_rate",
+		.handler = tfw_cfgop_frang_glob_in_vhost,
+		.allow_reconfig = true,
+		.allow_none = true,
+	},
+	{
+		.name = "http_ping_rate",
+		.handler = tfw_cfgop_frang_glob_in_vhost,
+		.allow_reconfig = true,
+		.allow_none = true,
+	},
+	{
+		.name = "http_settings_rate",
+		.handler = tfw_cfgop_frang_glob_in_vhost,
+		.allow_reconfig = true,
+		.allow_none = true,
+	},
+	{
+		.name = "http_empty_frame_rate",
+		.handler = tfw_cfgop_frang_glob_in_vhost,
+		.allow_reconfig = true,
+		.allow_none = true,
+	},
+	{
+		.name = "http_sticky_fail_rate",
+		.handler = tfw_cfgop_frang_glob_in_vhost,
+		.allow_reconfig = true,
+		.allow_none = true,
+	},
+	/* Options that can be set only for a location. */
+	{
+		.name = "location_request_rate",
+		.handler = tfw_cfgop_frang_loc_req_rate,
+		.allow_reconfig = true,
+		.allow_none = true,
+	},
+	{
+		.name = "location_request_burst",
+		.handler = tfw_cfgop_frang_loc_req_burst,
+		.allow_reconfig = true,
+		.allow_none = true,
+	},
 	/* Option can be redefined per vhost|location. */
 	{
 		.name = "http_uri_len",
@@ -2734,6 +3686,30 @@ static TfwCfgSpec tfw_vhost_location_specs[] = {
 		.allow_repeat = true,
 		.allow_reconfig = true,
 	},
+	{
+		.name = "cache_admission",
+		.deflt = NULL,
+		.handler = tfw_cfgop_loc_cache_admission,
+		.allow_none = true,
+		.allow_repeat = false,
+		.allow_reconfig = true,
+	},
+	{
+		.name = "cache_key_normalize",
+		.deflt = NULL,
+		.handler = tfw_cfgop_loc_cache_key_normalize,
+		.allow_none = true,
+		.allow_repeat = false,
+		.allow_reconfig = true,
+	},
+	{
+		.name = "cache_key_drop_args",
+		.deflt = NULL,
+		.handler = tfw_cfgop_loc_cache_key_drop_args,
+		.allow_none = true,
+		.allow_repeat = false,
+		.allow_reconfig = true,
+	},
 	{
 		.name = "nonidempotent",
 		.deflt = NULL,
@@ -2825,6 +3801,30 @@ static TfwCfgSpec tfw_vhost_internal_specs[] = {
 		.allow_repeat = true,
 		.allow_reconfig = true,
 	},
+	{
+		.name = "cache_admission",
+		.deflt = NULL,
+		.handler = tfw_cfgop_in_cache_admission,
+		.allow_none = true,
+		.allow_repeat = false,
+		.allow_reconfig = true,
+	},
+	{
+		.name = "cache_key_normalize",
+		.deflt = NULL,
+		.handler = tfw_cfgop_in_cache_key_normalize,
+		.allow_none = true,
+		.allow_repeat = false,
+		.allow_reconfig = true,
+	},
+	{
+		.name = "cache_key_drop_args",
+		.deflt = NULL,
+		.handler = tfw_cfgop_in_cache_key_drop_args,
+		.allow_none = true,
+		.allow_repeat = false,
+		.allow_reconfig = true,
+	},
 	{
 		.name = "http_post_validate",
 		.deflt = NULL,
@@ -2991,6 +3991,30 @@ static TfwCfgSpec tfw_vhost_specs[] = {
 		.allow_repeat = true,
 		.allow_reconfig = true,
 	},
+	{
+		.name = "cache_admission",
+		.deflt = NULL,
+		.handler = tfw_cfgop_out_cache_admission,
+		.allow_none = true,
+		.allow_repeat = false,
+		.allow_reconfig = true,
+	},
+	{
+		.name = "cache_key_normalize",
+		.deflt = NULL,
+		.handler = tfw_cfgop_out_cache_key_normalize,
+		.allow_none = true,
+		.allow_repeat = false,
+		.allow_reconfig = true,
+	},
+	{
+		.name = "cache_key_drop_args",
+		.deflt = NULL,
+		.handler = tfw_cfgop_out_cache_key_drop_args,
+		.allow_none = true,
+		.allow_repeat = false,
+		.allow_reconfig = true,
+	},
 	{
 		.name = "http_post_validate",
 		.deflt = NULL,
@@ -3105,7 +4129,8 @@ static TfwCfgSpec tfw_vhost_specs[] = {
 		.dest = tfw_vhost_internal_specs,
 		.spec_ext = &(TfwCfgSpecChild) {
 			.begin_hook = tfw_cfgop_vhost_begin,
-			.finish_hook = tfw_cfgop_vhost_finish
+			.finish_hook = tfw_cfgop_vhost_finish,
+			.versioned = true
 		},
 		.allow_none = true,
 		.allow_repeat = true,
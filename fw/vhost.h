@@ -23,6 +23,8 @@
 #include "str.h"
 #include "addr.h"
 #include "msg.h"
+#include "mpm.h"
+#include "procfs_if.h"
 #include "server.h"
 #include "tls.h"
 
@@ -68,12 +70,18 @@ typedef struct {
  * @hdr		- Header string, see @tfw_http_msg_hdr_xfrm_str();
  * @hid		- Header index in the header table;
  * @append	- if set the value is added to the end of an existing header,
- *		  otherwise the original value is overwritten with given one.
+ *		  otherwise the original value is overwritten with given one;
+ * @h1_len	- Length of the header in @h1_blk of the modifications, zero
+ *		  for deletion;
+ * @h2_len	- Length of the header in @h2_blk of the modifications, zero
+ *		  for deletion.
  */
 struct tfw_hdr_mods_desc_t {
 	TfwStr		*hdr;
 	unsigned int	hid;
 	bool		append;
+	unsigned int	h1_len;
+	unsigned int	h2_len;
 };
 
 /**
@@ -81,10 +89,16 @@ struct tfw_hdr_mods_desc_t {
  *
  * @sz		- Number of headers to modify;
  * @hdrs	- Headers to modify;
+ * @h1_blk	- The headers with values in HTTP/1.1 format, in the order of
+ *		  @hdrs, precompiled to be added to messages as is;
+ * @h2_blk	- The same headers in HPACK format, as literal header fields
+ *		  without indexing with static-indexed names where possible.
  */
 struct tfw_hdr_mods_t {
 	size_t		sz;
 	TfwHdrModsDesc	*hdrs;
+	TfwStr		h1_blk;
+	TfwStr		h2_blk;
 };
 
 enum {
@@ -94,6 +108,31 @@ enum {
 	TFW_VHOST_HDRMOD_NUM
 };
 
+/* Max request frequency for cache admission, see frequency sketch in cache. */
+#define TFW_CACHE_ADMISSION_MAX	15
+
+/* Cache key normalization steps. */
+#define TFW_CACHE_KEY_SORT_ARGS		0x1
+#define TFW_CACHE_KEY_HOST		0x2
+#define TFW_CACHE_KEY_FRAGMENT		0x4
+
+#define TFW_CACHE_KEY_DROP_MAX		16
+
+/**
+ * Normalization of the cache key of requests, so requests for the same
+ * resource with differently written URIs share the cache entry.
+ *
+ * @flags	- TFW_CACHE_KEY_* normalization steps;
+ * @drop_n	- number of names in @drop;
+ * @drop	- names of query arguments excluded from the key, a name ending
+ *		  with '*' matches all the names with the prefix;
+ */
+typedef struct {
+	unsigned int	flags;
+	unsigned int	drop_n;
+	TfwStr		drop[TFW_CACHE_KEY_DROP_MAX];
+} TfwCacheKeyNorm;
+
 /**
  * Group of policies by specific location.
  *
@@ -104,11 +143,16 @@ enum {
  * @nipdef_sz	- Size of @nipdef array.
  * @capo	- Array of pointers to Cache Policy definitions.
  * @nipdef	- Array of pointers to Non-Idempotent Request definitions.
+ * @capo_mpm	- Matcher compiled from @capo patterns.
+ * @nipdef_mpm	- Matcher compiled from @nipdef patterns.
  * @frang_cfg	- Pointer to location-specific Frang settings structure.
  * @main_sg	- Main server group to which requests must be proxied.
  * @backup_sg	- Backup server group.
  * @hdrs_pool	- Pointer to parent vhost's pool (for mod. headers allocation).
  * @mod_hdrs	- Modification of request/response headers before forwarding.
+ * @cache_admission - Min frequency of requests to admit a response to cache.
+ * @cache_key	- Normalization of the cache key, NULL if it isn't configured.
+ * @stat	- Per-CPU traffic of the location.
  */
 typedef struct {
 	short			op;
@@ -118,12 +162,17 @@ typedef struct {
 	size_t			nipdef_sz;
 	TfwCaPolicy		**capo;
 	TfwNipDef		**nipdef;
+	TfwMpm			*capo_mpm;
+	TfwMpm			*nipdef_mpm;
 	FrangVhostCfg		*frang_cfg;
 	TfwSrvGroup		*main_sg;
 	TfwSrvGroup		*backup_sg;
 	TfwPool			*hdrs_pool;
 	TfwHdrMods		mod_hdrs[TFW_VHOST_HDRMOD_NUM];
 	unsigned int		validate_post_req:1;
+	unsigned char		cache_admission;
+	TfwCacheKeyNorm		*cache_key;
+	TfwVhostStat __percpu	*stat;
 } TfwLocation;
 
 /* Cache purge configuration modes. */
@@ -141,6 +190,8 @@ enum {
 	 * removed.
 	 */
 	TFW_VHOST_B_STICKY_SESS_FAILOVER,
+	/* Unchanged vhost moved from the running configuration. */
+	TFW_VHOST_B_REUSED,
 };
 
 /* Max number of headers allowed for end user to modify. */
@@ -154,6 +205,7 @@ enum {
  *		  which is not counted by 'len' member.
  * @loc		- Array of groups of policies by specific location.
  * @loc_dflt	- Default policy.
+ * @loc_mpm	- Matcher compiled from @loc patterns.
  * @vhost_dflt	- Pointer to default virtual host with global policies.
  * @hdrs_pool	- Modification headers allocation pool for vhost's policies.
  * @frang_gconf	- Global frang configuration. Applicable only for 'default'
@@ -164,6 +216,7 @@ enum {
  * @refcnt	- Number of users of the virtual host object.
  * @loc_sz	- Count of elements in @loc array.
  * @flags	- flags.
+ * @digest	- Digest of the vhost section, see TfwCfgSpecChild.
  * @tls_cfg	- TLS per-vhost configuration data used in data processing.
  */
 struct  tfw_vhost_t {
@@ -171,6 +224,7 @@ struct  tfw_vhost_t {
 	TfwStr			name;
 	TfwLocation		*loc;
 	TfwLocation		*loc_dflt;
+	TfwMpm			*loc_mpm;
 	TfwVhost		*vhost_dflt;
 	TfwPool			*hdrs_pool;
 	FrangGlobCfg		*frang_gconf;
@@ -178,6 +232,7 @@ struct  tfw_vhost_t {
 	atomic64_t		refcnt;
 	size_t			loc_sz;
 	unsigned long		flags;
+	u64			digest;
 	TlsPeerCfg		tls_cfg;
 };
 
@@ -189,6 +244,9 @@ struct  tfw_vhost_t {
  * @hdr_via		- 'Via' header value for HTTP messages.
  * @capuacl		- Array of addresses permitted for purge configuration.
  * @hdr_via_len		- Length of 'Via' header value.
+ * @hdr_via_h2		- Whole 'Via' header for HTTP/2 responses encoded
+ *			  in HPACK format.
+ * @hdr_via_h2_len	- Length of @hdr_via_h2.
  * @capuacl_sz		- Count of elements in @capuacl array.
  * @cache_purge		- Enable/disable cache purge configuration.
  * @cache_purge_mode	- Cache purge configuration mode.
@@ -198,6 +256,8 @@ typedef struct {
 	const char		*hdr_via;
 	TfwAddr			*capuacl;
 	size_t			hdr_via_len;
+	const char		*hdr_via_h2;
+	size_t			hdr_via_h2_len;
 	size_t			capuacl_sz;
 	u8			cache_purge:1;
 	u8			cache_purge_mode:2;
@@ -227,7 +287,7 @@ bool tfw_capuacl_match(TfwAddr *addr);
 TfwCaPolicy *tfw_capolicy_match(TfwLocation *loc, TfwStr *arg);
 TfwLocation *tfw_location_match(TfwVhost *vhost, TfwStr *arg);
 TfwVhost *tfw_vhost_lookup_reconfig(const char *name);
-TfwVhost *tfw_vhost_lookup(const TfwStr *name);
+TfwVhost *tfw_vhost_lookup_sni(const TfwStr *name, TlsPeerCfg **tls_cfg);
 TfwVhost *tfw_vhost_lookup_default(void);
 bool tfw_vhost_is_default_reconfig(TfwVhost *vhost);
 TfwSrvConn *tfw_vhost_get_srv_conn(TfwMsg *msg);
@@ -235,6 +295,10 @@ TfwVhost *tfw_vhost_new(const char *name);
 TfwGlobal *tfw_vhost_get_global(void);
 TfwHdrMods *tfw_vhost_get_hdr_mods(TfwLocation *loc, TfwVhost *vhost,
 				   int mod_type);
+const char *tfw_location_op_name(const TfwLocation *loc);
+void tfw_location_stat_collect(const TfwLocation *loc, TfwVhostStat *stat);
+int tfw_vhost_for_each_loc(int (*fn)(TfwVhost *, TfwLocation *, void *),
+			   void *data);
 
 static inline TfwVhost*
 tfw_vhost_from_tls_conf(const TlsPeerCfg *cfg)
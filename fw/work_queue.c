@@ -71,17 +71,22 @@ tfw_wq_destroy(TfwRBQueue *q)
 }
 
 /**
- * If there is no space in the queue, then current head value is returned
- * to be used as a ticket for trunstilie synchronization. Since we have QSZ
- * free slots, then the ticket value is always greater than 0.
+ * Push @n items from @items array with one reservation of the queue slots.
+ * Either all the items are pushed or none of them. If there is no space in
+ * the queue, then current head value is returned to be used as a ticket for
+ * trunstilie synchronization. Since we have QSZ free slots, then the ticket
+ * value is always greater than 0.
  */
 long
-__tfw_wq_push(TfwRBQueue *q, void *ptr)
+__tfw_wq_push_bulk(TfwRBQueue *q, void *items, int n)
 {
-	long head, tail;
+	long head, tail, i;
 	atomic64_t *head_local;
 	int budget = 10;
 
+	if (WARN_ON_ONCE(n <= 0 || n > QSZ))
+		return LONG_MAX;
+
 	/*
 	 * Producers can run on the same CPU (softirq and user space process),
 	 * so they will write to the same q->thr_pos[cpu_id].
@@ -102,7 +107,7 @@ __tfw_wq_push(TfwRBQueue *q, void *ptr)
 	for ( ; ; head = atomic64_read(&q->head)) {
 		tail = atomic64_read(&q->tail);
 		WARN_ON_ONCE(head > tail + QSZ);
-		if (unlikely(head == tail + QSZ)) {
+		if (unlikely(head + n > tail + QSZ)) {
 			/*
 			 * Small threshold budget to pass through temporary
 			 * queue overflow.
@@ -115,17 +120,19 @@ __tfw_wq_push(TfwRBQueue *q, void *ptr)
 		}
 
 		/*
-		 * There is an empty slot to push a new item.
+		 * There are enough empty slots to push the new items.
 		 * Acquire the current head position and move the global head.
 		 * If current head position is acquired by a competing
 		 * producer, then read the current head and try again.
 		 */
-		if (atomic64_cmpxchg(&q->head, head, head + 1) == head)
+		if (atomic64_cmpxchg(&q->head, head, head + n) == head)
 			break;
 		cpu_relax();
 	}
 
-	memcpy(&q->array[head & QMASK], ptr, WQ_ITEM_SZ);
+	for (i = 0; i < n; ++i)
+		memcpy(&q->array[(head + i) & QMASK],
+		       (char *)items + i * WQ_ITEM_SZ, WQ_ITEM_SZ);
 	wmb();
 
 	head = 0;
@@ -136,6 +143,29 @@ full_out:
 	return head;
 }
 
+/*
+ * Actualize @last_head from heads of all current producers.
+ * We do it only when we need a new value, i.e. not so frequently, since
+ * atomic reads are faster than updates. Don't support switching off cpus
+ * in runtime.
+ */
+static void
+tfw_wq_update_last_head(TfwRBQueue *q)
+{
+	int cpu;
+
+	q->last_head = atomic64_read(&q->head);
+	for_each_online_cpu(cpu) {
+		atomic64_t *head_local = per_cpu_ptr(q->heads, cpu);
+		long curr_h = atomic64_read(head_local);
+
+		/* Force compiler to use curr_h only once. */
+		barrier();
+		if (curr_h < q->last_head)
+			q->last_head = curr_h;
+	}
+}
+
 /**
  * Sets tail value to be compared with current turnstile ticket, so
  * @ticket is the identifier of currently successfully pop()'ed item or an item
@@ -144,7 +174,7 @@ full_out:
 int
 tfw_wq_pop_ticket(TfwRBQueue *q, void *buf, long *ticket)
 {
-	int cpu, r = -EBUSY;
+	int r = -EBUSY;
 	long tail;
 
 	local_bh_disable();
@@ -156,22 +186,7 @@ tfw_wq_pop_ticket(TfwRBQueue *q, void *buf, long *ticket)
 	 * far we can move, so probably we have to return with nothing now.
 	 */
 	if (unlikely(tail >= q->last_head)) {
-		/*
-		 * Actualize @last_head from heads of all current producers.
-		 * We do it here since atomic reads are faster than updates and
-		 * we can do this only when we need a new value, i.e. not so
-		 * frequently. Don't support switching off cpus in runtime.
-		 */
-		q->last_head = atomic64_read(&q->head);
-		for_each_online_cpu(cpu) {
-			atomic64_t *head_local = per_cpu_ptr(q->heads, cpu);
-			long curr_h = atomic64_read(head_local);
-
-			/* Force compiler to use curr_h only once. */
-			barrier();
-			if (curr_h < q->last_head)
-				q->last_head = curr_h;
-		}
+		tfw_wq_update_last_head(q);
 
 		/* Second try. */
 		if (tail >= q->last_head)
@@ -193,3 +208,38 @@ out:
 		*ticket = tail;
 	return r;
 }
+
+/**
+ * Pop up to @n items to @buf array. All the items are released to producers
+ * with one memory barrier and one @tail update. The heads of the producers
+ * are rescanned only if no items are known to be ready, so the function can
+ * return less items than are in the queue. Returns the number of the items.
+ */
+int
+tfw_wq_pop_bulk(TfwRBQueue *q, void *buf, int n)
+{
+	long tail, i;
+
+	local_bh_disable();
+
+	tail = atomic64_read(&q->tail);
+	/* See tfw_wq_pop_ticket(). */
+	if (unlikely(tail >= q->last_head)) {
+		tfw_wq_update_last_head(q);
+		if (tail >= q->last_head) {
+			n = 0;
+			goto out;
+		}
+	}
+	n = min_t(long, n, q->last_head - tail);
+
+	for (i = 0; i < n; ++i)
+		memcpy((char *)buf + i * WQ_ITEM_SZ,
+		       &q->array[(tail + i) & QMASK], WQ_ITEM_SZ);
+	mb();
+
+	atomic64_set(&q->tail, tail + n);
+out:
+	local_bh_enable();
+	return n;
+}
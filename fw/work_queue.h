@@ -57,8 +57,15 @@ do {								\
 
 int tfw_wq_init(TfwRBQueue *wq, int node);
 void tfw_wq_destroy(TfwRBQueue *wq);
-long __tfw_wq_push(TfwRBQueue *wq, void *ptr);
+long __tfw_wq_push_bulk(TfwRBQueue *wq, void *items, int n);
 int tfw_wq_pop_ticket(TfwRBQueue *wq, void *buf, long *ticket);
+int tfw_wq_pop_bulk(TfwRBQueue *wq, void *buf, int n);
+
+static inline long
+__tfw_wq_push(TfwRBQueue *q, void *ptr)
+{
+	return __tfw_wq_push_bulk(q, ptr, 1);
+}
 
 static inline int
 tfw_wq_size(TfwRBQueue *q)
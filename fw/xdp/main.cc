@@ -0,0 +1,279 @@
+/**
+ *		Tempesta FW
+ *
+ * Loader of the XDP filter program, which keeps the program map of blocked
+ * addresses in sync with the Tempesta FW filter table.
+ *
+ * The filter table is mapped read-only through libtdb and is rescanned
+ * periodically. New blocked addresses are added to the map and the addresses
+ * which aren't in the table any more, e.g. after Tempesta FW restart with a
+ * clean table, are removed. The map is cleared if there is no table, i.e.
+ * Tempesta FW isn't running.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <net/if.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <unistd.h>
+#include <linux/if_link.h>
+
+#include <cstring>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include <libtdb.h>
+
+#include "tfw_xdp.h"
+
+namespace po = boost::program_options;
+
+bool debug = false;
+
+namespace {
+
+/*
+ * The filter rule, see TfwFRule in fw/filter.c.
+ */
+struct FRule {
+	in6_addr	addr;
+	int		action;
+};
+
+const int F_DROP = 0;
+
+struct AddrLess {
+	bool
+	operator()(const in6_addr &a, const in6_addr &b) const noexcept
+	{
+		return memcmp(&a, &b, sizeof(a)) < 0;
+	}
+};
+
+typedef std::set<in6_addr, AddrLess> AddrSet;
+
+volatile sig_atomic_t stop;
+
+void
+on_signal(int)
+{
+	stop = 1;
+}
+
+/**
+ * Read the blocked addresses from the filter table.
+ * @return false if there is no table.
+ */
+bool
+read_table(const std::string &table, AddrSet &addrs)
+{
+	try {
+		TdbMap map(table);
+
+		map.for_each([&](unsigned long, const char *data, size_t len) {
+			const FRule *r = reinterpret_cast<const FRule *>(data);
+
+			if (len >= sizeof(*r) && r->action == F_DROP)
+				addrs.insert(r->addr);
+		});
+	}
+	catch (TdbExcept &e) {
+		if (debug)
+			std::cerr << e.what() << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Make the map contain exactly @addrs.
+ * @return number of added addresses.
+ */
+size_t
+sync_map(int map_fd, const AddrSet &addrs)
+{
+	in6_addr key, next;
+	std::vector<in6_addr> stale;
+	size_t n = 0;
+	unsigned int val = 0;
+	void *prev = nullptr;
+
+	while (!bpf_map_get_next_key(map_fd, prev, &next)) {
+		if (!addrs.count(next))
+			stale.push_back(next);
+		key = next;
+		prev = &key;
+	}
+	for (const in6_addr &a : stale)
+		bpf_map_delete_elem(map_fd, &a);
+
+	for (const in6_addr &a : addrs) {
+		if (!bpf_map_lookup_elem(map_fd, &a, &val))
+			continue;
+		if (bpf_map_update_elem(map_fd, &a, &val, BPF_ANY))
+			std::cerr << "cannot add a blocked address: "
+				  << strerror(errno) << std::endl;
+		else
+			++n;
+	}
+
+	return n;
+}
+
+unsigned long long
+dropped(int stat_fd)
+{
+	unsigned int key = 0;
+	int ncpus = libbpf_num_possible_cpus();
+	unsigned long long sum = 0;
+
+	if (ncpus <= 0)
+		return 0;
+	std::vector<unsigned long long> cnt(ncpus);
+	if (bpf_map_lookup_elem(stat_fd, &key, cnt.data()))
+		return 0;
+	for (unsigned long long c : cnt)
+		sum += c;
+
+	return sum;
+}
+
+} // namespace
+
+int
+main(int argc, char *argv[])
+{
+	std::vector<std::string> ifaces;
+	std::vector<int> ifindexes;
+	std::string obj_path, table;
+	unsigned int interval;
+	bpf_object *obj;
+	bpf_program *prog;
+	int r = 1, prog_fd, map_fd, stat_fd;
+	int flags = XDP_FLAGS_UPDATE_IF_NOEXIST;
+	bool have_tbl = true;
+
+	po::options_description desc("\n\tTempesta FW XDP Filter\n"
+				     "\nUsage:");
+	desc.add_options()
+		("debug,d", "Switch on debug mode")
+		("help,h", "Print this help message")
+		("iface,i", po::value<std::vector<std::string>>(&ifaces)
+			    ->required(),
+		 "Network interface to attach the program to, may be"
+		 " specified several times")
+		("interval,n", po::value<unsigned int>(&interval)
+			       ->default_value(1000),
+		 "Interval of the filter table scans in milliseconds")
+		("obj,o", po::value<std::string>(&obj_path)
+			  ->default_value("tfw_xdp_filter.o"),
+		 "The XDP program object file")
+		("skb", "Use generic XDP mode for drivers without XDP support")
+		("table,t", po::value<std::string>(&table)
+			    ->default_value("filter0"),
+		 "The filter table name, see filter_db configuration option");
+	try {
+		po::variables_map vm;
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		if (vm.count("help")) {
+			std::cout << desc << std::endl;
+			return 0;
+		}
+		po::notify(vm);
+		debug = vm.count("debug");
+		if (vm.count("skb"))
+			flags |= XDP_FLAGS_SKB_MODE;
+	}
+	catch (po::error &e) {
+		std::cerr << e.what() << std::endl << desc << std::endl;
+		return 1;
+	}
+
+	for (const std::string &ifn : ifaces) {
+		int idx = if_nametoindex(ifn.c_str());
+
+		if (!idx) {
+			std::cerr << "no interface " << ifn << std::endl;
+			return 1;
+		}
+		ifindexes.push_back(idx);
+	}
+
+	obj = bpf_object__open_file(obj_path.c_str(), nullptr);
+	if (libbpf_get_error(obj)) {
+		std::cerr << "cannot open " << obj_path << std::endl;
+		return 1;
+	}
+	if (bpf_object__load(obj)) {
+		std::cerr << "cannot load " << obj_path << std::endl;
+		goto close;
+	}
+	prog = bpf_object__find_program_by_name(obj, TFW_XDP_PROG);
+	map_fd = bpf_object__find_map_fd_by_name(obj, TFW_XDP_MAP_BLOCK);
+	stat_fd = bpf_object__find_map_fd_by_name(obj, TFW_XDP_MAP_STAT);
+	if (!prog || map_fd < 0 || stat_fd < 0) {
+		std::cerr << "bad XDP program object " << obj_path << std::endl;
+		goto close;
+	}
+	prog_fd = bpf_program__fd(prog);
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	for (size_t i = 0; i < ifindexes.size(); ++i)
+		if (bpf_set_link_xdp_fd(ifindexes[i], prog_fd, flags)) {
+			std::cerr << "cannot attach XDP program to "
+				  << ifaces[i] << std::endl;
+			ifindexes.resize(i);
+			goto detach;
+		}
+
+	while (!stop) {
+		AddrSet addrs;
+		bool tbl = read_table(table, addrs);
+		size_t n = sync_map(map_fd, addrs);
+
+		if (tbl != have_tbl) {
+			std::cout << (tbl ? "filter table " + table + " is open"
+					  : "no filter table " + table)
+				  << std::endl;
+			have_tbl = tbl;
+		}
+		if (debug && n)
+			std::cout << "blocked " << n << " new addresses, "
+				  << addrs.size() << " total, "
+				  << dropped(stat_fd) << " packets dropped"
+				  << std::endl;
+		usleep(interval * 1000);
+	}
+	r = 0;
+detach:
+	flags &= ~XDP_FLAGS_UPDATE_IF_NOEXIST;
+	for (int idx : ifindexes)
+		bpf_set_link_xdp_fd(idx, -1, flags);
+close:
+	bpf_object__close(obj);
+
+	return r;
+}
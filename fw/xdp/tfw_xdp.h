@@ -0,0 +1,32 @@
+/**
+ *		Tempesta FW
+ *
+ * Definitions shared by the XDP filter program and its loader.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __TFW_XDP_H__
+#define __TFW_XDP_H__
+
+/* Maximum number of blocked addresses in the map, the LRU ones are evicted. */
+#define TFW_XDP_MAX_ADDRS	(1 << 20)
+
+#define TFW_XDP_PROG		"tfw_xdp_filter"
+#define TFW_XDP_MAP_BLOCK	"tfw_xdp_block"
+#define TFW_XDP_MAP_STAT	"tfw_xdp_stat"
+
+#endif /* __TFW_XDP_H__ */
@@ -0,0 +1,123 @@
+/**
+ *		Tempesta FW
+ *
+ * XDP program dropping packets from the addresses blocked by Tempesta FW.
+ *
+ * The blocked addresses are kept in the IPv6 form, IPv4 addresses are
+ * v4-mapped just like in the filter module (fw/filter.c). The map is filled
+ * by tfw_xdp from the filter table, so the packets of blocked clients are
+ * dropped in the driver before any skb allocation. The netfilter hooks still
+ * check each packet, so a block takes effect immediately even before it's
+ * propagated to the map, and addresses evicted from the LRU map are still
+ * blocked.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/in6.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <bpf/bpf_endian.h>
+#include <bpf/bpf_helpers.h>
+
+#include "tfw_xdp.h"
+
+/* 802.1Q header, user space headers don't define it. */
+struct vlan_hdr {
+	__be16	h_vlan_TCI;
+	__be16	h_vlan_encapsulated_proto;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, TFW_XDP_MAX_ADDRS);
+	__type(key, struct in6_addr);
+	__type(value, __u32);
+} tfw_xdp_block SEC(".maps");
+
+/* Number of dropped packets. */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, __u64);
+} tfw_xdp_stat SEC(".maps");
+
+static __always_inline int
+tfw_xdp_check(struct in6_addr *addr)
+{
+	__u32 zero = 0;
+	__u64 *cnt;
+
+	if (!bpf_map_lookup_elem(&tfw_xdp_block, addr))
+		return XDP_PASS;
+	if ((cnt = bpf_map_lookup_elem(&tfw_xdp_stat, &zero)))
+		++*cnt;
+
+	return XDP_DROP;
+}
+
+SEC("xdp")
+int
+tfw_xdp_filter(struct xdp_md *ctx)
+{
+	void *data = (void *)(long)ctx->data;
+	void *data_end = (void *)(long)ctx->data_end;
+	struct ethhdr *eth = data;
+	struct in6_addr addr = {};
+	void *l3;
+	__u16 proto;
+
+	if ((void *)(eth + 1) > data_end)
+		return XDP_PASS;
+	l3 = eth + 1;
+	proto = eth->h_proto;
+	if (proto == bpf_htons(ETH_P_8021Q)
+	    || proto == bpf_htons(ETH_P_8021AD))
+	{
+		struct vlan_hdr *vh = l3;
+
+		if ((void *)(vh + 1) > data_end)
+			return XDP_PASS;
+		l3 = vh + 1;
+		proto = vh->h_vlan_encapsulated_proto;
+	}
+
+	if (proto == bpf_htons(ETH_P_IP)) {
+		struct iphdr *ih = l3;
+
+		if ((void *)(ih + 1) > data_end)
+			return XDP_PASS;
+		addr.s6_addr32[2] = bpf_htonl(0xffff);
+		addr.s6_addr32[3] = ih->saddr;
+	}
+	else if (proto == bpf_htons(ETH_P_IPV6)) {
+		struct ipv6hdr *ih = l3;
+
+		if ((void *)(ih + 1) > data_end)
+			return XDP_PASS;
+		addr = ih->saddr;
+	}
+	else {
+		return XDP_PASS;
+	}
+
+	return tfw_xdp_check(&addr);
+}
+
+char _license[] SEC("license") = "GPL";
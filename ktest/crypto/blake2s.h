@@ -0,0 +1,38 @@
+/**
+ *	Tempesta kernel emulation unit testing framework.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __CRYPTO_BLAKE2S_H__
+#define __CRYPTO_BLAKE2S_H__
+
+#include "linux/compiler.h"
+
+#define BLAKE2S_BLOCK_SIZE	64
+#define BLAKE2S_HASH_SIZE	32
+#define BLAKE2S_KEY_SIZE	32
+
+struct blake2s_state {
+	u32	h[8];
+	u32	t[2];
+	u32	f[2];
+	u8	buf[BLAKE2S_BLOCK_SIZE];
+	unsigned int buflen;
+	unsigned int outlen;
+};
+
+#endif /* __CRYPTO_BLAKE2S_H__ */
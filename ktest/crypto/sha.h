@@ -22,6 +22,9 @@
 
 #include "linux/compiler.h"
 
+#define SHA1_DIGEST_SIZE	20
+#define SHA1_BLOCK_SIZE		64
+
 #define SHA512_DIGEST_SIZE	64
 #define SHA512_BLOCK_SIZE	128
 
@@ -30,6 +30,12 @@ typedef struct refcount_struct {
 	atomic_t refs;
 } refcount_t;
 
+#define smp_mb__before_atomic()	__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define smp_rmb()		__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb()		__atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_load_acquire(p)	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
 #define atomic_set(v, i)	((v)->counter = (i))
 #define atomic_read(v)		(*(volatile int *)&(v)->counter)
 
@@ -65,6 +71,20 @@ atomic_dec_and_test(atomic_t *v)
 	return __atomic_sub_fetch(&v->counter, 1, __ATOMIC_SEQ_CST) == 0;
 }
 
+static inline int
+atomic_inc_return(atomic_t *v)
+{
+	return __atomic_add_fetch(&v->counter, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline int
+atomic_dec_return(atomic_t *v)
+{
+	return __atomic_sub_fetch(&v->counter, 1, __ATOMIC_SEQ_CST);
+}
+
+#define atomic_dec(v)		((void)atomic_dec_return(v))
+
 typedef struct {
 	long counter;
 } atomic64_t;
@@ -92,4 +112,12 @@ atomic64_inc(atomic64_t *v)
 	__atomic_fetch_add(&v->counter, 1, __ATOMIC_SEQ_CST);
 }
 
+static inline long
+atomic64_dec_return(atomic64_t *v)
+{
+	return __atomic_sub_fetch(&v->counter, 1, __ATOMIC_SEQ_CST);
+}
+
+#define atomic64_dec(v)		((void)atomic64_dec_return(v))
+
 #endif /* __ATOMIC_H__ */
@@ -0,0 +1,102 @@
+/**
+ *	Tempesta kernel emulation unit testing framework.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __BITMAP_H__
+#define __BITMAP_H__
+
+#include "bitops.h"
+#include "compiler.h"
+#include "kernel.h"
+
+static inline int
+__bitmap_test_bit(unsigned long nr, const unsigned long *map)
+{
+	return (map[nr / BITS_PER_LONG] >> (nr % BITS_PER_LONG)) & 1;
+}
+
+static inline void
+bitmap_copy(unsigned long *dst, const unsigned long *src, unsigned int nbits)
+{
+	memcpy(dst, src, BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+}
+
+static inline void
+bitmap_zero(unsigned long *dst, unsigned int nbits)
+{
+	memset(dst, 0, BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+}
+
+static inline unsigned long
+bitmap_find_next_zero_area(unsigned long *map, unsigned long size,
+			   unsigned long start, unsigned int nr,
+			   unsigned long align_mask)
+{
+	unsigned long i;
+
+	for ( ; start + nr <= size; start = (start + i + 1 + align_mask)
+					    & ~align_mask)
+	{
+		for (i = 0; i < nr; ++i)
+			if (__bitmap_test_bit(start + i, map))
+				break;
+		if (i == nr)
+			return start;
+	}
+
+	return size;
+}
+
+static inline unsigned int
+bitmap_weight(const unsigned long *src, unsigned int nbits)
+{
+	unsigned int i, w = 0;
+
+	for (i = 0; i < nbits; ++i)
+		w += __bitmap_test_bit(i, src);
+
+	return w;
+}
+
+static inline void
+bitmap_fill(unsigned long *dst, unsigned int nbits)
+{
+	memset(dst, 0xff, BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+}
+
+static inline void
+bitmap_complement(unsigned long *dst, const unsigned long *src,
+		  unsigned int nbits)
+{
+	unsigned int i;
+
+	for (i = 0; i < BITS_TO_LONGS(nbits); ++i)
+		dst[i] = ~src[i];
+}
+
+static inline void
+bitmap_or(unsigned long *dst, const unsigned long *src1,
+	  const unsigned long *src2, unsigned int nbits)
+{
+	unsigned int i;
+
+	for (i = 0; i < BITS_TO_LONGS(nbits); ++i)
+		dst[i] = src1[i] | src2[i];
+}
+
+#endif /* __BITMAP_H__ */
@@ -20,12 +20,17 @@
 #ifndef __BITOPS_H__
 #define __BITOPS_H__
 
+#include "compiler.h"
+
 #define IS_IMMEDIATE(nr)		(__builtin_constant_p(nr))
 #define BITOP_ADDR(x)			"+m" (*(volatile long *) (x))
 #define CONST_MASK_ADDR(nr, addr)	BITOP_ADDR((void *)(addr) + ((nr)>>3))
 #define CONST_MASK(nr)			(1 << ((nr) & 7))
 #define LOCK_PREFIX "\n\tlock; "
 
+#define BIT(nr)				(1UL << (nr))
+#define BIT_ULL(nr)			(1ULL << (nr))
+
 static inline void
 set_bit(unsigned int nr, volatile unsigned long *addr)
 {
@@ -35,11 +40,52 @@ set_bit(unsigned int nr, volatile unsigned long *addr)
 			: "iq" ((unsigned char)CONST_MASK(nr))
 			: "memory");
 	} else {
-		asm volatile(LOCK_PREFIX "bts %1,%0"
-			: BITOP_ADDR(addr) : "Ir" (nr) : "memory");
+		asm volatile(LOCK_PREFIX "btsq %1,%0"
+			: BITOP_ADDR(addr) : "Ir" ((long)nr) : "memory");
 	}
 }
 
+static inline void
+clear_bit(unsigned int nr, volatile unsigned long *addr)
+{
+	asm volatile(LOCK_PREFIX "btrq %1,%0"
+		: BITOP_ADDR(addr) : "Ir" ((long)nr) : "memory");
+}
+
+static inline int
+test_bit(unsigned int nr, const volatile unsigned long *addr)
+{
+	return (addr[nr / BITS_PER_LONG] >> (nr % BITS_PER_LONG)) & 1;
+}
+
+static inline void
+__set_bit(unsigned int nr, volatile unsigned long *addr)
+{
+	addr[nr / BITS_PER_LONG] |= 1UL << (nr % BITS_PER_LONG);
+}
+
+static inline void
+__clear_bit(unsigned int nr, volatile unsigned long *addr)
+{
+	addr[nr / BITS_PER_LONG] &= ~(1UL << (nr % BITS_PER_LONG));
+}
+
+static inline int
+__test_and_set_bit(unsigned int nr, volatile unsigned long *addr)
+{
+	int old = test_bit(nr, addr);
+
+	__set_bit(nr, addr);
+
+	return old;
+}
+
+static inline unsigned long
+__fls(unsigned long word)
+{
+	return BITS_PER_LONG - 1 - __builtin_clzl(word);
+}
+
 static inline unsigned long
 ffz(unsigned long word)
 {
@@ -49,4 +95,32 @@ ffz(unsigned long word)
 	return word;
 }
 
+static inline unsigned long
+find_next_bit(const unsigned long *addr, unsigned long size,
+	      unsigned long offset)
+{
+	for ( ; offset < size; ++offset)
+		if (test_bit(offset, addr))
+			return offset;
+	return size;
+}
+
+static inline unsigned long
+find_next_zero_bit(const unsigned long *addr, unsigned long size,
+		   unsigned long offset)
+{
+	for ( ; offset < size; ++offset)
+		if (!test_bit(offset, addr))
+			return offset;
+	return size;
+}
+
+#define find_first_bit(addr, size)	find_next_bit(addr, size, 0)
+#define find_first_zero_bit(addr, size)	find_next_zero_bit(addr, size, 0)
+
+#define for_each_set_bit(bit, addr, size)				\
+	for ((bit) = find_first_bit((addr), (size));			\
+	     (bit) < (size);						\
+	     (bit) = find_next_bit((addr), (size), (bit) + 1))
+
 #endif /* __BITOPS_H__ */
@@ -40,6 +40,13 @@ do {									\
 	abort();							\
 } while (0)
 
+#define WARN_ON(condition) ({					\
+	int __ret_warn_on = !!(condition);				\
+	if (__ret_warn_on)						\
+		__WARN();						\
+	__ret_warn_on;							\
+})
+
 #define WARN(condition, format...) ({					\
 	int __ret_warn_on = !!(condition);				\
 	if (__ret_warn_on) {						\
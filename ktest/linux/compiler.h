@@ -29,12 +29,39 @@ typedef long ktime_t;
 /* asm/types.h */
 #define BITS_PER_LONG	64
 
+#define READ_ONCE(x)	(*(volatile typeof(x) *)&(x))
+#define WRITE_ONCE(x, v) (*(volatile typeof(x) *)&(x) = (v))
+
 #define likely(e)	__builtin_expect((bool)(e), 1)
 #define unlikely(e)	__builtin_expect((bool)(e), 0)
 
 #define cpu_to_be64(x)	__builtin_bswap64(x)
 #define be64_to_cpu(x)	__builtin_bswap64(x)
+#define cpu_to_be32(x)	__builtin_bswap32(x)
+#define be32_to_cpu(x)	__builtin_bswap32(x)
 
 #define __percpu
+#define __rcu
+
+#define __maybe_unused		__attribute__((unused))
+#define __must_check		__attribute__((warn_unused_result))
+#ifndef __always_inline
+#define __always_inline		inline __attribute__((always_inline))
+#endif
+#define noinline		__attribute__((noinline))
+#define __cold			__attribute__((cold))
+#define __packed		__attribute__((packed))
+#define __annotate_jump_table
+#define fallthrough		__attribute__((__fallthrough__))
+
+/* objtool annotations. */
+#define STACK_FRAME_NON_STANDARD(func)
+
+#define barrier()		__asm__ __volatile__("" : : : "memory")
+
+#define ___PASTE(a, b)		a##b
+#define __PASTE(a, b)		___PASTE(a, b)
+#define __UNIQUE_ID(prefix)	__PASTE(__PASTE(__UNIQUE_ID_, prefix),	\
+					__COUNTER__)
 
 #endif /* __COMPILER_H__ */
@@ -0,0 +1,44 @@
+/**
+ *	Tempesta kernel emulation unit testing framework.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __KTEST_LINUX_HASH_H__
+#define __KTEST_LINUX_HASH_H__
+
+#include <linux/types.h>
+
+#define GOLDEN_RATIO_64		0x61C8864680B583EBull
+
+static inline u64
+hash_64(u64 val, unsigned int bits)
+{
+	return val * GOLDEN_RATIO_64 >> (64 - bits);
+}
+
+#define GOLDEN_RATIO_32		0x61C88647
+
+static inline u32
+hash_32(u32 val, unsigned int bits)
+{
+	return val * GOLDEN_RATIO_32 >> (32 - bits);
+}
+
+#define hash_long(val, bits)	hash_64(val, bits)
+#define hash_ptr(ptr, bits)	hash_long((unsigned long)(ptr), bits)
+
+#endif /* __KTEST_LINUX_HASH_H__ */
@@ -0,0 +1,56 @@
+/**
+ *	Tempesta kernel emulation unit testing framework.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __KTEST_LINUX_HASHTABLE_H__
+#define __KTEST_LINUX_HASHTABLE_H__
+
+#include <linux/hash.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+
+#define DEFINE_HASHTABLE(name, bits)					\
+	struct hlist_head name[1 << (bits)] =				\
+			{ [0 ... ((1 << (bits)) - 1)] = { NULL } }
+#define DECLARE_HASHTABLE(name, bits)					\
+	struct hlist_head name[1 << (bits)]
+
+#define HASH_SIZE(name)		(ARRAY_SIZE(name))
+#define HASH_BITS(name)		ilog2(HASH_SIZE(name))
+
+#define hash_min(val, bits)	hash_long(val, bits)
+
+static inline void
+__hash_init(struct hlist_head *ht, unsigned int sz)
+{
+	unsigned int i;
+
+	for (i = 0; i < sz; i++)
+		INIT_HLIST_HEAD(&ht[i]);
+}
+
+#define hash_init(ht)		__hash_init(ht, HASH_SIZE(ht))
+#define hash_add(ht, node, key)						\
+	hlist_add_head(node, &ht[hash_min(key, HASH_BITS(ht))])
+#define hash_del(node)		hlist_del(node)
+
+#define hash_for_each_possible(name, obj, member, key)			\
+	hlist_for_each_entry(obj, &name[hash_min(key, HASH_BITS(name))],\
+			     member)
+
+#endif /* __KTEST_LINUX_HASHTABLE_H__ */
@@ -0,0 +1,47 @@
+/**
+ *	Tempesta kernel emulation unit testing framework.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __KTEST_LINUX_JHASH_H__
+#define __KTEST_LINUX_JHASH_H__
+
+#include <linux/types.h>
+
+/*
+ * Jenkins one-at-a-time hash: the values differ from the kernel jhash(),
+ * but the callers need a hash function only.
+ */
+static inline u32
+jhash(const void *key, u32 length, u32 initval)
+{
+	const unsigned char *k = key;
+	u32 h = initval;
+
+	while (length--) {
+		h += *k++;
+		h += h << 10;
+		h ^= h >> 6;
+	}
+	h += h << 3;
+	h ^= h >> 11;
+	h += h << 15;
+
+	return h;
+}
+
+#endif /* __KTEST_LINUX_JHASH_H__ */
@@ -0,0 +1,51 @@
+/**
+ *	Tempesta kernel emulation unit testing framework.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __JIFFIES_H__
+#define __JIFFIES_H__
+
+#include <time.h>
+
+#define HZ			1000
+
+static inline unsigned long
+__ktest_jiffies(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	return ts.tv_sec * HZ + ts.tv_nsec / (1000000000 / HZ);
+}
+
+#define jiffies			__ktest_jiffies()
+
+#define time_after(a, b)	((long)((b) - (a)) < 0)
+#define time_before(a, b)	time_after(b, a)
+#define time_after_eq(a, b)	((long)((a) - (b)) >= 0)
+#define time_before_eq(a, b)	time_after_eq(b, a)
+#define time_in_range(a, b, c)	(time_after_eq(a, b) && time_before_eq(a, c))
+
+#define time_is_before_jiffies(a)	time_after(jiffies, a)
+#define time_is_after_jiffies(a)	time_before(jiffies, a)
+
+#define msecs_to_jiffies(m)	((unsigned long)(m) * HZ / 1000)
+#define jiffies_to_msecs(j)	((unsigned int)((j) * 1000 / HZ))
+
+#endif /* __JIFFIES_H__ */
@@ -0,0 +1,37 @@
+/**
+ *	Tempesta kernel emulation unit testing framework.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __JUMP_LABEL_H__
+#define __JUMP_LABEL_H__
+
+#include <stdbool.h>
+
+struct static_key_false {
+	bool	enabled;
+};
+
+#define DEFINE_STATIC_KEY_FALSE(name)	struct static_key_false name
+#define DECLARE_STATIC_KEY_FALSE(name)	extern struct static_key_false name
+
+#define static_branch_likely(x)		((x)->enabled)
+#define static_branch_unlikely(x)	((x)->enabled)
+#define static_branch_enable(x)		((x)->enabled = true)
+#define static_branch_disable(x)	((x)->enabled = false)
+
+#endif /* __JUMP_LABEL_H__ */
@@ -22,15 +22,21 @@
 
 #include <linux/errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "bug.h"
 #include "compiler.h"
+#include "err.h"
+#include "init.h"
+#include "jiffies.h"
 
 #define ARRAY_SIZE(x)   	(sizeof(x) / sizeof(*(x)))
 
 #define KERN_INFO		""
 #define KERN_WARNING		""
 #define KERN_ERR		""
+#define KERN_CONT		""
 
 #define printk			printf
 #define pr_err(fmt, ...)	fprintf(stderr, fmt, ##__VA_ARGS__)
@@ -52,7 +58,9 @@
 #define __page_aligned_data	__attribute__((__aligned__(4096)))
 #define CRYPTO_MINALIGN_ATTR __attribute__ ((__aligned__(L1_CACHE_BYTES)))
 
+#ifndef offsetof
 #define offsetof(TYPE, MEMBER)	((size_t)&((TYPE *)0)->MEMBER)
+#endif
 
 #define container_of(ptr, type, member) ({				\
 	void *__mptr = (void *)(ptr);					\
@@ -84,16 +92,42 @@
 #define max_t(type, x, y)						\
 	__max(type, type, (min1_), (min2_), x, y)
 
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+
+#define clamp_t(type, val, lo, hi)	min_t(type, max_t(type, val, lo), hi)
+
+static inline int
+kstrtoul(const char *s, unsigned int base, unsigned long *res)
+{
+	char *end;
+
+	*res = strtoul(s, &end, base);
+	if (end == s || (*end && *end != '\n'))
+		return -EINVAL;
+
+	return 0;
+}
+
 struct module { /* dummy strut */ };
 
 #define request_module(...)
 
-#define __init
 
 struct list_head {
 	struct list_head *next, *prev;
 };
 
+struct hlist_head {
+	struct hlist_node *first;
+};
+
+struct hlist_node {
+	struct hlist_node *next, **pprev;
+};
+
+#define BITS_TO_LONGS(nr)	DIV_ROUND_UP(nr, BITS_PER_LONG)
+#define DECLARE_BITMAP(name, bits)	unsigned long name[BITS_TO_LONGS(bits)]
+
 static inline int
 get_random_bytes_arch(void *buf, int nbytes)
 {
@@ -169,4 +203,12 @@ task_stack_page(void)
 
 #define EXPORT_SYMBOL(...)
 
+#include "bitmap.h"
+#include "cache.h"
+#include "list.h"
+#include "preempt.h"
+#include "rcupdate.h"
+#include "sched.h"
+#include "topology.h"
+
 #endif /* __KERNEL_H__ */
@@ -29,6 +29,7 @@
 	name:
 
 #define SYM_FUNC_START(name)	SYM_START(name, SYM_L_GLOBAL, .align 4)
+#define SYM_CODE_START(name)	SYM_START(name, SYM_L_GLOBAL, .align 4)
 
 #define SYM_CODE_END(name)						\
 	.size name, .-name
@@ -22,6 +22,8 @@
 
 #define DECLARE_PER_CPU(type, name)	extern type name
 #define DEFINE_PER_CPU(type, name)	type name
+#define DECLARE_PER_CPU_ALIGNED(type, name)	extern type name
+#define DEFINE_PER_CPU_ALIGNED(type, name)	type name
 
 #ifndef NR_CPUS
 /* 32 should be enough for testing. */
@@ -30,16 +32,24 @@
 
 #define __get_cpu_var(var)		var
 #define this_cpu_read(var)		var
+#define this_cpu_inc(var)		((var)++)
+#define this_cpu_dec(var)		((var)--)
+#define this_cpu_add(var, n)		((var) += (n))
+#define this_cpu_sub(var, n)		((var) -= (n))
+
+#define smp_processor_id()		0
+#define raw_smp_processor_id()		0
 #define alloc_percpu(t)			calloc(NR_CPUS, sizeof(t))
 #define __alloc_percpu(s, a)		calloc(NR_CPUS, (s))
 #define free_percpu(p)			free(p)
 #define for_each_possible_cpu(c)	for (c = 0; c < NR_CPUS; ++c)
+#define for_each_online_cpu(c)		for_each_possible_cpu(c)
 
 #if NR_CPUS == 1
 
 #define per_cpu_ptr(ptr, cpu)		({ (void)(cpu); (ptr); })
 #define per_cpu(var, cpu)		(*per_cpu_ptr(&(var), cpu))
-#define this_cpu_ptr(var)		var
+#define this_cpu_ptr(var)		(var)
 
 #else /* multiprocessing */
 
@@ -27,6 +27,9 @@
 #define local_bh_disable()
 #define local_bh_enable()
 
+#define in_serving_softirq()		0
+#define in_softirq()			0
+
 #define preempt_disable()
 #define preempt_enable()
 
@@ -0,0 +1,35 @@
+/**
+ *	Tempesta kernel emulation unit testing framework.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __RBTREE_H__
+#define __RBTREE_H__
+
+struct rb_node {
+	unsigned long	__rb_parent_color;
+	struct rb_node	*rb_right;
+	struct rb_node	*rb_left;
+};
+
+struct rb_root {
+	struct rb_node	*rb_node;
+};
+
+#define RB_ROOT		(struct rb_root) { NULL, }
+
+#endif /* __RBTREE_H__ */
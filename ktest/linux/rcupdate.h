@@ -0,0 +1,44 @@
+/**
+ *	Tempesta kernel emulation unit testing framework.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __RCUPDATE_H__
+#define __RCUPDATE_H__
+
+/*
+ * The tests don't remove records, so just never reclaim retired records:
+ * RCU callbacks aren't called.
+ */
+struct rcu_head {
+	struct rcu_head	*next;
+	void		(*func)(struct rcu_head *head);
+};
+
+#define rcu_read_lock()
+#define rcu_read_unlock()
+#define rcu_read_lock_bh()
+#define rcu_read_unlock_bh()
+#define rcu_dereference(p)		(p)
+#define rcu_dereference_protected(p, c)	(p)
+#define rcu_access_pointer(p)		(p)
+#define rcu_assign_pointer(p, v)	((p) = (v))
+#define synchronize_rcu()
+#define call_rcu(head, f)		((void)(head), (void)(f))
+#define rcu_barrier()
+
+#endif /* __RCUPDATE_H__ */
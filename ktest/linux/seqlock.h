@@ -0,0 +1,69 @@
+/**
+ *	Tempesta kernel emulation unit testing framework.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __SEQLOCK_H__
+#define __SEQLOCK_H__
+
+#include "compiler.h"
+
+/*
+ * Sequence counters. Writers are serialized by a lock, so just keep odd
+ * counter values while a write is in progress.
+ */
+typedef struct {
+	unsigned int	sequence;
+} seqcount_t;
+
+#define seqcount_init(s)		((s)->sequence = 0)
+
+static inline unsigned int
+read_seqcount_begin(const seqcount_t *s)
+{
+	unsigned int seq;
+
+	while ((seq = READ_ONCE(s->sequence)) & 1)
+		;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return seq;
+}
+
+static inline int
+read_seqcount_retry(const seqcount_t *s, unsigned int start)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return READ_ONCE(s->sequence) != start;
+}
+
+static inline void
+write_seqcount_begin(seqcount_t *s)
+{
+	s->sequence++;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+write_seqcount_end(seqcount_t *s)
+{
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	s->sequence++;
+}
+
+#endif /* __SEQLOCK_H__ */
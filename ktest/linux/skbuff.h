@@ -23,12 +23,14 @@
 #include "atomic.h"
 #include "compiler.h"
 #include "kernel.h"
+#include "rbtree.h"
+#include "slab.h"
 
 typedef unsigned int __wsum;
 typedef unsigned char *sk_buff_data_t;
 
-struct rb_node { /* dummy strut */ };
-struct sock { /* dummy strut */ };
+struct sock;
+struct ubuf_info;
 struct net_device { /* dummy strut */ };
 
 struct sk_buff {
@@ -142,4 +144,172 @@ struct sk_buff {
 	refcount_t		users;
 };
 
+struct sk_buff_head {
+	struct sk_buff		*next;
+	struct sk_buff		*prev;
+	__u32			qlen;
+	spinlock_t		lock;
+};
+
+/*
+ * There are no pages in user space, a page pointer is the address of
+ * the page data.
+ */
+struct page;
+
+#define page_address(p)		((void *)(p))
+#define virt_to_page(a)		((struct page *)(a))
+
+#define MAX_SKB_FRAGS		17
+
+typedef struct bio_vec {
+	struct page		*bv_page;
+	unsigned int		bv_len;
+	unsigned int		bv_offset;
+} skb_frag_t;
+
+struct skb_shared_info {
+	__u8			nr_frags;
+	__u8			tx_flags;
+	unsigned int		gso_size;
+	struct sk_buff		*frag_list;
+	skb_frag_t		frags[MAX_SKB_FRAGS];
+};
+
+#define skb_shinfo(skb)		((struct skb_shared_info *)((skb)->end))
+
+static inline unsigned int
+skb_headlen(const struct sk_buff *skb)
+{
+	return skb->len - skb->data_len;
+}
+
+static inline unsigned char *
+skb_tail_pointer(const struct sk_buff *skb)
+{
+	return skb->tail;
+}
+
+static inline int
+skb_tailroom(const struct sk_buff *skb)
+{
+	return skb->data_len ? 0 : skb->end - skb->tail;
+}
+
+static inline void
+skb_reserve(struct sk_buff *skb, int len)
+{
+	skb->data += len;
+	skb->tail += len;
+}
+
+static inline void *
+skb_put(struct sk_buff *skb, unsigned int len)
+{
+	void *tmp = skb->tail;
+
+	BUG_ON(skb->tail + len > skb->end);
+	skb->tail += len;
+	skb->len += len;
+
+	return tmp;
+}
+
+static inline void *
+skb_push(struct sk_buff *skb, unsigned int len)
+{
+	skb->data -= len;
+	skb->len += len;
+	BUG_ON(skb->data < skb->head);
+
+	return skb->data;
+}
+
+static inline void *
+skb_frag_address(const skb_frag_t *frag)
+{
+	return (char *)page_address(frag->bv_page) + frag->bv_offset;
+}
+
+static inline unsigned int
+skb_frag_size(const skb_frag_t *frag)
+{
+	return frag->bv_len;
+}
+
+static inline void
+skb_frag_size_add(skb_frag_t *frag, int delta)
+{
+	frag->bv_len += delta;
+}
+
+static inline void
+skb_fill_page_desc(struct sk_buff *skb, int i, struct page *page, int off,
+		   int size)
+{
+	skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+
+	frag->bv_page = page;
+	frag->bv_offset = off;
+	frag->bv_len = size;
+	skb_shinfo(skb)->nr_frags = i + 1;
+}
+
+/**
+ * Allocate a linear skb, the shared info follows the data like in the kernel.
+ */
+static inline struct sk_buff *
+alloc_skb(unsigned int size, gfp_t priority)
+{
+	struct sk_buff *skb;
+
+	size = (size + SMP_CACHE_BYTES - 1) & ~(SMP_CACHE_BYTES - 1);
+	if (!(skb = calloc(1, sizeof(*skb))))
+		return NULL;
+	if (!(skb->head = calloc(1, size + sizeof(struct skb_shared_info)))) {
+		free(skb);
+		return NULL;
+	}
+	skb->data = skb->tail = skb->head;
+	skb->end = skb->head + size;
+	skb->truesize = size + sizeof(*skb);
+	atomic_set(&skb->users.refs, 1);
+
+	return skb;
+}
+
+static inline void
+kfree_skb(struct sk_buff *skb)
+{
+	if (!skb)
+		return;
+	free(skb->head);
+	free(skb);
+}
+
+#define consume_skb(skb)	kfree_skb(skb)
+
+static inline struct sk_buff *
+skb_peek(const struct sk_buff_head *list)
+{
+	struct sk_buff *skb = list->next;
+
+	return skb == (struct sk_buff *)list ? NULL : skb;
+}
+
+static inline struct sk_buff *
+skb_dequeue(struct sk_buff_head *list)
+{
+	struct sk_buff *skb = skb_peek(list);
+
+	if (skb) {
+		skb->next->prev = skb->prev;
+		skb->prev->next = skb->next;
+		skb->next = skb->prev = NULL;
+		list->qlen--;
+	}
+
+	return skb;
+}
+
 #endif /* __SKBUFF_H__ */
@@ -79,14 +79,22 @@ __get_free_pages(gfp_t gfp_mask, unsigned int order)
 #define kzalloc(size, ...)		calloc(1, size)
 
 #define kfree(p)			free(p)
+#define kcalloc(n, size, ...)		calloc(n, size)
+#define kvcalloc(n, size, ...)		calloc(n, size)
+#define kvmalloc_array(n, size, ...)	calloc(n, size)
+#define kvfree(p)			free(p)
+#define kstrdup(s, ...)			strdup(s)
 #define free_pages(p, order)		free((void *)p)
 
-#define get_order(n)	( ((n) < 4096) ? 0				\
-			  : ((n) < 8192) ? 1				\
-			    : ((n) < 16384) ? 2				\
-			      : ((n) < 32768) ? 3			\
-			        : ((n) < 65536) ? 4			\
-				  : ((n) < 131072) ? 5			\
-				    : ((n) < 262144) ? 6 : (abort(), 7) )
+static inline int
+get_order(unsigned long size)
+{
+	int order = 0;
+
+	for (size = (size - 1) >> 12; size; size >>= 1)
+		++order;
+
+	return order;
+}
 
 #endif /* __SLAB_H__ */
@@ -0,0 +1,39 @@
+/**
+ *	Tempesta kernel emulation unit testing framework.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __NET_INET_SOCK_H__
+#define __NET_INET_SOCK_H__
+
+#include <netinet/in.h>
+
+#include "sock.h"
+
+struct inet_sock {
+	struct sock	sk;
+	__be16		inet_sport;
+	__be16		inet_dport;
+};
+
+static inline struct inet_sock *
+inet_sk(const struct sock *sk)
+{
+	return (struct inet_sock *)sk;
+}
+
+#endif /* __NET_INET_SOCK_H__ */
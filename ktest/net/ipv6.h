@@ -0,0 +1,41 @@
+/**
+ *	Tempesta kernel emulation unit testing framework.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __NET_IPV6_H__
+#define __NET_IPV6_H__
+
+#include <netinet/in.h>
+#include <stdbool.h>
+
+static inline bool
+ipv6_addr_v4mapped(const struct in6_addr *a)
+{
+	return IN6_IS_ADDR_V4MAPPED(a);
+}
+
+static inline void
+ipv6_addr_set_v4mapped(const __be32 addr, struct in6_addr *v4mapped)
+{
+	memset(v4mapped, 0, 10);
+	v4mapped->s6_addr[10] = 0xff;
+	v4mapped->s6_addr[11] = 0xff;
+	memcpy(&v4mapped->s6_addr[12], &addr, 4);
+}
+
+#endif /* __NET_IPV6_H__ */
@@ -0,0 +1,45 @@
+/**
+ *	Tempesta kernel emulation unit testing framework.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __NET_SOCK_H__
+#define __NET_SOCK_H__
+
+#include "linux/compiler.h"
+#include "linux/cpumask.h"
+#include "linux/skbuff.h"
+#include "linux/spinlock.h"
+#include "linux/timer.h"
+#include "linux/topology.h"
+#include "linux/workqueue.h"
+
+struct sock {
+	unsigned char	sk_state;
+	void		*sk_user_data;
+	void		(*sk_state_change)(struct sock *sk);
+	void		(*sk_data_ready)(struct sock *sk);
+	void		(*sk_write_space)(struct sock *sk);
+	int		(*sk_write_xmit)(struct sock *sk, struct sk_buff *skb,
+					 unsigned int mss_now,
+					 unsigned int limit);
+};
+
+#define sock_hold(sk)		((void)(sk))
+#define sock_put(sk)		((void)(sk))
+
+#endif /* __NET_SOCK_H__ */
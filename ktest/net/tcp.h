@@ -0,0 +1,54 @@
+/**
+ *	Tempesta kernel emulation unit testing framework.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __NET_TCP_H__
+#define __NET_TCP_H__
+
+#include "sock.h"
+
+/* Tempesta FW reserves the room for TLS and HTTP/2 headers in each skb. */
+#define HTTP2_MAX_OFFSET	32
+#define MAX_TCP_HEADER		(128 + 32 + 16 + HTTP2_MAX_OFFSET)
+#define SKB_DATA_ALIGN(x)	(((x) + (SMP_CACHE_BYTES - 1))		\
+				 & ~(SMP_CACHE_BYTES - 1))
+#define SKB_MAX_HEADER	(PAGE_SIZE - MAX_TCP_HEADER			\
+			 - SKB_DATA_ALIGN(sizeof(struct sk_buff))	\
+			 - SKB_DATA_ALIGN(sizeof(struct skb_shared_info)) \
+			 - SKB_DATA_ALIGN(1))
+
+enum {
+	TCP_ESTABLISHED = 1,
+	TCP_CLOSE = 7,
+};
+
+struct tcphdr;
+
+struct tcp_sock {
+	struct sock	sk;
+	u32		write_seq;
+	u32		snd_nxt;
+};
+
+static inline struct tcp_sock *
+tcp_sk(const struct sock *sk)
+{
+	return (struct tcp_sock *)sk;
+}
+
+#endif /* __NET_TCP_H__ */
@@ -17,10 +17,74 @@
  * this program; if not, write to the Free Software Foundation, Inc., 59
  * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
+#include <linux/init.h>
 #include <linux/kernel.h>
 
 #include "hash.h"
 
+/*
+ * The CRC32 instruction has latency of 3 cycles and throughput of 1 cycle,
+ * so the two lanes of the hash can't load the CPU. Long data is processed
+ * by stripes of three blocks, and each of the blocks is hashed by its own
+ * pair of lanes, so six independent CRC chains run in parallel. The lanes
+ * of the second and the third blocks start from zero and are recombined
+ * with the first block lanes at the end of the stripe: a CRC state is
+ * advanced over the data of the following blocks as over the zero data,
+ * which is a linear function of the state, and the CRCs of the blocks are
+ * XORed to it. The result is the same as of the plain two lanes hashing,
+ * so the hash values don't depend on the data length threshold or on the
+ * chunks of the data hashed by tfw_hash_str_len().
+ *
+ * @hash_shift[s] advance a CRC state over (s + 1) * HASH_LANE_WORDS zero
+ * words, a byte of the state per table. The tables are used instead of
+ * PCLMUL to not to use FPU registers.
+ */
+#define HASH_LANE_WORDS		16
+#define HASH_STRIPE_WORDS	(HASH_LANE_WORDS * 2 * 3)
+
+static u32 hash_shift[2][4][256] __read_mostly;
+
+static inline unsigned long
+hash_shift_apply(u32 (*t)[256], unsigned long crc)
+{
+	return t[0][crc & 0xff] ^ t[1][(crc >> 8) & 0xff]
+	       ^ t[2][(crc >> 16) & 0xff] ^ t[3][crc >> 24];
+}
+
+/*
+ * Hash the whole stripes of @n words at @d and return the number of the
+ * processed words.
+ */
+static size_t
+__hash_calc_stripes(unsigned long *crc0, unsigned long *crc1,
+		    const unsigned long *d, size_t n)
+{
+	const size_t w = HASH_LANE_WORDS * 2;
+	size_t i, done;
+
+	for (done = 0; n - done >= HASH_STRIPE_WORDS;
+	     done += HASH_STRIPE_WORDS, d += HASH_STRIPE_WORDS)
+	{
+		unsigned long a0 = *crc0, a1 = *crc1;
+		unsigned long b0 = 0, b1 = 0, c0 = 0, c1 = 0;
+
+		for (i = 0; i < w; i += 2) {
+			CRCQ(a0, d[i]);
+			CRCQ(a1, d[i + 1]);
+			CRCQ(b0, d[w + i]);
+			CRCQ(b1, d[w + i + 1]);
+			CRCQ(c0, d[2 * w + i]);
+			CRCQ(c1, d[2 * w + i + 1]);
+		}
+		*crc0 = hash_shift_apply(hash_shift[1], a0)
+			^ hash_shift_apply(hash_shift[0], b0) ^ c0;
+		*crc1 = hash_shift_apply(hash_shift[1], a1)
+			^ hash_shift_apply(hash_shift[0], b1) ^ c1;
+	}
+
+	return done;
+}
+
 /**
  * CRC32 instruction doesn't use FPU registers,
  * so no need for FPU context protection.
@@ -29,11 +93,12 @@ void
 __hash_calc(unsigned long *crc0, unsigned long *crc1, const char *data,
 	    size_t len)
 {
-	int i;
-	size_t n = (len >> 3) & ~1UL;
+	size_t i = 0, n = (len >> 3) & ~1UL;
 	unsigned long *d = (unsigned long *)data;
 
-	for (i = 0; i < n; i += 2) {
+	if (n >= HASH_STRIPE_WORDS)
+		i = __hash_calc_stripes(crc0, crc1, d, n);
+	for ( ; i < n; i += 2) {
 		CRCQ(*crc0, d[i]);
 		CRCQ(*crc1, d[i + 1]);
 	}
@@ -47,3 +112,19 @@ __hash_calc(unsigned long *crc0, unsigned long *crc1, const char *data,
 	}
 }
 EXPORT_SYMBOL(__hash_calc);
+
+void __init
+hash_calc_init(void)
+{
+	int s, j, b, i;
+
+	for (s = 0; s < 2; ++s)
+		for (j = 0; j < 4; ++j)
+			for (b = 0; b < 256; ++b) {
+				unsigned long crc = (unsigned long)b << (j * 8);
+
+				for (i = 0; i < HASH_LANE_WORDS * (s + 1); ++i)
+					CRCQ(crc, 0UL);
+				hash_shift[s][j][b] = crc;
+			}
+}
@@ -28,6 +28,7 @@
 
 void __hash_calc(unsigned long *crc0, unsigned long *crc1, const char *data,
 		 size_t len);
+void hash_calc_init(void);
 
 static inline unsigned long
 hash_calc(const char *data, size_t len)
@@ -20,6 +20,8 @@
 #include <linux/module.h>
 #include <linux/string.h>
 
+#include "hash.h"
+
 MODULE_AUTHOR("Tempesta Technologies, INC");
 MODULE_VERSION("0.1.1");
 MODULE_LICENSE("GPL");
@@ -65,6 +67,8 @@ EXPORT_SYMBOL(bzero_fast);
 static int __init
 tempesta_lib_init(void)
 {
+	hash_calc_init();
+
 	return 0;
 }
 
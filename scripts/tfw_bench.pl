@@ -0,0 +1,491 @@
+#!/usr/bin/env perl
+#
+# Run the user space benchmarks of Tempesta FW, store the results as JSON
+# and compare them with a baseline.
+#
+# Copyright (C) 2026 Tempesta Technologies, Inc.
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License,
+# or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.
+# See the GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program; if not, write to the Free Software Foundation, Inc., 59
+# Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+use 5.16.0;
+use strict;
+use warnings;
+use Cwd 'abs_path';
+use File::Basename;
+use File::Temp 'tempdir';
+use Getopt::Long;
+use JSON::PP;
+use POSIX qw(strftime);
+
+my $root = abs_path(dirname(abs_path($0)) . '/..');
+my @all_suites = qw(tls tdb cache parser str);
+
+my %opt = (
+	runs		=> 3,
+	threshold	=> 5,
+	out		=> 'bench.json',
+	suites		=> join(',', @all_suites),
+);
+GetOptions(\%opt, 'runs|n=i', 'threshold|t=f', 'out|o=s', 'baseline|b=s',
+	   'suites|s=s', 'help|h')
+	&& !$opt{help} && $opt{runs} > 0 && !@ARGV
+	or die "Usage: $0 [-n <runs>] [-s <suites>] [-o <out.json>]"
+	       . " [-b <baseline.json>] [-t <threshold %>]\n";
+
+# Two worker threads for the multi-threaded benchmarks, so the results are
+# comparable between machines with different number of CPUs.
+my $threads = `getconf _NPROCESSORS_ONLN` > 1 ? 2 : 1;
+
+sub slug
+{
+	my ($s) = @_;
+
+	$s = lc $s;
+	$s =~ s/[^a-z0-9.]+/_/g;
+	$s =~ s/^_|_$//g;
+	return $s;
+}
+
+sub build
+{
+	my ($dir, @targets) = @_;
+
+	say STDERR "Building $dir...";
+	my $log = `make -C $root/$dir @targets 2>&1`;
+	die "$log\nCannot build $dir\n" if $?;
+}
+
+# Run a benchmark and return its stdout lines.
+sub run
+{
+	my ($cmd) = @_;
+
+	my @out = `$cmd`;
+	die "'$cmd' failed\n" if $?;
+	chomp @out;
+	return @out;
+}
+
+# Parse CSV output with a header line to an array of hashes.
+sub csv
+{
+	my ($hdr, @lines) = @_;
+	my @keys = split /,/, $hdr;
+
+	return map {
+		my %r;
+		@r{@keys} = split /,/;
+		\%r;
+	} @lines;
+}
+
+#
+# Each suite function runs the benchmark once and returns a hash of
+# name => [value, unit, better], where better is 'higher' or 'lower'.
+#
+
+sub bench_tls
+{
+	my %res;
+
+	for (csv(run("cd $root/tls/t && ./benchmark -c -t 1"))) {
+		$res{'tls/' . slug($_->{name})}
+			= [$_->{ops_per_s}, 'ops/s', 'higher'];
+	}
+	return %res;
+}
+
+sub bench_tdb
+{
+	my %res;
+
+	for (csv(run("$root/db/t/tdb_bench -t $threads -m 32 -o 200000"))) {
+		my $n = join('/', 'tdb', $_->{phase},
+			     "$_->{recs}_$_->{rec_len}", $_->{dist});
+		$res{$n} = [$_->{ops_per_sec}, 'ops/s', 'higher'];
+	}
+	return %res;
+}
+
+sub bench_cache
+{
+	my %res;
+
+	# Full tables while the write burst are expected, so stderr is muted.
+	for (csv(run("$root/db/t/tdb_cache_bench -t $threads -m 64 -k 5000"
+		     . " -S 16384 2>/dev/null")))
+	{
+		$res{"cache/$_->{mode}"} = [$_->{hits_per_sec}, 'hits/s',
+					    'higher'];
+	}
+	return %res;
+}
+
+sub hpack_int
+{
+	my ($v, $prefix, $mask) = @_;
+	my $max = (1 << $prefix) - 1;
+
+	return chr($mask | $v) if $v < $max;
+	my $s = chr($mask | $max);
+	for ($v -= $max; $v >= 128; $v >>= 7) {
+		$s .= chr(($v & 127) | 128);
+	}
+	return $s . chr($v);
+}
+
+sub hpack_str
+{
+	my ($s) = @_;
+
+	return hpack_int(length $s, 7, 0) . $s;
+}
+
+sub h2_headers
+{
+	my ($id, $block) = @_;
+
+	return pack('NCN', length($block) << 8 | 1, 5, $id) . $block;
+}
+
+# Write the parser inputs: browser like requests with a typical header set,
+# responses with a small body and HTTP/2 requests with literal header fields
+# and with fields from the HPACK dynamic table as real clients send them.
+sub parser_inputs
+{
+	my ($dir) = @_;
+	my $n = 100;
+	my @hdrs = (
+		[58, 'user-agent', 'Mozilla/5.0 (X11; Linux x86_64; rv:128.0)'
+				   . ' Gecko/20100101 Firefox/128.0'],
+		[19, 'accept', 'text/html,application/xhtml+xml,application/'
+			       . 'xml;q=0.9,*/*;q=0.8'],
+		[17, 'accept-language', 'en-US,en;q=0.5'],
+		[16, 'accept-encoding', 'gzip, deflate, br'],
+		[51, 'referer', 'https://www.example.com/index.html'],
+		[32, 'cookie', '_ga=GA1.2.1234567890.1234567890; session='
+			       . '5f2b9e0c4d8a7b6e3f1c0a9d8e7b6c5a'],
+	);
+	my ($h1, $resp, $lit, $idx) = ('', '', '', '');
+	my $body = 'x' x 1024;
+
+	for my $i (0 .. $n - 1) {
+		my $path = "/static/img/logo-$i.png?v=1.2.3";
+
+		$h1 .= "GET $path HTTP/1.1\r\nHost: www.example.com\r\n"
+		       . join('', map { "\u$_->[1]: $_->[2]\r\n" } @hdrs)
+		       . "Connection: keep-alive\r\n\r\n";
+		$resp .= "HTTP/1.1 200 OK\r\n"
+			 . "Date: Thu, 15 Oct 2026 10:00:00 GMT\r\n"
+			 . "Server: nginx\r\n"
+			 . "Content-Type: text/html; charset=utf-8\r\n"
+			 . "Content-Length: " . length($body) . "\r\n"
+			 . "Cache-Control: max-age=3600\r\n"
+			 . "ETag: \"5f2b9e0c-$i\"\r\n"
+			 . "Last-Modified: Wed, 14 Oct 2026 10:00:00 GMT\r\n"
+			 . "Vary: Accept-Encoding\r\n\r\n" . $body;
+
+		# :method GET, :scheme https and :authority, :path literals.
+		my $pseudo = "\x82\x87" . hpack_int(1, 4, 0)
+			     . hpack_str('www.example.com')
+			     . hpack_int(4, 4, 0) . hpack_str($path);
+		my $b = $pseudo;
+		$b .= hpack_int($_->[0], 4, 0) . hpack_str($_->[2]) for @hdrs;
+		$lit .= h2_headers(2 * $i + 1, $b);
+
+		# The first request adds the headers to the dynamic table with
+		# incremental indexing, the newest entry has index 62.
+		$b = $pseudo;
+		for my $j (0 .. $#hdrs) {
+			$b .= $i ? hpack_int(62 + $#hdrs - $j, 7, 0x80)
+				 : hpack_int($hdrs[$j][0], 6, 0x40)
+				   . hpack_str($hdrs[$j][2]);
+		}
+		$idx .= h2_headers(2 * $i + 1, $b);
+	}
+
+	my %f = (
+		h1_req		=> $h1,
+		h1_resp		=> $resp,
+		h2_req_literal	=> $lit,
+		h2_req_indexed	=> $idx,
+	);
+	for (keys %f) {
+		open(my $fh, '>', "$dir/$_")
+			or die "Cannot write $dir/$_: $!\n";
+		binmode $fh;
+		print $fh $f{$_};
+		close $fh;
+	}
+}
+
+my $parser_dir;
+
+sub bench_parser
+{
+	my %res;
+	my $hp = "$root/fw/t/unit/user_space/hot_path";
+	my %args = (
+		h1_req		=> '',
+		h1_req_chunk_64	=> '-c 64',
+		h1_resp		=> '-r',
+		h2_req_literal	=> '-2',
+		h2_req_indexed	=> '-2',
+	);
+
+	unless ($parser_dir) {
+		$parser_dir = tempdir(CLEANUP => 1);
+		parser_inputs($parser_dir);
+	}
+	for my $n (sort keys %args) {
+		(my $f = $n) =~ s/_chunk_\d+$//;
+		for (run("$hp $args{$n} -n 2000 $parser_dir/$f")) {
+			die "Valid messages are blocked in $n: $_\n"
+				if /blocked [1-9]/;
+			next unless /^([\d.]+) cycles\/byte/;
+			$res{"parser/$n"} = [$1, 'cycles/byte', 'lower'];
+		}
+		die "No results from hot_path for $n\n"
+			unless $res{"parser/$n"};
+	}
+	return %res;
+}
+
+sub bench_str
+{
+	my %res;
+	my $hp = "$root/fw/t/unit/user_space/hot_path";
+
+	# Only the aligned data, the misaligned runs mostly repeat them.
+	for (run("$hp -S")) {
+		next unless /^tfw_test:\s+(.+?)\s+len\s+(\d+)\s+chunks\s+(\d+)
+			     \s+align\s+0:\s+([\d.]+)\s+ns\/op/x;
+		$res{'str/' . slug($1) . "/len_$2/chunks_$3"}
+			= [$4, 'ns/op', 'lower'];
+	}
+	die "No results from the string benchmarks\n" unless %res;
+	return %res;
+}
+
+my %suites = (
+	tls	=> [\&bench_tls, 'tls/t', 'benchmark'],
+	tdb	=> [\&bench_tdb, 'db/t', 'tdb_bench'],
+	cache	=> [\&bench_cache, 'db/t', 'tdb_cache_bench'],
+	parser	=> [\&bench_parser, 'fw/t/unit/user_space', 'hot_path'],
+	str	=> [\&bench_str, 'fw/t/unit/user_space', 'hot_path'],
+);
+
+sub cpu_model
+{
+	open(my $fh, '<', '/proc/cpuinfo') or return 'unknown';
+	while (<$fh>) {
+		return $1 if /^model name\s*:\s*(.*)$/;
+	}
+	return 'unknown';
+}
+
+sub first_line
+{
+	my ($cmd) = @_;
+	my $l = `$cmd 2>/dev/null` // '';
+
+	($l) = split /\n/, $l;
+	return $l // 'unknown';
+}
+
+sub file_line
+{
+	my ($f) = @_;
+
+	open(my $fh, '<', $f) or return 'unknown';
+	chomp(my $l = <$fh> // 'unknown');
+	return $l;
+}
+
+# The environment which affects the results: the results from different
+# CPUs, kernels or compilers aren't comparable.
+sub meta
+{
+	my $commit = first_line("git -C $root rev-parse HEAD");
+	$commit .= '-dirty'
+		if `git -C $root status --porcelain -uno 2>/dev/null`;
+
+	return {
+		date		=> strftime('%Y-%m-%dT%H:%M:%SZ', gmtime),
+		host		=> first_line('uname -n'),
+		cpu		=> cpu_model(),
+		cpus		=> first_line('getconf _NPROCESSORS_ONLN') + 0,
+		governor	=> file_line('/sys/devices/system/cpu/cpu0/'
+					     . 'cpufreq/scaling_governor'),
+		kernel		=> first_line('uname -r'),
+		compiler	=> first_line('cc --version'),
+		commit		=> $commit,
+		runs		=> $opt{runs},
+		threads		=> $threads,
+	};
+}
+
+# Run each suite several times and report the best result and the relative
+# spread of the results, the spread is used as the noise level of a metric.
+# The best result is less affected by the other load on the machine than
+# the median or the average.
+sub measure
+{
+	my (@names) = @_;
+	my (%vals, %res, %built);
+
+	for my $s (@names) {
+		my ($fn, $dir, $target) = @{$suites{$s}};
+
+		build($dir, $target) unless $built{"$dir/$target"}++;
+		for my $r (1 .. $opt{runs}) {
+			say STDERR "Running $s, $r/$opt{runs}...";
+			my %m = $fn->();
+			while (my ($n, $v) = each %m) {
+				push @{$vals{$n}{v}}, $v->[0];
+				@{$vals{$n}}{qw(unit better)} = @$v[1, 2];
+			}
+		}
+	}
+	for my $n (keys %vals) {
+		my @v = sort { $a <=> $b } @{$vals{$n}{v}};
+		my $best = $vals{$n}{better} eq 'higher' ? $v[-1] : $v[0];
+		my $noise = $best ? ($v[-1] - $v[0]) / $best : 0;
+
+		$res{$n} = {
+			value	=> $best + 0,
+			unit	=> $vals{$n}{unit},
+			better	=> $vals{$n}{better},
+			noise	=> sprintf('%.4f', $noise) + 0,
+		};
+	}
+	return \%res;
+}
+
+# A metric regresses if it's worse than the baseline by more than
+# the threshold plus the noise of both the results.
+sub compare
+{
+	my ($cur, $base) = @_;
+	my $regr = 0;
+
+	for (qw(cpu kernel compiler threads)) {
+		next if ($cur->{meta}{$_} // '') eq ($base->{meta}{$_} // '');
+		warn "WARNING: $_ differs from the baseline: '"
+		     . ($base->{meta}{$_} // '') . "' vs '"
+		     . ($cur->{meta}{$_} // '') . "', the results may be"
+		     . " incomparable\n";
+	}
+
+	printf "%-48s %14s %14s %8s %8s\n", 'metric', 'baseline', 'current',
+	       'change', 'limit';
+	for my $n (sort keys %{$cur->{results}}) {
+		my $c = $cur->{results}{$n};
+		my $b = $base->{results}{$n};
+
+		unless ($b && $b->{value}) {
+			printf "%-48s %14s %14.2f\n", $n, '-', $c->{value};
+			next;
+		}
+		my $d = ($c->{value} - $b->{value}) / $b->{value};
+		my $worse = $c->{better} eq 'higher' ? -$d : $d;
+		my $lim = $opt{threshold} / 100 + $c->{noise} + $b->{noise};
+		my $bad = $worse > $lim;
+
+		printf "%-48s %14.2f %14.2f %+7.1f%% %7.1f%%%s\n", $n,
+		       $b->{value}, $c->{value}, $d * 100, $lim * 100,
+		       $bad ? '  REGRESSION' : '';
+		$regr++ if $bad;
+	}
+	for (sort keys %{$base->{results}}) {
+		say "$_: missing in the current results"
+			unless $cur->{results}{$_};
+	}
+
+	return $regr;
+}
+
+my @run = split /,/, $opt{suites};
+for (@run) {
+	die "Unknown benchmark suite '$_', available are: @all_suites\n"
+		unless $suites{$_};
+}
+
+my $base;
+if ($opt{baseline}) {
+	open(my $fh, '<', $opt{baseline})
+		or die "Cannot read $opt{baseline}: $!\n";
+	local $/;
+	$base = decode_json(<$fh>);
+}
+
+my $res = {
+	meta	=> meta(),
+	results	=> measure(@run),
+};
+
+open(my $fh, '>', $opt{out}) or die "Cannot write $opt{out}: $!\n";
+print $fh JSON::PP->new->pretty->canonical->encode($res);
+close $fh;
+say STDERR "The results are written to $opt{out}";
+
+if ($base) {
+	my $regr = compare($res, $base);
+
+	if ($regr) {
+		say "$regr performance regression(s) against $opt{baseline}";
+		exit 1;
+	}
+	say "No performance regressions against $opt{baseline}";
+}
+
+__END__
+
+=head1 NAME
+
+tfw_bench.pl - run the Tempesta FW benchmarks and catch regressions
+
+=head1 SYNOPSIS
+
+tfw_bench.pl [-n <runs>] [-s <suites>] [-o <out.json>] [-b <baseline.json>]
+[-t <threshold %>]
+
+=head1 DESCRIPTION
+
+Builds and runs the user space benchmarks:
+
+	tls	- TLS crypto primitives, tls/t/benchmark;
+	tdb	- TDB inserts and lookups, db/t/tdb_bench;
+	cache	- cache lookups on NUMA nodes, db/t/tdb_cache_bench;
+	parser	- HTTP/1 and HTTP/2 parsers with HPACK decoding,
+		  fw/t/unit/user_space/hot_path on generated traffic;
+	str	- string routines, the test_str_perf.c microbenchmarks.
+
+Each suite runs several times (-n, 3 by default), the best result is stored
+with the relative spread of the results as the noise level. The JSON
+output (-o, bench.json by default) also contains the CPU, kernel, compiler
+and commit, which the results were collected on.
+
+With -b the results are compared with the baseline JSON. A metric regresses
+if it's worse than the baseline by more than the threshold (-t, 5% by
+default) plus the noise of the both results, and the script exits with
+status 1 in this case. The baseline must be collected on the same machine
+with the same kernel and compiler, the script warns if they differ.
+
+Use -s to run only some of the comma separated suites.
+
+The kernel benchmarks, e.g. fw/t/bomber.c, aren't run by the script since
+they require a loaded module and a running server.
+
+=cut
@@ -0,0 +1,169 @@
+/*
+ *		Tempesta TLS
+ *
+ * AES-GCM on VAES and VPCLMULQDQ for TLS records.
+ *
+ * The Linux crypto API requires scatterlists for the records data, walks them
+ * with the generic scatterwalk code and splits the data by pages, so the
+ * vectorized AES-GCM implementation gets short chunks. The routines below are
+ * called directly on the skb fragments of any length: full blocks go to the
+ * assembly routines and only the partial blocks at the fragment borders are
+ * handled here.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <linux/errno.h>
+#include <linux/string.h>
+
+#include "aes_gcm.h"
+
+#ifdef VAES
+
+int
+ttls_aes_gcm_setkey(TlsAesGcmKey *key, const unsigned char *k,
+		    unsigned int len)
+{
+	if (len != 16 && len != 32)
+		return -EINVAL;
+
+	ttls_aes_gcm_setkey_x86_64(key, k, len);
+
+	return 0;
+}
+
+static void
+ttls_aes_gcm_ctr_inc(unsigned char *ctr)
+{
+	unsigned int *c = (unsigned int *)(ctr + 12);
+
+	*c = cpu_to_be32(be32_to_cpu(*c) + 1);
+}
+
+/**
+ * Start an operation with 12-byte nonce @iv and the additional authenticated
+ * data @aad of @aad_len bytes.
+ */
+void
+ttls_aes_gcm_start(TlsAesGcm *st, const TlsAesGcmKey *key,
+		   const unsigned char *iv, const unsigned char *aad,
+		   unsigned int aad_len, bool enc)
+{
+	size_t n = aad_len & ~(TTLS_GCM_BLOCK - 1);
+
+	memset(st, 0, sizeof(*st));
+	st->key = key;
+	st->enc = enc;
+	st->aad_len = aad_len;
+
+	memcpy(st->j0, iv, 12);
+	st->j0[15] = 1;
+	memcpy(st->ctr, st->j0, TTLS_GCM_BLOCK);
+	ttls_aes_gcm_ctr_inc(st->ctr);
+
+	if (n)
+		ttls_aes_gcm_ghash_x86_64(key, st->y, aad, n);
+	if (aad_len > n) {
+		memcpy(st->blk, aad + n, aad_len - n);
+		ttls_aes_gcm_ghash_x86_64(key, st->y, st->blk, TTLS_GCM_BLOCK);
+		memset(st->blk, 0, TTLS_GCM_BLOCK);
+	}
+}
+
+/**
+ * Encrypt or decrypt @len bytes from @src to @dst, the buffers may be the
+ * same.
+ */
+void
+ttls_aes_gcm_update(TlsAesGcm *st, const unsigned char *src,
+		    unsigned char *dst, size_t len)
+{
+	size_t i, n;
+
+	st->len += len;
+
+	if (st->pos) {
+		n = min_t(size_t, TTLS_GCM_BLOCK - st->pos, len);
+		for (i = 0; i < n; ++i) {
+			unsigned char c = src[i] ^ st->ks[st->pos + i];
+
+			st->blk[st->pos + i] = st->enc ? c : src[i];
+			dst[i] = c;
+		}
+		st->pos += n;
+		src += n;
+		dst += n;
+		len -= n;
+		if (st->pos < TTLS_GCM_BLOCK)
+			return;
+		ttls_aes_gcm_ghash_x86_64(st->key, st->y, st->blk,
+					  TTLS_GCM_BLOCK);
+		st->pos = 0;
+	}
+
+	if ((n = len & ~(TTLS_GCM_BLOCK - 1))) {
+		if (st->enc)
+			ttls_aes_gcm_enc_x86_64(st->key, st->y, st->ctr, src,
+						dst, n);
+		else
+			ttls_aes_gcm_dec_x86_64(st->key, st->y, st->ctr, src,
+						dst, n);
+		src += n;
+		dst += n;
+		len -= n;
+	}
+
+	if (len) {
+		ttls_aes_gcm_block_x86_64(st->key, st->ks, st->ctr);
+		ttls_aes_gcm_ctr_inc(st->ctr);
+		for (i = 0; i < len; ++i) {
+			unsigned char c = src[i] ^ st->ks[i];
+
+			st->blk[i] = st->enc ? c : src[i];
+			dst[i] = c;
+		}
+		st->pos = len;
+	}
+}
+
+/**
+ * Finish the operation and write the 16-byte authentication tag to @tag.
+ */
+void
+ttls_aes_gcm_finish(TlsAesGcm *st, unsigned char *tag)
+{
+	int i;
+	unsigned char ek0[TTLS_GCM_BLOCK];
+
+	if (st->pos) {
+		memset(st->blk + st->pos, 0, TTLS_GCM_BLOCK - st->pos);
+		ttls_aes_gcm_ghash_x86_64(st->key, st->y, st->blk,
+					  TTLS_GCM_BLOCK);
+	}
+	*(__be64 *)st->blk = cpu_to_be64((u64)st->aad_len * 8);
+	*(__be64 *)(st->blk + 8) = cpu_to_be64((u64)st->len * 8);
+	ttls_aes_gcm_ghash_x86_64(st->key, st->y, st->blk, TTLS_GCM_BLOCK);
+
+	/* GHASH is byte reflected. */
+	ttls_aes_gcm_block_x86_64(st->key, ek0, st->j0);
+	for (i = 0; i < TTLS_GCM_BLOCK; ++i)
+		tag[i] = ek0[i] ^ st->y[TTLS_GCM_BLOCK - 1 - i];
+
+	memset(st->ks, 0, TTLS_GCM_BLOCK);
+	memset(ek0, 0, TTLS_GCM_BLOCK);
+}
+
+#endif /* VAES */
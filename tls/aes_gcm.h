@@ -0,0 +1,100 @@
+/*
+ *		Tempesta TLS
+ *
+ * AES-GCM on VAES and VPCLMULQDQ, called directly instead of the Linux
+ * crypto API.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __TTLS_AES_GCM_H__
+#define __TTLS_AES_GCM_H__
+
+#include <linux/types.h>
+
+#define TTLS_GCM_BLOCK		16
+/* Number of the precomputed GHASH key powers. */
+#define TTLS_GCM_HPOW_N		16
+
+/**
+ * Expanded AES-GCM key, the layout is used by aes_gcm_x86-64.S.
+ *
+ * @h_pow	- GHASH key powers H^16..H^1, byte reflected and multiplied
+ *		  by x^-1;
+ * @rk		- AES round keys;
+ * @rounds	- number of AES rounds, 10 or 14;
+ */
+typedef struct {
+	unsigned char	h_pow[TTLS_GCM_HPOW_N][TTLS_GCM_BLOCK];
+	unsigned char	rk[15][TTLS_GCM_BLOCK];
+	unsigned int	rounds;
+} __attribute__((aligned(64))) TlsAesGcmKey;
+
+/**
+ * State of one AES-GCM encryption or decryption. The data can be passed in
+ * chunks of any length, e.g. skb fragments.
+ *
+ * @key		- the expanded key;
+ * @y		- GHASH accumulator, byte reflected;
+ * @ctr		- the next counter block;
+ * @j0		- the first counter block, used for the tag;
+ * @ks		- key stream of a partially processed block;
+ * @blk		- ciphertext of a partially processed block for GHASH;
+ * @pos		- number of processed bytes in @ks and @blk;
+ * @enc		- encryption or decryption;
+ * @aad_len	- length of the additional authenticated data;
+ * @len		- length of the processed data;
+ */
+typedef struct {
+	const TlsAesGcmKey	*key;
+	unsigned char		y[TTLS_GCM_BLOCK];
+	unsigned char		ctr[TTLS_GCM_BLOCK];
+	unsigned char		j0[TTLS_GCM_BLOCK];
+	unsigned char		ks[TTLS_GCM_BLOCK];
+	unsigned char		blk[TTLS_GCM_BLOCK];
+	unsigned int		pos;
+	bool			enc;
+	unsigned int		aad_len;
+	unsigned long		len;
+} TlsAesGcm;
+
+void ttls_aes_gcm_setkey_x86_64(TlsAesGcmKey *key, const unsigned char *k,
+				unsigned int len);
+void ttls_aes_gcm_block_x86_64(const TlsAesGcmKey *key, unsigned char *out,
+			       const unsigned char *in);
+void ttls_aes_gcm_ghash_x86_64(const TlsAesGcmKey *key, unsigned char *y,
+			       const unsigned char *data, size_t len);
+void ttls_aes_gcm_enc_x86_64(const TlsAesGcmKey *key, unsigned char *y,
+			     unsigned char *ctr, const unsigned char *src,
+			     unsigned char *dst, size_t len);
+void ttls_aes_gcm_dec_x86_64(const TlsAesGcmKey *key, unsigned char *y,
+			     unsigned char *ctr, const unsigned char *src,
+			     unsigned char *dst, size_t len);
+
+/*
+ * The functions use AVX-512 registers and must be called with saved FPU
+ * context, e.g. in the network softirq.
+ */
+int ttls_aes_gcm_setkey(TlsAesGcmKey *key, const unsigned char *k,
+			unsigned int len);
+void ttls_aes_gcm_start(TlsAesGcm *st, const TlsAesGcmKey *key,
+			const unsigned char *iv, const unsigned char *aad,
+			unsigned int aad_len, bool enc);
+void ttls_aes_gcm_update(TlsAesGcm *st, const unsigned char *src,
+			 unsigned char *dst, size_t len);
+void ttls_aes_gcm_finish(TlsAesGcm *st, unsigned char *tag);
+
+#endif /* __TTLS_AES_GCM_H__ */
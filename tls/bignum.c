@@ -1103,35 +1103,25 @@ __mpi_montg_init(unsigned long *mm, const TlsMpi *N)
 
 /**
  * Montgomery multiplication: A = A * B * R^-1 mod N  (HAC 14.36).
- *
- * TODO #1335: this is used for modular exponentiation only, so repalce it with
- * an adequate assembly implementation for the RSA handshakes.
+ * This is used for modular exponentiation only, see mpi_mont_mul_x86_64().
  */
 static int
 __mpi_montmul(TlsMpi *A, const TlsMpi *B, const TlsMpi *N, unsigned long mm,
 	      TlsMpi *T)
 {
-	size_t i, n, m;
-	unsigned long u0, u1, *d;
+	size_t n, m;
+	unsigned long *d;
 
-	BUG_ON(T->limbs < N->used + 1);
+	BUG_ON(T->limbs < N->used * 2 + 1);
 	bzero_fast(MPI_P(T), T->limbs * CIL);
 
-	d = MPI_P(T);
 	n = N->used;
 	m = (B->used < n) ? B->used : n;
+	if (A->used < n)
+		bzero_fast(MPI_P(A) + A->used, (n - A->used) * CIL);
 
-	for (i = 0; i < n; i++) {
-		/* T = (T + u0*B + u1*N) / 2^BIL */
-		u0 = MPI_P(A)[i];
-		u1 = (d[0] + u0 * MPI_P(B)[0]) * mm;
-
-		__mpi_mul(m, MPI_P(B), d, u0);
-		__mpi_mul(n, MPI_P(N), d, u1);
-
-		*d++ = u0;
-		d[n + 1] = 0;
-	}
+	mpi_mont_mul_x86_64(MPI_P(T), MPI_P(A), MPI_P(B), m, MPI_P(N), n, mm);
+	d = MPI_P(T) + n;
 	mpi_fixup_used(T, T->limbs);
 
 	memcpy_fast(MPI_P(A), d, (n + 1) * CIL);
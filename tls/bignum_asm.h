@@ -72,5 +72,9 @@ void mpi_mul_mont_mod_p256_x86_64(unsigned long *x, const unsigned long *a,
 void mpi_sqr_mont_mod_p256_x86_64(unsigned long *x, const unsigned long *a);
 void mpi_from_mont_p256_x86_64(unsigned long *x);
 
+void mpi_mont_mul_x86_64(unsigned long *t, const unsigned long *a,
+			 const unsigned long *b, size_t b_len,
+			 const unsigned long *n, size_t n_len, unsigned long mm);
+
 #endif /* __BIGNUM_ASM_H__ */
 
@@ -23,6 +23,8 @@
 
 #include <crypto/aead.h>
 #include <net/tls.h>
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
 
 #include "lib/str.h"
 #include "crypto.h"
@@ -38,6 +40,9 @@ typedef struct {
 	TlsCipherInfo		*info;
 } TlsCipherDef;
 
+/* AES-GCM is called directly instead of the crypto API if the CPU allows. */
+static bool ttls_vaes __read_mostly;
+
 void
 ttls_cipher_free(TlsCipherCtx *ctx)
 {
@@ -45,6 +50,10 @@ ttls_cipher_free(TlsCipherCtx *ctx)
 		return;
 	if (ctx->cipher_ctx)
 		crypto_free_aead(ctx->cipher_ctx);
+	if (ctx->gcm) {
+		bzero_fast(ctx->gcm, sizeof(TlsAesGcmKey));
+		kfree(ctx->gcm);
+	}
 	bzero_fast(ctx, sizeof(TlsCipherCtx));
 }
 
@@ -75,6 +84,35 @@ ttls_cipher_setup(TlsCipherCtx *ctx, const TlsCipherInfo *ci,
 	return 0;
 }
 
+/**
+ * Set the key for the crypto API transformation and, for AES-GCM on a CPU
+ * with VAES, expand the key for the direct calls. The crypto API remains the
+ * fallback if the key can't be allocated or has an unsupported length.
+ */
+int
+ttls_cipher_setkey(TlsCipherCtx *ctx, const unsigned char *key,
+		   unsigned int key_len)
+{
+	int r;
+
+	if ((r = crypto_aead_setkey(ctx->cipher_ctx, key, key_len)))
+		return r;
+
+#ifdef VAES
+	if (!ttls_vaes || ctx->cipher_info->mode != TTLS_MODE_GCM)
+		return 0;
+
+	if (!(ctx->gcm = kmalloc(sizeof(TlsAesGcmKey), GFP_ATOMIC)))
+		return 0;
+	if (ttls_aes_gcm_setkey(ctx->gcm, key, key_len)) {
+		kfree(ctx->gcm);
+		ctx->gcm = NULL;
+	}
+#endif
+
+	return 0;
+}
+
 static TlsCipherInfo aes_128_gcm_info = {
 	TTLS_CIPHER_AES_128_GCM,
 	TTLS_MODE_GCM,
@@ -428,6 +466,18 @@ ttls_crypto_modinit(void)
 	};
 	char **inst_set;
 
+#ifdef VAES
+	ttls_vaes = boot_cpu_has(X86_FEATURE_VAES)
+		    && boot_cpu_has(X86_FEATURE_VPCLMULQDQ)
+		    && boot_cpu_has(X86_FEATURE_AVX512VL)
+		    && boot_cpu_has(X86_FEATURE_AVX512BW)
+		    && boot_cpu_has(X86_FEATURE_BMI2)
+		    && cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM
+					 | XFEATURE_MASK_AVX512, NULL);
+	if (ttls_vaes)
+		T_LOG("Use VAES AES-GCM for TLS records\n");
+#endif
+
 	for (c = ttls_ciphers; c->info; c++) {
 		name = c->info->drv_name;
 		if ((r = ttls_ciphermod_preload(name)))
@@ -25,6 +25,8 @@
 #include <crypto/hash.h>
 #include <crypto/sha.h>
 
+#include "aes_gcm.h"
+
 /* An enumeration of supported ciphers. */
 typedef enum {
 	TTLS_CIPHER_ID_NONE = 0,
@@ -99,6 +101,8 @@ typedef struct {
  *
  * @cipher_info		- Information about the associated cipher;
  * @cipher_ctx		- The cipher-specific context;
+ * @gcm			- AES-GCM key for the direct VAES calls, NULL if
+ *			  only the crypto API is used;
  * @iv_size		- IV size in Bytes, for ciphers with variable-length
  *			  IVs;
  * @iv			- Current IV;
@@ -106,6 +110,7 @@ typedef struct {
 typedef struct {
 	const TlsCipherInfo		*cipher_info;
 	struct crypto_aead		*cipher_ctx;
+	TlsAesGcmKey			*gcm;
 	unsigned char			iv_size;
 	unsigned char			iv[TTLS_MAX_IV_LENGTH];
 } TlsCipherCtx;
@@ -158,6 +163,8 @@ ttls_cipher_info_from_type(const ttls_cipher_type_t cipher_type);
 void ttls_cipher_free(TlsCipherCtx *ctx);
 int ttls_cipher_setup(TlsCipherCtx *ctx, const TlsCipherInfo *ci,
 		      unsigned int tag_size);
+int ttls_cipher_setkey(TlsCipherCtx *ctx, const unsigned char *key,
+		       unsigned int key_len);
 
 const TlsMdInfo *ttls_md_info_from_type(ttls_md_type_t md_type);
 void ttls_md_init(TlsMdCtx *ctx);
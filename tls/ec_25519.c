@@ -10,9 +10,16 @@
  * coordinates. Import/export of points uses only the x coordinates, which is
  * internaly represented as X / Z.
  *
- * For scalar multiplication, we'll use a Montgomery ladder.
+ * For scalar multiplication, we'll use a Montgomery ladder. The fixed-base
+ * multiplication for key generation uses a comb with a precomputed table on
+ * the birationally equivalent Edwards curve (Ed25519), since the ladder can't
+ * use a precomputation.
  *
- * Copyright (C) 2020 Tempesta Technologies, Inc.
+ * [ED25519] D.J.Bernstein, N.Duif, T.Lange, P.Schwabe, B.Yang,
+ *	     "High-speed high-security signatures",
+ *	     https://ed25519.cr.yp.to/ed25519-20110926.pdf
+ *
+ * Copyright (C) 2020-2026 Tempesta Technologies, Inc.
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -360,11 +367,389 @@ ecp_mul_mxz(TlsEcpPoint *R, const TlsMpi *m, const unsigned long *pX,
 	return 0;
 }
 
-/* TODO #1335 specialize the routine. */
+/*
+ * Field arithmetic for the fixed-base multiplication, [ED25519] section 4.
+ * The elements are stored in radix 2^51, so a product fits 128 bits and
+ * there are no conditional branches. All the routines leave each limb below
+ * 2^52, which is enough for the inputs of the routines.
+ */
+#define FE_MASK		((1UL << 51) - 1)
+
+typedef unsigned long Fe25519[5];
+
+/**
+ * Precomputed point of Ed25519 in affine coordinates:
+ * (y + x, y - x, 2 * d * x * y).
+ */
+typedef struct {
+	Fe25519		yplusx;
+	Fe25519		yminusx;
+	Fe25519		xy2d;
+} Ge25519Pre;
+
+/* Extended coordinates (X:Y:Z:T), x = X/Z, y = Y/Z, x * y = T/Z. */
+typedef struct {
+	Fe25519		X;
+	Fe25519		Y;
+	Fe25519		Z;
+	Fe25519		T;
+} Ge25519;
+
+/* Number of the comb tables for radix 2^4 digits of 256-bit scalar. */
+#define GE_D		32
+/* Size of each table, i.e. maximum absolute value of a signed digit. */
+#define GE_W_SZ		8
+
+/*
+ * Static precomputed table for the base point of Ed25519, which corresponds
+ * to the base point of Curve25519: combT_G[i][j] = (j + 1) * 256^i * B.
+ */
+static const Ge25519Pre combT_G[GE_D][GE_W_SZ] __page_aligned_data = {
+	#include "ec25519_G.autogen.h" /* Generated by t/tgen_ec25519.c */
+};
+
+static void
+fe_carry(Fe25519 h)
+{
+	unsigned long c;
+
+	c = h[0] >> 51;
+	h[0] &= FE_MASK;
+	h[1] += c;
+	c = h[1] >> 51;
+	h[1] &= FE_MASK;
+	h[2] += c;
+	c = h[2] >> 51;
+	h[2] &= FE_MASK;
+	h[3] += c;
+	c = h[3] >> 51;
+	h[3] &= FE_MASK;
+	h[4] += c;
+	c = h[4] >> 51;
+	h[4] &= FE_MASK;
+	h[0] += c * 19;
+}
+
+static void
+fe_from_limbs(Fe25519 h, const unsigned long s[G_LIMBS])
+{
+	h[0] = s[0] & FE_MASK;
+	h[1] = (s[0] >> 51 | s[1] << 13) & FE_MASK;
+	h[2] = (s[1] >> 38 | s[2] << 26) & FE_MASK;
+	h[3] = (s[2] >> 25 | s[3] << 39) & FE_MASK;
+	h[4] = (s[3] >> 12) & FE_MASK;
+}
+
+/**
+ * Write the fully reduced @f to the regular limbs.
+ */
+static void
+fe_to_limbs(unsigned long *s, const Fe25519 f)
+{
+	Fe25519 h;
+	unsigned long q;
+
+	memcpy(h, f, sizeof(h));
+	fe_carry(h);
+	fe_carry(h);
+
+	/* q = 1 if h >= p and 0 otherwise. */
+	q = (h[0] + 19) >> 51;
+	q = (h[1] + q) >> 51;
+	q = (h[2] + q) >> 51;
+	q = (h[3] + q) >> 51;
+	q = (h[4] + q) >> 51;
+
+	h[0] += 19 * q;
+	h[1] += h[0] >> 51;
+	h[0] &= FE_MASK;
+	h[2] += h[1] >> 51;
+	h[1] &= FE_MASK;
+	h[3] += h[2] >> 51;
+	h[2] &= FE_MASK;
+	h[4] += h[3] >> 51;
+	h[3] &= FE_MASK;
+	h[4] &= FE_MASK;
+
+	s[0] = h[0] | h[1] << 51;
+	s[1] = h[1] >> 13 | h[2] << 38;
+	s[2] = h[2] >> 26 | h[3] << 25;
+	s[3] = h[3] >> 39 | h[4] << 12;
+}
+
+static void
+fe_1(Fe25519 h)
+{
+	h[0] = 1;
+	h[1] = h[2] = h[3] = h[4] = 0;
+}
+
+static void
+fe_add(Fe25519 h, const Fe25519 f, const Fe25519 g)
+{
+	int i;
+
+	for (i = 0; i < 5; ++i)
+		h[i] = f[i] + g[i];
+	fe_carry(h);
+}
+
+/* h = f - g + 4 * p, so the limbs never underflow. */
+static void
+fe_sub(Fe25519 h, const Fe25519 f, const Fe25519 g)
+{
+	h[0] = f[0] + 0x1fffffffffffb4UL - g[0];
+	h[1] = f[1] + 0x1ffffffffffffcUL - g[1];
+	h[2] = f[2] + 0x1ffffffffffffcUL - g[2];
+	h[3] = f[3] + 0x1ffffffffffffcUL - g[3];
+	h[4] = f[4] + 0x1ffffffffffffcUL - g[4];
+	fe_carry(h);
+}
+
+static void
+fe_mul(Fe25519 h, const Fe25519 f, const Fe25519 g)
+{
+	__uint128_t r0, r1, r2, r3, r4;
+	unsigned long g1_19 = g[1] * 19, g2_19 = g[2] * 19;
+	unsigned long g3_19 = g[3] * 19, g4_19 = g[4] * 19;
+	unsigned long c;
+
+	r0 = (__uint128_t)f[0] * g[0] + (__uint128_t)f[1] * g4_19
+	     + (__uint128_t)f[2] * g3_19 + (__uint128_t)f[3] * g2_19
+	     + (__uint128_t)f[4] * g1_19;
+	r1 = (__uint128_t)f[0] * g[1] + (__uint128_t)f[1] * g[0]
+	     + (__uint128_t)f[2] * g4_19 + (__uint128_t)f[3] * g3_19
+	     + (__uint128_t)f[4] * g2_19;
+	r2 = (__uint128_t)f[0] * g[2] + (__uint128_t)f[1] * g[1]
+	     + (__uint128_t)f[2] * g[0] + (__uint128_t)f[3] * g4_19
+	     + (__uint128_t)f[4] * g3_19;
+	r3 = (__uint128_t)f[0] * g[3] + (__uint128_t)f[1] * g[2]
+	     + (__uint128_t)f[2] * g[1] + (__uint128_t)f[3] * g[0]
+	     + (__uint128_t)f[4] * g4_19;
+	r4 = (__uint128_t)f[0] * g[4] + (__uint128_t)f[1] * g[3]
+	     + (__uint128_t)f[2] * g[2] + (__uint128_t)f[3] * g[1]
+	     + (__uint128_t)f[4] * g[0];
+
+	r1 += (unsigned long)(r0 >> 51);
+	h[0] = (unsigned long)r0 & FE_MASK;
+	r2 += (unsigned long)(r1 >> 51);
+	h[1] = (unsigned long)r1 & FE_MASK;
+	r3 += (unsigned long)(r2 >> 51);
+	h[2] = (unsigned long)r2 & FE_MASK;
+	r4 += (unsigned long)(r3 >> 51);
+	h[3] = (unsigned long)r3 & FE_MASK;
+	c = (unsigned long)(r4 >> 51);
+	h[4] = (unsigned long)r4 & FE_MASK;
+	h[0] += c * 19;
+	h[1] += h[0] >> 51;
+	h[0] &= FE_MASK;
+}
+
+static void
+fe_sqn(Fe25519 h, const Fe25519 f, int n)
+{
+	fe_mul(h, f, f);
+	while (--n > 0)
+		fe_mul(h, h, h);
+}
+
+/**
+ * h = 1 / z = z^(p - 2) with the same addition chain as in [ED25519].
+ */
+static void
+fe_inv(Fe25519 h, const Fe25519 z)
+{
+	Fe25519 z2, z9, z11, z_5_0, z_10_0, z_20_0, z_50_0, z_100_0, t;
+
+	fe_mul(z2, z, z);
+	fe_sqn(t, z2, 2);
+	fe_mul(z9, t, z);
+	fe_mul(z11, z9, z2);
+	fe_mul(t, z11, z11);
+	fe_mul(z_5_0, t, z9);
+	fe_sqn(t, z_5_0, 5);
+	fe_mul(z_10_0, t, z_5_0);
+	fe_sqn(t, z_10_0, 10);
+	fe_mul(z_20_0, t, z_10_0);
+	fe_sqn(t, z_20_0, 20);
+	fe_mul(t, t, z_20_0);
+	fe_sqn(t, t, 10);
+	fe_mul(z_50_0, t, z_10_0);
+	fe_sqn(t, z_50_0, 50);
+	fe_mul(z_100_0, t, z_50_0);
+	fe_sqn(t, z_100_0, 100);
+	fe_mul(t, t, z_100_0);
+	fe_sqn(t, t, 50);
+	fe_mul(t, t, z_50_0);
+	fe_sqn(t, t, 5);
+	fe_mul(h, t, z11);
+}
+
+/* h = g if b == 1 and h is unchanged if b == 0, in constant time. */
+static void
+fe_cmov(Fe25519 h, const Fe25519 g, unsigned long b)
+{
+	unsigned long mask = -b;
+	int i;
+
+	for (i = 0; i < 5; ++i)
+		h[i] ^= mask & (h[i] ^ g[i]);
+}
+
+/*
+ * Mixed addition and doubling in extended coordinates,
+ * http://www.hyperelliptic.org/EFD/g1p/auto-twisted-extended-1.html
+ * (madd-2008-hwcd-2 and dbl-2008-hwcd) for a = -1.
+ *
+ * Cost: 7M for the addition and 4M + 4S for the doubling.
+ */
+static void
+ge_madd(Ge25519 *r, const Ge25519 *p, const Ge25519Pre *q)
+{
+	Fe25519 a, b, c, d, e, f, g, h;
+
+	fe_sub(a, p->Y, p->X);
+	fe_mul(a, a, q->yminusx);
+	fe_add(b, p->Y, p->X);
+	fe_mul(b, b, q->yplusx);
+	fe_mul(c, p->T, q->xy2d);
+	fe_add(d, p->Z, p->Z);
+	fe_sub(e, b, a);
+	fe_sub(f, d, c);
+	fe_add(g, d, c);
+	fe_add(h, b, a);
+
+	fe_mul(r->X, e, f);
+	fe_mul(r->Y, g, h);
+	fe_mul(r->Z, f, g);
+	fe_mul(r->T, e, h);
+}
+
+static void
+ge_dbl(Ge25519 *r, const Ge25519 *p)
+{
+	Fe25519 a, b, c, e, f, g, h;
+
+	fe_mul(a, p->X, p->X);
+	fe_mul(b, p->Y, p->Y);
+	fe_mul(c, p->Z, p->Z);
+	fe_add(c, c, c);
+	fe_add(h, a, b);
+	fe_add(e, p->X, p->Y);
+	fe_mul(e, e, e);
+	fe_sub(e, h, e);
+	fe_sub(g, a, b);
+	fe_add(f, c, g);
+
+	fe_mul(r->X, e, f);
+	fe_mul(r->Y, g, h);
+	fe_mul(r->Z, f, g);
+	fe_mul(r->T, e, h);
+}
+
+static void
+ge_set_zero(Ge25519 *r)
+{
+	memset(r, 0, sizeof(*r));
+	fe_1(r->Y);
+	fe_1(r->Z);
+}
+
+/**
+ * Constant time selection of @b * 256^pos * B, where -8 <= b <= 8.
+ * All the table entries are read regardless of @b.
+ */
+static void
+ge_select_comb_g(Ge25519Pre *t, int pos, signed char b)
+{
+	Ge25519Pre minust;
+	unsigned long neg = (unsigned long)(long)b >> 63;
+	unsigned long babs = b - ((-neg & b) << 1);
+	int i;
+
+	fe_1(t->yplusx);
+	fe_1(t->yminusx);
+	memset(t->xy2d, 0, sizeof(Fe25519));
+
+	for (i = 0; i < GE_W_SZ; ++i) {
+		unsigned long eq = ((babs ^ (i + 1)) - 1) >> 63;
+
+		fe_cmov(t->yplusx, combT_G[pos][i].yplusx, eq);
+		fe_cmov(t->yminusx, combT_G[pos][i].yminusx, eq);
+		fe_cmov(t->xy2d, combT_G[pos][i].xy2d, eq);
+	}
+
+	memcpy(minust.yplusx, t->yminusx, sizeof(Fe25519));
+	memcpy(minust.yminusx, t->yplusx, sizeof(Fe25519));
+	memset(minust.xy2d, 0, sizeof(Fe25519));
+	fe_sub(minust.xy2d, minust.xy2d, t->xy2d);
+
+	fe_cmov(t->yplusx, minust.yplusx, neg);
+	fe_cmov(t->yminusx, minust.yminusx, neg);
+	fe_cmov(t->xy2d, minust.xy2d, neg);
+}
+
+/**
+ * Fixed-base comb multiplication R = m * G with signed radix 2^4 digits,
+ * [ED25519] section 4: the odd digits are added first, the sum is multiplied
+ * by 16 and the even digits are added. The result is converted from Ed25519
+ * to the Curve25519 x/z coordinates: u = (1 + y) / (1 - y).
+ *
+ * Cost: 64 mixed additions, 4 doublings and 1I, instead of 254 ladder steps.
+ */
 static int
-ecp_mul_mxz_g(TlsEcpPoint *R, const TlsMpi *m, bool rnd)
+ecp_mul_comb_g(TlsEcpPoint *R, const TlsMpi *m)
 {
-	return ecp_mul_mxz(R, m, MPI_P(&G.G.X), MPI_P(&G.G.Y), rnd);
+	signed char e[GE_D * 2];
+	unsigned long k[G_LIMBS];
+	Fe25519 n, d;
+	Ge25519Pre t;
+	Ge25519 h;
+	int i, carry;
+
+	if (WARN_ON_ONCE(m->used > G_LIMBS || R->X.limbs < G_LIMBS))
+		return -EINVAL;
+	for (i = 0; i < G_LIMBS; ++i)
+		k[i] = i < m->used ? MPI_P(m)[i] : 0;
+	/* The scalars are clamped, so the most significant bit is zero. */
+	WARN_ON_ONCE(k[G_LIMBS - 1] >> 63);
+
+	for (i = 0; i < GE_D * 2; ++i)
+		e[i] = (k[i / 16] >> ((i % 16) * 4)) & 0xf;
+	for (carry = 0, i = 0; i < GE_D * 2 - 1; ++i) {
+		e[i] += carry;
+		carry = (e[i] + 8) >> 4;
+		e[i] -= carry << 4;
+	}
+	e[GE_D * 2 - 1] += carry;
+
+	ge_set_zero(&h);
+	for (i = 1; i < GE_D * 2; i += 2) {
+		ge_select_comb_g(&t, i / 2, e[i]);
+		ge_madd(&h, &h, &t);
+	}
+	for (i = 0; i < 4; ++i)
+		ge_dbl(&h, &h);
+	for (i = 0; i < GE_D * 2; i += 2) {
+		ge_select_comb_g(&t, i / 2, e[i]);
+		ge_madd(&h, &h, &t);
+	}
+
+	fe_add(n, h.Z, h.Y);
+	fe_sub(d, h.Z, h.Y);
+	fe_inv(d, d);
+	fe_mul(n, n, d);
+	fe_to_limbs(MPI_P(&R->X), n);
+	mpi_fixup_used(&R->X, G_LIMBS);
+	ttls_mpi_lset(&R->Z, 1);
+	ttls_mpi_lset(&R->Y, 0); /* TODO #1335 reset/free the MPI */
+
+	bzero_fast(k, sizeof(k));
+	bzero_fast(e, sizeof(e));
+	bzero_fast(&h, sizeof(h));
+	bzero_fast(&t, sizeof(t));
+
+	return 0;
 }
 
 /*
@@ -402,7 +787,7 @@ ec25519_gen_keypair(TlsMpi *d, TlsEcpPoint *Q)
 	ttls_mpi_set_bit(d, 1, 0);
 	ttls_mpi_set_bit(d, 2, 0);
 
-	return ecp_mul_mxz_g(Q, d, true);
+	return ecp_mul_comb_g(Q, d);
 }
 
 const TlsEcpGrp CURVE25519_G ____cacheline_aligned = {
@@ -94,6 +94,8 @@
 #define W		5			/* m * P window bits */
 #define W_SZ		(1U << (W - 1))		/* m * P window size */
 #define D		((G_BITS + W - 1) / W)
+/* Number of keypairs generated at once. */
+#define ECP256_BATCH	8
 
 static const struct {
 	unsigned long	secp256r1_p[G_LIMBS];
@@ -253,6 +255,18 @@ static const EcpXY combT_G[G_D + 1][G_W_SZ] __page_aligned_data = {
 };
 static DEFINE_PER_CPU(Ecp256Point, combT[W_SZ]);
 
+/*
+ * Per-CPU pool of keypairs generated in batches for ECDHE and for ECDSA
+ * ephemeral keys. Each keypair is used only once and is zeroed after use.
+ */
+typedef struct {
+	unsigned int	n;
+	unsigned long	d[ECP256_BATCH][G_LIMBS];
+	EcpXY		q[ECP256_BATCH];
+} Ecp256KpPool;
+
+static DEFINE_PER_CPU(Ecp256KpPool, kp_pool);
+
 /**
  * Copy single coordinate of a point.
  */
@@ -664,6 +678,71 @@ ecp256_normalize_jac(Ecp256Point *r, bool norm_mont)
 	ecp256_lset(r->z, 1);
 }
 
+/*
+ * Normalize @n <= ECP256_BATCH jacobian points using Montgomery's simultaneous
+ * inversion [2, Algorithm 2.26]: the product of all the Z coordinates is
+ * inverted once and the inverse of each Z is extracted from it by two
+ * multiplications. None of the points may be at infinity.
+ *
+ * Cost: 1I + (3(n - 1) + 4n)M + nS instead of n(1I + 3M + 1S).
+ */
+static void
+ecp256_normalize_jac_batch(Ecp256Point *r, int n, bool norm_mont)
+{
+	int i;
+	unsigned long acc[ECP256_BATCH][8], z[8] = {}, zzi[8], x[8], y[8];
+	unsigned long *zp;
+	DECLARE_MPI_AUTO(zi, 8);
+
+	BUG_ON(n < 1 || n > ECP256_BATCH);
+
+	for (i = 0; i < n; ++i) {
+		if (norm_mont) {
+			ecp256_copy(z, r[i].z);
+			mpi_from_mont_p256_x86_64(z);
+			ecp256_copy(r[i].z, z);
+		}
+		if (!i)
+			ecp256_copy(acc[0], r[0].z);
+		else
+			mpi_mul_mod_p256_x86_64_4(acc[i], acc[i - 1], r[i].z);
+	}
+
+	ecp256_mpi_write(&zi, acc[n - 1]);
+	ecp256_inv_mod(&zi, &zi, &G.P);
+
+	for (i = n - 1; i >= 0; --i) {
+		/* 1/z[i] = 1/(z[0]...z[i]) * (z[0]...z[i - 1]) */
+		if (i) {
+			mpi_mul_mod_p256_x86_64_4(z, MPI_P(&zi), acc[i - 1]);
+			mpi_mul_mod_p256_x86_64_4(MPI_P(&zi), MPI_P(&zi),
+						  r[i].z);
+			zp = z;
+		} else {
+			zp = MPI_P(&zi);
+		}
+
+		memset(x, 0, sizeof(x));
+		memset(y, 0, sizeof(y));
+		ecp256_copy(x, r[i].x);
+		ecp256_copy(y, r[i].y);
+		if (norm_mont) {
+			mpi_from_mont_p256_x86_64(x);
+			mpi_from_mont_p256_x86_64(y);
+		}
+
+		mpi_sqr_mod_p256_x86_64_4(zzi, zp);
+		mpi_mul_mod_p256_x86_64_4(x, x, zzi);
+		ecp256_copy(r[i].x, x);
+
+		mpi_mul_mod_p256_x86_64_4(y, y, zzi);
+		mpi_mul_mod_p256_x86_64_4(y, y, zp);
+		ecp256_copy(r[i].y, y);
+
+		ecp256_lset(r[i].z, 1);
+	}
+}
+
 /**
  * Conditional point inversion: Q -> -Q = (Q.X, -Q.Y, Q.Z) without leak.
  * "inv" must be 0 (don't invert) or 1 (invert) or the result will be invalid.
@@ -1341,27 +1420,34 @@ ecp256_mul_comb_core_g(Ecp256Point *__restrict r,
  * [15] discussed that the current multi-table comb method isn't bad at all.
  */
 static void
-ecp256_mul_comb_g(TlsEcpPoint *R, const TlsMpi *m)
+__ecp256_mul_comb_g(Ecp256Point *r, const unsigned long *m)
 {
 	unsigned long M[4], mm[4];
 	unsigned char k[G_D + 1];
-	Ecp256Point r;
-	unsigned char m_is_odd = MPI_P(m)[0] & 1;
+	unsigned char m_is_odd = m[0] & 1;
 
 	/*
 	 * Make sure M is odd (M = m or M = N - m, since N is odd)
 	 * using the fact that m * P = - (N - m) * P
 	 */
-	ecp256_mpi_read(M, m);
-	mpi_sub_mod_p256_x86_64(mm, G.secp256r1_n, MPI_P(m));
+	ecp256_copy(M, m);
+	mpi_sub_mod_p256_x86_64(mm, G.secp256r1_n, m);
 	ecp256_safe_cond_assign(M, mm, !m_is_odd);
 
 	/* Go for comb multiplication, R = M * G */
 	ecp256_comb_fixed(k, G_D, G_W, M);
-	ecp256_mul_comb_core_g(&r, k);
+	ecp256_mul_comb_core_g(r, k);
 
-	/* Now get m * G from M * G and normalize it. */
-	ecp256_safe_invert_jac(&r, !m_is_odd);
+	/* Now get m * G from M * G. */
+	ecp256_safe_invert_jac(r, !m_is_odd);
+}
+
+static void
+ecp256_mul_comb_g(TlsEcpPoint *R, const TlsMpi *m)
+{
+	Ecp256Point r;
+
+	__ecp256_mul_comb_g(&r, MPI_P(m));
 	ecp256_normalize_jac(&r, true);
 
 	ecp256_mpi_write(&R->X, r.x);
@@ -1369,6 +1455,20 @@ ecp256_mul_comb_g(TlsEcpPoint *R, const TlsMpi *m)
 	ecp256_mpi_write(&R->Z, r.z);
 }
 
+/**
+ * Multi-buffer version of ecp256_mul_comb_g(): r[i] = m[i] * G for @n
+ * scalars. The Jacobian results are normalized by one modular inversion.
+ */
+static void
+ecp256_mul_comb_g_batch(Ecp256Point *r, unsigned long (*m)[G_LIMBS], int n)
+{
+	int i;
+
+	for (i = 0; i < n; ++i)
+		__ecp256_mul_comb_g(&r[i], m[i]);
+	ecp256_normalize_jac_batch(r, n, true);
+}
+
 /*
  * Multiplication and addition of two points by integers: R = m * G + n * Q
  * In contrast to ttls_ecp_mul(), this function does not guarantee a constant
@@ -1412,41 +1512,84 @@ ecp256_muladd(TlsEcpPoint *R, const TlsMpi *m, const TlsEcpPoint *Q,
 }
 
 /**
- * Generate a keypair with configurable base point - SEC1 3.2.1:
+ * Generate ECP256_BATCH keypairs at once - SEC1 3.2.1:
  * generate d such that 1 <= n < N.
  */
-int
-ecp256_gen_keypair(TlsMpi *d, TlsEcpPoint *Q)
+static int
+ecp256_gen_keypair_batch(Ecp256KpPool *pool)
 {
-	int count = 0;
-
-	/*
-	 * Match the procedure given in RFC 6979 (deterministic ECDSA):
-	 * - use the same byte ordering;
-	 * - keep the leftmost bits bits of the generated octet string;
-	 * - try until result is in the desired range.
-	 * This also avoids any biais, which is especially important
-	 * for ECDSA.
-	 */
-	do {
-		ttls_mpi_fill_random(d, G_BITS / 8);
+	int i, count;
+	Ecp256Point r[ECP256_BATCH];
+	TlsMpi *d = ttls_mpi_alloc_stack_init(G_LIMBS);
 
+	for (i = 0; i < ECP256_BATCH; ++i) {
+		count = 0;
 		/*
-		 * Each try has at worst a probability 1/2 of failing
-		 * (the msb has a probability 1/2 of being 0, and then
-		 * the result will be < N), so after 30 tries failure
-		 * probability is a most 2**(-30).
-		 *
-		 * For most curves, 1 try is enough with overwhelming
-		 * probability, since N starts with a lot of 1s in
-		 * binary, but some curves such as secp224k1 are
-		 * actually very close to the worst case.
+		 * Match the procedure given in RFC 6979 (deterministic ECDSA):
+		 * - use the same byte ordering;
+		 * - keep the leftmost bits bits of the generated octet string;
+		 * - try until result is in the desired range.
+		 * This also avoids any biais, which is especially important
+		 * for ECDSA.
 		 */
-		if (WARN_ON_ONCE(++count > 10))
-			return TTLS_ERR_ECP_RANDOM_FAILED;
-	} while (ttls_mpi_eq_0(d) || ttls_mpi_cmp_mpi(d, &G.N) >= 0);
+		do {
+			ttls_mpi_fill_random(d, G_BITS / 8);
+
+			/*
+			 * Each try has at worst a probability 1/2 of failing
+			 * (the msb has a probability 1/2 of being 0, and then
+			 * the result will be < N), so after 30 tries failure
+			 * probability is a most 2**(-30).
+			 *
+			 * For most curves, 1 try is enough with overwhelming
+			 * probability, since N starts with a lot of 1s in
+			 * binary, but some curves such as secp224k1 are
+			 * actually very close to the worst case.
+			 */
+			if (WARN_ON_ONCE(++count > 10))
+				return TTLS_ERR_ECP_RANDOM_FAILED;
+		} while (ttls_mpi_eq_0(d) || ttls_mpi_cmp_mpi(d, &G.N) >= 0);
+
+		ecp256_mpi_read(pool->d[i], d);
+	}
 
-	ecp256_mul_comb_g(Q, d);
+	ecp256_mul_comb_g_batch(r, pool->d, ECP256_BATCH);
+
+	for (i = 0; i < ECP256_BATCH; ++i) {
+		ecp256_copy(pool->q[i].x, r[i].x);
+		ecp256_copy(pool->q[i].y, r[i].y);
+	}
+	bzero_fast(r, sizeof(r));
+	bzero_fast(MPI_P(d), G_LIMBS * CIL);
+	pool->n = ECP256_BATCH;
+
+	return 0;
+}
+
+/**
+ * Get a keypair from the per-CPU pool, the pool is refilled in a batch when
+ * it's empty, so the point multiplications of many handshakes processed by
+ * the same CPU share the inversion.
+ */
+int
+ecp256_gen_keypair(TlsMpi *d, TlsEcpPoint *Q)
+{
+	int r;
+	unsigned long one[G_LIMBS];
+	Ecp256KpPool *pool = this_cpu_ptr(&kp_pool);
+
+	if (unlikely(!pool->n) && (r = ecp256_gen_keypair_batch(pool)))
+		return r;
+
+	--pool->n;
+	ecp256_mpi_write(d, pool->d[pool->n]);
+	ecp256_mpi_write(&Q->X, pool->q[pool->n].x);
+	ecp256_mpi_write(&Q->Y, pool->q[pool->n].y);
+	ecp256_lset(one, 1);
+	ecp256_mpi_write(&Q->Z, one);
+
+	bzero_fast(pool->d[pool->n], sizeof(pool->d[0]));
+	bzero_fast(&pool->q[pool->n], sizeof(pool->q[0]));
 
 	return 0;
 }
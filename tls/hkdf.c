@@ -0,0 +1,207 @@
+/**
+ *		Tempesta TLS
+ *
+ * HKDF (RFC 5869) and TLS 1.3 key schedule (RFC 8446 7).
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "debug.h"
+
+#include "tls_internal.h"
+
+/*
+ * TLS 1.3 key schedule, RFC 8446 7.1. The secrets are derived by HKDF
+ * (RFC 5869) with the hash of the cipher suite, so all the secrets and the
+ * transcript hashes have the hash length.
+ */
+#define TLS13_LABEL_PREFIX	"tls13 "
+#define TLS13_LABEL_PREFIX_LEN	(sizeof(TLS13_LABEL_PREFIX) - 1)
+#define TLS13_LABEL_MAX		(TLS13_LABEL_PREFIX_LEN + 12)
+
+/**
+ * HKDF-Extract(@salt, @ikm) into @prk of the hash length. Zero length @salt
+ * means the string of hash length zeros as RFC 5869 2.2 requires.
+ */
+int
+ttls_hkdf_extract(const TlsMdInfo *md_info, const unsigned char *salt,
+		  size_t slen, const unsigned char *ikm, size_t ilen,
+		  unsigned char *prk)
+{
+	int r;
+	TlsMdCtx md_ctx;
+	unsigned char zeros[TTLS_MD_MAX_SIZE] = { 0 };
+
+	if (!slen) {
+		salt = zeros;
+		slen = ttls_md_get_size(md_info);
+	}
+
+	ttls_md_init(&md_ctx);
+	if ((r = ttls_md_setup(&md_ctx, md_info, 1)))
+		return r;
+	if (!(r = ttls_md_hmac_starts(&md_ctx, salt, slen))
+	    && !(r = ttls_md_hmac_update(&md_ctx, ikm, ilen)))
+		r = ttls_md_hmac_finish(&md_ctx, prk);
+	ttls_md_free(&md_ctx);
+
+	return r;
+}
+
+/**
+ * HKDF-Expand(@prk, @info, @olen) into @okm, @olen can't be greater than
+ * 255 hash lengths.
+ */
+int
+ttls_hkdf_expand(const TlsMdInfo *md_info, const unsigned char *prk,
+		 size_t plen, const unsigned char *info, size_t ilen,
+		 unsigned char *okm, size_t olen)
+{
+	int r;
+	size_t i, k, md_len = ttls_md_get_size(md_info);
+	unsigned char t[TTLS_MD_MAX_SIZE], n = 0;
+	TlsMdCtx md_ctx;
+
+	if (olen > 255 * md_len)
+		return TTLS_ERR_BAD_INPUT_DATA;
+
+	ttls_md_init(&md_ctx);
+	if ((r = ttls_md_setup(&md_ctx, md_info, 1)))
+		return r;
+	if ((r = ttls_md_hmac_starts(&md_ctx, prk, plen)))
+		goto out;
+
+	/* T(n) = HMAC(PRK, T(n - 1) | info | n), T(0) is empty. */
+	for (i = 0; i < olen; i += md_len) {
+		++n;
+		if ((n > 1 && ((r = ttls_md_hmac_reset(&md_ctx))
+			       || (r = ttls_md_hmac_update(&md_ctx, t,
+							   md_len))))
+		    || (r = ttls_md_hmac_update(&md_ctx, info, ilen))
+		    || (r = ttls_md_hmac_update(&md_ctx, &n, 1))
+		    || (r = ttls_md_hmac_finish(&md_ctx, t)))
+			goto out;
+		k = min(md_len, olen - i);
+		memcpy_fast(okm + i, t, k);
+	}
+out:
+	ttls_md_free(&md_ctx);
+	bzero_fast(t, sizeof(t));
+
+	return r;
+}
+
+/**
+ * HKDF-Expand-Label(@secret, @label, @ctx, @olen), @secret has the hash
+ * length.
+ */
+int
+ttls_hkdf_expand_label(const TlsMdInfo *md_info, const unsigned char *secret,
+		       const char *label, size_t llen, const unsigned char *ctx,
+		       size_t clen, unsigned char *out, size_t olen)
+{
+	unsigned char info[4 + TLS13_LABEL_MAX + TTLS_MD_MAX_SIZE], *p = info;
+
+	if (WARN_ON_ONCE(TLS13_LABEL_PREFIX_LEN + llen > TLS13_LABEL_MAX
+			 || clen > TTLS_MD_MAX_SIZE || olen > 0xFFFF))
+		return TTLS_ERR_BAD_INPUT_DATA;
+
+	/* struct HkdfLabel, RFC 8446 7.1. */
+	*p++ = olen >> 8;
+	*p++ = olen & 0xFF;
+	*p++ = TLS13_LABEL_PREFIX_LEN + llen;
+	memcpy_fast(p, TLS13_LABEL_PREFIX, TLS13_LABEL_PREFIX_LEN);
+	p += TLS13_LABEL_PREFIX_LEN;
+	memcpy_fast(p, label, llen);
+	p += llen;
+	*p++ = clen;
+	memcpy_fast(p, ctx, clen);
+	p += clen;
+
+	return ttls_hkdf_expand(md_info, secret, ttls_md_get_size(md_info),
+				info, p - info, out, olen);
+}
+
+/**
+ * Derive-Secret(@secret, @label, Messages), where @thash is the transcript
+ * hash of the messages.
+ */
+int
+ttls_tls13_derive_secret(const TlsMdInfo *md_info, const unsigned char *secret,
+			 const char *label, size_t llen,
+			 const unsigned char *thash, unsigned char *out)
+{
+	size_t md_len = ttls_md_get_size(md_info);
+
+	return ttls_hkdf_expand_label(md_info, secret, label, llen, thash,
+				      md_len, out, md_len);
+}
+
+/**
+ * Move to the next stage of the key schedule: early secret -> handshake
+ * secret -> master secret. @secret is the current stage secret or NULL for
+ * the early secret, @ikm is the PSK, the (EC)DHE shared secret or NULL for
+ * the master secret respectively. The result is written to @out.
+ */
+int
+ttls_tls13_next_secret(const TlsMdInfo *md_info, const unsigned char *secret,
+		       const unsigned char *ikm, size_t ilen,
+		       unsigned char *out)
+{
+	int r;
+	size_t md_len = ttls_md_get_size(md_info);
+	unsigned char derived[TTLS_MD_MAX_SIZE];
+	unsigned char zeros[TTLS_MD_MAX_SIZE] = { 0 };
+
+	if (!ikm) {
+		ikm = zeros;
+		ilen = md_len;
+	}
+	if (!secret)
+		return ttls_hkdf_extract(md_info, NULL, 0, ikm, ilen, out);
+
+	/* Derive-Secret(secret, "derived", "") with hash of empty string. */
+	if ((r = ttls_md(md_info, NULL, 0, derived))
+	    || (r = ttls_tls13_derive_secret(md_info, secret, "derived",
+					     sizeof("derived") - 1, derived,
+					     derived)))
+		goto out;
+	r = ttls_hkdf_extract(md_info, derived, md_len, ikm, ilen, out);
+out:
+	bzero_fast(derived, sizeof(derived));
+
+	return r;
+}
+
+/**
+ * Traffic key and IV of @klen and @ivlen bytes for a traffic @secret,
+ * RFC 8446 7.3.
+ */
+int
+ttls_tls13_traffic_keys(const TlsMdInfo *md_info, const unsigned char *secret,
+			unsigned char *key, size_t klen, unsigned char *iv,
+			size_t ivlen)
+{
+	int r;
+
+	if ((r = ttls_hkdf_expand_label(md_info, secret, "key",
+					sizeof("key") - 1, NULL, 0, key,
+					klen)))
+		return r;
+
+	return ttls_hkdf_expand_label(md_info, secret, "iv", sizeof("iv") - 1,
+				      NULL, 0, iv, ivlen);
+}
@@ -173,6 +173,15 @@ ttls_mpi_pool_cleanup_ctx(unsigned long addr, bool zero)
 	mp->curr = clean_off;
 }
 
+/**
+ * Size of the MPI memory pool allocated for each handshake.
+ */
+size_t
+ttls_mpi_pool_hs_size(void)
+{
+	return PAGE_SIZE << __MPOOL_HS_ORDER;
+}
+
 /**
  * Free MPI memory pool storing the crypto context @ctx and return the freed
  * memory to the buddy allocator.
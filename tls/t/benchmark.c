@@ -1,7 +1,12 @@
 /**
  *		Tempesta TLS benchmark for crypto routines
  *
- * Copyright (C) 2020-2021 Tempesta Technologies, INC.
+ * Besides the primitives, the benchmark measures the server side public key
+ * cost of full handshakes for each key exchange and signature pair. Run with
+ * -c to get CSV output to compare different builds and with -t to change
+ * the time for each benchmark.
+ *
+ * Copyright (C) 2020-2026 Tempesta Technologies, INC.
  *
  * This program is free software; you can redistribute it and/or modify it
  * under the terms of the GNU General Public License as published by
@@ -25,12 +30,14 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#define NO_RSA_FUNC
 #include "ttls_mocks.h"
 /* mpool.c requires ECP and DHM routines. */
 #include "../asn1.c"
 #include "../bignum.c"
 #include "../ciphersuites.c"
 #include "../dhm.c"
+#include "../rsa.c" /* Must go before ec_p256.c defining short macros. */
 #include "../ec_p256.c"
 #include "../ecp.c"
 #include "../ecdh.c"
@@ -43,6 +50,8 @@ const TlsEcpGrp CURVE25519_G = {};
 #define BM_TIME		10
 static bool		run_bm;
 static unsigned long	iter;
+static unsigned int	bm_time = BM_TIME;
+static bool		bm_csv;
 
 static void
 fill_random(unsigned char *buf, size_t bytes)
@@ -58,31 +67,61 @@ bm_timeout(int sig)
 	run_bm = false;
 }
 
+static unsigned long
+bm_rdtsc(void)
+{
+	unsigned int lo, hi;
+
+	asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+
+	return ((unsigned long)hi << 32) | lo;
+}
+
 unsigned long
 tv_to_ms(const struct timeval *tv)
 {
 	return ((unsigned long)tv->tv_sec * 1000000 + tv->tv_usec) / 1000;
 }
 
+/**
+ * Print the benchmark results. The cycles are TSC ones, so they're
+ * comparable between builds on the same machine only.
+ */
+static void
+bm_report(const char *desc, unsigned long ops, unsigned long ms,
+	  unsigned long cycles)
+{
+	if (!ms)
+		ms = 1;
+	if (!ops)
+		ops = 1;
+	if (bm_csv)
+		printf("%s,%lu,%lu,%lu,%lu\n", desc, ops, ms, ops * 1000 / ms,
+		       cycles / ops);
+	else
+		printf(" %s:\tops=%lu time=%lums ops/s=%lu cycles/op=%lu\n",
+		       desc, ops, ms, ops * 1000 / ms, cycles / ops);
+}
+
 #define BENCHMARK(desc, bm_func)					\
 do {									\
-	unsigned long t;						\
+	unsigned long t, c;						\
 	struct timeval tv0, tv1;					\
 									\
-	printf(" %s:\t", desc);						\
-									\
 	/* We need only the single rare signal, so signal(2) is fine here. */\
 	signal(SIGALRM, bm_timeout);					\
-	alarm(BM_TIME);							\
+	alarm(bm_time);							\
 									\
 	gettimeofday(&tv0, NULL);					\
+	c = bm_rdtsc();							\
 	for (iter = 0, run_bm = true; run_bm; ++iter) {			\
 		bm_func;						\
 	}								\
+	c = bm_rdtsc() - c;						\
 	gettimeofday(&tv1, NULL);					\
 									\
 	t = tv_to_ms(&tv1) - tv_to_ms(&tv0);				\
-	printf("ops=%lu time=%lums ops/s=%lu\n", iter, t, iter * 1000 / t); \
+	bm_report(desc, iter, t, c);					\
 } while (0)
 
 #define UNROLL(F)	F; F; F; F; F; F; F; F; F; F; F; F; F; F; F; F; 
@@ -111,12 +150,25 @@ bm_sqr_mont_p256(void)
 }
 
 void
-bm_ecdsa_sign_p256(void)
+bm_mont_mul_2048(void)
 {
-	/*
-	 * Just some constants used as the key - hopefully they don't
-	 * affect speed of the test.
-	 */
+	unsigned long x[32 * 2 + 1], a[32], b[32], n[32], mm = 0x12345679UL;
+
+	fill_random((unsigned char *)a, sizeof(a));
+	fill_random((unsigned char *)b, sizeof(b));
+	fill_random((unsigned char *)n, sizeof(n));
+	n[0] |= 1;
+
+	BENCHMARK("2048-bit mont_mul",
+		bzero_fast(x, sizeof(x));
+		mpi_mont_mul_x86_64(x, a, b, 32, n, 32, mm);
+	);
+}
+
+/*
+ * Just some constants used as the keys - hopefully they don't affect speed
+ * of the test.
+ */
 #define EC_Qx								   \
 	"\xB8\x81\xE6\x91\x1E\xAD\xA2\x23\x61\xC5\x48\x7D\x77\xC6\xD2\x49" \
 	"\xDD\x38\xFF\xF8\xF7\x5E\xC2\x8D\x08\xFA\x02\x5B\x8C\xD4\xCE\x5B"
@@ -127,11 +179,69 @@ bm_ecdsa_sign_p256(void)
 	"\xC7\x1C\xBC\x8A\xCA\x38\xF7\xC9\x97\xF9\x3A\x6C\xBD\xFD\xCF\x7F" \
 	"\x4C\x9D\x32\xAA\x35\x1F\x49\xDB\xF4\x7D\x72\xD6\x64\x2F\x06\xDC"
 
-	int r;
+#define RSA2048_N							   \
+	"\xB3\x65\x18\xEA\x9B\xFC\xBA\x21\xAE\xB5\x3F\xFB\x6D\x35\xFB\x3D" \
+	"\x51\x5B\x43\xA2\xEF\x9C\x8D\x6D\xC9\x2E\xF6\x3D\xA5\xBE\x63\xCB" \
+	"\x44\xF4\x48\x30\x52\x3B\x89\x4E\x9A\x07\xC9\x95\xC8\x4C\x56\x9F" \
+	"\x0E\x1C\x13\x85\x30\xC6\x72\x89\xCA\xC2\xD1\x72\x53\xCA\xF3\x37" \
+	"\xCA\x3C\xC1\xB2\x2F\xEA\x09\x59\xC3\x63\x20\xF3\x76\xFE\x6D\x24" \
+	"\x95\x5F\x04\xFD\xFC\xC5\x89\x4F\x10\x2B\x89\x41\xF7\xE4\x33\x7A" \
+	"\xE8\xB5\x6A\x03\xF1\x1C\x1B\x70\xD7\x7C\x1A\x76\xDA\xD9\x11\x38" \
+	"\xE7\x7A\xED\xE6\x72\x8F\xB3\xCC\x70\xA3\x4F\xCB\xA1\x47\x89\x0D" \
+	"\xB5\x00\x14\x86\x6A\x94\x66\xB5\x25\x66\x59\x98\x19\x40\x24\xC1" \
+	"\x7E\xFC\x03\xB6\x57\x64\x27\x65\x42\x76\x70\xF7\x9E\xE5\xC1\x55" \
+	"\x7B\xC5\x2A\x35\xE3\x09\xB5\x20\x1A\x91\x77\x87\xFC\x4F\xE2\x91" \
+	"\x3C\x91\x29\xE8\x36\x4B\x9A\x25\xA9\xBF\x0C\xDC\x80\x44\x3D\xF5" \
+	"\xE2\x6C\xA7\x5E\x1E\x30\x5F\x8B\xE9\xB7\xF1\x41\x1E\xD4\xAE\x64" \
+	"\xA6\x58\x24\x5A\x50\xE1\xA6\xAE\xFD\xBF\xA4\xA9\x3C\x38\xE2\x4B" \
+	"\xDA\xA5\x53\xFB\x45\xF2\x42\xE4\x5D\xA6\x07\x13\xD7\xB8\xEE\xF7" \
+	"\xA6\x03\x9A\x9F\x3E\xAE\x08\xA0\x53\x19\x1B\xC5\x94\xDA\x0D\x03"
+
+#define RSA2048_D							   \
+	"\x19\xAC\xB0\xE5\xB6\xE0\x73\x35\x29\xDF\x67\xE2\x50\x8D\x86\xC1" \
+	"\x0E\x59\x3C\xF3\x5F\x4E\xAD\x11\x16\xD7\x81\x47\x6E\x66\xB2\xBA" \
+	"\x9F\x4A\x44\xE0\xA1\x8C\x42\xC8\xFC\x93\x7B\xBE\xD3\x95\x55\x5A" \
+	"\x5B\x37\x1A\x76\x17\xF6\x76\xE3\x10\xA1\x54\x3F\x84\x0D\x8A\x44" \
+	"\xA4\x4D\x90\xBD\x33\x4D\x4F\xFC\x48\x51\xF2\x1F\xD6\x1A\x70\xBD" \
+	"\x69\x21\x59\xC2\x0E\x00\xA9\x77\xA6\xCD\x4C\x4E\x24\x2F\xC5\x4C" \
+	"\x64\x6C\xBE\x59\x05\x13\x6C\x3B\xF8\xA3\x1A\xD8\x82\xD6\xC9\x37" \
+	"\xB7\x2D\x69\x49\xEF\x80\x70\x8F\xA4\x59\x43\x2C\xD6\x0E\xBA\x66" \
+	"\xFD\xF5\x91\x50\x5B\x99\xB7\x58\x49\x49\xEB\x3C\xEE\xD2\x0A\x6E" \
+	"\xA8\xE4\xFA\xD9\xFE\xA4\xA8\x70\x42\xA5\xE8\x95\xF8\x19\xCB\xDB" \
+	"\x6D\x73\xCA\x07\xCD\xBA\x72\x5A\xB5\xA1\xF8\x17\xB0\x07\x7E\xAE" \
+	"\xAE\x0B\x68\x50\x63\x23\x4F\x93\x1E\x4C\xF9\x82\xC4\xB9\xED\xE4" \
+	"\xCF\x9D\xFB\x80\x37\x6B\xFE\x5C\x4D\xFC\x0D\x70\xD9\x82\xED\x0F" \
+	"\xAC\xE8\xB5\x0A\x57\xBE\x78\x86\xE2\x76\x66\x27\xE3\x0B\x0F\x4D" \
+	"\xF4\x72\x86\xCF\xDB\x54\x0C\xB9\x75\x8F\x9C\xA7\xB2\x01\xD7\x16" \
+	"\x75\x99\xD6\xFF\xC7\x9F\xD7\x53\x18\x7C\x00\x8E\x34\xA8\x2C\xE5"
+
+#define RSA2048_P							   \
+	"\xD8\xDE\x2F\xAE\x6B\xEB\x6C\x11\x7A\x60\x8F\x77\x6F\x24\x80\x63" \
+	"\x35\xE0\x68\x70\xA2\x8D\xF0\xA6\x89\x90\x29\xAF\x10\xA1\x80\xDB" \
+	"\x2D\xF0\x48\x2A\xA2\xA2\x0B\xC1\x39\xA7\x89\x1B\x72\x81\x50\xD0" \
+	"\x25\xA0\x38\xAD\x66\xAE\xE4\x97\x92\x39\x52\x5B\xDD\x10\x90\x92" \
+	"\xF2\x0E\x44\x7F\x12\xB6\x9C\x45\xF2\x26\x29\x6E\x13\x3C\xC6\x16" \
+	"\x35\x43\xAA\x59\x43\x22\xE1\xE2\x34\xE8\xD5\xC0\xCC\x7C\xC9\xA1" \
+	"\xF3\x24\x06\xDC\xC4\x35\xEA\xE8\xE2\x84\x9A\x7A\x1A\x23\xB4\x82" \
+	"\xA2\x8B\x8A\x20\x73\x25\x69\xC7\x2A\x8F\x8D\x53\x34\x65\x1C\x75"
+
+#define RSA2048_Q							   \
+	"\xD3\xC3\xEA\x2B\x02\xAF\x11\x28\x0D\x46\x1B\x2A\x8E\x8A\xCD\x46" \
+	"\xA0\x75\x03\x77\x57\x02\xCF\x2E\x8A\xA8\xDC\x8E\x26\x33\xE0\x7A" \
+	"\xEC\x5F\xBD\x4D\xE5\x39\x54\x19\xEB\xF6\x7A\xF0\xCC\xB2\xCE\x57" \
+	"\x59\x20\x2D\x7C\x62\x95\x24\xA0\xCE\x16\x24\xD8\x61\x3D\xD7\x43" \
+	"\x0B\xCD\xEB\x0C\x0D\xD4\xAE\xFF\xEC\x1F\xAB\x0F\x45\x14\x6B\x30" \
+	"\x9F\xD2\xCB\xC6\x36\xF3\x2D\xBB\xE7\x5B\xF4\xE8\x0C\x86\x2B\x1D" \
+	"\x1E\x02\xC6\x5C\x41\x30\x61\x7E\x70\xFD\x33\x23\xA3\x09\xF9\x57" \
+	"\x11\x3E\x7C\x65\xAA\xFF\x16\xF1\x12\x9E\x30\x74\xA9\xE4\xB4\x97"
+
+#define RSA2048_E	"\x01\x00\x01"
+
+static TlsEcpKeypair *
+bm_ecdsa_p256_ctx(void)
+{
 	TlsMpiPool *mp;
 	TlsEcpKeypair *ctx;
-	size_t slen;
-	char hash[32], sig[80];
 
 	mp = ttls_mpi_pool_create(0, GFP_KERNEL);
 	BUG_ON(!mp);
@@ -145,30 +255,82 @@ bm_ecdsa_sign_p256(void)
 	ttls_mpi_lset(&ctx->Q.Z, 1);
 	ttls_mpi_read_binary(&ctx->d, EC_d, 32);
 
-	fill_random(hash, 32);
-
-	/*
-	 * The both WolfSSL and OpenSSL benchmark key derivation for ECDH
-	 * and signing for ECDSA only, they do not include ephimeral keys
-	 * generation.
-	 */
-	BENCHMARK("ECDSA sign (nistp256)",
-		r = ctx->grp->ecdsa_sign(&ctx->d, hash, 32, sig, &slen);
-		BUG_ON(r);
-		ttls_mpi_pool_cleanup_ctx(0, false);
-	);
-#undef EC_d
-#undef EC_Qy
-#undef EC_Qx
+	return ctx;
 }
 
-void
-bm_ecdhe_srv_p256(void)
+static TlsRSACtx *
+bm_rsa2048_ctx(void)
 {
 	int r;
-	size_t n;
+	TlsMpiPool *mp;
+	TlsRSACtx *rsa;
+
+	mp = ttls_mpi_pool_create(0, GFP_KERNEL);
+	BUG_ON(!mp);
+	rsa = ttls_mpool_alloc_data(mp, sizeof(TlsRSACtx));
+	BUG_ON(!rsa);
+	memset(rsa, 0, sizeof(TlsRSACtx));
+	ttls_rsa_init(rsa, TTLS_RSA_PKCS_V15, 0);
+
+	/* BUG_ON() is a no-op with NDEBUG, so don't call functions in it. */
+	r = ttls_rsa_import_raw(rsa, RSA2048_N, 256, RSA2048_P, 128,
+				RSA2048_Q, 128, RSA2048_D, 256, RSA2048_E, 3);
+	BUG_ON(r);
+	r = ttls_rsa_check_pubkey(rsa);
+	BUG_ON(r);
+
+	return rsa;
+}
+
+/*
+ * Copy (clone) ECDH context from the MPI profile for Secp256r1 PK
+ * operations, see __mpi_profile_clone().
+ * Correctness of the group load is tested in test_ecp.c.
+ */
+static TlsECDHCtx *
+bm_ecdhe_p256_ctx(void)
+{
 	TlsECDHCtx *ctx;
 	TlsMpiPool *mp;
+
+	mp = ttls_mpi_pool_create(0, GFP_KERNEL);
+	BUG_ON(!mp);
+	ctx = ttls_mpool_alloc_data(mp, cs_mp_ecdhe_secp256.mp.curr
+					- sizeof(*mp));
+	BUG_ON(!ctx);
+	mp->curr = cs_mp_ecdhe_secp256.mp.curr;
+	memcpy_fast(ctx, MPI_POOL_DATA(&cs_mp_ecdhe_secp256.mp),
+		    mp->curr - sizeof(*mp));
+
+	return ctx;
+}
+
+static void
+bm_ecdsa_p256_op(TlsEcpKeypair *ctx, const char *hash)
+{
+	size_t slen;
+	char sig[80];
+	int r;
+
+	r = ctx->grp->ecdsa_sign(&ctx->d, hash, 32, sig, &slen);
+	BUG_ON(r);
+}
+
+static void
+bm_rsa2048_op(TlsRSACtx *rsa, const char *hash)
+{
+	unsigned char sig[256];
+	int r;
+
+	r = ttls_rsa_pkcs1_sign(rsa, TTLS_MD_SHA256, hash, 32, sig);
+	BUG_ON(r);
+}
+
+static void
+bm_ecdhe_p256_op(TlsECDHCtx *ctx)
+{
+	int r;
+	size_t n;
 	unsigned char buf[128] = {0}, pms[TTLS_PREMASTER_SIZE] = {0};
 	const char clnt_buf[66] = "\x41\x04\xCE\xD4\x8B\x4C\x8A\x45"
 				  "\xA2\x08\xF8\x1F\xFD\xAF\xA6\x8C"
@@ -180,39 +342,134 @@ bm_ecdhe_srv_p256(void)
 				  "\xE9\x84\x9D\x52\x79\x7C\x9C\x74"
 				  "\x8F\x67";
 
-	mp = ttls_mpi_pool_create(0, GFP_KERNEL);
-	BUG_ON(!mp);
+	r = ttls_ecdh_make_params(ctx, &n, buf, 128);
+	BUG_ON(r);
+	r = ttls_ecdh_read_public(ctx, clnt_buf, 66);
+	BUG_ON(r);
+	r = ttls_ecdh_calc_secret(ctx, &n, pms, TTLS_MPI_MAX_SIZE);
+	BUG_ON(r);
+}
 
-	/*
-	 * Copy (clone) ECDH context from the MPI profile for Secp256r1 PK
-	 * operations, see __mpi_profile_clone().
-	 * Correctness of the group load is tested in test_ecp.c.
-	 */
-	ctx = ttls_mpool_alloc_data(mp, cs_mp_ecdhe_secp256.mp.curr
-					- sizeof(*mp));
-	BUG_ON(!ctx);
-	mp->curr = cs_mp_ecdhe_secp256.mp.curr;
-	memcpy_fast(ctx, MPI_POOL_DATA(&cs_mp_ecdhe_secp256.mp),
-		    mp->curr - sizeof(*mp));
+/*
+ * The both WolfSSL and OpenSSL benchmark key derivation for ECDH
+ * and signing for ECDSA only, they do not include ephimeral keys
+ * generation.
+ */
+void
+bm_ecdsa_sign_p256(void)
+{
+	TlsEcpKeypair *ctx = bm_ecdsa_p256_ctx();
+	char hash[32];
+
+	fill_random(hash, 32);
+
+	BENCHMARK("ECDSA sign (nistp256)",
+		bm_ecdsa_p256_op(ctx, hash);
+		ttls_mpi_pool_cleanup_ctx(0, false);
+	);
+}
+
+void
+bm_rsa_sign_2048(void)
+{
+	TlsRSACtx *rsa = bm_rsa2048_ctx();
+	char hash[32];
+
+	fill_random(hash, 32);
+
+	BENCHMARK("RSA sign (2048)",
+		bm_rsa2048_op(rsa, hash);
+		ttls_mpi_pool_cleanup_ctx(0, false);
+	);
+}
+
+void
+bm_ecdhe_srv_p256(void)
+{
+	TlsECDHCtx *ctx = bm_ecdhe_p256_ctx();
 
 	BENCHMARK("ECDHE srv (nistp256)",
-		r = ttls_ecdh_make_params(ctx, &n, buf, 128);
-		BUG_ON(r);
-		ttls_ecdh_read_public(ctx, clnt_buf, 66);
-		BUG_ON(r);
-		ttls_ecdh_calc_secret(ctx, &n, pms, TTLS_MPI_MAX_SIZE);
-		BUG_ON(r);
+		bm_ecdhe_p256_op(ctx);
+		ttls_mpi_pool_cleanup_ctx(0, false);
+	);
+}
+
+/**
+ * Full handshakes per second per core, limited by the server side public
+ * key operations: the ephemeral key generation and the shared secret for
+ * ECDHE and signing of ServerKeyExchange. Symmetric crypto and the
+ * handshake messages processing are a small fraction of a full handshake
+ * and aren't included.
+ */
+void
+bm_handshake_ecdhe_ecdsa(void)
+{
+	TlsEcpKeypair *ecdsa = bm_ecdsa_p256_ctx();
+	TlsECDHCtx *ecdh = bm_ecdhe_p256_ctx();
+	char hash[32];
+
+	fill_random(hash, 32);
+
+	BENCHMARK("handshake ECDHE-ECDSA (nistp256)",
+		bm_ecdhe_p256_op(ecdh);
+		bm_ecdsa_p256_op(ecdsa, hash);
 		ttls_mpi_pool_cleanup_ctx(0, false);
 	);
 }
 
+void
+bm_handshake_ecdhe_rsa(void)
+{
+	TlsRSACtx *rsa = bm_rsa2048_ctx();
+	TlsECDHCtx *ecdh = bm_ecdhe_p256_ctx();
+	char hash[32];
+
+	fill_random(hash, 32);
+
+	BENCHMARK("handshake ECDHE-RSA (nistp256 RSA-2048)",
+		bm_ecdhe_p256_op(ecdh);
+		bm_rsa2048_op(rsa, hash);
+		ttls_mpi_pool_cleanup_ctx(0, false);
+	);
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-c] [-t SECONDS]\n"
+			"  -c  print CSV: name,ops,time_ms,ops_per_s,"
+			"cycles_per_op\n"
+			"  -t  time for each benchmark, %u seconds by default\n",
+		prog, BM_TIME);
+}
+
 int
 main(int argc, char *argv[])
 {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "ct:")) != -1) {
+		switch (opt) {
+		case 'c':
+			bm_csv = true;
+			break;
+		case 't':
+			bm_time = atoi(optarg);
+			if (bm_time)
+				break;
+			/* Fall through. */
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
 	if (ttls_mpool_init()) {
 		fprintf(stderr, "Cannot initialize crypto memoty pool\n");
 		return 1;
 	}
+	if (bm_csv)
+		printf("name,ops,time_ms,ops_per_s,cycles_per_op\n");
 
 	/*
 	 * Benchmark multiplication vs squaring - the fundamental ratio
@@ -223,10 +480,18 @@ main(int argc, char *argv[])
 	 */
 	bm_mul_mont_p256();
 	bm_sqr_mont_p256();
+	bm_mont_mul_2048();
 
 	bm_ecdsa_sign_p256();
+	bm_rsa_sign_2048();
 	bm_ecdhe_srv_p256();
 
+	/* Run-time (softirq) logic for RSA. */
+	kernel_fpu_begin();
+	bm_handshake_ecdhe_ecdsa();
+	bm_handshake_ecdhe_rsa();
+	kernel_fpu_end();
+
 	ttls_mpool_exit();
 
 	return 0;
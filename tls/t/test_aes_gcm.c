@@ -0,0 +1,280 @@
+/**
+ *		Tempesta TLS AES-GCM unit test
+ *
+ * The reference tags and ciphertext are generated by AESGCM of the Python
+ * cryptography package for the same key, nonce, AAD and plaintext patterns.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "ttls_mocks.h"
+
+#include "../aes_gcm.c"
+
+#ifdef VAES
+
+#define DATA_MAX	16397
+
+static const struct {
+	unsigned int	key_len;
+	unsigned int	aad_len;
+	unsigned int	len;
+	const char	*tag;
+} vectors[] = {
+	{ 16, 0, 0,
+	  "\xac\x05\x39\xe4\x11\x69\x79\x9e\xe2\x76\x3e\x9a\xc4\x21\x17\xa1" },
+	{ 16, 0, 17,
+	  "\x33\x40\x66\x38\x04\xa1\xd8\xe6\x0f\xcf\x0b\x53\x04\xf9\x41\x52" },
+	{ 16, 0, 256,
+	  "\x51\xb7\x9e\xe1\xcc\x5a\xef\xc8\x87\x5c\xa3\xd5\xf5\xdc\xa2\x12" },
+	{ 16, 0, 1000,
+	  "\xa2\xd6\xd4\x02\xce\x0e\x6b\x5b\x6c\x5b\x0f\x5f\x0a\x25\x3e\x50" },
+	{ 16, 13, 0,
+	  "\xa2\x52\xe7\x4d\x24\xf4\xb2\xab\x34\x55\x5a\xcc\x50\x86\x48\xc0" },
+	{ 16, 13, 1,
+	  "\x8e\x0d\x9a\xa6\xe4\xc6\xc5\xd3\xbd\x9f\xd9\x64\xf6\xce\x3f\x1f" },
+	{ 16, 13, 15,
+	  "\x23\x62\x4d\xfb\xd0\x5c\x08\x2a\x8f\xa6\x31\x2d\xe5\x3e\xe8\x64" },
+	{ 16, 13, 16,
+	  "\xbd\x32\xe4\xdf\x33\x28\x43\xbd\xcc\x5c\xb0\x31\x89\xb1\x6d\x2b" },
+	{ 16, 13, 17,
+	  "\xd9\xac\x50\x3e\xdd\x61\x16\x79\x7c\x39\x71\x1b\x91\xb9\xdc\x5d" },
+	{ 16, 13, 63,
+	  "\x6c\xcd\x89\x09\x87\xbf\x5d\xc9\x29\xb8\xd8\xc8\x99\xae\x60\xb5" },
+	{ 16, 13, 64,
+	  "\x69\xfa\x51\x56\x68\x95\x1e\x32\x7f\x2e\x48\xdc\x64\x3d\xb6\x58" },
+	{ 16, 13, 255,
+	  "\x91\xf7\x61\x3e\x90\x25\xca\xcc\x04\x9b\x3d\xb0\x35\x1f\xbd\xa2" },
+	{ 16, 13, 256,
+	  "\xd5\x54\x43\x64\x03\x4e\x99\x4e\x25\xf5\x41\x0a\xf9\xca\x5f\x0a" },
+	{ 16, 13, 257,
+	  "\xdf\xa7\x9e\xa9\xbf\x69\x7a\xdf\x2d\xf1\xf0\x6d\xb1\xe7\xee\x55" },
+	{ 16, 13, 300,
+	  "\x74\x96\x1d\x7f\xd2\xa0\xc1\xd1\x2f\xa1\xe6\x34\x47\xfb\x07\xd9" },
+	{ 16, 13, 511,
+	  "\x85\x67\x10\x18\xe0\x79\xd7\x15\x1a\xd7\x0d\x69\x71\xae\x9a\xba" },
+	{ 16, 13, 512,
+	  "\xec\x82\x04\xeb\xa7\xa6\xce\x1b\x0c\x3a\x7a\x3a\x45\x59\x8e\xe2" },
+	{ 16, 13, 1000,
+	  "\x18\xa0\xf1\x94\xf3\xa3\x59\x7a\xc9\x7b\x6d\x4f\xaa\xf4\xeb\x7e" },
+	{ 16, 13, 4096,
+	  "\x72\x77\x10\xb9\x4a\x8a\x88\x2a\x1d\xd8\x0d\x6f\xdc\xfb\x06\x0f" },
+	{ 16, 13, 16397,
+	  "\x9b\x6d\xb4\xa8\x6a\x7e\x7e\xa5\x67\x8d\xcb\x90\xf6\x80\xa0\x46" },
+	{ 16, 16, 0,
+	  "\xbf\x13\x78\xe8\xf4\x59\xa2\x53\xb4\xa3\x5a\x7e\x34\xbe\xde\xdc" },
+	{ 16, 16, 17,
+	  "\x3b\xfe\xf2\xe9\x12\x24\xb6\x0e\xef\x9a\xc7\x77\x54\xcc\xa0\xe2" },
+	{ 16, 16, 256,
+	  "\x31\x55\x9a\x20\x4a\x42\xad\xd6\x72\x53\x2b\x80\xf9\x8e\x5d\xf3" },
+	{ 16, 16, 1000,
+	  "\x24\x0d\x04\xbb\x61\x4a\xb6\xb9\x20\x2b\x2c\x2d\xf9\xe7\xdc\x53" },
+	{ 16, 20, 0,
+	  "\xb4\x79\xea\xf8\x09\x24\xd5\x30\xec\x52\x1d\x14\x4a\xe3\xdd\xa6" },
+	{ 16, 20, 17,
+	  "\x04\xc0\x3e\xa3\x99\x77\xaa\xf2\xd8\x6e\x58\xf2\xb2\x3d\xc0\x01" },
+	{ 16, 20, 256,
+	  "\x6d\xc4\x8a\x85\x03\xe1\xdc\xf3\xe1\x9e\x63\x1f\xe7\xd9\xc1\x23" },
+	{ 16, 20, 1000,
+	  "\x5c\x47\xbc\x59\xd8\xed\x26\xe3\x53\x8d\x29\x98\xa8\x62\xc3\x45" },
+	{ 32, 0, 0,
+	  "\xbb\x1a\x94\x8e\x06\x49\xe8\xd5\xf5\x20\xc5\xbb\x33\x43\xa5\xe2" },
+	{ 32, 0, 17,
+	  "\xb4\x50\x40\xfd\xf9\x03\xbd\x1e\x32\x46\x2a\xee\xb7\x22\x8f\x5a" },
+	{ 32, 0, 256,
+	  "\x8e\x6d\x2d\x1a\x40\xcf\xfd\xb7\x49\xbc\xd6\x57\xd5\x4d\x89\x94" },
+	{ 32, 0, 1000,
+	  "\x5f\x00\xdf\xcc\xea\xcf\xc2\xa0\xc5\x9a\xc2\xc4\x2a\xa8\x61\xcb" },
+	{ 32, 13, 0,
+	  "\x5f\x19\x2b\xf4\xab\x08\x21\x57\x0b\xa4\x11\xa5\xf7\x28\x02\xbb" },
+	{ 32, 13, 1,
+	  "\x84\x99\x8e\x3e\x90\x1e\x7a\xde\x7b\x99\x69\x51\x59\x25\xf0\xba" },
+	{ 32, 13, 15,
+	  "\x33\xf7\xdb\x06\x68\x1c\xce\xb0\x34\x73\x2b\xd4\xfe\x8e\x61\x09" },
+	{ 32, 13, 16,
+	  "\xc0\x91\x37\x97\x62\xc4\xdb\xc1\xf1\x10\xa6\xa2\x64\x95\x9f\xce" },
+	{ 32, 13, 17,
+	  "\x1f\xc3\xc0\x16\xef\xba\x3f\x0d\xb7\x0f\x5f\x03\x8e\x4d\x78\x8f" },
+	{ 32, 13, 63,
+	  "\x8a\xc9\xe5\x39\x26\xf5\xa9\x8b\x84\x78\xb0\xca\x39\x0a\xc3\x39" },
+	{ 32, 13, 64,
+	  "\x3d\x43\xa1\x9f\x44\x40\x1d\x5e\x4b\xbc\x66\x8f\x8d\x1e\xef\x98" },
+	{ 32, 13, 255,
+	  "\x5c\xd8\x38\x3d\xf7\x84\x63\xa6\xfd\x10\x29\x26\xfb\x8d\xd7\xae" },
+	{ 32, 13, 256,
+	  "\x42\x87\xda\x73\x9f\x23\xd6\x1a\x89\x37\x4e\x5b\x23\xaf\x00\x7e" },
+	{ 32, 13, 257,
+	  "\xc9\xb0\x56\x5e\xbd\x25\x89\x3c\x9a\xe6\xdb\xb4\x22\x63\x76\xb3" },
+	{ 32, 13, 300,
+	  "\xab\x7d\x37\x77\xc8\x2f\x26\x75\xbf\xbf\xe7\x95\x3b\x10\x9d\x79" },
+	{ 32, 13, 511,
+	  "\x48\x67\xce\xf3\xb8\xfc\xf7\x03\xb4\xc3\x2c\x3f\xbe\x81\xb6\xae" },
+	{ 32, 13, 512,
+	  "\xcb\xb3\xc7\x23\xe4\xc0\x59\x92\x8e\x24\x5f\x69\x28\x55\x9c\xea" },
+	{ 32, 13, 1000,
+	  "\xe2\xe3\xe5\x49\xfd\x32\x1e\x33\xe3\xbd\x65\x6d\xda\x81\x27\xbb" },
+	{ 32, 13, 4096,
+	  "\xb8\xe0\x5a\xa8\x4e\xe3\x4e\xef\xe0\x59\x7b\x98\x8c\x7c\x68\x91" },
+	{ 32, 13, 16397,
+	  "\xf3\x3c\x87\x78\x8f\x7d\x5e\x04\x96\x29\x0f\xe4\x99\xe7\xfa\x00" },
+	{ 32, 16, 0,
+	  "\x93\x94\x3b\x1d\x66\xfb\xc2\x88\x85\xbf\xe6\x24\x28\xaa\x6c\x3d" },
+	{ 32, 16, 17,
+	  "\x6d\xca\xc8\x8e\x82\x05\x00\xa0\xed\xd4\x06\xc0\x17\x6e\xa9\xed" },
+	{ 32, 16, 256,
+	  "\xc8\x9e\xcb\xfa\xef\x80\xb1\xe7\x24\xa1\xfa\xf7\xaf\xc7\xf7\xfe" },
+	{ 32, 16, 1000,
+	  "\xcd\x62\x38\xa6\xd6\xb1\x51\xd6\x30\x2f\x2f\x51\xc0\xa4\x97\x51" },
+	{ 32, 20, 0,
+	  "\xab\xd0\xd5\x46\xc7\x53\x1d\x95\xe8\x87\xe7\xc8\xdb\xdb\xf7\xb0" },
+	{ 32, 20, 17,
+	  "\x77\xab\x0b\xe7\x7b\x1b\x88\xf5\x22\xe4\xe0\x59\x46\x09\xf4\x7d" },
+	{ 32, 20, 256,
+	  "\xcd\x77\x27\xa6\xbb\xaa\x69\xa4\x58\x37\xa5\x5d\x00\x3e\x64\x92" },
+	{ 32, 20, 1000,
+	  "\x69\xb4\x20\x9f\x9c\x57\xec\xf8\xef\x26\x17\xb4\xa1\x76\x13\x47" },
+};
+
+/* Ciphertext of 67 bytes with 16-byte key and 13-byte AAD. */
+static const char ct67[] =
+	"\xa8\x9e\x04\xc7\x77\x90\xc9\x34\xe1\xbd\x2c\xbf\x54\x58\x15\x2f"
+	"\x30\x9a\xb7\x54\x04\x76\xbb\xa3\xd6\x4d\x12\x4e\xe0\x63\x03\xb2"
+	"\x71\xf4\x01\x02\x2c\x3f\x22\x60\x38\x66\x43\x92\x83\xc5\x3a\x70"
+	"\x53\x72\x88\x21\xa2\xc2\xcc\x7b\x84\x70\x9d\x62\x9c\x90\x20\x36"
+	"\x9a\x91\x9f";
+
+static unsigned char pt[DATA_MAX], ct[DATA_MAX], buf[DATA_MAX];
+
+static void
+pattern(unsigned char *p, size_t n, unsigned int a, unsigned int b)
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		p[i] = i * a + b;
+}
+
+/* Process @len bytes in chunks of 1..70 bytes, or at once if @step is 0. */
+static void
+gcm_run(TlsAesGcmKey *key, bool enc, const unsigned char *aad,
+	unsigned int aad_len, const unsigned char *src, unsigned char *dst,
+	size_t len, unsigned int step, unsigned char *tag)
+{
+	TlsAesGcm st;
+	unsigned char iv[12];
+	size_t off, n;
+
+	pattern(iv, sizeof(iv), 29, 5);
+	ttls_aes_gcm_start(&st, key, iv, aad, aad_len, enc);
+	for (off = 0; off < len; off += n) {
+		n = step ? min_t(size_t, len - off, (off * step) % 70 + 1)
+			 : len;
+		ttls_aes_gcm_update(&st, src + off, dst + off, n);
+	}
+	ttls_aes_gcm_finish(&st, tag);
+}
+
+static void
+aes_gcm_vectors(void)
+{
+	int i;
+	unsigned int step;
+	unsigned char k[32], aad[20], tag[16];
+	TlsAesGcmKey key;
+
+	pattern(k, sizeof(k), 13, 1);
+	pattern(aad, sizeof(aad), 3, 11);
+	pattern(pt, sizeof(pt), 7, 3);
+
+	for (i = 0; i < ARRAY_SIZE(vectors); ++i) {
+		unsigned int len = vectors[i].len;
+
+		EXPECT_ZERO(ttls_aes_gcm_setkey(&key, k, vectors[i].key_len));
+		for (step = 0; step < 3; ++step) {
+			/* Out of place encryption. */
+			gcm_run(&key, true, aad, vectors[i].aad_len, pt, ct,
+				len, step, tag);
+			EXPECT_ZERO(memcmp(tag, vectors[i].tag, 16));
+
+			/* In place decryption. */
+			memcpy(buf, ct, len);
+			gcm_run(&key, false, aad, vectors[i].aad_len, buf, buf,
+				len, step, tag);
+			EXPECT_ZERO(memcmp(tag, vectors[i].tag, 16));
+			EXPECT_ZERO(memcmp(buf, pt, len));
+		}
+	}
+
+	EXPECT_ZERO(ttls_aes_gcm_setkey(&key, k, 16));
+	gcm_run(&key, true, aad, 13, pt, ct, sizeof(ct67) - 1, 0, tag);
+	EXPECT_ZERO(memcmp(ct, ct67, sizeof(ct67) - 1));
+
+	EXPECT_EQ(ttls_aes_gcm_setkey(&key, k, 24), -EINVAL);
+}
+
+/* A modified ciphertext or AAD must give a different tag. */
+static void
+aes_gcm_forgery(void)
+{
+	unsigned char k[16], aad[13], tag[16], tag2[16];
+	TlsAesGcmKey key;
+
+	pattern(k, sizeof(k), 13, 1);
+	pattern(aad, sizeof(aad), 3, 11);
+	pattern(pt, 1000, 7, 3);
+	EXPECT_ZERO(ttls_aes_gcm_setkey(&key, k, 16));
+
+	gcm_run(&key, true, aad, 13, pt, ct, 1000, 0, tag);
+	ct[517] ^= 1;
+	gcm_run(&key, false, aad, 13, ct, buf, 1000, 0, tag2);
+	EXPECT_TRUE(memcmp(tag, tag2, 16));
+	ct[517] ^= 1;
+	aad[12] ^= 0x80;
+	gcm_run(&key, false, aad, 13, ct, buf, 1000, 0, tag2);
+	EXPECT_TRUE(memcmp(tag, tag2, 16));
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (!__builtin_cpu_supports("vaes")
+	    || !__builtin_cpu_supports("vpclmulqdq")
+	    || !__builtin_cpu_supports("avx512vl")
+	    || !__builtin_cpu_supports("avx512bw"))
+	{
+		printf("skipped: no VAES and AVX-512 support\n");
+		return 0;
+	}
+
+	aes_gcm_vectors();
+	aes_gcm_forgery();
+
+	printf("success\n");
+
+	return 0;
+}
+
+#else /* VAES */
+
+int
+main(int argc, char *argv[])
+{
+	printf("skipped: no VAES support\n");
+
+	return 0;
+}
+
+#endif /* VAES */
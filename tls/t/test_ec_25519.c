@@ -25,16 +25,79 @@
 #include "../ec_25519.c"
 #include "../ecp.c"
 #include "../mpool.c"
+#include "util.h"
 
 /* Mock irrelevant groups. */
 const TlsEcpGrp SECP256_G = {};
 
+static void
+__ecp_mul_comb(const unsigned long k[4], const unsigned long u[4])
+{
+	TlsEcpPoint *R;
+	TlsMpi *d = ttls_mpi_alloc_stack_init(G_LIMBS);
+
+	ttls_ecp_point_tmp_alloc_init(R, G_LIMBS, G_LIMBS, G_LIMBS);
+
+	memcpy(MPI_P(d), k, G_LIMBS * CIL);
+	d->used = G_LIMBS;
+
+	EXPECT_ZERO(ecp_mul_comb_g(R, d));
+	EXPECT_MPI(&R->X, 4, u[0], u[1], u[2], u[3]);
+	EXPECT_MPI(&R->Z, 1, 1UL);
+
+	ttls_mpi_pool_cleanup_ctx(0, false);
+}
+
+/**
+ * RFC 7748 section 6.1: the public keys of Alice and Bob from their clamped
+ * private keys.
+ */
+static void
+ecp_mul_comb(void)
+{
+	static const unsigned long k_a[4] = {
+		0x7da518730a6d0770UL, 0x4566b25172c1163cUL,
+		0x2a99c0eb872f4cdfUL, 0x6a2cb91da5fb77b1UL
+	}, u_a[4] = {
+		0x54a7308909f02085UL, 0x5af73eb4dc7d8b74UL,
+		0xf41a38260d3abf0dUL, 0x6a4e9baa8ea9a4ebUL
+	}, k_b[4] = {
+		0x4b8a4a627e08ab58UL, 0xe60e80838b7fe179UL,
+		0xfdb6182629b13b6fUL, 0x6be088ff278b2f1cUL
+	}, u_b[4] = {
+		0xb4c17d7b7ddb9edeUL, 0x3735e4ecc2615bd3UL,
+		0x4d67785bc843833fUL, 0x4f2b886f147efcadUL
+	};
+
+	__ecp_mul_comb(k_a, u_a);
+	__ecp_mul_comb(k_b, u_b);
+}
+
+static void
+ecp_keypair(void)
+{
+	int i;
+	TlsEcpPoint *Q;
+	TlsMpi *d = ttls_mpi_alloc_stack_init(G_LIMBS);
+
+	ttls_ecp_point_tmp_alloc_init(Q, G_LIMBS, G_LIMBS, G_LIMBS);
+
+	for (i = 0; i < 64; ++i) {
+		EXPECT_ZERO(ec25519_gen_keypair(d, Q));
+		EXPECT_TRUE(ttls_mpi_cmp_mpi(&Q->X, &G.P) < 0);
+		EXPECT_MPI(&Q->Z, 1, 1UL);
+	}
+
+	ttls_mpi_pool_cleanup_ctx(0, false);
+}
+
 int
 main(int argc, char *argv[])
 {
 	BUG_ON(ttls_mpool_init());
 
-	/* TODO #1335 no real tests, just check initialization for now. */
+	ecp_mul_comb();
+	ecp_keypair();
 
 	ttls_mpool_exit();
 
@@ -448,6 +448,29 @@ ecp_inv(void)
 			  0x152a4e13984f9845UL, 0x510a62612850ec16UL);
 }
 
+static void
+ecp_keypair_batch(void)
+{
+	int i;
+	TlsEcpPoint *Q, *R;
+	TlsMpi *d = ttls_mpi_alloc_stack_init(G_LIMBS);
+
+	ttls_ecp_point_tmp_alloc_init(Q, G_LIMBS * 2, G_LIMBS * 2, G_LIMBS * 2);
+	ttls_ecp_point_tmp_alloc_init(R, G_LIMBS * 2, G_LIMBS * 2, G_LIMBS * 2);
+
+	/* Exhaust the per-CPU pool to get keypairs from two batches. */
+	for (i = 0; i <= ECP256_BATCH; ++i) {
+		EXPECT_ZERO(ecp256_gen_keypair(d, Q));
+
+		ecp256_mul_comb_g(R, d);
+		EXPECT_ZERO(ttls_mpi_cmp_mpi(&Q->X, &R->X));
+		EXPECT_ZERO(ttls_mpi_cmp_mpi(&Q->Y, &R->Y));
+		EXPECT_MPI(&Q->Z, 1, 1);
+	}
+
+	ttls_mpi_pool_cleanup_ctx(0, false);
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -458,6 +481,7 @@ main(int argc, char *argv[])
 	ecp_multi_dbl();
 	ecp_mul();
 	ecp_inv();
+	ecp_keypair_batch();
 
 	ttls_mpool_exit();
 
@@ -0,0 +1,390 @@
+/**
+ *		Tempesta TLS HKDF and TLS 1.3 key schedule unit test
+ *
+ * The HKDF test vectors are from RFC 5869 appendix A, the key schedule ones
+ * are from the simple 1-RTT handshake of RFC 8448 section 3.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "ttls_mocks.h"
+
+#include "../hkdf.c"
+
+/*
+ * The kernel crypto API isn't available in user space, so replace the weak
+ * message digest mocks by a plain SHA-256 and HMAC-SHA-256. The mocked
+ * ttls_md_info_from_type() always returns SHA-256.
+ */
+typedef struct {
+	u32		h[8];
+	u64		len;
+	unsigned char	buf[64];
+	unsigned char	key[64];
+	bool		hmac;
+} Sha256;
+
+static const u32 k256[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256_block(Sha256 *s, const unsigned char *p)
+{
+	int i;
+	u32 w[64], a, b, c, d, e, f, g, h, t1, t2;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (u32)p[i * 4] << 24 | (u32)p[i * 4 + 1] << 16
+		       | (u32)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+	for ( ; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7]
+		       + (ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18)
+			  ^ (w[i - 15] >> 3))
+		       + (ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19)
+			  ^ (w[i - 2] >> 10));
+
+	a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3];
+	e = s->h[4]; f = s->h[5]; g = s->h[6]; h = s->h[7];
+	for (i = 0; i < 64; i++) {
+		t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25))
+		     + ((e & f) ^ (~e & g)) + k256[i] + w[i];
+		t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22))
+		     + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+	s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+static void
+sha256_init(Sha256 *s)
+{
+	static const u32 h0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(s->h, h0, sizeof(h0));
+	s->len = 0;
+}
+
+static void
+sha256_update(Sha256 *s, const unsigned char *p, size_t n)
+{
+	while (n) {
+		size_t off = s->len % 64, k = min(64 - off, n);
+
+		memcpy(s->buf + off, p, k);
+		s->len += k;
+		p += k;
+		n -= k;
+		if (!(s->len % 64))
+			sha256_block(s, s->buf);
+	}
+}
+
+static void
+sha256_final(Sha256 *s, unsigned char *out)
+{
+	int i;
+	u64 bits = s->len * 8;
+	unsigned char pad[72] = { 0x80 };
+	size_t plen = (s->len % 64 < 56 ? 56 : 120) - s->len % 64;
+
+	for (i = 0; i < 8; i++)
+		pad[plen + i] = bits >> (56 - i * 8);
+	sha256_update(s, pad, plen + 8);
+	for (i = 0; i < 32; i++)
+		out[i] = s->h[i / 4] >> (24 - (i % 4) * 8);
+}
+
+static Sha256 *
+md_sha(TlsMdCtx *ctx)
+{
+	BUILD_BUG_ON(sizeof(Sha256) > sizeof(ctx->__ctx));
+	return (Sha256 *)ctx->__ctx;
+}
+
+static void
+hmac_pad_update(Sha256 *s, unsigned char pad)
+{
+	int i;
+	unsigned char b[64];
+
+	for (i = 0; i < 64; i++)
+		b[i] = s->key[i] ^ pad;
+	sha256_update(s, b, 64);
+}
+
+int
+ttls_md_setup(TlsMdCtx *ctx, const TlsMdInfo *md_info, int hmac)
+{
+	ctx->md_info = md_info;
+	memset(md_sha(ctx), 0, sizeof(Sha256));
+	md_sha(ctx)->hmac = hmac;
+	sha256_init(md_sha(ctx));
+
+	return 0;
+}
+
+int
+ttls_md_update(TlsMdCtx *ctx, const unsigned char *input, size_t ilen)
+{
+	sha256_update(md_sha(ctx), input, ilen);
+
+	return 0;
+}
+
+int
+ttls_md_finish(TlsMdCtx *ctx, unsigned char *output)
+{
+	Sha256 *s = md_sha(ctx);
+	unsigned char ih[32];
+
+	if (!s->hmac) {
+		sha256_final(s, output);
+		return 0;
+	}
+	sha256_final(s, ih);
+	sha256_init(s);
+	hmac_pad_update(s, 0x5c);
+	sha256_update(s, ih, sizeof(ih));
+	sha256_final(s, output);
+
+	return 0;
+}
+
+int
+ttls_md_hmac_reset(TlsMdCtx *ctx)
+{
+	sha256_init(md_sha(ctx));
+	hmac_pad_update(md_sha(ctx), 0x36);
+
+	return 0;
+}
+
+int
+ttls_md_hmac_starts(TlsMdCtx *ctx, const unsigned char *key, size_t keylen)
+{
+	Sha256 *s = md_sha(ctx);
+
+	memset(s->key, 0, sizeof(s->key));
+	if (keylen > sizeof(s->key)) {
+		sha256_init(s);
+		sha256_update(s, key, keylen);
+		sha256_final(s, s->key);
+	} else {
+		memcpy(s->key, key, keylen);
+	}
+
+	return ttls_md_hmac_reset(ctx);
+}
+
+int
+ttls_md(const TlsMdInfo *md_info, const unsigned char *input, size_t ilen,
+	unsigned char *output)
+{
+	Sha256 s;
+
+	sha256_init(&s);
+	sha256_update(&s, input, ilen);
+	sha256_final(&s, output);
+
+	return 0;
+}
+
+/* RFC 5869 A.1 - A.3, the SHA-256 cases. */
+static void
+test_hkdf_rfc5869(void)
+{
+	static const struct {
+		const char	*ikm;
+		size_t		ilen;
+		const char	*salt;
+		size_t		slen;
+		const char	*info;
+		size_t		nlen;
+		const char	*prk;
+		const char	*okm;
+		size_t		olen;
+	} v[] = {
+		{
+			"\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b"
+			"\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b", 22,
+			"\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c",
+			13,
+			"\xf0\xf1\xf2\xf3\xf4\xf5\xf6\xf7\xf8\xf9", 10,
+			"\x07\x77\x09\x36\x2c\x2e\x32\xdf\x0d\xdc\x3f\x0d\xc4"
+			"\x7b\xba\x63\x90\xb6\xc7\x3b\xb5\x0f\x9c\x31\x22\xec"
+			"\x84\x4a\xd7\xc2\xb3\xe5",
+			"\x3c\xb2\x5f\x25\xfa\xac\xd5\x7a\x90\x43\x4f\x64\xd0"
+			"\x36\x2f\x2a\x2d\x2d\x0a\x90\xcf\x1a\x5a\x4c\x5d\xb0"
+			"\x2d\x56\xec\xc4\xc5\xbf\x34\x00\x72\x08\xd5\xb8\x87"
+			"\x18\x58\x65", 42
+		},
+		{
+			"\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c"
+			"\x0d\x0e\x0f\x10\x11\x12\x13\x14\x15\x16\x17\x18\x19"
+			"\x1a\x1b\x1c\x1d\x1e\x1f\x20\x21\x22\x23\x24\x25\x26"
+			"\x27\x28\x29\x2a\x2b\x2c\x2d\x2e\x2f\x30\x31\x32\x33"
+			"\x34\x35\x36\x37\x38\x39\x3a\x3b\x3c\x3d\x3e\x3f\x40"
+			"\x41\x42\x43\x44\x45\x46\x47\x48\x49\x4a\x4b\x4c\x4d"
+			"\x4e\x4f", 80,
+			"\x60\x61\x62\x63\x64\x65\x66\x67\x68\x69\x6a\x6b\x6c"
+			"\x6d\x6e\x6f\x70\x71\x72\x73\x74\x75\x76\x77\x78\x79"
+			"\x7a\x7b\x7c\x7d\x7e\x7f\x80\x81\x82\x83\x84\x85\x86"
+			"\x87\x88\x89\x8a\x8b\x8c\x8d\x8e\x8f\x90\x91\x92\x93"
+			"\x94\x95\x96\x97\x98\x99\x9a\x9b\x9c\x9d\x9e\x9f\xa0"
+			"\xa1\xa2\xa3\xa4\xa5\xa6\xa7\xa8\xa9\xaa\xab\xac\xad"
+			"\xae\xaf", 80,
+			"\xb0\xb1\xb2\xb3\xb4\xb5\xb6\xb7\xb8\xb9\xba\xbb\xbc"
+			"\xbd\xbe\xbf\xc0\xc1\xc2\xc3\xc4\xc5\xc6\xc7\xc8\xc9"
+			"\xca\xcb\xcc\xcd\xce\xcf\xd0\xd1\xd2\xd3\xd4\xd5\xd6"
+			"\xd7\xd8\xd9\xda\xdb\xdc\xdd\xde\xdf\xe0\xe1\xe2\xe3"
+			"\xe4\xe5\xe6\xe7\xe8\xe9\xea\xeb\xec\xed\xee\xef\xf0"
+			"\xf1\xf2\xf3\xf4\xf5\xf6\xf7\xf8\xf9\xfa\xfb\xfc\xfd"
+			"\xfe\xff", 80,
+			"\x06\xa6\xb8\x8c\x58\x53\x36\x1a\x06\x10\x4c\x9c\xeb"
+			"\x35\xb4\x5c\xef\x76\x00\x14\x90\x46\x71\x01\x4a\x19"
+			"\x3f\x40\xc1\x5f\xc2\x44",
+			"\xb1\x1e\x39\x8d\xc8\x03\x27\xa1\xc8\xe7\xf7\x8c\x59"
+			"\x6a\x49\x34\x4f\x01\x2e\xda\x2d\x4e\xfa\xd8\xa0\x50"
+			"\xcc\x4c\x19\xaf\xa9\x7c\x59\x04\x5a\x99\xca\xc7\x82"
+			"\x72\x71\xcb\x41\xc6\x5e\x59\x0e\x09\xda\x32\x75\x60"
+			"\x0c\x2f\x09\xb8\x36\x77\x93\xa9\xac\xa3\xdb\x71\xcc"
+			"\x30\xc5\x81\x79\xec\x3e\x87\xc1\x4c\x01\xd5\xc1\xf3"
+			"\x43\x4f\x1d\x87", 82
+		},
+		{
+			"\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b"
+			"\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b", 22,
+			"", 0,
+			"", 0,
+			"\x19\xef\x24\xa3\x2c\x71\x7b\x16\x7f\x33\xa9\x1d\x6f"
+			"\x64\x8b\xdf\x96\x59\x67\x76\xaf\xdb\x63\x77\xac\x43"
+			"\x4c\x1c\x29\x3c\xcb\x04",
+			"\x8d\xa4\xe7\x75\xa5\x63\xc1\x8f\x71\x5f\x80\x2a\x06"
+			"\x3c\x5a\x31\xb8\xa1\x1f\x5c\x5e\xe1\x87\x9e\xc3\x45"
+			"\x4e\x5f\x3c\x73\x8d\x2d\x9d\x20\x13\x95\xfa\xa4\xb6"
+			"\x1a\x96\xc8", 42
+		},
+	};
+	int i;
+	unsigned char prk[32], okm[82];
+	const TlsMdInfo *md = ttls_md_info_from_type(TTLS_MD_SHA256);
+
+	for (i = 0; i < ARRAY_SIZE(v); i++) {
+		EXPECT_ZERO(ttls_hkdf_extract(md, v[i].salt, v[i].slen,
+					      v[i].ikm, v[i].ilen, prk));
+		EXPECT_ZERO(memcmp(prk, v[i].prk, sizeof(prk)));
+		EXPECT_ZERO(ttls_hkdf_expand(md, prk, sizeof(prk), v[i].info,
+					     v[i].nlen, okm, v[i].olen));
+		EXPECT_ZERO(memcmp(okm, v[i].okm, v[i].olen));
+	}
+
+	/* The output can't be longer than 255 hash lengths. */
+	EXPECT_EQ(ttls_hkdf_expand(md, prk, sizeof(prk), NULL, 0, okm,
+				   255 * 32 + 1), TTLS_ERR_BAD_INPUT_DATA);
+}
+
+/* RFC 8448 3, the simple 1-RTT handshake with TLS_AES_128_GCM_SHA256. */
+static void
+test_tls13_key_schedule(void)
+{
+	static const unsigned char early[] =
+		"\x33\xad\x0a\x1c\x60\x7e\xc0\x3b\x09\xe6\xcd\x98\x93\x68\x0c"
+		"\xe2\x10\xad\xf3\x00\xaa\x1f\x26\x60\xe1\xb2\x2e\x10\xf1\x70"
+		"\xf9\x2a";
+	static const unsigned char ecdhe[] =
+		"\x8b\xd4\x05\x4f\xb5\x5b\x9d\x63\xfd\xfb\xac\xf9\xf0\x4b\x9f"
+		"\x0d\x35\xe6\xd6\x3f\x53\x75\x63\xef\xd4\x62\x72\x90\x0f\x89"
+		"\x49\x2d";
+	static const unsigned char hs[] =
+		"\x1d\xc8\x26\xe9\x36\x06\xaa\x6f\xdc\x0a\xad\xc1\x2f\x74\x1b"
+		"\x01\x04\x6a\xa6\xb9\x9f\x69\x1e\xd2\x21\xa9\xf0\xca\x04\x3f"
+		"\xbe\xac";
+	/* Transcript hash of ClientHello and ServerHello. */
+	static const unsigned char th[] =
+		"\x86\x0c\x06\xed\xc0\x78\x58\xee\x8e\x78\xf0\xe7\x42\x8c\x58"
+		"\xed\xd6\xb4\x3f\x2c\xa3\xe6\xe9\x5f\x02\xed\x06\x3c\xf0\xe1"
+		"\xca\xd8";
+	static const unsigned char c_hs[] =
+		"\xb3\xed\xdb\x12\x6e\x06\x7f\x35\xa7\x80\xb3\xab\xf4\x5e\x2d"
+		"\x8f\x3b\x1a\x95\x07\x38\xf5\x2e\x96\x00\x74\x6a\x0e\x27\xa5"
+		"\x5a\x21";
+	static const unsigned char s_hs[] =
+		"\xb6\x7b\x7d\x69\x0c\xc1\x6c\x4e\x75\xe5\x42\x13\xcb\x2d\x37"
+		"\xb4\xe9\xc9\x12\xbc\xde\xd9\x10\x5d\x42\xbe\xfd\x59\xd3\x91"
+		"\xad\x38";
+	static const unsigned char master[] =
+		"\x18\xdf\x06\x84\x3d\x13\xa0\x8b\xf2\xa4\x49\x84\x4c\x5f\x8a"
+		"\x47\x80\x01\xbc\x4d\x4c\x62\x79\x84\xd5\xa4\x1d\xa8\xd0\x40"
+		"\x29\x19";
+	static const unsigned char s_key[] =
+		"\x3f\xce\x51\x60\x09\xc2\x17\x27\xd0\xf2\xe4\xe8\x6e\xe4\x03"
+		"\xbc";
+	static const unsigned char s_iv[] =
+		"\x5d\x31\x3e\xb2\x67\x12\x76\xee\x13\x00\x0b\x30";
+	unsigned char out[32], key[16], iv[12];
+	const TlsMdInfo *md = ttls_md_info_from_type(TTLS_MD_SHA256);
+
+	/* No PSK. */
+	EXPECT_ZERO(ttls_tls13_next_secret(md, NULL, NULL, 0, out));
+	EXPECT_ZERO(memcmp(out, early, sizeof(out)));
+
+	EXPECT_ZERO(ttls_tls13_next_secret(md, early, ecdhe, 32, out));
+	EXPECT_ZERO(memcmp(out, hs, sizeof(out)));
+
+	EXPECT_ZERO(ttls_tls13_derive_secret(md, hs, "c hs traffic", 12, th,
+					     out));
+	EXPECT_ZERO(memcmp(out, c_hs, sizeof(out)));
+	EXPECT_ZERO(ttls_tls13_derive_secret(md, hs, "s hs traffic", 12, th,
+					     out));
+	EXPECT_ZERO(memcmp(out, s_hs, sizeof(out)));
+
+	EXPECT_ZERO(ttls_tls13_traffic_keys(md, s_hs, key, sizeof(key), iv,
+					    sizeof(iv)));
+	EXPECT_ZERO(memcmp(key, s_key, sizeof(key)));
+	EXPECT_ZERO(memcmp(iv, s_iv, sizeof(iv)));
+
+	EXPECT_ZERO(ttls_tls13_next_secret(md, hs, NULL, 0, out));
+	EXPECT_ZERO(memcmp(out, master, sizeof(out)));
+}
+
+int
+main(int argc, char *argv[])
+{
+	test_hkdf_rfc5869();
+	test_tls13_key_schedule();
+
+	printf("success\n");
+
+	return 0;
+}
@@ -630,6 +630,84 @@ mont_basic(void)
 	EXPECT_EQ(r[3], 0xd7aac08c0475fb7dUL);
 }
 
+/* Reference word-serial Montgomery multiplication, HAC 14.36. */
+static void
+__mont_mul_ref(unsigned long *t, const unsigned long *a,
+	       const unsigned long *b, size_t m, const unsigned long *n,
+	       size_t len, unsigned long mm)
+{
+	size_t i, j;
+
+	memset(t, 0, (len + 2) * CIL);
+	for (i = 0; i < len; ++i) {
+		unsigned __int128 c = 0;
+		unsigned long u;
+
+		for (j = 0; j < m; ++j) {
+			c += (unsigned __int128)a[i] * b[j] + t[j];
+			t[j] = (unsigned long)c;
+			c >>= 64;
+		}
+		for ( ; j < len + 2; ++j) {
+			c += t[j];
+			t[j] = (unsigned long)c;
+			c >>= 64;
+		}
+
+		u = t[0] * mm;
+		c = 0;
+		for (j = 0; j < len; ++j) {
+			c += (unsigned __int128)u * n[j] + t[j];
+			t[j] = (unsigned long)c;
+			c >>= 64;
+		}
+		for ( ; j < len + 2; ++j) {
+			c += t[j];
+			t[j] = (unsigned long)c;
+			c >>= 64;
+		}
+
+		memmove(t, t + 1, (len + 1) * CIL);
+		t[len + 1] = 0;
+	}
+}
+
+static void
+mont_mul_generic(void)
+{
+	static const size_t sizes[] = {1, 3, 4, 16, 24, 32, 48, 64};
+	unsigned long a[64], b[64], n[64], t[64 * 2 + 1], r[64 + 2];
+	int i, k;
+
+	for (i = 0; i < ARRAY_SIZE(sizes); ++i) {
+		size_t len = sizes[i], m;
+		unsigned long mm, x;
+
+		for (k = 0; k < 16; ++k) {
+			get_random_bytes(n, len * CIL);
+			get_random_bytes(a, len * CIL);
+			get_random_bytes(b, len * CIL);
+			n[0] |= 1;
+			n[len - 1] |= 1UL << 63;
+			a[len - 1] >>= 1;
+			b[len - 1] >>= 1;
+
+			/* mm = -N^-1 mod 2^64 */
+			for (x = n[0], m = 0; m < 6; ++m)
+				x *= 2 - n[0] * x;
+			mm = -x;
+
+			/* The second half of the tests uses a short B. */
+			m = k < 8 ? len : len / 2 + 1;
+
+			memset(t, 0, sizeof(t));
+			mpi_mont_mul_x86_64(t, a, b, m, n, len, mm);
+			__mont_mul_ref(r, a, b, m, n, len, mm);
+			EXPECT_ZERO(memcmp(t + len, r, (len + 1) * CIL));
+		}
+	}
+}
+
 static void
 ecp_mod256(void)
 {
@@ -1048,6 +1126,7 @@ main(int argc, char *argv[])
 	mpi_shift();
 	mpi_elementary();
 	mont_basic();
+	mont_mul_generic();
 	ecp_mod256();
 	ecp_sub_mod256();
 	ecp_add_mod256();
@@ -0,0 +1,134 @@
+/**
+ *		Tempesta TLS
+ *
+ * Precomputation of the static table for m * B in Ed25519, which is used
+ * for the fixed-base multiplication in Curve25519.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include "ttls_mocks.h"
+#include "../bignum.c"
+#include "../ciphersuites.c"
+#include "../dhm.c" /* mpool.c requires DHM routines. */
+#include "../ec_25519.c"
+#include "../ecp.c"
+#include "../mpool.c"
+
+/* Mock irrelevant groups. */
+const TlsEcpGrp SECP256_G = {};
+
+/* The base point B = (x, 4/5) of Ed25519. */
+static const unsigned long B_x[G_LIMBS] = {
+	0xc9562d608f25d51aUL, 0x692cc7609525a7b2UL,
+	0xc0a4e231fdd6dc5cUL, 0x216936d3cd6e53feUL
+};
+static const unsigned long B_y[G_LIMBS] = {
+	0x6666666666666658UL, 0x6666666666666666UL,
+	0x6666666666666666UL, 0x6666666666666666UL
+};
+/* 2 * d, where d = -121665 / 121666. */
+static const unsigned long D2[G_LIMBS] = {
+	0xebd69b9426b2f159UL, 0x00e0149a8283b156UL,
+	0x198e80f2eef3d130UL, 0x2406d9dc56dffce7UL
+};
+
+/* Fully reduce a field element, so the table has canonical values. */
+static void
+tgen25519_reduce(Fe25519 h)
+{
+	unsigned long s[G_LIMBS];
+
+	fe_to_limbs(s, h);
+	fe_from_limbs(h, s);
+}
+
+/**
+ * Convert the extended point @p to the affine precomputed form.
+ */
+static void
+tgen25519_to_pre(Ge25519Pre *r, const Ge25519 *p)
+{
+	Fe25519 zi, x, y, d2;
+
+	fe_inv(zi, p->Z);
+	fe_mul(x, p->X, zi);
+	fe_mul(y, p->Y, zi);
+	fe_from_limbs(d2, D2);
+
+	fe_add(r->yplusx, y, x);
+	fe_sub(r->yminusx, y, x);
+	fe_mul(r->xy2d, x, y);
+	fe_mul(r->xy2d, r->xy2d, d2);
+
+	tgen25519_reduce(r->yplusx);
+	tgen25519_reduce(r->yminusx);
+	tgen25519_reduce(r->xy2d);
+}
+
+static void
+print_fe(const Fe25519 h, const char *sfx)
+{
+	printf("\t   {%#15lxUL, %#15lxUL, %#15lxUL,\n", h[0], h[1], h[2]);
+	printf("\t    %#15lxUL, %#15lxUL}%s\n", h[3], h[4], sfx);
+}
+
+/**
+ * Print the table of (j + 1) * 256^tid * B, j = 0..GE_W_SZ-1, where @P is
+ * 256^tid * B.
+ */
+static void
+print_T(const Ge25519 *P, int tid)
+{
+	Ge25519Pre p, t;
+	Ge25519 Q = *P;
+	int j;
+
+	tgen25519_to_pre(&p, P);
+
+	printf("\t{ /*    Table %d    */\n", tid);
+	for (j = 0; j < GE_W_SZ; ++j) {
+		tgen25519_to_pre(&t, &Q);
+		printf("\t  {\n");
+		print_fe(t.yplusx, ",");
+		print_fe(t.yminusx, ",");
+		print_fe(t.xy2d, "");
+		printf("\t  }%s\n", j < GE_W_SZ - 1 ? "," : "");
+		/* The twisted Edwards addition is complete, also for Q == P. */
+		ge_madd(&Q, &Q, &p);
+	}
+	printf("\t}%s\n", tid == GE_D - 1 ? "" : ",");
+}
+
+int
+main(int argc, char *argv[])
+{
+	Ge25519 P;
+	int i, j;
+
+	fe_from_limbs(P.X, B_x);
+	fe_from_limbs(P.Y, B_y);
+	fe_1(P.Z);
+	fe_mul(P.T, P.X, P.Y);
+
+	for (i = 0; i < GE_D; ++i) {
+		print_T(&P, i);
+		for (j = 0; j < 8; ++j)
+			ge_dbl(&P, &P);
+	}
+
+	return 0;
+}
@@ -21,20 +21,21 @@
 #include "ttls_mocks.h"
 
 /*
- * md_* mocks are required for RSA tests.
+ * md_* mocks are required for RSA tests. The mocks are weak, so a test can
+ * provide real digests.
  */
 
-void
+void __attribute__((weak))
 ttls_md_init(TlsMdCtx *ctx)
 {
 }
 
-void
+void __attribute__((weak))
 ttls_md_free(TlsMdCtx *ctx)
 {
 }
 
-int
+int __attribute__((weak))
 ttls_md_finish(TlsMdCtx *ctx, unsigned char *output)
 {
 	switch (ctx->md_info->type) {
@@ -53,14 +54,14 @@ ttls_md_finish(TlsMdCtx *ctx, unsigned char *output)
 	return 0;
 }
 
-int
+int __attribute__((weak))
 ttls_md(const TlsMdInfo *md_info, const unsigned char *input,
 		   size_t ilen, unsigned char *output)
 {
 	return 0;
 }
 
-int
+int __attribute__((weak))
 ttls_md_setup(TlsMdCtx *ctx, const TlsMdInfo *md_info, int hmac)
 {
 	return 0;
@@ -79,13 +80,13 @@ ttls_md_info_from_type(ttls_md_type_t md_type)
 	return &md_info;
 }
 
-int
+int __attribute__((weak))
 ttls_md_starts(TlsMdCtx *ctx)
 {
 	return 0;
 }
 
-int
+int __attribute__((weak))
 ttls_md_update(TlsMdCtx *ctx, const unsigned char *input, size_t ilen)
 {
 	return 0;
@@ -22,7 +22,18 @@
  * with this program; if not, write to the Free Software Foundation, Inc.,
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
-#if 0 /* TODO #769 Full TLS proxying */
+/*
+ * TODO #769 Full TLS proxying. The code below is not ported from mbed TLS to
+ * the Tempesta TLS record and handshake processing yet, so server connections
+ * are plain TCP. Upstream TLS also requires:
+ * - a TLS context and the TLS FSM for server connections in sock_srv.c;
+ * - per-server storage of the last session ID and session ticket, so
+ *   reconnects from tfw_sock_srv_connect_try() resume the session instead of
+ *   a full handshake;
+ * - per-server cache of the certificate chain verification result, keyed by
+ *   a hash of the chain sent by the server.
+ */
+#if 0
 
 #include "debug.h"
 #include "ttls.h"
@@ -115,6 +115,8 @@ typedef struct {
  * @new_session_ticket - use NewSessionTicket?
  * @resume	- session resume indicator;
  * @cli_exts	- client extension presence;
+ * @status_req	- client requested OCSP stapling (RFC 6066 8) and we have
+ *		  a response for it;
  * @pmslen	- premaster length;
  * @key_cert	- chosen key/cert pair (server);
  * @fin_sha{256,512} - checksum contexts;
@@ -140,7 +142,8 @@ struct tls_handshake_t {
 					resume			: 1,
 					cli_exts		: 1,
 					curves_ext		: 1,
-					secure_renegotiation	: 1;
+					secure_renegotiation	: 1,
+					status_req		: 1;
 
 	size_t				pmslen;
 	TlsKeyCert			*key_cert;
@@ -214,6 +217,28 @@ void ttls_handshake_wrapup(TlsCtx *tls);
 
 int ttls_derive_keys(TlsCtx *tls);
 
+int ttls_hkdf_extract(const TlsMdInfo *md_info, const unsigned char *salt,
+		      size_t slen, const unsigned char *ikm, size_t ilen,
+		      unsigned char *prk);
+int ttls_hkdf_expand(const TlsMdInfo *md_info, const unsigned char *prk,
+		     size_t plen, const unsigned char *info, size_t ilen,
+		     unsigned char *okm, size_t olen);
+int ttls_hkdf_expand_label(const TlsMdInfo *md_info,
+			   const unsigned char *secret, const char *label,
+			   size_t llen, const unsigned char *ctx, size_t clen,
+			   unsigned char *out, size_t olen);
+int ttls_tls13_derive_secret(const TlsMdInfo *md_info,
+			     const unsigned char *secret, const char *label,
+			     size_t llen, const unsigned char *thash,
+			     unsigned char *out);
+int ttls_tls13_next_secret(const TlsMdInfo *md_info,
+			   const unsigned char *secret,
+			   const unsigned char *ikm, size_t ilen,
+			   unsigned char *out);
+int ttls_tls13_traffic_keys(const TlsMdInfo *md_info,
+			    const unsigned char *secret, unsigned char *key,
+			    size_t klen, unsigned char *iv, size_t ivlen);
+
 void __ttls_add_record(TlsCtx *tls, struct sg_table *sgt, int sg_i,
 		       unsigned char *hdr_buf);
 int __ttls_send_record(TlsCtx *tls, struct sg_table *sgt);
@@ -247,15 +272,19 @@ int ttls_check_sig_hash(const TlsCtx *tls, ttls_md_type_t md);
 int ttls_match_sig_hashes(const TlsCtx *tls);
 void ttls_update_checksum(TlsCtx *tls, const unsigned char *buf, size_t len);
 
+static inline TlsKeyCert *
+ttls_own_key_cert(TlsCtx *tls)
+{
+	if (tls->hs && tls->hs->key_cert)
+		return tls->hs->key_cert;
+
+	return tls->peer_conf ? tls->peer_conf->key_cert : NULL;
+}
+
 static inline TlsX509Crt *
 ttls_own_cert(TlsCtx *tls)
 {
-	TlsKeyCert *key_cert;
-
-	if (tls->hs && tls->hs->key_cert)
-		key_cert = tls->hs->key_cert;
-	else
-		key_cert = tls->peer_conf ? tls->peer_conf->key_cert : NULL;
+	TlsKeyCert *key_cert = ttls_own_key_cert(tls);
 
 	return key_cert ? key_cert->cert : NULL;
 }
@@ -39,6 +39,8 @@
 
 ttls_sni_cb_t *ttls_sni_cb;
 ttls_hs_over_cb_t *ttls_hs_over_cb;
+ttls_sess_get_cb_t *ttls_sess_get_cb;
+ttls_sess_put_cb_t *ttls_sess_put_cb;
 
 /**
  * TLS Fallback Signaling Cipher Suite Value (SCSV), RFC 7507 3.
@@ -265,6 +267,28 @@ ttls_parse_extended_ms_ext(TlsCtx *tls, const unsigned char *buf, size_t len)
 	return 0;
 }
 
+/**
+ * We staple the OCSP response regardless of the responders and extensions
+ * listed by the client, just like the other servers do. Other status types
+ * are ignored.
+ */
+static int
+ttls_parse_status_request_ext(TlsCtx *tls, const unsigned char *buf,
+			      size_t len)
+{
+	if (len < 5) {
+		T_DBG("ClientHello: bad status request extension\n");
+		ttls_send_alert(tls, TTLS_ALERT_LEVEL_FATAL,
+				TTLS_ALERT_MSG_DECODE_ERROR);
+		return TTLS_ERR_BAD_HS_CLIENT_HELLO;
+	}
+
+	if (buf[0] == TTLS_CERT_STATUS_OCSP)
+		tls->hs->status_req = 1;
+
+	return 0;
+}
+
 static int
 ttls_parse_session_ticket_ext(TlsCtx *tls, unsigned char *buf, size_t len)
 {
@@ -339,6 +363,37 @@ ttls_process_session_ticket(TlsCtx *tls)
 	return 0;
 }
 
+/**
+ * Try to resume the session by the session ID sent by the client, if it
+ * didn't send a valid ticket. The cached session is used only if it was
+ * established with the same ciphersuite as we've chosen for the client,
+ * otherwise a full handshake is made.
+ */
+static void
+ttls_sess_cache_lookup(TlsCtx *tls)
+{
+	TlsSess sess;
+
+	if (!ttls_sess_get_cb || tls->hs->resume
+	    || tls->sess.id_len != TTLS_SESS_ID_LEN)
+		return;
+	if (ttls_sess_get_cb(tls, &sess))
+		return;
+
+	if (sess.ciphersuite != tls->sess.ciphersuite) {
+		T_DBG("ClientHello: cached session has other ciphersuite\n");
+	} else {
+		T_DBG("ClientHello: session restored from the cache\n");
+		tls->sess.start = sess.start;
+		tls->sess.etm = sess.etm;
+		memcpy_fast(tls->sess.master, sess.master,
+			    sizeof(tls->sess.master));
+		tls->hs->resume = 1;
+		tls->hs->new_session_ticket = 0;
+	}
+	bzero_fast(&sess, sizeof(sess));
+}
+
 static int
 ttls_parse_alpn_ext(TlsCtx *tls, const unsigned char *buf, size_t len)
 {
@@ -999,6 +1054,11 @@ bad_version:
 			if (ttls_parse_extended_ms_ext(tls, tmp, ext_sz))
 				return TTLS_ERR_BAD_HS_CLIENT_HELLO;
 			break;
+		case TTLS_TLS_EXT_STATUS_REQUEST:
+			T_DBG("found status request extension\n");
+			if (ttls_parse_status_request_ext(tls, tmp, ext_sz))
+				return TTLS_ERR_BAD_HS_CLIENT_HELLO;
+			break;
 		case TTLS_TLS_EXT_SESSION_TICKET:
 			T_DBG("found session ticket extension\n");
 			if (ttls_parse_session_ticket_ext(tls, tmp, ext_sz))
@@ -1078,6 +1138,8 @@ bad_version:
 	if (r)
 		return r;
 
+	ttls_sess_cache_lookup(tls);
+
 	ttls_update_checksum(tls, buf - hh_len, p - buf + hh_len);
 
 	return 0;
@@ -1144,6 +1206,34 @@ ttls_write_session_ticket_ext(TlsCtx *tls, unsigned char *p, size_t *olen)
 	*olen = 4;
 }
 
+/**
+ * The extension is acknowledged only if we have a response to staple. The
+ * response is read again in ttls_write_certificate_status() and may
+ * disappear in between, RFC 6066 8 allows not to send it anyway.
+ */
+static void
+ttls_write_status_request_ext(TlsCtx *tls, unsigned char *p, size_t *olen)
+{
+	const TlsKeyCert *kc = ttls_own_key_cert(tls);
+
+	if (!tls->hs->status_req || tls->hs->resume || !kc
+	    || !rcu_access_pointer(kc->ocsp))
+	{
+		tls->hs->status_req = 0;
+		*olen = 0;
+		return;
+	}
+
+	T_DBG("ServerHello: adding status request extension\n");
+
+	*(unsigned short *)p = htons(TTLS_TLS_EXT_STATUS_REQUEST);
+	p += 2;
+	*p++ = 0x00;
+	*p++ = 0x00;
+
+	*olen = 4;
+}
+
 static void
 ttls_write_supported_point_formats_ext(TlsCtx *tls, unsigned char *p,
 				       size_t *olen)
@@ -1290,6 +1380,8 @@ ttls_write_server_hello(TlsCtx *tls, struct sg_table *sgt,
 	ext_len += olen;
 	ttls_write_session_ticket_ext(tls, p + 2 + ext_len, &olen);
 	ext_len += olen;
+	ttls_write_status_request_ext(tls, p + 2 + ext_len, &olen);
+	ext_len += olen;
 	ttls_write_supported_point_formats_ext(tls, p + 2 + ext_len, &olen);
 	ext_len += olen;
 	ttls_write_alpn_ext(tls, p + 2 + ext_len, &olen);
@@ -1636,6 +1728,52 @@ ttls_write_certificate_request(TlsCtx *tls, struct sg_table *sgt,
 	return 0;
 }
 
+/**
+ * Write CertificateStatus message with the stapled OCSP response right after
+ * the Certificate message, RFC 6066 8. The response is referenced as is.
+ */
+static int
+ttls_write_certificate_status(TlsCtx *tls, struct sg_table *sgt,
+			      unsigned char **in_buf)
+{
+	const TlsKeyCert *kc;
+	const TlsOcsp *ocsp;
+	TlsIOCtx *io = &tls->io_out;
+	unsigned char *p = *in_buf;
+	int sg_i;
+
+	if (!tls->hs->status_req)
+		return 0;
+
+	rcu_read_lock();
+
+	kc = ttls_own_key_cert(tls);
+	if (!(ocsp = rcu_dereference(kc->ocsp))) {
+		rcu_read_unlock();
+		T_DBG("OCSP response has gone, don't staple it\n");
+		return 0;
+	}
+
+	T_DBG("sending CertificateStatus, %u bytes\n", ocsp->len);
+
+	sg_i = sgt->nents++;
+	sg_set_buf(&sgt->sgl[sg_i], p, TLS_HEADER_SIZE + TTLS_HS_HDR_LEN);
+	get_page(virt_to_page(p));
+	sg_set_buf(&sgt->sgl[sgt->nents++], ocsp->data, ocsp->len);
+	get_page(virt_to_page(ocsp->data));
+
+	io->msglen = TTLS_HS_HDR_LEN + ocsp->len;
+	ttls_write_hshdr(TTLS_HS_CERTIFICATE_STATUS, p + TLS_HEADER_SIZE,
+			 io->msglen);
+
+	rcu_read_unlock();
+
+	__ttls_add_record(tls, sgt, sg_i, p);
+	*in_buf = p + TLS_HEADER_SIZE + TTLS_HS_HDR_LEN;
+
+	return 0;
+}
+
 static int
 ttls_write_server_hello_done(TlsCtx *tls, struct sg_table *sgt,
 			     unsigned char **in_buf)
@@ -1980,6 +2118,8 @@ ttls_handshake_server_hello(TlsCtx *tls, struct sg_table *sgt,
 	T_FSM_STATE(TTLS_SERVER_CERTIFICATE) {
 		if ((r = ttls_write_certificate(tls, sgt, in_buf)))
 			T_FSM_EXIT();
+		if ((r = ttls_write_certificate_status(tls, sgt, in_buf)))
+			T_FSM_EXIT();
 		CHECK_STATE(128);
 		T_FSM_JMP(TTLS_SERVER_KEY_EXCHANGE);
 	}
@@ -2234,6 +2374,9 @@ ttls_handshake_server_step(TlsCtx *tls, unsigned char *buf, size_t len,
 
 	T_FSM_STATE(TTLS_HANDSHAKE_WRAPUP) {
 		resumed = tls->hs->resume;
+		if (!resumed && ttls_sess_put_cb
+		    && tls->sess.id_len == TTLS_SESS_ID_LEN)
+			ttls_sess_put_cb(tls);
 		ttls_handshake_wrapup(tls);
 		tls->state = TTLS_HANDSHAKE_OVER;
 		fallthrough;
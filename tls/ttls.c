@@ -48,10 +48,14 @@ MODULE_LICENSE("GPL");
 static DEFINE_PER_CPU(struct aead_request *, g_req) ____cacheline_aligned;
 
 static struct kmem_cache *ttls_hs_cache = NULL;
+/* Number of TLS contexts with handshake in progress. */
+static DEFINE_PER_CPU(long, ttls_hs_active);
 static ttls_send_cb_t *ttls_send_cb;
 extern ttls_sni_cb_t *ttls_sni_cb;
 extern ttls_hs_over_cb_t *ttls_hs_over_cb;
 extern ttls_cli_id_t *ttls_cli_id_cb;
+extern ttls_sess_get_cb_t *ttls_sess_get_cb;
+extern ttls_sess_put_cb_t *ttls_sess_put_cb;
 
 static inline size_t
 ttls_max_ciphertext_len(const TlsXfrm *xfrm)
@@ -245,6 +249,18 @@ ttls_register_callbacks(ttls_send_cb_t *send_cb, ttls_sni_cb_t *sni_cb,
 }
 EXPORT_SYMBOL(ttls_register_callbacks);
 
+/**
+ * The session cache is optional, session tickets are used without it.
+ */
+void
+ttls_register_sess_cache_cb(ttls_sess_get_cb_t *get_cb,
+			    ttls_sess_put_cb_t *put_cb)
+{
+	ttls_sess_get_cb = get_cb;
+	ttls_sess_put_cb = put_cb;
+}
+EXPORT_SYMBOL(ttls_register_sess_cache_cb);
+
 /**
  * Returns true if handshake is fully processed.
  */
@@ -561,7 +577,7 @@ ttls_derive_keys(TlsCtx *tls)
 {
 	unsigned char keyblk[256] ____cacheline_aligned;
 	unsigned char tmp[32];
-	unsigned char *key1, *key2, *mac_enc, *mac_dec;
+	unsigned char *key1, *key2;
 	const TlsCipherInfo *ci;
 	const TlsMdInfo *md_info;
 	size_t mac_key_len, iv_copy_len;
@@ -661,15 +677,9 @@ ttls_derive_keys(TlsCtx *tls)
 	} else {
 		BUG_ON(ci->mode != TTLS_MODE_STREAM);
 		/*
-		 * TODO #1031: Initialize HMAC contexts - do we need this for
-		 * CHACHA20_POLY1305?
+		 * TODO #1031: CHACHA20_POLY1305 is AEAD as well, so no HMAC
+		 * contexts are kept in the transform.
 		 */
-		if ((r = ttls_md_setup(&xfrm->md_ctx_enc, md_info, 1))
-		    || (r = ttls_md_setup(&xfrm->md_ctx_dec, md_info, 1)))
-		{
-			return r;
-		}
-
 		/* Get MAC length */
 		mac_key_len = ttls_md_get_size(md_info);
 		xfrm->maclen = mac_key_len;
@@ -688,8 +698,6 @@ ttls_derive_keys(TlsCtx *tls)
 	if (tls->conf->endpoint == TTLS_IS_CLIENT) {
 		key1 = keyblk + mac_key_len * 2;
 		key2 = keyblk + mac_key_len * 2 + xfrm->keylen;
-		mac_enc = keyblk;
-		mac_dec = keyblk + mac_key_len;
 		iv_copy_len = xfrm->fixed_ivlen ? : xfrm->ivlen;
 		memcpy_fast(xfrm->iv_enc, key2 + xfrm->keylen, iv_copy_len);
 		memcpy_fast(xfrm->iv_dec, key2 + xfrm->keylen + iv_copy_len,
@@ -697,8 +705,6 @@ ttls_derive_keys(TlsCtx *tls)
 	} else {
 		key1 = keyblk + mac_key_len * 2 + xfrm->keylen;
 		key2 = keyblk + mac_key_len * 2;
-		mac_enc = keyblk + mac_key_len;
-		mac_dec = keyblk;
 		iv_copy_len = xfrm->fixed_ivlen ? : xfrm->ivlen;
 		memcpy_fast(xfrm->iv_dec, key1 + xfrm->keylen, iv_copy_len);
 		memcpy_fast(xfrm->iv_enc, key1 + xfrm->keylen + iv_copy_len,
@@ -709,11 +715,6 @@ ttls_derive_keys(TlsCtx *tls)
 	T_DBG3_BUF("derive keys: IV_dec fixed", xfrm->iv_dec, iv_copy_len);
 	T_DBG3_BUF("derive keys: key_dec", key2, ci->key_len);
 
-	if (mac_key_len) {
-		ttls_md_hmac_starts(&xfrm->md_ctx_enc, mac_enc, mac_key_len);
-		ttls_md_hmac_starts(&xfrm->md_ctx_dec, mac_dec, mac_key_len);
-	}
-
 	if ((r = ttls_cipher_setup(&xfrm->cipher_ctx_enc, ci, TTLS_TAG_LEN))) {
 		T_DBG("cannot setup encryption cipher, %d\n", r);
 		return r;
@@ -723,13 +724,13 @@ ttls_derive_keys(TlsCtx *tls)
 		return r;
 	}
 
-	r = crypto_aead_setkey(xfrm->cipher_ctx_enc.cipher_ctx, key1, ci->key_len);
+	r = ttls_cipher_setkey(&xfrm->cipher_ctx_enc, key1, ci->key_len);
 	if (r) {
 		T_DBG("cannot set encryption key, %d\n", r);
 		return r;
 	}
 
-	r = crypto_aead_setkey(xfrm->cipher_ctx_dec.cipher_ctx, key2, ci->key_len);
+	r = ttls_cipher_setkey(&xfrm->cipher_ctx_dec, key2, ci->key_len);
 	if (r) {
 		T_DBG("cannot set decryption key, %d\n", r);
 		return r;
@@ -787,6 +788,164 @@ ttls_aead_req_free(struct crypto_aead *tfm, struct aead_request *req)
 		bzero_fast(req, ttls_aead_reqsize());
 }
 
+#ifdef VAES
+/**
+ * Encrypt @len bytes following the AAD at the beginning of @sg to @out_sg with
+ * AES-GCM without the crypto API and write the tag after the ciphertext.
+ * The scatterlists are walked directly, so the segments may be of any length
+ * and don't need to match each other.
+ */
+static void
+ttls_encrypt_gcm(const TlsAesGcmKey *key, const unsigned char *iv,
+		 struct scatterlist *sg, struct scatterlist *out_sg,
+		 unsigned int len)
+{
+	unsigned int s_off = TLS_AAD_SPACE_SIZE, d_off = TLS_AAD_SPACE_SIZE;
+	unsigned int n;
+	unsigned char tag[TTLS_TAG_LEN];
+	TlsAesGcm st;
+
+	ttls_aes_gcm_start(&st, key, iv, sg_virt(out_sg), TLS_AAD_SPACE_SIZE,
+			   true);
+
+	while (len) {
+		for ( ; s_off >= sg->length; sg = sg_next(sg))
+			s_off -= sg->length;
+		for ( ; d_off >= out_sg->length; out_sg = sg_next(out_sg))
+			d_off -= out_sg->length;
+		n = min3(len, sg->length - s_off, out_sg->length - d_off);
+		ttls_aes_gcm_update(&st, sg_virt(sg) + s_off,
+				    sg_virt(out_sg) + d_off, n);
+		s_off += n;
+		d_off += n;
+		len -= n;
+	}
+
+	ttls_aes_gcm_finish(&st, tag);
+
+	for (len = 0; len < TTLS_TAG_LEN; len += n) {
+		for ( ; d_off >= out_sg->length; out_sg = sg_next(out_sg))
+			d_off -= out_sg->length;
+		n = min(TTLS_TAG_LEN - len, out_sg->length - d_off);
+		memcpy_fast(sg_virt(out_sg) + d_off, tag + len, n);
+		d_off += n;
+	}
+}
+
+/**
+ * Decrypt in place (@st != NULL) or copy to @to @len bytes of @skb and its
+ * fragments starting from offset @off. Returns the number of processed bytes.
+ */
+static unsigned int
+ttls_skb_gcm(TlsAesGcm *st, unsigned char *to, struct sk_buff *skb,
+	     unsigned int off, unsigned int len)
+{
+	int i;
+	unsigned int n, done = 0;
+	unsigned char *p;
+	struct sk_buff *frag;
+
+	for (i = -1; i < skb_shinfo(skb)->nr_frags && done < len; ++i) {
+		if (i < 0) {
+			p = skb->data;
+			n = skb_headlen(skb);
+		} else {
+			p = skb_frag_address(&skb_shinfo(skb)->frags[i]);
+			n = skb_frag_size(&skb_shinfo(skb)->frags[i]);
+		}
+		if (off >= n) {
+			off -= n;
+			continue;
+		}
+		n = min(n - off, len - done);
+		if (st)
+			ttls_aes_gcm_update(st, p + off, p + off, n);
+		else
+			memcpy_fast(to + done, p + off, n);
+		done += n;
+		off = 0;
+	}
+
+	skb_walk_frags(skb, frag) {
+		if (done == len)
+			break;
+		if (off >= frag->len) {
+			off -= frag->len;
+			continue;
+		}
+		n = ttls_skb_gcm(st, to ? to + done : NULL, frag, off,
+				 min(frag->len - off, len - done));
+		done += n;
+		off = 0;
+	}
+
+	return done;
+}
+
+/**
+ * The same as ttls_skb_gcm(), but for the ingress skb list of @io.
+ */
+static int
+ttls_skb_list_gcm(TlsIOCtx *io, TlsAesGcm *st, unsigned char *to,
+		  unsigned int off, unsigned int len)
+{
+	unsigned int n;
+	struct sk_buff *skb = io->skb_list;
+
+	for ( ; skb && len;
+	     skb = (skb->next != io->skb_list) ? skb->next : NULL)
+	{
+		if (off >= skb->len) {
+			off -= skb->len;
+			continue;
+		}
+		n = ttls_skb_gcm(st, to, skb, off, min(len, skb->len - off));
+		if (to)
+			to += n;
+		len -= n;
+		off = 0;
+	}
+
+	return len ? -EINVAL : 0;
+}
+
+/**
+ * Decrypt a record of @dec_msglen bytes with AES-GCM directly on the skb
+ * fragments or on linear @buf, if it's not NULL, and verify its tag.
+ */
+static int
+ttls_decrypt_gcm(TlsCtx *tls, unsigned char *buf, size_t dec_msglen)
+{
+	int r;
+	TlsXfrm *xfrm = &tls->xfrm;
+	TlsIOCtx *io = &tls->io_in;
+	unsigned int off = ttls_payload_off(xfrm);
+	unsigned char aad[TLS_AAD_SPACE_SIZE];
+	unsigned char tag[TTLS_TAG_LEN], rec_tag[TTLS_TAG_LEN];
+	TlsAesGcm st;
+
+	ttls_make_aad(tls, io, aad);
+	ttls_aes_gcm_start(&st, xfrm->cipher_ctx_dec.gcm, xfrm->iv_dec, aad,
+			   TLS_AAD_SPACE_SIZE, false);
+
+	if (buf) {
+		ttls_aes_gcm_update(&st, buf, buf, dec_msglen);
+		memcpy_fast(rec_tag, buf + dec_msglen, TTLS_TAG_LEN);
+	} else {
+		if ((r = ttls_skb_list_gcm(io, &st, NULL, off, dec_msglen)))
+			return TTLS_ERR_INTERNAL_ERROR;
+		if ((r = ttls_skb_list_gcm(io, NULL, rec_tag, off + dec_msglen,
+					   TTLS_TAG_LEN)))
+			return TTLS_ERR_INTERNAL_ERROR;
+	}
+
+	ttls_aes_gcm_finish(&st, tag);
+
+	/* The same error as from the crypto API. */
+	return crypto_memneq(tag, rec_tag, TTLS_TAG_LEN) ? -EBADMSG : 0;
+}
+#endif
+
 /**
  * This TLS records encryption function can be called synchronously, on
  * handshake finished, or asynchronously, on callback from the TCP/IP stack. We
@@ -814,15 +973,23 @@ ttls_encrypt(TlsCtx *tls, struct sg_table *sgt, struct sg_table *out_sgt)
 	WARN_ON_ONCE(io->msglen > TLS_MAX_PAYLOAD_SIZE + TLS_MAX_OVERHEAD
 				  - TLS_HEADER_SIZE);
 
-	req = ttls_aead_req_alloc(c_ctx->cipher_ctx);
-	if (unlikely(!req))
-		return -ENOMEM;
-
 	*(long *)(xfrm->iv_enc + xfrm->fixed_ivlen) = iv;
 	T_DBG3_BUF("IV used", xfrm->iv_enc, xfrm->ivlen);
 
 	elen = ttls_msg2crypt_len(io, xfrm);
 	ttls_make_aad(tls, io, sg_virt(out_sgt->sgl));
+#ifdef VAES
+	if (c_ctx->gcm) {
+		ttls_encrypt_gcm(c_ctx->gcm, xfrm->iv_enc, sgt->sgl,
+				 out_sgt->sgl, elen);
+		goto done;
+	}
+#endif
+
+	req = ttls_aead_req_alloc(c_ctx->cipher_ctx);
+	if (unlikely(!req))
+		return -ENOMEM;
+
 	aead_request_set_tfm(req, c_ctx->cipher_ctx);
 	aead_request_set_ad(req, TLS_AAD_SPACE_SIZE);
 	aead_request_set_crypt(req, sgt->sgl, out_sgt->sgl, elen, xfrm->iv_enc);
@@ -837,20 +1004,22 @@ ttls_encrypt(TlsCtx *tls, struct sg_table *sgt, struct sg_table *out_sgt)
 		  sgt->sgl, sgt->nents, 0,
 		  min_t(size_t, 256, io->msglen + TLS_HEADER_SIZE));
 
-	if ((r = crypto_aead_encrypt(req))) {
+	r = crypto_aead_encrypt(req);
+	ttls_aead_req_free(c_ctx->cipher_ctx, req);
+	if (r) {
 		T_WARN("AEAD encryption failed: %d\n", r);
-		goto err;
+		return r;
 	}
+#ifdef VAES
+done:
+#endif
 	T_DBG3_SL("encrypted buf (first 64 bytes)", sgt->sgl, sgt->nents, 0,
 		  min_t(size_t, 64, io->msglen + TLS_HEADER_SIZE));
 
 	if (unlikely(++io->ctr > (~0UL >> 1)))
 		T_WARN("outgoing message counter would wrap\n");
 
-err:
-	ttls_aead_req_free(c_ctx->cipher_ctx, req);
-
-	return r;
+	return 0;
 }
 EXPORT_SYMBOL(ttls_encrypt);
 
@@ -889,6 +1058,14 @@ __ttls_decrypt(TlsCtx *tls, unsigned char *buf)
 	dec_msglen = io->msglen - expiv_len - TTLS_TAG_LEN;
 
 	memcpy_fast(xfrm->iv_dec + xfrm->fixed_ivlen, io->iv, sizeof(io->iv));
+#ifdef VAES
+	if (xfrm->cipher_ctx_dec.gcm) {
+		r = ttls_decrypt_gcm(tls, buf, dec_msglen);
+		if (unlikely(++io->ctr > (~0UL >> 1)))
+			T_WARN("incoming message counter would wrap\n");
+		return r;
+	}
+#endif
 	req = ttls_crypto_req_sglist(tls, tfm, dec_msglen + TTLS_TAG_LEN, buf,
 				     &sg, &sgn);
 	if (!req)
@@ -1283,6 +1460,7 @@ ttls_handshake_free(TlsHandshake *hs)
 
 	bzero_fast(hs, sizeof(TlsHandshake));
 	kmem_cache_free(ttls_hs_cache, hs);
+	this_cpu_dec(ttls_hs_active);
 }
 
 void
@@ -1355,6 +1533,7 @@ ttls_write_certificate(TlsCtx *tls, struct sg_table *sgt,
 	unsigned int sg_i;
 	size_t n, tot_len = 0;
 	const TlsX509Crt *crt;
+	const TlsKeyCert *kc;
 	TlsIOCtx *io = &tls->io_out;
 	unsigned char *p = *in_buf;
 
@@ -1379,6 +1558,18 @@ ttls_write_certificate(TlsCtx *tls, struct sg_table *sgt,
 		return TTLS_ERR_CERTIFICATE_REQUIRED;
 	}
 
+	/*
+	 * The chain is serialized on the configuration, so just reference it
+	 * in a single fragment.
+	 */
+	kc = ttls_own_key_cert(tls);
+	if (likely(kc && kc->chain)) {
+		tot_len = kc->chain_len;
+		get_page(virt_to_page(kc->chain));
+		sg_set_buf(&sgt->sgl[sgt->nents++], kc->chain, tot_len);
+		goto write_hdr;
+	}
+
 	/*
 	 * Write the certifictes chain.
 	 * All the certificates are placed in separate pages by the x509 parser.
@@ -1410,6 +1601,7 @@ ttls_write_certificate(TlsCtx *tls, struct sg_table *sgt,
 	if (crt)
 		T_WARN("Can not write full certificates chain\n");
 
+write_hdr:
 	/*
 	 * Write thr handshake headers on our own (TLS_HEADER_SIZE + 7 bytes).
 	 *
@@ -1864,6 +2056,7 @@ ttls_ctx_init(TlsCtx *tls, const TlsCfg *conf)
 	if (!tls->hs)
 		return -ENOMEM;
 	bzero_fast(tls->hs, sizeof(*tls->hs));
+	this_cpu_inc(ttls_hs_active);
 
 	tls->hs->sni_authmode = TTLS_VERIFY_UNSET;
 
@@ -1901,6 +2094,43 @@ ttls_set_session(TlsCtx *tls, const TlsSess *sess)
 	return 0;
 }
 
+/**
+ * Serialize the certificates chain of @kc, as it's written to the Certificate
+ * message, into contiguous pages, so handshakes don't walk the chain and send
+ * it in one fragment. Too large chains are left to ttls_write_certificate(),
+ * which reports the error on a handshake.
+ */
+static int
+ttls_key_cert_chain_init(TlsKeyCert *kc)
+{
+	const TlsX509Crt *crt;
+	unsigned char *p;
+	size_t n, len = 0;
+
+	kc->chain = NULL;
+	kc->chain_len = 0;
+
+	for (crt = kc->cert; crt; crt = crt->next)
+		len += crt->raw.len + TTLS_CERT_LEN_LEN;
+	if (!len || len > TLS_MAX_PAYLOAD_SIZE - 7)
+		return 0;
+
+	p = (unsigned char *)__get_free_pages(GFP_KERNEL | __GFP_COMP,
+					      get_order(len));
+	if (!p)
+		return -ENOMEM;
+	kc->chain = p;
+	kc->chain_len = len;
+
+	for (crt = kc->cert; crt; crt = crt->next) {
+		n = crt->raw.len + TTLS_CERT_LEN_LEN;
+		memcpy(p, crt->raw.p, n);
+		p += n;
+	}
+
+	return 0;
+}
+
 /**
  * Set own certificate chain and private key.
  *
@@ -1934,7 +2164,14 @@ ttls_conf_own_cert(TlsPeerCfg *conf, TlsX509Crt *own_cert, TlsPkCtx *pk_key,
 	new->key = pk_key;
 	new->ca_chain = ca_chain;
 	new->ca_crl = ca_crl;
+	/* The CAs or CRLs may reuse memory of the previous configuration. */
+	ttls_x509_crt_vcache_flush();
 	new->next = NULL;
+	RCU_INIT_POINTER(new->ocsp, NULL);
+	if (ttls_key_cert_chain_init(new)) {
+		kfree(new);
+		return -ENOMEM;
+	}
 
 	/* Update conf->key_cert if the list was NULL, else add to the end. */
 	if (!conf->key_cert) {
@@ -2285,6 +2522,64 @@ ttls_close_notify(TlsCtx *tls)
 }
 EXPORT_SYMBOL(ttls_close_notify);
 
+static void
+ttls_ocsp_free(TlsOcsp *ocsp)
+{
+	if (!ocsp)
+		return;
+	free_pages((unsigned long)ocsp->data, get_order(ocsp->len));
+	kfree(ocsp);
+}
+
+/**
+ * Staple DER encoded OCSP response @resp of @len bytes to the certificate of
+ * @kc or remove the stapled response if @resp is NULL. The response is stored
+ * as the CertificateStatus message body in its own pages, so handshakes just
+ * reference it. The same response isn't replaced.
+ *
+ * Called in process context, there must be only one writer for @kc.
+ */
+int
+ttls_key_cert_set_ocsp(TlsKeyCert *kc, const unsigned char *resp, size_t len)
+{
+	TlsOcsp *ocsp = NULL, *old = rcu_dereference_protected(kc->ocsp, 1);
+
+	if (resp) {
+		if (!len || len + TTLS_CERT_STATUS_HDR_LEN + TTLS_HS_HDR_LEN
+			    > TLS_MAX_PAYLOAD_SIZE)
+			return -EINVAL;
+		if (old && old->len == len + TTLS_CERT_STATUS_HDR_LEN
+		    && !memcmp(old->data + TTLS_CERT_STATUS_HDR_LEN, resp, len))
+			return 0;
+
+		if (!(ocsp = kmalloc(sizeof(*ocsp), GFP_KERNEL)))
+			return -ENOMEM;
+		ocsp->len = len + TTLS_CERT_STATUS_HDR_LEN;
+		ocsp->data = (unsigned char *)
+			__get_free_pages(GFP_KERNEL | __GFP_COMP,
+					 get_order(ocsp->len));
+		if (!ocsp->data) {
+			kfree(ocsp);
+			return -ENOMEM;
+		}
+		ocsp->data[0] = TTLS_CERT_STATUS_OCSP;
+		ocsp->data[1] = (unsigned char)(len >> 16);
+		ocsp->data[2] = (unsigned char)(len >> 8);
+		ocsp->data[3] = (unsigned char)len;
+		memcpy(ocsp->data + TTLS_CERT_STATUS_HDR_LEN, resp, len);
+	}
+
+	rcu_assign_pointer(kc->ocsp, ocsp);
+	if (old) {
+		/* Handshakes in flight keep their references to the pages. */
+		synchronize_rcu();
+		ttls_ocsp_free(old);
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL(ttls_key_cert_set_ocsp);
+
 void
 ttls_key_cert_free(TlsKeyCert *key_cert)
 {
@@ -2292,6 +2587,11 @@ ttls_key_cert_free(TlsKeyCert *key_cert)
 
 	while (cur) {
 		next = cur->next;
+		/* Handshakes in flight keep their references to the pages. */
+		if (cur->chain)
+			free_pages((unsigned long)cur->chain,
+				   get_order(cur->chain_len));
+		ttls_ocsp_free(rcu_dereference_protected(cur->ocsp, 1));
 		kfree(cur);
 		cur = next;
 	}
@@ -2313,6 +2613,26 @@ ttls_ctx_clear(TlsCtx *tls)
 }
 EXPORT_SYMBOL(ttls_ctx_clear);
 
+/**
+ * Collect TLS memory usage. Only the TLS context is kept for an established
+ * connection, the handshake context and the MPI pool are freed at the end of
+ * the handshake.
+ */
+void
+ttls_mem_stat(TlsMemStat *st)
+{
+	int cpu;
+	long n = 0;
+
+	for_each_online_cpu(cpu)
+		n += *per_cpu_ptr(&ttls_hs_active, cpu);
+
+	st->ctx_sz = sizeof(TlsCtx);
+	st->hs_sz = sizeof(TlsHandshake) + ttls_mpi_pool_hs_size();
+	st->hs_active = max(n, 0L);
+}
+EXPORT_SYMBOL(ttls_mem_stat);
+
 void
 ttls_config_init(TlsCfg *conf)
 {
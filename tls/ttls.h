@@ -211,6 +211,7 @@
 #define TTLS_HS_CERTIFICATE_VERIFY		15
 #define TTLS_HS_CLIENT_KEY_EXCHANGE		16
 #define TTLS_HS_FINISHED			20
+#define TTLS_HS_CERTIFICATE_STATUS		22
 #define TTLS_HS_INVALID				0xff
 
 /*
@@ -221,6 +222,7 @@
 #define TTLS_TLS_EXT_SERVERNAME_HOSTNAME	0
 #define TTLS_TLS_EXT_MAX_FRAGMENT_LENGTH	1
 #define TTLS_TLS_EXT_TRUNCATED_HMAC		4
+#define TTLS_TLS_EXT_STATUS_REQUEST		5
 #define TTLS_TLS_EXT_SUPPORTED_ELLIPTIC_CURVES	10
 #define TTLS_TLS_EXT_SUPPORTED_POINT_FORMATS	11
 #define TTLS_TLS_EXT_SIG_ALG			13
@@ -304,8 +306,6 @@ typedef struct {
  * either in negotiation or active.
  *
  * @ciphersuite_info	- chosen ciphersuite_info;
- * @md_ctx_enc		- MAC encryption context;
- * @md_ctx_dec		- MAC decryption context;
  * @cipher_ctx_enc	- encryption crypto context;
  * @cipher_ctx_dec	- decryption crypto context;
  * @keylen		- symmetric key length (bytes);
@@ -318,8 +318,6 @@ typedef struct {
  */
 typedef struct {
 	const TlsCiphersuite		*ciphersuite_info;
-	TlsMdCtx			md_ctx_enc;
-	TlsMdCtx			md_ctx_dec;
 	TlsCipherCtx			cipher_ctx_enc;
 	TlsCipherCtx			cipher_ctx_dec;
 	unsigned int			keylen;
@@ -331,6 +329,23 @@ typedef struct {
 	unsigned char			iv_dec[16];
 } TlsXfrm;
 
+/* CertificateStatusType of OCSP stapling, RFC 6066 8. */
+#define TTLS_CERT_STATUS_OCSP			1
+/* Status type and length of the response in CertificateStatus message. */
+#define TTLS_CERT_STATUS_HDR_LEN		4
+
+/**
+ * OCSP response stapled to the certificate.
+ *
+ * @data	- CertificateStatus message body, i.e. the status type, the
+ *		  response length and DER encoded OCSPResponse;
+ * @len		- length of @data;
+ */
+typedef struct {
+	unsigned char	*data;
+	unsigned int	len;
+} TlsOcsp;
+
 /**
  * List of certificate + private key pairs
  *
@@ -339,6 +354,10 @@ typedef struct {
  * @ca_chain		- trusted CA chain for the issues certificate;
  * @ca_crl		- trusted CAs CRLs;
  * @next		- next certificate in list;
+ * @chain		- the certificates chain serialized as in the Certificate
+ *			  message, NULL if the chain can't be sent at all;
+ * @chain_len		- length of @chain;
+ * @ocsp		- OCSP response for @cert, replaced under RCU;
  */
 typedef struct ttls_key_cert {
 	TlsX509Crt			*cert;
@@ -346,6 +365,9 @@ typedef struct ttls_key_cert {
 	TlsX509Crt			*ca_chain;
 	ttls_x509_crl			*ca_crl;
 	struct ttls_key_cert		*next;
+	unsigned char			*chain;
+	unsigned int			chain_len;
+	TlsOcsp __rcu			*ocsp;
 } TlsKeyCert;
 
 #define TTLS_TICKET_KEY_LEN		16 /* 128 bits */
@@ -564,6 +586,19 @@ typedef struct ttls_context {
 	char			*hostname;
 } TlsCtx;
 
+/**
+ * TLS memory usage statistics.
+ *
+ * @ctx_sz	- size of the TLS context of each connection;
+ * @hs_sz	- maximum size of handshake data of a connection in handshake;
+ * @hs_active	- number of connections in handshake;
+ */
+typedef struct {
+	size_t		ctx_sz;
+	size_t		hs_sz;
+	unsigned long	hs_active;
+} TlsMemStat;
+
 typedef int ttls_send_cb_t(TlsCtx *tls, struct sg_table *sgt);
 typedef int ttls_sni_cb_t(TlsCtx *tls, const unsigned char *data, size_t len);
 typedef unsigned long ttls_cli_id_t(TlsCtx *tls, unsigned long hash);
@@ -574,6 +609,14 @@ enum {
 	TTLS_HS_CB_INCOMPLETE,
 };
 typedef int ttls_hs_over_cb_t(TlsCtx *tls, int state);
+/*
+ * Server side session cache for resumption by session ID, RFC 5246 7.4.1.2.
+ * The get callback looks up the session with ID from @tls->sess and copies
+ * it to @sess, returns 0 if the session is found. The put callback stores
+ * @tls->sess after a full handshake.
+ */
+typedef int ttls_sess_get_cb_t(TlsCtx *tls, TlsSess *sess);
+typedef void ttls_sess_put_cb_t(TlsCtx *tls);
 
 bool ttls_hs_done(TlsCtx *tls);
 bool ttls_xfrm_ready(TlsCtx *tls);
@@ -583,6 +626,8 @@ void ttls_write_hshdr(unsigned char type, unsigned char *buf,
 void *ttls_alloc_crypto_req(unsigned int extra_size, unsigned int *rsz);
 void ttls_register_callbacks(ttls_send_cb_t *send_cb, ttls_sni_cb_t *sni_cb,
 			     ttls_hs_over_cb_t *hs_over_cb, ttls_cli_id_t *cli_id_cb);
+void ttls_register_sess_cache_cb(ttls_sess_get_cb_t *get_cb,
+				 ttls_sess_put_cb_t *put_cb);
 
 const char *ttls_get_ciphersuite_name(const int ciphersuite_id);
 
@@ -614,7 +659,10 @@ int ttls_send_alert(TlsCtx *tls, unsigned char lvl, unsigned char msg);
 int ttls_close_notify(TlsCtx *tls);
 
 void ttls_ctx_clear(TlsCtx *tls);
+void ttls_mem_stat(TlsMemStat *st);
 void ttls_key_cert_free(TlsKeyCert *key_cert);
+int ttls_key_cert_set_ocsp(TlsKeyCert *kc, const unsigned char *resp,
+			   size_t len);
 
 void ttls_config_init(TlsCfg *conf);
 int ttls_config_defaults(TlsCfg *conf, int endpoint);
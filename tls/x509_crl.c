@@ -32,6 +32,7 @@
  */
 #include "debug.h"
 #include "x509_crl.h"
+#include "x509_crt.h"
 #include "oid.h"
 #include "pem.h"
 #include "tls_internal.h"
@@ -508,6 +509,9 @@ ttls_x509_crl_parse_der(ttls_x509_crl *chain,
 				TTLS_ERR_ASN1_LENGTH_MISMATCH);
 	}
 
+	/* Cached verifications didn't check the new CRL. */
+	ttls_x509_crt_vcache_flush();
+
 	return 0;
 }
 
@@ -594,6 +598,8 @@ void ttls_x509_crl_free(ttls_x509_crl *crl)
 	if (crl == NULL)
 		return;
 
+	ttls_x509_crt_vcache_flush();
+
 	do
 	{
 		kfree(crl_cur->sig_opts);
@@ -1619,6 +1619,142 @@ x509_crt_verify_child(TlsX509Crt *child, TlsX509Crt *parent,
 	return 0;
 }
 
+/*
+ * Cache of successfully verified peer certificate chains, so the same client
+ * reconnecting many times doesn't make us verify all the signatures of its
+ * chain on each handshake. An entry is keyed by SHA-256 of the whole presented
+ * chain and is valid only for the same trusted CAs, CRLs and profile. It
+ * expires with the first certificate or CRL in use, and the whole cache is
+ * invalidated on any CRL or trusted CAs update by the generation counter.
+ *
+ * Only the chain verification is cached: the CN and the leaf key checks are
+ * cheap and depend on the connection.
+ */
+#define TTLS_X509_VCACHE_BITS	8
+#define TTLS_X509_VCACHE_SZ	(1 << TTLS_X509_VCACHE_BITS)
+#define TTLS_X509_VCACHE_FP_LEN	32
+
+/**
+ * @fp		- SHA-256 fingerprint of the raw peer chain;
+ * @trust_ca	- the list of trusted CAs the chain was verified against;
+ * @ca_crl	- the list of CRLs used for the verification;
+ * @expires	- time when the entry becomes invalid;
+ * @profile_id	- the verification profile;
+ * @gen		- the cache generation when the entry was added;
+ */
+typedef struct {
+	unsigned char		fp[TTLS_X509_VCACHE_FP_LEN];
+	const TlsX509Crt	*trust_ca;
+	const ttls_x509_crl	*ca_crl;
+	time64_t		expires;
+	int			profile_id;
+	unsigned int		gen;
+} TlsX509VCacheEnt;
+
+static TlsX509VCacheEnt x509_vcache[TTLS_X509_VCACHE_SZ];
+static DEFINE_SPINLOCK(x509_vcache_lock);
+static atomic_t x509_vcache_gen = ATOMIC_INIT(0);
+
+/**
+ * Invalidate all the cached verification results. Must be called on any
+ * change of the trusted CAs or CRLs.
+ */
+void
+ttls_x509_crt_vcache_flush(void)
+{
+	atomic_inc(&x509_vcache_gen);
+}
+
+static time64_t
+x509_time_to_time64(const ttls_x509_time *t)
+{
+	return mktime64(t->year, t->mon, t->day, t->hour, t->min, t->sec);
+}
+
+static int
+x509_vcache_fp(const TlsX509Crt *crt, unsigned char *fp)
+{
+	int r;
+	TlsMdCtx ctx;
+
+	ttls_md_init(&ctx);
+	if ((r = ttls_md_setup(&ctx, ttls_md_info_from_type(TTLS_MD_SHA256),
+			       0)))
+		return r;
+	if ((r = ttls_md_starts(&ctx)))
+		goto out;
+	/* DER encoding is self-delimiting, so just concatenate the chain. */
+	for ( ; crt && crt->raw.len; crt = crt->next)
+		if ((r = ttls_md_update(&ctx, crt->raw.p, crt->raw.len)))
+			goto out;
+	r = ttls_md_finish(&ctx, fp);
+out:
+	ttls_md_free(&ctx);
+	return r;
+}
+
+static TlsX509VCacheEnt *
+x509_vcache_slot(const unsigned char *fp)
+{
+	return &x509_vcache[*(u32 *)fp & (TTLS_X509_VCACHE_SZ - 1)];
+}
+
+static bool
+x509_vcache_lookup(const unsigned char *fp, const TlsX509Crt *trust_ca,
+		   const ttls_x509_crl *ca_crl, int profile_id)
+{
+	bool hit;
+	TlsX509VCacheEnt *e = x509_vcache_slot(fp);
+
+	spin_lock_bh(&x509_vcache_lock);
+	hit = e->gen == atomic_read(&x509_vcache_gen)
+	      && e->expires > ttls_time()
+	      && e->trust_ca == trust_ca && e->ca_crl == ca_crl
+	      && e->profile_id == profile_id
+	      && !memcmp(e->fp, fp, TTLS_X509_VCACHE_FP_LEN);
+	spin_unlock_bh(&x509_vcache_lock);
+
+	return hit;
+}
+
+/**
+ * Cache the successful verification of @crt. The trusted CA used for the
+ * verification is valid now, so the earliest expiration of the currently
+ * valid trusted CAs bounds the entry lifetime. We don't track the CA
+ * actually used, the bound is just shorter if some other CA expires earlier.
+ */
+static void
+x509_vcache_insert(const unsigned char *fp, const TlsX509Crt *crt,
+		   const TlsX509Crt *trust_ca, const ttls_x509_crl *ca_crl,
+		   int profile_id, unsigned int gen)
+{
+	const TlsX509Crt *c;
+	const ttls_x509_crl *crl;
+	TlsX509VCacheEnt *e = x509_vcache_slot(fp);
+	time64_t t, now = ttls_time(), expires = TIME64_MAX;
+
+	for (c = crt; c && c->raw.len; c = c->next)
+		expires = min(expires, x509_time_to_time64(&c->valid_to));
+	for (c = trust_ca; c && c->raw.len; c = c->next) {
+		t = x509_time_to_time64(&c->valid_to);
+		if (t > now)
+			expires = min(expires, t);
+	}
+	for (crl = ca_crl; crl && crl->version; crl = crl->next)
+		expires = min(expires, x509_time_to_time64(&crl->next_update));
+	if (expires <= now)
+		return;
+
+	spin_lock_bh(&x509_vcache_lock);
+	memcpy(e->fp, fp, TTLS_X509_VCACHE_FP_LEN);
+	e->trust_ca = trust_ca;
+	e->ca_crl = ca_crl;
+	e->expires = expires;
+	e->profile_id = profile_id;
+	e->gen = gen;
+	spin_unlock_bh(&x509_vcache_lock);
+}
+
 /**
  * Verify the certificate signature according to profile.
  *
@@ -1651,6 +1787,9 @@ ttls_x509_crt_verify_with_profile(TlsX509Crt *crt,
 	size_t cn_len;
 	int ret;
 	int pathlen = 0, selfsigned = 0;
+	bool fp_ok;
+	unsigned int gen;
+	unsigned char fp[TTLS_X509_VCACHE_FP_LEN];
 	TlsX509Crt *parent;
 	ttls_x509_name *name;
 	ttls_x509_sequence *cur = NULL;
@@ -1731,6 +1870,18 @@ ttls_x509_crt_verify_with_profile(TlsX509Crt *crt,
 	if (x509_profile_check_key(profile, pk_type, &crt->pk) != 0)
 		*flags |= TTLS_X509_BADCERT_BAD_KEY;
 
+	/*
+	 * Skip the chain verification if the chain was already verified.
+	 * Read the generation before the verification, so a concurrent CRL
+	 * or CAs update isn't lost by the insertion of a stale result.
+	 */
+	gen = atomic_read(&x509_vcache_gen);
+	fp_ok = !x509_vcache_fp(crt, fp);
+	if (fp_ok && x509_vcache_lookup(fp, trust_ca, ca_crl, profile_id)) {
+		T_DBG("x509: certificate chain verification cache hit\n");
+		return *flags ? TTLS_ERR_X509_CERT_VERIFY_FAILED : 0;
+	}
+
 	/* Look for a parent in trusted CAs */
 	for (parent = trust_ca; parent != NULL; parent = parent->next)
 	{
@@ -1787,6 +1938,9 @@ exit:
 	if (*flags != 0)
 		return TTLS_ERR_X509_CERT_VERIFY_FAILED;
 
+	if (fp_ok)
+		x509_vcache_insert(fp, crt, trust_ca, ca_crl, profile_id, gen);
+
 	return 0;
 }
 
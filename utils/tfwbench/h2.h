@@ -0,0 +1,268 @@
+/**
+ *		Tempesta FW Benchmark
+ *
+ * Minimal HTTP/2 framing and HPACK coding sufficient for a load generating
+ * client. The client disables the HPACK dynamic table, so it never needs
+ * to keep the table state, and only decodes the response status.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __TFWBENCH_H2_H__
+#define __TFWBENCH_H2_H__
+
+#include <stdint.h>
+
+#include <string>
+
+namespace h2 {
+
+enum : uint8_t {
+	DATA		= 0,
+	HEADERS		= 1,
+	PRIORITY	= 2,
+	RST_STREAM	= 3,
+	SETTINGS	= 4,
+	PUSH_PROMISE	= 5,
+	PING		= 6,
+	GOAWAY		= 7,
+	WINDOW_UPDATE	= 8,
+	CONTINUATION	= 9,
+};
+
+enum : uint8_t {
+	F_END_STREAM	= 0x01,
+	F_ACK		= 0x01,
+	F_END_HEADERS	= 0x04,
+	F_PADDED	= 0x08,
+	F_PRIORITY	= 0x20,
+};
+
+enum : uint16_t {
+	S_HEADER_TABLE_SIZE		= 1,
+	S_ENABLE_PUSH			= 2,
+	S_MAX_CONCURRENT_STREAMS	= 3,
+	S_INITIAL_WINDOW_SIZE		= 4,
+};
+
+static const size_t FRAME_HDR = 9;
+static const uint32_t WINDOW_MAX = 0x7fffffff;
+static const uint32_t SID_MAX = 0x7fffffff;
+static const char PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+/* Static table indexes of the request pseudo-headers names. */
+static const unsigned int IDX_AUTHORITY = 1;
+static const unsigned int IDX_METHOD = 2;
+static const unsigned int IDX_PATH = 4;
+static const unsigned int IDX_SCHEME = 6;
+static const unsigned int IDX_USER_AGENT = 58;
+
+static inline uint32_t
+get32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static inline void
+put32(std::string &out, uint32_t v)
+{
+	out += (char)(v >> 24);
+	out += (char)(v >> 16);
+	out += (char)(v >> 8);
+	out += (char)v;
+}
+
+static inline void
+frame_hdr(std::string &out, uint32_t len, uint8_t type, uint8_t flags,
+	  uint32_t sid)
+{
+	out += (char)(len >> 16);
+	out += (char)(len >> 8);
+	out += (char)len;
+	out += (char)type;
+	out += (char)flags;
+	put32(out, sid & SID_MAX);
+}
+
+static inline void
+setting(std::string &out, uint16_t id, uint32_t val)
+{
+	out += (char)(id >> 8);
+	out += (char)id;
+	put32(out, val);
+}
+
+static inline void
+window_update(std::string &out, uint32_t sid, uint32_t inc)
+{
+	frame_hdr(out, 4, WINDOW_UPDATE, 0, sid);
+	put32(out, inc);
+}
+
+/**
+ * The client connection preface: the magic, the settings disabling the
+ * dynamic table and server push, and the largest flow control windows,
+ * so the client never blocks the server.
+ */
+static inline void
+preface(std::string &out)
+{
+	out.append(PREFACE, sizeof(PREFACE) - 1);
+	frame_hdr(out, 18, SETTINGS, 0, 0);
+	setting(out, S_HEADER_TABLE_SIZE, 0);
+	setting(out, S_ENABLE_PUSH, 0);
+	setting(out, S_INITIAL_WINDOW_SIZE, WINDOW_MAX);
+	window_update(out, 0, WINDOW_MAX - 65535);
+}
+
+/**
+ * Encode HPACK integer @v with @n-bit prefix, @first are the bits of the
+ * first byte preceding the prefix.
+ */
+static inline void
+hpack_int(std::string &out, uint8_t first, int n, uint32_t v)
+{
+	uint32_t max = (1U << n) - 1;
+
+	if (v < max) {
+		out += (char)(first | v);
+		return;
+	}
+	out += (char)(first | max);
+	for (v -= max; v >= 0x80; v >>= 7)
+		out += (char)(0x80 | (v & 0x7f));
+	out += (char)v;
+}
+
+/**
+ * Encode a literal header field without indexing. The name is taken from
+ * the static table if @idx isn't zero. The strings are not Huffman encoded.
+ */
+static inline void
+hpack_field(std::string &out, unsigned int idx, const std::string &name,
+	    const std::string &val)
+{
+	hpack_int(out, 0, 4, idx);
+	if (!idx) {
+		hpack_int(out, 0, 7, name.size());
+		out += name;
+	}
+	hpack_int(out, 0, 7, val.size());
+	out += val;
+}
+
+static inline bool
+hpack_dec_int(const uint8_t *&p, const uint8_t *end, int n, uint32_t &v)
+{
+	uint32_t max = (1U << n) - 1;
+	int shift = 0;
+
+	if (p >= end)
+		return false;
+	if ((v = *p++ & max) < max)
+		return true;
+	do {
+		if (p >= end || shift > 21)
+			return false;
+		v += (uint32_t)(*p & 0x7f) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+
+	return true;
+}
+
+/**
+ * Decode a Huffman encoded status code. The codes of the digits are
+ * 00000-00010 for '0'-'2' and 011001-011111 for '3'-'9', RFC 7541 B.
+ */
+static inline int
+huff_status(const uint8_t *p, uint32_t len)
+{
+	uint32_t bits = 0, acc = 0;
+	int st = 0, n;
+
+	for (n = 0; n < 3; ++n) {
+		while (bits < 6 && len) {
+			acc = acc << 8 | *p++;
+			bits += 8;
+			--len;
+		}
+		if (bits < 5)
+			return 0;
+		uint32_t c = (acc >> (bits - 5)) & 0x1f;
+		if (c <= 2) {
+			bits -= 5;
+		} else {
+			if (bits < 6)
+				return 0;
+			c = (acc >> (bits - 6)) & 0x3f;
+			if (c < 0x19 || c > 0x1f)
+				return 0;
+			c -= 0x19 - 3;
+			bits -= 6;
+		}
+		st = st * 10 + c;
+	}
+
+	return st;
+}
+
+/**
+ * Decode :status, the first field of a response header block. The dynamic
+ * table is disabled, so the status is either indexed in the static table
+ * or a literal with the static name. Returns 0 if the block doesn't start
+ * with the status, e.g. for trailers.
+ */
+static inline int
+hpack_status(const uint8_t *p, const uint8_t *end)
+{
+	static const int st_idx[] = { 200, 204, 206, 304, 400, 404, 500 };
+	uint32_t v, len;
+	int st = 0;
+
+	/* Skip the dynamic table size updates. */
+	while (p < end && (*p & 0xe0) == 0x20)
+		if (!hpack_dec_int(p, end, 5, v))
+			return 0;
+	if (p >= end)
+		return 0;
+
+	if (*p & 0x80) {
+		if (!hpack_dec_int(p, end, 7, v))
+			return 0;
+		return v >= 8 && v <= 14 ? st_idx[v - 8] : 0;
+	}
+	if (!hpack_dec_int(p, end, (*p & 0x40) ? 6 : 4, v) || v < 8 || v > 14)
+		return 0;
+	if (p >= end)
+		return 0;
+	bool huff = *p & 0x80;
+	if (!hpack_dec_int(p, end, 7, len) || len > (uint32_t)(end - p))
+		return 0;
+	if (huff)
+		return huff_status(p, len);
+	for ( ; len; --len, ++p) {
+		if (*p < '0' || *p > '9')
+			return 0;
+		st = st * 10 + *p - '0';
+	}
+
+	return st;
+}
+
+} // namespace h2
+
+#endif // __TFWBENCH_H2_H__
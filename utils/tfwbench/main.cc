@@ -0,0 +1,1401 @@
+/**
+ *		Tempesta FW Benchmark
+ *
+ * HTTP/1.1 and HTTP/2 load generator over plain TCP or TLS. Each thread
+ * runs an epoll loop over its connections and keeps the configured number
+ * of requests in flight on each of them: pipelined requests for HTTP/1.1
+ * and concurrent streams for HTTP/2. The handshake mode only establishes
+ * and closes the connections to measure the handshake rate, with or
+ * without TLS session resumption.
+ *
+ * Requests are taken round-robin from a file of "METHOD URI" lines, so
+ * a traffic profile can be reproduced, or a single "GET /" is sent.
+ *
+ * The closed loop above hides the queueing delay of an overloaded server:
+ * a slow response just delays the next request. The open-loop mode sends
+ * requests at a constant rate instead, by their intended send times, and
+ * measures the latency from the intended time. So a request waiting for
+ * a free connection or stream is accounted with the waiting time, i.e.
+ * the latency is free of coordinated omission. The ramp mode repeats the
+ * open-loop test searching for the maximum rate sustained with the given
+ * 99th percentile of the latency.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "h2.h"
+
+/*
+ * The latency histogram in microseconds, like HdrHistogram: values below
+ * 2 * LAT_SUB are counted exactly, above that each power of two range is
+ * split to LAT_SUB linear buckets, so a value is known within 1/LAT_SUB.
+ */
+static const int LAT_SUB_BITS = 5;
+static const uint64_t LAT_SUB = 1 << LAT_SUB_BITS;
+static const int LAT_BUCKETS = (65 - LAT_SUB_BITS) * LAT_SUB;
+/* Maximum number of the ramp mode steps. */
+static const int RAMP_STEPS = 20;
+/* Maximum size of HTTP/1.1 response headers or a chunk size line. */
+static const size_t H1_HDR_MAX = 64 * 1024;
+/* Send connection WINDOW_UPDATE after this amount of received data. */
+static const uint32_t H2_WND_UPDATE = 1 << 20;
+
+static struct {
+	std::string		host;
+	std::string		port = "80";
+	std::string		authority;
+	struct sockaddr_storage	addr;
+	socklen_t		addr_len;
+	int			threads = 1;
+	int			conns = 1;
+	int			duration = 10;
+	int			depth = 1;
+	bool			h2 = false;
+	bool			tls = false;
+	bool			hs_only = false;
+	bool			resume = false;
+	double			rate = 0;
+	unsigned long		p99 = 0;
+} cfg;
+
+class BenchExcept : public std::runtime_error {
+public:
+	BenchExcept(const std::string &msg)
+		: std::runtime_error(msg)
+	{}
+};
+
+struct Request {
+	std::string	h1;
+	std::string	h2;	/* HPACK encoded header block */
+	bool		head;
+};
+
+static std::vector<Request> requests;
+static SSL_CTX *ssl_ctx;
+static std::atomic<bool> running(true);
+
+static inline uint64_t
+now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static inline int
+lat_bucket(uint64_t v)
+{
+	if (v < 2 * LAT_SUB)
+		return v;
+	int e = 64 - __builtin_clzll(v) - 1 - LAT_SUB_BITS;
+
+	return e * LAT_SUB + (v >> e);
+}
+
+/* The upper bound of the values counted by bucket @b. */
+static inline uint64_t
+lat_value(int b)
+{
+	if ((uint64_t)b < 2 * LAT_SUB)
+		return b;
+	int e = b / LAT_SUB - 1;
+
+	return ((b % LAT_SUB + LAT_SUB + 1) << e) - 1;
+}
+
+struct Stat {
+	uint64_t	conn_ok = 0;
+	uint64_t	conn_err = 0;
+	uint64_t	handshakes = 0;
+	uint64_t	resumed = 0;
+	uint64_t	tls_err = 0;
+	uint64_t	scheduled = 0;
+	uint64_t	unsent = 0;
+	uint64_t	requests = 0;
+	uint64_t	responses = 0;
+	uint64_t	errors = 0;
+	uint64_t	bytes_in = 0;
+	uint64_t	status[6] = {};
+	uint64_t	lat[LAT_BUCKETS] = {};
+	uint64_t	lat_max = 0;
+
+	void
+	add(const Stat &s)
+	{
+		conn_ok += s.conn_ok;
+		conn_err += s.conn_err;
+		handshakes += s.handshakes;
+		resumed += s.resumed;
+		tls_err += s.tls_err;
+		scheduled += s.scheduled;
+		unsent += s.unsent;
+		requests += s.requests;
+		responses += s.responses;
+		errors += s.errors;
+		bytes_in += s.bytes_in;
+		for (int i = 0; i < 6; ++i)
+			status[i] += s.status[i];
+		for (int i = 0; i < LAT_BUCKETS; ++i)
+			lat[i] += s.lat[i];
+		lat_max = std::max(lat_max, s.lat_max);
+	}
+
+	/* @t0 is the intended send time of the request in open-loop mode. */
+	void
+	response(int st, uint64_t t0)
+	{
+		unsigned int c = st / 100;
+		uint64_t us = (now_ns() - t0) / 1000;
+
+		++responses;
+		++status[c >= 1 && c <= 5 ? c - 1 : 5];
+		++lat[lat_bucket(us)];
+		lat_max = std::max(lat_max, us);
+	}
+
+	/* The latency percentile @q, in microseconds. */
+	uint64_t
+	percentile(double q) const
+	{
+		uint64_t lim = (uint64_t)(responses * q / 100 + 0.5), sum = 0;
+		int b;
+
+		if (!responses)
+			return 0;
+		for (b = 0; b < LAT_BUCKETS - 1; ++b)
+			if ((sum += lat[b]) >= std::max<uint64_t>(lim, 1))
+				break;
+
+		return std::min(lat_value(b), lat_max);
+	}
+};
+
+/**
+ * Incremental parser of HTTP/1.1 responses. The bodies are skipped
+ * without copying.
+ */
+class H1Parser {
+public:
+	enum Res { MORE, DONE, ERROR };
+
+	void
+	start(bool head)
+	{
+		state_ = S_HDR;
+		head_ = head;
+		last_ = false;
+		buf_.clear();
+	}
+
+	bool
+	close_delimited() const
+	{
+		return state_ == S_EOF;
+	}
+
+	/* The server closes the connection after the response. */
+	bool
+	last() const
+	{
+		return last_;
+	}
+
+	int
+	status() const
+	{
+		return status_;
+	}
+
+	/**
+	 * Consume the data of the current response from @p, @len is updated
+	 * with the rest of the data which belongs to the next responses.
+	 */
+	Res
+	feed(const char *&p, size_t &len)
+	{
+		while (len) {
+			switch (state_) {
+			case S_HDR: {
+				ssize_t n = line(p, len, "\r\n\r\n");
+				if (n < 0)
+					return buf_.size() > H1_HDR_MAX
+					       ? ERROR : MORE;
+				if (!headers())
+					return ERROR;
+				if (state_ == S_DONE)
+					return DONE;
+				break;
+			}
+			case S_CHUNK_SIZE: {
+				ssize_t n = line(p, len, "\r\n");
+				if (n < 0)
+					return buf_.size() > H1_HDR_MAX
+					       ? ERROR : MORE;
+				char *end;
+				left_ = strtoull(buf_.c_str(), &end, 16);
+				if (end == buf_.c_str())
+					return ERROR;
+				buf_.clear();
+				if (left_) {
+					left_ += 2;
+					state_ = S_CHUNK;
+				} else {
+					state_ = S_TRAILER;
+				}
+				break;
+			}
+			case S_TRAILER: {
+				ssize_t n = line(p, len, "\r\n");
+				if (n < 0)
+					return MORE;
+				bool last = buf_.size() == 2;
+				buf_.clear();
+				if (last) {
+					state_ = S_DONE;
+					return DONE;
+				}
+				break;
+			}
+			case S_BODY:
+			case S_CHUNK: {
+				size_t n = len < left_ ? len : left_;
+				p += n;
+				len -= n;
+				left_ -= n;
+				if (left_)
+					return MORE;
+				if (state_ == S_CHUNK) {
+					state_ = S_CHUNK_SIZE;
+					break;
+				}
+				state_ = S_DONE;
+				return DONE;
+			}
+			case S_EOF:
+				p += len;
+				len = 0;
+				return MORE;
+			default:
+				return ERROR;
+			}
+		}
+
+		return MORE;
+	}
+
+private:
+	enum {
+		S_HDR, S_BODY, S_CHUNK_SIZE, S_CHUNK, S_TRAILER, S_EOF, S_DONE
+	};
+
+	/**
+	 * Accumulate a line up to and including @term in @buf_. Returns -1
+	 * if there is no the terminator in the data yet.
+	 */
+	ssize_t
+	line(const char *&p, size_t &len, const char *term)
+	{
+		size_t tlen = strlen(term), old = buf_.size();
+		size_t from = old >= tlen ? old - tlen + 1 : 0;
+
+		buf_.append(p, len);
+		size_t pos = buf_.find(term, from);
+		if (pos == std::string::npos) {
+			p += len;
+			len = 0;
+			return -1;
+		}
+		size_t used = pos + tlen - old;
+		buf_.resize(pos + tlen);
+		p += used;
+		len -= used;
+
+		return pos;
+	}
+
+	bool
+	headers()
+	{
+		const char *s = buf_.c_str();
+		bool chunked = false, cl = false;
+
+		if (strncmp(s, "HTTP/1.", 7) || buf_.size() < 12)
+			return false;
+		status_ = atoi(s + 9);
+		left_ = 0;
+		/* HTTP/1.0 connections aren't persistent by default. */
+		last_ = s[7] == '0';
+
+		for (s = strstr(s, "\r\n"); s && s[2] != '\r'; ) {
+			s += 2;
+			if (!strncasecmp(s, "content-length:", 15)) {
+				left_ = strtoull(s + 15, NULL, 10);
+				cl = true;
+			}
+			else if (!strncasecmp(s, "transfer-encoding:", 18)) {
+				const char *e = strstr(s, "\r\n");
+				std::string v(s + 18, e - s - 18);
+				chunked = v.find("chunked") != std::string::npos;
+			}
+			else if (!strncasecmp(s, "connection:", 11)) {
+				const char *e = strstr(s, "\r\n");
+				std::string v(s + 11, e - s - 11);
+				if (strcasestr(v.c_str(), "close"))
+					last_ = true;
+				else if (strcasestr(v.c_str(), "keep-alive"))
+					last_ = false;
+			}
+			s = strstr(s, "\r\n");
+		}
+		buf_.clear();
+
+		if (head_ || status_ < 200 || status_ == 204 || status_ == 304)
+			state_ = S_DONE;
+		else if (chunked)
+			state_ = S_CHUNK_SIZE;
+		else if (cl)
+			state_ = left_ ? S_BODY : S_DONE;
+		else
+			state_ = S_EOF;
+
+		return true;
+	}
+
+	int		state_ = S_HDR;
+	bool		head_ = false;
+	bool		last_ = false;
+	int		status_ = 0;
+	uint64_t	left_ = 0;
+	std::string	buf_;
+};
+
+struct InFlight {
+	uint64_t	ts;
+	int		status;
+	bool		head;
+};
+
+enum {
+	C_CLOSED, C_CONNECTING, C_TLS, C_READY
+};
+
+struct Conn {
+	int					fd = -1;
+	SSL					*ssl = nullptr;
+	int					state = C_CLOSED;
+	uint32_t				events = 0;
+	std::string				wbuf;
+	size_t					woff = 0;
+	/* HTTP/1.1 */
+	H1Parser				h1;
+	std::deque<InFlight>			pipeline;
+	/* HTTP/2 */
+	std::string				rbuf;
+	std::unordered_map<uint32_t, InFlight>	streams;
+	uint32_t				next_sid = 1;
+	uint32_t				srv_max = UINT32_MAX;
+	uint32_t				unacked = 0;
+	bool					draining = false;
+};
+
+class Worker {
+public:
+	/* @rate is the requests rate of the thread in open-loop mode. */
+	Worker(int id, double rate)
+		: id_(id), conns_(cfg.conns), req_(id), rate_(rate)
+	{}
+
+	~Worker()
+	{
+		if (sess_)
+			SSL_SESSION_free(sess_);
+		if (tfd_ >= 0)
+			::close(tfd_);
+		if (ep_ >= 0)
+			::close(ep_);
+	}
+
+	const Stat &
+	stat() const
+	{
+		return stat_;
+	}
+
+	void
+	run()
+	{
+		struct epoll_event ev[64];
+
+		if ((ep_ = epoll_create1(0)) < 0) {
+			std::cerr << "epoll_create1: " << strerror(errno)
+				  << std::endl;
+			return;
+		}
+		start_ = now_ns();
+		if (rate_ && !timer_init())
+			return;
+		for (auto &c : conns_)
+			open(c);
+
+		while (running.load(std::memory_order_relaxed)) {
+			int n = epoll_wait(ep_, ev, 64, 100);
+			for (int i = 0; i < n; ++i) {
+				if (!ev[i].data.ptr) {
+					uint64_t exp;
+					if (::read(tfd_, &exp, sizeof(exp)) < 0)
+						continue;
+					schedule();
+					continue;
+				}
+				event(*(Conn *)ev[i].data.ptr, ev[i].events);
+			}
+		}
+
+		for (auto &c : conns_)
+			close(c, false);
+		stat_.unsent = backlog_.size();
+	}
+
+	/**
+	 * Keep the last session for resumption, called by OpenSSL when
+	 * a session or a session ticket is received.
+	 */
+	static int
+	new_session(SSL *ssl, SSL_SESSION *sess)
+	{
+		Worker *w = (Worker *)SSL_get_app_data(ssl);
+
+		if (w->sess_)
+			SSL_SESSION_free(w->sess_);
+		w->sess_ = sess;
+
+		return 1;
+	}
+
+private:
+	void
+	open(Conn &c)
+	{
+		c.fd = socket(cfg.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (c.fd < 0) {
+			++stat_.conn_err;
+			return;
+		}
+		int one = 1;
+		setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		if (connect(c.fd, (struct sockaddr *)&cfg.addr, cfg.addr_len)
+		    && errno != EINPROGRESS)
+		{
+			++stat_.conn_err;
+			::close(c.fd);
+			c.fd = -1;
+			return;
+		}
+		c.state = C_CONNECTING;
+		c.events = EPOLLOUT;
+		struct epoll_event ev = { .events = c.events, .data = { &c } };
+		epoll_ctl(ep_, EPOLL_CTL_ADD, c.fd, &ev);
+	}
+
+	/**
+	 * Close the connection and open a new one if @reopen. The requests
+	 * in flight are accounted as errors unless the benchmark is over.
+	 */
+	void
+	close(Conn &c, bool reopen = true)
+	{
+		if (c.state == C_CLOSED)
+			return;
+		if (c.ssl) {
+			/* Unclean shutdown makes the session not resumable. */
+			if (SSL_is_init_finished(c.ssl))
+				SSL_shutdown(c.ssl);
+			SSL_free(c.ssl);
+			c.ssl = nullptr;
+		}
+		::close(c.fd);
+		c.fd = -1;
+		c.state = C_CLOSED;
+
+		/* A close-delimited response is complete now. */
+		if (!c.pipeline.empty() && c.h1.close_delimited()) {
+			stat_.response(c.h1.status(), c.pipeline.front().ts);
+			c.pipeline.pop_front();
+		}
+		if (reopen)
+			stat_.errors += c.pipeline.size() + c.streams.size();
+		c.pipeline.clear();
+		c.streams.clear();
+		c.wbuf.clear();
+		c.woff = 0;
+		c.rbuf.clear();
+		c.next_sid = 1;
+		c.srv_max = UINT32_MAX;
+		c.unacked = 0;
+		c.draining = false;
+
+		if (reopen && running.load(std::memory_order_relaxed))
+			open(c);
+	}
+
+	/* The intended send time of the next request in open-loop mode. */
+	uint64_t
+	next_ts() const
+	{
+		return start_ + (uint64_t)(stat_.scheduled * 1e9 / rate_);
+	}
+
+	/*
+	 * The epoll timeout has millisecond resolution, so the requests are
+	 * sent on time by a timer firing at the next intended send time.
+	 */
+	bool
+	timer_init()
+	{
+		struct epoll_event ev = { .events = EPOLLIN, .data = { nullptr } };
+
+		if ((tfd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0
+		    || epoll_ctl(ep_, EPOLL_CTL_ADD, tfd_, &ev))
+		{
+			std::cerr << "timerfd: " << strerror(errno) << std::endl;
+			return false;
+		}
+		timer_arm();
+
+		return true;
+	}
+
+	void
+	timer_arm()
+	{
+		uint64_t ts = next_ts();
+		struct itimerspec its = {};
+
+		its.it_value.tv_sec = ts / 1000000000;
+		its.it_value.tv_nsec = ts % 1000000000;
+		timerfd_settime(tfd_, TFD_TIMER_ABSTIME, &its, NULL);
+	}
+
+	/**
+	 * Queue the requests whose send time has come and send them on the
+	 * connections with room for them. The queued requests wait for
+	 * the responses freeing the room instead of being skipped.
+	 */
+	void
+	schedule()
+	{
+		uint64_t now = now_ns();
+
+		for (uint64_t ts; (ts = next_ts()) <= now; ++stat_.scheduled)
+			backlog_.push_back(ts);
+		for (size_t i = 0; !backlog_.empty() && i < conns_.size(); ++i)
+		{
+			Conn &c = conns_[rr_++ % conns_.size()];
+			if (c.state == C_READY)
+				fill(c);
+		}
+		timer_arm();
+	}
+
+	bool
+	has_room(const Conn &c) const
+	{
+		if (c.draining)
+			return false;
+		if (cfg.h2)
+			return c.streams.size()
+			       < std::min<uint32_t>(cfg.depth, c.srv_max);
+		return c.pipeline.size() < (size_t)cfg.depth;
+	}
+
+	void
+	set_events(Conn &c, uint32_t events)
+	{
+		if (c.events == events)
+			return;
+		c.events = events;
+		struct epoll_event ev = { .events = events, .data = { &c } };
+		epoll_ctl(ep_, EPOLL_CTL_MOD, c.fd, &ev);
+	}
+
+	void
+	event(Conn &c, uint32_t events)
+	{
+		switch (c.state) {
+		case C_CONNECTING:
+			connected(c);
+			break;
+		case C_TLS:
+			handshake(c);
+			break;
+		case C_READY:
+			if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				if (!recv(c))
+					return;
+			if (events & EPOLLOUT)
+				flush(c);
+			break;
+		}
+	}
+
+	void
+	connected(Conn &c)
+	{
+		int err = 0;
+		socklen_t len = sizeof(err);
+
+		getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err) {
+			++stat_.conn_err;
+			close(c);
+			return;
+		}
+		++stat_.conn_ok;
+		if (!cfg.tls) {
+			established(c);
+			return;
+		}
+
+		if (!(c.ssl = SSL_new(ssl_ctx))) {
+			++stat_.tls_err;
+			close(c);
+			return;
+		}
+		SSL_set_app_data(c.ssl, this);
+		SSL_set_fd(c.ssl, c.fd);
+		SSL_set_connect_state(c.ssl);
+		SSL_set_tlsext_host_name(c.ssl, cfg.authority.c_str());
+		if (cfg.resume && sess_)
+			SSL_set_session(c.ssl, sess_);
+		c.state = C_TLS;
+		handshake(c);
+	}
+
+	void
+	handshake(Conn &c)
+	{
+		int r = SSL_do_handshake(c.ssl);
+
+		if (r != 1) {
+			switch (SSL_get_error(c.ssl, r)) {
+			case SSL_ERROR_WANT_READ:
+				set_events(c, EPOLLIN);
+				return;
+			case SSL_ERROR_WANT_WRITE:
+				set_events(c, EPOLLOUT);
+				return;
+			default:
+				++stat_.tls_err;
+				ERR_clear_error();
+				close(c);
+				return;
+			}
+		}
+
+		++stat_.handshakes;
+		if (SSL_session_reused(c.ssl))
+			++stat_.resumed;
+		if (cfg.h2) {
+			const unsigned char *alpn;
+			unsigned int len;
+
+			SSL_get0_alpn_selected(c.ssl, &alpn, &len);
+			if (len != 2 || memcmp(alpn, "h2", 2)) {
+				++stat_.tls_err;
+				close(c);
+				return;
+			}
+		}
+		established(c);
+	}
+
+	void
+	established(Conn &c)
+	{
+		if (cfg.hs_only) {
+			close(c);
+			return;
+		}
+		c.state = C_READY;
+		set_events(c, EPOLLIN);
+		if (cfg.h2)
+			h2::preface(c.wbuf);
+		else
+			c.h1.start(false);
+		fill(c);
+	}
+
+	/**
+	 * Send new requests up to the configured depth or the server limit
+	 * of concurrent streams. In open-loop mode only the queued requests
+	 * are sent, with their intended send times.
+	 */
+	void
+	fill(Conn &c)
+	{
+		while (has_room(c)) {
+			uint64_t ts;
+
+			if (!rate_) {
+				ts = now_ns();
+			} else if (!backlog_.empty()) {
+				ts = backlog_.front();
+				backlog_.pop_front();
+			} else {
+				break;
+			}
+			send_req(c, next_req(), ts);
+		}
+		flush(c);
+	}
+
+	void
+	send_req(Conn &c, const Request &r, uint64_t ts)
+	{
+		++stat_.requests;
+		if (cfg.h2) {
+			uint32_t sid = c.next_sid;
+
+			h2::frame_hdr(c.wbuf, r.h2.size(), h2::HEADERS,
+				      h2::F_END_STREAM | h2::F_END_HEADERS, sid);
+			c.wbuf += r.h2;
+			c.streams[sid] = { ts, 0, r.head };
+			if ((c.next_sid += 2) > h2::SID_MAX - 2)
+				c.draining = true;
+		} else {
+			if (c.pipeline.empty())
+				c.h1.start(r.head);
+			c.wbuf += r.h1;
+			c.pipeline.push_back({ ts, 0, r.head });
+		}
+	}
+
+	const Request &
+	next_req()
+	{
+		return requests[req_++ % requests.size()];
+	}
+
+	void
+	flush(Conn &c)
+	{
+		while (c.woff < c.wbuf.size()) {
+			ssize_t r = write(c, c.wbuf.data() + c.woff,
+					  c.wbuf.size() - c.woff);
+			if (r < 0) {
+				close(c);
+				return;
+			}
+			if (!r) {
+				set_events(c, EPOLLIN | EPOLLOUT);
+				return;
+			}
+			c.woff += r;
+		}
+		c.wbuf.clear();
+		c.woff = 0;
+		set_events(c, EPOLLIN);
+	}
+
+	/* Returns the number of written bytes, 0 if the socket is full. */
+	ssize_t
+	write(Conn &c, const char *p, size_t len)
+	{
+		if (!c.ssl) {
+			ssize_t r = send(c.fd, p, len, MSG_NOSIGNAL);
+			if (r < 0)
+				return errno == EAGAIN ? 0 : -1;
+			return r;
+		}
+
+		int r = SSL_write(c.ssl, p, len);
+		if (r > 0)
+			return r;
+		switch (SSL_get_error(c.ssl, r)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			return 0;
+		default:
+			ERR_clear_error();
+			return -1;
+		}
+	}
+
+	/* Returns the number of read bytes, 0 if there is no data. */
+	ssize_t
+	read(Conn &c, char *p, size_t len)
+	{
+		if (!c.ssl) {
+			ssize_t r = ::read(c.fd, p, len);
+			if (r < 0)
+				return errno == EAGAIN ? 0 : -1;
+			return r ? r : -1;
+		}
+
+		int r = SSL_read(c.ssl, p, len);
+		if (r > 0)
+			return r;
+		switch (SSL_get_error(c.ssl, r)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			return 0;
+		default:
+			ERR_clear_error();
+			return -1;
+		}
+	}
+
+	/* Returns false if the connection was closed. */
+	bool
+	recv(Conn &c)
+	{
+		char buf[64 * 1024];
+		ssize_t r;
+
+		while ((r = read(c, buf, sizeof(buf))) > 0) {
+			stat_.bytes_in += r;
+			if (!(cfg.h2 ? h2_input(c, buf, r)
+				     : h1_input(c, buf, r)))
+			{
+				++stat_.errors;
+				close(c);
+				return false;
+			}
+		}
+		if (r < 0) {
+			close(c);
+			return false;
+		}
+		/* Reconnect when the drained connection is idle. */
+		if (c.draining && (c.h1.last() || c.streams.empty())) {
+			flush(c);
+			if (c.state == C_READY)
+				close(c);
+			return false;
+		}
+		fill(c);
+
+		return c.state == C_READY;
+	}
+
+	bool
+	h1_input(Conn &c, const char *p, size_t len)
+	{
+		while (len) {
+			if (c.pipeline.empty())
+				return false;
+			switch (c.h1.feed(p, len)) {
+			case H1Parser::MORE:
+				break;
+			case H1Parser::ERROR:
+				return false;
+			case H1Parser::DONE:
+				stat_.response(c.h1.status(),
+					       c.pipeline.front().ts);
+				c.pipeline.pop_front();
+				if (c.h1.last()) {
+					/* The pipelined requests are lost. */
+					c.draining = true;
+					return true;
+				}
+				if (!c.pipeline.empty())
+					c.h1.start(c.pipeline.front().head);
+				break;
+			}
+		}
+
+		return true;
+	}
+
+	void
+	h2_complete(Conn &c, uint32_t sid)
+	{
+		auto it = c.streams.find(sid);
+
+		if (it == c.streams.end())
+			return;
+		stat_.response(it->second.status, it->second.ts);
+		c.streams.erase(it);
+	}
+
+	bool
+	h2_frame(Conn &c, const uint8_t *f, uint32_t len, uint8_t type,
+		 uint8_t flags, uint32_t sid)
+	{
+		switch (type) {
+		case h2::SETTINGS:
+			if (flags & h2::F_ACK)
+				break;
+			for (uint32_t i = 0; i + 6 <= len; i += 6)
+				if ((f[i] << 8 | f[i + 1])
+				    == h2::S_MAX_CONCURRENT_STREAMS)
+					c.srv_max = h2::get32(f + i + 2);
+			h2::frame_hdr(c.wbuf, 0, h2::SETTINGS, h2::F_ACK, 0);
+			break;
+		case h2::PING:
+			if (flags & h2::F_ACK || len != 8)
+				break;
+			h2::frame_hdr(c.wbuf, 8, h2::PING, h2::F_ACK, 0);
+			c.wbuf.append((const char *)f, 8);
+			break;
+		case h2::HEADERS: {
+			const uint8_t *end = f + len;
+			if (flags & h2::F_PADDED) {
+				if (!len || *f >= len)
+					return false;
+				end -= *f++;
+			}
+			if (flags & h2::F_PRIORITY)
+				f += 5;
+			auto it = c.streams.find(sid);
+			if (it != c.streams.end() && f < end) {
+				int st = h2::hpack_status(f, end);
+				if (st)
+					it->second.status = st;
+			}
+			if (flags & h2::F_END_STREAM)
+				h2_complete(c, sid);
+			break;
+		}
+		case h2::DATA:
+			if ((c.unacked += len) >= H2_WND_UPDATE) {
+				h2::window_update(c.wbuf, 0, c.unacked);
+				c.unacked = 0;
+			}
+			if (flags & h2::F_END_STREAM)
+				h2_complete(c, sid);
+			break;
+		case h2::RST_STREAM:
+			if (c.streams.erase(sid))
+				++stat_.errors;
+			break;
+		case h2::GOAWAY: {
+			if (len < 8)
+				return false;
+			uint32_t last = h2::get32(f) & h2::SID_MAX;
+			/* The streams above @last are never processed. */
+			for (auto it = c.streams.begin();
+			     it != c.streams.end(); )
+			{
+				if (it->first > last) {
+					++stat_.errors;
+					it = c.streams.erase(it);
+				} else {
+					++it;
+				}
+			}
+			c.draining = true;
+			break;
+		}
+		default:
+			break;
+		}
+
+		return true;
+	}
+
+	bool
+	h2_input(Conn &c, const char *p, size_t len)
+	{
+		size_t off = 0;
+
+		c.rbuf.append(p, len);
+		while (c.rbuf.size() - off >= h2::FRAME_HDR) {
+			const uint8_t *f = (const uint8_t *)c.rbuf.data() + off;
+			uint32_t flen = f[0] << 16 | f[1] << 8 | f[2];
+
+			if (c.rbuf.size() - off < h2::FRAME_HDR + flen)
+				break;
+			if (!h2_frame(c, f + h2::FRAME_HDR, flen, f[3], f[4],
+				      h2::get32(f + 5) & h2::SID_MAX))
+				return false;
+			off += h2::FRAME_HDR + flen;
+		}
+		c.rbuf.erase(0, off);
+
+		return true;
+	}
+
+	int			id_;
+	int			ep_ = -1;
+	int			tfd_ = -1;
+	std::vector<Conn>	conns_;
+	size_t			req_;
+	size_t			rr_ = 0;
+	double			rate_;
+	uint64_t		start_ = 0;
+	/* Intended send times of the requests waiting for a connection. */
+	std::deque<uint64_t>	backlog_;
+	SSL_SESSION		*sess_ = nullptr;
+	Stat			stat_;
+};
+
+static void
+usage(const char *prog)
+{
+	std::cerr << "Usage: " << prog << " [options]\n"
+		"  -s ADDR:PORT  server address, [IPv6]:PORT for IPv6"
+		" (default 127.0.0.1:80)\n"
+		"  -a HOST       Host header and TLS SNI (default the address)\n"
+		"  -t N          number of threads (default 1)\n"
+		"  -c N          connections per thread (default 1)\n"
+		"  -d SECONDS    test duration (default 10)\n"
+		"  -m N          pipelined requests or concurrent HTTP/2"
+		" streams per connection (default 1)\n"
+		"  -f FILE       requests, \"METHOD URI\" per line\n"
+		"  -2            use HTTP/2, with prior knowledge over TCP\n"
+		"  -T            use TLS\n"
+		"  -H            only establish connections, i.e. measure"
+		" the handshake rate\n"
+		"  -r            resume TLS sessions\n"
+		"  -R RATE       open-loop mode: send RATE requests per second"
+		" in total\n"
+		"  -p USEC       ramp mode: find the maximum rate, starting from"
+		" RATE,\n"
+		"                with the 99th percentile latency within USEC,"
+		" each step\n"
+		"                runs for the test duration\n";
+}
+
+static void
+parse_addr(const std::string &s)
+{
+	struct addrinfo hints = {}, *ai;
+	size_t colon;
+
+	if (s[0] == '[') {
+		size_t br = s.find(']');
+		if (br == std::string::npos)
+			throw BenchExcept("bad address " + s);
+		cfg.host = s.substr(1, br - 1);
+		colon = s.find(':', br);
+	} else {
+		colon = s.rfind(':');
+		cfg.host = s.substr(0, colon);
+	}
+	if (colon != std::string::npos)
+		cfg.port = s.substr(colon + 1);
+
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(cfg.host.c_str(), cfg.port.c_str(), &hints, &ai))
+		throw BenchExcept("cannot resolve " + s);
+	memcpy(&cfg.addr, ai->ai_addr, ai->ai_addrlen);
+	cfg.addr_len = ai->ai_addrlen;
+	freeaddrinfo(ai);
+}
+
+static void
+add_request(const std::string &method, const std::string &uri)
+{
+	Request r;
+	std::string scheme = cfg.tls ? "https" : "http";
+
+	r.h1 = method + " " + uri + " HTTP/1.1\r\nHost: " + cfg.authority
+	       + "\r\nUser-Agent: tfwbench\r\n\r\n";
+	h2::hpack_field(r.h2, h2::IDX_METHOD, "", method);
+	h2::hpack_field(r.h2, h2::IDX_SCHEME, "", scheme);
+	h2::hpack_field(r.h2, h2::IDX_PATH, "", uri);
+	h2::hpack_field(r.h2, h2::IDX_AUTHORITY, "", cfg.authority);
+	h2::hpack_field(r.h2, h2::IDX_USER_AGENT, "", "tfwbench");
+	r.head = method == "HEAD";
+	requests.push_back(r);
+}
+
+static void
+load_requests(const char *path)
+{
+	std::ifstream f(path);
+	std::string line;
+
+	if (!f)
+		throw BenchExcept(std::string("cannot open ") + path);
+	while (std::getline(f, line)) {
+		std::istringstream ls(line);
+		std::string method, uri;
+
+		if (!(ls >> method) || method[0] == '#')
+			continue;
+		if (!(ls >> uri) || uri[0] != '/')
+			throw BenchExcept("bad request line: " + line);
+		add_request(method, uri);
+	}
+	if (requests.empty())
+		throw BenchExcept(std::string("no requests in ") + path);
+}
+
+static void
+init_tls()
+{
+	static const unsigned char alpn_h2[] = "\x02h2";
+	static const unsigned char alpn_h1[] = "\x08http/1.1";
+
+	if (!(ssl_ctx = SSL_CTX_new(TLS_client_method())))
+		throw BenchExcept("cannot create TLS context");
+	/* The benchmark doesn't verify the server certificate. */
+	SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, NULL);
+	SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE
+				  | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	if (cfg.h2)
+		SSL_CTX_set_alpn_protos(ssl_ctx, alpn_h2, sizeof(alpn_h2) - 1);
+	else
+		SSL_CTX_set_alpn_protos(ssl_ctx, alpn_h1, sizeof(alpn_h1) - 1);
+	if (cfg.resume) {
+		SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT
+					       | SSL_SESS_CACHE_NO_INTERNAL);
+		SSL_CTX_sess_set_new_cb(ssl_ctx, Worker::new_session);
+	} else {
+		SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_TICKET);
+	}
+}
+
+static void
+report(const Stat &s, double sec)
+{
+	static const double ith[] = { 50, 90, 99, 99.9, 99.99 };
+
+	std::cout << "duration " << sec << "s\n"
+		  << "connections " << s.conn_ok << " errors " << s.conn_err
+		  << "\n";
+	if (cfg.tls)
+		std::cout << "handshakes " << s.handshakes << " ("
+			  << s.handshakes / sec << "/s) resumed " << s.resumed
+			  << " errors " << s.tls_err << "\n";
+	else if (cfg.hs_only)
+		std::cout << "connections/s " << s.conn_ok / sec << "\n";
+	if (cfg.hs_only)
+		return;
+
+	if (cfg.rate)
+		std::cout << "scheduled " << s.scheduled << " ("
+			  << s.scheduled / sec << "/s) unsent " << s.unsent
+			  << "\n";
+	std::cout << "requests " << s.requests << " responses "
+		  << s.responses << " (" << s.responses / sec << "/s)"
+		  << " errors " << s.errors << "\n"
+		  << "received " << s.bytes_in << " bytes ("
+		  << s.bytes_in / sec / (1 << 20) << " MB/s)\n"
+		  << "status 1xx " << s.status[0] << " 2xx " << s.status[1]
+		  << " 3xx " << s.status[2] << " 4xx " << s.status[3]
+		  << " 5xx " << s.status[4] << " other " << s.status[5] << "\n"
+		  << "latency, us";
+	for (double q : ith)
+		std::cout << " p" << q << " " << s.percentile(q);
+	std::cout << " max " << s.lat_max << "\n";
+}
+
+/* Run the test for the configured duration with the total @rate. */
+static Stat
+run(double rate, double &sec)
+{
+	std::vector<Worker *> workers;
+	std::vector<std::thread> threads;
+	uint64_t t0 = now_ns();
+	Stat total;
+
+	running = true;
+	for (int i = 0; i < cfg.threads; ++i)
+		workers.push_back(new Worker(i, rate / cfg.threads));
+	for (auto w : workers)
+		threads.emplace_back(&Worker::run, w);
+
+	sleep(cfg.duration);
+	running = false;
+	for (auto &t : threads)
+		t.join();
+
+	for (auto w : workers) {
+		total.add(w->stat());
+		delete w;
+	}
+	sec = (now_ns() - t0) / 1e9;
+
+	return total;
+}
+
+/**
+ * The rate is sustained if the 99th percentile is within the target, all
+ * the requests got responses and almost all the scheduled requests were
+ * sent: a growing backlog means the rate is above the server capacity.
+ */
+static bool
+sustained(const Stat &s)
+{
+	return s.responses && !s.errors && s.percentile(99) <= cfg.p99
+	       && s.unsent * 100 <= s.scheduled;
+}
+
+/**
+ * Double the rate until it isn't sustained, then bisect between the last
+ * sustained and the failed rates to 5% precision.
+ */
+static void
+ramp()
+{
+	double good = 0, bad = 0, rate = cfg.rate, sec;
+
+	for (int i = 0; i < RAMP_STEPS; ++i) {
+		Stat s = run(rate, sec);
+		bool ok = sustained(s);
+
+		std::cout << "rate " << rate << "/s: responses "
+			  << s.responses / sec << "/s errors " << s.errors
+			  << " unsent " << s.unsent << " p99 "
+			  << s.percentile(99) << "us "
+			  << (ok ? "ok" : "fail") << std::endl;
+		if (ok)
+			good = rate;
+		else
+			bad = rate;
+		if (bad && bad - good <= bad * 0.05)
+			break;
+		rate = bad ? (good + bad) / 2 : rate * 2;
+		if (rate < 1)
+			break;
+	}
+
+	if (good)
+		std::cout << "max rate " << good << "/s with p99 within "
+			  << cfg.p99 << "us\n";
+	else
+		std::cout << "no rate from " << cfg.rate << "/s is sustained"
+			  << " with p99 within " << cfg.p99 << "us\n";
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file = NULL;
+	std::string addr = "127.0.0.1:80";
+	int c;
+
+	while ((c = getopt(argc, argv, "s:a:t:c:d:m:f:2THrR:p:h")) != -1) {
+		switch (c) {
+		case 's':
+			addr = optarg;
+			break;
+		case 'a':
+			cfg.authority = optarg;
+			break;
+		case 't':
+			cfg.threads = atoi(optarg);
+			break;
+		case 'c':
+			cfg.conns = atoi(optarg);
+			break;
+		case 'd':
+			cfg.duration = atoi(optarg);
+			break;
+		case 'm':
+			cfg.depth = atoi(optarg);
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case '2':
+			cfg.h2 = true;
+			break;
+		case 'T':
+			cfg.tls = true;
+			break;
+		case 'H':
+			cfg.hs_only = true;
+			break;
+		case 'r':
+			cfg.resume = true;
+			break;
+		case 'R':
+			cfg.rate = atof(optarg);
+			break;
+		case 'p':
+			cfg.p99 = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+	if (cfg.threads < 1 || cfg.conns < 1 || cfg.duration < 1
+	    || cfg.depth < 1 || cfg.rate < 0
+	    || ((cfg.rate || cfg.p99) && cfg.hs_only)
+	    || (cfg.p99 && !cfg.rate))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	try {
+		parse_addr(addr);
+		if (cfg.authority.empty())
+			cfg.authority = cfg.host;
+		if (file)
+			load_requests(file);
+		else
+			add_request("GET", "/");
+		if (cfg.tls)
+			init_tls();
+	}
+	catch (BenchExcept &e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	if (cfg.p99) {
+		ramp();
+	} else {
+		double sec;
+		Stat s = run(cfg.rate, sec);
+		report(s, sec);
+	}
+	if (ssl_ctx)
+		SSL_CTX_free(ssl_ctx);
+
+	return 0;
+}
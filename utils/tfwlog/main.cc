@@ -0,0 +1,195 @@
+/**
+ *		Tempesta FW Access Log Shipper
+ *
+ * Read the access log rings of /dev/tempesta_log and print the records as
+ * text lines, see fw/access_log_if.h for the rings format. The tool is
+ * a reference for shippers writing the records to their storage.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <access_log_if.h>
+
+static const char *DEV = "/dev/" TFW_ALOG_DEV_NAME;
+
+class AccLogExcept : public std::runtime_error {
+public:
+	AccLogExcept(const std::string &msg)
+		: std::runtime_error(msg + (errno ? std::string(" (")
+						   + strerror(errno) + ")"
+						 : ""))
+	{}
+};
+
+/**
+ * Mapped rings of all the CPUs. The rings are mapped for the whole life of
+ * the object, so the records are read without system calls.
+ */
+class AccLog {
+public:
+	AccLog()
+		: fd_(-1), size_(0)
+	{
+		errno = 0;
+		if ((fd_ = ::open(DEV, O_RDWR)) < 0)
+			throw AccLogExcept(std::string("cannot open ") + DEV);
+
+		// The first ring header tells the rings geometry.
+		TfwAccLogHdr *h = map(0, sizeof(TfwAccLogHdr));
+		if (!h)
+			throw AccLogExcept("cannot map the first ring");
+		if (h->magic != TFW_ALOG_MAGIC
+		    || h->version != TFW_ALOG_VERSION
+		    || h->rec_len != sizeof(TfwAccLogRec))
+			throw AccLogExcept("unsupported access log format");
+		size_ = h->size;
+		unsigned int cpu_n = h->cpu_n;
+		::munmap(h, sizeof(TfwAccLogHdr));
+
+		// Not all the CPUs may be possible.
+		for (unsigned int cpu = 0; cpu < cpu_n; ++cpu)
+			if ((h = map((off_t)cpu * size_, size_)))
+				rings_.push_back(h);
+	}
+
+	~AccLog()
+	{
+		for (auto h : rings_)
+			::munmap(h, size_);
+		if (fd_ >= 0)
+			::close(fd_);
+	}
+
+	/**
+	 * Print the ready records of all the rings. Returns the number of
+	 * printed records or -1 if the rings were closed and drained.
+	 */
+	long
+	drain()
+	{
+		long n = 0;
+		bool closed = true;
+
+		for (auto h : rings_) {
+			// The kernel doesn't write the ring after the flag.
+			closed &= !!(__atomic_load_n(&h->flags,
+						     __ATOMIC_ACQUIRE)
+				     & TFW_ALOG_F_CLOSED);
+
+			__u64 head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+			__u64 tail = h->tail;
+			auto recs = (const TfwAccLogRec *)((char *)h
+							   + TFW_ALOG_HDR_SZ);
+
+			for ( ; tail != head; ++tail, ++n)
+				print(recs[tail & (h->rec_n - 1)]);
+			__atomic_store_n(&h->tail, tail, __ATOMIC_RELEASE);
+
+			if (h->drops != drops_[h]) {
+				std::cerr << "dropped " << h->drops - drops_[h]
+					  << " records" << std::endl;
+				drops_[h] = h->drops;
+			}
+		}
+
+		return closed ? -1 : n;
+	}
+
+private:
+	TfwAccLogHdr *
+	map(off_t off, size_t len)
+	{
+		void *p = ::mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+				 fd_, off);
+
+		return p == MAP_FAILED ? nullptr : (TfwAccLogHdr *)p;
+	}
+
+	static void
+	print(const TfwAccLogRec &r)
+	{
+		char cli[INET6_ADDRSTRLEN], srv[INET6_ADDRSTRLEN] = "-";
+
+		ntop(r.client, cli);
+		if (r.upstream_port)
+			ntop(r.upstream, srv);
+
+		std::cout << r.ts / 1000000000 << "." << std::setfill('0')
+			  << std::setw(3) << r.ts / 1000000 % 1000 << " "
+			  << cli << ":" << r.client_port << " "
+			  << std::string(r.vhost, strnlen(r.vhost,
+							  sizeof(r.vhost)))
+			  << " " << (unsigned)r.method
+			  << " " << (unsigned)r.version
+			  << " " << r.status << " " << r.bytes
+			  << " " << srv << ":" << r.upstream_port
+			  << " " << r.req_time << " " << r.srv_time << "\n";
+	}
+
+	static void
+	ntop(const __u8 *addr, char *buf)
+	{
+		if (IN6_IS_ADDR_V4MAPPED((const in6_addr *)addr))
+			inet_ntop(AF_INET, addr + 12, buf, INET6_ADDRSTRLEN);
+		else
+			inet_ntop(AF_INET6, addr, buf, INET6_ADDRSTRLEN);
+	}
+
+	int				fd_;
+	size_t				size_;
+	std::vector<TfwAccLogHdr *>	rings_;
+	std::map<TfwAccLogHdr *, __u64>	drops_;
+};
+
+int
+main(int argc, char *argv[])
+{
+	while (true) {
+		try {
+			AccLog alog;
+			long n;
+
+			while ((n = alog.drain()) >= 0) {
+				std::cout.flush();
+				if (!n)
+					usleep(100000);
+			}
+			// The rings were resized, remap them.
+			std::cout.flush();
+		}
+		catch (AccLogExcept &e) {
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+	}
+
+	return 0;
+}
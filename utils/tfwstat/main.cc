@@ -0,0 +1,196 @@
+/**
+ *		Tempesta FW Statistics Reader
+ *
+ * Print a statistics snapshot as "name value" lines, one server per line
+ * at the end, suitable for collectors and shell scripts.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+
+#include <iostream>
+
+#include "tfwstat.h"
+
+static const char *lat_names[_TFW_LAT_NUM] = {
+	"recv", "parse", "tbl", "cache", "fwd", "resp_parse", "adjust",
+	"encrypt", "send"
+};
+
+static void
+print_perf(const TfwPerfStat &s)
+{
+#define P(f)	std::cout << #f " " << s.f << "\n"
+	P(ss.pfl_hits);
+	P(ss.pfl_misses);
+	P(ss.wq_full);
+	P(ss.pg_recycled);
+	P(cache.hits);
+	P(cache.misses);
+	P(cache.evictions);
+	P(cache.collapsed);
+	P(cache.stale);
+	P(cache.refreshes);
+	P(cache.rejected);
+	P(clnt.rx_messages);
+	P(clnt.msgs_forwarded);
+	P(clnt.msgs_fromcache);
+	P(clnt.msgs_parserr);
+	P(clnt.msgs_filtout);
+	P(clnt.msgs_otherr);
+	P(clnt.online);
+	P(clnt.conn_attempts);
+	P(clnt.conn_established);
+	P(clnt.conn_disconnects);
+	P(clnt.rx_bytes);
+	P(clnt.hpack_hits);
+	P(clnt.hpack_misses);
+	P(serv.rx_messages);
+	P(serv.msgs_forwarded);
+	P(serv.msgs_parserr);
+	P(serv.msgs_filtout);
+	P(serv.msgs_otherr);
+	P(serv.conn_attempts);
+	P(serv.conn_established);
+	P(serv.conn_disconnects);
+	P(serv.conn_restricted);
+	P(serv.rx_bytes);
+#undef P
+}
+
+/**
+ * Print the number of samples of each stage and the non-empty buckets as
+ * "log2(cycles):count" pairs.
+ */
+static void
+print_lat(const TfwLatStat &lat)
+{
+	for (int s = 0; s < _TFW_LAT_NUM; ++s) {
+		unsigned long long n = 0;
+
+		for (int b = 0; b < TFW_LAT_BUCKETS; ++b)
+			n += lat.hist[s][b];
+		std::cout << "lat." << lat_names[s] << " " << n;
+		for (int b = 0; b < TFW_LAT_BUCKETS; ++b)
+			if (lat.hist[s][b])
+				std::cout << " " << b << ":" << lat.hist[s][b];
+		std::cout << "\n";
+	}
+}
+
+static void
+print_srv(const TfwStatsSrv &srv)
+{
+	char addr[INET6_ADDRSTRLEN];
+
+	if (IN6_IS_ADDR_V4MAPPED((const in6_addr *)srv.addr))
+		inet_ntop(AF_INET, srv.addr + 12, addr, sizeof(addr));
+	else
+		inet_ntop(AF_INET6, srv.addr, addr, sizeof(addr));
+
+	std::cout << "server " << std::string(srv.sg_name,
+					      strnlen(srv.sg_name,
+						      sizeof(srv.sg_name)))
+		  << " " << addr << ":" << srv.port
+		  << " flags=" << srv.flags
+		  << " conns=" << srv.conn_n
+		  << " sched=" << srv.conn_sched
+		  << " parked=" << srv.conn_parked
+		  << " qsize=" << srv.qsize << "/" << srv.max_qsize
+		  << " qtime=" << srv.qtime
+		  << " sessions=" << srv.sess_n
+		  << " rtime=";
+	for (int i = 0; i < TFW_STATS_RTIME_N; ++i)
+		std::cout << (i ? "," : "") << srv.rtime[i];
+	std::cout << " rtail=";
+	for (int i = 0; i < TFW_STATS_RTAIL_N; ++i)
+		std::cout << (i ? "," : "") << srv.rtail[i];
+	std::cout << "\n";
+}
+
+/**
+ * Print a vhost location, the default location is printed as "*", and
+ * the non-empty latency buckets as "log2(us):count" pairs.
+ */
+static void
+print_vhost(const TfwStatsVhost &vh)
+{
+	const TfwVhostStat &s = vh.stat;
+	std::string loc(vh.loc, strnlen(vh.loc, sizeof(vh.loc)));
+
+	std::cout << "vhost " << std::string(vh.vhost,
+					     strnlen(vh.vhost,
+						     sizeof(vh.vhost)))
+		  << " \"" << (loc.empty() ? "*" : loc) << "\""
+		  << " requests=" << s.requests
+		  << " bytes_in=" << s.bytes_in
+		  << " bytes_out=" << s.bytes_out
+		  << " cache_hits=" << s.cache_hits
+		  << " status=";
+	for (int i = 0; i < TFW_VHOST_STATUS_N; ++i)
+		std::cout << (i ? "," : "") << s.status[i];
+	std::cout << " lat=";
+	for (int b = 0, n = 0; b < TFW_VHOST_LAT_BUCKETS; ++b)
+		if (s.lat[b])
+			std::cout << (n++ ? "," : "") << b << ":" << s.lat[b];
+	std::cout << "\n";
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *path = TfwStats::PATH;
+	int c;
+
+	while ((c = getopt(argc, argv, "p:h")) != -1) {
+		switch (c) {
+		case 'p':
+			path = optarg;
+			break;
+		default:
+			std::cerr << "Usage: " << argv[0] << " [-p PATH]\n";
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	try {
+		TfwStats stats(path);
+
+		stats.read();
+
+		const TfwStatsHdr &h = stats.hdr();
+		std::cout << "ts " << h.ts << "\n";
+		print_perf(h.perf);
+		std::cout << "skb_in_flight " << h.skb_in_flight << "\n"
+			  << "warmup " << h.warmup_sent << "/"
+			  << h.warmup_total << "\n";
+		if (h.lat_enabled)
+			print_lat(h.lat);
+		for (size_t i = 0; i < stats.srv_n(); ++i)
+			print_srv(stats.srv(i));
+		for (size_t i = 0; i < stats.vhost_n(); ++i)
+			print_vhost(stats.vhost(i));
+	}
+	catch (TfwStatsExcept &e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
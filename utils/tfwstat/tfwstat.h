@@ -0,0 +1,170 @@
+/**
+ *		Tempesta FW Statistics Reader
+ *
+ * Reader of the binary statistics snapshots from /proc/tempesta/stats,
+ * see fw/procfs_if.h for the format.
+ *
+ * Copyright (C) 2026 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef __TFWSTAT_H__
+#define __TFWSTAT_H__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <procfs_if.h>
+
+class TfwStatsExcept : public std::exception {
+private:
+	static const size_t maxmsg = 256;
+	std::string str_;
+
+public:
+	TfwStatsExcept(const char* fmt, ...) noexcept
+	{
+		va_list ap;
+		char msg[maxmsg];
+		va_start(ap, fmt);
+		vsnprintf(msg, maxmsg, fmt, ap);
+		va_end(ap);
+		str_ = msg;
+		if (errno)
+			str_ += std::string(" (") + strerror(errno) + ")";
+	}
+
+	const char *
+	what() const noexcept
+	{
+		return str_.c_str();
+	}
+};
+
+/**
+ * A statistics snapshot. The reader keeps the buffer between the snapshots,
+ * so periodic scrapes don't allocate memory once the buffer is large enough.
+ */
+class TfwStats {
+public:
+	static constexpr const char *PATH = "/proc/tempesta/stats";
+
+	TfwStats(const char *path = PATH)
+		: path_(path), buf_(sizeof(TfwStatsHdr))
+	{}
+
+	/**
+	 * Read a new snapshot. The file must be read in one open session:
+	 * the kernel builds the whole snapshot on the first read.
+	 */
+	void
+	read()
+	{
+		size_t off = 0;
+		ssize_t r;
+
+		errno = 0;
+		int fd = ::open(path_.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw TfwStatsExcept("cannot open %s", path_.c_str());
+
+		while (true) {
+			if (off == buf_.size())
+				buf_.resize(buf_.size() * 2);
+			r = ::read(fd, buf_.data() + off, buf_.size() - off);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0)
+				break;
+			off += r;
+		}
+		::close(fd);
+		if (r < 0)
+			throw TfwStatsExcept("cannot read %s", path_.c_str());
+
+		check(off);
+	}
+
+	const TfwStatsHdr &
+	hdr() const noexcept
+	{
+		return *(const TfwStatsHdr *)buf_.data();
+	}
+
+	size_t
+	srv_n() const noexcept
+	{
+		return hdr().srv_n;
+	}
+
+	const TfwStatsSrv &
+	srv(size_t i) const noexcept
+	{
+		const TfwStatsHdr &h = hdr();
+
+		return *(const TfwStatsSrv *)(buf_.data() + h.hdr_len
+					      + i * h.srv_len);
+	}
+
+	size_t
+	vhost_n() const noexcept
+	{
+		return hdr().vhost_n;
+	}
+
+	const TfwStatsVhost &
+	vhost(size_t i) const noexcept
+	{
+		const TfwStatsHdr &h = hdr();
+
+		return *(const TfwStatsVhost *)(buf_.data() + h.hdr_len
+						+ h.srv_n * h.srv_len
+						+ i * h.vhost_len);
+	}
+
+private:
+	void
+	check(size_t len) const
+	{
+		const TfwStatsHdr &h = hdr();
+
+		errno = 0;
+		if (len < offsetof(TfwStatsHdr, ts) || h.magic != TFW_STATS_MAGIC)
+			throw TfwStatsExcept("bad statistics format");
+		if (h.version != TFW_STATS_VERSION)
+			throw TfwStatsExcept("unsupported statistics version %u",
+					     h.version);
+		// Newer kernels may only append fields to the structures.
+		if (h.hdr_len < sizeof(TfwStatsHdr)
+		    || h.srv_len < sizeof(TfwStatsSrv)
+		    || h.vhost_len < sizeof(TfwStatsVhost)
+		    || len != h.hdr_len + (size_t)h.srv_n * h.srv_len
+			      + (size_t)h.vhost_n * h.vhost_len)
+			throw TfwStatsExcept("truncated statistics: %zu bytes",
+					     len);
+	}
+
+	std::string		path_;
+	std::vector<char>	buf_;
+};
+
+#endif // __TFWSTAT_H__